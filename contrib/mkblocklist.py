@@ -0,0 +1,26 @@
+#!/usr/bin/env python3
+#
+# mkblocklist.py - Build a PASS_BLOCKLIST_FILE from a list of passwords
+#
+# Usage: mkblocklist.py < passwords.txt > blocklist
+#
+# The passwords are read one per line (as bytes, without the newline).
+# The file is written in the byte order of the host, for the machines
+# of the same architecture.
+
+import struct
+import sys
+
+def fnv1a64(data):
+    h = 14695981039346656037
+    for b in data:
+        h ^= b
+        h = (h * 1099511628211) & 0xffffffffffffffff
+    return h
+
+hashes = sorted({fnv1a64(line.rstrip(b"\r\n"))
+                 for line in sys.stdin.buffer if line.rstrip(b"\r\n")})
+out = sys.stdout.buffer
+out.write(struct.pack("=8sIIQ", b"SHADOWBL", 1, 0, len(hashes)))
+for h in hashes:
+    out.write(struct.pack("=Q", h))
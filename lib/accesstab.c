@@ -0,0 +1,272 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "accesstab.h"
+
+/*
+ * Groups of the access rules
+ *
+ * The rules of all the tables are evaluated for a single user, and the
+ * same groups are often listed by several rules. Each group is only
+ * looked up once per process.
+ */
+struct access_group {
+	char *name;
+	/*@null@*/struct group *gr;	/* NULL if the group does not exist */
+};
+
+static /*@null@*/struct access_group *groups = NULL;
+static size_t ngroups = 0;
+
+/*
+ * split_field - split a field of a rule in tokens
+ *
+ *	The field is modified in place.
+ */
+static int split_field (struct access_table *table,
+                        char *field,
+                        /*@out@*/struct access_field *f)
+{
+	const char *sep = table->separators;
+	size_t n = 0;
+	char *cp;
+
+	for (cp = field + strspn (field, sep); '\0' != *cp;
+	     cp += strspn (cp, sep)) {
+		cp += strcspn (cp, sep);
+		n++;
+	}
+
+	f->tokens = (char **) arena_alloc (&table->arena,
+	                                   (n + 1) * sizeof (char *));
+	if (NULL == f->tokens) {
+		return -1;
+	}
+	f->count = 0;
+	for (cp = field + strspn (field, sep); '\0' != *cp;) {
+		f->tokens[f->count] = cp;
+		f->count++;
+		cp += strcspn (cp, sep);
+		if ('\0' != *cp) {
+			*cp = '\0';
+			cp++;
+			cp += strspn (cp, sep);
+		}
+	}
+	f->tokens[f->count] = NULL;
+	return 0;
+}
+
+/*
+ * add_rule - add a line of the file to the rules of the table
+ *
+ *	Trailing whitespace is stripped, and blank lines and lines
+ *	starting with a '#' character are ignored.
+ */
+static int add_rule (struct access_table *table, char *line, int lineno)
+{
+	struct access_rule *rule;
+	size_t len = strlen (line);
+	size_t i;
+	char *cp;
+
+	while ((len > 0) && isspace ((unsigned char) line[len - 1])) {
+		len--;
+	}
+	line[len] = '\0';
+	while ((' ' == *line) || ('\t' == *line)) {
+		line++;
+	}
+	if (('\0' == *line) || ('#' == *line)) {
+		return 0;
+	}
+
+	rule = &table->rules[table->count];
+	rule->lineno = lineno;
+	rule->ignored = false;
+	rule->count = 1;
+	for (cp = line; NULL != (cp = strchr (cp, ':')); cp++) {
+		rule->count++;
+	}
+	rule->fields = (struct access_field *)
+	               arena_alloc (&table->arena,
+	                            rule->count * sizeof (struct access_field));
+	if (NULL == rule->fields) {
+		return -1;
+	}
+	for (i = 0; i < rule->count; i++) {
+		cp = strchr (line, ':');
+		if (NULL != cp) {
+			*cp = '\0';
+		}
+		if (split_field (table, line, &rule->fields[i]) != 0) {
+			return -1;
+		}
+		line = cp + 1;
+	}
+	table->count++;
+	return 0;
+}
+
+/*
+ * access_table_load - load the rules of the table
+ *
+ *	The file is only read again if it changed since the last call.
+ *
+ *	It returns 1 if the rules were (re)loaded, 0 if they did not change,
+ *	and -1 if the file could not be read, with table->err set. The table
+ *	is then empty.
+ */
+int access_table_load (struct access_table *table)
+{
+	struct stat sb;
+	size_t len = 0;
+	size_t lines = 1;
+	char *buf;
+	char *line;
+	char *next;
+	int lineno = 0;
+	int fd;
+
+	if (stat (table->file, &sb) != 0) {
+		goto fail;
+	}
+	if (   table->loaded
+	    && (sb.st_dev == table->dev)
+	    && (sb.st_ino == table->ino)
+	    && (sb.st_size == table->size)
+	    && (sb.st_mtime == table->mtime)) {
+		return 0;
+	}
+
+	access_table_free (table);
+	fd = open (table->file, O_RDONLY);
+	if (fd < 0) {
+		goto fail;
+	}
+	if (fstat (fd, &sb) != 0) {
+		goto fail_close;
+	}
+	buf = (char *) arena_alloc (&table->arena, (size_t) sb.st_size + 1);
+	if (NULL == buf) {
+		goto fail_close;
+	}
+	while (len < (size_t) sb.st_size) {
+		ssize_t n = read (fd, buf + len, (size_t) sb.st_size - len);
+
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			goto fail_close;
+		}
+		if (0 == n) {
+			break;
+		}
+		len += (size_t) n;
+	}
+	(void) close (fd);
+	buf[len] = '\0';
+
+	for (line = buf; NULL != (line = strchr (line, '\n')); line++) {
+		lines++;
+	}
+	table->rules = (struct access_rule *)
+	               arena_alloc (&table->arena,
+	                            lines * sizeof (struct access_rule));
+	if (NULL == table->rules) {
+		goto fail;
+	}
+	for (line = buf; NULL != line; line = next) {
+		next = strchr (line, '\n');
+		if (NULL != next) {
+			*next = '\0';
+			next++;
+		}
+		lineno++;
+		if (add_rule (table, line, lineno) != 0) {
+			goto fail;
+		}
+	}
+
+	table->dev = sb.st_dev;
+	table->ino = sb.st_ino;
+	table->size = sb.st_size;
+	table->mtime = sb.st_mtime;
+	table->loaded = true;
+	return 1;
+
+      fail_close:
+	table->err = errno;
+	(void) close (fd);
+	access_table_free (table);
+	return -1;
+
+      fail:
+	table->err = errno;
+	access_table_free (table);
+	return -1;
+}
+
+/*
+ * access_table_free - free the rules of the table
+ */
+void access_table_free (struct access_table *table)
+{
+	arena_release (&table->arena);
+	table->rules = NULL;
+	table->count = 0;
+	table->loaded = false;
+}
+
+/*
+ * access_getgr - get a group listed by an access rule
+ *
+ *	The group is looked up the first time, and kept for the lifetime
+ *	of the process. It returns NULL if the group does not exist.
+ */
+/*@null@*/const struct group *access_getgr (const char *name)
+{
+	struct access_group *g;
+	struct group *gr;
+	size_t i;
+
+	for (i = 0; i < ngroups; i++) {
+		if (strcmp (groups[i].name, name) == 0) {
+			return groups[i].gr;
+		}
+	}
+
+	gr = getgrnam (name); /* local, no need for xgetgrnam */
+
+	/* If the group cannot be kept, it is used without caching it */
+	g = (struct access_group *) realloc (groups,
+	                                     (ngroups + 1) * sizeof (*g));
+	if (NULL == g) {
+		return gr;
+	}
+	groups = g;
+	g = &groups[ngroups];
+	g->name = strdup (name);
+	g->gr = (NULL != gr) ? __gr_dup_packed (gr) : NULL;
+	if ((NULL == g->name) || ((NULL != gr) && (NULL == g->gr))) {
+		free (g->name);
+		if (NULL != g->gr) {
+			gr_free_packed (g->gr);
+		}
+		return gr;
+	}
+	ngroups++;
+	return g->gr;
+}
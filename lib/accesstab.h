@@ -0,0 +1,47 @@
+#ifndef _ACCESSTAB_H_
+#define _ACCESSTAB_H_
+
+#include <sys/types.h>
+#include <grp.h>
+#include <time.h>
+#include "defines.h"
+#include "arena.h"
+
+/*
+ * Access control tables (/etc/login.access, /etc/suauth, /etc/porttime)
+ *
+ * The table is parsed once, and only parsed again when the file changes.
+ * Blank lines and comments are skipped. Each rule is a line of colon
+ * separated fields, and each field a list of tokens.
+ */
+struct access_field {
+	size_t count;
+	char **tokens;		/* NULL terminated */
+};
+
+struct access_rule {
+	int lineno;		/* for diagnostics */
+	bool ignored;		/* set by the user of the table */
+	size_t count;		/* number of fields */
+	struct access_field *fields;
+};
+
+struct access_table {
+	const char *file;
+	const char *separators;	/* between the tokens of a field */
+	int err;		/* errno of the last failed load */
+	bool loaded;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	size_t count;		/* number of rules */
+	/*@null@*/struct access_rule *rules;
+	struct arena arena;
+};
+
+extern int access_table_load (struct access_table *table);
+extern void access_table_free (struct access_table *table);
+extern /*@null@*/const struct group *access_getgr (const char *name);
+
+#endif
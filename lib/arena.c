@@ -0,0 +1,106 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdlib.h>
+#include <string.h>
+#include "defines.h"
+#include "arena.h"
+
+/*
+ * Size of the blocks. Bigger objects get a block of their own.
+ */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+/*
+ * Alignment of the returned objects.
+ */
+#define ARENA_ALIGN (2 * sizeof (void *))
+
+struct arena_block {
+	/*@owned@*/ /*@null@*/struct arena_block *next;
+	size_t size;		/* usable bytes after the header */
+	size_t used;
+};
+
+#define BLOCK_HEADER \
+	((sizeof (struct arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/*
+ * arena_alloc - Allocate size bytes from the arena.
+ *
+ *	It returns NULL (with errno set to ENOMEM) on failure.
+ */
+/*@null@*/void *arena_alloc (struct arena *a, size_t size)
+{
+	struct arena_block *b = a->blocks;
+	void *ret;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if ((NULL == b) || ((b->size - b->used) < size)) {
+		size_t bsize = ARENA_BLOCK_SIZE;
+
+		if (size > bsize) {
+			bsize = size;
+		}
+		b = (struct arena_block *) malloc (BLOCK_HEADER + bsize);
+		if (NULL == b) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		b->size = bsize;
+		b->used = 0;
+		if ((NULL != a->blocks) && (size > ARENA_BLOCK_SIZE)) {
+			/* Keep using the free space of the current block */
+			b->next = a->blocks->next;
+			a->blocks->next = b;
+		} else {
+			b->next = a->blocks;
+			a->blocks = b;
+		}
+		a->total += bsize;
+	}
+
+	ret = (char *) b + BLOCK_HEADER + b->used;
+	b->used += size;
+	return ret;
+}
+
+/*
+ * arena_strndup - Copy the first len characters of s in the arena,
+ *                 and NUL terminate them.
+ */
+/*@null@*/char *arena_strndup (struct arena *a, const char *s, size_t len)
+{
+	char *ret;
+
+	ret = (char *) arena_alloc (a, len + 1);
+	if (NULL != ret) {
+		memcpy (ret, s, len);
+		ret[len] = '\0';
+	}
+	return ret;
+}
+
+/*@null@*/char *arena_strdup (struct arena *a, const char *s)
+{
+	return arena_strndup (a, s, strlen (s));
+}
+
+/*
+ * arena_release - Free all the objects of the arena.
+ *
+ *	The arena can be used again afterwards.
+ */
+void arena_release (struct arena *a)
+{
+	struct arena_block *b;
+
+	while (NULL != a->blocks) {
+		b = a->blocks;
+		a->blocks = b->next;
+		free (b);
+	}
+	a->total = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * Memory arena.
+ *
+ * Objects are allocated from large blocks. They cannot be freed
+ * individually, all the blocks are released at once by arena_release().
+ *
+ * A zeroed struct arena is an empty arena.
+ */
+struct arena_block;
+
+struct arena {
+	/*@owned@*/ /*@null@*/struct arena_block *blocks;
+	size_t total;		/* size of all the blocks */
+};
+
+extern /*@null@*/void *arena_alloc (struct arena *, size_t size);
+extern /*@null@*/char *arena_strndup (struct arena *,
+                                      const char *s, size_t len);
+extern /*@null@*/char *arena_strdup (struct arena *, const char *s);
+extern void arena_release (struct arena *);
+
+#endif
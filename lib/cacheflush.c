@@ -0,0 +1,92 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "cacheflush.h"
+#include "nscd.h"
+#include "sssd.h"
+
+/*
+ * The databases changed by the program, and not flushed yet
+ *
+ * The programs used to flush the caches of nscd and sssd after each
+ * change, and again before exiting. The changes are now only recorded,
+ * and the caches are flushed once, by the handler registered with
+ * atexit() for this process only (not for the children which exit
+ * without exec, see run_command).
+ *
+ * If SHADOW_SKIP_CACHE_FLUSH is set in the environment, the caches are
+ * not flushed. Scripts which run many tools can then flush them once at
+ * the end. The variable is ignored by setuid programs.
+ */
+static int pending;
+static bool registered = false;
+static pid_t flush_pid;
+
+static void cache_flush_pending (void);
+
+void cache_flush_defer (int dbflags)
+{
+	pending |= dbflags;
+	if (!registered) {
+		registered = true;
+		flush_pid = getpid ();
+		if (atexit (cache_flush_pending) != 0) {
+			/* Flush now, as before */
+			cache_flush_pending ();
+			registered = false;
+		}
+	}
+}
+
+/*
+ * cache_flush_now - flush the caches of the changed databases without
+ *                   waiting for the exit
+ *
+ *	It is used by the programs which keep running after a change.
+ */
+void cache_flush_now (void)
+{
+	cache_flush_pending ();
+}
+
+/*
+ * cache_flush_pending - flush the caches of the changed databases
+ *
+ *	sss_cache is started first, and waited for after the nscd caches
+ *	were invalidated.
+ */
+static void cache_flush_pending (void)
+{
+	int dbflags = pending;
+	int nscd_flags = 0;
+	int sssd_flags = 0;
+	pid_t pid;
+
+	if ((0 == dbflags) || (getpid () != flush_pid)) {
+		return;
+	}
+	pending = 0;
+
+	if (NULL != shadow_getenv ("SHADOW_SKIP_CACHE_FLUSH")) {
+		return;
+	}
+
+	if ((dbflags & CACHE_DB_PASSWD) != 0) {
+		nscd_flags |= NSCD_DB_PASSWD;
+		sssd_flags |= SSSD_DB_PASSWD;
+	}
+	if ((dbflags & CACHE_DB_GROUP) != 0) {
+		nscd_flags |= NSCD_DB_GROUP;
+		sssd_flags |= SSSD_DB_GROUP;
+	}
+
+	(void) sssd_flush_cache_start (sssd_flags, &pid);
+	(void) nscd_flush_caches (nscd_flags);
+	(void) sssd_flush_cache_wait (pid);
+}
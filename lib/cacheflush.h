@@ -0,0 +1,22 @@
+#ifndef _CACHEFLUSH_H_
+#define _CACHEFLUSH_H_
+
+#define CACHE_DB_PASSWD	0x001
+#define CACHE_DB_GROUP	0x002
+
+/*
+ * cache_flush_defer - record that the passwd and/or group databases
+ *                     changed
+ *
+ *	The nscd and sssd caches of the changed databases are flushed
+ *	once, when the program exits.
+ */
+extern void cache_flush_defer (int dbflags);
+
+/*
+ * cache_flush_now - flush the caches of the databases recorded with
+ *                   cache_flush_defer() now
+ */
+extern void cache_flush_now (void);
+
+#endif
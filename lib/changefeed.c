@@ -0,0 +1,233 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "commonio.h"
+#include "getdef.h"
+
+/*
+ * Change feed of the databases (CHANGE_FEED)
+ *
+ * When a database is committed, the keys of its added, modified and
+ * removed entries are sent to CHANGE_FEED, so that the caches can
+ * invalidate these entries instead of the whole database. The record of
+ * a commit is:
+ *
+ *	<file> <pid>
+ *	added <name> <id>
+ *	modified <name> <id> [<previous id>]
+ *	removed <name> <id>
+ *	<empty line>
+ *
+ * <id> is "-" for the databases without IDs (shadow, gshadow). The
+ * previous ID of a modified entry is only given when it changed.
+ *
+ * CHANGE_FEED is a UNIX datagram socket (one datagram per record), or
+ * a FIFO or a regular file, to which the record is appended with a
+ * single write. The feed is only a hint: the failures are ignored, and
+ * a FIFO without reader is skipped.
+ */
+
+static /*@null@*/const char *feed_path (void)
+{
+	const char *path = getdef_str ("CHANGE_FEED");
+
+	if ((NULL == path) || ('/' != path[0])) {
+		return NULL;
+	}
+	return path;
+}
+
+static void feed_printf (struct commonio_buf *buf, const char *fmt, ...)
+{
+	va_list ap;
+	char *cp;
+	int n;
+
+	va_start (ap, fmt);
+	n = vsnprintf (NULL, 0, fmt, ap);
+	va_end (ap);
+	if (n < 0) {
+		return;
+	}
+	cp = commonio_buf_reserve (buf, (size_t) n + 1);
+	if (NULL == cp) {
+		return;
+	}
+	va_start (ap, fmt);
+	(void) vsnprintf (cp, (size_t) n + 1, fmt, ap);
+	va_end (ap);
+	buf->len += (size_t) n;
+}
+
+/*
+ * feed_key - Append the key of eptr to buf.
+ */
+static void feed_key (struct commonio_buf *buf,
+                      const struct commonio_db *db,
+                      const char *what,
+                      const char *name,
+                      /*@null@*/const void *eptr)
+{
+	if ((NULL == db->ops->getid) || (NULL == eptr)) {
+		feed_printf (buf, "%s %s -\n", what, name);
+	} else {
+		feed_printf (buf, "%s %s %lu\n", what, name,
+		             (unsigned long) db->ops->getid (eptr));
+	}
+}
+
+/*
+ * commonio_feed_remove - Record that the entry name (with the object
+ *                        eptr, if known) is removed.
+ *
+ *	It is sent with the next commit of the database.
+ */
+void commonio_feed_remove (struct commonio_db *db, const char *name,
+                           /*@null@*/const void *eptr)
+{
+	if (NULL == feed_path ()) {
+		return;
+	}
+	feed_key (&db->feed_removed, db, "removed", name, eptr);
+}
+
+/*
+ * commonio_feed_change - Record that the entry name is added (without
+ *                        old) or modified from old to eptr, when the
+ *                        change is not in the entries of db (see
+ *                        commonio_stream).
+ *
+ *	It is sent with the next commit of the database.
+ */
+void commonio_feed_change (struct commonio_db *db, const char *name,
+                           /*@null@*/const void *old, const void *eptr)
+{
+	if (NULL == feed_path ()) {
+		return;
+	}
+	if (NULL == old) {
+		feed_key (&db->feed_removed, db, "added", name, eptr);
+	} else if (   (NULL != db->ops->getid)
+	           && (db->ops->getid (old) != db->ops->getid (eptr))) {
+		feed_printf (&db->feed_removed, "modified %s %lu %lu\n", name,
+		             (unsigned long) db->ops->getid (eptr),
+		             (unsigned long) db->ops->getid (old));
+	} else {
+		feed_key (&db->feed_removed, db, "modified", name, eptr);
+	}
+}
+
+/*
+ * feed_send - Send a record to path.
+ */
+static void feed_send (const char *path, const char *data, size_t len)
+{
+	struct stat sb;
+	int fd;
+
+	if (stat (path, &sb) == 0 && S_ISSOCK (sb.st_mode)) {
+		struct sockaddr_un sun;
+
+		if (strlen (path) >= sizeof sun.sun_path) {
+			return;
+		}
+		memzero (&sun, sizeof sun);
+		sun.sun_family = AF_UNIX;
+		strcpy (sun.sun_path, path);
+		fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			return;
+		}
+		(void) sendto (fd, data, len, MSG_DONTWAIT,
+		               (const struct sockaddr *) &sun, sizeof sun);
+		(void) close (fd);
+		return;
+	}
+
+	fd = open (path,
+	           O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK | O_NOCTTY
+	           | O_NOFOLLOW | O_CLOEXEC,
+	           0600);
+	if (fd < 0) {
+		return;
+	}
+	(void) write (fd, data, len);
+	(void) close (fd);
+}
+
+/*
+ * commonio_feed_commit - Send the record of the changes of db, which
+ *                        were just committed.
+ *
+ *	It is called before the changed flags of the entries are reset.
+ */
+void commonio_feed_commit (struct commonio_db *db)
+{
+	struct commonio_buf buf = { NULL, 0, 0 };
+	const struct commonio_entry *p;
+	const char *path = feed_path ();
+	size_t keys = 0;
+
+	if (NULL == path) {
+		goto out;
+	}
+
+	feed_printf (&buf, "%s %lu\n", db->filename, (unsigned long) getpid ());
+	for (p = db->head; NULL != p; p = p->next) {
+		const char *name;
+		const void *old;
+
+		if (!p->changed || (NULL == p->eptr)) {
+			continue;
+		}
+		name = db->ops->getname (p->eptr);
+		if (NULL == p->line) {
+			feed_key (&buf, db, "added", name, p->eptr);
+			keys++;
+			continue;
+		}
+		/* The line is still the one of the previous commit */
+		old = (NULL != db->ops->getid) ? db->ops->parse (p->line) : NULL;
+		if (   (NULL != old)
+		    && (db->ops->getid (old) != db->ops->getid (p->eptr))) {
+			feed_printf (&buf, "modified %s %lu %lu\n", name,
+			             (unsigned long) db->ops->getid (p->eptr),
+			             (unsigned long) db->ops->getid (old));
+		} else {
+			feed_key (&buf, db, "modified", name, p->eptr);
+		}
+		keys++;
+	}
+	if (db->feed_removed.len > 0) {
+		char *cp = commonio_buf_reserve (&buf, db->feed_removed.len);
+
+		if (NULL != cp) {
+			memcpy (cp, db->feed_removed.data, db->feed_removed.len);
+			buf.len += db->feed_removed.len;
+			keys++;
+		}
+	}
+	feed_printf (&buf, "\n");
+
+	if ((keys > 0) && (NULL != buf.data)) {
+		feed_send (path, buf.data, buf.len);
+	}
+
+      out:
+	free (buf.data);
+	free (db->feed_removed.data);
+	memzero (&db->feed_removed, sizeof db->feed_removed);
+}
@@ -37,36 +37,112 @@
 #include "defines.h"
 #include <assert.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <utime.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif				/* HAVE_LINUX_FS_H */
 #include <stdio.h>
 #include <signal.h>
-#include "nscd.h"
-#include "sssd.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* HAVE_PTHREAD */
+#include "cacheflush.h"
 #ifdef WITH_TCB
 #include <tcb.h>
 #endif				/* WITH_TCB */
 #include "prototypes.h"
 #include "commonio.h"
+#include "getdef.h"
+#include "memberfile.h"
+#include "metrics.h"
+#include "timing.h"
+#include "probes.h"
 
 /* local function prototypes */
 static int lrename (const char *, const char *);
 static int check_link_count (const char *file);
 static int do_lock_file (const char *file, const char *lock, bool log);
+static void lock_delay (unsigned long ms);
+static int lock_with_retries (struct commonio_db *db);
+static void remove_lock (struct commonio_db *db);
 static /*@null@*/ /*@dependent@*/FILE *fopen_set_perms (
 	const char *name,
 	const char *mode,
 	const struct stat *sb);
+static int copy_file (int in, int out, off_t size);
 static int create_backup (const char *, FILE *);
+static int link_backup (const char *file, const char *backup);
+static void rollback_append (const struct commonio_db *db, int fd);
+static int pwrite_all (int fd, const char *buf, size_t len, off_t offset);
+static int replay_journal (const struct commonio_db *db, int fd);
+static /*@null@*/FILE *journal_entries (const struct commonio_db *db,
+                                        const struct stat *sb);
+static /*@null@*/struct commonio_entry *appended_entries (
+	const struct commonio_db *db);
+static /*@null@*/FILE *append_entries (const struct commonio_db *db,
+                                       const struct commonio_entry *first,
+                                       const struct stat *sb);
+static int backup_db (const struct commonio_db *db, FILE *fp,
+                      const struct stat *sb);
+static int prepare_db (struct commonio_db *db);
+static int sync_db (struct commonio_db *db);
+static int commit_db (struct commonio_db *db, bool keep,
+                      /*@out@*/bool *renamed);
+static void sync_parent_dirs (struct commonio_db *const *dbs,
+                              const bool *renamed, size_t count);
+static /*@null@*/char *format_line (struct commonio_db *db,
+                                    const struct commonio_entry *p);
+static int keep_db (struct commonio_db *db, bool reread);
+static int commonio_txn_write (struct commonio_txn *txn, bool keep);
+static void abort_db (struct commonio_db *db);
 static void free_linked_list (struct commonio_db *);
+static size_t sort_range (struct commonio_db *db,
+                          /*@out@*/struct commonio_entry **nis);
+static void relink_sorted (struct commonio_db *db,
+                           struct commonio_entry **entries, size_t n,
+                           /*@null@*/struct commonio_entry *nis);
+static void unmap_file (struct commonio_db *db);
+static /*@null@*/struct commonio_entry *new_entry (struct commonio_db *db,
+                                                   /*@null@*/char *line);
 static void add_one_entry (
 	struct commonio_db *db,
 	/*@owned@*/struct commonio_entry *p);
 static bool name_is_nis (const char *name);
-static int write_all (const struct commonio_db *);
+static bool entry_is_nis (const struct commonio_db *db,
+                          const struct commonio_entry *p);
+static int write_all (const struct commonio_db *db,
+                      /*@null@*/const struct commonio_entry *first,
+                      FILE *fp, int shard);
+static int write_entries (const struct commonio_db *db,
+                          /*@null@*/const struct commonio_entry *first,
+                          FILE *fp, int shard);
+static bool can_format (const struct commonio_db *db);
+static int write_buffer (int fd, const char *buf, size_t len);
+static /*@null@*/char *format_entries (const struct commonio_db *db,
+                                       /*@null@*/const struct commonio_entry *first,
+                                       size_t *len, int shard);
+static void shards_free (struct commonio_db *db);
+static int shards_read (struct commonio_db *db);
+static unsigned int shard_for (const struct commonio_db *db,
+                               const void *eptr);
+static void shards_mark_dirty (struct commonio_db *db);
+static int prepare_shards (struct commonio_db *db,
+                           const struct stat *main_sb);
+static int sync_shards (struct commonio_db *db);
+static bool shards_pending (const struct commonio_db *db);
+static int commit_shards (struct commonio_db *db);
+static void abort_shards (struct commonio_db *db);
+static void sync_dir (const char *dir);
 static /*@dependent@*/ /*@null@*/struct commonio_entry *find_entry_by_name (
 	struct commonio_db *,
 	const char *);
@@ -74,10 +150,108 @@ static /*@dependent@*/ /*@null@*/struct commonio_entry *next_entry_by_name (
 	struct commonio_db *,
 	/*@null@*/struct commonio_entry *pos,
 	const char *);
+static bool has_other_entry_by_name (struct commonio_db *,
+                                     const struct commonio_entry *,
+                                     const char *);
+static size_t name_hash (const char *name, size_t len);
+static bool index_build (struct commonio_db *db);
+static void index_free (struct commonio_db *db);
+static void index_insert (struct commonio_db *db, struct commonio_entry *p);
+static void index_remove (struct commonio_db *db,
+                          const struct commonio_entry *p);
+static bool id_index_build (struct commonio_db *db);
+static void id_index_free (struct commonio_db *db);
+static void id_index_insert (struct commonio_db *db, struct commonio_entry *p);
+static void id_index_remove (struct commonio_db *db,
+                             const struct commonio_entry *p);
+static bool gid_index_build (struct commonio_db *db);
+static void gid_index_free (struct commonio_db *db);
+static void gid_index_insert (struct commonio_db *db,
+                              struct commonio_entry *p);
+static void gid_index_remove (struct commonio_db *db,
+                              const struct commonio_entry *p);
+static void member_index_free (struct commonio_db *db);
+static void member_index_insert (struct commonio_db *db,
+                                 struct commonio_entry *p);
+static void member_index_remove (struct commonio_db *db,
+                                 const struct commonio_entry *p);
 
 static int lock_count = 0;
 static bool nscd_need_reload = false;
 
+/*
+ * Databases open while the operations are timed, whose memory is noted
+ * when the program exits (see note_open_dbs), if they are still open.
+ */
+#define MEMORY_DBS	16
+static /*@dependent@*/ /*@null@*/struct commonio_db *memory_dbs[MEMORY_DBS];
+static bool memory_exit = false;	/* note_open_dbs is registered */
+#ifdef HAVE_PTHREAD
+/* The timings and the memory of the databases opened by commonio_open_set */
+static pthread_mutex_t open_note_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif				/* HAVE_PTHREAD */
+
+/*
+ * PID of the process which held the last busy lock, 0 if no lock was
+ * busy (see lock_wait_log).
+ */
+static pid_t lock_holder = 0;
+
+/*
+ * Number of processes which were ahead in the lock queue when the last
+ * lock was requested (see lock_queue_enter).
+ */
+static unsigned long lock_queue_depth = 0;
+
+/*
+ * Set when the files are not the ones of the running system (see
+ * commonio_set_offline).
+ */
+static bool offline = false;
+
+/*
+ * Shard argument of write_all(): write the entries of all the files.
+ */
+#define SHARD_ALL	(-1)
+
+/*
+ * How hard the commits try to survive a crash (COMMIT_DURABILITY or the
+ * SHADOW_COMMIT_DURABILITY environment variable):
+ *  - none: nothing is synced (e.g. for image builds or tmpfs roots),
+ *  - default: the new files are synced before they replace the
+ *    databases,
+ *  - full: the directories of the replaced databases are also synced
+ *    after the renames.
+ */
+enum durability {
+	DURABILITY_NONE,
+	DURABILITY_DEFAULT,
+	DURABILITY_FULL
+};
+
+static enum durability durability (void)
+{
+	const char *level;
+
+	if (offline) {
+		return DURABILITY_NONE;
+	}
+	level = shadow_getenv ("SHADOW_COMMIT_DURABILITY");
+	if ((NULL == level) || ('\0' == level[0])) {
+		level = getdef_str ("COMMIT_DURABILITY");
+	}
+	if (NULL == level) {
+		return DURABILITY_DEFAULT;
+	}
+	if (strcmp (level, "none") == 0) {
+		return DURABILITY_NONE;
+	}
+	if (strcmp (level, "full") == 0) {
+		return DURABILITY_FULL;
+	}
+	return DURABILITY_DEFAULT;
+}
+
 /*
  * Simple rename(P) alternative that attempts to rename to symlink
  * target.
@@ -212,6 +386,7 @@ static int do_lock_file (const char *file, const char *lock, bool log)
 		return 0;
 	}
 	if (kill (pid, 0) == 0) {
+		lock_holder = pid;
 		if (log) {
 			(void) fprintf (stderr,
 			                "%s: lock %s already used by PID %lu\n",
@@ -296,839 +471,5394 @@ static /*@null@*/ /*@dependent@*/FILE *fopen_set_perms (
 }
 
 
-static int create_backup (const char *backup, FILE * fp)
+/*
+ * pwrite_all - Write len bytes of buf to fd, at offset.
+ */
+static int pwrite_all (int fd, const char *buf, size_t len, off_t offset)
 {
-	struct stat sb;
-	struct utimbuf ub;
-	FILE *bkfp;
-	int c;
+	ssize_t n;
 
-	if (fstat (fileno (fp), &sb) != 0) {
-		return -1;
+	while (len > 0) {
+		n = pwrite (fd, buf, len, offset);
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= (size_t) n;
+		offset += n;
 	}
+	return 0;
+}
 
-	bkfp = fopen_set_perms (backup, "w", &sb);
-	if (NULL == bkfp) {
-		return -1;
+
+/*
+ * copy_file - Copy the size first bytes of in to the empty file out.
+ *
+ *	The file is cloned if the filesystem supports it, or copied in
+ *	the kernel with copy_file_range(). Otherwise, it is copied with
+ *	a read/write loop.
+ *
+ *	The file offsets of in and out are not used.
+ */
+static int copy_file (int in, int out, off_t size)
+{
+	char buf[65536];
+	off_t off = 0;
+	ssize_t n;
+
+#ifdef FICLONE
+	if (ioctl (out, FICLONE, in) == 0) {
+		return 0;
 	}
+#endif				/* FICLONE */
+
+#ifdef HAVE_COPY_FILE_RANGE
+	{
+		off_t off_out = 0;
 
-	/* TODO: faster copy, not one-char-at-a-time.  --marekm */
-	c = 0;
-	if (fseek (fp, 0, SEEK_SET) == 0) {
-		while ((c = getc (fp)) != EOF) {
-			if (putc (c, bkfp) == EOF) {
+		while (off < size) {
+			n = copy_file_range (in, &off, out, &off_out,
+			                     (size_t) (size - off), 0);
+			if (n <= 0) {
 				break;
 			}
 		}
+		/* On failure, continue with read/write */
+		off = off_out;
+	}
+#endif				/* HAVE_COPY_FILE_RANGE */
+
+	while (off < size) {
+		n = pread (in, buf, sizeof buf, off);
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return -1;
+		}
+		if (0 == n) {
+			break;
+		}
+		if (pwrite_all (out, buf, (size_t) n, off) != 0) {
+			return -1;
+		}
+		off += n;
+	}
+	return 0;
+}
+
+static int write_backup (const char *backup, FILE * fp,
+                         const struct stat *sb)
+{
+	struct utimbuf ub;
+	FILE *bkfp;
+
+	bkfp = fopen_set_perms (backup, "w", sb);
+	if (NULL == bkfp) {
+		return -1;
 	}
-	if ((c != EOF) || (ferror (fp) != 0) || (fflush (bkfp) != 0)) {
+
+	if (copy_file (fileno (fp), fileno (bkfp), sb->st_size) != 0) {
 		(void) fclose (bkfp);
 		/* FIXME: unlink the backup file? */
 		return -1;
 	}
-	if (   (fsync (fileno (bkfp)) != 0)
+	if (   (   (DURABILITY_NONE != durability ())
+	        && (fsync (fileno (bkfp)) != 0))
 	    || (fclose (bkfp) != 0)) {
 		/* FIXME: unlink the backup file? */
 		return -1;
 	}
 
-	ub.actime = sb.st_atime;
-	ub.modtime = sb.st_mtime;
+	ub.actime = sb->st_atime;
+	ub.modtime = sb->st_mtime;
 	(void) utime (backup, &ub);
 	return 0;
 }
 
-
-static void free_linked_list (struct commonio_db *db)
+static int create_backup (const char *backup, FILE * fp)
 {
-	struct commonio_entry *p;
-
-	while (NULL != db->head) {
-		p = db->head;
-		db->head = p->next;
-
-		if (NULL != p->line) {
-			free (p->line);
-		}
-
-		if (NULL != p->eptr) {
-			db->ops->free (p->eptr);
-		}
+	struct stat sb;
+	int ret;
 
-		free (p);
+	if (fstat (fileno (fp), &sb) != 0) {
+		return -1;
 	}
-	db->tail = NULL;
-}
-
-
-int commonio_setname (struct commonio_db *db, const char *name)
-{
-	snprintf (db->filename, sizeof (db->filename), "%s", name);
-	return 1;
-}
-
 
-bool commonio_present (const struct commonio_db *db)
-{
-	return (access (db->filename, F_OK) == 0);
+	SHADOW_PROBE2 (create_backup__entry, backup, (long) sb.st_size);
+	ret = write_backup (backup, fp, &sb);
+	SHADOW_PROBE3 (create_backup__return, backup, ret, (long) sb.st_size);
+	return ret;
 }
 
-
-int commonio_lock_nowait (struct commonio_db *db, bool log)
+/*
+ * link_backup - Make backup a hard link to file.
+ *
+ *	The database is replaced by a new file, so the current inode of
+ *	the file can be kept as the backup, without copying it.
+ */
+static int link_backup (const char *file, const char *backup)
 {
-	char* file = NULL;
-	char* lock = NULL;
-	size_t lock_file_len;
-	size_t file_len;
-	int err = 0;
-
-	if (db->locked) {
-		return 1;
-	}
-	file_len = strlen(db->filename) + 11;/* %lu max size */
-	lock_file_len = strlen(db->filename) + 6; /* sizeof ".lock" */
-	file = (char*)malloc(file_len);
-	if(file == NULL) {
-		goto cleanup_ENOMEM;
-	}
-	lock = (char*)malloc(lock_file_len);
-	if(lock == NULL) {
-		goto cleanup_ENOMEM;
-	}
-	snprintf (file, file_len, "%s.%lu",
-	          db->filename, (unsigned long) getpid ());
-	snprintf (lock, lock_file_len, "%s.lock", db->filename);
-	if (do_lock_file (file, lock, log) != 0) {
-		db->locked = true;
-		lock_count++;
-		err = 1;
+	if ((unlink (backup) != 0) && (ENOENT != errno)) {
+		return -1;
 	}
-cleanup_ENOMEM:
-	if(file)
-		free(file);
-	if(lock)
-		free(lock);
-	return err;
+	return link (file, backup);
 }
 
-
-int commonio_lock (struct commonio_db *db)
+/*
+ * rollback_append - Undo an append which was interrupted.
+ *
+ *	append_entries() records the inode and the size of the file in
+ *	<file>.append before appending, and removes it when the new
+ *	entries are on disk. If this record is still there, the file is
+ *	truncated back to its previous size.
+ *
+ *	The record is ignored if the file was replaced in the meantime.
+ */
+static void rollback_append (const struct commonio_db *db, int fd)
 {
-/*#ifdef HAVE_LCKPWDF*/ /* not compatible with prefix option*/
-#if 0
-	/*
-	 * only if the system libc has a real lckpwdf() - the one from
-	 * lockpw.c calls us and would cause infinite recursion!
-	 */
+	char name[1024];
+	FILE *fp;
+	unsigned long ino, size;
+	struct stat sb;
 
-	/*
-	 * Call lckpwdf() on the first lock.
-	 * If it succeeds, call *_lock() only once
-	 * (no retries, it should always succeed).
-	 */
-	if (0 == lock_count) {
-		if (lckpwdf () == -1) {
-			if (geteuid () != 0) {
-				(void) fprintf (stderr,
-				                "%s: Permission denied.\n",
-				                Prog);
-			}
-			return 0;	/* failure */
-		}
+	if ((size_t) snprintf (name, sizeof name, "%s.append",
+	                       db->filename) >= sizeof name) {
+		return;
 	}
-
-	if (commonio_lock_nowait (db, true) != 0) {
-		return 1;	/* success */
+	fp = fopen (name, "r");
+	if (NULL == fp) {
+		return;
 	}
 
-	ulckpwdf ();
-	return 0;		/* failure */
-#else				/* !HAVE_LCKPWDF */
-	int i;
-
-	/*
-	 * lckpwdf() not used - do it the old way.
-	 */
-#ifndef LOCK_TRIES
-#define LOCK_TRIES 15
-#endif
-
-#ifndef LOCK_SLEEP
-#define LOCK_SLEEP 1
-#endif
-	for (i = 0; i < LOCK_TRIES; i++) {
-		if (i > 0) {
-			sleep (LOCK_SLEEP);	/* delay between retries */
-		}
-		if (commonio_lock_nowait (db, i==LOCK_TRIES-1) != 0) {
-			return 1;	/* success */
-		}
-		/* no unnecessary retries on "permission denied" errors */
-		if (geteuid () != 0) {
-			(void) fprintf (stderr, "%s: Permission denied.\n",
-			                Prog);
-			return 0;
+	if (   (fscanf (fp, "%lu %lu", &ino, &size) == 2)
+	    && (fstat (fd, &sb) == 0)
+	    && (sb.st_ino == (ino_t) ino)
+	    && (sb.st_size >= (off_t) size)) {
+		if (ftruncate (fd, (off_t) size) != 0) {
+			/* Keep the record, the next open will retry */
+			(void) fclose (fp);
+			return;
 		}
+		(void) fsync (fd);
 	}
-	return 0;		/* failure */
-#endif				/* !HAVE_LCKPWDF */
+	(void) fclose (fp);
+	(void) unlink (name);
 }
 
-static void dec_lock_count (void)
+/*
+ * appended_entries - Return the first new entry if the only changes
+ *                    to the database are new entries at its end.
+ *
+ *	Otherwise, or if no entries were added, NULL is returned and the
+ *	file must be rewritten.
+ */
+static /*@null@*/struct commonio_entry *appended_entries (
+	const struct commonio_db *db)
 {
-	if (lock_count > 0) {
-		lock_count--;
-		if (lock_count == 0) {
-			/* Tell nscd when lock count goes to zero,
-			   if any of the files were changed.  */
-			if (nscd_need_reload) {
-				nscd_flush_cache ("passwd");
-				nscd_flush_cache ("group");
-				sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
-				nscd_need_reload = false;
-			}
-#ifdef HAVE_LCKPWDF
-			ulckpwdf ();
-#endif				/* HAVE_LCKPWDF */
-		}
-	}
-}
+	struct commonio_entry *p, *first = NULL;
 
+	if (db->rewrite) {
+		return NULL;
+	}
 
-int commonio_unlock (struct commonio_db *db)
-{
-	char lock[1024];
-
-	if (db->isopen) {
-		db->readonly = true;
-		if (commonio_close (db) == 0) {
-			if (db->locked) {
-				dec_lock_count ();
+	for (p = db->head; NULL != p; p = p->next) {
+		if (NULL == first) {
+			if (p->changed) {
+				if (NULL != p->line) {
+					/* An existing entry was modified */
+					return NULL;
+				}
+				first = p;
 			}
-			return 0;
+		} else if (!p->changed || (NULL != p->line)) {
+			/* Something follows the new entries */
+			return NULL;
 		}
 	}
-	if (db->locked) {
-		/*
-		 * Unlock in reverse order: remove the lock file,
-		 * then call ulckpwdf() (if used) on last unlock.
-		 */
-		db->locked = false;
-		snprintf (lock, sizeof lock, "%s.lock", db->filename);
-		unlink (lock);
-		dec_lock_count ();
-		return 1;
-	}
-	return 0;
-}
 
+	return first;
+}
 
 /*
- * Add an entry at the end.
+ * append_entries - Append the entries, starting at first, to the file.
  *
- * defines p->next, p->prev
- * (unfortunately, owned special are not supported)
+ *	sb is the status of the file when it was opened.
+ *
+ *	Return the stream of the file, flushed but not synced yet. The
+ *	append is completed by commit_db(), or undone by abort_db().
+ *	On failure, the file is restored and NULL is returned.
  */
-static void add_one_entry (struct commonio_db *db,
-                           /*@owned@*/struct commonio_entry *p)
+static /*@null@*/FILE *append_entries (const struct commonio_db *db,
+                                       const struct commonio_entry *first,
+                                       const struct stat *sb)
 {
-	/*@-mustfreeonly@*/
-	p->next = NULL;
-	p->prev = db->tail;
-	/*@=mustfreeonly@*/
-	if (NULL == db->head) {
-		db->head = p;
+	char name[1024];
+	FILE *rec, *fp;
+	struct stat nsb;
+	char c;
+	int errors = 0;
+
+	/* Record the current size, for rollback_append() */
+	if ((size_t) snprintf (name, sizeof name, "%s.append",
+	                       db->filename) >= sizeof name) {
+		errno = ENAMETOOLONG;
+		return NULL;
 	}
-	if (NULL != db->tail) {
-		db->tail->next = p;
+	rec = fopen_set_perms (name, "w", sb);
+	if (NULL == rec) {
+		return NULL;
+	}
+	if (fprintf (rec, "%lu %lu\n",
+	             (unsigned long) sb->st_ino,
+	             (unsigned long) sb->st_size) < 0) {
+		errors++;
+	}
+	if (fflush (rec) != 0) {
+		errors++;
+	}
+#ifdef HAVE_FSYNC
+	if (fsync (fileno (rec)) != 0) {
+		errors++;
+	}
+#else				/* !HAVE_FSYNC */
+	sync ();
+#endif				/* !HAVE_FSYNC */
+	if (fclose (rec) != 0) {
+		errors++;
+	}
+	if (errors != 0) {
+		(void) unlink (name);
+		return NULL;
+	}
+
+	fp = fopen (db->filename, "a");
+	if (NULL == fp) {
+		(void) unlink (name);
+		return NULL;
+	}
+	if (   (fstat (fileno (fp), &nsb) != 0)
+	    || (nsb.st_ino != sb->st_ino)
+	    || (nsb.st_size != sb->st_size)) {
+		(void) fclose (fp);
+		(void) unlink (name);
+		return NULL;
 	}
-	db->tail = p;
-}
 
+	/* The last line may not be terminated */
+	if (   (sb->st_size > 0)
+	    && (   (pread (fileno (db->fp), &c, 1, sb->st_size - 1) != 1)
+	        || ('\n' != c))
+	    && (putc ('\n', fp) == EOF)) {
+		errors++;
+	}
 
-static bool name_is_nis (const char *name)
-{
-	return (('+' == name[0]) || ('-' == name[0]));
-}
+	if ((0 == errors) && (write_all (db, first, fp, SHARD_ALL) != 0)) {
+		errors++;
+	}
+
+	if (fflush (fp) != 0) {
+		errors++;
+	}
+	if (errors != 0) {
+		if (ftruncate (fileno (fp), sb->st_size) == 0) {
+			(void) fsync (fileno (fp));
+			(void) unlink (name);
+		}
+		/* else rollback_append() will take care of it */
+		(void) fclose (fp);
+		return NULL;
+	}
 
+	return fp;
+}
 
 /*
- * New entries are inserted before the first NIS entry.  Order is preserved
- * when db is written out.
+ * Journal of an update in place: <file>.journal
+ *
+ * The journal holds the bytes which replace the end (or, if the size
+ * does not change, the middle) of the file. It is synced before the
+ * file is changed, and removed when the file is synced. If it is still
+ * there, the update is replayed (see replay_journal).
  */
-#ifndef KEEP_NIS_AT_END
-#define KEEP_NIS_AT_END 1
-#endif
+#define JOURNAL_MAGIC "shjrnl\0\1"
+
+struct journal_header {
+	char magic[8];
+	uint64_t ino;		/* inode of the updated file */
+	uint64_t offset;	/* where the data is written */
+	uint64_t length;	/* length of the data, after the header */
+	uint64_t size;		/* size of the updated file */
+	uint32_t checksum;	/* of the header and the data */
+	uint32_t pad;
+};
 
-#if KEEP_NIS_AT_END
-static void add_one_entry_nis (struct commonio_db *db,
-                               /*@owned@*/struct commonio_entry *newp);
+/*
+ * journal_checksum - FNV-1a hash of the journal, with a zero checksum
+ *                    field.
+ */
+static uint32_t journal_checksum (const struct journal_header *h,
+                                  const char *data)
+{
+	struct journal_header c = *h;
+	const unsigned char *cp;
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	c.checksum = 0;
+	cp = (const unsigned char *) &c;
+	for (i = 0; i < sizeof c; i++) {
+		hash = (hash ^ cp[i]) * 16777619U;
+	}
+	cp = (const unsigned char *) data;
+	for (i = 0; i < h->length; i++) {
+		hash = (hash ^ cp[i]) * 16777619U;
+	}
+	return hash;
+}
 
 /*
- * Insert an entry between the regular entries, and the NIS entries.
+ * replay_journal - Apply the journal of the database to the file (fd).
  *
- * defines newp->next, newp->prev
- * (unfortunately, owned special are not supported)
+ *	It is used to commit the update, and by commonio_open to finish
+ *	an update which was interrupted. The replay can be repeated: it
+ *	only writes the bytes of the journal and sets the size.
+ *
+ *	A journal which is incomplete (the file was not changed yet) or
+ *	which was written for another file is removed.
+ *
+ *	It returns 1 if the journal was applied, 0 if there was no valid
+ *	journal, and -1 if the file could not be updated. In the last
+ *	case, the journal is kept.
  */
-static void add_one_entry_nis (struct commonio_db *db,
-                               /*@owned@*/struct commonio_entry *newp)
+static int replay_journal (const struct commonio_db *db, int fd)
 {
-	struct commonio_entry *p;
+	char name[1024];
+	struct journal_header h;
+	struct stat sb;
+	char *data = NULL;
+	FILE *fp;
+	int ret = 0;
 
-	for (p = db->head; NULL != p; p = p->next) {
-		if (name_is_nis (p->eptr ? db->ops->getname (p->eptr)
-		                         : p->line)) {
-			/*@-mustfreeonly@*/
-			newp->next = p;
-			newp->prev = p->prev;
-			/*@=mustfreeonly@*/
-			if (NULL != p->prev) {
-				p->prev->next = newp;
-			} else {
-				db->head = newp;
-			}
-			p->prev = newp;
-			return;
-		}
+	if ((size_t) snprintf (name, sizeof name, "%s.journal",
+	                       db->filename) >= sizeof name) {
+		return 0;
+	}
+	fp = fopen (name, "r");
+	if (NULL == fp) {
+		return 0;
 	}
-	add_one_entry (db, newp);
-}
-#endif				/* KEEP_NIS_AT_END */
 
-/* Initial buffer size, as well as increment if not sufficient
-   (for reading very long lines in group files).  */
-#define BUFLEN 4096
+	if (   (fread (&h, sizeof h, 1, fp) != 1)
+	    || (memcmp (h.magic, JOURNAL_MAGIC, sizeof h.magic) != 0)
+	    || (fstat (fd, &sb) != 0)
+	    || (sb.st_ino != (ino_t) h.ino)
+	    || (h.length > SIZE_MAX)
+	    || (h.length > h.size)
+	    || (h.offset > (h.size - h.length))
+	    || (h.size > (uint64_t) LLONG_MAX)) {
+		goto out;
+	}
+	data = (char *) malloc ((size_t) h.length + 1);
+	if (   (NULL == data)
+	    || (fread (data, 1, (size_t) h.length, fp) != h.length)
+	    || (journal_checksum (&h, data) != h.checksum)) {
+		goto out;
+	}
 
-int commonio_open (struct commonio_db *db, int mode)
+	ret = 1;
+	if (   (pwrite_all (fd, data, (size_t) h.length,
+	                    (off_t) h.offset) != 0)
+	    || (ftruncate (fd, (off_t) h.size) != 0)
+#ifdef HAVE_FSYNC
+	    || (fsync (fd) != 0)
+#endif				/* HAVE_FSYNC */
+	   ) {
+		ret = -1;
+	}
+#ifndef HAVE_FSYNC
+	sync ();
+#endif				/* !HAVE_FSYNC */
+
+      out:
+	free (data);
+	(void) fclose (fp);
+	if (-1 != ret) {
+		(void) unlink (name);
+	}
+	return ret;
+}
+
+/*
+ * journal_entries - Write the journal of the update of the file.
+ *
+ *	The database is formatted in memory and compared with the file
+ *	(sb is its status when it was opened): only the bytes after the
+ *	common beginning are logged, or only the changed middle if the
+ *	size does not change.
+ *
+ *	Return the stream of the journal, flushed but not synced yet. The
+ *	update is done by commit_db(), or dropped by abort_db().
+ *	On failure, NULL is returned and the file shall be rewritten.
+ */
+static /*@null@*/FILE *journal_entries (const struct commonio_db *db,
+                                        const struct stat *sb)
 {
+	char name[1024];
+	struct journal_header h;
+	const char *old = NULL;
 	char *buf;
-	char *cp;
-	char *line;
-	struct commonio_entry *p;
-	void *eptr = NULL;
-	int flags = mode;
-	size_t buflen;
-	int fd;
-	int saved_errno;
-
-	mode &= ~O_CREAT;
+	size_t len, old_len, start, end;
+	FILE *fp = NULL;
 
-	if (   db->isopen
-	    || (   (O_RDONLY != mode)
-	        && (O_RDWR != mode))) {
-		errno = EINVAL;
-		return 0;
-	}
-	db->readonly = (mode == O_RDONLY);
-	if (!db->readonly && !db->locked) {
-		errno = EACCES;
-		return 0;
+	if (   !can_format (db)
+	    || !S_ISREG (sb->st_mode)
+	    || ((unsigned long long) sb->st_size > SIZE_MAX)) {
+		return NULL;
 	}
 
-	db->head = NULL;
-	db->tail = NULL;
-	db->cursor = NULL;
-	db->changed = false;
+	buf = format_entries (db, db->head, &len, SHARD_ALL);
+	if (NULL == buf) {
+		return NULL;
+	}
 
-	fd = open (db->filename,
-	             (db->readonly ? O_RDONLY : O_RDWR)
-	           | O_NOCTTY | O_NONBLOCK | O_NOFOLLOW);
-	saved_errno = errno;
-	db->fp = NULL;
-	if (fd >= 0) {
-#ifdef WITH_TCB
-		if (tcb_is_suspect (fd) != 0) {
-			(void) close (fd);
-			errno = EINVAL;
-			return 0;
-		}
-#endif				/* WITH_TCB */
-		db->fp = fdopen (fd, db->readonly ? "r" : "r+");
-		saved_errno = errno;
-		if (NULL == db->fp) {
-			(void) close (fd);
+	/* The mapping of the database was changed by read_mapped */
+	old_len = (size_t) sb->st_size;
+	if (old_len > 0) {
+		old = mmap (NULL, old_len, PROT_READ, MAP_SHARED,
+		            fileno (db->fp), 0);
+		if (MAP_FAILED == old) {
+			free (buf);
+			return NULL;
 		}
 	}
-	errno = saved_errno;
 
-	/*
-	 * If O_CREAT was specified and the file didn't exist, it will be
-	 * created by commonio_close().  We have no entries to read yet.  --marekm
-	 */
-	if (NULL == db->fp) {
-		if (((flags & O_CREAT) != 0) && (ENOENT == errno)) {
-			db->isopen = true;
-			return 1;
+	start = 0;
+	while ((start < len) && (start < old_len) && (buf[start] == old[start])) {
+		start++;
+	}
+	end = len;
+	if (len == old_len) {
+		while ((end > start) && (buf[end - 1] == old[end - 1])) {
+			end--;
 		}
-		return 0;
 	}
 
-	/* Do not inherit fd in spawned processes (e.g. nscd) */
-	fcntl (fileno (db->fp), F_SETFD, FD_CLOEXEC);
+	memzero (&h, sizeof h);
+	memcpy (h.magic, JOURNAL_MAGIC, sizeof h.magic);
+	h.ino = (uint64_t) sb->st_ino;
+	h.offset = (uint64_t) start;
+	h.length = (uint64_t) (end - start);
+	h.size = (uint64_t) len;
+	h.checksum = journal_checksum (&h, buf + start);
+
+	if ((size_t) snprintf (name, sizeof name, "%s.journal",
+	                       db->filename) >= sizeof name) {
+		errno = ENAMETOOLONG;
+		fp = NULL;
+	} else {
+		fp = fopen_set_perms (name, "w", sb);
+	}
+	if (NULL != fp) {
+		if (   (fwrite (&h, sizeof h, 1, fp) != 1)
+		    || (fwrite (buf + start, 1, end - start, fp) != (end - start))
+		    || (fflush (fp) != 0)) {
+			(void) fclose (fp);
+			(void) unlink (name);
+			fp = NULL;
+		}
+	}
 
-	buflen = BUFLEN;
-	buf = (char *) malloc (buflen);
-	if (NULL == buf) {
-		goto cleanup_ENOMEM;
+	if (NULL != old) {
+		(void) munmap ((void *) old, old_len);
 	}
+	free (buf);
+	return fp;
+}
 
-	while (db->ops->fgets (buf, (int) buflen, db->fp) == buf) {
-		while (   ((cp = strrchr (buf, '\n')) == NULL)
-		       && (feof (db->fp) == 0)) {
-			size_t len;
+/*
+ * note_memory - Note the memory held by the database, for LOG_TIMINGS
+ *               and METRICS_DIR (see metrics_db_memory).
+ *
+ *	The nodes of the member index are allocated in the arena, and
+ *	counted with the lines.
+ */
+static void note_memory (const struct commonio_db *db)
+{
+	unsigned long long bytes[DB_MEMORY_KINDS];
+	const struct commonio_entry *p;
+	char **names;
+	unsigned int l;
+	size_t i;
 
-			buflen += BUFLEN;
-			cp = (char *) realloc (buf, buflen);
-			if (NULL == cp) {
-				goto cleanup_buf;
-			}
-			buf = cp;
-			len = strlen (buf);
-			if (db->ops->fgets (buf + len,
-			                    (int) (buflen - len),
-			                    db->fp) == NULL) {
-				goto cleanup_buf;
-			}
+	memzero (bytes, sizeof bytes);
+	for (p = db->head; NULL != p; p = p->next) {
+		bytes[DB_MEMORY_ENTRIES] += sizeof *p;
+		if (NULL == p->eptr) {
+			continue;
 		}
-		cp = strrchr (buf, '\n');
-		if (NULL != cp) {
-			*cp = '\0';
+		if (NULL != db->ops->size) {
+			bytes[DB_MEMORY_OBJECTS] += db->ops->size (p->eptr);
 		}
-
-		line = strdup (buf);
-		if (NULL == line) {
-			goto cleanup_buf;
+		if (NULL == db->ops->getmembers) {
+			continue;
 		}
-
-		if (name_is_nis (line)) {
-			eptr = NULL;
-		} else {
-			eptr = db->ops->parse (line);
-			if (NULL != eptr) {
-				eptr = db->ops->dup (eptr);
-				if (NULL == eptr) {
-					goto cleanup_line;
-				}
+		for (l = 0;
+		     NULL != (names = db->ops->getmembers (p->eptr, l));
+		     l++) {
+			for (i = 0; NULL != names[i]; i++) {
+				bytes[DB_MEMORY_MEMBERS] +=   sizeof (char *)
+				                            + strlen (names[i]) + 1;
 			}
+			bytes[DB_MEMORY_MEMBERS] += sizeof (char *);
 		}
+	}
+	bytes[DB_MEMORY_LINES] = db->map_size + db->arena.total;
+	bytes[DB_MEMORY_INDEXES] =
+	      (  db->name_index_size + db->id_index_size
+	       + db->gid_index_size) * sizeof (struct commonio_entry *)
+	    + db->member_index_size * sizeof (struct member_node *);
+	metrics_db_memory (db->filename, bytes);
+}
 
-		p = (struct commonio_entry *) malloc (sizeof *p);
-		if (NULL == p) {
-			goto cleanup_entry;
+/*
+ * note_open_dbs - Note the memory of the databases which are still
+ *                 open when the program exits.
+ *
+ *	It is registered with atexit() after the report of the timings,
+ *	thus it runs before it.
+ */
+static void note_open_dbs (void)
+{
+	size_t i;
+
+	for (i = 0; i < MEMORY_DBS; i++) {
+		if (NULL != memory_dbs[i]) {
+			note_memory (memory_dbs[i]);
 		}
+	}
+}
 
-		p->eptr = eptr;
-		p->line = line;
-		p->changed = false;
+/*
+ * watch_memory - Note the memory of the database when it is opened,
+ *                and when it is released or the program exits.
+ */
+static void watch_memory (struct commonio_db *db)
+{
+	size_t i;
 
-		add_one_entry (db, p);
+	note_memory (db);
+	if (!memory_exit) {
+		memory_exit = (atexit (note_open_dbs) == 0);
+	}
+	for (i = 0; i < MEMORY_DBS; i++) {
+		if (NULL == memory_dbs[i]) {
+			memory_dbs[i] = db;
+			return;
+		}
 	}
+}
 
-	free (buf);
+static void free_linked_list (struct commonio_db *db)
+{
+	struct commonio_entry *p;
+	size_t i;
 
-	if (ferror (db->fp) != 0) {
-		goto cleanup_errno;
+	for (i = 0; i < MEMORY_DBS; i++) {
+		if (memory_dbs[i] == db) {
+			memory_dbs[i] = NULL;
+			note_memory (db);
+		}
 	}
+	while (NULL != db->head) {
+		p = db->head;
+		db->head = p->next;
 
-	if ((NULL != db->ops->open_hook) && (db->ops->open_hook () == 0)) {
-		goto cleanup_errno;
+		if (NULL != p->eptr) {
+			db->ops->free (p->eptr);
+		}
+	}
+	db->tail = NULL;
+	db->nis_first = NULL;
+	db->nis_known = false;
+	index_free (db);
+	id_index_free (db);
+	gid_index_free (db);
+	member_index_free (db);
+	db->member_lookup = false;
+	if (NULL != db->type_index) {
+		db->ops->free_index (db->type_index);
+		db->type_index = NULL;
 	}
+	unmap_file (db);
+	/* The entries and lines */
+	arena_release (&db->entry_arena);
+	arena_release (&db->arena);
+	/* The removals which were not committed */
+	free (db->feed_removed.data);
+	memzero (&db->feed_removed, sizeof db->feed_removed);
+	/* The sequence is read again with the next open */
+	memzero (&db->seq, sizeof db->seq);
+	/* The shards are listed again with the next open */
+	shards_free (db);
+}
 
-	db->isopen = true;
+
+/*
+ * commonio_set_offline - write the files for an image which is not the
+ *                        running system
+ *
+ *	The files are still locked and replaced atomically, but they are
+ *	written without backups and without fsync, and the name service
+ *	caches are not flushed. This is for the images built with --prefix
+ *	or --root, where the durability of a live system is not needed.
+ */
+void commonio_set_offline (bool enable)
+{
+	offline = enable;
+}
+
+/*
+ * commonio_buf_reserve - Make room for n more bytes in buf.
+ *
+ *	Return where the bytes shall be written, at buf->data + buf->len.
+ *	The caller advances buf->len once they are written.
+ *	On failure, NULL is returned and buf is unchanged.
+ */
+/*@null@*/char *commonio_buf_reserve (struct commonio_buf *buf, size_t n)
+{
+	char *data;
+	size_t size;
+
+	if (buf->size - buf->len < n) {
+		if (n > SIZE_MAX / 2 - buf->len) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		size = buf->size * 2;
+		if (size < buf->len + n) {
+			size = buf->len + n;
+		}
+		data = (char *) realloc (buf->data, size);
+		if (NULL == data) {
+			return NULL;
+		}
+		buf->data = data;
+		buf->size = size;
+	}
+	return buf->data + buf->len;
+}
+
+int commonio_setname (struct commonio_db *db, const char *name)
+{
+	snprintf (db->filename, sizeof (db->filename), "%s", name);
 	return 1;
+}
 
-      cleanup_entry:
-	if (NULL != eptr) {
-		db->ops->free (eptr);
+
+bool commonio_present (const struct commonio_db *db)
+{
+	return (access (db->filename, F_OK) == 0);
+}
+
+
+int commonio_lock_nowait (struct commonio_db *db, bool log)
+{
+	char* file = NULL;
+	char* lock = NULL;
+	size_t lock_file_len;
+	size_t file_len;
+	int err = 0;
+
+	if (db->locked) {
+		return 1;
 	}
-      cleanup_line:
-	free (line);
-      cleanup_buf:
+	file_len = strlen(db->filename) + 11;/* %lu max size */
+	lock_file_len = strlen(db->filename) + 6; /* sizeof ".lock" */
+	file = (char*)malloc(file_len);
+	if(file == NULL) {
+		goto cleanup_ENOMEM;
+	}
+	lock = (char*)malloc(lock_file_len);
+	if(lock == NULL) {
+		goto cleanup_ENOMEM;
+	}
+	snprintf (file, file_len, "%s.%lu",
+	          db->filename, (unsigned long) getpid ());
+	snprintf (lock, lock_file_len, "%s.lock", db->filename);
+	if (do_lock_file (file, lock, log) != 0) {
+		db->locked = true;
+		timing_start (&db->locked_at);
+		lock_count++;
+		err = 1;
+	}
+cleanup_ENOMEM:
+	if(file)
+		free(file);
+	if(lock)
+		free(lock);
+	return err;
+}
+
+
+#ifndef LOCK_TRIES
+#define LOCK_TRIES 15
+#endif
+
+#ifndef LOCK_SLEEP
+#define LOCK_SLEEP 1
+#endif
+
+/*
+ * Bounds of the delay between two attempts to get a lock, in ms.
+ */
+#define LOCK_MIN_DELAY 1
+#define LOCK_MAX_DELAY 100
+
+/*
+ * lock_delay - Sleep for the given number of milliseconds.
+ */
+static void lock_delay (unsigned long ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t) (ms / 1000);
+	ts.tv_nsec = (long) ((ms % 1000) * 1000000);
+	while ((nanosleep (&ts, &ts) != 0) && (EINTR == errno)) {
+		/* continue with the remaining time */
+	}
+}
+
+/*
+ * elapsed_ms - Milliseconds elapsed since start, or 0 if start is not
+ *              known.
+ */
+static unsigned long elapsed_ms (const struct timespec *start)
+{
+	struct timespec now;
+
+	if (   (start->tv_nsec < 0)
+	    || (clock_gettime (CLOCK_MONOTONIC, &now) != 0)) {
+		return 0;
+	}
+	return (unsigned long) (  ((long long) now.tv_sec - (long long) start->tv_sec)
+	                            * 1000LL
+	                        + ((long long) now.tv_nsec - (long long) start->tv_nsec)
+	                            / 1000000LL);
+}
+
+/*
+ * lock_wait_log - Log the time waited since start for the lock of file,
+ *                 when it was held by another process and the wait
+ *                 exceeded LOCK_WAIT_LOG milliseconds.
+ */
+static void lock_wait_log (const char *file, const struct timespec *start)
+{
+	unsigned long threshold, ms;
+
+	threshold = (unsigned long) getdef_unum ("LOCK_WAIT_LOG", 0);
+	if (   (0 == threshold)
+	    || ((0 == lock_holder) && (0 == lock_queue_depth))
+	    || (start->tv_nsec < 0)) {
+		return;
+	}
+
+	ms = elapsed_ms (start);
+	if (ms < threshold) {
+		return;
+	}
+	if (0 == lock_queue_depth) {
+		SYSLOG ((LOG_WARN, "waited %lu ms for the lock of %s, held by PID %lu",
+		         ms, file, (unsigned long) lock_holder));
+	} else if (0 == lock_holder) {
+		SYSLOG ((LOG_WARN, "waited %lu ms for the lock of %s, %lu processes ahead in the queue",
+		         ms, file, lock_queue_depth));
+	} else {
+		SYSLOG ((LOG_WARN, "waited %lu ms for the lock of %s, held by PID %lu, %lu processes ahead in the queue",
+		         ms, file, (unsigned long) lock_holder,
+		         lock_queue_depth));
+	}
+}
+
+/*
+ * Lock queue (LOCK_QUEUE)
+ *
+ * The lock file cannot be waited for: the processes waiting for it retry
+ * with a backoff, and a process which locks the database again right
+ * after unlocking it may get the lock before all of them. With
+ * LOCK_QUEUE, the processes which wait take a ticket in <file>.lockq,
+ * and get the lock in the order of their tickets:
+ *
+ *	- The ticket counter is at the start of the file. It is incremented
+ *	  under a lock of its bytes, and reset when the queue is empty.
+ *	- Each process holds a write lock on the byte LOCK_QUEUE_BASE +
+ *	  ticket of the file, from its ticket to its unlock.
+ *	- A process waits with a read lock on the bytes of the tickets
+ *	  before its own, which is granted when all the processes ahead
+ *	  left the queue, or died.
+ *
+ * The locks are open file description locks, released by the kernel
+ * when the process exits. The first process of the queue then takes the
+ * lock file as before: the processes which do not use the queue are
+ * still excluded by the lock file.
+ */
+#ifdef F_OFD_SETLKW
+#define LOCK_QUEUE_BASE	4096
+
+/*
+ * Databases with a place in their lock queue, whose descriptors are
+ * closed in the forked children by commonio_close_queues.
+ */
+#define QUEUE_DBS	16
+static /*@dependent@*/ /*@null@*/struct commonio_db *queue_dbs[QUEUE_DBS];
+
+static int lock_queue_setlk (int fd, int cmd, short type, off_t start,
+                             off_t len)
+{
+	struct flock fl;
+
+	memzero (&fl, sizeof fl);
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+	return fcntl (fd, cmd, &fl);
+}
+
+/*
+ * lock_queue_ahead - Number of the processes with a ticket below ticket
+ *                    in the queue open as fd.
+ */
+static unsigned long lock_queue_ahead (int fd, off_t ticket)
+{
+	struct flock fl;
+	unsigned long n = 0;
+	off_t start = 0;
+
+	while (start < ticket) {
+		memzero (&fl, sizeof fl);
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = LOCK_QUEUE_BASE + start;
+		fl.l_len = ticket - start;
+		if ((fcntl (fd, F_OFD_GETLK, &fl) != 0) || (F_UNLCK == fl.l_type)) {
+			break;
+		}
+		n++;
+		start = fl.l_start - LOCK_QUEUE_BASE + 1;
+	}
+	return n;
+}
+
+/*
+ * lock_queue_enter - Take a ticket in the lock queue of the database.
+ *
+ *	It returns the ticket, or -1 if the queue is not used (with
+ *	LOCK_QUEUE unset, without open file description locks, or if the
+ *	name of the queue file is too long).
+ */
+static off_t lock_queue_enter (struct commonio_db *db)
+{
+	char name[1024];
+	uint64_t next;
+	off_t ticket = -1;
+	size_t slot;
+	int fd;
+
+	lock_queue_depth = 0;
+	if (db->queued || db->locked || !getdef_bool ("LOCK_QUEUE")) {
+		return -1;
+	}
+	for (slot = 0; slot < QUEUE_DBS; slot++) {
+		if (NULL == queue_dbs[slot]) {
+			break;
+		}
+	}
+	if (QUEUE_DBS == slot) {
+		return -1;
+	}
+	if ((size_t) snprintf (name, sizeof name, "%s.lockq",
+	                       db->filename) >= sizeof name) {
+		return -1;
+	}
+	fd = open (name, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+	if (lock_queue_setlk (fd, F_OFD_SETLKW, F_WRLCK, 0,
+	                      (off_t) sizeof next) != 0) {
+		(void) close (fd);
+		return -1;
+	}
+	if (pread (fd, &next, sizeof next, 0) != (ssize_t) sizeof next) {
+		next = 0;
+	}
+	/* Nobody is in the queue: start again from the first ticket */
+	if (   (next > (uint64_t) INT32_MAX)
+	    || (lock_queue_ahead (fd, (off_t) next) == 0)) {
+		next = 0;
+	}
+	if (lock_queue_setlk (fd, F_OFD_SETLK, F_WRLCK,
+	                      LOCK_QUEUE_BASE + (off_t) next, 1) == 0) {
+		ticket = (off_t) next;
+		next++;
+		if (pwrite (fd, &next, sizeof next, 0) != (ssize_t) sizeof next) {
+			ticket = -1;
+		}
+	}
+	(void) lock_queue_setlk (fd, F_OFD_SETLK, F_UNLCK, 0,
+	                         (off_t) sizeof next);
+	if (-1 == ticket) {
+		(void) close (fd);
+		return -1;
+	}
+
+	db->lock_queue = fd;
+	db->queued = true;
+	queue_dbs[slot] = db;
+	lock_queue_depth = lock_queue_ahead (fd, ticket);
+	return ticket;
+}
+
+static void lock_queue_alarm (unused int sig)
+{
+	/* interrupt the wait */
+}
+
+/*
+ * lock_queue_wait - Wait until the processes ahead in the lock queue of
+ *                   the database left it, for at most ms milliseconds.
+ *
+ *	It returns 1 if the process is the first of the queue, 0 otherwise.
+ */
+static int lock_queue_wait (struct commonio_db *db, off_t ticket,
+                            unsigned long ms)
+{
+	struct sigaction sa, oldsa;
+	struct itimerval it, oldit;
+	int ret;
+
+	if (0 == ticket) {
+		return 1;
+	}
+	if (0 == ms) {
+		ret = lock_queue_setlk (db->lock_queue, F_OFD_SETLK, F_RDLCK,
+		                        LOCK_QUEUE_BASE, ticket);
+	} else {
+		/* The wait is interrupted by SIGALRM, like in lckpwdf() */
+		memzero (&sa, sizeof sa);
+		sa.sa_handler = lock_queue_alarm;
+		(void) sigemptyset (&sa.sa_mask);
+		(void) sigaction (SIGALRM, &sa, &oldsa);
+		memzero (&it, sizeof it);
+		it.it_value.tv_sec = (time_t) (ms / 1000);
+		it.it_value.tv_usec = (suseconds_t) ((ms % 1000) * 1000);
+		(void) setitimer (ITIMER_REAL, &it, &oldit);
+		ret = lock_queue_setlk (db->lock_queue, F_OFD_SETLKW, F_RDLCK,
+		                        LOCK_QUEUE_BASE, ticket);
+		(void) setitimer (ITIMER_REAL, &oldit, NULL);
+		(void) sigaction (SIGALRM, &oldsa, NULL);
+	}
+	if (0 != ret) {
+		return 0;
+	}
+	(void) lock_queue_setlk (db->lock_queue, F_OFD_SETLK, F_UNLCK,
+	                         LOCK_QUEUE_BASE, ticket);
+	return 1;
+}
+
+/*
+ * lock_queue_leave - Leave the lock queue of the database, if the
+ *                    process is in it.
+ */
+static void lock_queue_leave (struct commonio_db *db)
+{
+	size_t i;
+
+	if (db->queued) {
+		(void) close (db->lock_queue);
+		db->queued = false;
+		for (i = 0; i < QUEUE_DBS; i++) {
+			if (queue_dbs[i] == db) {
+				queue_dbs[i] = NULL;
+			}
+		}
+	}
+}
+
+/*
+ * commonio_close_queues - Close the lock queues inherited by a child.
+ *
+ *	The lock queue of a database is held by its open file description,
+ *	which a forked child shares with its parent: a child which does not
+ *	exec (the descriptors are close-on-exec) and outlives the lock of
+ *	its parent must call this, or the processes behind in the queues
+ *	wait for it. The locks of the parent are not changed.
+ */
+void commonio_close_queues (void)
+{
+	size_t i;
+
+	for (i = 0; i < QUEUE_DBS; i++) {
+		if (NULL != queue_dbs[i]) {
+			(void) close (queue_dbs[i]->lock_queue);
+			queue_dbs[i]->queued = false;
+			queue_dbs[i] = NULL;
+		}
+	}
+}
+#else				/* !F_OFD_SETLKW */
+static off_t lock_queue_enter (unused struct commonio_db *db)
+{
+	lock_queue_depth = 0;
+	return -1;
+}
+
+static int lock_queue_wait (unused struct commonio_db *db,
+                            unused off_t ticket, unused unsigned long ms)
+{
+	return 1;
+}
+
+static void lock_queue_leave (unused struct commonio_db *db)
+{
+}
+
+void commonio_close_queues (void)
+{
+}
+#endif				/* !F_OFD_SETLKW */
+
+/*
+ * lock_with_retries - Lock the database, waiting for other processes
+ *                     (see LOCK_TIMEOUT).
+ */
+static int lock_with_retries (struct commonio_db *db)
+{
+/*#ifdef HAVE_LCKPWDF*/ /* not compatible with prefix option*/
+#if 0
+	/*
+	 * only if the system libc has a real lckpwdf() - the one from
+	 * lockpw.c calls us and would cause infinite recursion!
+	 */
+
+	/*
+	 * Call lckpwdf() on the first lock.
+	 * If it succeeds, call *_lock() only once
+	 * (no retries, it should always succeed).
+	 */
+	if (0 == lock_count) {
+		if (lckpwdf () == -1) {
+			if (geteuid () != 0) {
+				(void) fprintf (stderr,
+				                "%s: Permission denied.\n",
+				                Prog);
+			}
+			return 0;	/* failure */
+		}
+	}
+
+	if (commonio_lock_nowait (db, true) != 0) {
+		return 1;	/* success */
+	}
+
+	ulckpwdf ();
+	return 0;		/* failure */
+#else				/* !HAVE_LCKPWDF */
+	unsigned long timeout, waited = 0, delay = LOCK_MIN_DELAY;
+	struct timespec start;
+	off_t ticket;
+	bool last;
+
+	/*
+	 * lckpwdf() not used - do it the old way.
+	 *
+	 * The lock file cannot be waited for, so retry with an
+	 * exponential backoff: a lock released by another process is
+	 * noticed quickly, without busy looping on a long wait.
+	 *
+	 * With LOCK_QUEUE, the process first waits for its turn in the
+	 * lock queue, and is woken as soon as the processes ahead left it.
+	 */
+	timeout = (unsigned long) getdef_unum ("LOCK_TIMEOUT",
+	                                       LOCK_TRIES * LOCK_SLEEP) * 1000;
+	ticket = lock_queue_enter (db);
+	if (ticket > 0) {
+		if (clock_gettime (CLOCK_MONOTONIC, &start) != 0) {
+			start.tv_nsec = -1;
+		}
+		(void) lock_queue_wait (db, ticket, timeout);
+		waited = elapsed_ms (&start);
+		if (waited > timeout) {
+			waited = timeout;
+		}
+	}
+	for (;;) {
+		last = (waited >= timeout);
+		if (commonio_lock_nowait (db, last) != 0) {
+			return 1;	/* success */
+		}
+		/* no unnecessary retries on "permission denied" errors */
+		if (geteuid () != 0) {
+			(void) fprintf (stderr, "%s: Permission denied.\n",
+			                Prog);
+			lock_queue_leave (db);
+			return 0;
+		}
+		if (last) {
+			lock_queue_leave (db);
+			return 0;	/* failure */
+		}
+
+		if (delay > timeout - waited) {
+			delay = timeout - waited;
+		}
+		lock_delay (delay);	/* delay between retries */
+		waited += delay;
+		delay *= 2;
+		if (delay > LOCK_MAX_DELAY) {
+			delay = LOCK_MAX_DELAY;
+		}
+	}
+#endif				/* !HAVE_LCKPWDF */
+}
+
+/*
+ * commonio_lock - Lock the database.
+ *
+ *	The wait is timed as TIMING_LOCK, with the number of processes
+ *	ahead in the lock queue (LOCK_QUEUE) as its entries, and logged
+ *	with the PID of the process which held the lock if it exceeds
+ *	LOCK_WAIT_LOG.
+ */
+int commonio_lock (struct commonio_db *db)
+{
+	struct timespec start, waited;
+	int ret;
+
+	SHADOW_PROBE1 (commonio_lock__entry, db->filename);
+	lock_holder = 0;
+	timing_start (&start);
+	if (clock_gettime (CLOCK_MONOTONIC, &waited) != 0) {
+		waited.tv_nsec = -1;
+	}
+	ret = lock_with_retries (db);
+	timing_stop (TIMING_LOCK, &start, lock_queue_depth, 0);
+	lock_wait_log (db->filename, &waited);
+	SHADOW_PROBE2 (commonio_lock__return, db->filename, ret);
+	return ret;
+}
+
+static int lock_set_cmp (const void *p1, const void *p2)
+{
+	const struct commonio_db *db1 = *(struct commonio_db *const *) p1;
+	const struct commonio_db *db2 = *(struct commonio_db *const *) p2;
+
+	return strcmp (db1->filename, db2->filename);
+}
+
+/*
+ * commonio_lock_set - Lock a set of databases, all or none.
+ *
+ *	The databases are locked in a canonical order (by file name).
+ *	If one of them is busy, the locks obtained in this attempt are
+ *	released before waiting, so that the process does not hold locks
+ *	while it sleeps. It then retries the whole set, with the backoff
+ *	and the timeout of commonio_lock(). The databases which were
+ *	already locked by the caller stay locked.
+ *
+ *	With LOCK_QUEUE, the process first waits for its turn in the lock
+ *	queue of each database, in the same order.
+ *
+ *	On failure, *failed is set to the index in dbs of the database
+ *	which could not be locked, and none of the others is locked.
+ *
+ *	It returns 1 on success, 0 on failure.
+ */
+int commonio_lock_set (struct commonio_db *const *dbs, size_t count,
+                       /*@out@*/size_t *failed)
+{
+	struct commonio_db *sorted[COMMONIO_TXN_MAX];
+	bool held[COMMONIO_TXN_MAX];
+	unsigned long timeout, slept = 0, delay = LOCK_MIN_DELAY;
+	unsigned long depth = 0;
+	struct timespec start, waited;
+	const char *busy = NULL;
+	off_t ticket;
+	size_t i, j;
+	bool last;
+	int ret = 0;
+
+	*failed = 0;
+	if (count > COMMONIO_TXN_MAX) {
+		errno = EINVAL;
+		return 0;
+	}
+	memcpy (sorted, dbs, count * sizeof (*sorted));
+	qsort (sorted, count, sizeof (*sorted), lock_set_cmp);
+	for (i = 0; i < count; i++) {
+		held[i] = sorted[i]->locked;
+	}
+
+	lock_holder = 0;
+	timing_start (&start);
+	if (clock_gettime (CLOCK_MONOTONIC, &waited) != 0) {
+		waited.tv_nsec = -1;
+	}
+	timeout = (unsigned long) getdef_unum ("LOCK_TIMEOUT",
+	                                       LOCK_TRIES * LOCK_SLEEP) * 1000;
+	for (i = 0; i < count; i++) {
+		ticket = lock_queue_enter (sorted[i]);
+		depth += lock_queue_depth;
+		if (ticket > 0) {
+			(void) lock_queue_wait (sorted[i], ticket,
+			                        timeout - slept);
+			slept = elapsed_ms (&waited);
+			if (slept > timeout) {
+				slept = timeout;
+			}
+		}
+	}
+	lock_queue_depth = depth;
+	for (;;) {
+		last = (slept >= timeout);
+		for (i = 0; i < count; i++) {
+			if (commonio_lock_nowait (sorted[i], last) == 0) {
+				break;
+			}
+		}
+		if (i == count) {
+			ret = 1;	/* success */
+			break;
+		}
+
+		busy = sorted[i]->filename;
+
+		/*
+		 * All or nothing. The databases may be open (see
+		 * commonio_lock_optimistic), and keep their place in the
+		 * lock queues.
+		 */
+		for (j = 0; j < i; j++) {
+			if (!held[j]) {
+				remove_lock (sorted[j]);
+			}
+		}
+		for (j = 0; j < count; j++) {
+			if (dbs[j] == sorted[i]) {
+				*failed = j;
+			}
+		}
+
+		/* no unnecessary retries on "permission denied" errors */
+		if (geteuid () != 0) {
+			(void) fprintf (stderr, "%s: Permission denied.\n",
+			                Prog);
+			break;
+		}
+		if (last) {
+			break;	/* failure */
+		}
+
+		if (delay > timeout - slept) {
+			delay = timeout - slept;
+		}
+		lock_delay (delay);	/* delay between retries */
+		slept += delay;
+		delay *= 2;
+		if (delay > LOCK_MAX_DELAY) {
+			delay = LOCK_MAX_DELAY;
+		}
+	}
+	if (0 == ret) {
+		for (j = 0; j < count; j++) {
+			if (!held[j]) {
+				lock_queue_leave (sorted[j]);
+			}
+		}
+	}
+	timing_stop (TIMING_LOCK, &start, depth, 0);
+	if (NULL != busy) {
+		lock_wait_log (busy, &waited);
+	} else if ((0 != depth) && (0 != count)) {
+		lock_wait_log (sorted[0]->filename, &waited);
+	}
+	return ret;
+}
+
+static void dec_lock_count (void)
+{
+	if (lock_count > 0) {
+		lock_count--;
+		if (lock_count == 0) {
+			/* Flush the caches when the program exits,
+			   if any of the files were changed.  */
+			if (nscd_need_reload && !offline) {
+				cache_flush_defer (CACHE_DB_PASSWD | CACHE_DB_GROUP);
+				nscd_need_reload = false;
+			}
+#ifdef HAVE_LCKPWDF
+			ulckpwdf ();
+#endif				/* HAVE_LCKPWDF */
+		}
+	}
+}
+
+
+/*
+ * remove_lock - Remove the lock file of a locked database.
+ *
+ *	The process keeps its place in the lock queue, if any.
+ */
+static void remove_lock (struct commonio_db *db)
+{
+	char lock[1024];
+
+	/*
+	 * Unlock in reverse order: remove the lock file,
+	 * then call ulckpwdf() (if used) on last unlock.
+	 */
+	db->locked = false;
+	snprintf (lock, sizeof lock, "%s.lock", db->filename);
+	unlink (lock);
+	timing_stop (TIMING_LOCK_HELD, &db->locked_at, 0, 0);
+	dec_lock_count ();
+}
+
+int commonio_unlock (struct commonio_db *db)
+{
+	if (db->isopen) {
+		db->readonly = true;
+		if (commonio_close (db) == 0) {
+			if (db->locked) {
+				dec_lock_count ();
+			}
+			return 0;
+		}
+	}
+	if (db->locked) {
+		remove_lock (db);
+		lock_queue_leave (db);
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Initial number of buckets of the name index.
+ * The index is grown (rebuilt) when it holds more entries than buckets.
+ */
+#define INDEX_MIN_SIZE 256
+
+/*
+ * name_hash - FNV-1a hash of a name of the given length
+ */
+static size_t name_hash (const char *name, size_t len)
+{
+	size_t h = 2166136261U;
+
+	for (; len > 0; len--, name++) {
+		h ^= (unsigned char) *name;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * ent_name, ent_id, ent_gid - Return the name, ID and group ID of an
+ *                             object.
+ *
+ *	When the type of the database describes the layout of its objects,
+ *	the fields are read directly, without an indirect call.
+ */
+static inline const char *ent_name (const struct commonio_db *db,
+                                    const void *eptr)
+{
+	const struct commonio_ops *ops = db->ops;
+
+	if (ops->has_fields) {
+		return *(char *const *) ((const char *) eptr + ops->name_offset);
+	}
+	return ops->getname (eptr);
+}
+
+/* The uid_t and gid_t fields have the same representation as id_t */
+static inline id_t ent_id (const struct commonio_db *db, const void *eptr)
+{
+	const struct commonio_ops *ops = db->ops;
+
+	if (ops->has_fields && (0 != ops->id_offset)) {
+		return (id_t) *(const uid_t *) ((const char *) eptr
+		                                + ops->id_offset);
+	}
+	return ops->getid (eptr);
+}
+
+static inline id_t ent_gid (const struct commonio_db *db, const void *eptr)
+{
+	const struct commonio_ops *ops = db->ops;
+
+	if (ops->has_fields && (0 != ops->groupid_offset)) {
+		return (id_t) *(const gid_t *) ((const char *) eptr
+		                                + ops->groupid_offset);
+	}
+	return ops->getgroupid (eptr);
+}
+
+/*
+ * entry_key - Return the name of an entry, as used by the name index.
+ *
+ *	The name of the entries read from the file is the first field of
+ *	the line. This avoids parsing the entries to index them. It is
+ *	also the name returned by getname for the valid entries, and it
+ *	does not change when the entry is updated.
+ *	The name of the new entries is given by getname.
+ *
+ *	It returns NULL for the entries which are not indexed (NIS
+ *	entries).
+ */
+static /*@null@*/const char *entry_key (const struct commonio_db *db,
+                                        const struct commonio_entry *p,
+                                        size_t *len)
+{
+	const char *name;
+
+	if (NULL != p->line) {
+		if (name_is_nis (p->line)) {
+			return NULL;
+		}
+		*len = strcspn (p->line, ":");
+		return p->line;
+	}
+	if (NULL == p->eptr) {
+		return NULL;
+	}
+	name = ent_name (db, p->eptr);
+	*len = strlen (name);
+	return name;
+}
+
+/*
+ * entry_has_name - Check if an entry is a valid entry with the given name.
+ *
+ *	The entry is only parsed if the first field of its line matches.
+ *
+ *	It returns 1 if it has the name, 0 if not, and -1 with errno set to
+ *	ENOMEM if it could not be parsed.
+ */
+static int entry_has_name (const struct commonio_db *db,
+                           struct commonio_entry *p,
+                           const char *name, size_t len)
+{
+	const char *key;
+	size_t keylen;
+	void *eptr;
+
+	key = entry_key (db, p, &keylen);
+	if (   (NULL == key)
+	    || (keylen != len)
+	    || (memcmp (key, name, len) != 0)) {
+		return 0;
+	}
+	eptr = commonio_entry_eptr (db, p);
+	if (!p->parsed) {
+		return -1;
+	}
+	return ((NULL != eptr) && (strcmp (ent_name (db, eptr), name) == 0)) ? 1 : 0;
+}
+
+static /*@dependent@*/ /*@null@*/struct commonio_entry **index_bucket (
+	const struct commonio_db *db,
+	const char *name, size_t len)
+{
+	return &db->name_index[name_hash (name, len) & (db->name_index_size - 1)];
+}
+
+static void index_free (struct commonio_db *db)
+{
+	if (NULL != db->name_index) {
+		free (db->name_index);
+		db->name_index = NULL;
+	}
+	db->name_index_size = 0;
+	db->name_index_count = 0;
+}
+
+/*
+ * index_link - Add an entry at the end of its hash chain.
+ *
+ * The chains keep the entries in the order they were inserted.
+ */
+static void index_link (struct commonio_db *db, struct commonio_entry *p)
+{
+	struct commonio_entry **pp;
+	const char *key;
+	size_t len;
+
+	key = entry_key (db, p, &len);
+	if (NULL == key) {
+		return;
+	}
+	pp = index_bucket (db, key, len);
+	while (NULL != *pp) {
+		pp = &(*pp)->name_next;
+	}
+	p->name_next = NULL;
+	*pp = p;
+	db->name_index_count++;
+}
+
+/*
+ * index_build - Build the name index of the database.
+ *
+ * The entries are inserted in list order, so that the first entry of a
+ * hash chain matching a name is also the first of the list.
+ *
+ * It returns false if the index could not be allocated. The lookups
+ * will then fall back to a linear scan of the list.
+ */
+static bool index_build (struct commonio_db *db)
+{
+	struct commonio_entry *p;
+	size_t count = 0;
+	size_t size = INDEX_MIN_SIZE;
+
+	for (p = db->head; NULL != p; p = p->next) {
+		count++;
+	}
+	while (size < count) {
+		size *= 2;
+	}
+
+	index_free (db);
+	db->name_index = (struct commonio_entry **)
+	                 calloc (size, sizeof (struct commonio_entry *));
+	if (NULL == db->name_index) {
+		return false;
+	}
+	db->name_index_size = size;
+
+	for (p = db->head; NULL != p; p = p->next) {
+		index_link (db, p);
+	}
+	return true;
+}
+
+/*
+ * index_insert - Register a new entry in the name index, if the index
+ *                was already built.
+ */
+static void index_insert (struct commonio_db *db, struct commonio_entry *p)
+{
+	if (NULL == db->name_index) {
+		return;
+	}
+	if (db->name_index_count >= db->name_index_size) {
+		/* p is already linked in the list */
+		(void) index_build (db);
+		return;
+	}
+	index_link (db, p);
+}
+
+/*
+ * index_remove - Remove an entry from the name index.
+ */
+static void index_remove (struct commonio_db *db,
+                          const struct commonio_entry *p)
+{
+	struct commonio_entry **pp;
+	const char *key;
+	size_t len;
+
+	if (NULL == db->name_index) {
+		return;
+	}
+	key = entry_key (db, p, &len);
+	if (NULL == key) {
+		return;
+	}
+	pp = index_bucket (db, key, len);
+	while (NULL != *pp) {
+		if (*pp == p) {
+			*pp = p->name_next;
+			db->name_index_count--;
+			return;
+		}
+		pp = &(*pp)->name_next;
+	}
+}
+
+
+/*
+ * id_hash - hash of a numerical ID (Fibonacci hashing)
+ */
+#define id_hash(id) ((size_t) ((unsigned long) (id) * 2654435761UL))
+
+static void id_index_free (struct commonio_db *db)
+{
+	if (NULL != db->id_index) {
+		free (db->id_index);
+		db->id_index = NULL;
+	}
+	db->id_index_size = 0;
+	db->id_index_count = 0;
+}
+
+static void id_index_link (struct commonio_db *db, struct commonio_entry *p)
+{
+	struct commonio_entry **pp;
+
+	pp = &db->id_index[  id_hash (ent_id (db, p->eptr))
+	                   & (db->id_index_size - 1)];
+	while (NULL != *pp) {
+		pp = &(*pp)->id_next;
+	}
+	p->id_next = NULL;
+	*pp = p;
+	db->id_index_count++;
+}
+
+/*
+ * id_index_build - Build the ID index of the database.
+ *
+ * Like the name index, it is built in list order. It returns false if
+ * the database has no getid operation or if the index could not be
+ * allocated.
+ */
+static bool id_index_build (struct commonio_db *db)
+{
+	struct commonio_entry *p;
+	size_t count = 0;
+	size_t size = INDEX_MIN_SIZE;
+
+	if (NULL == db->ops->getid) {
+		return false;
+	}
+	/* The lookups scan the list if an entry cannot be parsed */
+	if (commonio_parse_entries (db) != 0) {
+		return false;
+	}
+
+	for (p = db->head; NULL != p; p = p->next) {
+		count++;
+	}
+	while (size < count) {
+		size *= 2;
+	}
+
+	id_index_free (db);
+	db->id_index = (struct commonio_entry **)
+	               calloc (size, sizeof (struct commonio_entry *));
+	if (NULL == db->id_index) {
+		return false;
+	}
+	db->id_index_size = size;
+
+	for (p = db->head; NULL != p; p = p->next) {
+		if (NULL != commonio_entry_eptr (db, p)) {
+			id_index_link (db, p);
+		}
+	}
+	return true;
+}
+
+static void id_index_insert (struct commonio_db *db, struct commonio_entry *p)
+{
+	if ((NULL == db->id_index) || (NULL == p->eptr)) {
+		return;
+	}
+	if (db->id_index_count >= db->id_index_size) {
+		(void) id_index_build (db);
+		return;
+	}
+	id_index_link (db, p);
+}
+
+static void id_index_remove (struct commonio_db *db,
+                             const struct commonio_entry *p)
+{
+	struct commonio_entry **pp;
+
+	if ((NULL == db->id_index) || (NULL == p->eptr)) {
+		return;
+	}
+	pp = &db->id_index[  id_hash (ent_id (db, p->eptr))
+	                   & (db->id_index_size - 1)];
+	while (NULL != *pp) {
+		if (*pp == p) {
+			*pp = p->id_next;
+			db->id_index_count--;
+			return;
+		}
+		pp = &(*pp)->id_next;
+	}
+}
+
+static void gid_index_free (struct commonio_db *db)
+{
+	if (NULL != db->gid_index) {
+		free (db->gid_index);
+		db->gid_index = NULL;
+	}
+	db->gid_index_size = 0;
+	db->gid_index_count = 0;
+}
+
+static void gid_index_link (struct commonio_db *db, struct commonio_entry *p)
+{
+	struct commonio_entry **pp;
+
+	pp = &db->gid_index[  id_hash (ent_gid (db, p->eptr))
+	                    & (db->gid_index_size - 1)];
+	while (NULL != *pp) {
+		pp = &(*pp)->gid_next;
+	}
+	p->gid_next = NULL;
+	*pp = p;
+	db->gid_index_count++;
+}
+
+/*
+ * gid_index_build - Build the group ID index of the database.
+ *
+ * It returns false if the database has no getgroupid operation or if
+ * the index could not be allocated.
+ */
+static bool gid_index_build (struct commonio_db *db)
+{
+	struct commonio_entry *p;
+	size_t count = 0;
+	size_t size = INDEX_MIN_SIZE;
+
+	if (NULL == db->ops->getgroupid) {
+		return false;
+	}
+	/* The lookups scan the list if an entry cannot be parsed */
+	if (commonio_parse_entries (db) != 0) {
+		return false;
+	}
+
+	for (p = db->head; NULL != p; p = p->next) {
+		count++;
+	}
+	while (size < count) {
+		size *= 2;
+	}
+
+	gid_index_free (db);
+	db->gid_index = (struct commonio_entry **)
+	                calloc (size, sizeof (struct commonio_entry *));
+	if (NULL == db->gid_index) {
+		return false;
+	}
+	db->gid_index_size = size;
+
+	for (p = db->head; NULL != p; p = p->next) {
+		if (NULL != commonio_entry_eptr (db, p)) {
+			gid_index_link (db, p);
+		}
+	}
+	return true;
+}
+
+static void gid_index_insert (struct commonio_db *db,
+                              struct commonio_entry *p)
+{
+	if ((NULL == db->gid_index) || (NULL == p->eptr)) {
+		return;
+	}
+	if (db->gid_index_count >= db->gid_index_size) {
+		(void) gid_index_build (db);
+		return;
+	}
+	gid_index_link (db, p);
+}
+
+static void gid_index_remove (struct commonio_db *db,
+                              const struct commonio_entry *p)
+{
+	struct commonio_entry **pp;
+
+	if ((NULL == db->gid_index) || (NULL == p->eptr)) {
+		return;
+	}
+	pp = &db->gid_index[  id_hash (ent_gid (db, p->eptr))
+	                    & (db->gid_index_size - 1)];
+	while (NULL != *pp) {
+		if (*pp == p) {
+			*pp = p->gid_next;
+			db->gid_index_count--;
+			return;
+		}
+		pp = &(*pp)->gid_next;
+	}
+}
+
+
+/*
+ * Node of the member index: an entry listing name.
+ *
+ * name points to the object of the entry. The nodes of an entry are
+ * removed before its object is released.
+ */
+struct member_node {
+	/*@dependent@*/const char *name;
+	/*@dependent@*/struct commonio_entry *entry;
+	/*@dependent@*/ /*@null@*/struct member_node *next;
+};
+
+static void member_index_free (struct commonio_db *db)
+{
+	if (NULL != db->member_index) {
+		free (db->member_index);
+		db->member_index = NULL;
+	}
+	db->member_index_size = 0;
+	db->member_index_count = 0;
+	/* The nodes are in the arena */
+	db->member_free = NULL;
+}
+
+static /*@dependent@*/struct member_node **member_bucket (
+	const struct commonio_db *db, const char *name)
+{
+	return &db->member_index[  name_hash (name, strlen (name))
+	                         & (db->member_index_size - 1)];
+}
+
+/*
+ * member_index_grow - Double the number of buckets of the member index.
+ *
+ *	The index is kept as is if the new buckets cannot be allocated.
+ */
+static void member_index_grow (struct commonio_db *db)
+{
+	struct member_node **old = db->member_index;
+	size_t old_size = db->member_index_size;
+	size_t i;
+
+	db->member_index = (struct member_node **)
+	                   calloc (old_size * 2, sizeof (struct member_node *));
+	if (NULL == db->member_index) {
+		db->member_index = old;
+		return;
+	}
+	db->member_index_size = old_size * 2;
+	for (i = 0; i < old_size; i++) {
+		struct member_node *n, *next;
+
+		for (n = old[i]; NULL != n; n = next) {
+			struct member_node **pp = member_bucket (db, n->name);
+
+			next = n->next;
+			n->next = *pp;
+			*pp = n;
+		}
+	}
+	free (old);
+}
+
+/*
+ * member_index_link - Add the nodes of an entry to the member index.
+ *
+ *	They are added at the head of their hash chains. A name listed
+ *	several times by the entry is only added once.
+ *
+ *	It returns false if a node could not be allocated.
+ */
+static bool member_index_link (struct commonio_db *db,
+                               struct commonio_entry *p)
+{
+	unsigned int l;
+	char **names;
+
+	for (l = 0; NULL != (names = db->ops->getmembers (p->eptr, l)); l++) {
+		size_t i;
+
+		for (i = 0; NULL != names[i]; i++) {
+			struct member_node **pp = member_bucket (db, names[i]);
+			struct member_node *n;
+
+			/* The nodes of p already added are at the head */
+			for (n = *pp; (NULL != n) && (n->entry == p); n = n->next) {
+				if (strcmp (n->name, names[i]) == 0) {
+					break;
+				}
+			}
+			if ((NULL != n) && (n->entry == p)) {
+				continue;
+			}
+
+			n = db->member_free;
+			if (NULL != n) {
+				db->member_free = n->next;
+			} else {
+				n = (struct member_node *)
+				    commonio_alloc (db, sizeof *n);
+				if (NULL == n) {
+					return false;
+				}
+			}
+			n->name = names[i];
+			n->entry = p;
+			n->next = *pp;
+			*pp = n;
+			db->member_index_count++;
+		}
+	}
+	if (db->member_index_count >= 2 * db->member_index_size) {
+		member_index_grow (db);
+	}
+	return true;
+}
+
+/*
+ * member_index_build - Build the member index of the database.
+ *
+ *	The entries are added from the end of the list, so that the
+ *	entries of a name are found in the list order.
+ *
+ *	It returns false if the database has no getmembers operation or if
+ *	the index could not be allocated.
+ */
+static bool member_index_build (struct commonio_db *db)
+{
+	struct commonio_entry *p;
+
+	if (NULL == db->ops->getmembers) {
+		return false;
+	}
+	/* The lookups scan the list if an entry cannot be parsed */
+	if (commonio_parse_entries (db) != 0) {
+		return false;
+	}
+
+	member_index_free (db);
+	db->member_index = (struct member_node **)
+	                   calloc (INDEX_MIN_SIZE, sizeof (struct member_node *));
+	if (NULL == db->member_index) {
+		return false;
+	}
+	db->member_index_size = INDEX_MIN_SIZE;
+
+	for (p = db->tail; NULL != p; p = p->prev) {
+		if (   (NULL != commonio_entry_eptr (db, p))
+		    && !member_index_link (db, p)) {
+			member_index_free (db);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void member_index_insert (struct commonio_db *db,
+                                 struct commonio_entry *p)
+{
+	if ((NULL == db->member_index) || (NULL == p->eptr)) {
+		return;
+	}
+	if (!member_index_link (db, p)) {
+		/* The index is built again on the next lookup */
+		member_index_free (db);
+	}
+}
+
+static void member_index_remove (struct commonio_db *db,
+                                 const struct commonio_entry *p)
+{
+	unsigned int l;
+	char **names;
+
+	if ((NULL == db->member_index) || (NULL == p->eptr)) {
+		return;
+	}
+	for (l = 0; NULL != (names = db->ops->getmembers (p->eptr, l)); l++) {
+		size_t i;
+
+		for (i = 0; NULL != names[i]; i++) {
+			struct member_node **pp = member_bucket (db, names[i]);
+
+			while (NULL != *pp) {
+				struct member_node *n = *pp;
+
+				if (   (n->entry == p)
+				    && (strcmp (n->name, names[i]) == 0)) {
+					*pp = n->next;
+					n->next = db->member_free;
+					db->member_free = n;
+					db->member_index_count--;
+					break;
+				}
+				pp = &n->next;
+			}
+		}
+	}
+}
+
+
+/*
+ * Add an entry at the end.
+ *
+ * defines p->next, p->prev
+ * (unfortunately, owned special are not supported)
+ */
+static void add_one_entry (struct commonio_db *db,
+                           /*@owned@*/struct commonio_entry *p)
+{
+	/*@-mustfreeonly@*/
+	p->next = NULL;
+	p->prev = db->tail;
+	/*@=mustfreeonly@*/
+	if (NULL == db->head) {
+		db->head = p;
+	}
+	if (NULL != db->tail) {
+		db->tail->next = p;
+	}
+	db->tail = p;
+	if (   db->nis_known
+	    && (NULL == db->nis_first)
+	    && entry_is_nis (db, p)) {
+		db->nis_first = p;
+	}
+	index_insert (db, p);
+	id_index_insert (db, p);
+	gid_index_insert (db, p);
+	member_index_insert (db, p);
+}
+
+
+static bool name_is_nis (const char *name)
+{
+	return (('+' == name[0]) || ('-' == name[0]));
+}
+
+/*
+ * entry_is_nis - Check if an entry is a NIS entry.
+ */
+static bool entry_is_nis (const struct commonio_db *db,
+                          const struct commonio_entry *p)
+{
+	return name_is_nis ((NULL != p->eptr) ? ent_name (db, p->eptr)
+	                                      : p->line);
+}
+
+
+/*
+ * New entries are inserted before the first NIS entry.  Order is preserved
+ * when db is written out.
+ */
+#ifndef KEEP_NIS_AT_END
+#define KEEP_NIS_AT_END 1
+#endif
+
+#if KEEP_NIS_AT_END
+static void add_one_entry_nis (struct commonio_db *db,
+                               /*@owned@*/struct commonio_entry *newp);
+
+/*
+ * Insert an entry between the regular entries, and the NIS entries.
+ *
+ * defines newp->next, newp->prev
+ * (unfortunately, owned special are not supported)
+ */
+static void add_one_entry_nis (struct commonio_db *db,
+                               /*@owned@*/struct commonio_entry *newp)
+{
+	struct commonio_entry *p;
+
+	if (!db->nis_known) {
+		for (p = db->head; NULL != p; p = p->next) {
+			if (entry_is_nis (db, p)) {
+				break;
+			}
+		}
+		db->nis_first = p;
+		db->nis_known = true;
+	}
+
+	p = db->nis_first;
+	if (NULL == p) {
+		/* add_one_entry() updates nis_first if newp is a NIS entry */
+		add_one_entry (db, newp);
+		return;
+	}
+
+	/*@-mustfreeonly@*/
+	newp->next = p;
+	newp->prev = p->prev;
+	/*@=mustfreeonly@*/
+	if (NULL != p->prev) {
+		p->prev->next = newp;
+	} else {
+		db->head = newp;
+	}
+	p->prev = newp;
+	if (entry_is_nis (db, newp)) {
+		db->nis_first = newp;
+	}
+	index_insert (db, newp);
+	id_index_insert (db, newp);
+	gid_index_insert (db, newp);
+	member_index_insert (db, newp);
+}
+#endif				/* KEEP_NIS_AT_END */
+
+/*
+ * commonio_entry_eptr - Return the object of an entry, parsing the line
+ *                       on the first call.
+ *
+ *	It returns NULL for the NIS entries and for the lines which cannot
+ *	be parsed.
+ *
+ *	If the object cannot be allocated, it returns NULL with errno set
+ *	to ENOMEM. The entry is then not parsed: it is not handled as an
+ *	invalid line, and the next call tries again.
+ */
+/*@dependent@*/ /*@null@*/void *commonio_entry_eptr (
+	const struct commonio_db *db,
+	struct commonio_entry *p)
+{
+	void *eptr;
+
+	if (p->parsed) {
+		return p->eptr;
+	}
+
+	if ((NULL == p->line) || name_is_nis (p->line)) {
+		p->parsed = true;
+		return NULL;
+	}
+
+	if (NULL != db->ops->parse_alloc) {
+		errno = 0;
+		eptr = db->ops->parse_alloc (p->line);
+		if ((NULL == eptr) && (ENOMEM == errno)) {
+			return NULL;
+		}
+		p->eptr = eptr;
+		p->parsed = true;
+		return p->eptr;
+	}
+
+	eptr = db->ops->parse (p->line);
+	if (NULL != eptr) {
+		eptr = db->ops->dup (eptr);
+		if (NULL == eptr) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	/* An invalid line is kept unchanged in the database */
+	p->eptr = eptr;
+	p->parsed = true;
+	return p->eptr;
+}
+
+/*
+ * commonio_parse_entries - Parse all the entries of the database.
+ *
+ *	This is needed before walking the list directly and reading the
+ *	eptr fields.
+ *
+ *	It returns 0 on success, and -1 with errno set to ENOMEM if an
+ *	entry could not be allocated.
+ */
+int commonio_parse_entries (const struct commonio_db *db)
+{
+	struct commonio_entry *p;
+
+	for (p = db->head; NULL != p; p = p->next) {
+		(void) commonio_entry_eptr (db, p);
+		if (!p->parsed) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void unmap_file (struct commonio_db *db)
+{
+	if (NULL != db->map) {
+		(void) munmap (db->map, db->map_size);
+		db->map = NULL;
+		db->map_size = 0;
+	}
+}
+
+/*
+ * commonio_alloc - Allocate memory which will be released when the
+ *                  database is closed.
+ *
+ *	This is used for the lines of the entries. The entries read from
+ *	the file are allocated from entry_arena (see new_entry).
+ */
+/*@dependent@*/ /*@null@*/void *commonio_alloc (struct commonio_db *db,
+                                                size_t size)
+{
+	return arena_alloc (&db->arena, size);
+}
+
+/*
+ * new_entry - Allocate an entry for the provided line.
+ *
+ *	The entry is not parsed yet.
+ */
+static /*@null@*/struct commonio_entry *new_entry (struct commonio_db *db,
+                                                   /*@null@*/char *line)
+{
+	struct commonio_entry *p;
+
+	p = (struct commonio_entry *) arena_alloc (&db->entry_arena,
+	                                           sizeof *p);
+	if (NULL == p) {
+		return NULL;
+	}
+	p->eptr = NULL;
+	p->line = line;
+	p->changed = false;
+	p->parsed = false;
+	p->shard = 0;
+	return p;
+}
+
+/*
+ * read_mapped - Load the entries of the database from a private mapping
+ *               of the file.
+ *
+ *	The lines are terminated in place in the mapping, they are not
+ *	copied. With fgetsx, the continuation lines ("\\\n") are joined in
+ *	place as well.
+ *
+ *	It returns 1 on success, 0 on failure (with errno set), and -1 if
+ *	the file cannot be mapped. In that case, nothing was loaded and the
+ *	file shall be read with stdio.
+ */
+static int read_mapped (struct commonio_db *db)
+{
+	struct stat sb;
+	struct commonio_entry *p;
+	char *cp, *end, *line, *dst;
+	bool continuation;
+	long pagesize;
+
+	if ((db->ops->fgets != fgets) && (db->ops->fgets != fgetsx)) {
+		/* Unknown line format */
+		return -1;
+	}
+	continuation = (db->ops->fgets == fgetsx);
+
+	if (   (fstat (fileno (db->fp), &sb) != 0)
+	    || !S_ISREG (sb.st_mode)
+	    || (sb.st_size <= 0)
+	    || ((unsigned long long) sb.st_size > SIZE_MAX)) {
+		return -1;
+	}
+
+	db->map_size = (size_t) sb.st_size;
+	db->map = mmap (NULL, db->map_size, PROT_READ | PROT_WRITE,
+	                MAP_PRIVATE, fileno (db->fp), 0);
+	if (MAP_FAILED == db->map) {
+		db->map = NULL;
+		db->map_size = 0;
+		return -1;
+	}
+
+	cp = db->map;
+	end = db->map + db->map_size;
+	while (cp < end) {
+		line = cp;
+		dst = cp;
+		for (;;) {
+			char *nl = memchr (cp, '\n', (size_t) (end - cp));
+			size_t len = (NULL != nl) ? (size_t) (nl - cp)
+			                          : (size_t) (end - cp);
+
+			if (dst != cp) {
+				memmove (dst, cp, len);
+			}
+			dst += len;
+			cp += len;
+			if (NULL == nl) {
+				break;
+			}
+			cp++;	/* skip '\n' */
+			if (   continuation
+			    && (dst > line)
+			    && ('\\' == dst[-1])
+			    && (cp < end)) {
+				dst--;	/* drop the backslash, join the lines */
+				continue;
+			}
+			break;
+		}
+
+		if (dst < end) {
+			*dst = '\0';
+		} else {
+			/*
+			 * The last line has no newline and fills the
+			 * mapping, it cannot be terminated in place.
+			 * (Otherwise, the remainder of the last page is
+			 * filled with zeros.)
+			 */
+			pagesize = sysconf (_SC_PAGESIZE);
+			if ((pagesize > 0) && ((db->map_size % (size_t) pagesize) != 0)) {
+				*dst = '\0';	/* still inside the last page */
+			} else {
+				line = arena_strndup (&db->arena, line,
+				                      (size_t) (dst - line));
+				if (NULL == line) {
+					errno = ENOMEM;
+					return 0;
+				}
+			}
+		}
+
+		p = new_entry (db, line);
+		if (NULL == p) {
+			errno = ENOMEM;
+			return 0;
+		}
+		add_one_entry (db, p);
+	}
+
+	return 1;
+}
+
+/* Initial buffer size. It is doubled when a line does not fit
+   (for reading very long lines in group files).  */
+#define BUFLEN 4096
+
+/*
+ * read_line - Read a line of fp with the fgets operation of the database.
+ *
+ *	*bufp is a buffer of *buflenp bytes (at least BUFLEN), allocated
+ *	with malloc(). The length of the line read so far is kept, so that
+ *	only the bytes returned by the last call to fgets are scanned, and
+ *	the buffer grows geometrically: reading a long line is linear in
+ *	its length. The newline is removed, and the length of the line is
+ *	stored in *lenp.
+ *
+ *	It returns 1 when a line was read, 0 at the end of the file or on
+ *	a read error (see ferror()), and -1 on failure to grow the buffer.
+ */
+static int read_line (const struct commonio_db *db, FILE *fp,
+                      char **bufp, size_t *buflenp, /*@out@*/size_t *lenp)
+{
+	char *buf = *bufp;
+	char *cp;
+	size_t len;
+
+	if (db->ops->fgets (buf, (int) *buflenp, fp) != buf) {
+		return 0;
+	}
+	len = strlen (buf);
+	/* fgets stops after a newline: it can only be the last byte */
+	while (   ((0 == len) || ('\n' != buf[len - 1]))
+	       && (feof (fp) == 0)) {
+		if (*buflenp > (size_t) INT_MAX / 2) {
+			return -1;
+		}
+		cp = (char *) realloc (buf, *buflenp * 2);
+		if (NULL == cp) {
+			return -1;
+		}
+		buf = cp;
+		*bufp = buf;
+		*buflenp *= 2;
+		if (db->ops->fgets (buf + len,
+		                    (int) (*buflenp - len),
+		                    fp) == NULL) {
+			return -1;
+		}
+		len += strlen (buf + len);
+	}
+	if ((0 != len) && ('\n' == buf[len - 1])) {
+		len--;
+		buf[len] = '\0';
+	}
+	*lenp = len;
+	return 1;
+}
+
+/*
+ * read_stdio - Load the entries of the database with the fgets operation.
+ *
+ *	It returns 1 on success, 0 on failure (with errno set).
+ */
+static int read_stdio (struct commonio_db *db)
+{
+	char *buf;
+	char *line;
+	struct commonio_entry *p;
+	size_t buflen;
+	size_t len;
+	int ret;
+
+	buflen = BUFLEN;
+	buf = (char *) malloc (buflen);
+	if (NULL == buf) {
+		goto cleanup_ENOMEM;
+	}
+
+	while ((ret = read_line (db, db->fp, &buf, &buflen, &len)) > 0) {
+		line = arena_strndup (&db->arena, buf, len);
+		if (NULL == line) {
+			goto cleanup_buf;
+		}
+
+		p = new_entry (db, line);
+		if (NULL == p) {
+			goto cleanup_buf;
+		}
+
+		add_one_entry (db, p);
+	}
+	if (ret < 0) {
+		goto cleanup_buf;
+	}
+
+	free (buf);
+
+	if (ferror (db->fp) != 0) {
+		return 0;
+	}
+	return 1;
+
+      cleanup_buf:
 	free (buf);
       cleanup_ENOMEM:
 	errno = ENOMEM;
+	return 0;
+}
+
+/*
+ * update_in_progress - Whether a writer is updating the database file
+ *                      in place (see journal_entries and append_entries),
+ *                      or was interrupted while doing so.
+ */
+static bool update_in_progress (const struct commonio_db *db)
+{
+	char name[1024];
+
+	/* The writers do not create these files if the names are too long */
+	if (   ((size_t) snprintf (name, sizeof name, "%s.journal",
+	                           db->filename) < sizeof name)
+	    && (access (name, F_OK) == 0)) {
+		return true;
+	}
+	if ((size_t) snprintf (name, sizeof name, "%s.append",
+	                       db->filename) >= sizeof name) {
+		return false;
+	}
+	return (access (name, F_OK) == 0);
+}
+
+/*
+ * repair_update - Finish or undo the update in place of a writer which
+ *                 was interrupted, for a reader without the lock.
+ *
+ *	The writers hold the lock while <file>.journal or <file>.append
+ *	exist. If the lock can be taken, the writer died, and the update
+ *	is replayed or rolled back as a writer would do when it opens the
+ *	database. Otherwise, the update is still in progress (or the
+ *	reader cannot lock the database), and the reader shall wait.
+ *
+ *	It returns 1 if the file was repaired, 0 otherwise.
+ */
+static int repair_update (struct commonio_db *db)
+{
+	int fd;
+	int ret = 0;
+
+	if (commonio_lock_nowait (db, false) == 0) {
+		return 0;
+	}
+	fd = open (db->filename, O_RDWR | O_NOCTTY | O_NONBLOCK | O_NOFOLLOW);
+	if (fd >= 0) {
+		rollback_append (db, fd);
+		(void) replay_journal (db, fd);
+		(void) close (fd);
+		if (!update_in_progress (db)) {
+			ret = 1;
+		}
+	}
+	(void) commonio_unlock (db);
+	return ret;
+}
+
+/*
+ * shards_generation - Get the generation of the <file>.d directory of
+ *                     the database.
+ *
+ *	The shard files are replaced by rename(), which changes the
+ *	directory. st_ino is set to 0 if there is no such directory.
+ *
+ *	It returns 0 on success, -1 on failure (with errno set).
+ */
+static int shards_generation (const struct commonio_db *db,
+                              /*@out@*/struct stat *sb)
+{
+	char dir[1024];
+
+	if ((size_t) snprintf (dir, sizeof dir, "%s.d",
+	                       db->filename) >= sizeof dir) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (stat (dir, sb) != 0) {
+		memzero (sb, sizeof *sb);
+		return ((ENOENT == errno) || (ENOTDIR == errno)) ? 0 : -1;
+	}
+	return 0;
+}
+
+/*
+ * same_generation - Whether the file did not change between the two
+ *                   stat() calls.
+ */
+static bool same_generation (const struct stat *sb1, const struct stat *sb2)
+{
+	return    (sb1->st_dev == sb2->st_dev)
+	       && (sb1->st_ino == sb2->st_ino)
+	       && (sb1->st_size == sb2->st_size)
+	       && (sb1->st_mtime == sb2->st_mtime)
+	       && (sb1->st_ctime == sb2->st_ctime)
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	       && (sb1->st_mtim.tv_nsec == sb2->st_mtim.tv_nsec)
+	       && (sb1->st_ctim.tv_nsec == sb2->st_ctim.tv_nsec)
+#endif				/* HAVE_STRUCT_STAT_ST_MTIM */
+	       ;
+}
+
+#ifdef ENABLE_SDT
+/*
+ * entry_count - Number of entries of the database, for the probes.
+ */
+static long entry_count (const struct commonio_db *db)
+{
+	const struct commonio_entry *p;
+	long n = 0;
+
+	for (p = db->head; NULL != p; p = p->next) {
+		n++;
+	}
+	return n;
+}
+#endif				/* ENABLE_SDT */
+
+/*
+ * open_db - Open the database and read its entries.
+ *
+ *	With O_RDONLY, the database does not need to be locked. The file
+ *	is replaced atomically by the writers, except when they update it
+ *	in place (JOURNAL_UPDATES, APPEND_NEW_ENTRIES). The file is then
+ *	read again until it was read while no update was in progress and
+ *	it did not change (same inode, size and times), waiting at most
+ *	LOCK_TIMEOUT. The writers are never blocked by the readers.
+ *	The update of a writer which died is repaired (see repair_update)
+ *	instead of being waited for.
+ */
+static int open_db (struct commonio_db *db, int mode)
+{
+	int flags = mode;
+	int fd;
+	int saved_errno;
+	int ret;
+	struct timespec start;
+	bool snapshot;
+	struct stat gen;
+	unsigned long timeout, waited = 0, delay = LOCK_MIN_DELAY;
+
+	mode &= ~O_CREAT;
+
+	if (   db->isopen
+	    || (   (O_RDONLY != mode)
+	        && (O_RDWR != mode))) {
+		errno = EINVAL;
+		return 0;
+	}
+	db->readonly = (mode == O_RDONLY);
+	if (!db->readonly && !db->locked && !db->optimistic) {
+		errno = EACCES;
+		return 0;
+	}
+	/* Without the lock, the writers may change the file under us */
+	snapshot = !db->locked;
+
+      retry:
+	db->head = NULL;
+	db->tail = NULL;
+	db->cursor = NULL;
+	db->nis_first = NULL;
+	db->nis_known = false;
+	db->changed = false;
+	db->rewrite = false;
+	db->reordered = false;
+	db->map = NULL;
+	db->map_size = 0;
+
+	timing_start (&start);
+	fd = open (db->filename,
+	             (snapshot ? O_RDONLY : O_RDWR)
+	           | O_NOCTTY | O_NONBLOCK | O_NOFOLLOW);
+	saved_errno = errno;
+	db->fp = NULL;
+	memzero (&db->generation, sizeof db->generation);
+	memzero (&db->shards_generation, sizeof db->shards_generation);
+	if (fd >= 0) {
+#ifdef WITH_TCB
+		if (tcb_is_suspect (fd) != 0) {
+			(void) close (fd);
+			errno = EINVAL;
+			return 0;
+		}
+#endif				/* WITH_TCB */
+		if (!snapshot) {
+			rollback_append (db, fd);
+			(void) replay_journal (db, fd);
+		} else if (   update_in_progress (db)
+		           || (fstat (fd, &gen) != 0)
+		           || (   db->optimistic
+		               && (shards_generation (db,
+		                                      &db->shards_generation)
+		                   != 0))) {
+			(void) close (fd);
+			goto busy;
+		}
+		db->fp = fdopen (fd, snapshot ? "r" : "r+");
+		saved_errno = errno;
+		if (NULL == db->fp) {
+			(void) close (fd);
+		}
+	}
+	errno = saved_errno;
+
+	/*
+	 * If O_CREAT was specified and the file didn't exist, it will be
+	 * created by commonio_close().  We have no entries to read yet.  --marekm
+	 */
+	if (NULL == db->fp) {
+		if (((flags & O_CREAT) != 0) && (ENOENT == errno)) {
+			db->isopen = true;
+			return 1;
+		}
+		return 0;
+	}
+
+	/* Do not inherit fd in spawned processes (e.g. nscd) */
+	fcntl (fileno (db->fp), F_SETFD, FD_CLOEXEC);
+
+	/*
+	 * The entries are only split into lines here. They are parsed
+	 * when they are used (see commonio_entry_eptr).
+	 *
+	 * Without the lock, the file is copied if it may be updated in
+	 * place: the pages of the mapping which were not written to would
+	 * show the changes made after the file was read.
+	 */
+	if (snapshot && getdef_bool ("JOURNAL_UPDATES")) {
+		ret = -1;
+	} else {
+		ret = read_mapped (db);
+	}
+	if (-1 == ret) {
+		ret = read_stdio (db);
+	}
+	if ((0 == ret) || (shards_read (db) == 0)) {
+		goto cleanup_errno;
+	}
+
+	if (snapshot) {
+		struct stat sb;
+
+		if (   (fstat (fileno (db->fp), &sb) != 0)
+		    || !same_generation (&gen, &sb)
+		    || update_in_progress (db)) {
+			free_linked_list (db);
+			fclose (db->fp);
+			db->fp = NULL;
+			goto busy;
+		}
+		db->generation = gen;
+	}
+
+	if ((NULL != db->ops->open_hook) && (db->ops->open_hook () == 0)) {
+		goto cleanup_errno;
+	}
+
+	db->arena_open = db->arena.total + db->entry_arena.total;
+	db->isopen = true;
+
+	if (timing_enabled ()) {
+		const struct commonio_entry *p;
+		unsigned long count = 0;
+		struct stat sb;
+
+		for (p = db->head; NULL != p; p = p->next) {
+			count++;
+		}
+		if (fstat (fileno (db->fp), &sb) != 0) {
+			sb.st_size = 0;
+		}
+#ifdef HAVE_PTHREAD
+		(void) pthread_mutex_lock (&open_note_lock);
+#endif				/* HAVE_PTHREAD */
+		timing_stop (TIMING_OPEN, &start, count,
+		             (unsigned long long) sb.st_size);
+		metrics_db_entries (db->filename, count);
+		watch_memory (db);
+#ifdef HAVE_PTHREAD
+		(void) pthread_mutex_unlock (&open_note_lock);
+#endif				/* HAVE_PTHREAD */
+	}
+	return 1;
+
       cleanup_errno:
 	saved_errno = errno;
 	free_linked_list (db);
-	fclose (db->fp);
-	db->fp = NULL;
-	errno = saved_errno;
+	fclose (db->fp);
+	db->fp = NULL;
+	errno = saved_errno;
+	return 0;
+
+      busy:
+	if (update_in_progress (db) && (repair_update (db) != 0)) {
+		goto retry;
+	}
+	/* A writer is updating the file: read it again a bit later */
+	timeout = (unsigned long) getdef_unum ("LOCK_TIMEOUT",
+	                                       LOCK_TRIES * LOCK_SLEEP) * 1000;
+	if (waited >= timeout) {
+		errno = EBUSY;
+		return 0;
+	}
+	if (delay > timeout - waited) {
+		delay = timeout - waited;
+	}
+	lock_delay (delay);
+	waited += delay;
+	delay *= 2;
+	if (delay > LOCK_MAX_DELAY) {
+		delay = LOCK_MAX_DELAY;
+	}
+	goto retry;
+}
+
+int commonio_open (struct commonio_db *db, int mode)
+{
+	int ret;
+
+	SHADOW_PROBE2 (commonio_open__entry, db->filename, mode);
+	ret = open_db (db, mode);
+	SHADOW_PROBE3 (commonio_open__return, db->filename, ret,
+	               (0 != ret) ? entry_count (db) : 0L);
+	return ret;
+}
+
+/*
+ * Open of a database of commonio_open_set, by a thread of the pool.
+ */
+struct open_job {
+	struct commonio_db *db;
+	int mode;
+	int ret;
+	int saved_errno;
+};
+
+static void open_job_run (unused struct work_pool *pool, void *arg)
+{
+	struct open_job *job = arg;
+
+	job->ret = commonio_open (job->db, job->mode);
+	job->saved_errno = errno;
+}
+
+/*
+ * commonio_open_set - Open a set of databases, reading them concurrently.
+ *
+ *	With OPEN_THREADS, the files are read by a pool of threads, one
+ *	database per thread, and the set is open when the largest file is
+ *	read. It returns when all of them are read, before the caller
+ *	looks up any entry. Each thread only changes its own database:
+ *	the entries are split in lines, and only parsed by the open hooks,
+ *	whose parsers do not share their buffers with the other databases.
+ *	The settings and the timings are set up before the threads start.
+ *
+ *	The databases are normally locked first with commonio_lock_set().
+ *	The shadow file of USE_TCB cannot be opened this way (see
+ *	spw_open).
+ *
+ *	On failure, *failed is set to the index in dbs of the first
+ *	database which could not be opened, and errno is set. The other
+ *	databases may be open.
+ *
+ *	It returns 1 on success, 0 on failure.
+ */
+int commonio_open_set (struct commonio_db *const *dbs, size_t count,
+                       int mode, /*@out@*/size_t *failed)
+{
+	struct open_job jobs[COMMONIO_TXN_MAX];
+	/*@null@*/struct work_pool *pool = NULL;
+	int nthreads = getdef_num ("OPEN_THREADS", 1);
+	size_t i, n;
+
+	*failed = 0;
+	if (count > COMMONIO_TXN_MAX) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	if ((nthreads > 1) && (count > 1)) {
+		if ((size_t) nthreads > count) {
+			nthreads = (int) count;
+		}
+		(void) timing_enabled ();
+		pool = work_pool_start ((size_t) nthreads, count);
+	}
+	for (n = 0; n < count; n++) {
+		jobs[n].db = dbs[n];
+		jobs[n].mode = mode;
+		if (!work_pool_queue (pool, open_job_run, &jobs[n], true)) {
+			open_job_run (pool, &jobs[n]);
+			if (0 == jobs[n].ret) {
+				/* Like the successive opens, stop there */
+				n++;
+				break;
+			}
+		}
+	}
+	(void) work_pool_stop (pool);
+
+	for (i = 0; i < n; i++) {
+		if (0 == jobs[i].ret) {
+			*failed = i;
+			errno = jobs[i].saved_errno;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * commonio_open_optimistic - Open a database for writing, without
+ *                            holding its lock yet.
+ *
+ *	The database is read like the unlocked readers do, and the
+ *	changes can be prepared while the other writers are not blocked.
+ *	It must then be locked with commonio_lock_optimistic() before it
+ *	is closed: this checks that the file was not changed since it was
+ *	read. If it was, the changes are discarded, and the caller opens
+ *	the database again (with the lock) and applies them again.
+ *
+ *	A database which is already locked is just opened.
+ */
+int commonio_open_optimistic (struct commonio_db *db, int mode)
+{
+	int ret;
+
+	if (db->locked) {
+		return commonio_open (db, mode);
+	}
+	db->optimistic = true;
+	ret = commonio_open (db, mode);
+	if (0 == ret) {
+		db->optimistic = false;
+	}
+	return ret;
+}
+
+/*
+ * validate_optimistic - Check that a database opened without the lock
+ *                       was not changed since it was read, once it is
+ *                       locked.
+ *
+ *	The database file is then open for writing, as if it had been
+ *	opened with the lock.
+ *
+ *	It returns 1 if the database can be written, 0 otherwise (with
+ *	errno set to ESTALE if it was changed).
+ */
+static int validate_optimistic (struct commonio_db *db)
+{
+	struct stat sb;
+	FILE *fp;
+	int fd;
+
+	if (shards_generation (db, &sb) != 0) {
+		return 0;
+	}
+	if (   (sb.st_ino != db->shards_generation.st_ino)
+	    || (   (0 != sb.st_ino)
+	        && !same_generation (&db->shards_generation, &sb))) {
+		errno = ESTALE;
+		return 0;
+	}
+
+	fd = open (db->filename, O_RDWR | O_NOCTTY | O_NONBLOCK | O_NOFOLLOW);
+	if (fd < 0) {
+		if ((ENOENT == errno) && (0 == db->generation.st_ino)) {
+			db->optimistic = false;
+			return 1;	/* still to be created */
+		}
+		return 0;
+	}
+	if (0 == db->generation.st_ino) {
+		(void) close (fd);
+		errno = ESTALE;
+		return 0;
+	}
+	rollback_append (db, fd);
+	(void) replay_journal (db, fd);
+	if (fstat (fd, &sb) != 0) {
+		(void) close (fd);
+		return 0;
+	}
+	if (!same_generation (&db->generation, &sb)) {
+		(void) close (fd);
+		errno = ESTALE;
+		return 0;
+	}
+
+	fp = fdopen (fd, "r+");
+	if (NULL == fp) {
+		(void) close (fd);
+		return 0;
+	}
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
+	if (NULL != db->fp) {
+		(void) fclose (db->fp);
+	}
+	db->fp = fp;
+	db->optimistic = false;
+	return 1;
+}
+
+/*
+ * commonio_lock_optimistic - Lock a set of databases, some of which were
+ *                            opened with commonio_open_optimistic().
+ *
+ *	The databases are locked with commonio_lock_set(). Then, the
+ *	databases opened without the lock are checked: if one of them was
+ *	changed by another writer, all the databases which were not locked
+ *	before are unlocked and closed (their changes are discarded),
+ *	*failed is set to its index in dbs, and errno is set to ESTALE.
+ *
+ *	It returns 1 on success, 0 on failure.
+ */
+int commonio_lock_optimistic (struct commonio_db *const *dbs, size_t count,
+                              /*@out@*/size_t *failed)
+{
+	bool held[COMMONIO_TXN_MAX];
+	int saved_errno;
+	size_t i;
+
+	*failed = 0;
+	if (count > COMMONIO_TXN_MAX) {
+		errno = EINVAL;
+		return 0;
+	}
+	for (i = 0; i < count; i++) {
+		held[i] = dbs[i]->locked;
+	}
+	if (commonio_lock_set (dbs, count, failed) == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (   dbs[i]->optimistic
+		    && (validate_optimistic (dbs[i]) == 0)) {
+			break;
+		}
+	}
+	if (i == count) {
+		return 1;
+	}
+
+	saved_errno = errno;
+	*failed = i;
+	for (i = 0; i < count; i++) {
+		dbs[i]->optimistic = false;
+		if (!held[i]) {
+			(void) commonio_unlock (dbs[i]);
+		}
+	}
+	errno = saved_errno;
+	return 0;
+}
+
+/*
+ * scan_list - Call scan for each entry of an open database.
+ */
+static int scan_list (struct commonio_db *db,
+                      int (*scan) (const void *ent, void *arg), void *arg)
+{
+	struct commonio_entry *p;
+	const void *eptr;
+	int ret;
+
+	for (p = db->head; NULL != p; p = p->next) {
+		eptr = commonio_entry_eptr (db, p);
+		if (NULL == eptr) {
+			if (!p->parsed) {
+				return -1;	/* ENOMEM */
+			}
+			continue;
+		}
+		ret = scan (eptr, arg);
+		if (0 != ret) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * commonio_scan_lines - Call scan for each line of the database file.
+ *
+ *	The lines are read in a single buffer and parsed with the parse
+ *	operation, which returns an entry in a static buffer: no memory is
+ *	allocated for the entries, except for the groups whose members are
+ *	in a member file, which are read with parse_alloc and released
+ *	after the call.
+ *
+ *	scan gets each line (without its newline) with its entry, or with
+ *	NULL for the NIS lines and the lines which cannot be parsed, like
+ *	the entries of commonio_entry_eptr(). The file is read even if the
+ *	database is open, and its shard files are not read.
+ *
+ *	It returns the value which stopped the scan, 0 when all the lines
+ *	were scanned, and -1 on failure (with errno set).
+ */
+int commonio_scan_lines (struct commonio_db *db,
+                         int (*scan) (const char *line, const void *ent,
+                                      void *arg),
+                         void *arg)
+{
+	FILE *fp;
+	char *buf;
+	void *eptr;
+	size_t buflen = BUFLEN;
+	size_t len;
+	unsigned long count = 0;
+	unsigned long long bytes = 0;
+	struct timespec start;
+	int saved_errno;
+	int ret = 0;
+	int rc;
+
+	timing_start (&start);
+	fp = fopen (db->filename, "r");
+	if (NULL == fp) {
+		return -1;
+	}
+	buf = (char *) malloc (buflen);
+	if (NULL == buf) {
+		(void) fclose (fp);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	while ((rc = read_line (db, fp, &buf, &buflen, &len)) > 0) {
+		bytes += len + 1;
+		count++;
+		if (name_is_nis (buf)) {
+			ret = scan (buf, NULL, arg);
+		} else if (   (NULL != db->ops->parse_alloc)
+		           && member_file_line (buf)) {
+			eptr = db->ops->parse_alloc (buf);
+			ret = scan (buf, eptr, arg);
+			if (NULL != eptr) {
+				db->ops->free (eptr);
+			}
+		} else {
+			ret = scan (buf, db->ops->parse (buf), arg);
+		}
+		if (0 != ret) {
+			break;
+		}
+	}
+	if ((rc < 0) || ((0 == ret) && (ferror (fp) != 0))) {
+		ret = -1;
+		if (rc < 0) {
+			errno = ENOMEM;
+		}
+	}
+
+	saved_errno = errno;
+	free (buf);
+	(void) fclose (fp);
+	errno = saved_errno;
+	timing_stop (TIMING_OPEN, &start, count, bytes);
+	return ret;
+}
+
+/* The callback of commonio_scan(), for scan_entry() */
+struct scan_arg {
+	int (*scan) (const void *ent, void *arg);
+	void *arg;
+};
+
+/*
+ * scan_entry - Call the callback of commonio_scan() for the valid
+ *              entries.
+ */
+static int scan_entry (unused const char *line, const void *ent, void *arg)
+{
+	const struct scan_arg *sa = arg;
+
+	if (NULL == ent) {
+		return 0;
+	}
+	return sa->scan (ent, sa->arg);
+}
+
+/*
+ * commonio_scan - Call scan for each entry of the database, in a single
+ *                 read-only pass.
+ *
+ *	The entries of an open database are walked (the cursor of
+ *	commonio_next() is not changed). Otherwise, the file is read line
+ *	by line without building the list of entries, in constant memory,
+ *	and without locking it. The file is read like commonio_open()
+ *	does when its shard files must be read too (SHARDED_DATABASES),
+ *	or when a writer is updating it in place.
+ *
+ *	The entries passed to scan are only valid during the call. scan
+ *	returns 0 to continue, or another value to stop the scan.
+ *
+ *	It returns the value which stopped the scan, 0 when all the
+ *	entries were scanned, and -1 on failure (with errno set).
+ */
+int commonio_scan (struct commonio_db *db,
+                   int (*scan) (const void *ent, void *arg), void *arg)
+{
+	int ret;
+
+	if (db->isopen) {
+		return scan_list (db, scan, arg);
+	}
+
+	if (   !getdef_bool ("SHARDED_DATABASES")
+	    && !update_in_progress (db)) {
+		struct scan_arg sa;
+
+		sa.scan = scan;
+		sa.arg = arg;
+		return commonio_scan_lines (db, scan_entry, &sa);
+	}
+
+	if (commonio_open (db, O_RDONLY) == 0) {
+		return -1;
+	}
+	ret = scan_list (db, scan, arg);
+	(void) commonio_close (db);
+	return ret;
+}
+
+/*
+ * sort_range - Return the number of entries which can be sorted.
+ *
+ *	With KEEP_NIS_AT_END, the entries from the first NIS entry are not
+ *	sorted, and *nis is set to the first NIS entry.
+ */
+static size_t sort_range (struct commonio_db *db,
+                          /*@out@*/struct commonio_entry **nis)
+{
+	struct commonio_entry *ptr;
+	size_t n = 0;
+
+	for (ptr = db->head;
+	        (NULL != ptr)
+#if KEEP_NIS_AT_END
+	     && ((NULL == ptr->line)
+	         || (('+' != ptr->line[0])
+	             && ('-' != ptr->line[0])))
+#endif
+	     ;
+	     ptr = ptr->next) {
+		/* The comparison functions use the eptr fields */
+		(void) commonio_entry_eptr (db, ptr);
+		n++;
+	}
+	*nis = ptr;
+	return n;
+}
+
+/*
+ * relink_sorted - Link the n entries of db in the order of the entries
+ *                 array, followed by nis (the unsorted entries).
+ */
+static void relink_sorted (struct commonio_db *db,
+                           struct commonio_entry **entries, size_t n,
+                           /*@null@*/struct commonio_entry *nis)
+{
+	size_t i;
+
+	/* Take care of the head and tail separately */
+	db->head = entries[0];
+	n--;
+	if (NULL == nis) {
+		db->tail = entries[n];
+	}
+	db->head->prev = NULL;
+	db->head->next = entries[1];
+	entries[n]->prev = entries[n - 1];
+	entries[n]->next = nis;
+	if (NULL != nis) {
+		nis->prev = entries[n];
+	}
+
+	/* Now other elements have prev and next entries */
+	for (i = 1; i < n; i++) {
+		entries[i]->prev = entries[i - 1];
+		entries[i]->next = entries[i + 1];
+	}
+
+	/* sort_range() only looks at the lines of the NIS entries */
+	db->nis_known = false;
+	db->changed = true;
+	db->rewrite = true;
+	db->reordered = true;
+}
+
+/*
+ * Sort given db according to cmp function (usually compares uids)
+ */
+int
+commonio_sort (struct commonio_db *db, int (*cmp) (const void *, const void *))
+{
+	struct commonio_entry **entries, *ptr, *nis;
+	size_t n;
+
+	n = sort_range (db, &nis);
+	if (n <= 1) {
+		return 0;
+	}
+
+	entries = malloc (n * sizeof (struct commonio_entry *));
+	if (entries == NULL) {
+		return -1;
+	}
+
+	n = 0;
+	for (ptr = db->head; nis != ptr; ptr = ptr->next) {
+		entries[n] = ptr;
+		n++;
+	}
+	qsort (entries, n, sizeof (struct commonio_entry *), cmp);
+
+	relink_sorted (db, entries, n, nis);
+	free (entries);
+
+	return 0;
+}
+
+struct sort_key {
+	id_t id;
+	/*@dependent@*/struct commonio_entry *ent;
+};
+
+/*
+ * commonio_sort_id - Sort db by ID (see the getid operation).
+ *
+ *	The (ID, entry) pairs are extracted once and sorted with a radix
+ *	sort, one byte of the ID per pass. The sort is stable: entries with
+ *	the same ID keep their relative order. Invalid entries are moved
+ *	after the valid ones, also in their order.
+ */
+int commonio_sort_id (struct commonio_db *db)
+{
+	struct sort_key *base, *keys, *tmp, *swap;
+	struct commonio_entry **entries, *ptr, *nis;
+	size_t count[256];
+	size_t n, valid, invalid, i, b, pos;
+	unsigned int shift;
+
+	if (NULL == db->ops->getid) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	n = sort_range (db, &nis);
+	if (n <= 1) {
+		return 0;
+	}
+
+	base = malloc (2 * n * sizeof (*base));
+	entries = malloc (n * sizeof (*entries));
+	if ((NULL == base) || (NULL == entries)) {
+		free (base);
+		free (entries);
+		return -1;
+	}
+	keys = base;
+	tmp = base + n;
+
+	/* The invalid entries are put at the end of entries */
+	valid = 0;
+	invalid = 0;
+	for (ptr = db->head; nis != ptr; ptr = ptr->next) {
+		if (NULL == ptr->eptr) {
+			entries[n - 1 - invalid] = ptr;
+			invalid++;
+		} else {
+			keys[valid].id = ent_id (db, ptr->eptr);
+			keys[valid].ent = ptr;
+			valid++;
+		}
+	}
+
+	for (shift = 0;
+	     (valid > 1) && (shift < sizeof (id_t) * CHAR_BIT);
+	     shift += CHAR_BIT) {
+		memzero (count, sizeof count);
+		for (i = 0; i < valid; i++) {
+			count[(keys[i].id >> shift) & 0xff]++;
+		}
+		/* Skip the passes on bytes which are the same for all IDs */
+		if (count[(keys[0].id >> shift) & 0xff] == valid) {
+			continue;
+		}
+		for (b = 0, pos = 0; b < 256; b++) {
+			size_t c = count[b];
+
+			count[b] = pos;
+			pos += c;
+		}
+		for (i = 0; i < valid; i++) {
+			tmp[count[(keys[i].id >> shift) & 0xff]++] = keys[i];
+		}
+		swap = keys;
+		keys = tmp;
+		tmp = swap;
+	}
+
+	for (i = 0; i < valid; i++) {
+		entries[i] = keys[i].ent;
+	}
+	/* The invalid entries were stored in reverse order */
+	for (i = 0; i < invalid / 2; i++) {
+		ptr = entries[valid + i];
+		entries[valid + i] = entries[n - 1 - i];
+		entries[n - 1 - i] = ptr;
+	}
+
+	relink_sorted (db, entries, n, nis);
+	free (base);
+	free (entries);
+
+	return 0;
+}
+
+/*
+ * Sort entries in db according to order in another.
+ */
+int commonio_sort_wrt (struct commonio_db *shadow,
+                       const struct commonio_db *passwd)
+{
+	struct commonio_entry *head = NULL, *pw_ptr, *spw_ptr;
+	const char *name;
+
+	if ((NULL == shadow) || (NULL == shadow->head)) {
+		return 0;
+	}
+
+	for (pw_ptr = passwd->head; NULL != pw_ptr; pw_ptr = pw_ptr->next) {
+		if (NULL == commonio_entry_eptr (passwd, pw_ptr)) {
+			continue;
+		}
+		name = ent_name (passwd, pw_ptr->eptr);
+		if (!name_is_nis (name)) {
+			/* Use the name index of shadow */
+			spw_ptr = find_entry_by_name (shadow, name);
+		} else {
+			/* NIS entries are not indexed */
+			for (spw_ptr = shadow->head;
+			     NULL != spw_ptr;
+			     spw_ptr = spw_ptr->next) {
+				if (NULL == commonio_entry_eptr (shadow, spw_ptr)) {
+					continue;
+				}
+				if (strcmp (name,
+				            ent_name (shadow, spw_ptr->eptr))
+				    == 0) {
+					break;
+				}
+			}
+		}
+		if (NULL == spw_ptr) {
+			continue;
+		}
+		commonio_del_entry (shadow, spw_ptr);
+		spw_ptr->next = head;
+		head = spw_ptr;
+	}
+
+	for (spw_ptr = head; NULL != spw_ptr; spw_ptr = head) {
+		head = head->next;
+
+		if (NULL != shadow->head) {
+			shadow->head->prev = spw_ptr;
+		}
+		spw_ptr->next = shadow->head;
+		shadow->head = spw_ptr;
+	}
+
+	shadow->head->prev = NULL;
+	shadow->nis_known = false;
+	shadow->changed = true;
+	shadow->rewrite = true;
+	shadow->reordered = true;
+
+	/* commonio_del_entry() removed the relinked entries from the index */
+	index_free (shadow);
+	id_index_free (shadow);
+	gid_index_free (shadow);
+
+	return 0;
+}
+
+/*
+ * write_all - Write the database to its file.
+ *
+ * It returns 0 if all the entries could be written correctly.
+ */
+/*
+ * write_entries - Write the entries, starting at first, to fp.
+ *
+ *	Only the entries of the given shard are written, unless shard is
+ *	SHARD_ALL.
+ */
+static int write_entries (const struct commonio_db *db,
+                          /*@null@*/const struct commonio_entry *first,
+                          FILE *fp, int shard)
+{
+	const struct commonio_entry *p;
+	void *eptr;
+
+	for (p = first; NULL != p; p = p->next) {
+		if ((SHARD_ALL != shard) && ((unsigned int) shard != p->shard)) {
+			continue;
+		}
+		if (p->changed) {
+			eptr = p->eptr;
+			assert (NULL != eptr);
+			if (db->ops->put (eptr, fp) != 0) {
+				return -1;
+			}
+		} else if (NULL != p->line) {
+			if (db->ops->fputs (p->line, fp) == EOF) {
+				return -1;
+			}
+			if (putc ('\n', fp) == EOF) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * can_format - Check if the entries of db can be formatted in a buffer
+ *              by format_entries().
+ */
+static bool can_format (const struct commonio_db *db)
+{
+	/* Unchanged lines are copied verbatim */
+	if ((db->ops->fputs != fputs) && (db->ops->fputs != fputsx)) {
+		return false;
+	}
+#ifdef HAVE_OPEN_MEMSTREAM
+	return true;
+#else				/* !HAVE_OPEN_MEMSTREAM */
+	return (NULL != db->ops->format);
+#endif				/* !HAVE_OPEN_MEMSTREAM */
+}
+
+/*
+ * write_buffer - Write len bytes of buf to fd.
+ */
+static int write_buffer (int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write (fd, buf, len);
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= (size_t) n;
+	}
+	return 0;
+}
+
+/*
+ * format_entries - Format the entries, starting at first, in a buffer.
+ *
+ *	The unchanged lines are copied, only the changed entries are
+ *	formatted, directly in the buffer with ops->format, or else with
+ *	ops->put through a memory stream.
+ *
+ *	Return the allocated buffer, and its length in *len.
+ */
+static /*@null@*/char *format_entries (const struct commonio_db *db,
+                                       /*@null@*/const struct commonio_entry *first,
+                                       size_t *len, int shard)
+{
+	const struct commonio_entry *p;
+	struct commonio_buf out = { NULL, 0, 0 };
+	char *cp;
+	size_t size = 1, n;
+#ifdef HAVE_OPEN_MEMSTREAM
+	FILE *mem = NULL;
+	char *mbuf = NULL;
+	size_t mlen = 0, mdone = 0;
+#endif				/* HAVE_OPEN_MEMSTREAM */
+
+	/* Usually, the changed entries are few: make room for the rest */
+	for (p = first; NULL != p; p = p->next) {
+		if ((SHARD_ALL != shard) && ((unsigned int) shard != p->shard)) {
+			continue;
+		}
+		if (!p->changed && (NULL != p->line)) {
+			size += strlen (p->line) + 1;
+		}
+	}
+	if (NULL == commonio_buf_reserve (&out, size)) {
+		return NULL;
+	}
+
+	for (p = first; NULL != p; p = p->next) {
+		if ((SHARD_ALL != shard) && ((unsigned int) shard != p->shard)) {
+			continue;
+		}
+		if (p->changed) {
+			assert (NULL != p->eptr);
+			if (NULL != db->ops->format) {
+				if (db->ops->format (p->eptr, &out) != 0) {
+					goto fail;
+				}
+				continue;
+			}
+#ifdef HAVE_OPEN_MEMSTREAM
+			if (NULL == mem) {
+				mem = open_memstream (&mbuf, &mlen);
+				if (NULL == mem) {
+					goto fail;
+				}
+			}
+			if (   (db->ops->put (p->eptr, mem) != 0)
+			    || (fflush (mem) != 0)) {
+				goto fail;
+			}
+			n = mlen - mdone;
+			cp = commonio_buf_reserve (&out, n);
+			if (NULL == cp) {
+				goto fail;
+			}
+			memcpy (cp, mbuf + mdone, n);
+			out.len += n;
+			mdone = mlen;
+#else				/* !HAVE_OPEN_MEMSTREAM */
+			goto fail;
+#endif				/* !HAVE_OPEN_MEMSTREAM */
+		} else if (NULL != p->line) {
+			n = strlen (p->line);
+			cp = commonio_buf_reserve (&out, n + 1);
+			if (NULL == cp) {
+				goto fail;
+			}
+			memcpy (cp, p->line, n);
+			cp[n] = '\n';
+			out.len += n + 1;
+		}
+	}
+
+#ifdef HAVE_OPEN_MEMSTREAM
+	if (NULL != mem) {
+		if (fclose (mem) != 0) {
+			mem = NULL;
+			goto fail;
+		}
+		free (mbuf);
+	}
+#endif				/* HAVE_OPEN_MEMSTREAM */
+	*len = out.len;
+	return out.data;
+
+      fail:
+#ifdef HAVE_OPEN_MEMSTREAM
+	if (NULL != mem) {
+		(void) fclose (mem);
+	}
+	free (mbuf);
+#endif				/* HAVE_OPEN_MEMSTREAM */
+	free (out.data);
+	return NULL;
+}
+
+/*
+ * write_all - Write the entries, starting at first, to fp.
+ *
+ *	When possible, the output is built in a single buffer and
+ *	written with one write loop, instead of one write for each
+ *	buffer full of stdio output.
+ *	fp is flushed first, so that what was already written to it
+ *	comes first.
+ *
+ *	Only the entries of the given shard are written, unless shard is
+ *	SHARD_ALL.
+ */
+static int write_all (const struct commonio_db *db,
+                      /*@null@*/const struct commonio_entry *first,
+                      FILE *fp, int shard)
+{
+	struct timespec start;
+	size_t len = 0;
+	int ret;
+	char *buf;
+
+	SHADOW_PROBE2 (write_all__entry, db->filename, shard);
+	timing_start (&start);
+	if (can_format (db)) {
+		buf = format_entries (db, first, &len, shard);
+		if (NULL == buf) {
+			SHADOW_PROBE3 (write_all__return, db->filename, -1, 0L);
+			return -1;
+		}
+
+		ret = 0;
+		if (   (fflush (fp) != 0)
+		    || (write_buffer (fileno (fp), buf, len) != 0)) {
+			ret = -1;
+		}
+		free (buf);
+	} else {
+		ret = write_entries (db, first, fp, shard);
+	}
+	timing_stop (TIMING_WRITE, &start, 0, (unsigned long long) len);
+	SHADOW_PROBE3 (write_all__return, db->filename, ret, (long) len);
+	return ret;
+}
+
+
+/*
+ * Shard files of a database (SHARDED_DATABASES)
+ *
+ * The entries of <file> may also be split into the files of <file>.d/,
+ * e.g. one per team or tenant. The shard files are named with
+ * [A-Za-z0-9_] only and read in the order of their names, after the
+ * database file. Their entries are then part of the database, and
+ * each entry is written back to its own file.
+ *
+ * New entries are added to shard 1 + hash(name) % count. The NIS
+ * entries stay in the database file.
+ *
+ * Only the files whose entries changed, were added or were removed are
+ * written on close, so a change to a large database only rewrites one
+ * small file. The lock of the database file covers its shard files.
+ */
+struct commonio_shards {
+	size_t count;
+	/* Index 0 is the database file */
+	/*@owned@*/ /*@null@*/char *names[COMMONIO_SHARDS_MAX + 1];
+	size_t entries[COMMONIO_SHARDS_MAX + 1];
+	bool dirty[COMMONIO_SHARDS_MAX + 1];
+	bool pending[COMMONIO_SHARDS_MAX + 1];
+	/*@null@*/FILE *fps[COMMONIO_SHARDS_MAX + 1];
+};
+
+static bool valid_shard_name (const char *name)
+{
+	if ('\0' == *name) {
+		return false;
+	}
+	for (; '\0' != *name; name++) {
+		if (   !isalnum ((unsigned char) *name)
+		    && ('_' != *name)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int shard_name_cmp (const void *p1, const void *p2)
+{
+	return strcmp (*(char *const *) p1, *(char *const *) p2);
+}
+
+static void shards_free (struct commonio_db *db)
+{
+	size_t i;
+
+	if (NULL == db->shards) {
+		return;
+	}
+	for (i = 1; i <= db->shards->count; i++) {
+		if (NULL != db->shards->fps[i]) {
+			(void) fclose (db->shards->fps[i]);
+		}
+		free (db->shards->names[i]);
+	}
+	free (db->shards);
+	db->shards = NULL;
+}
+
+/*
+ * shards_read - Read the shard files of the database, if it has any.
+ *
+ *	It returns 1 on success, 0 on failure (with errno set).
+ */
+static int shards_read (struct commonio_db *db)
+{
+	char dir[1024];
+	struct commonio_shards *shards;
+	const struct commonio_entry *p;
+	struct dirent *ent;
+	FILE *fp;
+	DIR *d;
+	size_t i;
+
+	if (!getdef_bool ("SHARDED_DATABASES")) {
+		return 1;
+	}
+	if ((size_t) snprintf (dir, sizeof dir, "%s.d",
+	                       db->filename) >= sizeof dir) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+	d = opendir (dir);
+	if (NULL == d) {
+		return ((ENOENT == errno) || (ENOTDIR == errno)) ? 1 : 0;
+	}
+
+	shards = (struct commonio_shards *) calloc (1, sizeof *shards);
+	if (NULL == shards) {
+		(void) closedir (d);
+		errno = ENOMEM;
+		return 0;
+	}
+	db->shards = shards;
+	while ((ent = readdir (d)) != NULL) {
+		if (!valid_shard_name (ent->d_name)) {
+			/* ., .., backups, temporary files */
+			continue;
+		}
+		if (shards->count == COMMONIO_SHARDS_MAX) {
+			(void) closedir (d);
+			errno = E2BIG;
+			return 0;
+		}
+		/* Room for the "+" and "-" names in the 1024 bytes buffers */
+		if (strlen (dir) + strlen (ent->d_name) + 3 > 1024) {
+			(void) closedir (d);
+			errno = ENAMETOOLONG;
+			return 0;
+		}
+		shards->names[shards->count + 1] =
+			(char *) malloc (strlen (dir) + strlen (ent->d_name) + 2);
+		if (NULL == shards->names[shards->count + 1]) {
+			(void) closedir (d);
+			errno = ENOMEM;
+			return 0;
+		}
+		(void) sprintf (shards->names[shards->count + 1], "%s/%s",
+		                dir, ent->d_name);
+		shards->count++;
+	}
+	(void) closedir (d);
+	if (0 == shards->count) {
+		shards_free (db);
+		return 1;
+	}
+	qsort (&shards->names[1], shards->count, sizeof shards->names[1],
+	       shard_name_cmp);
+
+	for (p = db->head; NULL != p; p = p->next) {
+		shards->entries[0]++;
+	}
+
+	fp = db->fp;
+	for (i = 1; i <= shards->count; i++) {
+		const struct commonio_entry *last = db->tail;
+		struct commonio_entry *e;
+
+		db->fp = fopen (shards->names[i], "r");
+		if (NULL == db->fp) {
+			db->fp = fp;
+			return 0;
+		}
+		if (read_stdio (db) == 0) {
+			(void) fclose (db->fp);
+			db->fp = fp;
+			return 0;
+		}
+		(void) fclose (db->fp);
+		for (e = (NULL != last) ? last->next : db->head;
+		     NULL != e;
+		     e = e->next) {
+			e->shard = (unsigned int) i;
+			shards->entries[i]++;
+		}
+	}
+	db->fp = fp;
+	return 1;
+}
+
+/*
+ * shard_for - The file of a new entry.
+ *
+ *	The entries of the databases without names (e.g. /etc/subuid) stay
+ *	in the main file.
+ */
+static unsigned int shard_for (const struct commonio_db *db,
+                               const void *eptr)
+{
+	const char *name;
+
+	if (   (NULL == db->shards)
+	    || (!db->ops->has_fields && (NULL == db->ops->getname))) {
+		return 0;
+	}
+	name = ent_name (db, eptr);
+	if (name_is_nis (name)) {
+		return 0;
+	}
+	return 1 + (unsigned int) (name_hash (name, strlen (name))
+	                           % db->shards->count);
+}
+
+/*
+ * shards_mark_dirty - Find the files which must be written.
+ */
+static void shards_mark_dirty (struct commonio_db *db)
+{
+	struct commonio_shards *shards = db->shards;
+	size_t entries[COMMONIO_SHARDS_MAX + 1];
+	const struct commonio_entry *p;
+	size_t i;
+
+	memzero (entries, sizeof entries);
+	for (i = 0; i <= shards->count; i++) {
+		shards->dirty[i] = db->reordered;
+	}
+	for (p = db->head; NULL != p; p = p->next) {
+		entries[p->shard]++;
+		if (p->changed) {
+			shards->dirty[p->shard] = true;
+		}
+	}
+	for (i = 0; i <= shards->count; i++) {
+		if (entries[i] != shards->entries[i]) {
+			/* Entries were added or removed */
+			shards->dirty[i] = true;
+		}
+	}
+}
+
+/*
+ * prepare_shards - Write the changed shard files to <shard>+.
+ *
+ *	A shard file which was removed in the meantime is created with
+ *	the permissions of the database file.
+ */
+static int prepare_shards (struct commonio_db *db,
+                           const struct stat *main_sb)
+{
+	struct commonio_shards *shards = db->shards;
+	char buf[1024];
+	struct stat sb;
+	size_t i;
+
+	for (i = 1; i <= shards->count; i++) {
+		int errors = 0;
+
+		if (!shards->dirty[i]) {
+			continue;
+		}
+		if (stat (shards->names[i], &sb) != 0) {
+			sb = *main_sb;
+		} else if (!offline) {
+			snprintf (buf, sizeof buf, "%s-", shards->names[i]);
+			if (link_backup (shards->names[i], buf) != 0) {
+				return 0;
+			}
+		}
+
+		snprintf (buf, sizeof buf, "%s+", shards->names[i]);
+#ifdef WITH_SELINUX
+		if (set_selinux_file_context (buf) != 0) {
+			errors++;
+		}
+#endif
+		shards->fps[i] = fopen_set_perms (buf, "w", &sb);
+		if (NULL != shards->fps[i]) {
+			shards->pending[i] = true;
+			if (write_all (db, db->head, shards->fps[i], (int) i) != 0) {
+				errors++;
+			}
+			if (fflush (shards->fps[i]) != 0) {
+				errors++;
+			}
+		} else {
+			errors++;
+		}
+#ifdef WITH_SELINUX
+		if (reset_selinux_file_context () != 0) {
+			errors++;
+		}
+#endif
+		if (0 != errors) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * sync_shards - Make sure that the shard files written by
+ *               prepare_shards are on disk, and close them.
+ */
+static int sync_shards (struct commonio_db *db)
+{
+	struct commonio_shards *shards = db->shards;
+	int errors = 0;
+	size_t i;
+
+	for (i = 1; i <= shards->count; i++) {
+		if (NULL == shards->fps[i]) {
+			continue;
+		}
+		if (   (durability () != DURABILITY_NONE)
+		    && (fsync (fileno (shards->fps[i])) != 0)) {
+			errors++;
+		}
+		if (fclose (shards->fps[i]) != 0) {
+			errors++;
+		}
+		shards->fps[i] = NULL;
+	}
+	return (errors == 0) ? 1 : 0;
+}
+
+static bool shards_pending (const struct commonio_db *db)
+{
+	size_t i;
+
+	if (NULL == db->shards) {
+		return false;
+	}
+	for (i = 1; i <= db->shards->count; i++) {
+		if (db->shards->pending[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * commit_shards - Replace the changed shard files.
+ */
+static int commit_shards (struct commonio_db *db)
+{
+	struct commonio_shards *shards = db->shards;
+	const struct commonio_entry *p;
+	bool renamed = false;
+	char buf[1024];
+	size_t i;
+
+	for (i = 1; i <= shards->count; i++) {
+		if (!shards->pending[i]) {
+			continue;
+		}
+		snprintf (buf, sizeof buf, "%s+", shards->names[i]);
+		if (lrename (buf, shards->names[i]) != 0) {
+			return 0;
+		}
+		shards->pending[i] = false;
+		renamed = true;
+	}
+	if (renamed) {
+		nscd_need_reload = true;
+		if (   (durability () == DURABILITY_FULL)
+		    && ((size_t) snprintf (buf, sizeof buf, "%s.d",
+		                           db->filename) < sizeof buf)) {
+			sync_dir (buf);
+		}
+	}
+
+	/* For the next checkpoint (see keep_db) */
+	memzero (shards->entries, sizeof shards->entries);
+	for (p = db->head; NULL != p; p = p->next) {
+		shards->entries[p->shard]++;
+	}
+	return 1;
+}
+
+/*
+ * abort_shards - Remove the shard files written by prepare_shards.
+ */
+static void abort_shards (struct commonio_db *db)
+{
+	struct commonio_shards *shards = db->shards;
+	char buf[1024];
+	size_t i;
+
+	for (i = 1; i <= shards->count; i++) {
+		if (NULL != shards->fps[i]) {
+			(void) fclose (shards->fps[i]);
+			shards->fps[i] = NULL;
+		}
+		if (shards->pending[i]) {
+			snprintf (buf, sizeof buf, "%s+", shards->names[i]);
+			(void) unlink (buf);
+			shards->pending[i] = false;
+		}
+	}
+}
+
+/*
+ * backup_db - Create the backup file of the database, before it is
+ *             replaced. An offline image does not need one.
+ *
+ *	fp is the database file, of status sb.
+ *	It returns 0 on success, -1 on failure.
+ */
+static int backup_db (const struct commonio_db *db, FILE *fp,
+                      const struct stat *sb)
+{
+	char buf[1024];
+	int errors = 0;
+	struct timespec start;
+
+	if (offline) {
+		return 0;
+	}
+	snprintf (buf, sizeof buf, "%s-", db->filename);
+
+#ifdef WITH_SELINUX
+	if (set_selinux_file_context (buf) != 0) {
+		errors++;
+	}
+#endif
+	timing_start (&start);
+	if (   (!getdef_bool ("BACKUP_HARD_LINK")
+	        || (link_backup (db->filename, buf) != 0))
+	    && (create_backup (buf, fp) != 0)) {
+		errors++;
+	}
+	timing_stop (TIMING_BACKUP, &start, 0,
+	             (unsigned long long) sb->st_size);
+#ifdef WITH_SELINUX
+	if (reset_selinux_file_context () != 0) {
+		errors++;
+	}
+#endif
+	return (errors == 0) ? 0 : -1;
+}
+
+/*
+ * prepare_db - Write the changes of an open database.
+ *
+ *	The changes are written to <file>+, appended to the file (see
+ *	append_entries), or written to the journal of the file (see
+ *	journal_entries), and flushed. db->fp is then the written file.
+ *
+ *	The changed shards of a sharded database are written to their
+ *	<shard>+ file (see prepare_shards). The database file is then
+ *	only written if its own entries changed.
+ *
+ *	If the database was not changed, it is only closed.
+ *
+ *	On failure, the database is left for abort_db().
+ */
+static int prepare_db (struct commonio_db *db)
+{
+	char buf[1024];
+	int errors = 0;
+	struct stat sb;
+	FILE *fp = NULL;
+	struct timespec start;
+
+	if (!db->isopen) {
+		errno = EINVAL;
+		return 0;
+	}
+	db->isopen = false;
+
+	if (!db->changed || db->readonly) {
+		if (NULL != db->fp) {
+			(void) fclose (db->fp);
+			db->fp = NULL;
+		}
+		free_linked_list (db);
+		db->optimistic = false;
+		return 1;
+	}
+
+	/* Opened with commonio_open_optimistic(), but never locked */
+	if (!db->locked) {
+		errno = EACCES;
+		return 0;
+	}
+
+	/* The close hooks may change the list without updating the index */
+	index_free (db);
+	id_index_free (db);
+	gid_index_free (db);
+	if ((NULL != db->ops->close_hook) && (db->ops->close_hook () == 0)) {
+		return 0;
+	}
+
+	if (NULL != db->shards) {
+		shards_mark_dirty (db);
+	}
+
+	memzero (&sb, sizeof sb);
+	if (NULL != db->fp) {
+		if (fstat (fileno (db->fp), &sb) != 0) {
+			return 0;
+		}
+
+		if ((NULL != db->shards) && !db->shards->dirty[0]) {
+			/* Only the shard files changed */
+			if (fclose (db->fp) != 0) {
+				errors++;
+			}
+			db->fp = NULL;
+			if (prepare_shards (db, &sb) == 0) {
+				errors++;
+			}
+			return (errors == 0) ? 1 : 0;
+		}
+
+		/*
+		 * If entries were only added at the end, append them to
+		 * the file instead of rewriting it. Otherwise, the file
+		 * may be updated in place through a journal. The shard
+		 * files are small: they are always rewritten.
+		 */
+		if (   (NULL == db->shards) && !offline
+		    && getdef_bool ("APPEND_NEW_ENTRIES")) {
+			struct commonio_entry *first = appended_entries (db);
+
+			if (NULL != first) {
+				fp = append_entries (db, first, &sb);
+			}
+			if (NULL != fp) {
+				db->pending_append = true;
+			}
+		}
+		if (   (NULL == fp) && (NULL == db->shards) && !offline
+		    && getdef_bool ("JOURNAL_UPDATES")) {
+			timing_start (&start);
+			fp = journal_entries (db, &sb);
+			timing_stop (TIMING_WRITE, &start, 0, 0);
+			if (NULL != fp) {
+				db->pending_journal = true;
+			}
+		}
+		if (NULL != fp) {
+			if (fclose (db->fp) != 0) {
+				errors++;
+			}
+			db->fp = fp;
+			return (errors == 0) ? 1 : 0;
+		}
+
+		if (backup_db (db, db->fp, &sb) != 0) {
+			errors++;
+		}
+
+		if (fclose (db->fp) != 0) {
+			errors++;
+		}
+		db->fp = NULL;
+
+		if (errors != 0) {
+			return 0;
+		}
+	} else {
+		/*
+		 * Default permissions for new [g]shadow files.
+		 */
+		sb.st_mode = db->st_mode;
+		sb.st_uid = db->st_uid;
+		sb.st_gid = db->st_gid;
+	}
+
+	if ((size_t) snprintf (buf, sizeof buf, "%s+",
+	                       db->filename) >= sizeof buf) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+
+#ifdef WITH_SELINUX
+	if (set_selinux_file_context (buf) != 0) {
+		errors++;
+	}
+#endif
+
+	db->fp = fopen_set_perms (buf, "w", &sb);
+	if (NULL != db->fp) {
+		db->pending_rename = true;
+		if (write_all (db, db->head, db->fp,
+		               (NULL != db->shards) ? 0 : SHARD_ALL) != 0) {
+			errors++;
+		}
+		if (fflush (db->fp) != 0) {
+			errors++;
+		}
+	} else {
+		errors++;
+	}
+
+#ifdef WITH_SELINUX
+	if (reset_selinux_file_context () != 0) {
+		errors++;
+	}
+#endif
+
+	if (   (0 == errors) && (NULL != db->shards)
+	    && (prepare_shards (db, &sb) == 0)) {
+		errors++;
+	}
+
+	return (errors == 0) ? 1 : 0;
+}
+
+/*
+ * sync_db - Make sure that the changes written by prepare_db are on
+ *           disk.
+ */
+static int sync_db (struct commonio_db *db)
+{
+	int errors = 0;
+	struct timespec start;
+
+	if ((NULL != db->shards) && (sync_shards (db) == 0)) {
+		errors++;
+	}
+	if (!db->pending_rename && !db->pending_append && !db->pending_journal) {
+		return (errors == 0) ? 1 : 0;
+	}
+
+	timing_start (&start);
+	if (DURABILITY_NONE != durability ()) {
+#ifdef HAVE_FSYNC
+		if (fsync (fileno (db->fp)) != 0) {
+			errors++;
+		}
+#else				/* !HAVE_FSYNC */
+		sync ();
+#endif				/* !HAVE_FSYNC */
+	}
+	timing_stop (TIMING_FSYNC, &start, 0, 0);
+	if (fclose (db->fp) != 0) {
+		errors++;
+	}
+	db->fp = NULL;
+
+	return (errors == 0) ? 1 : 0;
+}
+
+/*
+ * commit_db - Replace the database by the synced changes.
+ *
+ *	If keep is set, the database stays open with its entries (see
+ *	keep_db). Otherwise, it is closed.
+ *
+ *	renamed is set if the file was replaced by the new one, whose
+ *	directory is then synced by the caller (see sync_parent_dirs).
+ *
+ *	On failure, the database is left for abort_db().
+ */
+static int commit_db (struct commonio_db *db, bool keep,
+                      /*@out@*/bool *renamed)
+{
+	char buf[1024];
+	bool written =    db->pending_rename
+	               || db->pending_append
+	               || db->pending_journal
+	               || shards_pending (db);
+	bool journaled = db->pending_journal;
+	int fd, ret;
+	struct timespec start;
+
+	*renamed = false;
+	if (db->pending_rename) {
+		if ((size_t) snprintf (buf, sizeof buf, "%s+",
+		                       db->filename) >= sizeof buf) {
+			errno = ENAMETOOLONG;
+			return 0;
+		}
+		timing_start (&start);
+		ret = lrename (buf, db->filename);
+		timing_stop (TIMING_RENAME, &start, 0, 0);
+		if (ret != 0) {
+			return 0;
+		}
+		db->pending_rename = false;
+		*renamed = true;
+		nscd_need_reload = true;
+	} else if (db->pending_append) {
+		/* The new entries are on disk, forget the previous size */
+		if ((size_t) snprintf (buf, sizeof buf, "%s.append",
+		                       db->filename) < sizeof buf) {
+			(void) unlink (buf);
+		}
+		db->pending_append = false;
+		nscd_need_reload = true;
+	} else if (db->pending_journal) {
+		fd = open (db->filename, O_RDWR | O_NOCTTY | O_NOFOLLOW);
+		if (fd < 0) {
+			return 0;
+		}
+		timing_start (&start);
+		ret = replay_journal (db, fd);
+		timing_stop (TIMING_JOURNAL, &start, 0, 0);
+		(void) close (fd);
+		if (-1 == ret) {
+			/*
+			 * The file may be partly updated, the journal is
+			 * kept for the next open.
+			 */
+			db->pending_journal = false;
+		}
+		if (1 != ret) {
+			return 0;
+		}
+		db->pending_journal = false;
+		nscd_need_reload = true;
+	}
+	if ((NULL != db->shards) && (commit_shards (db) == 0)) {
+		return 0;
+	}
+
+	if (written) {
+		db->commits++;
+	}
+	/* The snapshot only indexes the database file */
+	if (   written && (NULL == db->shards)
+	    && getdef_bool ("INDEX_SNAPSHOT")) {
+		/* The snapshot is only a cache, the lookups can do without */
+		(void) commonio_snapshot_update (db);
+	}
+	if (written && !offline) {
+		commonio_feed_commit (db);
+	}
+	if (written && db->seq.changed) {
+		/* The allocations check the IDs, see commonio_seq_commit */
+		(void) commonio_seq_commit (db);
+	}
+
+	if (keep) {
+		/*
+		 * The journal was replayed in the mapped file: the lines
+		 * of the entries may have changed under them.
+		 */
+		return keep_db (db, journaled);
+	}
+	free_linked_list (db);
+	return 1;
+}
+
+/*
+ * sync_dir - Sync a directory after files were renamed in it.
+ *
+ *	The files are already replaced: a failure is only logged.
+ */
+static void sync_dir (const char *dir)
+{
+	int fd;
+
+	fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if ((fd < 0) || (fsync (fd) != 0)) {
+		SYSLOG ((LOG_WARN, "cannot sync %s: %s", dir, strerror (errno)));
+	}
+	if (fd >= 0) {
+		(void) close (fd);
+	}
+}
+
+/*
+ * sync_parent_dirs - Sync the directories of the renamed databases, with
+ *                    a full durability.
+ *
+ *	Each directory is synced once, even if several databases of a
+ *	transaction were renamed in it. The databases are already
+ *	replaced: a failure is only logged.
+ */
+static void sync_parent_dirs (struct commonio_db *const *dbs,
+                              const bool *renamed, size_t count)
+{
+	char dirs[COMMONIO_TXN_MAX][1024];
+	size_t ndirs = 0;
+	size_t i, j;
+
+	if (DURABILITY_FULL != durability ()) {
+		return;
+	}
+
+	for (i = 0; (i < count) && (ndirs < COMMONIO_TXN_MAX); i++) {
+		char *slash;
+
+		if (   !renamed[i]
+		    || (strlen (dbs[i]->filename) >= sizeof dirs[ndirs])) {
+			continue;
+		}
+		(void) strcpy (dirs[ndirs], dbs[i]->filename);
+		slash = strrchr (dirs[ndirs], '/');
+		if (NULL == slash) {
+			(void) strcpy (dirs[ndirs], ".");
+		} else if (slash == dirs[ndirs]) {
+			slash[1] = '\0';
+		} else {
+			*slash = '\0';
+		}
+		for (j = 0; j < ndirs; j++) {
+			if (strcmp (dirs[j], dirs[ndirs]) == 0) {
+				break;
+			}
+		}
+		if (j < ndirs) {
+			continue;
+		}
+
+		sync_dir (dirs[ndirs]);
+		ndirs++;
+	}
+}
+
+/*
+ * format_line - Format a changed entry as a line, without the newline.
+ *
+ *	The line is allocated in the arena of the database.
+ */
+static /*@null@*/char *format_line (struct commonio_db *db,
+                                    const struct commonio_entry *p)
+{
+	struct commonio_buf out = { NULL, 0, 0 };
+	char *line;
+
+	if (NULL != db->ops->format) {
+		if (db->ops->format (p->eptr, &out) != 0) {
+			free (out.data);
+			return NULL;
+		}
+	} else {
+#ifdef HAVE_OPEN_MEMSTREAM
+		FILE *mem = open_memstream (&out.data, &out.len);
+
+		if (NULL == mem) {
+			return NULL;
+		}
+		if (db->ops->put (p->eptr, mem) != 0) {
+			(void) fclose (mem);
+			free (out.data);
+			return NULL;
+		}
+		if (fclose (mem) != 0) {
+			free (out.data);
+			return NULL;
+		}
+#else				/* !HAVE_OPEN_MEMSTREAM */
+		return NULL;
+#endif				/* !HAVE_OPEN_MEMSTREAM */
+	}
+
+	if ((out.len > 0) && ('\n' == out.data[out.len - 1])) {
+		out.len--;
+	}
+	line = arena_strndup (&db->arena, (NULL != out.data) ? out.data : "",
+	                      out.len);
+	free (out.data);
+	return line;
+}
+
+/*
+ * Growth of the arenas of a kept database which is always allowed
+ * before it is read again (see keep_db).
+ */
+#define ARENA_REREAD_SLACK (1024 * 1024)
+
+/*
+ * keep_db - Keep a committed database open with its entries.
+ *
+ *	The changed entries get the line which was written for them, and
+ *	the new file is opened, as if it had just been read by
+ *	commonio_open(). If this is not possible, or if reread is set,
+ *	the database is read again.
+ *
+ *	The arenas keep the lines and the entries which were replaced or
+ *	removed. The database is also read again when the arenas are more
+ *	than twice as large as when it was read (and ARENA_REREAD_SLACK
+ *	more), so that the memory of a program which keeps it open, like
+ *	shadowd, does not grow without bound.
+ */
+static int keep_db (struct commonio_db *db, bool reread)
+{
+	struct commonio_entry *p;
+	int fd;
+
+	if (  db->arena.total + db->entry_arena.total
+	    > 2 * db->arena_open + ARENA_REREAD_SLACK) {
+		reread = true;
+	}
+	for (p = db->head; !reread && (NULL != p); p = p->next) {
+		if (!p->changed) {
+			continue;
+		}
+		p->line = format_line (db, p);
+		if (NULL == p->line) {
+			reread = true;
+			break;
+		}
+		p->changed = false;
+	}
+
+	if (!reread) {
+		fd = open (db->filename, O_RDWR | O_NOCTTY | O_NOFOLLOW);
+		if (fd >= 0) {
+			db->fp = fdopen (fd, "r+");
+			if (NULL == db->fp) {
+				(void) close (fd);
+			}
+		}
+		reread = (NULL == db->fp);
+	}
+	if (reread) {
+		free_linked_list (db);
+		return commonio_open (db, O_CREAT | O_RDWR);
+	}
+	fcntl (fileno (db->fp), F_SETFD, FD_CLOEXEC);
+
+	/* The close hooks may have changed the list */
+	index_free (db);
+	id_index_free (db);
+	gid_index_free (db);
+	member_index_free (db);
+	db->member_lookup = false;
+	if (NULL != db->type_index) {
+		db->ops->free_index (db->type_index);
+		db->type_index = NULL;
+	}
+
+	db->cursor = NULL;
+	db->changed = false;
+	db->rewrite = false;
+	db->reordered = false;
+	db->isopen = true;
+
+	if ((NULL != db->ops->open_hook) && (db->ops->open_hook () == 0)) {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * abort_db - Close the database after a failure, without changing it.
+ *
+ *	The written changes, if any, are discarded.
+ */
+static void abort_db (struct commonio_db *db)
+{
+	char buf[1024];
+	int fd;
+
+	db->isopen = false;
+	db->optimistic = false;
+	if (NULL != db->fp) {
+		(void) fclose (db->fp);
+		db->fp = NULL;
+	}
+
+	if (db->pending_rename) {
+		if ((size_t) snprintf (buf, sizeof buf, "%s+",
+		                       db->filename) < sizeof buf) {
+			(void) unlink (buf);
+		}
+		db->pending_rename = false;
+	} else if (db->pending_append) {
+		fd = open (db->filename, O_RDWR | O_NOCTTY | O_NOFOLLOW);
+		if (fd >= 0) {
+			rollback_append (db, fd);
+			(void) close (fd);
+		}
+		db->pending_append = false;
+	} else if (db->pending_journal) {
+		/* The file was not changed yet */
+		if ((size_t) snprintf (buf, sizeof buf, "%s.journal",
+		                       db->filename) < sizeof buf) {
+			(void) unlink (buf);
+		}
+		db->pending_journal = false;
+	}
+	if (NULL != db->shards) {
+		abort_shards (db);
+	}
+
+	free_linked_list (db);
+}
+
+int commonio_close (struct commonio_db *db)
+{
+	bool renamed;
+	int ret = 1;
+
+	SHADOW_PROBE1 (commonio_close__entry, db->filename);
+	if (   (prepare_db (db) == 0)
+	    || (sync_db (db) == 0)
+	    || (commit_db (db, false, &renamed) == 0)) {
+		abort_db (db);
+		ret = 0;
+	} else {
+		sync_parent_dirs (&db, &renamed, 1);
+	}
+	SHADOW_PROBE2 (commonio_close__return, db->filename, ret);
+	return ret;
+}
+
+/*
+ * commonio_txn_init - Initialize an empty transaction.
+ */
+void commonio_txn_init (struct commonio_txn *txn)
+{
+	txn->count = 0;
+	txn->failed = NULL;
+}
+
+/*
+ * commonio_txn_add - Add an open database to the transaction.
+ */
+int commonio_txn_add (struct commonio_txn *txn, struct commonio_db *db)
+{
+	if (   !db->isopen
+	    || (txn->count >= (sizeof txn->dbs / sizeof txn->dbs[0]))) {
+		errno = EINVAL;
+		return 0;
+	}
+	txn->dbs[txn->count] = db;
+	txn->count++;
+	return 1;
+}
+
+/*
+ * commonio_txn_commit - Close all the databases of the transaction.
+ *
+ *	The changes of all the databases are written and synced before
+ *	any database is replaced. If one of them cannot be written, none
+ *	of the databases is changed.
+ *
+ *	In all cases, the databases are closed (but still locked).
+ *	On failure, txn->failed is the database which could not be
+ *	written, and 0 is returned.
+ */
+int commonio_txn_commit (struct commonio_txn *txn)
+{
+	return commonio_txn_write (txn, false);
+}
+
+/*
+ * commonio_txn_checkpoint - Commit the changes of the databases of the
+ *                           transaction, and keep them open.
+ *
+ *	This is like commonio_txn_commit(), but on success the databases
+ *	are still open, with their entries, as if they had been opened
+ *	again. It is used by the programs which make several commits
+ *	while they hold the locks.
+ *
+ *	On failure, the databases are closed.
+ */
+int commonio_txn_checkpoint (struct commonio_txn *txn)
+{
+	return commonio_txn_write (txn, true);
+}
+
+/*
+ * txn_skip - Check if a database of a checkpoint can be left as is.
+ */
+static bool txn_skip (const struct commonio_db *db, bool keep)
+{
+	return keep && (!db->changed || db->readonly);
+}
+
+static int commonio_txn_write (struct commonio_txn *txn, bool keep)
+{
+	bool renamed[COMMONIO_TXN_MAX];
+	size_t i, j;
+
+	for (i = 0; i < txn->count; i++) {
+		renamed[i] = false;
+	}
+
+	for (i = 0; i < txn->count; i++) {
+		if (txn_skip (txn->dbs[i], keep)) {
+			continue;
+		}
+		if (prepare_db (txn->dbs[i]) == 0) {
+			goto fail;
+		}
+	}
+	for (i = 0; i < txn->count; i++) {
+		if (txn_skip (txn->dbs[i], keep)) {
+			continue;
+		}
+		if (sync_db (txn->dbs[i]) == 0) {
+			goto fail;
+		}
+	}
+	for (i = 0; i < txn->count; i++) {
+		if (txn_skip (txn->dbs[i], keep)) {
+			continue;
+		}
+		if (commit_db (txn->dbs[i], keep, &renamed[i]) == 0) {
+			/* The previous databases are already replaced */
+			sync_parent_dirs (txn->dbs, renamed, i);
+			goto fail;
+		}
+	}
+	/* A single sync per directory for all the renamed files */
+	sync_parent_dirs (txn->dbs, renamed, txn->count);
+	return 1;
+
+      fail:
+	txn->failed = txn->dbs[i];
+	for (j = 0; j < txn->count; j++) {
+		abort_db (txn->dbs[j]);
+	}
 	return 0;
 }
 
-/*
- * Sort given db according to cmp function (usually compares uids)
- */
-int
-commonio_sort (struct commonio_db *db, int (*cmp) (const void *, const void *))
+static /*@dependent@*/ /*@null@*/struct commonio_entry *next_entry_by_name (
+	struct commonio_db *db,
+	/*@null@*/struct commonio_entry *pos,
+	const char *name)
+{
+	struct commonio_entry *p;
+	size_t len;
+	int r;
+
+	if (NULL == pos) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	len = strlen (name);
+	for (p = pos; NULL != p; p = p->next) {
+		r = entry_has_name (db, p, name, len);
+		if (1 == r) {
+			return p;
+		} else if (-1 == r) {
+			return NULL;
+		}
+	}
+	errno = ENOENT;
+	return NULL;
+}
+
+/*
+ * find_entry_by_name - Find the first entry with the specified name.
+ *
+ * The name index is used (and built on the first call). If several
+ * entries share the name, the list is scanned to return the first one.
+ *
+ * Otherwise, it returns NULL with errno set to ENOENT, or to ENOMEM if an
+ * entry with this name could not be parsed.
+ */
+static /*@dependent@*/ /*@null@*/struct commonio_entry *find_entry_by_name (
+	struct commonio_db *db,
+	const char *name)
+{
+	struct commonio_entry *p;
+	struct commonio_entry *found = NULL;
+	size_t len = strlen (name);
+	int r;
+
+	if ((NULL == db->name_index) && !index_build (db)) {
+		return next_entry_by_name (db, db->head, name);
+	}
+
+	for (p = *index_bucket (db, name, len); NULL != p; p = p->name_next) {
+		r = entry_has_name (db, p, name, len);
+		if (-1 == r) {
+			return NULL;
+		} else if (1 == r) {
+			if (NULL != found) {
+				/* Duplicate names, keep the list order */
+				return next_entry_by_name (db, db->head, name);
+			}
+			found = p;
+		}
+	}
+	if (NULL == found) {
+		errno = ENOENT;
+	}
+	return found;
+}
+
+/*
+ * has_other_entry_by_name - Check if an entry other than the provided one
+ *                           has the specified name.
+ */
+static bool has_other_entry_by_name (struct commonio_db *db,
+                                     const struct commonio_entry *ent,
+                                     const char *name)
+{
+	struct commonio_entry *p;
+	size_t len = strlen (name);
+
+	/* An entry which cannot be parsed may have the name */
+	if (NULL == db->name_index) {
+		for (p = db->head; NULL != p; p = p->next) {
+			if ((p != ent) && (entry_has_name (db, p, name, len) != 0)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	for (p = *index_bucket (db, name, len); NULL != p; p = p->name_next) {
+		if ((p != ent) && (entry_has_name (db, p, name, len) != 0)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * update_entry - Replace the entry with the name of nentry, or add
+ *                nentry.
+ *
+ *	The database takes nentry, which is released on failure.
+ */
+static int update_entry (struct commonio_db *db, /*@only@*/void *nentry)
+{
+	struct commonio_entry *p;
+
+	p = find_entry_by_name (db, ent_name (db, nentry));
+	if (NULL != p) {
+		if (has_other_entry_by_name (db, p, ent_name (db, nentry))) {
+			fprintf (stderr, _("Multiple entries named '%s' in %s. Please fix this with pwck or grpck.\n"), ent_name (db, nentry), db->filename);
+			db->ops->free (nentry);
+			return 0;
+		}
+		/* The IDs and the members may have changed */
+		id_index_remove (db, p);
+		gid_index_remove (db, p);
+		member_index_remove (db, p);
+		db->ops->free (p->eptr);
+		p->eptr = nentry;
+		id_index_insert (db, p);
+		gid_index_insert (db, p);
+		member_index_insert (db, p);
+		p->changed = true;
+		db->cursor = p;
+
+		db->changed = true;
+		return 1;
+	}
+	if (ENOMEM == errno) {
+		/* The entry of this name may be there */
+		db->ops->free (nentry);
+		return 0;
+	}
+	/* not found, new entry */
+	p = new_entry (db, NULL);
+	if (NULL == p) {
+		db->ops->free (nentry);
+		errno = ENOMEM;
+		return 0;
+	}
+
+	p->eptr = nentry;
+	p->changed = true;
+	p->parsed = true;
+	p->shard = shard_for (db, nentry);
+
+#if KEEP_NIS_AT_END
+	add_one_entry_nis (db, p);
+#else				/* !KEEP_NIS_AT_END */
+	add_one_entry (db, p);
+#endif				/* !KEEP_NIS_AT_END */
+
+	db->changed = true;
+	return 1;
+}
+
+int commonio_update (struct commonio_db *db, const void *eptr)
 {
-	struct commonio_entry **entries, *ptr;
-	size_t n = 0, i;
-#if KEEP_NIS_AT_END
-	struct commonio_entry *nis = NULL;
-#endif
+	void *nentry;
 
-	for (ptr = db->head;
-	        (NULL != ptr)
-#if KEEP_NIS_AT_END
-	     && ((NULL == ptr->line)
-	         || (('+' != ptr->line[0])
-	             && ('-' != ptr->line[0])))
-#endif
-	     ;
-	     ptr = ptr->next) {
-		n++;
+	if (!db->isopen || db->readonly) {
+		errno = EINVAL;
+		return 0;
 	}
-#if KEEP_NIS_AT_END
-	if (NULL != ptr) {
-		nis = ptr;
+	nentry = db->ops->dup (eptr);
+	if (NULL == nentry) {
+		errno = ENOMEM;
+		return 0;
 	}
-#endif
+	return update_entry (db, nentry);
+}
 
-	if (n <= 1) {
+/*
+ * commonio_update_owned - Like commonio_update, without copying the
+ *                         object.
+ *
+ *	The database takes eptr, which must have been allocated like the
+ *	copies of the dup operation (it is released with the free
+ *	operation), even on failure. The caller must not use it afterwards.
+ */
+int commonio_update_owned (struct commonio_db *db, /*@only@*/void *eptr)
+{
+	if (!db->isopen || db->readonly) {
+		db->ops->free (eptr);
+		errno = EINVAL;
 		return 0;
 	}
+	return update_entry (db, eptr);
+}
 
-	entries = malloc (n * sizeof (struct commonio_entry *));
-	if (entries == NULL) {
-		return -1;
-	}
+/*
+ * commonio_modify - Change the entry with the specified name in place.
+ *
+ *	modify is called with the object of the entry, which is then
+ *	marked as changed. It may only change the numerical fields of the
+ *	object (for example pw_uid or gr_gid), not its name or its
+ *	strings, which belong to the object (use commonio_update to
+ *	change them).
+ *
+ *	The entries are neither copied nor reordered: an entry can be
+ *	changed during a walk of the database.
+ *
+ *	It returns 0 with errno set to ENOENT if there is no such entry, or
+ *	to ENOMEM if an entry could not be parsed.
+ */
+int commonio_modify (struct commonio_db *db, const char *name,
+                     void (*modify) (void *ent, void *arg), void *arg)
+{
+	struct commonio_entry *p;
 
-	n = 0;
-	for (ptr = db->head;
-#if KEEP_NIS_AT_END
-	     nis != ptr;
-#else
-	     NULL != ptr;
-#endif
-/*@ -nullderef @*/
-	     ptr = ptr->next
-/*@ +nullderef @*/
-	    ) {
-		entries[n] = ptr;
-		n++;
+	if (!db->isopen || db->readonly) {
+		errno = EINVAL;
+		return 0;
 	}
-	qsort (entries, n, sizeof (struct commonio_entry *), cmp);
-
-	/* Take care of the head and tail separately */
-	db->head = entries[0];
-	n--;
-#if KEEP_NIS_AT_END
-	if (NULL == nis)
-#endif
-	{
-		db->tail = entries[n];
+	p = find_entry_by_name (db, name);
+	if (NULL == p) {
+		return 0;
 	}
-	db->head->prev = NULL;
-	db->head->next = entries[1];
-	entries[n]->prev = entries[n - 1];
-#if KEEP_NIS_AT_END
-	entries[n]->next = nis;
-#else
-	entries[n]->next = NULL;
-#endif
-
-	/* Now other elements have prev and next entries */
-	for (i = 1; i < n; i++) {
-		entries[i]->prev = entries[i - 1];
-		entries[i]->next = entries[i + 1];
+	if (has_other_entry_by_name (db, p, name)) {
+		fprintf (stderr, _("Multiple entries named '%s' in %s. Please fix this with pwck or grpck.\n"), name, db->filename);
+		return 0;
 	}
 
-	free (entries);
-	db->changed = true;
+	/* The IDs and the members may change */
+	id_index_remove (db, p);
+	gid_index_remove (db, p);
+	member_index_remove (db, p);
+	modify (p->eptr, arg);
+	id_index_insert (db, p);
+	gid_index_insert (db, p);
+	member_index_insert (db, p);
+	p->changed = true;
 
-	return 0;
+	db->changed = true;
+	return 1;
 }
 
 /*
- * Sort entries in db according to order in another.
+ * Streaming edits (STREAM_UPDATES)
+ *
+ * commonio_stream() applies a few edits to a locked database without
+ * loading it: the file is copied line by line to <file>+, with the
+ * edited entries changed, removed or added on the way, and <file>+ is
+ * then committed like commonio_close() does (backup, fsync, rename).
+ * Only the longest line and the edited entries are held in memory, and
+ * the file is read once.
+ *
+ * The entries are found by the name before the first ':' of their line.
+ * The new entries are added at the end of the file, or before the first
+ * NIS (+ or -) entry: if such an entry comes before the end, with an
+ * entry still to be added, the name may be further in the file, and the
+ * edits are applied by loading the database instead. They are also
+ * applied this way without STREAM_UPDATES, or with SHARDED_DATABASES.
  */
-int commonio_sort_wrt (struct commonio_db *shadow,
-                       const struct commonio_db *passwd)
+
+/*
+ * stream_match - Find the edit of the entry of line, if any.
+ */
+static /*@null@*/struct commonio_edit *stream_match (
+	struct commonio_edit *edits, size_t count, const char *line)
 {
-	struct commonio_entry *head = NULL, *pw_ptr, *spw_ptr;
-	const char *name;
+	const char *colon = strchr (line, ':');
+	size_t len;
+	size_t i;
 
-	if ((NULL == shadow) || (NULL == shadow->head)) {
-		return 0;
+	if (NULL == colon) {
+		return NULL;
 	}
-
-	for (pw_ptr = passwd->head; NULL != pw_ptr; pw_ptr = pw_ptr->next) {
-		if (NULL == pw_ptr->eptr) {
-			continue;
-		}
-		name = passwd->ops->getname (pw_ptr->eptr);
-		for (spw_ptr = shadow->head;
-		     NULL != spw_ptr;
-		     spw_ptr = spw_ptr->next) {
-			if (NULL == spw_ptr->eptr) {
-				continue;
-			}
-			if (strcmp (name, shadow->ops->getname (spw_ptr->eptr))
-			    == 0) {
-				break;
-			}
+	len = (size_t) (colon - line);
+	for (i = 0; i < count; i++) {
+		if (   (strncmp (edits[i].name, line, len) == 0)
+		    && ('\0' == edits[i].name[len])) {
+			return &edits[i];
 		}
-		if (NULL == spw_ptr) {
-			continue;
-		}
-		commonio_del_entry (shadow, spw_ptr);
-		spw_ptr->next = head;
-		head = spw_ptr;
 	}
+	return NULL;
+}
 
-	for (spw_ptr = head; NULL != spw_ptr; spw_ptr = head) {
-		head = head->next;
+static bool stream_adds_pending (const struct commonio_edit *edits,
+                                 size_t count)
+{
+	size_t i;
 
-		if (NULL != shadow->head) {
-			shadow->head->prev = spw_ptr;
+	for (i = 0; i < count; i++) {
+		if (!edits[i].found && (NULL != edits[i].add)) {
+			return true;
 		}
-		spw_ptr->next = shadow->head;
-		shadow->head = spw_ptr;
 	}
+	return false;
+}
 
-	shadow->head->prev = NULL;
-	shadow->changed = true;
-
+static int stream_copy (const struct commonio_db *db, const char *line,
+                        FILE *fp)
+{
+	if (   (db->ops->fputs (line, fp) == EOF)
+	    || (putc ('\n', fp) == EOF)) {
+		return -1;
+	}
 	return 0;
 }
 
 /*
- * write_all - Write the database to its file.
+ * stream_parse - Parse line into a new object, like the entries are
+ *                parsed by commonio_entry_eptr().
  *
- * It returns 0 if all the entries could be written correctly.
+ *	It returns NULL if the line is not a valid entry.
  */
-static int write_all (const struct commonio_db *db)
-	/*@requires notnull db->fp@*/
+static /*@null@*/ /*@only@*/void *stream_parse (const struct commonio_db *db,
+                                                const char *line)
 {
-	const struct commonio_entry *p;
-	void *eptr;
+	const void *eptr;
 
-	for (p = db->head; NULL != p; p = p->next) {
-		if (p->changed) {
-			eptr = p->eptr;
-			assert (NULL != eptr);
-			if (db->ops->put (eptr, db->fp) != 0) {
-				return -1;
-			}
-		} else if (NULL != p->line) {
-			if (db->ops->fputs (p->line, db->fp) == EOF) {
-				return -1;
-			}
-			if (putc ('\n', db->fp) == EOF) {
-				return -1;
-			}
-		}
+	if (NULL != db->ops->parse_alloc) {
+		return db->ops->parse_alloc (line);
 	}
-	return 0;
+	eptr = db->ops->parse (line);
+	return (NULL != eptr) ? db->ops->dup (eptr) : NULL;
 }
 
-
-int commonio_close (struct commonio_db *db)
+/*
+ * stream_entry - Write the entry of line, with its edit.
+ *
+ *	changed is set if the entry was changed or removed.
+ *	It returns 0 on success, -1 on failure (with errno set).
+ */
+static int stream_entry (struct commonio_db *db, struct commonio_edit *e,
+                         const char *line, FILE *fp,
+                         /*@out@*/bool *changed)
 {
-	char buf[1024];
-	int errors = 0;
-	struct stat sb;
+	const void *nent;
+	void *old;
+	int ret = 0;
 
-	if (!db->isopen) {
+	*changed = false;
+	if (e->found && (e->remove || (NULL != e->change))) {
+		fprintf (stderr, _("Multiple entries named '%s' in %s. Please fix this with pwck or grpck.\n"), e->name, db->filename);
 		errno = EINVAL;
-		return 0;
+		return -1;
 	}
-	db->isopen = false;
-
-	if (!db->changed || db->readonly) {
-		if (NULL != db->fp) {
-			(void) fclose (db->fp);
-			db->fp = NULL;
-		}
-		goto success;
+	old = stream_parse (db, line);
+	if (NULL == old) {
+		/* An invalid line, like for commonio_locate() */
+		return stream_copy (db, line, fp);
 	}
-
-	if ((NULL != db->ops->close_hook) && (db->ops->close_hook () == 0)) {
-		goto fail;
+	e->found = true;
+	if ((NULL == e->change) && !e->remove) {
+		db->ops->free (old);
+		return stream_copy (db, line, fp);
 	}
 
-	memzero (&sb, sizeof sb);
-	if (NULL != db->fp) {
-		if (fstat (fileno (db->fp), &sb) != 0) {
-			(void) fclose (db->fp);
-			db->fp = NULL;
-			goto fail;
+	if (e->remove) {
+		commonio_feed_remove (db, e->name, old);
+	} else {
+		nent = e->change (old, e->arg);
+		if (NULL == nent) {
+			db->ops->free (old);
+			errno = ECANCELED;
+			return -1;
 		}
+		ret = db->ops->put (nent, fp);
+		commonio_feed_change (db, e->name, old, nent);
+	}
+	db->ops->free (old);
+	*changed = true;
+	return ret;
+}
 
-		/*
-		 * Create backup file.
-		 */
-		snprintf (buf, sizeof buf, "%s-", db->filename);
-
-#ifdef WITH_SELINUX
-		if (set_selinux_file_context (buf) != 0) {
-			errors++;
-		}
-#endif
-		if (create_backup (buf, db->fp) != 0) {
-			errors++;
-		}
+/*
+ * stream_db - Apply the edits while copying the database to <file>+,
+ *             and commit it.
+ *
+ *	It returns 1 on success, 0 on failure (with errno set), and -1 if
+ *	the edits cannot be streamed. The file is then unchanged.
+ */
+static int stream_db (struct commonio_db *db, struct commonio_edit *edits,
+                      size_t count)
+{
+	char name[1024];
+	struct stat sb;
+	FILE *src = NULL;
+	char *buf;
+	size_t buflen = BUFLEN;
+	size_t len, i;
+	bool changed = false;
+	bool renamed, edited;
+	int fd, r = 0, ret = 0, saved_errno;
 
-		if (fclose (db->fp) != 0) {
-			errors++;
+	fd = open (db->filename, O_RDWR | O_NOCTTY | O_NOFOLLOW);
+	if (fd >= 0) {
+#ifdef WITH_TCB
+		if (tcb_is_suspect (fd) != 0) {
+			(void) close (fd);
+			errno = EINVAL;
+			return 0;
 		}
-
-#ifdef WITH_SELINUX
-		if (reset_selinux_file_context () != 0) {
-			errors++;
+#endif				/* WITH_TCB */
+		rollback_append (db, fd);
+		(void) replay_journal (db, fd);
+		src = fdopen (fd, "r");
+		if (NULL == src) {
+			(void) close (fd);
+			return 0;
 		}
-#endif
-		if (errors != 0) {
-			db->fp = NULL;
-			goto fail;
+		fcntl (fd, F_SETFD, FD_CLOEXEC);
+		if (fstat (fd, &sb) != 0) {
+			(void) fclose (src);
+			return 0;
 		}
-	} else {
-		/*
-		 * Default permissions for new [g]shadow files.
-		 */
+	} else if (ENOENT == errno) {
+		/* Like commonio_open() with O_CREAT */
+		memzero (&sb, sizeof sb);
 		sb.st_mode = db->st_mode;
 		sb.st_uid = db->st_uid;
 		sb.st_gid = db->st_gid;
+	} else {
+		return 0;
 	}
 
-	snprintf (buf, sizeof buf, "%s+", db->filename);
+	buf = (char *) malloc (buflen);
+	if (NULL == buf) {
+		if (NULL != src) {
+			(void) fclose (src);
+		}
+		errno = ENOMEM;
+		return 0;
+	}
 
+	if ((size_t) snprintf (name, sizeof name, "%s+",
+	                       db->filename) >= sizeof name) {
+		errno = ENAMETOOLONG;
+		goto fail;
+	}
 #ifdef WITH_SELINUX
-	if (set_selinux_file_context (buf) != 0) {
-		errors++;
+	if (set_selinux_file_context (name) != 0) {
+		goto fail;
+	}
+#endif
+	db->fp = fopen_set_perms (name, "w", &sb);
+#ifdef WITH_SELINUX
+	if (reset_selinux_file_context () != 0) {
+		goto fail;
+	}
+#endif
+	if (NULL == db->fp) {
+		goto fail;
+	}
+	db->pending_rename = true;
+
+	while (   (NULL != src)
+	       && ((r = read_line (db, src, &buf, &buflen, &len)) > 0)) {
+		struct commonio_edit *e;
+
+		if (name_is_nis (buf)) {
+			if (stream_adds_pending (edits, count)) {
+				ret = -1;
+				goto fail;
+			}
+			e = NULL;
+		} else {
+			e = stream_match (edits, count, buf);
+		}
+		if (NULL == e) {
+			r = stream_copy (db, buf, db->fp);
+		} else {
+			r = stream_entry (db, e, buf, db->fp, &edited);
+			changed = changed || edited;
+		}
+		if (0 != r) {
+			goto fail;
+		}
+	}
+	if (r < 0) {
+		errno = ENOMEM;
+		goto fail;
 	}
-#endif
-
-	db->fp = fopen_set_perms (buf, "w", &sb);
-	if (NULL == db->fp) {
+	if ((NULL != src) && (ferror (src) != 0)) {
 		goto fail;
 	}
-
-	if (write_all (db) != 0) {
-		errors++;
+	for (i = 0; i < count; i++) {
+		if (edits[i].found || (NULL == edits[i].add)) {
+			continue;
+		}
+		if (db->ops->put (edits[i].add, db->fp) != 0) {
+			goto fail;
+		}
+		commonio_feed_change (db, edits[i].name, NULL, edits[i].add);
+		changed = true;
 	}
-
+	free (buf);
+	buf = NULL;
 	if (fflush (db->fp) != 0) {
-		errors++;
-	}
-#ifdef HAVE_FSYNC
-	if (fsync (fileno (db->fp)) != 0) {
-		errors++;
-	}
-#else				/* !HAVE_FSYNC */
-	sync ();
-#endif				/* !HAVE_FSYNC */
-	if (fclose (db->fp) != 0) {
-		errors++;
-	}
-
-	db->fp = NULL;
-
-	if (errors != 0) {
-		unlink (buf);
 		goto fail;
 	}
 
-	if (lrename (buf, db->filename) != 0) {
-		goto fail;
+	if (!changed) {
+		/* <file>+ is discarded */
+		if (NULL != src) {
+			(void) fclose (src);
+		}
+		abort_db (db);
+		return 1;
 	}
-
-#ifdef WITH_SELINUX
-	if (reset_selinux_file_context () != 0) {
-		goto fail;
+	if (NULL != src) {
+		if (backup_db (db, src, &sb) != 0) {
+			goto fail;
+		}
+		(void) fclose (src);
+		src = NULL;
 	}
-#endif
+	if (   (sync_db (db) == 0)
+	    || (commit_db (db, false, &renamed) == 0)) {
+		saved_errno = errno;
+		abort_db (db);
+		errno = saved_errno;
+		return 0;
+	}
+	sync_parent_dirs (&db, &renamed, 1);
+	return 1;
 
-	nscd_need_reload = true;
-	goto success;
       fail:
-	errors++;
-      success:
-
-	free_linked_list (db);
-	return errors == 0;
+	saved_errno = errno;
+	free (buf);
+	if (NULL != src) {
+		(void) fclose (src);
+	}
+	abort_db (db);
+	errno = saved_errno;
+	return ret;
 }
 
-static /*@dependent@*/ /*@null@*/struct commonio_entry *next_entry_by_name (
-	struct commonio_db *db,
-	/*@null@*/struct commonio_entry *pos,
-	const char *name)
+/*
+ * edit_db - Apply the edits to the loaded database.
+ */
+static int edit_db (struct commonio_db *db, struct commonio_edit *edits,
+                    size_t count)
 {
-	struct commonio_entry *p;
-	void *ep;
+	const void *eptr;
+	const void *nent;
+	size_t i;
+	int saved_errno;
 
-	if (NULL == pos) {
-		return NULL;
+	if (commonio_open (db, O_CREAT | O_RDWR) == 0) {
+		return 0;
 	}
-
-	for (p = pos; NULL != p; p = p->next) {
-		ep = p->eptr;
-		if (   (NULL != ep)
-		    && (strcmp (db->ops->getname (ep), name) == 0)) {
-			break;
+	for (i = 0; i < count; i++) {
+		struct commonio_edit *e = &edits[i];
+
+		eptr = commonio_locate (db, e->name);
+		e->found = (NULL != eptr);
+		if (!e->found) {
+			if (   (NULL != e->add)
+			    && (commonio_update (db, e->add) == 0)) {
+				goto fail;
+			}
+		} else if (e->remove) {
+			if (commonio_remove (db, e->name) == 0) {
+				goto fail;
+			}
+		} else if (NULL != e->change) {
+			nent = e->change (eptr, e->arg);
+			if (NULL == nent) {
+				errno = ECANCELED;
+				goto fail;
+			}
+			if (commonio_update (db, nent) == 0) {
+				goto fail;
+			}
 		}
 	}
-	return p;
-}
+	return commonio_close (db);
 
-static /*@dependent@*/ /*@null@*/struct commonio_entry *find_entry_by_name (
-	struct commonio_db *db,
-	const char *name)
-{
-	return next_entry_by_name (db, db->head, name);
+      fail:
+	saved_errno = errno;
+	abort_db (db);
+	errno = saved_errno;
+	return 0;
 }
 
-
-int commonio_update (struct commonio_db *db, const void *eptr)
+/*
+ * commonio_stream - Apply a few edits to a locked database which is not
+ *                   open, and write it.
+ *
+ *	For each edit, the entry named e->name is removed if e->remove is
+ *	set, or replaced by the object returned by e->change, which stays
+ *	owned by the caller. If there is no such entry, e->add is added
+ *	if it is set. e->found is set if the entry existed.
+ *
+ *	If e->change returns NULL, the database is not changed, and 0 is
+ *	returned with errno set to ECANCELED. It may be called again with
+ *	a fresh object of the entry if the streaming is abandoned.
+ *
+ *	It returns 1 on success, 0 on failure (with errno set). The file is
+ *	only written if an entry was changed, removed or added.
+ */
+int commonio_stream (struct commonio_db *db, struct commonio_edit *edits,
+                     size_t count)
 {
-	struct commonio_entry *p;
-	void *nentry;
+	size_t i;
+	int ret;
 
-	if (!db->isopen || db->readonly) {
+	if (db->isopen || !db->locked) {
 		errno = EINVAL;
 		return 0;
 	}
-	nentry = db->ops->dup (eptr);
-	if (NULL == nentry) {
-		errno = ENOMEM;
-		return 0;
+	for (i = 0; i < count; i++) {
+		edits[i].found = false;
 	}
-	p = find_entry_by_name (db, db->ops->getname (eptr));
-	if (NULL != p) {
-		if (next_entry_by_name (db, p->next, db->ops->getname (eptr)) != NULL) {
-			fprintf (stderr, _("Multiple entries named '%s' in %s. Please fix this with pwck or grpck.\n"), db->ops->getname (eptr), db->filename);
-			db->ops->free (nentry);
-			return 0;
+	if (   getdef_bool ("STREAM_UPDATES")
+	    && !getdef_bool ("SHARDED_DATABASES")) {
+		ret = stream_db (db, edits, count);
+		if (-1 != ret) {
+			return ret;
+		}
+		for (i = 0; i < count; i++) {
+			edits[i].found = false;
 		}
-		db->ops->free (p->eptr);
-		p->eptr = nentry;
-		p->changed = true;
-		db->cursor = p;
-
-		db->changed = true;
-		return 1;
-	}
-	/* not found, new entry */
-	p = (struct commonio_entry *) malloc (sizeof *p);
-	if (NULL == p) {
-		db->ops->free (nentry);
-		errno = ENOMEM;
-		return 0;
 	}
-
-	p->eptr = nentry;
-	p->line = NULL;
-	p->changed = true;
-
-#if KEEP_NIS_AT_END
-	add_one_entry_nis (db, p);
-#else				/* !KEEP_NIS_AT_END */
-	add_one_entry (db, p);
-#endif				/* !KEEP_NIS_AT_END */
-
-	db->changed = true;
-	return 1;
+	return edit_db (db, edits, count);
 }
 
 #ifdef ENABLE_SUBIDS
@@ -1147,7 +5877,7 @@ int commonio_append (struct commonio_db *db, const void *eptr)
 		return 0;
 	}
 	/* new entry */
-	p = (struct commonio_entry *) malloc (sizeof *p);
+	p = new_entry (db, NULL);
 	if (NULL == p) {
 		db->ops->free (nentry);
 		errno = ENOMEM;
@@ -1155,8 +5885,9 @@ int commonio_append (struct commonio_db *db, const void *eptr)
 	}
 
 	p->eptr = nentry;
-	p->line = NULL;
 	p->changed = true;
+	p->parsed = true;
+	p->shard = shard_for (db, nentry);
 	add_one_entry (db, p);
 
 	db->changed = true;
@@ -1166,9 +5897,18 @@ int commonio_append (struct commonio_db *db, const void *eptr)
 
 void commonio_del_entry (struct commonio_db *db, const struct commonio_entry *p)
 {
+	index_remove (db, p);
+	id_index_remove (db, p);
+	gid_index_remove (db, p);
+	member_index_remove (db, p);
+
 	if (p == db->cursor) {
 		db->cursor = p->next;
 	}
+	if (p == db->nis_first) {
+		/* The next NIS entry is looked up on the next insertion */
+		db->nis_known = false;
+	}
 
 	if (NULL != p->prev) {
 		p->prev->next = p->next;
@@ -1183,6 +5923,26 @@ void commonio_del_entry (struct commonio_db *db, const struct commonio_entry *p)
 	}
 
 	db->changed = true;
+	db->rewrite = true;
+}
+
+/*
+ * commonio_has_duplicate - Check if another valid entry of the database
+ *                          has the name of ent.
+ *
+ *	The name index is used (and built on the first call), so that
+ *	checking all the entries of a database is linear.
+ */
+bool commonio_has_duplicate (struct commonio_db *db,
+                             const struct commonio_entry *ent)
+{
+	if (NULL == ent->eptr) {
+		return false;
+	}
+	if (NULL == db->name_index) {
+		(void) index_build (db);
+	}
+	return has_other_entry_by_name (db, ent, ent_name (db, ent->eptr));
 }
 
 /*
@@ -1198,19 +5958,17 @@ int commonio_remove (struct commonio_db *db, const char *name)
 	}
 	p = find_entry_by_name (db, name);
 	if (NULL == p) {
-		errno = ENOENT;
 		return 0;
 	}
-	if (next_entry_by_name (db, p->next, name) != NULL) {
+	if (has_other_entry_by_name (db, p, name)) {
 		fprintf (stderr, _("Multiple entries named '%s' in %s. Please fix this with pwck or grpck.\n"), name, db->filename);
 		return 0;
 	}
 
 	commonio_del_entry (db, p);
+	commonio_feed_remove (db, name, p->eptr);
 
-	if (NULL != p->line) {
-		free (p->line);
-	}
+	/* The entry and its line are released when the db is closed */
 
 	if (NULL != p->eptr) {
 		db->ops->free (p->eptr);
@@ -1226,7 +5984,8 @@ int commonio_remove (struct commonio_db *db, const char *name)
  *	If found, it returns the entry and set the cursor of the database to
  *	that entry.
  *
- *	Otherwise, it returns NULL.
+ *	Otherwise, it returns NULL with errno set to ENOENT, or to ENOMEM if
+ *	an entry could not be parsed.
  */
 /*@observer@*/ /*@null@*/const void *commonio_locate (struct commonio_db *db, const char *name)
 {
@@ -1238,13 +5997,293 @@ int commonio_remove (struct commonio_db *db, const char *name)
 	}
 	p = find_entry_by_name (db, name);
 	if (NULL == p) {
-		errno = ENOENT;
 		return NULL;
 	}
 	db->cursor = p;
 	return p->eptr;
 }
 
+/*
+ * first_entry_by_id - Scan the list for the first entry with the
+ *                     specified ID.
+ *
+ *	Otherwise, it returns NULL with errno set to ENOENT, or to ENOMEM if
+ *	an entry could not be parsed.
+ */
+static /*@dependent@*/ /*@null@*/struct commonio_entry *first_entry_by_id (
+	const struct commonio_db *db, id_t id)
+{
+	struct commonio_entry *p;
+
+	for (p = db->head; NULL != p; p = p->next) {
+		if (NULL != commonio_entry_eptr (db, p)) {
+			if (ent_id (db, p->eptr) == id) {
+				return p;
+			}
+		} else if (!p->parsed) {
+			return NULL;
+		}
+	}
+	errno = ENOENT;
+	return NULL;
+}
+
+/*
+ * commonio_locate_id - Find the first entry with the specified ID in
+ *                      the database.
+ *
+ *	The database must provide the getid operation.
+ *
+ *	If found, it returns the entry and set the cursor of the database to
+ *	that entry.
+ *
+ *	Otherwise, it returns NULL with errno set to ENOENT, or to ENOMEM if
+ *	an entry could not be parsed.
+ */
+/*@observer@*/ /*@null@*/const void *commonio_locate_id (struct commonio_db *db, id_t id)
+{
+	struct commonio_entry *p;
+	struct commonio_entry *found = NULL;
+
+	if (!db->isopen || (NULL == db->ops->getid)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((NULL == db->id_index) && !id_index_build (db)) {
+		found = first_entry_by_id (db, id);
+	} else {
+		for (p = db->id_index[id_hash (id) & (db->id_index_size - 1)];
+		     NULL != p;
+		     p = p->id_next) {
+			if (ent_id (db, p->eptr) != id) {
+				continue;
+			}
+			if (NULL == found) {
+				found = p;
+				continue;
+			}
+			/*
+			 * Several entries use this ID (non unique IDs).
+			 * The chains do not follow the list order after
+			 * updates, so scan the list to find the first one.
+			 */
+			found = first_entry_by_id (db, id);
+			break;
+		}
+		if (NULL == found) {
+			errno = ENOENT;
+		}
+	}
+
+	if (NULL == found) {
+		return NULL;
+	}
+	db->cursor = found;
+	return found->eptr;
+}
+
+/*
+ * commonio_locate_gid - Find the entries with the specified group ID in
+ *                       the database.
+ *
+ *	The database must provide the getgroupid operation.
+ *
+ *	*objs is set to a malloced array of the *count objects with this
+ *	group ID (NULL if there are none). The objects remain valid until
+ *	they are updated or removed.
+ *
+ *	It returns 0 on failure, 1 otherwise.
+ */
+int commonio_locate_gid (struct commonio_db *db, id_t gid,
+                         /*@out@*/const void ***objs,
+                         /*@out@*/size_t *count)
+{
+	const void **found = NULL;
+	size_t n = 0, size = 0;
+	struct commonio_entry *p;
+	bool indexed;
+
+	*objs = NULL;
+	*count = 0;
+	if (!db->isopen || (NULL == db->ops->getgroupid)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	indexed = (NULL != db->gid_index) || gid_index_build (db);
+	if (indexed) {
+		p = db->gid_index[id_hash (gid) & (db->gid_index_size - 1)];
+	} else {
+		p = db->head;
+	}
+	for (; NULL != p; p = indexed ? p->gid_next : p->next) {
+		if (NULL == commonio_entry_eptr (db, p)) {
+			if (!p->parsed) {
+				/* ENOMEM */
+				free (found);
+				return 0;
+			}
+			continue;
+		}
+		if (ent_gid (db, p->eptr) != gid) {
+			continue;
+		}
+
+		if (n == size) {
+			const void **tmp;
+
+			size = (0 == size) ? 8 : size * 2;
+			tmp = (const void **) realloc (found,
+			                               size * sizeof (*found));
+			if (NULL == tmp) {
+				free (found);
+				errno = ENOMEM;
+				return 0;
+			}
+			found = tmp;
+		}
+		found[n] = p->eptr;
+		n++;
+	}
+
+	*objs = found;
+	*count = n;
+	return 1;
+}
+
+/*
+ * may_list_member - Check if an entry may list name.
+ *
+ *	The entries which were not parsed yet do not have to be parsed if
+ *	their line does not contain name, unless their members are in a
+ *	member file.
+ */
+static bool may_list_member (const struct commonio_entry *p,
+                             const char *name)
+{
+	return    p->parsed
+	       || (NULL == p->line)
+	       || (strstr (p->line, name) != NULL)
+	       || member_file_line (p->line);
+}
+
+/*
+ * has_member - Check if an object lists name.
+ */
+static bool has_member (const struct commonio_db *db, const void *eptr,
+                        const char *name)
+{
+	unsigned int l;
+	char **names;
+
+	for (l = 0; NULL != (names = db->ops->getmembers (eptr, l)); l++) {
+		size_t i;
+
+		for (i = 0; NULL != names[i]; i++) {
+			if (strcmp (names[i], name) == 0) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/*
+ * commonio_locate_member - Find the entries listing the specified name
+ *                          in the database.
+ *
+ *	The database must provide the getmembers operation.
+ *
+ *	*objs is set to a malloced array of the *count objects listing
+ *	name (NULL if there are none). Each object is listed once. The
+ *	objects remain valid until they are updated or removed.
+ *
+ *	The first lookup scans the list, without parsing the lines which
+ *	do not contain name. The member index is built on the next one.
+ *
+ *	It returns 0 on failure, 1 otherwise.
+ */
+int commonio_locate_member (struct commonio_db *db, const char *name,
+                            /*@out@*/const void ***objs,
+                            /*@out@*/size_t *count)
+{
+	const void **found = NULL;
+	size_t n = 0, size = 0;
+	struct commonio_entry *p;
+	const struct member_node *node;
+
+	*objs = NULL;
+	*count = 0;
+	if (!db->isopen || (NULL == db->ops->getmembers)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	if (   (NULL == db->member_index)
+	    && (!db->member_lookup || !member_index_build (db))) {
+		db->member_lookup = true;
+		node = NULL;
+		p = db->head;
+	} else {
+		node = *member_bucket (db, name);
+		p = NULL;
+	}
+	while (true) {
+		const void *eptr;
+
+		/* Next object listing name */
+		if (NULL != db->member_index) {
+			while (   (NULL != node)
+			       && (strcmp (node->name, name) != 0)) {
+				node = node->next;
+			}
+			if (NULL == node) {
+				break;
+			}
+			eptr = node->entry->eptr;
+			node = node->next;
+		} else {
+			while (   (NULL != p)
+			       && (   !may_list_member (p, name)
+			           || (NULL == commonio_entry_eptr (db, p))
+			           || !has_member (db, p->eptr, name))) {
+				if (!p->parsed && may_list_member (p, name)) {
+					/* ENOMEM */
+					free (found);
+					return 0;
+				}
+				p = p->next;
+			}
+			if (NULL == p) {
+				break;
+			}
+			eptr = p->eptr;
+			p = p->next;
+		}
+
+		if (n == size) {
+			const void **tmp;
+
+			size = (0 == size) ? 8 : size * 2;
+			tmp = (const void **) realloc (found,
+			                               size * sizeof (*found));
+			if (NULL == tmp) {
+				free (found);
+				errno = ENOMEM;
+				return 0;
+			}
+			found = tmp;
+		}
+		found[n] = eptr;
+		n++;
+	}
+
+	*objs = found;
+	*count = n;
+	return 1;
+}
+
 /*
  * commonio_rewind - Restore the database cursor to the first entry.
  *
@@ -1264,6 +6303,8 @@ int commonio_rewind (struct commonio_db *db)
  * commonio_next - Return the next entry of the specified database
  *
  * It returns the next entry, or NULL if no other entries could be found.
+ * If an entry could not be parsed, it returns NULL with errno set to
+ * ENOMEM, and the next call tries again.
  */
 /*@observer@*/ /*@null@*/const void *commonio_next (struct commonio_db *db)
 {
@@ -1280,10 +6321,15 @@ int commonio_rewind (struct commonio_db *db)
 	}
 
 	while (NULL != db->cursor) {
-		eptr = db->cursor->eptr;
+		eptr = commonio_entry_eptr (db, db->cursor);
 		if (NULL != eptr) {
 			return eptr;
 		}
+		if (!db->cursor->parsed) {
+			/* ENOMEM, keep the cursor */
+			db->cursor = db->cursor->prev;
+			return NULL;
+		}
 
 		db->cursor = db->cursor->next;
 	}
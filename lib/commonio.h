@@ -38,17 +38,62 @@
 #include <selinux/selinux.h>
 #endif
 
+#include <stddef.h>
 #include "defines.h" /* bool */
+#include "arena.h"
+
+struct member_node;
+struct commonio_shards;
+
+/*
+ * Maximum number of shard files of a database (see SHARDED_DATABASES).
+ */
+#define COMMONIO_SHARDS_MAX 255
+
+/*
+ * Growable output buffer, used by the format operation.
+ * data holds len bytes, and has room for size bytes.
+ */
+struct commonio_buf {
+	/*@null@*/ /*@only@*/char *data;
+	size_t len;
+	size_t size;
+};
+
+/*
+ * Last IDs allocated from the ranges of a database (see idseq.c).
+ * Index 0 is for the system range, 1 for the regular range.
+ */
+struct commonio_seq {
+	id_t last[2];
+	bool known[2];
+	bool loaded;		/* <file>.seq was read */
+	bool changed;		/* to be written with the next commit */
+};
 
 /*
  * Linked list entry.
+ *
+ * The entries read from the database file are parsed on demand: eptr is
+ * only valid when parsed is set. Use commonio_entry_eptr() to get it.
+ * line may point into the mapping of the database file (see
+ * commonio_db.map).
  */
 struct commonio_entry {
 	/*@null@*/char *line;
 	/*@null@*/void *eptr;		/* struct passwd, struct spwd, ... */
 	/*@dependent@*/ /*@null@*/struct commonio_entry *prev;
 	/*@owned@*/ /*@null@*/struct commonio_entry *next;
+	/*@dependent@*/ /*@null@*/struct commonio_entry *name_next;	/* name index chain */
+	/*@dependent@*/ /*@null@*/struct commonio_entry *id_next;	/* ID index chain */
+	/*@dependent@*/ /*@null@*/struct commonio_entry *gid_next;	/* group ID index chain */
 	bool changed:1;
+	bool parsed:1;
+	/*
+	 * File of the entry: 0 for the database file, or the number of
+	 * its shard file (see commonio_db.shards).
+	 */
+	unsigned int shard:8;
 };
 
 /*
@@ -87,6 +132,8 @@ struct commonio_ops {
 	/*
 	 * fgets and fputs (can be replaced by versions that
 	 * understand line continuation conventions).
+	 * They must stop after the first newline, like fgets(3), so that
+	 * a newline can only be the last character of the string.
 	 */
 	/*@null@*/char *(*fgets) (/*@returned@*/ /*@out@*/char *s, int n, FILE *stream);
 	int (*fputs) (const char *, FILE *);
@@ -99,8 +146,78 @@ struct commonio_ops {
 	 */
 	/*@null@*/int (*open_hook) (void);
 	/*@null@*/int (*close_hook) (void);
+
+	/*
+	 * Return the numerical ID of the object (for example, pw_uid
+	 * for struct passwd).
+	 * If NULL, the database cannot be searched by ID.
+	 */
+	/*@null@*/id_t (*getid) (const void *);
+
+	/*
+	 * Release the index kept by the database type in type_index.
+	 * If NULL, the database type keeps no such index.
+	 */
+	/*@null@*/void (*free_index) (/*@only@*/void *);
+
+	/*
+	 * Return the list of names with the given number (starting at 0)
+	 * of the object (for example, gr_mem for struct group), or NULL
+	 * after the last list.
+	 * If NULL, the database cannot be searched by member.
+	 */
+	/*@null@*/char **(*getmembers) (const void *, unsigned int);
+
+	/*
+	 * Parse a string into a new object, which is released with the
+	 * free operation. Unlike parse, it does not use a static area:
+	 * the lines can be parsed concurrently. If the object cannot be
+	 * allocated, NULL is returned with errno set to ENOMEM.
+	 * If NULL, the parse and dup operations are used.
+	 */
+	/*@null@*/ /*@only@*/void *(*parse_alloc) (const char *);
+
+	/*
+	 * Append the line of the object, with its newline, to the buffer
+	 * (see commonio_buf_reserve()). Return 0 on success, -1 if the
+	 * object cannot be written or on failure.
+	 * If NULL, the put operation is used.
+	 */
+	/*@null@*/int (*format) (const void *, struct commonio_buf *);
+
+	/*
+	 * Return the group ID of the object (for example, pw_gid for
+	 * struct passwd).
+	 * If NULL, the database cannot be searched by group ID.
+	 */
+	/*@null@*/id_t (*getgroupid) (const void *);
+
+	/*
+	 * The layout of the object (see COMMONIO_NAME_FIELD() and
+	 * COMMONIO_ID_FIELD()): the offset of its name, a char *, and
+	 * of its ID and group ID, uid_t or gid_t fields (0 if none).
+	 * With it, the lookups, the indexes and the sorts read the fields
+	 * directly instead of calling getname, getid and getgroupid.
+	 * If has_fields is false, only the operations are used.
+	 */
+	bool has_fields;
+	size_t name_offset;
+	size_t id_offset;
+	size_t groupid_offset;
+
+	/*
+	 * Return the bytes of memory held by the object: the structure
+	 * and its strings, but not its lists of names (see getmembers),
+	 * which are counted apart. The strings shared by the entries
+	 * (see strintern.h) are counted for each entry.
+	 * If NULL, the memory of the objects is not reported.
+	 */
+	/*@null@*/size_t (*size) (const void *);
 };
 
+#define COMMONIO_NAME_FIELD(type, name)	true, offsetof (type, name)
+#define COMMONIO_ID_FIELD(type, id)	offsetof (type, id)
+
 /*
  * Database structure.
  */
@@ -143,28 +260,282 @@ struct commonio_db {
 	bool isopen:1;
 	bool locked:1;
 	bool readonly:1;
+	/*
+	 * Set when the database was opened for writing without the lock
+	 * (see commonio_open_optimistic), until it is locked.
+	 */
+	bool optimistic:1;
+	/*
+	 * Set when the process has a place in the lock queue of the
+	 * database (LOCK_QUEUE), open as lock_queue.
+	 */
+	bool queued:1;
+	/*
+	 * Set when entries were removed or reordered: the file cannot
+	 * just be appended to.
+	 */
+	bool rewrite:1;
+	/*
+	 * Set when the entries were sorted: all the shard files are
+	 * written.
+	 */
+	bool reordered:1;
+
+	/*
+	 * Hash index of the entries by name.
+	 * It is built on the first lookup and kept up to date afterwards.
+	 */
+	/*@owned@*/ /*@null@*/struct commonio_entry **name_index;
+	size_t name_index_size;
+	size_t name_index_count;
+
+	/*
+	 * Hash index of the entries by ID (see the getid operation).
+	 * It is built on the first lookup by ID and kept up to date
+	 * afterwards.
+	 */
+	/*@owned@*/ /*@null@*/struct commonio_entry **id_index;
+	size_t id_index_size;
+	size_t id_index_count;
+
+	/*
+	 * Hash index of the entries by group ID (see the getgroupid
+	 * operation). It is built on the first lookup by group ID and
+	 * kept up to date afterwards.
+	 */
+	/*@owned@*/ /*@null@*/struct commonio_entry **gid_index;
+	size_t gid_index_size;
+	size_t gid_index_count;
+
+	/*
+	 * Private mapping of the database file, if it was loaded with
+	 * mmap. The lines of the unchanged entries point into it.
+	 */
+	/*@null@*/char *map;
+	size_t map_size;
+
+	/*
+	 * Memory of the lines of the entries (when they are not in the
+	 * mapping) and of the indexes until the database is closed.
+	 */
+	struct arena arena;
+
+	/*
+	 * Memory of the entries. They are allocated apart from the
+	 * lines, so that they form an array in the order they were
+	 * read, and the walks of the list are sequential in memory.
+	 */
+	struct arena entry_arena;
+
+	/*
+	 * Size of the arenas when the database was read. keep_db reads
+	 * the database again when they grew too much since then.
+	 */
+	size_t arena_open;
+
+	/*
+	 * Set while a close is in progress, when the changes were written
+	 * to <file>+, appended to the file, or written to <file>.journal,
+	 * but not committed yet.
+	 */
+	bool pending_rename:1;
+	bool pending_append:1;
+	bool pending_journal:1;
+
+	/*
+	 * Index private to the database type (see the free_index
+	 * operation). It is released with the entries.
+	 */
+	/*@owned@*/ /*@null@*/void *type_index;
+
+	/*
+	 * Hash index of the entries by member (see the getmembers
+	 * operation). It is built on the first lookup by member and kept
+	 * up to date afterwards. Its nodes are allocated in the arena.
+	 */
+	/*@owned@*/ /*@null@*/struct member_node **member_index;
+	size_t member_index_size;
+	size_t member_index_count;
+	/*@dependent@*/ /*@null@*/struct member_node *member_free;
+	bool member_lookup:1;	/* set after the first lookup by member */
+
+	/*
+	 * First NIS (+ or -) entry, before which the new entries are
+	 * inserted, or NULL if there are none. It is only valid when
+	 * nis_known is set: it is looked up on the first insertion, and
+	 * kept up to date afterwards.
+	 */
+	/*@dependent@*/ /*@null@*/struct commonio_entry *nis_first;
+	bool nis_known:1;
+
+	/*
+	 * Number of times the changes were committed to the file by this
+	 * process. The caches of the file compare it to know if they are
+	 * still valid.
+	 */
+	unsigned long commits;
+
+	/*
+	 * Keys of the entries removed since the last commit, and of the
+	 * entries changed by commonio_stream, for the change feed (see
+	 * changefeed.c).
+	 */
+	struct commonio_buf feed_removed;
+
+	/*
+	 * When the lock was obtained, for the time it is held (see
+	 * commonio_unlock).
+	 */
+	struct timespec locked_at;
+	int lock_queue;
+
+	/*
+	 * Last allocated IDs (ID_SEQUENCE).
+	 */
+	struct commonio_seq seq;
+
+	/*
+	 * Shard files of the database, in <file>.d/, or NULL if it has
+	 * none (see SHARDED_DATABASES).
+	 */
+	/*@owned@*/ /*@null@*/struct commonio_shards *shards;
+
+	/*
+	 * Generation of the file and of its <file>.d directory when they
+	 * were read without the lock (see commonio_open_optimistic).
+	 * st_ino is 0 if they did not exist.
+	 */
+	struct stat generation;
+	struct stat shards_generation;
+};
+
+/*
+ * Maximum number of databases in a transaction.
+ */
+#define COMMONIO_TXN_MAX 8
+
+/*
+ * A set of databases which are closed together: the changes are only
+ * committed if all the databases could be written.
+ */
+struct commonio_txn {
+	/*@dependent@*/struct commonio_db *dbs[COMMONIO_TXN_MAX];
+	size_t count;
+
+	/*
+	 * The database which could not be written, after a failed commit.
+	 */
+	/*@dependent@*/ /*@null@*/struct commonio_db *failed;
 };
 
+/*
+ * An edit of commonio_stream.
+ */
+struct commonio_edit {
+	/*@observer@*/const char *name;
+
+	/*
+	 * Return the new object of the entry, which stays owned by the
+	 * caller, or NULL to cancel the edits.
+	 * If NULL, the entry is kept as is.
+	 */
+	/*@null@*/const void *(*change) (const void *ent, void *arg);
+	void *arg;
+
+	/*@null@*/const void *add;	/* added if there is no such entry */
+	bool remove;		/* remove the entry */
+	bool found;		/* set if the entry existed */
+};
+
+extern void commonio_set_offline (bool enable);
+extern /*@null@*/char *commonio_buf_reserve (struct commonio_buf *buf,
+                                             size_t n);
 extern int commonio_setname (struct commonio_db *, const char *);
 extern bool commonio_present (const struct commonio_db *db);
 extern int commonio_lock (struct commonio_db *);
+extern int commonio_lock_set (struct commonio_db *const *dbs, size_t count,
+                              /*@out@*/size_t *failed);
 extern int commonio_lock_nowait (struct commonio_db *, bool log);
 extern int commonio_open (struct commonio_db *, int);
+extern int commonio_open_set (struct commonio_db *const *dbs, size_t count,
+                              int mode, /*@out@*/size_t *failed);
+extern int commonio_open_optimistic (struct commonio_db *, int);
+extern int commonio_lock_optimistic (struct commonio_db *const *dbs,
+                                     size_t count,
+                                     /*@out@*/size_t *failed);
 extern /*@observer@*/ /*@null@*/const void *commonio_locate (struct commonio_db *, const char *);
+extern /*@observer@*/ /*@null@*/const void *commonio_locate_id (struct commonio_db *, id_t);
+extern int commonio_locate_gid (struct commonio_db *, id_t gid,
+                                /*@out@*/const void ***objs,
+                                /*@out@*/size_t *count);
+extern int commonio_locate_member (struct commonio_db *, const char *name,
+                                   /*@out@*/const void ***objs,
+                                   /*@out@*/size_t *count);
 extern int commonio_update (struct commonio_db *, const void *);
+extern int commonio_update_owned (struct commonio_db *,
+                                  /*@only@*/void *eptr);
+extern int commonio_modify (struct commonio_db *, const char *name,
+                            void (*modify) (void *ent, void *arg),
+                            void *arg);
 #ifdef ENABLE_SUBIDS
 extern int commonio_append (struct commonio_db *, const void *);
 #endif				/* ENABLE_SUBIDS */
 extern int commonio_remove (struct commonio_db *, const char *);
+extern int commonio_stream (struct commonio_db *,
+                            struct commonio_edit *edits, size_t count);
 extern int commonio_rewind (struct commonio_db *);
 extern /*@observer@*/ /*@null@*/const void *commonio_next (struct commonio_db *);
+extern int commonio_scan (struct commonio_db *,
+                          int (*scan) (const void *ent, void *arg),
+                          void *arg);
+extern int commonio_scan_lines (struct commonio_db *,
+                                int (*scan) (const char *line,
+                                             const void *ent, void *arg),
+                                void *arg);
 extern int commonio_close (struct commonio_db *);
+extern void commonio_txn_init (struct commonio_txn *);
+extern int commonio_txn_add (struct commonio_txn *, struct commonio_db *);
+extern int commonio_txn_commit (struct commonio_txn *);
+extern int commonio_txn_checkpoint (struct commonio_txn *);
 extern int commonio_unlock (struct commonio_db *);
+extern void commonio_close_queues (void);
 extern void commonio_del_entry (struct commonio_db *,
                                 const struct commonio_entry *);
+extern bool commonio_has_duplicate (struct commonio_db *,
+                                   const struct commonio_entry *);
+extern /*@dependent@*/ /*@null@*/void *commonio_alloc (struct commonio_db *,
+                                                       size_t size);
+extern /*@dependent@*/ /*@null@*/void *commonio_entry_eptr (
+	const struct commonio_db *,
+	struct commonio_entry *);
+extern int commonio_parse_entries (const struct commonio_db *);
 extern int commonio_sort_wrt (struct commonio_db *shadow,
                               const struct commonio_db *passwd);
+extern int commonio_sort_id (struct commonio_db *db);
 extern int commonio_sort (struct commonio_db *db,
                           int (*cmp) (const void *, const void *));
 
+/* changefeed.c */
+extern void commonio_feed_remove (struct commonio_db *db, const char *name,
+                                  /*@null@*/const void *eptr);
+extern void commonio_feed_change (struct commonio_db *db, const char *name,
+                                  /*@null@*/const void *old,
+                                  const void *eptr);
+extern void commonio_feed_commit (struct commonio_db *db);
+
+/* idseq.c */
+extern bool commonio_seq_get (struct commonio_db *db, bool sys,
+                              /*@out@*/id_t *id);
+extern void commonio_seq_set (struct commonio_db *db, bool sys, id_t id);
+extern int commonio_seq_commit (struct commonio_db *db);
+
+/* snapshot.c */
+extern int commonio_snapshot_update (const struct commonio_db *db);
+extern int commonio_snapshot_locate (const struct commonio_db *db,
+                                     const char *name,
+                                     /*@out@*/void **ent);
+extern int commonio_snapshot_locate_id (const struct commonio_db *db,
+                                        id_t id,
+                                        /*@out@*/void **ent);
+
 #endif
@@ -47,7 +47,13 @@ extern char * textdomain (const char * domainname);
 
 #ifdef ENABLE_NLS
 # include <libintl.h>
-# define _(Text) gettext (Text)
+/* The locale may be loaded by the first message, see nls.c */
+extern char *nls_gettext (const char *msgid);
+extern char *nls_ngettext (const char *msgid1, const char *msgid2,
+                           unsigned long n);
+# define _(Text) nls_gettext (Text)
+# undef ngettext
+# define ngettext(Msgid1, Msgid2, N) nls_ngettext (Msgid1, Msgid2, N)
 #else
 # undef bindtextdomain
 # define bindtextdomain(Domain, Directory)	(NULL)
@@ -179,7 +185,8 @@ char *strchr (), *strrchr (), *strtok ();
 	do {								\
 		char *old_locale = setlocale (LC_ALL, NULL);		\
 		char *saved_locale = NULL;				\
-		if (NULL != old_locale) {				\
+		if (   (NULL != old_locale)				\
+		    && (strcmp (old_locale, "C") != 0)) {		\
 			saved_locale = strdup (old_locale);		\
 		}							\
 		if (NULL != saved_locale) {				\
@@ -195,9 +202,14 @@ char *strchr (), *strrchr (), *strtok ();
 #define SYSLOG(x) syslog x
 #endif				/* !ENABLE_NLS */
 
+/* An event about an entry of a bulk operation, see logbatch.c:
+   SYSLOG_ENTRY((LOG_INFO, "delete users", name, "delete user '%s'", name)); */
+#define SYSLOG_ENTRY(x) log_batch x
+
 #else				/* !USE_SYSLOG */
 
 #define SYSLOG(x)		/* empty */
+#define SYSLOG_ENTRY(x)		/* empty */
 #define openlog(a,b,c)		/* empty */
 #define closelog()		/* empty */
 
@@ -34,12 +34,52 @@
 
 #ident "$Id$"
 
+#include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#if defined (HAVE_CRYPT_R) && defined (HAVE_CRYPT_H)
+#include <crypt.h>
+#endif
 
 #include "prototypes.h"
 #include "defines.h"
 
+/*
+ * method_supported - check that libcrypt supports the method of salt
+ *
+ *	Some crypt() do not return NULL if the algorithm is not
+ *	supported, and return a DES encrypted password.
+ */
+static bool method_supported (/*@null@*/const char *salt, const char *cp)
+{
+	/*@observer@*/const char *method;
+	static char nummethod[4] = "$x$";
+
+	if ((NULL == salt) || (salt[0] != '$') || (strlen (cp) > 13)) {
+		return true;
+	}
+
+	switch (salt[1])
+	{
+		case '1':
+			method = "MD5";
+			break;
+		case '5':
+			method = "SHA256";
+			break;
+		case '6':
+			method = "SHA512";
+			break;
+		default:
+			nummethod[1] = salt[1];
+			method = &nummethod[0];
+	}
+	(void) fprintf (stderr,
+	                _("crypt method not supported by libcrypt? (%s)\n"),
+	                method);
+	return false;
+}
+
 /*@exposed@*//*@null@*/char *pw_encrypt (const char *clear, const char *salt)
 {
 	static char cipher[128];
@@ -55,32 +95,7 @@
 		return NULL;
 	}
 
-	/* Some crypt() do not return NULL if the algorithm is not
-	 * supported, and return a DES encrypted password. */
-	if ((NULL != salt) && (salt[0] == '$') && (strlen (cp) <= 13))
-	{
-		/*@observer@*/const char *method;
-		switch (salt[1])
-		{
-			case '1':
-				method = "MD5";
-				break;
-			case '5':
-				method = "SHA256";
-				break;
-			case '6':
-				method = "SHA512";
-				break;
-			default:
-			{
-				static char nummethod[4] = "$x$";
-				nummethod[1] = salt[1];
-				method = &nummethod[0];
-			}
-		}
-		(void) fprintf (stderr,
-		                _("crypt method not supported by libcrypt? (%s)\n"),
-		                method);
+	if (!method_supported (salt, cp)) {
 		exit (EXIT_FAILURE);
 	}
 
@@ -93,3 +108,31 @@
 	return cipher;
 }
 
+#if defined (HAVE_CRYPT_R) && defined (HAVE_CRYPT_H)
+/*
+ * pw_encrypt_r - encrypt clear with crypt_r()
+ *
+ *	Each thread passes its own data, which must be zeroed before its
+ *	first use. The result is stored in data.
+ *
+ *	Unlike pw_encrypt(), it does not exit if the method of salt is not
+ *	supported. It returns NULL, with errno set to EINVAL.
+ */
+/*@null@*/char *pw_encrypt_r (const char *clear, const char *salt,
+                              struct crypt_data *data)
+{
+	char *cp;
+
+	cp = crypt_r (clear, salt, data);
+	if (NULL == cp) {
+		return NULL;
+	}
+
+	if (!method_supported (salt, cp)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return cp;
+}
+#endif				/* HAVE_CRYPT_R && HAVE_CRYPT_H */
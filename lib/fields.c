@@ -58,26 +58,94 @@ int valid_field (const char *field, const char *illegal)
 		return -1;
 	}
 
-	/* For each character of field, search if it appears in the list
-	 * of illegal characters. */
+	/* Search all the illegal characters at once */
+	if ('\0' != field[strcspn (field, illegal)]) {
+		return -1;
+	}
+
+	/* Search if there are some non-printable characters */
 	for (cp = field; '\0' != *cp; cp++) {
-		if (strchr (illegal, *cp) != NULL) {
-			err = -1;
+		if (!isprint (*cp)) {
+			err = 1;
 			break;
 		}
 	}
 
-	if (0 == err) {
-		/* Search if there are some non-printable characters */
-		for (cp = field; '\0' != *cp; cp++) {
-			if (!isprint (*cp)) {
-				err = 1;
-				break;
-			}
+	return err;
+}
+
+/*
+ * The record parsers split their lines with the functions below. The
+ * separators are searched with strchr(), which the libc implements
+ * with vector instructions, instead of byte loops.
+ */
+
+/*
+ * count_char - count the occurrences of c in s
+ */
+size_t count_char (const char *s, char c)
+{
+	size_t n = 0;
+
+	for (s = strchr (s, c); NULL != s; s = strchr (s + 1, c)) {
+		n++;
+	}
+	return n;
+}
+
+/*
+ * split_fields - split s in fields separated by sep, in place
+ *
+ *	The first max fields are stored in fields, and their separators are
+ *	replaced by NUL characters. The remainder of s is left unchanged.
+ *
+ *	It returns the number of fields of s, or max + 1 if s has more than
+ *	max fields.
+ */
+size_t split_fields (char *s, char sep, char **fields, size_t max)
+{
+	size_t n = 0;
+
+	for (;;) {
+		if (n == max) {
+			return max + 1;
 		}
+		fields[n] = s;
+		n++;
+		s = strchr (s, sep);
+		if (NULL == s) {
+			return n;
+		}
+		*s = '\0';
+		s++;
 	}
+}
 
-	return err;
+/*
+ * split_list - split a comma-separated list of names, in place
+ *
+ *	list must have room for count_char (s, ',') + 2 pointers. It is
+ *	terminated by NULL. An empty list, or an empty last element, is
+ *	ignored.
+ *
+ *	It returns the number of elements.
+ */
+size_t split_list (char *s, char **list)
+{
+	size_t n = 0;
+
+	while ('\0' != *s) {
+		list[n] = s;
+		n++;
+		s = strchr (s, ',');
+		if (NULL == s) {
+			break;
+		}
+		*s = '\0';
+		s++;
+	}
+	list[n] = NULL;
+	return n;
 }
 
 /*
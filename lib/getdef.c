@@ -40,7 +40,13 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "getdef.h"
+#include "timing.h"
 /*
  * A configuration item definition.
  */
@@ -77,40 +83,75 @@ struct itemdef {
 
 #define NUMDEFS	(sizeof(def_table)/sizeof(def_table[0]))
 static struct itemdef def_table[] = {
+	{"APPEND_NEW_ENTRIES", NULL},
+	{"BACKUP_HARD_LINK", NULL},
+	{"CHANGE_FEED", NULL},
+	{"CHECK_THREADS", NULL},
 	{"CHFN_RESTRICT", NULL},
+	{"CHOWN_THREADS", NULL},
+	{"COMMIT_DURABILITY", NULL},
 	{"CONSOLE_GROUPS", NULL},
 	{"CONSOLE", NULL},
+	{"COPY_THREADS", NULL},
 	{"CREATE_HOME", NULL},
+	{"CRYPT_THREADS", NULL},
 	{"DEFAULT_HOME", NULL},
 	{"ENCRYPT_METHOD", NULL},
 	{"ENV_PATH", NULL},
 	{"ENV_SUPATH", NULL},
 	{"ERASECHAR", NULL},
+	{"EXTERNAL_MEMBERS_MIN", NULL},
 	{"FAIL_DELAY", NULL},
 	{"FAKE_SHELL", NULL},
 	{"GID_MAX", NULL},
 	{"GID_MIN", NULL},
+	{"HOME_SKEL_SNAPSHOT", NULL},
 	{"HUSHLOGIN_FILE", NULL},
+	{"ID_ALLOC_ENUMERATE", NULL},
+	{"ID_SEQUENCE", NULL},
+	{"INDEX_SNAPSHOT", NULL},
+	{"JOURNAL_UPDATES", NULL},
 	{"KILLCHAR", NULL},
 	{"LASTLOG_UID_MAX", NULL},
+	{"LOCK_QUEUE", NULL},
+	{"LOCK_TIMEOUT", NULL},
+	{"LOCK_WAIT_LOG", NULL},
 	{"LOGIN_RETRIES", NULL},
 	{"LOGIN_TIMEOUT", NULL},
+	{"LOG_KEYED_UID_MIN", NULL},
 	{"LOG_OK_LOGINS", NULL},
+	{"LOG_TIMINGS", NULL},
 	{"LOG_UNKFAIL_ENAB", NULL},
 	{"MAIL_DIR", NULL},
 	{"MAIL_FILE", NULL},
 	{"MAX_MEMBERS_PER_GROUP", NULL},
 	{"MD5_CRYPT_ENAB", NULL},
+	{"METRICS_DIR", NULL},
+	{"MOVE_HOME_RESUME", NULL},
+	{"OPEN_THREADS", NULL},
+	{"OPTIMISTIC_LOCKING", NULL},
+	{"PASS_BLOCKLIST_FILE", NULL},
 	{"PASS_MAX_DAYS", NULL},
 	{"PASS_MIN_DAYS", NULL},
 	{"PASS_WARN_AGE", NULL},
 #ifdef USE_SHA_CRYPT
 	{"SHA_CRYPT_MAX_ROUNDS", NULL},
 	{"SHA_CRYPT_MIN_ROUNDS", NULL},
+	{"SHA_CRYPT_TARGET_MS", NULL},
 #endif
+	{"REMOTE_GID_RANGES", NULL},
+	{"REMOTE_UID_RANGES", NULL},
+	{"REMOVE_THREADS", NULL},
+	{"RESOLVE_THREADS", NULL},
+	{"SHARDED_DATABASES", NULL},
+	{"STREAM_UPDATES", NULL},
 	{"SUB_GID_COUNT", NULL},
 	{"SUB_GID_MAX", NULL},
 	{"SUB_GID_MIN", NULL},
+	{"SUB_ID_CACHE_DIR", NULL},
+	{"SUB_ID_CACHE_TTL", NULL},
+	{"SUB_ID_COMPACT", NULL},
+	{"SUB_ID_PROVIDER", NULL},
 	{"SUB_UID_COUNT", NULL},
 	{"SUB_UID_MAX", NULL},
 	{"SUB_UID_MIN", NULL},
@@ -126,12 +167,15 @@ static struct itemdef def_table[] = {
 	{"UID_MAX", NULL},
 	{"UID_MIN", NULL},
 	{"UMASK", NULL},
+	{"USERDEL_ASYNC_REMOVE", NULL},
 	{"USERDEL_CMD", NULL},
+	{"USERDEL_CMD_BATCH", NULL},
 	{"USERGROUPS_ENAB", NULL},
 #ifndef USE_PAM
 	PAMDEFS
 #endif
 #ifdef USE_SYSLOG
+	{"SYSLOG_BATCH", NULL},
 	{"SYSLOG_SG_ENAB", NULL},
 	{"SYSLOG_SU_ENAB", NULL},
 #endif
@@ -159,9 +203,47 @@ static struct itemdef knowndef_table[] = {
 static const char* def_fname = LOGINDEFS;	/* login config defs file       */
 static bool def_loaded = false;		/* are defs already loaded?     */
 
+/*
+ * Items of def_table, sorted by name for def_find.
+ * It is built on the first lookup.
+ */
+static struct itemdef *def_index[NUMDEFS];
+static size_t def_index_count = 0;
+
+/*
+ * Pre-parsed image of the login.defs file: <login.defs>.cache
+ *
+ * The image holds the values of the items, as "name\0value\0" pairs
+ * after the header. It is only used if the cache file exists, is owned
+ * by root and is not writable by the group or others, and if
+ * login.defs is still the file it was built from (same device, inode,
+ * size, modification and change times). Otherwise, login.defs is read,
+ * and the image is rebuilt if the real and effective users are root.
+ *
+ * Like the database snapshots, it uses the native byte order and is
+ * rebuilt when its magic does not match.
+ */
+#define DEFS_CACHE_MAGIC "shdefs\0\1"
+
+struct defs_cache_header {
+	char magic[8];
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	uint64_t length;	/* size of the pairs */
+};
+
 /* local function prototypes */
 static /*@observer@*/ /*@null@*/struct itemdef *def_find (const char *);
 static void def_load (void);
+static void def_read (void);
+static void stat_to_header (const struct stat *sb,
+                            struct defs_cache_header *h);
+static bool def_cache_load (const char *cache, const struct stat *sb);
+static void def_cache_update (const char *cache, const struct stat *sb);
 
 
 /*
@@ -392,18 +474,52 @@ int putdef_str (const char *name, const char *value)
  * specified configuration option.
  */
 
+static int itemdef_cmp (const void *p1, const void *p2)
+{
+	const struct itemdef *d1 = *(struct itemdef * const *) p1;
+	const struct itemdef *d2 = *(struct itemdef * const *) p2;
+
+	return strcmp (d1->name, d2->name);
+}
+
+/*
+ * def_index_build - Sort the items of def_table.
+ */
+static void def_index_build (void)
+{
+	struct itemdef *ptr;
+
+	for (ptr = def_table; NULL != ptr->name; ptr++) {
+		def_index[def_index_count++] = ptr;
+	}
+	qsort (def_index, def_index_count, sizeof (def_index[0]),
+	       itemdef_cmp);
+}
+
 static /*@observer@*/ /*@null@*/struct itemdef *def_find (const char *name)
 {
 	struct itemdef *ptr;
+	size_t lo = 0, hi;
 
+	if (0 == def_index_count) {
+		def_index_build ();
+	}
 
 	/*
-	 * Search into the table.
+	 * Search into the sorted items.
 	 */
 
-	for (ptr = def_table; NULL != ptr->name; ptr++) {
-		if (strcmp (ptr->name, name) == 0) {
-			return ptr;
+	hi = def_index_count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp (def_index[mid]->name, name);
+
+		if (0 == cmp) {
+			return def_index[mid];
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
 	}
 
@@ -436,17 +552,188 @@ void setdef_config_file (const char* file)
 	def_fname = file;
 }
 
+static void stat_to_header (const struct stat *sb,
+                            struct defs_cache_header *h)
+{
+	memzero (h, sizeof *h);
+	memcpy (h->magic, DEFS_CACHE_MAGIC, sizeof h->magic);
+	h->dev = (uint64_t) sb->st_dev;
+	h->ino = (uint64_t) sb->st_ino;
+	h->size = (uint64_t) sb->st_size;
+	h->mtime_sec = (int64_t) sb->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	h->mtime_nsec = (int64_t) sb->st_mtim.tv_nsec;
+#else				/* !HAVE_STRUCT_STAT_ST_MTIM */
+	h->mtime_nsec = 0;
+#endif				/* !HAVE_STRUCT_STAT_ST_MTIM */
+	h->ctime_sec = (int64_t) sb->st_ctime;
+}
+
+/*
+ * def_cache_load - Load the values from the image of login.defs.
+ *
+ *	sb is the status of login.defs.
+ *
+ *	It returns false if there is no valid and up to date image.
+ */
+static bool def_cache_load (const char *cache, const struct stat *sb)
+{
+	struct defs_cache_header h;
+	const struct defs_cache_header *hp;
+	struct stat csb;
+	const char *map = MAP_FAILED;
+	const char *cp, *end;
+	bool ret = false;
+	int pass;
+	int fd;
+
+	fd = open (cache, O_RDONLY | O_NOCTTY);
+	if (fd < 0) {
+		return false;
+	}
+	if (   (fstat (fd, &csb) != 0)
+	    || !S_ISREG (csb.st_mode)
+	    || (0 != csb.st_uid)
+	    || ((csb.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+	    || ((unsigned long long) csb.st_size > SIZE_MAX)
+	    || ((size_t) csb.st_size < sizeof h)) {
+		goto out;
+	}
+	map = mmap (NULL, (size_t) csb.st_size, PROT_READ, MAP_PRIVATE,
+	            fd, 0);
+	if (MAP_FAILED == map) {
+		goto out;
+	}
+	hp = (const struct defs_cache_header *) map;
+	stat_to_header (sb, &h);
+	if (   (memcmp (h.magic, hp->magic, sizeof h.magic) != 0)
+	    || (h.dev != hp->dev)
+	    || (h.ino != hp->ino)
+	    || (h.size != hp->size)
+	    || (h.mtime_sec != hp->mtime_sec)
+	    || (h.mtime_nsec != hp->mtime_nsec)
+	    || (h.ctime_sec != hp->ctime_sec)
+	    || (hp->length != (size_t) csb.st_size - sizeof h)) {
+		goto out;
+	}
+
+	/*
+	 * Check that the image only holds complete pairs, then store
+	 * the values.
+	 */
+	end = map + csb.st_size;
+	for (pass = 0; pass < 2; pass++) {
+		for (cp = map + sizeof h; cp < end;) {
+			const char *name = cp;
+			const char *value;
+
+			cp = memchr (cp, '\0', (size_t) (end - cp));
+			if (NULL == cp) {
+				goto out;
+			}
+			value = cp + 1;
+			cp = memchr (value, '\0', (size_t) (end - value));
+			if (NULL == cp) {
+				goto out;
+			}
+			cp++;
+			if (1 == pass) {
+				(void) putdef_str (name, value);
+			}
+		}
+	}
+	ret = true;
+
+      out:
+	if (MAP_FAILED != map) {
+		(void) munmap ((void *) map, (size_t) csb.st_size);
+	}
+	(void) close (fd);
+	return ret;
+}
+
+/*
+ * def_cache_update - Rebuild the image of login.defs from the loaded
+ *                    values.
+ *
+ *	sb is the status of login.defs. Failures are ignored: login.defs
+ *	is read again the next time.
+ */
+static void def_cache_update (const char *cache, const struct stat *sb)
+{
+	char tmp[1024];
+	struct defs_cache_header h;
+	const struct itemdef *d;
+	FILE *fp;
+	bool ok;
+
+	/*
+	 * A change of login.defs in the same second, after the image was
+	 * built, could not be detected on the file systems which do not
+	 * store the nanoseconds.
+	 */
+	if ((time_t) sb->st_ctime >= time (NULL) - 1) {
+		return;
+	}
+
+	if ((size_t) snprintf (tmp, sizeof tmp, "%s+", cache) >= sizeof tmp) {
+		return;
+	}
+	stat_to_header (sb, &h);
+	for (d = def_table; NULL != d->name; d++) {
+		if (NULL != d->value) {
+			h.length += strlen (d->name) + strlen (d->value) + 2;
+		}
+	}
+
+	fp = fopen (tmp, "w");
+	if (NULL == fp) {
+		return;
+	}
+	ok = (fchmod (fileno (fp), 0644) == 0)
+	     && (fwrite (&h, sizeof h, 1, fp) == 1);
+	for (d = def_table; ok && (NULL != d->name); d++) {
+		if (NULL != d->value) {
+			ok =    (fwrite (d->name, strlen (d->name) + 1, 1, fp) == 1)
+			     && (fwrite (d->value, strlen (d->value) + 1, 1, fp) == 1);
+		}
+	}
+	if (   (fclose (fp) != 0)
+	    || !ok
+	    || (rename (tmp, cache) != 0)) {
+		(void) unlink (tmp);
+	}
+}
+
 /*
  * def_load - load configuration table
  *
  * Loads the user-configured options from the default configuration file
  */
 
+/*
+ * def_load - load the definitions, and time it (see timing_exec)
+ */
 static void def_load (void)
+{
+	struct timespec start;
+
+	/* Not timing_start(): LOG_TIMINGS is not known yet */
+	if (clock_gettime (CLOCK_MONOTONIC, &start) != 0) {
+		start.tv_nsec = -1;
+	}
+	def_read ();
+	timing_stop (TIMING_DEFS, &start, 0, 0);
+}
+
+static void def_read (void)
 {
 	int i;
 	FILE *fp;
 	char buf[1024], *name, *value, *s;
+	char cache[1024];
+	struct stat sb;
+	bool use_cache;
 
 	/*
 	 * Set the initialized flag.
@@ -468,6 +755,17 @@ static void def_load (void)
 		exit (EXIT_FAILURE);
 	}
 
+	/*
+	 * Use the pre-parsed image if it is up to date.
+	 */
+	use_cache =    ((size_t) snprintf (cache, sizeof cache, "%s.cache",
+	                                   def_fname) < sizeof cache)
+	            && (fstat (fileno (fp), &sb) == 0);
+	if (use_cache && def_cache_load (cache, &sb)) {
+		(void) fclose (fp);
+		return;
+	}
+
 	/*
 	 * Go through all of the lines in the file.
 	 */
@@ -517,6 +815,17 @@ static void def_load (void)
 	}
 
 	(void) fclose (fp);
+
+	/*
+	 * The image is only rebuilt by root, and if it was enabled by
+	 * creating the cache file.
+	 */
+	if (   use_cache
+	    && (0 == getuid ())
+	    && (0 == geteuid ())
+	    && (access (cache, F_OK) == 0)) {
+		def_cache_update (cache, &sb);
+	}
 }
 
 
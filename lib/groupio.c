@@ -43,10 +43,11 @@
 #include "commonio.h"
 #include "getdef.h"
 #include "groupio.h"
+#include "memberfile.h"
 
 static /*@null@*/struct commonio_entry *merge_group_entries (
 	/*@null@*/ /*@returned@*/struct commonio_entry *gr1,
-	/*@null@*/struct commonio_entry *gr2);
+	struct commonio_entry **continuations, size_t n);
 static int split_groups (unsigned int max_members);
 static int group_open_hook (void);
 
@@ -71,14 +72,76 @@ static const char *group_getname (const void *ent)
 	return gr->gr_name;
 }
 
+static id_t group_getid (const void *ent)
+{
+	const struct group *gr = ent;
+
+	return (id_t) gr->gr_gid;
+}
+
+static /*@null@*/char **group_getmembers (const void *ent, unsigned int n)
+{
+	const struct group *gr = ent;
+
+	return (0 == n) ? gr->gr_mem : NULL;
+}
+
+static size_t group_size (const void *ent)
+{
+	const struct group *gr = ent;
+
+	return   sizeof *gr
+	       + strlen (gr->gr_name) + strlen (gr->gr_passwd) + 2;
+}
+
 static void *group_parse (const char *line)
 {
 	return (void *) sgetgrent (line);
 }
 
+/*
+ * group_parse_alloc - parse a line into a new entry
+ *
+ *	The entries of the group database are modified in place when
+ *	groups are merged or split, so they are not packed: the line is
+ *	parsed in a temporary buffer and copied with __gr_dup().
+ *
+ *	The members of a group listed as "@" are read from its member
+ *	file.
+ */
+static /*@null@*/ /*@only@*/void *group_parse_alloc (const char *line)
+{
+	struct group grent, *result;
+	struct group *gr = NULL;
+	size_t len = sgetgrent_buflen (line);
+	char *buf;
+
+	buf = (char *) malloc (len);
+	if (NULL == buf) {
+		return NULL;
+	}
+	(void) sgetgrent_r (line, &grent, buf, len, &result);
+	if ((NULL != result) && member_file_listed (result->gr_mem)) {
+		char **members = member_file_read (gr_dbname (),
+		                                   result->gr_name);
+
+		if (NULL != members) {
+			result->gr_mem = members;
+			gr = __gr_dup (result);
+			member_file_free (members);
+		}
+	} else if (NULL != result) {
+		gr = __gr_dup (result);
+	}
+	memzero (buf, len);
+	free (buf);
+	return gr;
+}
+
 static int group_put (const void *ent, FILE * file)
 {
 	const struct group *gr = ent;
+	struct group grent;
 
 	if (   (NULL == gr)
 	    || (valid_field (gr->gr_name, ":\n") == -1)
@@ -97,12 +160,104 @@ static int group_put (const void *ent, FILE * file)
 		}
 	}
 
+	/* The members were written by group_close_hook */
+	if (member_file_used (gr->gr_name, gr->gr_mem)) {
+		grent = *gr;
+		grent.gr_mem = (char **) member_file_marker ();
+		gr = &grent;
+	}
+
 	return (putgrent (gr, file) == -1) ? -1 : 0;
 }
 
+/*
+ * group_format - Append the line of gr to out, as putgrent() would
+ *                write it.
+ */
+static int group_format (const void *ent, struct commonio_buf *out)
+{
+	const struct group *gr = ent;
+	struct group grent;
+	char gid[32] = "";
+	size_t len, i;
+	char *cp;
+
+	if (   (NULL == gr)
+	    || (valid_field (gr->gr_name, ":\n") == -1)
+	    || (valid_field (gr->gr_passwd, ":\n") == -1)
+	    || (gr->gr_gid == (gid_t)-1)) {
+		return -1;
+	}
+
+	/* The members were written by group_close_hook */
+	if (member_file_used (gr->gr_name, gr->gr_mem)) {
+		for (i = 0; NULL != gr->gr_mem[i]; i++) {
+			if (valid_field (gr->gr_mem[i], ",:\n") == -1) {
+				return -1;
+			}
+		}
+		grent = *gr;
+		grent.gr_mem = (char **) member_file_marker ();
+		gr = &grent;
+	}
+
+	/* The NIS compat entries have no GID */
+	if (('+' != gr->gr_name[0]) && ('-' != gr->gr_name[0])) {
+		(void) snprintf (gid, sizeof gid, "%lu",
+		                 (unsigned long) gr->gr_gid);
+	}
+
+	len = strlen (gr->gr_name) + strlen (gr->gr_passwd) + strlen (gid) + 4;
+	for (i = 0; (NULL != gr->gr_mem) && (NULL != gr->gr_mem[i]); i++) {
+		if (valid_field (gr->gr_mem[i], ",:\n") == -1) {
+			return -1;
+		}
+		len += strlen (gr->gr_mem[i]) + 1;
+	}
+	cp = commonio_buf_reserve (out, len);
+	if (NULL == cp) {
+		return -1;
+	}
+	cp = stpcpy (cp, gr->gr_name);
+	*cp++ = ':';
+	cp = stpcpy (cp, gr->gr_passwd);
+	*cp++ = ':';
+	cp = stpcpy (cp, gid);
+	*cp++ = ':';
+	for (i = 0; (NULL != gr->gr_mem) && (NULL != gr->gr_mem[i]); i++) {
+		if (i > 0) {
+			*cp++ = ',';
+		}
+		cp = stpcpy (cp, gr->gr_mem[i]);
+	}
+	*cp++ = '\n';
+	out->len = (size_t) (cp - out->data);
+
+	return 0;
+}
+
+/*
+ * group_close_hook - Write the member files of the changed large
+ *                    groups, and split the other groups if needed.
+ */
 static int group_close_hook (void)
 {
 	unsigned int max_members = getdef_unum("MAX_MEMBERS_PER_GROUP", 0);
+	const struct commonio_entry *gr;
+
+	if (commonio_parse_entries (__gr_get_db ()) != 0) {
+		return 0;
+	}
+	for (gr = __gr_get_head (); NULL != gr; gr = gr->next) {
+		const struct group *gptr = gr->eptr;
+
+		if (   gr->changed && (NULL != gptr)
+		    && member_file_used (gptr->gr_name, gptr->gr_mem)
+		    && (member_file_write (gr_dbname (), gptr->gr_name,
+		                           gptr->gr_mem) != 0)) {
+			return 0;
+		}
+	}
 
 	if (0 == max_members) {
 		return 1;
@@ -120,7 +275,17 @@ static struct commonio_ops group_ops = {
 	fgetsx,
 	fputsx,
 	group_open_hook,
-	group_close_hook
+	group_close_hook,
+	group_getid,
+	NULL,			/* free_index */
+	group_getmembers,
+	group_parse_alloc,
+	group_format,
+	NULL,			/* getgroupid */
+	COMMONIO_NAME_FIELD (struct group, gr_name),
+	COMMONIO_ID_FIELD (struct group, gr_gid),
+	0,			/* groupid_offset */
+	group_size
 };
 
 static /*@owned@*/struct commonio_db group_db = {
@@ -169,14 +334,48 @@ int gr_open (int mode)
 
 /*@observer@*/ /*@null@*/const struct group *gr_locate_gid (gid_t gid)
 {
-	const struct group *grp;
+	return commonio_locate_id (&group_db, (id_t) gid);
+}
 
-	gr_rewind ();
-	while (   ((grp = gr_next ()) != NULL)
-	       && (grp->gr_gid != gid)) {
+/*
+ * gr_locate_member - Find the groups listing name as a member.
+ *
+ *	*groups is set to a malloced array of the *count groups.
+ *	It returns 0 on failure.
+ */
+int gr_locate_member (const char *name,
+                      /*@out@*/const struct group ***groups,
+                      /*@out@*/size_t *count)
+{
+	const void **objs;
+	int ret;
+
+	ret = commonio_locate_member (&group_db, name, &objs, count);
+	*groups = (const struct group **) objs;
+	return ret;
+}
+
+/*
+ * gr_seq_get - Get the last GID allocated from the system or regular
+ *              range (ID_SEQUENCE).
+ */
+bool gr_seq_get (bool sys_group, /*@out@*/gid_t *gid)
+{
+	id_t id;
+
+	if (!commonio_seq_get (&group_db, sys_group, &id)) {
+		return false;
 	}
+	*gid = (gid_t) id;
+	return true;
+}
 
-	return grp;
+/*
+ * gr_seq_set - Record the allocation of gid, with the next commit.
+ */
+void gr_seq_set (bool sys_group, gid_t gid)
+{
+	commonio_seq_set (&group_db, sys_group, (id_t) gid);
 }
 
 int gr_update (const struct group *gr)
@@ -184,6 +383,17 @@ int gr_update (const struct group *gr)
 	return commonio_update (&group_db, (const void *) gr);
 }
 
+int gr_update_owned (/*@only@*/struct group *gr)
+{
+	return commonio_update_owned (&group_db, (void *) gr);
+}
+
+int gr_modify (const char *name, void (*modify) (void *ent, void *arg),
+               void *arg)
+{
+	return commonio_modify (&group_db, name, modify, arg);
+}
+
 int gr_remove (const char *name)
 {
 	return commonio_remove (&group_db, name);
@@ -194,6 +404,15 @@ int gr_rewind (void)
 	return commonio_rewind (&group_db);
 }
 
+/*
+ * gr_scan - Call scan with each struct group of the database (see
+ *           commonio_scan()).
+ */
+int gr_scan (int (*scan) (const void *ent, void *arg), void *arg)
+{
+	return commonio_scan (&group_db, scan, arg);
+}
+
 /*@observer@*/ /*@null@*/const struct group *gr_next (void)
 {
 	return commonio_next (&group_db);
@@ -216,10 +435,14 @@ void __gr_set_changed (void)
 
 /*@dependent@*/ /*@null@*/struct commonio_entry *__gr_get_head (void)
 {
+	/* NULL with errno set to ENOMEM if an entry cannot be parsed */
+	if (commonio_parse_entries (&group_db) != 0) {
+		return NULL;
+	}
 	return group_db.head;
 }
 
-/*@observer@*/const struct commonio_db *__gr_get_db (void)
+struct commonio_db *__gr_get_db (void)
 {
 	return &group_db;
 }
@@ -229,160 +452,268 @@ void __gr_del_entry (const struct commonio_entry *ent)
 	commonio_del_entry (&group_db, ent);
 }
 
-static int gr_cmp (const void *p1, const void *p2)
+bool __gr_has_duplicate (const struct commonio_entry *ent)
 {
-	gid_t u1, u2;
+	return commonio_has_duplicate (&group_db, ent);
+}
 
-	if ((*(struct commonio_entry **) p1)->eptr == NULL) {
-		return 1;
-	}
-	if ((*(struct commonio_entry **) p2)->eptr == NULL) {
-		return -1;
-	}
+/* Sort entries by GID */
+int gr_sort ()
+{
+	return commonio_sort_id (&group_db);
+}
 
-	u1 = ((struct group *) (*(struct commonio_entry **) p1)->eptr)->gr_gid;
-	u2 = ((struct group *) (*(struct commonio_entry **) p2)->eptr)->gr_gid;
+/*
+ * An entry of the group database, and its position in the file.
+ */
+struct split_entry {
+	struct commonio_entry *entry;
+	size_t pos;
+};
 
-	if (u1 < u2) {
-		return -1;
-	} else if (u1 > u2) {
-		return 1;
-	} else {
-		return 0;
-	}
+static bool same_split_group (const struct group *g1, const struct group *g2)
+{
+	return (   (0 == strcmp (g1->gr_name, g2->gr_name))
+	        && (0 == strcmp (g1->gr_passwd, g2->gr_passwd))
+	        && (g1->gr_gid == g2->gr_gid));
 }
 
-/* Sort entries by GID */
-int gr_sort ()
+/*
+ * Order of the entries for group_open_hook: the entries of a split group
+ * (same name, password and GID) are sorted together, in the file order.
+ */
+static int split_entry_cmp (const void *p1, const void *p2)
 {
-	return commonio_sort (&group_db, gr_cmp);
+	const struct split_entry *e1 = p1;
+	const struct split_entry *e2 = p2;
+	const struct group *g1 = e1->entry->eptr;
+	const struct group *g2 = e2->entry->eptr;
+	int ret;
+
+	ret = strcmp (g1->gr_name, g2->gr_name);
+	if (0 != ret) {
+		return ret;
+	}
+	ret = strcmp (g1->gr_passwd, g2->gr_passwd);
+	if (0 != ret) {
+		return ret;
+	}
+	if (g1->gr_gid != g2->gr_gid) {
+		return (g1->gr_gid < g2->gr_gid) ? -1 : 1;
+	}
+	return (e1->pos < e2->pos) ? -1 : ((e1->pos > e2->pos) ? 1 : 0);
 }
 
 static int group_open_hook (void)
 {
 	unsigned int max_members = getdef_unum("MAX_MEMBERS_PER_GROUP", 0);
-	struct commonio_entry *gr1, *gr2;
+	struct commonio_entry *gr;
+	struct split_entry *entries;
+	struct commonio_entry **continuations;
+	size_t n = 0, i, j, k;
+	int ret = 1;
 
 	if (0 == max_members) {
 		return 1;
 	}
 
-	for (gr1 = group_db.head; NULL != gr1; gr1 = gr1->next) {
-		for (gr2 = gr1->next; NULL != gr2; gr2 = gr2->next) {
-			struct group *g1 = (struct group *)gr1->eptr;
-			struct group *g2 = (struct group *)gr2->eptr;
-			if (NULL != g1 &&
-			    NULL != g2 &&
-			    0 == strcmp (g1->gr_name, g2->gr_name) &&
-			    0 == strcmp (g1->gr_passwd, g2->gr_passwd) &&
-			    g1->gr_gid == g2->gr_gid) {
-				/* Both group entries refer to the same
-				 * group. It is a split group. Merge the
-				 * members. */
-				gr1 = merge_group_entries (gr1, gr2);
-				if (NULL == gr1)
-					return 0;
-				/* Unlink gr2 */
-				if (NULL != gr2->next) {
-					gr2->next->prev = gr2->prev;
-				}
-				/* gr2 does not start with head */
-				assert (NULL != gr2->prev);
-				gr2->prev->next = gr2->next;
+	if (commonio_parse_entries (&group_db) != 0) {
+		return 0;
+	}
+	for (gr = group_db.head; NULL != gr; gr = gr->next) {
+		if (NULL != gr->eptr) {
+			n++;
+		}
+	}
+	if (n < 2) {
+		return 1;
+	}
+
+	/*
+	 * Sort the entries so that the lines of each split group follow
+	 * each other, then merge each of these groups at once.
+	 */
+	entries = (struct split_entry *) malloc (n * sizeof (*entries));
+	continuations = (struct commonio_entry **)
+	                malloc (n * sizeof (*continuations));
+	if ((NULL == entries) || (NULL == continuations)) {
+		free (entries);
+		free (continuations);
+		errno = ENOMEM;
+		return 0;
+	}
+	for (gr = group_db.head, i = 0; NULL != gr; gr = gr->next) {
+		if (NULL != gr->eptr) {
+			entries[i].entry = gr;
+			entries[i].pos = i;
+			i++;
+		}
+	}
+	qsort (entries, n, sizeof (*entries), split_entry_cmp);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1;
+		     (j < n) && same_split_group (entries[i].entry->eptr,
+		                                  entries[j].entry->eptr);
+		     j++) {
+			continuations[j - i - 1] = entries[j].entry;
+		}
+		if (j - i < 2) {
+			continue;
+		}
+
+		/* It is a split group. Merge the members. */
+		if (NULL == merge_group_entries (entries[i].entry,
+		                                 continuations, j - i - 1)) {
+			ret = 0;
+			break;
+		}
+		for (k = 0; k < j - i - 1; k++) {
+			struct commonio_entry *gr2 = continuations[k];
+
+			/* Unlink gr2 */
+			if (NULL != gr2->next) {
+				gr2->next->prev = gr2->prev;
+			} else {
+				group_db.tail = gr2->prev;
 			}
+			/* gr2 does not start with head */
+			assert (NULL != gr2->prev);
+			gr2->prev->next = gr2->next;
 		}
-		assert (NULL != gr1);
 	}
 
-	return 1;
+	free (entries);
+	free (continuations);
+	return ret;
 }
 
 /*
- * Merge the list of members of the two group entries.
- *
- * The commonio_entry arguments shall be group entries.
+ * Set of the member names of a group, used by merge_group_entries.
+ */
+struct member_set {
+	const char **slots;
+	size_t size;
+};
+
+static bool member_set_init (struct member_set *set, size_t n)
+{
+	set->size = 16;
+	while (set->size < 2 * n) {
+		set->size *= 2;
+	}
+	set->slots = (const char **) calloc (set->size, sizeof (*set->slots));
+	return (NULL != set->slots);
+}
+
+/*
+ * member_set_add - Add a name to the set.
  *
- * You should not merge the members of two groups if they don't have the
- * same name, password and gid.
+ *	It returns false if the name was already in the set.
+ */
+static bool member_set_add (struct member_set *set, const char *name)
+{
+	size_t h = 2166136261U;
+	const char *cp;
+
+	for (cp = name; '\0' != *cp; cp++) {
+		h ^= (unsigned char) *cp;
+		h *= 16777619U;
+	}
+	for (h &= set->size - 1; NULL != set->slots[h]; h = (h + 1) & (set->size - 1)) {
+		if (0 == strcmp (set->slots[h], name)) {
+			return false;
+		}
+	}
+	set->slots[h] = name;
+	return true;
+}
+
+/*
+ * merge_group_entries - Merge the lines and the members of the n
+ * continuations of a split group in its first entry, gr1.
  *
- * It merge the members of the second entry in the first one, and return
- * the modified first entry on success, or NULL on failure (with errno
- * set).
+ *	The members of the continuations already listed are dropped.
  */
 static /*@null@*/struct commonio_entry *merge_group_entries (
 	/*@null@*/ /*@returned@*/struct commonio_entry *gr1,
-	/*@null@*/struct commonio_entry *gr2)
+	struct commonio_entry **continuations, size_t n)
 {
 	struct group *gptr1;
-	struct group *gptr2;
+	struct member_set set;
 	char **new_members;
 	size_t members = 0;
-	char *new_line;
-	size_t new_line_len, i;
-	if (NULL == gr2 || NULL == gr1) {
+	char *new_line, *cp;
+	size_t new_line_len, i, k;
+	if (NULL == gr1) {
 		errno = EINVAL;
 		return NULL;
 	}
 
 	gptr1 = (struct group *)gr1->eptr;
-	gptr2 = (struct group *)gr2->eptr;
-	if (NULL == gptr2 || NULL == gptr1) {
+	if (NULL == gptr1) {
 		errno = EINVAL;
 		return NULL;
 	}
 
-	/* Concatenate the 2 lines */
-	new_line_len = strlen (gr1->line) + strlen (gr2->line) +1;
-	new_line = (char *)malloc (new_line_len + 1);
+	/* Concatenate the lines */
+	new_line_len = strlen (gr1->line);
+	for (i=0; NULL != gptr1->gr_mem[i]; i++);
+	members += i;
+	for (k = 0; k < n; k++) {
+		const struct group *gptr2 = continuations[k]->eptr;
+
+		if (NULL == gptr2) {
+			errno = EINVAL;
+			return NULL;
+		}
+		new_line_len += strlen (continuations[k]->line) + 1;
+		for (i=0; NULL != gptr2->gr_mem[i]; i++);
+		members += i;
+	}
+	new_line = (char *) commonio_alloc (&group_db, new_line_len + 1);
 	if (NULL == new_line) {
 		errno = ENOMEM;
 		return NULL;
 	}
-	snprintf(new_line, new_line_len + 1, "%s\n%s", gr1->line, gr2->line);
-
-	/* Concatenate the 2 list of members */
-	for (i=0; NULL != gptr1->gr_mem[i]; i++);
-	members += i;
-	for (i=0; NULL != gptr2->gr_mem[i]; i++) {
-		char **pmember = gptr1->gr_mem;
-		while (NULL != *pmember) {
-			if (0 == strcmp(*pmember, gptr2->gr_mem[i])) {
-				break;
-			}
-			pmember++;
-		}
-		if (NULL == *pmember) {
-			members++;
-		}
+	cp = stpcpy (new_line, gr1->line);
+	for (k = 0; k < n; k++) {
+		*cp = '\n';
+		cp = stpcpy (cp + 1, continuations[k]->line);
 	}
+
+	/* Concatenate the lists of members */
 	new_members = (char **)calloc ( (members+1), sizeof(char*) );
 	if (NULL == new_members) {
-		free (new_line);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (!member_set_init (&set, members)) {
+		free (new_members);
 		errno = ENOMEM;
 		return NULL;
 	}
 	for (i=0; NULL != gptr1->gr_mem[i]; i++) {
 		new_members[i] = gptr1->gr_mem[i];
+		(void) member_set_add (&set, gptr1->gr_mem[i]);
 	}
 	/* NULL termination enforced by above calloc */
 
 	members = i;
-	for (i=0; NULL != gptr2->gr_mem[i]; i++) {
-		char **pmember = new_members;
-		while (NULL != *pmember) {
-			if (0 == strcmp(*pmember, gptr2->gr_mem[i])) {
-				break;
+	for (k = 0; k < n; k++) {
+		const struct group *gptr2 = continuations[k]->eptr;
+
+		for (i=0; NULL != gptr2->gr_mem[i]; i++) {
+			if (member_set_add (&set, gptr2->gr_mem[i])) {
+				new_members[members] = gptr2->gr_mem[i];
+				members++;
 			}
-			pmember++;
-		}
-		if (NULL == *pmember) {
-			new_members[members] = gptr2->gr_mem[i];
-			members++;
-			new_members[members] = NULL;
 		}
 	}
+	free (set.slots);
 
 	gr1->line = new_line;
+	free (gptr1->gr_mem);
 	gptr1->gr_mem = new_members;
 
 	return gr1;
@@ -394,69 +725,109 @@ static /*@null@*/struct commonio_entry *merge_group_entries (
  *
  * Return 0 on failure (errno set) and 1 on success.
  */
-static int split_groups (unsigned int max_members)
+/*
+ * split_group - Split the members of a group in lines of at most
+ * max_members members.
+ *
+ *	The members above max_members are moved to new entries, inserted
+ *	after gr.
+ *
+ *	It returns the last entry of the group, or NULL on failure.
+ */
+static /*@null@*/struct commonio_entry *split_group (
+	struct commonio_entry *gr, unsigned int max_members)
 {
-	struct commonio_entry *gr;
+	struct group *gptr = (struct group *)gr->eptr;
+	struct commonio_entry *prev = gr;
+	size_t members, first;
 
-	for (gr = group_db.head; NULL != gr; gr = gr->next) {
-		struct group *gptr = (struct group *)gr->eptr;
+	for (members = 0; NULL != gptr->gr_mem[members]; members++);
+
+	for (first = max_members; first < members; first += max_members) {
 		struct commonio_entry *new;
 		struct group *new_gptr;
-		unsigned int members = 0;
-		unsigned int i;
+		size_t count = members - first;
+		size_t i;
 
-		/* Check if this group must be split */
-		if (!gr->changed) {
-			continue;
-		}
-		if (NULL == gptr) {
-			continue;
-		}
-		for (members = 0; NULL != gptr->gr_mem[members]; members++);
-		if (members <= max_members) {
-			continue;
+		if (count > max_members) {
+			count = max_members;
 		}
 
-		new = (struct commonio_entry *) malloc (sizeof *new);
+		new = (struct commonio_entry *)
+		      commonio_alloc (&group_db, sizeof *new);
 		if (NULL == new) {
 			errno = ENOMEM;
-			return 0;
+			return NULL;
 		}
-		new->eptr = group_dup(gr->eptr);
-		if (NULL == new->eptr) {
-			free (new);
+		new_gptr = (struct group *) malloc (sizeof *new_gptr);
+		if (NULL == new_gptr) {
 			errno = ENOMEM;
-			return 0;
+			return NULL;
+		}
+		memset (new_gptr, 0, sizeof *new_gptr);
+		new_gptr->gr_gid = gptr->gr_gid;
+		new_gptr->gr_name = strdup (gptr->gr_name);
+		new_gptr->gr_passwd = strdup (gptr->gr_passwd);
+		new_gptr->gr_mem = (char **)
+		                   malloc ((count + 1) * sizeof (char *));
+		if (   (NULL == new_gptr->gr_name)
+		    || (NULL == new_gptr->gr_passwd)
+		    || (NULL == new_gptr->gr_mem)) {
+			gr_free (new_gptr);
+			errno = ENOMEM;
+			return NULL;
 		}
-		new_gptr = (struct group *)new->eptr;
+
+		/*
+		 * Move the members. They are removed from gptr, which
+		 * thus ends at max_members.
+		 */
+		for (i = 0; i < count; i++) {
+			new_gptr->gr_mem[i] = gptr->gr_mem[first + i];
+			gptr->gr_mem[first + i] = NULL;
+		}
+		new_gptr->gr_mem[count] = NULL;
+
+		new->eptr = new_gptr;
 		new->line = NULL;
 		new->changed = true;
+		new->parsed = true;
 
-		/* Enforce the maximum number of members on gptr */
-		for (i = max_members; NULL != gptr->gr_mem[i]; i++) {
-			free (gptr->gr_mem[i]);
-			gptr->gr_mem[i] = NULL;
+		/* insert the new entry in the list */
+		new->prev = prev;
+		new->next = prev->next;
+		if (NULL != prev->next) {
+			prev->next->prev = new;
+		} else {
+			group_db.tail = new;
 		}
-		/* Shift all the members */
-		/* The number of members in new_gptr will be check later */
-		for (i = 0; NULL != new_gptr->gr_mem[i + max_members]; i++) {
-			if (NULL != new_gptr->gr_mem[i]) {
-				free (new_gptr->gr_mem[i]);
-			}
-			new_gptr->gr_mem[i] = new_gptr->gr_mem[i + max_members];
-			new_gptr->gr_mem[i + max_members] = NULL;
+		prev->next = new;
+		prev = new;
+	}
+
+	return prev;
+}
+
+static int split_groups (unsigned int max_members)
+{
+	struct commonio_entry *gr;
+
+	for (gr = group_db.head; NULL != gr; gr = gr->next) {
+		/*
+		 * Only the changed groups may have to be split. The
+		 * groups with a member file keep a short line.
+		 */
+		if (   !gr->changed || (NULL == gr->eptr)
+		    || member_file_used (((struct group *) gr->eptr)->gr_name,
+		                         ((struct group *) gr->eptr)->gr_mem)) {
+			continue;
 		}
-		for (; NULL != new_gptr->gr_mem[i]; i++) {
-			free (new_gptr->gr_mem[i]);
-			new_gptr->gr_mem[i] = NULL;
+		/* Continue after the new entries */
+		gr = split_group (gr, max_members);
+		if (NULL == gr) {
+			return 0;
 		}
-
-		/* insert the new entry in the list */
-		new->prev = gr;
-		new->next = gr->next;
-		gr->next = new;
 	}
 
 	return 1;
 }
-
@@ -37,19 +37,30 @@
 
 #include <sys/types.h>
 #include <grp.h>
+#include "defines.h" /* bool */
 
 extern int gr_close (void);
 extern /*@observer@*/ /*@null@*/const struct group *gr_locate (const char *name);
 extern /*@observer@*/ /*@null@*/const struct group *gr_locate_gid (gid_t gid);
+extern int gr_locate_member (const char *name,
+                             /*@out@*/const struct group ***groups,
+                             /*@out@*/size_t *count);
 extern int gr_lock (void);
+extern bool gr_seq_get (bool sys_group, /*@out@*/gid_t *gid);
+extern void gr_seq_set (bool sys_group, gid_t gid);
 extern int gr_setdbname (const char *filename);
 extern /*@observer@*/const char *gr_dbname (void);
 extern /*@observer@*/ /*@null@*/const struct group *gr_next (void);
 extern int gr_open (int mode);
 extern int gr_remove (const char *name);
 extern int gr_rewind (void);
+extern int gr_scan (int (*scan) (const void *ent, void *arg), void *arg);
 extern int gr_unlock (void);
 extern int gr_update (const struct group *gr);
+extern int gr_update_owned (/*@only@*/struct group *gr);
+extern int gr_modify (const char *name,
+                      void (*modify) (void *ent, void *arg),
+                      void *arg);
 extern int gr_sort (void);
 
 #endif
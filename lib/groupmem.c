@@ -38,6 +38,7 @@
 #include "prototypes.h"
 #include "defines.h"
 #include "groupio.h"
+#include "strintern.h"
 
 /*@null@*/ /*@only@*/struct group *__gr_dup (const struct group *grent)
 {
@@ -75,8 +76,9 @@
 		gr_free(gr);
 		return NULL;
 	}
+	/* The members are interned (see gr_free) */
 	for (i = 0; grent->gr_mem[i]; i++) {
-		gr->gr_mem[i] = strdup (grent->gr_mem[i]);
+		gr->gr_mem[i] = str_intern (grent->gr_mem[i]);
 		if (NULL == gr->gr_mem[i]) {
 			gr_free(gr);
 			return NULL;
@@ -96,11 +98,69 @@ void gr_free (/*@out@*/ /*@only@*/struct group *grent)
 	}
 	if (NULL != grent->gr_mem) {
 		size_t i;
+		/*
+		 * The members copied by __gr_dup() are interned, the
+		 * ones added by the tools are not.
+		 */
 		for (i = 0; NULL != grent->gr_mem[i]; i++) {
-			free (grent->gr_mem[i]);
+			if (!str_interned (grent->gr_mem[i])) {
+				free (grent->gr_mem[i]);
+			}
 		}
 		free (grent->gr_mem);
 	}
 	free (grent);
 }
 
+/*
+ * __gr_dup_packed - copy a group entry in a single allocation
+ *
+ *	The list of members and the password are stored after the
+ *	structure. The name and the members are interned (see
+ *	strintern.h). The fields of the copy must not be freed or
+ *	reallocated, and the copy is released with gr_free_packed().
+ */
+/*@null@*/ /*@only@*/struct group *__gr_dup_packed (const struct group *grent)
+{
+	struct group *gr;
+	size_t passwd_len;
+	size_t n, i;
+
+	passwd_len = strlen (grent->gr_passwd) + 1;
+	for (n = 0; NULL != grent->gr_mem[n]; n++);
+
+	gr = (struct group *) malloc (  sizeof *gr + (n + 1) * sizeof (char *)
+	                              + passwd_len);
+	if (NULL == gr) {
+		return NULL;
+	}
+	/* The libc might define other fields. They won't be copied. */
+	memset (gr, 0, sizeof *gr);
+	gr->gr_gid = grent->gr_gid;
+
+	gr->gr_mem = (char **) (gr + 1);
+	gr->gr_passwd = memcpy (gr->gr_mem + n + 1, grent->gr_passwd,
+	                        passwd_len);
+	gr->gr_name = str_intern (grent->gr_name);
+	if (NULL == gr->gr_name) {
+		free (gr);
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		gr->gr_mem[i] = str_intern (grent->gr_mem[i]);
+		if (NULL == gr->gr_mem[i]) {
+			free (gr);
+			return NULL;
+		}
+	}
+	gr->gr_mem[n] = NULL;
+
+	return gr;
+}
+
+void gr_free_packed (/*@out@*/ /*@only@*/struct group *grent)
+{
+	memzero (grent->gr_passwd, strlen (grent->gr_passwd));
+	free (grent);
+}
+
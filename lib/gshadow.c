@@ -41,10 +41,11 @@
 #include "prototypes.h"
 #include "defines.h"
 static /*@null@*/FILE *shadow;
+/* The lists are kept between the calls, and only grown */
 static /*@null@*//*@only@*/char **members = NULL;
-static size_t nmembers = 0;
+static size_t members_size = 0;
 static /*@null@*//*@only@*/char **admins = NULL;
-static size_t nadmins = 0;
+static size_t admins_size = 0;
 static struct sgrp sgroup;
 
 #define	FIELDS	4
@@ -78,33 +79,33 @@ static int bind_nis (void)
 }
 #endif
 
-static /*@null@*/char **build_list (char *s, char **list[], size_t * nlist)
+/*
+ * build_list - split a comma-separated list into *list
+ *
+ *	*list has room for *size pointers. It is only reallocated when the
+ *	list has more elements, so that parsing the entries does not
+ *	allocate memory once the longest list was seen.
+ */
+static /*@null@*/char **build_list (/*@null@*/char *s, char **list[], size_t *size)
 {
-	char **ptr = *list;
-	size_t nelem = *nlist, size;
-
-	while (s != NULL && *s != '\0') {
-		size = (nelem + 1) * sizeof (ptr);
-		ptr = realloc (*list, size);
-		if (NULL != ptr) {
-			ptr[nelem] = s;
-			nelem++;
-			*list = ptr;
-			*nlist = nelem;
-			s = strchr (s, ',');
-			if (NULL != s) {
-				*s = '\0';
-				s++;
-			}
+	char **ptr;
+	size_t n;
+
+	n = (NULL != s) ? count_char (s, ',') + 2 : 1;
+	if (n > *size) {
+		ptr = realloc (*list, n * sizeof (char *));
+		if (NULL == ptr) {
+			return NULL;
 		}
-	}
-	size = (nelem + 1) * sizeof (ptr);
-	ptr = realloc (*list, size);
-	if (NULL != ptr) {
-		ptr[nelem] = NULL;
 		*list = ptr;
+		*size = n;
 	}
-	return ptr;
+	if (NULL != s) {
+		(void) split_list (s, *list);
+	} else {
+		(*list)[0] = NULL;
+	}
+	return *list;
 }
 
 void setsgent (void)
@@ -135,7 +136,7 @@ void endsgent (void)
 
 	char *fields[FIELDS];
 	char *cp;
-	int i;
+	size_t n, i;
 	size_t len = strlen (string) + 1;
 
 	if (len > sgrbuflen) {
@@ -160,12 +161,9 @@ void endsgent (void)
 	 * all 4 of them and save the starting addresses in fields[].
 	 */
 
-	for (cp = sgrbuf, i = 0; (i < FIELDS) && (NULL != cp); i++) {
-		fields[i] = cp;
-		cp = strchr (cp, ':');
-		if (NULL != cp) {
-			*cp++ = '\0';
-		}
+	n = split_fields (sgrbuf, ':', fields, FIELDS);
+	for (i = n; i < FIELDS; i++) {
+		fields[i] = NULL;
 	}
 
 	/*
@@ -173,7 +171,7 @@ void endsgent (void)
 	 * the line is invalid.
 	 */
 
-	if ((NULL != cp) || (i != FIELDS)) {
+	if (n != FIELDS) {
 #ifdef	USE_NIS
 		if (!IS_NISCHAR (fields[0][0])) {
 			return 0;
@@ -187,18 +185,8 @@ void endsgent (void)
 
 	sgroup.sg_name = fields[0];
 	sgroup.sg_passwd = fields[1];
-	if (0 != nadmins) {
-		nadmins = 0;
-		free (admins);
-		admins = NULL;
-	}
-	if (0 != nmembers) {
-		nmembers = 0;
-		free (members);
-		members = NULL;
-	}
-	sgroup.sg_adm = build_list (fields[2], &admins, &nadmins);
-	sgroup.sg_mem = build_list (fields[3], &members, &nmembers);
+	sgroup.sg_adm = build_list (fields[2], &admins, &admins_size);
+	sgroup.sg_mem = build_list (fields[3], &members, &members_size);
 
 	return &sgroup;
 }
@@ -0,0 +1,196 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "commonio.h"
+#include "getdef.h"
+
+/*
+ * Sequence of the allocated IDs (ID_SEQUENCE)
+ *
+ * The last UID or GID allocated from the system and regular ranges is
+ * kept in <file>.seq, next to the passwd or group file:
+ *
+ *	system <id>
+ *	regular <id>
+ *
+ * find_new_uid() and find_new_gid() try the ID which follows it (or
+ * precedes it, for the system range which is allocated downwards)
+ * before they scan the database, and the scan does not go back before
+ * it, so that the IDs of the deleted users and groups are not reused
+ * until the range is exhausted.
+ *
+ * The file is written when the database is committed, while it is
+ * still locked. If it could not be written, or if the IDs were
+ * allocated without it, the next allocation finds that the candidate
+ * is used and scans the database.
+ */
+
+static /*@observer@*/const char *const seq_names[2] = {
+	"system",
+	"regular",
+};
+
+/*
+ * seq_load - Read <file>.seq, once per open of the database.
+ */
+static void seq_load (struct commonio_db *db)
+{
+	char buf[1024];
+	char line[64];
+	FILE *fp;
+
+	db->seq.loaded = true;
+	if ((size_t) snprintf (buf, sizeof buf, "%s.seq",
+	                       db->filename) >= sizeof buf) {
+		return;
+	}
+	fp = fopen (buf, "r");
+	if (NULL == fp) {
+		return;
+	}
+	while (fgets (line, sizeof line, fp) == line) {
+		char *cp = strchr (line, ' ');
+		unsigned long id;
+		int i;
+
+		if (NULL == cp) {
+			continue;
+		}
+		*cp++ = '\0';
+		cp[strcspn (cp, "\n")] = '\0';
+		if (getulong (cp, &id) == 0) {
+			continue;
+		}
+		for (i = 0; i < 2; i++) {
+			if (strcmp (line, seq_names[i]) == 0) {
+				db->seq.last[i] = (id_t) id;
+				db->seq.known[i] = true;
+			}
+		}
+	}
+	(void) fclose (fp);
+}
+
+/*
+ * commonio_seq_get - Get the last ID allocated from the system (sys) or
+ *                    regular range of db.
+ *
+ *	It returns false if ID_SEQUENCE is not set, or if no ID was
+ *	allocated from this range yet.
+ */
+bool commonio_seq_get (struct commonio_db *db, bool sys, /*@out@*/id_t *id)
+{
+	int i = sys ? 0 : 1;
+
+	if (!getdef_bool ("ID_SEQUENCE")) {
+		return false;
+	}
+	if (!db->seq.loaded) {
+		seq_load (db);
+	}
+	if (!db->seq.known[i]) {
+		return false;
+	}
+	*id = db->seq.last[i];
+	return true;
+}
+
+/*
+ * commonio_seq_set - Record that id was allocated from the system (sys)
+ *                    or regular range of db.
+ *
+ *	It is written with the next commit of db.
+ */
+void commonio_seq_set (struct commonio_db *db, bool sys, id_t id)
+{
+	int i = sys ? 0 : 1;
+
+	if (!getdef_bool ("ID_SEQUENCE")) {
+		return;
+	}
+	if (!db->seq.loaded) {
+		seq_load (db);
+	}
+	db->seq.last[i] = id;
+	db->seq.known[i] = true;
+	db->seq.changed = true;
+}
+
+/*
+ * commonio_seq_commit - Write <file>.seq.
+ *
+ *	It is written to <file>.seq+ and renamed, with the owner and the
+ *	permissions of the database.
+ *
+ *	It returns 1 on success, 0 on failure.
+ */
+int commonio_seq_commit (struct commonio_db *db)
+{
+	char buf[1024];
+	char tmp[1024];
+	struct stat sb;
+	FILE *fp;
+	int i;
+
+	if (   ((size_t) snprintf (buf, sizeof buf, "%s.seq",
+	                           db->filename) >= sizeof buf)
+	    || ((size_t) snprintf (tmp, sizeof tmp, "%s.seq+",
+	                           db->filename) >= sizeof tmp)) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+
+	if (stat (db->filename, &sb) != 0) {
+		return 0;
+	}
+	fp = fopen (tmp, "w");
+	if (NULL == fp) {
+		return 0;
+	}
+#ifdef HAVE_FCHOWN
+	if (fchown (fileno (fp), sb.st_uid, sb.st_gid) != 0) {
+		goto fail;
+	}
+#endif				/* HAVE_FCHOWN */
+#ifdef HAVE_FCHMOD
+	if (fchmod (fileno (fp), sb.st_mode & 0664) != 0) {
+		goto fail;
+	}
+#endif				/* HAVE_FCHMOD */
+	for (i = 0; i < 2; i++) {
+		if (   db->seq.known[i]
+		    && (fprintf (fp, "%s %lu\n", seq_names[i],
+		                 (unsigned long) db->seq.last[i]) < 0)) {
+			goto fail;
+		}
+	}
+	if ((fflush (fp) != 0) || (fsync (fileno (fp)) != 0)) {
+		goto fail;
+	}
+	if (fclose (fp) != 0) {
+		fp = NULL;
+		goto fail;
+	}
+	fp = NULL;
+	if (rename (tmp, buf) != 0) {
+		goto fail;
+	}
+	db->seq.changed = false;
+	return 1;
+
+      fail:
+	if (NULL != fp) {
+		(void) fclose (fp);
+	}
+	(void) unlink (tmp);
+	return 0;
+}
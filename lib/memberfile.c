@@ -0,0 +1,249 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "prototypes.h"
+#include "defines.h"
+#include "getdef.h"
+#include "memberfile.h"
+
+/*
+ * member_file_listed - Check if the members of a group are in its
+ *                      member file.
+ */
+bool member_file_listed (/*@null@*/char *const *members)
+{
+	return    (NULL != members)
+	       && (NULL != members[0])
+	       && (strcmp (members[0], MEMBER_FILE_MARKER) == 0)
+	       && (NULL == members[1]);
+}
+
+/*
+ * member_file_line - Check if the members of the group of a line (of
+ *                    /etc/group or /etc/gshadow) are in its member
+ *                    file.
+ *
+ *	The members are the last field of these lines.
+ */
+bool member_file_line (const char *line)
+{
+	const char *sep = strrchr (line, ':');
+
+	return (NULL != sep) && (strcmp (sep + 1, MEMBER_FILE_MARKER) == 0);
+}
+
+/*
+ * member_file_used - Check if the members of a group are written to
+ *                    its member file.
+ *
+ *	They are when the group has at least EXTERNAL_MEMBERS_MIN members.
+ *	The NIS entries keep their members.
+ */
+bool member_file_used (const char *group, /*@null@*/char *const *members)
+{
+	unsigned long min = getdef_ulong ("EXTERNAL_MEMBERS_MIN", 0);
+	unsigned long n;
+
+	if (   (0 == min)
+	    || (NULL == members)
+	    || ('+' == group[0]) || ('-' == group[0])) {
+		return false;
+	}
+	for (n = 0; (n < min) && (NULL != members[n]); n++);
+	return (n == min);
+}
+
+/*
+ * member_file_marker - The list of members written in the line of a
+ *                      group whose members are in its member file.
+ */
+char *const *member_file_marker (void)
+{
+	static char marker[] = MEMBER_FILE_MARKER;
+	static char *const members[] = { marker, NULL };
+
+	return members;
+}
+
+static bool member_file_path (const char *dbname, const char *group,
+                              const char *suffix, char *buf, size_t size)
+{
+	int len;
+
+	if (   ('\0' == group[0]) || ('.' == group[0])
+	    || (NULL != strchr (group, '/'))) {
+		errno = EINVAL;
+		return false;
+	}
+	len = snprintf (buf, size, "%s.members/%s%s", dbname, group, suffix);
+	if ((len < 0) || ((size_t) len >= size)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * member_file_read - Read the member file of a group.
+ *
+ *	It returns a NULL terminated list of malloc()ed names, freed with
+ *	member_file_free(), or NULL on failure (with errno set).
+ */
+/*@null@*/ /*@only@*/char **member_file_read (const char *dbname,
+                                              const char *group)
+{
+	char path[1024];
+	char buf[BUFSIZ];
+	char **members = NULL;
+	size_t n = 0, size = 0;
+	FILE *fp;
+
+	if (!member_file_path (dbname, group, "", path, sizeof path)) {
+		return NULL;
+	}
+	fp = fopen (path, "r");
+	if (NULL == fp) {
+		SYSLOG ((LOG_ERR, "cannot open %s: %s", path, strerror (errno)));
+		return NULL;
+	}
+	while (fgets (buf, (int) sizeof buf, fp) == buf) {
+		char *nl = strchr (buf, '\n');
+
+		if (NULL == nl) {
+			/* No user name is that long */
+			errno = EINVAL;
+			goto fail;
+		}
+		*nl = '\0';
+		if ('\0' == buf[0]) {
+			continue;
+		}
+		if (n + 1 >= size) {
+			char **tmp;
+
+			size = (0 == size) ? 64 : size * 2;
+			tmp = (char **) realloc (members, size * sizeof (char *));
+			if (NULL == tmp) {
+				goto fail;
+			}
+			members = tmp;
+		}
+		members[n] = strdup (buf);
+		if (NULL == members[n]) {
+			goto fail;
+		}
+		n++;
+		members[n] = NULL;
+	}
+	if (ferror (fp) != 0) {
+		goto fail;
+	}
+	(void) fclose (fp);
+	if (NULL == members) {
+		members = (char **) calloc (1, sizeof (char *));
+	}
+	return members;
+
+      fail:
+	SYSLOG ((LOG_ERR, "cannot read %s", path));
+	if (NULL != members) {
+		member_file_free (members);
+	}
+	(void) fclose (fp);
+	return NULL;
+}
+
+static int member_cmp (const void *p1, const void *p2)
+{
+	return strcmp (*(char *const *) p1, *(char *const *) p2);
+}
+
+/*
+ * member_file_write - Replace the member file of a group.
+ *
+ *	The file gets the owner and the mode of the database file. The
+ *	caller holds the lock of the database.
+ *
+ *	It returns 0 on success, -1 on failure (with errno set).
+ */
+int member_file_write (const char *dbname, const char *group,
+                       char *const *members)
+{
+	char path[1024], tmp[1024];
+	const char **sorted;
+	struct stat sb;
+	size_t n, i;
+	FILE *fp;
+
+	if (   !member_file_path (dbname, group, "", path, sizeof path)
+	    || !member_file_path (dbname, group, "+", tmp, sizeof tmp)) {
+		return -1;
+	}
+	if (stat (dbname, &sb) != 0) {
+		return -1;
+	}
+
+	/* <file>.members/ */
+	*strrchr (tmp, '/') = '\0';
+	if (mkdir (tmp, ((sb.st_mode & 0004) != 0) ? 0755 : 0700) == 0) {
+		if (chown (tmp, sb.st_uid, sb.st_gid) != 0) {
+			return -1;
+		}
+	} else if (EEXIST != errno) {
+		return -1;
+	}
+	tmp[strlen (tmp)] = '/';
+
+	for (n = 0; NULL != members[n]; n++);
+	sorted = (const char **) malloc ((n + 1) * sizeof (char *));
+	if (NULL == sorted) {
+		return -1;
+	}
+	memcpy (sorted, members, n * sizeof (char *));
+	qsort (sorted, n, sizeof (char *), member_cmp);
+
+	fp = fopen (tmp, "w");
+	if (NULL == fp) {
+		free (sorted);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if ((i > 0) && (strcmp (sorted[i - 1], sorted[i]) == 0)) {
+			continue;
+		}
+		(void) fputs (sorted[i], fp);
+		(void) putc ('\n', fp);
+	}
+	free (sorted);
+	if (   (fchown (fileno (fp), sb.st_uid, sb.st_gid) != 0)
+	    || (fchmod (fileno (fp), sb.st_mode & 0664) != 0)
+	    || (fflush (fp) != 0)
+	    || (fsync (fileno (fp)) != 0)) {
+		(void) fclose (fp);
+		(void) unlink (tmp);
+		return -1;
+	}
+	if (   (fclose (fp) != 0)
+	    || (rename (tmp, path) != 0)) {
+		(void) unlink (tmp);
+		return -1;
+	}
+	return 0;
+}
+
+void member_file_free (/*@only@*/char **members)
+{
+	size_t i;
+
+	for (i = 0; NULL != members[i]; i++) {
+		free (members[i]);
+	}
+	free (members);
+}
@@ -0,0 +1,29 @@
+#ifndef _MEMBERFILE_H_
+#define _MEMBERFILE_H_
+
+#include <config.h>
+
+#include <stdbool.h>
+
+/*
+ * Member files of large groups (EXTERNAL_MEMBERS_MIN)
+ *
+ * When the list of members of a group (in /etc/group or /etc/gshadow)
+ * is the single name "@", the members are stored in
+ * <file>.members/<group>, one name per line, in sorted order. The line
+ * of the group then stays short, whatever its number of members.
+ */
+#define MEMBER_FILE_MARKER	"@"
+
+extern bool member_file_listed (/*@null@*/char *const *members);
+extern bool member_file_line (const char *line);
+extern bool member_file_used (const char *group,
+                              /*@null@*/char *const *members);
+extern char *const *member_file_marker (void);
+extern /*@null@*/ /*@only@*/char **member_file_read (const char *dbname,
+                                                     const char *group);
+extern int member_file_write (const char *dbname, const char *group,
+                              char *const *members);
+extern void member_file_free (/*@only@*/char **members);
+
+#endif
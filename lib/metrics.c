@@ -0,0 +1,570 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "metrics.h"
+#include "timing.h"
+
+/*
+ * The series of shadow_<tool>.prom are:
+ *
+ *	shadow_runs_total{tool}
+ *	shadow_phase_calls_total{tool,phase}
+ *	shadow_phase_entries_total{tool,phase}
+ *	shadow_phase_bytes_total{tool,phase}
+ *	shadow_phase_misses_total{tool,phase}	NSS lookups which found
+ *		nothing (the hits are the entries)
+ *	shadow_phase_duration_seconds{tool,phase}	histogram of the time
+ *		spent in the phase by each run
+ *	shadow_db_entries{tool,db}	entries of the database when it was
+ *		last opened
+ *	shadow_db_bytes{tool,db,kind}	memory held by the database, by
+ *		kind (entries, lines, objects, members, indexes), when it
+ *		was closed, or when the tool exited
+ *	shadow_db_peak_bytes{tool,db}	most memory held by the database
+ *		during the last run
+ *	shadow_max_rss_bytes{tool}	peak resident size of the last run
+ *
+ * The phases are the ones of LOG_TIMINGS. The "commit" phase of the
+ * histogram is the sum of the backup, write, fsync, rename and journal
+ * phases of a run.
+ *
+ * The file is read, updated and written again as a whole to a temporary
+ * file renamed over it, so that the collector never reads a partial
+ * file. The runs of a tool update it in turn, with an flock() of
+ * .shadow_<tool>.lock (the collector only reads the *.prom files).
+ */
+
+#define METRICS_DBS	16
+
+struct metric {
+	char *key;		/* name{labels} */
+	double value;
+};
+
+struct metrics {
+	struct metric *m;
+	size_t count;
+	size_t size;
+};
+
+/* In the order of their series in the file */
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+} families[] = {
+	{ "shadow_db_bytes", "gauge",
+	  "Memory held by the database when it was closed or at exit." },
+	{ "shadow_db_entries", "gauge",
+	  "Entries of the database when it was last opened." },
+	{ "shadow_db_peak_bytes", "gauge",
+	  "Most memory held by the database during the last run." },
+	{ "shadow_max_rss_bytes", "gauge",
+	  "Peak resident size of the last run." },
+	{ "shadow_phase_bytes_total", "counter",
+	  "Bytes read or written in the phase." },
+	{ "shadow_phase_calls_total", "counter",
+	  "Number of times the phase happened." },
+	{ "shadow_phase_duration_seconds", "histogram",
+	  "Time spent in the phase by a run of the tool." },
+	{ "shadow_phase_entries_total", "counter",
+	  "Entries read or written in the phase." },
+	{ "shadow_phase_misses_total", "counter",
+	  "NSS lookups of the phase which found nothing." },
+	{ "shadow_runs_total", "counter",
+	  "Runs of the tool." },
+};
+
+static const char *const memory_kinds[DB_MEMORY_KINDS] = {
+	"entries",
+	"lines",
+	"objects",
+	"members",
+	"indexes",
+};
+
+static const char *const buckets[] = {
+	"0.001", "0.01", "0.1", "1", "10", "+Inf"
+};
+
+static struct {
+	char *db;
+	unsigned long entries;
+	unsigned long long bytes[DB_MEMORY_KINDS];
+	unsigned long long peak;
+} dbs[METRICS_DBS];
+static size_t db_count = 0;
+
+/*
+ * db_slot - Index of the database in dbs, which is added if needed, or
+ * -1 if there is no room.
+ */
+static int db_slot (const char *db)
+{
+	size_t i;
+
+	for (i = 0; i < db_count; i++) {
+		if (strcmp (dbs[i].db, db) == 0) {
+			return (int) i;
+		}
+	}
+	if (db_count < METRICS_DBS) {
+		dbs[db_count].db = strdup (db);
+		if (NULL != dbs[db_count].db) {
+			db_count++;
+			return (int) (db_count - 1);
+		}
+	}
+	return -1;
+}
+
+/*
+ * metrics_db_entries - Note the number of entries of a database which
+ * was opened.
+ */
+void metrics_db_entries (const char *db, unsigned long entries)
+{
+	int i = db_slot (db);
+
+	if (i >= 0) {
+		dbs[i].entries = entries;
+	}
+}
+
+/*
+ * metrics_db_memory - Note the memory held by a database, by kind.
+ *
+ *	The last figures are reported, with the largest total noted for
+ *	the database.
+ */
+void metrics_db_memory (const char *db,
+                        const unsigned long long bytes[DB_MEMORY_KINDS])
+{
+	unsigned long long total = 0;
+	int i = db_slot (db);
+	int k;
+
+	if (i < 0) {
+		return;
+	}
+	for (k = 0; k < DB_MEMORY_KINDS; k++) {
+		dbs[i].bytes[k] = bytes[k];
+		total += bytes[k];
+	}
+	if (total > dbs[i].peak) {
+		dbs[i].peak = total;
+	}
+}
+
+/*
+ * max_rss - Peak resident size of the process, in bytes (0 if unknown).
+ */
+static unsigned long long max_rss (void)
+{
+	struct rusage ru;
+
+	if (getrusage (RUSAGE_SELF, &ru) != 0) {
+		return 0;
+	}
+	/* In kilobytes */
+	return (unsigned long long) ru.ru_maxrss * 1024ULL;
+}
+
+/*
+ * metrics_format_memory - Format the memory held by each database,
+ * and the peak resident size, for LOG_TIMINGS:
+ *
+ *	db=/etc/group entries=1840 lines=10240 objects=3312 members=960
+ *	indexes=2048 peak=18400 max_rss=3493888
+ *
+ *	It returns the length of the string, 0 if no database was noted.
+ */
+size_t metrics_format_memory (char *buf, size_t size)
+{
+	size_t len = 0;
+	size_t i;
+	int k, n;
+
+	buf[0] = '\0';
+	for (i = 0; i < db_count; i++) {
+		if (0 == dbs[i].peak) {
+			continue;
+		}
+		n = snprintf (buf + len, size - len, " db=%s", dbs[i].db);
+		for (k = 0; (n > 0) && (k < DB_MEMORY_KINDS); k++) {
+			len += strlen (buf + len);
+			n = snprintf (buf + len, size - len, " %s=%llu",
+			              memory_kinds[k], dbs[i].bytes[k]);
+		}
+		if (n > 0) {
+			len += strlen (buf + len);
+			n = snprintf (buf + len, size - len, " peak=%llu",
+			              dbs[i].peak);
+		}
+		if (n < 0) {
+			return len;
+		}
+		len += strlen (buf + len);
+	}
+	if (0 != len) {
+		(void) snprintf (buf + len, size - len, " max_rss=%llu",
+		                 max_rss ());
+		len += strlen (buf + len);
+	}
+	return len;
+}
+
+/*
+ * label_value - Copy s to buf, as a label value.
+ */
+static void label_value (char *buf, size_t size, const char *s)
+{
+	size_t i;
+
+	for (i = 0; ('\0' != s[i]) && (i + 1 < size); i++) {
+		buf[i] = (   ('"' == s[i]) || ('\\' == s[i])
+		          || ('\n' == s[i])) ? '_' : s[i];
+	}
+	buf[i] = '\0';
+}
+
+/*
+ * family_of - Index of the family of the metric key, -1 if it is not
+ * one of ours.
+ */
+static int family_of (const char *key)
+{
+	size_t i, len;
+
+	for (i = 0; i < sizeof families / sizeof families[0]; i++) {
+		len = strlen (families[i].name);
+		if (   (strncmp (key, families[i].name, len) == 0)
+		    && (   ('{' == key[len])
+		        || (   ('_' == key[len])
+		            && (strcmp (families[i].type, "histogram") == 0)))) {
+			return (int) i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * metric_add - Add value to the metric key, or set it to value.
+ *
+ *	The metric is created if needed. It is dropped if memory is
+ *	exhausted.
+ */
+static void metric_add (struct metrics *ms, const char *key,
+                        double value, bool set)
+{
+	size_t i;
+
+	for (i = 0; i < ms->count; i++) {
+		if (strcmp (ms->m[i].key, key) == 0) {
+			ms->m[i].value = set ? value : ms->m[i].value + value;
+			return;
+		}
+	}
+
+	if (ms->count == ms->size) {
+		size_t size = (0 == ms->size) ? 64 : ms->size * 2;
+		struct metric *m;
+
+		m = realloc (ms->m, size * sizeof (*m));
+		if (NULL == m) {
+			return;
+		}
+		ms->m = m;
+		ms->size = size;
+	}
+	ms->m[ms->count].key = strdup (key);
+	if (NULL != ms->m[ms->count].key) {
+		ms->m[ms->count].value = value;
+		ms->count++;
+	}
+}
+
+/*
+ * metric_cmp - Sort the metrics by family, then by labels, with the
+ * buckets of a histogram by increasing bound.
+ */
+static int metric_cmp (const void *p1, const void *p2)
+{
+	const char *k1 = ((const struct metric *) p1)->key;
+	const char *k2 = ((const struct metric *) p2)->key;
+	const char *le1 = strstr (k1, "le=\"");
+	const char *le2 = strstr (k2, "le=\"");
+
+	if (   (NULL != le1) && (NULL != le2)
+	    && ((le1 - k1) == (le2 - k2))
+	    && (strncmp (k1, k2, (size_t) (le1 - k1)) == 0)) {
+		/* strtod() parses +Inf */
+		double b1 = strtod (le1 + 4, NULL);
+		double b2 = strtod (le2 + 4, NULL);
+
+		return (b1 < b2) ? -1 : ((b1 > b2) ? 1 : 0);
+	}
+	return strcmp (k1, k2);
+}
+
+/*
+ * metrics_read - Read the metrics of a previous run.
+ *
+ *	The lines which are not one of our metrics are dropped.
+ */
+static void metrics_read (FILE *fp, struct metrics *ms)
+{
+	char line[1024];
+
+	while (fgets (line, (int) sizeof line, fp) == line) {
+		char *sep, *end;
+		double value;
+
+		if (('#' == line[0]) || (NULL == strchr (line, '\n'))) {
+			continue;
+		}
+		sep = strrchr (line, ' ');
+		if (NULL == sep) {
+			continue;
+		}
+		*sep = '\0';
+		value = strtod (sep + 1, &end);
+		if ((end == sep + 1) || (family_of (line) < 0)) {
+			continue;
+		}
+		metric_add (ms, line, value, true);
+	}
+}
+
+/*
+ * observe - Add a run which spent ns in phase to the histogram.
+ */
+static void observe (struct metrics *ms, const char *tool,
+                     const char *phase, unsigned long long ns)
+{
+	double seconds = (double) ns / 1e9;
+	char key[256];
+	size_t i;
+
+	for (i = 0; i < sizeof buckets / sizeof buckets[0]; i++) {
+		(void) snprintf (key, sizeof key,
+		                 "shadow_phase_duration_seconds_bucket"
+		                 "{tool=\"%s\",phase=\"%s\",le=\"%s\"}",
+		                 tool, phase, buckets[i]);
+		metric_add (ms, key,
+		            (seconds <= strtod (buckets[i], NULL)) ? 1 : 0,
+		            false);
+	}
+	(void) snprintf (key, sizeof key,
+	                 "shadow_phase_duration_seconds_sum"
+	                 "{tool=\"%s\",phase=\"%s\"}", tool, phase);
+	metric_add (ms, key, seconds, false);
+	(void) snprintf (key, sizeof key,
+	                 "shadow_phase_duration_seconds_count"
+	                 "{tool=\"%s\",phase=\"%s\"}", tool, phase);
+	metric_add (ms, key, 1, false);
+}
+
+/*
+ * metrics_add_run - Add the totals of this run to the metrics.
+ */
+static void metrics_add_run (struct metrics *ms, const char *tool)
+{
+	unsigned long long commit_ns = 0;
+	bool commit = false;
+	char key[1024];
+	char db[512];
+	unsigned long long rss;
+	int i, k;
+	size_t j;
+
+	(void) snprintf (key, sizeof key,
+	                 "shadow_runs_total{tool=\"%s\"}", tool);
+	metric_add (ms, key, 1, false);
+	rss = max_rss ();
+	if (0 != rss) {
+		(void) snprintf (key, sizeof key,
+		                 "shadow_max_rss_bytes{tool=\"%s\"}", tool);
+		metric_add (ms, key, (double) rss, true);
+	}
+
+	for (i = 0; i < TIMING_PHASES; i++) {
+		const struct timing_totals *t;
+		const char *phase;
+
+		t = timing_totals ((enum timing_phase) i);
+		if (0 == t->calls) {
+			continue;
+		}
+		phase = timing_phase_name ((enum timing_phase) i);
+		(void) snprintf (key, sizeof key,
+		                 "shadow_phase_calls_total"
+		                 "{tool=\"%s\",phase=\"%s\"}", tool, phase);
+		metric_add (ms, key, (double) t->calls, false);
+		(void) snprintf (key, sizeof key,
+		                 "shadow_phase_entries_total"
+		                 "{tool=\"%s\",phase=\"%s\"}", tool, phase);
+		metric_add (ms, key, (double) t->entries, false);
+		(void) snprintf (key, sizeof key,
+		                 "shadow_phase_bytes_total"
+		                 "{tool=\"%s\",phase=\"%s\"}", tool, phase);
+		metric_add (ms, key, (double) t->bytes, false);
+		if (0 != t->misses) {
+			(void) snprintf (key, sizeof key,
+			                 "shadow_phase_misses_total"
+			                 "{tool=\"%s\",phase=\"%s\"}",
+			                 tool, phase);
+			metric_add (ms, key, (double) t->misses, false);
+		}
+		observe (ms, tool, phase, t->ns);
+
+		switch (i) {
+		case TIMING_BACKUP:
+		case TIMING_WRITE:
+		case TIMING_FSYNC:
+		case TIMING_RENAME:
+		case TIMING_JOURNAL:
+			commit = true;
+			commit_ns += t->ns;
+			break;
+		default:
+			break;
+		}
+	}
+	if (commit) {
+		observe (ms, tool, "commit", commit_ns);
+	}
+
+	for (j = 0; j < db_count; j++) {
+		label_value (db, sizeof db, dbs[j].db);
+		(void) snprintf (key, sizeof key,
+		                 "shadow_db_entries{tool=\"%s\",db=\"%s\"}",
+		                 tool, db);
+		metric_add (ms, key, (double) dbs[j].entries, true);
+		if (0 == dbs[j].peak) {
+			continue;
+		}
+		for (k = 0; k < DB_MEMORY_KINDS; k++) {
+			(void) snprintf (key, sizeof key,
+			                 "shadow_db_bytes"
+			                 "{tool=\"%s\",db=\"%s\",kind=\"%s\"}",
+			                 tool, db, memory_kinds[k]);
+			metric_add (ms, key, (double) dbs[j].bytes[k], true);
+		}
+		(void) snprintf (key, sizeof key,
+		                 "shadow_db_peak_bytes{tool=\"%s\",db=\"%s\"}",
+		                 tool, db);
+		metric_add (ms, key, (double) dbs[j].peak, true);
+	}
+}
+
+/*
+ * metrics_print - Write the metrics, sorted, in the text format of
+ * Prometheus.
+ */
+static bool metrics_print (FILE *fp, struct metrics *ms)
+{
+	int prev = -1;
+	size_t i;
+
+	qsort (ms->m, ms->count, sizeof (ms->m[0]), metric_cmp);
+	for (i = 0; i < ms->count; i++) {
+		double v = ms->m[i].value;
+		int f = family_of (ms->m[i].key);
+
+		if (f != prev) {
+			(void) fprintf (fp, "# HELP %s %s\n# TYPE %s %s\n",
+			                families[f].name, families[f].help,
+			                families[f].name, families[f].type);
+			prev = f;
+		}
+		if (   (v >= 0) && (v < 1e15)
+		    && (v == (double) (unsigned long long) v)) {
+			(void) fprintf (fp, "%s %llu\n",
+			                ms->m[i].key, (unsigned long long) v);
+		} else {
+			(void) fprintf (fp, "%s %.9f\n", ms->m[i].key, v);
+		}
+	}
+	return (ferror (fp) == 0);
+}
+
+/*
+ * metrics_write - Add the totals of this run to
+ * <dir>/shadow_<tool>.prom.
+ *
+ *	The errors are ignored: the metrics must not make the tool fail.
+ */
+void metrics_write (const char *dir)
+{
+	struct metrics ms = { NULL, 0, 0 };
+	char tool[64];
+	char path[1024], tmp[1024], lock[1024];
+	int lockfd, fd;
+	size_t i;
+	FILE *fp;
+
+	label_value (tool, sizeof tool, Prog);
+	if (   (NULL != strchr (tool, '/'))
+	    || (snprintf (path, sizeof path, "%s/shadow_%s.prom",
+	                  dir, tool) >= (int) sizeof path)
+	    || (snprintf (tmp, sizeof tmp, "%s.XXXXXX",
+	                  path) >= (int) sizeof tmp)
+	    || (snprintf (lock, sizeof lock, "%s/.shadow_%s.lock",
+	                  dir, tool) >= (int) sizeof lock)) {
+		return;
+	}
+
+	lockfd = open (lock, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (lockfd < 0) {
+		return;
+	}
+	while (flock (lockfd, LOCK_EX) != 0) {
+		if (EINTR != errno) {
+			(void) close (lockfd);
+			return;
+		}
+	}
+
+	fp = fopen (path, "r");
+	if (NULL != fp) {
+		metrics_read (fp, &ms);
+		(void) fclose (fp);
+	}
+	metrics_add_run (&ms, tool);
+
+	fd = mkstemp (tmp);
+	if (fd >= 0) {
+		fp = fdopen (fd, "w");
+		if (NULL == fp) {
+			(void) close (fd);
+			(void) unlink (tmp);
+		} else {
+			bool ok = (fchmod (fd, 0644) == 0)
+			          && metrics_print (fp, &ms);
+
+			if (   (fclose (fp) != 0) || !ok
+			    || (rename (tmp, path) != 0)) {
+				(void) unlink (tmp);
+			}
+		}
+	}
+
+	(void) close (lockfd);
+	for (i = 0; i < ms.count; i++) {
+		free (ms.m[i].key);
+	}
+	free (ms.m);
+}
@@ -0,0 +1,32 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <config.h>
+
+/*
+ * Metrics of the tools, for the textfile collector of the Prometheus
+ * node exporter (METRICS_DIR)
+ *
+ * When the program exits, the totals of the timed phases (see timing.h)
+ * are added to the counters and histograms of <METRICS_DIR>/shadow_<tool>.prom.
+ */
+extern void metrics_db_entries (const char *db, unsigned long entries);
+
+/*
+ * Memory held by a loaded database (see commonio.c), by kind.
+ */
+enum db_memory_kind {
+	DB_MEMORY_ENTRIES,	/* the nodes of the list of entries */
+	DB_MEMORY_LINES,	/* the raw lines (file mapping and arena) */
+	DB_MEMORY_OBJECTS,	/* the parsed structures and their strings */
+	DB_MEMORY_MEMBERS,	/* the lists of members and administrators */
+	DB_MEMORY_INDEXES,	/* the hash tables of the lookups */
+	DB_MEMORY_KINDS
+};
+
+extern void metrics_db_memory (const char *db,
+                               const unsigned long long bytes[DB_MEMORY_KINDS]);
+extern size_t metrics_format_memory (char *buf, size_t size);
+extern void metrics_write (const char *dir);
+
+#endif
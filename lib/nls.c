@@ -0,0 +1,67 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdlib.h>
+#include "defines.h"
+#include "prototypes.h"
+
+/*
+ * Deferred loading of the locale
+ *
+ * su, login, newgrp and sg are run very often by scripts, which never
+ * see a translated message. Instead of setting the locale when they
+ * start, they call nls_defer(): the locale and the message catalog are
+ * then only loaded by the first translated message (see _() in
+ * defines.h), or by nls_load() before something else needs the locale
+ * (for example the prompts of the PAM modules).
+ */
+
+static bool nls_pending = false;
+static /*@null@*/const char *nls_dir = NULL;
+
+/*
+ * nls_defer - load the locale with the first translated message
+ *
+ *	localedir is the directory of the message catalogs.
+ */
+void nls_defer (const char *localedir)
+{
+	nls_dir = localedir;
+	nls_pending = true;
+}
+
+/*
+ * nls_load - set the locale from the environment, and bind the message
+ *            catalog
+ *
+ *	It can be called again after a change of the environment.
+ */
+void nls_load (void)
+{
+	nls_pending = false;
+	(void) setlocale (LC_ALL, "");
+	if (NULL != nls_dir) {
+		(void) bindtextdomain (PACKAGE, nls_dir);
+	}
+	(void) textdomain (PACKAGE);
+}
+
+#ifdef ENABLE_NLS
+/*@observer@*/char *nls_gettext (const char *msgid)
+{
+	if (nls_pending) {
+		nls_load ();
+	}
+	return dgettext (NULL, msgid);
+}
+
+/*@observer@*/char *nls_ngettext (const char *msgid1, const char *msgid2,
+                                  unsigned long n)
+{
+	if (nls_pending) {
+		nls_load ();
+	}
+	return dngettext (NULL, msgid1, msgid2, n);
+}
+#endif				/* ENABLE_NLS */
@@ -3,20 +3,163 @@
 #include <config.h>
 #ifdef USE_NSCD
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include "exitcodes.h"
 #include "defines.h"
 #include "prototypes.h"
 #include "nscd.h"
+#include "timing.h"
 
 #define MSG_NSCD_FLUSH_CACHE_FAILED "%s: Failed to flush the nscd cache.\n"
 
+/* The protocol of the nscd socket, as used by nscd -i */
+#define NSCD_SOCKET	"/var/run/nscd/socket"
+#define NSCD_VERSION	2
+#define NSCD_INVALIDATE	10
+
+struct nscd_request {
+	int32_t version;
+	int32_t type;
+	int32_t key_len;
+};
+
+static int invalidate (const char *service);
+static int flush_cache (const char *service);
+static int spawn_nscd (const char *service);
+
 /*
  * nscd_flush_cache - flush specified service buffer in nscd cache
  */
 int nscd_flush_cache (const char *service)
+{
+	struct timespec start;
+	int ret;
+
+	timing_start (&start);
+	ret = flush_cache (service);
+	timing_stop (TIMING_NSCD, &start, 0, 0);
+	return ret;
+}
+
+/*
+ * nscd_flush_caches - flush the passwd and/or group buffers in nscd cache
+ *
+ *	dbflags is a combination of NSCD_DB_PASSWD and NSCD_DB_GROUP.
+ *
+ *	If nscd is not running, the other buffers are not tried.
+ */
+int nscd_flush_caches (int dbflags)
+{
+	const char *services[2];
+	struct timespec start;
+	size_t n = 0, i;
+	int ret = 0;
+
+	if ((dbflags & NSCD_DB_PASSWD) != 0) {
+		services[n++] = "passwd";
+	}
+	if ((dbflags & NSCD_DB_GROUP) != 0) {
+		services[n++] = "group";
+	}
+
+	timing_start (&start);
+	for (i = 0; i < n; i++) {
+		int rv = invalidate (services[i]);
+
+		if (0 == rv) {
+			break;	/* nscd is not running */
+		}
+		if ((rv < 0) && (spawn_nscd (services[i]) != 0)) {
+			ret = -1;
+		}
+	}
+	timing_stop (TIMING_NSCD, &start, 0, 0);
+	return ret;
+}
+
+/*
+ * invalidate - ask nscd to invalidate the buffer of service through its
+ *              socket, without spawning nscd -i
+ *
+ *	It returns 1 if the buffer was invalidated, 0 if nscd is not
+ *	running, and -1 if nscd -i should be used instead.
+ */
+static int invalidate (const char *service)
+{
+	struct sockaddr_un addr;
+	struct nscd_request req;
+	struct iovec iov[2];
+	struct msghdr msg;
+	int32_t resp;
+	ssize_t n;
+	size_t len;
+	int fd;
+
+	len = strlen (service) + 1;
+	memzero (&addr, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, NSCD_SOCKET);
+
+	fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0) {
+		int err = errno;
+
+		(void) close (fd);
+		if ((ENOENT == err) || (ECONNREFUSED == err)) {
+			return 0;
+		}
+		return -1;
+	}
+
+	req.version = NSCD_VERSION;
+	req.type = NSCD_INVALIDATE;
+	req.key_len = (int32_t) len;
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof (req);
+	iov[1].iov_base = (void *) service;
+	iov[1].iov_len = len;
+	memzero (&msg, sizeof (msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	do {
+		n = sendmsg (fd, &msg, MSG_NOSIGNAL);
+	} while ((n < 0) && (EINTR == errno));
+	if (n != (ssize_t) (sizeof (req) + len)) {
+		(void) close (fd);
+		return -1;
+	}
+
+	/* nscd does not answer if the request is denied */
+	do {
+		n = read (fd, &resp, sizeof (resp));
+	} while ((n < 0) && (EINTR == errno));
+	(void) close (fd);
+	if ((n != (ssize_t) sizeof (resp)) || (0 != resp)) {
+		return -1;
+	}
+	return 1;
+}
+
+static int flush_cache (const char *service)
+{
+	if (invalidate (service) >= 0) {
+		return 0;
+	}
+	return spawn_nscd (service);
+}
+
+static int spawn_nscd (const char *service)
 {
 	int status, code;
 	const char *cmd = "/usr/sbin/nscd";
@@ -1,13 +1,19 @@
 #ifndef _NSCD_H_
 #define _NSCD_H_
 
+#define NSCD_DB_PASSWD	0x001
+#define NSCD_DB_GROUP	0x002
+
 /*
  * nscd_flush_cache - flush specified service buffer in nscd cache
+ * nscd_flush_caches - flush the passwd and/or group buffers in nscd cache
  */
 #ifdef	USE_NSCD
 extern int nscd_flush_cache (const char *service);
+extern int nscd_flush_caches (int dbflags);
 #else
 #define nscd_flush_cache(service) (0)
+#define nscd_flush_caches(dbflags) ((void) (dbflags), 0)
 #endif
 
 #endif
@@ -0,0 +1,82 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <pwd.h>
+#include <grp.h>
+#include <shadow.h>
+#include "prototypes.h"
+#include "defines.h"
+#include "timing.h"
+
+/*
+ * Accounting of the NSS lookups
+ *
+ * The lookups of the users and groups may be remote (LDAP, sssd, ...)
+ * requests. Each lookup is counted in the phase of its kind (getpwnam,
+ * getpwuid, getgrnam, getgrgid, getspnam), with the time it took, as an
+ * entry when it found one, and as a miss otherwise. They are reported
+ * with LOG_TIMINGS and METRICS_DIR, like the other phases:
+ *
+ *	timings: getpwnam=0.012003s getpwnam_calls=40 getpwnam_entries=38
+ *	         getpwnam_misses=2 ...
+ *
+ * The timed_* functions are the non reentrant lookups, for the callers
+ * which use the static result directly. The x* functions (see
+ * xgetXXbyYY.c) count their lookups in the same phases.
+ */
+
+/*@observer@*/ /*@null@*/struct passwd *timed_getpwnam (const char *name)
+{
+	struct timespec start;
+	struct passwd *pw;
+
+	timing_start (&start);
+	pw = getpwnam (name);
+	timing_stop_lookup (TIMING_GETPWNAM, &start, NULL != pw);
+	return pw;
+}
+
+/*@observer@*/ /*@null@*/struct passwd *timed_getpwuid (uid_t uid)
+{
+	struct timespec start;
+	struct passwd *pw;
+
+	timing_start (&start);
+	pw = getpwuid (uid);
+	timing_stop_lookup (TIMING_GETPWUID, &start, NULL != pw);
+	return pw;
+}
+
+/*@observer@*/ /*@null@*/struct group *timed_getgrnam (const char *name)
+{
+	struct timespec start;
+	struct group *gr;
+
+	timing_start (&start);
+	gr = getgrnam (name);
+	timing_stop_lookup (TIMING_GETGRNAM, &start, NULL != gr);
+	return gr;
+}
+
+/*@observer@*/ /*@null@*/struct group *timed_getgrgid (gid_t gid)
+{
+	struct timespec start;
+	struct group *gr;
+
+	timing_start (&start);
+	gr = getgrgid (gid);
+	timing_stop_lookup (TIMING_GETGRGID, &start, NULL != gr);
+	return gr;
+}
+
+/*@observer@*/ /*@null@*/struct spwd *timed_getspnam (const char *name)
+{
+	struct timespec start;
+	struct spwd *sp;
+
+	timing_start (&start);
+	sp = getspnam (name);
+	timing_stop_lookup (TIMING_GETSPNAM, &start, NULL != sp);
+	return sp;
+}
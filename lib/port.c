@@ -40,8 +40,17 @@
 #include "defines.h"
 #include "prototypes.h"
 #include "port.h"
+#include "accesstab.h"
 
-static FILE *ports;
+static struct access_table table = { PORTS, "," };
+
+/*
+ * The entries of /etc/porttime, compiled from the rules of the table.
+ * The names and users point to the tokens of the rules.
+ */
+static /*@null@*/struct port *ports = NULL;
+static size_t nports = 0;
+static struct arena ports_arena;
 
 /*
  * portcmp - compare the name of a port to a /etc/porttime entry
@@ -73,284 +82,183 @@ static int portcmp (const char *pattern, const char *port)
 }
 
 /*
- * setportent - open /etc/porttime file or rewind
+ * parse_time - parse a time entry of /etc/porttime
  *
- *	the /etc/porttime file is rewound if already open, or
- *	opened for reading.
- */
-
-static void setportent (void)
-{
-	if (NULL != ports) {
-		rewind (ports);
-	} else {
-		ports = fopen (PORTS, "r");
-	}
-}
-
-/*
- * endportent - close the /etc/porttime file
+ *	The valid days are 'Su', 'Mo', 'Tu', 'We', 'Th', 'Fr', and 'Sa'.
+ *	In addition, the value 'Al' represents all 7 days, and 'Wk'
+ *	represents the 5 weekdays.
  *
- *	the /etc/porttime file is closed and the ports variable set
- *	to NULL to indicate that the /etc/porttime file is no longer
- *	open.
- */
-
-static void endportent (void)
-{
-	if (NULL != ports) {
-		(void) fclose (ports);
-	}
-
-	ports = (FILE *) 0;
-}
-
-/*
- * getportent - read a single entry from /etc/porttime
+ *	Times are given as HHMM-HHMM.  The ending time may be before
+ *	the starting time.  Days are presumed to wrap at 0000.
  *
- *	the next line in /etc/porttime is converted to a (struct port)
- *	and a pointer to a static (struct port) is returned to the
- *	invoker.  NULL is returned on either EOF or error.  errno is
- *	set to EINVAL on error to distinguish the two conditions.
+ *	It returns 0 on success, -1 if the entry is invalid, and -2 if the
+ *	days are invalid.
  */
-
-static struct port *getportent (void)
+static int parse_time (const char *cp, /*@out@*/struct pt_time *pt)
 {
-	static struct port port;	/* static struct to point to         */
-	static char buf[BUFSIZ];	/* some space for stuff              */
-	static char *ttys[PORT_TTY + 1];	/* some pointers to tty names     */
-	static char *users[PORT_IDS + 1];	/* some pointers to user ids     */
-	static struct pt_time ptimes[PORT_TIMES + 1];	/* time ranges         */
-	char *cp;		/* pointer into line                 */
 	int dtime;		/* scratch time of day               */
-	int i, j;
-	int saveerr = errno;	/* errno value on entry              */
-
-	/*
-	 * If the ports file is not open, open the file.  Do not rewind
-	 * since we want to search from the beginning each time.
-	 */
-
-	if (NULL == ports) {
-		setportent ();
-	}
-
-	if (NULL == ports) {
-		errno = saveerr;
-		return 0;
-	}
+	int i;
 
 	/*
-	 * Common point for beginning a new line -
-	 *
-	 *      - read a line, and NUL terminate
-	 *      - skip lines which begin with '#'
-	 *      - parse off the tty names
-	 *      - parse off a list of user names
-	 *      - parse off a list of days and times
+	 * Start off with no days of the week
 	 */
 
-      again:
+	pt->t_days = 0;
 
 	/*
-	 * Get the next line and remove the last character, which
-	 * is a '\n'.  Lines which begin with '#' are all ignored.
+	 * Check each two letter sequence to see if it is
+	 * one of the abbreviations for the days of the
+	 * week or the other two values.
 	 */
 
-	if (fgets (buf, (int) sizeof buf, ports) == 0) {
-		errno = saveerr;
-		return 0;
-	}
-	if ('#' == buf[0]) {
-		goto again;
+	for (i = 0;
+	     ('\0' != cp[i]) && ('\0' != cp[i + 1]) && isalpha (cp[i]);
+	     i += 2) {
+		switch ((cp[i] << 8) | (cp[i + 1])) {
+		case ('S' << 8) | 'u':
+			pt->t_days |= 01;
+			break;
+		case ('M' << 8) | 'o':
+			pt->t_days |= 02;
+			break;
+		case ('T' << 8) | 'u':
+			pt->t_days |= 04;
+			break;
+		case ('W' << 8) | 'e':
+			pt->t_days |= 010;
+			break;
+		case ('T' << 8) | 'h':
+			pt->t_days |= 020;
+			break;
+		case ('F' << 8) | 'r':
+			pt->t_days |= 040;
+			break;
+		case ('S' << 8) | 'a':
+			pt->t_days |= 0100;
+			break;
+		case ('W' << 8) | 'k':
+			pt->t_days |= 076;
+			break;
+		case ('A' << 8) | 'l':
+			pt->t_days |= 0177;
+			break;
+		default:
+			return -2;
+		}
 	}
 
 	/*
-	 * Get the name of the TTY device.  It is the first colon
-	 * separated field, and is the name of the TTY with no
-	 * leading "/dev".  The entry '*' is used to specify all
-	 * TTY devices.
+	 * The default is 'Al' if no days were seen.
 	 */
 
-	buf[strlen (buf) - 1] = 0;
-
-	port.pt_names = ttys;
-	for (cp = buf, j = 0; j < PORT_TTY; j++) {
-		port.pt_names[j] = cp;
-		while (('\0' != *cp) && (':' != *cp) && (',' != *cp)) {
-			cp++;
-		}
-
-		if ('\0' == *cp) {
-			goto again;	/* line format error */
-		}
-
-		if (':' == *cp) {	/* end of tty name list */
-			break;
-		}
-
-		if (',' == *cp) {	/* end of current tty name */
-			*cp++ = '\0';
-		}
+	if (0 == i) {
+		pt->t_days = 0177;
 	}
-	*cp = '\0';
-	cp++;
-	port.pt_names[j + 1] = (char *) 0;
 
 	/*
-	 * Get the list of user names.  It is the second colon
-	 * separated field, and is a comma separated list of user
-	 * names.  The entry '*' is used to specify all usernames.
-	 * The last entry in the list is a (char *) 0 pointer.
+	 * The start and end times are separated from each
+	 * other by a '-'.  The times are four digit numbers
+	 * representing the times of day.
 	 */
 
-	if (':' != *cp) {
-		port.pt_users = users;
-		port.pt_users[0] = cp;
-
-		for (j = 1; ':' != *cp; cp++) {
-			if ((',' == *cp) && (j < PORT_IDS)) {
-				*cp = '\0';
-				cp++;
-				port.pt_users[j] = cp;
-				j++;
-			}
-		}
-		port.pt_users[j] = 0;
-	} else {
-		port.pt_users = 0;
+	for (dtime = 0; ('\0' != cp[i]) && isdigit (cp[i]); i++) {
+		dtime = dtime * 10 + cp[i] - '0';
 	}
 
-	if (':' != *cp) {
-		goto again;
+	if (('-' != cp[i]) || (dtime > 2400) || ((dtime % 100) > 59)) {
+		return -1;
 	}
+	pt->t_start = dtime;
+	cp = cp + i + 1;
 
-	*cp = '\0';
-	cp++;
-
-	/*
-	 * Get the list of valid times.  The times field is the third
-	 * colon separated field and is a list of days of the week and
-	 * times during which this port may be used by this user.  The
-	 * valid days are 'Su', 'Mo', 'Tu', 'We', 'Th', 'Fr', and 'Sa'.
-	 *
-	 * In addition, the value 'Al' represents all 7 days, and 'Wk'
-	 * represents the 5 weekdays.
-	 *
-	 * Times are given as HHMM-HHMM.  The ending time may be before
-	 * the starting time.  Days are presumed to wrap at 0000.
-	 */
-
-	if ('\0' == *cp) {
-		port.pt_times = 0;
-		return &port;
+	for (dtime = 0, i = 0;
+	     ('\0' != cp[i]) && isdigit (cp[i]);
+	     i++) {
+		dtime = dtime * 10 + cp[i] - '0';
 	}
 
-	port.pt_times = ptimes;
+	if (('\0' != cp[i]) || (dtime > 2400) || ((dtime % 100) > 59)) {
+		return -1;
+	}
+	pt->t_end = dtime;
 
-	/*
-	 * Get the next comma separated entry
-	 */
+	return 0;
+}
 
-	for (j = 0; ('\0' != *cp) && (j < PORT_TIMES); j++) {
+/*
+ * compile_ports - compile the rules of /etc/porttime
+ *
+ *	Each rule consists of a list of TTY device names, a list of user
+ *	names, and a list of times.  Rules with a format error are
+ *	ignored.  Invalid days end the file.
+ */
 
-		/*
-		 * Start off with no days of the week
-		 */
+static int compile_ports (void)
+{
+	size_t i, j;
 
-		port.pt_times[j].t_days = 0;
+	arena_release (&ports_arena);
+	nports = 0;
+	ports = (struct port *) arena_alloc (&ports_arena,
+	                                     (table.count + 1) * sizeof (struct port));
+	if (NULL == ports) {
+		return -1;
+	}
 
-		/*
-		 * Check each two letter sequence to see if it is
-		 * one of the abbreviations for the days of the
-		 * week or the other two values.
-		 */
+	for (i = 0; i < table.count; i++) {
+		const struct access_rule *rule = &table.rules[i];
+		const struct access_field *times;
+		struct port *port = &ports[nports];
 
-		for (i = 0;
-		     ('\0' != cp[i]) && ('\0' != cp[i + 1]) && isalpha (cp[i]);
-		     i += 2) {
-			switch ((cp[i] << 8) | (cp[i + 1])) {
-			case ('S' << 8) | 'u':
-				port.pt_times[j].t_days |= 01;
-				break;
-			case ('M' << 8) | 'o':
-				port.pt_times[j].t_days |= 02;
-				break;
-			case ('T' << 8) | 'u':
-				port.pt_times[j].t_days |= 04;
-				break;
-			case ('W' << 8) | 'e':
-				port.pt_times[j].t_days |= 010;
-				break;
-			case ('T' << 8) | 'h':
-				port.pt_times[j].t_days |= 020;
-				break;
-			case ('F' << 8) | 'r':
-				port.pt_times[j].t_days |= 040;
-				break;
-			case ('S' << 8) | 'a':
-				port.pt_times[j].t_days |= 0100;
-				break;
-			case ('W' << 8) | 'k':
-				port.pt_times[j].t_days |= 076;
-				break;
-			case ('A' << 8) | 'l':
-				port.pt_times[j].t_days |= 0177;
-				break;
-			default:
-				errno = EINVAL;
-				return 0;
-			}
+		if (rule->count != 3) {
+			continue;	/* line format error */
 		}
 
 		/*
-		 * The default is 'Al' if no days were seen.
+		 * The TTY devices have no leading "/dev".  The entry '*'
+		 * is used to specify all TTY devices, and all user names.
 		 */
 
-		if (0 == i) {
-			port.pt_times[j].t_days = 0177;
-		}
+		port->pt_names = rule->fields[0].tokens;
+		port->pt_users = (0 != rule->fields[1].count)
+		                 ? rule->fields[1].tokens : NULL;
 
 		/*
-		 * The start and end times are separated from each
-		 * other by a '-'.  The times are four digit numbers
-		 * representing the times of day.
+		 * The end of the list of times is indicated by a pair
+		 * of -1's for the start and end times.  An entry without
+		 * times never lets the user in.
 		 */
 
-		for (dtime = 0; ('\0' != cp[i]) && isdigit (cp[i]); i++) {
-			dtime = dtime * 10 + cp[i] - '0';
+		times = &rule->fields[2];
+		if (0 == times->count) {
+			port->pt_times = NULL;
+			nports++;
+			continue;
 		}
-
-		if (('-' != cp[i]) || (dtime > 2400) || ((dtime % 100) > 59)) {
-			goto again;
+		port->pt_times = (struct pt_time *)
+		                 arena_alloc (&ports_arena,
+		                              (times->count + 1) * sizeof (struct pt_time));
+		if (NULL == port->pt_times) {
+			return -1;
 		}
-		port.pt_times[j].t_start = dtime;
-		cp = cp + i + 1;
+		for (j = 0; j < times->count; j++) {
+			int ret = parse_time (times->tokens[j], &port->pt_times[j]);
 
-		for (dtime = 0, i = 0;
-		     ('\0' != cp[i]) && isdigit (cp[i]);
-		     i++) {
-			dtime = dtime * 10 + cp[i] - '0';
+			if (-2 == ret) {
+				return 0;
+			}
+			if (0 != ret) {
+				break;
+			}
 		}
-
-		if (   ((',' != cp[i]) && ('\0' != cp[i]))
-		    || (dtime > 2400)
-		    || ((dtime % 100) > 59)) {
-			goto again;
+		if (j < times->count) {
+			continue;	/* line format error */
 		}
-
-		port.pt_times[j].t_end = dtime;
-		cp = cp + i + 1;
+		port->pt_times[j].t_start = port->pt_times[j].t_end = -1;
+		nports++;
 	}
 
-	/*
-	 * The end of the list is indicated by a pair of -1's for the
-	 * start and end times.
-	 */
-
-	port.pt_times[j].t_start = port.pt_times[j].t_end = -1;
-
-	return &port;
+	return 0;
 }
 
 /*
@@ -358,20 +266,37 @@ static struct port *getportent (void)
  *
  *	getttyuser() searches the ports file for an entry with a TTY
  *	and user field both of which match the supplied TTY and
- *	user name.  The file is searched from the beginning, so the
- *	entries are treated as an ordered list.
+ *	user name.  The entries are treated as an ordered list.
+ *
+ *	The ports file is only parsed again when it changed.
  */
 
-static struct port *getttyuser (const char *tty, const char *user)
+static /*@null@*/const struct port *getttyuser (const char *tty, const char *user)
 {
+	size_t n;
 	int i, j;
-	struct port *port;
-
-	setportent ();
+	const struct port *port;
+
+	switch (access_table_load (&table)) {
+	case -1:
+		arena_release (&ports_arena);
+		ports = NULL;
+		nports = 0;
+		return NULL;
+	case 1:
+		if (compile_ports () != 0) {
+			/* Retry on the next call */
+			access_table_free (&table);
+			return NULL;
+		}
+		break;
+	default:
+		break;
+	}
 
-	while ((port = getportent ()) != NULL) {
-		if (   (0 == port->pt_names)
-		    || (0 == port->pt_users)) {
+	for (n = 0; n < nports; n++) {
+		port = &ports[n];
+		if (NULL == port->pt_users) {
 			continue;
 		}
 
@@ -381,7 +306,7 @@ static struct port *getttyuser (const char *tty, const char *user)
 			}
 		}
 
-		if (port->pt_names[i] == 0) {
+		if (NULL == port->pt_names[i]) {
 			continue;
 		}
 
@@ -392,39 +317,23 @@ static struct port *getttyuser (const char *tty, const char *user)
 			}
 		}
 
-		if (port->pt_users[j] != 0) {
-			break;
+		if (NULL != port->pt_users[j]) {
+			return port;
 		}
 	}
-	endportent ();
-	return port;
+	return NULL;
 }
 
 /*
- * isttytime - tell if a given user may login at a particular time
- *
- *	isttytime searches the ports file for an entry which matches
- *	the user name and TTY given.
+ * port_allows - tell if the times of the entry pp allow a login at when
  */
 
-bool isttytime (const char *id, const char *port, time_t when)
+static bool port_allows (const struct port *pp, time_t when)
 {
 	int i;
 	int dtime;
-	struct port *pp;
 	struct tm *tm;
 
-	/*
-	 * Try to find a matching entry for this user.  Default to
-	 * letting the user in - there are plenty of ways to have an
-	 * entry to match all users.
-	 */
-
-	pp = getttyuser (port, id);
-	if (NULL == pp) {
-		return true;
-	}
-
 	/*
 	 * The entry is there, but has no time entries - don't
 	 * ever let them login.
@@ -475,3 +384,99 @@ bool isttytime (const char *id, const char *port, time_t when)
 	return false;
 }
 
+/*
+ * isttytime - tell if a given user may login at a particular time
+ *
+ *	isttytime searches the ports file for an entry which matches
+ *	the user name and TTY given.
+ */
+
+bool isttytime (const char *id, const char *port, time_t when)
+{
+	const struct port *pp;
+
+	/*
+	 * Try to find a matching entry for this user.  Default to
+	 * letting the user in - there are plenty of ways to have an
+	 * entry to match all users.
+	 */
+
+	pp = getttyuser (port, id);
+	if (NULL == pp) {
+		return true;
+	}
+
+	return port_allows (pp, when);
+}
+
+/*
+ * denied_at - check if pp denies a login at the time dtime (HHMM) of
+ *             the day-th day after when
+ *
+ *	It returns the earliest of that time and end, if the login is
+ *	denied at that time after when, or end otherwise.
+ */
+
+static time_t denied_at (const struct port *pp, time_t when,
+                         int day, int dtime, time_t end)
+{
+	struct tm tm = *localtime (&when);
+	time_t t;
+
+	tm.tm_mday += day;
+	tm.tm_hour = dtime / 100;
+	tm.tm_min = dtime % 100;
+	tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	t = mktime (&tm);
+	if (   (t <= when)
+	    || (((time_t) -1 != end) && (t >= end))
+	    || port_allows (pp, t)) {
+		return end;
+	}
+	return t;
+}
+
+/*
+ * ttytime_end - tell when a given user stops being allowed on a TTY
+ *
+ *	ttytime_end returns the first time, not before when, at which
+ *	isttytime() is false for the user and TTY, or (time_t) -1 if the
+ *	user is always allowed.
+ *
+ *	The times of a day only stop allowing a login at midnight, or
+ *	the minute after the end of a time entry: only these minutes of
+ *	the next week are checked.
+ */
+
+time_t ttytime_end (const char *id, const char *port, time_t when)
+{
+	const struct port *pp;
+	time_t end = (time_t) -1;
+	int day;
+	int i;
+
+	pp = getttyuser (port, id);
+	if (NULL == pp) {
+		return (time_t) -1;
+	}
+	if (!port_allows (pp, when)) {
+		return when;
+	}
+
+	for (day = 0; (day <= 7) && ((time_t) -1 == end); day++) {
+		end = denied_at (pp, when, day, 0, end);
+		for (i = 0; pp->pt_times[i].t_start != -1; i++) {
+			int dtime = pp->pt_times[i].t_end + 1;
+
+			if ((dtime % 100) == 60) {
+				dtime += 40;
+			}
+			if (dtime < 2400) {
+				end = denied_at (pp, when, day, dtime, end);
+			}
+		}
+	}
+
+	return end;
+}
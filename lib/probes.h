@@ -0,0 +1,38 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#include <config.h>
+
+/*
+ * Static probes (configure --enable-sdt)
+ *
+ * The probes of the "shadow" provider mark the entry and the return of
+ * the database and file tree operations, with the file names and the
+ * number of entries or bytes, for tracers such as bpftrace, perf,
+ * SystemTap or DTrace:
+ *
+ *	bpftrace -e 'usdt:/usr/sbin/useradd:shadow:commonio_lock__entry
+ *	             { printf("%s\n", str(arg0)); }'
+ *
+ * Without --enable-sdt, the macros are empty and their arguments are
+ * not evaluated.
+ */
+#ifdef ENABLE_SDT
+#include <sys/sdt.h>
+
+#define SHADOW_PROBE0(name)	DTRACE_PROBE (shadow, name)
+#define SHADOW_PROBE1(name, a1)	DTRACE_PROBE1 (shadow, name, a1)
+#define SHADOW_PROBE2(name, a1, a2)	DTRACE_PROBE2 (shadow, name, a1, a2)
+#define SHADOW_PROBE3(name, a1, a2, a3)	\
+	DTRACE_PROBE3 (shadow, name, a1, a2, a3)
+#define SHADOW_PROBE4(name, a1, a2, a3, a4)	\
+	DTRACE_PROBE4 (shadow, name, a1, a2, a3, a4)
+#else				/* !ENABLE_SDT */
+#define SHADOW_PROBE0(name)	do {} while (0)
+#define SHADOW_PROBE1(name, a1)	do {} while (0)
+#define SHADOW_PROBE2(name, a1, a2)	do {} while (0)
+#define SHADOW_PROBE3(name, a1, a2, a3)	do {} while (0)
+#define SHADOW_PROBE4(name, a1, a2, a3, a4)	do {} while (0)
+#endif				/* !ENABLE_SDT */
+
+#endif				/* _PROBES_H_ */
@@ -51,6 +51,7 @@
 #include <utmp.h>
 #endif
 #include <sys/types.h>
+#include <stdint.h>
 #include <pwd.h>
 #include <grp.h>
 #include <shadow.h>
@@ -76,7 +77,73 @@ extern int isexpired (const struct passwd *, /*@null@*/const struct spwd *);
 /* basename.c */
 extern /*@observer@*/const char *Basename (const char *str);
 
+/* blocklist.c */
+extern bool pass_blocklisted (const char *pass);
+extern void pass_blocklist_close (void);
+
+/* checkcache.c */
+struct check_result {
+	/*@null@*/ /*@only@*/char *name;	/* NULL for an ID */
+	id_t id;
+	bool checked;
+	bool exists;
+	/*@null@*/ /*@only@*/struct check_result *next;
+};
+struct check_cache {
+	/*@null@*/ /*@only@*/struct check_result **buckets;
+	size_t size;		/* power of 2 */
+	size_t count;
+};
+typedef void (*check_fn) (struct check_result *r);
+extern struct check_result *check_cache_get (struct check_cache *cache,
+                                             /*@null@*/const char *name,
+                                             id_t id,
+                                             /*@out@*/bool *added);
+extern void check_cache_run (struct check_cache *cache, check_fn check,
+                             int nthreads);
+extern void check_cache_free (struct check_cache *cache);
+
+/* checkstate.c */
+#define CHECK_STATE_DBS	2
+struct check_hashes {
+	/*@null@*/ /*@only@*/uint64_t *hashes;
+	size_t count;
+	size_t size;
+};
+struct check_state {
+	struct check_hashes old[CHECK_STATE_DBS];	/* from the last run */
+	struct check_hashes new[CHECK_STATE_DBS];	/* for the next run */
+};
+extern void check_state_load (/*@out@*/struct check_state *st,
+                              const char *file);
+extern bool check_state_known (const struct check_state *st, size_t db,
+                               const char *line);
+extern void check_state_add (struct check_state *st, size_t db,
+                             const char *line);
+extern int check_state_save (struct check_state *st, const char *file);
+extern void check_state_free (struct check_state *st);
+
 /* chowndir.c */
+struct uid_move;
+struct chown_map {
+	/* sorted by their old ID (from) */
+	const struct uid_move *uids;
+	size_t nuids;
+	const struct uid_move *gids;
+	size_t ngids;
+};
+struct chown_job {
+	const char *root;
+	uid_t old_uid;
+	uid_t new_uid;
+	gid_t old_gid;
+	gid_t new_gid;
+	/* if not NULL, replaces the IDs above */
+	/*@null@*/const struct chown_map *map;
+};
+extern /*@null@*/const struct uid_move *chown_map_find (
+	const struct uid_move *moves, size_t count, unsigned long id);
+extern int chown_trees (const struct chown_job *jobs, size_t count);
 extern int chown_tree (const char *root,
                        uid_t old_uid, uid_t new_uid,
                        gid_t old_gid, gid_t new_gid);
@@ -124,9 +191,63 @@ extern int copy_tree (const char *src_root, const char *dst_root,
                       bool reset_selinux,
                       uid_t old_uid, uid_t new_uid,
                       gid_t old_gid, gid_t new_gid);
+extern int copy_tree_resume (const char *src_root, const char *dst_root,
+                             bool reset_selinux,
+                             uid_t old_uid, uid_t new_uid,
+                             gid_t old_gid, gid_t new_gid);
+extern int copy_tree_cached (const char *src_root, const char *dst_root,
+                             bool reset_selinux,
+                             uid_t old_uid, uid_t new_uid,
+                             gid_t old_gid, gid_t new_gid);
+
+/* credcache.c */
+extern /*@null@*/ /*@only@*/struct passwd *cred_getpwnam (const char *name);
+extern /*@null@*/ /*@only@*/struct passwd *cred_getpwuid (uid_t uid);
+extern /*@null@*/ /*@only@*/struct spwd *cred_getspnam (const char *name);
+extern /*@null@*/ /*@only@*/struct group *cred_getgrnam (const char *name);
+extern bool cred_getgrnam_gid (const char *name, /*@out@*/gid_t *gid);
+extern /*@null@*/ /*@only@*/struct group *cred_getgrgid (gid_t gid);
+extern void cred_invalidate (void);
+
+/* cryptjobs.c */
+struct crypt_job {
+	const char *clear;
+	/*@only@*/char *salt;
+	/*@null@*//*@only@*/char *cipher;	/* NULL if crypt failed */
+	int err;			/* errno if crypt failed */
+};
+extern void crypt_jobs_run (struct crypt_job *jobs, size_t n);
+extern void crypt_jobs_free (/*@only@*/struct crypt_job *jobs, size_t n);
+
+/* dirbatch.c */
+struct dir_batch_entry {
+	ino_t ino;
+	unsigned char type;	/* DT_*, DT_UNKNOWN if not known */
+	const char *name;
+};
+struct dir_batch {
+	int fd;
+	bool eof;
+	unsigned long batches;
+	/*@null@*/ /*@only@*/char *buf;
+	size_t size;
+	/*@null@*/ /*@only@*/struct dir_batch_entry *ents;
+	size_t count;
+	size_t ents_size;
+	/*@null@*/DIR *dir;	/* without getdents64 */
+};
+extern void dir_batch_init (/*@out@*/struct dir_batch *b, int fd);
+extern ssize_t dir_batch_next (struct dir_batch *b);
+extern void dir_batch_free (struct dir_batch *b);
+extern int stat_owner (int dirfd, const char *name, /*@out@*/struct stat *sb);
 
 /* encrypt.c */
 extern /*@exposed@*//*@null@*/char *pw_encrypt (const char *, const char *);
+#if defined (HAVE_CRYPT_R) && defined (HAVE_CRYPT_H)
+struct crypt_data;
+extern /*@null@*/char *pw_encrypt_r (const char *clear, const char *salt,
+                                     struct crypt_data *data);
+#endif				/* HAVE_CRYPT_R && HAVE_CRYPT_H */
 
 /* entry.c */
 extern void pw_entry (const char *, struct passwd *);
@@ -137,28 +258,99 @@ extern void initenv (void);
 extern void set_env (int, char *const *);
 extern void sanitize_env (void);
 
+/* export.c */
+enum export_format {
+	EXPORT_NONE,
+	EXPORT_TSV,
+	EXPORT_JSON
+};
+struct export_record {
+	FILE *fp;
+	enum export_format format;
+	bool first;
+};
+extern bool export_format_parse (const char *s,
+                                 /*@out@*/enum export_format *format);
+extern void export_start (/*@out@*/struct export_record *r, FILE *fp,
+                          enum export_format format);
+extern void export_num (struct export_record *r, const char *key,
+                        long long value);
+extern void export_str (struct export_record *r, const char *key,
+                        const char *s, size_t len);
+extern void export_end (struct export_record *r);
+
+/* extsort.c */
+#define EXTSORT_MEMORY	(4 * 1024 * 1024)	/* of each sort of pwck -S */
+struct extsort_run;
+struct extsort {
+	/*@null@*/ /*@only@*/char *buf;	/* records, then their pointers */
+	size_t size;
+	size_t used;		/* by the records in memory */
+	size_t count;		/* records in memory */
+	size_t next;		/* next record in memory */
+	size_t max_record;
+	/*@null@*/FILE *spill;	/* sorted runs */
+	/*@null@*/ /*@only@*/struct extsort_run *runs;
+	size_t nruns;
+	/*@null@*/ /*@only@*/size_t *heap;	/* of the runs, when merging */
+	size_t heap_count;
+};
+extern int extsort_init (/*@out@*/struct extsort *s, size_t limit);
+extern int extsort_add (struct extsort *s, const char *key, size_t len,
+                        uint64_t value);
+extern int extsort_sort (struct extsort *s);
+extern int extsort_peek (const struct extsort *s,
+                         /*@out@*/const char **key, /*@out@*/size_t *len,
+                         /*@out@*/uint64_t *value);
+extern int extsort_pop (struct extsort *s);
+extern void extsort_free (struct extsort *s);
+extern int extsort_keycmp (const char *k1, size_t l1,
+                           const char *k2, size_t l2);
+
 /* fields.c */
 extern void change_field (char *, size_t, const char *);
 extern int valid_field (const char *, const char *);
+extern size_t count_char (const char *s, char c);
+extern size_t split_fields (char *s, char sep, char **fields, size_t max);
+extern size_t split_list (char *s, char **list);
 
 /* find_new_gid.c */
+struct id_pool;
 extern int find_new_gid (bool sys_group,
                          gid_t *gid,
                          /*@null@*/gid_t const *preferred_gid);
+extern int reserve_gids (struct id_pool *pool, bool sys_group, size_t n,
+                         gid_t *gids, /*@null@*/gid_t const *preferred_gid);
+extern int prepare_gid_pool (struct id_pool *pool, bool sys_group);
+
+/* find_new_ids.c */
+extern int reserve_ids (struct id_pool *uid_pool, struct id_pool *gid_pool,
+                        bool sys, uid_t *uid, gid_t *gid);
 
 /* find_new_uid.c */
 extern int find_new_uid (bool sys_user,
                          uid_t *uid,
                          /*@null@*/uid_t const *preferred_uid);
+extern int reserve_uids (struct id_pool *pool, bool sys_user, size_t n,
+                         uid_t *uids, /*@null@*/uid_t const *preferred_uid);
+extern int prepare_uid_pool (struct id_pool *pool, bool sys_user);
 
 #ifdef ENABLE_SUBIDS
 /* find_new_sub_gids.c */
 extern int find_new_sub_gids (const char *owner,
 			      gid_t *range_start, unsigned long *range_count);
+extern int reserve_sub_gids (size_t n, unsigned long *range_starts,
+			     unsigned long *range_count);
+
+/* find_new_sub_ids.c */
+extern int reserve_sub_ids (size_t n, unsigned long *range_starts,
+			    unsigned long *range_count);
 
 /* find_new_sub_uids.c */
 extern int find_new_sub_uids (const char *owner,
 			      uid_t *range_start, unsigned long *range_count);
+extern int reserve_sub_uids (size_t n, unsigned long *range_starts,
+			     unsigned long *range_count);
 #endif				/* ENABLE_SUBIDS */
 
 
@@ -192,15 +384,26 @@ extern int getulong (const char *numstr, /*@out@*/unsigned long int *result);
 extern /*@null@*/char *fgetsx (/*@returned@*/ /*@out@*/char *, int, FILE *);
 extern int fputsx (const char *, FILE *);
 
+/* grouplist.c */
+extern /*@null@*//*@only@*/gid_t *user_grouplist (const char *user, gid_t gid,
+                                                   /*@out@*/size_t *ngroups);
+
 /* groupio.c */
 extern void __gr_del_entry (const struct commonio_entry *ent);
-extern /*@observer@*/const struct commonio_db *__gr_get_db (void);
+extern struct commonio_db *__gr_get_db (void);
 extern /*@dependent@*/ /*@null@*/struct commonio_entry *__gr_get_head (void);
+extern bool __gr_has_duplicate (const struct commonio_entry *ent);
 extern void __gr_set_changed (void);
 
 /* groupmem.c */
 extern /*@null@*/ /*@only@*/struct group *__gr_dup (const struct group *grent);
 extern void gr_free (/*@out@*/ /*@only@*/struct group *grent);
+extern /*@null@*/ /*@only@*/struct group *__gr_dup_packed (const struct group *grent);
+extern void gr_free_packed (/*@out@*/ /*@only@*/struct group *grent);
+
+/* homevol.c */
+extern int home_clone (const char *home, uid_t uid, gid_t gid, mode_t mode);
+extern int home_drop (const char *home);
 
 /* hushed.c */
 extern bool hushed (const char *username);
@@ -218,6 +421,9 @@ extern void audit_logger (int type, const char *pgname, const char *op,
                           const char *name, unsigned int id,
                           shadow_audit_result result);
 void audit_logger_message (const char *message, shadow_audit_result result);
+extern void audit_logger_begin (void);
+extern void audit_logger_commit (void);
+extern void audit_logger_rollback (void);
 #endif
 
 /* limits.c */
@@ -226,8 +432,22 @@ extern void setup_limits (const struct passwd *);
 #endif
 
 /* list.c */
+/* Set of member names */
+struct name_set {
+	const char **slots;
+	size_t size;
+};
+extern void name_set_init (struct name_set *set, size_t n);
+extern bool name_set_add (struct name_set *set, const char *name);
+extern bool name_set_has (const struct name_set *set, const char *name);
+extern void name_set_free (struct name_set *set);
 extern /*@only@*/ /*@out@*/char **add_list (/*@returned@*/ /*@only@*/char **, const char *);
 extern /*@only@*/ /*@out@*/char **del_list (/*@returned@*/ /*@only@*/char **, const char *);
+extern /*@only@*/ /*@out@*/char **del_list_set (/*@returned@*/ /*@only@*/char **list,
+                                                const struct name_set *dels);
+extern /*@only@*/ /*@out@*/char **edit_list (/*@returned@*/ /*@only@*/char **,
+                                             /*@null@*/char *const *add,
+                                             /*@null@*/char *const *del);
 extern /*@only@*/ /*@out@*/char **dup_list (char *const *);
 extern bool is_on_list (char *const *list, const char *member);
 extern /*@only@*/char **comma_to_list (const char *);
@@ -239,6 +459,34 @@ extern void dolastlog (
 	/*@unique@*/const char *line,
 	/*@unique@*/const char *host);
 
+/* logbatch.c */
+extern void log_batch (int priority, const char *event, const char *name,
+                       const char *fmt, ...)
+	__attribute__ ((format (printf, 4, 5)));
+extern void log_batch_flush (void);
+
+/* logrecord.c */
+struct uid_keyed;
+struct log_file {
+	const char *name;
+	int fd;			/* -1 until the first access */
+	bool missing;		/* the file does not exist */
+	bool dirty;		/* written since it was opened */
+	/*@null@*/struct uid_keyed *keyed;	/* <name>.keyed, if opened */
+	bool unkeyed;		/* no <name>.keyed, all UIDs are indexed */
+};
+#define LOG_FILE_INIT(name)	{ (name), -1, false, false, NULL, false }
+#define LOG_UNKEYED_FILE_INIT(name)	{ (name), -1, false, false, NULL, true }
+extern int log_record_read (struct log_file *lf, uid_t uid,
+                            void *rec, size_t size);
+extern int log_record_write (struct log_file *lf, uid_t uid,
+                             const void *rec, size_t size);
+struct uid_move;
+extern int log_records_move (struct log_file *lf,
+                             const struct uid_move *moves,
+                             size_t count, size_t size);
+extern int log_file_close (struct log_file *lf);
+
 /* login_nopam.c */
 extern int login_access (const char *user, const char *from);
 
@@ -254,11 +502,36 @@ extern void motd (void);
 /* myname.c */
 extern /*@null@*//*@only@*/struct passwd *get_my_pwent (void);
 
+/* nls.c */
+extern void nls_defer (const char *localedir);
+extern void nls_load (void);
+
+/* nsslookup.c */
+extern /*@observer@*/ /*@null@*/struct passwd *timed_getpwnam (const char *name);
+extern /*@observer@*/ /*@null@*/struct passwd *timed_getpwuid (uid_t uid);
+extern /*@observer@*/ /*@null@*/struct group *timed_getgrnam (const char *name);
+extern /*@observer@*/ /*@null@*/struct group *timed_getgrgid (gid_t gid);
+extern /*@observer@*/ /*@null@*/struct spwd *timed_getspnam (const char *name);
+
+/* nsstab.c */
+extern /*@observer@*/const struct passwd *const *nss_passwd_list (/*@out@*/size_t *count);
+extern /*@observer@*/const struct group *const *nss_group_list (/*@out@*/size_t *count);
+extern /*@observer@*/ /*@null@*/const struct passwd *nss_getpwuid (uid_t uid);
+extern /*@observer@*/ /*@null@*/const struct group *nss_getgrgid (gid_t gid);
+
 /* pam_pass_non_interactive.c */
 #ifdef USE_PAM
 extern int do_pam_passwd_non_interactive (const char *pam_service,
                                            const char *username,
                                            const char* password);
+struct pam_passwd_job {
+	const char *name;
+	const char *password;
+	bool failed;
+};
+extern size_t do_pam_passwd_batch (const char *pam_service,
+                                   struct pam_passwd_job *jobs,
+                                   size_t count);
 #endif				/* USE_PAM */
 
 /* obscure.c */
@@ -273,6 +546,7 @@ extern void do_pam_passwd (const char *user, bool silent, bool change_expired);
 
 /* port.c */
 extern bool isttytime (const char *, const char *, time_t);
+extern time_t ttytime_end (const char *, const char *, time_t);
 
 /* prefix_flag.c */
 extern const char* process_prefix_flag (const char* short_opt, int argc, char **argv);
@@ -285,9 +559,25 @@ extern struct group *prefix_getgr_nam_gid(const char *grname);
 extern void prefix_setpwent();
 extern struct passwd* prefix_getpwent();
 extern void prefix_endpwent();
+extern int prefix_pw_scan (int (*scan) (const void *ent, void *arg), void *arg);
 extern void prefix_setgrent();
 extern struct group* prefix_getgrent();
 extern void prefix_endgrent();
+extern int prefix_gr_scan (int (*scan) (const void *ent, void *arg), void *arg);
+
+/* progress.c */
+struct tree_progress {
+	unsigned long long files;	/* entries copied or removed */
+	unsigned long long bytes;	/* bytes copied */
+	double elapsed;			/* seconds since the start */
+	const char *path;		/* directory being processed */
+	bool done;			/* last report */
+};
+typedef void (*tree_progress_fn) (const struct tree_progress *progress);
+extern void tree_progress_start (tree_progress_fn fn, unsigned int interval);
+extern void tree_progress_stop (void);
+extern void tree_progress_add (unsigned long files, unsigned long long bytes);
+extern void tree_progress_path (const char *path);
 
 /* pwd2spwd.c */
 #ifndef USE_PAM
@@ -306,20 +596,42 @@ extern void pwd_init (void);
 extern void __pw_del_entry (const struct commonio_entry *ent);
 extern struct commonio_db *__pw_get_db (void);
 extern /*@dependent@*/ /*@null@*/struct commonio_entry *__pw_get_head (void);
+extern bool __pw_has_duplicate (const struct commonio_entry *ent);
 
 /* pwmem.c */
 extern /*@null@*/ /*@only@*/struct passwd *__pw_dup (const struct passwd *pwent);
 extern void pw_free (/*@out@*/ /*@only@*/struct passwd *pwent);
+extern /*@null@*/ /*@only@*/struct passwd *__pw_dup_packed (const struct passwd *pwent);
+extern void pw_free_packed (/*@out@*/ /*@only@*/struct passwd *pwent);
 
 /* remove_tree.c */
 extern int remove_tree (const char *root, bool remove_root);
+extern int remove_trees (const char *const *roots, size_t count,
+                         bool remove_root);
+
+/* resolver.c */
+struct nss_resolver;
+enum resolve_key {
+	RESOLVE_PWNAM,
+	RESOLVE_PWUID,
+	RESOLVE_GRNAM,
+	RESOLVE_GRGID
+};
+extern /*@null@*/ /*@only@*/struct nss_resolver *resolver_start (void);
+extern bool resolver_request (struct nss_resolver *res, enum resolve_key key,
+                              /*@null@*/const char *name, id_t id);
+extern /*@observer@*/ /*@null@*/const void *resolver_wait (
+	struct nss_resolver *res, enum resolve_key key,
+	/*@null@*/const char *name, id_t id);
+extern void resolver_free (/*@null@*/ /*@only@*/struct nss_resolver *res);
 
 /* rlogin.c */
 extern int do_rlogin (const char *remote_host, char *name, size_t namelen,
                       char *term, size_t termlen);
 
 /* root_flag.c */
-extern void process_root_flag (const char* short_opt, int argc, char **argv);
+extern void process_root_flag (const char* short_opt, bool read_stdin,
+                               int argc, char **argv);
 
 /* salt.c */
 extern /*@observer@*/const char *crypt_make_salt (/*@null@*//*@observer@*/const char *meth, /*@null@*/void *arg);
@@ -334,6 +646,9 @@ extern int reset_selinux_file_context (void);
 #ifdef WITH_SELINUX
 extern int set_seuser(const char *login_name, const char *seuser_name);
 extern int del_seuser(const char *login_name);
+extern int seuser_batch_begin (void);
+extern int seuser_batch_commit (void);
+extern void seuser_batch_abort (void);
 #endif
 
 /* setugid.c */
@@ -352,35 +667,58 @@ extern void setup (struct passwd *);
 extern void setup_env (struct passwd *);
 
 /* sgetgrent.c */
+extern size_t sgetgrent_buflen (const char *buf);
+extern int sgetgrent_r (const char *buf, struct group *grent,
+                        char *buffer, size_t buflen, struct group **result);
 extern struct group *sgetgrent (const char *buf);
 
 /* sgetpwent.c */
+extern int sgetpwent_r (const char *buf, struct passwd *pwent,
+                        char *buffer, size_t buflen, struct passwd **result);
 extern struct passwd *sgetpwent (const char *buf);
 
 /* sgetspent.c */
 #ifndef HAVE_SGETSPENT
 extern struct spwd *sgetspent (const char *string);
 #endif
+#ifndef HAVE_SGETSPENT_R
+extern int sgetspent_r (const char *string, struct spwd *spbuf,
+                        char *buffer, size_t buflen, struct spwd **result);
+#endif
 
 /* sgroupio.c */
 extern void __sgr_del_entry (const struct commonio_entry *ent);
 extern /*@null@*/ /*@only@*/struct sgrp *__sgr_dup (const struct sgrp *sgent);
 extern void sgr_free (/*@out@*/ /*@only@*/struct sgrp *sgent);
+extern /*@null@*/ /*@only@*/struct sgrp *__sgr_dup_packed (const struct sgrp *sgent);
+extern void sgr_free_packed (/*@out@*/ /*@only@*/struct sgrp *sgent);
+extern struct commonio_db *__sgr_get_db (void);
 extern /*@dependent@*/ /*@null@*/struct commonio_entry *__sgr_get_head (void);
+extern bool __sgr_has_duplicate (const struct commonio_entry *ent);
 extern void __sgr_set_changed (void);
 
 /* shadowio.c */
+extern struct commonio_db *__spw_get_db (void);
 extern /*@dependent@*/ /*@null@*/struct commonio_entry *__spw_get_head (void);
 extern void __spw_del_entry (const struct commonio_entry *ent);
+extern bool __spw_has_duplicate (const struct commonio_entry *ent);
 
 /* shadowmem.c */
 extern /*@null@*/ /*@only@*/struct spwd *__spw_dup (const struct spwd *spent);
 extern void spw_free (/*@out@*/ /*@only@*/struct spwd *spent);
+extern /*@null@*/ /*@only@*/struct spwd *__spw_dup_packed (const struct spwd *spent);
+extern void spw_free_packed (/*@out@*/ /*@only@*/struct spwd *spent);
 
 /* shell.c */
 extern int shell (const char *file, /*@null@*/const char *arg, char *const envp[]);
 
+/* shells.c */
+extern bool shell_is_listed (const char *sh);
+
 /* spawn.c */
+extern pid_t start_command (const char *cmd, const char *argv[],
+                            /*@null@*/const char *envp[]);
+extern int wait_command (pid_t pid, /*@out@*/int *status);
 extern int run_command (const char *cmd, const char *argv[],
                         /*@null@*/const char *envp[], /*@out@*/int *status);
 
@@ -415,7 +753,43 @@ extern int set_filesize_limit (int blocks);
 /* user_busy.c */
 extern int user_busy (const char *name, uid_t uid);
 
+/* used_ids.c */
+struct id_range {
+	id_t first;
+	id_t last;
+};
+struct used_ids {
+	/*@null@*/struct id_range *ranges;
+	size_t count;
+	size_t size;
+};
+extern bool used_ids_add (struct used_ids *set, id_t id);
+extern bool used_ids_add_range (struct used_ids *set, id_t first, id_t last);
+extern bool used_ids_add_ranges (struct used_ids *set, const char *list,
+                                 id_t min, id_t max);
+extern void used_ids_sort (struct used_ids *set);
+extern bool used_ids_contains (const struct used_ids *set, id_t id);
+extern bool used_ids_next_free (const struct used_ids *set, id_t *id, id_t max);
+extern bool used_ids_prev_free (const struct used_ids *set, id_t *id, id_t min);
+extern void used_ids_free (struct used_ids *set);
+struct id_pool {
+	bool ready;		/* set up by id_pool_setup() */
+	bool down;		/* search from max toward min */
+	bool wrapped;		/* the search restarted from the other end */
+	bool done;		/* all the IDs were returned */
+	id_t min;
+	id_t max;
+	id_t start;
+	id_t next;
+	struct used_ids used;
+};
+extern void id_pool_setup (struct id_pool *pool, id_t min, id_t max,
+                           id_t start, bool down);
+extern bool id_pool_next (struct id_pool *pool, id_t *id);
+extern void id_pool_free (struct id_pool *pool);
+
 /* utmp.c */
+extern int append_record (const char *filename, const void *rec, size_t size);
 #ifndef USE_UTMPX
 extern /*@null@*/struct utmp *get_current_utmp (void);
 extern struct utmp *prepare_utmp (const char *name,
@@ -435,12 +809,24 @@ extern int setutmpx (struct utmpx *utx);
 /* valid.c */
 extern bool valid (const char *, const struct passwd *);
 
+/* workpool.c */
+struct work_pool;
+typedef void (*work_fn) (struct work_pool *pool, void *arg);
+extern /*@null@*/struct work_pool *work_pool_start (size_t nthreads,
+                                                    size_t max_queued);
+extern bool work_pool_queue (/*@null@*/struct work_pool *pool,
+                             work_fn fn, void *arg, bool wait);
+extern void work_pool_fail (struct work_pool *pool);
+extern bool work_pool_failed (struct work_pool *pool);
+extern int work_pool_stop (/*@null@*/ /*@only@*/struct work_pool *pool);
+
 /* xmalloc.c */
 extern /*@maynotreturn@*/ /*@only@*//*@out@*//*@notnull@*/char *xmalloc (size_t size)
   /*@ensures MaxSet(result) == (size - 1); @*/;
 extern /*@maynotreturn@*/ /*@only@*//*@notnull@*/char *xstrdup (const char *);
 
 /* xgetpwnam.c */
+/* The results of the xget* functions are released with *_free_packed */
 extern /*@null@*/ /*@only@*/struct passwd *xgetpwnam (const char *);
 /* xgetpwuid.c */
 extern /*@null@*/ /*@only@*/struct passwd *xgetpwuid (uid_t);
@@ -46,14 +46,14 @@ static /*@null@*/ /*@only@*/void *passwd_dup (const void *ent)
 {
 	const struct passwd *pw = ent;
 
-	return __pw_dup (pw);
+	return __pw_dup_packed (pw);
 }
 
 static void passwd_free (/*@out@*/ /*@only@*/void *ent)
 {
 	struct passwd *pw = ent;
 
-	pw_free (pw);
+	pw_free_packed (pw);
 }
 
 static const char *passwd_getname (const void *ent)
@@ -63,11 +63,64 @@ static const char *passwd_getname (const void *ent)
 	return pw->pw_name;
 }
 
+static id_t passwd_getid (const void *ent)
+{
+	const struct passwd *pw = ent;
+
+	return (id_t) pw->pw_uid;
+}
+
+static id_t passwd_getgid (const void *ent)
+{
+	const struct passwd *pw = ent;
+
+	return (id_t) pw->pw_gid;
+}
+
+static size_t passwd_size (const void *ent)
+{
+	const struct passwd *pw = ent;
+
+	return   sizeof *pw
+	       + strlen (pw->pw_name) + strlen (pw->pw_passwd)
+	       + strlen (pw->pw_gecos) + strlen (pw->pw_dir)
+	       + strlen (pw->pw_shell) + 5;
+}
+
 static void *passwd_parse (const char *line)
 {
 	return (void *) sgetpwent (line);
 }
 
+/*
+ * passwd_parse_alloc - parse a line into a packed entry
+ *
+ *	The strings are stored after the structure, as with
+ *	__pw_dup_packed(). Like sgetpwent(), the lines of 1024 characters
+ *	or more are invalid.
+ */
+static /*@null@*/ /*@only@*/void *passwd_parse_alloc (const char *line)
+{
+	struct passwd *pw, *result;
+	size_t len = strlen (line) + 1;
+
+	if (len > 1024) {
+		return NULL;
+	}
+	pw = (struct passwd *) malloc (sizeof *pw + len);
+	if (NULL == pw) {
+		return NULL;
+	}
+	/* The libc might define other fields. They are not set. */
+	memset (pw, 0, sizeof *pw);
+	(void) sgetpwent_r (line, pw, (char *) (pw + 1), len, &result);
+	if (NULL == result) {
+		free (pw);
+		return NULL;
+	}
+	return pw;
+}
+
 static int passwd_put (const void *ent, FILE * file)
 {
 	const struct passwd *pw = ent;
@@ -86,6 +139,62 @@ static int passwd_put (const void *ent, FILE * file)
 	return (putpwent (pw, file) == -1) ? -1 : 0;
 }
 
+/*
+ * passwd_format - Append the line of pw to out, as putpwent() would
+ *                 write it.
+ */
+static int passwd_format (const void *ent, struct commonio_buf *out)
+{
+	const struct passwd *pw = ent;
+	char uid[32] = "", gid[32] = "";
+	size_t len;
+	char *cp;
+
+	if (   (NULL == pw)
+	    || (valid_field (pw->pw_name, ":\n") == -1)
+	    || (valid_field (pw->pw_passwd, ":\n") == -1)
+	    || (pw->pw_uid == (uid_t)-1)
+	    || (pw->pw_gid == (gid_t)-1)
+	    || (valid_field (pw->pw_gecos, ":\n") == -1)
+	    || (valid_field (pw->pw_dir, ":\n") == -1)
+	    || (valid_field (pw->pw_shell, ":\n") == -1)) {
+		return -1;
+	}
+
+	/* The NIS compat entries have no IDs */
+	if (('+' != pw->pw_name[0]) && ('-' != pw->pw_name[0])) {
+		(void) snprintf (uid, sizeof uid, "%lu",
+		                 (unsigned long) pw->pw_uid);
+		(void) snprintf (gid, sizeof gid, "%lu",
+		                 (unsigned long) pw->pw_gid);
+	}
+
+	len =   strlen (pw->pw_name) + strlen (pw->pw_passwd)
+	      + strlen (uid) + strlen (gid) + strlen (pw->pw_gecos)
+	      + strlen (pw->pw_dir) + strlen (pw->pw_shell) + 7;
+	cp = commonio_buf_reserve (out, len);
+	if (NULL == cp) {
+		return -1;
+	}
+	cp = stpcpy (cp, pw->pw_name);
+	*cp++ = ':';
+	cp = stpcpy (cp, pw->pw_passwd);
+	*cp++ = ':';
+	cp = stpcpy (cp, uid);
+	*cp++ = ':';
+	cp = stpcpy (cp, gid);
+	*cp++ = ':';
+	cp = stpcpy (cp, pw->pw_gecos);
+	*cp++ = ':';
+	cp = stpcpy (cp, pw->pw_dir);
+	*cp++ = ':';
+	cp = stpcpy (cp, pw->pw_shell);
+	*cp = '\n';
+	out->len += len;
+
+	return 0;
+}
+
 static struct commonio_ops passwd_ops = {
 	passwd_dup,
 	passwd_free,
@@ -95,7 +204,17 @@ static struct commonio_ops passwd_ops = {
 	fgets,
 	fputs,
 	NULL,			/* open_hook */
-	NULL			/* close_hook */
+	NULL,			/* close_hook */
+	passwd_getid,
+	NULL,			/* free_index */
+	NULL,			/* getmembers */
+	passwd_parse_alloc,
+	passwd_format,
+	passwd_getgid,
+	COMMONIO_NAME_FIELD (struct passwd, pw_name),
+	COMMONIO_ID_FIELD (struct passwd, pw_uid),
+	COMMONIO_ID_FIELD (struct passwd, pw_gid),
+	passwd_size
 };
 
 static struct commonio_db passwd_db = {
@@ -144,14 +263,43 @@ int pw_open (int mode)
 
 /*@observer@*/ /*@null@*/const struct passwd *pw_locate_uid (uid_t uid)
 {
-	const struct passwd *pwd;
+	return commonio_locate_id (&passwd_db, (id_t) uid);
+}
+
+/*
+ * pw_locate_gid - Find the users with the specified primary group.
+ *
+ *	*pwds is set to a malloced array of *count entries.
+ *
+ *	It returns 0 on failure, 1 otherwise.
+ */
+int pw_locate_gid (gid_t gid, const struct passwd ***pwds, size_t *count)
+{
+	return commonio_locate_gid (&passwd_db, (id_t) gid,
+	                            (const void ***) pwds, count);
+}
+
+/*
+ * pw_seq_get - Get the last UID allocated from the system or regular
+ *              range (ID_SEQUENCE).
+ */
+bool pw_seq_get (bool sys_user, /*@out@*/uid_t *uid)
+{
+	id_t id;
 
-	pw_rewind ();
-	while (   ((pwd = pw_next ()) != NULL)
-	       && (pwd->pw_uid != uid)) {
+	if (!commonio_seq_get (&passwd_db, sys_user, &id)) {
+		return false;
 	}
+	*uid = (uid_t) id;
+	return true;
+}
 
-	return pwd;
+/*
+ * pw_seq_set - Record the allocation of uid, with the next commit.
+ */
+void pw_seq_set (bool sys_user, uid_t uid)
+{
+	commonio_seq_set (&passwd_db, sys_user, (id_t) uid);
 }
 
 int pw_update (const struct passwd *pw)
@@ -159,16 +307,45 @@ int pw_update (const struct passwd *pw)
 	return commonio_update (&passwd_db, (const void *) pw);
 }
 
+int pw_update_owned (/*@only@*/struct passwd *pw)
+{
+	return commonio_update_owned (&passwd_db, (void *) pw);
+}
+
+int pw_modify (const char *name, void (*modify) (void *ent, void *arg),
+               void *arg)
+{
+	return commonio_modify (&passwd_db, name, modify, arg);
+}
+
 int pw_remove (const char *name)
 {
 	return commonio_remove (&passwd_db, name);
 }
 
+/*
+ * pw_stream_edits - Apply the edits to the locked database, which is not
+ *                   open (see commonio_stream()).
+ */
+int pw_stream_edits (struct commonio_edit *edits, size_t count)
+{
+	return commonio_stream (&passwd_db, edits, count);
+}
+
 int pw_rewind (void)
 {
 	return commonio_rewind (&passwd_db);
 }
 
+/*
+ * pw_scan - Call scan with each struct passwd of the database (see
+ *           commonio_scan()).
+ */
+int pw_scan (int (*scan) (const void *ent, void *arg), void *arg)
+{
+	return commonio_scan (&passwd_db, scan, arg);
+}
+
 /*@observer@*/ /*@null@*/const struct passwd *pw_next (void)
 {
 	return commonio_next (&passwd_db);
@@ -186,6 +363,10 @@ int pw_unlock (void)
 
 /*@null@*/struct commonio_entry *__pw_get_head (void)
 {
+	/* NULL with errno set to ENOMEM if an entry cannot be parsed */
+	if (commonio_parse_entries (&passwd_db) != 0) {
+		return NULL;
+	}
 	return passwd_db.head;
 }
 
@@ -194,33 +375,18 @@ void __pw_del_entry (const struct commonio_entry *ent)
 	commonio_del_entry (&passwd_db, ent);
 }
 
-struct commonio_db *__pw_get_db (void)
+bool __pw_has_duplicate (const struct commonio_entry *ent)
 {
-	return &passwd_db;
+	return commonio_has_duplicate (&passwd_db, ent);
 }
 
-static int pw_cmp (const void *p1, const void *p2)
+struct commonio_db *__pw_get_db (void)
 {
-	uid_t u1, u2;
-
-	if ((*(struct commonio_entry **) p1)->eptr == NULL)
-		return 1;
-	if ((*(struct commonio_entry **) p2)->eptr == NULL)
-		return -1;
-
-	u1 = ((struct passwd *) (*(struct commonio_entry **) p1)->eptr)->pw_uid;
-	u2 = ((struct passwd *) (*(struct commonio_entry **) p2)->eptr)->pw_uid;
-
-	if (u1 < u2)
-		return -1;
-	else if (u1 > u2)
-		return 1;
-	else
-		return 0;
+	return &passwd_db;
 }
 
 /* Sort entries by UID */
 int pw_sort ()
 {
-	return commonio_sort (&passwd_db, pw_cmp);
+	return commonio_sort_id (&passwd_db);
 }
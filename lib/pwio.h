@@ -37,19 +37,32 @@
 
 #include <sys/types.h>
 #include <pwd.h>
+#include "defines.h" /* bool */
+
+struct commonio_edit;
 
 extern int pw_close (void);
 extern /*@observer@*/ /*@null@*/const struct passwd *pw_locate (const char *name);
 extern /*@observer@*/ /*@null@*/const struct passwd *pw_locate_uid (uid_t uid);
+extern int pw_locate_gid (gid_t gid, /*@out@*/const struct passwd ***pwds,
+                          /*@out@*/size_t *count);
 extern int pw_lock (void);
+extern bool pw_seq_get (bool sys_user, /*@out@*/uid_t *uid);
+extern void pw_seq_set (bool sys_user, uid_t uid);
 extern int pw_setdbname (const char *filename);
 extern /*@observer@*/const char *pw_dbname (void);
 extern /*@observer@*/ /*@null@*/const struct passwd *pw_next (void);
 extern int pw_open (int mode);
 extern int pw_remove (const char *name);
 extern int pw_rewind (void);
+extern int pw_stream_edits (struct commonio_edit *edits, size_t count);
+extern int pw_scan (int (*scan) (const void *ent, void *arg), void *arg);
 extern int pw_unlock (void);
 extern int pw_update (const struct passwd *pw);
+extern int pw_update_owned (/*@only@*/struct passwd *pw);
+extern int pw_modify (const char *name,
+                      void (*modify) (void *ent, void *arg),
+                      void *arg);
 extern int pw_sort (void);
 
 #endif
@@ -39,6 +39,7 @@
 #include "defines.h"
 #include "prototypes.h"
 #include "pwio.h"
+#include "strintern.h"
 
 /*@null@*/ /*@only@*/struct passwd *__pw_dup (const struct passwd *pwent)
 {
@@ -104,3 +105,53 @@ void pw_free (/*@out@*/ /*@only@*/struct passwd *pwent)
 	free (pwent);
 }
 
+/*
+ * __pw_dup_packed - copy a passwd entry in a single allocation
+ *
+ *	The password and the GECOS field are stored after the structure.
+ *	The name, the home directory and the shell are interned (see
+ *	strintern.h). The fields of the copy must not be freed or
+ *	reallocated, and the copy is released with pw_free_packed().
+ */
+/*@null@*/ /*@only@*/struct passwd *__pw_dup_packed (const struct passwd *pwent)
+{
+	struct passwd *pw;
+	size_t passwd_len, gecos_len;
+	char *cp;
+
+	passwd_len = strlen (pwent->pw_passwd) + 1;
+	gecos_len  = strlen (pwent->pw_gecos) + 1;
+
+	pw = (struct passwd *) malloc (sizeof *pw + passwd_len + gecos_len);
+	if (NULL == pw) {
+		return NULL;
+	}
+	/* The libc might define other fields. They won't be copied. */
+	memset (pw, 0, sizeof *pw);
+	pw->pw_uid = pwent->pw_uid;
+	pw->pw_gid = pwent->pw_gid;
+
+	pw->pw_name = str_intern (pwent->pw_name);
+	pw->pw_dir = str_intern (pwent->pw_dir);
+	pw->pw_shell = str_intern (pwent->pw_shell);
+	if (   (NULL == pw->pw_name)
+	    || (NULL == pw->pw_dir)
+	    || (NULL == pw->pw_shell)) {
+		free (pw);
+		return NULL;
+	}
+
+	cp = (char *) (pw + 1);
+	pw->pw_passwd = memcpy (cp, pwent->pw_passwd, passwd_len);
+	cp += passwd_len;
+	pw->pw_gecos = memcpy (cp, pwent->pw_gecos, gecos_len);
+
+	return pw;
+}
+
+void pw_free_packed (/*@out@*/ /*@only@*/struct passwd *pwent)
+{
+	memzero (pwent->pw_passwd, strlen (pwent->pw_passwd));
+	free (pwent);
+}
+
@@ -34,12 +34,38 @@
 #include "defines.h"
 
 #include <selinux/selinux.h>
+#include <selinux/label.h>
 #include "prototypes.h"
 
 
 static bool selinux_checked = false;
 static bool selinux_enabled;
 
+/*
+ * The labeling handle of the file contexts is opened on the first use,
+ * and kept for the other files.
+ */
+static bool selabel_opened = false;
+static /*@null@*/struct selabel_handle *selabel_hnd = NULL;
+
+/*
+ * Context for the created files, as last set by these functions, when
+ * fscreate_known is set (NULL for the default context).
+ * The files of a copied tree usually have the same context: it is then
+ * not set again.
+ */
+static bool fscreate_known = false;
+static /*@null@*/security_context_t fscreate_context = NULL;
+
+static void fscreate_forget (void)
+{
+	if (NULL != fscreate_context) {
+		freecon (fscreate_context);
+		fscreate_context = NULL;
+	}
+	fscreate_known = false;
+}
+
 /*
  * set_selinux_file_context - Set the security context before any file or
  *                            directory creation.
@@ -49,6 +75,9 @@ static bool selinux_enabled;
  *
  *	Callers may have to Reset SELinux to create files with default
  *	contexts with reset_selinux_file_context
+ *
+ *	The context for the created files shall only be changed with
+ *	these functions.
  */
 int set_selinux_file_context (const char *dst_name)
 {
@@ -60,19 +89,41 @@ int set_selinux_file_context (const char *dst_name)
 	}
 
 	if (selinux_enabled) {
+		if (!selabel_opened) {
+			selabel_hnd = selabel_open (SELABEL_CTX_FILE, NULL, 0);
+			selabel_opened = true;
+		}
 		/* Get the default security context for this file */
-		if (matchpathcon (dst_name, 0, &scontext) < 0) {
+		if (   (NULL == selabel_hnd)
+		    || (selabel_lookup (selabel_hnd, &scontext, dst_name, 0) < 0)) {
 			if (security_getenforce () != 0) {
 				return 1;
 			}
+			scontext = NULL;
+		}
+		if (   fscreate_known
+		    && ((NULL == scontext)
+		        ? (NULL == fscreate_context)
+		        : (   (NULL != fscreate_context)
+		           && (strcmp (scontext, fscreate_context) == 0)))) {
+			if (NULL != scontext) {
+				freecon (scontext);
+			}
+			return 0;
 		}
 		/* Set the security context for the next created file */
+		fscreate_forget ();
 		if (setfscreatecon (scontext) < 0) {
+			if (NULL != scontext) {
+				freecon (scontext);
+			}
 			if (security_getenforce () != 0) {
 				return 1;
 			}
+			return 0;
 		}
-		freecon (scontext);
+		fscreate_context = scontext;
+		fscreate_known = true;
 	}
 	return 0;
 }
@@ -91,9 +142,11 @@ int reset_selinux_file_context (void)
 		selinux_checked = true;
 	}
 	if (selinux_enabled) {
+		fscreate_forget ();
 		if (setfscreatecon (NULL) != 0) {
 			return 1;
 		}
+		fscreate_known = true;
 	}
 	return 0;
 }
@@ -234,25 +234,23 @@ done:
 }
 
 
-int set_seuser (const char *login_name, const char *seuser_name)
+/*
+ * Transaction of a batch of changes, see seuser_batch_begin().
+ */
+static /*@null@*/semanage_handle_t *batch_handle = NULL;
+
+
+/*
+ * seuser_set - Add or modify the login mapping of login_name in the
+ *              transaction of handle.
+ */
+static int seuser_set (semanage_handle_t *handle,
+                       const char *login_name, const char *seuser_name)
 {
-	semanage_handle_t *handle = NULL;
 	semanage_seuser_key_t *key = NULL;
 	int ret;
 	int seuser_exists = 0;
 
-	if (NULL == seuser_name) {
-		/* don't care, just let system pick the defaults */
-		return 0;
-	}
-
-	handle = semanage_init ();
-	if (NULL == handle) {
-		fprintf (stderr, _("Cannot init SELinux management\n"));
-		ret = 1;
-		goto done;
-	}
-
 	ret = semanage_seuser_key_create (handle, login_name, &key);
 	if (ret != 0) {
 		fprintf (stderr, _("Cannot create SELinux user key\n"));
@@ -285,35 +283,28 @@ int set_seuser (const char *login_name, const char *seuser_name)
 		}
 	}
 
-	ret = semanage_commit (handle);
-	if (ret < 0) {
-		fprintf (stderr, _("Cannot commit SELinux transaction\n"));
-		ret = 1;
-		goto done;
-	}
-
 	ret = 0;
 
 done:
 	semanage_seuser_key_free (key);
-	semanage_handle_destroy (handle);
 	return ret;
 }
 
 
-int del_seuser (const char *login_name)
+/*
+ * seuser_del - Delete the login mapping of login_name in the
+ *              transaction of handle.
+ *
+ *	*deleted is set if the transaction was changed.
+ */
+static int seuser_del (semanage_handle_t *handle, const char *login_name,
+                       /*@out@*/bool *deleted)
 {
-	semanage_handle_t *handle = NULL;
 	semanage_seuser_key_t *key = NULL;
 	int ret;
 	int exists = 0;
 
-	handle = semanage_init ();
-	if (NULL == handle) {
-		fprintf (stderr, _("Cannot init SELinux management\n"));
-		ret = 1;
-		goto done;
-	}
+	*deleted = false;
 
 	ret = semanage_seuser_key_create (handle, login_name, &key);
 	if (ret != 0) {
@@ -361,17 +352,134 @@ int del_seuser (const char *login_name)
 		goto done;
 	}
 
+	*deleted = true;
+	ret = 0;
+done:
+	semanage_seuser_key_free (key);
+	return ret;
+}
+
+
+/*
+ * seuser_commit - Commit the transaction of handle, and destroy it.
+ */
+static int seuser_commit (semanage_handle_t *handle)
+{
+	int ret;
+
 	ret = semanage_commit (handle);
+	semanage_handle_destroy (handle);
 	if (ret < 0) {
 		fprintf (stderr, _("Cannot commit SELinux transaction\n"));
-		ret = 1;
-		goto done;
+		return 1;
 	}
+	return 0;
+}
 
-	ret = 0;
-done:
-	semanage_handle_destroy (handle);
-	return ret;
+
+/*
+ * seuser_batch_begin - Start a batch of login mapping changes.
+ *
+ *	Until seuser_batch_commit() or seuser_batch_abort() is called,
+ *	set_seuser() and del_seuser() only add their changes to a single
+ *	transaction. Each commit rebuilds the policy, which takes long:
+ *	the tools which change many users commit once.
+ */
+int seuser_batch_begin (void)
+{
+	if (NULL != batch_handle) {
+		return 0;
+	}
+	batch_handle = semanage_init ();
+	if (NULL == batch_handle) {
+		fprintf (stderr, _("Cannot init SELinux management\n"));
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * seuser_batch_commit - Commit the changes of the batch.
+ */
+int seuser_batch_commit (void)
+{
+	semanage_handle_t *handle = batch_handle;
+
+	if (NULL == handle) {
+		return 0;
+	}
+	batch_handle = NULL;
+	return seuser_commit (handle);
+}
+
+
+/*
+ * seuser_batch_abort - Drop the changes of the batch.
+ */
+void seuser_batch_abort (void)
+{
+	if (NULL != batch_handle) {
+		semanage_handle_destroy (batch_handle);
+		batch_handle = NULL;
+	}
+}
+
+
+int set_seuser (const char *login_name, const char *seuser_name)
+{
+	semanage_handle_t *handle = NULL;
+
+	if (NULL == seuser_name) {
+		/* don't care, just let system pick the defaults */
+		return 0;
+	}
+
+	if (NULL != batch_handle) {
+		return seuser_set (batch_handle, login_name, seuser_name);
+	}
+
+	handle = semanage_init ();
+	if (NULL == handle) {
+		fprintf (stderr, _("Cannot init SELinux management\n"));
+		return 1;
+	}
+
+	if (seuser_set (handle, login_name, seuser_name) != 0) {
+		semanage_handle_destroy (handle);
+		return 1;
+	}
+
+	return seuser_commit (handle);
+}
+
+
+int del_seuser (const char *login_name)
+{
+	semanage_handle_t *handle = NULL;
+	bool deleted;
+
+	if (NULL != batch_handle) {
+		return seuser_del (batch_handle, login_name, &deleted);
+	}
+
+	handle = semanage_init ();
+	if (NULL == handle) {
+		fprintf (stderr, _("Cannot init SELinux management\n"));
+		return 1;
+	}
+
+	if (seuser_del (handle, login_name, &deleted) != 0) {
+		semanage_handle_destroy (handle);
+		return 1;
+	}
+	if (!deleted) {
+		/* Nothing to commit */
+		semanage_handle_destroy (handle);
+		return 0;
+	}
+
+	return seuser_commit (handle);
 }
 #else				/* !WITH_SELINUX */
 extern int errno;		/* warning: ANSI C forbids an empty source file */
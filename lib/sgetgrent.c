@@ -34,6 +34,8 @@
 
 #ident "$Id$"
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <grp.h>
@@ -43,84 +45,50 @@
 #define	NFIELDS	4
 
 /*
- * list - turn a comma-separated string into an array of (char *)'s
+ * sgetgrent_buflen - size of the buffer needed by sgetgrent_r() to parse
+ *                    buf
  *
- *	list() converts the comma-separated list of member names into
- *	an array of character pointers.
- *
- *	WARNING: I profiled this once with and without strchr() calls
- *	and found that using a register variable and an explicit loop
- *	works best.  For large /etc/group files, this is a major win.
- *
- * FINALLY added dynamic allocation.  Still need to fix sgetsgent().
- *  --marekm
+ *	The buffer holds a copy of buf, and the list of members: at most
+ *	one more member than commas, and the terminating NULL.
  */
-static char **list (char *s)
+size_t sgetgrent_buflen (const char *buf)
 {
-	static char **members = 0;
-	static int size = 0;	/* max members + 1 */
-	int i;
-	char **rbuf;
-
-	i = 0;
-	for (;;) {
-		/* check if there is room for another pointer (to a group
-		   member name, or terminating NULL).  */
-		if (i >= size) {
-			size = i + 100;	/* at least: i + 1 */
-			if (members) {
-				rbuf =
-				    realloc (members, size * sizeof (char *));
-			} else {
-				/* for old (before ANSI C) implementations of
-				   realloc() that don't handle NULL properly */
-				rbuf = malloc (size * sizeof (char *));
-			}
-			if (!rbuf) {
-				if (members)
-					free (members);
-				members = 0;
-				size = 0;
-				return (char **) 0;
-			}
-			members = rbuf;
-		}
-		if (!s || s[0] == '\0')
-			break;
-		members[i++] = s;
-		while (('\0' != *s) && (',' != *s)) {
-			s++;
-		}
-		if ('\0' != *s) {
-			*s++ = '\0';
-		}
-	}
-	members[i] = (char *) 0;
-	return members;
-}
+	size_t len = strlen (buf) + 1;
+	size_t n = count_char (buf, ',') + 2;
 
+	/* The list may need to be aligned in the buffer */
+	return (n + 1) * sizeof (char *) + len;
+}
 
-struct group *sgetgrent (const char *buf)
+/*
+ * sgetgrent_r - convert a string to a (struct group), reentrant version
+ *
+ *	The list of members and the strings of the group are stored in
+ *	buffer, which must have at least sgetgrent_buflen(buf) bytes.
+ *
+ *	It returns 0 and sets *result to grent on success. Otherwise,
+ *	*result is set to NULL and it returns ERANGE if the buffer is too
+ *	small, or EINVAL if the entry is invalid.
+ */
+int sgetgrent_r (const char *buf, struct group *grent,
+                 char *buffer, size_t buflen, struct group **result)
 {
-	static char *grpbuf = 0;
-	static size_t size = 0;
-	static char *grpfields[NFIELDS];
-	static struct group grent;
-	int i;
+	char *grpfields[NFIELDS];
+	char **members;
+	char *grpbuf;
+	size_t pad, n;
 	char *cp;
 
-	if (strlen (buf) + 1 > size) {
-		/* no need to use realloc() here - just free it and
-		   allocate a larger block */
-		if (grpbuf)
-			free (grpbuf);
-		size = strlen (buf) + 1000;	/* at least: strlen(buf) + 1 */
-		grpbuf = malloc (size);
-		if (!grpbuf) {
-			size = 0;
-			return 0;
-		}
+	*result = NULL;
+
+	if (buflen < sgetgrent_buflen (buf)) {
+		return ERANGE;
 	}
+	pad = (sizeof (char *) - ((uintptr_t) buffer % sizeof (char *)))
+	      % sizeof (char *);
+	members = (char **) (buffer + pad);
+	/* The copy of buf is stored at the end of the buffer */
+	grpbuf = buffer + buflen - (strlen (buf) + 1);
 	strcpy (grpbuf, buf);
 
 	cp = strrchr (grpbuf, '\n');
@@ -128,27 +96,50 @@ struct group *sgetgrent (const char *buf)
 		*cp = '\0';
 	}
 
-	for (cp = grpbuf, i = 0; (i < NFIELDS) && (NULL != cp); i++) {
-		grpfields[i] = cp;
-		cp = strchr (cp, ':');
-		if (NULL != cp) {
-			*cp = '\0';
-			cp++;
-		}
+	/* The fields after the members are ignored */
+	n = split_fields (grpbuf, ':', grpfields, NFIELDS);
+	if (n < (NFIELDS - 1) || *grpfields[2] == '\0') {
+		return EINVAL;
 	}
-	if (i < (NFIELDS - 1) || *grpfields[2] == '\0') {
-		return (struct group *) 0;
+	grent->gr_name = grpfields[0];
+	grent->gr_passwd = grpfields[1];
+	if (get_gid (grpfields[2], &grent->gr_gid) == 0) {
+		return EINVAL;
 	}
-	grent.gr_name = grpfields[0];
-	grent.gr_passwd = grpfields[1];
-	if (get_gid (grpfields[2], &grent.gr_gid) == 0) {
-		return (struct group *) 0;
-	}
-	grent.gr_mem = list (grpfields[3]);
-	if (NULL == grent.gr_mem) {
-		return (struct group *) 0;	/* out of memory */
+
+	/* Turn the comma-separated list of members into an array */
+	if (n >= NFIELDS) {
+		(void) split_list (grpfields[3], members);
+	} else {
+		members[0] = NULL;
 	}
+	grent->gr_mem = members;
 
-	return &grent;
+	*result = grent;
+	return 0;
 }
 
+struct group *sgetgrent (const char *buf)
+{
+	static char *grpbuf = NULL;
+	static size_t size = 0;
+	static struct group grent;
+	struct group *result;
+	size_t len;
+
+	len = sgetgrent_buflen (buf);
+	if (len > size) {
+		/* no need to use realloc() here - just free it and
+		   allocate a larger block */
+		free (grpbuf);
+		size = len + 1000;	/* at least: len */
+		grpbuf = malloc (size);
+		if (NULL == grpbuf) {
+			size = 0;
+			return NULL;
+		}
+	}
+
+	(void) sgetgrent_r (buf, &grent, grpbuf, size, &result);
+	return result;
+}
@@ -34,6 +34,7 @@
 
 #ident "$Id$"
 
+#include <errno.h>
 #include <sys/types.h>
 #include "defines.h"
 #include <stdio.h>
@@ -43,80 +44,87 @@
 #define	NFIELDS	7
 
 /*
- * sgetpwent - convert a string to a (struct passwd)
+ * sgetpwent_r - convert a string to a (struct passwd), reentrant version
  *
- * sgetpwent() parses a string into the parts required for a password
+ * sgetpwent_r() parses a string into the parts required for a password
  * structure.  Strict checking is made for the UID and GID fields and
- * presence of the correct number of colons.  Any failing tests result
- * in a NULL pointer being returned.
+ * presence of the correct number of colons.
+ *
+ * The strings of the entry are stored in buffer, which must be longer
+ * than buf. It returns 0 and sets *result to pwent on success.
+ * Otherwise, *result is set to NULL and it returns ERANGE if the buffer
+ * is too small, or EINVAL if the entry is invalid.
  *
- * NOTE: This function uses hard-coded string scanning functions for
- *	performance reasons.  I am going to come up with some conditional
- *	compilation glarp to improve on this in the future.
  */
-struct passwd *sgetpwent (const char *buf)
+int sgetpwent_r (const char *buf, struct passwd *pwent,
+                 char *buffer, size_t buflen, struct passwd **result)
 {
-	static struct passwd pwent;
-	static char pwdbuf[1024];
-	register int i;
-	register char *cp;
 	char *fields[NFIELDS];
+	size_t n;
+
+	*result = NULL;
 
 	/*
-	 * Copy the string to a static buffer so the pointers into
+	 * Copy the string to the buffer so the pointers into
 	 * the password structure remain valid.
 	 */
 
-	if (strlen (buf) >= sizeof pwdbuf)
-		return 0;	/* fail if too long */
-	strcpy (pwdbuf, buf);
+	if (strlen (buf) >= buflen) {
+		return ERANGE;
+	}
+	strcpy (buffer, buf);
 
 	/*
 	 * Save a pointer to the start of each colon separated
 	 * field.  The fields are converted into NUL terminated strings.
 	 */
 
-	for (cp = pwdbuf, i = 0; (i < NFIELDS) && (NULL != cp); i++) {
-		fields[i] = cp;
-		while (('\0' != *cp) && (':' != *cp)) {
-			cp++;
-		}
-
-		if ('\0' != *cp) {
-			*cp = '\0';
-			cp++;
-		} else {
-			cp = NULL;
-		}
-	}
+	n = split_fields (buffer, ':', fields, NFIELDS);
 
 	/*
-	 * There must be exactly NFIELDS colon separated fields or
-	 * the entry is invalid.  Also, the UID and GID must be non-blank.
+	 * There must be at least NFIELDS colon separated fields (the
+	 * following ones are ignored) or the entry is invalid.  Also,
+	 * the UID and GID must be non-blank.
 	 */
 
-	if (i != NFIELDS || *fields[2] == '\0' || *fields[3] == '\0')
-		return NULL;
+	if (n < NFIELDS || *fields[2] == '\0' || *fields[3] == '\0')
+		return EINVAL;
 
 	/*
 	 * Each of the fields is converted the appropriate data type
 	 * and the result assigned to the password structure.  If the
-	 * UID or GID does not convert to an integer value, a NULL
-	 * pointer is returned.
+	 * UID or GID does not convert to an integer value, the entry
+	 * is invalid.
 	 */
 
-	pwent.pw_name = fields[0];
-	pwent.pw_passwd = fields[1];
-	if (get_uid (fields[2], &pwent.pw_uid) == 0) {
-		return NULL;
+	pwent->pw_name = fields[0];
+	pwent->pw_passwd = fields[1];
+	if (get_uid (fields[2], &pwent->pw_uid) == 0) {
+		return EINVAL;
 	}
-	if (get_gid (fields[3], &pwent.pw_gid) == 0) {
-		return NULL;
+	if (get_gid (fields[3], &pwent->pw_gid) == 0) {
+		return EINVAL;
 	}
-	pwent.pw_gecos = fields[4];
-	pwent.pw_dir = fields[5];
-	pwent.pw_shell = fields[6];
+	pwent->pw_gecos = fields[4];
+	pwent->pw_dir = fields[5];
+	pwent->pw_shell = fields[6];
 
-	return &pwent;
+	*result = pwent;
+	return 0;
 }
 
+/*
+ * sgetpwent - convert a string to a (struct passwd)
+ *
+ * The entry is kept in static storage. Any failing tests (see
+ * sgetpwent_r()) result in a NULL pointer being returned.
+ */
+struct passwd *sgetpwent (const char *buf)
+{
+	static struct passwd pwent;
+	static char pwdbuf[1024];
+	struct passwd *result;
+
+	(void) sgetpwent_r (buf, &pwent, pwdbuf, sizeof pwdbuf, &result);
+	return result;
+}
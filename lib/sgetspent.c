@@ -33,39 +33,49 @@
 #include <config.h>
 
 /* Newer versions of Linux libc already have shadow support.  */
-#ifndef HAVE_SGETSPENT
+#if !defined (HAVE_SGETSPENT) || !defined (HAVE_SGETSPENT_R)
 
 #ident "$Id$"
 
+#include <errno.h>
 #include <sys/types.h>
 #include "prototypes.h"
 #include "defines.h"
 #include <stdio.h>
 #define	FIELDS	9
 #define	OFIELDS	5
+
+#ifndef HAVE_SGETSPENT_R
 /*
- * sgetspent - convert string in shadow file format to (struct spwd *)
+ * sgetspent_r - convert string in shadow file format to (struct spwd *),
+ *               reentrant version
+ *
+ *	The strings of the entry are stored in buffer, which must be longer
+ *	than string. It returns 0 and sets *result to spbuf on success.
+ *	Otherwise, *result is set to NULL and it returns ERANGE if the
+ *	buffer is too small, or EINVAL if the entry is invalid.
  */
-struct spwd *sgetspent (const char *string)
+int sgetspent_r (const char *string, struct spwd *spbuf,
+                 char *buffer, size_t buflen, struct spwd **result)
 {
-	static char spwbuf[1024];
-	static struct spwd spwd;
 	char *fields[FIELDS];
 	char *cp;
 	char *cpp;
 	int i;
 
+	*result = NULL;
+
 	/*
-	 * Copy string to local buffer.  It has to be tokenized and we
+	 * Copy string to the buffer.  It has to be tokenized and we
 	 * have to do that to our private copy.
 	 */
 
-	if (strlen (string) >= sizeof spwbuf) {
-		return 0;	/* fail if too long */
+	if (strlen (string) >= buflen) {
+		return ERANGE;
 	}
-	strcpy (spwbuf, string);
+	strcpy (buffer, string);
 
-	cp = strrchr (spwbuf, '\n');
+	cp = strrchr (buffer, '\n');
 	if (NULL != cp) {
 		*cp = '\0';
 	}
@@ -75,7 +85,7 @@ struct spwd *sgetspent (const char *string)
 	 * FIELDS different fields.
 	 */
 
-	for (cp = spwbuf, i = 0; ('\0' != *cp) && (i < FIELDS); i++) {
+	for (cp = buffer, i = 0; ('\0' != *cp) && (i < FIELDS); i++) {
 		fields[i] = cp;
 		while (('\0' != *cp) && (':' != *cp)) {
 			cp++;
@@ -93,16 +103,16 @@ struct spwd *sgetspent (const char *string)
 
 	if ( ((NULL != cp) && ('\0' != *cp)) ||
 	     ((i != FIELDS) && (i != OFIELDS)) ) {
-		return 0;
+		return EINVAL;
 	}
 
 	/*
 	 * Start populating the structure.  The fields are all in
-	 * static storage, as is the structure we pass back.
+	 * the buffer.
 	 */
 
-	spwd.sp_namp = fields[0];
-	spwd.sp_pwdp = fields[1];
+	spbuf->sp_namp = fields[0];
+	spbuf->sp_pwdp = fields[1];
 
 	/*
 	 * Get the last changed date.  For all of the integer fields,
@@ -111,10 +121,10 @@ struct spwd *sgetspent (const char *string)
 	 */
 
 	if (fields[2][0] == '\0') {
-		spwd.sp_lstchg = -1;
-	} else if (   (getlong (fields[2], &spwd.sp_lstchg) == 0)
-	           || (spwd.sp_lstchg < 0)) {
-		return 0;
+		spbuf->sp_lstchg = -1;
+	} else if (   (getlong (fields[2], &spbuf->sp_lstchg) == 0)
+	           || (spbuf->sp_lstchg < 0)) {
+		return EINVAL;
 	}
 
 	/*
@@ -122,10 +132,10 @@ struct spwd *sgetspent (const char *string)
 	 */
 
 	if (fields[3][0] == '\0') {
-		spwd.sp_min = -1;
-	} else if (   (getlong (fields[3], &spwd.sp_min) == 0)
-	           || (spwd.sp_min < 0)) {
-		return 0;
+		spbuf->sp_min = -1;
+	} else if (   (getlong (fields[3], &spbuf->sp_min) == 0)
+	           || (spbuf->sp_min < 0)) {
+		return EINVAL;
 	}
 
 	/*
@@ -133,10 +143,10 @@ struct spwd *sgetspent (const char *string)
 	 */
 
 	if (fields[4][0] == '\0') {
-		spwd.sp_max = -1;
-	} else if (   (getlong (fields[4], &spwd.sp_max) == 0)
-	           || (spwd.sp_max < 0)) {
-		return 0;
+		spbuf->sp_max = -1;
+	} else if (   (getlong (fields[4], &spbuf->sp_max) == 0)
+	           || (spbuf->sp_max < 0)) {
+		return EINVAL;
 	}
 
 	/*
@@ -145,12 +155,13 @@ struct spwd *sgetspent (const char *string)
 	 */
 
 	if (i == OFIELDS) {
-		spwd.sp_warn   = -1;
-		spwd.sp_inact  = -1;
-		spwd.sp_expire = -1;
-		spwd.sp_flag   = SHADOW_SP_FLAG_UNSET;
+		spbuf->sp_warn   = -1;
+		spbuf->sp_inact  = -1;
+		spbuf->sp_expire = -1;
+		spbuf->sp_flag   = SHADOW_SP_FLAG_UNSET;
 
-		return &spwd;
+		*result = spbuf;
+		return 0;
 	}
 
 	/*
@@ -158,10 +169,10 @@ struct spwd *sgetspent (const char *string)
 	 */
 
 	if (fields[5][0] == '\0') {
-		spwd.sp_warn = -1;
-	} else if (   (getlong (fields[5], &spwd.sp_warn) == 0)
-	           || (spwd.sp_warn < 0)) {
-		return 0;
+		spbuf->sp_warn = -1;
+	} else if (   (getlong (fields[5], &spbuf->sp_warn) == 0)
+	           || (spbuf->sp_warn < 0)) {
+		return EINVAL;
 	}
 
 	/*
@@ -170,10 +181,10 @@ struct spwd *sgetspent (const char *string)
 	 */
 
 	if (fields[6][0] == '\0') {
-		spwd.sp_inact = -1;
-	} else if (   (getlong (fields[6], &spwd.sp_inact) == 0)
-	           || (spwd.sp_inact < 0)) {
-		return 0;
+		spbuf->sp_inact = -1;
+	} else if (   (getlong (fields[6], &spbuf->sp_inact) == 0)
+	           || (spbuf->sp_inact < 0)) {
+		return EINVAL;
 	}
 
 	/*
@@ -182,10 +193,10 @@ struct spwd *sgetspent (const char *string)
 	 */
 
 	if (fields[7][0] == '\0') {
-		spwd.sp_expire = -1;
-	} else if (   (getlong (fields[7], &spwd.sp_expire) == 0)
-	           || (spwd.sp_expire < 0)) {
-		return 0;
+		spbuf->sp_expire = -1;
+	} else if (   (getlong (fields[7], &spbuf->sp_expire) == 0)
+	           || (spbuf->sp_expire < 0)) {
+		return EINVAL;
 	}
 
 	/*
@@ -194,14 +205,33 @@ struct spwd *sgetspent (const char *string)
 	 */
 
 	if (fields[8][0] == '\0') {
-		spwd.sp_flag = SHADOW_SP_FLAG_UNSET;
-	} else if (getlong (fields[8], &spwd.sp_flag) == 0) {
+		spbuf->sp_flag = SHADOW_SP_FLAG_UNSET;
+	} else if (getlong (fields[8], &spbuf->sp_flag) == 0) {
 		/* FIXME: add a getulong function */
-		return 0;
+		return EINVAL;
 	}
 
-	return (&spwd);
+	*result = spbuf;
+	return 0;
+}
+#endif				/* !HAVE_SGETSPENT_R */
+
+#ifndef HAVE_SGETSPENT
+/*
+ * sgetspent - convert string in shadow file format to (struct spwd *)
+ *
+ *	The entry is kept in static storage.
+ */
+struct spwd *sgetspent (const char *string)
+{
+	static char spwbuf[1024];
+	static struct spwd spwd;
+	struct spwd *result;
+
+	(void) sgetspent_r (string, &spwd, spwbuf, sizeof spwbuf, &result);
+	return result;
 }
+#endif				/* !HAVE_SGETSPENT */
 #else
 extern int errno;		/* warning: ANSI C forbids an empty source file */
 #endif
@@ -42,6 +42,8 @@
 #include "commonio.h"
 #include "getdef.h"
 #include "sgroupio.h"
+#include "memberfile.h"
+#include "strintern.h"
 
 /*@null@*/ /*@only@*/struct sgrp *__sgr_dup (const struct sgrp *sgent)
 {
@@ -132,18 +134,76 @@
 	return sg;
 }
 
+/*
+ * __sgr_dup_packed - copy a gshadow entry in a single allocation
+ *
+ *	The lists of administrators and members and the password are
+ *	stored after the structure. The name, the administrators and the
+ *	members are interned (see strintern.h). The fields of the copy must
+ *	not be freed or reallocated, and the copy is released with
+ *	sgr_free_packed().
+ */
+/*@null@*/ /*@only@*/struct sgrp *__sgr_dup_packed (const struct sgrp *sgent)
+{
+	struct sgrp *sg;
+	size_t passwd_len;
+	size_t nadm, nmem, i;
+
+	passwd_len = strlen (sgent->sg_passwd) + 1;
+	for (nadm = 0; NULL != sgent->sg_adm[nadm]; nadm++);
+	for (nmem = 0; NULL != sgent->sg_mem[nmem]; nmem++);
+
+	sg = (struct sgrp *) malloc (  sizeof *sg
+	                             + (nadm + 1 + nmem + 1) * sizeof (char *)
+	                             + passwd_len);
+	if (NULL == sg) {
+		return NULL;
+	}
+	/* Do the same as the other _dup function, even if we know the
+	 * structure. */
+	memset (sg, 0, sizeof *sg);
+
+	sg->sg_adm = (char **) (sg + 1);
+	sg->sg_mem = sg->sg_adm + nadm + 1;
+	sg->sg_passwd = memcpy (sg->sg_mem + nmem + 1, sgent->sg_passwd,
+	                        passwd_len);
+	sg->sg_name = str_intern (sgent->sg_name);
+	if (NULL == sg->sg_name) {
+		free (sg);
+		return NULL;
+	}
+	for (i = 0; i < nadm; i++) {
+		sg->sg_adm[i] = str_intern (sgent->sg_adm[i]);
+		if (NULL == sg->sg_adm[i]) {
+			free (sg);
+			return NULL;
+		}
+	}
+	sg->sg_adm[nadm] = NULL;
+	for (i = 0; i < nmem; i++) {
+		sg->sg_mem[i] = str_intern (sgent->sg_mem[i]);
+		if (NULL == sg->sg_mem[i]) {
+			free (sg);
+			return NULL;
+		}
+	}
+	sg->sg_mem[nmem] = NULL;
+
+	return sg;
+}
+
 static /*@null@*/ /*@only@*/void *gshadow_dup (const void *ent)
 {
 	const struct sgrp *sg = ent;
 
-	return __sgr_dup (sg);
+	return __sgr_dup_packed (sg);
 }
 
 static void gshadow_free (/*@out@*/ /*@only@*/void *ent)
 {
 	struct sgrp *sg = ent;
 
-	sgr_free (sg);
+	sgr_free_packed (sg);
 }
 
 void sgr_free (/*@out@*/ /*@only@*/struct sgrp *sgent)
@@ -165,6 +225,12 @@ void sgr_free (/*@out@*/ /*@only@*/struct sgrp *sgent)
 	free (sgent);
 }
 
+void sgr_free_packed (/*@out@*/ /*@only@*/struct sgrp *sgent)
+{
+	memzero (sgent->sg_passwd, strlen (sgent->sg_passwd));
+	free (sgent);
+}
+
 static const char *gshadow_getname (const void *ent)
 {
 	const struct sgrp *gr = ent;
@@ -172,14 +238,65 @@ static const char *gshadow_getname (const void *ent)
 	return gr->sg_name;
 }
 
+static /*@null@*/char **gshadow_getmembers (const void *ent, unsigned int n)
+{
+	const struct sgrp *sg = ent;
+
+	switch (n) {
+	case 0:
+		return sg->sg_mem;
+	case 1:
+		return sg->sg_adm;
+	default:
+		return NULL;
+	}
+}
+
+static size_t gshadow_size (const void *ent)
+{
+	const struct sgrp *sg = ent;
+
+	return   sizeof *sg
+	       + strlen (sg->sg_name) + strlen (sg->sg_passwd) + 2;
+}
+
 static void *gshadow_parse (const char *line)
 {
 	return (void *) sgetsgent (line);
 }
 
+/*
+ * gshadow_parse_alloc - parse a line into a new entry
+ *
+ *	The members of a group listed as "@" are read from its member
+ *	file.
+ */
+static /*@null@*/ /*@only@*/void *gshadow_parse_alloc (const char *line)
+{
+	struct sgrp *sg = sgetsgent (line);
+	struct sgrp *dup;
+	char **members;
+
+	if (NULL == sg) {
+		return NULL;
+	}
+	if (!member_file_listed (sg->sg_mem)) {
+		return __sgr_dup_packed (sg);
+	}
+	members = member_file_read (sgr_dbname (), sg->sg_name);
+	if (NULL == members) {
+		return NULL;
+	}
+	sg->sg_mem = members;
+	dup = __sgr_dup_packed (sg);
+	member_file_free (members);
+	return dup;
+}
+
 static int gshadow_put (const void *ent, FILE * file)
 {
 	const struct sgrp *sg = ent;
+	struct sgrp sgent;
 
 	if (   (NULL == sg)
 	    || (valid_field (sg->sg_name, ":\n") == -1)
@@ -207,9 +324,125 @@ static int gshadow_put (const void *ent, FILE * file)
 		}
 	}
 
+	/* The members were written by gshadow_close_hook */
+	if (member_file_used (sg->sg_name, sg->sg_mem)) {
+		sgent = *sg;
+		sgent.sg_mem = (char **) member_file_marker ();
+		sg = &sgent;
+	}
+
 	return (putsgent (sg, file) == -1) ? -1 : 0;
 }
 
+/*
+ * gshadow_list_len - Length of the names of list, with their separators
+ *                    and the one which follows the list.
+ */
+static size_t gshadow_list_len (/*@null@*/char *const *list)
+{
+	size_t len = 0, i;
+
+	for (i = 0; (NULL != list) && (NULL != list[i]); i++) {
+		len += strlen (list[i]) + 1;
+	}
+	return (0 == len) ? 1 : len;
+}
+
+/*
+ * gshadow_list_cpy - Copy the names of list, separated by commas, to cp.
+ *
+ *	Return the end of the copy.
+ */
+static char *gshadow_list_cpy (char *cp, /*@null@*/char *const *list)
+{
+	size_t i;
+
+	for (i = 0; (NULL != list) && (NULL != list[i]); i++) {
+		if (i > 0) {
+			*cp++ = ',';
+		}
+		cp = stpcpy (cp, list[i]);
+	}
+	return cp;
+}
+
+/*
+ * gshadow_format - Append the line of sg to out, as putsgent() would
+ *                  write it.
+ */
+static int gshadow_format (const void *ent, struct commonio_buf *out)
+{
+	const struct sgrp *sg = ent;
+	struct sgrp sgent;
+	size_t len, i;
+	char *cp;
+
+	if (   (NULL == sg)
+	    || (valid_field (sg->sg_name, ":\n") == -1)
+	    || (valid_field (sg->sg_passwd, ":\n") == -1)) {
+		return -1;
+	}
+	for (i = 0; (NULL != sg->sg_adm) && (NULL != sg->sg_adm[i]); i++) {
+		if (valid_field (sg->sg_adm[i], ",:\n") == -1) {
+			return -1;
+		}
+	}
+	for (i = 0; (NULL != sg->sg_mem) && (NULL != sg->sg_mem[i]); i++) {
+		if (valid_field (sg->sg_mem[i], ",:\n") == -1) {
+			return -1;
+		}
+	}
+
+	/* The members were written by gshadow_close_hook */
+	if (member_file_used (sg->sg_name, sg->sg_mem)) {
+		sgent = *sg;
+		sgent.sg_mem = (char **) member_file_marker ();
+		sg = &sgent;
+	}
+
+	len =   strlen (sg->sg_name) + strlen (sg->sg_passwd) + 2
+	      + gshadow_list_len (sg->sg_adm) + gshadow_list_len (sg->sg_mem);
+	cp = commonio_buf_reserve (out, len);
+	if (NULL == cp) {
+		return -1;
+	}
+	cp = stpcpy (cp, sg->sg_name);
+	*cp++ = ':';
+	cp = stpcpy (cp, sg->sg_passwd);
+	*cp++ = ':';
+	cp = gshadow_list_cpy (cp, sg->sg_adm);
+	*cp++ = ':';
+	cp = gshadow_list_cpy (cp, sg->sg_mem);
+	*cp = '\n';
+	out->len += len;
+
+	return 0;
+}
+
+/*
+ * gshadow_close_hook - Write the member files of the changed large
+ *                      groups.
+ */
+static int gshadow_close_hook (void)
+{
+	const struct commonio_entry *sg;
+
+	if (commonio_parse_entries (__sgr_get_db ()) != 0) {
+		return 0;
+	}
+	for (sg = __sgr_get_head (); NULL != sg; sg = sg->next) {
+		const struct sgrp *sgptr = sg->eptr;
+
+		if (   sg->changed && (NULL != sgptr)
+		    && member_file_used (sgptr->sg_name, sgptr->sg_mem)
+		    && (member_file_write (sgr_dbname (), sgptr->sg_name,
+		                           sgptr->sg_mem) != 0)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
 static struct commonio_ops gshadow_ops = {
 	gshadow_dup,
 	gshadow_free,
@@ -219,7 +452,17 @@ static struct commonio_ops gshadow_ops = {
 	fgetsx,
 	fputsx,
 	NULL,			/* open_hook */
-	NULL			/* close_hook */
+	gshadow_close_hook,
+	NULL,			/* getid */
+	NULL,			/* free_index */
+	gshadow_getmembers,
+	gshadow_parse_alloc,
+	gshadow_format,
+	NULL,			/* getgroupid */
+	COMMONIO_NAME_FIELD (struct sgrp, sg_name),
+	0,			/* id_offset */
+	0,			/* groupid_offset */
+	gshadow_size
 };
 
 static struct commonio_db gshadow_db = {
@@ -273,11 +516,41 @@ int sgr_open (int mode)
 	return commonio_locate (&gshadow_db, name);
 }
 
+/*
+ * sgr_locate_member - Find the groups listing name as a member or as an
+ * administrator.
+ *
+ *	*groups is set to a malloced array of the *count groups.
+ *	It returns 0 on failure.
+ */
+int sgr_locate_member (const char *name,
+                       /*@out@*/const struct sgrp ***groups,
+                       /*@out@*/size_t *count)
+{
+	const void **objs;
+	int ret;
+
+	ret = commonio_locate_member (&gshadow_db, name, &objs, count);
+	*groups = (const struct sgrp **) objs;
+	return ret;
+}
+
 int sgr_update (const struct sgrp *sg)
 {
 	return commonio_update (&gshadow_db, (const void *) sg);
 }
 
+int sgr_update_owned (/*@only@*/struct sgrp *sg)
+{
+	return commonio_update_owned (&gshadow_db, (void *) sg);
+}
+
+int sgr_modify (const char *name, void (*modify) (void *ent, void *arg),
+                void *arg)
+{
+	return commonio_modify (&gshadow_db, name, modify, arg);
+}
+
 int sgr_remove (const char *name)
 {
 	return commonio_remove (&gshadow_db, name);
@@ -288,6 +561,15 @@ int sgr_rewind (void)
 	return commonio_rewind (&gshadow_db);
 }
 
+/*
+ * sgr_scan - Call scan with each struct sgrp of the database (see
+ *           commonio_scan()).
+ */
+int sgr_scan (int (*scan) (const void *ent, void *arg), void *arg)
+{
+	return commonio_scan (&gshadow_db, scan, arg);
+}
+
 /*@null@*/const struct sgrp *sgr_next (void)
 {
 	return commonio_next (&gshadow_db);
@@ -308,8 +590,17 @@ void __sgr_set_changed (void)
 	gshadow_db.changed = true;
 }
 
+struct commonio_db *__sgr_get_db (void)
+{
+	return &gshadow_db;
+}
+
 /*@dependent@*/ /*@null@*/struct commonio_entry *__sgr_get_head (void)
 {
+	/* NULL with errno set to ENOMEM if an entry cannot be parsed */
+	if (commonio_parse_entries (&gshadow_db) != 0) {
+		return NULL;
+	}
 	return gshadow_db.head;
 }
 
@@ -318,6 +609,11 @@ void __sgr_del_entry (const struct commonio_entry *ent)
 	commonio_del_entry (&gshadow_db, ent);
 }
 
+bool __sgr_has_duplicate (const struct commonio_entry *ent)
+{
+	return commonio_has_duplicate (&gshadow_db, ent);
+}
+
 /* Sort with respect to group ordering. */
 int sgr_sort ()
 {
@@ -38,6 +38,9 @@
 extern int sgr_close (void);
 extern bool sgr_file_present (void);
 extern /*@observer@*/ /*@null@*/const struct sgrp *sgr_locate (const char *name);
+extern int sgr_locate_member (const char *name,
+                              /*@out@*/const struct sgrp ***groups,
+                              /*@out@*/size_t *count);
 extern int sgr_lock (void);
 extern int sgr_setdbname (const char *filename);
 extern /*@observer@*/const char *sgr_dbname (void);
@@ -45,8 +48,13 @@ extern /*@null@*/const struct sgrp *sgr_next (void);
 extern int sgr_open (int mode);
 extern int sgr_remove (const char *name);
 extern int sgr_rewind (void);
+extern int sgr_scan (int (*scan) (const void *ent, void *arg), void *arg);
 extern int sgr_unlock (void);
 extern int sgr_update (const struct sgrp *sg);
+extern int sgr_update_owned (/*@only@*/struct sgrp *sg);
+extern int sgr_modify (const char *name,
+                       void (*modify) (void *ent, void *arg),
+                       void *arg);
 extern int sgr_sort (void);
 
 #endif
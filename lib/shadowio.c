@@ -51,14 +51,14 @@ static /*@null@*/ /*@only@*/void *shadow_dup (const void *ent)
 {
 	const struct spwd *sp = ent;
 
-	return __spw_dup (sp);
+	return __spw_dup_packed (sp);
 }
 
 static void shadow_free (/*@out@*//*@only@*/void *ent)
 {
 	struct spwd *sp = ent;
 
-	spw_free (sp);
+	spw_free_packed (sp);
 }
 
 static const char *shadow_getname (const void *ent)
@@ -68,11 +68,43 @@ static const char *shadow_getname (const void *ent)
 	return sp->sp_namp;
 }
 
+static size_t shadow_size (const void *ent)
+{
+	const struct spwd *sp = ent;
+
+	return sizeof *sp + strlen (sp->sp_namp) + strlen (sp->sp_pwdp) + 2;
+}
+
 static void *shadow_parse (const char *line)
 {
 	return (void *) sgetspent (line);
 }
 
+/*
+ * shadow_parse_alloc - parse a line into a packed entry
+ *
+ *	The strings are stored after the structure, as with
+ *	__spw_dup_packed().
+ */
+static /*@null@*/ /*@only@*/void *shadow_parse_alloc (const char *line)
+{
+	struct spwd *sp, *result;
+	size_t len = strlen (line) + 1;
+
+	sp = (struct spwd *) malloc (sizeof *sp + len);
+	if (NULL == sp) {
+		return NULL;
+	}
+	/* The libc might define other fields. They are not set. */
+	memset (sp, 0, sizeof *sp);
+	(void) sgetspent_r (line, sp, (char *) (sp + 1), len, &result);
+	if (NULL == result) {
+		free (sp);
+		return NULL;
+	}
+	return sp;
+}
+
 static int shadow_put (const void *ent, FILE * file)
 {
 	const struct spwd *sp = ent;
@@ -86,6 +118,68 @@ static int shadow_put (const void *ent, FILE * file)
 	return (putspent (sp, file) == -1) ? -1 : 0;
 }
 
+/*
+ * shadow_format - Append the line of sp to out, as putspent() would
+ *                 write it.
+ */
+static int shadow_format (const void *ent, struct commonio_buf *out)
+{
+	const struct spwd *sp = ent;
+	char nums[7][32];
+	size_t len, i;
+	char *cp;
+
+	if (   (NULL == sp)
+	    || (valid_field (sp->sp_namp, ":\n") == -1)
+	    || (valid_field (sp->sp_pwdp, ":\n") == -1)) {
+		return -1;
+	}
+
+	/* The unset numbers are empty */
+	{
+		long vals[6];
+
+		vals[0] = sp->sp_lstchg;
+		vals[1] = sp->sp_min;
+		vals[2] = sp->sp_max;
+		vals[3] = sp->sp_warn;
+		vals[4] = sp->sp_inact;
+		vals[5] = sp->sp_expire;
+		for (i = 0; i < 6; i++) {
+			nums[i][0] = '\0';
+			if (-1 != vals[i]) {
+				(void) snprintf (nums[i], sizeof nums[i], "%ld",
+				                 vals[i]);
+			}
+		}
+	}
+	nums[6][0] = '\0';
+	if (SHADOW_SP_FLAG_UNSET != sp->sp_flag) {
+		(void) snprintf (nums[6], sizeof nums[6], "%ld",
+		                 (long) sp->sp_flag);
+	}
+
+	len = strlen (sp->sp_namp) + strlen (sp->sp_pwdp) + 9;
+	for (i = 0; i < 7; i++) {
+		len += strlen (nums[i]);
+	}
+	cp = commonio_buf_reserve (out, len);
+	if (NULL == cp) {
+		return -1;
+	}
+	cp = stpcpy (cp, sp->sp_namp);
+	*cp++ = ':';
+	cp = stpcpy (cp, sp->sp_pwdp);
+	for (i = 0; i < 7; i++) {
+		*cp++ = ':';
+		cp = stpcpy (cp, nums[i]);
+	}
+	*cp = '\n';
+	out->len += len;
+
+	return 0;
+}
+
 static struct commonio_ops shadow_ops = {
 	shadow_dup,
 	shadow_free,
@@ -95,7 +189,17 @@ static struct commonio_ops shadow_ops = {
 	fgets,
 	fputs,
 	NULL,			/* open_hook */
-	NULL			/* close_hook */
+	NULL,			/* close_hook */
+	NULL,			/* getid */
+	NULL,			/* free_index */
+	NULL,			/* getmembers */
+	shadow_parse_alloc,
+	shadow_format,
+	NULL,			/* getgroupid */
+	COMMONIO_NAME_FIELD (struct spwd, sp_namp),
+	0,			/* id_offset */
+	0,			/* groupid_offset */
+	shadow_size
 };
 
 static struct commonio_db shadow_db = {
@@ -187,16 +291,59 @@ int spw_update (const struct spwd *sp)
 	return commonio_update (&shadow_db, (const void *) sp);
 }
 
+int spw_update_owned (/*@only@*/struct spwd *sp)
+{
+	return commonio_update_owned (&shadow_db, (void *) sp);
+}
+
+int spw_modify (const char *name, void (*modify) (void *ent, void *arg),
+                void *arg)
+{
+	return commonio_modify (&shadow_db, name, modify, arg);
+}
+
 int spw_remove (const char *name)
 {
 	return commonio_remove (&shadow_db, name);
 }
 
+/*
+ * spw_stream_edits - Apply the edits to the locked database, which is
+ *                    not open (see commonio_stream()).
+ */
+int spw_stream_edits (struct commonio_edit *edits, size_t count)
+{
+	int retval = 0;
+#ifdef WITH_TCB
+	bool use_tcb = getdef_bool ("USE_TCB");
+
+	if (use_tcb && (shadowtcb_drop_priv () == SHADOWTCB_FAILURE)) {
+		return 0;
+	}
+#endif				/* WITH_TCB */
+	retval = commonio_stream (&shadow_db, edits, count);
+#ifdef WITH_TCB
+	if (use_tcb && (shadowtcb_gain_priv () == SHADOWTCB_FAILURE)) {
+		return 0;
+	}
+#endif				/* WITH_TCB */
+	return retval;
+}
+
 int spw_rewind (void)
 {
 	return commonio_rewind (&shadow_db);
 }
 
+/*
+ * spw_scan - Call scan with each struct spwd of the database (see
+ *           commonio_scan()).
+ */
+int spw_scan (int (*scan) (const void *ent, void *arg), void *arg)
+{
+	return commonio_scan (&shadow_db, scan, arg);
+}
+
 /*@observer@*/ /*@null@*/const struct spwd *spw_next (void)
 {
 	return commonio_next (&shadow_db);
@@ -245,8 +392,17 @@ int spw_unlock (void)
 #endif				/* WITH_TCB */
 }
 
+struct commonio_db *__spw_get_db (void)
+{
+	return &shadow_db;
+}
+
 struct commonio_entry *__spw_get_head (void)
 {
+	/* NULL with errno set to ENOMEM if an entry cannot be parsed */
+	if (commonio_parse_entries (&shadow_db) != 0) {
+		return NULL;
+	}
 	return shadow_db.head;
 }
 
@@ -255,6 +411,11 @@ void __spw_del_entry (const struct commonio_entry *ent)
 	commonio_del_entry (&shadow_db, ent);
 }
 
+bool __spw_has_duplicate (const struct commonio_entry *ent)
+{
+	return commonio_has_duplicate (&shadow_db, ent);
+}
+
 /* Sort with respect to passwd ordering. */
 int spw_sort ()
 {
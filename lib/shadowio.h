@@ -36,6 +36,8 @@
 
 #include "defines.h"
 
+struct commonio_edit;
+
 extern int spw_close (void);
 extern bool spw_file_present (void);
 extern /*@observer@*/ /*@null@*/const struct spwd *spw_locate (const char *name);
@@ -46,8 +48,14 @@ extern /*@observer@*/ /*@null@*/const struct spwd *spw_next (void);
 extern int spw_open (int mode);
 extern int spw_remove (const char *name);
 extern int spw_rewind (void);
+extern int spw_stream_edits (struct commonio_edit *edits, size_t count);
+extern int spw_scan (int (*scan) (const void *ent, void *arg), void *arg);
 extern int spw_unlock (void);
 extern int spw_update (const struct spwd *sp);
+extern int spw_update_owned (/*@only@*/struct spwd *sp);
+extern int spw_modify (const char *name,
+                       void (*modify) (void *ent, void *arg),
+                       void *arg);
 extern int spw_sort (void);
 
 #endif
@@ -40,6 +40,7 @@
 #include <shadow.h>
 #include <stdio.h>
 #include "shadowio.h"
+#include "strintern.h"
 
 /*@null@*/ /*@only@*/struct spwd *__spw_dup (const struct spwd *spent)
 {
@@ -87,3 +88,50 @@ void spw_free (/*@out@*/ /*@only@*/struct spwd *spent)
 	free (spent);
 }
 
+/*
+ * __spw_dup_packed - copy a shadow entry in a single allocation
+ *
+ *	The password is stored after the structure, and the name is
+ *	interned (see strintern.h). The fields of the copy must not be
+ *	freed or reallocated, and the copy is released with
+ *	spw_free_packed().
+ */
+/*@null@*/ /*@only@*/struct spwd *__spw_dup_packed (const struct spwd *spent)
+{
+	struct spwd *sp;
+	size_t pwdp_len;
+	char *cp;
+
+	pwdp_len = strlen (spent->sp_pwdp) + 1;
+
+	sp = (struct spwd *) malloc (sizeof *sp + pwdp_len);
+	if (NULL == sp) {
+		return NULL;
+	}
+	/* The libc might define other fields. They won't be copied. */
+	memset (sp, 0, sizeof *sp);
+	sp->sp_lstchg = spent->sp_lstchg;
+	sp->sp_min    = spent->sp_min;
+	sp->sp_max    = spent->sp_max;
+	sp->sp_warn   = spent->sp_warn;
+	sp->sp_inact  = spent->sp_inact;
+	sp->sp_expire = spent->sp_expire;
+	sp->sp_flag   = spent->sp_flag;
+
+	sp->sp_namp = str_intern (spent->sp_namp);
+	if (NULL == sp->sp_namp) {
+		free (sp);
+		return NULL;
+	}
+	cp = (char *) (sp + 1);
+	sp->sp_pwdp = memcpy (cp, spent->sp_pwdp, pwdp_len);
+
+	return sp;
+}
+
+void spw_free_packed (/*@out@*/ /*@only@*/struct spwd *spent)
+{
+	memzero (spent->sp_pwdp, strlen (spent->sp_pwdp));
+	free (spent);
+}
+
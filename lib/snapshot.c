@@ -0,0 +1,538 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "commonio.h"
+#include "snapshot.h"
+
+struct build_entry {
+	const char *name;
+	struct snapshot_record rec;
+};
+
+struct snapshot {
+	const struct snapshot_header *header;
+	const struct snapshot_record *records;
+	size_t size;
+	const char *text;
+	size_t text_size;
+};
+
+static void stat_to_header (const struct stat *sb,
+                            struct snapshot_header *h);
+static bool is_continuation (const struct commonio_db *db);
+static /*@null@*/char *join_line (const char *line, size_t len,
+                                  bool continuation);
+static int name_cmp (const void *p1, const void *p2);
+static int id_cmp (const void *p1, const void *p2);
+static int snapshot_open (const struct commonio_db *db,
+                          struct snapshot *s);
+static void snapshot_close (struct snapshot *s);
+static int snapshot_parse (const struct commonio_db *db,
+                           const struct snapshot *s,
+                           const struct snapshot_record *rec,
+                           void **ent);
+
+static void stat_to_header (const struct stat *sb, struct snapshot_header *h)
+{
+	h->dev = (uint64_t) sb->st_dev;
+	h->ino = (uint64_t) sb->st_ino;
+	h->size = (uint64_t) sb->st_size;
+	h->mtime_sec = (int64_t) sb->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	h->mtime_nsec = (int64_t) sb->st_mtim.tv_nsec;
+#else				/* !HAVE_STRUCT_STAT_ST_MTIM */
+	h->mtime_nsec = 0;
+#endif				/* !HAVE_STRUCT_STAT_ST_MTIM */
+}
+
+/*
+ * is_continuation - Whether a line ending with a backslash continues on
+ *                   the next line (see fgetsx).
+ */
+static bool is_continuation (const struct commonio_db *db)
+{
+	return (db->ops->fgets == fgetsx);
+}
+
+/*
+ * join_line - Copy a line of the text file, with the continuation
+ *             lines joined.
+ */
+static /*@null@*/char *join_line (const char *line, size_t len,
+                                  bool continuation)
+{
+	char *buf, *dst;
+	size_t i;
+
+	buf = malloc (len + 1);
+	if (NULL == buf) {
+		return NULL;
+	}
+	dst = buf;
+	for (i = 0; i < len; i++) {
+		if (   continuation
+		    && ('\\' == line[i])
+		    && ((i + 1) < len)
+		    && ('\n' == line[i + 1])) {
+			i++;
+			continue;
+		}
+		*dst++ = line[i];
+	}
+	*dst = '\0';
+	return buf;
+}
+
+static int name_cmp (const void *p1, const void *p2)
+{
+	const struct build_entry *e1 = p1;
+	const struct build_entry *e2 = p2;
+	size_t len;
+	int ret;
+
+	len = e1->rec.name_length;
+	if (e2->rec.name_length < len) {
+		len = e2->rec.name_length;
+	}
+	ret = memcmp (e1->name, e2->name, len);
+	if (0 != ret) {
+		return ret;
+	}
+	if (e1->rec.name_length != e2->rec.name_length) {
+		return (e1->rec.name_length < e2->rec.name_length) ? -1 : 1;
+	}
+	/* Keep the order of the file */
+	return (e1->rec.offset < e2->rec.offset) ? -1 : 1;
+}
+
+static int id_cmp (const void *p1, const void *p2)
+{
+	const struct build_entry *e1 = p1;
+	const struct build_entry *e2 = p2;
+
+	if (e1->rec.id != e2->rec.id) {
+		return (e1->rec.id < e2->rec.id) ? -1 : 1;
+	}
+	return (e1->rec.offset < e2->rec.offset) ? -1 : 1;
+}
+
+/*
+ * commonio_snapshot_update - Rebuild the snapshot of the database file.
+ *
+ *	It is called after the database file was replaced, while it is
+ *	still locked. The snapshot is written to <file>.idx+ and renamed.
+ *	If the snapshot cannot be built, <file>.idx is removed. There is
+ *	no snapshot for the databases without a getname operation.
+ *
+ *	It returns 1 on success, 0 on failure.
+ */
+int commonio_snapshot_update (const struct commonio_db *db)
+{
+	char buf[1024];
+	char tmp[1024];
+	struct snapshot_header h;
+	struct build_entry *entries = NULL;
+	size_t count = 0, alloc = 0, id_count = 0, i;
+	struct stat sb;
+	const char *text = NULL, *cp, *end;
+	bool continuation = is_continuation (db);
+	FILE *fp = NULL;
+	int fd;
+	int ret = 0;
+
+	if (   ((size_t) snprintf (buf, sizeof buf, "%s.idx",
+	                           db->filename) >= sizeof buf)
+	    || ((size_t) snprintf (tmp, sizeof tmp, "%s.idx+",
+	                           db->filename) >= sizeof tmp)) {
+		/* No snapshot can be written, nor used by snapshot_open */
+		return 0;
+	}
+
+	if (NULL == db->ops->getname) {
+		/* The entries cannot be searched by name */
+		(void) unlink (buf);
+		return 0;
+	}
+
+	fd = open (db->filename, O_RDONLY | O_NOCTTY);
+	if (fd < 0) {
+		goto out;
+	}
+	if (   (fstat (fd, &sb) != 0)
+	    || !S_ISREG (sb.st_mode)
+	    || ((unsigned long long) sb.st_size > SIZE_MAX)
+	    || ((unsigned long long) sb.st_size > UINT32_MAX)) {
+		goto out;
+	}
+	if (sb.st_size > 0) {
+		text = mmap (NULL, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE,
+		             fd, 0);
+		if (MAP_FAILED == text) {
+			text = NULL;
+			goto out;
+		}
+	}
+
+	cp = text;
+	end = text + sb.st_size;
+	while (cp < end) {
+		const char *line = cp;
+		const char *nl, *name;
+		size_t len;
+		char *joined;
+		void *eptr;
+
+		for (;;) {
+			nl = memchr (cp, '\n', (size_t) (end - cp));
+			cp = (NULL != nl) ? nl + 1 : end;
+			if (   continuation
+			    && (NULL != nl)
+			    && (nl > line)
+			    && ('\\' == nl[-1])
+			    && (cp < end)) {
+				continue;
+			}
+			break;
+		}
+		len = (size_t) (cp - line);
+		if ((NULL != nl) && (cp == nl + 1)) {
+			len--;	/* without the newline */
+		}
+
+		joined = join_line (line, len, continuation);
+		if (NULL == joined) {
+			goto out;
+		}
+		eptr = db->ops->parse (joined);
+		free (joined);
+		if (NULL == eptr) {
+			/* Lines which cannot be parsed are not found */
+			continue;
+		}
+
+		/* The name must start the line, as it is searched there */
+		name = db->ops->getname (eptr);
+		if (   (strlen (name) > len)
+		    || (strncmp (line, name, strlen (name)) != 0)) {
+			continue;
+		}
+
+		if (count == alloc) {
+			struct build_entry *e;
+
+			alloc = (0 == alloc) ? 64 : (alloc * 2);
+			e = realloc (entries, alloc * sizeof *entries);
+			if (NULL == e) {
+				goto out;
+			}
+			entries = e;
+		}
+		entries[count].name = line;
+		entries[count].rec.offset = (uint64_t) (line - text);
+		entries[count].rec.length = (uint32_t) len;
+		entries[count].rec.name_length = (uint32_t) strlen (name);
+		entries[count].rec.id = (NULL != db->ops->getid)
+		                        ? (uint32_t) db->ops->getid (eptr)
+		                        : 0;
+		entries[count].rec.pad = 0;
+		count++;
+	}
+	if (NULL != db->ops->getid) {
+		id_count = count;
+	}
+
+	memzero (&h, sizeof h);
+	memcpy (h.magic, SNAPSHOT_MAGIC, sizeof h.magic);
+	h.name_count = (uint32_t) count;
+	h.id_count = (uint32_t) id_count;
+	stat_to_header (&sb, &h);
+
+	/* The snapshot has the permissions of the database */
+	fp = fopen (tmp, "w");
+	if (NULL == fp) {
+		goto out;
+	}
+#ifdef HAVE_FCHOWN
+	if (fchown (fileno (fp), sb.st_uid, sb.st_gid) != 0) {
+		goto out;
+	}
+#endif				/* HAVE_FCHOWN */
+#ifdef HAVE_FCHMOD
+	if (fchmod (fileno (fp), sb.st_mode & 0664) != 0) {
+		goto out;
+	}
+#endif				/* HAVE_FCHMOD */
+
+	if (fwrite (&h, sizeof h, 1, fp) != 1) {
+		goto out;
+	}
+	if (count > 0) {
+		qsort (entries, count, sizeof *entries, name_cmp);
+	}
+	for (i = 0; i < count; i++) {
+		if (fwrite (&entries[i].rec, sizeof entries[i].rec, 1, fp) != 1) {
+			goto out;
+		}
+	}
+	if (id_count > 0) {
+		qsort (entries, id_count, sizeof *entries, id_cmp);
+	}
+	for (i = 0; i < id_count; i++) {
+		if (fwrite (&entries[i].rec, sizeof entries[i].rec, 1, fp) != 1) {
+			goto out;
+		}
+	}
+	if (fclose (fp) != 0) {
+		fp = NULL;
+		goto out;
+	}
+	fp = NULL;
+
+	if (rename (tmp, buf) == 0) {
+		ret = 1;
+	}
+
+      out:
+	if (NULL != fp) {
+		(void) fclose (fp);
+	}
+	if (0 == ret) {
+		(void) unlink (tmp);
+		(void) unlink (buf);
+	}
+	free (entries);
+	if (NULL != text) {
+		(void) munmap ((void *) text, (size_t) sb.st_size);
+	}
+	if (fd >= 0) {
+		(void) close (fd);
+	}
+	return ret;
+}
+
+/*
+ * snapshot_open - Map the snapshot and the text file.
+ *
+ *	It returns 1 on success, 0 if there is no snapshot or if it is not
+ *	up to date.
+ */
+static int snapshot_open (const struct commonio_db *db, struct snapshot *s)
+{
+	char buf[1024];
+	struct snapshot_header h;
+	struct stat sb, isb;
+	void *map;
+	int fd, ifd;
+	int ret = 0;
+
+	memzero (s, sizeof *s);
+	if ((size_t) snprintf (buf, sizeof buf, "%s.idx",
+	                       db->filename) >= sizeof buf) {
+		return 0;
+	}
+
+	ifd = open (buf, O_RDONLY | O_NOCTTY);
+	if (ifd < 0) {
+		return 0;
+	}
+	fd = open (db->filename, O_RDONLY | O_NOCTTY);
+	if (fd < 0) {
+		(void) close (ifd);
+		return 0;
+	}
+
+	if (   (fstat (fd, &sb) != 0)
+	    || (fstat (ifd, &isb) != 0)
+	    || !S_ISREG (isb.st_mode)
+	    || ((unsigned long long) isb.st_size > SIZE_MAX)
+	    || ((size_t) isb.st_size < sizeof h)) {
+		goto out;
+	}
+	memzero (&h, sizeof h);
+	memcpy (h.magic, SNAPSHOT_MAGIC, sizeof h.magic);
+	stat_to_header (&sb, &h);
+
+	map = mmap (NULL, (size_t) isb.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+	if (MAP_FAILED == map) {
+		goto out;
+	}
+	s->header = map;
+	s->size = (size_t) isb.st_size;
+	s->records = (const struct snapshot_record *) (s->header + 1);
+	if (   (memcmp (h.magic, s->header->magic, sizeof h.magic) != 0)
+	    || (h.dev != s->header->dev)
+	    || (h.ino != s->header->ino)
+	    || (h.size != s->header->size)
+	    || (h.mtime_sec != s->header->mtime_sec)
+	    || (h.mtime_nsec != s->header->mtime_nsec)
+	    || (  (  (size_t) s->header->name_count
+	           + (size_t) s->header->id_count)
+	        != ((s->size - sizeof h) / sizeof *s->records))) {
+		goto out;
+	}
+
+	s->text_size = (size_t) sb.st_size;
+	if (s->text_size > 0) {
+		map = mmap (NULL, s->text_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED == map) {
+			goto out;
+		}
+		s->text = map;
+	}
+	ret = 1;
+
+      out:
+	if ((0 == ret) && (NULL != s->header)) {
+		(void) munmap ((void *) s->header, s->size);
+		s->header = NULL;
+	}
+	(void) close (fd);
+	(void) close (ifd);
+	return ret;
+}
+
+static void snapshot_close (struct snapshot *s)
+{
+	if (NULL != s->text) {
+		(void) munmap ((void *) s->text, s->text_size);
+	}
+	if (NULL != s->header) {
+		(void) munmap ((void *) s->header, s->size);
+	}
+}
+
+/*
+ * snapshot_parse - Parse the line of a record with the parse operation.
+ */
+static int snapshot_parse (const struct commonio_db *db,
+                           const struct snapshot *s,
+                           const struct snapshot_record *rec,
+                           void **ent)
+{
+	char *line;
+
+	if (   (rec->offset > s->text_size)
+	    || (rec->length > (s->text_size - rec->offset))) {
+		return -1;
+	}
+	line = join_line (s->text + rec->offset, rec->length,
+	                  is_continuation (db));
+	if (NULL == line) {
+		return -1;
+	}
+	*ent = db->ops->parse (line);
+	free (line);
+	return (NULL != *ent) ? 1 : -1;
+}
+
+/*
+ * commonio_snapshot_locate - Find the first entry with the given name in
+ *                            the snapshot of the database file.
+ *
+ *	It returns 1 and sets *ent (parsed in the static area of the parse
+ *	operation) if the entry was found, 0 if it is not in the database,
+ *	and -1 if the snapshot cannot be used. In the last case, the text
+ *	file shall be searched.
+ *
+ *	The database does not need to be open.
+ */
+int commonio_snapshot_locate (const struct commonio_db *db,
+                              const char *name,
+                              void **ent)
+{
+	struct snapshot s;
+	size_t lo, hi, len;
+	int ret = 0;
+
+	if (snapshot_open (db, &s) == 0) {
+		return -1;
+	}
+
+	len = strlen (name);
+	lo = 0;
+	hi = s.header->name_count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct snapshot_record *rec = &s.records[mid];
+		size_t n = (rec->name_length < len) ? rec->name_length : len;
+		int cmp;
+
+		if (   (rec->offset > s.text_size)
+		    || (rec->name_length > (s.text_size - rec->offset))) {
+			ret = -1;
+			goto out;
+		}
+		cmp = memcmp (s.text + rec->offset, name, n);
+		if ((0 == cmp) && (rec->name_length < len)) {
+			cmp = -1;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (   (lo < s.header->name_count)
+	    && (s.records[lo].name_length == len)
+	    && (memcmp (s.text + s.records[lo].offset, name, len) == 0)) {
+		ret = snapshot_parse (db, &s, &s.records[lo], ent);
+	}
+
+      out:
+	snapshot_close (&s);
+	return ret;
+}
+
+/*
+ * commonio_snapshot_locate_id - Find the first entry with the given ID
+ *                               in the snapshot of the database file.
+ *
+ *	See commonio_snapshot_locate().
+ */
+int commonio_snapshot_locate_id (const struct commonio_db *db,
+                                 id_t id,
+                                 void **ent)
+{
+	struct snapshot s;
+	const struct snapshot_record *ids;
+	size_t lo, hi;
+	int ret = 0;
+
+	if (NULL == db->ops->getid) {
+		return -1;
+	}
+	if (snapshot_open (db, &s) == 0) {
+		return -1;
+	}
+
+	ids = s.records + s.header->name_count;
+	lo = 0;
+	hi = s.header->id_count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ids[mid].id < (uint32_t) id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((lo < s.header->id_count) && (ids[lo].id == (uint32_t) id)) {
+		ret = snapshot_parse (db, &s, &ids[lo], ent);
+	}
+
+	snapshot_close (&s);
+	return ret;
+}
@@ -0,0 +1,42 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+
+/*
+ * Binary snapshot of a database: <file>.idx
+ *
+ * The snapshot indexes the lines of the text file by name and by ID
+ * (for the databases with a getid operation). It does not copy the
+ * lines: the records are offsets into the text file. The snapshot is
+ * only used when the text file is still the file it was built from
+ * (same device, inode, size and modification time); otherwise, the
+ * lookups fall back to reading the text file.
+ *
+ * The snapshot is a cache of the host: it uses the native byte order
+ * and is rebuilt when its magic does not match.
+ *
+ * This format is also read by the shadowidx NSS module.
+ */
+#define SNAPSHOT_MAGIC "shidx\0\0\1"
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t name_count;	/* records sorted by name */
+	uint32_t id_count;	/* records sorted by ID, after the above */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+struct snapshot_record {
+	uint64_t offset;	/* start of the line in the text file */
+	uint32_t length;	/* length of the line, without the '\n' */
+	uint32_t name_length;	/* the name starts the line */
+	uint32_t id;
+	uint32_t pad;
+};
+
+#endif
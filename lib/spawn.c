@@ -35,18 +35,68 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif				/* HAVE_POSIX_SPAWN */
 #include "exitcodes.h"
 #include "prototypes.h"
 
-int run_command (const char *cmd, const char *argv[],
-                 /*@null@*/const char *envp[], /*@out@*/int *status)
+/*
+ * start_command - start cmd, without waiting for it
+ *
+ *	It returns the PID of the child, which must be waited for with
+ *	wait_command(), or -1 if the child could not be created.
+ *
+ *	If cmd cannot be executed, the child exits with E_CMD_NOTFOUND or
+ *	E_CMD_NOEXEC.
+ */
+pid_t start_command (const char *cmd, const char *argv[],
+                     /*@null@*/const char *envp[])
 {
-	pid_t pid, wpid;
+	pid_t pid;
+#ifdef HAVE_POSIX_SPAWN
+	int err;
+#endif				/* HAVE_POSIX_SPAWN */
 
 	if (NULL == envp) {
 		envp = (const char **)environ;
 	}
 
+#ifdef HAVE_POSIX_SPAWN
+	/*
+	 * posix_spawn does not copy the page tables of the caller, which
+	 * may have large databases loaded.
+	 */
+	err = posix_spawn (&pid, cmd, NULL, NULL,
+	                   (char * const *) argv, (char * const *) envp);
+	if (0 == err) {
+		return pid;
+	}
+	if ((EAGAIN == err) || (ENOMEM == err)) {
+		fprintf (stderr, "%s: cannot execute %s: %s\n",
+		         Prog, cmd, strerror (err));
+		return -1;
+	}
+
+	/*
+	 * The command could not be executed. Report it as the exit status
+	 * of a child, as if execve had failed in the child.
+	 */
+	if (ENOENT != err) {
+		fprintf (stderr, "%s: cannot execute %s: %s\n",
+		         Prog, cmd, strerror (err));
+	}
+	pid = vfork ();
+	if (0 == pid) {
+		_exit ((ENOENT == err) ? E_CMD_NOTFOUND : E_CMD_NOEXEC);
+	} else if ((pid_t)-1 == pid) {
+		fprintf (stderr, "%s: cannot execute %s: %s\n",
+		         Prog, cmd, strerror (errno));
+		return -1;
+	}
+
+	return pid;
+#else				/* !HAVE_POSIX_SPAWN */
 	(void) fflush (stdout);
 	(void) fflush (stderr);
 
@@ -66,6 +116,17 @@ int run_command (const char *cmd, const char *argv[],
 		return -1;
 	}
 
+	return pid;
+#endif				/* !HAVE_POSIX_SPAWN */
+}
+
+/*
+ * wait_command - wait for a child started with start_command()
+ */
+int wait_command (pid_t pid, /*@out@*/int *status)
+{
+	pid_t wpid;
+
 	do {
 		wpid = waitpid (pid, status, 0);
 	} while (   ((pid_t)-1 == wpid && errno == EINTR)
@@ -80,3 +141,15 @@ int run_command (const char *cmd, const char *argv[],
 	return 0;
 }
 
+int run_command (const char *cmd, const char *argv[],
+                 /*@null@*/const char *envp[], /*@out@*/int *status)
+{
+	pid_t pid;
+
+	pid = start_command (cmd, argv, envp);
+	if ((pid_t)-1 == pid) {
+		return -1;
+	}
+
+	return wait_command (pid, status);
+}
@@ -10,22 +10,41 @@
 #include "defines.h"
 #include "prototypes.h"
 #include "sssd.h"
+#include "timing.h"
 
 #define MSG_SSSD_FLUSH_CACHE_FAILED "%s: Failed to flush the sssd cache.\n"
 
+static struct timespec flush_start;
+
+/*
+ * sssd_flush_cache - flush specified service buffer in sssd cache
+ */
 int sssd_flush_cache (int dbflags)
 {
-	int status, code, rv;
+	pid_t pid;
+
+	if (sssd_flush_cache_start (dbflags, &pid) != 0) {
+		return -1;
+	}
+	return sssd_flush_cache_wait (pid);
+}
+
+/*
+ * sssd_flush_cache_start - start sss_cache, without waiting for it
+ *
+ *	pid is set to the PID of sss_cache, to be passed to
+ *	sssd_flush_cache_wait(). It is set to -1 if there is nothing to
+ *	flush.
+ */
+int sssd_flush_cache_start (int dbflags, /*@out@*/pid_t *pid)
+{
 	const char *cmd = "/usr/sbin/sss_cache";
-	char *sss_cache_args = NULL;
+	char sss_cache_args[4];
 	const char *spawnedArgs[] = {"sss_cache", NULL, NULL};
 	const char *spawnedEnv[] = {NULL};
 	int i = 0;
 
-	sss_cache_args = malloc(4);
-	if (sss_cache_args == NULL) {
-	    return -1;
-	}
+	*pid = (pid_t) -1;
 
 	sss_cache_args[i++] = '-';
 	if (dbflags & SSSD_DB_PASSWD) {
@@ -37,15 +56,37 @@ int sssd_flush_cache (int dbflags)
 	sss_cache_args[i++] = '\0';
 	if (i == 2) {
 		/* Neither passwd nor group, nothing to do */
-		free(sss_cache_args);
 		return 0;
 	}
 	spawnedArgs[1] = sss_cache_args;
 
-	rv = run_command (cmd, spawnedArgs, spawnedEnv, &status);
-	free(sss_cache_args);
+	timing_start (&flush_start);
+	*pid = start_command (cmd, spawnedArgs, spawnedEnv);
+	if ((pid_t) -1 == *pid) {
+		/* start_command writes its own more detailed message. */
+		(void) fprintf (stderr, _(MSG_SSSD_FLUSH_CACHE_FAILED), Prog);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * sssd_flush_cache_wait - wait for the sss_cache started by
+ *                         sssd_flush_cache_start()
+ */
+int sssd_flush_cache_wait (pid_t pid)
+{
+	int status, code, rv;
+
+	if ((pid_t) -1 == pid) {
+		return 0;
+	}
+
+	rv = wait_command (pid, &status);
+	timing_stop (TIMING_SSSD, &flush_start, 0, 0);
 	if (rv != 0) {
-		/* run_command writes its own more detailed message. */
+		/* wait_command writes its own more detailed message. */
 		(void) fprintf (stderr, _(MSG_SSSD_FLUSH_CACHE_FAILED), Prog);
 		return -1;
 	}
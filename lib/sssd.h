@@ -1,16 +1,25 @@
 #ifndef _SSSD_H_
 #define _SSSD_H_
 
+#include <sys/types.h>
+
 #define SSSD_DB_PASSWD	0x001
 #define SSSD_DB_GROUP	0x002
 
 /*
  * sssd_flush_cache - flush specified service buffer in sssd cache
+ * sssd_flush_cache_start - start flushing, without waiting for sss_cache
+ * sssd_flush_cache_wait - wait for the flush started by
+ *                         sssd_flush_cache_start
  */
 #ifdef	USE_SSSD
 extern int sssd_flush_cache (int dbflags);
+extern int sssd_flush_cache_start (int dbflags, /*@out@*/pid_t *pid);
+extern int sssd_flush_cache_wait (pid_t pid);
 #else
 #define sssd_flush_cache(service) (0)
+#define sssd_flush_cache_start(service, pid) ((void) (service), *(pid) = (pid_t) -1, 0)
+#define sssd_flush_cache_wait(pid) (0)
 #endif
 
 #endif
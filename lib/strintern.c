@@ -0,0 +1,138 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defines.h"
+#include "arena.h"
+#include "strintern.h"
+
+/*
+ * The strings are stored in an arena, and found with an open addressing
+ * hash table, which doubles when it is half full.
+ */
+#define INTERN_MIN_SLOTS	1024
+
+struct intern_slot {
+	/*@dependent@*/ /*@null@*/char *s;
+	uint32_t hash;
+};
+
+static struct arena intern_arena;
+static /*@only@*/ /*@null@*/struct intern_slot *slots = NULL;
+static size_t slot_count = 0;	/* a power of 2 */
+static size_t used = 0;
+
+/*
+ * intern_hash - FNV-1a hash of a string of the given length
+ */
+static uint32_t intern_hash (const char *s, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * intern_find - Return the slot of the string, or the free slot where
+ * it would be added.
+ */
+static struct intern_slot *intern_find (const char *s, size_t len,
+                                        uint32_t h)
+{
+	size_t i = h & (slot_count - 1);
+
+	while (NULL != slots[i].s) {
+		if (   (slots[i].hash == h)
+		    && (strncmp (slots[i].s, s, len) == 0)
+		    && ('\0' == slots[i].s[len])) {
+			break;
+		}
+		i = (i + 1) & (slot_count - 1);
+	}
+	return &slots[i];
+}
+
+/*
+ * intern_grow - Double the size of the table.
+ */
+static bool intern_grow (void)
+{
+	size_t count = (0 == slot_count) ? INTERN_MIN_SLOTS : slot_count * 2;
+	struct intern_slot *old = slots;
+	size_t old_count = slot_count;
+	size_t i, j;
+
+	slots = (struct intern_slot *) calloc (count, sizeof *slots);
+	if (NULL == slots) {
+		slots = old;
+		return false;
+	}
+	slot_count = count;
+	for (i = 0; i < old_count; i++) {
+		if (NULL == old[i].s) {
+			continue;
+		}
+		j = old[i].hash & (count - 1);
+		while (NULL != slots[j].s) {
+			j = (j + 1) & (count - 1);
+		}
+		slots[j] = old[i];
+	}
+	free (old);
+	return true;
+}
+
+/*
+ * str_intern_n - Intern the len first characters of s.
+ *
+ *	It returns NULL (with errno set to ENOMEM) on failure.
+ */
+/*@observer@*/ /*@null@*/char *str_intern_n (const char *s, size_t len)
+{
+	struct intern_slot *slot;
+	uint32_t h;
+
+	if (((used + 1) * 2 > slot_count) && !intern_grow ()) {
+		return NULL;
+	}
+
+	h = intern_hash (s, len);
+	slot = intern_find (s, len, h);
+	if (NULL == slot->s) {
+		slot->s = arena_strndup (&intern_arena, s, len);
+		if (NULL == slot->s) {
+			return NULL;
+		}
+		slot->hash = h;
+		used++;
+	}
+	return slot->s;
+}
+
+/*@observer@*/ /*@null@*/char *str_intern (const char *s)
+{
+	return str_intern_n (s, strlen (s));
+}
+
+/*
+ * str_interned - Whether s is an interned string (and not only equal to
+ * one).
+ */
+bool str_interned (const char *s)
+{
+	size_t len;
+
+	if (0 == used) {
+		return false;
+	}
+	len = strlen (s);
+	return (intern_find (s, len, intern_hash (s, len))->s == s);
+}
@@ -0,0 +1,27 @@
+#ifndef _STRINTERN_H_
+#define _STRINTERN_H_
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Interned strings
+ *
+ * A string which is interned is stored once per process, and the same
+ * pointer is returned for all the copies of the string: the names of
+ * the users are shared by the entries of passwd and shadow and by the
+ * lists of members of the groups, the home prefixes and the shells by
+ * the entries of passwd. Two interned strings are equal if and only if
+ * they are the same pointer.
+ *
+ * The interned strings must not be modified nor freed. They are only
+ * released when the process exits. Passwords must not be interned.
+ */
+extern /*@observer@*/ /*@null@*/char *str_intern (const char *s);
+extern /*@observer@*/ /*@null@*/char *str_intern_n (const char *s,
+                                                   size_t len);
+extern bool str_interned (const char *s);
+
+#endif
@@ -0,0 +1,266 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#ifdef ENABLE_SUBIDS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_DLOPEN
+#include <dlfcn.h>
+#endif
+#include "prototypes.h"
+#include "defines.h"
+#include "getdef.h"
+#include "subidprovider.h"
+
+/*
+ * The answers of the provider are kept in SUB_ID_CACHE_DIR, in a file
+ * per owner and type ("uid.<owner>" or "gid.<owner>") with a
+ * "start:count" line per range. For SUB_ID_CACHE_TTL seconds, a cached
+ * answer is used without querying the provider, so that newuidmap and
+ * newgidmap do not wait for a slow or unreachable service.
+ */
+#define SUBID_CACHE_TTL_DEFAULT	300
+
+static bool provider_loaded = false;
+static /*@null@*/subid_list_ranges_func provider_list_ranges = NULL;
+
+/*
+ * provider_load - Load SUB_ID_PROVIDER, once.
+ *
+ *	Return false if it cannot be loaded.
+ */
+static bool provider_load (const char *path)
+{
+#ifdef HAVE_DLOPEN
+	void *handle;
+#endif
+
+	if (provider_loaded) {
+		return (NULL != provider_list_ranges);
+	}
+	provider_loaded = true;
+
+#ifdef HAVE_DLOPEN
+	handle = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+	if (NULL == handle) {
+		(void) fprintf (stderr,
+		                _("%s: cannot load %s: %s\n"),
+		                Prog, path, dlerror ());
+		SYSLOG ((LOG_ERR, "cannot load %s", path));
+		return false;
+	}
+	*(void **) (&provider_list_ranges) =
+		dlsym (handle, SUBID_PROVIDER_LIST_RANGES);
+	if (NULL == provider_list_ranges) {
+		(void) fprintf (stderr,
+		                _("%s: %s does not provide %s\n"),
+		                Prog, path, SUBID_PROVIDER_LIST_RANGES);
+		SYSLOG ((LOG_ERR, "%s does not provide %s",
+		         path, SUBID_PROVIDER_LIST_RANGES));
+		(void) dlclose (handle);
+		return false;
+	}
+	return true;
+#else				/* !HAVE_DLOPEN */
+	(void) fprintf (stderr,
+	                _("%s: cannot load %s: not supported\n"),
+	                Prog, path);
+	SYSLOG ((LOG_ERR, "cannot load %s", path));
+	return false;
+#endif				/* !HAVE_DLOPEN */
+}
+
+/*
+ * cache_path - Build the path of the cache file of owner.
+ *
+ *	Return false if the answers are not cached, or if owner cannot be
+ *	used in a file name.
+ */
+static bool cache_path (enum subid_type type, const char *owner,
+                        char *buf, size_t size)
+{
+	const char *dir = getdef_str ("SUB_ID_CACHE_DIR");
+	int len;
+
+	if (   (NULL == dir) || ('\0' == dir[0])
+	    || (getdef_long ("SUB_ID_CACHE_TTL", SUBID_CACHE_TTL_DEFAULT) <= 0)
+	    || ('\0' == owner[0]) || ('.' == owner[0])
+	    || (NULL != strchr (owner, '/'))) {
+		return false;
+	}
+	len = snprintf (buf, size, "%s/%s.%s", dir,
+	                (SUBID_TYPE_UID == type) ? "uid" : "gid", owner);
+	return (len > 0) && ((size_t) len < size);
+}
+
+/*
+ * cache_read - Read the cached ranges of owner, if they did not expire.
+ *
+ *	Only the files owned by root are trusted.
+ */
+static bool cache_read (const char *path,
+                        struct subid_provider_range **ranges, size_t *count)
+{
+	struct subid_provider_range *r = NULL;
+	size_t n = 0, size = 0;
+	struct stat sb;
+	char buf[128];
+	time_t now;
+	long ttl;
+	FILE *fp;
+
+	fp = fopen (path, "r");
+	if (NULL == fp) {
+		return false;
+	}
+	ttl = getdef_long ("SUB_ID_CACHE_TTL", SUBID_CACHE_TTL_DEFAULT);
+	now = time (NULL);
+	if (   (fstat (fileno (fp), &sb) != 0)
+	    || !S_ISREG (sb.st_mode)
+	    || (0 != sb.st_uid)
+	    || (now < sb.st_mtime)
+	    || (now - sb.st_mtime >= ttl)) {
+		(void) fclose (fp);
+		return false;
+	}
+
+	while (fgets (buf, (int) sizeof buf, fp) == buf) {
+		struct subid_provider_range range;
+		char *sep, *nl;
+
+		nl = strchr (buf, '\n');
+		if (NULL != nl) {
+			*nl = '\0';
+		}
+		sep = strchr (buf, ':');
+		if (NULL == sep) {
+			goto invalid;
+		}
+		*sep = '\0';
+		if (   (getulong (buf, &range.start) == 0)
+		    || (getulong (sep + 1, &range.count) == 0)) {
+			goto invalid;
+		}
+		if (n == size) {
+			struct subid_provider_range *tmp;
+
+			size = (0 == size) ? 4 : size * 2;
+			tmp = realloc (r, size * sizeof (*r));
+			if (NULL == tmp) {
+				goto invalid;
+			}
+			r = tmp;
+		}
+		r[n] = range;
+		n++;
+	}
+	(void) fclose (fp);
+	*ranges = r;
+	*count = n;
+	return true;
+
+      invalid:
+	free (r);
+	(void) fclose (fp);
+	return false;
+}
+
+/*
+ * cache_write - Replace the cached ranges of owner.
+ *
+ *	Errors are ignored: the provider is then queried again next time.
+ */
+static void cache_write (const char *path,
+                         const struct subid_provider_range *ranges,
+                         size_t count)
+{
+	char tmp[1024];
+	size_t i;
+	FILE *fp;
+	int fd;
+
+	if (snprintf (tmp, sizeof tmp, "%s.XXXXXX", path) >= (int) sizeof tmp) {
+		return;
+	}
+	fd = mkstemp (tmp);
+	if (fd < 0) {
+		return;
+	}
+	fp = fdopen (fd, "w");
+	if (NULL == fp) {
+		(void) close (fd);
+		(void) unlink (tmp);
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		(void) fprintf (fp, "%lu:%lu\n", ranges[i].start, ranges[i].count);
+	}
+	if (   (fchmod (fd, 0644) != 0)
+	    || (fflush (fp) != 0)
+	    || (fclose (fp) != 0)
+	    || (rename (tmp, path) != 0)) {
+		(void) unlink (tmp);
+	}
+}
+
+/*
+ * subid_provider_ranges - Get the subordinate IDs of owner from
+ * SUB_ID_PROVIDER.
+ *
+ *	On success, *ranges is a malloc()ed array of the *count ranges
+ *	of owner (NULL if there are none), which the caller frees.
+ *
+ *	Return 1 on success, 0 if SUB_ID_PROVIDER is not set (the local
+ *	files are used), and -1 if the provider failed and no valid
+ *	cached answer is available.
+ */
+int subid_provider_ranges (enum subid_type type, const char *owner,
+                           struct subid_provider_range **ranges,
+                           size_t *count)
+{
+	const char *provider = getdef_str ("SUB_ID_PROVIDER");
+	char path[1024];
+	bool cached;
+
+	*ranges = NULL;
+	*count = 0;
+	if ((NULL == provider) || ('\0' == provider[0])) {
+		return 0;
+	}
+
+	cached = cache_path (type, owner, path, sizeof path);
+	if (cached && cache_read (path, ranges, count)) {
+		return 1;
+	}
+
+	if (!provider_load (provider)) {
+		errno = ENOSYS;
+		return -1;
+	}
+	if (provider_list_ranges (owner, type, ranges, count) != 0) {
+		SYSLOG ((LOG_WARN, "cannot get the subordinate %s of %s from %s",
+		         (SUBID_TYPE_UID == type) ? "UIDs" : "GIDs",
+		         owner, provider));
+		*ranges = NULL;
+		*count = 0;
+		if (0 == errno) {
+			errno = EIO;
+		}
+		return -1;
+	}
+	if (cached) {
+		cache_write (path, *ranges, *count);
+	}
+	return 1;
+}
+#else				/* !ENABLE_SUBIDS */
+extern int errno;		/* warning: ANSI C forbids an empty source file */
+#endif				/* !ENABLE_SUBIDS */
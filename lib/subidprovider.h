@@ -0,0 +1,50 @@
+#ifndef _SUBIDPROVIDER_H_
+#define _SUBIDPROVIDER_H_
+
+#include <config.h>
+
+#ifdef ENABLE_SUBIDS
+
+#include <sys/types.h>
+
+/*
+ * Providers of subordinate IDs (SUB_ID_PROVIDER)
+ *
+ * By default, the subordinate IDs are read from /etc/subuid and
+ * /etc/subgid. SUB_ID_PROVIDER can name a shared object which answers
+ * for another source (e.g. a central service for a fleet of hosts). It
+ * must export:
+ *
+ *	int shadow_subid_list_ranges (const char *owner,
+ *	                              enum subid_type type,
+ *	                              struct subid_provider_range **ranges,
+ *	                              size_t *count);
+ *
+ * which sets *ranges to a malloc()ed array of the *count ranges of owner
+ * (none if the owner has no ranges), freed by the caller, and returns
+ * 0. It returns -1 if the source cannot be queried.
+ */
+enum subid_type {
+	SUBID_TYPE_UID,
+	SUBID_TYPE_GID
+};
+
+struct subid_provider_range {
+	unsigned long start;
+	unsigned long count;
+};
+
+#define SUBID_PROVIDER_LIST_RANGES	"shadow_subid_list_ranges"
+
+typedef int (*subid_list_ranges_func) (const char *owner,
+                                       enum subid_type type,
+                                       struct subid_provider_range **ranges,
+                                       size_t *count);
+
+extern int subid_provider_ranges (enum subid_type type, const char *owner,
+                                  /*@out@*/struct subid_provider_range **ranges,
+                                  /*@out@*/size_t *count);
+
+#endif				/* ENABLE_SUBIDS */
+
+#endif
@@ -11,7 +11,13 @@
 #include <stdio.h>
 #include "commonio.h"
 #include "subordinateio.h"
+#include "subidprovider.h"
+#include "getdef.h"
+#include "probes.h"
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <pwd.h>
 
 struct subordinate_range {
@@ -22,6 +28,9 @@ struct subordinate_range {
 
 #define NFIELDS 3
 
+static void range_index_free (/*@only@*/void *p);
+static int subordinate_range_cmp (const void *p1, const void *p2);
+
 /*
  * subordinate_dup: create a duplicate range
  *
@@ -150,6 +159,8 @@ static struct commonio_ops subordinate_ops = {
 	fputs,			/* fputs */
 	NULL,			/* open_hook */
 	NULL,			/* close_hook */
+	NULL,			/* getid */
+	range_index_free,	/* free_index */
 };
 
 static /*@observer@*/ /*@null*/const struct subordinate_range *subordinate_next(struct commonio_db *db)
@@ -157,6 +168,456 @@ static /*@observer@*/ /*@null*/const struct subordinate_range *subordinate_next(
 	return (const struct subordinate_range *)commonio_next (db);
 }
 
+/*
+ * UID of a range owner, as returned by getpwnam().
+ */
+struct owner_uid {
+	/*@owned@*/char *name;
+	bool found;
+	uid_t uid;
+};
+
+/*
+ * Index of the ranges of a database, kept in its type_index.
+ *
+ * It is built on the first query and kept up to date by add_range and
+ * remove_range, which are the only functions changing the ranges.
+ */
+struct range_index {
+	/* Entries sorted with subordinate_range_cmp */
+	/*@owned@*/struct commonio_entry **by_start;
+	/* Entries sorted by owner, then by start */
+	/*@owned@*/struct commonio_entry **by_owner;
+	/*
+	 * Highest end (last ID + 1) of the entries by_start[0] to
+	 * by_start[i]. It is rebuilt when needed if max_end_valid is not
+	 * set.
+	 */
+	/*@owned@*/unsigned long *max_end;
+	/*
+	 * Owner UID of by_start[i], or NULL if it was not resolved yet.
+	 * It points to an element of owners.
+	 */
+	/*@owned@*/const struct owner_uid **owner_uids;
+	size_t count;
+	size_t size;
+	bool max_end_valid;
+	/*
+	 * Set when the linked list is known to be sorted with
+	 * subordinate_range_cmp.
+	 */
+	bool list_sorted;
+	/*
+	 * Owner names already resolved, sorted by name. Each name is thus
+	 * looked up only once while the database is open.
+	 */
+	/*@owned@*/struct owner_uid **owners;
+	size_t owners_count;
+	size_t owners_size;
+};
+
+static const struct subordinate_range *entry_range (
+	const struct commonio_entry *ent)
+{
+	return (const struct subordinate_range *) ent->eptr;
+}
+
+static unsigned long range_last (const struct subordinate_range *range)
+{
+	return range->start + range->count - 1;
+}
+
+static unsigned long range_end (const struct subordinate_range *range)
+{
+	return range->start + range->count;
+}
+
+static int owner_cmp (const void *p1, const void *p2)
+{
+	const struct subordinate_range *range1, *range2;
+	int ret;
+
+	range1 = entry_range (*(struct commonio_entry * const *) p1);
+	range2 = entry_range (*(struct commonio_entry * const *) p2);
+
+	ret = strcmp (range1->owner, range2->owner);
+	if (0 != ret)
+		return ret;
+	if (range1->start < range2->start)
+		return -1;
+	else if (range1->start > range2->start)
+		return 1;
+	else if (range1->count < range2->count)
+		return -1;
+	else if (range1->count > range2->count)
+		return 1;
+	return 0;
+}
+
+static void range_index_free (/*@only@*/void *p)
+{
+	struct range_index *idx = p;
+	size_t i;
+
+	for (i = 0; i < idx->owners_count; i++) {
+		free (idx->owners[i]->name);
+		free (idx->owners[i]);
+	}
+	free (idx->owners);
+	free (idx->by_start);
+	free (idx->by_owner);
+	free (idx->max_end);
+	free (idx->owner_uids);
+	free (idx);
+}
+
+static bool range_index_grow (struct range_index *idx, size_t size)
+{
+	struct commonio_entry **by_start, **by_owner;
+	unsigned long *max_end;
+	const struct owner_uid **owner_uids;
+
+	by_start = realloc (idx->by_start, size * sizeof (*by_start));
+	if (NULL == by_start)
+		return false;
+	idx->by_start = by_start;
+	by_owner = realloc (idx->by_owner, size * sizeof (*by_owner));
+	if (NULL == by_owner)
+		return false;
+	idx->by_owner = by_owner;
+	max_end = realloc (idx->max_end, size * sizeof (*max_end));
+	if (NULL == max_end)
+		return false;
+	idx->max_end = max_end;
+	owner_uids = realloc (idx->owner_uids, size * sizeof (*owner_uids));
+	if (NULL == owner_uids)
+		return false;
+	idx->owner_uids = owner_uids;
+	idx->size = size;
+	return true;
+}
+
+/*
+ * range_index_fill: (re)build the arrays of @idx from the entries of @db.
+ *
+ * The owner UIDs already resolved are kept.
+ *
+ * Returns false on allocation failure.
+ */
+static bool range_index_fill (struct commonio_db *db, struct range_index *idx)
+{
+	struct commonio_entry *ent;
+	size_t n = 0;
+
+	if (commonio_parse_entries (db) != 0)
+		return false;
+	for (ent = db->head; NULL != ent; ent = ent->next) {
+		if (NULL != ent->eptr)
+			n++;
+	}
+	if ((n >= idx->size) && !range_index_grow (idx, n + 64))
+		return false;
+
+	idx->count = 0;
+	for (ent = db->head; NULL != ent; ent = ent->next) {
+		if (NULL != ent->eptr) {
+			idx->by_start[idx->count] = ent;
+			idx->by_owner[idx->count] = ent;
+			idx->owner_uids[idx->count] = NULL;
+			idx->count++;
+		}
+	}
+	qsort (idx->by_start, idx->count, sizeof (*idx->by_start),
+	       subordinate_range_cmp);
+	qsort (idx->by_owner, idx->count, sizeof (*idx->by_owner),
+	       owner_cmp);
+	idx->max_end_valid = false;
+	idx->list_sorted = false;
+	return true;
+}
+
+/*
+ * range_index: return the index of @db, building it if needed.
+ *
+ * Returns NULL (with errno set) on failure.
+ */
+static /*@null@*/struct range_index *range_index (struct commonio_db *db)
+{
+	struct range_index *idx;
+
+	if (NULL != db->type_index)
+		return db->type_index;
+
+	idx = calloc (1, sizeof (*idx));
+	if (NULL == idx)
+		return NULL;
+
+	if (!range_index_fill (db, idx)) {
+		range_index_free (idx);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	db->type_index = idx;
+	return idx;
+}
+
+/*
+ * first_after: return the position in @a of the first entry greater
+ *              than @ent according to @cmp.
+ */
+static size_t first_after (struct commonio_entry **a, size_t n,
+			   struct commonio_entry *ent,
+			   int (*cmp) (const void *, const void *))
+{
+	size_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (cmp (&a[mid], &ent) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * find_entry: return the position of @ent in @a, which is sorted
+ *             according to @cmp, or @n if it is not found.
+ */
+static size_t find_entry (struct commonio_entry **a, size_t n,
+			  struct commonio_entry *ent,
+			  int (*cmp) (const void *, const void *))
+{
+	size_t i = first_after (a, n, ent, cmp);
+
+	/* Look for ent among the entries equal to it */
+	while (i > 0) {
+		i--;
+		if (a[i] == ent)
+			return i;
+		if (cmp (&a[i], &ent) != 0)
+			break;
+	}
+	return n;
+}
+
+/*
+ * range_index_insert: add the entry @ent to the index of @db.
+ *
+ * If the index is not built, nothing is done. If it cannot be grown, it
+ * is released and built again on the next query.
+ */
+static void range_index_insert (struct commonio_db *db,
+				struct commonio_entry *ent)
+{
+	struct range_index *idx = db->type_index;
+	size_t pos;
+
+	if (NULL == idx)
+		return;
+	if (   (idx->count == idx->size)
+	    && !range_index_grow (idx, idx->size * 2)) {
+		/* Build it again on the next query */
+		range_index_free (idx);
+		db->type_index = NULL;
+		return;
+	}
+
+	pos = first_after (idx->by_start, idx->count, ent,
+			   subordinate_range_cmp);
+	/* The list is still sorted if ent was appended after the highest range */
+	idx->list_sorted =    idx->list_sorted
+			   && (pos == idx->count)
+			   && (ent == db->tail)
+			   && (ent->prev == ((0 == pos) ? NULL
+			                                : idx->by_start[pos - 1]));
+	if (idx->max_end_valid && (pos == idx->count)) {
+		unsigned long end = range_end (entry_range (ent));
+
+		if ((pos > 0) && (idx->max_end[pos - 1] > end))
+			end = idx->max_end[pos - 1];
+		idx->max_end[pos] = end;
+	} else {
+		idx->max_end_valid = false;
+	}
+	memmove (&idx->by_start[pos + 1], &idx->by_start[pos],
+		 (idx->count - pos) * sizeof (*idx->by_start));
+	idx->by_start[pos] = ent;
+	memmove (&idx->owner_uids[pos + 1], &idx->owner_uids[pos],
+		 (idx->count - pos) * sizeof (*idx->owner_uids));
+	idx->owner_uids[pos] = NULL;
+
+	pos = first_after (idx->by_owner, idx->count, ent, owner_cmp);
+	memmove (&idx->by_owner[pos + 1], &idx->by_owner[pos],
+		 (idx->count - pos) * sizeof (*idx->by_owner));
+	idx->by_owner[pos] = ent;
+
+	idx->count++;
+}
+
+/*
+ * range_index_remove: remove the entry @ent from the index of @db.
+ *
+ * This must be done before the range of @ent is changed.
+ */
+static void range_index_remove (struct commonio_db *db,
+				struct commonio_entry *ent)
+{
+	struct range_index *idx = db->type_index;
+	size_t pos;
+
+	if (NULL == idx)
+		return;
+
+	pos = find_entry (idx->by_start, idx->count, ent,
+			  subordinate_range_cmp);
+	if (pos < idx->count) {
+		memmove (&idx->by_start[pos], &idx->by_start[pos + 1],
+			 (idx->count - pos - 1) * sizeof (*idx->by_start));
+		memmove (&idx->owner_uids[pos], &idx->owner_uids[pos + 1],
+			 (idx->count - pos - 1) * sizeof (*idx->owner_uids));
+		if (pos != idx->count - 1)
+			idx->max_end_valid = false;
+	}
+	pos = find_entry (idx->by_owner, idx->count, ent, owner_cmp);
+	if (pos < idx->count) {
+		memmove (&idx->by_owner[pos], &idx->by_owner[pos + 1],
+			 (idx->count - pos - 1) * sizeof (*idx->by_owner));
+		idx->count--;
+	}
+}
+
+/*
+ * max_end: return the highest end (last ID + 1) of the ranges
+ *          by_start[0] to by_start[@i].
+ */
+static unsigned long max_end (struct range_index *idx, size_t i)
+{
+	if (!idx->max_end_valid) {
+		size_t j;
+
+		for (j = 0; j < idx->count; j++) {
+			unsigned long end = range_end (entry_range (idx->by_start[j]));
+
+			if ((j > 0) && (idx->max_end[j - 1] > end))
+				end = idx->max_end[j - 1];
+			idx->max_end[j] = end;
+		}
+		idx->max_end_valid = true;
+	}
+	return idx->max_end[i];
+}
+
+/*
+ * start_after: return the position in by_start of the first range
+ *              starting after @val.
+ */
+static size_t start_after (const struct range_index *idx, unsigned long val)
+{
+	size_t lo = 0, hi = idx->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (entry_range (idx->by_start[mid])->start <= val)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * owner_first: return the position in by_owner of the first range of
+ *              @owner, or of the first range of the following owner.
+ */
+static size_t owner_first (const struct range_index *idx, const char *owner)
+{
+	size_t lo = 0, hi = idx->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (strcmp (entry_range (idx->by_owner[mid])->owner, owner) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * resolve_owner: return the UID of @name, looking it up only if it was not
+ *                already resolved.
+ *
+ * Returns NULL on allocation failure.
+ */
+static /*@null@*/const struct owner_uid *resolve_owner (
+	struct range_index *idx, const char *name)
+{
+	struct owner_uid *ou;
+	const struct passwd *pwd;
+	size_t lo = 0, hi = idx->owners_count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp (idx->owners[mid]->name, name);
+
+		if (0 == cmp)
+			return idx->owners[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (idx->owners_count == idx->owners_size) {
+		size_t size = (0 == idx->owners_size) ? 16 : idx->owners_size * 2;
+		struct owner_uid **owners;
+
+		owners = realloc (idx->owners, size * sizeof (*owners));
+		if (NULL == owners)
+			return NULL;
+		idx->owners = owners;
+		idx->owners_size = size;
+	}
+	ou = malloc (sizeof (*ou));
+	if (NULL == ou)
+		return NULL;
+	ou->name = strdup (name);
+	if (NULL == ou->name) {
+		free (ou);
+		return NULL;
+	}
+	pwd = timed_getpwnam (name);
+	ou->found = (NULL != pwd);
+	ou->uid = (NULL != pwd) ? pwd->pw_uid : (uid_t) -1;
+
+	memmove (&idx->owners[lo + 1], &idx->owners[lo],
+		 (idx->owners_count - lo) * sizeof (*idx->owners));
+	idx->owners[lo] = ou;
+	idx->owners_count++;
+	return ou;
+}
+
+/*
+ * range_owner_uid: return the owner UID of by_start[@i].
+ */
+static /*@null@*/const struct owner_uid *range_owner_uid (
+	struct range_index *idx, size_t i)
+{
+	if (NULL == idx->owner_uids[i]) {
+		const struct subordinate_range *range;
+
+		range = entry_range (idx->by_start[i]);
+		idx->owner_uids[i] = resolve_owner (idx, range->owner);
+	}
+	return idx->owner_uids[i];
+}
+
 /*
  * range_exists: Check whether @owner owns any ranges
  *
@@ -167,13 +628,15 @@ static /*@observer@*/ /*@null*/const struct subordinate_range *subordinate_next(
  */
 static const bool range_exists(struct commonio_db *db, const char *owner)
 {
-	const struct subordinate_range *range;
-	commonio_rewind(db);
-	while ((range = commonio_next(db)) != NULL) {
-		if (0 == strcmp(range->owner, owner))
-			return true;
-	}
-	return false;
+	struct range_index *idx = range_index (db);
+	size_t i;
+
+	if (NULL == idx)
+		return false;
+
+	i = owner_first (idx, owner);
+	return (i < idx->count)
+	    && (0 == strcmp (entry_range (idx->by_owner[i])->owner, owner));
 }
 
 /*
@@ -190,25 +653,24 @@ static const bool range_exists(struct commonio_db *db, const char *owner)
 static const struct subordinate_range *find_range(struct commonio_db *db,
 						  const char *owner, unsigned long val)
 {
+	struct range_index *idx = range_index (db);
 	const struct subordinate_range *range;
+	size_t i;
+
+	if (NULL == idx)
+		return NULL;
 
 	/*
-	 * Search for exact username/group specification
-	 *
-	 * This is the original method - go fast through the db, doing only
-	 * exact username/group string comparison. Therefore we leave it as-is
-	 * for the time being, in order to keep it equally fast as it was
-	 * before.
+	 * Search for exact username/group specification, among the
+	 * ranges of @owner starting at or before @val.
 	 */
-	commonio_rewind(db);
-	while ((range = commonio_next(db)) != NULL) {
-		unsigned long first = range->start;
-		unsigned long last = first + range->count - 1;
-
-		if (0 != strcmp(range->owner, owner))
-			continue;
-
-		if ((val >= first) && (val <= last))
+	for (i = owner_first (idx, owner);
+	     (i < idx->count)
+	     && (0 == strcmp (entry_range (idx->by_owner[i])->owner, owner))
+	     && (entry_range (idx->by_owner[i])->start <= val);
+	     i++) {
+		range = entry_range (idx->by_owner[i]);
+		if (val <= range_last (range))
 			return range;
 	}
 
@@ -226,27 +688,29 @@ static const struct subordinate_range *find_range(struct commonio_db *db,
          * (It may be specified as literal UID or as another username which
          * has the same UID as the username we are looking for.)
          */
-        struct passwd *pwd;
+        const struct owner_uid *ou;
         uid_t          owner_uid;
         char           owner_uid_string[33] = "";
 
 
         /* Get UID of the username we are looking for */
-        pwd = getpwnam(owner);
-        if (NULL == pwd) {
+        ou = resolve_owner(idx, owner);
+        if ((NULL == ou) || !ou->found) {
                 /* Username not defined in /etc/passwd, or error occured during lookup */
                 return NULL;
         }
-        owner_uid = pwd->pw_uid;
+        owner_uid = ou->uid;
         sprintf(owner_uid_string, "%lu", (unsigned long int)owner_uid);
 
-        commonio_rewind(db);
-        while ((range = commonio_next(db)) != NULL) {
-                unsigned long first = range->start;
-                unsigned long last = first + range->count - 1;
+        /*
+         * Only the ranges starting at or before @val are checked, and the
+         * search stops when none of the remaining ones end after @val.
+         */
+        for (i = start_after (idx, val); (i > 0) && (max_end (idx, i - 1) > val); i--) {
+                range = entry_range (idx->by_start[i - 1]);
 
                 /* For performance reasons check range before using getpwnam() */
-                if ((val < first) || (val > last)) {
+                if (val > range_last (range)) {
                         continue;
                 }
 
@@ -268,15 +732,18 @@ static const struct subordinate_range *find_range(struct commonio_db *db,
                  *
                  * If specified as literal username, we will get its
                  * UID and compare that to UID we are looking for.
+                 *
+                 * The UIDs are cached, so that each owner is looked up
+                 * only once.
                  */
-                const struct passwd *range_owner_pwd;
+                const struct owner_uid *range_owner;
 
-                range_owner_pwd = getpwnam(range->owner);
-                if (NULL == range_owner_pwd) {
+                range_owner = range_owner_uid(idx, i - 1);
+                if ((NULL == range_owner) || !range_owner->found) {
                         continue;
                 }
 
-                if (owner_uid == range_owner_pwd->pw_uid) {
+                if (owner_uid == range_owner->uid) {
                         return range;
                 }
         }
@@ -355,34 +822,64 @@ static int subordinate_range_cmp (const void *p1, const void *p2)
 }
 
 /*
- * find_free_range: find an unused consecutive sequence of ids to allocate
- *                  to a user.
+ * find_free_ranges: find @n unused consecutive sequences of ids to
+ *                   allocate to users.
  * @db: database to search
  * @min: the first uid in the range to find
  * @max: the highest uid to find
- * @count: the number of uids needed
+ * @count: the number of uids needed in each sequence
+ * @n: the number of sequences
+ * @starts: the first uid of each sequence found
  *
- * Return the lowest new uid, or ULONG_MAX on failure.
+ * The sequences are carved, from the lowest ones, in a single walk of the
+ * ranges of the database. They are the same as the ones found by @n calls
+ * to find_free_range(), with the sequences found added between the calls.
+ *
+ * Return false if less than @n sequences are available.
  */
-static unsigned long find_free_range(struct commonio_db *db,
-				     unsigned long min, unsigned long max,
-				     unsigned long count)
+static bool find_free_ranges(struct commonio_db *db,
+			     unsigned long min, unsigned long max,
+			     unsigned long count,
+			     size_t n, /*@out@*/unsigned long *starts)
 {
-	const struct subordinate_range *range;
+	struct range_index *idx;
 	unsigned long low, high;
+	size_t i, found = 0;
+
+	if (0 == n)
+		return true;
 
 	/* When given invalid parameters fail */
 	if ((count == 0) || (max < min))
-		goto fail;
+		return false;
+
+	idx = range_index (db);
+	if (NULL == idx)
+		return false;
 
-	/* Sort by range then by owner */
-	commonio_sort (db, subordinate_range_cmp);
-	commonio_rewind(db);
+	/*
+	 * Sort by range then by owner.
+	 * The ranges are searched with the index, but the database is
+	 * still written sorted.
+	 */
+	if (!idx->list_sorted) {
+		commonio_sort (db, subordinate_range_cmp);
+		idx->list_sorted = true;
+	}
 
+	/* Skip the ranges starting before min */
+	i = start_after (idx, min);
 	low = min;
-	while ((range = commonio_next(db)) != NULL) {
+	if ((i > 0) && (max_end (idx, i - 1) > low)) {
+		low = max_end (idx, i - 1);
+		if (low > max)
+			return false;
+	}
+
+	for (; i < idx->count; i++) {
+		const struct subordinate_range *range = entry_range (idx->by_start[i]);
 		unsigned long first = range->start;
-		unsigned long last = first + range->count - 1;
+		unsigned long last = range_last (range);
 
 		/* Find the top end of the hole before this range */
 		high = first;
@@ -392,22 +889,107 @@ static unsigned long find_free_range(struct commonio_db *db,
 			high = max + 1;
 		}
 
-		/* Is the hole before this range large enough? */
-		if ((high > low) && ((high - low) >= count))
-			return low;
+		/* Carve the hole before this range */
+		while ((high > low) && ((high - low) >= count)) {
+			starts[found] = low;
+			found++;
+			if (found == n)
+				return true;
+			low += count;
+		}
 
 		/* Compute the low end of the next hole */
 		if (low < (last + 1))
 			low = last + 1;
 		if (low > max)
-			goto fail;
+			return false;
 	}
 
-	/* Is the remaining unclaimed area large enough? */
-	if (((max - low) + 1) >= count)
-		return low;
-fail:
-	return ULONG_MAX;
+	/* Carve the remaining unclaimed area */
+	while ((low <= max) && (((max - low) + 1) >= count)) {
+		starts[found] = low;
+		found++;
+		if (found == n)
+			return true;
+		low += count;
+	}
+	return false;
+}
+
+/*
+ * find_free_range: find an unused consecutive sequence of ids to allocate
+ *                  to a user.
+ * @db: database to search
+ * @min: the first uid in the range to find
+ * @max: the highest uid to find
+ * @count: the number of uids needed
+ *
+ * Return the lowest new uid, or ULONG_MAX on failure.
+ */
+static unsigned long find_free_range(struct commonio_db *db,
+				     unsigned long min, unsigned long max,
+				     unsigned long count)
+{
+	unsigned long start;
+
+	SHADOW_PROBE4 (find_free_range__entry, db->filename, min, max, count);
+	if (!find_free_ranges (db, min, max, count, 1, &start))
+		start = ULONG_MAX;
+	SHADOW_PROBE2 (find_free_range__return, db->filename, start);
+	return start;
+}
+
+/*
+ * next_range: return the next range of the database.
+ * @db: database to iterate
+ * @start: set to the first id of the range
+ * @count: set to the number of ids in the range
+ *
+ * Return false at the end of the database.
+ */
+static bool next_range(struct commonio_db *db,
+		       unsigned long *start, unsigned long *count)
+{
+	const struct subordinate_range *range;
+
+	range = commonio_next(db);
+	if (NULL == range)
+		return false;
+
+	*start = range->start;
+	*count = range->count;
+	return true;
+}
+
+/*
+ * sorted_range: return the @i-th range of the database, in the order of
+ *               the starts.
+ * @db: database to query
+ * @i: position of the range
+ * @owner: set to the owner of the range
+ * @start: set to the first id of the range
+ * @count: set to the number of ids in the range
+ *
+ * The ranges are sorted once, in the index of the database. @owner is
+ * valid while the database is open and not changed.
+ *
+ * Return false after the last range, or if the index cannot be built.
+ */
+static bool sorted_range (struct commonio_db *db, size_t i,
+			  const char **owner,
+			  unsigned long *start, unsigned long *count)
+{
+	struct range_index *idx = range_index (db);
+	const struct subordinate_range *range;
+
+	if ((NULL == idx) || (i >= idx->count))
+		return false;
+
+	range = entry_range (idx->by_start[i]);
+	*owner = range->owner;
+	*start = range->start;
+	*count = range->count;
+	return true;
 }
 
 /*
@@ -434,7 +1016,52 @@ static int add_range(struct commonio_db *db,
 		return 1;
 
 	/* Otherwise append the range */
-	return commonio_append(db, &range);
+	if (commonio_append(db, &range) == 0)
+		return 0;
+	range_index_insert(db, db->tail);
+	return 1;
+}
+
+/*
+ * add_ranges: add @n subuid ranges of @count uids to the database.
+ * @db: database to which to add
+ * @owners: uid which owns each range
+ * @starts: the first uid of each range
+ * @n: the number of ranges
+ * @count: the number of uids in each range
+ *
+ * Unlike add_range, this does not check if the ranges are already
+ * present: they should have been found by find_free_ranges. The index is
+ * rebuilt once, after all the ranges were added.
+ *
+ * Return 1 on success. On error return 0 and set errno appropriately.
+ */
+static int add_ranges(struct commonio_db *db,
+		      const char *const *owners, const unsigned long *starts,
+		      size_t n, unsigned long count)
+{
+	struct range_index *idx = db->type_index;
+	size_t i;
+	int ret = 1;
+
+	for (i = 0; i < n; i++) {
+		struct subordinate_range range;
+
+		range.owner = owners[i];
+		range.start = starts[i];
+		range.count = count;
+		if (commonio_append(db, &range) == 0) {
+			ret = 0;
+			break;
+		}
+	}
+
+	if ((NULL != idx) && !range_index_fill (db, idx)) {
+		/* Build it again on the next query */
+		range_index_free (idx);
+		db->type_index = NULL;
+	}
+	return ret;
 }
 
 /*
@@ -452,37 +1079,60 @@ static int remove_range (struct commonio_db *db,
                          const char *owner,
                          unsigned long start, unsigned long count)
 {
-	struct commonio_entry *ent;
+	struct range_index *idx;
+	struct commonio_entry **ents;
+	size_t i, first_pos, n;
 	unsigned long end;
+	int ret = 1;
 
 	if (count == 0) {
 		return 1;
 	}
 
+	idx = range_index (db);
+	if (NULL == idx) {
+		return 0;
+	}
+
+	/*
+	 * The ranges of owner starting before the end of the range to
+	 * remove. They are copied, since the index is changed below.
+	 */
 	end = start + count - 1;
-	for (ent = db->head; NULL != ent; ent = ent->next) {
+	first_pos = owner_first (idx, owner);
+	for (n = 0; first_pos + n < idx->count; n++) {
+		const struct subordinate_range *range;
+
+		range = entry_range (idx->by_owner[first_pos + n]);
+		if (   (0 != strcmp (range->owner, owner))
+		    || (range->start > end)) {
+			break;
+		}
+	}
+	if (0 == n) {
+		return 1;
+	}
+	ents = malloc (n * sizeof (*ents));
+	if (NULL == ents) {
+		return 0;
+	}
+	memcpy (ents, &idx->by_owner[first_pos], n * sizeof (*ents));
+
+	for (i = 0; i < n; i++) {
+		struct commonio_entry *ent = ents[i];
 		struct subordinate_range *range = ent->eptr;
 		unsigned long first;
 		unsigned long last;
 
-		/* Skip unparsed entries */
-		if (NULL == range) {
-			continue;
-		}
-
 		first = range->start;
 		last = first + range->count - 1;
 
-		/* Skip entries with a different owner */
-		if (0 != strcmp (range->owner, owner)) {
-			continue;
-		}
-
 		/* Skip entries outside of the range to remove */
 		if ((end < first) || (start > last)) {
 			continue;
 		}
 
+		range_index_remove (db, ent);
 		if (start <= first) {
 			if (end >= last) {
 				/* to be removed: [start,      end]
@@ -490,6 +1140,7 @@ static int remove_range (struct commonio_db *db,
 				/* entry completely contained in the
 				 * range to remove */
 				commonio_del_entry (db, ent);
+				continue;
 			} else {
 				/* to be removed: [start,  end]
 				 * range:           [first, last] */
@@ -520,8 +1171,11 @@ static int remove_range (struct commonio_db *db,
 				tail.count = (last - tail.start) + 1;
 
 				if (commonio_append (db, &tail) == 0) {
-					return 0;
+					range_index_insert (db, ent);
+					ret = 0;
+					break;
 				}
+				range_index_insert (db, db->tail);
 
 				range->count = start - range->start;
 
@@ -529,9 +1183,546 @@ static int remove_range (struct commonio_db *db,
 				db->changed = true;
 			}
 		}
+		range_index_insert (db, ent);
+		/* The entry was changed in place */
+		if (NULL != db->type_index) {
+			((struct range_index *) db->type_index)->list_sorted = false;
+		}
 	}
 
-	return 1;
+	free (ents);
+	return ret;
+}
+
+/*
+ * list_is_sorted: check if the entries of @db are sorted with
+ *                 subordinate_range_cmp, up to the first NIS entry.
+ */
+static bool list_is_sorted (const struct commonio_db *db)
+{
+	struct commonio_entry *ent, *prev = NULL;
+
+	for (ent = db->head; NULL != ent; ent = ent->next) {
+		if (   (NULL == ent->eptr) && (NULL != ent->line)
+		    && (('+' == ent->line[0]) || ('-' == ent->line[0]))) {
+			break;
+		}
+		if (   (NULL != prev)
+		    && (subordinate_range_cmp (&prev, &ent) > 0)) {
+			return false;
+		}
+		prev = ent;
+	}
+	return true;
+}
+
+/*
+ * compact_ranges: merge the overlapping or adjacent ranges of each owner,
+ *                 and sort the database by start.
+ * @db: database to compact
+ *
+ * The database is only changed if it was not already compacted.
+ */
+static void compact_ranges (struct commonio_db *db)
+{
+	struct range_index *idx = range_index (db);
+	bool merged = false;
+	size_t i, j;
+
+	if (NULL == idx)
+		return;
+
+	for (i = 0; i < idx->count; i = j) {
+		struct commonio_entry *cur = idx->by_owner[i];
+		struct subordinate_range *range = cur->eptr;
+
+		j = i + 1;
+		if (0 == range->count)
+			continue;
+
+		/* The ranges of the owner, sorted by start, are merged in cur */
+		for (; j < idx->count; j++) {
+			struct commonio_entry *next = idx->by_owner[j];
+			const struct subordinate_range *r = entry_range (next);
+			unsigned long last = range_last (range);
+
+			if (0 != strcmp (r->owner, range->owner))
+				break;
+			/* Empty ranges are left unchanged */
+			if (0 == r->count)
+				continue;
+			if ((last != ULONG_MAX) && (r->start > last + 1))
+				break;
+			if (range_last (r) > last) {
+				/* The count would overflow */
+				if (range_last (r) - range->start == ULONG_MAX)
+					break;
+				range->count = range_last (r) - range->start + 1;
+			}
+			commonio_del_entry (db, next);
+			cur->changed = true;
+			merged = true;
+		}
+	}
+
+	if (merged && !range_index_fill (db, idx)) {
+		range_index_free (idx);
+		db->type_index = NULL;
+		idx = NULL;
+	}
+
+	if (merged || !list_is_sorted (db)) {
+		commonio_sort (db, subordinate_range_cmp);
+		if (NULL != idx)
+			idx->list_sorted = true;
+	}
+}
+
+/*
+ * subordinate_close: close @db, compacting it first if it was opened for
+ *                    writing and SUB_ID_COMPACT is set.
+ */
+static int subordinate_close (struct commonio_db *db)
+{
+	if (db->isopen && !db->readonly && getdef_bool ("SUB_ID_COMPACT"))
+		compact_ranges (db);
+	return commonio_close (db);
+}
+
+/*
+ * Read-only view of the ranges of one owner.
+ *
+ * newuidmap and newgidmap only check whether the caller owns the
+ * requested ranges. For them, the file is mapped and parsed in place
+ * once, without the commonio database: nothing is locked or copied, and
+ * only the ranges of the owner are kept, sorted and merged. The ranges
+ * of the other owners are only needed when the owner can be matched by
+ * UID (see find_range).
+ */
+struct owner_range {
+	/*@dependent@*/const char *owner;	/* not NUL terminated */
+	size_t owner_len;
+	unsigned long start;
+	unsigned long count;
+};
+
+struct subid_ranges {
+	/*@owned@*/ /*@null@*/void *map;
+	size_t map_size;
+	/* Ranges of the owner, sorted by start and merged */
+	/*@owned@*/ /*@null@*/struct owner_range *own;
+	size_t own_count;
+	size_t own_size;
+	/* Ranges of the other owners, in the file order */
+	/*@owned@*/ /*@null@*/struct owner_range *others;
+	size_t others_count;
+	size_t others_size;
+	/* The owner can be matched by UID */
+	bool by_uid;
+	/*@owned@*/char *owner;
+	/*@owned@*/ /*@null@*/struct owner_uid **owners;
+	size_t owners_count;
+	size_t owners_size;
+};
+
+static bool owner_ranges_add (struct owner_range **ranges,
+                              size_t *count, size_t *size,
+                              const struct owner_range *range)
+{
+	if (*count == *size) {
+		size_t new_size = (0 == *size) ? 8 : *size * 2;
+		struct owner_range *r;
+
+		r = realloc (*ranges, new_size * sizeof (*r));
+		if (NULL == r)
+			return false;
+		*ranges = r;
+		*size = new_size;
+	}
+	(*ranges)[*count] = *range;
+	(*count)++;
+	return true;
+}
+
+static int owner_range_cmp (const void *p1, const void *p2)
+{
+	const struct owner_range *r1 = p1, *r2 = p2;
+
+	if (r1->start < r2->start)
+		return -1;
+	else if (r1->start > r2->start)
+		return 1;
+	return 0;
+}
+
+/*
+ * parse_range_line: parse a line of the file, like subordinate_parse.
+ *
+ * Returns false if the line is not a valid range.
+ */
+static bool parse_range_line (const char *line, size_t len,
+                              /*@out@*/struct owner_range *range)
+{
+	const char *fields[NFIELDS];
+	size_t lens[NFIELDS];
+	const char *cp = line, *end = line + len;
+	char buf[1024];
+	int i;
+
+	/* Longer lines are rejected by subordinate_parse */
+	if (len >= sizeof buf)
+		return false;
+
+	for (i = 0; (i < NFIELDS) && (NULL != cp); i++) {
+		const char *sep = memchr (cp, ':', (size_t) (end - cp));
+
+		fields[i] = cp;
+		lens[i] = (NULL != sep) ? (size_t) (sep - cp)
+		                        : (size_t) (end - cp);
+		cp = (NULL != sep) ? sep + 1 : NULL;
+	}
+	if (   (i != NFIELDS)
+	    || (0 == lens[0]) || (0 == lens[1]) || (0 == lens[2])) {
+		return false;
+	}
+
+	range->owner = fields[0];
+	range->owner_len = lens[0];
+	memcpy (buf, fields[1], lens[1]);
+	buf[lens[1]] = '\0';
+	if (getulong (buf, &range->start) == 0)
+		return false;
+	memcpy (buf, fields[2], lens[2]);
+	buf[lens[2]] = '\0';
+	if (getulong (buf, &range->count) == 0)
+		return false;
+	return true;
+}
+
+void subid_ranges_free (/*@only@*/ /*@null@*/struct subid_ranges *ranges)
+{
+	size_t i;
+
+	if (NULL == ranges)
+		return;
+	if (NULL != ranges->map)
+		(void) munmap (ranges->map, ranges->map_size);
+	for (i = 0; i < ranges->owners_count; i++) {
+		free (ranges->owners[i]->name);
+		free (ranges->owners[i]);
+	}
+	free (ranges->owners);
+	free (ranges->own);
+	free (ranges->others);
+	free (ranges->owner);
+	free (ranges);
+}
+
+/*
+ * merge_own_ranges: sort and merge the overlapping or adjacent ranges of
+ *                   the owner.
+ */
+static void merge_own_ranges (struct subid_ranges *ranges)
+{
+	size_t i, n;
+
+	if (0 == ranges->own_count)
+		return;
+
+	qsort (ranges->own, ranges->own_count, sizeof (*ranges->own),
+	       owner_range_cmp);
+	for (i = 1, n = 0; i < ranges->own_count; i++) {
+		struct owner_range *cur = &ranges->own[n];
+		unsigned long last = cur->start + cur->count - 1;
+
+		if (   (last == ULONG_MAX)
+		    || (ranges->own[i].start <= last + 1)) {
+			unsigned long l = ranges->own[i].start
+			                  + ranges->own[i].count - 1;
+
+			if (l > last)
+				cur->count = l - cur->start + 1;
+		} else {
+			n++;
+			ranges->own[n] = ranges->own[i];
+		}
+	}
+	ranges->own_count = n + 1;
+}
+
+/*
+ * load_ranges: read the ranges of @owner from @filename.
+ *
+ * Returns NULL (with errno set) on failure.
+ */
+static /*@null@*/ /*@only@*/struct subid_ranges *load_ranges (
+	const char *filename, bool by_uid, const char *owner)
+{
+	struct subid_ranges *ranges;
+	struct stat sb;
+	const char *cp, *end;
+	size_t owner_len = strlen (owner);
+	int fd;
+
+	ranges = calloc (1, sizeof (*ranges));
+	if (NULL == ranges)
+		return NULL;
+	ranges->by_uid = by_uid;
+	ranges->owner = strdup (owner);
+	if (NULL == ranges->owner)
+		goto fail;
+
+	fd = open (filename, O_RDONLY | O_NOCTTY | O_NONBLOCK | O_NOFOLLOW);
+	if (fd < 0)
+		goto fail;
+	if (fstat (fd, &sb) != 0) {
+		(void) close (fd);
+		goto fail;
+	}
+	if (!S_ISREG (sb.st_mode)) {
+		(void) close (fd);
+		errno = EINVAL;
+		goto fail;
+	}
+	if (sb.st_size > 0) {
+		ranges->map_size = (size_t) sb.st_size;
+		ranges->map = mmap (NULL, ranges->map_size, PROT_READ,
+		                    MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED == ranges->map) {
+			ranges->map = NULL;
+			(void) close (fd);
+			goto fail;
+		}
+	}
+	(void) close (fd);
+
+	cp = ranges->map;
+	end = cp + ranges->map_size;
+	while (cp < end) {
+		const char *nl = memchr (cp, '\n', (size_t) (end - cp));
+		size_t len = (NULL != nl) ? (size_t) (nl - cp)
+		                          : (size_t) (end - cp);
+		struct owner_range range;
+		bool ok = true;
+
+		/* NIS entries and invalid lines are ignored, and so are
+		 * the empty ranges */
+		if (   (0 != len) && ('+' != *cp) && ('-' != *cp)
+		    && parse_range_line (cp, len, &range)
+		    && (0 != range.count)) {
+			if (   (range.owner_len == owner_len)
+			    && (strncmp (range.owner, owner, owner_len) == 0)) {
+				ok = owner_ranges_add (&ranges->own,
+				                       &ranges->own_count,
+				                       &ranges->own_size,
+				                       &range);
+			} else if (by_uid) {
+				ok = owner_ranges_add (&ranges->others,
+				                       &ranges->others_count,
+				                       &ranges->others_size,
+				                       &range);
+			}
+		}
+		if (!ok) {
+			errno = ENOMEM;
+			goto fail;
+		}
+		cp += len + 1;
+	}
+
+	merge_own_ranges (ranges);
+	return ranges;
+
+      fail:
+	{
+		int saved_errno = errno;
+
+		subid_ranges_free (ranges);
+		errno = saved_errno;
+	}
+	return NULL;
+}
+
+/*
+ * load_owner_ranges: get the ranges of @owner from SUB_ID_PROVIDER, or
+ *                    from @filename when it is not set.
+ *
+ * The ranges of a provider are only matched by owner name.
+ *
+ * Returns NULL (with errno set) on failure.
+ */
+static /*@null@*/ /*@only@*/struct subid_ranges *load_owner_ranges (
+	const char *filename, bool by_uid, const char *owner,
+	enum subid_type type)
+{
+	struct subid_provider_range *list;
+	struct subid_ranges *ranges;
+	size_t i, n;
+	int ret;
+
+	ret = subid_provider_ranges (type, owner, &list, &n);
+	if (0 == ret)
+		return load_ranges (filename, by_uid, owner);
+	if (ret < 0)
+		return NULL;
+
+	ranges = calloc (1, sizeof (*ranges));
+	if (NULL == ranges)
+		goto fail;
+	ranges->owner = strdup (owner);
+	if (NULL == ranges->owner)
+		goto fail;
+	for (i = 0; i < n; i++) {
+		struct owner_range range;
+
+		if (0 == list[i].count)
+			continue;
+		range.owner = ranges->owner;
+		range.owner_len = strlen (owner);
+		range.start = list[i].start;
+		range.count = list[i].count;
+		if (!owner_ranges_add (&ranges->own, &ranges->own_count,
+		                       &ranges->own_size, &range))
+			goto fail;
+	}
+	free (list);
+	merge_own_ranges (ranges);
+	return ranges;
+
+      fail:
+	free (list);
+	subid_ranges_free (ranges);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/*
+ * lookup_owner: return the cached UID of an owner, looking it up the
+ *               first time.
+ *
+ * Returns NULL on allocation failure.
+ */
+static /*@null@*/const struct owner_uid *lookup_owner (
+	struct subid_ranges *ranges, const char *name, size_t len)
+{
+	struct owner_uid *ou;
+	const struct passwd *pwd;
+	size_t i;
+
+	for (i = 0; i < ranges->owners_count; i++) {
+		ou = ranges->owners[i];
+		if ((strncmp (ou->name, name, len) == 0) && ('\0' == ou->name[len]))
+			return ou;
+	}
+
+	if (ranges->owners_count == ranges->owners_size) {
+		size_t size = (0 == ranges->owners_size) ? 8 : ranges->owners_size * 2;
+		struct owner_uid **owners;
+
+		owners = realloc (ranges->owners, size * sizeof (*owners));
+		if (NULL == owners)
+			return NULL;
+		ranges->owners = owners;
+		ranges->owners_size = size;
+	}
+	ou = malloc (sizeof (*ou));
+	if (NULL == ou)
+		return NULL;
+	ou->name = strndup (name, len);
+	if (NULL == ou->name) {
+		free (ou);
+		return NULL;
+	}
+	pwd = timed_getpwnam (ou->name);
+	ou->found = (NULL != pwd);
+	ou->uid = (NULL != pwd) ? pwd->pw_uid : (uid_t) -1;
+	ranges->owners[ranges->owners_count] = ou;
+	ranges->owners_count++;
+	return ou;
+}
+
+/*
+ * find_owner_range: return the last ID of a range of the owner
+ *                   including @val, like find_range.
+ *
+ * Returns false if there are no such range.
+ */
+static bool find_owner_range (struct subid_ranges *ranges,
+                              unsigned long val,
+                              /*@out@*/unsigned long *last)
+{
+	const struct owner_uid *ou;
+	char owner_uid_string[33];
+	size_t lo = 0, hi = ranges->own_count;
+	size_t i;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ranges->own[mid].start <= val)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (   (lo > 0)
+	    && (val - ranges->own[lo - 1].start < ranges->own[lo - 1].count)) {
+		*last = ranges->own[lo - 1].start + ranges->own[lo - 1].count - 1;
+		return true;
+	}
+
+	if (0 == ranges->others_count)
+		return false;
+
+	/* Try to match the other ranges by UID */
+	ou = lookup_owner (ranges, ranges->owner, strlen (ranges->owner));
+	if ((NULL == ou) || !ou->found)
+		return false;
+	(void) snprintf (owner_uid_string, sizeof owner_uid_string, "%lu",
+	                 (unsigned long) ou->uid);
+
+	for (i = 0; i < ranges->others_count; i++) {
+		const struct owner_range *range = &ranges->others[i];
+		const struct owner_uid *range_owner;
+
+		if ((val < range->start) || (val - range->start >= range->count))
+			continue;
+
+		if (   (range->owner_len != strlen (owner_uid_string))
+		    || (strncmp (range->owner, owner_uid_string,
+		                 range->owner_len) != 0)) {
+			range_owner = lookup_owner (ranges, range->owner,
+			                            range->owner_len);
+			if (   (NULL == range_owner)
+			    || !range_owner->found
+			    || (range_owner->uid != ou->uid)) {
+				continue;
+			}
+		}
+		*last = range->start + range->count - 1;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * subid_ranges_have: check if the owner of @ranges owns all the IDs of
+ *                    [@start, @start + @count), like have_range.
+ */
+bool subid_ranges_have (struct subid_ranges *ranges,
+                        unsigned long start, unsigned long count)
+{
+	unsigned long end, last;
+
+	if (count == 0)
+		return false;
+
+	end = start + count - 1;
+	while (find_owner_range (ranges, start, &last)) {
+		if (last >= end)
+			return true;
+		start = last + 1;
+	}
+	return false;
 }
 
 static struct commonio_db subordinate_uid_db = {
@@ -600,7 +1791,12 @@ int sub_uid_remove (const char *owner, uid_t start, unsigned long count)
 
 int sub_uid_close (void)
 {
-	return commonio_close (&subordinate_uid_db);
+	return subordinate_close (&subordinate_uid_db);
+}
+
+struct commonio_db *__sub_uid_get_db (void)
+{
+	return &subordinate_uid_db;
 }
 
 int sub_uid_unlock (void)
@@ -608,6 +1804,19 @@ int sub_uid_unlock (void)
 	return commonio_unlock (&subordinate_uid_db);
 }
 
+bool sub_uid_find_free_ranges(uid_t min, uid_t max, unsigned long count,
+			      size_t n, unsigned long *starts)
+{
+	return find_free_ranges (&subordinate_uid_db, min, max, count, n, starts);
+}
+
+int sub_uid_add_ranges (const char *const *owners,
+			const unsigned long *starts, size_t n,
+			unsigned long count)
+{
+	return add_ranges (&subordinate_uid_db, owners, starts, n, count);
+}
+
 uid_t sub_uid_find_free_range(uid_t min, uid_t max, unsigned long count)
 {
 	unsigned long start;
@@ -615,6 +1824,29 @@ uid_t sub_uid_find_free_range(uid_t min, uid_t max, unsigned long count)
 	return start == ULONG_MAX ? (uid_t) -1 : start;
 }
 
+int sub_uid_rewind (void)
+{
+	return commonio_rewind (&subordinate_uid_db);
+}
+
+bool sub_uid_next_range (unsigned long *start, unsigned long *count)
+{
+	return next_range (&subordinate_uid_db, start, count);
+}
+
+bool sub_uid_sorted_range (size_t i, const char **owner,
+			   unsigned long *start, unsigned long *count)
+{
+	return sorted_range (&subordinate_uid_db, i, owner, start, count);
+}
+
+/*@null@*/ /*@only@*/struct subid_ranges *sub_uid_load_ranges (const char *owner)
+{
+	return load_owner_ranges (subordinate_uid_db.filename,
+	                          strcmp (subordinate_uid_db.filename, "/etc/subuid") == 0,
+	                          owner, SUBID_TYPE_UID);
+}
+
 static struct commonio_db subordinate_gid_db = {
 	"/etc/subgid",		/* filename */
 	&subordinate_ops,	/* ops */
@@ -681,7 +1913,12 @@ int sub_gid_remove (const char *owner, gid_t start, unsigned long count)
 
 int sub_gid_close (void)
 {
-	return commonio_close (&subordinate_gid_db);
+	return subordinate_close (&subordinate_gid_db);
+}
+
+struct commonio_db *__sub_gid_get_db (void)
+{
+	return &subordinate_gid_db;
 }
 
 int sub_gid_unlock (void)
@@ -689,12 +1926,98 @@ int sub_gid_unlock (void)
 	return commonio_unlock (&subordinate_gid_db);
 }
 
+bool sub_gid_find_free_ranges(gid_t min, gid_t max, unsigned long count,
+			      size_t n, unsigned long *starts)
+{
+	return find_free_ranges (&subordinate_gid_db, min, max, count, n, starts);
+}
+
+int sub_gid_add_ranges (const char *const *owners,
+			const unsigned long *starts, size_t n,
+			unsigned long count)
+{
+	return add_ranges (&subordinate_gid_db, owners, starts, n, count);
+}
+
 gid_t sub_gid_find_free_range(gid_t min, gid_t max, unsigned long count)
 {
 	unsigned long start;
 	start = find_free_range (&subordinate_gid_db, min, max, count);
 	return start == ULONG_MAX ? (gid_t) -1 : start;
 }
+
+int sub_gid_rewind (void)
+{
+	return commonio_rewind (&subordinate_gid_db);
+}
+
+bool sub_gid_next_range (unsigned long *start, unsigned long *count)
+{
+	return next_range (&subordinate_gid_db, start, count);
+}
+
+bool sub_gid_sorted_range (size_t i, const char **owner,
+			   unsigned long *start, unsigned long *count)
+{
+	return sorted_range (&subordinate_gid_db, i, owner, start, count);
+}
+
+/*@null@*/ /*@only@*/struct subid_ranges *sub_gid_load_ranges (const char *owner)
+{
+	return load_owner_ranges (subordinate_gid_db.filename,
+	                          strcmp (subordinate_gid_db.filename, "/etc/subgid") == 0,
+	                          owner, SUBID_TYPE_GID);
+}
+
+/*
+ * sub_ids_find_free_ranges: find @n sequences of ids which are unused
+ *                           both as subordinate uids and as subordinate
+ *                           gids.
+ * @min: the first id in the range to find
+ * @max: the highest id to find
+ * @count: the number of ids needed in each sequence
+ * @n: the number of sequences
+ * @starts: the first id of each sequence found
+ *
+ * Each sequence is the lowest start free in both databases: the candidate
+ * of one database is used as the lower bound of the other one, until
+ * both agree. Each step skips at least one used range, so that the
+ * search depends on the number of ranges, and not on the number of ids.
+ *
+ * Return false if less than @n sequences are available.
+ */
+bool sub_ids_find_free_ranges(unsigned long min, unsigned long max,
+			      unsigned long count,
+			      size_t n, unsigned long *starts)
+{
+	unsigned long low = min;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		unsigned long ustart, gstart;
+
+		for (;;) {
+			if (   !find_free_ranges (&subordinate_uid_db, low, max,
+			                          count, 1, &ustart)
+			    || !find_free_ranges (&subordinate_gid_db, ustart, max,
+			                          count, 1, &gstart)) {
+				return false;
+			}
+			if (gstart == ustart) {
+				break;
+			}
+			low = gstart;
+		}
+		starts[i] = ustart;
+
+		/* The next sequences are searched after this one */
+		if (max - ustart < count) {
+			return (i + 1 == n);
+		}
+		low = ustart + count;
+	}
+	return true;
+}
 #else				/* !ENABLE_SUBIDS */
 extern int errno;		/* warning: ANSI C forbids an empty source file */
 #endif				/* !ENABLE_SUBIDS */
@@ -11,7 +11,11 @@
 
 #include <sys/types.h>
 
+struct commonio_db;
+struct subid_ranges;
+
 extern int sub_uid_close(void);
+extern struct commonio_db *__sub_uid_get_db (void);
 extern bool have_sub_uids(const char *owner, uid_t start, unsigned long count);
 extern bool sub_uid_file_present (void);
 extern bool sub_uid_assigned(const char *owner);
@@ -23,8 +27,20 @@ extern int sub_uid_unlock (void);
 extern int sub_uid_add (const char *owner, uid_t start, unsigned long count);
 extern int sub_uid_remove (const char *owner, uid_t start, unsigned long count);
 extern uid_t sub_uid_find_free_range(uid_t min, uid_t max, unsigned long count);
+extern bool sub_uid_find_free_ranges(uid_t min, uid_t max, unsigned long count,
+                                     size_t n, unsigned long *starts);
+extern int sub_uid_add_ranges (const char *const *owners,
+                               const unsigned long *starts, size_t n,
+                               unsigned long count);
+extern int sub_uid_rewind (void);
+extern bool sub_uid_next_range (unsigned long *start, unsigned long *count);
+extern bool sub_uid_sorted_range (size_t i, /*@out@*/const char **owner,
+                                  /*@out@*/unsigned long *start,
+                                  /*@out@*/unsigned long *count);
+extern /*@null@*/ /*@only@*/struct subid_ranges *sub_uid_load_ranges (const char *owner);
 
 extern int sub_gid_close(void);
+extern struct commonio_db *__sub_gid_get_db (void);
 extern bool have_sub_gids(const char *owner, gid_t start, unsigned long count);
 extern bool sub_gid_file_present (void);
 extern bool sub_gid_assigned(const char *owner);
@@ -36,6 +52,25 @@ extern int sub_gid_unlock (void);
 extern int sub_gid_add (const char *owner, gid_t start, unsigned long count);
 extern int sub_gid_remove (const char *owner, gid_t start, unsigned long count);
 extern uid_t sub_gid_find_free_range(gid_t min, gid_t max, unsigned long count);
+extern bool sub_gid_find_free_ranges(gid_t min, gid_t max, unsigned long count,
+                                     size_t n, unsigned long *starts);
+extern int sub_gid_add_ranges (const char *const *owners,
+                               const unsigned long *starts, size_t n,
+                               unsigned long count);
+extern int sub_gid_rewind (void);
+extern bool sub_gid_next_range (unsigned long *start, unsigned long *count);
+extern bool sub_gid_sorted_range (size_t i, /*@out@*/const char **owner,
+                                  /*@out@*/unsigned long *start,
+                                  /*@out@*/unsigned long *count);
+extern /*@null@*/ /*@only@*/struct subid_ranges *sub_gid_load_ranges (const char *owner);
+
+extern bool sub_ids_find_free_ranges(unsigned long min, unsigned long max,
+                                     unsigned long count,
+                                     size_t n, unsigned long *starts);
+
+extern bool subid_ranges_have (struct subid_ranges *ranges,
+                               unsigned long start, unsigned long count);
+extern void subid_ranges_free (/*@only@*/ /*@null@*/struct subid_ranges *ranges);
 #endif				/* ENABLE_SUBIDS */
 
 #endif
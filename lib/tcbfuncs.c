@@ -43,14 +43,35 @@
 
 static /*@null@*//*@only@*/char *stored_tcb_user = NULL;
 
+/*
+ * Batch session (see shadowtcb_batch_begin)
+ *
+ * tcb_dirfd is a descriptor of TCB_DIR, and the operations on the tcb
+ * directories are relative to it. batch_shadowgid and batch_authgid
+ * are the groups of the tcb directories, resolved once.
+ * priv_depth counts the nested shadowtcb_drop_priv() calls: the
+ * privileges are only dropped by the outer call, and only gained back
+ * by the matching shadowtcb_gain_priv().
+ */
+static int tcb_dirfd = -1;
+static gid_t batch_shadowgid;
+static gid_t batch_authgid;
+static unsigned int priv_depth = 0;
+
 shadowtcb_status shadowtcb_drop_priv (void)
 {
 	if (!getdef_bool ("USE_TCB")) {
 		return SHADOWTCB_SUCCESS;
 	}
 
+	if ((-1 != tcb_dirfd) && (priv_depth > 0)) {
+		priv_depth++;
+		return SHADOWTCB_SUCCESS;
+	}
+
 	if (NULL != stored_tcb_user) {
 		if (tcb_drop_priv (stored_tcb_user) == 0) {
+			priv_depth = 1;
 			return SHADOWTCB_SUCCESS;
 		}
 	}
@@ -64,9 +85,69 @@ shadowtcb_status shadowtcb_gain_priv (void)
 		return SHADOWTCB_SUCCESS;
 	}
 
+	if ((-1 != tcb_dirfd) && (priv_depth > 1)) {
+		priv_depth--;
+		return SHADOWTCB_SUCCESS;
+	}
+
+	priv_depth = 0;
 	return (tcb_gain_priv () == 0) ? SHADOWTCB_SUCCESS : SHADOWTCB_FAILURE;
 }
 
+/*
+ * auth_gid - get the group of the shadow files
+ *
+ *	This is the auth group if TCB_AUTH_GROUP is set, shadowgid (the
+ *	group of TCB_DIR) otherwise.
+ */
+static gid_t auth_gid (gid_t shadowgid)
+{
+	struct group *gr;
+
+	if (getdef_bool ("TCB_AUTH_GROUP")) {
+		gr = getgrnam ("auth");
+		if (NULL != gr) {
+			return gr->gr_gid;
+		}
+	}
+	return shadowgid;
+}
+
+/*
+ * tcb_groups - get the groups of the tcb directories and shadow files
+ */
+static shadowtcb_status tcb_groups (gid_t *shadowgid, gid_t *authgid)
+{
+	struct stat tcbdir_stat;
+
+	if (-1 != tcb_dirfd) {
+		*shadowgid = batch_shadowgid;
+		*authgid = batch_authgid;
+		return SHADOWTCB_SUCCESS;
+	}
+
+	if (stat (TCB_DIR, &tcbdir_stat) != 0) {
+		fprintf (stderr,
+		         _("%s: Cannot stat %s: %s\n"),
+		         Prog, TCB_DIR, strerror (errno));
+		return SHADOWTCB_FAILURE;
+	}
+	*shadowgid = tcbdir_stat.st_gid;
+	*authgid = auth_gid (*shadowgid);
+	return SHADOWTCB_SUCCESS;
+}
+
+/*
+ * TCB_AT - descriptor and path to use with the *at() functions for path,
+ *          a path in TCB_DIR
+ *
+ *	In a batch session, path is used relative to tcb_dirfd, without
+ *	resolving TCB_DIR again.
+ */
+#define TCB_AT(path) \
+	((-1 != tcb_dirfd) ? tcb_dirfd : AT_FDCWD), \
+	((-1 != tcb_dirfd) ? (path) + sizeof (TCB_DIR) : (path))
+
 /* In case something goes wrong, we return immediately, not polluting the
  * code with free(). All errors are fatal, so the application is expected
  * to exit soon.
@@ -115,7 +196,7 @@ static /*@null@*/ char *shadowtcb_path_rel_existing (const char *name)
 		OUT_OF_MEMORY;
 		return NULL;
 	}
-	if (lstat (path, &st) != 0) {
+	if (fstatat (TCB_AT (path), &st, AT_SYMLINK_NOFOLLOW) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot stat %s: %s\n"),
 		         Prog, path, strerror (errno));
@@ -138,7 +219,7 @@ static /*@null@*/ char *shadowtcb_path_rel_existing (const char *name)
 		free (path);
 		return NULL;
 	}
-	ret = readlink (path, link, sizeof (link) - 1);
+	ret = readlinkat (TCB_AT (path), link, sizeof (link) - 1);
 	if (-1 == ret) {
 		fprintf (stderr,
 		         _("%s: Cannot read symbolic link %s: %s\n"),
@@ -200,16 +281,13 @@ static /*@null@*/ char *shadowtcb_path_existing (const char *name)
 static shadowtcb_status mkdir_leading (const char *name, uid_t uid)
 {
 	char *ind, *dir, *ptr, *path = shadowtcb_path_rel (name, uid);
-	struct stat st;
+	gid_t shadowgid, authgid;
 
 	if (NULL == path) {
 		return SHADOWTCB_FAILURE;
 	}
 	ptr = path;
-	if (stat (TCB_DIR, &st) != 0) {
-		fprintf (stderr,
-		         _("%s: Cannot stat %s: %s\n"),
-		         Prog, TCB_DIR, strerror (errno));
+	if (tcb_groups (&shadowgid, &authgid) == SHADOWTCB_FAILURE) {
 		goto out_free_path;
 	}
 	while ((ind = strchr (ptr, '/'))) {
@@ -218,19 +296,19 @@ static shadowtcb_status mkdir_leading (const char *name, uid_t uid)
 			OUT_OF_MEMORY;
 			return SHADOWTCB_FAILURE;
 		}
-		if ((mkdir (dir, 0700) != 0) && (errno != EEXIST)) {
+		if ((mkdirat (TCB_AT (dir), 0700) != 0) && (errno != EEXIST)) {
 			fprintf (stderr,
 			         _("%s: Cannot create directory %s: %s\n"),
 			         Prog, dir, strerror (errno));
 			goto out_free_dir;
 		}
-		if (chown (dir, 0, st.st_gid) != 0) {
+		if (fchownat (TCB_AT (dir), 0, shadowgid, 0) != 0) {
 			fprintf (stderr,
 			         _("%s: Cannot change owner of %s: %s\n"),
 			         Prog, dir, strerror (errno));
 			goto out_free_dir;
 		}
-		if (chmod (dir, 0711) != 0) {
+		if (fchmodat (TCB_AT (dir), 0711, 0) != 0) {
 			fprintf (stderr,
 			         _("%s: Cannot change mode of %s: %s\n"),
 			         Prog, dir, strerror (errno));
@@ -260,7 +338,7 @@ static shadowtcb_status unlink_suffs (const char *user)
 			OUT_OF_MEMORY;
 			return SHADOWTCB_FAILURE;
 		}
-		if ((unlink (tmp) != 0) && (errno != ENOENT)) {
+		if ((unlinkat (TCB_AT (tmp), 0) != 0) && (errno != ENOENT)) {
 			fprintf (stderr,
 			         _("%s: unlink: %s: %s\n"),
 			         Prog, tmp, strerror (errno));
@@ -284,7 +362,7 @@ static shadowtcb_status rmdir_leading (char *path)
 			OUT_OF_MEMORY;
 			return SHADOWTCB_FAILURE;
 		}
-		if (rmdir (dir) != 0) {
+		if (unlinkat (TCB_AT (dir), AT_REMOVEDIR) != 0) {
 			if (errno != ENOTEMPTY) {
 				fprintf (stderr,
 				         _("%s: Cannot remove directory %s: %s\n"),
@@ -314,7 +392,7 @@ static shadowtcb_status move_dir (const char *user_newname, uid_t user_newid)
 	if (asprintf (&olddir, TCB_DIR "/%s", stored_tcb_user) == -1) {
 		goto out_free_nomem;
 	}
-	if (stat (olddir, &oldmode) != 0) {
+	if (fstatat (TCB_AT (olddir), &oldmode, 0) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot stat %s: %s\n"),
 		         Prog, olddir, strerror (errno));
@@ -341,7 +419,7 @@ static shadowtcb_status move_dir (const char *user_newname, uid_t user_newid)
 	if (mkdir_leading (user_newname, the_newid) == SHADOWTCB_FAILURE) {
 		goto out_free;
 	}
-	if (rename (real_old_dir, real_new_dir) != 0) {
+	if (renameat (TCB_AT (real_old_dir), TCB_AT (real_new_dir)) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot rename %s to %s: %s\n"),
 		         Prog, real_old_dir, real_new_dir, strerror (errno));
@@ -350,7 +428,7 @@ static shadowtcb_status move_dir (const char *user_newname, uid_t user_newid)
 	if (rmdir_leading (real_old_dir_rel) == SHADOWTCB_FAILURE) {
 		goto out_free;
 	}
-	if ((unlink (olddir) != 0) && (errno != ENOENT)) {
+	if ((unlinkat (TCB_AT (olddir), 0) != 0) && (errno != ENOENT)) {
 		fprintf (stderr,
 		         _("%s: Cannot remove %s: %s\n"),
 		         Prog, olddir, strerror (errno));
@@ -364,7 +442,7 @@ static shadowtcb_status move_dir (const char *user_newname, uid_t user_newid)
 		goto out_free;
 	}
 	if (   (strcmp (real_new_dir, newdir) != 0)
-	    && (symlink (real_new_dir_rel, newdir) != 0)) {
+	    && (symlinkat (real_new_dir_rel, TCB_AT (newdir)) != 0)) {
 		fprintf (stderr,
 		         _("%s: Cannot create symbolic link %s: %s\n"),
 		         Prog, real_new_dir_rel, strerror (errno));
@@ -418,7 +496,8 @@ shadowtcb_status shadowtcb_remove (const char *name)
 	shadowtcb_status ret = SHADOWTCB_SUCCESS;
 	char *path = shadowtcb_path_existing (name);
 	char *rel = shadowtcb_path_rel_existing (name);
-	if ((NULL == path) || (NULL == rel) || (rmdir (path) != 0)) {
+	if (   (NULL == path) || (NULL == rel)
+	    || (unlinkat (TCB_AT (path), AT_REMOVEDIR) != 0)) {
 		return SHADOWTCB_FAILURE;
 	}
 	if (rmdir_leading (rel) == SHADOWTCB_FAILURE) {
@@ -430,7 +509,7 @@ shadowtcb_status shadowtcb_remove (const char *name)
 		OUT_OF_MEMORY;
 		return SHADOWTCB_FAILURE;
 	}
-	if ((unlink (path) != 0) && (errno != ENOENT)) {
+	if ((unlinkat (TCB_AT (path), 0) != 0) && (errno != ENOENT)) {
 		ret = SHADOWTCB_FAILURE;
 	}
 	free (path);
@@ -463,25 +542,25 @@ shadowtcb_status shadowtcb_move (/*@NULL@*/const char *user_newname, uid_t user_
 		OUT_OF_MEMORY;
 		return SHADOWTCB_FAILURE;
 	}
-	if (stat (tcbdir, &dirmode) != 0) {
+	if (fstatat (TCB_AT (tcbdir), &dirmode, 0) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot stat %s: %s\n"),
 		         Prog, tcbdir, strerror (errno));
 		goto out_free;
 	}
-	if (chown (tcbdir, 0, 0) != 0) {
+	if (fchownat (TCB_AT (tcbdir), 0, 0, 0) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot change owners of %s: %s\n"),
 		         Prog, tcbdir, strerror (errno));
 		goto out_free;
 	}
-	if (chmod (tcbdir, 0700) != 0) {
+	if (fchmodat (TCB_AT (tcbdir), 0700, 0) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot change mode of %s: %s\n"),
 		         Prog, tcbdir, strerror (errno));
 		goto out_free;
 	}
-	if (lstat (shadow, &filemode) != 0) {
+	if (fstatat (TCB_AT (shadow), &filemode, AT_SYMLINK_NOFOLLOW) != 0) {
 		if (errno != ENOENT) {
 			fprintf (stderr,
 			         _("%s: Cannot lstat %s: %s\n"),
@@ -501,13 +580,13 @@ shadowtcb_status shadowtcb_move (/*@NULL@*/const char *user_newname, uid_t user_
 			         Prog, user_newname);
 			goto out_free;
 		}
-		if (chown (shadow, user_newid, filemode.st_gid) != 0) {
+		if (fchownat (TCB_AT (shadow), user_newid, filemode.st_gid, 0) != 0) {
 			fprintf (stderr,
 			         _("%s: Cannot change owner of %s: %s\n"),
 			         Prog, shadow, strerror (errno));
 			goto out_free;
 		}
-		if (chmod (shadow, filemode.st_mode & 07777) != 0) {
+		if (fchmodat (TCB_AT (shadow), filemode.st_mode & 07777, 0) != 0) {
 			fprintf (stderr,
 			         _("%s: Cannot change mode of %s: %s\n"),
 			         Prog, shadow, strerror (errno));
@@ -517,7 +596,7 @@ shadowtcb_status shadowtcb_move (/*@NULL@*/const char *user_newname, uid_t user_
 	if (unlink_suffs (user_newname) == SHADOWTCB_FAILURE) {
 		goto out_free;
 	}
-	if (chown (tcbdir, user_newid, dirmode.st_gid) != 0) {
+	if (fchownat (TCB_AT (tcbdir), user_newid, dirmode.st_gid, 0) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot change owner of %s: %s\n"),
 		         Prog, tcbdir, strerror (errno));
@@ -533,42 +612,29 @@ out_free:
 shadowtcb_status shadowtcb_create (const char *name, uid_t uid)
 {
 	char *dir, *shadow;
-	struct stat tcbdir_stat;
 	gid_t shadowgid, authgid;
-	struct group *gr;
 	int fd;
 	shadowtcb_status ret = SHADOWTCB_FAILURE;
 
 	if (!getdef_bool ("USE_TCB")) {
 		return SHADOWTCB_SUCCESS;
 	}
-	if (stat (TCB_DIR, &tcbdir_stat) != 0) {
-		fprintf (stderr,
-		         _("%s: Cannot stat %s: %s\n"),
-		         Prog, TCB_DIR, strerror (errno));
+	if (tcb_groups (&shadowgid, &authgid) == SHADOWTCB_FAILURE) {
 		return SHADOWTCB_FAILURE;
 	}
-	shadowgid = tcbdir_stat.st_gid;
-	authgid = shadowgid;
-	if (getdef_bool ("TCB_AUTH_GROUP")) {
-		gr = getgrnam ("auth");
-		if (NULL != gr) {
-			authgid = gr->gr_gid;
-		}
-	}
 
 	if (   (asprintf (&dir, TCB_DIR "/%s", name) == -1)
 	    || (asprintf (&shadow, TCB_FMT, name) == -1)) {
 		OUT_OF_MEMORY;
 		return SHADOWTCB_FAILURE;
 	}
-	if (mkdir (dir, 0700) != 0) {
+	if (mkdirat (TCB_AT (dir), 0700) != 0) {
 		fprintf (stderr,
 		         _("%s: mkdir: %s: %s\n"),
 		         Prog, dir, strerror (errno));
 		goto out_free;
 	}
-	fd = open (shadow, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	fd = openat (TCB_AT (shadow), O_RDWR | O_CREAT | O_TRUNC, 0600);
 	if (fd < 0) {
 		fprintf (stderr,
 		         _("%s: Cannot open %s: %s\n"),
@@ -576,25 +642,25 @@ shadowtcb_status shadowtcb_create (const char *name, uid_t uid)
 		goto out_free;
 	}
 	close (fd);
-	if (chown (shadow, 0, authgid) != 0) {
+	if (fchownat (TCB_AT (shadow), 0, authgid, 0) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot change owner of %s: %s\n"),
 		         Prog, shadow, strerror (errno));
 		goto out_free;
 	}
-	if (chmod (shadow, (mode_t) ((authgid == shadowgid) ? 0600 : 0640)) != 0) {
+	if (fchmodat (TCB_AT (shadow), (mode_t) ((authgid == shadowgid) ? 0600 : 0640), 0) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot change mode of %s: %s\n"),
 		         Prog, shadow, strerror (errno));
 		goto out_free;
 	}
-	if (chown (dir, 0, authgid) != 0) {
+	if (fchownat (TCB_AT (dir), 0, authgid, 0) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot change owner of %s: %s\n"),
 		         Prog, dir, strerror (errno));
 		goto out_free;
 	}
-	if (chmod (dir, (mode_t) ((authgid == shadowgid) ? 02700 : 02710)) != 0) {
+	if (fchmodat (TCB_AT (dir), (mode_t) ((authgid == shadowgid) ? 02700 : 02710), 0) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot change mode of %s: %s\n"),
 		         Prog, dir, strerror (errno));
@@ -611,3 +677,185 @@ out_free:
 	return ret;
 }
 
+/*
+ * shadowtcb_batch_begin - start a batch of operations on the tcb
+ *                         directories of many users
+ *
+ *	TCB_DIR is opened once, and the operations of the batch are done
+ *	relative to it. The groups of the tcb directories are resolved
+ *	once for the batch.
+ *	Within the batch, the shadowtcb_drop_priv() / shadowtcb_gain_priv()
+ *	calls nest: a caller can drop the privileges once for a user
+ *	around several calls to the spw_* functions.
+ */
+shadowtcb_status shadowtcb_batch_begin (void)
+{
+	struct stat tcbdir_stat;
+	int fd;
+
+	if (!getdef_bool ("USE_TCB") || (-1 != tcb_dirfd)) {
+		return SHADOWTCB_SUCCESS;
+	}
+	fd = open (TCB_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf (stderr,
+		         _("%s: Cannot open %s: %s\n"),
+		         Prog, TCB_DIR, strerror (errno));
+		return SHADOWTCB_FAILURE;
+	}
+	if (fstat (fd, &tcbdir_stat) != 0) {
+		fprintf (stderr,
+		         _("%s: Cannot stat %s: %s\n"),
+		         Prog, TCB_DIR, strerror (errno));
+		(void) close (fd);
+		return SHADOWTCB_FAILURE;
+	}
+	batch_shadowgid = tcbdir_stat.st_gid;
+	batch_authgid = auth_gid (batch_shadowgid);
+	tcb_dirfd = fd;
+	return SHADOWTCB_SUCCESS;
+}
+
+/*
+ * shadowtcb_batch_end - end a batch started by shadowtcb_batch_begin()
+ *
+ *	If the privileges are still dropped, they are gained back.
+ */
+shadowtcb_status shadowtcb_batch_end (void)
+{
+	shadowtcb_status ret = SHADOWTCB_SUCCESS;
+
+	if (-1 == tcb_dirfd) {
+		return SHADOWTCB_SUCCESS;
+	}
+	if (priv_depth > 0) {
+		priv_depth = 1;
+		ret = shadowtcb_gain_priv ();
+	}
+	(void) close (tcb_dirfd);
+	tcb_dirfd = -1;
+	return ret;
+}
+
+/*
+ * Read of the shadow files of many users (see shadowtcb_read_all)
+ */
+struct tcb_read {
+	const char *name;
+	/*@null@*/ /*@only@*/struct spwd *spw;
+};
+
+/*
+ * tcb_read_one - read and parse the shadow file of r->name
+ *
+ *	The file is opened relative to tcb_dirfd, and only read. r->spw
+ *	is left NULL if it cannot be read, or if it does not contain the
+ *	entry of the user.
+ */
+static void tcb_read_one (unused struct work_pool *pool, void *arg)
+{
+	struct tcb_read *r = arg;
+	struct spwd *sp, *result;
+	char *path = NULL;
+	char buf[BUFSIZ];
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+
+	if (asprintf (&path, "%s/shadow", r->name) == -1) {
+		return;
+	}
+	fd = openat (tcb_dirfd, path, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+	free (path);
+	if (fd < 0) {
+		return;
+	}
+	while (len < sizeof (buf) - 1) {
+		n = read (fd, buf + len, sizeof (buf) - 1 - len);
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			(void) close (fd);
+			return;
+		}
+		if (0 == n) {
+			break;
+		}
+		len += (size_t) n;
+	}
+	(void) close (fd);
+	buf[len] = '\0';
+	buf[strcspn (buf, "\n")] = '\0';
+	len = strlen (buf) + 1;
+
+	/* One block, as the entries of the shadow database */
+	sp = (struct spwd *) malloc (sizeof *sp + len);
+	if (NULL == sp) {
+		return;
+	}
+	memset (sp, 0, sizeof *sp);
+	(void) sgetspent_r (buf, sp, (char *) (sp + 1), len, &result);
+	if ((NULL == result) || (strcmp (sp->sp_namp, r->name) != 0)) {
+		free (sp);
+		return;
+	}
+	r->spw = sp;
+}
+
+/*
+ * shadowtcb_read_all - read the shadow entries of many users
+ *
+ *	The shadow files of the count users of names are read
+ *	concurrently by CHECK_THREADS threads, with openat() relative to
+ *	TCB_DIR, without locking them. It is meant for the read-only
+ *	checks and reports, and must be called as root, in a batch
+ *	session (see shadowtcb_batch_begin).
+ *
+ *	entries[i] is set to the entry of names[i], in one block to be
+ *	freed with free(), or to NULL if it could not be read. The
+ *	caller can then use the usual per-user functions for these users,
+ *	to report why.
+ */
+shadowtcb_status shadowtcb_read_all (const char *const *names, size_t count,
+                                     /*@out@*/struct spwd **entries)
+{
+	/*@null@*/struct work_pool *pool = NULL;
+	struct tcb_read *reads;
+	int nthreads = getdef_num ("CHECK_THREADS", 1);
+	size_t i;
+
+	if ((-1 == tcb_dirfd) || (0 == count)) {
+		for (i = 0; i < count; i++) {
+			entries[i] = NULL;
+		}
+		return (-1 == tcb_dirfd) ? SHADOWTCB_FAILURE : SHADOWTCB_SUCCESS;
+	}
+
+	reads = (struct tcb_read *) calloc (count, sizeof *reads);
+	if (NULL == reads) {
+		OUT_OF_MEMORY;
+		return SHADOWTCB_FAILURE;
+	}
+	if ((nthreads > 1) && (count > 1)) {
+		if ((size_t) nthreads > count) {
+			nthreads = (int) count;
+		}
+		pool = work_pool_start ((size_t) nthreads,
+		                        2 * (size_t) nthreads);
+	}
+	for (i = 0; i < count; i++) {
+		reads[i].name = names[i];
+		reads[i].spw = NULL;
+		if (!work_pool_queue (pool, tcb_read_one, &reads[i], true)) {
+			tcb_read_one (pool, &reads[i]);
+		}
+	}
+	(void) work_pool_stop (pool);
+
+	for (i = 0; i < count; i++) {
+		entries[i] = reads[i].spw;
+	}
+	free (reads);
+	return SHADOWTCB_SUCCESS;
+}
@@ -3,6 +3,8 @@
 
 #include <sys/types.h>
 
+struct spwd;
+
 typedef enum {
 	SHADOWTCB_FAILURE = 0,
 	SHADOWTCB_SUCCESS = 1
@@ -15,5 +17,10 @@ extern shadowtcb_status shadowtcb_remove (const char *name);
 extern shadowtcb_status shadowtcb_move (/*@null@*/const char *user_newname,
                                         uid_t user_newid);
 extern shadowtcb_status shadowtcb_create (const char *name, uid_t uid);
+extern shadowtcb_status shadowtcb_batch_begin (void);
+extern shadowtcb_status shadowtcb_batch_end (void);
+extern shadowtcb_status shadowtcb_read_all (const char *const *names,
+                                            size_t count,
+                                            /*@out@*/struct spwd **entries);
 
 #endif
@@ -0,0 +1,340 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* HAVE_PTHREAD */
+#include "defines.h"
+#include "getdef.h"
+#include "metrics.h"
+#include "timing.h"
+
+static /*@observer@*/const char *const phase_names[TIMING_PHASES] = {
+	"lock",
+	"lock_held",
+	"open",
+	"backup",
+	"write",
+	"fsync",
+	"rename",
+	"journal",
+	"nscd",
+	"sssd",
+	"defs",
+	"nss",
+	"getpwnam",
+	"getpwuid",
+	"getgrnam",
+	"getgrgid",
+	"getspnam",
+	"pam_start",
+	"pam_auth",
+	"pam_acct",
+	"pam_session",
+	"limits",
+	"env",
+	"utmp",
+	"lastlog",
+	"faillog",
+};
+
+static struct timing_totals timings[TIMING_PHASES];
+static int enabled = -1;	/* not known yet */
+static bool log_timings = false;
+static /*@null@*/const char *metrics_dir = NULL;
+static pid_t report_pid;	/* the children do not report */
+static struct timespec origin;	/* see timing_begin */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t lookup_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif				/* HAVE_PTHREAD */
+
+static size_t timing_format (char *buf, size_t size);
+static void timing_report (void);
+
+/*
+ * timing_begin - Note the start of the program, for timing_exec().
+ */
+void timing_begin (void)
+{
+	if (clock_gettime (CLOCK_MONOTONIC, &origin) != 0) {
+		origin.tv_nsec = -1;
+	}
+}
+
+/*
+ * timing_enabled - Whether the operations are timed (LOG_TIMINGS or
+ *                  METRICS_DIR).
+ *
+ *	login.defs is only checked once. The report is then registered
+ *	with atexit(), for this process only (not for the children which
+ *	exit without exec, see run_command).
+ *
+ *	The timings are also logged when root sets SHADOW_LOG_TIMINGS in
+ *	the environment, to trace a single invocation.
+ */
+bool timing_enabled (void)
+{
+	if (-1 == enabled) {
+		enabled = 0;
+		report_pid = getpid ();
+		log_timings =    getdef_bool ("LOG_TIMINGS")
+		              || (   (0 == getuid ())
+		                  && (NULL != shadow_getenv ("SHADOW_LOG_TIMINGS")));
+		metrics_dir = getdef_str ("METRICS_DIR");
+		if ((NULL != metrics_dir) && ('\0' == metrics_dir[0])) {
+			metrics_dir = NULL;
+		}
+		if (   (log_timings || (NULL != metrics_dir))
+		    && (atexit (timing_report) == 0)) {
+			enabled = 1;
+		}
+	}
+	return (1 == enabled);
+}
+
+/*
+ * timing_start - Start timing a phase.
+ *
+ *	If timing is disabled, start is marked so that timing_stop()
+ *	ignores it.
+ */
+void timing_start (/*@out@*/struct timespec *start)
+{
+	if (   !timing_enabled ()
+	    || (clock_gettime (CLOCK_MONOTONIC, start) != 0)) {
+		start->tv_sec = 0;
+		start->tv_nsec = -1;
+	}
+}
+
+/*
+ * timing_stop - Add the time since start, and the number of processed
+ *               entries and bytes (if known, 0 otherwise) to a phase.
+ */
+void timing_stop (enum timing_phase phase,
+                  const struct timespec *start,
+                  unsigned long entries,
+                  unsigned long long bytes)
+{
+	struct timespec now;
+	struct timing_totals *t = &timings[phase];
+	long long ns;
+
+	if (   (start->tv_nsec < 0)
+	    || (clock_gettime (CLOCK_MONOTONIC, &now) != 0)) {
+		return;
+	}
+
+	ns =   ((long long) now.tv_sec - (long long) start->tv_sec)
+	         * 1000000000LL
+	     + ((long long) now.tv_nsec - (long long) start->tv_nsec);
+	if (ns > 0) {
+		t->ns += (unsigned long long) ns;
+	}
+	t->calls++;
+	t->entries += entries;
+	t->bytes += bytes;
+}
+
+/*
+ * timing_stop_lookup - Add an NSS lookup to a phase, as an entry if it
+ *                      found one, and as a miss otherwise.
+ *
+ *	The lookups may happen in the worker threads of pwck and grpck.
+ */
+void timing_stop_lookup (enum timing_phase phase,
+                         const struct timespec *start,
+                         bool found)
+{
+	if (start->tv_nsec < 0) {
+		return;
+	}
+#ifdef HAVE_PTHREAD
+	(void) pthread_mutex_lock (&lookup_lock);
+#endif				/* HAVE_PTHREAD */
+	timing_stop (phase, start, found ? 1 : 0, 0);
+	if (!found) {
+		timings[phase].misses++;
+	}
+#ifdef HAVE_PTHREAD
+	(void) pthread_mutex_unlock (&lookup_lock);
+#endif				/* HAVE_PTHREAD */
+}
+
+/*
+ * timing_format - Format the time spent in each phase:
+ *
+ *	 lock=0.000012s open=0.004512s open_entries=1200 ...
+ *
+ *	The phases which did not happen are omitted. <phase>_calls is
+ *	given when a phase happened several times. For the NSS lookups,
+ *	<phase>_entries counts the hits and <phase>_misses the misses.
+ *
+ *	It returns the length of the line.
+ */
+static size_t timing_format (char *buf, size_t size)
+{
+	size_t len = 0;
+	int i, n;
+
+	buf[0] = '\0';
+	for (i = 0; i < TIMING_PHASES; i++) {
+		const struct timing_totals *t = &timings[i];
+
+		if (0 == t->calls) {
+			continue;
+		}
+		n = snprintf (buf + len, size - len, " %s=%llu.%06llus",
+		              phase_names[i],
+		              t->ns / 1000000000ULL,
+		              (t->ns % 1000000000ULL) / 1000ULL);
+		if ((n > 0) && (t->calls > 1)) {
+			len += strlen (buf + len);
+			n = snprintf (buf + len, size - len, " %s_calls=%lu",
+			              phase_names[i], t->calls);
+		}
+		if ((n > 0) && (t->entries > 0)) {
+			len += strlen (buf + len);
+			n = snprintf (buf + len, size - len, " %s_entries=%lu",
+			              phase_names[i], t->entries);
+		}
+		if ((n > 0) && (t->bytes > 0)) {
+			len += strlen (buf + len);
+			n = snprintf (buf + len, size - len, " %s_bytes=%llu",
+			              phase_names[i], t->bytes);
+		}
+		if ((n > 0) && (t->misses > 0)) {
+			len += strlen (buf + len);
+			n = snprintf (buf + len, size - len, " %s_misses=%lu",
+			              phase_names[i], t->misses);
+		}
+		if (n < 0) {
+			break;
+		}
+		len += strlen (buf + len);
+	}
+
+	return len;
+}
+
+/*
+ * timing_happened - Whether a phase happened since the last reset.
+ *
+ *	The parent of login and su, whose child reported the startup, thus
+ *	does not count another run in the metrics.
+ */
+static bool timing_happened (void)
+{
+	int i;
+
+	for (i = 0; i < TIMING_PHASES; i++) {
+		if (0 != timings[i].calls) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * timing_report - Log the time spent in each phase, on a single line,
+ *                 and add it to the metrics, when the program exits.
+ *
+ *	The memory held by the databases (see metrics_format_memory) is
+ *	logged on a second line.
+ */
+static void timing_report (void)
+{
+	char buf[2048];
+
+	if (getpid () != report_pid) {
+		return;
+	}
+
+	if (log_timings && (timing_format (buf, sizeof buf) != 0)) {
+		SYSLOG ((LOG_INFO, "timings:%s", buf));
+	}
+	if (log_timings && (metrics_format_memory (buf, sizeof buf) != 0)) {
+		SYSLOG ((LOG_INFO, "memory:%s", buf));
+	}
+	if ((NULL != metrics_dir) && timing_happened ()) {
+		metrics_write (metrics_dir);
+	}
+}
+
+/*
+ * timing_exec - Log the time spent in each phase before executing a
+ *               program, and the time since timing_begin() as exec:
+ *
+ *	timings: defs=0.000210s nss=0.001203s pam_auth=0.120112s ...
+ *	         exec=0.131003s
+ *
+ *	The phases are also added to the metrics. Nothing is reported
+ *	when the program exits afterwards.
+ */
+void timing_exec (void)
+{
+	char buf[1024];
+	struct timespec now;
+	size_t len;
+	long long ns;
+
+	if (!timing_enabled ()) {
+		return;
+	}
+
+	if (NULL != metrics_dir) {
+		metrics_write (metrics_dir);
+	}
+	if (!log_timings) {
+		timing_reset ();
+		return;
+	}
+
+	len = timing_format (buf, sizeof buf);
+	if (   (origin.tv_nsec >= 0)
+	    && (clock_gettime (CLOCK_MONOTONIC, &now) == 0)) {
+		ns =   ((long long) now.tv_sec - (long long) origin.tv_sec)
+		         * 1000000000LL
+		     + ((long long) now.tv_nsec - (long long) origin.tv_nsec);
+		(void) snprintf (buf + len, sizeof buf - len,
+		                 " exec=%lld.%06llds",
+		                 ns / 1000000000LL,
+		                 (ns % 1000000000LL) / 1000LL);
+	}
+	if ('\0' != buf[0]) {
+		SYSLOG ((LOG_INFO, "timings:%s", buf));
+	}
+	timing_reset ();
+}
+
+/*
+ * timing_reset - Forget the time spent in each phase.
+ *
+ *	This is used by a parent when its child reports the phases.
+ */
+void timing_reset (void)
+{
+	memzero (timings, sizeof timings);
+}
+
+/*
+ * timing_phase_name - Name of a phase, as logged.
+ */
+/*@observer@*/const char *timing_phase_name (enum timing_phase phase)
+{
+	return phase_names[phase];
+}
+
+/*
+ * timing_totals - Totals of a phase since the last reset.
+ */
+/*@observer@*/const struct timing_totals *timing_totals (
+	enum timing_phase phase)
+{
+	return &timings[phase];
+}
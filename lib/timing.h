@@ -0,0 +1,67 @@
+#ifndef _TIMING_H_
+#define _TIMING_H_
+
+#include <time.h>
+#include "defines.h"
+
+/*
+ * Phases of the database operations, and of the startup of login and su,
+ * which are timed when LOG_TIMINGS or METRICS_DIR is set. The totals are
+ * logged, or added to the metrics, when the program exits, or before
+ * login and su execute the shell.
+ */
+enum timing_phase {
+	TIMING_LOCK,		/* waiting for the locks */
+	TIMING_LOCK_HELD,	/* from the lock to the unlock */
+	TIMING_OPEN,
+	TIMING_BACKUP,
+	TIMING_WRITE,
+	TIMING_FSYNC,
+	TIMING_RENAME,
+	TIMING_JOURNAL,
+	TIMING_NSCD,
+	TIMING_SSSD,
+	TIMING_DEFS,		/* loading login.defs */
+	TIMING_NSS,		/* looking up the user */
+	TIMING_GETPWNAM,	/* the NSS lookups, see nsslookup.c */
+	TIMING_GETPWUID,
+	TIMING_GETGRNAM,
+	TIMING_GETGRGID,
+	TIMING_GETSPNAM,
+	TIMING_PAM_START,
+	TIMING_PAM_AUTH,
+	TIMING_PAM_ACCT,
+	TIMING_PAM_SESSION,	/* pam_setcred and pam_open_session */
+	TIMING_LIMITS,
+	TIMING_ENV,
+	TIMING_UTMP,
+	TIMING_LASTLOG,
+	TIMING_FAILLOG,
+	TIMING_PHASES
+};
+
+struct timing_totals {
+	unsigned long calls;
+	unsigned long long ns;
+	unsigned long entries;
+	unsigned long long bytes;
+	unsigned long misses;	/* lookups which found nothing */
+};
+
+extern void timing_begin (void);
+extern bool timing_enabled (void);
+extern void timing_start (/*@out@*/struct timespec *start);
+extern void timing_stop (enum timing_phase phase,
+                         const struct timespec *start,
+                         unsigned long entries,
+                         unsigned long long bytes);
+extern void timing_stop_lookup (enum timing_phase phase,
+                                const struct timespec *start,
+                                bool found);
+extern void timing_exec (void);
+extern void timing_reset (void);
+extern /*@observer@*/const char *timing_phase_name (enum timing_phase phase);
+extern /*@observer@*/const struct timing_totals *timing_totals (
+	enum timing_phase phase);
+
+#endif
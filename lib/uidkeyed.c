@@ -0,0 +1,654 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "getdef.h"
+#include "uidrecords.h"
+
+/*
+ * Records of the high UIDs, stored by key (LOG_KEYED_UID_MIN)
+ *
+ * The records of lastlog and faillog are stored at the offset
+ * UID * record size of the file. With UIDs spread over 2^31, the file is
+ * a huge sparse file. The records of the UIDs from LOG_KEYED_UID_MIN are
+ * instead stored in <file>.keyed, a hash table with open addressing,
+ * whose size depends on the number of records:
+ *
+ *	char     magic[8];	"SHADOWKY"
+ *	uint32_t version;	1
+ *	uint32_t record_size;
+ *	uint64_t capacity;	number of slots, a power of 2
+ *	uint64_t count;		number of used slots
+ *	slots[capacity]:
+ *		uint64_t key;	UID + 1, 0 for an empty slot
+ *		char record[record_size], padded to 8 bytes
+ *
+ * in the byte order of the host. The empty records are not stored.
+ *
+ * The file is locked with flock() while it is open, shared for the
+ * readers and exclusive for the writers. When it is full, it is
+ * rebuilt with twice as many slots in <file>.keyed+, which is renamed
+ * over it; the processes waiting for the old file then open the new
+ * one.
+ *
+ * The file is created with the owner and the permissions of <file>, and
+ * only if <file> exists, so that the records are only kept if the
+ * administrator created the log file.
+ */
+
+#define KEYED_MAGIC	"SHADOWKY"
+#define KEYED_VERSION	1
+#define KEYED_MIN_SLOTS	64
+
+struct keyed_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;
+	uint64_t count;
+};
+
+/*
+ * uid_keyed - check if the record of uid is stored by key
+ */
+bool uid_keyed (unsigned long uid)
+{
+	return uid >= getdef_ulong ("LOG_KEYED_UID_MIN", ULONG_MAX);
+}
+
+static off_t slot_offset (const struct uid_keyed *k, uint64_t slot)
+{
+	return (off_t) sizeof (struct keyed_header)
+	       + (off_t) slot * (off_t) k->slot_size;
+}
+
+static uint64_t slot_home (const struct uid_keyed *k, uint64_t key)
+{
+	uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+
+	return (h ^ (h >> 29)) & (k->capacity - 1);
+}
+
+static int full_pread (int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t cnt;
+
+	do {
+		cnt = pread (fd, buf, len, off);
+	} while ((cnt < 0) && (EINTR == errno));
+	if (cnt == (ssize_t) len) {
+		return 0;
+	}
+	if (cnt >= 0) {
+		errno = EIO;
+	}
+	return -1;
+}
+
+static int full_pwrite (int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t cnt;
+
+	do {
+		cnt = pwrite (fd, buf, len, off);
+	} while ((cnt < 0) && (EINTR == errno));
+	if (cnt == (ssize_t) len) {
+		return 0;
+	}
+	if (cnt >= 0) {
+		errno = ENOSPC;
+	}
+	return -1;
+}
+
+static int write_header (struct uid_keyed *k)
+{
+	struct keyed_header h;
+
+	memzero (&h, sizeof h);
+	memcpy (h.magic, KEYED_MAGIC, sizeof h.magic);
+	h.version = KEYED_VERSION;
+	h.record_size = (uint32_t) k->record_size;
+	h.capacity = k->capacity;
+	h.count = k->count;
+	k->dirty = true;
+	return full_pwrite (k->fd, &h, sizeof h, 0);
+}
+
+/*
+ * init_table - make the table of k empty, with capacity slots
+ */
+static int init_table (struct uid_keyed *k, uint64_t capacity)
+{
+	k->capacity = capacity;
+	k->count = 0;
+	if (ftruncate (k->fd, slot_offset (k, capacity)) != 0) {
+		return -1;
+	}
+	return write_header (k);
+}
+
+/*
+ * read_header - check the header of the file of k
+ */
+static int read_header (struct uid_keyed *k)
+{
+	struct keyed_header h;
+	struct stat sb;
+
+	if (fstat (k->fd, &sb) != 0) {
+		return -1;
+	}
+	if (0 == sb.st_size) {
+		/* Created, but not initialized yet */
+		if (k->writable) {
+			return init_table (k, KEYED_MIN_SLOTS);
+		}
+		k->capacity = 0;
+		k->count = 0;
+		return 0;
+	}
+	if (full_pread (k->fd, &h, sizeof h, 0) != 0) {
+		return -1;
+	}
+	if (   (memcmp (h.magic, KEYED_MAGIC, sizeof h.magic) != 0)
+	    || (KEYED_VERSION != h.version)
+	    || (h.record_size != k->record_size)
+	    || (h.capacity < KEYED_MIN_SLOTS)
+	    || ((h.capacity & (h.capacity - 1)) != 0)
+	    || (h.count >= h.capacity)) {
+		errno = EINVAL;
+		return -1;
+	}
+	k->capacity = h.capacity;
+	k->count = h.count;
+	if (sb.st_size < slot_offset (k, h.capacity)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * create_file - create the file of k, like file
+ */
+static int create_file (const char *file, const char *path)
+{
+	struct stat sb;
+	int fd;
+
+	if (stat (file, &sb) != 0) {
+		return -1;
+	}
+	fd = open (path, O_RDWR | O_CREAT | O_EXCL | O_NOCTTY | O_CLOEXEC,
+	           sb.st_mode & 0666);
+	if (fd < 0) {
+		return -1;
+	}
+	if (   (fchown (fd, sb.st_uid, sb.st_gid) != 0)
+	    || (fchmod (fd, sb.st_mode & 0666) != 0)) {
+		(void) close (fd);
+		(void) unlink (path);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * uid_keyed_open - open and lock the records stored by key for file
+ *
+ *	If writable is true, the file is locked for writing, and created if
+ *	file exists.
+ *
+ *	It returns 1 if the records are open, 0 if there are none (the
+ *	file does not exist), and -1 on error.
+ */
+int uid_keyed_open (/*@out@*/struct uid_keyed *k, const char *file,
+                    size_t record_size, bool writable)
+{
+	size_t len = strlen (file) + sizeof ".keyed";
+	struct stat sb;
+
+	memzero (k, sizeof *k);
+	k->fd = -1;
+	k->record_size = record_size;
+	k->slot_size = sizeof (uint64_t) + ((record_size + 7) & ~(size_t) 7);
+	k->writable = writable;
+	k->path = malloc (len);
+	if (NULL == k->path) {
+		return -1;
+	}
+	(void) snprintf (k->path, len, "%s.keyed", file);
+
+	for (;;) {
+		k->fd = open (k->path,
+		              (writable ? O_RDWR : O_RDONLY) | O_NOCTTY | O_CLOEXEC);
+		if ((k->fd < 0) && (ENOENT == errno)) {
+			if (!writable) {
+				break;
+			}
+			k->fd = create_file (file, k->path);
+			if ((k->fd < 0) && (EEXIST == errno)) {
+				continue;
+			}
+			if ((k->fd < 0) && (ENOENT == errno)) {
+				break;
+			}
+		}
+		if (k->fd < 0) {
+			goto fail;
+		}
+		while (flock (k->fd, writable ? LOCK_EX : LOCK_SH) != 0) {
+			if (EINTR != errno) {
+				goto fail;
+			}
+		}
+		if (fstat (k->fd, &sb) != 0) {
+			goto fail;
+		}
+		if (sb.st_nlink > 0) {
+			break;
+		}
+		/* Replaced by a larger table while we were waiting */
+		(void) close (k->fd);
+		k->fd = -1;
+	}
+
+	if (k->fd < 0) {
+		free (k->path);
+		k->path = NULL;
+		return 0;
+	}
+	if (read_header (k) != 0) {
+		goto fail;
+	}
+	return 1;
+
+      fail:
+	(void) uid_keyed_close (k);
+	return -1;
+}
+
+/*
+ * find_slot - find the slot of key, or the empty slot where it would be
+ *             inserted
+ *
+ *	It returns 1 if key was found, 0 if not, and -1 on error.
+ */
+static int find_slot (const struct uid_keyed *k, uint64_t key,
+                      /*@out@*/uint64_t *slot)
+{
+	uint64_t i, n;
+
+	*slot = 0;
+	if (0 == k->capacity) {
+		return 0;
+	}
+	i = slot_home (k, key);
+	for (n = 0; n < k->capacity; n++) {
+		uint64_t cur;
+
+		if (full_pread (k->fd, &cur, sizeof cur, slot_offset (k, i)) != 0) {
+			return -1;
+		}
+		if ((0 == cur) || (key == cur)) {
+			*slot = i;
+			return (key == cur) ? 1 : 0;
+		}
+		i = (i + 1) & (k->capacity - 1);
+	}
+	/* Never full, see grow () */
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * uid_keyed_get - copy the record of uid in record
+ *
+ *	It returns 0 if the record was found, and -1 otherwise. The
+ *	record is then cleared, like a missing record of the files
+ *	indexed by UID.
+ */
+int uid_keyed_get (struct uid_keyed *k, unsigned long uid,
+                   /*@out@*/void *record)
+{
+	uint64_t slot;
+
+	if (find_slot (k, (uint64_t) uid + 1, &slot) == 1) {
+		if (full_pread (k->fd, record, k->record_size,
+		                slot_offset (k, slot) + (off_t) sizeof (uint64_t))
+		    == 0) {
+			return 0;
+		}
+	}
+	memzero (record, k->record_size);
+	return -1;
+}
+
+/*
+ * uid_keyed_read - copy the record of uid in record, from k, or else
+ *                  from its offset in the file opened as fd
+ *
+ *	The programs which do not know the records stored by key (e.g.
+ *	pam_lastlog) write the record of any UID at its offset. This
+ *	record is used when uid has no record stored by key. k is NULL
+ *	if there is no keyed file, and fd is -1 if the file indexed by
+ *	UID is not open.
+ *
+ *	It returns 0 if a record was found, and -1 otherwise. The record
+ *	is then cleared.
+ */
+int uid_keyed_read (/*@null@*/struct uid_keyed *k, int fd,
+                    size_t record_size, unsigned long uid,
+                    /*@out@*/void *record)
+{
+	if ((NULL != k) && (uid_keyed_get (k, uid, record) == 0)) {
+		return 0;
+	}
+	if (   (fd >= 0)
+	    && (uid_record_read (fd, record_size, uid, record) == 0)) {
+		return 0;
+	}
+	memzero (record, record_size);
+	return -1;
+}
+
+/*
+ * grow - rebuild the table of k with twice as many slots
+ */
+static int grow (struct uid_keyed *k)
+{
+	struct uid_keyed n;
+	size_t len = strlen (k->path) + 2;
+	char *tmp, *slot;
+	struct stat sb;
+	uint64_t i;
+	int ret = -1;
+
+	tmp = malloc (len);
+	slot = malloc (k->slot_size);
+	if ((NULL == tmp) || (NULL == slot) || (fstat (k->fd, &sb) != 0)) {
+		goto out;
+	}
+	(void) snprintf (tmp, len, "%s+", k->path);
+
+	n = *k;
+	n.path = tmp;
+	n.fd = open (tmp, O_RDWR | O_CREAT | O_TRUNC | O_NOCTTY | O_CLOEXEC,
+	             sb.st_mode & 0666);
+	if (n.fd < 0) {
+		goto out;
+	}
+	if (   (fchown (n.fd, sb.st_uid, sb.st_gid) != 0)
+	    || (fchmod (n.fd, sb.st_mode & 0666) != 0)
+	    || (flock (n.fd, LOCK_EX) != 0)
+	    || (init_table (&n, 2 * k->capacity) != 0)) {
+		goto fail;
+	}
+	for (i = 0; i < k->capacity; i++) {
+		uint64_t key, to;
+
+		if (full_pread (k->fd, slot, k->slot_size, slot_offset (k, i))
+		    != 0) {
+			goto fail;
+		}
+		memcpy (&key, slot, sizeof key);
+		if (0 == key) {
+			continue;
+		}
+		if (   (find_slot (&n, key, &to) != 0)
+		    || (full_pwrite (n.fd, slot, k->slot_size,
+		                     slot_offset (&n, to)) != 0)) {
+			goto fail;
+		}
+		n.count++;
+	}
+	if (   (write_header (&n) != 0)
+	    || (fsync (n.fd) != 0)
+	    || (rename (tmp, k->path) != 0)) {
+		goto fail;
+	}
+
+	/* The old file is unlocked, its waiters will open the new one */
+	(void) close (k->fd);
+	k->fd = n.fd;
+	k->capacity = n.capacity;
+	k->count = n.count;
+	k->dirty = true;
+	ret = 0;
+	goto out;
+
+      fail:
+	(void) close (n.fd);
+	(void) unlink (tmp);
+      out:
+	free (tmp);
+	free (slot);
+	return ret;
+}
+
+/*
+ * remove_slot - empty the slot of a removed record
+ *
+ *	The following records of the same probe sequence are moved back,
+ *	so that they can still be found.
+ */
+static int remove_slot (struct uid_keyed *k, uint64_t slot)
+{
+	uint64_t mask = k->capacity - 1;
+	uint64_t i = slot, j = slot;
+	char *buf;
+	int ret = -1;
+
+	buf = calloc (1, k->slot_size);
+	if (NULL == buf) {
+		return -1;
+	}
+	for (;;) {
+		uint64_t key, home;
+
+		j = (j + 1) & mask;
+		if (full_pread (k->fd, buf, k->slot_size, slot_offset (k, j))
+		    != 0) {
+			goto out;
+		}
+		memcpy (&key, buf, sizeof key);
+		if (0 == key) {
+			break;
+		}
+		home = slot_home (k, key);
+		/* Move it back if its home is not between i and j */
+		if ((i <= j) ? ((home <= i) || (home > j))
+		             : ((home <= i) && (home > j))) {
+			if (full_pwrite (k->fd, buf, k->slot_size,
+			                 slot_offset (k, i)) != 0) {
+				goto out;
+			}
+			i = j;
+		}
+	}
+	memzero (buf, k->slot_size);
+	if (full_pwrite (k->fd, buf, k->slot_size, slot_offset (k, i)) != 0) {
+		goto out;
+	}
+	k->count--;
+	ret = write_header (k);
+
+      out:
+	free (buf);
+	return ret;
+}
+
+static bool is_empty (const void *record, size_t size)
+{
+	const char *cp = record;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if ('\0' != cp[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * uid_keyed_put - write the record of uid
+ *
+ *	An empty record (all zeros) is removed.
+ *
+ *	It returns 0 on success, and -1 otherwise.
+ */
+int uid_keyed_put (struct uid_keyed *k, unsigned long uid,
+                   const void *record)
+{
+	uint64_t key = (uint64_t) uid + 1;
+	uint64_t slot;
+	int found;
+
+	if (!k->writable) {
+		errno = EBADF;
+		return -1;
+	}
+	found = find_slot (k, key, &slot);
+	if (found < 0) {
+		return -1;
+	}
+	if (is_empty (record, k->record_size)) {
+		return (1 == found) ? remove_slot (k, slot) : 0;
+	}
+	if (0 == found) {
+		if ((k->count + 1) * 4 > k->capacity * 3) {
+			if (   (grow (k) != 0)
+			    || (find_slot (k, key, &slot) != 0)) {
+				return -1;
+			}
+		}
+		if (full_pwrite (k->fd, &key, sizeof key, slot_offset (k, slot))
+		    != 0) {
+			return -1;
+		}
+		k->count++;
+		if (write_header (k) != 0) {
+			return -1;
+		}
+	}
+	k->dirty = true;
+	return full_pwrite (k->fd, record, k->record_size,
+	                    slot_offset (k, slot) + (off_t) sizeof key);
+}
+
+/*
+ * uid_keyed_foreach - call fn for the records of the UIDs between
+ *                     uid_min and uid_max
+ *
+ *	The records are visited in no particular order. If fn returns
+ *	true, the modified record is written (or removed if it is empty).
+ *
+ *	It returns 0 on success, and -1 otherwise. *uid is then set to the
+ *	UID of the record which could not be read or written.
+ */
+int uid_keyed_foreach (struct uid_keyed *k,
+                       unsigned long uid_min, unsigned long uid_max,
+                       uid_record_fn fn, void *arg,
+                       /*@out@*/unsigned long *uid)
+{
+	unsigned long *removed = NULL;
+	size_t nremoved = 0, i;
+	char *buf;
+	uint64_t slot;
+	int ret = -1;
+
+	*uid = uid_min;
+	buf = malloc (k->slot_size);
+	if (NULL == buf) {
+		return -1;
+	}
+	for (slot = 0; slot < k->capacity; slot++) {
+		uint64_t key;
+
+		if (full_pread (k->fd, buf, k->slot_size, slot_offset (k, slot))
+		    != 0) {
+			goto out;
+		}
+		memcpy (&key, buf, sizeof key);
+		if (   (0 == key)
+		    || (key - 1 < uid_min) || (key - 1 > uid_max)) {
+			continue;
+		}
+		*uid = (unsigned long) (key - 1);
+		if (!fn (buf + sizeof key, *uid, arg)) {
+			continue;
+		}
+		if (!is_empty (buf + sizeof key, k->record_size)) {
+			if (full_pwrite (k->fd, buf + sizeof key, k->record_size,
+			                 slot_offset (k, slot)
+			                 + (off_t) sizeof key) != 0) {
+				goto out;
+			}
+			k->dirty = true;
+			continue;
+		}
+		/* Removed after the scan, which they would disturb */
+		if (0 == (nremoved & 63)) {
+			unsigned long *r = realloc (removed,
+			                            (nremoved + 64)
+			                            * sizeof *removed);
+			if (NULL == r) {
+				goto out;
+			}
+			removed = r;
+		}
+		removed[nremoved] = *uid;
+		nremoved++;
+	}
+	for (i = 0; i < nremoved; i++) {
+		*uid = removed[i];
+		memzero (buf, k->record_size);
+		if (uid_keyed_put (k, removed[i], buf) != 0) {
+			goto out;
+		}
+	}
+	ret = 0;
+
+      out:
+	free (buf);
+	free (removed);
+	return ret;
+}
+
+/*
+ * uid_keyed_close - synchronize the written records, unlock and close
+ *                   the file
+ *
+ *	It returns 0 on success, and -1 on error.
+ */
+int uid_keyed_close (struct uid_keyed *k)
+{
+	int ret = 0;
+
+	if (k->fd >= 0) {
+		if (k->dirty && (fdatasync (k->fd) != 0)) {
+			ret = -1;
+		}
+		if ((close (k->fd) != 0) && (0 == ret)) {
+			ret = -1;
+		}
+	}
+	free (k->path);
+	k->path = NULL;
+	k->fd = -1;
+	k->dirty = false;
+	return ret;
+}
@@ -0,0 +1,590 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "uidrecords.h"
+
+/*
+ * The records of lastlog and faillog are stored at the offset
+ * UID * record size of the file. Rather than seeking and reading each
+ * record through stdio, the callers map the records of the range of
+ * UIDs they report, and get them from memory.
+ *
+ * The files are sparse, the pages of the holes are only read as zeros
+ * when they are accessed.
+ *
+ * The updates of ranges of UIDs read and write blocks of records, and
+ * the records which are emptied are turned into holes.
+ */
+
+/* Size of the blocks of records read or written at once */
+#define UID_RECORDS_BLOCK	65536
+
+/*
+ * uid_records_map - map the records of the UIDs between uid_min and
+ *                   uid_max of the file opened as fd
+ *
+ *	It returns false if the records could not be mapped, e.g. if the
+ *	range does not fit in the address space. The caller should then
+ *	read the records from the file.
+ */
+bool uid_records_map (/*@out@*/struct uid_records *records, int fd,
+                      size_t record_size,
+                      unsigned long uid_min, unsigned long uid_max)
+{
+	struct stat sb;
+	unsigned long nrecords, last;
+	off_t start, end, page, offset;
+	void *map;
+
+	memzero (records, sizeof *records);
+	records->record_size = record_size;
+	records->uid_min = uid_min;
+	records->uid_max = uid_max;
+
+	if (   (0 == record_size) || (uid_min > uid_max)
+	    || (fstat (fd, &sb) != 0)) {
+		return false;
+	}
+
+	/* The records after the end of the file are empty */
+	nrecords = (unsigned long) (sb.st_size / (off_t) record_size);
+	if (uid_min >= nrecords) {
+		records->mapped = true;
+		return true;
+	}
+	last = (uid_max < nrecords) ? uid_max : nrecords - 1;
+
+	page = (off_t) sysconf (_SC_PAGESIZE);
+	if (page <= 0) {
+		return false;
+	}
+	start = (off_t) uid_min * (off_t) record_size;
+	end = ((off_t) last + 1) * (off_t) record_size;
+	/* The offset of the mapping must be aligned on a page */
+	offset = start - start % page;
+	if ((uintmax_t) (end - offset) > SIZE_MAX) {
+		return false;
+	}
+
+	map = mmap (NULL, (size_t) (end - offset), PROT_READ, MAP_SHARED,
+	            fd, offset);
+	if (MAP_FAILED == map) {
+		return false;
+	}
+
+	records->map = map;
+	records->map_size = (size_t) (end - offset);
+	records->first = (const char *) map + (size_t) (start - offset);
+	records->count = last - uid_min + 1;
+	records->mapped = true;
+	return true;
+}
+
+/*
+ * uid_records_get - copy the record of uid in record
+ *
+ *	It returns false if uid is not in the mapped range. The caller
+ *	should then read the record from the file.
+ */
+bool uid_records_get (const struct uid_records *records,
+                      unsigned long uid, /*@out@*/void *record)
+{
+	if (   !records->mapped
+	    || (uid < records->uid_min) || (uid > records->uid_max)) {
+		return false;
+	}
+
+	if (uid - records->uid_min < records->count) {
+		memcpy (record,
+		        records->first
+		        + (uid - records->uid_min) * records->record_size,
+		        records->record_size);
+	} else {
+		/* Outside of the file, like a missing entry */
+		memzero (record, records->record_size);
+	}
+	return true;
+}
+
+/*
+ * uid_records_unmap - unmap the records
+ */
+void uid_records_unmap (struct uid_records *records)
+{
+	if (NULL != records->map) {
+		(void) munmap (records->map, records->map_size);
+	}
+	memzero (records, sizeof *records);
+}
+
+/*
+ * punch_records - turn the count records at uid into a hole
+ *
+ *	It returns false if the file system does not support it.
+ */
+static bool punch_records (int fd, size_t record_size,
+                           unsigned long uid, size_t count)
+{
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+	return fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	                  (off_t) uid * (off_t) record_size,
+	                  (off_t) (count * record_size)) == 0;
+#else				/* !FALLOC_FL_PUNCH_HOLE */
+	(void) fd;
+	(void) record_size;
+	(void) uid;
+	(void) count;
+	return false;
+#endif				/* !FALLOC_FL_PUNCH_HOLE */
+}
+
+static int write_records (int fd, size_t record_size, unsigned long uid,
+                          const char *buf, size_t count)
+{
+	size_t len = count * record_size;
+	off_t offset = (off_t) uid * (off_t) record_size;
+	size_t i;
+
+	/* Empty records are written as holes if possible */
+	for (i = 0; (i < len) && ('\0' == buf[i]); i++);
+	if ((i == len) && punch_records (fd, record_size, uid, count)) {
+		return 0;
+	}
+
+	while (len > 0) {
+		ssize_t cnt = pwrite (fd, buf, len, offset);
+
+		if (cnt < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return -1;
+		}
+		buf += cnt;
+		len -= (size_t) cnt;
+		offset += cnt;
+	}
+	return 0;
+}
+
+/*
+ * uid_records_update - update the records of the UIDs between uid_min
+ *                      and uid_max
+ *
+ *	fn is called with arg for each record. It returns true if it
+ *	modified the record. The records which are not in the file are
+ *	empty. The modified records are written in contiguous runs.
+ *
+ *	If holes is false, the empty records in the holes and after the
+ *	end of the file are skipped. It should only be used when fn does
+ *	not modify the empty records.
+ *
+ *	It returns 0 on success, -1 if the records could not be read, and
+ *	-2 if they could not be written. uid is then set to the first UID
+ *	of the block which failed.
+ */
+int uid_records_update (int fd, size_t record_size,
+                        unsigned long uid_min, unsigned long uid_max,
+                        bool holes, uid_record_fn fn, void *arg,
+                        /*@out@*/unsigned long *uid)
+{
+	struct stat sb;
+	char *buf;
+	size_t nrecords;
+	int ret = 0;
+
+	*uid = uid_min;
+	if ((0 == record_size) || (fstat (fd, &sb) != 0)) {
+		return -1;
+	}
+	nrecords = (record_size < UID_RECORDS_BLOCK)
+	           ? UID_RECORDS_BLOCK / record_size : 1;
+	buf = malloc (nrecords * record_size);
+	if (NULL == buf) {
+		return -1;
+	}
+
+	while ((0 == ret) && (*uid <= uid_max)) {
+		off_t offset = (off_t) *uid * (off_t) record_size;
+		size_t n, len, got, i, run;
+
+		if (!holes) {
+			if (offset >= sb.st_size) {
+				break;
+			}
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+			{
+				off_t data = lseek (fd, offset, SEEK_DATA);
+
+				if ((data < 0) && (ENXIO == errno)) {
+					/* Only a hole remains */
+					break;
+				}
+				if (data > offset) {
+					/* Skip to the record including data */
+					if ((unsigned long) (data / (off_t) record_size) > uid_max) {
+						break;
+					}
+					*uid = (unsigned long) (data / (off_t) record_size);
+					offset = (off_t) *uid * (off_t) record_size;
+				}
+			}
+#endif				/* SEEK_DATA && SEEK_HOLE */
+		}
+
+		n = nrecords;
+		if (uid_max - *uid < n - 1) {
+			n = uid_max - *uid + 1;
+		}
+		len = n * record_size;
+		for (got = 0; got < len;) {
+			ssize_t cnt = pread (fd, buf + got, len - got,
+			                     offset + (off_t) got);
+
+			if (cnt < 0) {
+				if (EINTR == errno) {
+					continue;
+				}
+				ret = -1;
+				break;
+			}
+			if (0 == cnt) {
+				break;
+			}
+			got += (size_t) cnt;
+		}
+		if (0 != ret) {
+			break;
+		}
+		/* Outside of the file, like a missing entry */
+		memzero (buf + got, len - got);
+		if (!holes) {
+			/* Skip the records after the end of the file */
+			n = (got + record_size - 1) / record_size;
+			if (0 == n) {
+				break;
+			}
+		}
+
+		for (i = 0, run = 0; i <= n; i++) {
+			if (   (i < n)
+			    && fn (buf + i * record_size, *uid + i, arg)) {
+				run++;
+				continue;
+			}
+			if (   (0 != run)
+			    && (write_records (fd, record_size, *uid + i - run,
+			                       buf + (i - run) * record_size,
+			                       run) != 0)) {
+				*uid += i - run;
+				ret = -2;
+				break;
+			}
+			run = 0;
+		}
+		if ((0 != ret) || (n > uid_max - *uid)) {
+			break;
+		}
+		*uid += n;
+	}
+
+	free (buf);
+	return ret;
+}
+
+static bool clear_record (void *record, unused unsigned long uid,
+                          void *arg)
+{
+	size_t *record_size = arg;
+	const char *cp = record;
+	size_t i;
+
+	for (i = 0; (i < *record_size) && ('\0' == cp[i]); i++);
+	if (i == *record_size) {
+		return false;
+	}
+	memzero (record, *record_size);
+	return true;
+}
+
+/*
+ * uid_records_clear - clear the records of the UIDs between uid_min and
+ *                     uid_max
+ *
+ *	The records are turned into a hole if the file system supports it,
+ *	and overwritten otherwise. The size of the file is not changed.
+ *
+ *	It returns 0 on success, or -1 or -2 like uid_records_update().
+ */
+int uid_records_clear (int fd, size_t record_size,
+                       unsigned long uid_min, unsigned long uid_max,
+                       /*@out@*/unsigned long *uid)
+{
+	struct stat sb;
+	unsigned long nrecords;
+
+	*uid = uid_min;
+	if ((0 == record_size) || (fstat (fd, &sb) != 0)) {
+		return -1;
+	}
+
+	/* The records after the end of the file are already empty */
+	nrecords = (unsigned long) ((sb.st_size + (off_t) record_size - 1)
+	                            / (off_t) record_size);
+	if ((uid_min > uid_max) || (uid_min >= nrecords)) {
+		return 0;
+	}
+	if (uid_max >= nrecords) {
+		uid_max = nrecords - 1;
+	}
+
+	if (punch_records (fd, record_size, uid_min,
+	                   (size_t) (uid_max - uid_min + 1))) {
+		return 0;
+	}
+
+	return uid_records_update (fd, record_size, uid_min, uid_max, false,
+	                           clear_record, &record_size, uid);
+}
+
+/*
+ * uid_records_fill - write record for the count UIDs starting at uid
+ *
+ *	It returns 0 on success, and -1 otherwise.
+ */
+int uid_records_fill (int fd, size_t record_size, unsigned long uid,
+                      unsigned long count, const void *record)
+{
+	char *buf;
+	size_t nrecords, i;
+	int ret = 0;
+
+	if ((0 == record_size) || (0 == count)) {
+		return 0;
+	}
+	nrecords = (record_size < UID_RECORDS_BLOCK)
+	           ? UID_RECORDS_BLOCK / record_size : 1;
+	if (nrecords > count) {
+		nrecords = (size_t) count;
+	}
+	buf = malloc (nrecords * record_size);
+	if (NULL == buf) {
+		return -1;
+	}
+	for (i = 0; i < nrecords; i++) {
+		memcpy (buf + i * record_size, record, record_size);
+	}
+
+	while ((0 == ret) && (count > 0)) {
+		size_t n = (count < nrecords) ? (size_t) count : nrecords;
+
+		ret = write_records (fd, record_size, uid, buf, n);
+		uid += n;
+		count -= n;
+	}
+
+	free (buf);
+	return ret;
+}
+
+struct uid_move_record {
+	const struct uid_move *move;
+	bool found;		/* the record of from was read */
+	char *record;
+};
+
+static int move_from_cmp (const void *p1, const void *p2)
+{
+	unsigned long u1 = ((const struct uid_move_record *) p1)->move->from;
+	unsigned long u2 = ((const struct uid_move_record *) p2)->move->from;
+
+	return (u1 > u2) - (u1 < u2);
+}
+
+static int move_to_cmp (const void *p1, const void *p2)
+{
+	unsigned long u1 = ((const struct uid_move_record *) p1)->move->to;
+	unsigned long u2 = ((const struct uid_move_record *) p2)->move->to;
+
+	return (u1 > u2) - (u1 < u2);
+}
+
+/*
+ * uid_records_move - move the records of count UIDs to other UIDs
+ *
+ *	All the records are read first, in the order of the file, then
+ *	the records to vacate are turned into holes, and the records are
+ *	written to their new UIDs, so that the moves can be chained
+ *	(e.g. 1000 to 1001 and 1001 to 1002).
+ *
+ *	If there is no record for the old UID, the record of the new UID
+ *	is cleared.
+ *
+ *	It returns 0 on success, or -1 or -2 like uid_records_update().
+ */
+int uid_records_move (int fd, size_t record_size,
+                      const struct uid_move *moves, size_t count)
+{
+	struct uid_move_record *mr;
+	struct stat sb;
+	char *records;
+	char *empty;
+	size_t i;
+	int ret = 0;
+
+	if ((0 == record_size) || (fstat (fd, &sb) != 0)) {
+		return -1;
+	}
+	if (0 == count) {
+		return 0;
+	}
+	if (count > SIZE_MAX / record_size) {
+		errno = ENOMEM;
+		return -1;
+	}
+	mr = malloc (count * sizeof *mr);
+	records = malloc (count * record_size);
+	empty = calloc (1, record_size);
+	if ((NULL == mr) || (NULL == records) || (NULL == empty)) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		mr[i].move = &moves[i];
+		mr[i].record = records + i * record_size;
+	}
+	qsort (mr, count, sizeof *mr, move_from_cmp);
+	for (i = 0; i < count; i++) {
+		off_t offset = (off_t) mr[i].move->from * (off_t) record_size;
+
+		mr[i].found = false;
+		if (offset + (off_t) record_size > sb.st_size) {
+			continue;
+		}
+		if (uid_record_read (fd, record_size, mr[i].move->from,
+		                     mr[i].record) != 0) {
+			ret = -1;
+			goto out;
+		}
+		mr[i].found = true;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (   mr[i].found && mr[i].move->vacate
+		    && (write_records (fd, record_size, mr[i].move->from,
+		                       empty, 1) != 0)) {
+			ret = -2;
+			goto out;
+		}
+	}
+
+	qsort (mr, count, sizeof *mr, move_to_cmp);
+	for (i = 0; i < count; i++) {
+		off_t offset = (off_t) mr[i].move->to * (off_t) record_size;
+		const char *record = mr[i].found ? mr[i].record : empty;
+
+		/* Nothing to clear after the end of the file */
+		if (!mr[i].found && (offset >= sb.st_size)) {
+			continue;
+		}
+		if (write_records (fd, record_size, mr[i].move->to,
+		                   record, 1) != 0) {
+			ret = -2;
+			goto out;
+		}
+	}
+
+      out:
+	free (empty);
+	free (records);
+	free (mr);
+	return ret;
+}
+
+/*
+ * uid_record_lock - lock or unlock the record of uid in the file opened
+ *                   as fd
+ *
+ *	type is F_RDLCK, F_WRLCK, or F_UNLCK. Only the bytes of the record
+ *	are locked, so that the updates of the records of other UIDs do
+ *	not wait. The lock is released by F_UNLCK, or when fd is closed.
+ *
+ *	The open file description locks are used when available, so that
+ *	the lock belongs to fd rather than to the process.
+ *
+ *	It returns 0 on success, and -1 otherwise (e.g. on file systems
+ *	without locks). The callers can then go on without the lock.
+ */
+int uid_record_lock (int fd, size_t record_size, unsigned long uid, int type)
+{
+	struct flock fl;
+	int ret;
+
+	memzero (&fl, sizeof fl);
+	fl.l_type = (short) type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (off_t) uid * (off_t) record_size;
+	fl.l_len = (off_t) record_size;
+
+	do {
+#ifdef F_OFD_SETLKW
+		ret = fcntl (fd, F_OFD_SETLKW, &fl);
+		if ((ret < 0) && (EINVAL == errno)) {
+			/* Kernel without open file description locks */
+			ret = fcntl (fd, F_SETLKW, &fl);
+		}
+#else				/* !F_OFD_SETLKW */
+		ret = fcntl (fd, F_SETLKW, &fl);
+#endif				/* !F_OFD_SETLKW */
+	} while ((ret < 0) && (EINTR == errno));
+
+	return (0 == ret) ? 0 : -1;
+}
+
+/*
+ * uid_record_read - read the record of uid from the file opened as fd
+ *
+ *	It returns 0 if the record was read, and -1 otherwise, e.g. if it
+ *	is after the end of the file.
+ */
+int uid_record_read (int fd, size_t record_size, unsigned long uid,
+                     /*@out@*/void *record)
+{
+	ssize_t cnt;
+
+	do {
+		cnt = pread (fd, record, record_size,
+		             (off_t) uid * (off_t) record_size);
+	} while ((cnt < 0) && (EINTR == errno));
+
+	return (cnt == (ssize_t) record_size) ? 0 : -1;
+}
+
+/*
+ * uid_record_write - write the record of uid in the file opened as fd
+ *
+ *	It returns 0 on success, and -1 otherwise.
+ */
+int uid_record_write (int fd, size_t record_size, unsigned long uid,
+                      const void *record)
+{
+	ssize_t cnt;
+
+	do {
+		cnt = pwrite (fd, record, record_size,
+		              (off_t) uid * (off_t) record_size);
+	} while ((cnt < 0) && (EINTR == errno));
+
+	return (cnt == (ssize_t) record_size) ? 0 : -1;
+}
@@ -0,0 +1,95 @@
+#ifndef _UIDRECORDS_H_
+#define _UIDRECORDS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "defines.h"
+
+/*
+ * Records of a file indexed by UID (lastlog, faillog), mapped in memory
+ * for a range of UIDs.
+ */
+struct uid_records {
+	/*@null@*/void *map;
+	size_t map_size;
+	/*@null@*/const char *first;	/* record of uid_min */
+	size_t record_size;
+	unsigned long uid_min;
+	unsigned long uid_max;
+	unsigned long count;		/* records in the file from uid_min */
+	bool mapped;
+};
+
+extern bool uid_records_map (/*@out@*/struct uid_records *records, int fd,
+                             size_t record_size,
+                             unsigned long uid_min, unsigned long uid_max);
+extern bool uid_records_get (const struct uid_records *records,
+                             unsigned long uid, /*@out@*/void *record);
+extern void uid_records_unmap (struct uid_records *records);
+
+/*
+ * Update of a record by uid_records_update(). It returns true if the
+ * record was modified.
+ */
+typedef bool (*uid_record_fn) (void *record, unsigned long uid, void *arg);
+
+extern int uid_records_update (int fd, size_t record_size,
+                               unsigned long uid_min, unsigned long uid_max,
+                               bool holes, uid_record_fn fn, void *arg,
+                               /*@out@*/unsigned long *uid);
+extern int uid_records_clear (int fd, size_t record_size,
+                              unsigned long uid_min, unsigned long uid_max,
+                              /*@out@*/unsigned long *uid);
+extern int uid_records_fill (int fd, size_t record_size, unsigned long uid,
+                             unsigned long count, const void *record);
+
+/*
+ * Move of a record by uid_records_move()
+ */
+struct uid_move {
+	unsigned long from;
+	unsigned long to;
+	bool vacate;		/* clear the record of from */
+};
+
+extern int uid_records_move (int fd, size_t record_size,
+                             const struct uid_move *moves, size_t count);
+
+/*
+ * Records of the high UIDs, stored by key in <file>.keyed (see uidkeyed.c)
+ */
+struct uid_keyed {
+	int fd;
+	/*@null@*/char *path;
+	size_t record_size;
+	size_t slot_size;
+	uint64_t capacity;
+	uint64_t count;
+	bool writable;
+	bool dirty;
+};
+
+extern bool uid_keyed (unsigned long uid);
+extern int uid_keyed_open (/*@out@*/struct uid_keyed *k, const char *file,
+                           size_t record_size, bool writable);
+extern int uid_keyed_get (struct uid_keyed *k, unsigned long uid,
+                          /*@out@*/void *record);
+extern int uid_keyed_read (/*@null@*/struct uid_keyed *k, int fd,
+                           size_t record_size, unsigned long uid,
+                           /*@out@*/void *record);
+extern int uid_keyed_put (struct uid_keyed *k, unsigned long uid,
+                          const void *record);
+extern int uid_keyed_foreach (struct uid_keyed *k,
+                              unsigned long uid_min, unsigned long uid_max,
+                              uid_record_fn fn, void *arg,
+                              /*@out@*/unsigned long *uid);
+extern int uid_keyed_close (struct uid_keyed *k);
+
+extern int uid_record_lock (int fd, size_t record_size, unsigned long uid,
+                            int type);
+extern int uid_record_read (int fd, size_t record_size, unsigned long uid,
+                            /*@out@*/void *record);
+extern int uid_record_write (int fd, size_t record_size, unsigned long uid,
+                             const void *record);
+
+#endif
@@ -0,0 +1,285 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdlib.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* HAVE_PTHREAD */
+#include "prototypes.h"
+
+/*
+ * Pool of threads running jobs queued by the caller, or by the jobs
+ * themselves.
+ *
+ * The number of queued jobs is limited, so that the memory and the
+ * resources (e.g. file descriptors) used by the queued jobs are bounded.
+ *
+ * Without POSIX threads, work_pool_start() returns NULL and the caller
+ * runs all the jobs itself.
+ */
+
+#define WORK_POOL_MAX_THREADS	32
+
+#ifdef HAVE_PTHREAD
+struct work_job {
+	work_fn fn;
+	void *arg;
+	/*@null@*/struct work_job *next;
+};
+
+struct work_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t queued_cond;	/* a job was queued, or stop is set */
+	pthread_cond_t taken_cond;	/* a job was taken */
+	/*@null@*/struct work_job *head;
+	/*@null@*/struct work_job *tail;
+	size_t queued;
+	size_t max_queued;
+	size_t running;		/* number of jobs being run */
+	bool stop;
+	bool failed;
+	size_t nthreads;
+	pthread_t threads[WORK_POOL_MAX_THREADS];
+};
+
+static void *work_pool_thread (void *arg)
+{
+	struct work_pool *pool = arg;
+	struct work_job *job;
+
+	(void) pthread_mutex_lock (&pool->lock);
+	for (;;) {
+		/*
+		 * A running job can still queue jobs, the threads can only
+		 * stop when they are all idle.
+		 */
+		while (   (NULL == pool->head)
+		       && (!pool->stop || (0 != pool->running))) {
+			(void) pthread_cond_wait (&pool->queued_cond,
+			                          &pool->lock);
+		}
+		job = pool->head;
+		if (NULL == job) {
+			break;
+		}
+		pool->head = job->next;
+		if (NULL == pool->head) {
+			pool->tail = NULL;
+		}
+		pool->queued--;
+		pool->running++;
+		(void) pthread_cond_signal (&pool->taken_cond);
+		(void) pthread_mutex_unlock (&pool->lock);
+
+		job->fn (pool, job->arg);
+		free (job);
+
+		(void) pthread_mutex_lock (&pool->lock);
+		pool->running--;
+		if (   pool->stop && (0 == pool->running)
+		    && (NULL == pool->head)) {
+			(void) pthread_cond_broadcast (&pool->queued_cond);
+		}
+	}
+	(void) pthread_mutex_unlock (&pool->lock);
+
+	return NULL;
+}
+#endif				/* HAVE_PTHREAD */
+
+/*
+ * work_pool_start - start a pool of nthreads threads
+ *
+ *	At most max_queued jobs wait for a thread.
+ *
+ *	It returns NULL if nthreads is lower than 2, or if no threads could
+ *	be started. The jobs should then be run by the caller.
+ */
+/*@null@*/struct work_pool *work_pool_start (size_t nthreads,
+                                             size_t max_queued)
+{
+#ifdef HAVE_PTHREAD
+	struct work_pool *pool;
+
+	if (nthreads < 2) {
+		return NULL;
+	}
+	if (nthreads > WORK_POOL_MAX_THREADS) {
+		nthreads = WORK_POOL_MAX_THREADS;
+	}
+
+	pool = calloc (1, sizeof *pool);
+	if (NULL == pool) {
+		return NULL;
+	}
+	if (pthread_mutex_init (&pool->lock, NULL) != 0) {
+		free (pool);
+		return NULL;
+	}
+	if (pthread_cond_init (&pool->queued_cond, NULL) != 0) {
+		(void) pthread_mutex_destroy (&pool->lock);
+		free (pool);
+		return NULL;
+	}
+	if (pthread_cond_init (&pool->taken_cond, NULL) != 0) {
+		(void) pthread_cond_destroy (&pool->queued_cond);
+		(void) pthread_mutex_destroy (&pool->lock);
+		free (pool);
+		return NULL;
+	}
+	pool->max_queued = (0 == max_queued) ? 1 : max_queued;
+
+	for (pool->nthreads = 0; pool->nthreads < nthreads; pool->nthreads++) {
+		if (pthread_create (&pool->threads[pool->nthreads], NULL,
+		                    work_pool_thread, pool) != 0) {
+			/* Use the threads which could be created */
+			break;
+		}
+	}
+	if (0 == pool->nthreads) {
+		(void) work_pool_stop (pool);
+		return NULL;
+	}
+
+	return pool;
+#else				/* !HAVE_PTHREAD */
+	(void) nthreads;
+	(void) max_queued;
+	return NULL;
+#endif				/* !HAVE_PTHREAD */
+}
+
+/*
+ * work_pool_queue - queue a job
+ *
+ *	fn will be called with pool and arg by one of the threads.
+ *
+ *	If the queue is full, work_pool_queue() waits for a job to be taken
+ *	if wait is true, and returns false otherwise.
+ *
+ *	It returns false if the job was not queued. The job should then be
+ *	run by the caller.
+ */
+bool work_pool_queue (/*@null@*/struct work_pool *pool,
+                      work_fn fn, void *arg, bool wait)
+{
+#ifdef HAVE_PTHREAD
+	struct work_job *job;
+
+	if (NULL == pool) {
+		return false;
+	}
+
+	(void) pthread_mutex_lock (&pool->lock);
+	while (pool->queued >= pool->max_queued) {
+		if (!wait) {
+			(void) pthread_mutex_unlock (&pool->lock);
+			return false;
+		}
+		(void) pthread_cond_wait (&pool->taken_cond, &pool->lock);
+	}
+	(void) pthread_mutex_unlock (&pool->lock);
+
+	job = malloc (sizeof *job);
+	if (NULL == job) {
+		return false;
+	}
+	job->fn = fn;
+	job->arg = arg;
+	job->next = NULL;
+
+	(void) pthread_mutex_lock (&pool->lock);
+	if (NULL == pool->tail) {
+		pool->head = job;
+	} else {
+		pool->tail->next = job;
+	}
+	pool->tail = job;
+	pool->queued++;
+	(void) pthread_cond_signal (&pool->queued_cond);
+	(void) pthread_mutex_unlock (&pool->lock);
+
+	return true;
+#else				/* !HAVE_PTHREAD */
+	(void) pool;
+	(void) fn;
+	(void) arg;
+	(void) wait;
+	return false;
+#endif				/* !HAVE_PTHREAD */
+}
+
+/*
+ * work_pool_fail - report that a job failed
+ */
+void work_pool_fail (struct work_pool *pool)
+{
+#ifdef HAVE_PTHREAD
+	(void) pthread_mutex_lock (&pool->lock);
+	pool->failed = true;
+	(void) pthread_mutex_unlock (&pool->lock);
+#else				/* !HAVE_PTHREAD */
+	(void) pool;
+#endif				/* !HAVE_PTHREAD */
+}
+
+/*
+ * work_pool_failed - check if a job failed
+ *
+ *	The jobs can use it to stop early after an error.
+ */
+bool work_pool_failed (struct work_pool *pool)
+{
+#ifdef HAVE_PTHREAD
+	bool failed;
+
+	(void) pthread_mutex_lock (&pool->lock);
+	failed = pool->failed;
+	(void) pthread_mutex_unlock (&pool->lock);
+
+	return failed;
+#else				/* !HAVE_PTHREAD */
+	(void) pool;
+	return false;
+#endif				/* !HAVE_PTHREAD */
+}
+
+/*
+ * work_pool_stop - wait for all the jobs and stop the threads
+ *
+ *	The pool is freed.
+ *
+ *	Return 0 if no jobs failed, -1 otherwise.
+ */
+int work_pool_stop (/*@null@*/ /*@only@*/struct work_pool *pool)
+{
+#ifdef HAVE_PTHREAD
+	size_t i;
+	bool failed;
+
+	if (NULL == pool) {
+		return 0;
+	}
+
+	(void) pthread_mutex_lock (&pool->lock);
+	pool->stop = true;
+	(void) pthread_cond_broadcast (&pool->queued_cond);
+	(void) pthread_mutex_unlock (&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++) {
+		(void) pthread_join (pool->threads[i], NULL);
+	}
+
+	failed = pool->failed;
+	(void) pthread_cond_destroy (&pool->taken_cond);
+	(void) pthread_cond_destroy (&pool->queued_cond);
+	(void) pthread_mutex_destroy (&pool->lock);
+	free (pool);
+
+	return failed ? -1 : 0;
+#else				/* !HAVE_PTHREAD */
+	(void) pool;
+	return 0;
+#endif				/* !HAVE_PTHREAD */
+}
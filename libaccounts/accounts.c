@@ -0,0 +1,844 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "chkname.h"
+#include "commonio.h"
+#include "getdef.h"
+#include "groupio.h"
+#include "pwio.h"
+#include "sgroupio.h"
+#include "shadowio.h"
+#ifdef ENABLE_SUBIDS
+#include "subordinateio.h"
+#endif
+#include "accounts.h"
+
+/*
+ * The library and the tools share lib/ and libmisc/, which report the
+ * errors with the name of the program.
+ */
+const char *Prog = "libshadow_accounts";
+
+/*
+ * Databases of the session, in the order of SHADOW_ACCT_*.
+ */
+struct session_db {
+	unsigned int flag;
+	struct commonio_db *(*get_db) (void);
+	int (*open) (int mode);
+	int (*unlock) (void);
+};
+
+static const struct session_db session_dbs[] = {
+	{ SHADOW_ACCT_PASSWD,  __pw_get_db,  pw_open,  pw_unlock },
+	{ SHADOW_ACCT_SHADOW,  __spw_get_db, spw_open, spw_unlock },
+	{ SHADOW_ACCT_GROUP,   __gr_get_db,  gr_open,  gr_unlock },
+#ifdef SHADOWGRP
+	{ SHADOW_ACCT_GSHADOW, __sgr_get_db, sgr_open, sgr_unlock },
+#endif
+#ifdef ENABLE_SUBIDS
+	{ SHADOW_ACCT_SUBUID,  __sub_uid_get_db, sub_uid_open, sub_uid_unlock },
+	{ SHADOW_ACCT_SUBGID,  __sub_gid_get_db, sub_gid_open, sub_gid_unlock },
+#endif
+};
+
+#define SESSION_DBS	(sizeof session_dbs / sizeof session_dbs[0])
+
+static bool session_open = false;
+/* Set when a commit failed: the databases are closed */
+static bool session_broken = false;
+static unsigned int session_flags = 0;
+
+static bool has_db (unsigned int flag)
+{
+	return (session_flags & flag) != 0;
+}
+
+/*
+ * check_session - Check that the databases of a call are open.
+ */
+static int check_session (unsigned int flags)
+{
+	if (!session_open || session_broken) {
+		errno = session_broken ? EIO : EINVAL;
+		return -1;
+	}
+	if ((session_flags & flags) != flags) {
+		errno = EBADF;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * shadow_acct_open - Lock and read the databases dbs (SHADOW_ACCT_*).
+ *
+ *	prefix is the root of the databases and of login.defs, or NULL
+ *	for the running system. The shadow and gshadow files are skipped
+ *	if they do not exist, and the subordinate IDs if they are not
+ *	supported.
+ */
+int shadow_acct_open (/*@null@*/const char *prefix, unsigned int dbs)
+{
+	struct commonio_db *locks[SESSION_DBS];
+	size_t i, n = 0, failed;
+
+	if (session_open) {
+		errno = EBUSY;
+		return -1;
+	}
+	if ((0 == dbs) || ((dbs & ~SHADOW_ACCT_ALL) != 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((NULL != prefix) && ('\0' != prefix[0])) {
+		char *argv[] = { (char *) "--prefix", (char *) prefix };
+
+		(void) process_prefix_flag ("-P", 2, argv);
+	}
+	if (!spw_file_present ()) {
+		dbs &= ~SHADOW_ACCT_SHADOW;
+	}
+#ifdef SHADOWGRP
+	if (!sgr_file_present ()) {
+		dbs &= ~SHADOW_ACCT_GSHADOW;
+	}
+#endif
+
+	session_flags = 0;
+	for (i = 0; i < SESSION_DBS; i++) {
+		if ((dbs & session_dbs[i].flag) != 0) {
+			locks[n] = session_dbs[i].get_db ();
+			n++;
+			session_flags |= session_dbs[i].flag;
+		}
+	}
+	if (commonio_lock_set (locks, n, &failed) == 0) {
+		errno = EBUSY;
+		return -1;
+	}
+	session_open = true;
+	session_broken = false;
+	for (i = 0; i < SESSION_DBS; i++) {
+		if (   has_db (session_dbs[i].flag)
+		    && (session_dbs[i].open (O_CREAT | O_RDWR) == 0)) {
+			int err = (0 != errno) ? errno : EIO;
+
+			(void) shadow_acct_close ();
+			errno = err;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * shadow_acct_commit - Write the changes made since the last commit.
+ *
+ *	The databases are written together: if one of them cannot be
+ *	written, none is changed. The session then stays open for the
+ *	next changes. After a failure, it can only be closed.
+ */
+int shadow_acct_commit (void)
+{
+	struct commonio_txn txn;
+	size_t i;
+
+	if (check_session (0) != 0) {
+		return -1;
+	}
+	commonio_txn_init (&txn);
+	for (i = 0; i < SESSION_DBS; i++) {
+		if (   has_db (session_dbs[i].flag)
+		    && (commonio_txn_add (&txn, session_dbs[i].get_db ()) == 0)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	if (commonio_txn_checkpoint (&txn) == 0) {
+		int err = (0 != errno) ? errno : EIO;
+
+		SYSLOG ((LOG_ERR, "failure while writing changes to %s",
+		         (NULL != txn.failed) ? txn.failed->filename : "?"));
+		session_broken = true;
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * shadow_acct_close - Unlock the databases.
+ *
+ *	The changes which were not committed are discarded.
+ */
+int shadow_acct_close (void)
+{
+	int ret = 0;
+	size_t i;
+
+	if (!session_open) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = SESSION_DBS; i > 0; i--) {
+		if (   has_db (session_dbs[i - 1].flag)
+		    && (session_dbs[i - 1].unlock () == 0)) {
+			ret = -1;
+		}
+	}
+	session_open = false;
+	session_broken = false;
+	session_flags = 0;
+	if (0 != ret) {
+		errno = EIO;
+	}
+	return ret;
+}
+
+/*@null@*/const struct passwd *shadow_acct_getpwnam (const char *name)
+{
+	if (check_session (SHADOW_ACCT_PASSWD) != 0) {
+		return NULL;
+	}
+	return pw_locate (name);
+}
+
+/*@null@*/const struct passwd *shadow_acct_getpwuid (uid_t uid)
+{
+	if (check_session (SHADOW_ACCT_PASSWD) != 0) {
+		return NULL;
+	}
+	return pw_locate_uid (uid);
+}
+
+/*@null@*/const struct spwd *shadow_acct_getspnam (const char *name)
+{
+	if (check_session (SHADOW_ACCT_SHADOW) != 0) {
+		return NULL;
+	}
+	return spw_locate (name);
+}
+
+/*@null@*/const struct group *shadow_acct_getgrnam (const char *name)
+{
+	if (check_session (SHADOW_ACCT_GROUP) != 0) {
+		return NULL;
+	}
+	return gr_locate (name);
+}
+
+/*@null@*/const struct group *shadow_acct_getgrgid (gid_t gid)
+{
+	if (check_session (SHADOW_ACCT_GROUP) != 0) {
+		return NULL;
+	}
+	return gr_locate_gid (gid);
+}
+
+/*
+ * shadow_acct_update_* - Add or replace an entry, as is.
+ *
+ *	No rule of the tools is applied, except the syntax of the files.
+ */
+int shadow_acct_update_passwd (const struct passwd *pw)
+{
+	if (check_session (SHADOW_ACCT_PASSWD) != 0) {
+		return -1;
+	}
+	if (pw_update (pw) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int shadow_acct_update_shadow (const struct spwd *sp)
+{
+	if (check_session (SHADOW_ACCT_SHADOW) != 0) {
+		return -1;
+	}
+	if (spw_update (sp) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int shadow_acct_update_group (const struct group *gr)
+{
+	if (check_session (SHADOW_ACCT_GROUP) != 0) {
+		return -1;
+	}
+	if (gr_update (gr) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * shadow_acct_alloc_uid, shadow_acct_alloc_gid - Find a free ID, as
+ * useradd and groupadd do.
+ *
+ *	The ID is only used once an entry is added with it.
+ */
+int shadow_acct_alloc_uid (bool system, /*@out@*/uid_t *uid)
+{
+	if (check_session (SHADOW_ACCT_PASSWD) != 0) {
+		return -1;
+	}
+	if (find_new_uid (system, uid, NULL) < 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return 0;
+}
+
+int shadow_acct_alloc_gid (bool system, /*@out@*/gid_t *gid)
+{
+	if (check_session (SHADOW_ACCT_GROUP) != 0) {
+		return -1;
+	}
+	if (find_new_gid (system, gid, NULL) < 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * shadow_acct_alloc_subids - Give owner a range of subordinate UIDs and
+ * a range of subordinate GIDs, as useradd does.
+ *
+ *	The ranges are paired (same start) when the configuration allows
+ *	it.
+ */
+int shadow_acct_alloc_subids (const char *owner)
+{
+#ifdef ENABLE_SUBIDS
+	unsigned long start, count;
+	uid_t uid_start;
+	gid_t gid_start;
+
+	if (check_session (SHADOW_ACCT_SUBUID | SHADOW_ACCT_SUBGID) != 0) {
+		return -1;
+	}
+	if ((reserve_sub_ids (1, &start, &count) == 0) && (0 != count)) {
+		uid_start = (uid_t) start;
+		gid_start = (gid_t) start;
+		if (   (sub_uid_add (owner, uid_start, count) == 0)
+		    || (sub_gid_add (owner, gid_start, count) == 0)) {
+			errno = EIO;
+			return -1;
+		}
+		return 0;
+	}
+	if (find_new_sub_uids (owner, &uid_start, &count) < 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (sub_uid_add (owner, uid_start, count) == 0) {
+		errno = EIO;
+		return -1;
+	}
+	if (find_new_sub_gids (owner, &gid_start, &count) < 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (sub_gid_add (owner, gid_start, count) == 0) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+#else				/* !ENABLE_SUBIDS */
+	(void) owner;
+	errno = ENOSYS;
+	return -1;
+#endif				/* !ENABLE_SUBIDS */
+}
+
+/*
+ * add_group - Add a group, and its gshadow entry if gshadow is open.
+ */
+static int add_group (const char *name, gid_t gid)
+{
+	struct group grent;
+	char *no_members[] = { NULL };
+
+	memzero (&grent, sizeof grent);
+	grent.gr_name = (char *) name;
+	grent.gr_passwd = (char *) (has_db (SHADOW_ACCT_GSHADOW) ?
+	                            SHADOW_PASSWD_STRING : "!");
+	grent.gr_gid = gid;
+	grent.gr_mem = no_members;
+	if (gr_update (&grent) == 0) {
+		errno = EIO;
+		return -1;
+	}
+#ifdef SHADOWGRP
+	if (has_db (SHADOW_ACCT_GSHADOW)) {
+		struct sgrp sgent;
+
+		memzero (&sgent, sizeof sgent);
+		sgent.sg_name = (char *) name;
+		sgent.sg_passwd = (char *) "!";
+		sgent.sg_adm = no_members;
+		sgent.sg_mem = no_members;
+		if (sgr_update (&sgent) == 0) {
+			errno = EIO;
+			return -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+/*
+ * shadow_acct_groupadd - Add a group, as groupadd does.
+ *
+ *	If gid is (gid_t) -1, a GID is allocated. *new_gid, if not NULL,
+ *	is set to the GID of the group.
+ */
+int shadow_acct_groupadd (const char *name, gid_t gid, bool system,
+                          /*@out@*/ /*@null@*/gid_t *new_gid)
+{
+	if (check_session (SHADOW_ACCT_GROUP) != 0) {
+		return -1;
+	}
+	if (!is_valid_group_name (name)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (NULL != gr_locate (name)) {
+		errno = EEXIST;
+		return -1;
+	}
+	if ((gid_t) -1 == gid) {
+		if (find_new_gid (system, &gid, NULL) < 0) {
+			errno = ENOSPC;
+			return -1;
+		}
+	} else if (   !getdef_bool ("ALLOW_DUPLICATE_GIDS")
+	           && (NULL != gr_locate_gid (gid))) {
+		errno = EEXIST;
+		return -1;
+	}
+	if (add_group (name, gid) != 0) {
+		return -1;
+	}
+	if (NULL != new_gid) {
+		*new_gid = gid;
+	}
+	return 0;
+}
+
+/*
+ * set_member - Add user to or remove user from the members of group.
+ */
+static int set_member (const char *group, const char *user, bool add)
+{
+	const struct group *gr;
+	struct group *ngr;
+
+	if (check_session (SHADOW_ACCT_GROUP) != 0) {
+		return -1;
+	}
+	gr = gr_locate (group);
+	if (NULL == gr) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (is_on_list (gr->gr_mem, user) != add) {
+		ngr = __gr_dup (gr);
+		if (NULL == ngr) {
+			errno = ENOMEM;
+			return -1;
+		}
+		ngr->gr_mem = add ? add_list (ngr->gr_mem, user)
+		                  : del_list (ngr->gr_mem, user);
+		if (gr_update (ngr) == 0) {
+			gr_free (ngr);
+			errno = EIO;
+			return -1;
+		}
+		gr_free (ngr);
+	}
+#ifdef SHADOWGRP
+	if (has_db (SHADOW_ACCT_GSHADOW)) {
+		const struct sgrp *sg = sgr_locate (group);
+		struct sgrp *nsg;
+
+		if ((NULL == sg) || (is_on_list (sg->sg_mem, user) == add)) {
+			return 0;
+		}
+		nsg = __sgr_dup (sg);
+		if (NULL == nsg) {
+			errno = ENOMEM;
+			return -1;
+		}
+		nsg->sg_mem = add ? add_list (nsg->sg_mem, user)
+		                  : del_list (nsg->sg_mem, user);
+		if (sgr_update (nsg) == 0) {
+			sgr_free (nsg);
+			errno = EIO;
+			return -1;
+		}
+		sgr_free (nsg);
+	}
+#endif
+	return 0;
+}
+
+/*
+ * shadow_acct_add_member, shadow_acct_del_member - Change the members of
+ * a group, as gpasswd -a and gpasswd -d do.
+ */
+int shadow_acct_add_member (const char *group, const char *user)
+{
+	if (   (check_session (SHADOW_ACCT_PASSWD) == 0)
+	    && (NULL == pw_locate (user))) {
+		errno = ENOENT;
+		return -1;
+	}
+	return set_member (group, user, true);
+}
+
+int shadow_acct_del_member (const char *group, const char *user)
+{
+	return set_member (group, user, false);
+}
+
+/*
+ * primary_group - Check if gid is the primary group of a user.
+ */
+static bool primary_group (gid_t gid)
+{
+	const struct passwd **pwds;
+	size_t count;
+
+	if (pw_locate_gid (gid, &pwds, &count) == 0) {
+		/* Better keep the group */
+		return true;
+	}
+	free (pwds);
+	return (0 != count);
+}
+
+/*
+ * shadow_acct_groupdel - Remove a group, as groupdel does.
+ *
+ *	A group which is the primary group of a user is not removed.
+ */
+int shadow_acct_groupdel (const char *name)
+{
+	const struct group *gr;
+
+	if (check_session (SHADOW_ACCT_GROUP | SHADOW_ACCT_PASSWD) != 0) {
+		return -1;
+	}
+	gr = gr_locate (name);
+	if (NULL == gr) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (primary_group (gr->gr_gid)) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (gr_remove (name) == 0) {
+		errno = EIO;
+		return -1;
+	}
+#ifdef SHADOWGRP
+	if (   has_db (SHADOW_ACCT_GSHADOW)
+	    && (NULL != sgr_locate (name))
+	    && (sgr_remove (name) == 0)) {
+		errno = EIO;
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+static long scale_age (long x)
+{
+	if (x <= 0) {
+		return x;
+	}
+
+	return x * (DAY / SCALE);
+}
+
+/*
+ * shadow_acct_useradd - Add a user, as useradd does.
+ *
+ *	*uid, if not NULL, is set to the UID of the user.
+ */
+int shadow_acct_useradd (const struct shadow_acct_user *user,
+                         /*@out@*/ /*@null@*/uid_t *uid)
+{
+	struct passwd pwent;
+	char home[PATH_MAX];
+	uid_t user_id;
+	gid_t user_gid;
+	bool user_group = false;
+
+	if (check_session (SHADOW_ACCT_PASSWD | SHADOW_ACCT_GROUP) != 0) {
+		return -1;
+	}
+	if (   (user->size < sizeof *user)
+	    || !is_valid_user_name (user->name)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (NULL != pw_locate (user->name)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	user_id = user->uid;
+	user_gid = user->gid;
+	if ((gid_t) -1 == user_gid) {
+		const struct group *gr = gr_locate (user->name);
+
+		if (NULL != gr) {
+			user_gid = gr->gr_gid;
+		} else {
+			user_group = true;
+		}
+	} else if (NULL == gr_locate_gid (user_gid)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if ((uid_t) -1 == user_id) {
+		if (find_new_uid (user->system, &user_id, NULL) < 0) {
+			errno = ENOSPC;
+			return -1;
+		}
+	} else if (   !getdef_bool ("ALLOW_DUPLICATE_UIDS")
+	           && (NULL != pw_locate_uid (user_id))) {
+		errno = EEXIST;
+		return -1;
+	}
+	if (user_group) {
+		/* The UID and the GID are the same, if possible */
+		if (find_new_gid (user->system, &user_gid,
+		                  (gid_t const *) &user_id) < 0) {
+			errno = ENOSPC;
+			return -1;
+		}
+		if (add_group (user->name, user_gid) != 0) {
+			return -1;
+		}
+	}
+
+	if (NULL == user->home) {
+		(void) snprintf (home, sizeof home, "/home/%s", user->name);
+	}
+	memzero (&pwent, sizeof pwent);
+	pwent.pw_name = (char *) user->name;
+	pwent.pw_passwd = (char *) (has_db (SHADOW_ACCT_SHADOW) ?
+	                            SHADOW_PASSWD_STRING :
+	                            ((NULL != user->password) ?
+	                             user->password : "!"));
+	pwent.pw_uid = user_id;
+	pwent.pw_gid = user_gid;
+	pwent.pw_gecos = (char *) ((NULL != user->gecos) ? user->gecos : "");
+	pwent.pw_dir = (NULL != user->home) ? (char *) user->home : home;
+	pwent.pw_shell = (char *) ((NULL != user->shell) ? user->shell : "");
+	if (pw_update (&pwent) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (has_db (SHADOW_ACCT_SHADOW)) {
+		struct spwd spent;
+
+		memzero (&spent, sizeof spent);
+		spent.sp_namp = (char *) user->name;
+		spent.sp_pwdp = (char *) ((NULL != user->password) ?
+		                          user->password : "!");
+		spent.sp_lstchg = (long) gettime () / SCALE;
+		if (0 == spent.sp_lstchg) {
+			/* Better disable aging than requiring a password change */
+			spent.sp_lstchg = -1;
+		}
+		spent.sp_min = scale_age (getdef_num ("PASS_MIN_DAYS", -1));
+		spent.sp_max = scale_age (getdef_num ("PASS_MAX_DAYS", -1));
+		spent.sp_warn = scale_age (getdef_num ("PASS_WARN_AGE", -1));
+		spent.sp_inact = -1;
+		spent.sp_expire = -1;
+		spent.sp_flag = SHADOW_SP_FLAG_UNSET;
+		if (spw_update (&spent) == 0) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if (   user->subids && !user->system
+	    && has_db (SHADOW_ACCT_SUBUID) && has_db (SHADOW_ACCT_SUBGID)
+	    && (shadow_acct_alloc_subids (user->name) != 0)) {
+		return -1;
+	}
+
+	if (NULL != uid) {
+		*uid = user_id;
+	}
+	return 0;
+}
+
+#ifdef SHADOWGRP
+/*
+ * del_gshadow_user - Remove name from the administrators and the
+ *                    members of the gshadow groups.
+ */
+static int del_gshadow_user (const char *name)
+{
+	const struct sgrp **sgroups;
+	char **names;
+	size_t count, i;
+	int ret = 0;
+
+	if (sgr_locate_member (name, &sgroups, &count) == 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	/* The list of groups is not valid after an update */
+	names = (char **) calloc (count + 1, sizeof (char *));
+	if (NULL == names) {
+		free (sgroups);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		names[i] = strdup (sgroups[i]->sg_name);
+		if (NULL == names[i]) {
+			ret = -1;
+			errno = ENOMEM;
+			break;
+		}
+	}
+	free (sgroups);
+
+	for (i = 0; (0 == ret) && (NULL != names[i]); i++) {
+		const struct sgrp *sg = sgr_locate (names[i]);
+		struct sgrp *nsg;
+
+		if (NULL == sg) {
+			continue;
+		}
+		nsg = __sgr_dup (sg);
+		if (NULL == nsg) {
+			ret = -1;
+			errno = ENOMEM;
+			break;
+		}
+		nsg->sg_adm = del_list (nsg->sg_adm, name);
+		nsg->sg_mem = del_list (nsg->sg_mem, name);
+		if (sgr_update (nsg) == 0) {
+			ret = -1;
+			errno = EIO;
+		}
+		sgr_free (nsg);
+	}
+	for (i = 0; i < count; i++) {
+		free (names[i]);
+	}
+	free (names);
+	return ret;
+}
+#endif				/* SHADOWGRP */
+
+/*
+ * shadow_acct_userdel - Remove a user, as userdel does (without its
+ * files).
+ *
+ *	The user is removed from the members of the groups, and its group
+ *	is removed if it has the name of the user, and is neither the
+ *	primary group of another user nor has members.
+ */
+int shadow_acct_userdel (const char *name)
+{
+	const struct passwd *pw;
+	const struct group *gr;
+	const struct group **groups;
+	size_t count, i;
+	gid_t user_gid;
+
+	if (check_session (SHADOW_ACCT_PASSWD | SHADOW_ACCT_GROUP) != 0) {
+		return -1;
+	}
+	pw = pw_locate (name);
+	if (NULL == pw) {
+		errno = ENOENT;
+		return -1;
+	}
+	user_gid = pw->pw_gid;
+	if (pw_remove (name) == 0) {
+		errno = EIO;
+		return -1;
+	}
+	if (   has_db (SHADOW_ACCT_SHADOW)
+	    && (NULL != spw_locate (name))
+	    && (spw_remove (name) == 0)) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (gr_locate_member (name, &groups, &count) == 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		/* groups[i] is freed by its update */
+		char *group = strdup (groups[i]->gr_name);
+
+		if (   (NULL == group)
+		    || (set_member (group, name, false) != 0)) {
+			free (group);
+			free (groups);
+			return -1;
+		}
+		free (group);
+	}
+	free (groups);
+#ifdef SHADOWGRP
+	if (has_db (SHADOW_ACCT_GSHADOW) && (del_gshadow_user (name) != 0)) {
+		return -1;
+	}
+#endif
+
+	gr = gr_locate (name);
+	if (   (NULL != gr) && (gr->gr_gid == user_gid)
+	    && (NULL == gr->gr_mem[0])
+	    && !primary_group (user_gid)
+	    && (shadow_acct_groupdel (name) != 0)) {
+		return -1;
+	}
+
+#ifdef ENABLE_SUBIDS
+	if (   has_db (SHADOW_ACCT_SUBUID)
+	    && (sub_uid_remove (name, 0, ULONG_MAX) == 0)) {
+		errno = EIO;
+		return -1;
+	}
+	if (   has_db (SHADOW_ACCT_SUBGID)
+	    && (sub_gid_remove (name, 0, ULONG_MAX) == 0)) {
+		errno = EIO;
+		return -1;
+	}
+#endif
+	return 0;
+}
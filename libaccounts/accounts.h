@@ -0,0 +1,104 @@
+#ifndef _SHADOW_ACCOUNTS_H_
+#define _SHADOW_ACCOUNTS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <grp.h>
+#include <pwd.h>
+#include <shadow.h>
+
+/*
+ * libshadow_accounts - Account databases of the shadow tools, as a
+ * library
+ *
+ * A long-lived program (e.g. a provisioning agent) opens the databases
+ * once, makes any number of changes with the rules of useradd, userdel,
+ * groupadd and gpasswd, and commits them when it wants: the files are
+ * locked, read and configured (login.defs) only once, instead of once
+ * per forked tool.
+ *
+ *	if (shadow_acct_open (NULL, SHADOW_ACCT_ALL) != 0) ...
+ *	for (...) {
+ *		if (shadow_acct_useradd (&user, &uid) != 0) ...
+ *	}
+ *	if (shadow_acct_commit () != 0) ...
+ *	shadow_acct_close ();
+ *
+ * A process has a single session: the functions are not thread safe.
+ * The databases stay locked from shadow_acct_open() to
+ * shadow_acct_close(), so the session should not be kept open longer
+ * than needed: the tools wait for the locks meanwhile.
+ *
+ * The functions return 0 on success and -1 on failure, with errno set.
+ * The entries returned by the lookups are owned by the library, and
+ * valid until the entry is changed or the session is closed.
+ *
+ * The structures of this header only get new fields at their end;
+ * callers set their size field to the size of the structure they were
+ * built with.
+ */
+
+/* Databases of a session (shadow_acct_open) */
+#define SHADOW_ACCT_PASSWD	0x01
+#define SHADOW_ACCT_SHADOW	0x02
+#define SHADOW_ACCT_GROUP	0x04
+#define SHADOW_ACCT_GSHADOW	0x08
+#define SHADOW_ACCT_SUBUID	0x10
+#define SHADOW_ACCT_SUBGID	0x20
+#define SHADOW_ACCT_ALL		0x3f
+
+/*
+ * A new user (shadow_acct_useradd)
+ */
+struct shadow_acct_user {
+	size_t size;		/* sizeof (struct shadow_acct_user) */
+	const char *name;
+	/* Encrypted password, or NULL for a locked password */
+	const char *password;
+	/* (uid_t) -1 to allocate a UID */
+	uid_t uid;
+	/*
+	 * Primary group, or (gid_t) -1 for a group with the name of the
+	 * user, created if needed (as with USERGROUPS_ENAB).
+	 */
+	gid_t gid;
+	const char *gecos;
+	/* NULL for /home/<name> (the home directory is not created) */
+	const char *home;
+	/* NULL for an empty shell (/bin/sh) */
+	const char *shell;
+	/* Allocate the IDs in the SYS_ ranges */
+	bool system;
+	/* Allocate subordinate UIDs and GIDs (if not system) */
+	bool subids;
+};
+
+extern int shadow_acct_open (/*@null@*/const char *prefix, unsigned int dbs);
+extern int shadow_acct_commit (void);
+extern int shadow_acct_close (void);
+
+extern /*@null@*/const struct passwd *shadow_acct_getpwnam (const char *name);
+extern /*@null@*/const struct passwd *shadow_acct_getpwuid (uid_t uid);
+extern /*@null@*/const struct spwd *shadow_acct_getspnam (const char *name);
+extern /*@null@*/const struct group *shadow_acct_getgrnam (const char *name);
+extern /*@null@*/const struct group *shadow_acct_getgrgid (gid_t gid);
+
+extern int shadow_acct_update_passwd (const struct passwd *pw);
+extern int shadow_acct_update_shadow (const struct spwd *sp);
+extern int shadow_acct_update_group (const struct group *gr);
+
+extern int shadow_acct_alloc_uid (bool system, /*@out@*/uid_t *uid);
+extern int shadow_acct_alloc_gid (bool system, /*@out@*/gid_t *gid);
+extern int shadow_acct_alloc_subids (const char *owner);
+
+extern int shadow_acct_useradd (const struct shadow_acct_user *user,
+                                /*@out@*/ /*@null@*/uid_t *uid);
+extern int shadow_acct_userdel (const char *name);
+extern int shadow_acct_groupadd (const char *name, gid_t gid, bool system,
+                                 /*@out@*/ /*@null@*/gid_t *new_gid);
+extern int shadow_acct_groupdel (const char *name);
+extern int shadow_acct_add_member (const char *group, const char *user);
+extern int shadow_acct_del_member (const char *group, const char *user);
+
+#endif
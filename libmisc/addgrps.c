@@ -44,19 +44,34 @@
 #ident "$Id$"
 
 #define SEP ",:"
+
+static int gid_cmp (const void *p1, const void *p2)
+{
+	GETGROUPS_T g1 = *(const GETGROUPS_T *) p1;
+	GETGROUPS_T g2 = *(const GETGROUPS_T *) p2;
+
+	return (g1 > g2) - (g1 < g2);
+}
+
 /*
  * Add groups with names from LIST (separated by commas or colons)
  * to the supplementary group set.  Silently ignore groups which are
  * already there.  Warning: uses strtok().
+ *
+ * The names are resolved through the credential cache, without copying
+ * the groups, and the new groups are added with a single setgroups()
+ * call.
  */
 int add_groups (const char *list)
 {
 	GETGROUPS_T *grouplist, *tmp;
-	size_t i;
+	GETGROUPS_T *known;
+	size_t i, nknown, nadded;
 	int ngroups;
-	bool added;
+	long ngroups_max;
 	char *token;
 	char buf[1024];
+	int ret;
 
 	if (strlen (list) >= sizeof (buf)) {
 		errno = EINVAL;
@@ -87,43 +102,83 @@ int add_groups (const char *list)
 		return -1;
 	}
 
-	added = false;
+	/*
+	 * Sorted set of the groups of grouplist, to ignore the groups
+	 * which are already there or listed several times.
+	 */
+	known = (GETGROUPS_T *) malloc (((size_t)ngroups + 1) * sizeof (GETGROUPS_T));
+	if (NULL == known) {
+		free (grouplist);
+		return -1;
+	}
+	memcpy (known, grouplist, (size_t)ngroups * sizeof (GETGROUPS_T));
+	nknown = (size_t)ngroups;
+	qsort (known, nknown, sizeof (GETGROUPS_T), gid_cmp);
+
+	nadded = 0;
 	for (token = strtok (buf, SEP); NULL != token; token = strtok (NULL, SEP)) {
-		struct group *grp;
+		gid_t gid;
+		size_t lo, hi;
 
-		grp = getgrnam (token); /* local, no need for xgetgrnam */
-		if (NULL == grp) {
+		if (!cred_getgrnam_gid (token, &gid)) {
 			fprintf (stderr, _("Warning: unknown group %s\n"),
 				 token);
 			continue;
 		}
 
-		for (i = 0; i < (size_t)ngroups && grouplist[i] != grp->gr_gid; i++);
-
-		if (i < (size_t)ngroups) {
+		/* Position of gid in the sorted set */
+		lo = 0;
+		hi = nknown;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (known[mid] < gid) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if ((lo < nknown) && (known[lo] == gid)) {
 			continue;
 		}
 
-		if (ngroups >= sysconf (_SC_NGROUPS_MAX)) {
-			fputs (_("Warning: too many groups\n"), stderr);
-			break;
-		}
-		tmp = (gid_t *) realloc (grouplist, (size_t)(ngroups + 1) * sizeof (GETGROUPS_T));
+		tmp = (gid_t *) realloc (grouplist, (nknown + 1) * sizeof (GETGROUPS_T));
 		if (NULL == tmp) {
-			free (grouplist);
-			return -1;
+			goto fail;
 		}
-		tmp[ngroups] = grp->gr_gid;
-		ngroups++;
 		grouplist = tmp;
-		added = true;
+		tmp = (gid_t *) realloc (known, (nknown + 1) * sizeof (GETGROUPS_T));
+		if (NULL == tmp) {
+			goto fail;
+		}
+		known = tmp;
+		memmove (&known[lo + 1], &known[lo],
+		         (nknown - lo) * sizeof (GETGROUPS_T));
+		known[lo] = gid;
+		grouplist[nknown] = gid;
+		nknown++;
+		nadded++;
 	}
+	free (known);
 
-	if (added) {
-		return setgroups ((size_t)ngroups, grouplist);
+	ngroups_max = sysconf (_SC_NGROUPS_MAX);
+	if ((ngroups_max >= 0) && ((size_t)ngroups + nadded > (size_t)ngroups_max)) {
+		fputs (_("Warning: too many groups\n"), stderr);
+		nadded = ((size_t)ngroups < (size_t)ngroups_max) ? (size_t)ngroups_max - (size_t)ngroups : 0;
 	}
 
-	return 0;
+	ret = 0;
+	if (nadded > 0) {
+		ret = setgroups ((size_t)ngroups + nadded, grouplist);
+	}
+	free (grouplist);
+
+	return ret;
+
+      fail:
+	free (grouplist);
+	free (known);
+	return -1;
 }
 #else				/* HAVE_SETGROUPS && !USE_PAM */
 extern int errno;		/* warning: ANSI C forbids an empty source file */
@@ -44,9 +44,28 @@
 #include <libaudit.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include "prototypes.h"
 int audit_fd;
 
+/*
+ * Records kept while the changes are not committed, see
+ * audit_logger_begin().
+ */
+struct audit_record {
+	bool is_message;	/* audit_logger_message, else audit_logger */
+	int type;
+	/*@only@*/char *op;	/* or message */
+	/*@null@*/ /*@only@*/char *name;
+	unsigned int id;
+	shadow_audit_result result;
+};
+
+static bool audit_queuing = false;
+static /*@null@*/ /*@only@*/struct audit_record *audit_queue = NULL;
+static size_t audit_queued = 0;
+static size_t audit_queue_size = 0;
+
 void audit_help_open (void)
 {
 	audit_fd = audit_open ();
@@ -76,30 +95,168 @@ void audit_help_open (void)
  * id  -  uid or gid that the operation is being performed on. This is used
  *	  only when user is NULL.
  */
+static void audit_send (const struct audit_record *r)
+{
+	if (r->is_message) {
+		audit_log_user_message (audit_fd,
+		                        AUDIT_USYS_CONFIG,
+		                        r->op,
+		                        NULL, /* hostname */
+		                        NULL, /* addr */
+		                        NULL, /* tty */
+		                        (int) r->result);
+	} else {
+		audit_log_acct_message (audit_fd, r->type, NULL, r->op,
+		                        r->name, r->id,
+		                        NULL, NULL, NULL, (int) r->result);
+	}
+}
+
+/*
+ * audit_queue_add - keep a copy of a record until the changes are
+ *                   committed
+ */
+static void audit_queue_add (const struct audit_record *r)
+{
+	struct audit_record *q;
+
+	if (audit_queued == audit_queue_size) {
+		size_t size = (0 == audit_queue_size) ? 16 : audit_queue_size * 2;
+
+		q = (struct audit_record *) realloc (audit_queue,
+		                                     size * sizeof (*q));
+		if (NULL == q) {
+			/* Better send it now than lose it */
+			audit_send (r);
+			return;
+		}
+		audit_queue = q;
+		audit_queue_size = size;
+	}
+	q = &audit_queue[audit_queued];
+	*q = *r;
+	q->op = strdup (r->op);
+	q->name = (NULL != r->name) ? strdup (r->name) : NULL;
+	if ((NULL == q->op) || ((NULL != r->name) && (NULL == q->name))) {
+		free (q->op);
+		free (q->name);
+		audit_send (r);
+		return;
+	}
+	audit_queued++;
+}
+
+/*
+ * audit_queue_flush - send the queued records, or only the failures if
+ *                     the changes were not committed
+ */
+static void audit_queue_flush (bool committed)
+{
+	size_t i;
+
+	for (i = 0; i < audit_queued; i++) {
+		if (committed || (SHADOW_AUDIT_FAILURE == audit_queue[i].result)) {
+			audit_send (&audit_queue[i]);
+		}
+		free (audit_queue[i].op);
+		free (audit_queue[i].name);
+	}
+	free (audit_queue);
+	audit_queue = NULL;
+	audit_queued = 0;
+	audit_queue_size = 0;
+	audit_queuing = false;
+}
+
+static void audit_logger_exit (void)
+{
+	audit_logger_rollback ();
+}
+
+/*
+ * audit_logger_begin - keep the records until the changes are committed
+ *
+ *	The records of audit_logger and audit_logger_message are queued,
+ *	and sent by audit_logger_commit() once the changes are written.
+ *	If the program exits before, or calls audit_logger_rollback(),
+ *	only the failures are sent: the successful changes did not
+ *	happen.
+ */
+void audit_logger_begin (void)
+{
+	static bool registered = false;
+
+	if (audit_fd < 0) {
+		return;
+	}
+	if (!registered) {
+		(void) atexit (audit_logger_exit);
+		registered = true;
+	}
+	audit_queuing = true;
+}
+
+/*
+ * audit_logger_commit - send the queued records
+ */
+void audit_logger_commit (void)
+{
+	if (audit_queuing) {
+		audit_queue_flush (true);
+	}
+}
+
+/*
+ * audit_logger_rollback - only send the queued failures
+ */
+void audit_logger_rollback (void)
+{
+	if (audit_queuing) {
+		audit_queue_flush (false);
+	}
+}
+
 void audit_logger (int type, unused const char *pgname, const char *op,
                    const char *name, unsigned int id,
                    shadow_audit_result result)
 {
+	struct audit_record r;
+
 	if (audit_fd < 0) {
 		return;
+	}
+
+	r.is_message = false;
+	r.type = type;
+	r.op = (char *) op;
+	r.name = (char *) name;
+	r.id = id;
+	r.result = result;
+	if (audit_queuing) {
+		audit_queue_add (&r);
 	} else {
-		audit_log_acct_message (audit_fd, type, NULL, op, name, id,
-		                        NULL, NULL, NULL, (int) result);
+		audit_send (&r);
 	}
 }
 
 void audit_logger_message (const char *message, shadow_audit_result result)
 {
+	struct audit_record r;
+
 	if (audit_fd < 0) {
 		return;
+	}
+
+	r.is_message = true;
+	r.type = AUDIT_USYS_CONFIG;
+	r.op = (char *) message;
+	r.name = NULL;
+	r.id = 0;
+	r.result = result;
+	if (audit_queuing) {
+		audit_queue_add (&r);
 	} else {
-		audit_log_user_message (audit_fd,
-		                        AUDIT_USYS_CONFIG,
-		                        message,
-		                        NULL, /* hostname */
-		                        NULL, /* addr */
-		                        NULL, /* tty */
-		                        (int) result);
+		audit_send (&r);
 	}
 }
 
@@ -0,0 +1,165 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "getdef.h"
+
+/*
+ * List of blocked passwords (PASS_BLOCKLIST_FILE)
+ *
+ * The file is a header followed by the sorted 64-bit FNV-1a hashes of
+ * the blocked passwords, in the byte order of the host:
+ *
+ *	char     magic[8];	"SHADOWBL"
+ *	uint32_t version;	1
+ *	uint32_t pad;
+ *	uint64_t count;
+ *	uint64_t hashes[count];
+ *
+ * It is mapped on the first check and searched by bisection, so that
+ * lists of hundreds of millions of passwords are neither read nor
+ * copied, and stays mapped until pass_blocklist_close() or the end of
+ * the program (e.g. for all the lines of chpasswd).
+ */
+
+#define BLOCKLIST_MAGIC "SHADOWBL"
+#define BLOCKLIST_VERSION 1
+
+struct blocklist_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+	uint64_t count;
+};
+
+static const uint64_t *hashes = NULL;
+static uint64_t hash_count = 0;
+static void *map = NULL;
+static size_t map_size = 0;
+static bool opened = false;
+
+static uint64_t pass_hash (const char *pass)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; '\0' != *pass; pass++) {
+		h ^= (unsigned char) *pass;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/*
+ * blocklist_open - Map PASS_BLOCKLIST_FILE.
+ *
+ *	A missing or invalid file is reported once, and no password is
+ *	then blocked.
+ */
+static void blocklist_open (const char *path)
+{
+	const struct blocklist_header *h;
+	struct stat sb;
+	int fd;
+
+	opened = true;
+	fd = open (path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0) {
+		SYSLOG ((LOG_WARN, "cannot open %s: %s", path, strerror (errno)));
+		return;
+	}
+	if (   (fstat (fd, &sb) != 0)
+	    || ((unsigned long long) sb.st_size > SIZE_MAX)
+	    || ((size_t) sb.st_size < sizeof *h)) {
+		goto invalid;
+	}
+	map = mmap (NULL, (size_t) sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == map) {
+		map = NULL;
+		goto invalid;
+	}
+	map_size = (size_t) sb.st_size;
+	(void) close (fd);
+	fd = -1;
+
+	h = map;
+	if (   (memcmp (h->magic, BLOCKLIST_MAGIC, sizeof h->magic) != 0)
+	    || (BLOCKLIST_VERSION != h->version)
+	    || (h->count > (map_size - sizeof *h) / sizeof (uint64_t))) {
+		goto invalid;
+	}
+	hashes = (const uint64_t *) (h + 1);
+	hash_count = h->count;
+#ifdef MADV_RANDOM
+	(void) madvise (map, map_size, MADV_RANDOM);
+#endif
+	return;
+
+      invalid:
+	SYSLOG ((LOG_WARN, "invalid blocklist %s", path));
+	if (fd >= 0) {
+		(void) close (fd);
+	}
+	pass_blocklist_close ();
+	opened = true;
+}
+
+/*
+ * pass_blocklisted - Check if pass is in PASS_BLOCKLIST_FILE.
+ */
+bool pass_blocklisted (const char *pass)
+{
+	const char *path;
+	uint64_t h, lo, hi;
+
+	if (!opened) {
+		path = getdef_str ("PASS_BLOCKLIST_FILE");
+		if ((NULL == path) || ('\0' == path[0])) {
+			opened = true;
+			return false;
+		}
+		blocklist_open (path);
+	}
+	if (0 == hash_count) {
+		return false;
+	}
+
+	h = pass_hash (pass);
+	lo = 0;
+	hi = hash_count;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (hashes[mid] < h) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo < hash_count) && (hashes[lo] == h);
+}
+
+/*
+ * pass_blocklist_close - Unmap PASS_BLOCKLIST_FILE.
+ *
+ *	It is mapped again by the next check.
+ */
+void pass_blocklist_close (void)
+{
+	if (NULL != map) {
+		(void) munmap (map, map_size);
+	}
+	map = NULL;
+	map_size = 0;
+	hashes = NULL;
+	hash_count = 0;
+	opened = false;
+}
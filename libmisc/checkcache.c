@@ -0,0 +1,242 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* HAVE_PTHREAD */
+#include "prototypes.h"
+#include "defines.h"
+
+/*
+ * Results of the checks of pwck and grpck
+ *
+ * Many entries share the same home directory, shell, group, or member.
+ * The results are kept in a hash table indexed by name (or by ID), so
+ * that each one is only checked once.
+ *
+ * The checkers first add all the names and IDs of the file, and check
+ * them concurrently with check_cache_run(). The problems are then
+ * reported while walking the file, in its order.
+ */
+
+/*
+ * check_hash - hash of a name, or of an ID if name is NULL
+ */
+static size_t check_hash (/*@null@*/const char *name, id_t id)
+{
+	size_t h = 2166136261U;
+
+	if (NULL == name) {
+		return (size_t) id * 2654435761U;
+	}
+	for (; '\0' != *name; name++) {
+		h = (h ^ (unsigned char) *name) * 16777619U;
+	}
+	return h;
+}
+
+/*
+ * check_cache_get - get the result of the check of name, or of id if
+ *                   name is NULL
+ *
+ *	If the name or ID was not known yet, an unchecked result is added,
+ *	and *added is set.
+ */
+struct check_result *check_cache_get (struct check_cache *cache,
+                                      /*@null@*/const char *name,
+                                      id_t id,
+                                      /*@out@*/bool *added)
+{
+	struct check_result *r;
+	size_t h = check_hash (name, id);
+
+	*added = false;
+	if (NULL != cache->buckets) {
+		for (r = cache->buckets[h & (cache->size - 1)];
+		     NULL != r;
+		     r = r->next) {
+			if (   (NULL == name)
+			    ? ((NULL == r->name) && (r->id == id))
+			    : ((NULL != r->name) && (strcmp (r->name, name) == 0))) {
+				return r;
+			}
+		}
+	}
+
+	/* Keep the chains short */
+	if (cache->count >= cache->size) {
+		struct check_result **buckets;
+		size_t size = (0 == cache->size) ? 64 : cache->size * 2;
+		size_t i;
+
+		buckets = (struct check_result **)
+		          xmalloc (size * sizeof (struct check_result *));
+		memset (buckets, 0, size * sizeof (struct check_result *));
+		for (i = 0; i < cache->size; i++) {
+			while (NULL != cache->buckets[i]) {
+				struct check_result **b;
+
+				r = cache->buckets[i];
+				cache->buckets[i] = r->next;
+				b = &buckets[check_hash (r->name, r->id) & (size - 1)];
+				r->next = *b;
+				*b = r;
+			}
+		}
+		free (cache->buckets);
+		cache->buckets = buckets;
+		cache->size = size;
+	}
+
+	r = (struct check_result *) xmalloc (sizeof (*r));
+	r->name = (NULL != name) ? xstrdup (name) : NULL;
+	r->id = id;
+	r->checked = false;
+	r->exists = false;
+	r->next = cache->buckets[h & (cache->size - 1)];
+	cache->buckets[h & (cache->size - 1)] = r;
+	cache->count++;
+	*added = true;
+
+	return r;
+}
+
+#ifdef HAVE_PTHREAD
+struct check_batch {
+	pthread_mutex_t lock;
+	struct check_result **results;
+	size_t n;
+	size_t next;		/* next result to take */
+	check_fn check;
+};
+
+static bool check_batch_take (struct check_batch *batch, size_t *i)
+{
+	bool taken;
+
+	(void) pthread_mutex_lock (&batch->lock);
+	*i = batch->next;
+	taken = (*i < batch->n);
+	if (taken) {
+		batch->next++;
+	}
+	(void) pthread_mutex_unlock (&batch->lock);
+
+	return taken;
+}
+
+/*
+ * check_worker - check the results of the batch until there are none left
+ */
+static void check_worker (struct work_pool *pool, void *arg)
+{
+	struct check_batch *batch = arg;
+	size_t i;
+
+	(void) pool;
+	while (check_batch_take (batch, &i)) {
+		batch->check (batch->results[i]);
+		batch->results[i]->checked = true;
+	}
+}
+#endif				/* HAVE_PTHREAD */
+
+/*
+ * check_cache_run - check all the results which were not checked yet
+ *
+ *	check is called on each result, and must set its exists field.
+ *	If nthreads is greater than 1, it is called concurrently by
+ *	nthreads threads, and must be thread safe.
+ */
+void check_cache_run (struct check_cache *cache, check_fn check,
+                      int nthreads)
+{
+	struct check_result **results;
+	struct check_result *r;
+	size_t n = 0;
+	size_t i;
+#ifdef HAVE_PTHREAD
+	struct check_batch batch;
+	struct work_pool *pool;
+#endif				/* HAVE_PTHREAD */
+
+	if (0 == cache->count) {
+		return;
+	}
+
+	results = (struct check_result **)
+	          xmalloc (cache->count * sizeof (struct check_result *));
+	for (i = 0; i < cache->size; i++) {
+		for (r = cache->buckets[i]; NULL != r; r = r->next) {
+			if (!r->checked) {
+				results[n] = r;
+				n++;
+			}
+		}
+	}
+	i = 0;
+
+#ifdef HAVE_PTHREAD
+	if ((nthreads > 1) && (n > 1)) {
+		if ((size_t) nthreads > n) {
+			nthreads = (int) n;
+		}
+		pool = work_pool_start ((size_t) nthreads, (size_t) nthreads);
+		if (   (NULL != pool)
+		    && (pthread_mutex_init (&batch.lock, NULL) == 0)) {
+			int t;
+
+			batch.results = results;
+			batch.n = n;
+			batch.next = 0;
+			batch.check = check;
+			for (t = 0; t < nthreads; t++) {
+				if (!work_pool_queue (pool, check_worker,
+				                      &batch, true)) {
+					break;
+				}
+			}
+			(void) work_pool_stop (pool);
+			(void) pthread_mutex_destroy (&batch.lock);
+			/* The results not taken by a thread are checked below */
+			i = batch.next;
+		} else if (NULL != pool) {
+			(void) work_pool_stop (pool);
+		}
+	}
+#else				/* !HAVE_PTHREAD */
+	(void) nthreads;
+#endif				/* !HAVE_PTHREAD */
+
+	for (; i < n; i++) {
+		check (results[i]);
+		results[i]->checked = true;
+	}
+
+	free (results);
+}
+
+/*
+ * check_cache_free - free all the results of the cache
+ */
+void check_cache_free (struct check_cache *cache)
+{
+	struct check_result *r;
+	size_t i;
+
+	for (i = 0; i < cache->size; i++) {
+		while (NULL != cache->buckets[i]) {
+			r = cache->buckets[i];
+			cache->buckets[i] = r->next;
+			free (r->name);
+			free (r);
+		}
+	}
+	free (cache->buckets);
+	cache->buckets = NULL;
+	cache->size = 0;
+	cache->count = 0;
+}
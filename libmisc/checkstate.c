@@ -0,0 +1,229 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "prototypes.h"
+#include "defines.h"
+
+/*
+ * State of the incremental checks of pwck and grpck
+ *
+ * After a run without problems, the checker saves the hashes of the
+ * lines of its databases in a state file. On the next run, the lines
+ * found in the state file were already checked, and only the checks
+ * which depend on other databases are done again for them.
+ *
+ * The state file is a cache of the host: it uses the native byte order
+ * and is ignored when its magic does not match.
+ *
+ *	magic[8]
+ *	for each of the CHECK_STATE_DBS databases:
+ *		uint64_t count
+ *		uint64_t hashes[count]	(sorted)
+ */
+#define CHECK_STATE_MAGIC "shchk\0\0\1"
+
+/*
+ * line_hash - 64 bits FNV-1a hash of a line
+ */
+static uint64_t line_hash (const char *line)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; '\0' != *line; line++) {
+		h = (h ^ (unsigned char) *line) * 1099511628211ULL;
+	}
+	return h;
+}
+
+static int hash_cmp (const void *p1, const void *p2)
+{
+	uint64_t h1 = *(const uint64_t *) p1;
+	uint64_t h2 = *(const uint64_t *) p2;
+
+	return (h1 > h2) - (h1 < h2);
+}
+
+/*
+ * check_state_load - load the hashes of the lines checked by the last
+ *                    clean run
+ *
+ *	If the file does not exist or is invalid, no lines are known, and
+ *	everything is checked.
+ */
+void check_state_load (struct check_state *st, const char *file)
+{
+	char magic[8];
+	uint64_t count;
+	size_t db;
+	FILE *fp;
+
+	memzero (st, sizeof (*st));
+
+	fp = fopen (file, "r");
+	if (NULL == fp) {
+		return;
+	}
+	if (   (fread (magic, sizeof magic, 1, fp) != 1)
+	    || (memcmp (magic, CHECK_STATE_MAGIC, sizeof magic) != 0)) {
+		goto invalid;
+	}
+	for (db = 0; db < CHECK_STATE_DBS; db++) {
+		struct check_hashes *old = &st->old[db];
+
+		if (   (fread (&count, sizeof count, 1, fp) != 1)
+		    || (count > SIZE_MAX / sizeof (uint64_t))) {
+			goto invalid;
+		}
+		if (0 == count) {
+			continue;
+		}
+		old->hashes = malloc ((size_t) count * sizeof (uint64_t));
+		if (NULL == old->hashes) {
+			goto invalid;
+		}
+		old->count = (size_t) count;
+		if (fread (old->hashes, sizeof (uint64_t), old->count, fp)
+		    != old->count) {
+			goto invalid;
+		}
+	}
+	(void) fclose (fp);
+	return;
+
+      invalid:
+	(void) fclose (fp);
+	check_state_free (st);
+}
+
+/*
+ * check_state_known - check if line of the database db was checked by
+ *                     the last clean run
+ */
+bool check_state_known (const struct check_state *st, size_t db,
+                        const char *line)
+{
+	uint64_t h;
+
+	if (0 == st->old[db].count) {
+		return false;
+	}
+	h = line_hash (line);
+	return (NULL != bsearch (&h, st->old[db].hashes, st->old[db].count,
+	                         sizeof (uint64_t), hash_cmp));
+}
+
+/*
+ * check_state_add - add a line of the database db to the state saved by
+ *                   check_state_save()
+ */
+void check_state_add (struct check_state *st, size_t db, const char *line)
+{
+	struct check_hashes *new = &st->new[db];
+
+	if (new->count == new->size) {
+		new->size = (0 == new->size) ? 1024 : new->size * 2;
+		new->hashes = realloc (new->hashes,
+		                       new->size * sizeof (uint64_t));
+		if (NULL == new->hashes) {
+			(void) fprintf (stderr,
+			                _("%s: failed to allocate memory: %s\n"),
+			                Prog, strerror (errno));
+			exit (13);
+		}
+	}
+	new->hashes[new->count] = line_hash (line);
+	new->count++;
+}
+
+/*
+ * check_state_save - save the lines added with check_state_add()
+ *
+ *	The state is written to <file>+ and renamed.
+ *
+ *	It returns 0 on success, -1 otherwise.
+ */
+int check_state_save (struct check_state *st, const char *file)
+{
+	char tmp[1024];
+	uint64_t count;
+	size_t db;
+	FILE *fp;
+	int fd;
+
+	if (snprintf (tmp, sizeof tmp, "%s+", file) >= (int) sizeof tmp) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+	fp = fdopen (fd, "w");
+	if (NULL == fp) {
+		(void) close (fd);
+		goto fail;
+	}
+
+	if (fwrite (CHECK_STATE_MAGIC, 8, 1, fp) != 1) {
+		goto fail;
+	}
+	for (db = 0; db < CHECK_STATE_DBS; db++) {
+		struct check_hashes *new = &st->new[db];
+
+		if (new->count > 1) {
+			qsort (new->hashes, new->count, sizeof (uint64_t),
+			       hash_cmp);
+		}
+		count = (uint64_t) new->count;
+		if (   (fwrite (&count, sizeof count, 1, fp) != 1)
+		    || (fwrite (new->hashes, sizeof (uint64_t), new->count, fp)
+		        != new->count)) {
+			goto fail;
+		}
+	}
+	if (   (fflush (fp) != 0)
+	    || (fsync (fileno (fp)) != 0)) {
+		goto fail;
+	}
+	if (fclose (fp) != 0) {
+		fp = NULL;
+		goto fail;
+	}
+	fp = NULL;
+
+	if (rename (tmp, file) != 0) {
+		goto fail;
+	}
+	return 0;
+
+      fail:
+	if (NULL != fp) {
+		(void) fclose (fp);
+	}
+	(void) unlink (tmp);
+	return -1;
+}
+
+/*
+ * check_state_free - free the hashes of the state
+ */
+void check_state_free (struct check_state *st)
+{
+	size_t db;
+
+	for (db = 0; db < CHECK_STATE_DBS; db++) {
+		free (st->old[db].hashes);
+		free (st->new[db].hashes);
+	}
+	memzero (st, sizeof (*st));
+}
@@ -38,164 +38,347 @@
 #include <sys/stat.h>
 #include "prototypes.h"
 #include "defines.h"
+#include "getdef.h"
+#include "uidrecords.h"
+#include "probes.h"
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+
 /*
- * chown_tree - change ownership of files in a directory tree
+ * Directory whose ownership is changed.
  *
- *	chown_dir() walks a directory tree and changes the ownership
- *	of all files owned by the provided user ID.
+ * The entries are accessed relative to the descriptor of the directory,
+ * so that their path is not resolved again, and so that a directory
+ * cannot be replaced by a symbolic link during the walk.
  *
- *	Only files owned (resp. group-owned) by old_uid (resp. by old_gid)
- *	will have their ownership (resp. group-ownership) modified, unless
- *	old_uid (resp. old_gid) is set to -1.
- *
- *	new_uid and new_gid can be set to -1 to indicate that no owner or
- *	group-owner shall be changed.
+ * With CHOWN_THREADS, the subdirectories are opened by the thread which
+ * finds them and queued to a pool of threads while the queue is not full.
+ * They are walked by the current thread otherwise.
  */
-int chown_tree (const char *root,
-                uid_t old_uid,
-                uid_t new_uid,
-                gid_t old_gid,
-                gid_t new_gid)
-{
-	char *new_name;
-	size_t new_name_len;
-	int rc = 0;
-	struct DIRECT *ent;
-	struct stat sb;
-	DIR *dir;
+struct chown_dir {
+	int fd;
+	const struct chown_job *job;
+};
 
-	new_name = malloc (1024);
-	if (NULL == new_name) {
-		return -1;
-	}
-	new_name_len = 1024;
+static /*@null@*/struct work_pool *chown_pool;
+static bool chown_failed;
 
-	/*
-	 * Make certain the directory exists.  This routine is called
-	 * directly by the invoker, or recursively.
-	 */
+static void chown_dir_walk (int fd, const struct chown_job *job);
 
-	if (access (root, F_OK) != 0) {
-		free (new_name);
-		return -1;
+static void chown_fail (void)
+{
+	if (NULL != chown_pool) {
+		work_pool_fail (chown_pool);
+	} else {
+		chown_failed = true;
 	}
+}
 
-	/*
-	 * Open the directory and read each entry.  Every entry is tested
-	 * to see if it is a directory, and if so this routine is called
-	 * recursively.  If not, it is checked to see if an ownership
-	 * shall be changed.
-	 */
+static bool chown_has_failed (void)
+{
+	if (NULL != chown_pool) {
+		return work_pool_failed (chown_pool);
+	}
+	return chown_failed;
+}
 
-	dir = opendir (root);
-	if (NULL == dir) {
-		free (new_name);
-		return -1;
+/*
+ * chown_ids - get the IDs to give to a file
+ *
+ *	By default, the IDs are not changed (-1).
+ *
+ *	If the file is not owned by the user, the owner is not changed.
+ *
+ *	If the file is not group-owned by the group, the group-owner is not
+ *	changed.
+ *
+ *	With a map, the owner and group-owner are changed if the map has
+ *	a new ID for them.
+ *
+ *	The IDs the file already has are not changed either. It returns
+ *	false if the file can be left as is.
+ */
+static bool chown_ids (const struct stat *sb, const struct chown_job *job,
+                       uid_t *uid, gid_t *gid)
+{
+	*uid = (uid_t) -1;
+	*gid = (gid_t) -1;
+	if (NULL != job->map) {
+		const struct uid_move *m;
+
+		m = chown_map_find (job->map->uids, job->map->nuids,
+		                    (unsigned long) sb->st_uid);
+		if ((NULL != m) && (m->to != (unsigned long) sb->st_uid)) {
+			*uid = (uid_t) m->to;
+		}
+		m = chown_map_find (job->map->gids, job->map->ngids,
+		                    (unsigned long) sb->st_gid);
+		if ((NULL != m) && (m->to != (unsigned long) sb->st_gid)) {
+			*gid = (gid_t) m->to;
+		}
+		return ((uid_t) -1 != *uid) || ((gid_t) -1 != *gid);
+	}
+	if (   (((uid_t) -1 == job->old_uid) || (sb->st_uid == job->old_uid))
+	    && (sb->st_uid != job->new_uid)) {
+		*uid = job->new_uid;
+	}
+	if (   (((gid_t) -1 == job->old_gid) || (sb->st_gid == job->old_gid))
+	    && (sb->st_gid != job->new_gid)) {
+		*gid = job->new_gid;
 	}
 
-	while ((ent = readdir (dir))) {
-		size_t ent_name_len;
-		uid_t tmpuid = (uid_t) -1;
-		gid_t tmpgid = (gid_t) -1;
+	return ((uid_t) -1 != *uid) || ((gid_t) -1 != *gid);
+}
 
-		/*
-		 * Skip the "." and ".." entries
-		 */
+/*
+ * chown_map_find - find the move of id in the count moves sorted by their
+ *                  old ID
+ */
+/*@null@*/const struct uid_move *chown_map_find (const struct uid_move *moves,
+                                                size_t count,
+                                                unsigned long id)
+{
+	size_t lo = 0;
+	size_t hi = count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
 
-		if (   (strcmp (ent->d_name, ".") == 0)
-		    || (strcmp (ent->d_name, "..") == 0)) {
-			continue;
+		if (moves[mid].from == id) {
+			return &moves[mid];
 		}
+		if (moves[mid].from < id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
 
-		/*
-		 * Make the filename for both the source and the
-		 * destination files.
-		 */
+static void chown_dir_job (unused struct work_pool *pool, void *arg)
+{
+	struct chown_dir *cd = arg;
+
+	chown_dir_walk (cd->fd, cd->job);
+	free (cd);
+}
+
+/*
+ * chown_dir_queue - walk the subdirectory open at fd
+ *
+ *	The subdirectory is walked by a thread of the pool if the queue is
+ *	not full, and by the current thread otherwise.
+ */
+static void chown_dir_queue (int fd, const struct chown_job *job)
+{
+	struct chown_dir *cd;
 
-		ent_name_len = strlen (root) + strlen (ent->d_name) + 2;
-		if (ent_name_len > new_name_len) {
-			/*@only@*/char *tmp = realloc (new_name, ent_name_len);
-			if (NULL == tmp) {
-				rc = -1;
-				break;
+	if (NULL != chown_pool) {
+		cd = malloc (sizeof *cd);
+		if (NULL != cd) {
+			cd->fd = fd;
+			cd->job = job;
+			if (work_pool_queue (chown_pool, chown_dir_job, cd,
+			                     false)) {
+				return;
 			}
-			new_name = tmp;
-			new_name_len = ent_name_len;
+			free (cd);
 		}
+	}
 
-		(void) snprintf (new_name, new_name_len, "%s/%s", root, ent->d_name);
+	chown_dir_walk (fd, job);
+}
 
+/*
+ * chown_entry - change ownership of the entry ent of the directory open
+ *               at fd, or walk it if it is a directory
+ *
+ *	The directories whose type is known are not stat'ed here: they are
+ *	checked when they are walked.
+ *
+ *	It returns false if the walk shall stop.
+ */
+static bool chown_entry (int fd, const struct dir_batch_entry *ent,
+                         const struct chown_job *job)
+{
+	struct stat sb;
+	uid_t tmpuid;
+	gid_t tmpgid;
+
+	if (DT_DIR == ent->type) {
+		sb.st_mode = S_IFDIR;
+	} else if (stat_owner (fd, ent->name, &sb) == -1) {
 		/* Don't follow symbolic links! */
-		if (LSTAT (new_name, &sb) == -1) {
-			continue;
-		}
+		return true;
+	}
 
-		if (S_ISDIR (sb.st_mode) && !S_ISLNK (sb.st_mode)) {
+	if (S_ISDIR (sb.st_mode)) {
+		int subfd;
 
-			/*
-			 * Do the entire subdirectory.
-			 */
+		/*
+		 * Do the entire subdirectory, including the
+		 * subdirectory itself.
+		 */
 
-			rc = chown_tree (new_name, old_uid, new_uid,
-			                 old_gid, new_gid);
-			if (0 != rc) {
-				break;
-			}
+		subfd = openat (fd, ent->name,
+		                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (subfd < 0) {
+			chown_fail ();
+			return false;
 		}
+		chown_dir_queue (subfd, job);
+		return !chown_has_failed ();
+	}
 #ifndef HAVE_LCHOWN
-		/* don't use chown (follows symbolic links!) */
-		if (S_ISLNK (sb.st_mode)) {
-			continue;
-		}
+	/* don't use chown (follows symbolic links!) */
+	if (S_ISLNK (sb.st_mode)) {
+		return true;
+	}
 #endif
-		/*
-		 * By default, the IDs are not changed (-1).
-		 *
-		 * If the file is not owned by the user, the owner is not
-		 * changed.
-		 *
-		 * If the file is not group-owned by the group, the
-		 * group-owner is not changed.
-		 */
-		if (((uid_t) -1 == old_uid) || (sb.st_uid == old_uid)) {
-			tmpuid = new_uid;
-		}
-		if (((gid_t) -1 == old_gid) || (sb.st_gid == old_gid)) {
-			tmpgid = new_gid;
+	if (   chown_ids (&sb, job, &tmpuid, &tmpgid)
+	    && (fchownat (fd, ent->name, tmpuid, tmpgid,
+	                  AT_SYMLINK_NOFOLLOW) != 0)) {
+		chown_fail ();
+		return false;
+	}
+	return true;
+}
+
+/*
+ * chown_dir_walk - change ownership of files in the directory open at fd
+ *
+ *	The descriptor is closed.
+ */
+static void chown_dir_walk (int fd, const struct chown_job *job)
+{
+	struct dir_batch batch;
+	struct stat sb;
+	uid_t tmpuid;
+	gid_t tmpgid;
+	bool ok = true;
+	ssize_t n;
+	ssize_t i;
+
+	/*
+	 * Read each entry, in batches sorted by inode number.  Every
+	 * entry is tested to see if it is a directory, and if so it is
+	 * walked as well.  If not, it is checked to see if an ownership
+	 * shall be changed.
+	 */
+
+	dir_batch_init (&batch, fd);
+	while (ok && ((n = dir_batch_next (&batch)) != 0)) {
+		if (n < 0) {
+			chown_fail ();
+			break;
 		}
-		if (((uid_t) -1 != tmpuid) || ((gid_t) -1 != tmpgid)) {
-			rc = LCHOWN (new_name, tmpuid, tmpgid);
-			if (0 != rc) {
-				break;
-			}
+		for (i = 0; ok && (i < n); i++) {
+			ok = chown_entry (fd, &batch.ents[i], job);
 		}
 	}
-
-	free (new_name);
-	(void) closedir (dir);
+	dir_batch_free (&batch);
 
 	/*
 	 * Now do the root of the tree
 	 */
 
-	if ((0 == rc) && (stat (root, &sb) == 0)) {
-		uid_t tmpuid = (uid_t) -1;
-		gid_t tmpgid = (gid_t) -1;
-		if (((uid_t) -1 == old_uid) || (sb.st_uid == old_uid)) {
-			tmpuid = new_uid;
-		}
-		if (((gid_t) -1 == old_gid) || (sb.st_gid == old_gid)) {
-			tmpgid = new_gid;
+	if (!chown_has_failed ()) {
+		if (fstat (fd, &sb) != 0) {
+			chown_fail ();
+		} else if (   chown_ids (&sb, job, &tmpuid, &tmpgid)
+		           && (fchown (fd, tmpuid, tmpgid) != 0)) {
+			chown_fail ();
 		}
-		if (((uid_t) -1 != tmpuid) || ((gid_t) -1 != tmpgid)) {
-			rc = LCHOWN (root, tmpuid, tmpgid);
+	}
+
+	(void) close (fd);
+}
+
+/*
+ * chown_trees - change ownership of files in several directory trees
+ *
+ *	The trees are walked with the same pool of threads, so that the
+ *	ownership of the home directories of several users can be changed in
+ *	one pass.
+ *
+ *	See chown_tree() for the meaning of the IDs of each job.
+ *
+ *	Return 0 if the ownership of all the trees was changed, -1
+ *	otherwise.
+ */
+int chown_trees (const struct chown_job *jobs, size_t count)
+{
+	int nthreads = getdef_num ("CHOWN_THREADS", 1);
+	size_t i;
+	int err;
+
+	SHADOW_PROBE2 (chown_trees__entry,
+	               (count > 0) ? jobs[0].root : "", (long) count);
+	chown_failed = false;
+	if (nthreads > 1) {
+		chown_pool = work_pool_start ((size_t) nthreads,
+		                              2 * (size_t) nthreads);
+	}
+
+	for (i = 0; (i < count) && !chown_has_failed (); i++) {
+		int fd;
+
+		fd = open (jobs[i].root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			chown_fail ();
+			break;
 		}
-	} else {
-		rc = -1;
+		chown_dir_queue (fd, &jobs[i]);
 	}
 
-	return rc;
+	err = work_pool_stop (chown_pool);
+	chown_pool = NULL;
+	if (chown_failed) {
+		err = -1;
+	}
+
+	SHADOW_PROBE3 (chown_trees__return,
+	               (count > 0) ? jobs[0].root : "", (long) count, err);
+	return err;
 }
 
+/*
+ * chown_tree - change ownership of files in a directory tree
+ *
+ *	chown_dir() walks a directory tree and changes the ownership
+ *	of all files owned by the provided user ID.
+ *
+ *	Only files owned (resp. group-owned) by old_uid (resp. by old_gid)
+ *	will have their ownership (resp. group-ownership) modified, unless
+ *	old_uid (resp. old_gid) is set to -1.
+ *
+ *	new_uid and new_gid can be set to -1 to indicate that no owner or
+ *	group-owner shall be changed. If nothing would be changed, the
+ *	tree is not walked.
+ */
+int chown_tree (const char *root,
+                uid_t old_uid,
+                uid_t new_uid,
+                gid_t old_gid,
+                gid_t new_gid)
+{
+	struct chown_job job;
+
+	if (   (   ((uid_t) -1 == new_uid)
+	        || (((uid_t) -1 != old_uid) && (new_uid == old_uid)))
+	    && (   ((gid_t) -1 == new_gid)
+	        || (((gid_t) -1 != old_gid) && (new_gid == old_gid)))) {
+		return 0;
+	}
+
+	job.root = root;
+	job.old_uid = old_uid;
+	job.new_uid = new_uid;
+	job.old_gid = old_gid;
+	job.new_gid = new_gid;
+	job.map = NULL;
+
+	return chown_trees (&job, 1);
+}
@@ -39,14 +39,26 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif				/* HAVE_LINUX_FS_H */
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif				/* HAVE_SYS_SENDFILE_H */
 #include "prototypes.h"
 #include "defines.h"
+#include "getdef.h"
+#include "probes.h"
 #ifdef WITH_SELINUX
 #include <selinux/selinux.h>
 #endif				/* WITH_SELINUX */
 #if defined(WITH_ACL) || defined(WITH_ATTR)
 #include <stdarg.h>
+#include <sys/xattr.h>
 #include <attr/error_context.h>
 #endif				/* WITH_ACL || WITH_ATTR */
 #ifdef WITH_ACL
@@ -60,51 +72,95 @@
 static /*@null@*/const char *src_orig;
 static /*@null@*/const char *dst_orig;
 
+/* Resume an interrupted copy (copy_tree_resume) */
+static bool copy_resume = false;
+
+/*
+ * The files with several links which were copied, and which are expected
+ * to be found again, are kept in a hash table indexed by device and
+ * inode. ln_count is the number of links which were not found yet.
+ */
 struct link_name {
 	dev_t ln_dev;
 	ino_t ln_ino;
 	nlink_t ln_count;
 	char *ln_name;
+	size_t ln_index;	/* index of the entry in a snapshot */
 	/*@dependent@*/struct link_name *ln_next;
 };
-static /*@exposed@*/struct link_name *links;
+static /*@null@*/ /*@owned@*/struct link_name **links;
+static size_t links_size;	/* number of buckets, a power of 2 */
+static size_t links_count;	/* number of entries */
+
+/*
+ * The entries of the trees are accessed relative to the descriptor of
+ * their directory, so that the path is not resolved again for each
+ * access, and so that a directory cannot be replaced by a symbolic link
+ * during the copy. The full path is kept for the libraries which need a
+ * path (ACL, extended attributes, SELinux) and for the hard links.
+ */
+struct path_info {
+	const char *full_path;
+	int dirfd;
+	const char *name;
+};
 
-static int copy_entry (const char *src, const char *dst,
+static int copy_dir_entries (const struct path_info *src,
+                             const struct path_info *dst,
+                             bool follow, bool reset_selinux,
+                             uid_t old_uid, uid_t new_uid,
+                             gid_t old_gid, gid_t new_gid);
+static int copy_entry (const struct path_info *src,
+                       const struct path_info *dst,
                        bool reset_selinux,
                        uid_t old_uid, uid_t new_uid,
                        gid_t old_gid, gid_t new_gid);
-static int copy_dir (const char *src, const char *dst,
+static int copy_dir (const struct path_info *src,
+                     const struct path_info *dst,
                      bool reset_selinux,
-                     const struct stat *statp, const struct timeval mt[],
+                     const struct stat *statp, const struct timespec mt[],
                      uid_t old_uid, uid_t new_uid,
                      gid_t old_gid, gid_t new_gid);
 #ifdef	S_IFLNK
-static /*@null@*/char *readlink_malloc (const char *filename);
-static int copy_symlink (const char *src, const char *dst,
+static /*@null@*/char *readlink_malloc (int dirfd, const char *filename);
+static int copy_symlink (const struct path_info *src,
+                         const struct path_info *dst,
                          unused bool reset_selinux,
-                         const struct stat *statp, const struct timeval mt[],
+                         const struct stat *statp, const struct timespec mt[],
+                         uid_t old_uid, uid_t new_uid,
+                         gid_t old_gid, gid_t new_gid);
+static int make_symlink (const char *oldlink,
+                         const struct path_info *dst,
+                         const struct stat *statp, const struct timespec mt[],
                          uid_t old_uid, uid_t new_uid,
                          gid_t old_gid, gid_t new_gid);
 #endif				/* S_IFLNK */
-static int copy_hardlink (const char *dst,
+static int copy_hardlink (const struct path_info *dst,
                           unused bool reset_selinux,
                           struct link_name *lp);
-static int copy_special (const char *src, const char *dst,
-                         bool reset_selinux,
-                         const struct stat *statp, const struct timeval mt[],
+static int copy_special (const struct path_info *src,
+                         const struct path_info *dst,
+                         bool reset_selinux, bool xattrs,
+                         const struct stat *statp, const struct timespec mt[],
                          uid_t old_uid, uid_t new_uid,
                          gid_t old_gid, gid_t new_gid);
-static int copy_file (const char *src, const char *dst,
-                      bool reset_selinux,
-                      const struct stat *statp, const struct timeval mt[],
+static int copy_file (const struct path_info *src,
+                      const struct path_info *dst,
+                      bool reset_selinux, bool xattrs,
+                      const struct stat *statp, const struct timespec mt[],
                       uid_t old_uid, uid_t new_uid,
                       gid_t old_gid, gid_t new_gid);
-static int chown_if_needed (const char *dst, const struct stat *statp,
-                            uid_t old_uid, uid_t new_uid,
-                            gid_t old_gid, gid_t new_gid);
-static int lchown_if_needed (const char *dst, const struct stat *statp,
-                             uid_t old_uid, uid_t new_uid,
-                             gid_t old_gid, gid_t new_gid);
+static int copy_attrs (const struct path_info *src, int ifd,
+                       const struct path_info *dst, int ofd,
+                       const struct stat *statp,
+                       bool reset_selinux, bool xattrs);
+static int copy_data (int ifd, int ofd, const struct stat *statp);
+static int copy_file_data (int ifd, int ofd, const struct stat *statp,
+                           const struct timespec mt[]);
+static int lchownat_if_needed (const struct path_info *dst,
+                               const struct stat *statp,
+                               uid_t old_uid, uid_t new_uid,
+                               gid_t old_gid, gid_t new_gid);
 static int fchown_if_needed (int fdst, const struct stat *statp,
                              uid_t old_uid, uid_t new_uid,
                              gid_t old_gid, gid_t new_gid);
@@ -136,38 +192,189 @@ static void error_acl (struct error_context *ctx, const char *fmt, ...)
 static struct error_context ctx = {
 	error_acl
 };
-#endif				/* WITH_ACL || WITH_ATTR */
 
 /*
- * remove_link - delete a link from the linked list
+ * Extended metadata of a source file (see src_xattrs)
  */
-static void remove_link (/*@only@*/struct link_name *ln)
+#define SRC_XATTR_ACL	0x1	/* POSIX ACLs */
+#define SRC_XATTR_OTHER	0x2	/* other extended attributes */
+
+/*
+ * File systems of the source files found to have no support for
+ * extended attributes.
+ */
+#define NOXATTR_DEVS	8
+static dev_t noxattr_devs[NOXATTR_DEVS];
+static size_t noxattr_count = 0;
+
+/*
+ * src_xattrs - find the extended metadata of a source file
+ *
+ *	The names of the extended attributes of path (or of fd, if it is
+ *	not -1), on the file system dev, are listed once, so that the
+ *	ACLs and the extended attributes are only copied when they
+ *	exist. Without ACL attributes, the ACL of the file is given by
+ *	its mode.
+ *
+ *	The file systems without extended attributes are remembered, and
+ *	their files are not checked.
+ *
+ *	If the attributes cannot be listed, both kinds are reported, and
+ *	the libraries handle the failure.
+ */
+static unsigned int src_xattrs (const char *path, int fd, dev_t dev)
 {
-	struct link_name *lp;
+	unsigned int ret = 0;
+	ssize_t len;
+	char *names, *cp;
+	size_t i;
+
+	for (i = 0; i < noxattr_count; i++) {
+		if (noxattr_devs[i] == dev) {
+			return 0;
+		}
+	}
 
-	if (links == ln) {
-		links = ln->ln_next;
-		free (ln->ln_name);
-		free (ln);
-		return;
+	len = (fd >= 0) ? flistxattr (fd, NULL, 0) : llistxattr (path, NULL, 0);
+	if (0 == len) {
+		return 0;
 	}
-	for (lp = links; NULL !=lp; lp = lp->ln_next) {
-		if (lp->ln_next == ln) {
-			break;
+	if (len < 0) {
+		if ((ENOTSUP == errno) && (noxattr_count < NOXATTR_DEVS)) {
+			noxattr_devs[noxattr_count] = dev;
+			noxattr_count++;
+			return 0;
 		}
+		return SRC_XATTR_ACL | SRC_XATTR_OTHER;
 	}
 
-	if (NULL == lp) {
-		free (ln->ln_name);
-		free (ln);
-		return;
+	names = (char *) malloc ((size_t) len);
+	if (NULL == names) {
+		return SRC_XATTR_ACL | SRC_XATTR_OTHER;
+	}
+	len = (fd >= 0) ? flistxattr (fd, names, (size_t) len)
+	                : llistxattr (path, names, (size_t) len);
+	if (len < 0) {
+		/* e.g. ERANGE, if an attribute was just added */
+		free (names);
+		return SRC_XATTR_ACL | SRC_XATTR_OTHER;
 	}
+	for (cp = names; cp < names + len; cp += strlen (cp) + 1) {
+		if (strncmp (cp, "system.posix_acl_", 17) == 0) {
+			ret |= SRC_XATTR_ACL;
+		} else {
+			ret |= SRC_XATTR_OTHER;
+		}
+	}
+	free (names);
+	return ret;
+}
+#endif				/* WITH_ACL || WITH_ATTR */
+
+static size_t link_hash (dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t) dev * 16777619U) ^ (uint64_t) ino;
+
+	/* Fibonacci hashing, the high bits are the best mixed */
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (size_t) (h >> 32);
+}
+
+/*
+ * find_link - return the address of the pointer to the entry of an inode
+ *
+ *	If the inode is not in the table, the address of the NULL pointer
+ *	ending its bucket is returned.
+ */
+static struct link_name **find_link (dev_t dev, ino_t ino)
+{
+	struct link_name **lpp;
+
+	lpp = &links[link_hash (dev, ino) & (links_size - 1)];
+	while (   (NULL != *lpp)
+	       && (((*lpp)->ln_dev != dev) || ((*lpp)->ln_ino != ino))) {
+		lpp = &(*lpp)->ln_next;
+	}
+	return lpp;
+}
+
+/*
+ * add_link - add an entry to the table, growing it as needed
+ */
+static void add_link (/*@only@*/struct link_name *ln)
+{
+	struct link_name **lpp;
+
+	if (links_count >= links_size) {
+		size_t size = (0 == links_size) ? 64 : links_size * 2;
+		struct link_name **table;
+		size_t i;
+
+		table = (struct link_name **) xmalloc (size * sizeof (*table));
+		for (i = 0; i < size; i++) {
+			table[i] = NULL;
+		}
+		for (i = 0; i < links_size; i++) {
+			while (NULL != links[i]) {
+				struct link_name *lp = links[i];
+				size_t h = link_hash (lp->ln_dev, lp->ln_ino);
+
+				links[i] = lp->ln_next;
+				lp->ln_next = table[h & (size - 1)];
+				table[h & (size - 1)] = lp;
+			}
+		}
+		free (links);
+		links = table;
+		links_size = size;
+	}
+
+	lpp = find_link (ln->ln_dev, ln->ln_ino);
+	ln->ln_next = NULL;
+	*lpp = ln;
+	links_count++;
+}
+
+/*
+ * remove_link - delete an entry from the table
+ */
+static void remove_link (/*@only@*/struct link_name *ln)
+{
+	struct link_name **lpp = find_link (ln->ln_dev, ln->ln_ino);
 
-	lp->ln_next = lp->ln_next->ln_next;
+	if (*lpp == ln) {
+		*lpp = ln->ln_next;
+		links_count--;
+	}
 	free (ln->ln_name);
 	free (ln);
 }
 
+/*
+ * free_links - delete all the entries from the table
+ *
+ *	Since there can be hardlinks elsewhere on the device, all the
+ *	links of a file are not always found.
+ */
+static void free_links (void)
+{
+	size_t i;
+
+	for (i = 0; i < links_size; i++) {
+		while (NULL != links[i]) {
+			struct link_name *lp = links[i];
+
+			links[i] = lp->ln_next;
+			free (lp->ln_name);
+			free (lp);
+		}
+	}
+	free (links);
+	links = NULL;
+	links_size = 0;
+	links_count = 0;
+}
+
 /*
  * check_link - see if a file is really a link
  */
@@ -184,8 +391,9 @@ static /*@exposed@*/ /*@null@*/struct link_name *check_link (const char *name, c
 	assert (NULL != src_orig);
 	assert (NULL != dst_orig);
 
-	for (lp = links; NULL != lp; lp = lp->ln_next) {
-		if ((lp->ln_dev == sb->st_dev) && (lp->ln_ino == sb->st_ino)) {
+	if (0 != links_count) {
+		lp = *find_link (sb->st_dev, sb->st_ino);
+		if (NULL != lp) {
 			return lp;
 		}
 	}
@@ -200,16 +408,105 @@ static /*@exposed@*/ /*@null@*/struct link_name *check_link (const char *name, c
 	name_len = strlen (name);
 	lp->ln_dev = sb->st_dev;
 	lp->ln_ino = sb->st_ino;
-	lp->ln_count = sb->st_nlink;
+	lp->ln_count = sb->st_nlink - 1;
+	lp->ln_index = 0;
 	len = name_len - src_len + dst_len + 1;
 	lp->ln_name = (char *) xmalloc (len);
 	(void) snprintf (lp->ln_name, len, "%s%s", dst_orig, name + src_len);
-	lp->ln_next = links;
-	links = lp;
+	add_link (lp);
 
 	return NULL;
 }
 
+/*
+ * Pool of threads copying the content of the regular files.
+ *
+ * copy_tree() still walks the tree alone, and creates the directories,
+ * links, and files with their ownership and permissions in order. Only
+ * copy_file_data() is left to the threads. The entries of a directory
+ * are thus all created when its times are set, and the hard links can
+ * be created before the data of the file is copied.
+ *
+ * The number of queued files is limited, to bound the number of open
+ * file descriptors.
+ */
+static /*@null@*/struct work_pool *copy_pool;
+
+struct copy_job {
+	int ifd;
+	int ofd;
+	struct stat sb;
+	struct timespec mt[2];
+};
+
+static void copy_job_run (struct work_pool *pool, void *arg)
+{
+	struct copy_job *job = arg;
+
+	if (copy_file_data (job->ifd, job->ofd, &job->sb, job->mt) != 0) {
+		work_pool_fail (pool);
+	}
+	free (job);
+}
+
+/*
+ * copy_pool_start - start the threads configured with COPY_THREADS
+ */
+static void copy_pool_start (void)
+{
+	int nthreads = getdef_num ("COPY_THREADS", 1);
+
+	if (nthreads > 1) {
+		copy_pool = work_pool_start ((size_t) nthreads,
+		                             2 * (size_t) nthreads);
+	}
+}
+
+/*
+ * copy_pool_queue - queue the copy of the content of a file
+ *
+ *	It returns false if the copy should be done by the caller.
+ */
+static bool copy_pool_queue (int ifd, int ofd, const struct stat *statp,
+                             const struct timespec mt[])
+{
+	struct copy_job *job;
+
+	if (NULL == copy_pool) {
+		return false;
+	}
+
+	job = malloc (sizeof *job);
+	if (NULL == job) {
+		return false;
+	}
+	job->ifd = ifd;
+	job->ofd = ofd;
+	job->sb = *statp;
+	job->mt[0] = mt[0];
+	job->mt[1] = mt[1];
+
+	if (!work_pool_queue (copy_pool, copy_job_run, job, true)) {
+		free (job);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * copy_pool_stop - wait for the queued copies and stop the threads
+ *
+ *	Return 0 if all the copies succeeded, -1 otherwise.
+ */
+static int copy_pool_stop (void)
+{
+	int err = work_pool_stop (copy_pool);
+
+	copy_pool = NULL;
+	return err;
+}
+
 /*
  * copy_tree - copy files in a directory tree
  *
@@ -226,6 +523,9 @@ static /*@exposed@*/ /*@null@*/struct link_name *check_link (const char *name, c
  *
  *	The same logic applies for the group-ownership and
  *	old_gid/new_gid.
+ *
+ *	If COPY_THREADS is set, the content of the files is copied by a
+ *	pool of threads.
  */
 int copy_tree (const char *src_root, const char *dst_root,
                bool copy_root, bool reset_selinux,
@@ -233,13 +533,12 @@ int copy_tree (const char *src_root, const char *dst_root,
                gid_t old_gid, gid_t new_gid)
 {
 	int err = 0;
-	bool set_orig = false;
-	struct DIRECT *ent;
-	DIR *dir;
+	struct path_info src = { src_root, AT_FDCWD, src_root };
+	struct path_info dst = { dst_root, AT_FDCWD, dst_root };
 
 	if (copy_root) {
 		struct stat sb;
-		if (access (dst_root, F_OK) == 0) {
+		if (!copy_resume && (access (dst_root, F_OK) == 0)) {
 			return -1;
 		}
 
@@ -253,20 +552,100 @@ int copy_tree (const char *src_root, const char *dst_root,
 			         Prog, src_root);
 			return -1;
 		}
+	}
 
-		return copy_entry (src_root, dst_root, reset_selinux,
-		                   old_uid, new_uid, old_gid, new_gid);
+	src_orig = src_root;
+	dst_orig = dst_root;
+	copy_pool_start ();
+
+	if (copy_root) {
+		err = copy_entry (&src, &dst, reset_selinux,
+		                  old_uid, new_uid, old_gid, new_gid);
+	} else {
+		/*
+		 * This routine is called after the home directory is
+		 * created. It assumes the target directory exists.
+		 */
+		err = copy_dir_entries (&src, &dst, true, reset_selinux,
+		                        old_uid, new_uid, old_gid, new_gid);
 	}
 
-	/*
-	 * Make certain both directories exist.  This routine is called
-	 * after the home directory is created, or recursively after the
-	 * target is created.  It assumes the target directory exists.
+	if (copy_pool_stop () != 0) {
+		err = -1;
+	}
+	src_orig = NULL;
+	dst_orig = NULL;
+	free_links ();
+
+#ifdef WITH_SELINUX
+	/* Reset SELinux to create files with default contexts.
+	 * Note that the context is only reset on exit of copy_tree (it is
+	 * assumed that the program would quit without needing a restored
+	 * context if copy_tree failed previously), hence the context is
+	 * set on the sub-functions of copy_entry.
 	 */
+	if (reset_selinux_file_context () != 0) {
+		err = -1;
+	}
+#endif				/* WITH_SELINUX */
 
-	if (   (access (src_root, F_OK) != 0)
-	    || (access (dst_root, F_OK) != 0)) {
-		return -1;
+	return err;
+}
+
+/*
+ * copy_tree_resume - resume an interrupted copy_tree
+ *
+ *	copy_tree_resume() copies src_root to dst_root like copy_tree()
+ *	with copy_root set, but dst_root may be the partial result of an
+ *	interrupted copy.
+ *
+ *	The existing directories are reused. The regular files which have
+ *	the size and the modification time of their source are kept: the
+ *	time is only set once the content was copied. The other entries
+ *	are replaced.
+ */
+int copy_tree_resume (const char *src_root, const char *dst_root,
+                      bool reset_selinux,
+                      uid_t old_uid, uid_t new_uid,
+                      gid_t old_gid, gid_t new_gid)
+{
+	int err;
+
+	copy_resume = true;
+	err = copy_tree (src_root, dst_root, true, reset_selinux,
+	                 old_uid, new_uid, old_gid, new_gid);
+	copy_resume = false;
+
+	return err;
+}
+
+/*
+ * copy_dir_entries - copy the entries of a directory
+ *
+ *	Copy the entries of the src directory to the existing dst
+ *	directory.
+ *
+ *	If follow is false, src and dst are not opened if they are
+ *	symbolic links.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int copy_dir_entries (const struct path_info *src,
+                             const struct path_info *dst,
+                             bool follow, bool reset_selinux,
+                             uid_t old_uid, uid_t new_uid,
+                             gid_t old_gid, gid_t new_gid)
+{
+	int err = 0;
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	int src_fd;
+	int dst_fd;
+	struct dir_batch batch;
+	ssize_t n;
+	ssize_t i;
+
+	if (!follow) {
+		flags |= O_NOFOLLOW;
 	}
 
 	/*
@@ -274,30 +653,34 @@ int copy_tree (const char *src_root, const char *dst_root,
 	 * entry in the directory is copied with the UID and GID set
 	 * to the provided values.  As an added security feature only
 	 * regular files (and directories ...) are copied, and no file
-	 * is made set-ID.
+	 * is made set-ID.  The entries are read in batches sorted by
+	 * inode number.
 	 */
-	dir = opendir (src_root);
-	if (NULL == dir) {
+	src_fd = openat (src->dirfd, src->name, flags);
+	if (src_fd < 0) {
 		return -1;
 	}
-
-	if (src_orig == NULL) {
-		src_orig = src_root;
-		dst_orig = dst_root;
-		set_orig = true;
+	dst_fd = openat (dst->dirfd, dst->name, flags);
+	if (dst_fd < 0) {
+		(void) close (src_fd);
+		return -1;
 	}
-	while ((0 == err) && (ent = readdir (dir)) != NULL) {
-		/*
-		 * Skip the "." and ".." entries
-		 */
-		if ((strcmp (ent->d_name, ".") != 0) &&
-		    (strcmp (ent->d_name, "..") != 0)) {
+	dir_batch_init (&batch, src_fd);
+	tree_progress_path (src->full_path);
+
+	while ((0 == err) && ((n = dir_batch_next (&batch)) != 0)) {
+		if (n < 0) {
+			err = -1;
+			break;
+		}
+		for (i = 0; (0 == err) && (i < n); i++) {
+			const struct dir_batch_entry *ent = &batch.ents[i];
 			char *src_name;
 			char *dst_name;
-			size_t src_len = strlen (ent->d_name) + 2;
-			size_t dst_len = strlen (ent->d_name) + 2;
-			src_len += strlen (src_root);
-			dst_len += strlen (dst_root);
+			size_t src_len = strlen (ent->name) + 2;
+			size_t dst_len = strlen (ent->name) + 2;
+			src_len += strlen (src->full_path);
+			dst_len += strlen (dst->full_path);
 
 			src_name = (char *) malloc (src_len);
 			dst_name = (char *) malloc (dst_len);
@@ -305,16 +688,26 @@ int copy_tree (const char *src_root, const char *dst_root,
 			if ((NULL == src_name) || (NULL == dst_name)) {
 				err = -1;
 			} else {
+				struct path_info src_entry;
+				struct path_info dst_entry;
+
 				/*
 				 * Build the filename for both the source and
 				 * the destination files.
 				 */
 				(void) snprintf (src_name, src_len, "%s/%s",
-				                 src_root, ent->d_name);
+				                 src->full_path, ent->name);
 				(void) snprintf (dst_name, dst_len, "%s/%s",
-				                 dst_root, ent->d_name);
+				                 dst->full_path, ent->name);
+
+				src_entry.full_path = src_name;
+				src_entry.dirfd = src_fd;
+				src_entry.name = ent->name;
+				dst_entry.full_path = dst_name;
+				dst_entry.dirfd = dst_fd;
+				dst_entry.name = ent->name;
 
-				err = copy_entry (src_name, dst_name,
+				err = copy_entry (&src_entry, &dst_entry,
 				                  reset_selinux,
 				                  old_uid, new_uid,
 				                  old_gid, new_gid);
@@ -327,32 +720,75 @@ int copy_tree (const char *src_root, const char *dst_root,
 			}
 		}
 	}
-	(void) closedir (dir);
+	dir_batch_free (&batch);
+	(void) close (src_fd);
+	(void) close (dst_fd);
 
-	if (set_orig) {
-		src_orig = NULL;
-		dst_orig = NULL;
-		/* FIXME: clean links
-		 * Since there can be hardlinks elsewhere on the device,
-		 * we cannot check that all the hardlinks were found:
-		assert (NULL == links);
-		 */
-	}
+	return err;
+}
 
-#ifdef WITH_SELINUX
-	/* Reset SELinux to create files with default contexts.
-	 * Note that the context is only reset on exit of copy_tree (it is
-	 * assumed that the program would quit without needing a restored
-	 * context if copy_tree failed previously), and that copy_tree can
-	 * be called recursively (hence the context is set on the
-	 * sub-functions of copy_entry).
-	 */
-	if (reset_selinux_file_context () != 0) {
-		err = -1;
-	}
-#endif				/* WITH_SELINUX */
+/*
+ * stat_times - get the access and modification times of a file
+ */
+static void stat_times (const struct stat *sb, struct timespec mt[])
+{
+#ifdef HAVE_STRUCT_STAT_ST_ATIM
+	mt[0].tv_sec  = sb->st_atim.tv_sec;
+	mt[0].tv_nsec = sb->st_atim.tv_nsec;
+#else				/* !HAVE_STRUCT_STAT_ST_ATIM */
+	mt[0].tv_sec  = sb->st_atime;
+# ifdef HAVE_STRUCT_STAT_ST_ATIMENSEC
+	mt[0].tv_nsec = sb->st_atimensec;
+# else				/* !HAVE_STRUCT_STAT_ST_ATIMENSEC */
+	mt[0].tv_nsec = 0;
+# endif				/* !HAVE_STRUCT_STAT_ST_ATIMENSEC */
+#endif				/* !HAVE_STRUCT_STAT_ST_ATIM */
 
-	return err;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	mt[1].tv_sec  = sb->st_mtim.tv_sec;
+	mt[1].tv_nsec = sb->st_mtim.tv_nsec;
+#else				/* !HAVE_STRUCT_STAT_ST_MTIM */
+	mt[1].tv_sec  = sb->st_mtime;
+# ifdef HAVE_STRUCT_STAT_ST_MTIMENSEC
+	mt[1].tv_nsec = sb->st_mtimensec;
+# else				/* !HAVE_STRUCT_STAT_ST_MTIMENSEC */
+	mt[1].tv_nsec = 0;
+# endif				/* !HAVE_STRUCT_STAT_ST_MTIMENSEC */
+#endif				/* !HAVE_STRUCT_STAT_ST_MTIM */
+}
+
+/*
+ * resume_entry - check the destination of a non-directory entry when
+ *                resuming a copy
+ *
+ *	Return 1 if dst is a regular file which was completely copied
+ *	from a regular file with the stat sb and the times mt, 0 if dst
+ *	does not exist (anymore) and must be copied, -1 on error.
+ */
+static int resume_entry (const struct path_info *dst,
+                         const struct stat *sb, const struct timespec mt[])
+{
+	struct stat dsb;
+	struct timespec dmt[2];
+
+	if (fstatat (dst->dirfd, dst->name, &dsb, AT_SYMLINK_NOFOLLOW) != 0) {
+		return (ENOENT == errno) ? 0 : -1;
+	}
+	if (S_ISDIR (dsb.st_mode)) {
+		return -1;
+	}
+	stat_times (&dsb, dmt);
+	if (   S_ISREG (sb->st_mode)
+	    && S_ISREG (dsb.st_mode)
+	    && (dsb.st_size == sb->st_size)
+	    && (dmt[1].tv_sec == mt[1].tv_sec)
+	    && (dmt[1].tv_nsec == mt[1].tv_nsec)) {
+		return 1;
+	}
+	if (unlinkat (dst->dirfd, dst->name, 0) != 0) {
+		return -1;
+	}
+	return 0;
 }
 
 /*
@@ -374,7 +810,8 @@ int copy_tree (const char *src_root, const char *dst_root,
  *	old_gid) will be modified, unless old_uid (resp. old_gid) is set
  *	to -1.
  */
-static int copy_entry (const char *src, const char *dst,
+static int copy_entry (const struct path_info *src,
+                       const struct path_info *dst,
                        bool reset_selinux,
                        uid_t old_uid, uid_t new_uid,
                        gid_t old_gid, gid_t new_gid)
@@ -382,36 +819,32 @@ static int copy_entry (const char *src, const char *dst,
 	int err = 0;
 	struct stat sb;
 	struct link_name *lp;
-	struct timeval mt[2];
+	struct timespec mt[2];
 
-	if (LSTAT (src, &sb) == -1) {
+	if (fstatat (src->dirfd, src->name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
 		/* If we cannot stat the file, do not care. */
 	} else {
-#ifdef HAVE_STRUCT_STAT_ST_ATIM
-		mt[0].tv_sec  = sb.st_atim.tv_sec;
-		mt[0].tv_usec = sb.st_atim.tv_nsec / 1000;
-#else				/* !HAVE_STRUCT_STAT_ST_ATIM */
-		mt[0].tv_sec  = sb.st_atime;
-# ifdef HAVE_STRUCT_STAT_ST_ATIMENSEC
-		mt[0].tv_usec = sb.st_atimensec / 1000;
-# else				/* !HAVE_STRUCT_STAT_ST_ATIMENSEC */
-		mt[0].tv_usec = 0;
-# endif				/* !HAVE_STRUCT_STAT_ST_ATIMENSEC */
-#endif				/* !HAVE_STRUCT_STAT_ST_ATIM */
+		int done = 0;
 
-#ifdef HAVE_STRUCT_STAT_ST_MTIM
-		mt[1].tv_sec  = sb.st_mtim.tv_sec;
-		mt[1].tv_usec = sb.st_mtim.tv_nsec / 1000;
-#else				/* !HAVE_STRUCT_STAT_ST_MTIM */
-		mt[1].tv_sec  = sb.st_mtime;
-# ifdef HAVE_STRUCT_STAT_ST_MTIMENSEC
-		mt[1].tv_usec = sb.st_mtimensec / 1000;
-# else				/* !HAVE_STRUCT_STAT_ST_MTIMENSEC */
-		mt[1].tv_usec = 0;
-# endif				/* !HAVE_STRUCT_STAT_ST_MTIMENSEC */
-#endif				/* !HAVE_STRUCT_STAT_ST_MTIM */
+		stat_times (&sb, mt);
 
-		if (S_ISDIR (sb.st_mode)) {
+		if (copy_resume && !S_ISDIR (sb.st_mode)) {
+			done = resume_entry (dst, &sb, mt);
+		}
+
+		if (0 != done) {
+			/*
+			 * Already copied: the file is still recorded
+			 * for its other links.
+			 */
+			if (done > 0) {
+				(void) check_link (src->full_path, &sb);
+			} else {
+				err = -1;
+			}
+		}
+
+		else if (S_ISDIR (sb.st_mode)) {
 			err = copy_dir (src, dst, reset_selinux, &sb, mt,
 			                old_uid, new_uid, old_gid, new_gid);
 		}
@@ -431,7 +864,7 @@ static int copy_entry (const char *src, const char *dst,
 		 * See if this is a previously copied link
 		 */
 
-		else if ((lp = check_link (src, &sb)) != NULL) {
+		else if ((lp = check_link (src->full_path, &sb)) != NULL) {
 			err = copy_hardlink (dst, reset_selinux, lp);
 		}
 
@@ -442,7 +875,7 @@ static int copy_entry (const char *src, const char *dst,
 		 */
 
 		else if (!S_ISREG (sb.st_mode)) {
-			err = copy_special (src, dst, reset_selinux, &sb, mt,
+			err = copy_special (src, dst, reset_selinux, true, &sb, mt,
 			                    old_uid, new_uid, old_gid, new_gid);
 		}
 
@@ -452,9 +885,13 @@ static int copy_entry (const char *src, const char *dst,
 		 */
 
 		else {
-			err = copy_file (src, dst, reset_selinux, &sb, mt,
+			err = copy_file (src, dst, reset_selinux, true, &sb, mt,
 			                 old_uid, new_uid, old_gid, new_gid);
 		}
+
+		if (0 == err) {
+			tree_progress_add (1, 0);
+		}
 	}
 
 	return err;
@@ -470,9 +907,10 @@ static int copy_entry (const char *src, const char *dst,
  *
  *	Return 0 on success, -1 on error.
  */
-static int copy_dir (const char *src, const char *dst,
+static int copy_dir (const struct path_info *src,
+                     const struct path_info *dst,
                      bool reset_selinux,
-                     const struct stat *statp, const struct timeval mt[],
+                     const struct stat *statp, const struct timespec mt[],
                      uid_t old_uid, uid_t new_uid,
                      gid_t old_gid, gid_t new_gid)
 {
@@ -484,34 +922,20 @@ static int copy_dir (const char *src, const char *dst,
 	 */
 
 #ifdef WITH_SELINUX
-	if (set_selinux_file_context (dst) != 0) {
+	if (set_selinux_file_context (dst->full_path) != 0) {
 		return -1;
 	}
 #endif				/* WITH_SELINUX */
-	if (   (mkdir (dst, statp->st_mode) != 0)
-	    || (chown_if_needed (dst, statp,
-	                         old_uid, new_uid, old_gid, new_gid) != 0)
-#ifdef WITH_ACL
-	    || (   (perm_copy_file (src, dst, &ctx) != 0)
-	        && (errno != 0))
-#else				/* !WITH_ACL */
-	    || (chmod (dst, statp->st_mode) != 0)
-#endif				/* !WITH_ACL */
-#ifdef WITH_ATTR
-	/*
-	 * If the third parameter is NULL, all extended attributes
-	 * except those that define Access Control Lists are copied.
-	 * ACLs are excluded by default because copying them between
-	 * file systems with and without ACL support needs some
-	 * additional logic so that no unexpected permissions result.
-	 */
-	    || (   !reset_selinux
-	        && (attr_copy_file (src, dst, NULL, &ctx) != 0)
-	        && (errno != 0))
-#endif				/* WITH_ATTR */
-	    || (copy_tree (src, dst, false, reset_selinux,
-	                   old_uid, new_uid, old_gid, new_gid) != 0)
-	    || (utimes (dst, mt) != 0)) {
+	if (   (   (mkdirat (dst->dirfd, dst->name, statp->st_mode) != 0)
+	        && (!copy_resume || (EEXIST != errno)))
+	    || (lchownat_if_needed (dst, statp,
+	                            old_uid, new_uid, old_gid, new_gid) != 0)
+	    || (copy_attrs (src, -1, dst, -1, statp,
+	                    reset_selinux, true) != 0)
+	    || (copy_dir_entries (src, dst, false, reset_selinux,
+	                          old_uid, new_uid, old_gid, new_gid) != 0)
+	    || (utimensat (dst->dirfd, dst->name, mt,
+	                   AT_SYMLINK_NOFOLLOW) != 0)) {
 		err = -1;
 	}
 
@@ -520,12 +944,12 @@ static int copy_dir (const char *src, const char *dst,
 
 #ifdef	S_IFLNK
 /*
- * readlink_malloc - wrapper for readlink
+ * readlink_malloc - wrapper for readlinkat
  *
  * return NULL on error.
  * The return string shall be freed by the caller.
  */
-static /*@null@*/char *readlink_malloc (const char *filename)
+static /*@null@*/char *readlink_malloc (int dirfd, const char *filename)
 {
 	size_t size = 1024;
 
@@ -536,7 +960,7 @@ static /*@null@*/char *readlink_malloc (const char *filename)
 			return NULL;
 		}
 
-		nchars = readlink (filename, buffer, size);
+		nchars = readlinkat (dirfd, filename, buffer, size);
 
 		if (nchars < 0) {
 			free(buffer);
@@ -565,54 +989,80 @@ static /*@null@*/char *readlink_malloc (const char *filename)
  *
  *	Return 0 on success, -1 on error.
  */
-static int copy_symlink (const char *src, const char *dst,
+static int copy_symlink (const struct path_info *src,
+                         const struct path_info *dst,
                          unused bool reset_selinux,
-                         const struct stat *statp, const struct timeval mt[],
+                         const struct stat *statp, const struct timespec mt[],
                          uid_t old_uid, uid_t new_uid,
                          gid_t old_gid, gid_t new_gid)
 {
 	char *oldlink;
-
-	/* copy_tree () must be the entry point */
-	assert (NULL != src_orig);
-	assert (NULL != dst_orig);
+	int err;
 
 	/*
 	 * Get the name of the file which the link points
-	 * to.  If that name begins with the original
-	 * source directory name, that part of the link
-	 * name will be replaced with the original
-	 * destination directory name.
+	 * to.
 	 */
 
-	oldlink = readlink_malloc (src);
+	oldlink = readlink_malloc (src->dirfd, src->name);
 	if (NULL == oldlink) {
 		return -1;
 	}
 
-	/* If src was a link to an entry of the src_orig directory itself,
-	 * create a link to the corresponding entry in the dst_orig
-	 * directory.
-	 */
+	err = make_symlink (oldlink, dst, statp, mt,
+	                    old_uid, new_uid, old_gid, new_gid);
+	free (oldlink);
+
+	return err;
+}
+
+/*
+ * make_symlink - create a symlink to oldlink
+ *
+ *	If oldlink begins with the original source directory name, that
+ *	part of the link name is replaced with the original destination
+ *	directory name.
+ *
+ *	statp, mt, old_uid, new_uid, old_gid, and new_gid are used to set
+ *	the access and modification and the access rights.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int make_symlink (const char *oldlink,
+                         const struct path_info *dst,
+                         const struct stat *statp, const struct timespec mt[],
+                         uid_t old_uid, uid_t new_uid,
+                         gid_t old_gid, gid_t new_gid)
+{
+	const char *newlink = oldlink;
+	char *dummy = NULL;
+
+	/* copy_tree () must be the entry point */
+	assert (NULL != src_orig);
+	assert (NULL != dst_orig);
+
+	/* If src was a link to an entry of the src_orig directory itself,
+	 * create a link to the corresponding entry in the dst_orig
+	 * directory.
+	 */
 	if (strncmp (oldlink, src_orig, strlen (src_orig)) == 0) {
 		size_t len = strlen (dst_orig) + strlen (oldlink) - strlen (src_orig) + 1;
-		char *dummy = (char *) xmalloc (len);
+		dummy = (char *) xmalloc (len);
 		(void) snprintf (dummy, len, "%s%s",
 		                 dst_orig,
 		                 oldlink + strlen (src_orig));
-		free (oldlink);
-		oldlink = dummy;
+		newlink = dummy;
 	}
 
 #ifdef WITH_SELINUX
-	if (set_selinux_file_context (dst) != 0) {
-		free (oldlink);
+	if (set_selinux_file_context (dst->full_path) != 0) {
+		free (dummy);
 		return -1;
 	}
 #endif				/* WITH_SELINUX */
-	if (   (symlink (oldlink, dst) != 0)
-	    || (lchown_if_needed (dst, statp,
-	                          old_uid, new_uid, old_gid, new_gid) != 0)) {
+	if (   (symlinkat (newlink, dst->dirfd, dst->name) != 0)
+	    || (lchownat_if_needed (dst, statp,
+	                            old_uid, new_uid, old_gid, new_gid) != 0)) {
 		/* FIXME: there are no modes on symlinks, right?
 		 *        ACL could be copied, but this would be much more
 		 *        complex than calling perm_copy_file.
@@ -620,19 +1070,17 @@ static int copy_symlink (const char *src, const char *dst,
 		 *        We currently only document that ACL and Extended
 		 *        Attributes are not copied.
 		 */
-		free (oldlink);
+		free (dummy);
 		return -1;
 	}
-	free (oldlink);
+	free (dummy);
 
-#ifdef HAVE_LUTIMES
 	/* 2007-10-18: We don't care about
 	 *  exit status of lutimes because
 	 *  it returns ENOSYS on many system
 	 *  - not implemented
 	 */
-	(void) lutimes (dst, mt);
-#endif				/* HAVE_LUTIMES */
+	(void) utimensat (dst->dirfd, dst->name, mt, AT_SYMLINK_NOFOLLOW);
 
 	return 0;
 }
@@ -645,13 +1093,13 @@ static int copy_symlink (const char *src, const char *dst,
  *
  *	Return 0 on success, -1 on error.
  */
-static int copy_hardlink (const char *dst,
+static int copy_hardlink (const struct path_info *dst,
                           unused bool reset_selinux,
                           struct link_name *lp)
 {
 	/* FIXME: selinux, ACL, Extended Attributes needed? */
 
-	if (link (lp->ln_name, dst) != 0) {
+	if (linkat (AT_FDCWD, lp->ln_name, dst->dirfd, dst->name, 0) != 0) {
 		return -1;
 	}
 
@@ -675,42 +1123,29 @@ static int copy_hardlink (const char *dst,
  *
  *	Return 0 on success, -1 on error.
  */
-static int copy_special (const char *src, const char *dst,
-                         bool reset_selinux,
-                         const struct stat *statp, const struct timeval mt[],
+static int copy_special (const struct path_info *src,
+                         const struct path_info *dst,
+                         bool reset_selinux, bool xattrs,
+                         const struct stat *statp, const struct timespec mt[],
                          uid_t old_uid, uid_t new_uid,
                          gid_t old_gid, gid_t new_gid)
 {
 	int err = 0;
 
 #ifdef WITH_SELINUX
-	if (set_selinux_file_context (dst) != 0) {
+	if (set_selinux_file_context (dst->full_path) != 0) {
 		return -1;
 	}
 #endif				/* WITH_SELINUX */
 
-	if (   (mknod (dst, statp->st_mode & ~07777, statp->st_rdev) != 0)
-	    || (chown_if_needed (dst, statp,
-	                         old_uid, new_uid, old_gid, new_gid) != 0)
-#ifdef WITH_ACL
-	    || (   (perm_copy_file (src, dst, &ctx) != 0)
-	        && (errno != 0))
-#else				/* !WITH_ACL */
-	    || (chmod (dst, statp->st_mode & 07777) != 0)
-#endif				/* !WITH_ACL */
-#ifdef WITH_ATTR
-	/*
-	 * If the third parameter is NULL, all extended attributes
-	 * except those that define Access Control Lists are copied.
-	 * ACLs are excluded by default because copying them between
-	 * file systems with and without ACL support needs some
-	 * additional logic so that no unexpected permissions result.
-	 */
-	    || (   !reset_selinux
-	        && (attr_copy_file (src, dst, NULL, &ctx) != 0)
-	        && (errno != 0))
-#endif				/* WITH_ATTR */
-	    || (utimes (dst, mt) != 0)) {
+	if (   (mknodat (dst->dirfd, dst->name,
+	                 statp->st_mode & ~07777, statp->st_rdev) != 0)
+	    || (lchownat_if_needed (dst, statp,
+	                            old_uid, new_uid, old_gid, new_gid) != 0)
+	    || (copy_attrs (src, -1, dst, -1, statp,
+	                    reset_selinux, xattrs) != 0)
+	    || (utimensat (dst->dirfd, dst->name, mt,
+	                   AT_SYMLINK_NOFOLLOW) != 0)) {
 		err = -1;
 	}
 
@@ -727,37 +1162,96 @@ static int copy_special (const char *src, const char *dst,
  *
  *	Return 0 on success, -1 on error.
  */
-static int copy_file (const char *src, const char *dst,
-                      bool reset_selinux,
-                      const struct stat *statp, const struct timeval mt[],
+static int copy_file (const struct path_info *src,
+                      const struct path_info *dst,
+                      bool reset_selinux, bool xattrs,
+                      const struct stat *statp, const struct timespec mt[],
                       uid_t old_uid, uid_t new_uid,
                       gid_t old_gid, gid_t new_gid)
 {
-	int err = 0;
 	int ifd;
 	int ofd;
-	char buf[1024];
-	ssize_t cnt;
 
-	ifd = open (src, O_RDONLY);
+	SHADOW_PROBE3 (copy_file__entry, src->full_path, dst->full_path,
+	               (long) statp->st_size);
+	ifd = openat (src->dirfd, src->name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
 	if (ifd < 0) {
 		return -1;
 	}
 #ifdef WITH_SELINUX
-	if (set_selinux_file_context (dst) != 0) {
+	if (set_selinux_file_context (dst->full_path) != 0) {
+		(void) close (ifd);
 		return -1;
 	}
 #endif				/* WITH_SELINUX */
-	ofd = open (dst, O_WRONLY | O_CREAT | O_TRUNC, statp->st_mode & 07777);
+	ofd = openat (dst->dirfd, dst->name,
+	              O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+	              statp->st_mode & 07777);
 	if (   (ofd < 0)
 	    || (fchown_if_needed (ofd, statp,
 	                          old_uid, new_uid, old_gid, new_gid) != 0)
+	    || (copy_attrs (src, ifd, dst, ofd, statp,
+	                    reset_selinux, xattrs) != 0)) {
+		(void) close (ifd);
+		if (ofd >= 0) {
+			(void) close (ofd);
+		}
+		return -1;
+	}
+
+	if (copy_pool_queue (ifd, ofd, statp, mt)) {
+		return 0;
+	}
+
+	return copy_file_data (ifd, ofd, statp, mt);
+}
+
+/*
+ * copy_attrs - copy the permissions, the ACLs and the extended attributes
+ *              of a file
+ *
+ *	If ofd is not -1, the files are accessed through ifd and ofd.
+ *	Otherwise, they are accessed through their path.
+ *
+ *	If xattrs is false, src is known to have neither ACLs nor extended
+ *	attributes, and only its mode is copied. Otherwise, the ACLs and
+ *	the extended attributes are only copied if src has some (see
+ *	src_xattrs).
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int copy_attrs (unused const struct path_info *src, unused int ifd,
+                       const struct path_info *dst, int ofd,
+                       const struct stat *statp,
+                       unused bool reset_selinux, unused bool xattrs)
+{
+#if defined(WITH_ACL) || defined(WITH_ATTR)
+	unsigned int meta = 0;
+
+	if (xattrs) {
+		meta = src_xattrs (src->full_path, ifd, statp->st_dev);
+	}
+#endif				/* WITH_ACL || WITH_ATTR */
+
 #ifdef WITH_ACL
-	    || (   (perm_copy_fd (src, ifd, dst, ofd, &ctx) != 0)
-	        && (errno != 0))
-#else				/* !WITH_ACL */
-	    || (fchmod (ofd, statp->st_mode & 07777) != 0)
-#endif				/* !WITH_ACL */
+	if ((meta & SRC_XATTR_ACL) != 0) {
+		if (   (   (ofd >= 0)
+		        ? (perm_copy_fd (src->full_path, ifd,
+		                         dst->full_path, ofd, &ctx) != 0)
+		        : (perm_copy_file (src->full_path, dst->full_path,
+		                           &ctx) != 0))
+		    && (errno != 0)) {
+			return -1;
+		}
+	} else
+#endif				/* WITH_ACL */
+	if (   (ofd >= 0)
+	    ? (fchmod (ofd, statp->st_mode & 07777) != 0)
+	    : (fchmodat (dst->dirfd, dst->name,
+	                 statp->st_mode & 07777, 0) != 0)) {
+		return -1;
+	}
+
 #ifdef WITH_ATTR
 	/*
 	 * If the third parameter is NULL, all extended attributes
@@ -766,40 +1260,248 @@ static int copy_file (const char *src, const char *dst,
 	 * file systems with and without ACL support needs some
 	 * additional logic so that no unexpected permissions result.
 	 */
-	    || (   !reset_selinux
-	        && (attr_copy_fd (src, ifd, dst, ofd, NULL, &ctx) != 0)
-	        && (errno != 0))
+	if (   ((meta & SRC_XATTR_OTHER) != 0) && !reset_selinux
+	    && (   (ofd >= 0)
+	        ? (attr_copy_fd (src->full_path, ifd,
+	                         dst->full_path, ofd, NULL, &ctx) != 0)
+	        : (attr_copy_file (src->full_path, dst->full_path,
+	                           NULL, &ctx) != 0))
+	    && (errno != 0)) {
+		return -1;
+	}
 #endif				/* WITH_ATTR */
-	   ) {
+
+	return 0;
+}
+
+/*
+ * copy_file_data - copy the content of a file
+ *
+ *	Copy the content of ifd to ofd and set the access and
+ *	modification times of ofd to mt. ifd and ofd are closed.
+ *
+ *	The copy_file__return probe fires here, where the copy of a file
+ *	ends, which may be in a thread of the copy pool.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int copy_file_data (int ifd, int ofd, const struct stat *statp,
+                           const struct timespec mt[])
+{
+	int ret = 0;
+
+	if (copy_data (ifd, ofd, statp) != 0) {
 		(void) close (ifd);
-		return -1;
+		(void) close (ofd);
+		ret = -1;
+	} else {
+		(void) close (ifd);
+		if (futimens (ofd, mt) != 0) {
+			(void) close (ofd);
+			ret = -1;
+		} else if (close (ofd) != 0) {
+			ret = -1;
+		}
 	}
 
-	while ((cnt = read (ifd, buf, sizeof buf)) > 0) {
-		if (write (ofd, buf, (size_t)cnt) != cnt) {
-			(void) close (ifd);
-			return -1;
+	SHADOW_PROBE2 (copy_file__return, ret, (long) statp->st_size);
+	return ret;
+}
+
+/*
+ * Methods used by copy_range(), from the fastest to the slowest one.
+ * When a method is not supported for a pair of files, the next one is
+ * used for the rest of the copy.
+ */
+enum copy_method {
+	COPY_FILE_RANGE,
+	COPY_SENDFILE,
+	COPY_READ_WRITE
+};
+
+#define COPY_BUFSIZE	(128 * 1024)
+
+/*
+ * copy_range - Copy len bytes at offset off of ifd to the same offset of
+ * ofd.
+ *
+ *	The copy stops early if the end of ifd is reached.
+ *
+ *	*buf is the buffer of the read/write loop. It is allocated when
+ *	first needed, and must be freed by the caller.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int copy_range (int ifd, int ofd, off_t off, off_t len,
+                       enum copy_method *method, char **buf)
+{
+	off_t end = off + len;
+	ssize_t cnt;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while ((COPY_FILE_RANGE == *method) && (off < end)) {
+		off_t off_out = off;
+
+		cnt = copy_file_range (ifd, &off, ofd, &off_out,
+		                       (size_t) (end - off), 0);
+		if (0 == cnt) {
+			return 0;
 		}
+		if (cnt < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			if (   (ENOSYS != errno) && (EXDEV != errno)
+			    && (EINVAL != errno) && (EOPNOTSUPP != errno)) {
+				return -1;
+			}
+			*method = COPY_SENDFILE;
+		} else {
+			tree_progress_add (0, (unsigned long long) cnt);
+		}
+	}
+#else				/* !HAVE_COPY_FILE_RANGE */
+	if (COPY_FILE_RANGE == *method) {
+		*method = COPY_SENDFILE;
 	}
+#endif				/* !HAVE_COPY_FILE_RANGE */
 
-	(void) close (ifd);
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+	/* sendfile() writes at the file offset of ofd */
+	if (   (COPY_SENDFILE == *method) && (off < end)
+	    && (lseek (ofd, off, SEEK_SET) != off)) {
+		*method = COPY_READ_WRITE;
+	}
+	while ((COPY_SENDFILE == *method) && (off < end)) {
+		cnt = sendfile (ofd, ifd, &off, (size_t) (end - off));
+		if (0 == cnt) {
+			return 0;
+		}
+		if (cnt < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			if ((EINVAL != errno) && (ENOSYS != errno)) {
+				return -1;
+			}
+			*method = COPY_READ_WRITE;
+		} else {
+			tree_progress_add (0, (unsigned long long) cnt);
+		}
+	}
+#else				/* !HAVE_SENDFILE || !HAVE_SYS_SENDFILE_H */
+	if (COPY_SENDFILE == *method) {
+		*method = COPY_READ_WRITE;
+	}
+#endif				/* !HAVE_SENDFILE || !HAVE_SYS_SENDFILE_H */
 
-#ifdef HAVE_FUTIMES
-	if (futimes (ofd, mt) != 0) {
-		return -1;
+	if ((off < end) && (NULL == *buf)) {
+		*buf = malloc (COPY_BUFSIZE);
+		if (NULL == *buf) {
+			return -1;
+		}
 	}
-#endif				/* HAVE_FUTIMES */
+	while (off < end) {
+		ssize_t wcnt;
+		size_t n = COPY_BUFSIZE;
+		size_t done;
 
-	if (close (ofd) != 0) {
-		return -1;
+		if ((off_t) n > end - off) {
+			n = (size_t) (end - off);
+		}
+		cnt = pread (ifd, *buf, n, off);
+		if (0 == cnt) {
+			return 0;
+		}
+		if (cnt < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return -1;
+		}
+		for (done = 0; done < (size_t) cnt; done += (size_t) wcnt) {
+			wcnt = pwrite (ofd, *buf + done, (size_t) cnt - done,
+			               off + (off_t) done);
+			if (wcnt < 0) {
+				if (EINTR == errno) {
+					wcnt = 0;
+					continue;
+				}
+				return -1;
+			}
+		}
+		off += cnt;
+		tree_progress_add (0, (unsigned long long) cnt);
 	}
 
-#ifndef HAVE_FUTIMES
-	if (utimes(dst, mt) != 0) {
-		return -1;
+	return 0;
+}
+
+/*
+ * copy_data - Copy the content of ifd to the empty file ofd.
+ *
+ *	The file is cloned if the file system supports it. Otherwise, the
+ *	data are copied with copy_range(). If the file is sparse, only its
+ *	data segments are copied, so that its holes are preserved.
+ *
+ *	statp is the status of ifd.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int copy_data (int ifd, int ofd, const struct stat *statp)
+{
+	enum copy_method method = COPY_FILE_RANGE;
+	char *buf = NULL;
+	int err = 0;
+
+	if (0 == statp->st_size) {
+		return 0;
 	}
-#endif				/* !HAVE_FUTIMES */
 
+#ifdef FICLONE
+	if (ioctl (ofd, FICLONE, ifd) == 0) {
+		tree_progress_add (0, (unsigned long long) statp->st_size);
+		return 0;
+	}
+#endif				/* FICLONE */
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	if ((statp->st_blocks * 512) < statp->st_size) {
+		off_t data, hole = 0;
+
+		for (;;) {
+			data = lseek (ifd, hole, SEEK_DATA);
+			if (data < 0) {
+				if (ENXIO == errno) {
+					/* Only a hole remains */
+					break;
+				}
+				if (0 == hole) {
+					/* Not supported, copy all the file */
+					goto copy_all;
+				}
+				err = -1;
+				break;
+			}
+			hole = lseek (ifd, data, SEEK_HOLE);
+			if (   (hole < 0)
+			    || (copy_range (ifd, ofd, data, hole - data,
+			                    &method, &buf) != 0)) {
+				err = -1;
+				break;
+			}
+		}
+		if ((0 == err) && (ftruncate (ofd, statp->st_size) != 0)) {
+			err = -1;
+		}
+		free (buf);
+		return err;
+	}
+copy_all:
+#endif				/* SEEK_DATA && SEEK_HOLE */
+
+	err = copy_range (ifd, ofd, 0, statp->st_size, &method, &buf);
+	free (buf);
 	return err;
 }
 
@@ -833,7 +1535,833 @@ static int chown_function ## _if_needed (type_dst dst,                 \
 	return chown_function (dst, tmpuid, tmpgid);                   \
 }
 
-def_chown_if_needed (chown, const char *)
-def_chown_if_needed (lchown, const char *)
+static int lchownat (const struct path_info *dst, uid_t uid, gid_t gid)
+{
+	return fchownat (dst->dirfd, dst->name, uid, gid, AT_SYMLINK_NOFOLLOW);
+}
+
+def_chown_if_needed (lchownat, const struct path_info *)
 def_chown_if_needed (fchown, int)
 
+
+/*
+ * Snapshots of the skeleton directories
+ *
+ * useradd -m copies the same skeleton again for every new user.
+ * copy_tree_cached() can then replay a snapshot of the skeleton instead
+ * of walking it: the snapshot lists the entries in the order of the
+ * walk, with their status, the targets of the symbolic links, the
+ * entries which are links to the same file, and the entries which have
+ * ACLs or extended attributes. The content of the regular files is still
+ * copied (or cloned) from the skeleton.
+ *
+ * The snapshot is stored in <skeleton>.cache. It is only used if the
+ * cache file exists, is owned by root and is not writable by the group
+ * or others, and if the skeleton and all its subdirectories are still
+ * the directories it was built from (same device, inode, mode,
+ * modification and change times). Since no entry can be added, removed
+ * or renamed without changing its directory, this only leaves the files
+ * changed in place, whose status is checked again when they are copied.
+ * Otherwise, the skeleton is scanned again, and the cache is rebuilt if
+ * the real and effective users are root.
+ *
+ * Like the image of login.defs, it uses the native byte order and is
+ * rebuilt when its magic does not match.
+ */
+#define SKEL_CACHE_MAGIC "shskel\0\1"
+
+#define SKEL_XATTRS	0x1	/* ACLs or extended attributes */
+
+struct skel_header {
+	char magic[8];
+	uint64_t count;		/* number of records */
+	uint64_t length;	/* size of the records */
+};
+
+/*
+ * The first record is the skeleton itself, at depth 0. The path of the
+ * other entries is relative to the skeleton. It follows the record, and
+ * is followed by the target of the symbolic links. The records are
+ * padded to a multiple of 8 bytes.
+ */
+struct skel_record {
+	uint32_t size;		/* size of the record and of its strings */
+	uint32_t depth;		/* depth of the entry in the tree */
+	uint32_t name;		/* offset of the base name in the path */
+	uint32_t target;	/* offset of the target of a symbolic link */
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t flags;
+	uint64_t rdev;
+	uint64_t dev;
+	uint64_t ino;
+	int64_t link;		/* index of the first link to the file, or -1 */
+	int64_t atime_sec;
+	int64_t atime_nsec;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+};
+
+struct skel_snapshot {
+	/*@only@*/char *data;	/* the header and the records */
+	size_t length;
+	size_t size;		/* allocated size, 0 if data is mapped */
+	/*@only@*/size_t *records;	/* offset of each record */
+	size_t count;
+	size_t max_depth;
+};
+
+static const struct skel_record *skel_record (const struct skel_snapshot *snap,
+                                              size_t i)
+{
+	return (const struct skel_record *) (snap->data + snap->records[i]);
+}
+
+static const char *skel_path (const struct skel_record *r)
+{
+	return (const char *) (r + 1);
+}
+
+static void skel_free (struct skel_snapshot *snap)
+{
+	if (NULL != snap->data) {
+		if (0 == snap->size) {
+			(void) munmap (snap->data, snap->length);
+		} else {
+			free (snap->data);
+		}
+	}
+	free (snap->records);
+	memzero (snap, sizeof *snap);
+}
+
+static void stat_ctime (const struct stat *sb, int64_t *sec, int64_t *nsec)
+{
+	*sec = (int64_t) sb->st_ctime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	*nsec = (int64_t) sb->st_ctim.tv_nsec;
+#else				/* !HAVE_STRUCT_STAT_ST_MTIM */
+	*nsec = 0;
+#endif				/* !HAVE_STRUCT_STAT_ST_MTIM */
+}
+
+/*
+ * skel_same - check if a file is still the file recorded in r
+ */
+static bool skel_same (const struct skel_record *r, const struct stat *sb)
+{
+	struct timespec mt[2];
+	int64_t sec, nsec;
+
+	stat_times (sb, mt);
+	stat_ctime (sb, &sec, &nsec);
+	return    (r->dev == (uint64_t) sb->st_dev)
+	       && (r->ino == (uint64_t) sb->st_ino)
+	       && (r->mode == (uint32_t) sb->st_mode)
+	       && (r->mtime_sec == (int64_t) mt[1].tv_sec)
+	       && (r->mtime_nsec == (int64_t) mt[1].tv_nsec)
+	       && (r->ctime_sec == sec)
+	       && (r->ctime_nsec == nsec);
+}
+
+/*
+ * skel_stat - get the status and the times recorded in r
+ */
+static void skel_stat (const struct skel_record *r,
+                       struct stat *sb, struct timespec mt[])
+{
+	memzero (sb, sizeof *sb);
+	sb->st_dev = (dev_t) r->dev;
+	sb->st_ino = (ino_t) r->ino;
+	sb->st_mode = (mode_t) r->mode;
+	sb->st_uid = (uid_t) r->uid;
+	sb->st_gid = (gid_t) r->gid;
+	sb->st_rdev = (dev_t) r->rdev;
+	mt[0].tv_sec = (time_t) r->atime_sec;
+	mt[0].tv_nsec = (long) r->atime_nsec;
+	mt[1].tv_sec = (time_t) r->mtime_sec;
+	mt[1].tv_nsec = (long) r->mtime_nsec;
+}
+
+/*
+ * skel_add - add the record of an entry to a snapshot
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int skel_add (struct skel_snapshot *snap, uint32_t depth,
+                     const char *path, size_t name,
+                     /*@null@*/const char *target,
+                     const struct stat *sb, int64_t link, uint32_t flags)
+{
+	struct skel_record r;
+	struct timespec mt[2];
+	size_t path_len = strlen (path) + 1;
+	size_t target_len = (NULL != target) ? strlen (target) + 1 : 0;
+	size_t size = (sizeof r + path_len + target_len + 7) & ~(size_t) 7;
+
+	if (size > UINT32_MAX) {
+		return -1;
+	}
+	if (snap->length + size > snap->size) {
+		size_t len = (0 == snap->size) ? 4096 : snap->size;
+		char *data;
+
+		while (len < snap->length + size) {
+			len *= 2;
+		}
+		data = realloc (snap->data, len);
+		if (NULL == data) {
+			return -1;
+		}
+		snap->data = data;
+		snap->size = len;
+	}
+	if ((snap->count & 255) == 0) {
+		size_t *records;
+
+		records = realloc (snap->records,
+		                   (snap->count + 256) * sizeof *records);
+		if (NULL == records) {
+			return -1;
+		}
+		snap->records = records;
+	}
+
+	memzero (&r, sizeof r);
+	r.size = (uint32_t) size;
+	r.depth = depth;
+	r.name = (uint32_t) name;
+	r.target = (NULL != target) ? (uint32_t) (sizeof r + path_len) : 0;
+	r.mode = (uint32_t) sb->st_mode;
+	r.uid = (uint32_t) sb->st_uid;
+	r.gid = (uint32_t) sb->st_gid;
+	r.flags = flags;
+	r.rdev = (uint64_t) sb->st_rdev;
+	r.dev = (uint64_t) sb->st_dev;
+	r.ino = (uint64_t) sb->st_ino;
+	r.link = link;
+	stat_times (sb, mt);
+	r.atime_sec = (int64_t) mt[0].tv_sec;
+	r.atime_nsec = (int64_t) mt[0].tv_nsec;
+	r.mtime_sec = (int64_t) mt[1].tv_sec;
+	r.mtime_nsec = (int64_t) mt[1].tv_nsec;
+	stat_ctime (sb, &r.ctime_sec, &r.ctime_nsec);
+
+	memzero (snap->data + snap->length, size);
+	memcpy (snap->data + snap->length, &r, sizeof r);
+	memcpy (snap->data + snap->length + sizeof r, path, path_len);
+	if (NULL != target) {
+		memcpy (snap->data + snap->length + r.target, target,
+		        target_len);
+	}
+	snap->records[snap->count] = snap->length;
+	snap->count++;
+	snap->length += size;
+	if (depth > snap->max_depth) {
+		snap->max_depth = depth;
+	}
+
+	return 0;
+}
+
+/*
+ * skel_scan_dir - add the entries of the directory open at fd to a
+ *                 snapshot
+ *
+ *	path is the path of the directory, relative to the skeleton
+ *	src_root. fd is closed.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int skel_scan_dir (struct skel_snapshot *snap,
+                          unused const char *src_root,
+                          int fd, const char *path, uint32_t depth)
+{
+	int err = 0;
+	struct dir_batch batch;
+	ssize_t n;
+	ssize_t i;
+
+	dir_batch_init (&batch, fd);
+	while ((0 == err) && ((n = dir_batch_next (&batch)) != 0)) {
+		if (n < 0) {
+			err = -1;
+			break;
+		}
+		for (i = 0; (0 == err) && (i < n); i++) {
+			const struct dir_batch_entry *ent = &batch.ents[i];
+			struct stat sb;
+			struct link_name *lp;
+			char *sub;
+			char *target = NULL;
+			int64_t link = -1;
+			uint32_t flags = 0;
+			size_t len;
+
+			/* copy_entry() skips the entries it cannot stat */
+			if (fstatat (fd, ent->name, &sb,
+			             AT_SYMLINK_NOFOLLOW) == -1) {
+				continue;
+			}
+
+			len = strlen (path) + strlen (ent->name) + 2;
+			sub = (char *) malloc (len);
+			if (NULL == sub) {
+				err = -1;
+				break;
+			}
+			if (0 == depth) {
+				(void) snprintf (sub, len, "%s", ent->name);
+			} else {
+				(void) snprintf (sub, len, "%s/%s",
+				                 path, ent->name);
+			}
+
+			if (S_ISLNK (sb.st_mode)) {
+				target = readlink_malloc (fd, ent->name);
+				if (NULL == target) {
+					err = -1;
+				}
+			} else if (!S_ISDIR (sb.st_mode) && (sb.st_nlink > 1)) {
+				lp = (0 != links_count) ?
+				     *find_link (sb.st_dev, sb.st_ino) : NULL;
+				if (NULL != lp) {
+					link = (int64_t) lp->ln_index;
+				} else {
+					lp = (struct link_name *)
+					     xmalloc (sizeof *lp);
+					lp->ln_dev = sb.st_dev;
+					lp->ln_ino = sb.st_ino;
+					lp->ln_count = 0;
+					lp->ln_name = NULL;
+					lp->ln_index = snap->count;
+					add_link (lp);
+				}
+			}
+#if defined(WITH_ACL) || defined(WITH_ATTR)
+			if (!S_ISLNK (sb.st_mode)) {
+				char *full;
+
+				len = strlen (src_root) + strlen (sub) + 2;
+				full = (char *) xmalloc (len);
+				(void) snprintf (full, len, "%s/%s",
+				                 src_root, sub);
+				/* A failure is handled as if there were attributes */
+				if (src_xattrs (full, -1, sb.st_dev) != 0) {
+					flags |= SKEL_XATTRS;
+				}
+				free (full);
+			}
+#endif				/* WITH_ACL || WITH_ATTR */
+
+			if (   (0 == err)
+			    && (skel_add (snap, depth + 1, sub,
+			                  (0 == depth) ? 0 : strlen (path) + 1,
+			                  target, &sb, link, flags) != 0)) {
+				err = -1;
+			}
+			if ((0 == err) && S_ISDIR (sb.st_mode)) {
+				int subfd;
+
+				subfd = openat (fd, ent->name,
+				                O_RDONLY | O_DIRECTORY
+				                | O_NOFOLLOW | O_CLOEXEC);
+				if (   (subfd < 0)
+				    || (skel_scan_dir (snap, src_root, subfd,
+				                       sub, depth + 1) != 0)) {
+					err = -1;
+				}
+			}
+			free (target);
+			free (sub);
+		}
+	}
+	dir_batch_free (&batch);
+	(void) close (fd);
+
+	return err;
+}
+
+/*
+ * skel_scan - build the snapshot of the skeleton src_root, open at
+ *             src_fd
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int skel_scan (struct skel_snapshot *snap,
+                      const char *src_root, int src_fd)
+{
+	struct stat sb;
+	int fd;
+	int err;
+
+	memzero (snap, sizeof *snap);
+	/* The records follow the header */
+	snap->length = sizeof (struct skel_header);
+
+	fd = openat (src_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	if (   (fstat (fd, &sb) != 0)
+	    || (skel_add (snap, 0, ".", 0, NULL, &sb, -1, 0) != 0)) {
+		(void) close (fd);
+		skel_free (snap);
+		return -1;
+	}
+	err = skel_scan_dir (snap, src_root, fd, ".", 0);
+	free_links ();
+	if (0 != err) {
+		skel_free (snap);
+	}
+
+	return err;
+}
+
+/*
+ * skel_load - load the snapshot of the skeleton open at src_fd
+ *
+ *	It returns false if there is no valid and up to date snapshot.
+ */
+static bool skel_load (const char *cache, int src_fd,
+                       struct skel_snapshot *snap)
+{
+	const struct skel_header *hp;
+	struct stat csb;
+	struct stat sb;
+	size_t off;
+	size_t i;
+	int fd;
+
+	memzero (snap, sizeof *snap);
+	fd = open (cache, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	if (   (fstat (fd, &csb) != 0)
+	    || !S_ISREG (csb.st_mode)
+	    || (0 != csb.st_uid)
+	    || ((csb.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+	    || ((unsigned long long) csb.st_size > SIZE_MAX)
+	    || ((size_t) csb.st_size < sizeof *hp)) {
+		(void) close (fd);
+		return false;
+	}
+	snap->data = mmap (NULL, (size_t) csb.st_size, PROT_READ, MAP_PRIVATE,
+	                   fd, 0);
+	(void) close (fd);
+	if (MAP_FAILED == snap->data) {
+		snap->data = NULL;
+		return false;
+	}
+	snap->length = (size_t) csb.st_size;
+
+	hp = (const struct skel_header *) snap->data;
+	if (   (memcmp (hp->magic, SKEL_CACHE_MAGIC, sizeof hp->magic) != 0)
+	    || (hp->length != snap->length - sizeof *hp)
+	    || (0 == hp->count)
+	    || (hp->count > hp->length / sizeof (struct skel_record))) {
+		goto fail;
+	}
+	snap->records = malloc ((size_t) hp->count * sizeof *snap->records);
+	if (NULL == snap->records) {
+		goto fail;
+	}
+
+	/*
+	 * Check that the records are complete and consistent.
+	 */
+	for (off = sizeof *hp, i = 0; i < hp->count; i++) {
+		const struct skel_record *r;
+		const struct skel_record *prev;
+		const char *path;
+		size_t path_len;
+
+		if (snap->length - off < sizeof *r) {
+			goto fail;
+		}
+		r = (const struct skel_record *) (snap->data + off);
+		if (   (r->size < sizeof *r)
+		    || ((r->size & 7) != 0)
+		    || (r->size > snap->length - off)) {
+			goto fail;
+		}
+		path = skel_path (r);
+		path_len = strnlen (path, r->size - sizeof *r);
+		if (   (path_len == r->size - sizeof *r)
+		    || (r->name >= path_len)
+		    || ((0 != r->name) && ('/' != path[r->name - 1]))) {
+			goto fail;
+		}
+		if (0 != r->target) {
+			if (   !S_ISLNK (r->mode)
+			    || (r->target != sizeof *r + path_len + 1)
+			    || (r->target >= r->size)
+			    || (memchr ((const char *) r + r->target, '\0',
+			                r->size - r->target) == NULL)) {
+				goto fail;
+			}
+		} else if (S_ISLNK (r->mode)) {
+			goto fail;
+		}
+		if (0 == i) {
+			if ((0 != r->depth) || !S_ISDIR (r->mode)) {
+				goto fail;
+			}
+		} else {
+			prev = skel_record (snap, i - 1);
+			if (   (0 == r->depth)
+			    || (r->depth > prev->depth + (S_ISDIR (prev->mode) ? 1 : 0))) {
+				goto fail;
+			}
+		}
+		if ((r->link < -1) || (r->link >= (int64_t) i)) {
+			goto fail;
+		}
+		if (-1 != r->link) {
+			const struct skel_record *lr;
+
+			lr = skel_record (snap, (size_t) r->link);
+			if (   S_ISDIR (r->mode) || S_ISLNK (r->mode)
+			    || S_ISDIR (lr->mode) || S_ISLNK (lr->mode)
+			    || (-1 != lr->link)) {
+				goto fail;
+			}
+		}
+		snap->records[i] = off;
+		snap->count = i + 1;
+		if (r->depth > snap->max_depth) {
+			snap->max_depth = r->depth;
+		}
+		off += r->size;
+	}
+	if (off != snap->length) {
+		goto fail;
+	}
+
+	/*
+	 * Check that the directories (and the special files) did not
+	 * change.
+	 */
+	for (i = 0; i < snap->count; i++) {
+		const struct skel_record *r = skel_record (snap, i);
+
+		if (   (S_ISREG (r->mode) || S_ISLNK (r->mode))
+		    || (-1 != r->link)) {
+			continue;
+		}
+		if (0 == i) {
+			if (fstat (src_fd, &sb) != 0) {
+				goto fail;
+			}
+		} else if (fstatat (src_fd, skel_path (r), &sb,
+		                    AT_SYMLINK_NOFOLLOW) != 0) {
+			goto fail;
+		}
+		if (!skel_same (r, &sb)) {
+			goto fail;
+		}
+	}
+
+	return true;
+
+      fail:
+	skel_free (snap);
+	return false;
+}
+
+/*
+ * skel_save - write a snapshot to the cache file
+ *
+ *	Failures are ignored: the skeleton is scanned again the next time.
+ */
+static void skel_save (const char *cache, const struct skel_snapshot *snap)
+{
+	char tmp[1024];
+	struct skel_header h;
+	size_t i;
+	FILE *fp;
+	bool ok;
+
+	/*
+	 * A change of the skeleton in the same second, after the snapshot
+	 * was built, could not be detected on the file systems which do
+	 * not store the nanoseconds.
+	 */
+	for (i = 0; i < snap->count; i++) {
+		if (skel_record (snap, i)->ctime_sec >= (int64_t) time (NULL) - 1) {
+			return;
+		}
+	}
+
+	if ((size_t) snprintf (tmp, sizeof tmp, "%s+", cache) >= sizeof tmp) {
+		return;
+	}
+	memzero (&h, sizeof h);
+	memcpy (h.magic, SKEL_CACHE_MAGIC, sizeof h.magic);
+	h.count = snap->count;
+	h.length = snap->length - sizeof h;
+
+	fp = fopen (tmp, "w");
+	if (NULL == fp) {
+		return;
+	}
+	ok =    (fchmod (fileno (fp), 0644) == 0)
+	     && (fwrite (&h, sizeof h, 1, fp) == 1)
+	     && (fwrite (snap->data + sizeof h, h.length, 1, fp) == 1);
+	if (   (fclose (fp) != 0)
+	    || !ok
+	    || (rename (tmp, cache) != 0)) {
+		(void) unlink (tmp);
+	}
+}
+
+/*
+ * skel_replay - create the entries of a snapshot in dst_root
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int skel_replay (const struct skel_snapshot *snap,
+                        const char *src_root, int src_fd,
+                        const char *dst_root, bool reset_selinux,
+                        uid_t old_uid, uid_t new_uid,
+                        gid_t old_gid, gid_t new_gid)
+{
+	int err = 0;
+	int *src_fds;
+	int *dst_fds;
+	size_t top = 0;
+	size_t i;
+
+	src_fds = (int *) xmalloc ((snap->max_depth + 1) * sizeof *src_fds);
+	dst_fds = (int *) xmalloc ((snap->max_depth + 1) * sizeof *dst_fds);
+	src_fds[0] = src_fd;
+	dst_fds[0] = open (dst_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dst_fds[0] < 0) {
+		free (src_fds);
+		free (dst_fds);
+		return -1;
+	}
+
+	for (i = 1; (0 == err) && (i < snap->count); i++) {
+		const struct skel_record *r = skel_record (snap, i);
+		const char *path = skel_path (r);
+		struct path_info src;
+		struct path_info dst;
+		struct stat sb;
+		struct timespec mt[2];
+		char *src_name;
+		char *dst_name;
+		bool counted = false;
+		size_t src_len = strlen (src_root) + strlen (path) + 2;
+		size_t dst_len = strlen (dst_root) + strlen (path) + 2;
+
+		/* Close the directories whose entries were all created */
+		while (top >= r->depth) {
+			(void) close (src_fds[top]);
+			(void) close (dst_fds[top]);
+			top--;
+		}
+
+		src_name = (char *) xmalloc (src_len);
+		dst_name = (char *) xmalloc (dst_len);
+		(void) snprintf (src_name, src_len, "%s/%s", src_root, path);
+		(void) snprintf (dst_name, dst_len, "%s/%s", dst_root, path);
+		src.full_path = src_name;
+		src.dirfd = src_fds[top];
+		src.name = path + r->name;
+		dst.full_path = dst_name;
+		dst.dirfd = dst_fds[top];
+		dst.name = path + r->name;
+		skel_stat (r, &sb, mt);
+
+		if (S_ISDIR (sb.st_mode)) {
+#ifdef WITH_SELINUX
+			if (set_selinux_file_context (dst.full_path) != 0) {
+				err = -1;
+			} else
+#endif				/* WITH_SELINUX */
+			if (   (mkdirat (dst.dirfd, dst.name, sb.st_mode) != 0)
+			    || (lchownat_if_needed (&dst, &sb,
+			                            old_uid, new_uid,
+			                            old_gid, new_gid) != 0)
+			    || (copy_attrs (&src, -1, &dst, -1, &sb, reset_selinux,
+			                    (r->flags & SKEL_XATTRS) != 0) != 0)) {
+				err = -1;
+			} else {
+				int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+				            | O_CLOEXEC;
+
+				src_fds[top + 1] = openat (src.dirfd, src.name,
+				                           flags);
+				dst_fds[top + 1] = openat (dst.dirfd, dst.name,
+				                           flags);
+				if (   (src_fds[top + 1] >= 0)
+				    && (dst_fds[top + 1] >= 0)) {
+					top++;
+					tree_progress_path (src.full_path);
+				} else {
+					if (src_fds[top + 1] >= 0) {
+						(void) close (src_fds[top + 1]);
+					}
+					if (dst_fds[top + 1] >= 0) {
+						(void) close (dst_fds[top + 1]);
+					}
+					err = -1;
+				}
+			}
+		}
+#ifdef	S_IFLNK
+		else if (S_ISLNK (sb.st_mode)) {
+			err = make_symlink ((const char *) r + r->target,
+			                    &dst, &sb, mt,
+			                    old_uid, new_uid, old_gid, new_gid);
+		}
+#endif				/* S_IFLNK */
+		else if (-1 != r->link) {
+			/* FIXME: selinux, ACL, Extended Attributes needed? */
+			if (linkat (dst_fds[0],
+			            skel_path (skel_record (snap,
+			                                    (size_t) r->link)),
+			            dst.dirfd, dst.name, 0) != 0) {
+				err = -1;
+			}
+		} else if (fstatat (src.dirfd, src.name, &sb,
+		                    AT_SYMLINK_NOFOLLOW) == -1) {
+			/* If we cannot stat the file, do not care. */
+		} else if (!skel_same (r, &sb)) {
+			/* The file was changed in place (copy_entry()
+			 * reports its progress) */
+			err = copy_entry (&src, &dst, reset_selinux,
+			                  old_uid, new_uid, old_gid, new_gid);
+			counted = true;
+		} else {
+			stat_times (&sb, mt);
+			if (S_ISREG (sb.st_mode)) {
+				err = copy_file (&src, &dst, reset_selinux,
+				                 (r->flags & SKEL_XATTRS) != 0,
+				                 &sb, mt, old_uid, new_uid,
+				                 old_gid, new_gid);
+			} else {
+				err = copy_special (&src, &dst, reset_selinux,
+				                    (r->flags & SKEL_XATTRS) != 0,
+				                    &sb, mt, old_uid, new_uid,
+				                    old_gid, new_gid);
+			}
+		}
+
+		if ((0 == err) && !counted) {
+			tree_progress_add (1, 0);
+		}
+		free (src_name);
+		free (dst_name);
+	}
+	while (top > 0) {
+		(void) close (src_fds[top]);
+		(void) close (dst_fds[top]);
+		top--;
+	}
+
+	/*
+	 * The times of the directories are set once all their entries
+	 * were created.
+	 */
+	for (i = snap->count - 1; (0 == err) && (i > 0); i--) {
+		const struct skel_record *r = skel_record (snap, i);
+		struct stat sb;
+		struct timespec mt[2];
+
+		if (!S_ISDIR (r->mode)) {
+			continue;
+		}
+		skel_stat (r, &sb, mt);
+		if (utimensat (dst_fds[0], skel_path (r), mt,
+		               AT_SYMLINK_NOFOLLOW) != 0) {
+			err = -1;
+		}
+	}
+
+	(void) close (dst_fds[0]);
+	free (src_fds);
+	free (dst_fds);
+
+	return err;
+}
+
+/*
+ * copy_tree_cached - copy the files of a skeleton directory
+ *
+ *	copy_tree_cached() copies the entries of src_root to the existing
+ *	dst_root directory, like copy_tree() with copy_root set to false.
+ *
+ *	If the <src_root>.cache file exists, src_root is copied from the
+ *	snapshot stored in this file, which is rebuilt when src_root
+ *	changes.
+ */
+int copy_tree_cached (const char *src_root, const char *dst_root,
+                      bool reset_selinux,
+                      uid_t old_uid, uid_t new_uid,
+                      gid_t old_gid, gid_t new_gid)
+{
+	struct skel_snapshot snap;
+	char cache[1024];
+	size_t len = strlen (src_root);
+	int src_fd;
+	int err;
+
+	/* The cache is next to the skeleton, not in it */
+	while ((len > 1) && ('/' == src_root[len - 1])) {
+		len--;
+	}
+	if (   ('/' == src_root[len - 1])
+	    || ((size_t) snprintf (cache, sizeof cache, "%.*s.cache",
+	                           (int) len, src_root) >= sizeof cache)
+	    || (access (cache, F_OK) != 0)) {
+		return copy_tree (src_root, dst_root, false, reset_selinux,
+		                  old_uid, new_uid, old_gid, new_gid);
+	}
+
+	src_fd = open (src_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (src_fd < 0) {
+		return -1;
+	}
+	if (!skel_load (cache, src_fd, &snap)) {
+		if (skel_scan (&snap, src_root, src_fd) != 0) {
+			(void) close (src_fd);
+			return copy_tree (src_root, dst_root, false,
+			                  reset_selinux,
+			                  old_uid, new_uid, old_gid, new_gid);
+		}
+		if ((0 == getuid ()) && (0 == geteuid ())) {
+			skel_save (cache, &snap);
+		}
+	}
+
+	src_orig = src_root;
+	dst_orig = dst_root;
+	copy_pool_start ();
+
+	err = skel_replay (&snap, src_root, src_fd, dst_root, reset_selinux,
+	                   old_uid, new_uid, old_gid, new_gid);
+
+	if (copy_pool_stop () != 0) {
+		err = -1;
+	}
+	src_orig = NULL;
+	dst_orig = NULL;
+	free_links ();
+	skel_free (&snap);
+	(void) close (src_fd);
+
+#ifdef WITH_SELINUX
+	/* Reset SELinux to create files with default contexts. */
+	if (reset_selinux_file_context () != 0) {
+		err = -1;
+	}
+#endif				/* WITH_SELINUX */
+
+	return err;
+}
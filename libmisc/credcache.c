@@ -0,0 +1,212 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pwd.h>
+#include <grp.h>
+#include "prototypes.h"
+#include "defines.h"
+
+/*
+ * Credential cache of su, login and newgrp
+ *
+ * While a user is authenticated, the same account and groups are looked
+ * up several times, and each lookup may be a remote NSS request. The
+ * results, including the failed lookups, are kept until
+ * cred_invalidate() is called. The callers shall invalidate the cache
+ * when the entries may have changed, e.g. after a password change or
+ * after PAM selected the account.
+ *
+ * Like the xget* functions, the lookups return copies of the entries,
+ * which shall be freed by the caller, with pw_free(), spw_free() or
+ * gr_free(). The cache itself keeps the packed results of the xget*
+ * functions.
+ */
+enum cred_kind {
+	CRED_PWNAM,
+	CRED_PWUID,
+	CRED_SPNAM,
+	CRED_GRNAM,
+	CRED_GRGID,
+	CRED_KINDS
+};
+
+struct cred_entry {
+	/*@null@*/ /*@only@*/char *name;	/* NULL for an ID */
+	id_t id;
+	/*@null@*/ /*@only@*/void *ent;	/* NULL if it does not exist */
+	/*@null@*/ /*@only@*/struct cred_entry *next;
+};
+
+static /*@null@*/ /*@only@*/struct cred_entry *cache[CRED_KINDS];
+
+static /*@null@*/struct cred_entry *cred_find (enum cred_kind kind,
+                                               /*@null@*/const char *name,
+                                               id_t id)
+{
+	struct cred_entry *e;
+
+	for (e = cache[kind]; NULL != e; e = e->next) {
+		if (   (NULL == name)
+		    ? (e->id == id)
+		    : (strcmp (e->name, name) == 0)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static struct cred_entry *cred_add (enum cred_kind kind,
+                                    /*@null@*/const char *name,
+                                    id_t id,
+                                    /*@null@*/ /*@only@*/void *ent)
+{
+	struct cred_entry *e;
+
+	e = (struct cred_entry *) xmalloc (sizeof (*e));
+	e->name = (NULL != name) ? xstrdup (name) : NULL;
+	e->id = id;
+	e->ent = ent;
+	e->next = cache[kind];
+	cache[kind] = e;
+	return e;
+}
+
+/*
+ * cred_copy - check the copy of an entry of the cache
+ */
+static /*@only@*/void *cred_copy (/*@null@*/ /*@only@*/void *copy)
+{
+	if (NULL == copy) {
+		(void) fprintf (stderr,
+		                _("%s: failed to allocate memory: %s\n"),
+		                Prog, strerror (errno));
+		exit (13);
+	}
+	return copy;
+}
+
+/*@null@*/ /*@only@*/struct passwd *cred_getpwnam (const char *name)
+{
+	struct cred_entry *e = cred_find (CRED_PWNAM, name, 0);
+
+	if (NULL == e) {
+		e = cred_add (CRED_PWNAM, name, 0, xgetpwnam (name));
+	}
+	if (NULL == e->ent) {
+		return NULL;
+	}
+	return cred_copy (__pw_dup (e->ent));
+}
+
+/*@null@*/ /*@only@*/struct passwd *cred_getpwuid (uid_t uid)
+{
+	struct cred_entry *e = cred_find (CRED_PWUID, NULL, (id_t) uid);
+
+	if (NULL == e) {
+		e = cred_add (CRED_PWUID, NULL, (id_t) uid, xgetpwuid (uid));
+	}
+	if (NULL == e->ent) {
+		return NULL;
+	}
+	return cred_copy (__pw_dup (e->ent));
+}
+
+/*@null@*/ /*@only@*/struct spwd *cred_getspnam (const char *name)
+{
+	struct cred_entry *e = cred_find (CRED_SPNAM, name, 0);
+
+	if (NULL == e) {
+		e = cred_add (CRED_SPNAM, name, 0, xgetspnam (name));
+	}
+	if (NULL == e->ent) {
+		return NULL;
+	}
+	return cred_copy (__spw_dup (e->ent));
+}
+
+/*@null@*/ /*@only@*/struct group *cred_getgrnam (const char *name)
+{
+	struct cred_entry *e = cred_find (CRED_GRNAM, name, 0);
+
+	if (NULL == e) {
+		e = cred_add (CRED_GRNAM, name, 0, xgetgrnam (name));
+	}
+	if (NULL == e->ent) {
+		return NULL;
+	}
+	return cred_copy (__gr_dup (e->ent));
+}
+
+/*
+ * cred_getgrnam_gid - resolve the ID of the group name
+ *
+ *	Unlike cred_getgrnam(), the entry, and its list of members, is
+ *	not copied.
+ *
+ *	It returns false if the group does not exist.
+ */
+bool cred_getgrnam_gid (const char *name, /*@out@*/gid_t *gid)
+{
+	struct cred_entry *e = cred_find (CRED_GRNAM, name, 0);
+
+	if (NULL == e) {
+		e = cred_add (CRED_GRNAM, name, 0, xgetgrnam (name));
+	}
+	if (NULL == e->ent) {
+		return false;
+	}
+	*gid = ((const struct group *) e->ent)->gr_gid;
+	return true;
+}
+
+/*@null@*/ /*@only@*/struct group *cred_getgrgid (gid_t gid)
+{
+	struct cred_entry *e = cred_find (CRED_GRGID, NULL, (id_t) gid);
+
+	if (NULL == e) {
+		e = cred_add (CRED_GRGID, NULL, (id_t) gid, xgetgrgid (gid));
+	}
+	if (NULL == e->ent) {
+		return NULL;
+	}
+	return cred_copy (__gr_dup (e->ent));
+}
+
+/*
+ * cred_invalidate - forget all the entries of the cache
+ *
+ *	The next lookups are resolved again.
+ */
+void cred_invalidate (void)
+{
+	struct cred_entry *e;
+	size_t kind;
+
+	for (kind = 0; kind < CRED_KINDS; kind++) {
+		while (NULL != cache[kind]) {
+			e = cache[kind];
+			cache[kind] = e->next;
+			if (NULL != e->ent) {
+				switch (kind) {
+				case CRED_PWNAM:
+				case CRED_PWUID:
+					pw_free_packed (e->ent);
+					break;
+				case CRED_SPNAM:
+					spw_free_packed (e->ent);
+					break;
+				default:
+					gr_free_packed (e->ent);
+					break;
+				}
+			}
+			free (e->name);
+			free (e);
+		}
+	}
+}
@@ -0,0 +1,174 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* HAVE_PTHREAD */
+#if defined (HAVE_CRYPT_R) && defined (HAVE_CRYPT_H)
+#include <crypt.h>
+#endif				/* HAVE_CRYPT_R && HAVE_CRYPT_H */
+#include "prototypes.h"
+#include "defines.h"
+#include "getdef.h"
+
+/*
+ * Encryption of a batch of passwords
+ *
+ * chpasswd and newusers read all their input, then encrypt all the
+ * passwords with crypt_jobs_run(), and update the entries in the order
+ * of the input.
+ *
+ * If CRYPT_THREADS is set, the passwords are encrypted by a pool of
+ * threads. Each thread takes the next job of the batch, and encrypts
+ * it with crypt_r() and its own state.
+ */
+
+#if defined (HAVE_PTHREAD) && defined (HAVE_CRYPT_R) && defined (HAVE_CRYPT_H)
+#define CRYPT_JOBS_THREADS
+#endif
+
+static void crypt_job_done (struct crypt_job *job, /*@null@*/const char *cp)
+{
+	if (NULL == cp) {
+		job->cipher = NULL;
+		job->err = errno;
+		return;
+	}
+	job->cipher = strdup (cp);
+	job->err = (NULL == job->cipher) ? ENOMEM : 0;
+}
+
+#ifdef CRYPT_JOBS_THREADS
+struct crypt_batch {
+	pthread_mutex_t lock;
+	struct crypt_job *jobs;
+	size_t n;
+	size_t next;		/* next job to take */
+};
+
+static bool crypt_batch_take (struct crypt_batch *batch, size_t *i)
+{
+	bool taken;
+
+	(void) pthread_mutex_lock (&batch->lock);
+	*i = batch->next;
+	taken = (*i < batch->n);
+	if (taken) {
+		batch->next++;
+	}
+	(void) pthread_mutex_unlock (&batch->lock);
+
+	return taken;
+}
+
+/*
+ * crypt_worker - encrypt the jobs of the batch until there are none left
+ */
+static void crypt_worker (struct work_pool *pool, void *arg)
+{
+	struct crypt_batch *batch = arg;
+	struct crypt_data *data;
+	size_t i;
+
+	/* crypt_r() requires a zeroed state for its first use */
+	data = calloc (1, sizeof *data);
+	if (NULL == data) {
+		/* The other threads, or the caller, take the jobs */
+		work_pool_fail (pool);
+		return;
+	}
+
+	while (crypt_batch_take (batch, &i)) {
+		struct crypt_job *job = &batch->jobs[i];
+
+		errno = 0;
+		crypt_job_done (job, pw_encrypt_r (job->clear, job->salt,
+		                                   data));
+	}
+
+	free (data);
+}
+#endif				/* CRYPT_JOBS_THREADS */
+
+/*
+ * crypt_jobs_run - encrypt the passwords of a batch of jobs
+ *
+ *	The cipher of each job is set, or its err if crypt failed.
+ *
+ *	The first job is encrypted by the caller with pw_encrypt(), which
+ *	exits if the method is not supported by libcrypt.
+ */
+void crypt_jobs_run (struct crypt_job *jobs, size_t n)
+{
+	size_t i = 0;
+#ifdef CRYPT_JOBS_THREADS
+	struct crypt_batch batch;
+	struct work_pool *pool;
+	int nthreads;
+#endif				/* CRYPT_JOBS_THREADS */
+
+	if (0 == n) {
+		return;
+	}
+
+	errno = 0;
+	crypt_job_done (&jobs[0], pw_encrypt (jobs[0].clear, jobs[0].salt));
+	i = 1;
+
+#ifdef CRYPT_JOBS_THREADS
+	nthreads = getdef_num ("CRYPT_THREADS", 1);
+	if ((nthreads > 1) && (n > 2)) {
+		if ((size_t) nthreads > n - 1) {
+			nthreads = (int) (n - 1);
+		}
+		pool = work_pool_start ((size_t) nthreads, (size_t) nthreads);
+		if (   (NULL != pool)
+		    && (pthread_mutex_init (&batch.lock, NULL) == 0)) {
+			int t;
+
+			batch.jobs = jobs;
+			batch.n = n;
+			batch.next = 1;
+			for (t = 0; t < nthreads; t++) {
+				if (!work_pool_queue (pool, crypt_worker,
+				                      &batch, true)) {
+					break;
+				}
+			}
+			(void) work_pool_stop (pool);
+			(void) pthread_mutex_destroy (&batch.lock);
+			/* The jobs not taken by a thread are encrypted below */
+			i = batch.next;
+		} else if (NULL != pool) {
+			(void) work_pool_stop (pool);
+		}
+	}
+#endif				/* CRYPT_JOBS_THREADS */
+
+	for (; i < n; i++) {
+		errno = 0;
+		crypt_job_done (&jobs[i], pw_encrypt (jobs[i].clear,
+		                                      jobs[i].salt));
+	}
+}
+
+/*
+ * crypt_jobs_free - free the salts and ciphers of the jobs, and the jobs
+ */
+void crypt_jobs_free (/*@only@*/struct crypt_job *jobs, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		free (jobs[i].salt);
+		if (NULL != jobs[i].cipher) {
+			memzero (jobs[i].cipher, strlen (jobs[i].cipher));
+			free (jobs[i].cipher);
+		}
+	}
+	free (jobs);
+}
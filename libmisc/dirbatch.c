@@ -0,0 +1,276 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif				/* HAVE_SYS_SYSCALL_H */
+#include "prototypes.h"
+#include "defines.h"
+
+/*
+ * Batched reading of the directories of the tree walkers
+ *
+ * copy_tree, chown_tree and remove_tree read the entries of a directory
+ * in batches: as many entries as fit in the buffer of the batch are read
+ * (with getdents64 when available, with readdir otherwise), and they are
+ * sorted by inode number before they are returned. On most file systems,
+ * the inodes are then read (stat, open, unlink) in the order of the inode
+ * table, instead of the order of the hash of the names.
+ *
+ * The buffer starts small, since most directories are small and a batch
+ * is kept for each directory of the walk, and grows for the large
+ * directories.
+ */
+
+#define DIR_BATCH_MIN	(32 * 1024)
+#define DIR_BATCH_MAX	(1024 * 1024)
+
+#if defined(HAVE_SYS_SYSCALL_H) && defined(SYS_getdents64)
+#define USE_GETDENTS64
+/* The record of getdents64, see getdents64(2) */
+struct dirent64_rec {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif				/* HAVE_SYS_SYSCALL_H && SYS_getdents64 */
+
+/*
+ * dir_batch_init - prepare the batched reading of the directory open at fd
+ *
+ *	fd is not closed by dir_batch_free().
+ */
+void dir_batch_init (/*@out@*/struct dir_batch *b, int fd)
+{
+	memzero (b, sizeof *b);
+	b->fd = fd;
+}
+
+static int ent_cmp (const void *p1, const void *p2)
+{
+	const struct dir_batch_entry *e1 = p1;
+	const struct dir_batch_entry *e2 = p2;
+
+	return (e1->ino > e2->ino) - (e1->ino < e2->ino);
+}
+
+/*
+ * add_entry - add an entry to the batch
+ *
+ *	name is in the buffer of the batch. The "." and ".." entries are
+ *	skipped.
+ */
+static int add_entry (struct dir_batch *b, ino_t ino, unsigned char type,
+                      const char *name)
+{
+	if (   ('.' == name[0])
+	    && (('\0' == name[1]) || (('.' == name[1]) && ('\0' == name[2])))) {
+		return 0;
+	}
+	if (b->count == b->ents_size) {
+		struct dir_batch_entry *ents;
+		size_t n = (0 == b->ents_size) ? 256 : 2 * b->ents_size;
+
+		ents = realloc (b->ents, n * sizeof *ents);
+		if (NULL == ents) {
+			return -1;
+		}
+		b->ents = ents;
+		b->ents_size = n;
+	}
+	b->ents[b->count].ino = ino;
+	b->ents[b->count].type = type;
+	b->ents[b->count].name = name;
+	b->count++;
+	return 0;
+}
+
+#ifdef USE_GETDENTS64
+/*
+ * fill - read the next entries in the buffer
+ *
+ *	It returns the number of bytes read, or -1 on failure.
+ */
+static ssize_t fill (struct dir_batch *b)
+{
+	size_t used = 0;
+
+	for (;;) {
+		long n;
+		size_t off;
+
+		n = syscall (SYS_getdents64, b->fd, b->buf + used,
+		             b->size - used);
+		if (n < 0) {
+			/* EINVAL: the next record does not fit */
+			if ((EINVAL == errno) && (0 != used)) {
+				return (ssize_t) used;
+			}
+			return -1;
+		}
+		if (0 == n) {
+			b->eof = true;
+			return (ssize_t) used;
+		}
+		for (off = used; off < used + (size_t) n;) {
+			struct dirent64_rec *d;
+
+			d = (struct dirent64_rec *) (b->buf + off);
+			if (add_entry (b, (ino_t) d->d_ino, d->d_type,
+			               d->d_name) != 0) {
+				return -1;
+			}
+			off += d->d_reclen;
+		}
+		used += (size_t) n;
+		/* Stop before a read which would mostly fail */
+		if (b->size - used < 1024) {
+			return (ssize_t) used;
+		}
+	}
+}
+#else				/* !USE_GETDENTS64 */
+static ssize_t fill (struct dir_batch *b)
+{
+	struct DIRECT *ent;
+	size_t used = 0;
+
+	if (NULL == b->dir) {
+		int fd = dup (b->fd);
+
+		if (fd < 0) {
+			return -1;
+		}
+		b->dir = fdopendir (fd);
+		if (NULL == b->dir) {
+			(void) close (fd);
+			return -1;
+		}
+	}
+
+	for (;;) {
+		long pos = telldir (b->dir);
+		size_t len;
+
+		errno = 0;
+		ent = readdir (b->dir);
+		if (NULL == ent) {
+			if (0 != errno) {
+				return -1;
+			}
+			b->eof = true;
+			return (ssize_t) used;
+		}
+		len = strlen (ent->d_name) + 1;
+		if (used + len > b->size) {
+			/* Read it again in the next batch */
+			seekdir (b->dir, pos);
+			return (ssize_t) used;
+		}
+		memcpy (b->buf + used, ent->d_name, len);
+# ifdef _DIRENT_HAVE_D_TYPE
+		if (add_entry (b, ent->d_ino, ent->d_type, b->buf + used) != 0)
+# else				/* !_DIRENT_HAVE_D_TYPE */
+		if (add_entry (b, ent->d_ino, DT_UNKNOWN, b->buf + used) != 0)
+# endif				/* !_DIRENT_HAVE_D_TYPE */
+		{
+			return -1;
+		}
+		used += len;
+	}
+}
+#endif				/* !USE_GETDENTS64 */
+
+/*
+ * dir_batch_next - read the next batch of entries
+ *
+ *	The entries (b->ents) are sorted by inode number. They are valid
+ *	until the next call.
+ *
+ *	It returns the number of entries, 0 at the end of the directory,
+ *	and -1 on failure (with errno set).
+ */
+ssize_t dir_batch_next (struct dir_batch *b)
+{
+	ssize_t n;
+
+	b->count = 0;
+	while ((0 == b->count) && !b->eof) {
+		/* The previous batch filled the buffer: take a larger one */
+		if ((b->size < DIR_BATCH_MAX) && (0 != b->batches)) {
+			free (b->buf);
+			b->buf = NULL;
+		}
+		if (NULL == b->buf) {
+			b->size = (0 == b->size) ? DIR_BATCH_MIN : 2 * b->size;
+			b->buf = malloc (b->size);
+			if (NULL == b->buf) {
+				return -1;
+			}
+		}
+		n = fill (b);
+		if (n < 0) {
+			return -1;
+		}
+		b->batches++;
+	}
+
+	qsort (b->ents, b->count, sizeof b->ents[0], ent_cmp);
+	return (ssize_t) b->count;
+}
+
+/*
+ * dir_batch_free - release the memory of a batched reading
+ */
+void dir_batch_free (struct dir_batch *b)
+{
+	if (NULL != b->dir) {
+		(void) closedir (b->dir);
+	}
+	free (b->buf);
+	free (b->ents);
+	memzero (b, sizeof *b);
+	b->fd = -1;
+}
+
+/*
+ * stat_owner - get the type, mode and owners of the entry name of the
+ *              directory open at dirfd, without following symbolic links
+ *
+ *	Only st_mode, st_uid and st_gid are set. With statx, the other
+ *	attributes are not requested, which spares their retrieval on the
+ *	file systems where they are expensive (network file systems).
+ *
+ *	It returns 0 on success, -1 on failure (with errno set).
+ */
+int stat_owner (int dirfd, const char *name, /*@out@*/struct stat *sb)
+{
+#if defined(HAVE_STATX) && defined(STATX_TYPE)
+	struct statx stx;
+
+	if (statx (dirfd, name, AT_SYMLINK_NOFOLLOW,
+	           STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID,
+	           &stx) != 0) {
+		return -1;
+	}
+	memzero (sb, sizeof *sb);
+	sb->st_mode = stx.stx_mode;
+	sb->st_uid = stx.stx_uid;
+	sb->st_gid = stx.stx_gid;
+	return 0;
+#else				/* !HAVE_STATX || !STATX_TYPE */
+	return fstatat (dirfd, name, sb, AT_SYMLINK_NOFOLLOW);
+#endif				/* !HAVE_STATX || !STATX_TYPE */
+}
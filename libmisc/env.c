@@ -35,6 +35,7 @@
 #ident "$Id$"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -76,6 +77,34 @@ static const char *noslash[] = {
 	(char *) 0
 };
 
+/*
+ * The forbid and noslash prefixes, compiled into a single table sorted
+ * by their first character. The prefixes starting with c are
+ * prefixes[first[c]] to prefixes[first[c + 1] - 1].
+ */
+struct env_prefix {
+	const char *prefix;
+	size_t len;
+	bool noslash;		/* allowed, but with no slashes */
+};
+static struct env_prefix prefixes[(sizeof forbid + sizeof noslash)
+                                  / sizeof (char *)];
+static size_t first[UCHAR_MAX + 2];
+static bool prefixes_compiled = false;
+
+/*
+ * Hash index of the variables of newenvp by name. The slots hold the
+ * position in newenvp plus one, 0 for an empty slot.
+ */
+static /*@null@*/size_t *env_index = NULL;
+static size_t env_index_size = 0;	/* a power of two */
+
+static void compile_prefixes (void);
+static /*@null@*/const struct env_prefix *match_prefix (const char *var);
+static size_t env_hash (const char *name, size_t n);
+static void env_index_insert (size_t pos);
+static /*@null@*/size_t *env_index_find (const char *name, size_t n);
+
 /*
  * initenv() must be called once before using addenv().
  */
@@ -85,11 +114,136 @@ void initenv (void)
 	*newenvp = NULL;
 }
 
+/*
+ * compile_prefixes - sort the forbid and noslash prefixes by their
+ *                    first character
+ */
+static void compile_prefixes (void)
+{
+	size_t count[UCHAR_MAX + 1];
+	const char **p;
+	size_t n = 0;
+	size_t c;
+
+	memzero (count, sizeof count);
+	for (p = forbid; NULL != *p; p++) {
+		count[(unsigned char) **p]++;
+	}
+	for (p = noslash; NULL != *p; p++) {
+		count[(unsigned char) **p]++;
+	}
+	first[0] = 0;
+	for (c = 0; c <= UCHAR_MAX; c++) {
+		first[c + 1] = first[c] + count[c];
+	}
+
+	memzero (count, sizeof count);
+	for (p = forbid; NULL != *p; p++, n++) {
+		c = (unsigned char) **p;
+		prefixes[first[c] + count[c]].prefix = *p;
+		prefixes[first[c] + count[c]].len = strlen (*p);
+		prefixes[first[c] + count[c]].noslash = false;
+		count[c]++;
+	}
+	for (p = noslash; NULL != *p; p++, n++) {
+		c = (unsigned char) **p;
+		prefixes[first[c] + count[c]].prefix = *p;
+		prefixes[first[c] + count[c]].len = strlen (*p);
+		prefixes[first[c] + count[c]].noslash = true;
+		count[c]++;
+	}
+	assert (n <= sizeof prefixes / sizeof prefixes[0]);
+	prefixes_compiled = true;
+}
+
+/*
+ * match_prefix - find the forbid or noslash prefix of var, if any
+ */
+static /*@null@*/const struct env_prefix *match_prefix (const char *var)
+{
+	size_t c = (unsigned char) *var;
+	size_t i;
+
+	if (!prefixes_compiled) {
+		compile_prefixes ();
+	}
+
+	for (i = first[c]; i < first[c + 1]; i++) {
+		if (strncmp (var, prefixes[i].prefix, prefixes[i].len) == 0) {
+			return &prefixes[i];
+		}
+	}
+	return NULL;
+}
+
+static size_t env_hash (const char *name, size_t n)
+{
+	size_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		h = (h ^ (unsigned char) name[i]) * 16777619U;
+	}
+	return h;
+}
+
+/*
+ * env_index_find - find the slot of the variable name (of length n)
+ *
+ *	It returns the slot of the variable, or the empty slot where it
+ *	should be inserted.
+ */
+static /*@null@*/size_t *env_index_find (const char *name, size_t n)
+{
+	size_t i;
+
+	if (0 == env_index_size) {
+		return NULL;
+	}
+	for (i = env_hash (name, n) & (env_index_size - 1);
+	     0 != env_index[i];
+	     i = (i + 1) & (env_index_size - 1)) {
+		const char *var = newenvp[env_index[i] - 1];
+
+		if (   (strncmp (name, var, n) == 0)
+		    && (('=' == var[n]) || ('\0' == var[n]))) {
+			break;
+		}
+	}
+	return &env_index[i];
+}
+
+/*
+ * env_index_insert - add the variable at position pos of newenvp to the
+ *                    index
+ *
+ *	The index is kept at most half full.
+ */
+static void env_index_insert (size_t pos)
+{
+	size_t *slot;
+	size_t i;
+
+	if ((pos + 1) * 2 > env_index_size) {
+		free (env_index);
+		env_index_size = (0 == env_index_size) ? 64 : env_index_size * 2;
+		env_index = (size_t *) xmalloc (env_index_size * sizeof (size_t));
+		memzero (env_index, env_index_size * sizeof (size_t));
+		for (i = 0; i < pos; i++) {
+			slot = env_index_find (newenvp[i],
+			                       strcspn (newenvp[i], "="));
+			*slot = i + 1;
+		}
+	}
+	slot = env_index_find (newenvp[pos], strcspn (newenvp[pos], "="));
+	*slot = pos + 1;
+}
+
 
 void addenv (const char *string, /*@null@*/const char *value)
 {
 	char *cp, *newstring;
-	size_t i;
+	size_t *slot;
 	size_t n;
 
 	if (NULL != value) {
@@ -118,16 +272,10 @@ void addenv (const char *string, /*@null@*/const char *value)
 	/*
 	 * If this environment variable is already set, change its value.
 	 */
-	for (i = 0; i < newenvc; i++) {
-		if (   (strncmp (newstring, newenvp[i], n) == 0)
-		    && (('=' == newenvp[i][n]) || ('\0' == newenvp[i][n]))) {
-			break;
-		}
-	}
-
-	if (i < newenvc) {
-		free (newenvp[i]);
-		newenvp[i] = newstring;
+	slot = env_index_find (newstring, n);
+	if ((NULL != slot) && (0 != *slot)) {
+		free (newenvp[*slot - 1]);
+		newenvp[*slot - 1] = newstring;
 		return;
 	}
 
@@ -174,6 +322,8 @@ void addenv (const char *string, /*@null@*/const char *value)
 			(void) fputs (_("Environment overflow\n"), stderr);
 			newenvc--;
 			free (newenvp[newenvc]);
+			newenvp[newenvc] = NULL;
+			return;
 		}
 	}
 
@@ -182,6 +332,8 @@ void addenv (const char *string, /*@null@*/const char *value)
 	 */
 
 	newenvp[newenvc] = NULL;
+
+	env_index_insert (newenvc - 1);
 }
 
 
@@ -207,15 +359,9 @@ void set_env (int argc, char *const *argv)
 			noname++;
 			addenv (variable, *argv);
 		} else {
-			const char **p;
+			const struct env_prefix *p = match_prefix (*argv);
 
-			for (p = forbid; NULL != *p; p++) {
-				if (strncmp (*argv, *p, strlen (*p)) == 0) {
-					break;
-				}
-			}
-
-			if (NULL != *p) {
+			if ((NULL != p) && !p->noslash) {
 				strncpy (variable, *argv, (size_t)(cp - *argv));
 				variable[cp - *argv] = '\0';
 				printf (_("You may not change $%s\n"),
@@ -240,36 +386,20 @@ void set_env (int argc, char *const *argv)
 void sanitize_env (void)
 {
 	char **envp = environ;
-	const char **bad;
+	const struct env_prefix *bad;
 	char **cur;
-	char **move;
+	char **keep = envp;
 
+	/* The variables which are kept are moved in one pass */
 	for (cur = envp; NULL != *cur; cur++) {
-		for (bad = forbid; NULL != *bad; bad++) {
-			if (strncmp (*cur, *bad, strlen (*bad)) == 0) {
-				for (move = cur; NULL != *move; move++) {
-					*move = *(move + 1);
-				}
-				cur--;
-				break;
-			}
-		}
-	}
-
-	for (cur = envp; NULL != *cur; cur++) {
-		for (bad = noslash; NULL != *bad; bad++) {
-			if (strncmp (*cur, *bad, strlen (*bad)) != 0) {
-				continue;
-			}
-			if (strchr (*cur, '/') == NULL) {
-				continue;	/* OK */
-			}
-			for (move = cur; NULL != *move; move++) {
-				*move = *(move + 1);
-			}
-			cur--;
-			break;
+		bad = match_prefix (*cur);
+		if (   (NULL != bad)
+		    && (!bad->noslash || (strchr (*cur, '/') != NULL))) {
+			continue;
 		}
+		*keep = *cur;
+		keep++;
 	}
+	*keep = NULL;
 }
 
@@ -0,0 +1,113 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdio.h>
+#include <string.h>
+#include "prototypes.h"
+#include "defines.h"
+
+/*
+ * Machine readable export of the records of lastlog and faillog
+ *
+ * Each record is written on a line, with its fields in a fixed order:
+ *
+ *	tsv:	the values separated by tabulations. The tabulations,
+ *		new lines and backslashes of the strings are escaped
+ *		(\t, \n, \\).
+ *	json:	a JSON object, {"uid":1000,"time":1700000000,...}
+ *
+ * The numbers are written as decimal integers, and the times as seconds
+ * since the Epoch. The strings of the records are not NUL terminated
+ * when they fill their field: their length is given.
+ */
+
+/*
+ * export_format_parse - get the export format named s
+ *
+ *	It returns false if there is no such format.
+ */
+bool export_format_parse (const char *s, /*@out@*/enum export_format *format)
+{
+	if (strcmp (s, "tsv") == 0) {
+		*format = EXPORT_TSV;
+	} else if (strcmp (s, "json") == 0) {
+		*format = EXPORT_JSON;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+void export_start (/*@out@*/struct export_record *r, FILE *fp,
+                   enum export_format format)
+{
+	r->fp = fp;
+	r->format = format;
+	r->first = true;
+	if (EXPORT_JSON == format) {
+		(void) putc ('{', fp);
+	}
+}
+
+static void export_key (struct export_record *r, const char *key)
+{
+	if (EXPORT_JSON == r->format) {
+		(void) fprintf (r->fp, "%s\"%s\":", r->first ? "" : ",", key);
+	} else if (!r->first) {
+		(void) putc ('\t', r->fp);
+	}
+	r->first = false;
+}
+
+void export_num (struct export_record *r, const char *key, long long value)
+{
+	export_key (r, key);
+	(void) fprintf (r->fp, "%lld", value);
+}
+
+/*
+ * export_str - write the string field key, of at most len bytes
+ */
+void export_str (struct export_record *r, const char *key,
+                 const char *s, size_t len)
+{
+	size_t i;
+
+	export_key (r, key);
+	if (EXPORT_JSON == r->format) {
+		(void) putc ('"', r->fp);
+	}
+	for (i = 0; (i < len) && ('\0' != s[i]); i++) {
+		unsigned char c = (unsigned char) s[i];
+
+		if (EXPORT_JSON == r->format) {
+			if (('"' == c) || ('\\' == c)) {
+				(void) fprintf (r->fp, "\\%c", c);
+			} else if (c < 0x20) {
+				(void) fprintf (r->fp, "\\u%04x", c);
+			} else {
+				(void) putc (c, r->fp);
+			}
+		} else if ('\t' == c) {
+			(void) fputs ("\\t", r->fp);
+		} else if ('\n' == c) {
+			(void) fputs ("\\n", r->fp);
+		} else if ('\\' == c) {
+			(void) fputs ("\\\\", r->fp);
+		} else {
+			(void) putc (c, r->fp);
+		}
+	}
+	if (EXPORT_JSON == r->format) {
+		(void) putc ('"', r->fp);
+	}
+}
+
+void export_end (struct export_record *r)
+{
+	if (EXPORT_JSON == r->format) {
+		(void) putc ('}', r->fp);
+	}
+	(void) putc ('\n', r->fp);
+}
@@ -0,0 +1,419 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "prototypes.h"
+#include "defines.h"
+
+/*
+ * External sort of the stream mode of pwck and grpck
+ *
+ * The records (a key and a 64 bits value) are kept in a buffer of a
+ * fixed size: the records are stored from its start, and the pointers
+ * to the records from its end. When the buffer is full, the records are
+ * sorted and written to a temporary file as a sorted run. The runs are
+ * then merged, each with a read buffer of its share of the same memory.
+ *
+ * The records are sorted by key (bytes), then by value.
+ *
+ *	record: uint64_t value, uint32_t len, char key[len]
+ */
+#define REC_HDR	(sizeof (uint64_t) + sizeof (uint32_t))
+
+struct extsort_run {
+	off_t pos;		/* next byte of the run in the file */
+	off_t end;
+	/*@only@*/char *buf;
+	size_t size;
+	size_t off;		/* current record in buf */
+	size_t have;		/* bytes in buf */
+};
+
+static const char *rec_key (const char *rec)
+{
+	return rec + REC_HDR;
+}
+
+static uint32_t rec_len (const char *rec)
+{
+	uint32_t len;
+
+	memcpy (&len, rec + sizeof (uint64_t), sizeof len);
+	return len;
+}
+
+static uint64_t rec_value (const char *rec)
+{
+	uint64_t value;
+
+	memcpy (&value, rec, sizeof value);
+	return value;
+}
+
+/*
+ * extsort_keycmp - compare two keys, like the sort does
+ */
+int extsort_keycmp (const char *k1, size_t l1, const char *k2, size_t l2)
+{
+	int c = memcmp (k1, k2, (l1 < l2) ? l1 : l2);
+
+	if (0 != c) {
+		return c;
+	}
+	return (l1 > l2) - (l1 < l2);
+}
+
+static int rec_cmp (const char *r1, const char *r2)
+{
+	int c = extsort_keycmp (rec_key (r1), rec_len (r1),
+	                        rec_key (r2), rec_len (r2));
+	uint64_t v1, v2;
+
+	if (0 != c) {
+		return c;
+	}
+	v1 = rec_value (r1);
+	v2 = rec_value (r2);
+	return (v1 > v2) - (v1 < v2);
+}
+
+static int rec_ptr_cmp (const void *p1, const void *p2)
+{
+	return rec_cmp (*(char *const *) p1, *(char *const *) p2);
+}
+
+/*
+ * recs - the pointers to the records in memory, at the end of the buffer
+ */
+static char **recs (const struct extsort *s)
+{
+	return (char **) (s->buf + s->size) - s->count;
+}
+
+/*
+ * extsort_init - prepare an empty sort which uses about limit bytes of
+ *                memory
+ *
+ *	It returns 0 on success, -1 on failure (with errno set).
+ */
+int extsort_init (/*@out@*/struct extsort *s, size_t limit)
+{
+	memset (s, 0, sizeof *s);
+	s->size = limit - limit % sizeof (char *);
+	s->buf = (char *) malloc (s->size);
+	if (NULL == s->buf) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * spill - write the records in memory to the temporary file, as a
+ *         sorted run
+ */
+static int spill (struct extsort *s)
+{
+	struct extsort_run *runs;
+	char **r = recs (s);
+	size_t i;
+	off_t start;
+
+	if (NULL == s->spill) {
+		const char *tmpdir = getenv ("TMPDIR");
+		char name[1024];
+		int fd;
+
+		if ((NULL == tmpdir) || ('\0' == tmpdir[0])) {
+			tmpdir = "/tmp";
+		}
+		(void) snprintf (name, sizeof name, "%s/shadow-sort.XXXXXX",
+		                 tmpdir);
+		fd = mkstemp (name);
+		if (fd < 0) {
+			return -1;
+		}
+		(void) unlink (name);
+		s->spill = fdopen (fd, "w+");
+		if (NULL == s->spill) {
+			(void) close (fd);
+			return -1;
+		}
+	}
+
+	runs = (struct extsort_run *)
+	       realloc (s->runs, (s->nruns + 1) * sizeof (*runs));
+	if (NULL == runs) {
+		return -1;
+	}
+	s->runs = runs;
+
+	qsort (r, s->count, sizeof (char *), rec_ptr_cmp);
+	start = ftello (s->spill);
+	for (i = 0; i < s->count; i++) {
+		if (fwrite (r[i], REC_HDR + rec_len (r[i]), 1, s->spill) != 1) {
+			return -1;
+		}
+	}
+	memset (&runs[s->nruns], 0, sizeof (runs[0]));
+	runs[s->nruns].pos = start;
+	runs[s->nruns].end = ftello (s->spill);
+	s->nruns++;
+
+	s->used = 0;
+	s->count = 0;
+	return 0;
+}
+
+/*
+ * extsort_add - add a record
+ *
+ *	It returns 0 on success, -1 on failure (with errno set).
+ */
+int extsort_add (struct extsort *s, const char *key, size_t len,
+                 uint64_t value)
+{
+	size_t need = REC_HDR + len + sizeof (char *);
+	uint32_t len32 = (uint32_t) len;
+	char *rec;
+
+	if ((len > UINT32_MAX) || (need > s->size)) {
+		errno = E2BIG;
+		return -1;
+	}
+	if (s->used + s->count * sizeof (char *) + need > s->size) {
+		if (spill (s) != 0) {
+			return -1;
+		}
+	}
+
+	rec = s->buf + s->used;
+	memcpy (rec, &value, sizeof value);
+	memcpy (rec + sizeof value, &len32, sizeof len32);
+	memcpy (rec + REC_HDR, key, len);
+	s->used += REC_HDR + len;
+	s->count++;
+	recs (s)[0] = rec;
+	if (REC_HDR + len > s->max_record) {
+		s->max_record = REC_HDR + len;
+	}
+	return 0;
+}
+
+/*
+ * run_fill - read the next records of a run in its buffer
+ *
+ *	It returns 1 if a whole record is available, 0 at the end of the
+ *	run, and -1 on failure.
+ */
+static int run_fill (struct extsort *s, struct extsort_run *run)
+{
+	ssize_t n;
+
+	for (;;) {
+		size_t left = run->have - run->off;
+
+		if (   (left >= REC_HDR)
+		    && (left >= REC_HDR + rec_len (run->buf + run->off))) {
+			return 1;
+		}
+		if (run->pos >= run->end) {
+			return 0;
+		}
+		memmove (run->buf, run->buf + run->off, left);
+		run->off = 0;
+		run->have = left;
+		n = pread (fileno (s->spill), run->buf + left,
+		           MIN (run->size - left, (size_t) (run->end - run->pos)),
+		           run->pos);
+		if (n <= 0) {
+			if (0 == n) {
+				errno = EIO;
+			}
+			return -1;
+		}
+		run->have += (size_t) n;
+		run->pos += n;
+	}
+}
+
+static const char *run_rec (const struct extsort *s, size_t i)
+{
+	const struct extsort_run *run = &s->runs[s->heap[i]];
+
+	return run->buf + run->off;
+}
+
+/*
+ * heap_down - restore the heap of the runs from the position i
+ */
+static void heap_down (struct extsort *s, size_t i)
+{
+	for (;;) {
+		size_t l = 2 * i + 1;
+		size_t m = i;
+		size_t tmp;
+
+		if (   (l < s->heap_count)
+		    && (rec_cmp (run_rec (s, l), run_rec (s, m)) < 0)) {
+			m = l;
+		}
+		if (   (l + 1 < s->heap_count)
+		    && (rec_cmp (run_rec (s, l + 1), run_rec (s, m)) < 0)) {
+			m = l + 1;
+		}
+		if (m == i) {
+			return;
+		}
+		tmp = s->heap[i];
+		s->heap[i] = s->heap[m];
+		s->heap[m] = tmp;
+		i = m;
+	}
+}
+
+/*
+ * extsort_sort - sort the records, after the last extsort_add()
+ *
+ *	When all the records fit in memory, they are sorted in place.
+ *	Otherwise, the last run is written, and the memory is shared by
+ *	the read buffers of the runs.
+ *
+ *	It returns 0 on success, -1 on failure (with errno set).
+ */
+int extsort_sort (struct extsort *s)
+{
+	size_t share;
+	size_t i;
+
+	if (0 == s->nruns) {
+		qsort (recs (s), s->count, sizeof (char *), rec_ptr_cmp);
+		return 0;
+	}
+
+	if ((0 != s->count) && (spill (s) != 0)) {
+		return -1;
+	}
+	if (fflush (s->spill) != 0) {
+		return -1;
+	}
+	free (s->buf);
+	s->buf = NULL;
+
+	/* Each buffer holds at least two records */
+	share = s->size / s->nruns;
+	if (share < 2 * s->max_record) {
+		share = 2 * s->max_record;
+	}
+	s->heap = (size_t *) malloc (s->nruns * sizeof (size_t));
+	if (NULL == s->heap) {
+		return -1;
+	}
+	for (i = 0; i < s->nruns; i++) {
+		struct extsort_run *run = &s->runs[i];
+		int ret;
+
+		run->size = share;
+		run->buf = (char *) malloc (share);
+		if (NULL == run->buf) {
+			return -1;
+		}
+		ret = run_fill (s, run);
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret > 0) {
+			s->heap[s->heap_count] = i;
+			s->heap_count++;
+		}
+	}
+	for (i = s->heap_count / 2; i > 0; i--) {
+		heap_down (s, i - 1);
+	}
+	return 0;
+}
+
+/*
+ * extsort_peek - get the smallest record which was not popped yet
+ *
+ *	The key is valid until the next extsort_pop().
+ *
+ *	It returns 1 if there is such a record, 0 otherwise.
+ */
+int extsort_peek (const struct extsort *s,
+                  /*@out@*/const char **key, /*@out@*/size_t *len,
+                  /*@out@*/uint64_t *value)
+{
+	const char *rec;
+
+	if (0 == s->nruns) {
+		if (s->next >= s->count) {
+			return 0;
+		}
+		rec = recs (s)[s->next];
+	} else {
+		if (0 == s->heap_count) {
+			return 0;
+		}
+		rec = run_rec (s, 0);
+	}
+	*key = rec_key (rec);
+	*len = rec_len (rec);
+	*value = rec_value (rec);
+	return 1;
+}
+
+/*
+ * extsort_pop - drop the smallest record
+ *
+ *	It returns 0 on success, -1 on failure (with errno set).
+ */
+int extsort_pop (struct extsort *s)
+{
+	struct extsort_run *run;
+	int ret;
+
+	if (0 == s->nruns) {
+		s->next++;
+		return 0;
+	}
+	if (0 == s->heap_count) {
+		return 0;
+	}
+	run = &s->runs[s->heap[0]];
+	run->off += REC_HDR + rec_len (run->buf + run->off);
+	ret = run_fill (s, run);
+	if (ret < 0) {
+		return -1;
+	}
+	if (0 == ret) {
+		s->heap_count--;
+		s->heap[0] = s->heap[s->heap_count];
+	}
+	heap_down (s, 0);
+	return 0;
+}
+
+/*
+ * extsort_free - release the memory and the temporary file of a sort
+ */
+void extsort_free (struct extsort *s)
+{
+	size_t i;
+
+	for (i = 0; i < s->nruns; i++) {
+		free (s->runs[i].buf);
+	}
+	free (s->runs);
+	free (s->heap);
+	free (s->buf);
+	if (NULL != s->spill) {
+		(void) fclose (s->spill);
+	}
+	memset (s, 0, sizeof *s);
+}
@@ -34,6 +34,7 @@
 
 #ident "$Id$"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -41,7 +42,74 @@
 #include "faillog.h"
 #include "getdef.h"
 #include "failure.h"
+#include "prototypes.h"
+#include "uidrecords.h"
 #define	YEAR	(365L*DAY)
+
+/*
+ * The records of the high UIDs are kept in FAILLOG_FILE.keyed
+ * (LOG_KEYED_UID_MIN) instead of at their offset in FAILLOG_FILE.
+ */
+struct fail_file {
+	int fd;
+	bool is_keyed;
+	struct uid_keyed keyed;
+};
+
+/*
+ * fail_open - open the faillog record of uid and lock it
+ *
+ *	It returns 1 on success, 0 if the file does not exist, and -1 on
+ *	error.
+ */
+static int fail_open (struct fail_file *ff, uid_t uid, bool writable)
+{
+	ff->is_keyed = uid_keyed ((unsigned long) uid);
+	ff->fd = -1;
+	if (ff->is_keyed) {
+		/* The whole file is locked while it is open */
+		return uid_keyed_open (&ff->keyed, FAILLOG_FILE,
+		                       sizeof (struct faillog), writable);
+	}
+
+	ff->fd = open (FAILLOG_FILE, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (ff->fd < 0) {
+		return (ENOENT == errno) ? 0 : -1;
+	}
+	(void) uid_record_lock (ff->fd, sizeof (struct faillog),
+	                        (unsigned long) uid,
+	                        writable ? F_WRLCK : F_RDLCK);
+	return 1;
+}
+
+static int fail_read (struct fail_file *ff, uid_t uid, struct faillog *fl)
+{
+	if (ff->is_keyed) {
+		return uid_keyed_get (&ff->keyed, (unsigned long) uid, fl);
+	}
+	return uid_record_read (ff->fd, sizeof *fl, (unsigned long) uid, fl);
+}
+
+static int fail_write (struct fail_file *ff, uid_t uid,
+                       const struct faillog *fl)
+{
+	if (ff->is_keyed) {
+		return uid_keyed_put (&ff->keyed, (unsigned long) uid, fl);
+	}
+	return uid_record_write (ff->fd, sizeof *fl, (unsigned long) uid, fl);
+}
+
+/*
+ * fail_close - close the file, which releases the lock
+ */
+static int fail_close (struct fail_file *ff)
+{
+	if (ff->is_keyed) {
+		return uid_keyed_close (&ff->keyed);
+	}
+	return close (ff->fd);
+}
+
 /*
  * failure - make failure entry
  *
@@ -50,19 +118,18 @@
  */
 void failure (uid_t uid, const char *tty, struct faillog *fl)
 {
-	int fd;
-	off_t offset_uid = (off_t) (sizeof *fl) * uid;
+	struct fail_file ff;
+	int ret;
 
 	/*
 	 * Don't do anything if failure logging isn't set up.
 	 */
 
-	if (access (FAILLOG_FILE, F_OK) != 0) {
+	ret = fail_open (&ff, uid, true);
+	if (0 == ret) {
 		return;
 	}
-
-	fd = open (FAILLOG_FILE, O_RDWR);
-	if (fd < 0) {
+	if (ret < 0) {
 		SYSLOG ((LOG_WARN,
 		         "Can't write faillog entry for UID %lu in %s.",
 		         (unsigned long) uid, FAILLOG_FILE));
@@ -73,14 +140,18 @@ void failure (uid_t uid, const char *tty, struct faillog *fl)
 	 * The file is indexed by UID value meaning that shared UID's
 	 * share failure log records.  That's OK since they really
 	 * share just about everything else ...
+	 *
+	 * The record is locked until it is written, so that the
+	 * concurrent failures of the same account are all counted. The
+	 * failures of other accounts do not wait. Without lock, the
+	 * record is still updated.
 	 */
 
-	if (   (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-	    || (read (fd, (char *) fl, sizeof *fl) != (ssize_t) sizeof *fl)) {
+	if (fail_read (&ff, uid, fl) != 0) {
 		/* This is not necessarily a failure. The file is
 		 * initially zero length.
 		 *
-		 * If lseek() or read() failed for any other reason, this
+		 * If pread() failed for any other reason, this
 		 * might reset the counter. But the new failure will be
 		 * logged.
 		 */
@@ -102,19 +173,16 @@ void failure (uid_t uid, const char *tty, struct faillog *fl)
 	(void) time (&fl->fail_time);
 
 	/*
-	 * Seek back to the correct position in the file and write the
-	 * record out.  Ideally we should lock the file in case the same
-	 * account is being logged simultaneously.  But the risk doesn't
-	 * seem that great.
+	 * Write the record out at the same position.  The lock is
+	 * released when the file is closed.
 	 */
 
-	if (   (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-	    || (write (fd, (char *) fl, sizeof *fl) != (ssize_t) sizeof *fl)
-	    || (close (fd) != 0)) {
+	if (   (fail_write (&ff, uid, fl) != 0)
+	    || (fail_close (&ff) != 0)) {
 		SYSLOG ((LOG_WARN,
 		         "Can't write faillog entry for UID %lu in %s.",
 		         (unsigned long) uid, FAILLOG_FILE));
-		(void) close (fd);
+		(void) fail_close (&ff);
 	}
 }
 
@@ -152,20 +220,19 @@ static bool too_many_failures (const struct faillog *fl)
 
 int failcheck (uid_t uid, struct faillog *fl, bool failed)
 {
-	int fd;
+	struct fail_file ff;
 	struct faillog fail;
-	off_t offset_uid = (off_t) (sizeof *fl) * uid;
+	int ret;
 
 	/*
 	 * Suppress the check if the log file isn't there.
 	 */
 
-	if (access (FAILLOG_FILE, F_OK) != 0) {
+	ret = fail_open (&ff, uid, !failed);
+	if (0 == ret) {
 		return 1;
 	}
-
-	fd = open (FAILLOG_FILE, failed?O_RDONLY:O_RDWR);
-	if (fd < 0) {
+	if (ret < 0) {
 		SYSLOG ((LOG_WARN,
 		         "Can't open the faillog file (%s) to check UID %lu. "
 		         "User access authorized.",
@@ -183,16 +250,18 @@ int failcheck (uid_t uid, struct faillog *fl, bool failed)
 	 * If read fails, there is no record for this user yet (the
 	 * file is initially zero length and extended by writes), so
 	 * no need to reset the count.
+	 *
+	 * The record is locked until it is reset, so that no concurrent
+	 * failure of the same account is lost.
 	 */
 
-	if (   (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-	    || (read (fd, (char *) fl, sizeof *fl) != (ssize_t) sizeof *fl)) {
-		(void) close (fd);
+	if (fail_read (&ff, uid, fl) != 0) {
+		(void) fail_close (&ff);
 		return 1;
 	}
 
 	if (too_many_failures (fl)) {
-		(void) close (fd);
+		(void) fail_close (&ff);
 		return 0;
 	}
 
@@ -200,23 +269,23 @@ int failcheck (uid_t uid, struct faillog *fl, bool failed)
 	 * The record is updated if this is not a failure.  The count will
 	 * be reset to zero, but the rest of the information will be left
 	 * in the record in case someone wants to see where the failed
-	 * login originated.
+	 * login originated.  There is nothing to write if the count is
+	 * already zero.
 	 */
 
-	if (!failed) {
+	if (!failed && (0 != fl->fail_cnt)) {
 		fail = *fl;
 		fail.fail_cnt = 0;
 
-		if (   (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-		    || (write (fd, (const void *) &fail, sizeof fail) != (ssize_t) sizeof fail)
-		    || (close (fd) != 0)) {
+		if (   (fail_write (&ff, uid, &fail) != 0)
+		    || (fail_close (&ff) != 0)) {
 			SYSLOG ((LOG_WARN,
 			         "Can't reset faillog entry for UID %lu in %s.",
 			         (unsigned long) uid, FAILLOG_FILE));
-			(void) close (fd);
+			(void) fail_close (&ff);
 		}
 	} else {
-		(void) close (fd);
+		(void) fail_close (&ff);
 	}
 
 	return 1;
@@ -299,7 +368,6 @@ void failtmp (const char *username,
     )
 {
 	const char *ftmp;
-	int fd;
 
 	/*
 	 * Get the name of the failure file.  If no file has been defined
@@ -312,32 +380,15 @@ void failtmp (const char *username,
 	}
 
 	/*
-	 * Open the file for append.  It must already exist for this
-	 * feature to be used.
-	 */
-
-	if (access (ftmp, F_OK) != 0) {
-		return;
-	}
-
-	fd = open (ftmp, O_WRONLY | O_APPEND);
-	if (-1 == fd) {
-		SYSLOG ((LOG_WARN,
-		         "Can't append failure of user %s to %s.",
-		         username, ftmp));
-		return;
-	}
-
-	/*
-	 * Append the new failure record and close the log file.
+	 * Append the new failure record.  The file must already exist
+	 * for this feature to be used.  It stays open for the next
+	 * failures.
 	 */
 
-	if (   (write (fd, (const void *) failent, sizeof *failent) != (ssize_t) sizeof *failent)
-	    || (close (fd) != 0)) {
+	if (append_record (ftmp, failent, sizeof *failent) < 0) {
 		SYSLOG ((LOG_WARN,
 		         "Can't append failure of user %s to %s.",
 		         username, ftmp));
-		(void) close (fd);
 	}
 }
 
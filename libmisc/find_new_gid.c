@@ -38,6 +38,7 @@
 #include "prototypes.h"
 #include "groupio.h"
 #include "getdef.h"
+#include "probes.h"
 
 /*
  * get_ranges - Get the minimum and maximum ID ranges for the search
@@ -120,7 +121,7 @@ static int get_ranges (bool sys_group, gid_t *min_id, gid_t *max_id,
 static int check_gid (const gid_t gid,
 		      const gid_t gid_min,
 		      const gid_t gid_max,
-		      bool *used_gids)
+		      /*@null@*/const struct used_ids *used_gids)
 {
 	/* First test that the preferred ID is in the range */
 	if (gid < gid_min || gid > gid_max) {
@@ -131,7 +132,7 @@ static int check_gid (const gid_t gid,
 	 * Check whether we already detected this GID
 	 * using the gr_next() loop
 	 */
-	if (used_gids != NULL && used_gids[gid]) {
+	if (used_gids != NULL && used_ids_contains (used_gids, gid)) {
 		return EEXIST;
 	}
 	/* Check if the GID exists according to NSS */
@@ -150,24 +151,178 @@ static int check_gid (const gid_t gid,
 	return 0;
 }
 
+/* The set of used GIDs of add_remote_gids() */
+struct remote_gids {
+	struct used_ids *used;
+	gid_t gid_min;
+	gid_t gid_max;
+	bool ok;
+};
+
 /*
- * find_new_gid - Find a new unused GID.
+ * add_remote_gid - Add the GID of an entry to the set of used GIDs
+ *
+ * The scan is stopped when the memory is exhausted.
+ */
+static int add_remote_gid (const void *ent, void *arg)
+{
+	const struct group *grp = ent;
+	struct remote_gids *remote = arg;
+
+	if (   (grp->gr_gid >= remote->gid_min)
+	    && (grp->gr_gid <= remote->gid_max)
+	    && !used_ids_add (remote->used, (id_t) grp->gr_gid)) {
+		remote->ok = false;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * add_remote_gids - Add the GIDs which are not in the local database
+ * to the set of used GIDs
+ *
+ * If ID_ALLOC_ENUMERATE is enabled, all the GIDs enumerated with
+ * prefix_gr_scan() are added, so that only the selected GID has to be checked with NSS.
+ * The ranges listed in REMOTE_GID_RANGES are also added.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int add_remote_gids (struct used_ids *used_gids,
+                            gid_t gid_min, gid_t gid_max)
+{
+	const char *ranges;
+
+	if (getdef_bool ("ID_ALLOC_ENUMERATE")) {
+		struct remote_gids remote;
+
+		remote.used = used_gids;
+		remote.gid_min = gid_min;
+		remote.gid_max = gid_max;
+		remote.ok = true;
+		(void) prefix_gr_scan (add_remote_gid, &remote);
+		if (!remote.ok) {
+			fprintf (stderr,
+				 _("%s: failed to allocate memory: %s\n"),
+				 Prog, strerror (errno));
+			return -1;
+		}
+	}
+
+	ranges = getdef_str ("REMOTE_GID_RANGES");
+	if (   (NULL != ranges)
+	    && !used_ids_add_ranges (used_gids, ranges,
+	                             (id_t) gid_min, (id_t) gid_max)) {
+		if (EINVAL == errno) {
+			fprintf (stderr,
+				 _("%s: Invalid configuration: REMOTE_GID_RANGES (%s)\n"),
+				 Prog, ranges);
+		} else {
+			fprintf (stderr,
+				 _("%s: failed to allocate memory: %s\n"),
+				 Prog, strerror (errno));
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * seq_candidate - Try the GID which follows the last allocated one
+ * (ID_SEQUENCE), without scanning the group file.
+ *
+ * The system groups are allocated downwards, the other ones upwards.
+ *
+ * Return true and set *gid if this GID is available.
+ */
+static bool seq_candidate (bool sys_group, gid_t gid_min, gid_t gid_max, gid_t *gid)
+{
+	struct used_ids used_gids = {NULL, 0, 0};
+	gid_t last, id;
+	bool found;
+
+	if (!gr_seq_get (sys_group, &last)) {
+		return false;
+	}
+	if (sys_group) {
+		if ((last <= gid_min) || (last > gid_max)) {
+			return false;
+		}
+		id = last - 1;
+	} else {
+		if ((last < gid_min) || (last >= gid_max)) {
+			return false;
+		}
+		id = last + 1;
+	}
+
+	/* The local entries are found with the GID index */
+	if (add_remote_gids (&used_gids, gid_min, gid_max) != 0) {
+		used_ids_free (&used_gids);
+		return false;
+	}
+	used_ids_sort (&used_gids);
+	found =    (check_gid (id, gid_min, gid_max, &used_gids) == 0)
+	        && (gr_locate_gid (id) == NULL);
+	used_ids_free (&used_gids);
+	if (!found) {
+		return false;
+	}
+
+	*gid = id;
+	gr_seq_set (sys_group, id);
+	return true;
+}
+
+/*
+ * seq_skip - Do not search the GIDs before the last allocated one
+ * (ID_SEQUENCE), so that the GIDs of the deleted groups are not reused
+ * until the range is exhausted.
  *
- * If successful, find_new_gid provides an unused group ID in the
+ * lowest_found and highest_found are where the searches for system and
+ * other groups start.
+ */
+static void seq_skip (bool sys_group, gid_t gid_min, gid_t gid_max,
+                      gid_t *lowest_found, gid_t *highest_found)
+{
+	gid_t last;
+
+	if (!gr_seq_get (sys_group, &last)) {
+		return;
+	}
+	if (sys_group) {
+		if (   (last > gid_min) && (last <= gid_max)
+		    && (last - 1 < *lowest_found)) {
+			*lowest_found = last - 1;
+		}
+	} else {
+		if (   (last >= gid_min) && (last < gid_max)
+		    && (last + 1 > *highest_found)) {
+			*highest_found = last + 1;
+		}
+	}
+}
+
+/*
+ * search_gid - Search a new unused GID, for find_new_gid().
+ *
+ * If successful, search_gid provides an unused group ID in the
  * [GID_MIN:GID_MAX] range.
  * This ID should be higher than all the used GID, but if not possible,
  * the lowest unused ID in the range will be returned.
  * 
  * Return 0 on success, -1 if no unused GIDs are available.
  */
-int find_new_gid (bool sys_group,
-                 gid_t *gid,
-                 /*@null@*/gid_t const *preferred_gid)
+static int search_gid (bool sys_group,
+                      gid_t *gid,
+                      /*@null@*/gid_t const *preferred_gid)
 {
-	bool *used_gids;
+	struct used_ids used_gids = {NULL, 0, 0};
 	const struct group *grp;
 	gid_t gid_min, gid_max, preferred_min;
-	gid_t group_id, id;
+	gid_t group_id;
+	id_t id;
 	gid_t lowest_found, highest_found;
 	int result;
 	int nospam = 0;
@@ -221,6 +376,10 @@ int find_new_gid (bool sys_group,
 		}
 	}
 
+	if (seq_candidate (sys_group, gid_min, gid_max, gid)) {
+		return 0;
+	}
+
 	/*
 	 * Search the entire group file,
 	 * looking for the next unused value.
@@ -240,16 +399,6 @@ int find_new_gid (bool sys_group,
 	 *
 	 */
 
-	/* Create an array to hold all of the discovered GIDs */
-	used_gids = malloc (sizeof (bool) * (gid_max +1));
-	if (NULL == used_gids) {
-		fprintf (stderr,
-			 _("%s: failed to allocate memory: %s\n"),
-			 Prog, strerror (errno));
-		return -1;
-	}
-	memset (used_gids, false, sizeof (bool) * (gid_max + 1));
-
 	/* First look for the lowest and highest value in the local database */
 	(void) gr_rewind ();
 	highest_found = gid_min;
@@ -271,13 +420,27 @@ int find_new_gid (bool sys_group,
 			highest_found = grp->gr_gid + 1;
 		}
 
-		/* create index of used GIDs */
+		/*
+		 * Create an index of the used GIDs. Only the IDs of the
+		 * range are kept, so that the memory used depends on the
+		 * number of entries, and not on GID_MAX.
+		 */
 		if (grp->gr_gid >= gid_min
-			&& grp->gr_gid <= gid_max) {
-
-			used_gids[grp->gr_gid] = true;
+			&& grp->gr_gid <= gid_max
+			&& !used_ids_add (&used_gids, (id_t) grp->gr_gid)) {
+			fprintf (stderr,
+				 _("%s: failed to allocate memory: %s\n"),
+				 Prog, strerror (errno));
+			used_ids_free (&used_gids);
+			return -1;
 		}
 	}
+	if (add_remote_gids (&used_gids, gid_min, gid_max) != 0) {
+		used_ids_free (&used_gids);
+		return -1;
+	}
+	used_ids_sort (&used_gids);
+	seq_skip (sys_group, gid_min, gid_max, &lowest_found, &highest_found);
 
 	if (sys_group) {
 		/*
@@ -306,11 +469,16 @@ int find_new_gid (bool sys_group,
 
 		/* Search through all of the IDs in the range */
 		for (id = lowest_found; id >= gid_min; id--) {
-			result = check_gid (id, gid_min, gid_max, used_gids);
+			/* Skip the GIDs known to be used */
+			if (!used_ids_prev_free (&used_gids, &id, gid_min)) {
+				break;
+			}
+			result = check_gid (id, gid_min, gid_max, &used_gids);
 			if (result == 0) {
 				/* This GID is available. Return it. */
 				*gid = id;
-				free (used_gids);
+				gr_seq_set (sys_group, id);
+				used_ids_free (&used_gids);
 				return 0;
 			} else if (result == EEXIST) {
 				/* This GID is in use, we'll continue to the next */
@@ -349,11 +517,16 @@ int find_new_gid (bool sys_group,
 		 */
 		if (lowest_found != gid_max) {
 			for (id = gid_max; id >= gid_min; id--) {
-				result = check_gid (id, gid_min, gid_max, used_gids);
+				/* Skip the GIDs known to be used */
+				if (!used_ids_prev_free (&used_gids, &id, gid_min)) {
+					break;
+				}
+				result = check_gid (id, gid_min, gid_max, &used_gids);
 				if (result == 0) {
 					/* This GID is available. Return it. */
 					*gid = id;
-					free (used_gids);
+					gr_seq_set (sys_group, id);
+					used_ids_free (&used_gids);
 					return 0;
 				} else if (result == EEXIST) {
 					/* This GID is in use, we'll continue to the next */
@@ -409,11 +582,16 @@ int find_new_gid (bool sys_group,
 
 		/* Search through all of the IDs in the range */
 		for (id = highest_found; id <= gid_max; id++) {
-			result = check_gid (id, gid_min, gid_max, used_gids);
+			/* Skip the GIDs known to be used */
+			if (!used_ids_next_free (&used_gids, &id, gid_max)) {
+				break;
+			}
+			result = check_gid (id, gid_min, gid_max, &used_gids);
 			if (result == 0) {
 				/* This GID is available. Return it. */
 				*gid = id;
-				free (used_gids);
+				gr_seq_set (sys_group, id);
+				used_ids_free (&used_gids);
 				return 0;
 			} else if (result == EEXIST) {
 				/* This GID is in use, we'll continue to the next */
@@ -452,11 +630,16 @@ int find_new_gid (bool sys_group,
 		 */
 		if (highest_found != gid_min) {
 			for (id = gid_min; id <= gid_max; id++) {
-				result = check_gid (id, gid_min, gid_max, used_gids);
+				/* Skip the GIDs known to be used */
+				if (!used_ids_next_free (&used_gids, &id, gid_max)) {
+					break;
+				}
+				result = check_gid (id, gid_min, gid_max, &used_gids);
 				if (result == 0) {
 					/* This GID is available. Return it. */
 					*gid = id;
-					free (used_gids);
+					gr_seq_set (sys_group, id);
+					used_ids_free (&used_gids);
 					return 0;
 				} else if (result == EEXIST) {
 					/* This GID is in use, we'll continue to the next */
@@ -492,7 +675,184 @@ int find_new_gid (bool sys_group,
 		_("%s: Can't get unique GID (no more available GIDs)\n"),
 		Prog);
 	SYSLOG ((LOG_WARN, "no more available GIDs on the system"));
-	free (used_gids);
+	used_ids_free (&used_gids);
 	return -1;
 }
 
+/*
+ * find_new_gid - Find a new unused GID.
+ *
+ * Return 0 on success, -1 if no unused GIDs are available.
+ */
+int find_new_gid (bool sys_group,
+                 gid_t *gid,
+                 /*@null@*/gid_t const *preferred_gid)
+{
+	int ret;
+
+	SHADOW_PROBE1 (find_new_gid__entry, (int) sys_group);
+	ret = search_gid (sys_group, gid, preferred_gid);
+	SHADOW_PROBE2 (find_new_gid__return, ret,
+	               (0 == ret) ? (unsigned long) *gid : 0UL);
+	return ret;
+}
+
+/*
+ * setup_gid_pool - Prepare the pool of reserve_gids()
+ *
+ * The pool starts where find_new_gid() would start its search.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int setup_gid_pool (struct id_pool *pool, bool sys_group,
+                          gid_t gid_min, gid_t gid_max)
+{
+	const struct group *grp;
+	gid_t lowest_found = gid_max, highest_found = gid_min;
+
+	(void) gr_rewind ();
+	while ((grp = gr_next ()) != NULL) {
+		if ((grp->gr_gid < gid_min) || (grp->gr_gid > gid_max)) {
+			continue;
+		}
+		if (grp->gr_gid <= lowest_found) {
+			lowest_found = grp->gr_gid - 1;
+		}
+		if (grp->gr_gid >= highest_found) {
+			highest_found = grp->gr_gid + 1;
+		}
+		if (!used_ids_add (&pool->used, (id_t) grp->gr_gid)) {
+			fprintf (stderr,
+				 _("%s: failed to allocate memory: %s\n"),
+				 Prog, strerror (errno));
+			id_pool_free (pool);
+			return -1;
+		}
+	}
+	if (add_remote_gids (&pool->used, gid_min, gid_max) != 0) {
+		id_pool_free (pool);
+		return -1;
+	}
+	used_ids_sort (&pool->used);
+	seq_skip (sys_group, gid_min, gid_max, &lowest_found, &highest_found);
+
+	if (sys_group) {
+		if (lowest_found < gid_min) {
+			lowest_found = gid_max;
+		}
+		id_pool_setup (pool, (id_t) gid_min, (id_t) gid_max,
+		               (id_t) lowest_found, true);
+	} else {
+		if (highest_found > gid_max) {
+			highest_found = gid_min;
+		}
+		id_pool_setup (pool, (id_t) gid_min, (id_t) gid_max,
+		               (id_t) highest_found, false);
+	}
+	return 0;
+}
+
+/*
+ * prepare_gid_pool - Set up the pool of reserve_gids(), if it was not
+ * set up yet.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int prepare_gid_pool (struct id_pool *pool, bool sys_group)
+{
+	gid_t gid_min, gid_max, preferred_min;
+
+	if (pool->ready) {
+		return 0;
+	}
+	if (get_ranges (sys_group, &gid_min, &gid_max, &preferred_min) == EINVAL) {
+		return -1;
+	}
+	return setup_gid_pool (pool, sys_group, gid_min, gid_max);
+}
+
+/*
+ * reserve_gids - Find n new unused GIDs.
+ *
+ * This selects the same GIDs as n calls to find_new_gid(), with the
+ * groups added between the calls, but the databases are scanned only
+ * once, when the pool is set up by the first call. The following
+ * calls continue the search where the previous one stopped.
+ *
+ * The pool must be zero-initialized before the first call, and
+ * released with id_pool_free(). sys_group must not change between calls.
+ *
+ * If preferred_gid is available, it is used as the first GID.
+ *
+ * Return 0 on success, -1 if not enough unused GIDs are available.
+ */
+int reserve_gids (struct id_pool *pool, bool sys_group, size_t n,
+                  gid_t *gids, /*@null@*/gid_t const *preferred_gid)
+{
+	gid_t gid_min, gid_max, preferred_min;
+	size_t i = 0;
+	int nospam = 0;
+
+	assert ((gids != NULL) || (0 == n));
+
+	if (get_ranges (sys_group, &gid_min, &gid_max, &preferred_min) == EINVAL) {
+		return -1;
+	}
+
+	if ((NULL != preferred_gid) && (n > 0)) {
+		int result = check_gid (*preferred_gid, preferred_min, gid_max, NULL);
+
+		if ((result == 0) && (gr_locate_gid (*preferred_gid) == NULL)) {
+			gids[i] = *preferred_gid;
+			i++;
+		} else if ((result != EEXIST) && (result != ERANGE) && (result != 0)) {
+			fprintf (stderr,
+				_("%s: Encountered error attempting to use "
+				  "preferred GID: %s\n"),
+				Prog, strerror (result));
+			return -1;
+		}
+	}
+
+	if (   (i < n)
+	    && !pool->ready
+	    && (setup_gid_pool (pool, sys_group, gid_min, gid_max) != 0)) {
+		return -1;
+	}
+
+	while (i < n) {
+		id_t id;
+		int result;
+
+		if (!id_pool_next (pool, &id)) {
+			fprintf (stderr,
+				_("%s: Can't get unique GID (no more available GIDs)\n"),
+				Prog);
+			SYSLOG ((LOG_WARN, "no more available GIDs on the system"));
+			return -1;
+		}
+
+		/* Skip the GIDs used since the pool was set up */
+		if (gr_locate_gid ((gid_t) id) != NULL) {
+			continue;
+		}
+
+		result = check_gid ((gid_t) id, gid_min, gid_max, NULL);
+		if (result == 0) {
+			gids[i] = (gid_t) id;
+			gr_seq_set (sys_group, (gid_t) id);
+			i++;
+		} else if ((result != EEXIST) && !nospam) {
+			fprintf (stderr,
+				_("%s: Can't get unique GID (%s). "
+				  "Suppressing additional messages.\n"),
+				Prog, strerror (result));
+			SYSLOG ((LOG_ERR,
+				"Error checking available GIDs: %s",
+				strerror (result)));
+			nospam = 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,159 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "prototypes.h"
+#include "pwio.h"
+#include "groupio.h"
+
+/*
+ * common_next_free - Find the first ID from *id toward last (upward, or
+ * downward if down is true) which is in none of the sorted sets u and g.
+ *
+ * Each step skips a whole interval of one of the sets, so that the
+ * search depends on the number of intervals, and not on the number of
+ * IDs.
+ *
+ * It returns false if there are no such ID. Otherwise, *id is set to
+ * this ID.
+ */
+static bool common_next_free (const struct used_ids *u,
+                              const struct used_ids *g,
+                              id_t *id, id_t last, bool down)
+{
+	id_t cur = *id;
+
+	for (;;) {
+		id_t prev = cur;
+
+		if (down) {
+			if (   !used_ids_prev_free (u, &cur, last)
+			    || !used_ids_prev_free (g, &cur, last)) {
+				return false;
+			}
+		} else {
+			if (   !used_ids_next_free (u, &cur, last)
+			    || !used_ids_next_free (g, &cur, last)) {
+				return false;
+			}
+		}
+		if (cur == prev) {
+			/* Free in both sets */
+			*id = cur;
+			return true;
+		}
+	}
+}
+
+/*
+ * ids_available - Check that id is not used as a UID or a GID since the
+ * pools were set up, nor by the other name services.
+ */
+static bool ids_available (id_t id)
+{
+	return    (pw_locate_uid ((uid_t) id) == NULL)
+	       && (gr_locate_gid ((gid_t) id) == NULL)
+	       && (prefix_getpwuid ((uid_t) id) == NULL)
+	       && (prefix_getgrgid ((gid_t) id) == NULL);
+}
+
+/*
+ * search_ids - Search [first:last] for an ID which is free as a UID and
+ * as a GID, starting from first (from last if down is true).
+ */
+static bool search_ids (const struct id_pool *uid_pool,
+                        const struct id_pool *gid_pool,
+                        id_t first, id_t last, bool down, id_t *id)
+{
+	id_t cur = down ? last : first;
+	id_t end = down ? first : last;
+
+	if (first > last) {
+		return false;
+	}
+	while (common_next_free (&uid_pool->used, &gid_pool->used,
+	                         &cur, end, down)) {
+		if (ids_available (cur)) {
+			*id = cur;
+			return true;
+		}
+		if (cur == end) {
+			break;
+		}
+		cur = down ? cur - 1 : cur + 1;
+	}
+	return false;
+}
+
+/*
+ * reserve_ids - Find an ID which is unused both as a UID and as a GID,
+ * for a user and its group.
+ *
+ * The UID and GID pools of reserve_uids() and reserve_gids() are set up
+ * if needed, and their sets of used IDs are intersected, so that the
+ * databases are scanned once and the other name services are only
+ * queried for the candidates which are free locally.
+ *
+ * The search starts after the IDs used in both ranges (before them for
+ * system accounts), as find_new_uid() and find_new_gid() do, and then
+ * restarts from the other end of the common range.
+ *
+ * Return 0 on success, -1 if there are no common unused IDs (the caller
+ * can still select the UID and the GID separately).
+ */
+int reserve_ids (struct id_pool *uid_pool, struct id_pool *gid_pool,
+                 bool sys, uid_t *uid, gid_t *gid)
+{
+	id_t min, max, start, id;
+	bool found;
+
+	assert ((NULL != uid) && (NULL != gid));
+
+	if (   (prepare_uid_pool (uid_pool, sys) != 0)
+	    || (prepare_gid_pool (gid_pool, sys) != 0)) {
+		return -1;
+	}
+
+	min = (uid_pool->min > gid_pool->min) ? uid_pool->min : gid_pool->min;
+	max = (uid_pool->max < gid_pool->max) ? uid_pool->max : gid_pool->max;
+	if (min > max) {
+		return -1;
+	}
+
+	if (sys) {
+		start = (uid_pool->start < gid_pool->start)
+		        ? uid_pool->start : gid_pool->start;
+	} else {
+		start = (uid_pool->start > gid_pool->start)
+		        ? uid_pool->start : gid_pool->start;
+	}
+	if (start < min) {
+		start = min;
+	} else if (start > max) {
+		start = max;
+	}
+
+	if (sys) {
+		found =    search_ids (uid_pool, gid_pool, min, start, true, &id)
+		        || (   (start < max)
+		            && search_ids (uid_pool, gid_pool, start + 1, max,
+		                           true, &id));
+	} else {
+		found =    search_ids (uid_pool, gid_pool, start, max, false, &id)
+		        || (   (start > min)
+		            && search_ids (uid_pool, gid_pool, min, start - 1,
+		                           false, &id));
+	}
+	if (!found) {
+		return -1;
+	}
+
+	*uid = (uid_t) id;
+	*gid = (gid_t) id;
+	pw_seq_set (sys, *uid);
+	gr_seq_set (sys, *gid);
+	return 0;
+}
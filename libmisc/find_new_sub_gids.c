@@ -80,6 +80,48 @@ int find_new_sub_gids (const char *owner,
 	*range_count = count;
 	return 0;
 }
+
+/*
+ * reserve_sub_gids - Find n new unused ranges of GIDs.
+ *
+ * This selects the same ranges as n calls to find_new_sub_gids(), with
+ * the ranges added between the calls, but the database is scanned only
+ * once. The ranges should then be added with sub_gid_add_ranges().
+ *
+ * Return 0 on success, -1 if not enough unused ranges are available.
+ */
+int reserve_sub_gids (size_t n, unsigned long *range_starts,
+		      unsigned long *range_count)
+{
+	unsigned long min, max;
+	unsigned long count;
+
+	assert ((range_starts != NULL) || (0 == n));
+	assert (range_count != NULL);
+
+	min = getdef_ulong ("SUB_GID_MIN", 100000UL);
+	max = getdef_ulong ("SUB_GID_MAX", 600100000UL);
+	count = getdef_ulong ("SUB_GID_COUNT", 65536);
+
+	if (min > max || count >= max || (min + count - 1) > max) {
+		(void) fprintf (stderr,
+				_("%s: Invalid configuration: SUB_GID_MIN (%lu),"
+				  " SUB_GID_MAX (%lu), SUB_GID_COUNT (%lu)\n"),
+			Prog, min, max, count);
+		return -1;
+	}
+
+	if (!sub_gid_find_free_ranges (min, max, count,
+	                               n, range_starts)) {
+		fprintf (stderr,
+		         _("%s: Can't get unique subordinate GID range\n"),
+		         Prog);
+		SYSLOG ((LOG_WARN, "no more available subordinate GIDs on the system"));
+		return -1;
+	}
+	*range_count = count;
+	return 0;
+}
 #else				/* !ENABLE_SUBIDS */
 extern int errno;		/* warning: ANSI C forbids an empty source file */
 #endif				/* !ENABLE_SUBIDS */
@@ -0,0 +1,61 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#ifdef ENABLE_SUBIDS
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "prototypes.h"
+#include "subordinateio.h"
+#include "getdef.h"
+
+/*
+ * reserve_sub_ids - Find n new ranges of IDs which are unused both as
+ * subordinate UIDs and as subordinate GIDs.
+ *
+ * The ranges are in [SUB_UID_MIN:SUB_UID_MAX] and in
+ * [SUB_GID_MIN:SUB_GID_MAX], and both databases are searched at once,
+ * so that a user gets the same subordinate UIDs and GIDs. They should
+ * then be added with sub_uid_add_ranges() and sub_gid_add_ranges().
+ *
+ * Return 0 on success, -1 if SUB_UID_COUNT and SUB_GID_COUNT differ or
+ * if not enough common ranges are available. Nothing is reported: the
+ * caller can still select the UIDs and the GIDs with reserve_sub_uids()
+ * and reserve_sub_gids().
+ */
+int reserve_sub_ids (size_t n, unsigned long *range_starts,
+		     unsigned long *range_count)
+{
+	unsigned long uid_min, uid_max, gid_min, gid_max;
+	unsigned long min, max;
+	unsigned long count;
+
+	assert ((range_starts != NULL) || (0 == n));
+	assert (range_count != NULL);
+
+	uid_min = getdef_ulong ("SUB_UID_MIN", 100000UL);
+	uid_max = getdef_ulong ("SUB_UID_MAX", 600100000UL);
+	gid_min = getdef_ulong ("SUB_GID_MIN", 100000UL);
+	gid_max = getdef_ulong ("SUB_GID_MAX", 600100000UL);
+	count = getdef_ulong ("SUB_UID_COUNT", 65536);
+	if (getdef_ulong ("SUB_GID_COUNT", 65536) != count) {
+		return -1;
+	}
+
+	min = (uid_min > gid_min) ? uid_min : gid_min;
+	max = (uid_max < gid_max) ? uid_max : gid_max;
+	if (min > max || count >= max || (min + count - 1) > max) {
+		return -1;
+	}
+
+	if (!sub_ids_find_free_ranges (min, max, count, n, range_starts)) {
+		return -1;
+	}
+	*range_count = count;
+	return 0;
+}
+#else				/* !ENABLE_SUBIDS */
+extern int errno;		/* warning: ANSI C forbids an empty source file */
+#endif				/* !ENABLE_SUBIDS */
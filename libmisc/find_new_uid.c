@@ -38,6 +38,7 @@
 #include "prototypes.h"
 #include "pwio.h"
 #include "getdef.h"
+#include "probes.h"
 
 /*
  * get_ranges - Get the minimum and maximum ID ranges for the search
@@ -120,7 +121,7 @@ static int get_ranges (bool sys_user, uid_t *min_id, uid_t *max_id,
 static int check_uid(const uid_t uid,
 		     const uid_t uid_min,
 		     const uid_t uid_max,
-		     bool *used_uids)
+		     /*@null@*/const struct used_ids *used_uids)
 {
 	/* First test that the preferred ID is in the range */
 	if (uid < uid_min || uid > uid_max) {
@@ -131,7 +132,7 @@ static int check_uid(const uid_t uid,
 	 * Check whether we already detected this UID
 	 * using the pw_next() loop
 	 */
-	if (used_uids != NULL && used_uids[uid]) {
+	if (used_uids != NULL && used_ids_contains (used_uids, uid)) {
 		return EEXIST;
 	}
 	/* Check if the UID exists according to NSS */
@@ -150,24 +151,178 @@ static int check_uid(const uid_t uid,
 	return 0;
 }
 
+/* The set of used UIDs of add_remote_uids() */
+struct remote_uids {
+	struct used_ids *used;
+	uid_t uid_min;
+	uid_t uid_max;
+	bool ok;
+};
+
 /*
- * find_new_uid - Find a new unused UID.
+ * add_remote_uid - Add the UID of an entry to the set of used UIDs
+ *
+ * The scan is stopped when the memory is exhausted.
+ */
+static int add_remote_uid (const void *ent, void *arg)
+{
+	const struct passwd *pwd = ent;
+	struct remote_uids *remote = arg;
+
+	if (   (pwd->pw_uid >= remote->uid_min)
+	    && (pwd->pw_uid <= remote->uid_max)
+	    && !used_ids_add (remote->used, (id_t) pwd->pw_uid)) {
+		remote->ok = false;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * add_remote_uids - Add the UIDs which are not in the local database
+ * to the set of used UIDs
+ *
+ * If ID_ALLOC_ENUMERATE is enabled, all the UIDs enumerated with
+ * prefix_pw_scan() are added, so that only the selected UID has to be checked with NSS.
+ * The ranges listed in REMOTE_UID_RANGES are also added.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int add_remote_uids (struct used_ids *used_uids,
+                            uid_t uid_min, uid_t uid_max)
+{
+	const char *ranges;
+
+	if (getdef_bool ("ID_ALLOC_ENUMERATE")) {
+		struct remote_uids remote;
+
+		remote.used = used_uids;
+		remote.uid_min = uid_min;
+		remote.uid_max = uid_max;
+		remote.ok = true;
+		(void) prefix_pw_scan (add_remote_uid, &remote);
+		if (!remote.ok) {
+			fprintf (stderr,
+				 _("%s: failed to allocate memory: %s\n"),
+				 Prog, strerror (errno));
+			return -1;
+		}
+	}
+
+	ranges = getdef_str ("REMOTE_UID_RANGES");
+	if (   (NULL != ranges)
+	    && !used_ids_add_ranges (used_uids, ranges,
+	                             (id_t) uid_min, (id_t) uid_max)) {
+		if (EINVAL == errno) {
+			fprintf (stderr,
+				 _("%s: Invalid configuration: REMOTE_UID_RANGES (%s)\n"),
+				 Prog, ranges);
+		} else {
+			fprintf (stderr,
+				 _("%s: failed to allocate memory: %s\n"),
+				 Prog, strerror (errno));
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * seq_candidate - Try the UID which follows the last allocated one
+ * (ID_SEQUENCE), without scanning the passwd file.
+ *
+ * The system users are allocated downwards, the other ones upwards.
+ *
+ * Return true and set *uid if this UID is available.
+ */
+static bool seq_candidate (bool sys_user, uid_t uid_min, uid_t uid_max, uid_t *uid)
+{
+	struct used_ids used_uids = {NULL, 0, 0};
+	uid_t last, id;
+	bool found;
+
+	if (!pw_seq_get (sys_user, &last)) {
+		return false;
+	}
+	if (sys_user) {
+		if ((last <= uid_min) || (last > uid_max)) {
+			return false;
+		}
+		id = last - 1;
+	} else {
+		if ((last < uid_min) || (last >= uid_max)) {
+			return false;
+		}
+		id = last + 1;
+	}
+
+	/* The local entries are found with the UID index */
+	if (add_remote_uids (&used_uids, uid_min, uid_max) != 0) {
+		used_ids_free (&used_uids);
+		return false;
+	}
+	used_ids_sort (&used_uids);
+	found =    (check_uid (id, uid_min, uid_max, &used_uids) == 0)
+	        && (pw_locate_uid (id) == NULL);
+	used_ids_free (&used_uids);
+	if (!found) {
+		return false;
+	}
+
+	*uid = id;
+	pw_seq_set (sys_user, id);
+	return true;
+}
+
+/*
+ * seq_skip - Do not search the UIDs before the last allocated one
+ * (ID_SEQUENCE), so that the UIDs of the deleted users are not reused
+ * until the range is exhausted.
  *
- * If successful, find_new_uid provides an unused user ID in the
+ * lowest_found and highest_found are where the searches for system and
+ * other users start.
+ */
+static void seq_skip (bool sys_user, uid_t uid_min, uid_t uid_max,
+                      uid_t *lowest_found, uid_t *highest_found)
+{
+	uid_t last;
+
+	if (!pw_seq_get (sys_user, &last)) {
+		return;
+	}
+	if (sys_user) {
+		if (   (last > uid_min) && (last <= uid_max)
+		    && (last - 1 < *lowest_found)) {
+			*lowest_found = last - 1;
+		}
+	} else {
+		if (   (last >= uid_min) && (last < uid_max)
+		    && (last + 1 > *highest_found)) {
+			*highest_found = last + 1;
+		}
+	}
+}
+
+/*
+ * search_uid - Search a new unused UID, for find_new_uid().
+ *
+ * If successful, search_uid provides an unused user ID in the
  * [UID_MIN:UID_MAX] range.
  * This ID should be higher than all the used UID, but if not possible,
  * the lowest unused ID in the range will be returned.
  * 
  * Return 0 on success, -1 if no unused UIDs are available.
  */
-int find_new_uid(bool sys_user,
-                 uid_t *uid,
-                 /*@null@*/uid_t const *preferred_uid)
+static int search_uid (bool sys_user,
+                      uid_t *uid,
+                      /*@null@*/uid_t const *preferred_uid)
 {
-	bool *used_uids;
+	struct used_ids used_uids = {NULL, 0, 0};
 	const struct passwd *pwd;
 	uid_t uid_min, uid_max, preferred_min;
-	uid_t user_id, id;
+	uid_t user_id;
+	id_t id;
 	uid_t lowest_found, highest_found;
 	int result;
 	int nospam = 0;
@@ -221,6 +376,10 @@ int find_new_uid(bool sys_user,
 		}
 	}
 
+	if (seq_candidate (sys_user, uid_min, uid_max, uid)) {
+		return 0;
+	}
+
 	/*
 	 * Search the entire passwd file,
 	 * looking for the next unused value.
@@ -240,16 +399,6 @@ int find_new_uid(bool sys_user,
 	 *
 	 */
 
-	/* Create an array to hold all of the discovered UIDs */
-	used_uids = malloc (sizeof (bool) * (uid_max +1));
-	if (NULL == used_uids) {
-		fprintf (stderr,
-			 _("%s: failed to allocate memory: %s\n"),
-			 Prog, strerror (errno));
-		return -1;
-	}
-	memset (used_uids, false, sizeof (bool) * (uid_max + 1));
-
 	/* First look for the lowest and highest value in the local database */
 	(void) pw_rewind ();
 	highest_found = uid_min;
@@ -271,13 +420,27 @@ int find_new_uid(bool sys_user,
 			highest_found = pwd->pw_uid + 1;
 		}
 
-		/* create index of used UIDs */
+		/*
+		 * Create an index of the used UIDs. Only the IDs of the
+		 * range are kept, so that the memory used depends on the
+		 * number of entries, and not on UID_MAX.
+		 */
 		if (pwd->pw_uid >= uid_min
-			&& pwd->pw_uid <= uid_max) {
-
-			used_uids[pwd->pw_uid] = true;
+			&& pwd->pw_uid <= uid_max
+			&& !used_ids_add (&used_uids, (id_t) pwd->pw_uid)) {
+			fprintf (stderr,
+				 _("%s: failed to allocate memory: %s\n"),
+				 Prog, strerror (errno));
+			used_ids_free (&used_uids);
+			return -1;
 		}
 	}
+	if (add_remote_uids (&used_uids, uid_min, uid_max) != 0) {
+		used_ids_free (&used_uids);
+		return -1;
+	}
+	used_ids_sort (&used_uids);
+	seq_skip (sys_user, uid_min, uid_max, &lowest_found, &highest_found);
 
 	if (sys_user) {
 		/*
@@ -306,11 +469,16 @@ int find_new_uid(bool sys_user,
 
 		/* Search through all of the IDs in the range */
 		for (id = lowest_found; id >= uid_min; id--) {
-			result = check_uid (id, uid_min, uid_max, used_uids);
+			/* Skip the UIDs known to be used */
+			if (!used_ids_prev_free (&used_uids, &id, uid_min)) {
+				break;
+			}
+			result = check_uid (id, uid_min, uid_max, &used_uids);
 			if (result == 0) {
 				/* This UID is available. Return it. */
 				*uid = id;
-				free (used_uids);
+				pw_seq_set (sys_user, id);
+				used_ids_free (&used_uids);
 				return 0;
 			} else if (result == EEXIST) {
 				/* This UID is in use, we'll continue to the next */
@@ -349,11 +517,16 @@ int find_new_uid(bool sys_user,
 		 */
 		if (lowest_found != uid_max) {
 			for (id = uid_max; id >= uid_min; id--) {
-				result = check_uid (id, uid_min, uid_max, used_uids);
+				/* Skip the UIDs known to be used */
+				if (!used_ids_prev_free (&used_uids, &id, uid_min)) {
+					break;
+				}
+				result = check_uid (id, uid_min, uid_max, &used_uids);
 				if (result == 0) {
 					/* This UID is available. Return it. */
 					*uid = id;
-					free (used_uids);
+					pw_seq_set (sys_user, id);
+					used_ids_free (&used_uids);
 					return 0;
 				} else if (result == EEXIST) {
 					/* This UID is in use, we'll continue to the next */
@@ -409,11 +582,16 @@ int find_new_uid(bool sys_user,
 
 		/* Search through all of the IDs in the range */
 		for (id = highest_found; id <= uid_max; id++) {
-			result = check_uid (id, uid_min, uid_max, used_uids);
+			/* Skip the UIDs known to be used */
+			if (!used_ids_next_free (&used_uids, &id, uid_max)) {
+				break;
+			}
+			result = check_uid (id, uid_min, uid_max, &used_uids);
 			if (result == 0) {
 				/* This UID is available. Return it. */
 				*uid = id;
-				free (used_uids);
+				pw_seq_set (sys_user, id);
+				used_ids_free (&used_uids);
 				return 0;
 			} else if (result == EEXIST) {
 				/* This UID is in use, we'll continue to the next */
@@ -452,11 +630,16 @@ int find_new_uid(bool sys_user,
 		 */
 		if (highest_found != uid_min) {
 			for (id = uid_min; id <= uid_max; id++) {
-				result = check_uid (id, uid_min, uid_max, used_uids);
+				/* Skip the UIDs known to be used */
+				if (!used_ids_next_free (&used_uids, &id, uid_max)) {
+					break;
+				}
+				result = check_uid (id, uid_min, uid_max, &used_uids);
 				if (result == 0) {
 					/* This UID is available. Return it. */
 					*uid = id;
-					free (used_uids);
+					pw_seq_set (sys_user, id);
+					used_ids_free (&used_uids);
 					return 0;
 				} else if (result == EEXIST) {
 					/* This UID is in use, we'll continue to the next */
@@ -492,7 +675,184 @@ int find_new_uid(bool sys_user,
 		_("%s: Can't get unique UID (no more available UIDs)\n"),
 		Prog);
 	SYSLOG ((LOG_WARN, "no more available UIDs on the system"));
-	free (used_uids);
+	used_ids_free (&used_uids);
 	return -1;
 }
 
+/*
+ * find_new_uid - Find a new unused UID.
+ *
+ * Return 0 on success, -1 if no unused UIDs are available.
+ */
+int find_new_uid(bool sys_user,
+                 uid_t *uid,
+                 /*@null@*/uid_t const *preferred_uid)
+{
+	int ret;
+
+	SHADOW_PROBE1 (find_new_uid__entry, (int) sys_user);
+	ret = search_uid (sys_user, uid, preferred_uid);
+	SHADOW_PROBE2 (find_new_uid__return, ret,
+	               (0 == ret) ? (unsigned long) *uid : 0UL);
+	return ret;
+}
+
+/*
+ * setup_uid_pool - Prepare the pool of reserve_uids()
+ *
+ * The pool starts where find_new_uid() would start its search.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int setup_uid_pool (struct id_pool *pool, bool sys_user,
+                          uid_t uid_min, uid_t uid_max)
+{
+	const struct passwd *pwd;
+	uid_t lowest_found = uid_max, highest_found = uid_min;
+
+	(void) pw_rewind ();
+	while ((pwd = pw_next ()) != NULL) {
+		if ((pwd->pw_uid < uid_min) || (pwd->pw_uid > uid_max)) {
+			continue;
+		}
+		if (pwd->pw_uid <= lowest_found) {
+			lowest_found = pwd->pw_uid - 1;
+		}
+		if (pwd->pw_uid >= highest_found) {
+			highest_found = pwd->pw_uid + 1;
+		}
+		if (!used_ids_add (&pool->used, (id_t) pwd->pw_uid)) {
+			fprintf (stderr,
+				 _("%s: failed to allocate memory: %s\n"),
+				 Prog, strerror (errno));
+			id_pool_free (pool);
+			return -1;
+		}
+	}
+	if (add_remote_uids (&pool->used, uid_min, uid_max) != 0) {
+		id_pool_free (pool);
+		return -1;
+	}
+	used_ids_sort (&pool->used);
+	seq_skip (sys_user, uid_min, uid_max, &lowest_found, &highest_found);
+
+	if (sys_user) {
+		if (lowest_found < uid_min) {
+			lowest_found = uid_max;
+		}
+		id_pool_setup (pool, (id_t) uid_min, (id_t) uid_max,
+		               (id_t) lowest_found, true);
+	} else {
+		if (highest_found > uid_max) {
+			highest_found = uid_min;
+		}
+		id_pool_setup (pool, (id_t) uid_min, (id_t) uid_max,
+		               (id_t) highest_found, false);
+	}
+	return 0;
+}
+
+/*
+ * prepare_uid_pool - Set up the pool of reserve_uids(), if it was not
+ * set up yet.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int prepare_uid_pool (struct id_pool *pool, bool sys_user)
+{
+	uid_t uid_min, uid_max, preferred_min;
+
+	if (pool->ready) {
+		return 0;
+	}
+	if (get_ranges (sys_user, &uid_min, &uid_max, &preferred_min) == EINVAL) {
+		return -1;
+	}
+	return setup_uid_pool (pool, sys_user, uid_min, uid_max);
+}
+
+/*
+ * reserve_uids - Find n new unused UIDs.
+ *
+ * This selects the same UIDs as n calls to find_new_uid(), with the
+ * users added between the calls, but the databases are scanned only
+ * once, when the pool is set up by the first call. The following
+ * calls continue the search where the previous one stopped.
+ *
+ * The pool must be zero-initialized before the first call, and
+ * released with id_pool_free(). sys_user must not change between calls.
+ *
+ * If preferred_uid is available, it is used as the first UID.
+ *
+ * Return 0 on success, -1 if not enough unused UIDs are available.
+ */
+int reserve_uids (struct id_pool *pool, bool sys_user, size_t n,
+                  uid_t *uids, /*@null@*/uid_t const *preferred_uid)
+{
+	uid_t uid_min, uid_max, preferred_min;
+	size_t i = 0;
+	int nospam = 0;
+
+	assert ((uids != NULL) || (0 == n));
+
+	if (get_ranges (sys_user, &uid_min, &uid_max, &preferred_min) == EINVAL) {
+		return -1;
+	}
+
+	if ((NULL != preferred_uid) && (n > 0)) {
+		int result = check_uid (*preferred_uid, preferred_min, uid_max, NULL);
+
+		if ((result == 0) && (pw_locate_uid (*preferred_uid) == NULL)) {
+			uids[i] = *preferred_uid;
+			i++;
+		} else if ((result != EEXIST) && (result != ERANGE) && (result != 0)) {
+			fprintf (stderr,
+				_("%s: Encountered error attempting to use "
+				  "preferred UID: %s\n"),
+				Prog, strerror (result));
+			return -1;
+		}
+	}
+
+	if (   (i < n)
+	    && !pool->ready
+	    && (setup_uid_pool (pool, sys_user, uid_min, uid_max) != 0)) {
+		return -1;
+	}
+
+	while (i < n) {
+		id_t id;
+		int result;
+
+		if (!id_pool_next (pool, &id)) {
+			fprintf (stderr,
+				_("%s: Can't get unique UID (no more available UIDs)\n"),
+				Prog);
+			SYSLOG ((LOG_WARN, "no more available UIDs on the system"));
+			return -1;
+		}
+
+		/* Skip the UIDs used since the pool was set up */
+		if (pw_locate_uid ((uid_t) id) != NULL) {
+			continue;
+		}
+
+		result = check_uid ((uid_t) id, uid_min, uid_max, NULL);
+		if (result == 0) {
+			uids[i] = (uid_t) id;
+			pw_seq_set (sys_user, (uid_t) id);
+			i++;
+		} else if ((result != EEXIST) && !nospam) {
+			fprintf (stderr,
+				_("%s: Can't get unique UID (%s). "
+				  "Suppressing additional messages.\n"),
+				Prog, strerror (result));
+			SYSLOG ((LOG_ERR,
+				"Error checking available UIDs: %s",
+				strerror (result)));
+			nospam = 1;
+		}
+	}
+
+	return 0;
+}
@@ -43,6 +43,7 @@
  * getgr_nam_gid - Return a pointer to the group specified by a string.
  * The string may be a valid GID or a valid groupname.
  * If the group does not exist on the system, NULL is returned.
+ * The group is released with gr_free_packed().
  */
 extern /*@only@*//*@null@*/struct group *getgr_nam_gid (/*@null@*/const char *grname)
 {
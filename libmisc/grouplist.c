@@ -0,0 +1,50 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdlib.h>
+#include <grp.h>
+#include "prototypes.h"
+
+/*
+ * user_grouplist - list the GIDs of the groups of a user
+ *
+ *	The list is built by getgrouplist(), with a single initgroups
+ *	query of NSS instead of a scan of the whole group database. It
+ *	always includes gid, which should be the primary group of the
+ *	user.
+ *
+ *	It returns an allocated list, or NULL if the groups could not be
+ *	listed this way. The caller should then scan the group database.
+ */
+/*@null@*//*@only@*/gid_t *user_grouplist (const char *user, gid_t gid,
+                                          /*@out@*/size_t *ngroups)
+{
+#ifdef HAVE_GETGROUPLIST
+	gid_t *groups = NULL;
+	int alloc = 16;
+	int n;
+	int i;
+
+	/* The groups may change between two calls. Do not retry forever. */
+	for (i = 0; i < 8; i++) {
+		free (groups);
+		groups = (gid_t *) malloc ((size_t) alloc * sizeof (*groups));
+		if (NULL == groups) {
+			return NULL;
+		}
+		n = alloc;
+		if (getgrouplist (user, gid, groups, &n) >= 0) {
+			*ngroups = (size_t) n;
+			return groups;
+		}
+		alloc = (n > alloc) ? n : alloc * 2;
+	}
+	free (groups);
+#else				/* !HAVE_GETGROUPLIST */
+	(void) user;
+	(void) gid;
+	(void) ngroups;
+#endif				/* !HAVE_GETGROUPLIST */
+	return NULL;
+}
@@ -0,0 +1,382 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif				/* HAVE_SYS_IOCTL_H */
+#ifdef HAVE_LINUX_BTRFS_H
+#include <sys/vfs.h>
+#include <linux/btrfs.h>
+#include <linux/magic.h>
+#endif				/* HAVE_LINUX_BTRFS_H */
+#ifdef HAVE_MNTENT_H
+#include <mntent.h>
+#endif				/* HAVE_MNTENT_H */
+#include "prototypes.h"
+#include "defines.h"
+#include "getdef.h"
+
+/*
+ * Home directories as file system volumes (HOME_SKEL_SNAPSHOT)
+ *
+ * When HOME_SKEL_SNAPSHOT names a snapshot of the skeleton directory,
+ * useradd -m creates the home directory as a writable clone of this
+ * snapshot, and userdel -r drops the clone, instead of copying and
+ * removing the files one by one:
+ *
+ *	btrfs:PATH	PATH is a (read only) btrfs subvolume. The home
+ *			directory is a snapshot of it, created in its parent
+ *			directory, which must be on the same btrfs file
+ *			system.
+ *	zfs:SNAPSHOT	SNAPSHOT is a ZFS snapshot (pool/skel@v1). The home
+ *			directory is a clone of it, created as a child of the
+ *			dataset mounted on its parent directory, and mounted
+ *			where the dataset inherits its mount point.
+ *
+ * The ownership of the files of the clone is then changed in one pass,
+ * like after a copy. Whenever a clone cannot be created, nothing is left
+ * behind, and the callers copy the skeleton as usual.
+ *
+ * Only the home directories which are a volume (the root of a btrfs
+ * subvolume, a mounted ZFS dataset) are dropped. The other ones are
+ * removed as usual.
+ */
+
+#ifndef ZFS_CMD
+#define ZFS_CMD	"/sbin/zfs"
+#endif
+
+/* The inode of the root directory of the btrfs subvolumes */
+#define BTRFS_SUBVOL_INO	256
+
+enum home_backend {
+	HOME_BACKEND_COPY,
+	HOME_BACKEND_BTRFS,
+	HOME_BACKEND_ZFS
+};
+
+/*
+ * home_backend - the backend of HOME_SKEL_SNAPSHOT, and its snapshot
+ */
+static enum home_backend home_backend (/*@out@*/const char **snapshot)
+{
+	const char *cp = getdef_str ("HOME_SKEL_SNAPSHOT");
+
+	*snapshot = NULL;
+	if (NULL == cp) {
+		return HOME_BACKEND_COPY;
+	}
+	if (strncmp (cp, "btrfs:", 6) == 0) {
+		*snapshot = cp + 6;
+		return HOME_BACKEND_BTRFS;
+	}
+	if (strncmp (cp, "zfs:", 4) == 0) {
+		*snapshot = cp + 4;
+		return HOME_BACKEND_ZFS;
+	}
+	return HOME_BACKEND_COPY;
+}
+
+/*
+ * split_home - split home in its parent directory and its name
+ *
+ *	It returns the parent directory (to be freed), or NULL if home has
+ *	no parent (with errno set).
+ */
+static /*@null@*/ /*@only@*/char *split_home (const char *home,
+                                              /*@out@*/const char **name)
+{
+	const char *cp = strrchr (home, '/');
+	char *parent;
+
+	if ((NULL == cp) || ('\0' == cp[1])) {
+		errno = EINVAL;
+		return NULL;
+	}
+	*name = cp + 1;
+	if (cp == home) {
+		return xstrdup ("/");
+	}
+	parent = xmalloc ((size_t) (cp - home) + 1);
+	memcpy (parent, home, (size_t) (cp - home));
+	parent[cp - home] = '\0';
+	return parent;
+}
+
+#ifdef HAVE_LINUX_BTRFS_H
+static int btrfs_clone (const char *snapshot, const char *home)
+{
+	struct btrfs_ioctl_vol_args_v2 args;
+	const char *name;
+	char *parent;
+	int src_fd, dir_fd;
+	int err = -1;
+
+	parent = split_home (home, &name);
+	if (NULL == parent) {
+		return -1;
+	}
+	if (strlen (name) > BTRFS_SUBVOL_NAME_MAX) {
+		free (parent);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	src_fd = open (snapshot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir_fd = open (parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if ((src_fd >= 0) && (dir_fd >= 0)) {
+		memzero (&args, sizeof args);
+		args.fd = src_fd;
+		(void) strncpy (args.name, name, BTRFS_SUBVOL_NAME_MAX);
+		err = ioctl (dir_fd, BTRFS_IOC_SNAP_CREATE_V2, &args);
+	}
+	if (src_fd >= 0) {
+		(void) close (src_fd);
+	}
+	if (dir_fd >= 0) {
+		(void) close (dir_fd);
+	}
+	free (parent);
+	return (0 == err) ? 0 : -1;
+}
+
+/*
+ * btrfs_drop - drop the subvolume of home
+ *
+ *	It returns 1 if home is not the root of a btrfs subvolume.
+ */
+static int btrfs_drop (const char *home)
+{
+	struct btrfs_ioctl_vol_args args;
+	struct statfs sfs;
+	struct stat sb;
+	const char *name;
+	char *parent;
+	int dir_fd;
+	int err = -1;
+
+	if (   (lstat (home, &sb) != 0)
+	    || !S_ISDIR (sb.st_mode)
+	    || (BTRFS_SUBVOL_INO != sb.st_ino)
+	    || (statfs (home, &sfs) != 0)
+	    || (BTRFS_SUPER_MAGIC != sfs.f_type)) {
+		return 1;
+	}
+	parent = split_home (home, &name);
+	if (NULL == parent) {
+		return 1;
+	}
+	dir_fd = open (parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd >= 0) {
+		memzero (&args, sizeof args);
+		(void) strncpy (args.name, name, BTRFS_PATH_NAME_MAX);
+		err = ioctl (dir_fd, BTRFS_IOC_SNAP_DESTROY, &args);
+		(void) close (dir_fd);
+	}
+	free (parent);
+	return (0 == err) ? 0 : -1;
+}
+#else				/* !HAVE_LINUX_BTRFS_H */
+static int btrfs_clone (unused const char *snapshot,
+                        unused const char *home)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+static int btrfs_drop (unused const char *home)
+{
+	return 1;
+}
+#endif				/* !HAVE_LINUX_BTRFS_H */
+
+#ifdef HAVE_MNTENT_H
+/*
+ * zfs_dataset - the ZFS dataset mounted on dir, or NULL
+ */
+static /*@null@*/ /*@only@*/char *zfs_dataset (const char *dir)
+{
+	struct mntent *m;
+	char *dataset = NULL;
+	FILE *fp;
+
+	fp = setmntent ("/proc/self/mounts", "r");
+	if (NULL == fp) {
+		return NULL;
+	}
+	/* The last mount on dir hides the previous ones */
+	while ((m = getmntent (fp)) != NULL) {
+		if (strcmp (m->mnt_dir, dir) != 0) {
+			continue;
+		}
+		free (dataset);
+		dataset = NULL;
+		if (strcmp (m->mnt_type, "zfs") == 0) {
+			dataset = xstrdup (m->mnt_fsname);
+		}
+	}
+	(void) endmntent (fp);
+	return dataset;
+}
+
+static int zfs_run (const char *verb, const char *arg1,
+                    /*@null@*/const char *arg2)
+{
+	const char *argv[] = { "zfs", verb, arg1, arg2, NULL };
+	int status;
+
+	if (run_command (ZFS_CMD, argv, NULL, &status) != 0) {
+		return -1;
+	}
+	if (!WIFEXITED (status) || (0 != WEXITSTATUS (status))) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static int zfs_clone (const char *snapshot, const char *home)
+{
+	struct stat sb;
+	const char *name;
+	char *parent;
+	char *dataset;
+	char *clone;
+	size_t len;
+	int err = -1;
+
+	parent = split_home (home, &name);
+	if (NULL == parent) {
+		return -1;
+	}
+	dataset = zfs_dataset (parent);
+	free (parent);
+	if (NULL == dataset) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	len = strlen (dataset) + strlen (name) + 2;
+	clone = xmalloc (len);
+	(void) snprintf (clone, len, "%s/%s", dataset, name);
+	free (dataset);
+
+	if (zfs_run ("clone", snapshot, clone) == 0) {
+		/* The clone must be mounted on home */
+		dataset = zfs_dataset (home);
+		if (   (NULL != dataset)
+		    && (strcmp (dataset, clone) == 0)
+		    && (stat (home, &sb) == 0)) {
+			err = 0;
+		} else {
+			(void) zfs_run ("destroy", clone, NULL);
+			errno = ENOTSUP;
+		}
+		free (dataset);
+	}
+	free (clone);
+	return err;
+}
+
+/*
+ * zfs_drop - destroy the dataset mounted on home
+ *
+ *	It returns 1 if no ZFS dataset is mounted on home.
+ */
+static int zfs_drop (const char *home)
+{
+	char *dataset = zfs_dataset (home);
+	int err;
+
+	if (NULL == dataset) {
+		return 1;
+	}
+	err = zfs_run ("destroy", dataset, NULL);
+	free (dataset);
+	return err;
+}
+#else				/* !HAVE_MNTENT_H */
+static int zfs_clone (unused const char *snapshot, unused const char *home)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+static int zfs_drop (unused const char *home)
+{
+	return 1;
+}
+#endif				/* !HAVE_MNTENT_H */
+
+/*
+ * home_clone - create the home directory as a clone of the snapshot of
+ *              the skeleton
+ *
+ *	home must not exist, and its parent directory must exist. The
+ *	files of the clone are given to uid and gid, and the home
+ *	directory gets mode.
+ *
+ *	It returns 0 if the home directory was cloned, 1 if
+ *	HOME_SKEL_SNAPSHOT is not set, and -1 on failure (with errno set).
+ *	On failure, the home directory was not created.
+ */
+int home_clone (const char *home, uid_t uid, gid_t gid, mode_t mode)
+{
+	const char *snapshot;
+	int err;
+
+	switch (home_backend (&snapshot)) {
+	case HOME_BACKEND_BTRFS:
+		err = btrfs_clone (snapshot, home);
+		break;
+	case HOME_BACKEND_ZFS:
+		err = zfs_clone (snapshot, home);
+		break;
+	default:
+		return 1;
+	}
+	if (0 != err) {
+		return -1;
+	}
+
+	if (   (chown_tree (home, (uid_t) -1, uid, (gid_t) -1, gid) != 0)
+	    || (chown (home, uid, gid) != 0)
+	    || (chmod (home, mode) != 0)) {
+		int saved = errno;
+
+		(void) home_drop (home);
+		errno = saved;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * home_drop - drop the home directory, if it is a volume
+ *
+ *	It returns 0 if the volume of home was dropped, 1 if home is not a
+ *	volume (or if HOME_SKEL_SNAPSHOT is not set), and -1 on failure
+ *	(with errno set).
+ */
+int home_drop (const char *home)
+{
+	const char *snapshot;
+
+	switch (home_backend (&snapshot)) {
+	case HOME_BACKEND_BTRFS:
+		return btrfs_drop (home);
+	case HOME_BACKEND_ZFS:
+		return zfs_drop (home);
+	default:
+		return 1;
+	}
+}
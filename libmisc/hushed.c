@@ -36,11 +36,125 @@
 #ident "$Id$"
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <pwd.h>
+#include <unistd.h>
 #include "defines.h"
 #include "prototypes.h"
 #include "getdef.h"
+
+/*
+ * Content of the hushed-logins file
+ *
+ * login asks several times if the user is hushed. The file is kept in
+ * memory, and only read again if it changed.
+ */
+static struct {
+	/*@null@*/ /*@only@*/char *data;
+	size_t len;
+	bool loaded;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+} hushlist;
+
+/*
+ * load_hushlist - read the hushed-logins file, unless it did not change
+ *
+ *	It returns 0 on success, -1 if the file could not be read.
+ */
+static int load_hushlist (const char *hushfile)
+{
+	struct stat sb;
+	size_t len = 0;
+	int fd;
+
+	if (stat (hushfile, &sb) != 0) {
+		return -1;
+	}
+	if (   hushlist.loaded
+	    && (sb.st_dev == hushlist.dev)
+	    && (sb.st_ino == hushlist.ino)
+	    && (sb.st_size == hushlist.size)
+	    && (sb.st_mtime == hushlist.mtime)) {
+		return 0;
+	}
+
+	free (hushlist.data);
+	hushlist.data = NULL;
+	hushlist.loaded = false;
+
+	fd = open (hushfile, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat (fd, &sb) != 0) {
+		goto fail;
+	}
+	hushlist.data = malloc ((size_t) sb.st_size + 1);
+	if (NULL == hushlist.data) {
+		goto fail;
+	}
+	while (len < (size_t) sb.st_size) {
+		ssize_t n = read (fd, hushlist.data + len, (size_t) sb.st_size - len);
+
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			goto fail;
+		}
+		if (0 == n) {
+			break;
+		}
+		len += (size_t) n;
+	}
+	(void) close (fd);
+	hushlist.data[len] = '\0';
+	hushlist.len = len;
+	hushlist.dev = sb.st_dev;
+	hushlist.ino = sb.st_ino;
+	hushlist.size = sb.st_size;
+	hushlist.mtime = sb.st_mtime;
+	hushlist.loaded = true;
+	return 0;
+
+      fail:
+	(void) close (fd);
+	free (hushlist.data);
+	hushlist.data = NULL;
+	return -1;
+}
+
+/*
+ * hushlist_has - check if one of the lines of the hushed-logins file is
+ *                name
+ */
+static bool hushlist_has (const char *name)
+{
+	size_t namelen = strlen (name);
+	const char *line = hushlist.data;
+	const char *end = hushlist.data + hushlist.len;
+
+	while (line < end) {
+		const char *eol = memchr (line, '\n', (size_t) (end - line));
+
+		if (NULL == eol) {
+			eol = end;
+		}
+		if (   ((size_t) (eol - line) == namelen)
+		    && (memcmp (line, name, namelen) == 0)) {
+			return true;
+		}
+		line = eol + 1;
+	}
+	return false;
+}
+
 /*
  * hushed - determine if a user receives login messages
  *
@@ -53,7 +167,6 @@ bool hushed (const char *username)
 	const char *hushfile;
 	char buf[BUFSIZ];
 	bool found;
-	FILE *fp;
 
 	/*
 	 * Get the name of the file to use.  If this option is not
@@ -65,7 +178,7 @@ bool hushed (const char *username)
 		return false;
 	}
 
-	pw = getpwnam (username);
+	pw = cred_getpwnam (username);
 	if (NULL == pw) {
 		return false;
 	}
@@ -77,6 +190,7 @@ bool hushed (const char *username)
 
 	if (hushfile[0] != '/') {
 		(void) snprintf (buf, sizeof (buf), "%s/%s", pw->pw_dir, hushfile);
+		pw_free (pw);
 		return (access (buf, F_OK) == 0);
 	}
 
@@ -85,16 +199,9 @@ bool hushed (const char *username)
 	 * and see if this user, or its shell is in there.
 	 */
 
-	fp = fopen (hushfile, "r");
-	if (NULL == fp) {
-		return false;
-	}
-	for (found = false; !found && (fgets (buf, (int) sizeof buf, fp) == buf);) {
-		buf[strlen (buf) - 1] = '\0';
-		found = (strcmp (buf, pw->pw_shell) == 0) ||
-		        (strcmp (buf, pw->pw_name) == 0);
-	}
-	(void) fclose (fp);
+	found =    (load_hushlist (hushfile) == 0)
+	        && (hushlist_has (pw->pw_shell) || hushlist_has (pw->pw_name));
+	pw_free (pw);
 	return found;
 }
 
@@ -41,6 +41,38 @@
 #include <sys/capability.h>
 #endif
 
+/*
+ * get_map_targets - Split a comma separated list of PIDs, so that the
+ * same mappings are set for several processes in one invocation.
+ *
+ *	It returns the number of PIDs, or 0 if the list is invalid.
+ */
+int get_map_targets(char *list, pid_t **targets)
+{
+	char *cp;
+	int count = 1;
+	int idx = 0;
+
+	for (cp = list; '\0' != *cp; cp++) {
+		if (',' == *cp)
+			count++;
+	}
+	*targets = (pid_t *) xmalloc(count * sizeof(pid_t));
+
+	for (cp = strtok(list, ","); NULL != cp; cp = strtok(NULL, ",")) {
+		if (!get_pid(cp, &(*targets)[idx])) {
+			break;
+		}
+		idx++;
+	}
+	if (idx != count) {
+		free(*targets);
+		*targets = NULL;
+		return 0;
+	}
+	return count;
+}
+
 struct map_range *get_map_ranges(int ranges, int argc, char **argv)
 {
 	struct map_range *mappings, *mapping;
@@ -37,6 +37,7 @@ struct map_range {
 };
 
 extern struct map_range *get_map_ranges(int ranges, int argc, char **argv);
+extern int get_map_targets(char *list, pid_t **targets);
 extern void write_mapping(int proc_dir_fd, int ranges,
 	struct map_range *mappings, const char *map_file, uid_t ruid);
 
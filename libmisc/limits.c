@@ -43,9 +43,12 @@
 #ident "$Id$"
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <unistd.h>
 #include "prototypes.h"
 #include "defines.h"
 #include <pwd.h>
@@ -143,25 +146,102 @@ static int set_umask (const char *value)
 
 
 /* Counts the number of user logins and check against the limit */
-static int check_logins (const char *name, const char *maxlogins)
-{
 #ifdef USE_UTMPX
-	struct utmpx *ut;
+#ifdef _PATH_UTMPX
+#define LIMITS_UTMP_FILE	_PATH_UTMPX
+#endif
+typedef struct utmpx limits_utmp;
 #else				/* !USE_UTMPX */
-	struct utmp *ut;
+#ifdef _PATH_UTMP
+#define LIMITS_UTMP_FILE	_PATH_UTMP
+#endif
+typedef struct utmp limits_utmp;
 #endif				/* !USE_UTMPX */
-	unsigned long limit, count;
 
-	if (getulong (maxlogins, &limit) == 0) {
-		return 0;
+/*
+ * count_logins - count the sessions of name in the utmp file, until limit
+ *                is exceeded
+ *
+ *	The records are read from a mapping of the file, without stdio,
+ *	and the user names are compared with a fixed width.
+ *
+ *	It returns false if the file could not be mapped. The sessions
+ *	should then be counted with getutent().
+ */
+static bool count_logins (const char *name, unsigned long limit,
+                          /*@out@*/unsigned long *count)
+{
+#ifdef LIMITS_UTMP_FILE
+	const limits_utmp *ut;
+	struct stat sb;
+	void *map;
+	size_t len, n, i;
+	int fd;
+
+	/* Like strncmp, compare the name up to its '\0' */
+	len = strlen (name);
+	len = (len < sizeof (ut->ut_user)) ? len + 1 : sizeof (ut->ut_user);
+
+	fd = open (LIMITS_UTMP_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	if ((fstat (fd, &sb) != 0) || !S_ISREG (sb.st_mode)) {
+		(void) close (fd);
+		return false;
+	}
+	*count = 0;
+	n = (size_t) sb.st_size / sizeof (*ut);
+	if (0 == n) {
+		(void) close (fd);
+		return true;
+	}
+	map = mmap (NULL, n * sizeof (*ut), PROT_READ, MAP_SHARED, fd, 0);
+	(void) close (fd);
+	if (MAP_FAILED == map) {
+		return false;
 	}
 
-	if (0 == limit) {	/* maximum 0 logins ? */
-		SYSLOG ((LOG_WARN, "No logins allowed for `%s'\n", name));
-		return LOGIN_ERROR_LOGIN;
+	ut = map;
+	for (i = 0; i < n; i++) {
+		if (USER_PROCESS != ut[i].ut_type) {
+			continue;
+		}
+		if ('\0' == ut[i].ut_user[0]) {
+			continue;
+		}
+		if (memcmp (name, ut[i].ut_user, len) != 0) {
+			continue;
+		}
+		(*count)++;
+		if (*count > limit) {
+			break;
+		}
 	}
+	(void) munmap (map, n * sizeof (*ut));
+	return true;
+#else				/* !LIMITS_UTMP_FILE */
+	(void) name;
+	(void) limit;
+	(void) count;
+	return false;
+#endif				/* !LIMITS_UTMP_FILE */
+}
+
+/*
+ * count_logins_utent - count the sessions of name with getutent(), until
+ *                      limit is exceeded
+ */
+static unsigned long count_logins_utent (const char *name,
+                                         unsigned long limit)
+{
+#ifdef USE_UTMPX
+	struct utmpx *ut;
+#else				/* !USE_UTMPX */
+	struct utmp *ut;
+#endif				/* !USE_UTMPX */
+	unsigned long count = 0;
 
-	count = 0;
 #ifdef USE_UTMPX
 	setutxent ();
 	while ((ut = getutxent ()))
@@ -189,6 +269,26 @@ static int check_logins (const char *name, const char *maxlogins)
 #else				/* !USE_UTMPX */
 	endutent ();
 #endif				/* !USE_UTMPX */
+
+	return count;
+}
+
+static int check_logins (const char *name, const char *maxlogins)
+{
+	unsigned long limit, count;
+
+	if (getulong (maxlogins, &limit) == 0) {
+		return 0;
+	}
+
+	if (0 == limit) {	/* maximum 0 logins ? */
+		SYSLOG ((LOG_WARN, "No logins allowed for `%s'\n", name));
+		return LOGIN_ERROR_LOGIN;
+	}
+
+	if (!count_logins (name, limit, &count)) {
+		count = count_logins_utent (name, limit);
+	}
 	/*
 	 * This is called after setutmp(), so the number of logins counted
 	 * includes the user who is currently trying to log in.
@@ -403,44 +503,111 @@ static int do_user_limits (const char *buf, const char *name)
 static bool user_in_group (const char *uname, const char *gname)
 {
 	struct group *groupdata;
+	bool ret;
 
 	if (uname == NULL || gname == NULL){ 
 		return false;
 	}
 
-	/* We are not claiming to be re-entrant!
-	 * In case of paranoia or a multithreaded login program,
-	 * one needs to add some mess for getgrnam_r. */
-	groupdata = getgrnam (gname);
+	groupdata = cred_getgrnam (gname);
 	if (NULL == groupdata) {
 		SYSLOG ((LOG_WARN, "Nonexisting group `%s' in limits file.",
 		         gname));
 		return false;
 	}
 
-	return is_on_list (groupdata->gr_mem, uname);
+	ret = is_on_list (groupdata->gr_mem, uname);
+	gr_free (groupdata);
+	return ret;
 }
 
-static int setup_user_limits (const char *uname)
+/*
+ * The rules of the limits file, in the order of the file.
+ *
+ * For a @group rule, the GID of the group is resolved the first time the
+ * rule needs to be checked.
+ */
+#define LIMITS_GID_UNRESOLVED	0
+#define LIMITS_GID_RESOLVED	1
+#define LIMITS_GID_MISSING	2
+struct limits_rule {
+	char *name;		/* user name, '*' or @group */
+	char *limits;
+	int gid_state;
+	gid_t gid;
+};
+
+/*
+ * The compiled limits file. It is kept as long as the file is not
+ * modified.
+ */
+static struct {
+	bool loaded;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;
+	struct limits_rule *rules;
+	size_t nrules;
+} limits_table;
+
+static long stat_mtime_nsec (const struct stat *sb)
 {
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	return (long) sb->st_mtim.tv_nsec;
+#else				/* !HAVE_STRUCT_STAT_ST_MTIM */
+	(void) sb;
+	return 0;
+#endif				/* !HAVE_STRUCT_STAT_ST_MTIM */
+}
+
+static void limits_table_free (void)
+{
+	size_t i;
+
+	for (i = 0; i < limits_table.nrules; i++) {
+		free (limits_table.rules[i].name);
+		free (limits_table.rules[i].limits);
+	}
+	free (limits_table.rules);
+	limits_table.rules = NULL;
+	limits_table.nrules = 0;
+	limits_table.loaded = false;
+}
+
+/*
+ * limits_table_load - compile the limits file, unless the compiled rules
+ *                     are up to date
+ *
+ *	It returns false if there is no limits file.
+ */
+static bool limits_table_load (void)
+{
+	struct stat sb;
 	FILE *fil;
 	char buf[1024];
 	char name[1024];
-	char limits[1024];
-	char deflimits[1024];
 	char tempbuf[1024];
+	size_t alloc = 0;
 
-	/* init things */
-	memzero (buf, sizeof (buf));
-	memzero (name, sizeof (name));
-	memzero (limits, sizeof (limits));
-	memzero (deflimits, sizeof (deflimits));
-	memzero (tempbuf, sizeof (tempbuf));
+	if (stat (LIMITS_FILE, &sb) != 0) {
+		limits_table_free ();
+		return false;
+	}
+	if (   limits_table.loaded
+	    && (limits_table.dev == sb.st_dev)
+	    && (limits_table.ino == sb.st_ino)
+	    && (limits_table.size == sb.st_size)
+	    && (limits_table.mtime == sb.st_mtime)
+	    && (limits_table.mtime_nsec == stat_mtime_nsec (&sb))) {
+		return true;
+	}
+	limits_table_free ();
 
-	/* start the checks */
 	fil = fopen (LIMITS_FILE, "r");
 	if (fil == NULL) {
-		return 0;
+		return false;
 	}
 	/* The limits file have the following format:
 	 * - '#' (comment) chars only as first chars on a line;
@@ -449,6 +616,8 @@ static int setup_user_limits (const char *uname)
 	 * FIXME: A better (smarter) checking should be done
 	 */
 	while (fgets (buf, 1024, fil) != NULL) {
+		struct limits_rule *rule;
+
 		if (('#' == buf[0]) || ('\n' == buf[0])) {
 			continue;
 		}
@@ -462,51 +631,165 @@ static int setup_user_limits (const char *uname)
 		 * entry means no care anyway :-).
 		 *
 		 * A '-' as a limits strings means no limits
-		 *
-		 * The username can also be:
-		 *  '*': the default limits (only the last is taken into
-		 *       account)
-		 *  @group: the limit applies to the members of the group
-		 *
-		 * To clarify: The first entry with matching user name rules,
-		 * everything after it is ignored. If there is no user entry,
-		 * the last encountered entry for a matching group rules.
-		 * If there is no matching group entry, the default limits rule.
 		 */
 		if (sscanf (buf, "%s%[ACDFIKLMNOPRSTUacdfiklmnoprstu0-9 \t-]",
-		            name, tempbuf) == 2) {
-			if (strcmp (name, uname) == 0) {
-				strcpy (limits, tempbuf);
-				break;
-			} else if (strcmp (name, "*") == 0) {
-				strcpy (deflimits, tempbuf);
-			} else if (name[0] == '@') {
-				/* If the user is in the group, the group
-				 * limits apply unless later a line for
-				 * the specific user is found.
-				 */
-				if (user_in_group (uname, name+1)) {
-					strcpy (limits, tempbuf);
-				}
+		            name, tempbuf) != 2) {
+			continue;
+		}
+		if (limits_table.nrules == alloc) {
+			struct limits_rule *rules;
+
+			alloc = (0 == alloc) ? 16 : alloc * 2;
+			rules = (struct limits_rule *)
+			        xmalloc (alloc * sizeof (*rules));
+			if (0 != limits_table.nrules) {
+				memcpy (rules, limits_table.rules,
+				        limits_table.nrules * sizeof (*rules));
 			}
+			free (limits_table.rules);
+			limits_table.rules = rules;
 		}
+		rule = &limits_table.rules[limits_table.nrules];
+		rule->name = xstrdup (name);
+		rule->limits = xstrdup (tempbuf);
+		rule->gid_state = LIMITS_GID_UNRESOLVED;
+		rule->gid = 0;
+		limits_table.nrules++;
 	}
 	(void) fclose (fil);
-	if (limits[0] == '\0') {
+
+	limits_table.dev = sb.st_dev;
+	limits_table.ino = sb.st_ino;
+	limits_table.size = sb.st_size;
+	limits_table.mtime = sb.st_mtime;
+	limits_table.mtime_nsec = stat_mtime_nsec (&sb);
+	limits_table.loaded = true;
+	return true;
+}
+
+/*
+ * rule_has_user - check if the user is a member of the group of a @group
+ *                 rule
+ *
+ *	groups is the list returned by user_grouplist().
+ */
+static bool rule_has_user (struct limits_rule *rule,
+                           const struct passwd *info,
+                           /*@null@*/const gid_t *groups, size_t ngroups)
+{
+	struct group *grp;
+	size_t i;
+
+	if (NULL == groups) {
+		return user_in_group (info->pw_name, rule->name + 1);
+	}
+
+	if (LIMITS_GID_UNRESOLVED == rule->gid_state) {
+		grp = cred_getgrnam (rule->name + 1);
+		if (NULL == grp) {
+			SYSLOG ((LOG_WARN,
+			         "Nonexisting group `%s' in limits file.",
+			         rule->name + 1));
+			rule->gid_state = LIMITS_GID_MISSING;
+		} else {
+			rule->gid = grp->gr_gid;
+			rule->gid_state = LIMITS_GID_RESOLVED;
+			gr_free (grp);
+		}
+	}
+	if (LIMITS_GID_RESOLVED != rule->gid_state) {
+		return false;
+	}
+
+	/*
+	 * getgrouplist() always lists the primary group. It only
+	 * matches if the user is listed as a member of the group.
+	 */
+	if (rule->gid == info->pw_gid) {
+		return user_in_group (info->pw_name, rule->name + 1);
+	}
+	for (i = 0; i < ngroups; i++) {
+		if (groups[i] == rule->gid) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int setup_user_limits (const struct passwd *info)
+{
+	struct limits_rule *rules;
+	const char *limits = NULL;
+	const char *deflimits = NULL;
+	gid_t *groups = NULL;
+	size_t ngroups = 0;
+	bool groups_listed = false;
+	size_t nrules, i;
+
+	if (!limits_table_load ()) {
+		return 0;
+	}
+	rules = limits_table.rules;
+	nrules = limits_table.nrules;
+
+	/*
+	 * The username can also be:
+	 *  '*': the default limits (only the last is taken into
+	 *       account)
+	 *  @group: the limit applies to the members of the group
+	 *
+	 * To clarify: The first entry with matching user name rules,
+	 * everything after it is ignored. If there is no user entry,
+	 * the last encountered entry for a matching group rules.
+	 * If there is no matching group entry, the default limits rule.
+	 */
+	for (i = 0; i < nrules; i++) {
+		if (strcmp (rules[i].name, info->pw_name) == 0) {
+			limits = rules[i].limits;
+			break;
+		} else if (strcmp (rules[i].name, "*") == 0) {
+			deflimits = rules[i].limits;
+		}
+	}
+
+	if (NULL == limits) {
+		/* Only the last matching group matters, so the groups
+		 * are checked from the end of the file.
+		 */
+		for (i = nrules; i > 0; i--) {
+			if ('@' != rules[i - 1].name[0]) {
+				continue;
+			}
+			if (!groups_listed) {
+				groups = user_grouplist (info->pw_name, info->pw_gid,
+				                         &ngroups);
+				groups_listed = true;
+			}
+			if (rule_has_user (&rules[i - 1], info,
+			                   groups, ngroups)) {
+				limits = rules[i - 1].limits;
+				break;
+			}
+		}
+		free (groups);
+	}
+
+	if ((NULL == limits) || ('\0' == limits[0])) {
 		/* no user specific limits */
-		if (deflimits[0] == '\0') {	/* no default limits */
+		if ((NULL == deflimits) || ('\0' == deflimits[0])) {
+			/* no default limits */
 			return 0;
 		}
-		strcpy (limits, deflimits);	/* use the default limits */
+		limits = deflimits;	/* use the default limits */
 	}
-	return do_user_limits (limits, uname);
+	return do_user_limits (limits, info->pw_name);
 }
 #endif				/* LIMITS */
 
 
 static void setup_usergroups (const struct passwd *info)
 {
-	const struct group *grp;
+	struct group *grp;
 
 /*
  *	if not root, and UID == GID, and username is the same as primary
@@ -514,8 +797,7 @@ static void setup_usergroups (const struct passwd *info)
  *	(examples: 022 -> 002, 077 -> 007).
  */
 	if ((0 != info->pw_uid) && (info->pw_uid == info->pw_gid)) {
-		/* local, no need for xgetgrgid */
-		grp = getgrgid (info->pw_gid);
+		grp = cred_getgrgid (info->pw_gid);
 		if (   (NULL != grp)
 		    && (strcmp (info->pw_name, grp->gr_name) == 0)) {
 			mode_t tmpmask;
@@ -523,6 +805,9 @@ static void setup_usergroups (const struct passwd *info)
 			tmpmask = (tmpmask & ~070) | ((tmpmask >> 3) & 070);
 			(void) umask (tmpmask);
 		}
+		if (NULL != grp) {
+			gr_free (grp);
+		}
 	}
 }
 
@@ -547,7 +832,7 @@ void setup_limits (const struct passwd *info)
 	if (getdef_bool ("QUOTAS_ENAB")) {
 #ifdef LIMITS
 		if (info->pw_uid != 0) {
-			if ((setup_user_limits (info->pw_name) & LOGIN_ERROR_LOGIN) != 0) {
+			if ((setup_user_limits (info) & LOGIN_ERROR_LOGIN) != 0) {
 				(void) fputs (_("Too many logins.\n"), stderr);
 				(void) sleep (2); /* XXX: Should be FAIL_DELAY */
 				exit (EXIT_FAILURE);
@@ -37,110 +37,240 @@
 #include "prototypes.h"
 #include "defines.h"
 /*
- * add_list - add a member to a list of group members
+ * name_set_init - Initialize an empty set for up to n names.
  *
- *	the array of member names is searched for the new member
- *	name, and if not present it is added to a freshly allocated
- *	list of users.
+ *	The names are not copied. They must remain valid while the set is
+ *	used.
  */
-/*@only@*/ /*@out@*/char **add_list (/*@returned@*/ /*@only@*/char **list, const char *member)
+void name_set_init (struct name_set *set, size_t n)
 {
-	int i;
-	char **tmp;
-
-	assert (NULL != member);
-	assert (NULL != list);
+	set->size = 16;
+	while (set->size < 2 * n) {
+		set->size *= 2;
+	}
+	set->slots = (const char **) xmalloc (set->size * sizeof (char *));
+	memset (set->slots, 0, set->size * sizeof (char *));
+}
 
-	/*
-	 * Scan the list for the new name.  Return the original list
-	 * pointer if it is present.
-	 */
+/*
+ * name_set_slot - Return the slot of name in the set, or the free slot
+ *                 where it would be added.
+ */
+static const char **name_set_slot (const struct name_set *set,
+                                   const char *name)
+{
+	size_t h = 2166136261U;
+	const char *cp;
 
-	for (i = 0; list[i] != (char *) 0; i++) {
-		if (strcmp (list[i], member) == 0) {
-			return list;
-		}
+	for (cp = name; '\0' != *cp; cp++) {
+		h ^= (unsigned char) *cp;
+		h *= 16777619U;
 	}
+	for (h &= set->size - 1;
+	     (NULL != set->slots[h]) && (strcmp (set->slots[h], name) != 0);
+	     h = (h + 1) & (set->size - 1));
+	return &set->slots[h];
+}
 
-	/*
-	 * Allocate a new list pointer large enough to hold all the
-	 * old entries, and the new entries as well.
-	 */
+/*
+ * name_set_add - Add a name to the set.
+ *
+ *	It returns false if the name was already in the set.
+ */
+bool name_set_add (struct name_set *set, const char *name)
+{
+	const char **slot = name_set_slot (set, name);
 
-	tmp = (char **) xmalloc ((i + 2) * sizeof member);
+	if (NULL != *slot) {
+		return false;
+	}
+	*slot = name;
+	return true;
+}
 
-	/*
-	 * Copy the original list to the new list, then append the
-	 * new member and NULL terminate the result.  This new list
-	 * is returned to the invoker.
-	 */
+/*
+ * name_set_has - Check if a name is in the set.
+ */
+bool name_set_has (const struct name_set *set, const char *name)
+{
+	return (NULL != *name_set_slot (set, name));
+}
 
-	for (i = 0; list[i] != (char *) 0; i++) {
-		tmp[i] = list[i];
-	}
+void name_set_free (struct name_set *set)
+{
+	free (set->slots);
+	set->slots = NULL;
+	set->size = 0;
+}
 
-	tmp[i] = xstrdup (member);
-	tmp[i+1] = (char *) 0;
+static size_t list_length (/*@null@*/char *const *list)
+{
+	size_t n = 0;
 
-	return tmp;
+	if (NULL != list) {
+		while (NULL != list[n]) {
+			n++;
+		}
+	}
+	return n;
 }
 
 /*
- * del_list - delete a member from a list of group members
+ * edit_list - add and delete members of a list of group members
  *
- *	the array of member names is searched for the old member
- *	name, and if present it is deleted from a freshly allocated
- *	list of users.
+ *	the members of del are deleted from the list, then the members of
+ *	add which are not in the list are appended to it, in their order.
+ *	add and del may be NULL.
+ *
+ *	If the list is changed, the result is built in a single freshly
+ *	allocated list of users. Otherwise, the original list pointer is
+ *	returned.
  */
-
-/*@only@*/ /*@out@*/char **del_list (/*@returned@*/ /*@only@*/char **list, const char *member)
+/*@only@*/ /*@out@*/char **edit_list (/*@returned@*/ /*@only@*/char **list,
+                                      /*@null@*/char *const *add,
+                                      /*@null@*/char *const *del)
 {
-	int i, j;
+	struct name_set dels, members;
+	size_t n, na, nd, kept, added, i, j;
+	bool *is_new;
 	char **tmp;
 
-	assert (NULL != member);
 	assert (NULL != list);
 
+	n = list_length (list);
+	na = list_length (add);
+	nd = list_length (del);
+	if ((0 == na) && (0 == nd)) {
+		return list;
+	}
+
 	/*
-	 * Scan the list for the old name.  Return the original list
-	 * pointer if it is not present.
+	 * Count the members which are kept, and the new members.
 	 */
-
-	for (i = j = 0; list[i] != (char *) 0; i++) {
-		if (strcmp (list[i], member) != 0) {
-			j++;
+	name_set_init (&dels, nd);
+	for (i = 0; i < nd; i++) {
+		(void) name_set_add (&dels, del[i]);
+	}
+	name_set_init (&members, n + na);
+	for (i = 0, kept = 0; i < n; i++) {
+		if (NULL == *name_set_slot (&dels, list[i])) {
+			(void) name_set_add (&members, list[i]);
+			kept++;
+		}
+	}
+	is_new = (bool *) xmalloc ((na + 1) * sizeof (bool));
+	added = 0;
+	for (i = 0; i < na; i++) {
+		is_new[i] = name_set_add (&members, add[i]);
+		if (is_new[i]) {
+			added++;
 		}
 	}
+	free (members.slots);
 
-	if (j == i) {
+	if ((kept == n) && (0 == added)) {
+		free (dels.slots);
+		free (is_new);
 		return list;
 	}
 
 	/*
-	 * Allocate a new list pointer large enough to hold all the
-	 * old entries.
+	 * Copy the members which are kept, then append the new members
+	 * and NULL terminate the result.
 	 */
+	tmp = (char **) xmalloc ((kept + added + 1) * sizeof (char *));
+	for (i = j = 0; i < n; i++) {
+		if (NULL == *name_set_slot (&dels, list[i])) {
+			tmp[j] = list[i];
+			j++;
+		}
+	}
+	for (i = 0; i < na; i++) {
+		if (is_new[i]) {
+			tmp[j] = xstrdup (add[i]);
+			j++;
+		}
+	}
+	tmp[j] = (char *) 0;
 
-	tmp = (char **) xmalloc ((j + 1) * sizeof member);
+	free (dels.slots);
+	free (is_new);
+	return tmp;
+}
 
-	/*
-	 * Copy the original list except the deleted members to the
-	 * new list, then NULL terminate the result.  This new list
-	 * is returned to the invoker.
-	 */
+/*
+ * del_list_set - delete the members of a set from a list of group members
+ *
+ *	If members are deleted, the result is built in a freshly allocated
+ *	list of users. Otherwise, the original list pointer is returned.
+ */
+/*@only@*/ /*@out@*/char **del_list_set (/*@returned@*/ /*@only@*/char **list,
+                                         const struct name_set *dels)
+{
+	size_t n, kept, i, j;
+	char **tmp;
+
+	assert (NULL != list);
+
+	n = list_length (list);
+	for (i = 0, kept = 0; i < n; i++) {
+		if (!name_set_has (dels, list[i])) {
+			kept++;
+		}
+	}
+	if (kept == n) {
+		return list;
+	}
 
-	for (i = j = 0; list[i] != (char *) 0; i++) {
-		if (strcmp (list[i], member) != 0) {
+	tmp = (char **) xmalloc ((kept + 1) * sizeof (char *));
+	for (i = j = 0; i < n; i++) {
+		if (!name_set_has (dels, list[i])) {
 			tmp[j] = list[i];
 			j++;
 		}
 	}
-
 	tmp[j] = (char *) 0;
 
 	return tmp;
 }
 
+/*
+ * add_list - add a member to a list of group members
+ *
+ *	the array of member names is searched for the new member
+ *	name, and if not present it is added to a freshly allocated
+ *	list of users.
+ */
+/*@only@*/ /*@out@*/char **add_list (/*@returned@*/ /*@only@*/char **list, const char *member)
+{
+	char *add[2];
+
+	assert (NULL != member);
+
+	add[0] = (char *) member;
+	add[1] = (char *) 0;
+	return edit_list (list, add, NULL);
+}
+
+/*
+ * del_list - delete a member from a list of group members
+ *
+ *	the array of member names is searched for the old member
+ *	name, and if present it is deleted from a freshly allocated
+ *	list of users.
+ */
+
+/*@only@*/ /*@out@*/char **del_list (/*@returned@*/ /*@only@*/char **list, const char *member)
+{
+	char *del[2];
+
+	assert (NULL != member);
+
+	del[0] = (char *) member;
+	del[1] = (char *) 0;
+	return edit_list (list, NULL, del);
+}
+
 /*
  * Duplicate a list.
  * The input list is not modified, but in order to allow the use of this
@@ -180,8 +310,9 @@ bool is_on_list (char *const *list, const char *member)
 	assert (NULL != member);
 	assert (NULL != list);
 
+	/* The interned names (see strintern.h) are compared by pointer */
 	while (NULL != *list) {
-		if (strcmp (*list, member) == 0) {
+		if ((*list == member) || (strcmp (*list, member) == 0)) {
 			return true;
 		}
 		list++;
@@ -41,6 +41,7 @@
 #include "defines.h"
 #include <lastlog.h>
 #include "prototypes.h"
+#include "uidrecords.h"
 
 /* 
  * dolastlog - create lastlog entry
@@ -55,42 +56,63 @@ void dolastlog (
 	/*@unique@*/const char *line,
 	/*@unique@*/const char *host)
 {
-	int fd;
-	off_t offset;
+	int fd = -1;
+	struct uid_keyed keyed;
+	bool is_keyed = uid_keyed ((unsigned long) pw->pw_uid);
 	struct lastlog newlog;
+	struct lastlog stamp;
 	time_t ll_time;
 
 	/*
-	 * If the file does not exist, don't create it.
+	 * The line and host of the new entry do not depend on the old
+	 * entry.  They are copied once here, and not in each of the keyed
+	 * and indexed paths below.
 	 */
-
-	fd = open (LASTLOG_FILE, O_RDWR);
-	if (-1 == fd) {
-		return;
-	}
+	strncpy (stamp.ll_line, line, sizeof stamp.ll_line);
+#if HAVE_LL_HOST
+	strncpy (stamp.ll_host, host, sizeof stamp.ll_host);
+#endif
 
 	/*
-	 * The file is indexed by UID number.  Seek to the record
-	 * for this UID.  Negative UID's will create problems, but ...
+	 * If the file does not exist, don't create it.
+	 *
+	 * The records of the high UIDs are kept in LASTLOG_FILE.keyed
+	 * (LOG_KEYED_UID_MIN).
 	 */
 
-	offset = (off_t) pw->pw_uid * sizeof newlog;
-
-	if (lseek (fd, offset, SEEK_SET) != offset) {
-		SYSLOG ((LOG_WARN,
-		         "Can't read last lastlog entry for UID %lu in %s. Entry not updated.",
-		         (unsigned long) pw->pw_uid, LASTLOG_FILE));
-		(void) close (fd);
-		return;
+	if (is_keyed) {
+		if (uid_keyed_open (&keyed, LASTLOG_FILE, sizeof newlog,
+		                    true) != 1) {
+			return;
+		}
+	} else {
+		fd = open (LASTLOG_FILE, O_RDWR | O_CLOEXEC);
+		if (-1 == fd) {
+			return;
+		}
 	}
 
 	/*
+	 * The file is indexed by UID number.  Negative UID's will create
+	 * problems, but ...
+	 *
 	 * Read the old entry so we can tell the user when they last
 	 * logged in.  Then construct the new entry and write it out
-	 * the way we read the old one in.
+	 * the way we read the old one in. The record is read and written
+	 * at its offset, without seeking.
 	 */
 
-	if (read (fd, (void *) &newlog, sizeof newlog) != (ssize_t) sizeof newlog) {
+	if (is_keyed) {
+		/* Or the record at its offset, e.g. from pam_lastlog */
+		fd = open (LASTLOG_FILE, O_RDONLY | O_CLOEXEC);
+		(void) uid_keyed_read (&keyed, fd, sizeof newlog,
+		                       (unsigned long) pw->pw_uid, &newlog);
+		if (-1 != fd) {
+			(void) close (fd);
+		}
+	} else if (uid_record_read (fd, sizeof newlog,
+	                            (unsigned long) pw->pw_uid,
+	                            &newlog) != 0) {
 		memzero (&newlog, sizeof newlog);
 	}
 	if (NULL != ll) {
@@ -100,13 +122,23 @@ void dolastlog (
 	ll_time = newlog.ll_time;
 	(void) time (&ll_time);
 	newlog.ll_time = ll_time;
-	strncpy (newlog.ll_line, line, sizeof newlog.ll_line);
+	memcpy (newlog.ll_line, stamp.ll_line, sizeof newlog.ll_line);
 #if HAVE_LL_HOST
-	strncpy (newlog.ll_host, host, sizeof newlog.ll_host);
+	memcpy (newlog.ll_host, stamp.ll_host, sizeof newlog.ll_host);
 #endif
-	if (   (lseek (fd, offset, SEEK_SET) != offset)
-	    || (write (fd, (const void *) &newlog, sizeof newlog) != (ssize_t) sizeof newlog)
-	    || (close (fd) != 0)) {
+	if (is_keyed) {
+		if (   (uid_keyed_put (&keyed, (unsigned long) pw->pw_uid,
+		                       &newlog) != 0)
+		    || (uid_keyed_close (&keyed) != 0)) {
+			SYSLOG ((LOG_WARN,
+			         "Can't write lastlog entry for UID %lu in %s.keyed.",
+			         (unsigned long) pw->pw_uid, LASTLOG_FILE));
+			(void) uid_keyed_close (&keyed);
+		}
+	} else if (   (uid_record_write (fd, sizeof newlog,
+	                                 (unsigned long) pw->pw_uid,
+	                                 &newlog) != 0)
+	           || (close (fd) != 0)) {
 		SYSLOG ((LOG_WARN,
 		         "Can't write lastlog entry for UID %lu in %s.",
 		         (unsigned long) pw->pw_uid, LASTLOG_FILE));
@@ -0,0 +1,246 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "prototypes.h"
+#include "defines.h"
+#include "getdef.h"
+
+/*
+ * Coalesced syslog of the bulk operations (SYSLOG_BATCH)
+ *
+ * The tools which change many entries at once (userdel of several
+ * users, useradd -B, pwck, grpck) log an event for each entry. When
+ * SYSLOG_BATCH is set to N, the entries of the same event are instead
+ * collected, and logged as a single record for N entries:
+ *
+ *	delete from group 'staff': count=3 names=alice,bob,carol
+ *
+ * The last records are logged when the program exits. Each entry is
+ * still logged at LOG_DEBUG when root sets SHADOW_LOG_DEBUG in the
+ * environment.
+ *
+ * The records are sent to the log socket without blocking. When the log
+ * daemon does not keep up (or cannot be reached), they are logged with
+ * syslog(), which waits.
+ */
+
+#ifndef _PATH_LOG
+#define _PATH_LOG	"/dev/log"
+#endif
+
+/* Events collected at the same time */
+#define LOG_BATCH_EVENTS	8
+/* Length of the names of a record, below the usual limits of the daemons */
+#define LOG_BATCH_NAMES		4000
+
+struct log_batch_event {
+	int priority;
+	/*@null@*/ /*@only@*/char *event;	/* NULL if unused */
+	unsigned long count;
+	char names[LOG_BATCH_NAMES];
+	size_t len;
+};
+
+static int batch_size = -1;	/* not known yet */
+static bool log_debug = false;
+static pid_t batch_pid;		/* the children do not log the batches */
+static struct log_batch_event events[LOG_BATCH_EVENTS];
+#ifdef USE_SYSLOG
+static int log_fd = -1;
+static bool log_fd_failed = false;
+#endif				/* USE_SYSLOG */
+
+/*
+ * log_send - send a record to the log daemon, without blocking if
+ *            possible
+ */
+static void log_send (int priority, const char *msg)
+{
+#ifdef USE_SYSLOG
+	static const char *const months[] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+	};
+	char buf[LOG_BATCH_NAMES + 512];
+	struct tm tm;
+	time_t now;
+	int len;
+
+	if ((log_fd < 0) && !log_fd_failed) {
+		struct sockaddr_un sun;
+
+		memzero (&sun, sizeof sun);
+		sun.sun_family = AF_UNIX;
+		(void) strncpy (sun.sun_path, _PATH_LOG,
+		                sizeof sun.sun_path - 1);
+		log_fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (   (log_fd >= 0)
+		    && (connect (log_fd, (struct sockaddr *) &sun,
+		                 sizeof sun) != 0)) {
+			(void) close (log_fd);
+			log_fd = -1;
+		}
+		log_fd_failed = (log_fd < 0);
+	}
+
+	now = time (NULL);
+	if ((log_fd >= 0) && (localtime_r (&now, &tm) != NULL)) {
+		len = snprintf (buf, sizeof buf,
+		                "<%d>%s %2d %02d:%02d:%02d %s[%ld]: %s",
+		                SYSLOG_FACILITY | priority, months[tm.tm_mon],
+		                tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+		                Prog, (long) getpid (), msg);
+		if (   (len > 0)
+		    && ((size_t) len < sizeof buf)
+		    && (send (log_fd, buf, (size_t) len,
+		              MSG_DONTWAIT | MSG_NOSIGNAL) == len)) {
+			return;
+		}
+	}
+#endif				/* USE_SYSLOG */
+	SYSLOG ((priority, "%s", msg));
+}
+
+static void flush_event (struct log_batch_event *e)
+{
+	char msg[LOG_BATCH_NAMES + 256];
+
+	if (0 != e->count) {
+		(void) snprintf (msg, sizeof msg, "%s: count=%lu names=%s",
+		                 e->event, e->count, e->names);
+		log_send (e->priority, msg);
+	}
+	e->count = 0;
+	e->len = 0;
+	e->names[0] = '\0';
+}
+
+/*
+ * log_batch_flush - log the entries collected so far
+ *
+ *	It is registered with atexit(), for this process only.
+ */
+void log_batch_flush (void)
+{
+	size_t i;
+
+	if ((batch_size <= 0) || (getpid () != batch_pid)) {
+		return;
+	}
+	for (i = 0; i < LOG_BATCH_EVENTS; i++) {
+		if (NULL != events[i].event) {
+			flush_event (&events[i]);
+			free (events[i].event);
+			events[i].event = NULL;
+		}
+	}
+}
+
+static bool log_batch_enabled (void)
+{
+	if (-1 == batch_size) {
+		batch_size = getdef_num ("SYSLOG_BATCH", 0);
+		batch_pid = getpid ();
+		log_debug =    (0 == getuid ())
+		            && (NULL != shadow_getenv ("SHADOW_LOG_DEBUG"));
+		if ((batch_size > 0) && (atexit (log_batch_flush) != 0)) {
+			batch_size = 0;
+		}
+	}
+	return (batch_size > 0);
+}
+
+static struct log_batch_event *find_event (int priority, const char *event)
+{
+	struct log_batch_event *e;
+	size_t i;
+
+	for (i = 0; i < LOG_BATCH_EVENTS; i++) {
+		e = &events[i];
+		if (   (NULL != e->event)
+		    && (e->priority == priority)
+		    && (strcmp (e->event, event) == 0)) {
+			return e;
+		}
+	}
+
+	/* Take a free slot, or the first one */
+	for (i = 0; i < LOG_BATCH_EVENTS; i++) {
+		if (NULL == events[i].event) {
+			break;
+		}
+	}
+	if (LOG_BATCH_EVENTS == i) {
+		i = 0;
+		flush_event (&events[0]);
+		free (events[0].event);
+	}
+	e = &events[i];
+	e->priority = priority;
+	e->event = xstrdup (event);
+	e->count = 0;
+	e->len = 0;
+	e->names[0] = '\0';
+	return e;
+}
+
+/*
+ * log_batch - log an event about an entry of a bulk operation
+ *
+ *	Without SYSLOG_BATCH, the message given by fmt is logged with
+ *	priority, as SYSLOG() would. Otherwise, name is added to the next
+ *	record of event, and the message is only logged at LOG_DEBUG (see
+ *	above).
+ */
+void log_batch (int priority, const char *event, const char *name,
+                const char *fmt, ...)
+{
+	struct log_batch_event *e;
+	char msg[1024];
+	size_t len;
+	va_list ap;
+
+	va_start (ap, fmt);
+	(void) vsnprintf (msg, sizeof msg, fmt, ap);
+	va_end (ap);
+
+	if (!log_batch_enabled ()) {
+		SYSLOG ((priority, "%s", msg));
+		return;
+	}
+	if (log_debug) {
+		SYSLOG ((LOG_DEBUG, "%s", msg));
+	}
+
+	if (NULL == name) {
+		name = "";
+	}
+	e = find_event (priority, event);
+	len = strlen (name);
+	if (e->len + len + 2 > sizeof e->names) {
+		flush_event (e);
+		if (len + 1 > sizeof e->names) {
+			len = sizeof e->names - 1;
+		}
+	}
+	if (0 != e->len) {
+		e->names[e->len] = ',';
+		e->len++;
+	}
+	memcpy (e->names + e->len, name, len);
+	e->len += len;
+	e->names[e->len] = '\0';
+	e->count++;
+	if (e->count >= (unsigned long) batch_size) {
+		flush_event (e);
+	}
+}
@@ -0,0 +1,249 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "prototypes.h"
+#include "defines.h"
+#include "uidrecords.h"
+
+/*
+ * Records of the lastlog and faillog files, indexed by UID
+ *
+ * The file is opened by the first access, and stays open until
+ * log_file_close(). The records written for several users are then
+ * synchronized at once.
+ *
+ * The records of the UIDs from LOG_KEYED_UID_MIN are kept in
+ * <file>.keyed (see uidkeyed.c), which is opened separately, unless the
+ * file is maintained by other programs which only know the indexed
+ * records (e.g. the tallylog of pam_tally2).
+ */
+
+/*
+ * log_file_open - open the file if it was not opened yet
+ *
+ *	It returns 1 if the file is open, 0 if it does not exist, and -1
+ *	on error.
+ */
+static int log_file_open (struct log_file *lf)
+{
+	if (lf->fd >= 0) {
+		return 1;
+	}
+	if (lf->missing) {
+		return 0;
+	}
+
+	lf->fd = open (lf->name, O_RDWR);
+	if (lf->fd < 0) {
+		if (ENOENT == errno) {
+			lf->missing = true;
+			return 0;
+		}
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * log_keyed_open - open <file>.keyed if it was not opened yet
+ *
+ *	It returns like log_file_open().
+ */
+static int log_keyed_open (struct log_file *lf, size_t size)
+{
+	int ret;
+
+	if (NULL != lf->keyed) {
+		return 1;
+	}
+	if (lf->missing) {
+		return 0;
+	}
+
+	lf->keyed = malloc (sizeof *lf->keyed);
+	if (NULL == lf->keyed) {
+		return -1;
+	}
+	ret = uid_keyed_open (lf->keyed, lf->name, size, true);
+	if (ret <= 0) {
+		free (lf->keyed);
+		lf->keyed = NULL;
+		if (0 == ret) {
+			lf->missing = true;
+		}
+	}
+	return ret;
+}
+
+/*
+ * log_record_read - read the record of uid
+ *
+ *	It returns 1 if the record was read, 0 if the file does not exist
+ *	or has no record for uid, and -1 if the file cannot be opened.
+ */
+int log_record_read (struct log_file *lf, uid_t uid, void *rec, size_t size)
+{
+	int ret;
+
+	if (!lf->unkeyed && uid_keyed ((unsigned long) uid)) {
+		ret = log_keyed_open (lf, size);
+		if (ret <= 0) {
+			return ret;
+		}
+		return (uid_keyed_get (lf->keyed, (unsigned long) uid,
+		                       rec) == 0) ? 1 : 0;
+	}
+
+	ret = log_file_open (lf);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	/* A failed read is handled like a missing record */
+	return (uid_record_read (lf->fd, size, (unsigned long) uid, rec) == 0)
+	       ? 1 : 0;
+}
+
+/*
+ * log_record_write - write the record of uid
+ *
+ *	Nothing is written if the file does not exist.
+ *	The record is synchronized by log_file_close().
+ *
+ *	It returns 0 on success, -1 on error.
+ */
+int log_record_write (struct log_file *lf, uid_t uid,
+                      const void *rec, size_t size)
+{
+	int ret;
+
+	if (!lf->unkeyed && uid_keyed ((unsigned long) uid)) {
+		ret = log_keyed_open (lf, size);
+		if (ret <= 0) {
+			return ret;
+		}
+		return (uid_keyed_put (lf->keyed, (unsigned long) uid,
+		                       rec) == 0) ? 0 : -1;
+	}
+
+	ret = log_file_open (lf);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	if (uid_record_write (lf->fd, size, (unsigned long) uid, rec) != 0) {
+		return -1;
+	}
+	lf->dirty = true;
+	return 0;
+}
+
+/*
+ * log_records_move_keyed - move records from or to <file>.keyed
+ *
+ *	Like uid_records_move(), all the records are read before the
+ *	records to vacate are cleared and the records are written to
+ *	their new UIDs.
+ */
+static int log_records_move_keyed (struct log_file *lf,
+                                   const struct uid_move *moves,
+                                   size_t count, size_t size)
+{
+	char *records;
+	const char *empty;
+	size_t i;
+	int ret = 0;
+
+	/* The last record stays empty */
+	records = calloc (count + 1, size);
+	if (NULL == records) {
+		return -1;
+	}
+	empty = records + count * size;
+	for (i = 0; i < count; i++) {
+		char *rec = records + i * size;
+
+		if (log_record_read (lf, (uid_t) moves[i].from, rec, size) != 1) {
+			memzero (rec, size);
+		}
+	}
+	for (i = 0; (i < count) && (0 == ret); i++) {
+		if (moves[i].vacate) {
+			ret = log_record_write (lf, (uid_t) moves[i].from,
+			                        empty, size);
+		}
+	}
+	for (i = 0; (i < count) && (0 == ret); i++) {
+		ret = log_record_write (lf, (uid_t) moves[i].to,
+		                        records + i * size, size);
+	}
+	free (records);
+	return ret;
+}
+
+/*
+ * log_records_move - move the records of count UIDs to other UIDs
+ *
+ *	See uid_records_move(). Nothing is moved if the file does not
+ *	exist. The records are synchronized by log_file_close().
+ *
+ *	It returns 0 on success, -1 on error.
+ */
+int log_records_move (struct log_file *lf, const struct uid_move *moves,
+                      size_t count, size_t size)
+{
+	size_t i;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		if (   !lf->unkeyed
+		    && (   uid_keyed (moves[i].from)
+		        || uid_keyed (moves[i].to))) {
+			return log_records_move_keyed (lf, moves, count, size);
+		}
+	}
+
+	ret = log_file_open (lf);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	lf->dirty = true;
+	return (uid_records_move (lf->fd, size, moves, count) == 0) ? 0 : -1;
+}
+
+/*
+ * log_file_close - synchronize the written records and close the file
+ *
+ *	It returns 0 on success, -1 on error.
+ */
+int log_file_close (struct log_file *lf)
+{
+	int ret = 0;
+
+	if (NULL != lf->keyed) {
+		if (uid_keyed_close (lf->keyed) != 0) {
+			ret = -1;
+		}
+		free (lf->keyed);
+		lf->keyed = NULL;
+	}
+	if (lf->fd < 0) {
+		return ret;
+	}
+
+	if (lf->dirty && (fdatasync (lf->fd) != 0)) {
+		ret = -1;
+	}
+	if ((close (lf->fd) != 0) && (0 == ret)) {
+		ret = -1;
+	}
+	lf->fd = -1;
+	lf->dirty = false;
+	return ret;
+}
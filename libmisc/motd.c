@@ -34,24 +34,92 @@
 
 #ident "$Id$"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "prototypes.h"
 #include "defines.h"
 #include "getdef.h"
+
+/*
+ * Biggest buffer used to copy a file. Regular files up to this size are
+ * copied with a single read and a single write.
+ */
+#define MOTD_MAX_BUF (1024 * 1024)
+
+/*
+ * print_file - copy a file to the standard output
+ */
+static void print_file (const char *file)
+{
+	struct stat sb;
+	size_t size = BUFSIZ;
+	char *buf;
+	ssize_t n;
+	int fd;
+
+	fd = open (file, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	if (   (fstat (fd, &sb) == 0)
+	    && S_ISREG (sb.st_mode)
+	    && (sb.st_size >= (off_t) size)) {
+		/* One more byte, to see the end of file in the same read */
+		size = (sb.st_size < MOTD_MAX_BUF) ? (size_t) sb.st_size + 1
+		                                   : MOTD_MAX_BUF;
+	}
+	buf = malloc (size);
+	if (NULL == buf) {
+		(void) close (fd);
+		return;
+	}
+
+	while ((n = read (fd, buf, size)) != 0) {
+		const char *cp = buf;
+
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			break;
+		}
+		while (n > 0) {
+			ssize_t w = write (STDOUT_FILENO, cp, (size_t) n);
+
+			if (w < 0) {
+				if (EINTR == errno) {
+					continue;
+				}
+				goto out;
+			}
+			cp += w;
+			n -= w;
+		}
+	}
+
+      out:
+	free (buf);
+	(void) close (fd);
+}
+
 /*
  * motd -- output the /etc/motd file
  *
  * motd() determines the name of a login announcement file and outputs
  * it to the user's terminal at login time.  The MOTD_FILE configuration
  * option is a colon-delimited list of filenames.
+ *
+ * The files are written directly to the standard output, and not through
+ * stdio.
  */
 void motd (void)
 {
-	FILE *fp;
 	char *motdlist;
 	const char *motdfile;
 	char *mb;
-	register int c;
 
 	motdfile = getdef_str ("MOTD_FILE");
 	if (NULL == motdfile) {
@@ -60,21 +128,17 @@ void motd (void)
 
 	motdlist = xstrdup (motdfile);
 
+	/* Do not mix with the buffered output */
+	(void) fflush (stdout);
+
 	for (mb = motdlist; ;mb = NULL) {
 		motdfile = strtok (mb, ":");
 		if (NULL == motdfile) {
 			break;
 		}
 
-		fp = fopen (motdfile, "r");
-		if (NULL != fp) {
-			while ((c = getc (fp)) != EOF) {
-				putchar (c);
-			}
-			fclose (fp);
-		}
+		print_file (motdfile);
 	}
-	fflush (stdout);
 
 	free (motdlist);
 }
@@ -58,12 +58,12 @@
 	 * the original user, like getlogin() does).  Does this matter?
 	 */
 	if ((NULL != cp) && ('\0' != *cp)) {
-		pw = xgetpwnam (cp);
+		pw = cred_getpwnam (cp);
 		if ((NULL != pw) && (pw->pw_uid == ruid)) {
 			return pw;
 		}
 	}
 
-	return xgetpwuid (ruid);
+	return cred_getpwuid (ruid);
 }
 
@@ -0,0 +1,279 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pwd.h>
+#include <grp.h>
+#include "prototypes.h"
+#include "defines.h"
+#include "arena.h"
+
+/*
+ * Tables of the users and groups enumerated with NSS
+ *
+ * The tools which scan all the accounts, or which look up many IDs,
+ * enumerate the passwd or group database once in a table. The scans and
+ * the lookups by ID are then served from memory.
+ *
+ * A table is only loaded for a scan, or after NSS_TABLE_PROBES lookups,
+ * as enumerating a big database costs more than a few lookups. Some
+ * services do not enumerate all their entries: an ID which is not in
+ * the table is still looked up with NSS.
+ *
+ * The entries are kept for the lifetime of the process.
+ */
+#define NSS_TABLE_PROBES	32
+
+struct nss_index {
+	id_t id;
+	size_t pos;		/* in the order of NSS */
+};
+
+struct nss_table {
+	bool loaded;
+	size_t probes;		/* lookups before the table was loaded */
+	size_t count;
+	size_t size;
+	/*@null@*/ /*@only@*/void **ents;	/* in the order of NSS */
+	/*@null@*/ /*@only@*/struct nss_index *by_id;
+	struct arena arena;
+};
+
+static struct nss_table pw_table;
+static struct nss_table gr_table;
+
+static void nss_table_nomem (void)
+{
+	(void) fprintf (stderr,
+	                _("%s: failed to allocate memory: %s\n"),
+	                Prog, strerror (errno));
+	exit (13);
+}
+
+static char *nss_table_strdup (struct nss_table *t, /*@null@*/const char *s)
+{
+	char *ret = arena_strdup (&t->arena, (NULL != s) ? s : "");
+
+	if (NULL == ret) {
+		nss_table_nomem ();
+	}
+	return ret;
+}
+
+static void *nss_table_alloc (struct nss_table *t, size_t size)
+{
+	void *ret = arena_alloc (&t->arena, size);
+
+	if (NULL == ret) {
+		nss_table_nomem ();
+	}
+	return ret;
+}
+
+static void nss_table_add (struct nss_table *t, void *ent)
+{
+	if (t->count == t->size) {
+		void **ents;
+
+		t->size = (0 == t->size) ? 256 : t->size * 2;
+		ents = realloc (t->ents, t->size * sizeof (void *));
+		if (NULL == ents) {
+			nss_table_nomem ();
+		}
+		t->ents = ents;
+	}
+	t->ents[t->count] = ent;
+	t->count++;
+}
+
+static id_t pw_id (const void *ent)
+{
+	return (id_t) ((const struct passwd *) ent)->pw_uid;
+}
+
+static id_t gr_id (const void *ent)
+{
+	return (id_t) ((const struct group *) ent)->gr_gid;
+}
+
+static int nss_index_cmp (const void *p1, const void *p2)
+{
+	const struct nss_index *i1 = p1;
+	const struct nss_index *i2 = p2;
+
+	if (i1->id != i2->id) {
+		return (i1->id > i2->id) ? 1 : -1;
+	}
+	return (i1->pos > i2->pos) - (i1->pos < i2->pos);
+}
+
+/*
+ * nss_table_sort - sort the entries of the table by ID
+ *
+ *	The entries with the same ID stay in the order of NSS, so that
+ *	the first one is found, like with getpwuid() or getgrgid().
+ */
+static void nss_table_sort (struct nss_table *t, id_t (*id) (const void *))
+{
+	size_t i;
+
+	t->by_id = malloc ((t->count + 1) * sizeof (struct nss_index));
+	if (NULL == t->by_id) {
+		nss_table_nomem ();
+	}
+	for (i = 0; i < t->count; i++) {
+		t->by_id[i].id = id (t->ents[i]);
+		t->by_id[i].pos = i;
+	}
+	qsort (t->by_id, t->count, sizeof (struct nss_index), nss_index_cmp);
+}
+
+/*
+ * nss_table_find - find the first entry with this ID
+ */
+static /*@null@*/const void *nss_table_find (const struct nss_table *t,
+                                             id_t wanted)
+{
+	size_t lo = 0;
+	size_t hi = t->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (t->by_id[mid].id < wanted) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((lo < t->count) && (t->by_id[lo].id == wanted)) {
+		return t->ents[t->by_id[lo].pos];
+	}
+	return NULL;
+}
+
+static void load_passwd (void)
+{
+	const struct passwd *pw;
+
+	setpwent ();
+	while ((pw = getpwent ()) != NULL) {
+		struct passwd *ent;
+
+		ent = nss_table_alloc (&pw_table, sizeof (*ent));
+		ent->pw_name = nss_table_strdup (&pw_table, pw->pw_name);
+		ent->pw_passwd = nss_table_strdup (&pw_table, pw->pw_passwd);
+		ent->pw_uid = pw->pw_uid;
+		ent->pw_gid = pw->pw_gid;
+		ent->pw_gecos = nss_table_strdup (&pw_table, pw->pw_gecos);
+		ent->pw_dir = nss_table_strdup (&pw_table, pw->pw_dir);
+		ent->pw_shell = nss_table_strdup (&pw_table, pw->pw_shell);
+		nss_table_add (&pw_table, ent);
+	}
+	endpwent ();
+
+	nss_table_sort (&pw_table, pw_id);
+	pw_table.loaded = true;
+}
+
+static void load_group (void)
+{
+	const struct group *gr;
+
+	setgrent ();
+	while ((gr = getgrent ()) != NULL) {
+		struct group *ent;
+		size_t n = 0;
+		size_t i;
+
+		while ((NULL != gr->gr_mem) && (NULL != gr->gr_mem[n])) {
+			n++;
+		}
+		ent = nss_table_alloc (&gr_table, sizeof (*ent));
+		ent->gr_name = nss_table_strdup (&gr_table, gr->gr_name);
+		ent->gr_passwd = nss_table_strdup (&gr_table, gr->gr_passwd);
+		ent->gr_gid = gr->gr_gid;
+		ent->gr_mem = nss_table_alloc (&gr_table,
+		                               (n + 1) * sizeof (char *));
+		for (i = 0; i < n; i++) {
+			ent->gr_mem[i] = nss_table_strdup (&gr_table,
+			                                   gr->gr_mem[i]);
+		}
+		ent->gr_mem[n] = NULL;
+		nss_table_add (&gr_table, ent);
+	}
+	endgrent ();
+
+	nss_table_sort (&gr_table, gr_id);
+	gr_table.loaded = true;
+}
+
+/*
+ * nss_passwd_list - return all the users, in the order of getpwent()
+ */
+/*@observer@*/const struct passwd *const *nss_passwd_list (/*@out@*/size_t *count)
+{
+	if (!pw_table.loaded) {
+		load_passwd ();
+	}
+	*count = pw_table.count;
+	return (const struct passwd *const *) pw_table.ents;
+}
+
+/*
+ * nss_group_list - return all the groups, in the order of getgrent()
+ */
+/*@observer@*/const struct group *const *nss_group_list (/*@out@*/size_t *count)
+{
+	if (!gr_table.loaded) {
+		load_group ();
+	}
+	*count = gr_table.count;
+	return (const struct group *const *) gr_table.ents;
+}
+
+/*
+ * nss_getpwuid - getpwuid() served from the table of the users
+ */
+/*@observer@*/ /*@null@*/const struct passwd *nss_getpwuid (uid_t uid)
+{
+	const struct passwd *pw;
+
+	if (!pw_table.loaded) {
+		pw_table.probes++;
+		if (pw_table.probes < NSS_TABLE_PROBES) {
+			return timed_getpwuid (uid);
+		}
+		load_passwd ();
+	}
+	pw = nss_table_find (&pw_table, (id_t) uid);
+	if (NULL != pw) {
+		return pw;
+	}
+	return timed_getpwuid (uid);
+}
+
+/*
+ * nss_getgrgid - getgrgid() served from the table of the groups
+ */
+/*@observer@*/ /*@null@*/const struct group *nss_getgrgid (gid_t gid)
+{
+	const struct group *gr;
+
+	if (!gr_table.loaded) {
+		gr_table.probes++;
+		if (gr_table.probes < NSS_TABLE_PROBES) {
+			return timed_getgrgid (gid);
+		}
+		load_group ();
+	}
+	gr = nss_table_find (&gr_table, (id_t) gid);
+	if (NULL != gr) {
+		return gr;
+	}
+	return timed_getgrgid (gid);
+}
@@ -238,6 +238,10 @@ static /*@observer@*//*@null@*/const char *obscure_msg (
 		return _("too short");
 	}
 
+	if (pass_blocklisted (new)) {
+		return _("blocked");
+	}
+
 	/*
 	 * Remaining checks are optional.
 	 */
@@ -39,23 +39,25 @@
 #include <security/pam_appl.h>
 #include "prototypes.h"
 
-/*@null@*/ /*@only@*/static const char *non_interactive_password = NULL;
 static int ni_conv (int num_msg,
                     const struct pam_message **msg,
                     struct pam_response **resp,
-                    unused void *appdata_ptr);
-static struct pam_conv non_interactive_pam_conv = {
-	ni_conv,
-	NULL
-};
-
+                    void *appdata_ptr);
+static int ni_start (const char *pam_service, const char *username,
+                     struct pam_conv *conv, pam_handle_t **pamh);
 
 
+/*
+ * ni_conv - answer the prompts of the PAM modules
+ *
+ *	appdata_ptr points to the password of the current user.
+ */
 static int ni_conv (int num_msg,
                     const struct pam_message **msg,
                     struct pam_response **resp,
-                    unused void *appdata_ptr)
+                    void *appdata_ptr)
 {
+	const char *non_interactive_password = *(const char **) appdata_ptr;
 	struct pam_response *responses;
 	int count;
 
@@ -134,22 +136,35 @@ failed_conversation:
  *
  * Return 0 on success, 1 on failure.
  */
-int do_pam_passwd_non_interactive (const char *pam_service,
-                                    const char *username,
-                                    const char* password)
+static int ni_start (const char *pam_service, const char *username,
+                     struct pam_conv *conv, pam_handle_t **pamh)
 {
-	pam_handle_t *pamh = NULL;
 	int ret;
 
-	ret = pam_start (pam_service, username, &non_interactive_pam_conv, &pamh);
+	*pamh = NULL;
+	ret = pam_start (pam_service, username, conv, pamh);
 	if (ret != PAM_SUCCESS) {
 		fprintf (stderr,
 		         _("%s: (user %s) pam_start failure %d\n"),
 		         Prog, username, ret);
 		return 1;
 	}
+	return 0;
+}
+
+int do_pam_passwd_non_interactive (const char *pam_service,
+                                    const char *username,
+                                    const char* password)
+{
+	pam_handle_t *pamh = NULL;
+	const char *current = password;
+	struct pam_conv conv = { ni_conv, &current };
+	int ret;
+
+	if (ni_start (pam_service, username, &conv, &pamh) != 0) {
+		return 1;
+	}
 
-	non_interactive_password = password;
 	ret = pam_chauthtok (pamh, 0);
 	if (ret != PAM_SUCCESS) {
 		fprintf (stderr,
@@ -162,6 +177,64 @@ int do_pam_passwd_non_interactive (const char *pam_service,
 
 	return ((PAM_SUCCESS == ret) ? 0 : 1);
 }
+
+/*
+ * Change non interactively the passwords of several users using PAM.
+ *
+ * The PAM handle of the first user is reused for the next users, by
+ * changing its PAM_USER item, instead of running a full PAM transaction
+ * for each user. After a failure, a new handle is started for the next
+ * user, so that the state left by the modules does not affect it.
+ *
+ * The failed field of each job is set. It returns the number of
+ * failures.
+ */
+size_t do_pam_passwd_batch (const char *pam_service,
+                            struct pam_passwd_job *jobs, size_t count)
+{
+	pam_handle_t *pamh = NULL;
+	const char *current = NULL;
+	struct pam_conv conv = { ni_conv, &current };
+	size_t failures = 0;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		jobs[i].failed = true;
+		failures++;
+
+		if (   (NULL != pamh)
+		    && (pam_set_item (pamh, PAM_USER, jobs[i].name) != PAM_SUCCESS)) {
+			(void) pam_end (pamh, PAM_SUCCESS);
+			pamh = NULL;
+		}
+		if (   (NULL == pamh)
+		    && (ni_start (pam_service, jobs[i].name, &conv, &pamh) != 0)) {
+			continue;
+		}
+
+		current = jobs[i].password;
+		ret = pam_chauthtok (pamh, 0);
+		if (ret != PAM_SUCCESS) {
+			fprintf (stderr,
+			         _("%s: (user %s) pam_chauthtok() failed, error:\n"
+			           "%s\n"),
+			         Prog, jobs[i].name, pam_strerror (pamh, ret));
+			(void) pam_end (pamh, PAM_SUCCESS);
+			pamh = NULL;
+			continue;
+		}
+
+		jobs[i].failed = false;
+		failures--;
+	}
+
+	if (NULL != pamh) {
+		(void) pam_end (pamh, PAM_SUCCESS);
+	}
+
+	return failures;
+}
 #else				/* !USE_PAM */
 extern int errno;		/* warning: ANSI C forbids an empty source file */
 #endif				/* !USE_PAM */
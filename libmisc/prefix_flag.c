@@ -38,6 +38,7 @@
 #include "prototypes.h"
 /*@-exitarg@*/
 #include "exitcodes.h"
+#include "commonio.h"
 #include "groupio.h"
 #include "pwio.h"
 #ifdef	SHADOWGRP
@@ -59,6 +60,53 @@ static char *def_conf_file = NULL;
 static FILE* fp_pwent = NULL;
 static FILE* fp_grent = NULL;
 
+/*
+ * In-memory index of a database file of the prefix
+ *
+ * The file is read once, and the entries are sorted by name and by ID.
+ * The index is reloaded when the commonio database of the file was
+ * committed since it was loaded.
+ */
+struct prefix_ent {
+	/*@dependent@*/const char *name;
+	id_t id;
+	size_t pos;		/* position in the file, to find the first entry */
+	/*@dependent@*/void *ent;
+};
+
+struct prefix_index {
+	/* Read the next entry of fp, return 1, 0 at the end, -1 on failure */
+	int (*read) (FILE *fp, /*@out@*/void **ent);
+	void (*free) (/*@only@*/void *ent);
+	const char *(*name) (const void *ent);
+	id_t (*id) (const void *ent);
+
+	bool loaded;
+	unsigned long commits;	/* commits of the database when loaded */
+	/*@only@*/ /*@null@*/struct prefix_ent *by_name;
+	/*@only@*/ /*@null@*/struct prefix_ent *by_id;
+	size_t count;
+};
+
+static int gr_read (FILE *fp, void **ent);
+static const char *gr_name (const void *ent);
+static id_t gr_id (const void *ent);
+static void gr_release (void *ent);
+static int pw_read (FILE *fp, void **ent);
+static const char *pw_name (const void *ent);
+static id_t pw_id (const void *ent);
+static void pw_release (void *ent);
+static int spw_read (FILE *fp, void **ent);
+static const char *spw_name (const void *ent);
+static id_t spw_id (const void *ent);
+static void spw_release (void *ent);
+
+static struct prefix_index gr_index = { gr_read, gr_release, gr_name, gr_id };
+static struct prefix_index pw_index = { pw_read, pw_release, pw_name, pw_id };
+static struct prefix_index spw_index = {
+	spw_read, spw_release, spw_name, spw_id
+};
+
 /*
  * process_prefix_flag - prefix all paths if given the --prefix option
  *
@@ -145,6 +193,11 @@ extern const char* process_prefix_flag (const char* short_opt, int argc, char **
 		def_conf_file = xmalloc(len);
 		snprintf(def_conf_file, len, "%s/%s", prefix, "/etc/login.defs");
 		setdef_config_file(def_conf_file);
+
+		/* An image does not need the durability of a live system */
+		if (NULL != shadow_getenv ("SHADOW_OFFLINE")) {
+			commonio_set_offline (true);
+		}
 	}	
 
 	if (prefix == NULL)
@@ -153,104 +206,349 @@ extern const char* process_prefix_flag (const char* short_opt, int argc, char **
 }
 
 
+static int gr_read (FILE *fp, void **ent)
+{
+	struct group *grp = fgetgrent (fp);
+
+	if (NULL == grp) {
+		return 0;
+	}
+	*ent = __gr_dup_packed (grp);
+	return (NULL != *ent) ? 1 : -1;
+}
+
+static const char *gr_name (const void *ent)
+{
+	return ((const struct group *) ent)->gr_name;
+}
+
+static id_t gr_id (const void *ent)
+{
+	return (id_t) ((const struct group *) ent)->gr_gid;
+}
+
+static void gr_release (void *ent)
+{
+	gr_free_packed ((struct group *) ent);
+}
+
+static int pw_read (FILE *fp, void **ent)
+{
+	struct passwd *pwd = fgetpwent (fp);
+
+	if (NULL == pwd) {
+		return 0;
+	}
+	*ent = __pw_dup_packed (pwd);
+	return (NULL != *ent) ? 1 : -1;
+}
+
+static const char *pw_name (const void *ent)
+{
+	return ((const struct passwd *) ent)->pw_name;
+}
+
+static id_t pw_id (const void *ent)
+{
+	return (id_t) ((const struct passwd *) ent)->pw_uid;
+}
+
+static void pw_release (void *ent)
+{
+	pw_free_packed ((struct passwd *) ent);
+}
+
+static int spw_read (FILE *fp, void **ent)
+{
+	struct spwd *sp = fgetspent (fp);
+
+	if (NULL == sp) {
+		return 0;
+	}
+	*ent = __spw_dup_packed (sp);
+	return (NULL != *ent) ? 1 : -1;
+}
+
+static const char *spw_name (const void *ent)
+{
+	return ((const struct spwd *) ent)->sp_namp;
+}
+
+static id_t spw_id (unused const void *ent)
+{
+	return 0;	/* no lookup by ID */
+}
+
+static void spw_release (void *ent)
+{
+	spw_free_packed ((struct spwd *) ent);
+}
+
+static int name_cmp (const void *p1, const void *p2)
+{
+	const struct prefix_ent *e1 = p1;
+	const struct prefix_ent *e2 = p2;
+	int ret = strcmp (e1->name, e2->name);
+
+	if (0 != ret) {
+		return ret;
+	}
+	return (e1->pos > e2->pos) - (e1->pos < e2->pos);
+}
+
+static int id_cmp (const void *p1, const void *p2)
+{
+	const struct prefix_ent *e1 = p1;
+	const struct prefix_ent *e2 = p2;
+
+	if (e1->id != e2->id) {
+		return (e1->id > e2->id) ? 1 : -1;
+	}
+	return (e1->pos > e2->pos) - (e1->pos < e2->pos);
+}
+
+/*
+ * prefix_index_free - forget the entries of the index
+ */
+static void prefix_index_free (struct prefix_index *idx)
+{
+	size_t i;
+
+	if (NULL != idx->by_name) {
+		for (i = 0; i < idx->count; i++) {
+			idx->free (idx->by_name[i].ent);
+		}
+	}
+	free (idx->by_name);
+	free (idx->by_id);
+	idx->by_name = NULL;
+	idx->by_id = NULL;
+	idx->count = 0;
+	idx->loaded = false;
+}
+
+/*
+ * prefix_index_load - load the index of file if needed
+ *
+ *	The index is kept until db is committed.
+ *
+ *	It returns false if the file could not be read.
+ */
+static bool prefix_index_load (struct prefix_index *idx,
+                               const struct commonio_db *db,
+                               const char *file)
+{
+	struct prefix_ent *ents = NULL;
+	size_t size = 0;
+	size_t n = 0;
+	void *ent;
+	FILE *fp;
+	int ret;
+
+	if (idx->loaded && (idx->commits == db->commits)) {
+		return true;
+	}
+	prefix_index_free (idx);
+
+	fp = fopen (file, "rt");
+	if (NULL == fp) {
+		return false;
+	}
+	while ((ret = idx->read (fp, &ent)) == 1) {
+		if (n == size) {
+			struct prefix_ent *bigger;
+
+			size = (0 == size) ? 64 : size * 2;
+			bigger = realloc (ents, size * sizeof (*ents));
+			if (NULL == bigger) {
+				idx->free (ent);
+				ret = -1;
+				break;
+			}
+			ents = bigger;
+		}
+		ents[n].name = idx->name (ent);
+		ents[n].id = idx->id (ent);
+		ents[n].pos = n;
+		ents[n].ent = ent;
+		n++;
+	}
+	(void) fclose (fp);
+
+	idx->by_name = ents;
+	idx->count = n;
+	if (0 == ret) {
+		idx->by_id = (0 != n) ? malloc (n * sizeof (*ents)) : NULL;
+		if ((0 != n) && (NULL == idx->by_id)) {
+			ret = -1;
+		}
+	}
+	if (0 != ret) {
+		prefix_index_free (idx);
+		return false;
+	}
+
+	if (0 != n) {
+		memcpy (idx->by_id, ents, n * sizeof (*ents));
+		qsort (idx->by_name, n, sizeof (*ents), name_cmp);
+		qsort (idx->by_id, n, sizeof (*ents), id_cmp);
+	}
+	idx->loaded = true;
+	idx->commits = db->commits;
+	return true;
+}
+
+/*
+ * prefix_index_locate - find the first entry of file named name, or with
+ *                       the ID id if name is NULL
+ */
+static /*@null@*/void *prefix_index_locate (struct prefix_index *idx,
+                                            const struct commonio_db *db,
+                                            const char *file,
+                                            /*@null@*/const char *name,
+                                            id_t id)
+{
+	const struct prefix_ent *ents;
+	size_t lo = 0;
+	size_t hi;
+
+	if (!prefix_index_load (idx, db, file)) {
+		return NULL;
+	}
+
+	/* Lower bound: the first entry not before name (or id) */
+	ents = (NULL != name) ? idx->by_name : idx->by_id;
+	hi = idx->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (  (NULL != name)
+		    ? (strcmp (ents[mid].name, name) < 0)
+		    : (ents[mid].id < id)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (   (lo == idx->count)
+	    || (  (NULL != name)
+	        ? (strcmp (ents[lo].name, name) != 0)
+	        : (ents[lo].id != id))) {
+		return NULL;
+	}
+	return ents[lo].ent;
+}
+
+/*
+ * The prefix_get* functions search the database files of the prefix.
+ * They use the snapshot of the database (see commonio_snapshot_locate)
+ * when it is up to date, and an in-memory index of the file otherwise.
+ * The entries returned belong to the index: they are valid until the
+ * database is committed.
+ */
 extern struct group *prefix_getgrnam(const char *name)
 {
 	if (group_db_file) {
-		FILE* fg;
-		struct group * grp = NULL;
+		void *ent;
 
-		fg = fopen(group_db_file, "rt");
-		if(!fg)
+		switch (commonio_snapshot_locate (__gr_get_db (), name, &ent)) {
+		case 1:
+			return (struct group *) ent;
+		case 0:
 			return NULL;
-		while(grp = fgetgrent(fg)) {
-			if(!strcmp(name, grp->gr_name))
-				break;
+		default:
+			break;
 		}
-		fclose(fg);
-		return grp;
+
+		return prefix_index_locate (&gr_index, __gr_get_db (),
+		                            group_db_file, name, 0);
 	}
 	
-	return getgrnam(name);
+	return timed_getgrnam (name);
 }
 
 extern struct group *prefix_getgrgid(gid_t gid)
 {
 	if (group_db_file) {
-		FILE* fg;
-		struct group * grp = NULL;
+		void *ent;
 
-		fg = fopen(group_db_file, "rt");
-		if(!fg)
+		switch (commonio_snapshot_locate_id (__gr_get_db (), (id_t) gid, &ent)) {
+		case 1:
+			return (struct group *) ent;
+		case 0:
 			return NULL;
-		while(grp = fgetgrent(fg)) {
-			if(gid == grp->gr_gid)
-				break;
+		default:
+			break;
 		}
-		fclose(fg);
-		return grp;
+
+		return prefix_index_locate (&gr_index, __gr_get_db (),
+		                            group_db_file, NULL, (id_t) gid);
 	}
 
-	return getgrgid(gid);
+	return timed_getgrgid (gid);
 }
 
 extern struct passwd *prefix_getpwuid(uid_t uid)
 {
 	if (passwd_db_file) {
-		FILE* fg;
-		struct passwd *pwd = NULL;
+		void *ent;
 
-		fg = fopen(passwd_db_file, "rt");
-		if(!fg)
+		switch (commonio_snapshot_locate_id (__pw_get_db (), (id_t) uid, &ent)) {
+		case 1:
+			return (struct passwd *) ent;
+		case 0:
 			return NULL;
-		while(pwd = fgetpwent(fg)) {
-			if(uid == pwd->pw_uid)
-				break;
+		default:
+			break;
 		}
-		fclose(fg);
-		return pwd;
+
+		return prefix_index_locate (&pw_index, __pw_get_db (),
+		                            passwd_db_file, NULL, (id_t) uid);
 	}
 	else {
-		return getpwuid(uid);
+		return timed_getpwuid (uid);
 	}
 }
 extern struct passwd *prefix_getpwnam(const char* name)
 {
 	if (passwd_db_file) {
-		FILE* fg;
-		struct passwd *pwd = NULL;
+		void *ent;
 
-		fg = fopen(passwd_db_file, "rt");
-		if(!fg)
+		switch (commonio_snapshot_locate (__pw_get_db (), name, &ent)) {
+		case 1:
+			return (struct passwd *) ent;
+		case 0:
 			return NULL;
-		while(pwd = fgetpwent(fg)) {
-			if(!strcmp(name, pwd->pw_name))
-				break;
+		default:
+			break;
 		}
-		fclose(fg);
-		return pwd;
+
+		return prefix_index_locate (&pw_index, __pw_get_db (),
+		                            passwd_db_file, name, 0);
 	}
 	else {
-		return getpwnam(name);
+		return timed_getpwnam (name);
 	}
 }
 extern struct spwd *prefix_getspnam(const char* name)
 {
 	if (spw_db_file) {
-		FILE* fg;
-		struct spwd *sp = NULL;
+		void *ent;
 
-		fg = fopen(spw_db_file, "rt");
-		if(!fg)
+		switch (commonio_snapshot_locate (__spw_get_db (), name, &ent)) {
+		case 1:
+			return (struct spwd *) ent;
+		case 0:
 			return NULL;
-		while(sp = fgetspent(fg)) {
-			if(!strcmp(name, sp->sp_namp))
-				break;
+		default:
+			break;
 		}
-		fclose(fg);
-		return sp;
+
+		return prefix_index_locate (&spw_index, __spw_get_db (),
+		                            spw_db_file, name, 0);
 	}
 	else {
-		return getspnam(name);
+		return timed_getspnam (name);
 	}
 }
 
@@ -272,6 +570,8 @@ extern struct passwd* prefix_getpwent()
 	if(!passwd_db_file) {
 		return getpwent();
 	}
+	if (!fp_pwent)
+		return NULL;
 	return fgetpwent(fp_pwent);
 }
 extern void prefix_endpwent()
@@ -285,6 +585,32 @@ extern void prefix_endpwent()
 	fp_pwent = NULL;
 }
 
+/*
+ * prefix_pw_scan - Call scan for each user
+ *
+ * With --prefix, the passwd file of the prefix is scanned with pw_scan(),
+ * without building its list of entries when it is not open. Otherwise,
+ * the users are enumerated with getpwent().
+ *
+ * Return the value returned by pw_scan() or by the last call to scan.
+ */
+extern int prefix_pw_scan (int (*scan) (const void *ent, void *arg), void *arg)
+{
+	const struct passwd *pw;
+	int ret = 0;
+
+	if (NULL != passwd_db_file) {
+		return pw_scan (scan, arg);
+	}
+
+	setpwent ();
+	while ((0 == ret) && ((pw = getpwent ()) != NULL)) {
+		ret = scan (pw, arg);
+	}
+	endpwent ();
+	return ret;
+}
+
 extern void prefix_setgrent()
 {
 	if(!group_db_file) {
@@ -303,6 +629,8 @@ extern struct group* prefix_getgrent()
 	if(!group_db_file) {
 		return getgrent();
 	}
+	if (!fp_grent)
+		return NULL;
 	return fgetgrent(fp_grent);
 }
 extern void prefix_endgrent()
@@ -316,6 +644,29 @@ extern void prefix_endgrent()
 	fp_grent = NULL;
 }
 
+/*
+ * prefix_gr_scan - Call scan for each group
+ *
+ * Like prefix_pw_scan(), with the group file of the prefix, or with
+ * getgrent().
+ */
+extern int prefix_gr_scan (int (*scan) (const void *ent, void *arg), void *arg)
+{
+	const struct group *gr;
+	int ret = 0;
+
+	if (NULL != group_db_file) {
+		return gr_scan (scan, arg);
+	}
+
+	setgrent ();
+	while ((0 == ret) && ((gr = getgrent ()) != NULL)) {
+		ret = scan (gr, arg);
+	}
+	endgrent ();
+	return ret;
+}
+
 extern struct group *prefix_getgr_nam_gid(const char *grname)
 {
 	long long int gid;
@@ -333,10 +684,11 @@ extern struct group *prefix_getgr_nam_gid(const char *grname)
 	    	&& ('\0' == *endptr)
 	    	&& (ERANGE != errno)
 	    	&& (gid == (gid_t)gid)) {
-			return prefix_getgrgid ((gid_t) gid);
+			g = prefix_getgrgid ((gid_t) gid);
+			return g ? __gr_dup_packed(g) : NULL;
 		}
 		g = prefix_getgrnam (grname);
-		return g ? __gr_dup(g) : NULL;
+		return g ? __gr_dup_packed(g) : NULL;
 	}
 	else
 		return getgr_nam_gid(grname);
@@ -0,0 +1,146 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* HAVE_PTHREAD */
+#include "prototypes.h"
+
+/*
+ * Progress of the copy or of the removal of a directory tree
+ *
+ * copy_tree() and remove_tree() report the entries they copied or
+ * removed, the bytes they copied, and the directory they are
+ * processing. If a callback was set with tree_progress_start(), it is
+ * called with the totals every interval seconds, and once more by
+ * tree_progress_stop().
+ *
+ * The counters can be updated by the threads of COPY_THREADS and
+ * REMOVE_THREADS. The callback is then called by the thread which
+ * updates the counters, with the lock held.
+ */
+
+static /*@null@*/tree_progress_fn progress_fn;
+static struct tree_progress progress;
+static char progress_path[1024];
+static struct timespec progress_start;
+static struct timespec progress_next;
+static time_t progress_interval;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif				/* HAVE_PTHREAD */
+
+static void progress_lock_acquire (void)
+{
+#ifdef HAVE_PTHREAD
+	(void) pthread_mutex_lock (&progress_lock);
+#endif				/* HAVE_PTHREAD */
+}
+
+static void progress_lock_release (void)
+{
+#ifdef HAVE_PTHREAD
+	(void) pthread_mutex_unlock (&progress_lock);
+#endif				/* HAVE_PTHREAD */
+}
+
+/*
+ * progress_report - call the callback if the interval elapsed, or if
+ *                   force is set
+ *
+ *	The lock must be held.
+ */
+static void progress_report (bool force)
+{
+	struct timespec now;
+
+	if (   (NULL == progress_fn)
+	    || (clock_gettime (CLOCK_MONOTONIC, &now) != 0)) {
+		return;
+	}
+	if (   !force
+	    && (   (now.tv_sec < progress_next.tv_sec)
+	        || (   (now.tv_sec == progress_next.tv_sec)
+	            && (now.tv_nsec < progress_next.tv_nsec)))) {
+		return;
+	}
+	progress_next.tv_sec = now.tv_sec + progress_interval;
+	progress_next.tv_nsec = now.tv_nsec;
+
+	progress.elapsed = (double) (now.tv_sec - progress_start.tv_sec)
+	                 + (double) (now.tv_nsec - progress_start.tv_nsec) / 1e9;
+	progress.path = progress_path;
+	progress_fn (&progress);
+}
+
+/*
+ * tree_progress_start - start reporting the progress to fn
+ *
+ *	fn is called every interval seconds (at least 1).
+ */
+void tree_progress_start (tree_progress_fn fn, unsigned int interval)
+{
+	progress_lock_acquire ();
+	memzero (&progress, sizeof progress);
+	progress_path[0] = '\0';
+	progress_interval = (0 == interval) ? 1 : (time_t) interval;
+	if (clock_gettime (CLOCK_MONOTONIC, &progress_start) != 0) {
+		progress_lock_release ();
+		return;
+	}
+	progress_next.tv_sec = progress_start.tv_sec + progress_interval;
+	progress_next.tv_nsec = progress_start.tv_nsec;
+	progress_fn = fn;
+	progress_lock_release ();
+}
+
+/*
+ * tree_progress_stop - report the totals and stop reporting
+ */
+void tree_progress_stop (void)
+{
+	if (NULL == progress_fn) {
+		return;
+	}
+
+	progress_lock_acquire ();
+	progress.done = true;
+	progress_report (true);
+	progress_fn = NULL;
+	progress_lock_release ();
+}
+
+/*
+ * tree_progress_add - add entries and bytes to the totals
+ */
+void tree_progress_add (unsigned long files, unsigned long long bytes)
+{
+	if (NULL == progress_fn) {
+		return;
+	}
+
+	progress_lock_acquire ();
+	progress.files += files;
+	progress.bytes += bytes;
+	progress_report (false);
+	progress_lock_release ();
+}
+
+/*
+ * tree_progress_path - set the directory being processed
+ */
+void tree_progress_path (const char *path)
+{
+	if (NULL == progress_fn) {
+		return;
+	}
+
+	progress_lock_acquire ();
+	(void) strncpy (progress_path, path, sizeof progress_path - 1);
+	progress_path[sizeof progress_path - 1] = '\0';
+	progress_lock_release ();
+}
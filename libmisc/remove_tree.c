@@ -40,94 +40,306 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* HAVE_PTHREAD */
 #include "prototypes.h"
 #include "defines.h"
+#include "getdef.h"
+#include "probes.h"
 
 /*
- * remove_tree - delete a directory tree
+ * Directory being removed.
  *
- *	remove_tree() walks a directory tree and deletes all the files
- *	and directories.
- *	At the end, it deletes the root directory itself.
+ * The entries of a directory are accessed relative to its descriptor, so
+ * that their path is not resolved again, and so that a directory cannot
+ * be replaced by a symbolic link while it is removed.
+ *
+ * With REMOVE_THREADS, the subdirectories are queued to a pool of
+ * threads while the queue is not full, and removed by the current thread
+ * otherwise. Each subdirectory holds a reference to its parent, whose
+ * descriptor is used to remove it. The last thread done with a directory
+ * and its subdirectories removes the directory.
  */
+struct remove_dir {
+	/*@null@*/struct remove_dir *parent;
+	int dirfd;		/* descriptor of the parent directory */
+	/*@only@*/char *name;
+	bool follow;		/* name can be a symbolic link */
+	bool remove;		/* remove the directory itself */
+	int fd;			/* its descriptor, -1 if not open */
+	unsigned long refs;	/* its walk and its subdirectories */
+};
 
-int remove_tree (const char *root, bool remove_root)
+static /*@null@*/struct work_pool *remove_pool;
+static bool remove_failed;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t remove_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif				/* HAVE_PTHREAD */
+
+static void remove_dir_walk (struct remove_dir *rd);
+
+static void remove_fail (void)
 {
-	char *new_name = NULL;
-	int err = 0;
-	struct DIRECT *ent;
-	struct stat sb;
-	DIR *dir;
+	if (NULL != remove_pool) {
+		work_pool_fail (remove_pool);
+	} else {
+		remove_failed = true;
+	}
+}
 
-	/*
-	 * Open the source directory and read each entry.  Every file
-	 * entry in the directory is copied with the UID and GID set
-	 * to the provided values.  As an added security feature only
-	 * regular files (and directories ...) are copied, and no file
-	 * is made set-ID.
-	 */
-	dir = opendir (root);
-	if (NULL == dir) {
-		return -1;
+static bool remove_has_failed (void)
+{
+	if (NULL != remove_pool) {
+		return work_pool_failed (remove_pool);
 	}
+	return remove_failed;
+}
 
-	while ((ent = readdir (dir))) {
-		size_t new_len = strlen (root) + strlen (ent->d_name) + 2;
+/*
+ * remove_dir_ref - add delta to the references of a directory
+ *
+ *	It returns the new number of references.
+ */
+static unsigned long remove_dir_ref (struct remove_dir *rd, int delta)
+{
+	unsigned long refs;
 
-		/*
-		 * Skip the "." and ".." entries
-		 */
+#ifdef HAVE_PTHREAD
+	if (NULL != remove_pool) {
+		(void) pthread_mutex_lock (&remove_lock);
+	}
+#endif				/* HAVE_PTHREAD */
+	refs = (delta > 0) ? ++rd->refs : --rd->refs;
+#ifdef HAVE_PTHREAD
+	if (NULL != remove_pool) {
+		(void) pthread_mutex_unlock (&remove_lock);
+	}
+#endif				/* HAVE_PTHREAD */
+
+	return refs;
+}
+
+/*
+ * remove_dir_new - return a directory to remove, with a reference
+ *
+ *	parent is NULL for the root of the tree.
+ */
+static /*@null@*/struct remove_dir *remove_dir_new (
+	/*@null@*/struct remove_dir *parent, int dirfd, const char *name)
+{
+	struct remove_dir *rd;
+
+	rd = malloc (sizeof *rd);
+	if (NULL == rd) {
+		return NULL;
+	}
+	rd->name = strdup (name);
+	if (NULL == rd->name) {
+		free (rd);
+		return NULL;
+	}
+	rd->parent = parent;
+	rd->dirfd = dirfd;
+	rd->follow = (NULL == parent);
+	rd->remove = true;
+	rd->fd = -1;
+	rd->refs = 1;
+	if (NULL != parent) {
+		(void) remove_dir_ref (parent, 1);
+	}
+
+	return rd;
+}
+
+/*
+ * remove_dir_release - drop a reference to a directory
+ *
+ *	When there are no references left, the directory is removed, and
+ *	its reference to its parent is dropped.
+ */
+static void remove_dir_release (/*@null@*/struct remove_dir *rd)
+{
+	while (NULL != rd) {
+		struct remove_dir *parent = rd->parent;
+
+		if (remove_dir_ref (rd, -1) != 0) {
+			return;
+		}
+
+		if (rd->fd >= 0) {
+			(void) close (rd->fd);
+		}
+		if (rd->remove && !remove_has_failed ()) {
+			if (unlinkat (rd->dirfd, rd->name, AT_REMOVEDIR) != 0) {
+				remove_fail ();
+			} else {
+				tree_progress_add (1, 0);
+			}
+		}
+		free (rd->name);
+		free (rd);
+		rd = parent;
+	}
+}
+
+static void remove_dir_job (unused struct work_pool *pool, void *arg)
+{
+	remove_dir_walk (arg);
+}
+
+/*
+ * remove_entry - delete the entry ent of the directory rd, open at fd
+ *
+ *	It returns false if the walk shall stop.
+ */
+static bool remove_entry (struct remove_dir *rd, int fd,
+                          const struct dir_batch_entry *ent)
+{
+	bool is_dir;
 
-		if (strcmp (ent->d_name, ".") == 0 ||
-		    strcmp (ent->d_name, "..") == 0) {
-			continue;
+	if (DT_UNKNOWN != ent->type) {
+		is_dir = (DT_DIR == ent->type);
+	} else {
+		struct stat sb;
+
+		if (fstatat (fd, ent->name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+			return true;
 		}
+		is_dir = S_ISDIR (sb.st_mode);
+	}
 
+	if (is_dir) {
 		/*
-		 * Make the filename for the current entry.
+		 * Recursively delete this directory.
 		 */
+		struct remove_dir *sub;
 
-		free (new_name);
-		new_name = (char *) malloc (new_len);
-		if (NULL == new_name) {
-			err = -1;
-			break;
+		sub = remove_dir_new (rd, fd, ent->name);
+		if (NULL == sub) {
+			remove_fail ();
+			return false;
 		}
-		(void) snprintf (new_name, new_len, "%s/%s", root, ent->d_name);
-		if (LSTAT (new_name, &sb) == -1) {
-			continue;
+		if (!work_pool_queue (remove_pool, remove_dir_job, sub, false)) {
+			remove_dir_walk (sub);
 		}
+		return !remove_has_failed ();
+	}
 
-		if (S_ISDIR (sb.st_mode)) {
-			/*
-			 * Recursively delete this directory.
-			 */
-			if (remove_tree (new_name, true) != 0) {
-				err = -1;
-				break;
-			}
-		} else {
-			/*
-			 * Delete the file.
-			 */
-			if (unlink (new_name) != 0) {
-				err = -1;
-				break;
-			}
+	/*
+	 * Delete the file.
+	 */
+	if (unlinkat (fd, ent->name, 0) != 0) {
+		remove_fail ();
+		return false;
+	}
+	tree_progress_add (1, 0);
+	return true;
+}
+
+/*
+ * remove_dir_walk - delete the entries of a directory, and then the
+ * directory, once its subdirectories are deleted
+ *
+ *	The entries are read in batches sorted by inode number. The
+ *	descriptor of the directory is kept until its subdirectories are
+ *	deleted.
+ */
+static void remove_dir_walk (struct remove_dir *rd)
+{
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	struct dir_batch batch;
+	bool ok = true;
+	ssize_t n;
+	ssize_t i;
+
+	if (!rd->follow) {
+		flags |= O_NOFOLLOW;
+	}
+
+	rd->fd = openat (rd->dirfd, rd->name, flags);
+	if (rd->fd < 0) {
+		remove_fail ();
+		remove_dir_release (rd);
+		return;
+	}
+
+	dir_batch_init (&batch, rd->fd);
+	while (ok && ((n = dir_batch_next (&batch)) != 0)) {
+		if (n < 0) {
+			remove_fail ();
+			break;
+		}
+		for (i = 0; ok && (i < n); i++) {
+			ok = remove_entry (rd, rd->fd, &batch.ents[i]);
 		}
 	}
-	if (NULL != new_name) {
-		free (new_name);
+	dir_batch_free (&batch);
+
+	remove_dir_release (rd);
+}
+
+/*
+ * remove_trees - delete several directory trees
+ *
+ *	The trees are walked with the same pool of threads, so that the
+ *	home directories of several users can be removed in one pass.
+ *
+ *	See remove_tree() for the meaning of remove_root.
+ *
+ *	Return 0 if all the trees were removed, -1 otherwise.
+ */
+int remove_trees (const char *const *roots, size_t count, bool remove_root)
+{
+	int nthreads = getdef_num ("REMOVE_THREADS", 1);
+	size_t i;
+	int err;
+
+	SHADOW_PROBE2 (remove_trees__entry,
+	               (count > 0) ? roots[0] : "", (long) count);
+	remove_failed = false;
+	if (nthreads > 1) {
+		remove_pool = work_pool_start ((size_t) nthreads,
+		                               2 * (size_t) nthreads);
 	}
-	(void) closedir (dir);
 
-	if (remove_root && (0 == err)) {
-		if (rmdir (root) != 0) {
-			err = -1;
+	for (i = 0; (i < count) && !remove_has_failed (); i++) {
+		struct remove_dir *rd;
+
+		rd = remove_dir_new (NULL, AT_FDCWD, roots[i]);
+		if (NULL == rd) {
+			remove_fail ();
+			break;
+		}
+		rd->remove = remove_root;
+		tree_progress_path (roots[i]);
+		if (!work_pool_queue (remove_pool, remove_dir_job, rd, false)) {
+			remove_dir_walk (rd);
 		}
 	}
 
+	err = work_pool_stop (remove_pool);
+	remove_pool = NULL;
+	if (remove_failed) {
+		err = -1;
+	}
+
+	SHADOW_PROBE3 (remove_trees__return,
+	               (count > 0) ? roots[0] : "", (long) count, err);
 	return err;
 }
 
+/*
+ * remove_tree - delete a directory tree
+ *
+ *	remove_tree() walks a directory tree and deletes all the files
+ *	and directories.
+ *	At the end, it deletes the root directory itself.
+ */
+
+int remove_tree (const char *root, bool remove_root)
+{
+	return remove_trees (&root, 1, remove_root);
+}
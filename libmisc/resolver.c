@@ -0,0 +1,366 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* HAVE_PTHREAD */
+#include <pwd.h>
+#include <grp.h>
+#include "prototypes.h"
+#include "defines.h"
+#include "getdef.h"
+
+/*
+ * Resolver of the users and groups of the reports
+ *
+ * The reports look up the owner of each record they print, and each
+ * lookup may be a remote NSS request (LDAP, sssd, ...). The resolver
+ * runs the lookups on RESOLVE_THREADS threads: the caller requests the
+ * keys of the next records while it prints the current one, and waits
+ * for each result in its own order. Each key is looked up only once.
+ *
+ * The number of requests running or queued is bounded by the work pool:
+ * resolver_request() does not queue more, and the caller then waits for
+ * a result before it requests the next keys.
+ *
+ * The results are the packed entries of the xget* functions, and are
+ * kept until resolver_free() is called.
+ *
+ * Without POSIX threads or the reentrant lookups, or with a single
+ * thread, resolver_start() returns NULL, and the callers look up the
+ * entries themselves.
+ */
+
+#define RESOLVE_QUEUED_PER_THREAD	4
+
+#if defined(HAVE_PTHREAD) && defined(HAVE_GETPWUID_R) \
+    && defined(HAVE_GETPWNAM_R) && defined(HAVE_GETGRGID_R) \
+    && defined(HAVE_GETGRNAM_R)
+#define RESOLVER_THREADS
+#endif
+
+#ifdef RESOLVER_THREADS
+struct resolve_entry {
+	enum resolve_key key;
+	/*@null@*/ /*@only@*/char *name;	/* NULL for an ID */
+	id_t id;
+	/*@null@*/ /*@only@*/void *ent;	/* NULL if it does not exist */
+	bool done;		/* set by the thread of the lookup */
+	/*@dependent@*/struct nss_resolver *res;
+	/*@null@*/ /*@only@*/struct resolve_entry *next;
+};
+
+/*
+ * The table of the keys is only used by the caller; the threads only
+ * set the results of their entries, under the lock.
+ */
+struct nss_resolver {
+	/*@only@*/struct work_pool *pool;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;	/* a lookup is done */
+	/*@null@*/ /*@only@*/struct resolve_entry **buckets;
+	size_t size;
+	size_t count;
+	unsigned long queued;	/* lookups queued, only used by the caller */
+	unsigned long done;	/* lookups done, under the lock */
+};
+
+static size_t resolve_hash (enum resolve_key key,
+                            /*@null@*/const char *name, id_t id)
+{
+	size_t h = 2166136261U ^ (size_t) key;
+
+	if (NULL == name) {
+		return ((size_t) id + (size_t) key) * 2654435761U;
+	}
+	for (; '\0' != *name; name++) {
+		h = (h ^ (unsigned char) *name) * 16777619U;
+	}
+	return h;
+}
+
+static /*@null@*/struct resolve_entry *resolve_find (
+	const struct nss_resolver *res, enum resolve_key key,
+	/*@null@*/const char *name, id_t id)
+{
+	struct resolve_entry *e;
+
+	if (NULL == res->buckets) {
+		return NULL;
+	}
+	for (e = res->buckets[resolve_hash (key, name, id) & (res->size - 1)];
+	     NULL != e;
+	     e = e->next) {
+		if (   (e->key == key)
+		    && (   (NULL == name)
+		        ? ((NULL == e->name) && (e->id == id))
+		        : ((NULL != e->name) && (strcmp (e->name, name) == 0)))) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static struct resolve_entry *resolve_add (struct nss_resolver *res,
+                                          enum resolve_key key,
+                                          /*@null@*/const char *name,
+                                          id_t id)
+{
+	struct resolve_entry *e;
+	struct resolve_entry **b;
+
+	/* Keep the chains short */
+	if (res->count >= res->size) {
+		struct resolve_entry **buckets;
+		size_t size = (0 == res->size) ? 64 : res->size * 2;
+		size_t i;
+
+		buckets = (struct resolve_entry **)
+		          xmalloc (size * sizeof (struct resolve_entry *));
+		memset (buckets, 0, size * sizeof (struct resolve_entry *));
+		for (i = 0; i < res->size; i++) {
+			while (NULL != res->buckets[i]) {
+				e = res->buckets[i];
+				res->buckets[i] = e->next;
+				b = &buckets[resolve_hash (e->key, e->name, e->id)
+				             & (size - 1)];
+				e->next = *b;
+				*b = e;
+			}
+		}
+		free (res->buckets);
+		res->buckets = buckets;
+		res->size = size;
+	}
+
+	e = (struct resolve_entry *) xmalloc (sizeof (*e));
+	e->key = key;
+	e->name = (NULL != name) ? xstrdup (name) : NULL;
+	e->id = id;
+	e->ent = NULL;
+	e->done = false;
+	e->res = res;
+	b = &res->buckets[resolve_hash (key, name, id) & (res->size - 1)];
+	e->next = *b;
+	*b = e;
+	res->count++;
+
+	return e;
+}
+
+/*
+ * resolve_drop - remove the last entry added for a key
+ */
+static void resolve_drop (struct nss_resolver *res, struct resolve_entry *e)
+{
+	res->buckets[resolve_hash (e->key, e->name, e->id)
+	             & (res->size - 1)] = e->next;
+	res->count--;
+	free (e->name);
+	free (e);
+}
+
+/*
+ * resolve_lookup - look up the entry of e, with the thread safe xget*
+ *                  functions
+ */
+static void resolve_lookup (struct work_pool *pool, void *arg)
+{
+	struct resolve_entry *e = arg;
+	void *ent = NULL;
+
+	(void) pool;
+	switch (e->key) {
+	case RESOLVE_PWNAM:
+		ent = xgetpwnam (e->name);
+		break;
+	case RESOLVE_PWUID:
+		ent = xgetpwuid ((uid_t) e->id);
+		break;
+	case RESOLVE_GRNAM:
+		ent = xgetgrnam (e->name);
+		break;
+	case RESOLVE_GRGID:
+		ent = xgetgrgid ((gid_t) e->id);
+		break;
+	}
+
+	(void) pthread_mutex_lock (&e->res->lock);
+	e->ent = ent;
+	e->done = true;
+	e->res->done++;
+	(void) pthread_cond_broadcast (&e->res->done_cond);
+	(void) pthread_mutex_unlock (&e->res->lock);
+}
+#endif				/* RESOLVER_THREADS */
+
+/*
+ * resolver_start - start the threads of a resolver
+ *
+ *	It returns NULL if the lookups shall be done by the caller, when
+ *	RESOLVE_THREADS is 1 or the threads cannot be used.
+ */
+/*@null@*/ /*@only@*/struct nss_resolver *resolver_start (void)
+{
+#ifdef RESOLVER_THREADS
+	struct nss_resolver *res;
+	int nthreads = getdef_num ("RESOLVE_THREADS", 1);
+
+	if (nthreads <= 1) {
+		return NULL;
+	}
+	res = (struct nss_resolver *) xmalloc (sizeof (*res));
+	memset (res, 0, sizeof (*res));
+	if (pthread_mutex_init (&res->lock, NULL) != 0) {
+		free (res);
+		return NULL;
+	}
+	if (pthread_cond_init (&res->done_cond, NULL) != 0) {
+		(void) pthread_mutex_destroy (&res->lock);
+		free (res);
+		return NULL;
+	}
+	res->pool = work_pool_start ((size_t) nthreads,
+	                             (size_t) nthreads
+	                             * RESOLVE_QUEUED_PER_THREAD);
+	if (NULL == res->pool) {
+		(void) pthread_cond_destroy (&res->done_cond);
+		(void) pthread_mutex_destroy (&res->lock);
+		free (res);
+		return NULL;
+	}
+	return res;
+#else				/* !RESOLVER_THREADS */
+	return NULL;
+#endif				/* !RESOLVER_THREADS */
+}
+
+/*
+ * resolver_request - request the lookup of a key
+ *
+ *	The key is a name for RESOLVE_PWNAM and RESOLVE_GRNAM, and an ID
+ *	(with a NULL name) otherwise.
+ *
+ *	It returns false if the lookup could not be queued because enough
+ *	lookups are pending; the caller shall request it again after it
+ *	waited for a result. It returns true if the key was requested
+ *	before.
+ */
+bool resolver_request (struct nss_resolver *res, enum resolve_key key,
+                       /*@null@*/const char *name, id_t id)
+{
+#ifdef RESOLVER_THREADS
+	struct resolve_entry *e;
+
+	if (NULL != resolve_find (res, key, name, id)) {
+		return true;
+	}
+	e = resolve_add (res, key, name, id);
+	if (!work_pool_queue (res->pool, resolve_lookup, e, false)) {
+		resolve_drop (res, e);
+		return false;
+	}
+	res->queued++;
+	return true;
+#else				/* !RESOLVER_THREADS */
+	(void) res;
+	(void) key;
+	(void) name;
+	(void) id;
+	return false;
+#endif				/* !RESOLVER_THREADS */
+}
+
+/*
+ * resolver_wait - wait for the entry of a key
+ *
+ *	The key is requested first if it was not. The entry (a struct
+ *	passwd or a struct group) belongs to the resolver; it is NULL if
+ *	it does not exist.
+ */
+/*@observer@*/ /*@null@*/const void *resolver_wait (struct nss_resolver *res,
+                                                    enum resolve_key key,
+                                                    /*@null@*/const char *name,
+                                                    id_t id)
+{
+#ifdef RESOLVER_THREADS
+	struct resolve_entry *e;
+	unsigned long done;
+
+	while (true) {
+		(void) pthread_mutex_lock (&res->lock);
+		done = res->done;
+		(void) pthread_mutex_unlock (&res->lock);
+		if (resolver_request (res, key, name, id)) {
+			break;
+		}
+		if (res->queued == done) {
+			/* Nothing is pending, the pool could not queue it */
+			e = resolve_add (res, key, name, id);
+			res->queued++;
+			resolve_lookup (res->pool, e);
+			break;
+		}
+		/* Wait until a pending lookup is done */
+		(void) pthread_mutex_lock (&res->lock);
+		while (res->done == done) {
+			(void) pthread_cond_wait (&res->done_cond, &res->lock);
+		}
+		(void) pthread_mutex_unlock (&res->lock);
+	}
+	e = resolve_find (res, key, name, id);
+	(void) pthread_mutex_lock (&res->lock);
+	while (!e->done) {
+		(void) pthread_cond_wait (&res->done_cond, &res->lock);
+	}
+	(void) pthread_mutex_unlock (&res->lock);
+	return e->ent;
+#else				/* !RESOLVER_THREADS */
+	(void) res;
+	(void) key;
+	(void) name;
+	(void) id;
+	return NULL;
+#endif				/* !RESOLVER_THREADS */
+}
+
+/*
+ * resolver_free - stop the threads of a resolver, and free its entries
+ */
+void resolver_free (/*@null@*/ /*@only@*/struct nss_resolver *res)
+{
+#ifdef RESOLVER_THREADS
+	size_t i;
+
+	if (NULL == res) {
+		return;
+	}
+	(void) work_pool_stop (res->pool);
+	for (i = 0; i < res->size; i++) {
+		while (NULL != res->buckets[i]) {
+			struct resolve_entry *e = res->buckets[i];
+
+			res->buckets[i] = e->next;
+			if (NULL != e->ent) {
+				if (   (RESOLVE_PWNAM == e->key)
+				    || (RESOLVE_PWUID == e->key)) {
+					pw_free_packed (e->ent);
+				} else {
+					gr_free_packed (e->ent);
+				}
+			}
+			free (e->name);
+			free (e);
+		}
+	}
+	free (res->buckets);
+	(void) pthread_cond_destroy (&res->done_cond);
+	(void) pthread_mutex_destroy (&res->lock);
+	free (res);
+#else				/* !RESOLVER_THREADS */
+	(void) res;
+#endif				/* !RESOLVER_THREADS */
+}
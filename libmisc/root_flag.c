@@ -34,33 +34,62 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "defines.h"
 #include "prototypes.h"
 /*@-exitarg@*/
 #include "exitcodes.h"
+#include "commonio.h"
 
 static void change_root (const char* newroot);
+static void drop_privileges (void);
+static void fan_out (const char *list, bool read_stdin, char **argv, int idx);
 
 /*
  * process_root_flag - chroot if given the --root option
  *
+ * With --roots FILE, the command is run in each root of FILE (see
+ * fan_out below): this only returns in the child process of each root.
+ * read_stdin tells whether the command reads its standard input, which
+ * must then be copied for each root.
+ *
  * This shall be called before accessing the passwd, group, shadow,
  * gshadow, useradd's default, login.defs files (non exhaustive list)
  * or authenticating the caller.
  *
  * The audit, syslog, or locale files shall be open before
  */
-extern void process_root_flag (const char* short_opt, int argc, char **argv)
+extern void process_root_flag (const char* short_opt, bool read_stdin,
+                                int argc, char **argv)
 {
 	/*
 	 * Parse the command line options.
 	 */
 	int i;
 	const char *newroot = NULL;
+	const char *roots = NULL;
+	int roots_idx = 0;
 
 	for (i = 0; i < argc; i++) {
-		if (   (strcmp (argv[i], "--root") == 0)
-		    || (strcmp (argv[i], short_opt) == 0)) {
+		if (strcmp (argv[i], "--roots") == 0) {
+			if (NULL != roots) {
+				fprintf (stderr,
+				         _("%s: multiple --roots options\n"),
+				         Prog);
+				exit (E_BAD_ARG);
+			}
+			if (i + 1 == argc) {
+				fprintf (stderr,
+				         _("%s: option '%s' requires an argument\n"),
+				         Prog, argv[i]);
+				exit (E_BAD_ARG);
+			}
+			roots = argv[i + 1];
+			roots_idx = i;
+		} else if (   (strcmp (argv[i], "--root") == 0)
+		           || (strcmp (argv[i], short_opt) == 0)) {
 			if (NULL != newroot) {
 				fprintf (stderr,
 				         _("%s: multiple --root options\n"),
@@ -78,20 +107,41 @@ extern void process_root_flag (const char* short_opt, int argc, char **argv)
 		}
 	}
 
+	if ((NULL != roots) && (NULL != newroot)) {
+		fprintf (stderr,
+		         _("%s: --root and --roots are incompatible\n"),
+		         Prog);
+		exit (E_BAD_ARG);
+	}
+	if (NULL != roots) {
+		/* Only returns in the child of each root, as --root DIR */
+		fan_out (roots, read_stdin, argv, roots_idx);
+		newroot = argv[roots_idx + 1];
+	}
+
 	if (NULL != newroot) {
 		change_root (newroot);
+
+		/* An image does not need the durability of a live system */
+		if (NULL != shadow_getenv ("SHADOW_OFFLINE")) {
+			commonio_set_offline (true);
+		}
 	}
 }
 
-static void change_root (const char* newroot)
+static void drop_privileges (void)
 {
-	/* Drop privileges */
 	if (   (setregid (getgid (), getgid ()) != 0)
 	    || (setreuid (getuid (), getuid ()) != 0)) {
 		fprintf (stderr, _("%s: failed to drop privileges (%s)\n"),
 		         Prog, strerror (errno));
 		exit (EXIT_FAILURE);
 	}
+}
+
+static void change_root (const char* newroot)
+{
+	drop_privileges ();
 
 	if ('/' != newroot[0]) {
 		fprintf (stderr,
@@ -122,3 +172,322 @@ static void change_root (const char* newroot)
 	}
 }
 
+/*
+ * Fan-out to many roots (--roots FILE)
+ *
+ * FILE lists the root directories, one per line ("-" for the standard
+ * input). Empty lines and lines starting with '#' are ignored.
+ *
+ * A child process is forked for each root, at most SHADOW_ROOT_JOBS (by
+ * default, the number of online CPUs) at a time: it runs the command as
+ * if given --root DIR instead of --roots FILE, so that each root is
+ * changed with its own configuration, locks and commits. A chroot is
+ * per process, hence processes instead of threads.
+ *
+ * The output of each child is kept in a temporary file, and the parent
+ * reports it, each line prefixed by the root, in the order of FILE,
+ * followed by a line for each root which failed. The parent then exits
+ * with the status of the first root which failed, or 0.
+ *
+ * For the commands which read their standard input (e.g. chpasswd), when
+ * it is a file or a pipe (and FILE is not "-"), it is read once and each
+ * root gets a copy of it. The other commands leave it alone.
+ */
+struct root_job {
+	/*@only@*/char *dir;
+	pid_t pid;
+	int out;		/* the output of the child, -1 when reported */
+	int status;
+	bool done;
+};
+
+static void tmp_name (char *name, size_t size, const char *what)
+{
+	const char *tmpdir = getenv ("TMPDIR");
+
+	if ((NULL == tmpdir) || ('\0' == tmpdir[0])) {
+		tmpdir = "/tmp";
+	}
+	(void) snprintf (name, size, "%s/shadow-%s.XXXXXX", tmpdir, what);
+}
+
+static size_t read_roots (const char *list, /*@out@*/struct root_job **jobs)
+{
+	FILE *fp;
+	char buf[BUFSIZ];
+	size_t n = 0;
+	size_t alloc = 0;
+
+	*jobs = NULL;
+	if (strcmp (list, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen (list, "r");
+		if (NULL == fp) {
+			fprintf (stderr, _("%s: cannot open %s: %s\n"),
+			         Prog, list, strerror (errno));
+			exit (E_BAD_ARG);
+		}
+	}
+
+	while (fgets (buf, (int) sizeof buf, fp) == buf) {
+		char *cp = strchr (buf, '\n');
+
+		if (NULL != cp) {
+			*cp = '\0';
+		}
+		if (('\0' == buf[0]) || ('#' == buf[0])) {
+			continue;
+		}
+		if ('/' != buf[0]) {
+			fprintf (stderr,
+			         _("%s: invalid chroot path '%s'\n"),
+			         Prog, buf);
+			exit (E_BAD_ARG);
+		}
+		if (n == alloc) {
+			alloc = (0 == alloc) ? 16 : 2 * alloc;
+			*jobs = (struct root_job *)
+			        realloc (*jobs, alloc * sizeof (**jobs));
+			if (NULL == *jobs) {
+				fprintf (stderr, _("%s: out of memory\n"), Prog);
+				exit (EXIT_FAILURE);
+			}
+		}
+		memset (&(*jobs)[n], 0, sizeof (**jobs));
+		(*jobs)[n].dir = xstrdup (buf);
+		(*jobs)[n].out = -1;
+		n++;
+	}
+	if (ferror (fp) || ((stdin != fp) && (fclose (fp) != 0))) {
+		fprintf (stderr, _("%s: cannot read %s: %s\n"),
+		         Prog, list, strerror (errno));
+		exit (E_BAD_ARG);
+	}
+	return n;
+}
+
+/*
+ * spool_stdin - copy the standard input to a temporary file
+ *
+ *	The file holds the input of the command (e.g. cleartext passwords):
+ *	it is removed at once, and only its descriptor is kept. Each child
+ *	opens it again through /proc/self/fd (see open_spool), to read it
+ *	from its own offset.
+ *
+ *	It returns -1 if the standard input is not spooled.
+ */
+static int spool_stdin (void)
+{
+	struct stat st;
+	char name[1024];
+	char buf[BUFSIZ];
+	ssize_t n;
+	int fd;
+
+	if (   (fstat (STDIN_FILENO, &st) != 0)
+	    || !(S_ISREG (st.st_mode) || S_ISFIFO (st.st_mode))) {
+		return -1;
+	}
+
+	tmp_name (name, sizeof name, "roots");
+	fd = mkstemp (name);
+	if (fd < 0) {
+		fprintf (stderr, _("%s: cannot create %s: %s\n"),
+		         Prog, name, strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+	(void) unlink (name);
+	while ((n = read (STDIN_FILENO, buf, sizeof buf)) != 0) {
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			break;
+		}
+		if (write (fd, buf, (size_t) n) != n) {
+			n = -1;
+			break;
+		}
+	}
+	if (n < 0) {
+		fprintf (stderr, _("%s: cannot write %s: %s\n"),
+		         Prog, name, strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/*
+ * open_spool - make the spooled input the standard input of a child
+ *
+ *	The child gets its own open file description of the spool, so that
+ *	the children do not share the offset of the descriptor.
+ */
+static void open_spool (int spool)
+{
+	char path[64];
+	int in;
+
+	(void) snprintf (path, sizeof path, "/proc/self/fd/%d", spool);
+	in = open (path, O_RDONLY);
+	if (in < 0) {
+		fprintf (stderr, _("%s: cannot open %s: %s\n"),
+		         Prog, path, strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+	if (dup2 (in, STDIN_FILENO) < 0) {
+		exit (EXIT_FAILURE);
+	}
+	(void) close (in);
+	(void) close (spool);
+}
+
+static long root_jobs (void)
+{
+	const char *env = shadow_getenv ("SHADOW_ROOT_JOBS");
+	long jobs = 0;
+
+	if ((NULL == env) || (getlong (env, &jobs) == 0) || (jobs < 1)) {
+		jobs = sysconf (_SC_NPROCESSORS_ONLN);
+	}
+	return (jobs < 1) ? 1 : jobs;
+}
+
+static void report_root (struct root_job *job)
+{
+	char buf[BUFSIZ];
+	bool bol = true;
+	FILE *fp;
+
+	if (   (lseek (job->out, 0, SEEK_SET) == 0)
+	    && (NULL != (fp = fdopen (job->out, "r")))) {
+		while (fgets (buf, (int) sizeof buf, fp) == buf) {
+			if (bol) {
+				printf ("%s: ", job->dir);
+			}
+			(void) fputs (buf, stdout);
+			bol = (NULL != strchr (buf, '\n'));
+		}
+		if (!bol) {
+			(void) putchar ('\n');
+		}
+		(void) fclose (fp);
+	} else {
+		(void) close (job->out);
+	}
+	job->out = -1;
+
+	if (0 != job->status) {
+		(void) fflush (stdout);
+		fprintf (stderr, _("%s: %s: failed with status %d\n"),
+		         Prog, job->dir, job->status);
+	}
+}
+
+static void fan_out (const char *list, bool read_stdin, char **argv, int idx)
+{
+	struct root_job *jobs;
+	int spool = -1;
+	size_t n, i;
+	size_t started = 0, reported = 0, failed = 0;
+	long running = 0;
+	long max_jobs = root_jobs ();
+	int status = 0;
+
+	/* The roots are only accessed by the children, as the caller */
+	drop_privileges ();
+
+	n = read_roots (list, &jobs);
+	if (read_stdin && (strcmp (list, "-") != 0)) {
+		spool = spool_stdin ();
+	}
+
+	while (reported < n) {
+		if ((started < n) && (running < max_jobs)) {
+			struct root_job *job = &jobs[started];
+			char out[1024];
+
+			tmp_name (out, sizeof out, "root");
+			job->out = mkstemp (out);
+			if (job->out < 0) {
+				fprintf (stderr, _("%s: cannot create %s: %s\n"),
+				         Prog, out, strerror (errno));
+				exit (EXIT_FAILURE);
+			}
+			(void) unlink (out);
+
+			(void) fflush (stdout);
+			(void) fflush (stderr);
+			job->pid = fork ();
+			if (0 == job->pid) {
+				if (-1 != spool) {
+					open_spool (spool);
+				}
+				if (   (dup2 (job->out, STDOUT_FILENO) < 0)
+				    || (dup2 (job->out, STDERR_FILENO) < 0)) {
+					exit (EXIT_FAILURE);
+				}
+				(void) close (job->out);
+				argv[idx] = (char *) "--root";
+				argv[idx + 1] = job->dir;
+				return;
+			}
+			if ((pid_t)-1 == job->pid) {
+				fprintf (stderr, _("%s: cannot fork: %s\n"),
+				         Prog, strerror (errno));
+				job->status = EXIT_FAILURE;
+				job->done = true;
+			} else {
+				running++;
+			}
+			started++;
+		} else {
+			int wstatus;
+			pid_t pid = wait (&wstatus);
+
+			if ((pid_t)-1 == pid) {
+				if (EINTR == errno) {
+					continue;
+				}
+				break;
+			}
+			for (i = 0; i < started; i++) {
+				if (!jobs[i].done && (jobs[i].pid == pid)) {
+					break;
+				}
+			}
+			if (i == started) {
+				continue;
+			}
+			jobs[i].done = true;
+			jobs[i].status = WIFEXITED (wstatus)
+			                 ? WEXITSTATUS (wstatus)
+			                 : 128 + WTERMSIG (wstatus);
+			running--;
+		}
+
+		while ((reported < started) && jobs[reported].done) {
+			report_root (&jobs[reported]);
+			if (0 != jobs[reported].status) {
+				if (0 == failed) {
+					status = jobs[reported].status;
+				}
+				failed++;
+			}
+			reported++;
+		}
+	}
+
+	if (-1 != spool) {
+		(void) close (spool);
+	}
+	if ((reported < n) && (0 == status)) {
+		status = EXIT_FAILURE;
+	}
+	if (0 != failed) {
+		fprintf (stderr, _("%s: %lu of %lu roots failed\n"),
+		         Prog, (unsigned long) failed, (unsigned long) n);
+	}
+	exit (status);
+}
@@ -3,76 +3,136 @@
  *
  * Written by Marek Michalkiewicz <marekm@i17linuxb.ists.pwr.wroc.pl>,
  * it is in the public domain.
- *
- * l64a was Written by J.T. Conklin <jtc@netbsd.org>. Public domain.
  */
 
 #include <config.h>
 
 #ident "$Id$"
 
-#include <sys/time.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <assert.h>
+#include <time.h>
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif				/* HAVE_SYS_RANDOM_H */
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* HAVE_PTHREAD */
 #include "prototypes.h"
 #include "defines.h"
 #include "getdef.h"
 
 /* local function prototypes */
-static void seedRNG (void);
+static bool fill_random (unsigned char *buf, size_t len);
+static void random_bytes (/*@out@*/unsigned char *buf, size_t len);
 static /*@observer@*/const char *gensalt (size_t salt_size);
 #ifdef USE_SHA_CRYPT
 static long shadow_random (long min, long max);
-static /*@observer@*/const char *SHA_salt_rounds (/*@null@*/int *prefered_rounds);
+static long SHA_calibrated_rounds (char magic, long target_ms);
+static /*@observer@*/const char *SHA_salt_rounds (char magic,
+                                                  /*@null@*/int *prefered_rounds);
 #endif /* USE_SHA_CRYPT */
 
-#ifndef HAVE_L64A
-static /*@observer@*/char *l64a(long value)
+/*
+ * Pool of random bytes
+ *
+ * The pool is filled by a single getrandom() (or a read of /dev/urandom)
+ * for many salts, and the salts take their bytes from it. It is shared by
+ * the threads.
+ */
+#define RANDOM_POOL_SIZE	512
+static unsigned char random_pool[RANDOM_POOL_SIZE];
+static size_t random_pool_pos = RANDOM_POOL_SIZE;	/* empty */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t random_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif				/* HAVE_PTHREAD */
+
+/*
+ * fill_random - fill buf with random bytes from the kernel
+ */
+static bool fill_random (unsigned char *buf, size_t len)
 {
-	static char buf[8];
-	char *s = buf;
-	int digit;
-	int i;
-
-	if (value < 0) {
-		errno = EINVAL;
-		return(NULL);
+	size_t done = 0;
+	ssize_t n;
+	int fd;
+
+#ifdef HAVE_GETRANDOM
+	while (done < len) {
+		n = getrandom (buf + done, len - done, 0);
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			break;
+		}
+		done += (size_t) n;
 	}
+	if (done == len) {
+		return true;
+	}
+	/* Not supported by the kernel, try /dev/urandom */
+	done = 0;
+#endif				/* HAVE_GETRANDOM */
 
-	for (i = 0; value != 0 && i < 6; i++) {
-		digit = value & 0x3f;
-
-		if (digit < 2) {
-			*s = digit + '.';
-		} else if (digit < 12) {
-			*s = digit + '0' - 2;
-		} else if (digit < 38) {
-			*s = digit + 'A' - 12;
-		} else {
-			*s = digit + 'a' - 38;
+	fd = open ("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	while (done < len) {
+		n = read (fd, buf + done, len - done);
+		if (n <= 0) {
+			if ((n < 0) && (EINTR == errno)) {
+				continue;
+			}
+			break;
 		}
-
-		value >>= 6;
-		s++;
+		done += (size_t) n;
 	}
+	(void) close (fd);
 
-	*s = '\0';
-
-	return(buf);
+	return (done == len);
 }
-#endif /* !HAVE_L64A */
 
-static void seedRNG (void)
+/*
+ * random_bytes - get len random bytes from the pool
+ *
+ *	It exits if the kernel provides no random bytes.
+ */
+static void random_bytes (/*@out@*/unsigned char *buf, size_t len)
 {
-	struct timeval tv;
-	static int seeded = 0;
-
-	if (0 == seeded) {
-		(void) gettimeofday (&tv, NULL);
-		srandom (tv.tv_sec ^ tv.tv_usec ^ getpid ());
-		seeded = 1;
+	size_t n;
+
+#ifdef HAVE_PTHREAD
+	(void) pthread_mutex_lock (&random_pool_lock);
+#endif				/* HAVE_PTHREAD */
+	while (len > 0) {
+		if (RANDOM_POOL_SIZE == random_pool_pos) {
+			if (!fill_random (random_pool, RANDOM_POOL_SIZE)) {
+				fprintf (stderr,
+				         _("Unable to obtain random bytes.\n"));
+				exit (EXIT_FAILURE);
+			}
+			random_pool_pos = 0;
+		}
+		n = RANDOM_POOL_SIZE - random_pool_pos;
+		if (n > len) {
+			n = len;
+		}
+		memcpy (buf, random_pool + random_pool_pos, n);
+		/* The bytes are only given once */
+		memzero (random_pool + random_pool_pos, n);
+		random_pool_pos += n;
+		buf += n;
+		len -= n;
 	}
+#ifdef HAVE_PTHREAD
+	(void) pthread_mutex_unlock (&random_pool_lock);
+#endif				/* HAVE_PTHREAD */
 }
 
 /*
@@ -81,29 +141,24 @@ static void seedRNG (void)
 #define MAGNUM(array,ch)	(array)[0]=(array)[2]='$',(array)[1]=(ch),(array)[3]='\0'
 
 #ifdef USE_SHA_CRYPT
-/* It is not clear what is the maximum value of random().
- * We assume 2^31-1.*/
-#define RANDOM_MAX 0x7FFFFFFF
-
 /*
  * Return a random number between min and max (both included).
- *
- * It favors slightly the higher numbers.
  */
 static long shadow_random (long min, long max)
 {
-	double drand;
-	long ret;
-	seedRNG ();
-	drand = (double) (max - min + 1) * random () / RANDOM_MAX;
-	/* On systems were this is not random() range is lower, we favor
-	 * higher numbers of salt. */
-	ret = (long) (max + 1 - drand);
-	/* And we catch limits, and use the highest number */
-	if ((ret < min) || (ret > max)) {
-		ret = max;
+	unsigned long range, limit, r;
+
+	if (max <= min) {
+		return max;
 	}
-	return ret;
+	range = (unsigned long) (max - min) + 1;
+	/* Reject the values which would favor the lower numbers */
+	limit = ULONG_MAX - (ULONG_MAX % range);
+	do {
+		random_bytes ((unsigned char *) &r, sizeof r);
+	} while (r >= limit);
+
+	return min + (long) (r % range);
 }
 
 /* Default number of rounds if not explicitly specified.  */
@@ -113,10 +168,66 @@ static long shadow_random (long min, long max)
 /* Maximum number of rounds.  */
 #define ROUNDS_MAX 999999999
 
+/* Number of rounds first timed to calibrate SHA_CRYPT_TARGET_MS */
+#define ROUNDS_CALIBRATION 10000
+/* Shortest measure (in ms) trusted to calibrate SHA_CRYPT_TARGET_MS */
+#define CALIBRATION_MIN_MS 20.0
+
+/*
+ * SHA_calibrated_rounds - number of rounds for which crypt() takes
+ *	target_ms milliseconds on this CPU with the SHA method of magic
+ *	('5' or '6').
+ *
+ *	The calibration is done once per method and process.
+ *	It returns -1 if crypt() could not be timed.
+ */
+static long SHA_calibrated_rounds (char magic, long target_ms)
+{
+	static double rounds_per_ms[2];	/* SHA256, SHA512 */
+	double *rate = ('5' == magic) ? &rounds_per_ms[0] : &rounds_per_ms[1];
+	char setting[64];	/* room for any long in the rounds */
+	struct timespec start, end;
+	double elapsed, rounds;
+	long tried = ROUNDS_CALIBRATION;
+
+	while (0.0 == *rate) {
+		(void) snprintf (setting, sizeof setting,
+		                 "$%c$rounds=%ld$calibration", magic, tried);
+		if (   (clock_gettime (CLOCK_MONOTONIC, &start) != 0)
+		    || (NULL == pw_encrypt ("calibration", setting))
+		    || (clock_gettime (CLOCK_MONOTONIC, &end) != 0)) {
+			*rate = -1.0;
+			break;
+		}
+		elapsed = (double) (end.tv_sec - start.tv_sec) * 1000.0
+		        + (double) (end.tv_nsec - start.tv_nsec) / 1000000.0;
+		/* Time more rounds if the clock is too coarse for this CPU */
+		if ((elapsed < CALIBRATION_MIN_MS) && (tried < ROUNDS_MAX / 16)) {
+			tried *= 8;
+			continue;
+		}
+		if (elapsed <= 0.0) {
+			*rate = -1.0;
+			break;
+		}
+		*rate = (double) tried / elapsed;
+	}
+	if (*rate < 0.0) {
+		return -1;
+	}
+
+	rounds = *rate * (double) target_ms;
+	if (rounds > (double) ROUNDS_MAX) {
+		return ROUNDS_MAX;
+	}
+	return (long) rounds;
+}
+
 /*
  * Return a salt prefix specifying the rounds number for the SHA crypt methods.
  */
-static /*@observer@*/const char *SHA_salt_rounds (/*@null@*/int *prefered_rounds)
+static /*@observer@*/const char *SHA_salt_rounds (char magic,
+                                                  /*@null@*/int *prefered_rounds)
 {
 	static char rounds_prefix[18]; /* Max size: rounds=999999999$ */
 	long rounds;
@@ -124,24 +235,39 @@ static /*@observer@*/const char *SHA_salt_rounds (/*@null@*/int *prefered_rounds
 	if (NULL == prefered_rounds) {
 		long min_rounds = getdef_long ("SHA_CRYPT_MIN_ROUNDS", -1);
 		long max_rounds = getdef_long ("SHA_CRYPT_MAX_ROUNDS", -1);
+		long target_ms = getdef_long ("SHA_CRYPT_TARGET_MS", -1);
 
-		if ((-1 == min_rounds) && (-1 == max_rounds)) {
-			return "";
-		}
-
-		if (-1 == min_rounds) {
-			min_rounds = max_rounds;
+		rounds = -1;
+		if (target_ms > 0) {
+			rounds = SHA_calibrated_rounds (magic, target_ms);
 		}
 
-		if (-1 == max_rounds) {
-			max_rounds = min_rounds;
-		}
-
-		if (min_rounds > max_rounds) {
-			max_rounds = min_rounds;
+		if ((-1 == min_rounds) && (-1 == max_rounds)) {
+			if (-1 == rounds) {
+				return "";
+			}
+		} else {
+			if (-1 == min_rounds) {
+				min_rounds = max_rounds;
+			}
+
+			if (-1 == max_rounds) {
+				max_rounds = min_rounds;
+			}
+
+			if (min_rounds > max_rounds) {
+				max_rounds = min_rounds;
+			}
+
+			/* The calibrated rounds are kept within the range */
+			if (-1 == rounds) {
+				rounds = shadow_random (min_rounds, max_rounds);
+			} else if (rounds < min_rounds) {
+				rounds = min_rounds;
+			} else if (rounds > max_rounds) {
+				rounds = max_rounds;
+			}
 		}
-
-		rounds = shadow_random (min_rounds, max_rounds);
 	} else if (0 == *prefered_rounds) {
 		return "";
 	} else {
@@ -173,18 +299,19 @@ static /*@observer@*/const char *SHA_salt_rounds (/*@null@*/int *prefered_rounds
 
 static /*@observer@*/const char *gensalt (size_t salt_size)
 {
+	static const char b64[64] =
+		"./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"abcdefghijklmnopqrstuvwxyz";
 	static char salt[32];
-
-	salt[0] = '\0';
+	unsigned char bytes[MAX_SALT_SIZE];
+	size_t i;
 
 	assert (salt_size >= MIN_SALT_SIZE &&
 	        salt_size <= MAX_SALT_SIZE);
-	seedRNG ();
-	strcat (salt, l64a (random()));
-	do {
-		strcat (salt, l64a (random()));
-	} while (strlen (salt) < salt_size);
-
+	random_bytes (bytes, salt_size);
+	for (i = 0; i < salt_size; i++) {
+		salt[i] = b64[bytes[i] & 0x3f];
+	}
 	salt[salt_size] = '\0';
 
 	return salt;
@@ -233,11 +360,11 @@ static /*@observer@*/const char *gensalt (size_t salt_size)
 #ifdef USE_SHA_CRYPT
 	} else if (0 == strcmp (method, "SHA256")) {
 		MAGNUM(result, '5');
-		strcat(result, SHA_salt_rounds((int *)arg));
+		strcat(result, SHA_salt_rounds('5', (int *)arg));
 		salt_len = (size_t) shadow_random (8, 16);
 	} else if (0 == strcmp (method, "SHA512")) {
 		MAGNUM(result, '6');
-		strcat(result, SHA_salt_rounds((int *)arg));
+		strcat(result, SHA_salt_rounds('6', (int *)arg));
 		salt_len = (size_t) shadow_random (8, 16);
 #endif /* USE_SHA_CRYPT */
 	} else if (0 != strcmp (method, "DES")) {
@@ -249,7 +376,7 @@ static /*@observer@*/const char *gensalt (size_t salt_size)
 	}
 
 	/*
-	 * Concatenate a pseudo random salt.
+	 * Concatenate a random salt.
 	 */
 	assert (sizeof (result) > strlen (result) + salt_len);
 	strncat (result, gensalt (salt_len),
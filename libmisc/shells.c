@@ -0,0 +1,178 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "prototypes.h"
+#include "defines.h"
+
+/*
+ * The login shells of /etc/shells
+ *
+ * The file is read once, in a hash set of its shells, and read again
+ * only when it changed (its modification time, size or inode), instead
+ * of being scanned with getusershell() for each check.
+ *
+ * The file is parsed like getusershell() does: the shell of a line is
+ * its first word starting with '/', and the comments start with '#'.
+ * Like getusershell(), /bin/sh and /bin/csh are the shells when the file
+ * does not exist, if the system has getusershell().
+ */
+
+#ifndef SHELLS_FILE
+#define SHELLS_FILE "/etc/shells"
+#endif
+
+static struct {
+	/*@null@*/ /*@only@*/char **slots;	/* NULL or a shell */
+	size_t size;		/* power of 2, at least twice the shells */
+	size_t count;
+	bool loaded;
+	bool missing;		/* the file did not exist */
+	struct stat sb;		/* of the file, when it was read */
+} shells;
+
+static size_t shell_hash (const char *sh)
+{
+	size_t h = 2166136261U;
+
+	for (; '\0' != *sh; sh++) {
+		h = (h ^ (unsigned char) *sh) * 16777619U;
+	}
+	return h;
+}
+
+/*
+ * shell_slot - the slot of sh, or the free slot where it would be added
+ */
+static char **shell_slot (const char *sh)
+{
+	size_t i = shell_hash (sh) & (shells.size - 1);
+
+	while (   (NULL != shells.slots[i])
+	       && (strcmp (shells.slots[i], sh) != 0)) {
+		i = (i + 1) & (shells.size - 1);
+	}
+	return &shells.slots[i];
+}
+
+static void shell_add (const char *sh)
+{
+	char **slot;
+
+	if (2 * (shells.count + 1) > shells.size) {
+		char **old = shells.slots;
+		size_t old_size = shells.size;
+		size_t i;
+
+		shells.size = (0 == old_size) ? 16 : 2 * old_size;
+		shells.slots = (char **) xmalloc (shells.size * sizeof (char *));
+		memset (shells.slots, 0, shells.size * sizeof (char *));
+		for (i = 0; i < old_size; i++) {
+			if (NULL != old[i]) {
+				*shell_slot (old[i]) = old[i];
+			}
+		}
+		free (old);
+	}
+	slot = shell_slot (sh);
+	if (NULL == *slot) {
+		*slot = xstrdup (sh);
+		shells.count++;
+	}
+}
+
+static void shells_clear (void)
+{
+	size_t i;
+
+	for (i = 0; i < shells.size; i++) {
+		free (shells.slots[i]);
+	}
+	free (shells.slots);
+	shells.slots = NULL;
+	shells.size = 0;
+	shells.count = 0;
+}
+
+/*
+ * shells_load - read SHELLS_FILE, if it changed since it was read
+ */
+static void shells_load (void)
+{
+	char buf[BUFSIZ];
+	struct stat sb;
+	FILE *fp;
+
+	if (stat (SHELLS_FILE, &sb) != 0) {
+		if (shells.loaded && shells.missing) {
+			return;
+		}
+		shells_clear ();
+		shells.loaded = true;
+		shells.missing = true;
+#ifdef HAVE_GETUSERSHELL
+		shell_add ("/bin/sh");
+		shell_add ("/bin/csh");
+#endif
+		return;
+	}
+	if (   shells.loaded
+	    && !shells.missing
+	    && (sb.st_mtime == shells.sb.st_mtime)
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	    && (sb.st_mtim.tv_nsec == shells.sb.st_mtim.tv_nsec)
+#endif
+	    && (sb.st_size == shells.sb.st_size)
+	    && (sb.st_ino == shells.sb.st_ino)
+	    && (sb.st_dev == shells.sb.st_dev)) {
+		return;
+	}
+
+	shells_clear ();
+	shells.loaded = true;
+	shells.missing = false;
+	shells.sb = sb;
+	fp = fopen (SHELLS_FILE, "r");
+	if (NULL == fp) {
+		/* Nothing is listed; read it again at the next check */
+		shells.loaded = false;
+		return;
+	}
+	while (fgets (buf, sizeof buf, fp) == buf) {
+		char *cp = buf;
+		char *end;
+
+		while (('#' != *cp) && ('/' != *cp) && ('\0' != *cp)) {
+			cp++;
+		}
+		if ('/' != *cp) {
+			continue;
+		}
+		for (end = cp;
+		     ('\0' != *end) && ('#' != *end)
+		     && (isspace ((unsigned char) *end) == 0);
+		     end++) {
+		}
+		*end = '\0';
+		shell_add (cp);
+	}
+	(void) fclose (fp);
+}
+
+/*
+ * shell_is_listed - whether sh is one of the shells of /etc/shells
+ */
+bool shell_is_listed (const char *sh)
+{
+	shells_load ();
+	if (0 == shells.count) {
+		return false;
+	}
+	return (NULL != *shell_slot (sh));
+}
@@ -0,0 +1,328 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "prototypes.h"
+
+/*
+ * Set of the IDs which cannot be selected by find_new_uid() and
+ * find_new_gid().
+ *
+ * The set is a list of intervals of IDs. They are collected in an
+ * array which is sorted and merged once all of them were added. The
+ * memory used thus depends on the number of accounts and configured
+ * ranges, and not on the size of the [min:max] range of IDs.
+ */
+
+static int range_cmp (const void *p1, const void *p2)
+{
+	const struct id_range *r1 = p1;
+	const struct id_range *r2 = p2;
+
+	if (r1->first < r2->first) {
+		return -1;
+	} else if (r1->first > r2->first) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * used_ids_add_range - Add the [first:last] interval to the set.
+ *
+ *	used_ids_sort() must be called once all the IDs were added.
+ *
+ *	It returns false (with errno set) on allocation failure.
+ */
+bool used_ids_add_range (struct used_ids *set, id_t first, id_t last)
+{
+	if (set->count == set->size) {
+		size_t size = (0 == set->size) ? 64 : set->size * 2;
+		struct id_range *ranges;
+
+		ranges = realloc (set->ranges, size * sizeof (*ranges));
+		if (NULL == ranges) {
+			return false;
+		}
+		set->ranges = ranges;
+		set->size = size;
+	}
+	set->ranges[set->count].first = first;
+	set->ranges[set->count].last = last;
+	set->count++;
+	return true;
+}
+
+/*
+ * used_ids_add - Add an ID to the set.
+ */
+bool used_ids_add (struct used_ids *set, id_t id)
+{
+	return used_ids_add_range (set, id, id);
+}
+
+/*
+ * used_ids_add_ranges - Add a comma separated list of ranges to the set.
+ *
+ *	Each range has one of the forms accepted by getrange(). Open ranges
+ *	extend to the min or max ID. Only the IDs in [min:max] are added.
+ *
+ *	It returns false on failure, with errno set to EINVAL if the list
+ *	is invalid.
+ */
+bool used_ids_add_ranges (struct used_ids *set, const char *list,
+                          id_t min, id_t max)
+{
+	char *buf, *range;
+	bool ret = true;
+
+	buf = strdup (list);
+	if (NULL == buf) {
+		return false;
+	}
+
+	for (range = strtok (buf, ", "); NULL != range;
+	     range = strtok (NULL, ", ")) {
+		unsigned long first, last;
+		bool has_first, has_last;
+
+		if (   (getrange (range, &first, &has_first,
+		                  &last, &has_last) == 0)
+		    || (has_first && has_last && (first > last))) {
+			errno = EINVAL;
+			ret = false;
+			break;
+		}
+		if (!has_first) {
+			first = min;
+		}
+		if (!has_last) {
+			last = max;
+		}
+		if ((first > max) || (last < min)) {
+			continue;
+		}
+		if (first < min) {
+			first = min;
+		}
+		if (last > max) {
+			last = max;
+		}
+		if (!used_ids_add_range (set, (id_t) first, (id_t) last)) {
+			ret = false;
+			break;
+		}
+	}
+
+	free (buf);
+	return ret;
+}
+
+/*
+ * used_ids_sort - Sort the set and merge the overlapping or adjacent
+ * intervals.
+ */
+void used_ids_sort (struct used_ids *set)
+{
+	size_t i, n;
+
+	if (0 == set->count) {
+		return;
+	}
+
+	qsort (set->ranges, set->count, sizeof (*set->ranges), range_cmp);
+	for (i = 1, n = 0; i < set->count; i++) {
+		struct id_range *cur = &set->ranges[n];
+
+		if (   (cur->last == (id_t) -1)
+		    || (set->ranges[i].first <= cur->last + 1)) {
+			if (set->ranges[i].last > cur->last) {
+				cur->last = set->ranges[i].last;
+			}
+		} else {
+			n++;
+			set->ranges[n] = set->ranges[i];
+		}
+	}
+	set->count = n + 1;
+}
+
+/*
+ * find_range - Return the interval of a sorted set containing id.
+ */
+static /*@null@*/const struct id_range *find_range (
+	const struct used_ids *set, id_t id)
+{
+	size_t lo = 0, hi = set->count;
+
+	/* Find the first interval starting after id */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (set->ranges[mid].first <= id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((0 == lo) || (set->ranges[lo - 1].last < id)) {
+		return NULL;
+	}
+	return &set->ranges[lo - 1];
+}
+
+/*
+ * used_ids_contains - Check if an ID is in a sorted set.
+ */
+bool used_ids_contains (const struct used_ids *set, id_t id)
+{
+	return find_range (set, id) != NULL;
+}
+
+/*
+ * used_ids_next_free - Find the lowest ID not in a sorted set which is
+ * higher or equal to *id and lower or equal to max.
+ *
+ *	It returns false if there are no such ID. Otherwise, *id is set to
+ *	this ID.
+ */
+bool used_ids_next_free (const struct used_ids *set, id_t *id, id_t max)
+{
+	const struct id_range *r;
+
+	if (*id > max) {
+		return false;
+	}
+	r = find_range (set, *id);
+	if (NULL != r) {
+		if (r->last >= max) {
+			return false;
+		}
+		*id = r->last + 1;
+	}
+	return true;
+}
+
+/*
+ * used_ids_prev_free - Find the highest ID not in a sorted set which is
+ * lower or equal to *id and higher or equal to min.
+ *
+ *	It returns false if there are no such ID. Otherwise, *id is set to
+ *	this ID.
+ */
+bool used_ids_prev_free (const struct used_ids *set, id_t *id, id_t min)
+{
+	const struct id_range *r;
+
+	if (*id < min) {
+		return false;
+	}
+	r = find_range (set, *id);
+	if (NULL != r) {
+		if (r->first <= min) {
+			return false;
+		}
+		*id = r->first - 1;
+	}
+	return true;
+}
+
+/*
+ * id_pool_setup - Prepare a pool to hand out the IDs of [min:max] which
+ * are not in its (sorted) set of used IDs.
+ *
+ *	The search starts at start. It goes toward max, and then restarts
+ *	from min, or toward min if down is true, and then restarts from max.
+ */
+void id_pool_setup (struct id_pool *pool, id_t min, id_t max, id_t start,
+                    bool down)
+{
+	pool->ready = true;
+	pool->down = down;
+	pool->wrapped = false;
+	pool->done = (max < min);
+	pool->min = min;
+	pool->max = max;
+	pool->start = start;
+	pool->next = start;
+}
+
+static void id_pool_wrap (struct id_pool *pool)
+{
+	if (   pool->wrapped
+	    || (pool->start == (pool->down ? pool->max : pool->min))) {
+		pool->done = true;
+		return;
+	}
+	pool->wrapped = true;
+	pool->next = pool->down ? pool->max : pool->min;
+}
+
+/*
+ * id_pool_next - Return the next ID of a pool.
+ *
+ *	Each ID is returned only once, without searching again the IDs
+ *	already returned. The caller still has to check that the ID was not
+ *	used since the pool was set up.
+ *
+ *	It returns false when all the IDs were returned.
+ */
+bool id_pool_next (struct id_pool *pool, id_t *id)
+{
+	while (!pool->done) {
+		id_t cur = pool->next;
+
+		if (!pool->down) {
+			id_t last = pool->wrapped ? pool->start - 1 : pool->max;
+
+			if (used_ids_next_free (&pool->used, &cur, last)) {
+				*id = cur;
+				if (cur == last) {
+					id_pool_wrap (pool);
+				} else {
+					pool->next = cur + 1;
+				}
+				return true;
+			}
+		} else {
+			id_t last = pool->wrapped ? pool->start + 1 : pool->min;
+
+			if (used_ids_prev_free (&pool->used, &cur, last)) {
+				*id = cur;
+				if (cur == last) {
+					id_pool_wrap (pool);
+				} else {
+					pool->next = cur - 1;
+				}
+				return true;
+			}
+		}
+		id_pool_wrap (pool);
+	}
+	return false;
+}
+
+/*
+ * id_pool_free - Release the memory used by a pool.
+ *
+ *	The pool can then be set up again.
+ */
+void id_pool_free (struct id_pool *pool)
+{
+	used_ids_free (&pool->used);
+	pool->ready = false;
+}
+
+/*
+ * used_ids_free - Release the memory used by the set.
+ */
+void used_ids_free (struct used_ids *set)
+{
+	free (set->ranges);
+	set->ranges = NULL;
+	set->count = 0;
+	set->size = 0;
+}
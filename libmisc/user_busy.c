@@ -37,8 +37,11 @@
 #include <assert.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include "defines.h"
 #include "prototypes.h"
 #ifdef ENABLE_SUBIDS
@@ -46,7 +49,19 @@
 #endif				/* ENABLE_SUBIDS */
 
 #ifdef __linux__
-static int check_status (const char *name, const char *sname, uid_t uid);
+#ifdef ENABLE_SUBIDS
+/*
+ * Subordinate UIDs of the user, resolved once for the whole scan of
+ * /proc. The ranges are sorted, so that each UID is found with a binary
+ * search.
+ */
+static /*@null@*/struct subid_ranges *busy_subuids;
+#endif				/* ENABLE_SUBIDS */
+
+static int check_status (int procfd, const char *path, uid_t uid,
+                         /*@null@*/unsigned long *threads);
+static int check_tasks (int procfd, pid_t pid, const struct stat *sbprocess,
+                        uid_t uid);
 static int user_busy_processes (const char *name, uid_t uid);
 #else				/* !__linux__ */
 static int user_busy_utmp (const char *name);
@@ -106,48 +121,149 @@ static int user_busy_utmp (const char *name)
 #endif				/* !__linux__ */
 
 #ifdef __linux__
-static int check_status (const char *name, const char *sname, uid_t uid)
+/*
+ * check_status - check if a process or a thread uses the user's UIDs
+ *
+ *	path is the directory of the process (PID) or of the thread
+ *	(PID/task/TID), relative to the procfd descriptor of /proc.
+ *
+ *	If threads is not NULL, it is set to the number of threads of the
+ *	process, or to 0 if it is unknown.
+ */
+static int check_status (int procfd, const char *path, uid_t uid,
+                         /*@null@*/unsigned long *threads)
 {
-	/* 40: /proc/xxxxxxxxxx/task/xxxxxxxxxx/status + \0 */
-	char status[40];
-	char line[1024];
-	FILE *sfile;
+	/* 35: xxxxxxxxxx/task/xxxxxxxxxx/status + \0 */
+	char status[35];
+	char buf[8192];
+	size_t len = 0;
+	const char *line;
+	unsigned long ruid, euid, suid;
+	int busy = 0;
+	int fd;
+
+	if (NULL != threads) {
+		*threads = 0;
+	}
 
-	snprintf (status, 40, "/proc/%s/status", sname);
-	status[39] = '\0';
+	(void) snprintf (status, sizeof status, "%s/status", path);
+	status[sizeof status - 1] = '\0';
 
-	sfile = fopen (status, "r");
-	if (NULL == sfile) {
+	/*
+	 * The status is read at once, it is a few lines long.
+	 */
+	fd = openat (procfd, status, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		return 0;
 	}
-	while (fgets (line, sizeof (line), sfile) == line) {
-		if (strncmp (line, "Uid:\t", 5) == 0) {
-			unsigned long ruid, euid, suid;
-			assert (uid == (unsigned long) uid);
-			if (sscanf (line,
-			            "Uid:\t%lu\t%lu\t%lu\n",
-			            &ruid, &euid, &suid) == 3) {
-				if (   (ruid == (unsigned long) uid)
-				    || (euid == (unsigned long) uid)
-				    || (suid == (unsigned long) uid)
+	while (len < sizeof buf - 1) {
+		ssize_t cnt = read (fd, buf + len, sizeof buf - 1 - len);
+		if (cnt < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			break;
+		}
+		if (0 == cnt) {
+			break;
+		}
+		len += (size_t) cnt;
+	}
+	(void) close (fd);
+	buf[len] = '\0';
+
+	line = strstr (buf, "\nUid:\t");
+	assert (uid == (unsigned long) uid);
+	if (   (NULL != line)
+	    && (sscanf (line + 1, "Uid:\t%lu\t%lu\t%lu\n",
+	                &ruid, &euid, &suid) == 3)) {
+		if (   (ruid == (unsigned long) uid)
+		    || (euid == (unsigned long) uid)
+		    || (suid == (unsigned long) uid)
 #ifdef ENABLE_SUBIDS
-				    || have_sub_uids(name, ruid, 1)
-				    || have_sub_uids(name, euid, 1)
-				    || have_sub_uids(name, suid, 1)
+		    || (   (NULL != busy_subuids)
+		        && (   subid_ranges_have (busy_subuids, ruid, 1)
+		            || subid_ranges_have (busy_subuids, euid, 1)
+		            || subid_ranges_have (busy_subuids, suid, 1)))
 #endif				/* ENABLE_SUBIDS */
-				   ) {
-					(void) fclose (sfile);
-					return 1;
-				}
-			} else {
-				/* Ignore errors. This is just a best effort. */
-			}
-			(void) fclose (sfile);
-			return 0;
+		   ) {
+			busy = 1;
 		}
+	} else {
+		/* Ignore errors. This is just a best effort. */
 	}
-	(void) fclose (sfile);
-	return 0;
+
+	if (NULL != threads) {
+		line = strstr (buf, "\nThreads:\t");
+		if (   (NULL == line)
+		    || (sscanf (line + 1, "Threads:\t%lu", threads) != 1)) {
+			*threads = 0;
+		}
+	}
+
+	return busy;
+}
+
+/*
+ * check_tasks - check if a thread of a multi-threaded process uses the
+ *               user's UIDs
+ *
+ *	sbprocess is the status of the /proc/PID directory.
+ *
+ *	The threads of a process share their credentials, unless they
+ *	were changed with the raw system calls. The status of a thread is
+ *	thus only read if its effective UID, that is the owner of
+ *	its /proc/PID/task/TID directory, is not the one of the process.
+ */
+static int check_tasks (int procfd, pid_t pid, const struct stat *sbprocess,
+                        uid_t uid)
+{
+	/* 22: xxxxxxxxxx/task + \0 */
+	char task_path[22];
+	/* 28: xxxxxxxxxx/task/xxxxxxxxxx + \0 */
+	char thread_path[28];
+	struct DIRECT *ent;
+	struct stat sbthread;
+	DIR *task_dir;
+	int fd;
+	int busy = 0;
+
+	(void) snprintf (task_path, sizeof task_path, "%lu/task",
+	                 (unsigned long) pid);
+	task_path[sizeof task_path - 1] = '\0';
+	fd = openat (procfd, task_path,
+	             O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		/* Ignore errors. This is just a best effort */
+		return 0;
+	}
+	task_dir = fdopendir (fd);
+	if (NULL == task_dir) {
+		(void) close (fd);
+		return 0;
+	}
+
+	while ((0 == busy) && ((ent = readdir (task_dir)) != NULL)) {
+		pid_t tid;
+
+		if (get_pid (ent->d_name, &tid) == 0) {
+			continue;
+		}
+		if (tid == pid) {
+			continue;
+		}
+		if (   (fstatat (fd, ent->d_name, &sbthread, 0) != 0)
+		    || (sbthread.st_uid == sbprocess->st_uid)) {
+			continue;
+		}
+		(void) snprintf (thread_path, sizeof thread_path, "%s/%lu",
+		                 task_path, (unsigned long) tid);
+		thread_path[sizeof thread_path - 1] = '\0';
+		busy = check_status (procfd, thread_path, uid, NULL);
+	}
+	(void) closedir (task_dir);
+
+	return busy;
 }
 
 static int user_busy_processes (const char *name, uid_t uid)
@@ -156,35 +272,49 @@ static int user_busy_processes (const char *name, uid_t uid)
 	struct dirent *ent;
 	char *tmp_d_name;
 	pid_t pid;
-	DIR *task_dir;
-	/* 22: /proc/xxxxxxxxxx/task + \0 */
-	char task_path[22];
-	char root_path[22];
+	int procfd;
+	/* 16: xxxxxxxxxx/root + \0 */
+	char root_path[16];
 	struct stat sbroot;
 	struct stat sbroot_process;
+	struct stat sbprocess;
+	unsigned long threads;
+	int busy = 0;
 
 #ifdef ENABLE_SUBIDS
-	sub_uid_open (O_RDONLY);
+	/* Ignore errors, e.g. if there are no subordinate UIDs */
+	busy_subuids = sub_uid_load_ranges (name);
 #endif				/* ENABLE_SUBIDS */
 
-	proc = opendir ("/proc");
+	/*
+	 * The entries of /proc are accessed relative to its descriptor,
+	 * so that the path of /proc is not resolved again for each of
+	 * them.
+	 */
+	procfd = open ("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	proc = (procfd >= 0) ? fdopendir (procfd) : NULL;
 	if (proc == NULL) {
 		perror ("opendir /proc");
+		if (procfd >= 0) {
+			(void) close (procfd);
+		}
 #ifdef ENABLE_SUBIDS
-		sub_uid_close();
-#endif
+		subid_ranges_free (busy_subuids);
+		busy_subuids = NULL;
+#endif				/* ENABLE_SUBIDS */
 		return 0;
 	}
 	if (stat ("/", &sbroot) != 0) {
 		perror ("stat (\"/\")");
 		(void) closedir (proc);
 #ifdef ENABLE_SUBIDS
-		sub_uid_close();
-#endif
+		subid_ranges_free (busy_subuids);
+		busy_subuids = NULL;
+#endif				/* ENABLE_SUBIDS */
 		return 0;
 	}
 
-	while ((ent = readdir (proc)) != NULL) {
+	while ((0 == busy) && ((ent = readdir (proc)) != NULL)) {
 		tmp_d_name = ent->d_name;
 		/*
 		 * Ingo Molnar's patch introducing NPTL for 2.4 hides
@@ -206,9 +336,10 @@ static int user_busy_processes (const char *name, uid_t uid)
 		}
 
 		/* Check if the process is in our chroot */
-		snprintf (root_path, 22, "/proc/%lu/root", (unsigned long) pid);
-		root_path[21] = '\0';
-		if (stat (root_path, &sbroot_process) != 0) {
+		snprintf (root_path, sizeof root_path, "%lu/root",
+		          (unsigned long) pid);
+		root_path[sizeof root_path - 1] = '\0';
+		if (fstatat (procfd, root_path, &sbroot_process, 0) != 0) {
 			continue;
 		}
 		if (   (sbroot.st_dev != sbroot_process.st_dev)
@@ -216,51 +347,27 @@ static int user_busy_processes (const char *name, uid_t uid)
 			continue;
 		}
 
-		if (check_status (name, tmp_d_name, uid) != 0) {
-			(void) closedir (proc);
-#ifdef ENABLE_SUBIDS
-			sub_uid_close();
-#endif
+		if (check_status (procfd, tmp_d_name, uid, &threads) != 0) {
+			busy = 1;
+		} else if (   (1 != threads)
+		           && (fstatat (procfd, tmp_d_name, &sbprocess, 0) == 0)
+		           && (check_tasks (procfd, pid, &sbprocess, uid) != 0)) {
+			busy = 1;
+		}
+
+		if (0 != busy) {
 			fprintf (stderr,
 			         _("%s: user %s is currently used by process %d\n"),
 			         Prog, name, pid);
-			return 1;
-		}
-
-		snprintf (task_path, 22, "/proc/%lu/task", (unsigned long) pid);
-		task_path[21] = '\0';
-		task_dir = opendir (task_path);
-		if (task_dir != NULL) {
-			while ((ent = readdir (task_dir)) != NULL) {
-				pid_t tid;
-				if (get_pid (ent->d_name, &tid) == 0) {
-					continue;
-				}
-				if (tid == pid) {
-					continue;
-				}
-				if (check_status (name, task_path+6, uid) != 0) {
-					(void) closedir (proc);
-#ifdef ENABLE_SUBIDS
-					sub_uid_close();
-#endif
-					fprintf (stderr,
-					         _("%s: user %s is currently used by process %d\n"),
-					         Prog, name, pid);
-					return 1;
-				}
-			}
-			(void) closedir (task_dir);
-		} else {
-			/* Ignore errors. This is just a best effort */
 		}
 	}
 
 	(void) closedir (proc);
 #ifdef ENABLE_SUBIDS
-	sub_uid_close();
+	subid_ranges_free (busy_subuids);
+	busy_subuids = NULL;
 #endif				/* ENABLE_SUBIDS */
-	return 0;
+	return busy;
 }
 #endif				/* __linux__ */
 
@@ -42,6 +42,9 @@
 #endif
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -49,6 +52,17 @@
 
 #ident "$Id$"
 
+#ifndef USE_PAM
+/*
+ * When get_current_utmp() found the entry of the session, the utmp
+ * database is kept open on this entry, and setutmp() overwrites it
+ * without scanning the database again.
+ *
+ * This is not done with PAM, as the modules may use the utmp database
+ * in the meantime.
+ */
+static bool utmp_session = false;
+#endif				/* !USE_PAM */
 
 /*
  * is_my_tty -- determine if "tty" is the same TTY stdin is using
@@ -102,9 +116,36 @@ static bool is_my_tty (const char *tty)
 {
 	struct utmp *ut;
 	struct utmp *ret = NULL;
+#if defined(HAVE_GETUTENT) && defined(HAVE_STRUCT_UTMP_UT_TYPE)
+	const char *tname = ttyname (STDIN_FILENO);
+#endif
 
 	setutent ();
 
+#if defined(HAVE_GETUTENT) && defined(HAVE_STRUCT_UTMP_UT_TYPE)
+	/*
+	 * The entries of the current terminal are found by getutline(),
+	 * which scans utmp with a single lock instead of locking it for
+	 * each entry.
+	 */
+	if ((NULL != tname) && (strncmp (tname, "/dev/", 5) == 0)) {
+		struct utmp key;
+
+		memzero (&key, sizeof (key));
+		strncpy (key.ut_line, tname + 5, sizeof (key.ut_line));
+		while ((ut = getutline (&key)) != NULL) {
+			if (   (ut->ut_pid == getpid ())
+#ifdef HAVE_STRUCT_UTMP_UT_ID
+			    && ('\0' != ut->ut_id[0])
+#endif
+			    && is_my_tty (ut->ut_line)) {
+				break;
+			}
+			/* Or the same entry would be returned again */
+			memzero (ut, sizeof (*ut));
+		}
+	} else
+#endif
 	/* First, try to find a valid utmp entry for this process.  */
 	while ((ut = getutent ()) != NULL) {
 		if (   (ut->ut_pid == getpid ())
@@ -125,6 +166,10 @@ static bool is_my_tty (const char *tty)
 	if (NULL != ut) {
 		ret = (struct utmp *) xmalloc (sizeof (*ret));
 		memcpy (ret, ut, sizeof (*ret));
+#ifndef USE_PAM
+		utmp_session = true;
+		return ret;
+#endif				/* !USE_PAM */
 	}
 
 	endutent ();
@@ -136,9 +181,30 @@ static bool is_my_tty (const char *tty)
 {
 	struct utmpx *ut;
 	struct utmpx *ret = NULL;
+	const char *tname = ttyname (STDIN_FILENO);
 
 	setutxent ();
 
+	/*
+	 * The entries of the current terminal are found by getutxline(),
+	 * which scans utmpx with a single lock instead of locking it for
+	 * each entry.
+	 */
+	if ((NULL != tname) && (strncmp (tname, "/dev/", 5) == 0)) {
+		struct utmpx key;
+
+		memzero (&key, sizeof (key));
+		strncpy (key.ut_line, tname + 5, sizeof (key.ut_line));
+		while ((ut = getutxline (&key)) != NULL) {
+			if (   (ut->ut_pid == getpid ())
+			    && ('\0' != ut->ut_id[0])
+			    && is_my_tty (ut->ut_line)) {
+				break;
+			}
+			/* Or the same entry would be returned again */
+			memzero (ut, sizeof (*ut));
+		}
+	} else
 	/* Find the utmpx entry for this PID. */
 	while ((ut = getutxent ()) != NULL) {
 		if (   (ut->ut_pid == getpid ())
@@ -153,6 +219,10 @@ static bool is_my_tty (const char *tty)
 	if (NULL != ut) {
 		ret = (struct utmpx *) xmalloc (sizeof (*ret));
 		memcpy (ret, ut, sizeof (*ret));
+#ifndef USE_PAM
+		utmp_session = true;
+		return ret;
+#endif				/* !USE_PAM */
 	}
 
 	endutxent ();
@@ -162,38 +232,80 @@ static bool is_my_tty (const char *tty)
 #endif
 
 
-#ifndef USE_PAM
 /*
- * Some systems already have updwtmp() and possibly updwtmpx().  Others
- * don't, so we re-implement these functions if necessary.
+ * Log files opened by append_record(), which stay open until the end of
+ * the program (or its exec), so that the repeated failures of login do
+ * not open and close btmp for each attempt.
  */
-#ifndef HAVE_UPDWTMP
-static void updwtmp (const char *filename, const struct utmp *ut)
+#define APPEND_FILES	4
+static struct {
+	/*@null@*/const char *name;
+	int fd;			/* -1 if the file does not exist */
+} append_files[APPEND_FILES];
+static size_t append_count = 0;
+
+/*
+ * append_record - append the record rec to the log file filename
+ *
+ *	The record is appended with a single O_APPEND write, which does
+ *	not need the lock taken by updwtmp() to be atomic. The file is not
+ *	created if it does not exist.
+ *
+ *	filename must stay valid until the end of the program.
+ *
+ *	It returns 1 if the record was appended, 0 if the file does not
+ *	exist, and -1 on error.
+ */
+int append_record (const char *filename, const void *rec, size_t size)
 {
-	int fd;
+	size_t i;
+	int fd = -1;
+	ssize_t n;
+
+	for (i = 0; i < append_count; i++) {
+		if (strcmp (append_files[i].name, filename) == 0) {
+			break;
+		}
+	}
+	if (i < append_count) {
+		fd = append_files[i].fd;
+		if (fd < 0) {
+			return 0;
+		}
+	} else {
+		fd = open (filename, O_APPEND | O_WRONLY | O_NOCTTY | O_CLOEXEC);
+		if ((fd < 0) && (ENOENT != errno)) {
+			return -1;
+		}
+		if (append_count < APPEND_FILES) {
+			append_files[append_count].name = filename;
+			append_files[append_count].fd = fd;
+			append_count++;
+			i = append_count - 1;
+		}
+		if (fd < 0) {
+			return 0;
+		}
+	}
 
-	fd = open (filename, O_APPEND | O_WRONLY, 0);
-	if (fd >= 0) {
-		write (fd, (const char *) ut, sizeof (*ut));
-		close (fd);
+	do {
+		n = write (fd, rec, size);
+	} while ((n < 0) && (EINTR == errno));
+	if (i == append_count) {
+		/* Not kept */
+		(void) close (fd);
 	}
+	return (n == (ssize_t) size) ? 1 : -1;
 }
-#endif				/* ! HAVE_UPDWTMP */
 
-#ifdef USE_UTMPX
-#ifndef HAVE_UPDWTMPX
-static void updwtmpx (const char *filename, const struct utmpx *utx)
+#ifndef USE_PAM
+/*
+ * append_wtmp - log an entry in wtmp
+ */
+static void append_wtmp (const char *filename, const void *ent, size_t size)
 {
-	int fd;
-
-	fd = open (filename, O_APPEND | O_WRONLY, 0);
-	if (fd >= 0) {
-		write (fd, (const char *) utx, sizeof (*utx));
-		close (fd);
-	}
+	(void) append_record (filename, ent, size);
 }
-#endif				/* ! HAVE_UPDWTMPX */
-#endif				/* ! USE_UTMPX */
 #endif				/* ! USE_PAM */
 
 
@@ -335,6 +447,9 @@ static void updwtmpx (const char *filename, const struct utmpx *utx)
 /*
  * setutmp - Update an entry in utmp and log an entry in wtmp
  *
+ *	If ut was prepared from the entry returned by get_current_utmp(),
+ *	this entry is overwritten without scanning utmp again.
+ *
  *	Return 1 on failure and 0 on success.
  */
 int setutmp (struct utmp *ut)
@@ -343,15 +458,23 @@ int setutmp (struct utmp *ut)
 
 	assert (NULL != ut);
 
-	setutent ();
+#ifndef USE_PAM
+	/* Overwrite the entry found by get_current_utmp() */
+	if (!utmp_session)
+#endif				/* !USE_PAM */
+	{
+		setutent ();
+	}
 	if (pututline (ut) == NULL) {
 		err = 1;
 	}
 	endutent ();
 
 #ifndef USE_PAM
+	utmp_session = false;
+
 	/* This is done by pam_lastlog */
-	updwtmp (_WTMP_FILE, ut);
+	append_wtmp (_WTMP_FILE, ut, sizeof (*ut));
 #endif				/* ! USE_PAM */
 
 	return err;
@@ -479,15 +602,23 @@ int setutmpx (struct utmpx *utx)
 
 	assert (NULL != utx);
 
-	setutxent ();
+#ifndef USE_PAM
+	/* Overwrite the entry found by get_current_utmp() */
+	if (!utmp_session)
+#endif				/* !USE_PAM */
+	{
+		setutxent ();
+	}
 	if (pututxline (utx) == NULL) {
 		err = 1;
 	}
 	endutxent ();
 
 #ifndef USE_PAM
+	utmp_session = false;
+
 	/* This is done by pam_lastlog */
-	updwtmpx (_WTMP_FILE "x", utx);
+	append_wtmp (_WTMP_FILE "x", utx, sizeof (*utx));
 #endif				/* ! USE_PAM */
 
 	return err;
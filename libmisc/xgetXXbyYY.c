@@ -53,7 +53,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif				/* HAVE_PTHREAD */
 #include "prototypes.h"
+#include "timing.h"
 
 #define XFUNCTION_NAME XPREFIX (FUNCTION_NAME)
 #define XPREFIX(name) XPREFIX1 (name)
@@ -64,44 +68,72 @@
 #define STRINGIZE(name) STRINGIZE1 (name)
 #define STRINGIZE1(name) #name
 
-/*@null@*/ /*@only@*/LOOKUP_TYPE *XFUNCTION_NAME (ARG_TYPE ARG_NAME)
+#if HAVE_FUNCTION_R
+/*
+ * Largest buffer needed by a lookup so far. The next lookups start with
+ * it, instead of growing the buffer again with several NSS requests.
+ */
+static size_t length_hint = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t length_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif				/* HAVE_PTHREAD */
+#endif				/* HAVE_FUNCTION_R */
+
+static /*@null@*/ /*@only@*/LOOKUP_TYPE *lookup (ARG_TYPE ARG_NAME)
 {
 #if HAVE_FUNCTION_R
-	LOOKUP_TYPE *result=NULL;
-	char *buffer=NULL;
-	/* we have to start with something */
-	size_t length = 0x100;
-
-	result = malloc(sizeof(LOOKUP_TYPE));
-	if (NULL == result) {
-		fprintf (stderr, _("%s: out of memory\n"),
-		         "x" STRINGIZE(FUNCTION_NAME));
-		exit (13);
+	LOOKUP_TYPE *result = NULL;
+	size_t length;
+
+#ifdef HAVE_PTHREAD
+	(void) pthread_mutex_lock (&length_lock);
+#endif				/* HAVE_PTHREAD */
+	length = length_hint;
+#ifdef HAVE_PTHREAD
+	(void) pthread_mutex_unlock (&length_lock);
+#endif				/* HAVE_PTHREAD */
+	if (0 == length) {
+		long max = sysconf (LENGTH_NAME);
+
+		/* we have to start with something */
+		length = (max > 0) ? (size_t) max : 0x400;
 	}
 
 	while (true) {
 		int status;
 		LOOKUP_TYPE *resbuf = NULL;
-		buffer = (char *)realloc (buffer, length);
-		if (NULL == buffer) {
+
+		/*
+		 * The strings are stored by the reentrant function right
+		 * after the structure, so that the result needs no copy.
+		 */
+		if (length > (size_t) -1 - sizeof (LOOKUP_TYPE)) {
+			break;
+		}
+		free (result);
+		result = (LOOKUP_TYPE *) malloc (sizeof (LOOKUP_TYPE) + length);
+		if (NULL == result) {
 			fprintf (stderr, _("%s: out of memory\n"),
 			         "x" STRINGIZE(FUNCTION_NAME));
 			exit (13);
 		}
 		errno = 0;
-		status = REENTRANT_NAME(ARG_NAME, result, buffer,
+		status = REENTRANT_NAME(ARG_NAME, result, (char *) (result + 1),
 		                        length, &resbuf);
 		if ((0 == status) && (resbuf == result)) {
-			/* Build a result structure that can be freed by
-			 * the shadow *_free functions. */
-			LOOKUP_TYPE *ret_result = DUP_FUNCTION(result);
-			free(buffer);
-			free(result);
-			return ret_result;
+#ifdef HAVE_PTHREAD
+			(void) pthread_mutex_lock (&length_lock);
+#endif				/* HAVE_PTHREAD */
+			if (length > length_hint) {
+				length_hint = length;
+			}
+#ifdef HAVE_PTHREAD
+			(void) pthread_mutex_unlock (&length_lock);
+#endif				/* HAVE_PTHREAD */
+			return result;
 		}
 
-		if (ERANGE != errno) {
-			free (buffer);
+		if ((ERANGE != status) && (ERANGE != errno)) {
 			free (result);
 			return NULL;
 		}
@@ -115,8 +147,7 @@
 		}
 	}
 
-	free(buffer);
-	free(result);
+	free (result);
 	return NULL;
 
 #else /* !HAVE_FUNCTION_R */
@@ -142,3 +173,21 @@
 #endif
 }
 
+/*
+ * The result uses the packed layout of DUP_FUNCTION: it is a single
+ * allocation, released with the matching *_free_packed function.
+ *
+ * The lookups, and whether they found an entry, are counted in the
+ * TIMING_PHASE phase (see nsslookup.c).
+ */
+/*@null@*/ /*@only@*/LOOKUP_TYPE *XFUNCTION_NAME (ARG_TYPE ARG_NAME)
+{
+	struct timespec start;
+	LOOKUP_TYPE *result;
+
+	timing_start (&start);
+	result = lookup (ARG_NAME);
+	timing_stop_lookup (TIMING_PHASE, &start, NULL != result);
+	return result;
+}
+
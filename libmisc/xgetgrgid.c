@@ -57,8 +57,10 @@
 #define FUNCTION_NAME	getgrgid
 #define ARG_TYPE	gid_t
 #define ARG_NAME	gid
-#define DUP_FUNCTION	__gr_dup
+#define DUP_FUNCTION	__gr_dup_packed
+#define LENGTH_NAME	_SC_GETGR_R_SIZE_MAX
 #define HAVE_FUNCTION_R (defined HAVE_GETGRGID_R)
+#define TIMING_PHASE	TIMING_GETGRGID
 
 #include "xgetXXbyYY.c"
 
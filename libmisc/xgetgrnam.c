@@ -57,8 +57,10 @@
 #define FUNCTION_NAME	getgrnam
 #define ARG_TYPE	const char *
 #define ARG_NAME	name
-#define DUP_FUNCTION	__gr_dup
+#define DUP_FUNCTION	__gr_dup_packed
+#define LENGTH_NAME	_SC_GETGR_R_SIZE_MAX
 #define HAVE_FUNCTION_R (defined HAVE_GETGRNAM_R)
+#define TIMING_PHASE	TIMING_GETGRNAM
 
 #include "xgetXXbyYY.c"
 
@@ -57,8 +57,10 @@
 #define FUNCTION_NAME	getpwnam
 #define ARG_TYPE	const char *
 #define ARG_NAME	name
-#define DUP_FUNCTION	__pw_dup
+#define DUP_FUNCTION	__pw_dup_packed
+#define LENGTH_NAME	_SC_GETPW_R_SIZE_MAX
 #define HAVE_FUNCTION_R (defined HAVE_GETPWNAM_R)
+#define TIMING_PHASE	TIMING_GETPWNAM
 
 #include "xgetXXbyYY.c"
 
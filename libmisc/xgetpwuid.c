@@ -57,8 +57,10 @@
 #define FUNCTION_NAME	getpwuid
 #define ARG_TYPE	uid_t
 #define ARG_NAME	uid
-#define DUP_FUNCTION	__pw_dup
+#define DUP_FUNCTION	__pw_dup_packed
+#define LENGTH_NAME	_SC_GETPW_R_SIZE_MAX
 #define HAVE_FUNCTION_R (defined HAVE_GETPWUID_R)
+#define TIMING_PHASE	TIMING_GETPWUID
 
 #include "xgetXXbyYY.c"
 
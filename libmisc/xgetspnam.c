@@ -57,8 +57,11 @@
 #define FUNCTION_NAME	getspnam
 #define ARG_TYPE	const char *
 #define ARG_NAME	name
-#define DUP_FUNCTION	__spw_dup
+#define DUP_FUNCTION	__spw_dup_packed
+/* There is no limit for the shadow entries, they are like the passwd ones */
+#define LENGTH_NAME	_SC_GETPW_R_SIZE_MAX
 #define HAVE_FUNCTION_R (defined HAVE_GETSPNAM_R)
+#define TIMING_PHASE	TIMING_GETSPNAM
 
 #include "xgetXXbyYY.c"
 
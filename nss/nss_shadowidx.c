@@ -0,0 +1,572 @@
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <nss.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "memberfile.h"
+#include "snapshot.h"
+
+/*
+ * libnss_shadowidx - NSS module serving the passwd and group lookups from
+ * the snapshots written by the tools (see INDEX_SNAPSHOT in login.defs)
+ *
+ * Only the lookups by name and by ID are provided. When a snapshot is
+ * missing or does not match its text file any more (e.g. after an edit
+ * with vi), the module is unavailable and the next service (usually
+ * files) answers. It should be listed before files in nsswitch.conf:
+ *
+ *	passwd:	shadowidx files
+ *	group:	shadowidx files
+ *
+ * With [NOTFOUND=return] after shadowidx, the unknown names and IDs are
+ * not searched in the text files either.
+ *
+ * The snapshot and the text file are mapped for each lookup, so that the
+ * module does not keep any state and never serves a replaced file.
+ */
+
+struct idx {
+	const struct snapshot_header *header;
+	const struct snapshot_record *records;
+	size_t size;
+	const char *text;
+	size_t text_size;
+};
+
+/*
+ * idx_open - Map the snapshot of file and file.
+ *
+ *	It returns false if there is no snapshot or if it is not up to date.
+ */
+static bool idx_open (const char *file, struct idx *ix)
+{
+	char buf[1024];
+	struct stat sb, isb;
+	void *map;
+	int fd, ifd;
+	bool ret = false;
+
+	memset (ix, 0, sizeof *ix);
+	if (snprintf (buf, sizeof buf, "%s.idx", file) >= (int) sizeof buf) {
+		return false;
+	}
+
+	ifd = open (buf, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+	if (ifd < 0) {
+		return false;
+	}
+	fd = open (file, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0) {
+		(void) close (ifd);
+		return false;
+	}
+
+	if (   (fstat (fd, &sb) != 0)
+	    || (fstat (ifd, &isb) != 0)
+	    || !S_ISREG (isb.st_mode)
+	    || ((unsigned long long) isb.st_size > SIZE_MAX)
+	    || ((size_t) isb.st_size < sizeof *ix->header)) {
+		goto out;
+	}
+
+	map = mmap (NULL, (size_t) isb.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+	if (MAP_FAILED == map) {
+		goto out;
+	}
+	ix->header = map;
+	ix->size = (size_t) isb.st_size;
+	ix->records = (const struct snapshot_record *) (ix->header + 1);
+	if (   (memcmp (ix->header->magic, SNAPSHOT_MAGIC,
+	                sizeof ix->header->magic) != 0)
+	    || (ix->header->dev != (uint64_t) sb.st_dev)
+	    || (ix->header->ino != (uint64_t) sb.st_ino)
+	    || (ix->header->size != (uint64_t) sb.st_size)
+	    || (ix->header->mtime_sec != (int64_t) sb.st_mtime)
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	    || (ix->header->mtime_nsec != (int64_t) sb.st_mtim.tv_nsec)
+#endif				/* HAVE_STRUCT_STAT_ST_MTIM */
+	    || (  (  (size_t) ix->header->name_count
+	           + (size_t) ix->header->id_count)
+	        != ((ix->size - sizeof *ix->header) / sizeof *ix->records))) {
+		goto out;
+	}
+
+	ix->text_size = (size_t) sb.st_size;
+	if (ix->text_size > 0) {
+		map = mmap (NULL, ix->text_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED == map) {
+			goto out;
+		}
+		ix->text = map;
+	}
+	ret = true;
+
+      out:
+	if (!ret && (NULL != ix->header)) {
+		(void) munmap ((void *) ix->header, ix->size);
+		ix->header = NULL;
+	}
+	(void) close (fd);
+	(void) close (ifd);
+	return ret;
+}
+
+static void idx_close (struct idx *ix)
+{
+	if (NULL != ix->text) {
+		(void) munmap ((void *) ix->text, ix->text_size);
+	}
+	if (NULL != ix->header) {
+		(void) munmap ((void *) ix->header, ix->size);
+	}
+}
+
+static bool record_valid (const struct idx *ix,
+                          const struct snapshot_record *rec)
+{
+	return    (rec->offset <= ix->text_size)
+	       && (rec->length <= (ix->text_size - rec->offset))
+	       && (rec->name_length <= rec->length);
+}
+
+/*
+ * is_nis - Whether the line of a record is a NIS entry (+name or -name),
+ *          which is not served by this module.
+ */
+static bool is_nis (const struct idx *ix, const struct snapshot_record *rec)
+{
+	return    (rec->length > 0)
+	       && (   ('+' == ix->text[rec->offset])
+	           || ('-' == ix->text[rec->offset]));
+}
+
+/*
+ * idx_find_name - Find the first record with the given name.
+ *
+ *	It returns NULL if there is none.
+ */
+static /*@null@*/const struct snapshot_record *idx_find_name (
+	const struct idx *ix,
+	const char *name)
+{
+	const struct snapshot_record *rec;
+	size_t lo, hi, len;
+
+	len = strlen (name);
+	lo = 0;
+	hi = ix->header->name_count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		size_t n;
+		int cmp;
+
+		rec = &ix->records[mid];
+		if (!record_valid (ix, rec)) {
+			return NULL;
+		}
+		n = (rec->name_length < len) ? rec->name_length : len;
+		cmp = memcmp (ix->text + rec->offset, name, n);
+		if ((0 == cmp) && (rec->name_length < len)) {
+			cmp = -1;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo >= ix->header->name_count) {
+		return NULL;
+	}
+	rec = &ix->records[lo];
+	if (   !record_valid (ix, rec)
+	    || (rec->name_length != len)
+	    || (memcmp (ix->text + rec->offset, name, len) != 0)) {
+		return NULL;
+	}
+	return rec;
+}
+
+/*
+ * idx_find_id - Find the first record with the given ID, which is not a
+ *               NIS entry.
+ *
+ *	It returns NULL if there is none.
+ */
+static /*@null@*/const struct snapshot_record *idx_find_id (
+	const struct idx *ix,
+	uint32_t id)
+{
+	const struct snapshot_record *ids;
+	size_t lo, hi;
+
+	ids = ix->records + ix->header->name_count;
+	lo = 0;
+	hi = ix->header->id_count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ids[mid].id < id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	for (; (lo < ix->header->id_count) && (ids[lo].id == id); lo++) {
+		if (!record_valid (ix, &ids[lo])) {
+			return NULL;
+		}
+		if (!is_nis (ix, &ids[lo])) {
+			return &ids[lo];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * copy_line - Copy the line of a record to buffer, with the continuation
+ *             lines joined if continuation is set.
+ *
+ *	It returns the size used in buffer, or 0 if buffer is too small.
+ */
+static size_t copy_line (const struct idx *ix,
+                         const struct snapshot_record *rec,
+                         bool continuation,
+                         char *buffer, size_t buflen)
+{
+	const char *line = ix->text + rec->offset;
+	size_t i, n = 0;
+
+	for (i = 0; i < rec->length; i++) {
+		if (   continuation
+		    && ('\\' == line[i])
+		    && ((i + 1) < rec->length)
+		    && ('\n' == line[i + 1])) {
+			i++;
+			continue;
+		}
+		if (n >= buflen) {
+			return 0;
+		}
+		buffer[n] = line[i];
+		n++;
+	}
+	if (n >= buflen) {
+		return 0;
+	}
+	buffer[n] = '\0';
+	return n + 1;
+}
+
+/*
+ * split_line - Split line in place in exactly nfields fields separated by
+ *              colons.
+ */
+static bool split_line (char *line, char **fields, size_t nfields)
+{
+	size_t i;
+
+	for (i = 0; i < nfields; i++) {
+		fields[i] = line;
+		line = strchr (line, ':');
+		if (NULL != line) {
+			*line = '\0';
+			line++;
+		} else if ((i + 1) != nfields) {
+			return false;
+		}
+	}
+	return (NULL == line);
+}
+
+static bool parse_id (const char *s, id_t *id)
+{
+	unsigned long long val;
+	char *end;
+
+	if (('\0' == *s) || ('-' == *s)) {
+		return false;
+	}
+	errno = 0;
+	val = strtoull (s, &end, 10);
+	if (   ('\0' != *end)
+	    || (0 != errno)
+	    || (val != (unsigned long long) (id_t) val)) {
+		return false;
+	}
+	*id = (id_t) val;
+	return true;
+}
+
+/*
+ * fill_passwd - Parse the passwd line of rec into pwd and buffer.
+ */
+static enum nss_status fill_passwd (const struct idx *ix,
+                                    const struct snapshot_record *rec,
+                                    struct passwd *pwd,
+                                    char *buffer, size_t buflen,
+                                    int *errnop)
+{
+	char *fields[7];
+	id_t uid, gid;
+
+	if (copy_line (ix, rec, false, buffer, buflen) == 0) {
+		*errnop = ERANGE;
+		return NSS_STATUS_TRYAGAIN;
+	}
+	if (   !split_line (buffer, fields, 7)
+	    || !parse_id (fields[2], &uid)
+	    || !parse_id (fields[3], &gid)) {
+		/* The tools would not use this line either */
+		return NSS_STATUS_NOTFOUND;
+	}
+	pwd->pw_name = fields[0];
+	pwd->pw_passwd = fields[1];
+	pwd->pw_uid = (uid_t) uid;
+	pwd->pw_gid = (gid_t) gid;
+	pwd->pw_gecos = fields[4];
+	pwd->pw_dir = fields[5];
+	pwd->pw_shell = fields[6];
+	return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * read_members - Read the member file of group (see EXTERNAL_MEMBERS_MIN)
+ *                into buffer, as a list of names separated by commas.
+ *
+ *	The size used in buffer is stored in *used.
+ */
+static enum nss_status read_members (const char *group,
+                                     char *buffer, size_t buflen,
+                                     size_t *used, int *errnop)
+{
+	char path[1024];
+	size_t n = 0, i, j;
+	ssize_t r;
+	int fd;
+
+	if (   ('\0' == group[0]) || ('.' == group[0])
+	    || (NULL != strchr (group, '/'))
+	    || (snprintf (path, sizeof path, "%s.members/%s",
+	                  GROUP_FILE, group) >= (int) sizeof path)) {
+		return NSS_STATUS_UNAVAIL;
+	}
+	fd = open (path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+	if (fd < 0) {
+		return NSS_STATUS_UNAVAIL;
+	}
+	for (;;) {
+		if (n >= buflen) {
+			(void) close (fd);
+			*errnop = ERANGE;
+			return NSS_STATUS_TRYAGAIN;
+		}
+		r = read (fd, buffer + n, buflen - n);
+		if (r > 0) {
+			n += (size_t) r;
+		} else if (0 == r) {
+			break;
+		} else if (EINTR != errno) {
+			(void) close (fd);
+			return NSS_STATUS_UNAVAIL;
+		}
+	}
+	(void) close (fd);
+
+	/* One name per line, the empty lines are skipped */
+	j = 0;
+	for (i = 0; i < n; i++) {
+		if ('\n' != buffer[i]) {
+			buffer[j] = buffer[i];
+			j++;
+		} else if ((j > 0) && (',' != buffer[j - 1])) {
+			buffer[j] = ',';
+			j++;
+		}
+	}
+	if ((j > 0) && (',' == buffer[j - 1])) {
+		j--;
+	}
+	buffer[j] = '\0';
+	*used = j + 1;
+	return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * fill_group - Parse the group line of rec into grp and buffer.
+ *
+ *	The line is copied at the start of buffer, and the array of the
+ *	members follows it. The members of a group listed in its member
+ *	file are copied between the line and the array.
+ */
+static enum nss_status fill_group (const struct idx *ix,
+                                   const struct snapshot_record *rec,
+                                   struct group *grp,
+                                   char *buffer, size_t buflen,
+                                   int *errnop)
+{
+	char *fields[4];
+	char **mem;
+	char *cp;
+	size_t used, count, align, i, len;
+	id_t gid;
+	enum nss_status ret;
+
+	used = copy_line (ix, rec, true, buffer, buflen);
+	if (0 == used) {
+		*errnop = ERANGE;
+		return NSS_STATUS_TRYAGAIN;
+	}
+	if (   !split_line (buffer, fields, 4)
+	    || !parse_id (fields[2], &gid)) {
+		return NSS_STATUS_NOTFOUND;
+	}
+	if (strcmp (fields[3], MEMBER_FILE_MARKER) == 0) {
+		ret = read_members (fields[0], buffer + used, buflen - used,
+		                    &len, errnop);
+		if (NSS_STATUS_SUCCESS != ret) {
+			return ret;
+		}
+		fields[3] = buffer + used;
+		used += len;
+	}
+
+	count = ('\0' != fields[3][0]) ? 1 : 0;
+	for (cp = fields[3]; '\0' != *cp; cp++) {
+		if (',' == *cp) {
+			count++;
+		}
+	}
+	align = (sizeof (char *) - (used % sizeof (char *))) % sizeof (char *);
+	if (   ((buflen - used) < align)
+	    || (((buflen - used - align) / sizeof (char *)) < (count + 1))) {
+		*errnop = ERANGE;
+		return NSS_STATUS_TRYAGAIN;
+	}
+	mem = (char **) (buffer + used + align);
+	cp = fields[3];
+	for (i = 0; i < count; i++) {
+		mem[i] = cp;
+		cp = strchr (cp, ',');
+		if (NULL != cp) {
+			*cp = '\0';
+			cp++;
+		}
+	}
+	mem[count] = NULL;
+
+	grp->gr_name = fields[0];
+	grp->gr_passwd = fields[1];
+	grp->gr_gid = (gid_t) gid;
+	grp->gr_mem = mem;
+	return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status _nss_shadowidx_getpwnam_r (const char *name,
+                                           struct passwd *pwd,
+                                           char *buffer, size_t buflen,
+                                           int *errnop)
+{
+	const struct snapshot_record *rec;
+	struct idx ix;
+	enum nss_status ret = NSS_STATUS_NOTFOUND;
+
+	if (('\0' == name[0]) || ('+' == name[0]) || ('-' == name[0])) {
+		return NSS_STATUS_NOTFOUND;
+	}
+	if (!idx_open (PASSWD_FILE, &ix)) {
+		return NSS_STATUS_UNAVAIL;
+	}
+	rec = idx_find_name (&ix, name);
+	if (NULL != rec) {
+		ret = fill_passwd (&ix, rec, pwd, buffer, buflen, errnop);
+	}
+	idx_close (&ix);
+	return ret;
+}
+
+enum nss_status _nss_shadowidx_getpwuid_r (uid_t uid,
+                                           struct passwd *pwd,
+                                           char *buffer, size_t buflen,
+                                           int *errnop)
+{
+	const struct snapshot_record *rec;
+	struct idx ix;
+	enum nss_status ret = NSS_STATUS_NOTFOUND;
+
+	if (!idx_open (PASSWD_FILE, &ix)) {
+		return NSS_STATUS_UNAVAIL;
+	}
+	if (0 == ix.header->id_count) {
+		ret = NSS_STATUS_UNAVAIL;
+	} else {
+		rec = idx_find_id (&ix, (uint32_t) uid);
+		if (NULL != rec) {
+			ret = fill_passwd (&ix, rec, pwd, buffer, buflen,
+			                   errnop);
+		}
+	}
+	idx_close (&ix);
+	return ret;
+}
+
+enum nss_status _nss_shadowidx_getgrnam_r (const char *name,
+                                           struct group *grp,
+                                           char *buffer, size_t buflen,
+                                           int *errnop)
+{
+	const struct snapshot_record *rec;
+	struct idx ix;
+	enum nss_status ret = NSS_STATUS_NOTFOUND;
+
+	if (('\0' == name[0]) || ('+' == name[0]) || ('-' == name[0])) {
+		return NSS_STATUS_NOTFOUND;
+	}
+	if (!idx_open (GROUP_FILE, &ix)) {
+		return NSS_STATUS_UNAVAIL;
+	}
+	rec = idx_find_name (&ix, name);
+	if (NULL != rec) {
+		ret = fill_group (&ix, rec, grp, buffer, buflen, errnop);
+	}
+	idx_close (&ix);
+	return ret;
+}
+
+enum nss_status _nss_shadowidx_getgrgid_r (gid_t gid,
+                                           struct group *grp,
+                                           char *buffer, size_t buflen,
+                                           int *errnop)
+{
+	const struct snapshot_record *rec;
+	struct idx ix;
+	enum nss_status ret = NSS_STATUS_NOTFOUND;
+
+	if (!idx_open (GROUP_FILE, &ix)) {
+		return NSS_STATUS_UNAVAIL;
+	}
+	if (0 == ix.header->id_count) {
+		ret = NSS_STATUS_UNAVAIL;
+	} else {
+		rec = idx_find_id (&ix, (uint32_t) gid);
+		if (NULL != rec) {
+			ret = fill_group (&ix, rec, grp, buffer, buflen,
+			                  errnop);
+		}
+	}
+	idx_close (&ix);
+	return ret;
+}
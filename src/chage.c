@@ -34,6 +34,7 @@
 
 #ident "$Id$"
 
+#include <assert.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -47,6 +48,7 @@
 #include "pam_defs.h"
 #endif				/* USE_PAM */
 #endif				/* ACCT_TOOLS_SETUID */
+#include <grp.h>
 #include <pwd.h>
 #ifdef WITH_SELINUX
 #include <selinux/selinux.h>
@@ -54,6 +56,7 @@
 #endif
 #include "prototypes.h"
 #include "defines.h"
+#include "getdef.h"
 #include "pwio.h"
 #include "shadowio.h"
 #ifdef WITH_TCB
@@ -75,8 +78,16 @@ static bool
     mflg = false,		/* set minimum number of days before password change */
     Mflg = false,		/* set maximum number of days before password change */
     Wflg = false;		/* set expiration warning days */
+static bool Bflg = false;	/* read the changes of the users from stdin */
+static bool Uflg = false;	/* change the users of a UID range */
+static bool Gflg = false;	/* change the members of a group */
+static bool rflg = false;	/* report the accounts about to expire */
 static bool amroot = false;
 
+static char *uid_range;		/* with -U */
+static char *group_name;	/* with -G */
+static long report_days;	/* with -r */
+
 static bool pw_locked  = false;	/* Indicate if the password file is locked */
 static bool spw_locked = false;	/* Indicate if the shadow file is locked */
 /* The name and UID of the user being worked on */
@@ -96,6 +107,8 @@ static void date_to_str (char *buf, size_t maxsize, time_t date);
 static int new_fields (void);
 static void print_date (time_t date);
 static void list_fields (void);
+static size_t report_expiry (void);
+static bool set_field (int opt, const char *arg);
 static void process_flags (int argc, char **argv);
 static void check_flags (int argc, int opt_index);
 static void check_perms (void);
@@ -143,11 +156,16 @@ static /*@noreturn@*/void usage (int status)
 	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
 	(void) fprintf (usageout,
 	                _("Usage: %s [options] LOGIN\n"
+	                  "       %s [options] -U RANGE|-G GROUP\n"
+	                  "       %s -B\n"
+	                  "       %s -r DAYS\n"
 	                  "\n"
 	                  "Options:\n"),
-	                Prog);
+	                Prog, Prog, Prog, Prog);
+	(void) fputs (_("  -B, --batch                   read the changes of the users from stdin\n"), usageout);
 	(void) fputs (_("  -d, --lastday LAST_DAY        set date of last password change to LAST_DAY\n"), usageout);
 	(void) fputs (_("  -E, --expiredate EXPIRE_DATE  set account expiration date to EXPIRE_DATE\n"), usageout);
+	(void) fputs (_("  -G, --group GROUP             change the users of the group GROUP\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
 	(void) fputs (_("  -I, --inactive INACTIVE       set password inactive after expiration\n"
 	                "                                to INACTIVE\n"), usageout);
@@ -156,7 +174,10 @@ static /*@noreturn@*/void usage (int status)
 	                "                                change to MIN_DAYS\n"), usageout);
 	(void) fputs (_("  -M, --maxdays MAX_DAYS        set maximum number of days before password\n"
 	                "                                change to MAX_DAYS\n"), usageout);
+	(void) fputs (_("  -r, --report DAYS             list the accounts which expire within DAYS\n"
+	                "                                days\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
+	(void) fputs (_("  -U, --uid-range RANGE         change the users with a UID in RANGE\n"), usageout);
 	(void) fputs (_("  -W, --warndays WARN_DAYS      set expiration warning days to WARN_DAYS\n"), usageout);
 	(void) fputs ("\n", usageout);
 	exit (status);
@@ -374,6 +395,85 @@ static void list_fields (void)
 	        warndays);
 }
 
+/*
+ * report_expiry - list the accounts which expire within report_days days
+ *
+ *	The shadow database is read once, and each account which password
+ *	expires, becomes inactive, or expires within report_days days (or
+ *	already did) is listed, in the order of the database:
+ *
+ *	user:PASSWORD_EXPIRES:PASSWORD_INACTIVE:ACCOUNT_EXPIRES
+ *
+ *	The dates are in the YYYY-MM-DD format, or "never". The password
+ *	of an account which must change it expires "now".
+ *
+ *	It returns the number of listed accounts.
+ */
+static size_t report_expiry (void)
+{
+	const struct spwd *sp;
+	long limit;
+	size_t count = 0;
+
+	if (spw_open (O_RDONLY) == 0) {
+		fprintf (stderr,
+		         _("%s: cannot open %s\n"), Prog, spw_dbname ());
+		SYSLOG ((LOG_WARN, "cannot open %s", spw_dbname ()));
+		fail_exit (E_NOPERM);
+	}
+
+	limit = (long) (gettime () / SCALE) + report_days;
+	(void) spw_rewind ();
+	while ((sp = spw_next ()) != NULL) {
+		/* -1 is never, for all of the dates */
+		long pwexp = -1, inact = -1;
+		bool due;
+		char pwbuf[16], inactbuf[16], expbuf[16];
+
+		if (   (sp->sp_lstchg > 0)
+		    && (sp->sp_max >= 0)
+		    && (sp->sp_max < (10000 * (DAY / SCALE)))) {
+			pwexp = sp->sp_lstchg + sp->sp_max;
+			if (sp->sp_inact >= 0) {
+				inact = pwexp + sp->sp_inact;
+			}
+		}
+		due =    (0 == sp->sp_lstchg)
+		      || ((-1 != pwexp) && (pwexp <= limit))
+		      || ((-1 != inact) && (inact <= limit))
+		      || ((sp->sp_expire >= 0) && (sp->sp_expire <= limit));
+		if (!due) {
+			continue;
+		}
+
+		if (0 == sp->sp_lstchg) {
+			strcpy (pwbuf, "now");
+		} else if (-1 == pwexp) {
+			strcpy (pwbuf, "never");
+		} else {
+			date_to_str (pwbuf, sizeof pwbuf, (time_t) pwexp * SCALE);
+		}
+		if (-1 == inact) {
+			strcpy (inactbuf, "never");
+		} else {
+			date_to_str (inactbuf, sizeof inactbuf,
+			             (time_t) inact * SCALE);
+		}
+		if (sp->sp_expire < 0) {
+			strcpy (expbuf, "never");
+		} else {
+			date_to_str (expbuf, sizeof expbuf,
+			             (time_t) sp->sp_expire * SCALE);
+		}
+		(void) printf ("%s:%s:%s:%s\n",
+		               sp->sp_namp, pwbuf, inactbuf, expbuf);
+		count++;
+	}
+
+	(void) spw_close ();
+	return count;
+}
+
 /*
  * process_flags - parse the command line options
  *
@@ -386,88 +486,63 @@ static void process_flags (int argc, char **argv)
 	 */
 	int c;
 	static struct option long_options[] = {
+		{"batch",      no_argument,       NULL, 'B'},
 		{"lastday",    required_argument, NULL, 'd'},
 		{"expiredate", required_argument, NULL, 'E'},
+		{"group",      required_argument, NULL, 'G'},
 		{"help",       no_argument,       NULL, 'h'},
 		{"inactive",   required_argument, NULL, 'I'},
 		{"list",       no_argument,       NULL, 'l'},
 		{"mindays",    required_argument, NULL, 'm'},
 		{"maxdays",    required_argument, NULL, 'M'},
+		{"report",     required_argument, NULL, 'r'},
 		{"root",       required_argument, NULL, 'R'},
+		{"uid-range",  required_argument, NULL, 'U'},
 		{"warndays",   required_argument, NULL, 'W'},
 		{NULL, 0, NULL, '\0'}
 	};
 
-	while ((c = getopt_long (argc, argv, "d:E:hI:lm:M:R:W:",
+	while ((c = getopt_long (argc, argv, "Bd:E:G:hI:lm:M:r:R:U:W:",
 	                         long_options, NULL)) != -1) {
 		switch (c) {
-		case 'd':
-			dflg = true;
-			lstchgdate = strtoday (optarg);
-			if (lstchgdate < -1) {
-				fprintf (stderr,
-				         _("%s: invalid date '%s'\n"),
-				         Prog, optarg);
-				usage (E_USAGE);
-			}
+		case 'B':
+			Bflg = true;
 			break;
+		case 'd':
 		case 'E':
-			Eflg = true;
-			expdate = strtoday (optarg);
-			if (expdate < -1) {
-				fprintf (stderr,
-				         _("%s: invalid date '%s'\n"),
-				         Prog, optarg);
+		case 'I':
+		case 'm':
+		case 'M':
+		case 'W':
+			if (!set_field (c, optarg)) {
 				usage (E_USAGE);
 			}
 			break;
+		case 'G':
+			Gflg = true;
+			group_name = optarg;
+			break;
 		case 'h':
 			usage (E_SUCCESS);
 			/*@notreached@*/break;
-		case 'I':
-			Iflg = true;
-			if (   (getlong (optarg, &inactdays) == 0)
-			    || (inactdays < -1)) {
-				fprintf (stderr,
-				         _("%s: invalid numeric argument '%s'\n"),
-				         Prog, optarg);
-				usage (E_USAGE);
-			}
-			break;
 		case 'l':
 			lflg = true;
 			break;
-		case 'm':
-			mflg = true;
-			if (   (getlong (optarg, &mindays) == 0)
-			    || (mindays < -1)) {
-				fprintf (stderr,
-				         _("%s: invalid numeric argument '%s'\n"),
-				         Prog, optarg);
-				usage (E_USAGE);
-			}
-			break;
-		case 'M':
-			Mflg = true;
-			if (   (getlong (optarg, &maxdays) == 0)
-			    || (maxdays < -1)) {
+		case 'r':
+			if (   (getlong (optarg, &report_days) == 0)
+			    || (report_days < 0)) {
 				fprintf (stderr,
-				         _("%s: invalid numeric argument '%s'\n"),
+				         _("%s: invalid number of days '%s'\n"),
 				         Prog, optarg);
 				usage (E_USAGE);
 			}
+			rflg = true;
 			break;
 		case 'R': /* no-op, handled in process_root_flag () */
 			break;
-		case 'W':
-			Wflg = true;
-			if (   (getlong (optarg, &warndays) == 0)
-			    || (warndays < -1)) {
-				fprintf (stderr,
-				         _("%s: invalid numeric argument '%s'\n"),
-				         Prog, optarg);
-				usage (E_USAGE);
-			}
+		case 'U':
+			Uflg = true;
+			uid_range = optarg;
 			break;
 		default:
 			usage (E_USAGE);
@@ -477,6 +552,80 @@ static void process_flags (int argc, char **argv)
 	check_flags (argc, optind);
 }
 
+/*
+ * set_field - set the aging field of the option opt to arg
+ *
+ *	It returns false if arg is not valid.
+ */
+static bool set_field (int opt, const char *arg)
+{
+	switch (opt) {
+	case 'd':
+		dflg = true;
+		lstchgdate = strtoday (arg);
+		if (lstchgdate < -1) {
+			fprintf (stderr,
+			         _("%s: invalid date '%s'\n"),
+			         Prog, arg);
+			return false;
+		}
+		break;
+	case 'E':
+		Eflg = true;
+		expdate = strtoday (arg);
+		if (expdate < -1) {
+			fprintf (stderr,
+			         _("%s: invalid date '%s'\n"),
+			         Prog, arg);
+			return false;
+		}
+		break;
+	case 'I':
+		Iflg = true;
+		if (   (getlong (arg, &inactdays) == 0)
+		    || (inactdays < -1)) {
+			fprintf (stderr,
+			         _("%s: invalid numeric argument '%s'\n"),
+			         Prog, arg);
+			return false;
+		}
+		break;
+	case 'm':
+		mflg = true;
+		if (   (getlong (arg, &mindays) == 0)
+		    || (mindays < -1)) {
+			fprintf (stderr,
+			         _("%s: invalid numeric argument '%s'\n"),
+			         Prog, arg);
+			return false;
+		}
+		break;
+	case 'M':
+		Mflg = true;
+		if (   (getlong (arg, &maxdays) == 0)
+		    || (maxdays < -1)) {
+			fprintf (stderr,
+			         _("%s: invalid numeric argument '%s'\n"),
+			         Prog, arg);
+			return false;
+		}
+		break;
+	case 'W':
+		Wflg = true;
+		if (   (getlong (arg, &warndays) == 0)
+		    || (warndays < -1)) {
+			fprintf (stderr,
+			         _("%s: invalid numeric argument '%s'\n"),
+			         Prog, arg);
+			return false;
+		}
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
 /*
  * check_flags - check flags and parameters consistency
  *
@@ -484,16 +633,40 @@ static void process_flags (int argc, char **argv)
  */
 static void check_flags (int argc, int opt_index)
 {
+	bool fields = mflg || Mflg || dflg || Wflg || Iflg || Eflg;
+
 	/*
 	 * Make certain the flags do not conflict and that there is a user
-	 * name on the command line.
+	 * name on the command line, unless several users are changed.
 	 */
 
+	if (rflg) {
+		/* All the accounts are reported */
+		if (   (argc != opt_index)
+		    || lflg || fields || Bflg || Uflg || Gflg) {
+			usage (E_USAGE);
+		}
+		return;
+	}
+
+	if (Bflg || Uflg || Gflg) {
+		/* The fields of -U and -G are set from the command line,
+		 * and the fields of -B from stdin.
+		 */
+		if (   (argc != opt_index)
+		    || lflg
+		    || (Bflg && (Uflg || Gflg || fields))
+		    || (!Bflg && !fields)) {
+			usage (E_USAGE);
+		}
+		return;
+	}
+
 	if (argc != opt_index + 1) {
 		usage (E_USAGE);
 	}
 
-	if (lflg && (mflg || Mflg || dflg || Wflg || Iflg || Eflg)) {
+	if (lflg && fields) {
 		fprintf (stderr,
 		         _("%s: do not include \"l\" with other flags\n"),
 		         Prog);
@@ -769,6 +942,244 @@ static void get_defaults (/*@null@*/const struct spwd *sp)
 	}
 }
 
+/*
+ * change_user - change the aging information of the user pw
+ *
+ *	The fields which are not set are kept. The change is committed by
+ *	close_files().
+ */
+static void change_user (/*@notnull@*/const struct passwd *pw)
+{
+	const struct spwd *sp;
+
+	STRFCPY (user_name, pw->pw_name);
+	user_uid = pw->pw_uid;
+	sp = spw_locate (pw->pw_name);
+	get_defaults (sp);
+#ifdef WITH_AUDIT
+	audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+	              "change aging information",
+	              user_name, (unsigned int) user_uid, 1);
+#endif
+	update_age (sp, pw);
+}
+
+static bool is_member (const struct passwd *pw, const struct group *gr)
+{
+	char **mem;
+
+	if (pw->pw_gid == gr->gr_gid) {
+		return true;
+	}
+	for (mem = gr->gr_mem; NULL != *mem; mem++) {
+		if (strcmp (*mem, pw->pw_name) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * change_users - change the aging information of the users selected
+ *                with -U and -G
+ *
+ *	The users are selected first, as update_age() can change the
+ *	password file.
+ *
+ *	It returns the number of changed users.
+ */
+static size_t change_users (void)
+{
+	unsigned long umin = 0, umax = 0;
+	bool has_umin = false, has_umax = false;
+	/*@null@*/struct group *gr = NULL;
+	const struct passwd *pw;
+	char **names = NULL;
+	size_t count = 0, alloc = 0, i;
+
+	if (   Uflg
+	    && (getrange (uid_range, &umin, &has_umin, &umax, &has_umax) == 0)) {
+		fprintf (stderr,
+		         _("%s: invalid user ID range '%s'\n"),
+		         Prog, uid_range);
+		fail_exit (E_BAD_ARG);
+	}
+	if (Gflg) {
+		gr = getgr_nam_gid (group_name);
+		if (NULL == gr) {
+			fprintf (stderr,
+			         _("%s: group '%s' does not exist\n"),
+			         Prog, group_name);
+			fail_exit (E_BAD_ARG);
+		}
+	}
+
+	(void) pw_rewind ();
+	while ((pw = pw_next ()) != NULL) {
+		if (   (has_umin && (pw->pw_uid < (uid_t) umin))
+		    || (has_umax && (pw->pw_uid > (uid_t) umax))
+		    || ((NULL != gr) && !is_member (pw, gr))) {
+			continue;
+		}
+		if (count == alloc) {
+			char **tmp;
+
+			alloc = (0 == alloc) ? 64 : alloc * 2;
+			tmp = (char **) xmalloc (alloc * sizeof (*tmp));
+			if (0 != count) {
+				memcpy (tmp, names, count * sizeof (*tmp));
+			}
+			free (names);
+			names = tmp;
+		}
+		names[count] = xstrdup (pw->pw_name);
+		count++;
+	}
+	if (NULL != gr) {
+		gr_free_packed (gr);
+	}
+
+	for (i = 0; i < count; i++) {
+		pw = pw_locate (names[i]);
+		assert (NULL != pw);
+		change_user (pw);
+		free (names[i]);
+	}
+	free (names);
+	return count;
+}
+
+/*
+ * change_batch - change the aging information of the users listed on
+ *                stdin
+ *
+ *	Each line is a user name followed by the fields to set, with the
+ *	names of their long options:
+ *
+ *	user:maxdays=90,warndays=7
+ *
+ *	The changes are ignored if a line is invalid.
+ *
+ *	It returns the number of changed users.
+ */
+static size_t change_batch (void)
+{
+	static const struct {
+		const char *name;
+		int opt;
+	} batch_fields[] = {
+		{"lastday",    'd'},
+		{"expiredate", 'E'},
+		{"inactive",   'I'},
+		{"mindays",    'm'},
+		{"maxdays",    'M'},
+		{"warndays",   'W'},
+	};
+	const size_t nfields = sizeof batch_fields / sizeof batch_fields[0];
+	char buf[BUFSIZ];
+	char *cp;
+	int line = 0;
+	int errors = 0;
+	size_t count = 0;
+
+	while (fgets (buf, (int) sizeof buf, stdin) != (char *) 0) {
+		const struct passwd *pw;
+		char *name, *field;
+		bool valid = true;
+
+		line++;
+		cp = strrchr (buf, '\n');
+		if (NULL != cp) {
+			*cp = '\0';
+		} else if (feof (stdin) == 0) {
+			/* Drop all remaining characters on this line. */
+			while (fgets (buf, (int) sizeof buf, stdin) != (char *) 0) {
+				if (strchr (buf, '\n') != NULL) {
+					break;
+				}
+			}
+			fprintf (stderr,
+			         _("%s: line %d: line too long\n"),
+			         Prog, line);
+			errors++;
+			continue;
+		}
+
+		name = buf;
+		cp = strchr (name, ':');
+		if (NULL == cp) {
+			fprintf (stderr, _("%s: line %d: invalid line\n"),
+			         Prog, line);
+			errors++;
+			continue;
+		}
+		*cp = '\0';
+		cp++;
+
+		dflg = false;
+		Eflg = false;
+		Iflg = false;
+		mflg = false;
+		Mflg = false;
+		Wflg = false;
+		for (field = strtok (cp, ","); NULL != field;
+		     field = strtok (NULL, ",")) {
+			char *value = strchr (field, '=');
+			size_t i;
+
+			if (NULL != value) {
+				*value = '\0';
+				value++;
+			}
+			for (i = 0; i < nfields; i++) {
+				if (strcmp (field, batch_fields[i].name) == 0) {
+					break;
+				}
+			}
+			if ((NULL == value) || (nfields == i)) {
+				fprintf (stderr,
+				         _("%s: line %d: invalid field '%s'\n"),
+				         Prog, line, field);
+				valid = false;
+				break;
+			}
+			if (!set_field (batch_fields[i].opt, value)) {
+				valid = false;
+				break;
+			}
+		}
+		if (   valid
+		    && !mflg && !Mflg && !dflg && !Wflg && !Iflg && !Eflg) {
+			fprintf (stderr, _("%s: line %d: invalid line\n"),
+			         Prog, line);
+			valid = false;
+		}
+		if (!valid) {
+			errors++;
+			continue;
+		}
+
+		pw = pw_locate (name);
+		if (NULL == pw) {
+			fprintf (stderr,
+			         _("%s: line %d: user '%s' does not exist in %s\n"),
+			         Prog, line, name, pw_dbname ());
+			errors++;
+			continue;
+		}
+		change_user (pw);
+		count++;
+	}
+
+	if (0 != errors) {
+		fprintf (stderr,
+		         _("%s: error detected, changes ignored\n"),
+		         Prog);
+		fail_exit (E_BAD_ARG);
+	}
+	return count;
+}
+
 /*
  * chage - change a user's password aging information
  *
@@ -776,12 +1187,16 @@ static void get_defaults (/*@null@*/const struct spwd *sp)
  *
  *	The valid options are
  *
+ *	-B	read the changes of the users from stdin (*)
  *	-d	set last password change date (*)
  *	-E	set account expiration date (*)
+ *	-G	change the users of a group (*)
  *	-I	set password inactive after expiration (*)
  *	-l	show account aging information
  *	-M	set maximum number of days before password change (*)
  *	-m	set minimum number of days before password change (*)
+ *	-r	list the accounts about to expire (*)
+ *	-U	change the users of a UID range (*)
  *	-W	set expiration warning days (*)
  *
  *	(*) requires root permission to execute.
@@ -807,7 +1222,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 #ifdef WITH_AUDIT
 	audit_help_open ();
@@ -836,6 +1251,52 @@ int main (int argc, char **argv)
 		exit (E_SHADOW_NOTFOUND);
 	}
 
+	/*
+	 * Report the accounts about to expire: the shadow database is read
+	 * once, and not locked.
+	 */
+	if (rflg) {
+		size_t count;
+
+#ifdef WITH_TCB
+		if (getdef_bool ("USE_TCB")) {
+			fprintf (stderr,
+			         _("%s: option -r is not supported with USE_TCB\n"),
+			         Prog);
+			fail_exit (E_USAGE);
+		}
+#endif				/* WITH_TCB */
+		count = report_expiry ();
+		SYSLOG ((LOG_INFO, "reported %lu accounts about to expire",
+		         (unsigned long) count));
+		closelog ();
+		exit (E_SUCCESS);
+	}
+
+	/*
+	 * Change several users at once: the databases are loaded and
+	 * written once.
+	 */
+	if (Bflg || Uflg || Gflg) {
+		size_t count;
+
+#ifdef WITH_TCB
+		if (getdef_bool ("USE_TCB")) {
+			fprintf (stderr,
+			         _("%s: options -B, -G and -U are not supported with USE_TCB\n"),
+			         Prog);
+			fail_exit (E_USAGE);
+		}
+#endif				/* WITH_TCB */
+		open_files (false);
+		count = Bflg ? change_batch () : change_users ();
+		close_files ();
+		SYSLOG ((LOG_INFO, "changed password expiry for %lu users",
+		         (unsigned long) count));
+		closelog ();
+		exit (E_SUCCESS);
+	}
+
 	open_files (lflg);
 	/* Drop privileges */
 	if (lflg && (   (setregid (rgid, rgid) != 0)
@@ -46,8 +46,7 @@
 #endif
 #include "defines.h"
 #include "getdef.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #ifdef USE_PAM
 #include "pam_defs.h"
 #endif
@@ -645,7 +644,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 	/*
 	 * This command behaves different for root and non-root
@@ -746,8 +745,7 @@ int main (int argc, char **argv)
 
 	SYSLOG ((LOG_INFO, "changed user '%s' information", user));
 
-	nscd_flush_cache ("passwd");
-	sssd_flush_cache (SSSD_DB_PASSWD);
+	cache_flush_defer (CACHE_DB_PASSWD);
 
 	closelog ();
 	exit (E_SUCCESS);
@@ -45,8 +45,7 @@
 #endif				/* USE_PAM */
 #endif				/* ACCT_TOOLS_SETUID */
 #include "defines.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #include "prototypes.h"
 #include "groupio.h"
 #ifdef	SHADOWGRP
@@ -78,6 +77,13 @@ static bool sgr_locked = false;
 static bool gr_locked = false;
 
 /* local function prototypes */
+/* A line of the input */
+struct input_line {
+	int line;
+	/*@only@*/char *name;
+	/*@only@*/char *newpwd;
+};
+
 static void fail_exit (int code);
 static /*@noreturn@*/void usage (int status);
 static void process_flags (int argc, char **argv);
@@ -85,6 +91,7 @@ static void check_flags (void);
 static void check_perms (void);
 static void open_files (void);
 static void close_files (void);
+static size_t drop_superseded_lines (struct input_line *lines, size_t nlines);
 
 /*
  * fail_exit - exit with a failure code after unlocking the files
@@ -380,12 +387,70 @@ static void close_files (void)
 	gr_locked = false;
 }
 
+static int input_line_cmp (const void *p1, const void *p2)
+{
+	const struct input_line *l1 = *(const struct input_line *const *) p1;
+	const struct input_line *l2 = *(const struct input_line *const *) p2;
+	int r;
+
+	r = strcmp (l1->name, l2->name);
+	if (0 != r) {
+		return r;
+	}
+	return (l1->line > l2->line) - (l1->line < l2->line);
+}
+
+/*
+ * drop_superseded_lines - keep only the last line of each group
+ *
+ *	The groups changed by several lines get the password of their
+ *	last line, as if the lines were applied in order. The other lines
+ *	are dropped, so that their passwords are not encrypted.
+ *
+ *	The order of the remaining lines is kept. It returns their number.
+ */
+static size_t drop_superseded_lines (struct input_line *lines, size_t nlines)
+{
+	struct input_line **sorted;
+	size_t i, n;
+
+	if (nlines < 2) {
+		return nlines;
+	}
+
+	sorted = (struct input_line **) xmalloc (nlines * sizeof (*sorted));
+	for (i = 0; i < nlines; i++) {
+		sorted[i] = &lines[i];
+	}
+	qsort (sorted, nlines, sizeof (*sorted), input_line_cmp);
+	for (i = 0; i + 1 < nlines; i++) {
+		if (strcmp (sorted[i]->name, sorted[i + 1]->name) == 0) {
+			free (sorted[i]->name);
+			sorted[i]->name = NULL;
+			strzero (sorted[i]->newpwd);
+			free (sorted[i]->newpwd);
+			sorted[i]->newpwd = NULL;
+		}
+	}
+	free (sorted);
+
+	for (i = 0, n = 0; i < nlines; i++) {
+		if (NULL != lines[i].name) {
+			lines[n] = lines[i];
+			n++;
+		}
+	}
+	return n;
+}
+
 int main (int argc, char **argv)
 {
 	char buf[BUFSIZ];
 	char *name;
-	char *newpwd;
 	char *cp;
+	struct input_line *lines = NULL;
+	size_t nlines = 0, alloc = 0, i;
+	/*@null@*/struct crypt_job *jobs = NULL;
 
 #ifdef	SHADOWGRP
 	const struct sgrp *sg;
@@ -403,7 +468,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", true, argc, argv);
 
 	process_flags (argc, argv);
 
@@ -418,9 +483,9 @@ int main (int argc, char **argv)
 	open_files ();
 
 	/*
-	 * Read each line, separating the group name from the password. The
-	 * group entry for each group will be looked up in the appropriate
-	 * file (gshadow or group) and the password changed.
+	 * Read all the lines first, separating the group name from the
+	 * password, so that the passwords can be encrypted at once, by
+	 * several threads if CRYPT_THREADS is set.
 	 */
 	while (fgets (buf, (int) sizeof buf, stdin) != (char *) 0) {
 		line++;
@@ -437,10 +502,7 @@ int main (int argc, char **argv)
 		/*
 		 * The group's name is the first field. It is separated from
 		 * the password with a ":" character which is replaced with a
-		 * NUL to give the new password. The new password will then
-		 * be encrypted in the normal fashion with a new salt
-		 * generated, unless the '-e' is given, in which case it is
-		 * assumed to already be encrypted.
+		 * NUL to give the new password.
 		 */
 
 		name = buf;
@@ -455,26 +517,74 @@ int main (int argc, char **argv)
 			errors++;
 			continue;
 		}
-		newpwd = cp;
-		if (   (!eflg)
-		    && (   (NULL == crypt_method)
-		        || (0 != strcmp (crypt_method, "NONE")))) {
-			void *arg = NULL;
-			const char *salt;
-			if (md5flg) {
-				crypt_method = "MD5";
+
+		if (nlines == alloc) {
+			struct input_line *tmp;
+
+			alloc = (0 == alloc) ? 64 : alloc * 2;
+			tmp = (struct input_line *) xmalloc (alloc * sizeof (*tmp));
+			if (0 != nlines) {
+				memcpy (tmp, lines, nlines * sizeof (*tmp));
 			}
+			free (lines);
+			lines = tmp;
+		}
+		lines[nlines].line = line;
+		lines[nlines].name = xstrdup (name);
+		lines[nlines].newpwd = xstrdup (cp);
+		nlines++;
+	}
+	strzero (buf);
+
+	/* Only the last password of each group is set */
+	nlines = drop_superseded_lines (lines, nlines);
+
+	/*
+	 * The new passwords will be encrypted in the normal fashion with
+	 * a new salt generated, unless the '-e' is given, in which case
+	 * they are assumed to already be encrypted.
+	 */
+	if (   (!eflg)
+	    && (   (NULL == crypt_method)
+	        || (0 != strcmp (crypt_method, "NONE")))
+	    && (0 != nlines)) {
+		void *arg = NULL;
+
+		if (md5flg) {
+			crypt_method = "MD5";
+		}
 #ifdef USE_SHA_CRYPT
-			if (sflg) {
-				arg = &sha_rounds;
-			}
+		if (sflg) {
+			arg = &sha_rounds;
+		}
 #endif
-			salt = crypt_make_salt (crypt_method, arg);
-			cp = pw_encrypt (newpwd, salt);
+		jobs = (struct crypt_job *) xmalloc (nlines * sizeof (*jobs));
+		for (i = 0; i < nlines; i++) {
+			jobs[i].clear = lines[i].newpwd;
+			jobs[i].salt = xstrdup (crypt_make_salt (crypt_method,
+			                                         arg));
+			jobs[i].cipher = NULL;
+		}
+		crypt_jobs_run (jobs, nlines);
+	}
+
+	/*
+	 * The group entry for each group will be looked up in the
+	 * appropriate file (gshadow or group) and the password changed,
+	 * in the order of the input. The lookups use the name indexes of
+	 * the databases, which are built on the first lookup.
+	 */
+	for (i = 0; i < nlines; i++) {
+		line = lines[i].line;
+		name = lines[i].name;
+		cp = lines[i].newpwd;
+
+		if (NULL != jobs) {
+			cp = jobs[i].cipher;
 			if (NULL == cp) {
 				fprintf (stderr,
 				         _("%s: failed to crypt password with salt '%s': %s\n"),
-				         Prog, salt, strerror (errno));
+				         Prog, jobs[i].salt, strerror (jobs[i].err));
 				fail_exit (1);
 			}
 		}
@@ -573,6 +683,16 @@ int main (int argc, char **argv)
 	 * changes to be written out all at once, and then unlocked
 	 * afterwards.
 	 */
+	if (NULL != jobs) {
+		crypt_jobs_free (jobs, nlines);
+	}
+	for (i = 0; i < nlines; i++) {
+		free (lines[i].name);
+		strzero (lines[i].newpwd);
+		free (lines[i].newpwd);
+	}
+	free (lines);
+
 	if (0 != errors) {
 		fprintf (stderr,
 		         _("%s: error detected, changes ignored\n"), Prog);
@@ -581,8 +701,7 @@ int main (int argc, char **argv)
 
 	close_files ();
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
+	cache_flush_defer (CACHE_DB_GROUP);
 
 	return (0);
 }
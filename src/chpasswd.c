@@ -43,8 +43,8 @@
 #include "pam_defs.h"
 #endif				/* USE_PAM */
 #include "defines.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
+#include "commonio.h"
 #include "getdef.h"
 #include "prototypes.h"
 #include "pwio.h"
@@ -71,6 +71,13 @@ static long sha_rounds = 5000;
 static bool is_shadow_pwd;
 static bool pw_locked = false;
 static bool spw_locked = false;
+/* The databases are opened without their locks (OPTIMISTIC_LOCKING) */
+static bool optimistic = false;
+
+static long pass_min_days = -1;
+static long pass_max_days = -1;
+static long pass_warn_age = -1;
+static long lstchg = -1;
 
 /* local function prototypes */
 static void fail_exit (int code);
@@ -79,6 +86,7 @@ static void process_flags (int argc, char **argv);
 static void check_flags (void);
 static void check_perms (void);
 static void open_files (void);
+static bool lock_files (void);
 static void close_files (void);
 
 /*
@@ -300,9 +308,29 @@ static void check_perms (void)
 
 /*
  * open_files - lock and open the password databases
+ *
+ *	With OPTIMISTIC_LOCKING, the databases are only opened: they are
+ *	locked by lock_files(), once the changes are ready.
  */
 static void open_files (void)
 {
+	if (optimistic) {
+		if (commonio_open_optimistic (__pw_get_db (),
+		                              O_CREAT | O_RDWR) == 0) {
+			fprintf (stderr,
+			         _("%s: cannot open %s\n"), Prog, pw_dbname ());
+			fail_exit (1);
+		}
+		if (   is_shadow_pwd
+		    && (commonio_open_optimistic (__spw_get_db (),
+		                                  O_CREAT | O_RDWR) == 0)) {
+			fprintf (stderr,
+			         _("%s: cannot open %s\n"), Prog, spw_dbname ());
+			fail_exit (1);
+		}
+		return;
+	}
+
 	/*
 	 * Lock the password file and open it for reading and writing. This
 	 * will bring all of the entries into memory where they may be updated.
@@ -338,6 +366,35 @@ static void open_files (void)
 	}
 }
 
+/*
+ * lock_files - lock the password databases opened by open_files() with
+ *              OPTIMISTIC_LOCKING
+ *
+ *	It returns false if another process changed the databases since
+ *	they were read. They are then closed, and the changes are lost.
+ */
+static bool lock_files (void)
+{
+	struct commonio_db *dbs[2];
+	size_t failed;
+
+	dbs[0] = __pw_get_db ();
+	dbs[1] = __spw_get_db ();
+	if (commonio_lock_optimistic (dbs, is_shadow_pwd ? 2 : 1,
+	                              &failed) == 0) {
+		if (ESTALE == errno) {
+			return false;
+		}
+		fprintf (stderr,
+		         _("%s: cannot lock %s; try again later.\n"),
+		         Prog, (0 == failed) ? pw_dbname () : spw_dbname ());
+		fail_exit (1);
+	}
+	pw_locked = true;
+	spw_locked = is_shadow_pwd;
+	return true;
+}
+
 /*
  * close_files - close and unlock the password databases
  */
@@ -374,15 +431,225 @@ static void close_files (void)
 	pw_locked = false;
 }
 
+/* A line of the input, split in the user name and the new password */
+struct input_line {
+	int line;
+	/*@only@*/char *name;
+	/*@only@*/char *newpwd;
+};
+
+static int input_line_cmp (const void *p1, const void *p2)
+{
+	const struct input_line *l1 = *(const struct input_line *const *) p1;
+	const struct input_line *l2 = *(const struct input_line *const *) p2;
+	int r;
+
+	r = strcmp (l1->name, l2->name);
+	if (0 != r) {
+		return r;
+	}
+	return (l1->line > l2->line) - (l1->line < l2->line);
+}
+
+/*
+ * drop_superseded_lines - keep only the last line of each user
+ *
+ *	The users changed by several lines get the password of their last
+ *	line. The other lines are dropped, so that their passwords are not
+ *	encrypted and each entry is updated once.
+ *
+ *	The order of the remaining lines is kept. It returns their number.
+ */
+static size_t drop_superseded_lines (struct input_line *lines, size_t nlines)
+{
+	struct input_line **sorted;
+	size_t i, n;
+
+	if (nlines < 2) {
+		return nlines;
+	}
+
+	sorted = (struct input_line **) xmalloc (nlines * sizeof (*sorted));
+	for (i = 0; i < nlines; i++) {
+		sorted[i] = &lines[i];
+	}
+	qsort (sorted, nlines, sizeof (*sorted), input_line_cmp);
+	for (i = 0; i + 1 < nlines; i++) {
+		if (strcmp (sorted[i]->name, sorted[i + 1]->name) == 0) {
+			free (sorted[i]->name);
+			sorted[i]->name = NULL;
+			strzero (sorted[i]->newpwd);
+			free (sorted[i]->newpwd);
+			sorted[i]->newpwd = NULL;
+		}
+	}
+	free (sorted);
+
+	for (i = 0, n = 0; i < nlines; i++) {
+		if (NULL != lines[i].name) {
+			lines[n] = lines[i];
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * drop_blocked_lines - drop the lines with a password of
+ *                      PASS_BLOCKLIST_FILE
+ *
+ *	The blocklist is mapped once for all the lines.
+ *
+ *	The order of the remaining lines is kept. It returns their number.
+ */
+static size_t drop_blocked_lines (struct input_line *lines, size_t nlines)
+{
+	size_t i, n;
+
+	for (i = 0, n = 0; i < nlines; i++) {
+		if (pass_blocklisted (lines[i].newpwd)) {
+			fprintf (stderr,
+			         _("%s: line %d: password of user '%s' is blocked\n"),
+			         Prog, lines[i].line, lines[i].name);
+			free (lines[i].name);
+			strzero (lines[i].newpwd);
+			free (lines[i].newpwd);
+			continue;
+		}
+		lines[n] = lines[i];
+		n++;
+	}
+	pass_blocklist_close ();
+	return n;
+}
+
+/*
+ * update_password - set the new password of the user of an input line
+ *
+ *	job is the encryption of the password, or NULL if it is already
+ *	encrypted.
+ *
+ *	It returns 1 if the entries of the user could not be updated, 0
+ *	otherwise.
+ */
+static int update_password (const struct input_line *l,
+                            /*@null@*/const struct crypt_job *job)
+{
+	char *name = l->name;
+	char *cp = l->newpwd;
+	int line = l->line;
+	const struct spwd *sp;
+	struct spwd newsp;
+	const struct passwd *pw;
+	struct passwd newpw;
+
+	if (NULL != job) {
+		cp = job->cipher;
+		if (NULL == cp) {
+			fprintf (stderr,
+			         _("%s: failed to crypt password with salt '%s': %s\n"),
+			         Prog, job->salt, strerror (job->err));
+			fail_exit (1);
+		}
+	}
+
+	/*
+	 * Get the password file entry for this user. The user must
+	 * already exist.
+	 */
+	pw = pw_locate (name);
+	if (NULL == pw) {
+		fprintf (stderr,
+		         _("%s: line %d: user '%s' does not exist\n"), Prog,
+		         line, name);
+		return 1;
+	}
+	if (is_shadow_pwd) {
+		/* The shadow entry should be updated if the
+		 * passwd entry has a password set to 'x'.
+		 * But on the other hand, if there is already both
+		 * a passwd and a shadow password, it's preferable
+		 * to update both.
+		 */
+		sp = spw_locate (name);
+
+		if (   (NULL == sp)
+		    && (strcmp (pw->pw_passwd,
+		                SHADOW_PASSWD_STRING) == 0)) {
+			/* If the password is set to 'x' in
+			 * passwd, but there are no entries in
+			 * shadow, create one.
+			 */
+			newsp.sp_namp  = name;
+			/* newsp.sp_pwdp  = NULL; will be set later */
+			/* newsp.sp_lstchg= 0;    will be set later */
+			newsp.sp_min   = pass_min_days;
+			newsp.sp_max   = pass_max_days;
+			newsp.sp_warn  = pass_warn_age;
+			newsp.sp_inact = -1;
+			newsp.sp_expire= -1;
+			newsp.sp_flag  = SHADOW_SP_FLAG_UNSET;
+			sp = &newsp;
+		}
+	} else {
+		sp = NULL;
+	}
+
+	/*
+	 * The freshly encrypted new password is merged into the
+	 * user's password file entry and the last password change
+	 * date is set to the current date.
+	 */
+	if (NULL != sp) {
+		newsp = *sp;
+		newsp.sp_pwdp = cp;
+		newsp.sp_lstchg = lstchg;
+	}
+
+	if (   (NULL == sp)
+	    || (strcmp (pw->pw_passwd, SHADOW_PASSWD_STRING) != 0)) {
+		newpw = *pw;
+		newpw.pw_passwd = cp;
+	}
+
+	/* 
+	 * The updated password file entry is then put back and will
+	 * be written to the password file later, after all the
+	 * other entries have been updated as well.
+	 */
+	if (NULL != sp) {
+		if (spw_update (&newsp) == 0) {
+			fprintf (stderr,
+			         _("%s: line %d: failed to prepare the new %s entry '%s'\n"),
+			         Prog, line, spw_dbname (), newsp.sp_namp);
+			return 1;
+		}
+	}
+	if (   (NULL == sp)
+	    || (strcmp (pw->pw_passwd, SHADOW_PASSWD_STRING) != 0)) {
+		if (pw_update (&newpw) == 0) {
+			fprintf (stderr,
+			         _("%s: line %d: failed to prepare the new %s entry '%s'\n"),
+			         Prog, line, pw_dbname (), newpw.pw_name);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 int main (int argc, char **argv)
 {
 	char buf[BUFSIZ];
 	char *name;
-	char *newpwd;
 	char *cp;
+	struct input_line *lines = NULL;
+	size_t nlines = 0, alloc = 0, i;
+	/*@null@*/struct crypt_job *jobs = NULL;
+	bool hash = false;
 
 #ifdef USE_PAM
 	bool use_pam = true;
+	/*@null@*/struct pam_passwd_job *pam_jobs = NULL;
 #endif				/* USE_PAM */
 
 	int errors = 0;
@@ -394,7 +661,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", true, argc, argv);
 
 	process_flags (argc, argv);
 
@@ -413,17 +680,15 @@ int main (int argc, char **argv)
 #endif				/* USE_PAM */
 	{
 		is_shadow_pwd = spw_file_present ();
+		optimistic = getdef_bool ("OPTIMISTIC_LOCKING");
 
 		open_files ();
 	}
 
 	/*
-	 * Read each line, separating the user name from the password. The
-	 * password entry for each user will be looked up in the appropriate
-	 * file (shadow or passwd) and the password changed. For shadow
-	 * files the last change date is set directly, for passwd files the
-	 * last change date is set in the age only if aging information is
-	 * present.
+	 * Read all the lines first, separating the user name from the
+	 * password, so that the passwords can be encrypted at once, by
+	 * several threads if CRYPT_THREADS is set.
 	 */
 	while (fgets (buf, (int) sizeof buf, stdin) != (char *) 0) {
 		line++;
@@ -452,10 +717,7 @@ int main (int argc, char **argv)
 		/*
 		 * The username is the first field. It is separated from the
 		 * password with a ":" character which is replaced with a
-		 * NUL to give the new password. The new password will then
-		 * be encrypted in the normal fashion with a new salt
-		 * generated, unless the '-e' is given, in which case it is
-		 * assumed to already be encrypted.
+		 * NUL to give the new password.
 		 */
 
 		name = buf;
@@ -470,136 +732,125 @@ int main (int argc, char **argv)
 			errors++;
 			continue;
 		}
-		newpwd = cp;
 
-#ifdef USE_PAM
-		if (use_pam){
-			if (do_pam_passwd_non_interactive ("chpasswd", name, newpwd) != 0) {
-				fprintf (stderr,
-				         _("%s: (line %d, user %s) password not changed\n"),
-				         Prog, line, name);
-				errors++;
-			}
-		} else
-#endif				/* USE_PAM */
-		{
-		const struct spwd *sp;
-		struct spwd newsp;
-		const struct passwd *pw;
-		struct passwd newpw;
-
-		if (   !eflg
-		    && (   (NULL == crypt_method)
-		        || (0 != strcmp (crypt_method, "NONE")))) {
-			void *arg = NULL;
-			const char *salt;
-			if (md5flg) {
-				crypt_method = "MD5";
-			}
-#ifdef USE_SHA_CRYPT
-			if (sflg) {
-				arg = &sha_rounds;
-			}
-#endif
-			salt = crypt_make_salt (crypt_method, arg);
-			cp = pw_encrypt (newpwd, salt);
-			if (NULL == cp) {
-				fprintf (stderr,
-				         _("%s: failed to crypt password with salt '%s': %s\n"),
-				         Prog, salt, strerror (errno));
-				fail_exit (1);
+		if (nlines == alloc) {
+			struct input_line *tmp;
+
+			alloc = (0 == alloc) ? 64 : alloc * 2;
+			tmp = (struct input_line *) xmalloc (alloc * sizeof (*tmp));
+			if (0 != nlines) {
+				memcpy (tmp, lines, nlines * sizeof (*tmp));
 			}
+			free (lines);
+			lines = tmp;
 		}
+		lines[nlines].line = line;
+		lines[nlines].name = xstrdup (name);
+		lines[nlines].newpwd = xstrdup (cp);
+		nlines++;
+	}
 
-		/*
-		 * Get the password file entry for this user. The user must
-		 * already exist.
-		 */
-		pw = pw_locate (name);
-		if (NULL == pw) {
-			fprintf (stderr,
-			         _("%s: line %d: user '%s' does not exist\n"), Prog,
-			         line, name);
-			errors++;
-			continue;
-		}
-		if (is_shadow_pwd) {
-			/* The shadow entry should be updated if the
-			 * passwd entry has a password set to 'x'.
-			 * But on the other hand, if there is already both
-			 * a passwd and a shadow password, it's preferable
-			 * to update both.
-			 */
-			sp = spw_locate (name);
-
-			if (   (NULL == sp)
-			    && (strcmp (pw->pw_passwd,
-			                SHADOW_PASSWD_STRING) == 0)) {
-				/* If the password is set to 'x' in
-				 * passwd, but there are no entries in
-				 * shadow, create one.
-				 */
-				newsp.sp_namp  = name;
-				/* newsp.sp_pwdp  = NULL; will be set later */
-				/* newsp.sp_lstchg= 0;    will be set later */
-				newsp.sp_min   = getdef_num ("PASS_MIN_DAYS", -1);
-				newsp.sp_max   = getdef_num ("PASS_MAX_DAYS", -1);
-				newsp.sp_warn  = getdef_num ("PASS_WARN_AGE", -1);
-				newsp.sp_inact = -1;
-				newsp.sp_expire= -1;
-				newsp.sp_flag  = SHADOW_SP_FLAG_UNSET;
-				sp = &newsp;
-			}
-		} else {
-			sp = NULL;
+	/*
+	 * Only the last password of each user is set. With PAM, each
+	 * change is done by the PAM modules, and all the lines are kept.
+	 */
+#ifdef USE_PAM
+	if (!use_pam)
+#endif				/* USE_PAM */
+	{
+		nlines = drop_superseded_lines (lines, nlines);
+
+		pass_min_days = getdef_num ("PASS_MIN_DAYS", -1);
+		pass_max_days = getdef_num ("PASS_MAX_DAYS", -1);
+		pass_warn_age = getdef_num ("PASS_WARN_AGE", -1);
+		lstchg = (long) gettime () / SCALE;
+		if (0 == lstchg) {
+			/* Better disable aging than requiring a
+			 * password change */
+			lstchg = -1;
 		}
+	}
 
-		/*
-		 * The freshly encrypted new password is merged into the
-		 * user's password file entry and the last password change
-		 * date is set to the current date.
-		 */
-		if (NULL != sp) {
-			newsp = *sp;
-			newsp.sp_pwdp = cp;
-			newsp.sp_lstchg = (long) gettime () / SCALE;
-			if (0 == newsp.sp_lstchg) {
-				/* Better disable aging than requiring a
-				 * password change */
-				newsp.sp_lstchg = -1;
-			}
+	/*
+	 * The new passwords will be encrypted in the normal fashion with
+	 * a new salt generated, unless the '-e' is given, in which case
+	 * they are assumed to already be encrypted.
+	 */
+#ifdef USE_PAM
+	if (!use_pam)
+#endif				/* USE_PAM */
+	{
+		hash = (   !eflg
+		        && (   (NULL == crypt_method)
+		            || (0 != strcmp (crypt_method, "NONE"))));
+
+		/* The clear text passwords are checked once for all */
+		if (!eflg) {
+			size_t kept = drop_blocked_lines (lines, nlines);
+
+			errors += (int) (nlines - kept);
+			nlines = kept;
 		}
+	}
+	if (hash && (0 != nlines)) {
+		void *arg = NULL;
 
-		if (   (NULL == sp)
-		    || (strcmp (pw->pw_passwd, SHADOW_PASSWD_STRING) != 0)) {
-			newpw = *pw;
-			newpw.pw_passwd = cp;
+		if (md5flg) {
+			crypt_method = "MD5";
 		}
+#ifdef USE_SHA_CRYPT
+		if (sflg) {
+			arg = &sha_rounds;
+		}
+#endif
+		jobs = (struct crypt_job *) xmalloc (nlines * sizeof (*jobs));
+		for (i = 0; i < nlines; i++) {
+			jobs[i].clear = lines[i].newpwd;
+			jobs[i].salt = xstrdup (crypt_make_salt (crypt_method,
+			                                         arg));
+			jobs[i].cipher = NULL;
+		}
+		crypt_jobs_run (jobs, nlines);
+	}
 
-		/* 
-		 * The updated password file entry is then put back and will
-		 * be written to the password file later, after all the
-		 * other entries have been updated as well.
-		 */
-		if (NULL != sp) {
-			if (spw_update (&newsp) == 0) {
-				fprintf (stderr,
-				         _("%s: line %d: failed to prepare the new %s entry '%s'\n"),
-				         Prog, line, spw_dbname (), newsp.sp_namp);
-				errors++;
-				continue;
-			}
+#ifdef USE_PAM
+	/*
+	 * With PAM, the passwords are changed by the PAM modules, in the
+	 * order of the input, with a single PAM handle.
+	 */
+	if (use_pam && (0 != nlines)) {
+		pam_jobs = (struct pam_passwd_job *)
+		           xmalloc (nlines * sizeof (*pam_jobs));
+		for (i = 0; i < nlines; i++) {
+			pam_jobs[i].name = lines[i].name;
+			pam_jobs[i].password = lines[i].newpwd;
 		}
-		if (   (NULL == sp)
-		    || (strcmp (pw->pw_passwd, SHADOW_PASSWD_STRING) != 0)) {
-			if (pw_update (&newpw) == 0) {
+		(void) do_pam_passwd_batch ("chpasswd", pam_jobs, nlines);
+	}
+#endif				/* USE_PAM */
+
+	/*
+	 * The password entry for each user will be looked up in the
+	 * appropriate file (shadow or passwd) and the password changed, in
+	 * the order of the input. The lookups use the name indexes of the
+	 * databases, which are built on the first lookup. For shadow files the last change date is
+	 * set directly, for passwd files the last change date is set in the
+	 * age only if aging information is present.
+	 */
+	for (i = 0; i < nlines; i++) {
+#ifdef USE_PAM
+		if (use_pam){
+			if (pam_jobs[i].failed) {
 				fprintf (stderr,
-				         _("%s: line %d: failed to prepare the new %s entry '%s'\n"),
-				         Prog, line, pw_dbname (), newpw.pw_name);
+				         _("%s: (line %d, user %s) password not changed\n"),
+				         Prog, lines[i].line, lines[i].name);
 				errors++;
-				continue;
 			}
-		}
+		} else
+#endif				/* USE_PAM */
+		{
+			errors += update_password (&lines[i],
+			                           (NULL != jobs) ? &jobs[i] : NULL);
 		}
 	}
 
@@ -629,12 +880,44 @@ int main (int argc, char **argv)
 	if (!use_pam)
 #endif				/* USE_PAM */
 	{
+		/*
+		 * With OPTIMISTIC_LOCKING, the databases are only locked
+		 * now. If another process changed them in the meantime,
+		 * they are read again with the locks, and the changes are
+		 * applied again.
+		 */
+		if (optimistic && !lock_files ()) {
+			optimistic = false;
+			open_files ();
+			for (i = 0; i < nlines; i++) {
+				errors += update_password (&lines[i],
+				                           (NULL != jobs) ? &jobs[i] : NULL);
+			}
+			if (0 != errors) {
+				fprintf (stderr,
+				         _("%s: error detected, changes ignored\n"),
+				         Prog);
+				fail_exit (1);
+			}
+		}
 	/* Save the changes */
 		close_files ();
 	}
 
-	nscd_flush_cache ("passwd");
-	sssd_flush_cache (SSSD_DB_PASSWD);
+	if (NULL != jobs) {
+		crypt_jobs_free (jobs, nlines);
+	}
+#ifdef USE_PAM
+	free (pam_jobs);
+#endif				/* USE_PAM */
+	for (i = 0; i < nlines; i++) {
+		free (lines[i].name);
+		strzero (lines[i].newpwd);
+		free (lines[i].newpwd);
+	}
+	free (lines);
+
+	cache_flush_defer (CACHE_DB_PASSWD);
 
 	return (0);
 }
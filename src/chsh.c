@@ -45,8 +45,7 @@
 #endif
 #include "defines.h"
 #include "getdef.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #include "prototypes.h"
 #include "pwauth.h"
 #include "pwio.h"
@@ -56,9 +55,6 @@
 /*@-exitarg@*/
 #include "exitcodes.h"
 
-#ifndef SHELLS_FILE
-#define SHELLS_FILE "/etc/shells"
-#endif
 /*
  * Global variables
  */
@@ -75,7 +71,6 @@ static bool pw_locked = false;
 static /*@noreturn@*/void fail_exit (int code);
 static /*@noreturn@*/void usage (int status);
 static void new_fields (void);
-static bool shell_is_listed (const char *);
 static bool is_restricted_shell (const char *);
 static void process_flags (int argc, char **argv);
 static void check_perms (const struct passwd *pw);
@@ -143,61 +138,6 @@ static bool is_restricted_shell (const char *sh)
 	return !shell_is_listed (sh);
 }
 
-/*
- * shell_is_listed - see if the user's login shell is listed in /etc/shells
- *
- * The /etc/shells file is read for valid names of login shells.  If the
- * /etc/shells file does not exist the user cannot set any shell unless
- * they are root.
- *
- * If getusershell() is available (Linux, *BSD, possibly others), use it
- * instead of re-implementing it.
- */
-static bool shell_is_listed (const char *sh)
-{
-	char *cp;
-	bool found = false;
-
-#ifndef HAVE_GETUSERSHELL
-	char buf[BUFSIZ];
-	FILE *fp;
-#endif
-
-#ifdef HAVE_GETUSERSHELL
-	setusershell ();
-	while ((cp = getusershell ())) {
-		if (strcmp (cp, sh) == 0) {
-			found = true;
-			break;
-		}
-	}
-	endusershell ();
-#else
-	fp = fopen (SHELLS_FILE, "r");
-	if (NULL == fp) {
-		return false;
-	}
-
-	while (fgets (buf, sizeof (buf), fp) == buf) {
-		cp = strrchr (buf, '\n');
-		if (NULL != cp) {
-			*cp = '\0';
-		}
-
-		if (buf[0] == '#') {
-			continue;
-		}
-
-		if (strcmp (buf, sh) == 0) {
-			found = true;
-			break;
-		}
-	}
-	fclose (fp);
-#endif
-	return found;
-}
-
 /*
  * process_flags - parse the command line options
  *
@@ -451,7 +391,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 	/*
 	 * This command behaves different for root and non-root users.
@@ -557,8 +497,7 @@ int main (int argc, char **argv)
 
 	SYSLOG ((LOG_INFO, "changed user '%s' shell to '%s'", user, loginsh));
 
-	nscd_flush_cache ("passwd");
-	sssd_flush_cache (SSSD_DB_PASSWD);
+	cache_flush_defer (CACHE_DB_PASSWD);
 
 	closelog ();
 	exit (E_SUCCESS);
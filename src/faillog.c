@@ -43,7 +43,9 @@
 #include <assert.h>
 #include "defines.h"
 #include "faillog.h"
+#include "getdef.h"
 #include "prototypes.h"
+#include "uidrecords.h"
 /*@-exitarg@*/
 #include "exitcodes.h"
 
@@ -57,6 +59,7 @@ static bool setmax_one (uid_t uid, short max);
 static void print (void);
 static bool reset_one (uid_t uid);
 static void reset (void);
+static void export_records (void);
 
 /*
  * Global variables
@@ -69,6 +72,11 @@ static bool has_umin = false;
 static unsigned long umax;	/* if uflg and has_umax, only display users with uid <= umax */
 static bool has_umax = false;
 static bool errors = false;
+static unsigned long keyed_min;	/* LOG_KEYED_UID_MIN */
+/* The users of the exported records, looked up with RESOLVE_THREADS */
+static /*@null@*/struct nss_resolver *resolver = NULL;
+static struct uid_keyed keyed;	/* records of the UIDs from keyed_min */
+static bool has_keyed = false;
 
 static bool aflg = false;	/* set if all users are to be printed always */
 static bool uflg = false;	/* set if user is a valid user id */
@@ -76,8 +84,11 @@ static bool tflg = false;	/* print is restricted to most recent days */
 static bool lflg = false;	/* set the locktime */
 static bool mflg = false;	/* set maximum failed login counters */
 static bool rflg = false;	/* reset the counters of login failures */
+static bool nflg = false;	/* export the names of the users */
+static enum export_format export_format = EXPORT_NONE;	/* -e */
 
 static struct stat statbuf;	/* fstat buffer for file size */
+static struct uid_records records;	/* records mapped by print () */
 
 #define	NOW	(time((time_t *) 0))
 
@@ -90,9 +101,12 @@ static /*@noreturn@*/void usage (int status)
 	                  "Options:\n"),
 	                Prog);
 	(void) fputs (_("  -a, --all                     display faillog records for all users\n"), usageout);
+	(void) fputs (_("  -e, --export FORMAT           export the non-empty faillog records, in the\n"
+	                "                                tsv or json FORMAT\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
 	(void) fputs (_("  -l, --lock-secs SEC           after failed login lock account for SEC seconds\n"), usageout);
 	(void) fputs (_("  -m, --maximum MAX             set maximum failed login counters to MAX\n"), usageout);
+	(void) fputs (_("  -n, --names                   export the names of the users (with -e)\n"), usageout);
 	(void) fputs (_("  -r, --reset                   reset the counters of login failures\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -t, --time DAYS               display faillog records more recent than DAYS\n"), usageout);
@@ -121,7 +135,17 @@ static void print_one (/*@null@*/const struct passwd *pw, bool force)
 	}
 
 	offset = (off_t) pw->pw_uid * sizeof (fl);
-	if (offset + sizeof (fl) <= statbuf.st_size) {
+	if (uid_keyed ((unsigned long) pw->pw_uid)) {
+		/* Stored by key, a missing record is cleared */
+		if (has_keyed) {
+			(void) uid_keyed_get (&keyed, (unsigned long) pw->pw_uid,
+			                      &fl);
+		} else {
+			memzero (&fl, sizeof (fl));
+		}
+	} else if (uid_records_get (&records, (unsigned long) pw->pw_uid, &fl)) {
+		/* Read from the mapped records */
+	} else if (offset + sizeof (fl) <= statbuf.st_size) {
 		/* fseeko errors are not really relevant for us. */
 		int err = fseeko (fail, offset, SEEK_SET);
 		assert (0 == err);
@@ -187,7 +211,7 @@ static void print_one (/*@null@*/const struct passwd *pw, bool force)
 static void print (void)
 {
 	if (uflg && has_umin && has_umax && (umin==umax)) {
-		print_one (getpwuid ((uid_t)umin), true);
+		print_one (timed_getpwuid ((uid_t)umin), true);
 	} else {
 		/* We only print records for existing users.
 		 * Loop based on the user database instead of reading the
@@ -195,10 +219,21 @@ static void print (void)
 		 * so except for very small ranges and large user
 		 * database, this should not be a performance issue.
 		 */
-		struct passwd *pwent;
+		const struct passwd *const *users;
+		size_t count, i;
+
+		/* The records of the selected users are mapped, so that
+		 * they are read from memory. If they cannot be mapped,
+		 * print_one () reads them from the file.
+		 */
+		(void) uid_records_map (&records, fileno (fail),
+		                        sizeof (struct faillog),
+		                        (uflg && has_umin) ? umin : 0,
+		                        (uflg && has_umax) ? umax : ULONG_MAX);
+		users = nss_passwd_list (&count);
+		for (i = 0; i < count; i++) {
+			const struct passwd *pwent = users[i];
 
-		setpwent ();
-		while ( (pwent = getpwent ()) != NULL ) {
 			if (   uflg
 			    && (   (has_umin && (pwent->pw_uid < (uid_t)umin))
 			        || (has_umax && (pwent->pw_uid > (uid_t)umax)))) {
@@ -206,8 +241,224 @@ static void print (void)
 			}
 			print_one (pwent, aflg);
 		}
-		endpwent ();
+		uid_records_unmap (&records);
+	}
+}
+
+/*
+ * Records exported with their names (-n), while the users are looked up
+ * with RESOLVE_THREADS. They are exported in their order when the batch
+ * is full.
+ */
+#define EXPORT_BATCH	64
+static struct {
+	unsigned long uids[EXPORT_BATCH];
+	struct faillog fls[EXPORT_BATCH];
+	size_t count;
+} batch;
+
+/*
+ * export_wanted - check that the faillog record fl is not empty, and not
+ *                 filtered out by the -t option
+ */
+static bool export_wanted (const struct faillog *fl)
+{
+	if (   (0 == fl->fail_cnt)
+	    && (0 == fl->fail_max)
+	    && (0 == fl->fail_time)
+	    && (0 == fl->fail_locktime)) {
+		return false;
+	}
+	return !(tflg && ((NOW - fl->fail_time) > seconds));
+}
+
+/*
+ * export_entry - export the faillog record fl of uid
+ */
+static void export_entry (unsigned long uid, const struct faillog *fl)
+{
+	struct export_record r;
+
+	export_start (&r, stdout, export_format);
+	export_num (&r, "uid", (long long) uid);
+	export_num (&r, "failures", (long long) fl->fail_cnt);
+	export_num (&r, "maximum", (long long) fl->fail_max);
+	export_num (&r, "time", (long long) fl->fail_time);
+	export_num (&r, "locktime", (long long) fl->fail_locktime);
+	export_str (&r, "line", fl->fail_line, sizeof (fl->fail_line));
+	if (nflg) {
+		const struct passwd *pw;
+		const char *name;
+
+		if (NULL != resolver) {
+			pw = resolver_wait (resolver, RESOLVE_PWUID, NULL,
+			                    (id_t) uid);
+		} else {
+			pw = nss_getpwuid ((uid_t) uid);
+		}
+		name = (NULL != pw) ? pw->pw_name : "";
+		export_str (&r, "name", name, strlen (name));
+	}
+	export_end (&r);
+}
+
+/*
+ * export_flush - export the records of the batch
+ */
+static void export_flush (void)
+{
+	size_t i;
+
+	for (i = 0; i < batch.count; i++) {
+		export_entry (batch.uids[i], &batch.fls[i]);
+	}
+	batch.count = 0;
+}
+
+/*
+ * export_record - export the faillog record of uid, unless it is empty or
+ *                 filtered out by the -t option
+ */
+static bool export_record (void *record, unsigned long uid,
+                           unused void *arg)
+{
+	const struct faillog *fl = record;
+
+	if (!export_wanted (fl)) {
+		return false;
+	}
+	if (NULL == resolver) {
+		export_entry (uid, fl);
+		return false;
+	}
+	/* The user is looked up while the next records are read */
+	(void) resolver_request (resolver, RESOLVE_PWUID, NULL, (id_t) uid);
+	batch.uids[batch.count] = uid;
+	batch.fls[batch.count] = *fl;
+	batch.count++;
+	if (EXPORT_BATCH == batch.count) {
+		export_flush ();
+	}
+	return false;
+}
+
+/*
+ * update_range - update the records of the UIDs between uid_min and
+ *                uid_max with fn
+ *
+ *	The records are read and written by blocks. If holes is false,
+ *	the missing entries are not updated.
+ *
+ *	The records stored by key (LOG_KEYED_UID_MIN) are updated up to
+ *	the maximum UID of -u, or all of them. Only their existing records
+ *	are updated.
+ *
+ *	write_error is the message reported if the records cannot be
+ *	written.
+ */
+static void update_range (uid_t uid_min, uid_t uid_max, bool holes,
+                          uid_record_fn fn, void *arg,
+                          const char *write_error)
+{
+	unsigned long uid;
+	int err = 0;
+
+	if ((unsigned long) uid_min < keyed_min) {
+		err = uid_records_update (fileno (fail), sizeof (struct faillog),
+		                          (unsigned long) uid_min,
+		                          ((unsigned long) uid_max < keyed_min)
+		                          ? (unsigned long) uid_max
+		                          : keyed_min - 1,
+		                          holes, fn, arg, &uid);
+	}
+	if ((0 == err) && has_keyed) {
+		unsigned long keyed_max = has_umax ? umax : ULONG_MAX;
+
+		if (keyed_max >= keyed_min) {
+			/* Read errors and write errors are not told apart */
+			if (uid_keyed_foreach (&keyed,
+			                       ((unsigned long) uid_min > keyed_min)
+			                       ? (unsigned long) uid_min
+			                       : keyed_min,
+			                       keyed_max, fn, arg, &uid) != 0) {
+				err = -2;
+			}
+		}
+	}
+	if (-1 == err) {
+		fprintf (stderr,
+		         _("%s: Failed to get the entry for UID %lu\n"),
+		         Prog, uid);
+		errors = true;
+	} else if (0 != err) {
+		fprintf (stderr, write_error, Prog, uid);
+		errors = true;
+	}
+}
+
+static bool reset_record (void *record, unused unsigned long uid,
+                          unused void *arg)
+{
+	struct faillog *fl = record;
+
+	if (0 == fl->fail_cnt) {
+		/* Like reset_one, do not write if the count is
+		 * already null.
+		 */
+		return false;
+	}
+	fl->fail_cnt = 0;
+	return true;
+}
+
+static bool setmax_record (void *record, unused unsigned long uid,
+                           void *arg)
+{
+	struct faillog *fl = record;
+	const short *max = arg;
+
+	if (*max == fl->fail_max) {
+		return false;
+	}
+	fl->fail_max = *max;
+	return true;
+}
+
+static bool set_locktime_record (void *record, unused unsigned long uid,
+                                 void *arg)
+{
+	struct faillog *fl = record;
+	const long *locktime = arg;
+
+	if (*locktime == fl->fail_locktime) {
+		return false;
+	}
+	fl->fail_locktime = *locktime;
+	return true;
+}
+
+/*
+ * update_keyed - update the record of uid stored by key with fn
+ *
+ *	A missing record is handled like an empty record.
+ *
+ *	This returns a boolean indicating if an error occurred. write_error
+ *	is then reported.
+ */
+static bool update_keyed (uid_t uid, uid_record_fn fn, void *arg,
+                          const char *write_error)
+{
+	struct faillog fl;
+
+	(void) uid_keyed_get (&keyed, (unsigned long) uid, &fl);
+	if (!fn (&fl, (unsigned long) uid, arg)) {
+		return false;
+	}
+	if (uid_keyed_put (&keyed, (unsigned long) uid, &fl) != 0) {
+		fprintf (stderr, write_error, Prog, (unsigned long) uid);
+		return true;
 	}
+	return false;
 }
 
 /*
@@ -220,6 +471,11 @@ static bool reset_one (uid_t uid)
 	off_t offset;
 	struct faillog fl;
 
+	if (has_keyed && uid_keyed ((unsigned long) uid)) {
+		return update_keyed (uid, reset_record, NULL,
+		                     _("%s: Failed to reset fail count for UID %lu\n"));
+	}
+
 	offset = (off_t) uid * sizeof (fl);
 	if (offset + sizeof (fl) <= statbuf.st_size) {
 		/* fseeko errors are not really relevant for us. */
@@ -297,33 +553,61 @@ static void reset (void)
 				uid = (uid_t)umin;
 			}
 
-			while (uid <= uidmax) {
-				if (reset_one (uid)) {
-					errors = true;
-				}
-				uid++;
-			}
+			update_range (uid, uidmax, false, reset_record, NULL,
+			              _("%s: Failed to reset fail count for UID %lu\n"));
 		} else {
 			/* Only reset records for existing users.
 			 */
-			struct passwd *pwent;
+			const struct passwd *const *users;
+			size_t count, i;
+
+			users = nss_passwd_list (&count);
+			for (i = 0; i < count; i++) {
+				const struct passwd *pwent = users[i];
 
-			setpwent ();
-			while ( (pwent = getpwent ()) != NULL ) {
 				if (   uflg
 				    && (   (has_umin && (pwent->pw_uid < (uid_t)umin))
-				        || (pwent->pw_uid > (uid_t)uidmax))) {
+				        || (   (pwent->pw_uid > (uid_t)uidmax)
+				            && !uid_keyed ((unsigned long) pwent->pw_uid)))) {
 					continue;
 				}
 				if (reset_one (pwent->pw_uid)) {
 					errors = true;
 				}
 			}
-			endpwent ();
 		}
 	}
 }
 
+/*
+ * export_records - export the non-empty records of the UIDs in the range
+ *                  of -u
+ *
+ *	Only the populated extents of the sparse faillog file are read,
+ *	and the records stored by key follow. The users are not looked up,
+ *	unless their names are exported (-n): the passwd database is then
+ *	enumerated once, or the users of the records are looked up with
+ *	RESOLVE_THREADS.
+ */
+static void export_records (void)
+{
+	if (nflg) {
+		resolver = resolver_start ();
+		if (NULL == resolver) {
+			size_t count;
+
+			(void) nss_passwd_list (&count);
+		}
+	}
+	update_range ((uid_t) ((uflg && has_umin) ? umin : 0),
+	              (uid_t) ((uflg && has_umax) ? umax : (uid_t) -1),
+	              false, export_record, NULL,
+	              _("%s: Failed to get the entry for UID %lu\n"));
+	export_flush ();
+	resolver_free (resolver);
+	resolver = NULL;
+}
+
 /*
  * setmax_one - Set the maximum failed login counter for one user
  *
@@ -334,6 +618,11 @@ static bool setmax_one (uid_t uid, short max)
 	off_t offset;
 	struct faillog fl;
 
+	if (has_keyed && uid_keyed ((unsigned long) uid)) {
+		return update_keyed (uid, setmax_record, &max,
+		                     _("%s: Failed to set max for UID %lu\n"));
+	}
+
 	offset = (off_t) uid * sizeof (fl);
 	if (offset + sizeof (fl) <= statbuf.st_size) {
 		/* fseeko errors are not really relevant for us. */
@@ -414,19 +703,21 @@ static void setmax (short max)
 				uidmax = (uid_t)umax;
 			}
 
-			while (uid <= uidmax) {
-				if (setmax_one (uid, max)) {
-					errors = true;
-				}
-				uid++;
-			}
+			/* The empty records only need to be written if
+			 * max is not null.
+			 */
+			update_range (uid, uidmax, 0 != max, setmax_record, &max,
+			              _("%s: Failed to set max for UID %lu\n"));
 		} else {
 			/* Only change records for existing users.
 			 */
-			struct passwd *pwent;
+			const struct passwd *const *users;
+			size_t count, i;
+
+			users = nss_passwd_list (&count);
+			for (i = 0; i < count; i++) {
+				const struct passwd *pwent = users[i];
 
-			setpwent ();
-			while ( (pwent = getpwent ()) != NULL ) {
 				if (   uflg
 				    && (   (has_umin && (pwent->pw_uid < (uid_t)umin))
 				        || (has_umax && (pwent->pw_uid > (uid_t)umax)))) {
@@ -436,7 +727,6 @@ static void setmax (short max)
 					errors = true;
 				}
 			}
-			endpwent ();
 		}
 	}
 }
@@ -451,6 +741,11 @@ static bool set_locktime_one (uid_t uid, long locktime)
 	off_t offset;
 	struct faillog fl;
 
+	if (has_keyed && uid_keyed ((unsigned long) uid)) {
+		return update_keyed (uid, set_locktime_record, &locktime,
+		                     _("%s: Failed to set locktime for UID %lu\n"));
+	}
+
 	offset = (off_t) uid * sizeof (fl);
 	if (offset + sizeof (fl) <= statbuf.st_size) {
 		/* fseeko errors are not really relevant for us. */
@@ -531,19 +826,21 @@ static void set_locktime (long locktime)
 				uidmax = (uid_t)umax;
 			}
 
-			while (uid <= uidmax) {
-				if (set_locktime_one (uid, locktime)) {
-					errors = true;
-				}
-				uid++;
-			}
+			/* The empty records only need to be written if
+			 * locktime is not null.
+			 */
+			update_range (uid, uidmax, 0 != locktime, set_locktime_record, &locktime,
+			              _("%s: Failed to set locktime for UID %lu\n"));
 		} else {
 			/* Only change records for existing users.
 			 */
-			struct passwd *pwent;
+			const struct passwd *const *users;
+			size_t count, i;
+
+			users = nss_passwd_list (&count);
+			for (i = 0; i < count; i++) {
+				const struct passwd *pwent = users[i];
 
-			setpwent ();
-			while ( (pwent = getpwent ()) != NULL ) {
 				if (   uflg
 				    && (   (has_umin && (pwent->pw_uid < (uid_t)umin))
 				        || (has_umax && (pwent->pw_uid > (uid_t)umax)))) {
@@ -553,7 +850,6 @@ static void set_locktime (long locktime)
 					errors = true;
 				}
 			}
-			endpwent ();
 		}
 	}
 }
@@ -574,27 +870,38 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 	{
 		int c;
 		static struct option long_options[] = {
 			{"all",       no_argument,       NULL, 'a'},
+			{"export",    required_argument, NULL, 'e'},
 			{"help",      no_argument,       NULL, 'h'},
 			{"lock-secs", required_argument, NULL, 'l'},
 			{"maximum",   required_argument, NULL, 'm'},
+			{"names",     no_argument,       NULL, 'n'},
 			{"reset",     no_argument,       NULL, 'r'},
 			{"root",      required_argument, NULL, 'R'},
 			{"time",      required_argument, NULL, 't'},
 			{"user",      required_argument, NULL, 'u'},
 			{NULL, 0, NULL, '\0'}
 		};
-		while ((c = getopt_long (argc, argv, "ahl:m:rR:t:u:",
+		while ((c = getopt_long (argc, argv, "ae:hl:m:nrR:t:u:",
 		                         long_options, NULL)) != -1) {
 			switch (c) {
 			case 'a':
 				aflg = true;
 				break;
+			case 'e':
+				if (!export_format_parse (optarg,
+				                          &export_format)) {
+					fprintf (stderr,
+					         _("%s: invalid export format '%s'\n"),
+					         Prog, optarg);
+					usage (E_USAGE);
+				}
+				break;
 			case 'h':
 				usage (E_SUCCESS);
 				/*@notreached@*/break;
@@ -621,6 +928,9 @@ int main (int argc, char **argv)
 				mflg = true;
 				break;
 			}
+			case 'n':
+				nflg = true;
+				break;
 			case 'r':
 				rflg = true;
 				break;
@@ -649,7 +959,7 @@ int main (int argc, char **argv)
 
 				uflg = true;
 				/* local, no need for xgetpwnam */
-				pwent = getpwnam (optarg);
+				pwent = timed_getpwnam (optarg);
 				if (NULL != pwent) {
 					umin = (unsigned long) pwent->pw_uid;
 					has_umin = true;
@@ -683,6 +993,10 @@ int main (int argc, char **argv)
 	if (tflg && (lflg || mflg || rflg)) {
 		usage (E_USAGE);
 	}
+	if (   ((EXPORT_NONE != export_format) && (lflg || mflg || rflg))
+	    || (nflg && (EXPORT_NONE == export_format))) {
+		usage (E_USAGE);
+	}
 
 	/* Open the faillog database */
 	if (lflg || mflg || rflg) {
@@ -705,6 +1019,21 @@ int main (int argc, char **argv)
 		exit (E_NOPERM);
 	}
 
+	/* The records of the high UIDs, if they are stored by key */
+	keyed_min = getdef_ulong ("LOG_KEYED_UID_MIN", ULONG_MAX);
+	if (ULONG_MAX != keyed_min) {
+		int ret = uid_keyed_open (&keyed, FAILLOG_FILE,
+		                          sizeof (struct faillog),
+		                          lflg || mflg || rflg);
+		if (ret < 0) {
+			fprintf (stderr,
+			         _("%s: Cannot open %s.keyed: %s\n"),
+			         Prog, FAILLOG_FILE, strerror (errno));
+			exit (E_NOPERM);
+		}
+		has_keyed = (1 == ret);
+	}
+
 	if (lflg) {
 		set_locktime (fail_locktime);
 	}
@@ -717,10 +1046,19 @@ int main (int argc, char **argv)
 		reset ();
 	}
 
-	if (!(lflg || mflg || rflg)) {
+	if (EXPORT_NONE != export_format) {
+		export_records ();
+	} else if (!(lflg || mflg || rflg)) {
 		print ();
 	}
 
+	if (has_keyed && (uid_keyed_close (&keyed) != 0)) {
+		fprintf (stderr,
+		         _("%s: Failed to write %s.keyed: %s\n"),
+		         Prog, FAILLOG_FILE, strerror (errno));
+		errors = true;
+	}
+
 	if (lflg || mflg || rflg) {
 		if (   (ferror (fail) != 0)
 		    || (fflush (fail) != 0)
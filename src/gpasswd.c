@@ -44,8 +44,7 @@
 #include <sys/types.h>
 #include "defines.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #include "prototypes.h"
 #ifdef SHADOWGRP
 #include "sgroupio.h"
@@ -204,7 +203,7 @@ static bool is_valid_user_list (const char *users)
 		 */
 
 		/* local, no need for xgetpwnam */
-		if (getpwnam (username) == NULL) {
+		if (timed_getpwnam (username) == NULL) {
 			fprintf (stderr, _("%s: user '%s' does not exist\n"),
 			         Prog, username);
 			is_valid = false;
@@ -248,7 +247,7 @@ static void process_flags (int argc, char **argv)
 			aflg = true;
 			user = optarg;
 			/* local, no need for xgetpwnam */
-			if (getpwnam (user) == NULL) {
+			if (timed_getpwnam (user) == NULL) {
 				fprintf (stderr,
 				         _("%s: user '%s' does not exist\n"),
 				         Prog, user);
@@ -993,7 +992,7 @@ int main (int argc, char **argv)
 	setbuf (stdout, NULL);
 	setbuf (stderr, NULL);
 
-	process_root_flag ("-Q", argc, argv);
+	process_root_flag ("-Q", false, argc, argv);
 
 #ifdef SHADOWGRP
 	is_shadowgrp = sgr_file_present ();
@@ -1201,8 +1200,7 @@ int main (int argc, char **argv)
 
 	close_files ();
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
+	cache_flush_defer (CACHE_DB_GROUP);
 
 	exit (E_SUCCESS);
 }
@@ -50,8 +50,7 @@
 #include "defines.h"
 #include "getdef.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #include "prototypes.h"
 #ifdef	SHADOWGRP
 #include "sgroupio.h"
@@ -584,7 +583,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 	prefix = process_prefix_flag ("-P", argc, argv);
 
 	OPENLOG ("groupadd");
@@ -625,8 +624,7 @@ int main (int argc, char **argv)
 	grp_update ();
 	close_files ();
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
+	cache_flush_defer (CACHE_DB_GROUP);
 
 	return E_SUCCESS;
 }
@@ -48,8 +48,8 @@
 #include <getopt.h>
 #include "defines.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "pwio.h"
+#include "cacheflush.h"
 #include "prototypes.h"
 #ifdef	SHADOWGRP
 #include "sgroupio.h"
@@ -281,23 +281,27 @@ static void open_files (void)
  */
 static void group_busy (gid_t gid)
 {
-	struct passwd *pwd;
+	const struct passwd **pwds;
+	size_t count;
 
 	/*
-	 * Nice slow linear search.
-	 */
-
-	prefix_setpwent ();
-
-	while ( ((pwd = prefix_getpwent ()) != NULL) && (pwd->pw_gid != gid) );
-
-	prefix_endpwent ();
-
-	/*
-	 * If pwd isn't NULL, it stopped because the gid's matched.
+	 * The passwd file is only read, it does not have to be locked.
 	 */
+	if (pw_open (O_RDONLY) == 0) {
+		fprintf (stderr,
+		         _("%s: cannot open %s\n"),
+		         Prog, pw_dbname ());
+		exit (E_GRP_UPDATE);
+	}
+	if (pw_locate_gid (gid, &pwds, &count) == 0) {
+		fprintf (stderr,
+		         _("%s: failed to allocate memory: %s\n"),
+		         Prog, strerror (errno));
+		exit (E_GRP_UPDATE);
+	}
 
-	if (pwd == (struct passwd *) 0) {
+	if (0 == count) {
+		(void) pw_close ();
 		return;
 	}
 
@@ -306,7 +310,7 @@ static void group_busy (gid_t gid)
 	 */
 	fprintf (stderr,
 	         _("%s: cannot remove the primary group of user '%s'\n"),
-	         Prog, pwd->pw_name);
+	         Prog, pwds[0]->pw_name);
 	exit (E_GROUP_BUSY);
 }
 
@@ -380,7 +384,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 	prefix = process_prefix_flag ("-P", argc, argv);
 
 	OPENLOG ("groupdel");
@@ -492,8 +496,7 @@ int main (int argc, char **argv)
 
 	close_files ();
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
+	cache_flush_defer (CACHE_DB_GROUP);
 
 	return E_SUCCESS;
 }
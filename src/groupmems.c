@@ -437,7 +437,7 @@ static void process_flags (int argc, char **argv)
 
 	/* local, no need for xgetpwnam */
 	if (   (NULL != adduser)
-	    && (getpwnam (adduser) == NULL)) {
+	    && (timed_getpwnam (adduser) == NULL)) {
 		fprintf (stderr, _("%s: user '%s' does not exist\n"),
 		         Prog, adduser);
 		fail_exit (EXIT_INVALID_USER);
@@ -600,7 +600,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 	OPENLOG ("groupmems");
 
@@ -50,8 +50,7 @@
 #include "defines.h"
 #include "groupio.h"
 #include "pwio.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #include "prototypes.h"
 #ifdef	SHADOWGRP
 #include "sgroupio.h"
@@ -707,32 +706,28 @@ static void open_files (void)
 
 void update_primary_groups (gid_t ogid, gid_t ngid)
 {
-	struct passwd *pwd;
-
-	prefix_setpwent ();
-	while ((pwd = prefix_getpwent ()) != NULL) {
-		if (pwd->pw_gid == ogid) {
-			const struct passwd *lpwd;
-			struct passwd npwd;
-			lpwd = pw_locate (pwd->pw_name);
-			if (NULL == lpwd) {
-				fprintf (stderr,
-				         _("%s: user '%s' does not exist in %s\n"),
-				         Prog, pwd->pw_name, pw_dbname ());
-				exit (E_GRP_UPDATE);
-			} else {
-				npwd = *lpwd;
-				npwd.pw_gid = ngid;
-				if (pw_update (&npwd) == 0) {
-					fprintf (stderr,
-					         _("%s: failed to prepare the new %s entry '%s'\n"),
-					         Prog, pw_dbname (), npwd.pw_name);
-					exit (E_GRP_UPDATE);
-				}
-			}
+	const struct passwd **pwds;
+	size_t count, i;
+
+	if (pw_locate_gid (ogid, &pwds, &count) == 0) {
+		fprintf (stderr,
+		         _("%s: failed to allocate memory: %s\n"),
+		         Prog, strerror (errno));
+		exit (E_GRP_UPDATE);
+	}
+	for (i = 0; i < count; i++) {
+		struct passwd npwd;
+
+		npwd = *pwds[i];
+		npwd.pw_gid = ngid;
+		if (pw_update (&npwd) == 0) {
+			fprintf (stderr,
+			         _("%s: failed to prepare the new %s entry '%s'\n"),
+			         Prog, pw_dbname (), npwd.pw_name);
+			exit (E_GRP_UPDATE);
 		}
 	}
-	prefix_endpwent ();
+	free (pwds);
 }
 
 /*
@@ -757,7 +752,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 	prefix = process_prefix_flag ("-P", argc, argv);
 
 	OPENLOG ("groupmod");
@@ -877,8 +872,7 @@ int main (int argc, char **argv)
 
 	close_files ();
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
+	cache_flush_defer (CACHE_DB_GROUP);
 
 	return E_SUCCESS;
 }
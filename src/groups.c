@@ -45,20 +45,75 @@
 const char *Prog;
 
 /* local function prototypes */
+static bool print_grouplist (const struct passwd *pwd);
 static void print_groups (const char *member);
 
+/*
+ * print_grouplist - print the groups of a user from the list of its GIDs
+ *
+ *	Only the names of the groups of the user are looked up. The
+ *	primary group is printed last.
+ *
+ *	It returns false if the GIDs could not be listed.
+ */
+static bool print_grouplist (const struct passwd *pwd)
+{
+	int groups = 0;
+	const struct group *grp;
+	gid_t *list;
+	size_t n, i;
+
+	list = user_grouplist (pwd->pw_name, pwd->pw_gid, &n);
+	if (NULL == list) {
+		return false;
+	}
+
+	for (i = 0; i <= n; i++) {
+		gid_t gid;
+
+		if (i < n) {
+			gid = list[i];
+			if (gid == pwd->pw_gid) {
+				continue;
+			}
+		} else {
+			gid = pwd->pw_gid;
+		}
+
+		grp = nss_getgrgid (gid);
+		if (NULL == grp) {
+			continue;
+		}
+		if (0 != groups) {
+			(void) putchar (' ');
+		}
+		groups++;
+
+		(void) printf ("%s", grp->gr_name);
+	}
+	free (list);
+
+	if (0 != groups) {
+		(void) putchar ('\n');
+	}
+	return true;
+}
+
 /*
  * print_groups - print the groups which the named user is a member of
  *
  *	print_groups() scans the groups file for the list of groups which
- *	the user is listed as being a member of.
+ *	the user is listed as being a member of, unless the groups could be
+ *	listed with user_grouplist().
  */
 static void print_groups (const char *member)
 {
 	int groups = 0;
-	struct group *grp;
+	const struct group *const *list;
+	const struct group *grp;
 	struct passwd *pwd;
 	bool flag = false;
+	size_t count, i;
 
 	pwd = getpwnam (member); /* local, no need for xgetpwnam */
 	if (NULL == pwd) {
@@ -67,8 +122,13 @@ static void print_groups (const char *member)
 		exit (EXIT_FAILURE);
 	}
 
-	setgrent ();
-	while ((grp = getgrent ()) != NULL) {
+	if (print_grouplist (pwd)) {
+		return;
+	}
+
+	list = nss_group_list (&count);
+	for (i = 0; i < count; i++) {
+		grp = list[i];
 		if (is_on_list (grp->gr_mem, member)) {
 			if (0 != groups) {
 				(void) putchar (' ');
@@ -81,11 +141,10 @@ static void print_groups (const char *member)
 			}
 		}
 	}
-	endgrent ();
 
 	/* The user may not be in the list of members of its primary group */
 	if (!flag) {
-		grp = getgrgid (pwd->pw_gid); /* local, no need for xgetgrgid */
+		grp = nss_getgrgid (pwd->pw_gid);
 		if (NULL != grp) {
 			if (0 != groups) {
 				(void) putchar (' ');
@@ -168,9 +227,9 @@ int main (int argc, char **argv)
 		 * values.
 		 */
 		if (-1 != pri_grp) {
-			struct group *gr;
-			/* local, no need for xgetgrgid */
-			gr = getgrgid (pri_grp);
+			const struct group *gr;
+
+			gr = nss_getgrgid (pri_grp);
 			if (NULL != gr) {
 				(void) printf ("%s", gr->gr_name);
 			} else {
@@ -179,13 +238,12 @@ int main (int argc, char **argv)
 		}
 
 		for (i = 0; i < ngroups; i++) {
-			struct group *gr;
+			const struct group *gr;
 			if ((0 != i) || (-1 != pri_grp)) {
 				(void) putchar (' ');
 			}
 
-			/* local, no need for xgetgrgid */
-			gr = getgrgid (groups[i]);
+			gr = nss_getgrgid (groups[i]);
 			if (NULL != gr) {
 				(void) printf ("%s", gr->gr_name);
 			} else {
@@ -44,9 +44,10 @@
 #include "commonio.h"
 #include "defines.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "getdef.h"
+#include "cacheflush.h"
 #include "prototypes.h"
+#include "pwio.h"
 
 #ifdef SHADOWGRP
 #include "sgroupio.h"
@@ -79,14 +80,35 @@ static bool is_shadow = false;
 static bool sgr_locked = false;
 #endif
 static bool gr_locked = false;
+static bool pw_opened = false;
+
+/*
+ * Results of the checks of the members which are not in the local
+ * passwd file.
+ */
+static struct check_cache users;
 /* Options */
 static bool read_only = false;
 static bool sort_mode = false;
+static bool stream_mode = false;
+static /*@null@*/const char *state_file = NULL;	/* incremental mode */
+
+/*
+ * Lines checked by the last clean run, in incremental mode.
+ * The database 0 is group, 1 is gshadow.
+ */
+static struct check_state state;
 
 /* local function prototypes */
 static void fail_exit (int status);
 static /*@noreturn@*/void usage (int status);
 static void delete_member (char **, const char *);
+static void check_user (struct check_result *r);
+static void add_members (/*@null@*/char *const *members);
+static void check_users (void);
+static bool user_exists (const char *name);
+static bool is_known (size_t db, const struct commonio_entry *ent);
+static void save_state (void);
 static void process_flags (int argc, char **argv);
 static void open_files (void);
 static void close_files (bool changed);
@@ -98,6 +120,7 @@ static int check_members (const char *groupname,
                           int *errors);
 static void check_grp_file (int *errors, bool *changed);
 #ifdef SHADOWGRP
+static int member_cmp (const void *p1, const void *p2);
 static void compare_members_lists (const char *groupname,
                                    char **members,
                                    char **other_members,
@@ -105,6 +128,7 @@ static void compare_members_lists (const char *groupname,
                                    const char *other_file);
 static void check_sgr_file (int *errors, bool *changed);
 #endif
+static void check_streams (int *errors);
 
 /*
  * fail_exit - exit with an error code after unlocking files
@@ -154,10 +178,14 @@ static /*@noreturn@*/void usage (int status)
 	                Prog);
 #endif				/* !SHADOWGRP */
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("  -i, --incremental STATE_FILE  only check the entries changed since\n"
+	                "                                the last clean run\n"), usageout);
 	(void) fputs (_("  -r, --read-only               display errors and warnings\n"
 	                "                                but do not change files\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -s, --sort                    sort entries by UID\n"), usageout);
+	(void) fputs (_("  -S, --stream                  read the files in bounded memory\n"
+	                "                                (implies --read-only)\n"), usageout);
 	(void) fputs ("\n", usageout);
 	exit (status);
 }
@@ -184,6 +212,102 @@ static void delete_member (char **list, const char *member)
 	}
 }
 
+/*
+ * check_user - check that a user exists in the name service
+ */
+static void check_user (struct check_result *r)
+{
+	struct passwd *pw;
+
+	/* local, no need for xgetpwnam, but it is thread safe */
+	pw = xgetpwnam (r->name);
+	r->exists = (NULL != pw);
+	if (NULL != pw) {
+		pw_free_packed (pw);
+	}
+}
+
+/*
+ * add_members - add the members which are not in the local passwd file
+ *               to the users to check
+ */
+static void add_members (/*@null@*/char *const *members)
+{
+	bool added;
+
+	if (NULL == members) {
+		return;
+	}
+	for (; NULL != *members; members++) {
+		if (pw_opened && (pw_locate (*members) != NULL)) {
+			continue;
+		}
+		(void) check_cache_get (&users, *members, 0, &added);
+	}
+}
+
+/*
+ * check_users - check the members of all the groups
+ *
+ *	The members which are not in the local passwd file are looked up
+ *	concurrently by CHECK_THREADS threads, since each lookup may wait
+ *	for a name service. The problems are then reported by
+ *	check_members(), in the order of the files.
+ */
+static void check_users (void)
+{
+	struct commonio_entry *ent;
+
+	for (ent = __gr_get_head (); NULL != ent; ent = ent->next) {
+		const struct group *grp = ent->eptr;
+
+		if (NULL != grp) {
+			add_members (grp->gr_mem);
+		}
+	}
+#ifdef	SHADOWGRP
+	if (is_shadow) {
+		for (ent = __sgr_get_head (); NULL != ent; ent = ent->next) {
+			const struct sgrp *sgr = ent->eptr;
+
+			if (NULL != sgr) {
+				add_members (sgr->sg_adm);
+				add_members (sgr->sg_mem);
+			}
+		}
+	}
+#endif
+
+#ifdef HAVE_GETPWNAM_R
+	check_cache_run (&users, check_user, getdef_num ("CHECK_THREADS", 1));
+#else				/* !HAVE_GETPWNAM_R */
+	check_cache_run (&users, check_user, 1);
+#endif				/* !HAVE_GETPWNAM_R */
+}
+
+/*
+ * user_exists - check if a user exists
+ *
+ *	The local passwd file is checked first, with its name index.
+ *	The other users are looked up in the name service, or in the
+ *	results of check_users().
+ */
+static bool user_exists (const char *name)
+{
+	struct check_result *r;
+	bool added;
+
+	if (pw_opened && (pw_locate (name) != NULL)) {
+		return true;
+	}
+	r = check_cache_get (&users, name, 0, &added);
+	if (!r->checked) {
+		check_user (r);
+		r->checked = true;
+	}
+	return r->exists;
+}
+
 /*
  * process_flags - parse the command line options
  *
@@ -194,22 +318,27 @@ static void process_flags (int argc, char **argv)
 	int c;
 	static struct option long_options[] = {
 		{"help",      no_argument,       NULL, 'h'},
+		{"incremental", required_argument, NULL, 'i'},
 		{"quiet",     no_argument,       NULL, 'q'},
 		{"read-only", no_argument,       NULL, 'r'},
 		{"root",      required_argument, NULL, 'R'},
 		{"sort",      no_argument,       NULL, 's'},
+		{"stream",    no_argument,       NULL, 'S'},
 		{NULL, 0, NULL, '\0'}
 	};
 
 	/*
 	 * Parse the command line arguments
 	 */
-	while ((c = getopt_long (argc, argv, "hqrR:s",
+	while ((c = getopt_long (argc, argv, "hi:qrR:sS",
 	                         long_options, NULL)) != -1) {
 		switch (c) {
 		case 'h':
 			usage (E_SUCCESS);
 			/*@notreached@*/break;
+		case 'i':
+			state_file = optarg;
+			break;
 		case 'q':
 			/* quiet - ignored for now */
 			break;
@@ -221,6 +350,10 @@ static void process_flags (int argc, char **argv)
 		case 's':
 			sort_mode = true;
 			break;
+		case 'S':
+			stream_mode = true;
+			read_only = true;
+			break;
 		default:
 			usage (E_USAGE);
 		}
@@ -230,6 +363,15 @@ static void process_flags (int argc, char **argv)
 		fprintf (stderr, _("%s: -s and -r are incompatible\n"), Prog);
 		exit (E_USAGE);
 	}
+	if (stream_mode && (NULL != state_file)) {
+		fprintf (stderr, _("%s: -S and -i are incompatible\n"), Prog);
+		exit (E_USAGE);
+	}
+	if (stream_mode && getdef_bool ("SHARDED_DATABASES")) {
+		fprintf (stderr, _("%s: -S cannot be used with %s\n"),
+		         Prog, "SHARDED_DATABASES");
+		exit (E_USAGE);
+	}
 
 	/*
 	 * Make certain we have the right number of arguments
@@ -308,6 +450,12 @@ static void open_files (void)
 		}
 		fail_exit (E_CANT_OPEN);
 	}
+	/*
+	 * The members are looked up in the local passwd file first.
+	 * It is only read, and getpwnam() is used if it cannot be
+	 * opened.
+	 */
+	pw_opened = (pw_open (O_RDONLY) != 0);
 #ifdef	SHADOWGRP
 	if (is_shadow && (sgr_open (read_only ? O_RDONLY : O_CREAT | O_RDWR) == 0)) {
 		fprintf (stderr, _("%s: cannot open %s\n"), Prog,
@@ -348,6 +496,11 @@ static void close_files (bool changed)
 #endif
 	}
 
+	if (pw_opened) {
+		(void) pw_close ();
+		pw_opened = false;
+	}
+
 	/*
 	 * Don't be anti-social - unlock the files when you're done.
 	 */
@@ -399,13 +552,13 @@ static int check_members (const char *groupname,
 {
 	int i;
 	int members_changed = 0;
+	char event[128];
 
 	/*
 	 * Make sure each member exists
 	 */
 	for (i = 0; NULL != members[i]; i++) {
-		/* local, no need for xgetpwnam */
-		if (getpwnam (members[i]) != NULL) {
+		if (user_exists (members[i])) {
 			continue;
 		}
 		/*
@@ -420,7 +573,10 @@ static int check_members (const char *groupname,
 			continue;
 		}
 
-		SYSLOG ((LOG_INFO, fmt_syslog, members[i], groupname));
+		/* The deleted members of the group are logged together */
+		(void) snprintf (event, sizeof event, fmt_syslog, "*", groupname);
+		SYSLOG_ENTRY ((LOG_INFO, event, members[i],
+		               fmt_syslog, members[i], groupname));
 		members_changed = 1;
 		delete_member (members, members[i]);
 
@@ -432,6 +588,14 @@ static int check_members (const char *groupname,
 }
 
 #ifdef SHADOWGRP
+/*
+ * member_cmp - compare two members, for qsort() and bsearch()
+ */
+static int member_cmp (const void *p1, const void *p2)
+{
+	return strcmp (*(char *const *) p1, *(char *const *) p2);
+}
+
 /*
  * compare_members_lists - make sure the list of members is contained in
  *                         another list.
@@ -448,29 +612,80 @@ static void compare_members_lists (const char *groupname,
                                    const char *file,
                                    const char *other_file)
 {
-	char **pmem, **other_pmem;
+	char **pmem;
+	char **sorted = NULL;
+	size_t n;
+
+	/*
+	 * Sort the other members, so that each member is found with a
+	 * binary search.
+	 */
+	for (n = 0; NULL != other_members[n]; n++);
+	if (n > 0) {
+		sorted = (char **) xmalloc (n * sizeof (char *));
+		memcpy (sorted, other_members, n * sizeof (char *));
+		qsort (sorted, n, sizeof (char *), member_cmp);
+	}
 
 	for (pmem = members; NULL != *pmem; pmem++) {
-		for (other_pmem = other_members; NULL != *other_pmem; other_pmem++) {
-			if (strcmp (*pmem, *other_pmem) == 0) {
-				break;
-			}
-		}
-		if (*other_pmem == NULL) {
+		if (   (NULL == sorted)
+		    || (NULL == bsearch (pmem, sorted, n, sizeof (char *),
+		                         member_cmp))) {
 			printf
 			    ("'%s' is a member of the '%s' group in %s but not in %s\n",
 			     *pmem, groupname, file, other_file);
 		}
 	}
+
+	free (sorted);
 }
 #endif				/* SHADOWGRP */
 
+/*
+ * is_known - check if the line of ent was checked by the last clean run
+ *
+ *	In incremental mode, the name and GID of these lines are not
+ *	checked again. Their duplicates and members are: they depend on
+ *	the other lines and databases.
+ */
+static bool is_known (size_t db, const struct commonio_entry *ent)
+{
+	return (NULL != state_file) && check_state_known (&state, db, ent->line);
+}
+
+/*
+ * save_state - save the lines of group and gshadow for the next
+ *              incremental run
+ */
+static void save_state (void)
+{
+	struct commonio_entry *ent;
+
+	for (ent = __gr_get_head (); NULL != ent; ent = ent->next) {
+		check_state_add (&state, 0, ent->line);
+	}
+#ifdef	SHADOWGRP
+	if (is_shadow) {
+		for (ent = __sgr_get_head (); NULL != ent; ent = ent->next) {
+			if (NULL != ent->line) {
+				check_state_add (&state, 1, ent->line);
+			}
+		}
+	}
+#endif
+	if (check_state_save (&state, state_file) != 0) {
+		fprintf (stderr,
+		         _("%s: cannot write the state file %s: %s\n"),
+		         Prog, state_file, strerror (errno));
+	}
+}
+
 /*
  * check_grp_file - check the content of the group file
  */
 static void check_grp_file (int *errors, bool *changed)
 {
-	struct commonio_entry *gre, *tgre;
+	struct commonio_entry *gre;
 	struct group *grp;
 #ifdef SHADOWGRP
 	struct sgrp *sgr;
@@ -517,8 +732,8 @@ static void check_grp_file (int *errors, bool *changed)
 			 * to try out the next list element.
 			 */
 		      delete_gr:
-			SYSLOG ((LOG_INFO, "delete group line '%s'",
-			         gre->line));
+			SYSLOG_ENTRY ((LOG_INFO, "delete group lines", gre->line,
+			               "delete group line '%s'", gre->line));
 			*changed = true;
 
 			__gr_del_entry (gre);
@@ -533,28 +748,7 @@ static void check_grp_file (int *errors, bool *changed)
 		/*
 		 * Make sure this entry has a unique name.
 		 */
-		for (tgre = __gr_get_head (); NULL != tgre; tgre = tgre->next) {
-
-			const struct group *ent = tgre->eptr;
-
-			/*
-			 * Don't check this entry
-			 */
-			if (tgre == gre) {
-				continue;
-			}
-
-			/*
-			 * Don't check invalid entries.
-			 */
-			if (NULL == ent) {
-				continue;
-			}
-
-			if (strcmp (grp->gr_name, ent->gr_name) != 0) {
-				continue;
-			}
-
+		if (__gr_has_duplicate (gre)) {
 			/*
 			 * Tell the user this entry is a duplicate of
 			 * another and ask them to delete it.
@@ -574,7 +768,7 @@ static void check_grp_file (int *errors, bool *changed)
 		/*
 		 * Check for invalid group names.  --marekm
 		 */
-		if (!is_valid_group_name (grp->gr_name)) {
+		if (!is_known (0, gre) && !is_valid_group_name (grp->gr_name)) {
 			*errors += 1;
 			printf (_("invalid group name '%s'\n"), grp->gr_name);
 		}
@@ -582,7 +776,7 @@ static void check_grp_file (int *errors, bool *changed)
 		/*
 		 * Check for invalid group ID.
 		 */
-		if (grp->gr_gid == (gid_t)-1) {
+		if (!is_known (0, gre) && (grp->gr_gid == (gid_t)-1)) {
 			printf (_("invalid group ID '%lu'\n"), (long unsigned int)grp->gr_gid);
 			*errors += 1;
 		}
@@ -630,9 +824,10 @@ static void check_grp_file (int *errors, bool *changed)
 					sg.sg_passwd = grp->gr_passwd;
 					sg.sg_adm = &empty;
 					sg.sg_mem = grp->gr_mem;
-					SYSLOG ((LOG_INFO,
-					         "add group '%s' to '%s'",
-					         grp->gr_name, sgr_file));
+					SYSLOG_ENTRY ((LOG_INFO, "add groups to gshadow",
+					               grp->gr_name,
+					               "add group '%s' to '%s'",
+					               grp->gr_name, sgr_file));
 					*changed = true;
 
 					if (sgr_update (&sg) == 0) {
@@ -682,7 +877,7 @@ static void check_grp_file (int *errors, bool *changed)
 static void check_sgr_file (int *errors, bool *changed)
 {
 	struct group *grp;
-	struct commonio_entry *sge, *tsge;
+	struct commonio_entry *sge;
 	struct sgrp *sgr;
 
 	/*
@@ -719,8 +914,8 @@ static void check_sgr_file (int *errors, bool *changed)
 			 * of the loop to try out the next list element.
 			 */
 		      delete_sg:
-			SYSLOG ((LOG_INFO, "delete shadow line '%s'",
-			         sge->line));
+			SYSLOG_ENTRY ((LOG_INFO, "delete shadow lines", sge->line,
+			               "delete shadow line '%s'", sge->line));
 			*changed = true;
 
 			__sgr_del_entry (sge);
@@ -735,28 +930,7 @@ static void check_sgr_file (int *errors, bool *changed)
 		/*
 		 * Make sure this entry has a unique name.
 		 */
-		for (tsge = __sgr_get_head (); NULL != tsge; tsge = tsge->next) {
-
-			const struct sgrp *ent = tsge->eptr;
-
-			/*
-			 * Don't check this entry
-			 */
-			if (tsge == sge) {
-				continue;
-			}
-
-			/*
-			 * Don't check invalid entries.
-			 */
-			if (NULL == ent) {
-				continue;
-			}
-
-			if (strcmp (sgr->sg_name, ent->sg_name) != 0) {
-				continue;
-			}
-
+		if (__sgr_has_duplicate (sge)) {
 			/*
 			 * Tell the user this entry is a duplicate of
 			 * another and ask them to delete it.
@@ -824,6 +998,787 @@ static void check_sgr_file (int *errors, bool *changed)
 }
 #endif				/* SHADOWGRP */
 
+/*
+ * Stream mode (--stream)
+ *
+ * The files are read twice, line by line, without loading them. The
+ * first pass adds to external sorts (see extsort.c) the names of the
+ * groups, their members (with the names of the users of passwd), and
+ * the pairs of a group and a member of group and gshadow. The sorts
+ * are merged to find the duplicates, the entries missing in the other
+ * file, the members which are not users, and the members which are not
+ * in both files. These findings are sorted by line and reported by the
+ * second pass, in the order of the files, like in the normal mode.
+ *
+ * The memory used does not depend on the size of the files. The
+ * members of the groups with duplicate names are compared with all the
+ * entries of the other file with the same name.
+ */
+
+/* Findings, in the order of their report for a line */
+#define FOUND_DUPLICATE	0	/* another entry has the same name */
+#define FOUND_NO_USER	1	/* a member is not a user */
+#define FOUND_MISSING	2	/* no entry in the other file */
+#define FOUND_COMPARE	3	/* a member is not in the other file */
+#define FOUND_NO_ADMIN	4	/* an administrator is not a user */
+#define FOUND_NO_SMEMBER	5	/* a gshadow member is not a user */
+
+/* References to a member (value of the sorts of the members) */
+#define REF_GR_MEM	0
+#define REF_SGR_ADM	1
+#define REF_SGR_MEM	2
+#define REF_LIST_BITS	2
+#define REF_INDEX_BITS	28
+#define REF_LINE_MAX	((1ULL << (64 - REF_LIST_BITS - REF_INDEX_BITS)) - 1)
+
+struct stream {
+	struct commonio_db *db;
+	const char *file;
+	struct extsort names;	/* name, line */
+	struct extsort found;	/* line (big endian), kind, index (big endian) */
+	unsigned long line;
+	struct stat sb;
+	/*@null@*/int *errors;
+};
+
+static struct stream gr_stream;
+#ifdef	SHADOWGRP
+static struct stream sgr_stream;
+#endif
+static struct extsort pw_users;	/* the users of passwd */
+static struct extsort members;	/* member, reference */
+#ifdef	SHADOWGRP
+/* The pairs of a group and a member: group '\0' member, reference */
+static struct extsort gr_pairs;
+static struct extsort sgr_pairs;
+#endif
+
+/*
+ * stream_fail - report a failure of the stream mode and exit
+ */
+static /*@noreturn@*/void stream_fail (const char *file)
+{
+	fprintf (stderr, _("%s: cannot check %s: %s\n"),
+	         Prog, file, strerror (errno));
+	fail_exit (E_CANT_OPEN);
+}
+
+/*
+ * put_be - store value in len bytes, big endian first
+ */
+static void put_be (/*@out@*/char *p, uint64_t value, int len)
+{
+	int i;
+
+	for (i = len - 1; i >= 0; i--) {
+		p[i] = (char) (value & 0xff);
+		value >>= 8;
+	}
+}
+
+static uint64_t ref_make (unsigned int list, unsigned long line, size_t index)
+{
+	if (   ((uint64_t) line > REF_LINE_MAX)
+	    || ((uint64_t) index >= (1ULL << REF_INDEX_BITS))) {
+		errno = EOVERFLOW;
+		stream_fail (gr_stream.file);
+	}
+	return   ((uint64_t) line << (REF_LIST_BITS + REF_INDEX_BITS))
+	       | ((uint64_t) list << REF_INDEX_BITS)
+	       | (uint64_t) index;
+}
+
+static unsigned int ref_list (uint64_t ref)
+{
+	return (unsigned int) (ref >> REF_INDEX_BITS)
+	       & ((1U << REF_LIST_BITS) - 1);
+}
+
+static unsigned long ref_line (uint64_t ref)
+{
+	return (unsigned long) (ref >> (REF_LIST_BITS + REF_INDEX_BITS));
+}
+
+static size_t ref_index (uint64_t ref)
+{
+	return (size_t) (ref & ((1ULL << REF_INDEX_BITS) - 1));
+}
+
+/*
+ * stream_found_add - record a finding for a line of a file
+ */
+static void stream_found_add (struct stream *st, unsigned long line,
+                              unsigned int kind, size_t index)
+{
+	char key[13];
+
+	put_be (key, line, 8);
+	key[8] = (char) kind;
+	put_be (key + 9, index, 4);
+	if (extsort_add (&st->found, key, sizeof key, 0) != 0) {
+		stream_fail (st->file);
+	}
+}
+
+/*
+ * group_members - the members of a group
+ *
+ *	Like in check_grp_file(), the groups with one member "" have no
+ *	members.
+ */
+static char *const *group_members (const struct group *grp)
+{
+	static char *const none[] = { NULL };
+
+	if (   (NULL != grp->gr_mem[0])
+	    && (NULL == grp->gr_mem[1])
+	    && ('\0' == grp->gr_mem[0][0])) {
+		return none;
+	}
+	return grp->gr_mem;
+}
+
+/*
+ * add_members_refs - first pass: add the members of a list, and their
+ *                    pairs with group if pairs is not NULL
+ */
+static int add_members_refs (const char *group, char *const *list,
+                             unsigned int kind, unsigned long line,
+                             /*@null@*/struct extsort *pairs)
+{
+	size_t i;
+
+	for (i = 0; NULL != list[i]; i++) {
+		if (extsort_add (&members, list[i], strlen (list[i]),
+		                 ref_make (kind, line, i)) != 0) {
+			return -1;
+		}
+#ifdef	SHADOWGRP
+		if (NULL != pairs) {
+			size_t glen = strlen (group);
+			size_t mlen = strlen (list[i]);
+			char *key = xmalloc (glen + 1 + mlen);
+			int ret;
+
+			memcpy (key, group, glen + 1);
+			memcpy (key + glen + 1, list[i], mlen);
+			ret = extsort_add (pairs, key, glen + 1 + mlen,
+			                   ref_make (kind, line, i));
+			free (key);
+			if (0 != ret) {
+				return -1;
+			}
+		}
+#endif
+	}
+	return 0;
+}
+
+/*
+ * stream_add_gr - first pass: add a line of group
+ */
+static int stream_add_gr (unused const char *line, const void *ent, void *arg)
+{
+	struct stream *st = arg;
+	const struct group *grp = ent;
+	struct extsort *pairs = NULL;
+
+	st->line++;
+	if (NULL == grp) {
+		return 0;
+	}
+#ifdef	SHADOWGRP
+	if (is_shadow) {
+		pairs = &gr_pairs;
+	}
+#endif
+	if (   (extsort_add (&st->names, grp->gr_name, strlen (grp->gr_name),
+	                     st->line) != 0)
+	    || (add_members_refs (grp->gr_name, group_members (grp),
+	                          REF_GR_MEM, st->line, pairs) != 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef	SHADOWGRP
+/*
+ * stream_add_sgr - first pass: add a line of gshadow
+ */
+static int stream_add_sgr (unused const char *line, const void *ent,
+                           void *arg)
+{
+	struct stream *st = arg;
+	const struct sgrp *sgr = ent;
+
+	st->line++;
+	if (NULL == sgr) {
+		return 0;
+	}
+	if (   (extsort_add (&st->names, sgr->sg_name, strlen (sgr->sg_name),
+	                     st->line) != 0)
+	    || (add_members_refs (sgr->sg_name, sgr->sg_adm,
+	                          REF_SGR_ADM, st->line, NULL) != 0)
+	    || (add_members_refs (sgr->sg_name, sgr->sg_mem,
+	                          REF_SGR_MEM, st->line, &sgr_pairs) != 0)) {
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/*
+ * stream_add_pw - first pass: add a user of passwd
+ */
+static int stream_add_pw (unused const char *line, const void *ent,
+                          unused void *arg)
+{
+	const struct passwd *pwd = ent;
+
+	if (NULL == pwd) {
+		return 0;
+	}
+	return extsort_add (&pw_users, pwd->pw_name, strlen (pwd->pw_name), 0);
+}
+
+/*
+ * stream_read - first pass over a file
+ */
+static void stream_read (struct stream *st, struct commonio_db *db,
+                         const char *file,
+                         int (*add) (const char *line, const void *ent,
+                                     void *arg))
+{
+	st->db = db;
+	st->file = file;
+	if (stat (db->filename, &st->sb) != 0) {
+		fprintf (stderr, _("%s: cannot open %s\n"), Prog, file);
+		fail_exit (E_CANT_OPEN);
+	}
+	if (   (extsort_init (&st->names, EXTSORT_MEMORY) != 0)
+	    || (extsort_init (&st->found, EXTSORT_MEMORY) != 0)
+	    || (commonio_scan_lines (db, add, st) != 0)
+	    || (extsort_sort (&st->names) != 0)) {
+		stream_fail (file);
+	}
+}
+
+/*
+ * pop_key - pop the next record of a sort if its key is key
+ */
+static bool pop_key (struct extsort *s, const char *key, size_t len,
+                     /*@out@*/uint64_t *value)
+{
+	const char *k;
+	size_t klen;
+
+	if (   (extsort_peek (s, &k, &klen, value) != 1)
+	    || (extsort_keycmp (k, klen, key, len) != 0)) {
+		return false;
+	}
+	if (extsort_pop (s) != 0) {
+		stream_fail (gr_stream.file);
+	}
+	return true;
+}
+
+/*
+ * join - merge two sorts
+ *
+ *	group is called for each key, with whether the sorts have records
+ *	with this key. It pops these records.
+ */
+static void join (struct extsort *a, struct extsort *b,
+                  void (*group) (const char *key, size_t len,
+                                 bool in_a, bool in_b))
+{
+	char *key = NULL;
+	size_t size = 0;
+
+	for (;;) {
+		const char *ka = NULL, *kb = NULL;
+		size_t la = 0, lb = 0;
+		uint64_t value;
+		bool in_a, in_b;
+		int c;
+
+		in_a = (NULL != a) && (extsort_peek (a, &ka, &la, &value) == 1);
+		in_b = (NULL != b) && (extsort_peek (b, &kb, &lb, &value) == 1);
+		if (!in_a && !in_b) {
+			break;
+		}
+		if (in_a && in_b) {
+			c = extsort_keycmp (ka, la, kb, lb);
+			in_a = (c <= 0);
+			in_b = (c >= 0);
+		}
+		if (!in_a) {
+			ka = kb;
+			la = lb;
+		}
+		/* The key is popped with the records */
+		if (la + 1 > size) {
+			free (key);
+			size = 2 * la + 1;
+			key = xmalloc (size);
+		}
+		memcpy (key, ka, la);
+		group (key, la, in_a, in_b);
+	}
+	free (key);
+}
+
+/*
+ * names_group - record the duplicates and the missing entries of a file
+ */
+static void names_group (struct stream *st, const char *name, size_t len,
+                         bool in_other)
+{
+	uint64_t line;
+	uint64_t next;
+	bool more;
+	bool dup;
+
+	if (!pop_key (&st->names, name, len, &line)) {
+		return;
+	}
+	more = pop_key (&st->names, name, len, &next);
+	dup = more;
+	for (;;) {
+		if (dup) {
+			stream_found_add (st, (unsigned long) line,
+			                  FOUND_DUPLICATE, 0);
+		}
+		if (!in_other) {
+			stream_found_add (st, (unsigned long) line,
+			                  FOUND_MISSING, 0);
+		}
+		if (!more) {
+			break;
+		}
+		line = next;
+		more = pop_key (&st->names, name, len, &next);
+	}
+}
+
+static void names_join (const char *name, size_t len,
+                        unused bool in_gr, unused bool in_sgr)
+{
+#ifdef	SHADOWGRP
+	names_group (&gr_stream, name, len, in_sgr || !is_shadow);
+	if (is_shadow) {
+		names_group (&sgr_stream, name, len, in_gr);
+	}
+#else
+	names_group (&gr_stream, name, len, true);
+#endif
+}
+
+/*
+ * ref_found_add - record a finding for the member of a reference
+ */
+static void ref_found_add (uint64_t ref, bool compare)
+{
+	switch (ref_list (ref)) {
+	case REF_GR_MEM:
+		stream_found_add (&gr_stream, ref_line (ref),
+		                  compare ? FOUND_COMPARE : FOUND_NO_USER,
+		                  ref_index (ref));
+		break;
+#ifdef	SHADOWGRP
+	case REF_SGR_ADM:
+		stream_found_add (&sgr_stream, ref_line (ref),
+		                  FOUND_NO_ADMIN, ref_index (ref));
+		break;
+	case REF_SGR_MEM:
+		stream_found_add (&sgr_stream, ref_line (ref),
+		                  compare ? FOUND_COMPARE : FOUND_NO_SMEMBER,
+		                  ref_index (ref));
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+/*
+ * members_join - record the members which are not users
+ *
+ *	The members which are not in passwd are looked up in the name
+ *	service, once for each name.
+ */
+static void members_join (const char *name, size_t len, bool in_members,
+                          bool in_users)
+{
+	uint64_t ref;
+	bool exists = in_users;
+
+	while (pop_key (&pw_users, name, len, &ref)) {
+	}
+	if (!in_members) {
+		return;
+	}
+	if (!exists) {
+		struct check_result r;
+
+		memset (&r, 0, sizeof r);
+		r.name = xmalloc (len + 1);
+		memcpy (r.name, name, len);
+		r.name[len] = '\0';
+		check_user (&r);
+		exists = r.exists;
+		free (r.name);
+	}
+	while (pop_key (&members, name, len, &ref)) {
+		if (!exists) {
+			ref_found_add (ref, false);
+		}
+	}
+}
+
+#ifdef	SHADOWGRP
+/*
+ * pairs_join - record the members of a group which are not members of
+ *              the group in the other file
+ */
+static void pairs_join (const char *key, size_t len, bool in_gr, bool in_sgr)
+{
+	uint64_t ref;
+
+	while (pop_key (&gr_pairs, key, len, &ref)) {
+		if (!in_sgr) {
+			ref_found_add (ref, true);
+		}
+	}
+	while (pop_key (&sgr_pairs, key, len, &ref)) {
+		if (!in_gr) {
+			ref_found_add (ref, true);
+		}
+	}
+}
+#endif
+
+/*
+ * found_next - pop the next finding of the current line if it is kind
+ */
+static bool found_next (struct stream *st, unsigned int kind,
+                        /*@out@*/size_t *index)
+{
+	const char *key;
+	size_t len;
+	uint64_t value;
+	char k[9];
+	int i;
+
+	put_be (k, st->line, 8);
+	k[8] = (char) kind;
+	if (   (extsort_peek (&st->found, &key, &len, &value) != 1)
+	    || (13 != len) || (memcmp (key, k, sizeof k) != 0)) {
+		return false;
+	}
+	*index = 0;
+	for (i = 9; i < 13; i++) {
+		*index = (*index << 8) | (unsigned char) key[i];
+	}
+	if (extsort_pop (&st->found) != 0) {
+		stream_fail (st->file);
+	}
+	return true;
+}
+
+/*
+ * found_drop - pop the findings of the current line which were not
+ *              reported
+ */
+static void found_drop (struct stream *st)
+{
+	const char *key;
+	size_t len;
+	uint64_t value;
+	char k[8];
+
+	put_be (k, st->line, 8);
+	while (   (extsort_peek (&st->found, &key, &len, &value) == 1)
+	       && (len >= sizeof k) && (memcmp (key, k, sizeof k) == 0)) {
+		if (extsort_pop (&st->found) != 0) {
+			stream_fail (st->file);
+		}
+	}
+}
+
+/*
+ * report_members - report the members of a list which are not users
+ *
+ *	The indexes beyond the list are ignored: the file changed since
+ *	the first pass (this is reported by stream_check()).
+ */
+static void report_members (struct stream *st, unsigned int kind,
+                            const char *groupname, char *const *list,
+                            const char *fmt_info, const char *fmt_prompt)
+{
+	size_t n;
+	size_t i;
+
+	for (n = 0; NULL != list[n]; n++);
+	while (found_next (st, kind, &i)) {
+		if (i >= n) {
+			continue;
+		}
+		*st->errors += 1;
+		printf (fmt_info, groupname, list[i]);
+		printf (fmt_prompt, list[i]);
+		(void) yes_or_no (true);
+	}
+}
+
+#ifdef	SHADOWGRP
+/*
+ * report_compare - report the members of a list which are not in the
+ *                  list of the group in the other file
+ */
+static void report_compare (struct stream *st, const char *groupname,
+                            char *const *list,
+                            const char *file, const char *other_file)
+{
+	size_t n;
+	size_t i;
+
+	for (n = 0; NULL != list[n]; n++);
+	while (found_next (st, FOUND_COMPARE, &i)) {
+		if (i < n) {
+			printf
+			    ("'%s' is a member of the '%s' group in %s but not in %s\n",
+			     list[i], groupname, file, other_file);
+		}
+	}
+}
+#endif
+
+/*
+ * check_gr_line - second pass: check a line of group
+ */
+static void check_gr_line (struct stream *st, const char *line,
+                           /*@null@*/const struct group *grp)
+{
+	char *const *mem;
+	size_t i;
+
+	if ((line[0] == '+') || (line[0] == '-')) {
+		return;
+	}
+
+	if (NULL == grp) {
+		(void) puts (_("invalid group file entry"));
+		printf (_("delete line '%s'? "), line);
+		*st->errors += 1;
+		(void) yes_or_no (true);
+		return;
+	}
+
+	if (found_next (st, FOUND_DUPLICATE, &i)) {
+		(void) puts (_("duplicate group entry"));
+		printf (_("delete line '%s'? "), line);
+		*st->errors += 1;
+		(void) yes_or_no (true);
+	}
+
+	if (!is_valid_group_name (grp->gr_name)) {
+		*st->errors += 1;
+		printf (_("invalid group name '%s'\n"), grp->gr_name);
+	}
+
+	if (grp->gr_gid == (gid_t)-1) {
+		printf (_("invalid group ID '%lu'\n"), (long unsigned int)grp->gr_gid);
+		*st->errors += 1;
+	}
+
+	mem = group_members (grp);
+	report_members (st, FOUND_NO_USER, grp->gr_name, mem,
+	                _("group %s: no user %s\n"),
+	                _("delete member '%s'? "));
+
+#ifdef	SHADOWGRP
+	if (!is_shadow) {
+		return;
+	}
+	if (found_next (st, FOUND_MISSING, &i)) {
+		printf (_("no matching group file entry in %s\n"), sgr_file);
+		printf (_("add group '%s' in %s? "), grp->gr_name, sgr_file);
+		*st->errors += 1;
+		(void) yes_or_no (true);
+		return;
+	}
+	report_compare (st, grp->gr_name, mem, grp_file, sgr_file);
+	if (strcmp (grp->gr_passwd, SHADOW_PASSWD_STRING) != 0) {
+		printf (_("group %s has an entry in %s, but its password field in %s is not set to 'x'\n"),
+		        grp->gr_name, sgr_file, grp_file);
+		*st->errors += 1;
+	}
+#endif
+}
+
+static int stream_check_gr (const char *line, const void *ent, void *arg)
+{
+	struct stream *st = arg;
+
+	st->line++;
+	check_gr_line (st, line, ent);
+	found_drop (st);
+	return 0;
+}
+
+#ifdef	SHADOWGRP
+/*
+ * check_sgr_line - second pass: check a line of gshadow
+ */
+static void check_sgr_line (struct stream *st, const char *line,
+                            /*@null@*/const struct sgrp *sgr)
+{
+	size_t i;
+
+	if (NULL == sgr) {
+		(void) puts (_("invalid shadow group file entry"));
+		printf (_("delete line '%s'? "), line);
+		*st->errors += 1;
+		(void) yes_or_no (true);
+		return;
+	}
+
+	if (found_next (st, FOUND_DUPLICATE, &i)) {
+		(void) puts (_("duplicate shadow group entry"));
+		printf (_("delete line '%s'? "), line);
+		*st->errors += 1;
+		(void) yes_or_no (true);
+	}
+
+	if (found_next (st, FOUND_MISSING, &i)) {
+		printf (_("no matching group file entry in %s\n"), grp_file);
+		printf (_("delete line '%s'? "), line);
+		*st->errors += 1;
+		(void) yes_or_no (true);
+		while (found_next (st, FOUND_COMPARE, &i)) {
+			/* Not compared without a group entry */
+		}
+	} else {
+		report_compare (st, sgr->sg_name, sgr->sg_mem,
+		                sgr_file, grp_file);
+	}
+
+	report_members (st, FOUND_NO_ADMIN, sgr->sg_name, sgr->sg_adm,
+	                _("shadow group %s: no administrative user %s\n"),
+	                _("delete administrative member '%s'? "));
+	report_members (st, FOUND_NO_SMEMBER, sgr->sg_name, sgr->sg_mem,
+	                _("shadow group %s: no user %s\n"),
+	                _("delete member '%s'? "));
+}
+
+static int stream_check_sgr (const char *line, const void *ent, void *arg)
+{
+	struct stream *st = arg;
+
+	st->line++;
+	check_sgr_line (st, line, ent);
+	found_drop (st);
+	return 0;
+}
+#endif
+
+/*
+ * stream_check - second pass over a file
+ *
+ *	A file replaced or changed since the first pass is reported: the
+ *	findings of the first pass may not match its lines.
+ */
+static void stream_check (struct stream *st,
+                          int (*check) (const char *line, const void *ent,
+                                        void *arg),
+                          int *errors)
+{
+	struct stat sb;
+
+	if (extsort_sort (&st->found) != 0) {
+		stream_fail (st->file);
+	}
+	st->line = 0;
+	st->errors = errors;
+	if (commonio_scan_lines (st->db, check, st) != 0) {
+		stream_fail (st->file);
+	}
+	extsort_free (&st->found);
+
+	if (   (stat (st->db->filename, &sb) != 0)
+	    || (sb.st_dev != st->sb.st_dev)
+	    || (sb.st_ino != st->sb.st_ino)
+	    || (sb.st_size != st->sb.st_size)
+	    || (sb.st_mtime != st->sb.st_mtime)) {
+		fprintf (stderr, _("%s: %s was changed during the check\n"),
+		         Prog, st->file);
+		*errors += 1;
+	}
+}
+
+/*
+ * check_streams - check group and gshadow in stream mode
+ *
+ *	Like in the normal mode, when passwd cannot be read, the members
+ *	are looked up in the name service.
+ */
+static void check_streams (int *errors)
+{
+	if (   (extsort_init (&pw_users, EXTSORT_MEMORY) != 0)
+	    || (extsort_init (&members, EXTSORT_MEMORY) != 0)
+#ifdef	SHADOWGRP
+	    || (extsort_init (&gr_pairs, EXTSORT_MEMORY) != 0)
+	    || (extsort_init (&sgr_pairs, EXTSORT_MEMORY) != 0)
+#endif
+	   ) {
+		stream_fail (grp_file);
+	}
+
+	stream_read (&gr_stream, __gr_get_db (), grp_file, stream_add_gr);
+#ifdef	SHADOWGRP
+	if (is_shadow) {
+		stream_read (&sgr_stream, __sgr_get_db (), sgr_file,
+		             stream_add_sgr);
+	}
+#endif
+	(void) commonio_scan_lines (__pw_get_db (), stream_add_pw, NULL);
+
+	if (   (extsort_sort (&pw_users) != 0)
+	    || (extsort_sort (&members) != 0)
+#ifdef	SHADOWGRP
+	    || (extsort_sort (&gr_pairs) != 0)
+	    || (extsort_sort (&sgr_pairs) != 0)
+#endif
+	   ) {
+		stream_fail (grp_file);
+	}
+
+#ifdef	SHADOWGRP
+	join (&gr_stream.names, is_shadow ? &sgr_stream.names : NULL,
+	      names_join);
+	join (&gr_pairs, &sgr_pairs, pairs_join);
+	extsort_free (&gr_pairs);
+	extsort_free (&sgr_pairs);
+	if (is_shadow) {
+		extsort_free (&sgr_stream.names);
+	}
+#else
+	join (&gr_stream.names, NULL, names_join);
+#endif
+	extsort_free (&gr_stream.names);
+	join (&members, &pw_users, members_join);
+	extsort_free (&members);
+	extsort_free (&pw_users);
+
+	stream_check (&gr_stream, stream_check_gr, errors);
+#ifdef	SHADOWGRP
+	if (is_shadow) {
+		stream_check (&sgr_stream, stream_check_sgr, errors);
+	}
+#endif
+}
+
 /*
  * grpck - verify group file integrity
  */
@@ -841,15 +1796,27 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 	OPENLOG ("grpck");
 
 	/* Parse the command line arguments */
 	process_flags (argc, argv);
 
+	if (stream_mode) {
+		check_streams (&errors);
+		if (0 != errors) {
+			printf (_("%s: no changes\n"), Prog);
+		}
+		return ((0 != errors) ? E_BAD_ENTRY : E_OKAY);
+	}
+
 	open_files ();
 
+	if (NULL != state_file) {
+		check_state_load (&state, state_file);
+	}
+
 	if (sort_mode) {
 		gr_sort ();
 #ifdef	SHADOWGRP
@@ -859,6 +1826,7 @@ int main (int argc, char **argv)
 		changed = true;
 #endif
 	} else {
+		check_users ();
 		check_grp_file (&errors, &changed);
 #ifdef	SHADOWGRP
 		if (is_shadow) {
@@ -867,12 +1835,16 @@ int main (int argc, char **argv)
 #endif
 	}
 
+	/* After a clean run, all the lines are known for the next run */
+	if ((NULL != state_file) && !sort_mode && (0 == errors) && !changed) {
+		save_state ();
+	}
+
 	/* Commit the change in the database if needed */
 	close_files (changed);
 
 	if (!read_only) {
-		nscd_flush_cache ("group");
-		sssd_flush_cache (SSSD_DB_GROUP);
+		cache_flush_defer (CACHE_DB_GROUP);
 	}
 
 	/*
@@ -47,8 +47,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #include "prototypes.h"
 /*@-exitarg@*/
 #include "exitcodes.h"
@@ -144,6 +143,8 @@ int main (int argc, char **argv)
 	struct group grent;
 	const struct sgrp *sg;
 	struct sgrp sgent;
+	char **orphans = NULL;
+	size_t orphans_count = 0, orphans_size = 0, i;
 
 	Prog = Basename (argv[0]);
 
@@ -151,7 +152,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 	OPENLOG ("grpconv");
 
@@ -189,18 +190,34 @@ int main (int argc, char **argv)
 		if (gr_locate (sg->sg_name) != NULL) {
 			continue;
 		}
-
-		if (sgr_remove (sg->sg_name) == 0) {
+		if (orphans_count == orphans_size) {
+			orphans_size = (0 == orphans_size) ? 64 : orphans_size * 2;
+			orphans = realloc (orphans,
+			                   orphans_size * sizeof (*orphans));
+			if (NULL == orphans) {
+				fprintf (stderr,
+				         _("%s: failed to allocate memory: %s\n"),
+				         Prog, strerror (errno));
+				fail_exit (3);
+			}
+		}
+		/* The entry is freed by sgr_remove() */
+		orphans[orphans_count] = xstrdup (sg->sg_name);
+		orphans_count++;
+	}
+	for (i = 0; i < orphans_count; i++) {
+		if (sgr_remove (orphans[i]) == 0) {
 			/*
 			 * This shouldn't happen (the entry exists) but...
 			 */
 			fprintf (stderr,
 			         _("%s: cannot remove entry '%s' from %s\n"),
-			         Prog, sg->sg_name, sgr_dbname ());
+			         Prog, orphans[i], sgr_dbname ());
 			fail_exit (3);
 		}
-		(void) sgr_rewind ();
+		free (orphans[i]);
 	}
+	free (orphans);
 
 	/*
 	 * Update shadow group passwords if non-shadow password is not "x".
@@ -273,8 +290,7 @@ int main (int argc, char **argv)
 		/* continue */
 	}
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
+	cache_flush_defer (CACHE_DB_GROUP);
 
 	return 0;
 }
@@ -34,6 +34,7 @@
 
 #ident "$Id$"
 
+#include <errno.h>
 #include <getopt.h>
 #include <lastlog.h>
 #include <pwd.h>
@@ -41,10 +42,12 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 #include <assert.h>
 #include "defines.h"
 #include "prototypes.h"
 #include "getdef.h"
+#include "uidrecords.h"
 /*@-exitarg@*/
 #include "exitcodes.h"
 
@@ -67,13 +70,22 @@ static bool has_umax = false;
 static time_t seconds;		/* that number of days in seconds */
 static time_t inverse_seconds;	/* that number of days in seconds */
 static struct stat statbuf;	/* fstat buffer for file size */
+static struct uid_records records;	/* records mapped by print () */
+static unsigned long keyed_min;	/* LOG_KEYED_UID_MIN */
+static struct uid_keyed keyed;	/* records of the UIDs from keyed_min */
+static bool has_keyed = false;
+/* The users of the records, looked up with RESOLVE_THREADS */
+static /*@null@*/struct nss_resolver *resolver = NULL;
 
 
+static bool aflg = false;	/* print only the users who logged in */
 static bool uflg = false;	/* print only an user of range of users */
 static bool tflg = false;	/* print is restricted to most recent days */
 static bool bflg = false;	/* print excludes most recent days */
 static bool Cflg = false;	/* clear record for user */
 static bool Sflg = false;	/* set record for user */
+static bool nflg = false;	/* export the names of the users */
+static enum export_format export_format = EXPORT_NONE;	/* -e */
 
 #define	NOW	(time ((time_t *) 0))
 
@@ -85,9 +97,13 @@ static /*@noreturn@*/void usage (int status)
 	                  "\n"
 	                  "Options:\n"),
 	                Prog);
+	(void) fputs (_("  -a, --active                  print only the users who logged in\n"), usageout);
 	(void) fputs (_("  -b, --before DAYS             print only lastlog records older than DAYS\n"), usageout);
 	(void) fputs (_("  -C, --clear                   clear lastlog record of an user (usable only with -u)\n"), usageout);
+	(void) fputs (_("  -e, --export FORMAT           export the records of the users who logged in,\n"
+	                "                                in the tsv or json FORMAT\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("  -n, --names                   export the names of the users (with -e)\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -S, --set                     set lastlog record to current time (usable only with -u)\n"), usageout);
 	(void) fputs (_("  -t, --time DAYS               print only lastlog records more recent than DAYS\n"), usageout);
@@ -96,26 +112,82 @@ static /*@noreturn@*/void usage (int status)
 	exit (status);
 }
 
-static void print_one (/*@null@*/const struct passwd *pw)
+/*
+ * print_entry - print the lastlog record ll of the user pw, unless it is
+ *               filtered out by the -t or -b options
+ */
+static void print_entry (const struct passwd *pw, const struct lastlog *ll)
 {
 	static bool once = false;
 	char *cp;
 	struct tm *tm;
 	time_t ll_time;
-	off_t offset;
-	struct lastlog ll;
 
 #ifdef HAVE_STRFTIME
 	char ptime[80];
 #endif
 
+	/* Filter out entries that do not match with the -t or -b options */
+	if (tflg && ((NOW - ll->ll_time) > seconds)) {
+		return;
+	}
+
+	if (bflg && ((NOW - ll->ll_time) < inverse_seconds)) {
+		return;
+	}
+
+	/* Print the header only once */
+	if (!once) {
+#ifdef HAVE_LL_HOST
+		puts (_("Username         Port     From             Latest"));
+#else
+		puts (_("Username                Port     Latest"));
+#endif
+		once = true;
+	}
+
+	ll_time = ll->ll_time;
+	tm = localtime (&ll_time);
+#ifdef HAVE_STRFTIME
+	strftime (ptime, sizeof (ptime), "%a %b %e %H:%M:%S %z %Y", tm);
+	cp = ptime;
+#else
+	cp = asctime (tm);
+	cp[24] = '\0';
+#endif
+
+	if (ll->ll_time == (time_t) 0) {
+		cp = _("**Never logged in**\0");
+	}
+
+#ifdef HAVE_LL_HOST
+	printf ("%-16s %-8.8s %-16.16s %s\n",
+	        pw->pw_name, ll->ll_line, ll->ll_host, cp);
+#else
+	printf ("%-16s\t%-8.8s %s\n",
+	        pw->pw_name, ll->ll_line, cp);
+#endif
+}
+
+static void print_one (/*@null@*/const struct passwd *pw)
+{
+	off_t offset;
+	struct lastlog ll;
+
 	if (NULL == pw) {
 		return;
 	}
 
 
 	offset = (off_t) pw->pw_uid * sizeof (ll);
-	if (offset + sizeof (ll) <= statbuf.st_size) {
+	if (uid_keyed ((unsigned long) pw->pw_uid)) {
+		/* Stored by key, or at its offset (e.g. by pam_lastlog) */
+		(void) uid_keyed_read (has_keyed ? &keyed : NULL,
+		                       fileno (lastlogfile), sizeof (ll),
+		                       (unsigned long) pw->pw_uid, &ll);
+	} else if (uid_records_get (&records, (unsigned long) pw->pw_uid, &ll)) {
+		/* Read from the mapped records */
+	} else if (offset + sizeof (ll) <= statbuf.st_size) {
 		/* fseeko errors are not really relevant for us. */
 		int err = fseeko (lastlogfile, offset, SEEK_SET);
 		assert (0 == err);
@@ -138,78 +210,445 @@ static void print_one (/*@null@*/const struct passwd *pw)
 		memzero (&ll, sizeof (ll));
 	}
 
-	/* Filter out entries that do not match with the -t or -b options */
-	if (tflg && ((NOW - ll.ll_time) > seconds)) {
-		return;
+	print_entry (pw, &ll);
+}
+
+/*
+ * record_user - the user of the record of uid
+ *
+ *	With RESOLVE_THREADS, it waits for the lookup requested while the
+ *	previous records were printed.
+ */
+static /*@null@*/const struct passwd *record_user (unsigned long uid)
+{
+	if (NULL != resolver) {
+		return resolver_wait (resolver, RESOLVE_PWUID, NULL, (id_t) uid);
 	}
+	return nss_getpwuid ((uid_t) uid);
+}
+
+/*
+ * keyed_record - check if uid has a record stored by key, which replaces
+ *                its record in the lastlog file
+ */
+static bool keyed_record (unsigned long uid)
+{
+	struct lastlog ll;
+
+	return    has_keyed
+	       && (uid >= keyed_min)
+	       && (uid_keyed_get (&keyed, uid, &ll) == 0);
+}
+
+/*
+ * print_active - print the records of the users who logged in, with a
+ *                UID between uid_min and uid_max
+ *
+ *	Only the populated extents of the sparse lastlog file are read, and
+ *	only the users of the non-empty records are looked up. The users
+ *	are printed in the order of their UIDs. The records replaced by a
+ *	record stored by key are skipped.
+ */
+static void print_active (unsigned long uid_min, unsigned long uid_max)
+{
+	struct lastlog buf[256];
+	int fd = fileno (lastlogfile);
+	off_t off, end;
 
-	if (bflg && ((NOW - ll.ll_time) < inverse_seconds)) {
+	if (uid_min >= (unsigned long) (statbuf.st_size / sizeof (buf[0]))) {
 		return;
 	}
+	off = (off_t) uid_min * sizeof (buf[0]);
+	end = statbuf.st_size;
+	if (uid_max < (unsigned long) (end / sizeof (buf[0]))) {
+		end = (off_t) (uid_max + 1) * sizeof (buf[0]);
+	}
 
-	/* Print the header only once */
-	if (!once) {
-#ifdef HAVE_LL_HOST
-		puts (_("Username         Port     From             Latest"));
-#else
-		puts (_("Username                Port     Latest"));
-#endif
-		once = true;
+	while (off < end) {
+		off_t data = off;
+		off_t hole = end;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+		data = lseek (fd, off, SEEK_DATA);
+		if (data < 0) {
+			if (ENXIO == errno) {
+				/* No data after off */
+				break;
+			}
+			/* Not supported, read everything */
+			data = off;
+		} else {
+			hole = lseek (fd, data, SEEK_HOLE);
+			if ((hole < 0) || (hole > end)) {
+				hole = end;
+			}
+			/* Start with the record including data */
+			data -= data % sizeof (buf[0]);
+		}
+#endif				/* SEEK_DATA && SEEK_HOLE */
+
+		while (data < hole) {
+			size_t len = sizeof buf;
+			ssize_t cnt;
+			size_t i, n, ahead;
+			unsigned long first = (unsigned long) (data / sizeof (buf[0]));
+
+			if ((off_t) len > end - data) {
+				len = (size_t) (end - data);
+			}
+			cnt = pread (fd, buf, len, data);
+			if ((cnt < 0) && (EINTR == errno)) {
+				continue;
+			}
+			if (cnt < 0) {
+				fprintf (stderr,
+				         _("%s: Failed to get the entry for UID %lu\n"),
+				         Prog,
+				         (unsigned long) (data / sizeof (buf[0])));
+				exit (EXIT_FAILURE);
+			}
+			n = (size_t) cnt / sizeof (buf[0]);
+			if (0 == n) {
+				/* End of file, or truncated record */
+				return;
+			}
+			for (i = 0; i < n; i++) {
+				if (keyed_record (first + i)) {
+					buf[i].ll_time = (time_t) 0;
+				}
+			}
+			ahead = 0;
+			for (i = 0; i < n; i++) {
+				const struct passwd *pw;
+
+				if (buf[i].ll_time == (time_t) 0) {
+					continue;
+				}
+				/* The next users are looked up meanwhile */
+				while (   (NULL != resolver) && (ahead < n)
+				       && (   (buf[ahead].ll_time == (time_t) 0)
+				           || resolver_request (resolver,
+				                                RESOLVE_PWUID, NULL,
+				                                (id_t) (first + ahead)))) {
+					ahead++;
+				}
+				pw = record_user (first + i);
+				if (NULL != pw) {
+					print_entry (pw, &buf[i]);
+				}
+			}
+			data += (off_t) (n * sizeof (buf[0]));
+		}
+		off = data;
 	}
+}
 
-	ll_time = ll.ll_time;
-	tm = localtime (&ll_time);
-#ifdef HAVE_STRFTIME
-	strftime (ptime, sizeof (ptime), "%a %b %e %H:%M:%S %z %Y", tm);
-	cp = ptime;
-#else
-	cp = asctime (tm);
-	cp[24] = '\0';
-#endif
+struct active_record {
+	unsigned long uid;
+	struct lastlog ll;
+};
 
-	if (ll.ll_time == (time_t) 0) {
-		cp = _("**Never logged in**\0");
+struct active_records {
+	struct active_record *recs;
+	size_t count;
+	size_t size;
+};
+
+static bool collect_active (void *record, unsigned long uid, void *arg)
+{
+	const struct lastlog *ll = record;
+	struct active_records *active = arg;
+
+	if (ll->ll_time == (time_t) 0) {
+		return false;
 	}
+	if (active->count == active->size) {
+		struct active_record *recs;
 
-#ifdef HAVE_LL_HOST
-	printf ("%-16s %-8.8s %-16.16s %s\n",
-	        pw->pw_name, ll.ll_line, ll.ll_host, cp);
-#else
-	printf ("%-16s\t%-8.8s %s\n",
-	        pw->pw_name, ll.ll_line, cp);
-#endif
+		active->size = (0 == active->size) ? 64 : active->size * 2;
+		recs = realloc (active->recs,
+		                active->size * sizeof (*active->recs));
+		if (NULL == recs) {
+			fprintf (stderr, _("%s: out of memory\n"), Prog);
+			exit (EXIT_FAILURE);
+		}
+		active->recs = recs;
+	}
+	active->recs[active->count].uid = uid;
+	active->recs[active->count].ll = *ll;
+	active->count++;
+	return false;
+}
+
+static int active_cmp (const void *p1, const void *p2)
+{
+	unsigned long uid1 = ((const struct active_record *) p1)->uid;
+	unsigned long uid2 = ((const struct active_record *) p2)->uid;
+
+	return (uid1 < uid2) ? -1 : (uid1 > uid2) ? 1 : 0;
+}
+
+/*
+ * print_active_keyed - print the records stored by key of the users who
+ *                      logged in, with a UID between uid_min and uid_max
+ *
+ *	The records are collected and sorted, so that the users are
+ *	printed in the order of their UIDs, after the users of the
+ *	lastlog file.
+ */
+static void print_active_keyed (unsigned long uid_min, unsigned long uid_max)
+{
+	struct active_records active = { NULL, 0, 0 };
+	unsigned long uid;
+	size_t i, ahead = 0;
+
+	if (!has_keyed || (uid_max < keyed_min)) {
+		return;
+	}
+	if (uid_min < keyed_min) {
+		uid_min = keyed_min;
+	}
+	if (uid_keyed_foreach (&keyed, uid_min, uid_max,
+	                       collect_active, &active, &uid) != 0) {
+		fprintf (stderr,
+		         _("%s: Failed to get the entry for UID %lu\n"),
+		         Prog, uid);
+		exit (EXIT_FAILURE);
+	}
+	qsort (active.recs, active.count, sizeof (*active.recs), active_cmp);
+	for (i = 0; i < active.count; i++) {
+		const struct passwd *pw;
+
+		/* The next users are looked up meanwhile */
+		while (   (NULL != resolver) && (ahead < active.count)
+		       && resolver_request (resolver, RESOLVE_PWUID, NULL,
+		                            (id_t) active.recs[ahead].uid)) {
+			ahead++;
+		}
+		pw = record_user (active.recs[i].uid);
+		if (NULL != pw) {
+			print_entry (pw, &active.recs[i].ll);
+		}
+	}
+	free (active.recs);
+}
+
+/*
+ * above_uid_max - check if some of the UIDs up to uid are above
+ *                 LASTLOG_UID_MAX, and not stored by key
+ */
+static bool above_uid_max (unsigned long uid, unsigned long lastlog_uid_max)
+{
+	return    (uid > lastlog_uid_max)
+	       && !uid_keyed (lastlog_uid_max + 1);
 }
 
 static void print (void)
 {
-	const struct passwd *pwent;
+	const struct passwd *const *users;
+	size_t count, i;
 	unsigned long lastlog_uid_max;
 
 	lastlog_uid_max = getdef_ulong ("LASTLOG_UID_MAX", 0xFFFFFFFFUL);
-	if (   (has_umin && umin > lastlog_uid_max)
-	    || (has_umax && umax > lastlog_uid_max)) {
+	if (   (has_umin && above_uid_max (umin, lastlog_uid_max))
+	    || (has_umax && above_uid_max (umax, lastlog_uid_max))) {
 		fprintf (stderr, _("%s: Selected uid(s) are higher than LASTLOG_UID_MAX (%lu),\n"
 				   "\tthe output might be incorrect.\n"), Prog, lastlog_uid_max);
 	}
 
-	if (uflg && has_umin && has_umax && (umin == umax)) {
-		print_one (getpwuid ((uid_t)umin));
+	if (aflg) {
+		unsigned long uid_min = (uflg && has_umin) ? umin : 0;
+		unsigned long uid_max = uflg ? (has_umax ? umax : ULONG_MAX)
+		                             : lastlog_uid_max;
+
+		/* The records stored by key follow the others */
+		print_active (uid_min, uid_max);
+		print_active_keyed (uid_min,
+		                    (uflg && has_umax) ? umax : ULONG_MAX);
+	} else if (uflg && has_umin && has_umax && (umin == umax)) {
+		print_one (timed_getpwuid ((uid_t)umin));
 	} else {
-		setpwent ();
-		while ( (pwent = getpwent ()) != NULL ) {
+		/* Map the records of the selected users, they are then
+		 * read from memory instead of with a seek and a read per
+		 * user. If they cannot be mapped, print_one () reads
+		 * them from the file.
+		 */
+		(void) uid_records_map (&records, fileno (lastlogfile),
+		                        sizeof (struct lastlog),
+		                        (uflg && has_umin) ? umin : 0,
+		                        uflg ? (has_umax ? umax : ULONG_MAX)
+		                             : lastlog_uid_max);
+		users = nss_passwd_list (&count);
+		for (i = 0; i < count; i++) {
+			const struct passwd *pwent = users[i];
+
 			if (   uflg
 			    && (   (has_umin && (pwent->pw_uid < (uid_t)umin))
 			        || (has_umax && (pwent->pw_uid > (uid_t)umax)))) {
 				continue;
-			} else if ( !uflg && pwent->pw_uid > (uid_t) lastlog_uid_max) {
+			} else if (   !uflg
+			           && (pwent->pw_uid > (uid_t) lastlog_uid_max)
+			           && !uid_keyed ((unsigned long) pwent->pw_uid)) {
 				continue;
 			}
 			print_one (pwent);
 		}
-		endpwent ();
+		uid_records_unmap (&records);
 	}
 }
 
+/*
+ * Records exported with their names (-n), while the users are looked up
+ * with RESOLVE_THREADS. They are exported in their order when the batch
+ * is full.
+ */
+#define EXPORT_BATCH	64
+static struct {
+	unsigned long uids[EXPORT_BATCH];
+	struct lastlog lls[EXPORT_BATCH];
+	size_t count;
+} batch;
+
+/*
+ * export_wanted - check that the lastlog record ll is not empty, and not
+ *                 filtered out by the -t or -b options
+ */
+static bool export_wanted (const struct lastlog *ll)
+{
+	return    (ll->ll_time != (time_t) 0)
+	       && !(tflg && ((NOW - ll->ll_time) > seconds))
+	       && !(bflg && ((NOW - ll->ll_time) < inverse_seconds));
+}
+
+/*
+ * export_entry - export the lastlog record ll of uid, unless it is empty
+ *                or filtered out by the -t or -b options
+ */
+static void export_entry (unsigned long uid, const struct lastlog *ll)
+{
+	struct export_record r;
+
+	if (!export_wanted (ll)) {
+		return;
+	}
+
+	export_start (&r, stdout, export_format);
+	export_num (&r, "uid", (long long) uid);
+	export_num (&r, "time", (long long) ll->ll_time);
+	export_str (&r, "line", ll->ll_line, sizeof (ll->ll_line));
+#ifdef HAVE_LL_HOST
+	export_str (&r, "host", ll->ll_host, sizeof (ll->ll_host));
+#endif
+	if (nflg) {
+		const struct passwd *pw = record_user (uid);
+		const char *name = (NULL != pw) ? pw->pw_name : "";
+
+		export_str (&r, "name", name, strlen (name));
+	}
+	export_end (&r);
+}
+
+/*
+ * export_flush - export the records of the batch
+ */
+static void export_flush (void)
+{
+	size_t i;
+
+	for (i = 0; i < batch.count; i++) {
+		export_entry (batch.uids[i], &batch.lls[i]);
+	}
+	batch.count = 0;
+}
+
+static bool export_record (void *record, unsigned long uid,
+                           unused void *arg)
+{
+	const struct lastlog *ll = record;
+
+	if (NULL == resolver) {
+		export_entry (uid, ll);
+		return false;
+	}
+	if (!export_wanted (ll)) {
+		return false;
+	}
+	/* The user is looked up while the next records are read */
+	(void) resolver_request (resolver, RESOLVE_PWUID, NULL, (id_t) uid);
+	batch.uids[batch.count] = uid;
+	batch.lls[batch.count] = *ll;
+	batch.count++;
+	if (EXPORT_BATCH == batch.count) {
+		export_flush ();
+	}
+	return false;
+}
+
+static bool export_unkeyed_record (void *record, unsigned long uid,
+                                   void *arg)
+{
+	if (keyed_record (uid)) {
+		return false;
+	}
+	return export_record (record, uid, arg);
+}
+
+/*
+ * export_records - export the records of the users who logged in, with
+ *                  a UID in the range of -u
+ *
+ *	Only the populated extents of the sparse lastlog file are read,
+ *	and the records stored by key follow, in the order of the keyed
+ *	file. The records of the lastlog file which they replace are
+ *	skipped. The users are not looked up, unless their names are
+ *	exported (-n): the passwd database is then enumerated once, or the
+ *	users of the records are looked up with RESOLVE_THREADS.
+ */
+static void export_records (void)
+{
+	unsigned long lastlog_uid_max;
+	unsigned long uid_min, uid_max;
+	unsigned long uid;
+
+	lastlog_uid_max = getdef_ulong ("LASTLOG_UID_MAX", 0xFFFFFFFFUL);
+	uid_min = (uflg && has_umin) ? umin : 0;
+	uid_max = uflg ? (has_umax ? umax : ULONG_MAX) : lastlog_uid_max;
+	if (nflg && (NULL == resolver)) {
+		size_t count;
+
+		(void) nss_passwd_list (&count);
+	}
+
+	/* The records stored by key follow the others */
+	if (   (uid_min <= uid_max)
+	    && (uid_records_update (fileno (lastlogfile),
+	                            sizeof (struct lastlog), uid_min, uid_max,
+	                            false, export_unkeyed_record, NULL,
+	                            &uid) != 0)) {
+		export_flush ();
+		fprintf (stderr,
+		         _("%s: Failed to get the entry for UID %lu\n"),
+		         Prog, uid);
+		exit (EXIT_FAILURE);
+	}
+
+	uid_max = (uflg && has_umax) ? umax : ULONG_MAX;
+	if (uid_min < keyed_min) {
+		uid_min = keyed_min;
+	}
+	if (   has_keyed
+	    && (uid_min <= uid_max)
+	    && (uid_keyed_foreach (&keyed, uid_min, uid_max,
+	                           export_record, NULL, &uid) != 0)) {
+		export_flush ();
+		fprintf (stderr,
+		         _("%s: Failed to get the entry for UID %lu\n"),
+		         Prog, uid);
+		exit (EXIT_FAILURE);
+	}
+	export_flush ();
+}
+
 static void update_one (/*@null@*/const struct passwd *pw)
 {
 	off_t offset;
@@ -220,11 +659,6 @@ static void update_one (/*@null@*/const struct passwd *pw)
 		return;
 	}
 
-	offset = (off_t) pw->pw_uid * sizeof (ll);
-	/* fseeko errors are not really relevant for us. */
-	err = fseeko (lastlogfile, offset, SEEK_SET);
-	assert (0 == err);
-
 	memzero (&ll, sizeof (ll));
 
 	if (Sflg) {
@@ -247,7 +681,22 @@ static void update_one (/*@null@*/const struct passwd *pw)
 	}
 #endif
 
-	if (fwrite (&ll, sizeof(ll), 1, lastlogfile) != 1) {
+	offset = (off_t) pw->pw_uid * sizeof (ll);
+	if (uid_keyed ((unsigned long) pw->pw_uid)) {
+		err = uid_keyed_put (&keyed, (unsigned long) pw->pw_uid, &ll);
+		/* The record at its offset would be used instead */
+		if ((0 == err) && (offset + sizeof (ll) <= statbuf.st_size)) {
+			err = uid_record_write (fileno (lastlogfile),
+			                        sizeof (ll),
+			                        (unsigned long) pw->pw_uid, &ll);
+		}
+	} else {
+		/* fseeko errors are not really relevant for us. */
+		err = fseeko (lastlogfile, offset, SEEK_SET);
+		assert (0 == err);
+		err = (fwrite (&ll, sizeof(ll), 1, lastlogfile) == 1) ? 0 : -1;
+	}
+	if (0 != err) {
 			fprintf (stderr,
 			         _("%s: Failed to update the entry for UID %lu\n"),
 			         Prog, (unsigned long int)pw->pw_uid);
@@ -255,37 +704,176 @@ static void update_one (/*@null@*/const struct passwd *pw)
 	}
 }
 
+static bool clear_record (void *record, unused unsigned long uid,
+                          unused void *arg)
+{
+	memzero (record, sizeof (struct lastlog));
+	return true;
+}
+
+/*
+ * clear_range - clear the records of the UIDs between uid_min and uid_max
+ *
+ *	The records of the UIDs without users are also cleared, so that
+ *	the users do not have to be enumerated. The records are turned
+ *	into a hole if the file system supports it, and removed if they
+ *	are stored by key. The records of the lastlog file are cleared
+ *	for the UIDs stored by key too, they would be used instead.
+ */
+static void clear_range (unsigned long uid_min, unsigned long uid_max)
+{
+	unsigned long uid;
+	int err = 0;
+
+#ifdef WITH_AUDIT
+	audit_logger (AUDIT_ACCT_UNLOCK, Prog,
+		"refreshing-lastlog",
+		NULL, (unsigned int) uid_min, SHADOW_AUDIT_SUCCESS);
+#endif
+	err = uid_records_clear (fileno (lastlogfile),
+	                         sizeof (struct lastlog), uid_min, uid_max,
+	                         &uid);
+	if ((0 == err) && has_keyed && (uid_max >= keyed_min)) {
+		err = uid_keyed_foreach (&keyed,
+		                         (uid_min > keyed_min) ? uid_min
+		                                               : keyed_min,
+		                         uid_max, clear_record, NULL, &uid);
+	}
+	if (0 != err) {
+		fprintf (stderr,
+		         _("%s: Failed to update the entry for UID %lu\n"),
+		         Prog, uid);
+		exit (EXIT_FAILURE);
+	}
+}
+
+static int uid_cmp (const void *p1, const void *p2)
+{
+	unsigned long uid1 = *(const unsigned long *) p1;
+	unsigned long uid2 = *(const unsigned long *) p2;
+
+	return (uid1 < uid2) ? -1 : (uid1 > uid2) ? 1 : 0;
+}
+
+/*
+ * set_range - set the records of the users selected with -u to the
+ *             current time
+ *
+ *	The users are enumerated first, and the records of consecutive
+ *	UIDs are then written at once.
+ */
+static void set_range (void)
+{
+	const struct passwd *const *users;
+	unsigned long *uids = NULL;
+	size_t nusers, count = 0, size = 0, i, j;
+	struct lastlog ll;
+
+	users = nss_passwd_list (&nusers);
+	for (i = 0; i < nusers; i++) {
+		const struct passwd *pwent = users[i];
+
+		if ((has_umin && (pwent->pw_uid < (uid_t)umin))
+			|| (has_umax && (pwent->pw_uid > (uid_t)umax))) {
+			continue;
+		}
+		if (count == size) {
+			unsigned long *new_uids;
+
+			size = (0 == size) ? 64 : size * 2;
+			new_uids = realloc (uids, size * sizeof (*uids));
+			if (NULL == new_uids) {
+				fprintf (stderr,
+				         _("%s: Out of memory. Cannot update %s.\n"),
+				         Prog, LASTLOG_FILE);
+				exit (EXIT_FAILURE);
+			}
+			uids = new_uids;
+		}
+		uids[count] = (unsigned long) pwent->pw_uid;
+		count++;
+#ifdef WITH_AUDIT
+		audit_logger (AUDIT_ACCT_UNLOCK, Prog,
+			"clearing-lastlog",
+			pwent->pw_name, (unsigned int) pwent->pw_uid, SHADOW_AUDIT_SUCCESS);
+#endif
+	}
+
+	if (0 == count) {
+		return;
+	}
+	qsort (uids, count, sizeof (*uids), uid_cmp);
+
+	memzero (&ll, sizeof (ll));
+	ll.ll_time = NOW;
+#ifdef HAVE_LL_HOST
+	strcpy (ll.ll_host, "localhost");
+#endif
+	strcpy (ll.ll_line, "lastlog");
+
+	for (i = 0; i < count; i = j) {
+		size_t n = 1;
+
+		if (uid_keyed (uids[i])) {
+			/* Stored by key, one at a time */
+			if (uid_keyed_put (&keyed, uids[i], &ll) != 0) {
+				fprintf (stderr,
+				         _("%s: Failed to update the entry for UID %lu\n"),
+				         Prog, uids[i]);
+				exit (EXIT_FAILURE);
+			}
+			j = i + 1;
+			continue;
+		}
+
+		/* Find the consecutive UIDs, several users can share a UID */
+		for (j = i + 1; j < count; j++) {
+			if (uids[j] == uids[j - 1]) {
+				continue;
+			}
+			if (uids[j] != uids[j - 1] + 1) {
+				break;
+			}
+			n++;
+		}
+		if (uid_records_fill (fileno (lastlogfile), sizeof (ll),
+		                      uids[i], n, &ll) != 0) {
+			fprintf (stderr,
+			         _("%s: Failed to update the entry for UID %lu\n"),
+			         Prog, uids[i]);
+			exit (EXIT_FAILURE);
+		}
+	}
+	free (uids);
+}
+
 static void update (void)
 {
-	const struct passwd *pwent;
 	unsigned long lastlog_uid_max;
 
 	if (!uflg) /* safety measure */
 		return;
 
 	lastlog_uid_max = getdef_ulong ("LASTLOG_UID_MAX", 0xFFFFFFFFUL);
-	if (   (has_umin && umin > lastlog_uid_max)
-	    || (has_umax && umax > lastlog_uid_max)) {
+	if (   (has_umin && above_uid_max (umin, lastlog_uid_max))
+	    || (has_umax && above_uid_max (umax, lastlog_uid_max))) {
 		fprintf (stderr, _("%s: Selected uid(s) are higher than LASTLOG_UID_MAX (%lu),\n"
 				   "\tthey will not be updated.\n"), Prog, lastlog_uid_max);
 		return;
 	}
 
 	if (has_umin && has_umax && (umin == umax)) {
-		update_one (getpwuid ((uid_t)umin));
+		update_one (timed_getpwuid ((uid_t)umin));
+	} else if (Cflg) {
+		clear_range (has_umin ? umin : 0,
+		             has_umax ? umax
+		                      : has_keyed ? ULONG_MAX : lastlog_uid_max);
 	} else {
-		setpwent ();
-		while ( (pwent = getpwent ()) != NULL ) {
-			if ((has_umin && (pwent->pw_uid < (uid_t)umin))
-				|| (has_umax && (pwent->pw_uid > (uid_t)umax))) {
-				continue;
-			}
-			update_one (pwent);
-		}
-		endpwent ();
+		set_range ();
 	}
 
-	if (fflush (lastlogfile) != 0 || fsync (fileno (lastlogfile)) != 0) {
+	if (   fflush (lastlogfile) != 0 || fsync (fileno (lastlogfile)) != 0
+	    || (has_keyed && (uid_keyed_close (&keyed) != 0))) {
 			fprintf (stderr,
 			         _("%s: Failed to update the lastlog file\n"),
 			         Prog);
@@ -305,7 +893,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 #ifdef WITH_AUDIT
 	audit_help_open ();
@@ -314,9 +902,12 @@ int main (int argc, char **argv)
 	{
 		int c;
 		static struct option const longopts[] = {
+			{"active", no_argument,       NULL, 'a'},
 			{"before", required_argument, NULL, 'b'},
 			{"clear",  no_argument,       NULL, 'C'},
+			{"export", required_argument, NULL, 'e'},
 			{"help",   no_argument,       NULL, 'h'},
+			{"names",  no_argument,       NULL, 'n'},
 			{"root",   required_argument, NULL, 'R'},
 			{"set",    no_argument,       NULL, 'S'},
 			{"time",   required_argument, NULL, 't'},
@@ -324,9 +915,12 @@ int main (int argc, char **argv)
 			{NULL, 0, NULL, '\0'}
 		};
 
-		while ((c = getopt_long (argc, argv, "b:ChR:St:u:", longopts,
+		while ((c = getopt_long (argc, argv, "ab:Ce:hnR:St:u:", longopts,
 		                         NULL)) != -1) {
 			switch (c) {
+			case 'a':
+				aflg = true;
+				break;
 			case 'b':
 			{
 				unsigned long inverse_days;
@@ -345,9 +939,21 @@ int main (int argc, char **argv)
 				Cflg = true;
 				break;
 			}
+			case 'e':
+				if (!export_format_parse (optarg,
+				                          &export_format)) {
+					fprintf (stderr,
+					         _("%s: invalid export format '%s'\n"),
+					         Prog, optarg);
+					usage (EXIT_FAILURE);
+				}
+				break;
 			case 'h':
 				usage (EXIT_SUCCESS);
 				/*@notreached@*/break;
+			case 'n':
+				nflg = true;
+				break;
 			case 'R': /* no-op, handled in process_root_flag () */
 				break;
 			case 'S':
@@ -380,7 +986,7 @@ int main (int argc, char **argv)
 				 */
 				uflg = true;
 				/* local, no need for xgetpwnam */
-				pwent = getpwnam (optarg);
+				pwent = timed_getpwnam (optarg);
 				if (NULL != pwent) {
 					umin = (unsigned long) pwent->pw_uid;
 					has_umin = true;
@@ -415,6 +1021,18 @@ int main (int argc, char **argv)
 			         Prog);
 			usage (EXIT_FAILURE);
 		}
+		if ((Cflg || Sflg) && (EXPORT_NONE != export_format)) {
+			fprintf (stderr,
+			         _("%s: Options -C and -S cannot be used together with option -e\n"),
+			         Prog);
+			usage (EXIT_FAILURE);
+		}
+		if (nflg && (EXPORT_NONE == export_format)) {
+			fprintf (stderr,
+			         _("%s: Option -n requires option -e\n"),
+			         Prog);
+			usage (EXIT_FAILURE);
+		}
 		if ((Cflg || Sflg) && !uflg) {
 			fprintf (stderr,
 			         _("%s: Options -C and -S require option -u to specify the user\n"),
@@ -437,10 +1055,38 @@ int main (int argc, char **argv)
 		exit (EXIT_FAILURE);
 	}
 
-	if (Cflg || Sflg)
+	/* The records of the high UIDs, if they are stored by key */
+	keyed_min = getdef_ulong ("LOG_KEYED_UID_MIN", ULONG_MAX);
+	if (ULONG_MAX != keyed_min) {
+		int ret = uid_keyed_open (&keyed, LASTLOG_FILE,
+		                          sizeof (struct lastlog),
+		                          Cflg || Sflg);
+		if (ret < 0) {
+			fprintf (stderr,
+			         _("%s: Cannot open %s.keyed: %s\n"),
+			         Prog, LASTLOG_FILE, strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+		has_keyed = (1 == ret);
+	}
+
+	if (Cflg || Sflg) {
 		update ();
-	else
-		print ();
+	} else {
+		/* The users of the records are looked up concurrently */
+		if ((EXPORT_NONE != export_format) ? nflg : aflg) {
+			resolver = resolver_start ();
+		}
+		if (EXPORT_NONE != export_format) {
+			export_records ();
+		} else {
+			print ();
+		}
+		resolver_free (resolver);
+		if (has_keyed) {
+			(void) uid_keyed_close (&keyed);
+		}
+	}
 
 	(void) fclose (lastlogfile);
 
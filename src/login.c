@@ -51,6 +51,8 @@
 #include "getdef.h"
 #include "prototypes.h"
 #include "pwauth.h"
+#include "timing.h"
+#include "uidrecords.h"
 /*@-exitarg@*/
 #include "exitcodes.h"
 
@@ -467,9 +469,15 @@ static /*@observer@*/const char *get_failent_user (/*@returned@*/const char *use
 	bool log_unkfail_enab = getdef_bool("LOG_UNKFAIL_ENAB");
 
 	if ((NULL != user) && ('\0' != user[0])) {
-		if (   log_unkfail_enab
-		    || (getpwnam (user) != NULL)) {
+		if (log_unkfail_enab) {
 			failent_user = user;
+		} else {
+			struct passwd *pw = cred_getpwnam (user);
+
+			if (NULL != pw) {
+				failent_user = user;
+				pw_free (pw);
+			}
 		}
 	}
 
@@ -550,6 +558,7 @@ int main (int argc, char **argv)
 	struct passwd *pwd = NULL;
 	char **envp = environ;
 	const char *failent_user;
+	struct timespec start;
 #ifdef USE_UTMPX
 	/*@null@*/struct utmpx *utent;
 #else
@@ -567,11 +576,15 @@ int main (int argc, char **argv)
 	 * Some quick initialization.
 	 */
 
+	timing_begin ();
+
 	sanitize_env ();
 
-	(void) setlocale (LC_ALL, "");
-	(void) bindtextdomain (PACKAGE, LOCALEDIR);
-	(void) textdomain (PACKAGE);
+	/*
+	 * The locale is loaded with the first message (see nls.c), or
+	 * before the user is prompted.
+	 */
+	nls_defer (LOCALEDIR);
 
 	initenv ();
 
@@ -727,7 +740,9 @@ int main (int argc, char **argv)
 	retries = getdef_unum ("LOGIN_RETRIES", RETRIES);
 
 #ifdef USE_PAM
+	timing_start (&start);
 	retcode = pam_start ("login", username, &conv, &pamh);
+	timing_stop (TIMING_PAM_START, &start, 0, 0);
 	if (retcode != PAM_SUCCESS) {
 		fprintf (stderr,
 		         _("login: PAM Failure, aborting: %s\n"),
@@ -800,7 +815,9 @@ int main (int argc, char **argv)
 			}
 #endif
 
+			timing_start (&start);
 			retcode = pam_authenticate (pamh, 0);
+			timing_stop (TIMING_PAM_AUTH, &start, 0, 0);
 
 			get_pam_user (&pam_user);
 			failent_user = get_failent_user (pam_user);
@@ -874,15 +891,22 @@ int main (int argc, char **argv)
 	}
 
 	/* Check the account validity */
+	timing_start (&start);
 	retcode = pam_acct_mgmt (pamh, 0);
 	if (retcode == PAM_NEW_AUTHTOK_REQD) {
 		retcode = pam_chauthtok (pamh, PAM_CHANGE_EXPIRED_AUTHTOK);
 	}
+	timing_stop (TIMING_PAM_ACCT, &start, 0, 0);
 	PAM_FAIL_CHECK;
 
+	/* The account may have been changed during the authentication */
+	cred_invalidate ();
+
 	/* Open the PAM session */
 	get_pam_user (&pam_user);
+	timing_start (&start);
 	retcode = pam_open_session (pamh, hushed (pam_user) ? PAM_SILENT : 0);
+	timing_stop (TIMING_PAM_SESSION, &start, 0, 0);
 	PAM_FAIL_CHECK;
 
 	/* Grab the user information out of the password file for future usage
@@ -898,7 +922,9 @@ int main (int argc, char **argv)
 	username = xstrdup (pam_user);
 	failent_user = get_failent_user (username);
 
-	pwd = xgetpwnam (username);
+	timing_start (&start);
+	pwd = cred_getpwnam (username);
+	timing_stop (TIMING_NSS, &start, 0, 0);
 	if (NULL == pwd) {
 		SYSLOG ((LOG_ERR, "cannot find user %s", failent_user));
 		fprintf (stderr,
@@ -915,7 +941,9 @@ int main (int argc, char **argv)
 		exit (1);
 	}
 
+	timing_start (&start);
 	retcode = pam_setcred (pamh, PAM_ESTABLISH_CRED);
+	timing_stop (TIMING_PAM_SESSION, &start, 0, 0);
 	PAM_FAIL_CHECK;
 	/* NOTE: If pam_setcred changes PAM_USER, this will not be taken
 	 * into account.
@@ -962,7 +990,9 @@ int main (int argc, char **argv)
 		/* Get the username to be used to log failures */
 		failent_user = get_failent_user (username);
 
-		pwd = xgetpwnam (username);
+		timing_start (&start);
+		pwd = cred_getpwnam (username);
+		timing_stop (TIMING_NSS, &start, 0, 0);
 		if (NULL == pwd) {
 			preauth_flag = false;
 			failed = true;
@@ -981,7 +1011,7 @@ int main (int argc, char **argv)
 		}
 
 		if (strcmp (user_passwd, SHADOW_PASSWD_STRING) == 0) {
-			spwd = xgetspnam (username);
+			spwd = cred_getspnam (username);
 			if (NULL != spwd) {
 				user_passwd = spwd->sp_pwdp;
 			} else {
@@ -1030,13 +1060,18 @@ int main (int argc, char **argv)
 			         username, fromhost));
 			failed = true;
 		}
-		if (   (NULL != pwd)
-		    && getdef_bool ("FAILLOG_ENAB")
-		    && !failcheck (pwd->pw_uid, &faillog, failed)) {
-			SYSLOG ((LOG_CRIT,
-			         "exceeded failure limit for '%s' %s",
-			         username, fromhost));
-			failed = true;
+		if ((NULL != pwd) && getdef_bool ("FAILLOG_ENAB")) {
+			bool ok;
+
+			timing_start (&start);
+			ok = failcheck (pwd->pw_uid, &faillog, failed);
+			timing_stop (TIMING_FAILLOG, &start, 0, 0);
+			if (!ok) {
+				SYSLOG ((LOG_CRIT,
+				         "exceeded failure limit for '%s' %s",
+				         username, fromhost));
+				failed = true;
+			}
 		}
 		if (!failed) {
 			break;
@@ -1163,9 +1198,12 @@ int main (int argc, char **argv)
 
 #ifndef USE_PAM			/* pam_lastlog handles this */
 	if (   getdef_bool ("LASTLOG_ENAB")
-	    && pwd->pw_uid <= (uid_t) getdef_ulong ("LASTLOG_UID_MAX", 0xFFFFFFFFUL)) {
+	    && (   (pwd->pw_uid <= (uid_t) getdef_ulong ("LASTLOG_UID_MAX", 0xFFFFFFFFUL))
+	        || uid_keyed ((unsigned long) pwd->pw_uid))) {
 		/* give last login and log this one */
+		timing_start (&start);
 		dolastlog (&ll, pwd, tty, hostname);
+		timing_stop (TIMING_LASTLOG, &start, 0, 0);
 	}
 #endif
 
@@ -1177,13 +1215,11 @@ int main (int argc, char **argv)
 	if (NULL != spwd) {		/* check for age of password */
 		if (expire (pwd, spwd)) {
 			/* The user updated her password, get the new
-			 * entries.
-			 * Use the x variants because we need to keep the
-			 * entry for a long time, and there might be other
-			 * getxxyyy in between.
+			 * entries. The cached entries are outdated.
 			 */
+			cred_invalidate ();
 			pw_free (pwd);
-			pwd = xgetpwnam (username);
+			pwd = cred_getpwnam (username);
 			if (NULL == pwd) {
 				SYSLOG ((LOG_ERR,
 				         "cannot find user %s after update of expired password",
@@ -1191,10 +1227,12 @@ int main (int argc, char **argv)
 				exit (1);
 			}
 			spw_free (spwd);
-			spwd = xgetspnam (username);
+			spwd = cred_getspnam (username);
 		}
 	}
+	timing_start (&start);
 	setup_limits (pwd);	/* nice, ulimit etc. */
+	timing_stop (TIMING_LIMITS, &start, 0, 0);
 #endif				/* ! USE_PAM */
 	chown_tty (pwd);
 
@@ -1216,6 +1254,7 @@ int main (int argc, char **argv)
 		 * parent - wait for child to finish, then cleanup
 		 * session
 		 */
+		timing_reset ();	/* the child reports the startup */
 		wait (NULL);
 		PAM_END;
 		exit (0);
@@ -1235,7 +1274,9 @@ int main (int argc, char **argv)
 	 * The utmp entry needs to be updated to indicate the new status
 	 * of the session, the new PID and SID.
 	 */
+	timing_start (&start);
 	update_utmp (username, tty, hostname, utent);
+	timing_stop (TIMING_UTMP, &start, 0, 0);
 
 	/* The pwd and spwd entries for the user have been copied.
 	 *
@@ -1261,7 +1302,9 @@ int main (int argc, char **argv)
 		exit (1);
 	}
 
+	timing_start (&start);
 	setup_env (pwd);	/* set env vars, cd to the home dir */
+	timing_stop (TIMING_ENV, &start, 0, 0);
 
 #ifdef USE_PAM
 	{
@@ -1275,9 +1318,7 @@ int main (int argc, char **argv)
 	}
 #endif
 
-	(void) setlocale (LC_ALL, "");
-	(void) bindtextdomain (PACKAGE, LOCALEDIR);
-	(void) textdomain (PACKAGE);
+	nls_load ();
 
 	if (!hushed (username)) {
 		addenv ("HUSHLOGIN=FALSE", NULL);
@@ -1300,7 +1341,8 @@ int main (int argc, char **argv)
 			}
 		}
 		if (   getdef_bool ("LASTLOG_ENAB")
-		    && pwd->pw_uid <= (uid_t) getdef_ulong ("LASTLOG_UID_MAX", 0xFFFFFFFFUL)
+		    && (   (pwd->pw_uid <= (uid_t) getdef_ulong ("LASTLOG_UID_MAX", 0xFFFFFFFFUL))
+		        || uid_keyed ((unsigned long) pwd->pw_uid))
 		    && (ll.ll_time != 0)) {
 			time_t ll_time = ll.ll_time;
 
@@ -1343,6 +1385,7 @@ int main (int argc, char **argv)
 	} else if (getdef_bool ("LOG_OK_LOGINS")) {
 		SYSLOG ((LOG_INFO, "'%s' logged in %s", username, fromhost));
 	}
+	timing_exec ();
 	closelog ();
 	tmp = getdef_str ("FAKE_SHELL");
 	if (NULL != tmp) {
@@ -25,6 +25,7 @@
 #ident "$Id$"
 
 #include "prototypes.h"
+#include "accesstab.h"
     /*
      * This module implements a simple but effective form of login access
      * control based on login names and on host (or domain) names, internet
@@ -62,115 +63,112 @@
 #define TABLE	"/etc/login.access"
 #endif
 
-/* Delimiters for fields and for lists of users, ttys or hosts. */
-static char fs[] = ":";		/* field separator */
-static char sep[] = ", \t";	/* list-element separator */
+/* Fields of the rules, and delimiters for lists of users, ttys or hosts. */
+#define	FIELD_PERM	0	/* permission field */
+#define	FIELD_USERS	1	/* list of login names */
+#define	FIELD_FROMS	2	/* list of terminals or hosts */
+#define	FIELD_COUNT	3
+static struct access_table table = { TABLE, ", \t" };
 
-static bool list_match (char *list, const char *item, bool (*match_fn) (const char *, const char *));
+static bool list_match (char *const *tok, const char *item, bool (*match_fn) (const char *, const char *));
 static bool user_match (const char *tok, const char *string);
 static bool from_match (const char *tok, const char *string);
 static bool string_match (const char *tok, const char *string);
 static const char *resolve_hostname (const char *string);
 
+/* check_rules - report the bad rules of a new table, and ignore them */
+static void check_rules (void)
+{
+	size_t i;
+
+	for (i = 0; i < table.count; i++) {
+		struct access_rule *rule = &table.rules[i];
+		const char *perm;
+
+		if (rule->count != FIELD_COUNT) {
+			SYSLOG ((LOG_ERR,
+				 "%s: line %d: bad field count",
+				 TABLE, rule->lineno));
+			rule->ignored = true;
+			continue;
+		}
+		perm = rule->fields[FIELD_PERM].tokens[0];
+		if (   (rule->fields[FIELD_PERM].count != 1)
+		    || ((perm[0] != '+') && (perm[0] != '-'))) {
+			SYSLOG ((LOG_ERR,
+				 "%s: line %d: bad first field",
+				 TABLE, rule->lineno));
+			rule->ignored = true;
+		}
+	}
+}
+
 /* login_access - match username/group and host/tty with access control file */
 int login_access (const char *user, const char *from)
 {
-	FILE *fp;
-	char line[BUFSIZ];
-	char *perm;		/* becomes permission field */
-	char *users;		/* becomes list of login names */
-	char *froms;		/* becomes list of terminals or hosts */
-	bool match = false;
+	size_t i;
 
 	/*
-	 * Process the table one line at a time and stop at the first match.
-	 * Blank lines and lines that begin with a '#' character are ignored.
-	 * Non-comment lines are broken at the ':' character. All fields are
+	 * Process the rules of the table and stop at the first match. The
+	 * table is only parsed again when the file changed. All fields are
 	 * mandatory. The first field should be a "+" or "-" character. A
 	 * non-existing table means no access control.
 	 */
-	fp = fopen (TABLE, "r");
-	if (NULL != fp) {
-		int lineno = 0;	/* for diagnostics */
-		while (   !match
-		       && (fgets (line, (int) sizeof (line), fp) == line)) {
-			int end;
-			lineno++;
-			end = (int) strlen (line) - 1;
-			if (line[end] != '\n') {
-				SYSLOG ((LOG_ERR,
-					 "%s: line %d: missing newline or line too long",
-					 TABLE, lineno));
-				continue;
-			}
-			if (line[0] == '#') {
-				continue;	/* comment line */
-			}
-			while (end > 0 && isspace (line[end - 1])) {
-				end--;
-			}
-			line[end] = '\0';	/* strip trailing whitespace */
-			if (line[0] == '\0') {	/* skip blank lines */
-				continue;
-			}
-			if (   ((perm = strtok (line, fs)) == NULL)
-			    || ((users = strtok ((char *) 0, fs)) == NULL)
-			    || ((froms = strtok ((char *) 0, fs)) == NULL)
-			    || (strtok ((char *) 0, fs) != NULL)) {
-				SYSLOG ((LOG_ERR,
-					 "%s: line %d: bad field count",
-					 TABLE, lineno));
-				continue;
-			}
-			if (perm[0] != '+' && perm[0] != '-') {
-				SYSLOG ((LOG_ERR,
-					 "%s: line %d: bad first field",
-					 TABLE, lineno));
-				continue;
-			}
-			match = (   list_match (froms, from, from_match)
-			         && list_match (users, user, user_match));
+	switch (access_table_load (&table)) {
+	case -1:
+		if (table.err != ENOENT) {
+			SYSLOG ((LOG_ERR, "cannot open %s: %s",
+			         TABLE, strerror (table.err)));
 		}
-		(void) fclose (fp);
-	} else if (errno != ENOENT) {
-		int err = errno;
-		SYSLOG ((LOG_ERR, "cannot open %s: %s", TABLE, strerror (err)));
+		return 1;
+	case 1:
+		check_rules ();
+		break;
+	default:
+		break;
 	}
-	return (!match || (line[0] == '+'))?1:0;
+
+	for (i = 0; i < table.count; i++) {
+		const struct access_rule *rule = &table.rules[i];
+
+		if (rule->ignored) {
+			continue;
+		}
+		if (   list_match (rule->fields[FIELD_FROMS].tokens, from, from_match)
+		    && list_match (rule->fields[FIELD_USERS].tokens, user, user_match)) {
+			return (rule->fields[FIELD_PERM].tokens[0][0] == '+')?1:0;
+		}
+	}
+	return 1;
 }
 
 /* list_match - match an item against a list of tokens with exceptions */
-static bool list_match (char *list, const char *item, bool (*match_fn) (const char *, const char*))
+static bool list_match (char *const *tok, const char *item, bool (*match_fn) (const char *, const char*))
 {
-	char *tok;
-	bool match = false;
-
 	/*
 	 * Process tokens one at a time. We have exhausted all possible matches
 	 * when we reach an "EXCEPT" token or the end of the list. If we do find
 	 * a match, look for an "EXCEPT" list and recurse to determine whether
 	 * the match is affected by any exceptions.
 	 */
-	for (tok = strtok (list, sep); tok != NULL; tok = strtok ((char *) 0, sep)) {
-		if (strcasecmp (tok, "EXCEPT") == 0) {	/* EXCEPT: give up */
-			break;
+	for (; NULL != *tok; tok++) {
+		if (strcasecmp (*tok, "EXCEPT") == 0) {	/* EXCEPT: give up */
+			return false;
 		}
-		match = (*match_fn) (tok, item);
-		if (match) {
+		if ((*match_fn) (*tok, item)) {
 			break;
 		}
 	}
+	if (NULL == *tok) {
+		return false;
+	}
 
 	/* Process exceptions to matches. */
-	if (match) {
-		while (   ((tok = strtok ((char *) 0, sep)) != NULL)
-		       && (strcasecmp (tok, "EXCEPT") != 0))
-			/* VOID */ ;
-		if (tok == 0 || !list_match ((char *) 0, item, match_fn)) {
-			return (match);
-		}
+	while (   (NULL != *tok)
+	       && (strcasecmp (*tok, "EXCEPT") != 0)) {
+		tok++;
 	}
-	return false;
+	return (NULL == *tok) || !list_match (tok + 1, item, match_fn);
 }
 
 /* myhostname - figure out local machine name */
@@ -206,7 +204,7 @@ netgroup_match (const char *group, const char *machine, const char *user)
 /* user_match - match a username against one token */
 static bool user_match (const char *tok, const char *string)
 {
-	struct group *group;
+	const struct group *group;
 
 #ifdef PRIMARY_GROUP_MATCH
 	struct passwd *userinf;
@@ -220,17 +218,22 @@ static bool user_match (const char *tok, const char *string)
 	 */
 	at = strchr (tok + 1, '@');
 	if (NULL != at) {	/* split user@host pattern */
-		*at = '\0';
-		return (   user_match (tok, string)
-		        && from_match (at + 1, myhostname ()));
+		char *user_tok = xstrdup (tok);
+		bool match;
+
+		user_tok[at - tok] = '\0';
+		match = (   user_match (user_tok, string)
+		         && from_match (at + 1, myhostname ()));
+		free (user_tok);
+		return match;
 #if HAVE_INNETGR
 	} else if (tok[0] == '@') {	/* netgroup */
 		return (netgroup_match (tok + 1, (char *) 0, string));
 #endif
 	} else if (string_match (tok, string)) {	/* ALL or exact match */
 		return true;
-	/* local, no need for xgetgrnam */
-	} else if ((group = getgrnam (tok)) != NULL) {	/* try group membership */
+	/* looked up once per process */
+	} else if ((group = access_getgr (tok)) != NULL) {	/* try group membership */
 		int i;
 		for (i = 0; NULL != group->gr_mem[i]; i++) {
 			if (strcasecmp (string, group->gr_mem[i]) == 0) {
@@ -263,12 +266,27 @@ static const char *resolve_hostname (const char *string)
 	/*
 	 * Resolve hostname to numeric IP address, as suggested
 	 * by Dave Hagewood <admin@arrowweb.com>.  --marekm
+	 *
+	 * The address is kept, so that the host is only resolved once for
+	 * all the network rules.
 	 */
+	static char *resolved_name = NULL;
+	static char *resolved_addr = NULL;
 	struct hostent *hp;
 
+	if (   (NULL != resolved_name)
+	    && (strcmp (resolved_name, string) == 0)) {
+		return (NULL != resolved_addr) ? resolved_addr : string;
+	}
+	free (resolved_name);
+	free (resolved_addr);
+	resolved_name = xstrdup (string);
+	resolved_addr = NULL;
+
 	hp = gethostbyname (string);
 	if (NULL != hp) {
-		return inet_ntoa (*((struct in_addr *) *(hp->h_addr_list)));
+		resolved_addr = xstrdup (inet_ntoa (*((struct in_addr *) *(hp->h_addr_list))));
+		return resolved_addr;
 	}
 
 	SYSLOG ((LOG_ERR, "%s - unknown host", string));
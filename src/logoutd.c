@@ -33,13 +33,19 @@
 
 #ident "$Id$"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif				/* HAVE_SYS_INOTIFY_H */
 #include "defines.h"
 #include "prototypes.h"
+#include "port.h"
 /*
  * Global variables
  */
@@ -53,43 +59,198 @@ const char *Prog;
 #define HUP_MESG_FILE "/etc/logoutd.mesg"
 #endif
 
-/* local function prototypes */
 #ifdef USE_UTMPX
-static int check_login (const struct utmpx *ut);
+#define UTMP_FILE_NAME _PATH_UTMPX
+#define UT_SIZE(field) (sizeof (((struct utmpx *) NULL)->field))
 #else				/* !USE_UTMPX */
-static int check_login (const struct utmp *ut);
+#define UTMP_FILE_NAME _PATH_UTMP
+#define UT_SIZE(field) (sizeof (((struct utmp *) NULL)->field))
 #endif				/* !USE_UTMPX */
+
+/*
+ * Without inotify, utmp is scanned every SCAN_INTERVAL seconds for the
+ * new sessions. Otherwise, logoutd sleeps until the end of the allowed
+ * time of the first session, or at most MAX_SLEEP seconds, so that the
+ * changes of the clock are followed.
+ */
+#define SCAN_INTERVAL	60
+#define MAX_SLEEP	3600
+
+/* Delay between the message, the SIGHUP, and the SIGKILL */
+#define LOGOUT_DELAY	10
+
+/*
+ * A login session found in utmp
+ */
+struct session {
+	pid_t pid;
+	char user[UT_SIZE (ut_user) + 1];	/* terminating NUL */
+	char line[UT_SIZE (ut_line) + 1];	/* terminating NUL */
+	time_t end;		/* end of the allowed time, or (time_t) -1 */
+	int stage;		/* of the logout, see logout_step() */
+	time_t next;		/* time of the next stage of the logout */
+	bool seen;		/* by the last scan of utmp */
+};
+
+static /*@null@*/ /*@only@*/struct session *sessions = NULL;
+static size_t nsessions = 0;
+static size_t sessions_size = 0;
+
+/* local function prototypes */
+static void scan_utmp (void);
+static void logout_step (struct session *s, time_t now);
 static void send_mesg_to_tty (int tty_fd);
 
 /*
- * check_login - check if user (struct utmpx/utmp) allowed to stay logged in
+ * scan_utmp - update the list of sessions from utmp
+ *
+ *	The sessions which are being logged out are kept until the end of
+ *	the logout.
  */
+static void scan_utmp (void)
+{
 #ifdef USE_UTMPX
-static int check_login (const struct utmpx *ut)
+	struct utmpx *ut;
 #else				/* !USE_UTMPX */
-static int check_login (const struct utmp *ut)
+	struct utmp *ut;
 #endif				/* !USE_UTMPX */
-{
-	char user[sizeof (ut->ut_user) + 1];
-	time_t now;
+	size_t i, n;
 
-	/*
-	 * ut_user may not have the terminating NUL.
+	for (i = 0; i < nsessions; i++) {
+		sessions[i].seen = false;
+	}
+
+	/* 
+	 * Attempt to re-open the utmpx/utmp file. The file is only
+	 * open while it is being used.
 	 */
-	strncpy (user, ut->ut_user, sizeof (ut->ut_user));
-	user[sizeof (ut->ut_user)] = '\0';
+#ifdef USE_UTMPX
+	setutxent ();
+	while ((ut = getutxent ()) != NULL)
+#else				/* !USE_UTMPX */
+	setutent ();
+	while ((ut = getutent ()) != NULL)
+#endif				/* !USE_UTMPX */
+	{
+		struct session *s = NULL;
 
-	(void) time (&now);
+		if (ut->ut_type != USER_PROCESS) {
+			continue;
+		}
+		if (ut->ut_user[0] == '\0') {
+			continue;
+		}
 
-	/*
-	 * Check if they are allowed to be logged in right now.
-	 */
-	if (!isttytime (user, ut->ut_line, now)) {
-		return 0;
+		for (i = 0; i < nsessions; i++) {
+			if (   (sessions[i].pid == ut->ut_pid)
+			    && (strncmp (sessions[i].line, ut->ut_line,
+			                 sizeof (ut->ut_line)) == 0)
+			    && (strncmp (sessions[i].user, ut->ut_user,
+			                 sizeof (ut->ut_user)) == 0)) {
+				s = &sessions[i];
+				break;
+			}
+		}
+		if (NULL == s) {
+			if (nsessions == sessions_size) {
+				struct session *ns;
+				size_t size = (0 == sessions_size) ? 64 : sessions_size * 2;
+
+				ns = (struct session *) realloc (sessions,
+				                                 size * sizeof (*ns));
+				if (NULL == ns) {
+					/* Retry on the next scan */
+					break;
+				}
+				sessions = ns;
+				sessions_size = size;
+			}
+			s = &sessions[nsessions];
+			nsessions++;
+			/*
+			 * ut_user and ut_line may not have the terminating
+			 * NUL.
+			 */
+			s->pid = ut->ut_pid;
+			strncpy (s->user, ut->ut_user, sizeof (ut->ut_user));
+			s->user[sizeof (ut->ut_user)] = '\0';
+			strncpy (s->line, ut->ut_line, sizeof (ut->ut_line));
+			s->line[sizeof (ut->ut_line)] = '\0';
+			s->stage = 0;
+		}
+		s->seen = true;
+	}
+#ifdef USE_UTMPX
+	endutxent ();
+#else				/* !USE_UTMPX */
+	endutent ();
+#endif				/* !USE_UTMPX */
+
+	/* Forget the sessions which ended */
+	for (i = 0, n = 0; i < nsessions; i++) {
+		if (sessions[i].seen || (0 != sessions[i].stage)) {
+			sessions[n] = sessions[i];
+			n++;
+		}
 	}
-	return 1;
+	nsessions = n;
 }
 
+/*
+ * logout_step - do the next stage of the logout of a session
+ *
+ *	The user is first told that the login time is exceeded, the
+ *	session is then hung up, and killed. Each stage is done
+ *	LOGOUT_DELAY seconds after the previous one, without waiting,
+ *	so that the other sessions are handled meanwhile.
+ *
+ *	After the last stage, s->stage is set to -1.
+ */
+static void logout_step (struct session *s, time_t now)
+{
+	char tty_name[sizeof (s->line) + 5];	/* /dev/ + NUL */
+	int tty_fd;
+
+	if (strncmp (s->line, "/dev/", 5) != 0) {
+		strcpy (tty_name, "/dev/");
+	} else {
+		tty_name[0] = '\0';
+	}
+	strcat (tty_name, s->line);
+
+	switch (s->stage) {
+	case 0:
+#ifndef O_NOCTTY
+#define O_NOCTTY 0
+#endif
+		tty_fd = open (tty_name, O_WRONLY | O_NDELAY | O_NOCTTY);
+		if (tty_fd != -1) {
+			send_mesg_to_tty (tty_fd);
+			close (tty_fd);
+			s->stage = 1;
+			s->next = now + LOGOUT_DELAY;
+			break;
+		}
+		/*@fallthrough@*/
+	case 1:
+		if (s->pid > 1) {
+			kill (-s->pid, SIGHUP);
+			s->stage = 2;
+			s->next = now + LOGOUT_DELAY;
+			break;
+		}
+		/*@fallthrough@*/
+	default:
+		if (s->pid > 1) {
+			kill (-s->pid, SIGKILL);
+		}
+		SYSLOG ((LOG_NOTICE,
+			 "logged off user '%s' on '%s'", s->user,
+			 tty_name));
+		s->stage = -1;
+		break;
+	}
+}
 
 static void send_mesg_to_tty (int tty_fd)
 {
@@ -138,23 +299,15 @@ static void send_mesg_to_tty (int tty_fd)
  *
  *	logoutd is started at system boot time and enforces the login
  *	time and port restrictions specified in /etc/porttime. The
- *	utmpx/utmp file is periodically scanned and offending users are logged
- *	off from the system.
+ *	utmpx/utmp file is scanned when it changes, and offending users
+ *	are logged off from the system when their allowed time ends.
  */
 int main (int argc, char **argv)
 {
 	int i;
-	int status;
 	pid_t pid;
-
-#ifdef USE_UTMPX
-	struct utmpx *ut;
-#else				/* !USE_UTMPX */
-	struct utmp *ut;
-#endif				/* !USE_UTMPX */
-	char user[sizeof (ut->ut_user) + 1];	/* terminating NUL */
-	char tty_name[sizeof (ut->ut_line) + 6];	/* /dev/ + NUL */
-	int tty_fd;
+	int ifd = -1;		/* inotify, or -1 */
+	bool rescan = true;
 
 	if (1 != argc) {
 		(void) fputs (_("Usage: logoutd\n"), stderr);
@@ -190,110 +343,105 @@ int main (int argc, char **argv)
 
 	OPENLOG ("logoutd");
 
+#ifdef HAVE_SYS_INOTIFY_H
+	ifd = inotify_init ();
+	if (ifd >= 0) {
+		(void) fcntl (ifd, F_SETFL, O_NONBLOCK);
+		(void) fcntl (ifd, F_SETFD, FD_CLOEXEC);
+	}
+#endif				/* HAVE_SYS_INOTIFY_H */
+
 	/*
-	 * Scan the utmpx/utmp file once per minute looking for users that
-	 * are not supposed to still be logged in.
+	 * Follow the sessions of the utmpx/utmp file, and log off the
+	 * users that are not supposed to still be logged in.
 	 */
 	while (true) {
+		time_t now, wake;
+		size_t n, j;
+		int timeout;
 
-		/* 
-		 * Attempt to re-open the utmpx/utmp file. The file is only
-		 * open while it is being used.
-		 */
-#ifdef USE_UTMPX
-		setutxent ();
-#else				/* !USE_UTMPX */
-		setutent ();
-#endif				/* !USE_UTMPX */
+		(void) time (&now);
+		if (rescan) {
+#ifdef HAVE_SYS_INOTIFY_H
+			/*
+			 * The files may have been replaced: the watches
+			 * are added again for the current files.
+			 */
+			if (   (ifd >= 0)
+			    && (inotify_add_watch (ifd, UTMP_FILE_NAME,
+			                           IN_MODIFY | IN_CLOSE_WRITE
+			                           | IN_DELETE_SELF | IN_MOVE_SELF) < 0)) {
+				(void) close (ifd);
+				ifd = -1;
+			}
+			if (ifd >= 0) {
+				/* The changes of the times of the sessions */
+				(void) inotify_add_watch (ifd, PORTS,
+				                          IN_MODIFY | IN_CLOSE_WRITE
+				                          | IN_DELETE_SELF
+				                          | IN_MOVE_SELF);
+			}
+#endif				/* HAVE_SYS_INOTIFY_H */
+			scan_utmp ();
+		}
+		wake = now + ((ifd >= 0) ? MAX_SLEEP : SCAN_INTERVAL);
 
 		/*
-		 * Read all of the entries in the utmpx/utmp file. The entries
-		 * for login sessions will be checked to see if the user
-		 * is permitted to be signed on at this time.
+		 * /etc/porttime is only parsed again when it changed: the
+		 * end of the allowed time is found again for each
+		 * session, in case it changed, or the clock did.
 		 */
-#ifdef USE_UTMPX
-		while ((ut = getutxent ()) != NULL)
-#else				/* !USE_UTMPX */
-		while ((ut = getutent ()) != NULL)
-#endif				/* !USE_UTMPX */
-		{
-			if (ut->ut_type != USER_PROCESS) {
+		for (n = 0; n < nsessions; n++) {
+			struct session *s = &sessions[n];
+
+			if (0 == s->stage) {
+				s->end = ttytime_end (s->user, s->line, now);
+				if (((time_t) -1 == s->end) || (s->end > now)) {
+					if (((time_t) -1 != s->end) && (s->end < wake)) {
+						wake = s->end;
+					}
+					continue;
+				}
+			} else if (s->next > now) {
+				if (s->next < wake) {
+					wake = s->next;
+				}
 				continue;
 			}
-			if (ut->ut_user[0] == '\0') {
-				continue;
+			logout_step (s, now);
+			if ((s->stage > 0) && (s->next < wake)) {
+				wake = s->next;
 			}
-			if (check_login (ut)) {
-				continue;
+		}
+		for (j = 0, n = 0; j < nsessions; j++) {
+			if (-1 != sessions[j].stage) {
+				sessions[n] = sessions[j];
+				n++;
 			}
+		}
+		nsessions = n;
 
-			/*
-			 * Put the rest of this in a child process. This
-			 * keeps the scan from waiting on other ports to die.
-			 */
+		timeout = (wake > now) ? (int) (wake - now) * 1000 : 0;
+		if (ifd >= 0) {
+			struct pollfd pfd;
 
-			pid = fork ();
-			if (pid > 0) {
-				/* parent */
-				continue;
-			} else if (pid < 0) {
-				/* failed - give up until the next scan */
-				break;
-			}
-			/* child */
+			pfd.fd = ifd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll (&pfd, 1, timeout) > 0) {
+				char buf[4096];
 
-			if (strncmp (ut->ut_line, "/dev/", 5) != 0) {
-				strcpy (tty_name, "/dev/");
+				/* Drain the events: utmp is scanned again */
+				while (read (ifd, buf, sizeof buf) > 0);
+				rescan = true;
 			} else {
-				tty_name[0] = '\0';
-			}
-
-			strcat (tty_name, ut->ut_line);
-#ifndef O_NOCTTY
-#define O_NOCTTY 0
-#endif
-			tty_fd =
-			    open (tty_name, O_WRONLY | O_NDELAY | O_NOCTTY);
-			if (tty_fd != -1) {
-				send_mesg_to_tty (tty_fd);
-				close (tty_fd);
-				sleep (10);
+				rescan = false;
 			}
-
-			if (ut->ut_pid > 1) {
-				kill (-ut->ut_pid, SIGHUP);
-				sleep (10);
-				kill (-ut->ut_pid, SIGKILL);
-			}
-
-			strncpy (user, ut->ut_user, sizeof (user) - 1);
-			user[sizeof (user) - 1] = '\0';
-
-			SYSLOG ((LOG_NOTICE,
-				 "logged off user '%s' on '%s'", user,
-				 tty_name));
-
-			/*
-			 * This child has done all it can, drop dead.
-			 */
-			exit (EXIT_SUCCESS);
+		} else {
+			(void) poll (NULL, 0, timeout);
+			rescan = true;
 		}
-
-#ifdef USE_UTMPX
-		endutxent ();
-#else				/* !USE_UTMPX */
-		endutent ();
-#endif				/* !USE_UTMPX */
-
-#ifndef DEBUG
-		sleep (60);
-#endif
-		/*
-		 * Reap any dead babies ...
-		 */
-		while (wait (&status) != -1);
 	}
 
 	return EXIT_FAILURE;
 }
-
@@ -47,14 +47,15 @@
 const char *Prog;
 
 
-static bool verify_range(struct passwd *pw, struct map_range *range, bool *allow_setgroups)
+static bool verify_range(struct passwd *pw, struct subid_ranges *subids,
+	struct map_range *range, bool *allow_setgroups)
 {
 	/* An empty range is invalid */
 	if (range->count == 0)
 		return false;
 
 	/* Test /etc/subgid. If the mapping is valid then we allow setgroups. */
-	if (have_sub_gids(pw->pw_name, range->lower, range->count)) {
+	if (subid_ranges_have(subids, range->lower, range->count)) {
 		*allow_setgroups = true;
 		return true;
 	}
@@ -68,15 +69,15 @@ static bool verify_range(struct passwd *pw, struct map_range *range, bool *allow
 	return false;
 }
 
-static void verify_ranges(struct passwd *pw, int ranges,
-	struct map_range *mappings, bool *allow_setgroups)
+static void verify_ranges(struct passwd *pw, struct subid_ranges *subids,
+	int ranges, struct map_range *mappings, bool *allow_setgroups)
 {
 	struct map_range *mapping;
 	int idx;
 
 	mapping = mappings;
 	for (idx = 0; idx < ranges; idx++, mapping++) {
-		if (!verify_range(pw, mapping, allow_setgroups)) {
+		if (!verify_range(pw, subids, mapping, allow_setgroups)) {
 			fprintf(stderr, _( "%s: gid range [%lu-%lu) -> [%lu-%lu) not allowed\n"),
 				Prog,
 				mapping->upper,
@@ -90,7 +91,7 @@ static void verify_ranges(struct passwd *pw, int ranges,
 
 static void usage(void)
 {
-	fprintf(stderr, _("usage: %s <pid> <gid> <lowergid> <count> [ <gid> <lowergid> <count> ] ... \n"), Prog);
+	fprintf(stderr, _("usage: %s <pid>[,<pid>...] <gid> <lowergid> <count> [ <gid> <lowergid> <count> ] ... \n"), Prog);
 	exit(EXIT_FAILURE);
 }
 
@@ -159,36 +160,15 @@ out:
 }
 
 /*
- * newgidmap - Set the gid_map for the specified process
+ * open_target - Open the proc directory of the target process, after
+ * checking that it belongs to the caller.
  */
-int main(int argc, char **argv)
+static int open_target(pid_t target, const struct passwd *pw)
 {
 	char proc_dir_name[32];
-	char *target_str;
-	pid_t target, parent;
 	int proc_dir_fd;
-	int ranges;
-	struct map_range *mappings;
 	struct stat st;
-	struct passwd *pw;
 	int written;
-	bool allow_setgroups = false;
-
-	Prog = Basename (argv[0]);
-
-	/*
-	 * The valid syntax are
-	 * newgidmap target_pid
-	 */
-	if (argc < 2)
-		usage();
-
-	/* Find the process that needs its user namespace
-	 * gid mapping set.
-	 */
-	target_str = argv[1];
-	if (!get_pid(target_str, &target))
-		usage();
 
 	/* max string length is 6 + 10 + 1 + 1 = 18, allocate 32 bytes */
 	written = snprintf(proc_dir_name, sizeof(proc_dir_name), "/proc/%u/",
@@ -202,25 +182,14 @@ int main(int argc, char **argv)
 	if (proc_dir_fd < 0) {
 		fprintf(stderr, _("%s: Could not open proc directory for target %u\n"),
 			Prog, target);
-		return EXIT_FAILURE;
-	}
-
-	/* Who am i? */
-	pw = get_my_pwent ();
-	if (NULL == pw) {
-		fprintf (stderr,
-			_("%s: Cannot determine your user name.\n"),
-			Prog);
-		SYSLOG ((LOG_WARN, "Cannot determine the user name of the caller (UID %lu)",
-				(unsigned long) getuid ()));
-		return EXIT_FAILURE;
+		exit(EXIT_FAILURE);
 	}
 
 	/* Get the effective uid and effective gid of the target process */
 	if (fstat(proc_dir_fd, &st) < 0) {
 		fprintf(stderr, _("%s: Could not stat directory for target %u\n"),
 			Prog, target);
-		return EXIT_FAILURE;
+		exit(EXIT_FAILURE);
 	}
 
 	/* Verify real user and real group matches the password entry
@@ -235,10 +204,64 @@ int main(int argc, char **argv)
 			Prog, target,
 			(unsigned long int)getuid(), (unsigned long int)pw->pw_uid, (unsigned long int)st.st_uid,
 			(unsigned long int)getgid(), (unsigned long int)pw->pw_gid, (unsigned long int)st.st_gid);
+		exit(EXIT_FAILURE);
+	}
+
+	return proc_dir_fd;
+}
+
+/*
+ * newgidmap - Set the gid_map for the specified processes
+ *
+ *	The target can be a comma separated list of PIDs, which get the
+ *	same mappings. The subordinate IDs are then loaded and checked
+ *	once, and all the targets are checked before any mapping is set.
+ */
+int main(int argc, char **argv)
+{
+	pid_t *targets;
+	int *proc_dir_fds;
+	int count, idx;
+	int ranges;
+	struct map_range *mappings;
+	struct passwd *pw;
+	struct subid_ranges *subids;
+	bool allow_setgroups = false;
+
+	Prog = Basename (argv[0]);
+
+	/*
+	 * The valid syntax are
+	 * newgidmap target_pid[,target_pid...]
+	 */
+	if (argc < 2)
+		usage();
+
+	/* Find the processes that need their user namespace
+	 * gid mapping set.
+	 */
+	count = get_map_targets(argv[1], &targets);
+	if (0 == count)
+		usage();
+
+	/* Who am i? */
+	pw = get_my_pwent ();
+	if (NULL == pw) {
+		fprintf (stderr,
+			_("%s: Cannot determine your user name.\n"),
+			Prog);
+		SYSLOG ((LOG_WARN, "Cannot determine the user name of the caller (UID %lu)",
+				(unsigned long) getuid ()));
 		return EXIT_FAILURE;
 	}
 
-	if (!sub_gid_open(O_RDONLY)) {
+	proc_dir_fds = (int *) xmalloc(count * sizeof(int));
+	for (idx = 0; idx < count; idx++) {
+		proc_dir_fds[idx] = open_target(targets[idx], pw);
+	}
+
+	subids = sub_gid_load_ranges(pw->pw_name);
+	if (NULL == subids) {
 		return EXIT_FAILURE;
 	}
 
@@ -247,11 +270,17 @@ int main(int argc, char **argv)
 	if (!mappings)
 		usage();
 
-	verify_ranges(pw, ranges, mappings, &allow_setgroups);
+	verify_ranges(pw, subids, ranges, mappings, &allow_setgroups);
 
-	write_setgroups(proc_dir_fd, allow_setgroups);
-	write_mapping(proc_dir_fd, ranges, mappings, "gid_map", pw->pw_uid);
-	sub_gid_close();
+	for (idx = 0; idx < count; idx++) {
+		write_setgroups(proc_dir_fds[idx], allow_setgroups);
+		write_mapping(proc_dir_fds[idx], ranges, mappings, "gid_map",
+			pw->pw_uid);
+		close(proc_dir_fds[idx]);
+	}
+	subid_ranges_free(subids);
+	free(proc_dir_fds);
+	free(targets);
 
 	return EXIT_SUCCESS;
 }
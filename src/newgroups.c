@@ -0,0 +1,668 @@
+/*
+ *	newgroups - create groups from a batch file
+ *
+ *	newgroups creates or updates a collection of entries in
+ *	/etc/group and /etc/gshadow by reading lines of the form
+ *
+ *		name:gid:members:administrators
+ *
+ *	All the lines are checked, the new GIDs are allocated at once,
+ *	and the group databases are written once, or not at all if one
+ *	of the lines is invalid.
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <pwd.h>
+#include <grp.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <string.h>
+#ifdef ACCT_TOOLS_SETUID
+#ifdef USE_PAM
+#include "pam_defs.h"
+#endif				/* USE_PAM */
+#endif				/* ACCT_TOOLS_SETUID */
+#include "prototypes.h"
+#include "defines.h"
+#include "commonio.h"
+#include "groupio.h"
+#include "cacheflush.h"
+#include "pwio.h"
+#include "sgroupio.h"
+#include "chkname.h"
+
+/*
+ * Global variables
+ */
+const char *Prog;
+
+static bool rflg = false;	/* create system groups */
+
+#ifdef SHADOWGRP
+static bool is_shadow_grp;
+static bool sgr_locked = false;
+#endif
+static bool gr_locked = false;
+static bool pw_opened = false;
+
+/* GIDs found for the new groups, see reserve_gids() */
+static struct id_pool gid_pool;
+
+/* A valid line of the input, split in its 4 fields */
+struct input_group {
+	int line;
+	/*@only@*/char *buf;
+	char *fields[4];
+	bool exists;		/* the group is updated */
+	bool allocate;		/* the GID of the new group is allocated */
+	gid_t gid;
+};
+
+/* local function prototypes */
+static /*@noreturn@*/void usage (int status);
+static /*@noreturn@*/void fail_exit (int);
+static void process_flags (int argc, char **argv);
+static void check_perms (void);
+static void open_files (void);
+static void close_files (void);
+static int check_members (int line, const char *list);
+static int check_line (struct input_group *grp, struct name_set *names);
+static void free_list (/*@only@*/char **list);
+static int write_group (const struct input_group *grp);
+
+/*
+ * usage - display usage message and exit
+ */
+static /*@noreturn@*/void usage (int status)
+{
+	FILE *usageout = (EXIT_SUCCESS != status) ? stderr : stdout;
+	(void) fprintf (usageout,
+	                _("Usage: %s [options] [file]\n"
+	                  "\n"
+	                  "Options:\n"),
+	                Prog);
+	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("  -r, --system                  create system groups\n"), usageout);
+	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
+	(void) fputs ("\n", usageout);
+
+	exit (status);
+}
+
+/*
+ * fail_exit - undo as much as possible
+ */
+static /*@noreturn@*/void fail_exit (int code)
+{
+	if (gr_locked) {
+		if (gr_unlock () == 0) {
+			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, gr_dbname ());
+			SYSLOG ((LOG_ERR, "failed to unlock %s", gr_dbname ()));
+			/* continue */
+		}
+	}
+#ifdef	SHADOWGRP
+	if (sgr_locked) {
+		if (sgr_unlock () == 0) {
+			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, sgr_dbname ());
+			SYSLOG ((LOG_ERR, "failed to unlock %s", sgr_dbname ()));
+			/* continue */
+		}
+	}
+#endif
+	if (pw_opened) {
+		(void) pw_close ();
+	}
+
+	exit (code);
+}
+
+/*
+ * process_flags - parse the command line options
+ *
+ *	It will not return if an error is encountered.
+ */
+static void process_flags (int argc, char **argv)
+{
+	int c;
+	static struct option long_options[] = {
+		{"help",   no_argument,       NULL, 'h'},
+		{"system", no_argument,       NULL, 'r'},
+		{"root",   required_argument, NULL, 'R'},
+		{NULL, 0, NULL, '\0'}
+	};
+
+	while ((c = getopt_long (argc, argv, "hrR:",
+	                         long_options, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			usage (EXIT_SUCCESS);
+			break;
+		case 'r':
+			rflg = true;
+			break;
+		case 'R': /* no-op, handled in process_root_flag () */
+			break;
+		default:
+			usage (EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (   (optind != argc)
+	    && (optind + 1 != argc)) {
+		usage (EXIT_FAILURE);
+	}
+
+	if (argv[optind] != NULL) {
+		if (freopen (argv[optind], "r", stdin) == NULL) {
+			char buf[BUFSIZ];
+			snprintf (buf, sizeof buf, "%s: %s", Prog, argv[optind]);
+			perror (buf);
+			fail_exit (EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * check_perms - check if the caller is allowed to add groups
+ *
+ *	With PAM support, the setuid bit can be set on newgroups to allow
+ *	non-root users to add groups.
+ *	Without PAM support, only users who can write in the group databases
+ *	can add groups.
+ *
+ *	It will not return if the user is not allowed.
+ */
+static void check_perms (void)
+{
+#ifdef ACCT_TOOLS_SETUID
+#ifdef USE_PAM
+	pam_handle_t *pamh = NULL;
+	int retval;
+	struct passwd *pampw;
+
+	pampw = getpwuid (getuid ()); /* local, no need for xgetpwuid */
+	if (NULL == pampw) {
+		fprintf (stderr,
+		         _("%s: Cannot determine your user name.\n"),
+		         Prog);
+		fail_exit (EXIT_FAILURE);
+	}
+
+	retval = pam_start ("newgroups", pampw->pw_name, &conv, &pamh);
+
+	if (PAM_SUCCESS == retval) {
+		retval = pam_authenticate (pamh, 0);
+	}
+
+	if (PAM_SUCCESS == retval) {
+		retval = pam_acct_mgmt (pamh, 0);
+	}
+
+	if (PAM_SUCCESS != retval) {
+		fprintf (stderr, _("%s: PAM: %s\n"),
+		         Prog, pam_strerror (pamh, retval));
+		SYSLOG((LOG_ERR, "%s", pam_strerror (pamh, retval)));
+		if (NULL != pamh) {
+			(void) pam_end (pamh, retval);
+		}
+		fail_exit (EXIT_FAILURE);
+	}
+	(void) pam_end (pamh, retval);
+#endif				/* USE_PAM */
+#endif				/* ACCT_TOOLS_SETUID */
+}
+
+/*
+ * open_files - lock and open the group databases
+ *
+ *	The password database is only opened to check the members.
+ */
+static void open_files (void)
+{
+	if (gr_lock () == 0) {
+		fprintf (stderr,
+		         _("%s: cannot lock %s; try again later.\n"),
+		         Prog, gr_dbname ());
+		fail_exit (EXIT_FAILURE);
+	}
+	gr_locked = true;
+#ifdef SHADOWGRP
+	if (is_shadow_grp) {
+		if (sgr_lock () == 0) {
+			fprintf (stderr,
+			         _("%s: cannot lock %s; try again later.\n"),
+			         Prog, sgr_dbname ());
+			fail_exit (EXIT_FAILURE);
+		}
+		sgr_locked = true;
+	}
+#endif
+
+	if (gr_open (O_CREAT | O_RDWR) == 0) {
+		fprintf (stderr, _("%s: cannot open %s\n"), Prog, gr_dbname ());
+		fail_exit (EXIT_FAILURE);
+	}
+#ifdef SHADOWGRP
+	if (is_shadow_grp && (sgr_open (O_CREAT | O_RDWR) == 0)) {
+		fprintf (stderr, _("%s: cannot open %s\n"), Prog, sgr_dbname ());
+		fail_exit (EXIT_FAILURE);
+	}
+#endif
+	if (pw_open (O_RDONLY) == 0) {
+		fprintf (stderr, _("%s: cannot open %s\n"), Prog, pw_dbname ());
+		fail_exit (EXIT_FAILURE);
+	}
+	pw_opened = true;
+}
+
+/*
+ * close_files - close and unlock the group databases
+ */
+static void close_files (void)
+{
+	struct commonio_txn txn;
+
+	(void) pw_close ();
+	pw_opened = false;
+
+	/*
+	 * Write both databases before replacing any of them, so that
+	 * either all the changes or none are committed.
+	 */
+	commonio_txn_init (&txn);
+	(void) commonio_txn_add (&txn, __gr_get_db ());
+#ifdef SHADOWGRP
+	if (is_shadow_grp) {
+		(void) commonio_txn_add (&txn, __sgr_get_db ());
+	}
+#endif
+
+	if (commonio_txn_commit (&txn) == 0) {
+		fprintf (stderr,
+		         _("%s: failure while writing changes to %s\n"),
+		         Prog, txn.failed->filename);
+		SYSLOG ((LOG_ERR, "failure while writing changes to %s", txn.failed->filename));
+		fail_exit (EXIT_FAILURE);
+	}
+
+	if (gr_unlock () == 0) {
+		fprintf (stderr,
+		         _("%s: failed to unlock %s\n"),
+		         Prog, gr_dbname ());
+		SYSLOG ((LOG_ERR, "failed to unlock %s", gr_dbname ()));
+		/* continue */
+	}
+	gr_locked = false;
+
+#ifdef SHADOWGRP
+	if (is_shadow_grp) {
+		if (sgr_unlock () == 0) {
+			fprintf (stderr,
+			         _("%s: failed to unlock %s\n"),
+			         Prog, sgr_dbname ());
+			SYSLOG ((LOG_ERR, "failed to unlock %s", sgr_dbname ()));
+			/* continue */
+		}
+		sgr_locked = false;
+	}
+#endif
+}
+
+/*
+ * check_members - check that the users of a comma separated list exist
+ *
+ *	It returns the number of unknown users.
+ */
+static int check_members (int line, const char *list)
+{
+	char **names = comma_to_list (list);
+	char **cp;
+	int errors = 0;
+
+	for (cp = names; NULL != *cp; cp++) {
+		/* local, no need for xgetpwnam */
+		if (   (pw_locate (*cp) == NULL)
+		    && (getpwnam (*cp) == NULL)) {
+			fprintf (stderr,
+			         _("%s: line %d: user '%s' does not exist\n"),
+			         Prog, line, *cp);
+			errors++;
+		}
+	}
+	free_list (names);
+
+	return errors;
+}
+
+/*
+ * check_line - check a line of the input
+ *
+ *	The group of the line is looked up, and its GID is checked or
+ *	marked to be allocated.
+ *
+ *	It returns the number of errors.
+ */
+static int check_line (struct input_group *grp, struct name_set *names)
+{
+	const char *name = grp->fields[0];
+	const char *gid = grp->fields[1];
+	const struct group *gr;
+	int errors = 0;
+
+	if (!is_valid_group_name (name)) {
+		fprintf (stderr,
+		         _("%s: line %d: invalid group name '%s'\n"),
+		         Prog, grp->line, name);
+		return 1;
+	}
+	if (!name_set_add (names, name)) {
+		fprintf (stderr,
+		         _("%s: line %d: group '%s' already listed\n"),
+		         Prog, grp->line, name);
+		return 1;
+	}
+
+	gr = gr_locate (name);
+	/* local, no need for xgetgrnam */
+	if ((NULL == gr) && (getgrnam (name) != NULL)) {
+		fprintf (stderr,
+		         _("%s: line %d: cannot update the entry of group %s (not in the group database)\n"),
+		         Prog, grp->line, name);
+		return 1;
+	}
+	grp->exists = (NULL != gr);
+
+	if ('\0' == gid[0]) {
+		grp->allocate = !grp->exists;
+		if (grp->exists) {
+			grp->gid = gr->gr_gid;
+		}
+	} else if (   (get_gid (gid, &grp->gid) == 0)
+	           || (grp->gid == (gid_t)-1)) {
+		fprintf (stderr,
+		         _("%s: line %d: invalid group ID '%s'\n"),
+		         Prog, grp->line, gid);
+		errors++;
+	} else if (grp->exists) {
+		if (grp->gid != gr->gr_gid) {
+			fprintf (stderr,
+			         _("%s: line %d: group '%s' already exists with GID %lu\n"),
+			         Prog, grp->line, name,
+			         (unsigned long) gr->gr_gid);
+			errors++;
+		}
+	} else if (   (gr_locate_gid (grp->gid) != NULL)
+	           || (getgrgid (grp->gid) != NULL)) {
+		fprintf (stderr,
+		         _("%s: line %d: GID '%lu' already exists\n"),
+		         Prog, grp->line, (unsigned long) grp->gid);
+		errors++;
+	}
+
+	errors += check_members (grp->line, grp->fields[2]);
+	errors += check_members (grp->line, grp->fields[3]);
+
+	return errors;
+}
+
+/*
+ * free_list - free a list returned by comma_to_list()
+ */
+static void free_list (/*@only@*/char **list)
+{
+	/* The names are in a single buffer, starting with the first one */
+	if (NULL != list[0]) {
+		free (list[0]);
+	}
+	free (list);
+}
+
+/*
+ * write_group - create or update the group of a line
+ *
+ *	The members (and administrators) of an existing group are
+ *	replaced.
+ *
+ *	It returns 0 on success, -1 on failure.
+ */
+static int write_group (const struct input_group *grp)
+{
+	struct group grent;
+	const struct group *gr;
+	char **members;
+	int err = 0;
+#ifdef SHADOWGRP
+	struct sgrp sgent;
+	const struct sgrp *sg;
+	char **admins;
+#endif
+
+	members = comma_to_list (grp->fields[2]);
+
+	gr = gr_locate (grp->fields[0]);
+	if (NULL != gr) {
+		grent = *gr;
+	} else {
+		memzero (&grent, sizeof grent);
+		grent.gr_name = grp->fields[0];
+		grent.gr_passwd = SHADOW_PASSWD_STRING;	/* XXX warning: const */
+		grent.gr_gid = grp->gid;
+	}
+	grent.gr_mem = members;
+
+	if (gr_update (&grent) == 0) {
+		fprintf (stderr,
+		         _("%s: line %d: failed to prepare the new %s entry '%s'\n"),
+		         Prog, grp->line, gr_dbname (), grent.gr_name);
+		err = -1;
+	}
+
+#ifdef SHADOWGRP
+	if (is_shadow_grp && (0 == err)) {
+		admins = comma_to_list (grp->fields[3]);
+		sg = sgr_locate (grp->fields[0]);
+		if (NULL != sg) {
+			sgent = *sg;
+		} else {
+			memzero (&sgent, sizeof sgent);
+			sgent.sg_name = grp->fields[0];
+			sgent.sg_passwd = "!";	/* XXX warning: const */
+		}
+		sgent.sg_adm = admins;
+		sgent.sg_mem = members;
+
+		if (sgr_update (&sgent) == 0) {
+			fprintf (stderr,
+			         _("%s: line %d: failed to prepare the new %s entry '%s'\n"),
+			         Prog, grp->line, sgr_dbname (), sgent.sg_name);
+			err = -1;
+		}
+		free_list (admins);
+	}
+#endif
+	free_list (members);
+
+	return err;
+}
+
+int main (int argc, char **argv)
+{
+	char buf[BUFSIZ];
+	char *fields[4];
+	int nfields;
+	char *cp;
+	int errors = 0;
+	int line = 0;
+	struct input_group *groups = NULL;
+	size_t ngroups = 0, alloc = 0, nallocated = 0, nadded = 0, i, j, len;
+	struct name_set names;
+	gid_t *gids = NULL;
+
+	Prog = Basename (argv[0]);
+
+	(void) setlocale (LC_ALL, "");
+	(void) bindtextdomain (PACKAGE, LOCALEDIR);
+	(void) textdomain (PACKAGE);
+
+	process_root_flag ("-R", true, argc, argv);
+
+	OPENLOG ("newgroups");
+
+	process_flags (argc, argv);
+
+	check_perms ();
+
+#ifdef SHADOWGRP
+	is_shadow_grp = sgr_file_present ();
+#endif
+
+	/*
+	 * Read all the lines first, so that the new GIDs can be allocated
+	 * at once.
+	 */
+	while (fgets (buf, (int) sizeof buf, stdin) != (char *) 0) {
+		line++;
+		cp = strrchr (buf, '\n');
+		if (NULL != cp) {
+			*cp = '\0';
+		} else {
+			if (feof (stdin) == 0) {
+				fprintf (stderr,
+				         _("%s: line %d: line too long\n"),
+				         Prog, line);
+				errors++;
+				continue;
+			}
+		}
+
+		/*
+		 * There MUST be 4 colon separated fields.
+		 */
+		for (cp = buf, nfields = 0; nfields < 4; nfields++) {
+			fields[nfields] = cp;
+			cp = strchr (cp, ':');
+			if (NULL != cp) {
+				*cp = '\0';
+				cp++;
+			} else {
+				break;
+			}
+		}
+		if (nfields != 3) {
+			fprintf (stderr, _("%s: line %d: invalid line\n"),
+			         Prog, line);
+			errors++;
+			continue;
+		}
+
+		if (ngroups == alloc) {
+			struct input_group *tmp;
+
+			alloc = (0 == alloc) ? 64 : alloc * 2;
+			tmp = (struct input_group *) xmalloc (alloc * sizeof (*tmp));
+			if (0 != ngroups) {
+				memcpy (tmp, groups, ngroups * sizeof (*tmp));
+			}
+			free (groups);
+			groups = tmp;
+		}
+		memzero (&groups[ngroups], sizeof groups[ngroups]);
+		groups[ngroups].line = line;
+		/* The fields are separated by NULs in buf */
+		len = (size_t) (fields[3] - buf) + strlen (fields[3]) + 1;
+		groups[ngroups].buf = xmalloc (len);
+		memcpy (groups[ngroups].buf, buf, len);
+		for (nfields = 0; nfields < 4; nfields++) {
+			groups[ngroups].fields[nfields] =
+				groups[ngroups].buf + (fields[nfields] - buf);
+		}
+		ngroups++;
+	}
+
+	open_files ();
+
+	/*
+	 * Check all the lines before changing anything.
+	 */
+	name_set_init (&names, ngroups);
+	for (i = 0; i < ngroups; i++) {
+		errors += check_line (&groups[i], &names);
+		if (groups[i].allocate) {
+			nallocated++;
+		}
+	}
+	name_set_free (&names);
+
+	/*
+	 * The groups with a known GID are written first, so that the
+	 * allocation skips their GIDs.
+	 */
+	for (i = 0; (0 == errors) && (i < ngroups); i++) {
+		if (groups[i].allocate) {
+			continue;
+		}
+		if (write_group (&groups[i]) != 0) {
+			errors++;
+		}
+		if (!groups[i].exists) {
+			nadded++;
+		}
+	}
+
+	if ((0 == errors) && (0 != nallocated)) {
+		gids = (gid_t *) xmalloc (nallocated * sizeof (*gids));
+		if (reserve_gids (&gid_pool, rflg, nallocated, gids, NULL) != 0) {
+			fprintf (stderr,
+			         _("%s: can't allocate %lu group IDs\n"),
+			         Prog, (unsigned long) nallocated);
+			errors++;
+		}
+	}
+	for (i = 0, j = 0; (0 == errors) && (i < ngroups); i++) {
+		if (!groups[i].allocate) {
+			continue;
+		}
+		groups[i].gid = gids[j];
+		j++;
+		if (write_group (&groups[i]) != 0) {
+			errors++;
+		}
+		nadded++;
+	}
+	id_pool_free (&gid_pool);
+	free (gids);
+
+	/*
+	 * Any detected errors will cause the entire set of changes to be
+	 * aborted. Unlocking the group files will cause all of the
+	 * changes to be ignored. Otherwise the files are written out all
+	 * at once, and then unlocked afterwards.
+	 */
+	if (0 != errors) {
+		fprintf (stderr,
+		         _("%s: error detected, changes ignored\n"), Prog);
+		fail_exit (EXIT_FAILURE);
+	}
+
+	close_files ();
+
+	SYSLOG ((LOG_INFO, "%lu groups added, %lu groups updated",
+	         (unsigned long) nadded, (unsigned long) (ngroups - nadded)));
+
+	for (i = 0; i < ngroups; i++) {
+		free (groups[i].buf);
+	}
+	free (groups);
+
+	cache_flush_defer (CACHE_DB_GROUP);
+
+	return EXIT_SUCCESS;
+}
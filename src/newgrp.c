@@ -83,7 +83,7 @@ static void usage (void)
 	}
 }
 
-static bool ingroup(const char *name, struct group *gr)
+static bool ingroup(const char *name, const struct group *gr)
 {
 	char **look;
 	bool notfound = true;
@@ -99,17 +99,39 @@ static bool ingroup(const char *name, struct group *gr)
  * find_matching_group - search all groups of a gr's group id for
  *                       membership of a given username
  *                       but check gr itself first
+ *
+ *	primary is the primary group of the user. If the GIDs of the
+ *	groups of the user can be listed, the group database is only
+ *	scanned when the user is a member of a group with gr's group id.
  */
-static /*@null@*/struct group *find_matching_group (const char *name, struct group *gr)
+static /*@null@*/struct group *find_matching_group (const char *name,
+                                                    gid_t primary,
+                                                    struct group *gr)
 {
+	const struct group *const *groups;
 	gid_t gid = gr->gr_gid;
+	gid_t *list;
+	size_t n, i;
 
 	if (ingroup(name, gr))
 		return gr;
 
-	setgrent ();
-	while ((gr = getgrent ()) != NULL) {
-		if (gr->gr_gid != gid) {
+	list = user_grouplist (name, primary, &n);
+	if (NULL != list) {
+		for (i = 0; i < n; i++) {
+			if (list[i] == gid) {
+				break;
+			}
+		}
+		free (list);
+		if (i == n) {
+			return NULL;
+		}
+	}
+
+	groups = nss_group_list (&n);
+	for (i = 0; i < n; i++) {
+		if (groups[i]->gr_gid != gid) {
 			continue;
 		}
 
@@ -117,11 +139,19 @@ static /*@null@*/struct group *find_matching_group (const char *name, struct gro
 		 * A group with matching GID was found.
 		 * Test for membership of 'name'.
 		 */
-		if (ingroup(name, gr))
-			break;
+		if (ingroup(name, groups[i])) {
+			/* The caller changes the password and members */
+			gr = __gr_dup (groups[i]);
+			if (NULL == gr) {
+				(void) fprintf (stderr,
+				                _("%s: failed to allocate memory: %s\n"),
+				                Prog, strerror (errno));
+				exit (13);
+			}
+			return gr;
+		}
 	}
-	endgrent ();
-	return gr;
+	return NULL;
 }
 
 /*
@@ -159,7 +189,7 @@ static void check_perms (const struct group *grp,
 	 * password, and the group has a password, she needs to give the
 	 * group password.
 	 */
-	spwd = xgetspnam (pwd->pw_name);
+	spwd = cred_getspnam (pwd->pw_name);
 	if (NULL != spwd) {
 		pwd->pw_passwd = spwd->sp_pwdp;
 	}
@@ -336,7 +366,7 @@ static void syslog_sg (const char *name, const char *group)
 			/* parent - wait for child to finish, then log session close */
 			int cst = 0;
 			gid_t gid = getgid();
-			struct group *grp = getgrgid (gid);
+			struct group *grp = cred_getgrgid (gid);
 			pid_t pid;
 
 			do {
@@ -351,7 +381,6 @@ static void syslog_sg (const char *name, const char *group)
 				}
 			} while (   ((pid == child) && (WIFSTOPPED (cst) != 0))
 			         || ((pid != child) && (errno == EINTR)));
-			/* local, no need for xgetgrgid */
 			if (NULL != grp) {
 				SYSLOG ((LOG_INFO,
 				         "user '%s' (login '%s' on %s) returned to group '%s'",
@@ -414,9 +443,8 @@ int main (int argc, char **argv)
 #ifdef WITH_AUDIT
 	audit_help_open ();
 #endif
-	(void) setlocale (LC_ALL, "");
-	(void) bindtextdomain (PACKAGE, LOCALEDIR);
-	(void) textdomain (PACKAGE);
+	/* The locale is loaded with the first message, see nls.c */
+	nls_defer (LOCALEDIR);
 
 	/*
 	 * Save my name for error messages and save my real gid incase of
@@ -536,7 +564,7 @@ int main (int argc, char **argv)
 			 * Perhaps in the past, but the default behavior now depends on the
 			 * group entry, so it had better exist.  -- JWP
 			 */
-			grp = xgetgrgid (pwd->pw_gid);
+			grp = cred_getgrgid (pwd->pw_gid);
 			if (NULL == grp) {
 				fprintf (stderr,
 				         _("%s: GID '%lu' does not exist\n"),
@@ -628,7 +656,7 @@ int main (int argc, char **argv)
 	 * including the user's name in the member list of the user's login
 	 * group.  -- JWP
 	 */
-	grp = getgrnam (group); /* local, no need for xgetgrnam */
+	grp = cred_getgrnam (group);
 	if (NULL == grp) {
 		fprintf (stderr, _("%s: group '%s' does not exist\n"), Prog, group);
 		goto failure;
@@ -652,7 +680,7 @@ int main (int argc, char **argv)
 	 * membership of the current user.
 	 */
 	if (!is_member) {
-		grp = find_matching_group (name, grp);
+		grp = find_matching_group (name, pwd->pw_gid, grp);
 		if (NULL == grp) {
 			/*
 			 * No matching group found. As we already know that
@@ -661,7 +689,7 @@ int main (int argc, char **argv)
 			 *
 			 * Re-read the group entry for further processing.
 			 */
-			grp = xgetgrnam (group);
+			grp = cred_getgrnam (group);
 			assert (NULL != grp);
 		}
 	}
@@ -59,10 +59,10 @@
 #endif				/* ACCT_TOOLS_SETUID */
 #include "prototypes.h"
 #include "defines.h"
+#include "commonio.h"
 #include "getdef.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #include "pwio.h"
 #include "sgroupio.h"
 #include "shadowio.h"
@@ -94,28 +94,98 @@ static bool sgr_locked = false;
 static bool pw_locked = false;
 static bool gr_locked = false;
 static bool spw_locked = false;
+#if defined(ENABLE_SUBIDS) || defined(WITH_SELINUX)
+/* Names of users, see add_owner() */
+struct owners {
+	char **names;
+	size_t count;
+	size_t size;
+};
+#endif				/* ENABLE_SUBIDS || WITH_SELINUX */
 #ifdef ENABLE_SUBIDS
 static bool is_sub_uid = false;
 static bool is_sub_gid = false;
 static bool sub_uid_locked = false;
 static bool sub_gid_locked = false;
+
+static struct owners sub_uid_owners;
+static struct owners sub_gid_owners;
 #endif				/* ENABLE_SUBIDS */
+#ifdef WITH_SELINUX
+/* Users which get a SELinux login mapping, see set_seusers() */
+static struct owners seuser_owners;
+#endif				/* WITH_SELINUX */
+#ifdef WITH_SELINUX
+/* SELinux user of the users of the input, see set_seusers() */
+static /*@null@*/const char *user_selinux = NULL;
+#define Zflg (NULL != user_selinux)
+#endif				/* WITH_SELINUX */
+
+/* IDs found for the new users and groups, see reserve_uids() */
+static struct id_pool uid_pool;
+static struct id_pool gid_pool;
+
+/* A valid line of the input, split in its 7 fields */
+struct input_line {
+	int line;
+	/*@only@*/char *buf;
+	char *fields[7];
+};
+
+/* A home directory created once the users are written */
+struct new_home {
+	int line;
+	/*@only@*/char *dir;
+	uid_t uid;
+	gid_t gid;
+	size_t depth;		/* number of '/' in dir */
+	bool created;
+};
+
+/* Mode of the new home directories */
+static mode_t home_mode;
+
+/* Skeleton copied to the new home directories (-k) */
+static /*@null@*/const char *skel_dir = NULL;
 
 /* local function prototypes */
 static void usage (int status);
 static void fail_exit (int);
+static bool new_group (const char *);
 static int add_group (const char *, const char *, gid_t *, gid_t);
-static int get_user_id (const char *, uid_t *);
+static int get_user_id (const char *, const char *, uid_t *);
 static int add_user (const char *, uid_t, gid_t);
 #ifndef USE_PAM
 static int update_passwd (struct passwd *, const char *);
 #endif				/* !USE_PAM */
 static int add_passwd (struct passwd *, const char *);
+#ifndef USE_PAM
+static /*@null@*/struct crypt_job *encrypt_passwords (
+	const struct input_line *lines, size_t nlines);
+#endif				/* !USE_PAM */
+#if defined(ENABLE_SUBIDS) || defined(WITH_SELINUX)
+static void add_owner (struct owners *, const char *);
+static void remove_duplicates (struct owners *);
+static void free_owners (struct owners *);
+#endif				/* ENABLE_SUBIDS || WITH_SELINUX */
+#ifdef ENABLE_SUBIDS
+static int add_sub_ids (void);
+static int add_sub_uids (void);
+static int add_sub_gids (void);
+#endif				/* ENABLE_SUBIDS */
+#ifdef WITH_SELINUX
+static int set_seusers (void);
+#endif				/* WITH_SELINUX */
 static void process_flags (int argc, char **argv);
 static void check_flags (void);
 static void check_perms (void);
 static void open_files (void);
 static void close_files (void);
+static void add_home (struct new_home **homes, size_t *nhomes, int line,
+                      const struct passwd *pwd);
+static int home_cmp (const void *p1, const void *p2);
+static void create_home (struct work_pool *pool, void *arg);
+static int create_homes (struct new_home *homes, size_t nhomes);
 
 /*
  * usage - display usage message and exit
@@ -139,6 +209,7 @@ static void usage (int status)
 	               );
 #endif				/* !USE_PAM */
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("  -k, --skel SKEL_DIR           copy SKEL_DIR to the created home directories\n"), usageout);
 	(void) fputs (_("  -r, --system                  create system accounts\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 #ifndef USE_PAM
@@ -148,6 +219,9 @@ static void usage (int status)
 	              usageout);
 #endif				/* USE_SHA_CRYPT */
 #endif				/* !USE_PAM */
+#ifdef WITH_SELINUX
+	(void) fputs (_("  -Z, --selinux-user SEUSER     use a specific SEUSER for the SELinux user mapping\n"), usageout);
+#endif				/* WITH_SELINUX */
 	(void) fputs ("\n", usageout);
 
 	exit (status);
@@ -208,6 +282,20 @@ static void fail_exit (int code)
 	exit (code);
 }
 
+/*
+ * new_group - Check if add_group() will create a group with the next
+ * available GID for the group field gid.
+ */
+static bool new_group (const char *gid)
+{
+	if (isdigit (gid[0])) {
+		return false;
+	}
+	return    ('\0' == gid[0])
+	       || (   (timed_getgrnam (gid) == NULL)
+	           && (gr_locate (gid) == NULL));
+}
+
 /*
  * add_group - create a new group or add a user to an existing group
  */
@@ -224,7 +312,7 @@ static int add_group (const char *name, const char *gid, gid_t *ngid, uid_t uid)
 	 * Start by seeing if the named group already exists. This will be
 	 * very easy to deal with if it does.
 	 */
-	grp = getgrnam (gid);
+	grp = timed_getgrnam (gid);
 	if (NULL == grp) {
 		grp = gr_locate (gid);
 	}
@@ -251,7 +339,7 @@ static int add_group (const char *name, const char *gid, gid_t *ngid, uid_t uid)
 		/* Look in both the system database (getgrgid) and in the
 		 * internal database (gr_locate_gid), which may contain
 		 * uncommitted changes */
-		if (   (getgrgid ((gid_t) grent.gr_gid) != NULL)
+		if (   (timed_getgrgid ((gid_t) grent.gr_gid) != NULL)
 		    || (gr_locate_gid ((gid_t) grent.gr_gid) != NULL)) {
 			/* The user will use this ID for her
 			 * primary group */
@@ -271,7 +359,7 @@ static int add_group (const char *name, const char *gid, gid_t *ngid, uid_t uid)
 		 * already the name of an existing group.
 		 * In both cases, figure out what group ID can be used.
 		 */
-		if (find_new_gid(rflg, &grent.gr_gid, &uid) < 0) {
+		if (reserve_gids (&gid_pool, rflg, 1, &grent.gr_gid, &uid) < 0) {
 			return -1;
 		}
 	}
@@ -339,11 +427,13 @@ static int add_group (const char *name, const char *gid, gid_t *ngid, uid_t uid)
 	return 0;
 }
 
-static int get_user_id (const char *uid, uid_t *nuid) {
+static int get_user_id (const char *uid, const char *gid, uid_t *nuid) {
 
 	/*
 	 * The first guess for the UID is either the numerical UID that the
-	 * caller provided, or the next available UID.
+	 * caller provided, or the next available UID. If a group is created
+	 * for the user, with the next available GID (see add_group), an ID
+	 * available for both is preferred.
 	 */
 	if (isdigit (uid[0])) {
 		if ((get_uid (uid, nuid) == 0) || (*nuid == (uid_t)-1)) {
@@ -356,7 +446,7 @@ static int get_user_id (const char *uid, uid_t *nuid) {
 		if ('\0' != uid[0]) {
 			const struct passwd *pwd;
 			/* local, no need for xgetpwnam */
-			pwd = getpwnam (uid);
+			pwd = timed_getpwnam (uid);
 			if (NULL == pwd) {
 				pwd = pw_locate (uid);
 			}
@@ -370,7 +460,14 @@ static int get_user_id (const char *uid, uid_t *nuid) {
 				return -1;
 			}
 		} else {
-			if (find_new_uid (rflg, nuid, NULL) < 0) {
+			gid_t ngid;
+
+			if (   new_group (gid)
+			    && (reserve_ids (&uid_pool, &gid_pool, rflg,
+			                     nuid, &ngid) == 0)) {
+				return 0;
+			}
+			if (reserve_uids (&uid_pool, rflg, 1, nuid, NULL) < 0) {
 				return -1;
 			}
 		}
@@ -414,33 +511,13 @@ static int add_user (const char *name, uid_t uid, gid_t gid)
 /* 
  * update_passwd - update the password in the passwd entry
  *
+ * password is the encrypted password, see encrypt_passwords().
+ *
  * Return 0 if successful.
  */
 static int update_passwd (struct passwd *pwd, const char *password)
 {
-	void *crypt_arg = NULL;
-	char *cp;
-	if (crypt_method != NULL) {
-#ifdef USE_SHA_CRYPT
-		if (sflg) {
-			crypt_arg = &sha_rounds;
-		}
-#endif
-	}
-
-	if ((crypt_method != NULL) && (0 == strcmp(crypt_method, "NONE"))) {
-		pwd->pw_passwd = (char *)password;
-	} else {
-		const char *salt = crypt_make_salt (crypt_method, crypt_arg);
-		cp = pw_encrypt (password, salt);
-		if (NULL == cp) {
-			fprintf (stderr,
-			         _("%s: failed to crypt password with salt '%s': %s\n"),
-			         Prog, salt, strerror (errno));
-			return 1;
-		}
-		pwd->pw_passwd = cp;
-	}
+	pwd->pw_passwd = (char *)password;
 
 	return 0;
 }
@@ -448,23 +525,16 @@ static int update_passwd (struct passwd *pwd, const char *password)
 
 /*
  * add_passwd - add or update the encrypted password
+ *
+ * password is the encrypted password, see encrypt_passwords(), or with
+ * PAM the clear text password.
  */
 static int add_passwd (struct passwd *pwd, const char *password)
 {
 	const struct spwd *sp;
 	struct spwd spent;
-	char *cp;
 
 #ifndef USE_PAM
-	void *crypt_arg = NULL;
-	if (crypt_method != NULL) {
-#ifdef USE_SHA_CRYPT
-		if (sflg) {
-			crypt_arg = &sha_rounds;
-		}
-#endif				/* USE_SHA_CRYPT */
-	}
-
 	/*
 	 * In the case of regular password files, this is real easy - pwd
 	 * points to the entry in the password file. Shadow files are
@@ -483,21 +553,7 @@ static int add_passwd (struct passwd *pwd, const char *password)
 #ifndef USE_PAM
 	if (NULL != sp) {
 		spent = *sp;
-		if (   (NULL != crypt_method)
-		    && (0 == strcmp(crypt_method, "NONE"))) {
-			spent.sp_pwdp = (char *)password;
-		} else {
-			const char *salt = crypt_make_salt (crypt_method,
-			                                    crypt_arg);
-			cp = pw_encrypt (password, salt);
-			if (NULL == cp) {
-				fprintf (stderr,
-				         _("%s: failed to crypt password with salt '%s': %s\n"),
-				         Prog, salt, strerror (errno));
-				return 1;
-			}
-			spent.sp_pwdp = cp;
-		}
+		spent.sp_pwdp = (char *)password;
 		spent.sp_lstchg = (long) gettime () / SCALE;
 		if (0 == spent.sp_lstchg) {
 			/* Better disable aging than requiring a password
@@ -535,19 +591,7 @@ static int add_passwd (struct passwd *pwd, const char *password)
 	 */
 	spent.sp_namp = pwd->pw_name;
 #ifndef USE_PAM
-	if ((crypt_method != NULL) && (0 == strcmp(crypt_method, "NONE"))) {
-		spent.sp_pwdp = (char *)password;
-	} else {
-		const char *salt = crypt_make_salt (crypt_method, crypt_arg);
-		cp = pw_encrypt (password, salt);
-		if (NULL == cp) {
-			fprintf (stderr,
-			         _("%s: failed to crypt password with salt '%s': %s\n"),
-			         Prog, salt, strerror (errno));
-			return 1;
-		}
-		spent.sp_pwdp = cp;
-	}
+	spent.sp_pwdp = (char *)password;
 #else
 	/*
 	 * Lock the password.
@@ -571,6 +615,315 @@ static int add_passwd (struct passwd *pwd, const char *password)
 	return (spw_update (&spent) == 0);
 }
 
+#ifndef USE_PAM
+/*
+ * encrypt_passwords - encrypt the passwords of all the input lines
+ *
+ *	The passwords are encrypted at once, by several threads if
+ *	CRYPT_THREADS is set. The job of each line has the same index as
+ *	the line.
+ *
+ *	It returns NULL if the passwords are not encrypted (-c NONE).
+ */
+static /*@null@*/struct crypt_job *encrypt_passwords (
+	const struct input_line *lines, size_t nlines)
+{
+	struct crypt_job *jobs;
+	void *crypt_arg = NULL;
+	size_t i;
+
+	if (   ((crypt_method != NULL) && (0 == strcmp(crypt_method, "NONE")))
+	    || (0 == nlines)) {
+		return NULL;
+	}
+	if (crypt_method != NULL) {
+#ifdef USE_SHA_CRYPT
+		if (sflg) {
+			crypt_arg = &sha_rounds;
+		}
+#endif				/* USE_SHA_CRYPT */
+	}
+
+	jobs = (struct crypt_job *) xmalloc (nlines * sizeof (*jobs));
+	for (i = 0; i < nlines; i++) {
+		jobs[i].clear = lines[i].fields[1];
+		jobs[i].salt = xstrdup (crypt_make_salt (crypt_method,
+		                                         crypt_arg));
+		jobs[i].cipher = NULL;
+	}
+	crypt_jobs_run (jobs, nlines);
+
+	return jobs;
+}
+#endif				/* !USE_PAM */
+
+#if defined(ENABLE_SUBIDS) || defined(WITH_SELINUX)
+/*
+ * add_owner - remember that a user needs subordinate IDs, or a SELinux
+ *             login mapping
+ */
+static void add_owner (struct owners *owners, const char *name)
+{
+	if (owners->count == owners->size) {
+		size_t size = (0 == owners->size) ? 64 : owners->size * 2;
+		char **names;
+
+		names = realloc (owners->names, size * sizeof (*names));
+		if (NULL == names) {
+			fprintf (stderr,
+			         _("%s: failed to allocate memory: %s\n"),
+			         Prog, strerror (errno));
+			fail_exit (EXIT_FAILURE);
+		}
+		owners->names = names;
+		owners->size = size;
+	}
+	owners->names[owners->count] = xstrdup (name);
+	owners->count++;
+}
+
+static int name_ptr_cmp (const void *p1, const void *p2)
+{
+	char *const *n1 = *(char *const *const *) p1;
+	char *const *n2 = *(char *const *const *) p2;
+	int ret;
+
+	ret = strcmp (*n1, *n2);
+	if (0 != ret) {
+		return ret;
+	}
+	/* Keep the input order */
+	return (n1 < n2) ? -1 : ((n1 > n2) ? 1 : 0);
+}
+
+/*
+ * remove_duplicates - only keep the first occurrence of each user
+ *
+ *	A user can be listed on several lines of the input.
+ */
+static void remove_duplicates (struct owners *owners)
+{
+	char ***sorted;
+	size_t i, first, n;
+
+	if (owners->count < 2) {
+		return;
+	}
+
+	sorted = (char ***) xmalloc (owners->count * sizeof (*sorted));
+	for (i = 0; i < owners->count; i++) {
+		sorted[i] = &owners->names[i];
+	}
+	qsort (sorted, owners->count, sizeof (*sorted), name_ptr_cmp);
+	for (i = 1, first = 0; i < owners->count; i++) {
+		if (strcmp (*sorted[i], *sorted[first]) == 0) {
+			free (*sorted[i]);
+			*sorted[i] = NULL;
+		} else {
+			first = i;
+		}
+	}
+	free (sorted);
+
+	for (i = 0, n = 0; i < owners->count; i++) {
+		if (NULL != owners->names[i]) {
+			owners->names[n] = owners->names[i];
+			n++;
+		}
+	}
+	owners->count = n;
+}
+
+static void free_owners (struct owners *owners)
+{
+	size_t i;
+
+	for (i = 0; i < owners->count; i++) {
+		free (owners->names[i]);
+	}
+	free (owners->names);
+	owners->names = NULL;
+	owners->count = 0;
+	owners->size = 0;
+}
+#endif				/* ENABLE_SUBIDS || WITH_SELINUX */
+
+#ifdef ENABLE_SUBIDS
+
+/*
+ * add_sub_ids - give the same subordinate UIDs and GIDs to the users
+ *
+ *	When the same users need subordinate UIDs and GIDs, the ranges
+ *	free in both databases are found at once, and added to both
+ *	databases. The owner lists are then emptied.
+ *
+ *	Otherwise, or if there are not enough common ranges, nothing is
+ *	done, and add_sub_uids() and add_sub_gids() select the ranges
+ *	separately.
+ *
+ *	It returns the number of errors.
+ */
+static int add_sub_ids (void)
+{
+	unsigned long *starts;
+	unsigned long count = 0;
+	size_t i;
+
+	if ((0 == sub_uid_owners.count) || (0 == sub_gid_owners.count)) {
+		return 0;
+	}
+	remove_duplicates (&sub_uid_owners);
+	remove_duplicates (&sub_gid_owners);
+	if (sub_uid_owners.count != sub_gid_owners.count) {
+		return 0;
+	}
+	for (i = 0; i < sub_uid_owners.count; i++) {
+		if (strcmp (sub_uid_owners.names[i], sub_gid_owners.names[i]) != 0) {
+			return 0;
+		}
+	}
+
+	starts = (unsigned long *) xmalloc (sub_uid_owners.count * sizeof (*starts));
+	if (reserve_sub_ids (sub_uid_owners.count, starts, &count) != 0) {
+		free (starts);
+		return 0;
+	}
+	if (sub_uid_add_ranges ((const char *const *) sub_uid_owners.names,
+	                        starts, sub_uid_owners.count, count) == 0) {
+		fprintf (stderr,
+			_("%s: failed to prepare new %s entry\n"),
+			Prog, sub_uid_dbname ());
+		free (starts);
+		return 1;
+	}
+	if (sub_gid_add_ranges ((const char *const *) sub_gid_owners.names,
+	                        starts, sub_gid_owners.count, count) == 0) {
+		fprintf (stderr,
+			_("%s: failed to prepare new %s entry\n"),
+			Prog, sub_gid_dbname ());
+		free (starts);
+		return 1;
+	}
+	free (starts);
+	free_owners (&sub_uid_owners);
+	free_owners (&sub_gid_owners);
+	return 0;
+}
+
+/*
+ * add_sub_uids - add the subordinate UIDs of the users which need them
+ *
+ *	The ranges of all the users are found at once, in the order of the
+ *	input.
+ *
+ *	It returns the number of errors.
+ */
+static int add_sub_uids (void)
+{
+	unsigned long *starts;
+	unsigned long count = 0;
+
+	if (0 == sub_uid_owners.count) {
+		return 0;
+	}
+	remove_duplicates (&sub_uid_owners);
+
+	starts = (unsigned long *) xmalloc (sub_uid_owners.count * sizeof (*starts));
+	if (reserve_sub_uids (sub_uid_owners.count, starts, &count) != 0) {
+		fprintf (stderr,
+			_("%s: can't find subordinate user range\n"),
+			Prog);
+		free (starts);
+		return 1;
+	}
+	if (sub_uid_add_ranges ((const char *const *) sub_uid_owners.names,
+	                        starts, sub_uid_owners.count, count) == 0) {
+		fprintf (stderr,
+			_("%s: failed to prepare new %s entry\n"),
+			Prog, sub_uid_dbname ());
+	}
+	free (starts);
+	return 0;
+}
+
+/*
+ * add_sub_gids - add the subordinate GIDs of the users which need them
+ *
+ *	The ranges of all the users are found at once, in the order of the
+ *	input.
+ *
+ *	It returns the number of errors.
+ */
+static int add_sub_gids (void)
+{
+	unsigned long *starts;
+	unsigned long count = 0;
+
+	if (0 == sub_gid_owners.count) {
+		return 0;
+	}
+	remove_duplicates (&sub_gid_owners);
+
+	starts = (unsigned long *) xmalloc (sub_gid_owners.count * sizeof (*starts));
+	if (reserve_sub_gids (sub_gid_owners.count, starts, &count) != 0) {
+		fprintf (stderr,
+			_("%s: can't find subordinate group range\n"),
+			Prog);
+		free (starts);
+		return 1;
+	}
+	if (sub_gid_add_ranges ((const char *const *) sub_gid_owners.names,
+	                        starts, sub_gid_owners.count, count) == 0) {
+		fprintf (stderr,
+			_("%s: failed to prepare new %s entry\n"),
+			Prog, sub_gid_dbname ());
+	}
+	free (starts);
+	return 0;
+}
+#endif				/* ENABLE_SUBIDS */
+
+#ifdef WITH_SELINUX
+/*
+ * set_seusers - set the SELinux login mapping of the users of the input
+ *
+ *	All the mappings are changed in a single transaction: each commit
+ *	rebuilds the policy.
+ *
+ *	It returns the number of errors.
+ */
+static int set_seusers (void)
+{
+	int errors = 0;
+	size_t i;
+
+	if (0 == seuser_owners.count) {
+		return 0;
+	}
+	remove_duplicates (&seuser_owners);
+
+	if (seuser_batch_begin () != 0) {
+		return 1;
+	}
+	for (i = 0; i < seuser_owners.count; i++) {
+		if (set_seuser (seuser_owners.names[i], user_selinux) != 0) {
+			fprintf (stderr,
+			         _("%s: warning: the user name %s to %s SELinux user mapping failed.\n"),
+			         Prog, seuser_owners.names[i], user_selinux);
+			errors++;
+		}
+	}
+	if (0 != errors) {
+		seuser_batch_abort ();
+		return errors;
+	}
+	if (seuser_batch_commit () != 0) {
+		errors++;
+	}
+	return errors;
+}
+#endif				/* WITH_SELINUX */
+
 /*
  * process_flags - parse the command line options
  *
@@ -584,6 +937,7 @@ static void process_flags (int argc, char **argv)
 		{"crypt-method", required_argument, NULL, 'c'},
 #endif				/* !USE_PAM */
 		{"help",         no_argument,       NULL, 'h'},
+		{"skel",         required_argument, NULL, 'k'},
 		{"system",       no_argument,       NULL, 'r'},
 		{"root",         required_argument, NULL, 'R'},
 #ifndef USE_PAM
@@ -591,20 +945,26 @@ static void process_flags (int argc, char **argv)
 		{"sha-rounds",   required_argument, NULL, 's'},
 #endif				/* USE_SHA_CRYPT */
 #endif				/* !USE_PAM */
+#ifdef WITH_SELINUX
+		{"selinux-user", required_argument, NULL, 'Z'},
+#endif				/* WITH_SELINUX */
 		{NULL, 0, NULL, '\0'}
 	};
 
 	while ((c = getopt_long (argc, argv,
 #ifndef USE_PAM
 #ifdef USE_SHA_CRYPT
-	                         "c:hrs:",
+	                         "c:hk:rs:"
 #else				/* !USE_SHA_CRYPT */
-	                         "c:hr",
+	                         "c:hk:r"
 #endif				/* !USE_SHA_CRYPT */
 #else				/* USE_PAM */
-	                         "hr",
+	                         "hk:r"
 #endif
-	                         long_options, NULL)) != -1) {
+#ifdef WITH_SELINUX
+	                         "Z:"
+#endif				/* WITH_SELINUX */
+	                         , long_options, NULL)) != -1) {
 		switch (c) {
 #ifndef USE_PAM
 		case 'c':
@@ -614,6 +974,9 @@ static void process_flags (int argc, char **argv)
 		case 'h':
 			usage (EXIT_SUCCESS);
 			break;
+		case 'k':
+			skel_dir = optarg;
+			break;
 		case 'r':
 			rflg = true;
 			break;
@@ -632,6 +995,17 @@ static void process_flags (int argc, char **argv)
 			break;
 #endif				/* USE_SHA_CRYPT */
 #endif				/* !USE_PAM */
+#ifdef WITH_SELINUX
+		case 'Z':
+			if (is_selinux_enabled () <= 0) {
+				fprintf (stderr,
+				         _("%s: -Z requires SELinux enabled kernel\n"),
+				         Prog);
+				usage (EXIT_FAILURE);
+			}
+			user_selinux = optarg;
+			break;
+#endif				/* WITH_SELINUX */
 		default:
 			usage (EXIT_FAILURE);
 			break;
@@ -663,6 +1037,16 @@ static void process_flags (int argc, char **argv)
  */
 static void check_flags (void)
 {
+	struct stat sb;
+
+	if (   (NULL != skel_dir)
+	    && ((stat (skel_dir, &sb) != 0) || !S_ISDIR (sb.st_mode))) {
+		fprintf (stderr,
+		         _("%s: invalid skeleton directory '%s'\n"),
+		         Prog, skel_dir);
+		usage (EXIT_FAILURE);
+	}
+
 #ifndef USE_PAM
 #ifdef USE_SHA_CRYPT
 	if (sflg && !cflg) {
@@ -746,6 +1130,9 @@ static void check_perms (void)
  */
 static void open_files (void)
 {
+	struct commonio_db *dbs[COMMONIO_TXN_MAX];
+	size_t count = 0, failed;
+
 	/*
 	 * Lock the password files and open them for update. This will bring
 	 * all of the entries into memory where they may be searched for an
@@ -807,42 +1194,30 @@ static void open_files (void)
 	}
 #endif				/* ENABLE_SUBIDS */
 
-	if (pw_open (O_CREAT | O_RDWR) == 0) {
-		fprintf (stderr, _("%s: cannot open %s\n"), Prog, pw_dbname ());
-		fail_exit (EXIT_FAILURE);
-	}
-	if (is_shadow && (spw_open (O_CREAT | O_RDWR) == 0)) {
-		fprintf (stderr, _("%s: cannot open %s\n"), Prog, spw_dbname ());
-		fail_exit (EXIT_FAILURE);
-	}
-	if (gr_open (O_CREAT | O_RDWR) == 0) {
-		fprintf (stderr, _("%s: cannot open %s\n"), Prog, gr_dbname ());
-		fail_exit (EXIT_FAILURE);
+	/* The files are read concurrently with OPEN_THREADS */
+	dbs[count++] = __pw_get_db ();
+	if (is_shadow) {
+		dbs[count++] = __spw_get_db ();
 	}
+	dbs[count++] = __gr_get_db ();
 #ifdef SHADOWGRP
-	if (is_shadow_grp && (sgr_open (O_CREAT | O_RDWR) == 0)) {
-		fprintf (stderr, _("%s: cannot open %s\n"), Prog, sgr_dbname ());
-		fail_exit (EXIT_FAILURE);
+	if (is_shadow_grp) {
+		dbs[count++] = __sgr_get_db ();
 	}
 #endif
 #ifdef ENABLE_SUBIDS
 	if (is_sub_uid) {
-		if (sub_uid_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr,
-			         _("%s: cannot open %s\n"),
-			         Prog, sub_uid_dbname ());
-			fail_exit (EXIT_FAILURE);
-		}
+		dbs[count++] = __sub_uid_get_db ();
 	}
 	if (is_sub_gid) {
-		if (sub_gid_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr,
-			         _("%s: cannot open %s\n"),
-			         Prog, sub_gid_dbname ());
-			fail_exit (EXIT_FAILURE);
-		}
+		dbs[count++] = __sub_gid_get_db ();
 	}
 #endif				/* ENABLE_SUBIDS */
+	if (commonio_open_set (dbs, count, O_CREAT | O_RDWR, &failed) == 0) {
+		fprintf (stderr, _("%s: cannot open %s\n"),
+		         Prog, dbs[failed]->filename);
+		fail_exit (EXIT_FAILURE);
+	}
 }
 
 /*
@@ -850,11 +1225,40 @@ static void open_files (void)
  */
 static void close_files (void)
 {
-	if (pw_close () == 0) {
-		fprintf (stderr, _("%s: failure while writing changes to %s\n"), Prog, pw_dbname ());
-		SYSLOG ((LOG_ERR, "failure while writing changes to %s", pw_dbname ()));
+	struct commonio_txn txn;
+
+	/*
+	 * Write all the databases before replacing any of them, so that
+	 * either all the changes or none are committed.
+	 */
+	commonio_txn_init (&txn);
+	(void) commonio_txn_add (&txn, __pw_get_db ());
+	if (is_shadow) {
+		(void) commonio_txn_add (&txn, __spw_get_db ());
+	}
+	(void) commonio_txn_add (&txn, __gr_get_db ());
+#ifdef SHADOWGRP
+	if (is_shadow_grp) {
+		(void) commonio_txn_add (&txn, __sgr_get_db ());
+	}
+#endif
+#ifdef ENABLE_SUBIDS
+	if (is_sub_uid) {
+		(void) commonio_txn_add (&txn, __sub_uid_get_db ());
+	}
+	if (is_sub_gid) {
+		(void) commonio_txn_add (&txn, __sub_gid_get_db ());
+	}
+#endif				/* ENABLE_SUBIDS */
+
+	if (commonio_txn_commit (&txn) == 0) {
+		fprintf (stderr,
+		         _("%s: failure while writing changes to %s\n"),
+		         Prog, txn.failed->filename);
+		SYSLOG ((LOG_ERR, "failure while writing changes to %s", txn.failed->filename));
 		fail_exit (EXIT_FAILURE);
 	}
+
 	if (pw_unlock () == 0) {
 		fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, pw_dbname ());
 		SYSLOG ((LOG_ERR, "failed to unlock %s", pw_dbname ()));
@@ -863,13 +1267,6 @@ static void close_files (void)
 	pw_locked = false;
 
 	if (is_shadow) {
-		if (spw_close () == 0) {
-			fprintf (stderr,
-			         _("%s: failure while writing changes to %s\n"),
-			         Prog, spw_dbname ());
-			SYSLOG ((LOG_ERR, "failure while writing changes to %s", spw_dbname ()));
-			fail_exit (EXIT_FAILURE);
-		}
 		if (spw_unlock () == 0) {
 			fprintf (stderr,
 			         _("%s: failed to unlock %s\n"),
@@ -880,28 +1277,6 @@ static void close_files (void)
 		spw_locked = false;
 	}
 
-	if (gr_close () == 0) {
-		fprintf (stderr,
-		         _("%s: failure while writing changes to %s\n"),
-		         Prog, gr_dbname ());
-		SYSLOG ((LOG_ERR, "failure while writing changes to %s", gr_dbname ()));
-		fail_exit (EXIT_FAILURE);
-	}
-#ifdef ENABLE_SUBIDS
-	if (is_sub_uid  && (sub_uid_close () == 0)) {
-		fprintf (stderr,
-		         _("%s: failure while writing changes to %s\n"), Prog, sub_uid_dbname ());
-		SYSLOG ((LOG_ERR, "failure while writing changes to %s", sub_uid_dbname ()));
-		fail_exit (EXIT_FAILURE);
-	}
-	if (is_sub_gid  && (sub_gid_close () == 0)) {
-		fprintf (stderr,
-		         _("%s: failure while writing changes to %s\n"), Prog, sub_gid_dbname ());
-		SYSLOG ((LOG_ERR, "failure while writing changes to %s", sub_gid_dbname ()));
-		fail_exit (EXIT_FAILURE);
-	}
-#endif				/* ENABLE_SUBIDS */
-
 	if (gr_unlock () == 0) {
 		fprintf (stderr,
 		         _("%s: failed to unlock %s\n"),
@@ -913,13 +1288,6 @@ static void close_files (void)
 
 #ifdef SHADOWGRP
 	if (is_shadow_grp) {
-		if (sgr_close () == 0) {
-			fprintf (stderr,
-			         _("%s: failure while writing changes to %s\n"),
-			         Prog, sgr_dbname ());
-			SYSLOG ((LOG_ERR, "failure while writing changes to %s", sgr_dbname ()));
-			fail_exit (EXIT_FAILURE);
-		}
 		if (sgr_unlock () == 0) {
 			fprintf (stderr,
 			         _("%s: failed to unlock %s\n"),
@@ -950,6 +1318,138 @@ static void close_files (void)
 #endif				/* ENABLE_SUBIDS */
 }
 
+/*
+ * add_home - remember that the home directory of a user shall be created
+ */
+static void add_home (struct new_home **homes, size_t *nhomes, int line,
+                      const struct passwd *pwd)
+{
+	struct new_home *h;
+	const char *cp;
+
+	/* The list is grown by chunks of 64 entries */
+	if (0 == (*nhomes % 64)) {
+		*homes = realloc (*homes, (*nhomes + 64) * sizeof (**homes));
+		if (NULL == *homes) {
+			fprintf (stderr,
+			         _("%s: failed to allocate memory: %s\n"),
+			         Prog, strerror (errno));
+			fail_exit (EXIT_FAILURE);
+		}
+	}
+	h = &(*homes)[*nhomes];
+	h->line = line;
+	h->dir = xstrdup (pwd->pw_dir);
+	h->uid = pwd->pw_uid;
+	h->gid = pwd->pw_gid;
+	h->created = false;
+	h->depth = 0;
+	for (cp = h->dir; '\0' != *cp; cp++) {
+		if ('/' == *cp) {
+			h->depth++;
+		}
+	}
+	(*nhomes)++;
+}
+
+/*
+ * home_cmp - sort the home directories by depth, then by name, and then
+ *            by line
+ */
+static int home_cmp (const void *p1, const void *p2)
+{
+	const struct new_home *h1 = p1;
+	const struct new_home *h2 = p2;
+	int cmp;
+
+	if (h1->depth != h2->depth) {
+		return (h1->depth > h2->depth) - (h1->depth < h2->depth);
+	}
+	cmp = strcmp (h1->dir, h2->dir);
+	if (0 != cmp) {
+		return cmp;
+	}
+	return (h1->line > h2->line) - (h1->line < h2->line);
+}
+
+static void create_home (unused struct work_pool *pool, void *arg)
+{
+	struct new_home *h = arg;
+
+/* FIXME: should check for directory */
+	if (mkdir (h->dir, home_mode) != 0) {
+		fprintf (stderr,
+		         _("%s: line %d: mkdir %s failed: %s\n"),
+		         Prog, h->line, h->dir, strerror (errno));
+	} else if (chown (h->dir, h->uid, h->gid) != 0) {
+		fprintf (stderr,
+		         _("%s: line %d: chown %s failed: %s\n"),
+		         Prog, h->line, h->dir, strerror (errno));
+	} else {
+		h->created = true;
+	}
+}
+
+/*
+ * create_homes - create the home directories of the new users
+ *
+ *	They are created once the users are written, by COPY_THREADS
+ *	threads. The directories of the same depth are created together,
+ *	so that a home directory inside another new home directory is
+ *	created after its parent. A directory listed on several lines is
+ *	created for the first of them.
+ *
+ *	With -k, the skeleton is then copied to each created directory.
+ *	copy_tree_cached() copies the content of the files with its own
+ *	threads, so the directories are populated one after the other.
+ *
+ *	It returns the number of directories which could not be populated.
+ */
+static int create_homes (struct new_home *homes, size_t nhomes)
+{
+	int errors = 0;
+	int nthreads = getdef_num ("COPY_THREADS", 1);
+	size_t i, j, k;
+
+	qsort (homes, nhomes, sizeof (*homes), home_cmp);
+
+	for (i = 0; i < nhomes; i = j) {
+		/*@null@*/struct work_pool *pool = NULL;
+
+		for (j = i;
+		     (j < nhomes) && (homes[j].depth == homes[i].depth);
+		     j++);
+		if ((nthreads > 1) && ((j - i) > 1)) {
+			pool = work_pool_start ((size_t) nthreads,
+			                        2 * (size_t) nthreads);
+		}
+		for (k = i; k < j; k++) {
+			if (   (k > i)
+			    && (strcmp (homes[k - 1].dir, homes[k].dir) == 0)) {
+				continue;
+			}
+			if (!work_pool_queue (pool, create_home, &homes[k], true)) {
+				create_home (pool, &homes[k]);
+			}
+		}
+		(void) work_pool_stop (pool);
+	}
+
+	for (i = 0; (NULL != skel_dir) && (i < nhomes); i++) {
+		if (   homes[i].created
+		    && (copy_tree_cached (skel_dir, homes[i].dir, false,
+		                          (uid_t) -1, homes[i].uid,
+		                          (gid_t) -1, homes[i].gid) != 0)) {
+			fprintf (stderr,
+			         _("%s: line %d: cannot copy %s to %s\n"),
+			         Prog, homes[i].line, skel_dir, homes[i].dir);
+			errors++;
+		}
+	}
+
+	return errors;
+}
+
 int main (int argc, char **argv)
 {
 	char buf[BUFSIZ];
@@ -962,11 +1462,18 @@ int main (int argc, char **argv)
 	int line = 0;
 	uid_t uid;
 	gid_t gid;
+	struct new_home *homes = NULL;
+	size_t nhomes = 0;
+	struct input_line *lines = NULL;
+	size_t nlines = 0, alloc = 0, i, len;
+	const char *password;
+#ifndef USE_PAM
+	/*@null@*/struct crypt_job *jobs = NULL;
+#endif				/* !USE_PAM */
 #ifdef USE_PAM
-	int *lines = NULL;
-	char **usernames = NULL;
-	char **passwords = NULL;
-	unsigned int nusers = 0;
+	int *pam_lines = NULL;
+	/*@null@*/struct pam_passwd_job *pam_jobs = NULL;
+	size_t nusers = 0;
 #endif				/* USE_PAM */
 
 	Prog = Basename (argv[0]);
@@ -976,7 +1483,7 @@ int main (int argc, char **argv)
 	(void) textdomain (PACKAGE);
 
 	/* FIXME: will not work with an input file */
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", true, argc, argv);
 
 	OPENLOG ("newusers");
 
@@ -996,8 +1503,12 @@ int main (int argc, char **argv)
 
 	open_files ();
 
+	/* Mode of the home directories created below */
+	home_mode = 0777 & ~getdef_num ("UMASK", GETDEF_DEFAULT_UMASK);
+
 	/*
-	 * Read each line. The line has the same format as a password file
+	 * Read all the lines first, so that the passwords can be encrypted
+	 * at once. The line has the same format as a password file
 	 * entry, except that certain fields are not constrained to be
 	 * numerical values. If a group ID is entered which does not already
 	 * exist, an attempt is made to allocate the same group ID as the
@@ -1042,20 +1553,54 @@ int main (int argc, char **argv)
 			continue;
 		}
 
+		if (nlines == alloc) {
+			struct input_line *tmp;
+
+			alloc = (0 == alloc) ? 64 : alloc * 2;
+			tmp = (struct input_line *) xmalloc (alloc * sizeof (*tmp));
+			if (0 != nlines) {
+				memcpy (tmp, lines, nlines * sizeof (*tmp));
+			}
+			free (lines);
+			lines = tmp;
+		}
+		lines[nlines].line = line;
+		/* The fields are separated by NULs in buf */
+		len = (size_t) (fields[6] - buf) + strlen (fields[6]) + 1;
+		lines[nlines].buf = xmalloc (len);
+		memcpy (lines[nlines].buf, buf, len);
+		for (nfields = 0; nfields < 7; nfields++) {
+			lines[nlines].fields[nfields] =
+				lines[nlines].buf + (fields[nfields] - buf);
+		}
+		nlines++;
+	}
+
+#ifndef USE_PAM
+	jobs = encrypt_passwords (lines, nlines);
+#endif				/* !USE_PAM */
+
+	/*
+	 * Process the lines in the order of the input.
+	 */
+	for (i = 0; i < nlines; i++) {
+		line = lines[i].line;
+		memcpy (fields, lines[i].fields, sizeof (lines[i].fields));
+
 		/*
 		 * First check if we have to create or update an user
 		 */
 		pw = pw_locate (fields[0]);
 		/* local, no need for xgetpwnam */
 		if (   (NULL == pw)
-		    && (getpwnam (fields[0]) != NULL)) {
+		    && (timed_getpwnam (fields[0]) != NULL)) {
 			fprintf (stderr, _("%s: cannot update the entry of user %s (not in the passwd database)\n"), Prog, fields[0]);
 			errors++;
 			continue;
 		}
 
 		if (   (NULL == pw)
-		    && (get_user_id (fields[2], &uid) != 0)) {
+		    && (get_user_id (fields[2], fields[3], &uid) != 0)) {
 			fprintf (stderr,
 			         _("%s: line %d: can't create user\n"),
 			         Prog, line);
@@ -1116,15 +1661,34 @@ int main (int argc, char **argv)
 
 #ifdef USE_PAM
 		/* keep the list of user/password for later update by PAM */
+		if (NULL == pam_jobs) {
+			/* at most one user per line */
+			pam_lines = (int *) xmalloc (nlines * sizeof (int));
+			pam_jobs = (struct pam_passwd_job *)
+			           xmalloc (nlines * sizeof (*pam_jobs));
+		}
+		pam_lines[nusers] = line;
+		pam_jobs[nusers].name = xstrdup (fields[0]);
+		pam_jobs[nusers].password = xstrdup (fields[1]);
 		nusers++;
-		lines     = realloc (lines,     sizeof (lines[0])     * nusers);
-		usernames = realloc (usernames, sizeof (usernames[0]) * nusers);
-		passwords = realloc (passwords, sizeof (passwords[0]) * nusers);
-		lines[nusers-1]     = line;
-		usernames[nusers-1] = strdup (fields[0]);
-		passwords[nusers-1] = strdup (fields[1]);
 #endif				/* USE_PAM */
-		if (add_passwd (&newpw, fields[1]) != 0) {
+		password = fields[1];
+#ifndef USE_PAM
+		if (NULL != jobs) {
+			password = jobs[i].cipher;
+			if (NULL == password) {
+				fprintf (stderr,
+				         _("%s: failed to crypt password with salt '%s': %s\n"),
+				         Prog, jobs[i].salt, strerror (jobs[i].err));
+				fprintf (stderr,
+				         _("%s: line %d: can't update password\n"),
+				         Prog, line);
+				errors++;
+				continue;
+			}
+		}
+#endif				/* !USE_PAM */
+		if (add_passwd (&newpw, password) != 0) {
 			fprintf (stderr,
 			         _("%s: line %d: can't update password\n"),
 			         Prog, line);
@@ -1143,24 +1707,10 @@ int main (int argc, char **argv)
 			newpw.pw_shell = fields[6];
 		}
 
+		/* The home directory is created once the users are written */
 		if (   ('\0' != fields[5][0])
 		    && (access (newpw.pw_dir, F_OK) != 0)) {
-/* FIXME: should check for directory */
-			mode_t msk = 0777 & ~getdef_num ("UMASK",
-			                                 GETDEF_DEFAULT_UMASK);
-			if (mkdir (newpw.pw_dir, msk) != 0) {
-				fprintf (stderr,
-				         _("%s: line %d: mkdir %s failed: %s\n"),
-				         Prog, line, newpw.pw_dir,
-				         strerror (errno));
-			} else if (chown (newpw.pw_dir,
-			                  newpw.pw_uid,
-			                  newpw.pw_gid) != 0) {
-				fprintf (stderr,
-				         _("%s: line %d: chown %s failed: %s\n"),
-				         Prog, line, newpw.pw_dir,
-				         strerror (errno));
-			}
+			add_home (&homes, &nhomes, line, &newpw);
 		}
 
 		/*
@@ -1176,46 +1726,42 @@ int main (int argc, char **argv)
 
 #ifdef ENABLE_SUBIDS
 		/*
-		 * Add subordinate uids if the user does not have them.
+		 * Add subordinate uids and gids if the user does not have
+		 * them. They are allocated for all the users at once, after
+		 * the whole input was read.
 		 */
 		if (is_sub_uid && !sub_uid_assigned(fields[0])) {
-			uid_t sub_uid_start = 0;
-			unsigned long sub_uid_count = 0;
-			if (find_new_sub_uids(fields[0], &sub_uid_start, &sub_uid_count) == 0) {
-				if (sub_uid_add(fields[0], sub_uid_start, sub_uid_count) == 0) {
-					fprintf (stderr,
-						_("%s: failed to prepare new %s entry\n"),
-						Prog, sub_uid_dbname ());
-				}
-			} else {
-				fprintf (stderr,
-					_("%s: can't find subordinate user range\n"),
-					Prog);
-				errors++;
-			}
+			add_owner (&sub_uid_owners, fields[0]);
 		}
-
-		/*
-		 * Add subordinate gids if the user does not have them.
-		 */
 		if (is_sub_gid && !sub_gid_assigned(fields[0])) {
-			gid_t sub_gid_start = 0;
-			unsigned long sub_gid_count = 0;
-			if (find_new_sub_gids(fields[0], &sub_gid_start, &sub_gid_count) == 0) {
-				if (sub_gid_add(fields[0], sub_gid_start, sub_gid_count) == 0) {
-					fprintf (stderr,
-						_("%s: failed to prepare new %s entry\n"),
-						Prog, sub_uid_dbname ());
-				}
-			} else {
-				fprintf (stderr,
-					_("%s: can't find subordinate group range\n"),
-					Prog);
-				errors++;
-			}
+			add_owner (&sub_gid_owners, fields[0]);
 		}
 #endif				/* ENABLE_SUBIDS */
+#ifdef WITH_SELINUX
+		if (Zflg) {
+			add_owner (&seuser_owners, fields[0]);
+		}
+#endif				/* WITH_SELINUX */
+	}
+
+#ifndef USE_PAM
+	if (NULL != jobs) {
+		crypt_jobs_free (jobs, nlines);
+	}
+#endif				/* !USE_PAM */
+	for (i = 0; i < nlines; i++) {
+		len = (size_t) (lines[i].fields[6] - lines[i].buf)
+		      + strlen (lines[i].fields[6]);
+		memzero (lines[i].buf, len);
+		free (lines[i].buf);
 	}
+	free (lines);
+
+#ifdef ENABLE_SUBIDS
+	errors += add_sub_ids ();
+	errors += add_sub_uids ();
+	errors += add_sub_gids ();
+#endif				/* ENABLE_SUBIDS */
 
 	/*
 	 * Any detected errors will cause the entire set of changes to be
@@ -1232,21 +1778,48 @@ int main (int argc, char **argv)
 
 	close_files ();
 
-	nscd_flush_cache ("passwd");
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
+	id_pool_free (&uid_pool);
+	id_pool_free (&gid_pool);
+#ifdef ENABLE_SUBIDS
+	free_owners (&sub_uid_owners);
+	free_owners (&sub_gid_owners);
+#endif				/* ENABLE_SUBIDS */
+#ifdef WITH_SELINUX
+	/* The users exist now */
+	errors += set_seusers ();
+	free_owners (&seuser_owners);
+#endif				/* WITH_SELINUX */
+
+	cache_flush_defer (CACHE_DB_PASSWD | CACHE_DB_GROUP);
+
+	errors += create_homes (homes, nhomes);
+	for (i = 0; i < nhomes; i++) {
+		free (homes[i].dir);
+	}
+	free (homes);
 
 #ifdef USE_PAM
-	unsigned int i;
-	/* Now update the passwords using PAM */
+	/*
+	 * Now update the passwords using PAM, with a single PAM handle.
+	 * The PAM modules are not expected to be thread safe: this is done
+	 * by a single thread.
+	 */
+	if (0 != nusers) {
+		(void) do_pam_passwd_batch ("newusers", pam_jobs, nusers);
+	}
 	for (i = 0; i < nusers; i++) {
-		if (do_pam_passwd_non_interactive ("newusers", usernames[i], passwords[i]) != 0) {
+		if (pam_jobs[i].failed) {
 			fprintf (stderr,
 			         _("%s: (line %d, user %s) password not changed\n"),
-			         Prog, lines[i], usernames[i]);
+			         Prog, pam_lines[i], pam_jobs[i].name);
 			errors++;
 		}
+		free ((char *) pam_jobs[i].name);
+		strzero ((char *) pam_jobs[i].password);
+		free ((char *) pam_jobs[i].password);
 	}
+	free (pam_jobs);
+	free (pam_lines);
 #endif				/* USE_PAM */
 
 	return ((0 == errors) ? EXIT_SUCCESS : EXIT_FAILURE);
@@ -50,12 +50,15 @@
 #include <time.h>
 #include "defines.h"
 #include "getdef.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
+#include "commonio.h"
 #include "prototypes.h"
 #include "pwauth.h"
 #include "pwio.h"
 #include "shadowio.h"
+#ifdef WITH_TCB
+#include "tcbfuncs.h"
+#endif				/* WITH_TCB */
 
 /*
  * exit status values
@@ -143,9 +146,14 @@ static void check_password (const struct passwd *, const struct spwd *);
 static /*@observer@*/const char *date_to_str (time_t);
 static /*@observer@*/const char *pw_status (const char *);
 static void print_status (const struct passwd *);
+static void print_spwd_status (const struct passwd *,
+                               /*@null@*/const struct spwd *);
+static void print_all_status (void);
 static /*@noreturn@*/void fail_exit (int);
 static /*@noreturn@*/void oom (void);
-static char *update_crypt_pw (char *);
+static /*@null@*/char *update_crypt_pw (char *);
+static /*@null@*/const void *change_passwd (const void *ent, void *arg);
+static /*@null@*/const void *change_shadow (const void *ent, void *arg);
 static void update_noshadow (void);
 
 static void update_shadow (void);
@@ -481,9 +489,17 @@ static /*@observer@*/const char *pw_status (const char *pass)
  */
 static void print_status (const struct passwd *pw)
 {
-	struct spwd *sp;
+	/* local, no need for xgetspnam */
+	print_spwd_status (pw, timed_getspnam (pw->pw_name));
+}
 
-	sp = getspnam (pw->pw_name); /* local, no need for xgetspnam */
+/*
+ * print_spwd_status - print the password status of pw, with its shadow
+ *                     entry sp if there is one
+ */
+static void print_spwd_status (const struct passwd *pw,
+                               /*@null@*/const struct spwd *sp)
+{
 	if (NULL != sp) {
 		(void) printf ("%s %s %s %lld %lld %lld %lld\n",
 		               pw->pw_name,
@@ -499,6 +515,119 @@ static void print_status (const struct passwd *pw)
 	}
 }
 
+#ifdef WITH_TCB
+/*
+ * print_all_tcb_status - print the password status of all the users,
+ *                        with USE_TCB
+ *
+ *	The users are listed first, and their shadow files are then read
+ *	concurrently from TCB_DIR by shadowtcb_read_all(). The users
+ *	which have no readable tcb shadow file are looked up with
+ *	getspnam().
+ */
+static void print_all_tcb_status (void)
+{
+	const struct passwd *pw;
+	struct passwd **users = NULL;
+	const char **names;
+	struct spwd **entries;
+	size_t n = 0, size = 0;
+	size_t i;
+	bool batch;
+
+	setpwent ();
+	while ((pw = getpwent ()) != NULL) {
+		if (n == size) {
+			size = (0 == size) ? 256 : 2 * size;
+			users = (struct passwd **)
+			        realloc (users, size * sizeof (*users));
+			if (NULL == users) {
+				oom ();
+			}
+		}
+		users[n] = __pw_dup (pw);
+		if (NULL == users[n]) {
+			oom ();
+		}
+		n++;
+	}
+	endpwent ();
+	if (0 == n) {
+		return;
+	}
+
+	names = (const char **) xmalloc (n * sizeof (*names));
+	entries = (struct spwd **) xmalloc (n * sizeof (*entries));
+	for (i = 0; i < n; i++) {
+		names[i] = users[i]->pw_name;
+	}
+	batch = (shadowtcb_batch_begin () == SHADOWTCB_SUCCESS);
+	if (   !batch
+	    || (shadowtcb_read_all (names, n, entries) == SHADOWTCB_FAILURE)) {
+		memzero (entries, n * sizeof (*entries));
+	}
+	if (batch) {
+		(void) shadowtcb_batch_end ();
+	}
+
+	for (i = 0; i < n; i++) {
+		if (NULL != entries[i]) {
+			print_spwd_status (users[i], entries[i]);
+			free (entries[i]);
+		} else {
+			/* local, no need for xgetspnam */
+			print_spwd_status (users[i], timed_getspnam (names[i]));
+		}
+		pw_free (users[i]);
+	}
+	free (names);
+	free (entries);
+	free (users);
+}
+#endif				/* WITH_TCB */
+
+/*
+ * print_all_status - print the password status of all the users (-a)
+ *
+ *	The local shadow file is read once, and the users are found in it
+ *	with the name index of the database, instead of a getspnam() for
+ *	each user. Only the users which are not in the local shadow file
+ *	are looked up with getspnam().
+ */
+static void print_all_status (void)
+{
+	const struct passwd *pw;
+	const struct spwd *sp;
+	bool local;
+
+#ifdef WITH_TCB
+	if (getdef_bool ("USE_TCB")) {
+		print_all_tcb_status ();
+		return;
+	}
+#endif				/* WITH_TCB */
+
+	local = (spw_open (O_RDONLY) != 0);
+
+	setpwent ();
+	while ((pw = getpwent ()) != NULL) {
+		sp = NULL;
+		if (local) {
+			sp = spw_locate (pw->pw_name);
+		}
+		if (NULL == sp) {
+			/* local, no need for xgetspnam */
+			sp = timed_getspnam (pw->pw_name);
+		}
+		print_spwd_status (pw, sp);
+	}
+	endpwent ();
+
+	if (local) {
+		(void) spw_close ();
+	}
+}
+
 
 static /*@noreturn@*/void fail_exit (int status)
 {
@@ -527,7 +656,11 @@ static /*@noreturn@*/void oom (void)
 	fail_exit (E_FAILURE);
 }
 
-static char *update_crypt_pw (char *cp)
+/*
+ * update_crypt_pw - Return the new encrypted password, or NULL if it
+ *                   cannot be changed.
+ */
+static /*@null@*/char *update_crypt_pw (char *cp)
 {
 #ifndef USE_PAM
 	if (do_update_pwd) {
@@ -545,7 +678,7 @@ static char *update_crypt_pw (char *cp)
 			                _("%s: unlocking the password would result in a passwordless account.\n"
 			                  "You should set a password with usermod -p to unlock the password of this account.\n"),
 			                Prog);
-			fail_exit (E_FAILURE);
+			return NULL;
 		} else {
 			cp++;
 		}
@@ -562,99 +695,43 @@ static char *update_crypt_pw (char *cp)
 }
 
 
-static void update_noshadow (void)
+/*
+ * change_passwd - Return the entry of /etc/passwd with the new password,
+ *                 or NULL if it cannot be changed.
+ */
+static /*@null@*/const void *change_passwd (const void *ent,
+                                            unused void *arg)
 {
-	const struct passwd *pw;
 	struct passwd *npw;
 
-	if (pw_lock () == 0) {
-		(void) fprintf (stderr,
-		                _("%s: cannot lock %s; try again later.\n"),
-		                Prog, pw_dbname ());
-		exit (E_PWDBUSY);
-	}
-	pw_locked = true;
-	if (pw_open (O_CREAT | O_RDWR) == 0) {
-		(void) fprintf (stderr,
-		                _("%s: cannot open %s\n"),
-		                Prog, pw_dbname ());
-		SYSLOG ((LOG_WARN, "cannot open %s", pw_dbname ()));
-		fail_exit (E_MISSING);
-	}
-	pw = pw_locate (name);
-	if (NULL == pw) {
-		(void) fprintf (stderr,
-		                _("%s: user '%s' does not exist in %s\n"),
-		                Prog, name, pw_dbname ());
-		fail_exit (E_NOPERM);
-	}
-	npw = __pw_dup (pw);
+	npw = __pw_dup (ent);
 	if (NULL == npw) {
 		oom ();
 	}
 	npw->pw_passwd = update_crypt_pw (npw->pw_passwd);
-	if (pw_update (npw) == 0) {
-		(void) fprintf (stderr,
-		                _("%s: failed to prepare the new %s entry '%s'\n"),
-		                Prog, pw_dbname (), npw->pw_name);
-		fail_exit (E_FAILURE);
-	}
-	if (pw_close () == 0) {
-		(void) fprintf (stderr,
-		                _("%s: failure while writing changes to %s\n"),
-		                Prog, pw_dbname ());
-		SYSLOG ((LOG_ERR, "failure while writing changes to %s", pw_dbname ()));
-		fail_exit (E_FAILURE);
-	}
-	if (pw_unlock () == 0) {
-		(void) fprintf (stderr,
-		                _("%s: failed to unlock %s\n"),
-		                Prog, pw_dbname ());
-		SYSLOG ((LOG_ERR, "failed to unlock %s", pw_dbname ()));
-		/* continue */
+	if (NULL == npw->pw_passwd) {
+		return NULL;
 	}
-	pw_locked = false;
+	return npw;
 }
 
-static void update_shadow (void)
+/*
+ * change_shadow - Return the entry of /etc/shadow with the new password
+ *                 and aging information, or NULL if it cannot be changed.
+ */
+static /*@null@*/const void *change_shadow (const void *ent,
+                                            unused void *arg)
 {
-	const struct spwd *sp;
 	struct spwd *nsp;
 
-	if (spw_lock () == 0) {
-		(void) fprintf (stderr,
-		                _("%s: cannot lock %s; try again later.\n"),
-		                Prog, spw_dbname ());
-		exit (E_PWDBUSY);
-	}
-	spw_locked = true;
-	if (spw_open (O_CREAT | O_RDWR) == 0) {
-		(void) fprintf (stderr,
-		                _("%s: cannot open %s\n"),
-		                Prog, spw_dbname ());
-		SYSLOG ((LOG_WARN, "cannot open %s", spw_dbname ()));
-		fail_exit (E_FAILURE);
-	}
-	sp = spw_locate (name);
-	if (NULL == sp) {
-		/* Try to update the password in /etc/passwd instead. */
-		(void) spw_close ();
-		update_noshadow ();
-		if (spw_unlock () == 0) {
-			(void) fprintf (stderr,
-			                _("%s: failed to unlock %s\n"),
-			                Prog, spw_dbname ());
-			SYSLOG ((LOG_ERR, "failed to unlock %s", spw_dbname ()));
-			/* continue */
-		}
-		spw_locked = false;
-		return;
-	}
-	nsp = __spw_dup (sp);
+	nsp = __spw_dup (ent);
 	if (NULL == nsp) {
 		oom ();
 	}
 	nsp->sp_pwdp = update_crypt_pw (nsp->sp_pwdp);
+	if (NULL == nsp->sp_pwdp) {
+		return NULL;
+	}
 	if (xflg) {
 		nsp->sp_max = (age_max * DAY) / SCALE;
 	}
@@ -686,20 +763,88 @@ static void update_shadow (void)
 	if (eflg) {
 		nsp->sp_lstchg = 0;
 	}
+	return nsp;
+}
+
+/*
+ * update_noshadow - Change the password in /etc/passwd.
+ *
+ *	With STREAM_UPDATES, the entry is changed while the file is copied,
+ *	without loading it (see commonio_stream()).
+ */
+static void update_noshadow (void)
+{
+	struct commonio_edit edit;
 
-	if (spw_update (nsp) == 0) {
+	if (pw_lock () == 0) {
 		(void) fprintf (stderr,
-		                _("%s: failed to prepare the new %s entry '%s'\n"),
-		                Prog, spw_dbname (), nsp->sp_namp);
+		                _("%s: cannot lock %s; try again later.\n"),
+		                Prog, pw_dbname ());
+		exit (E_PWDBUSY);
+	}
+	pw_locked = true;
+	memzero (&edit, sizeof edit);
+	edit.name = name;
+	edit.change = change_passwd;
+	if (pw_stream_edits (&edit, 1) == 0) {
+		if (ECANCELED == errno) {
+			fail_exit (E_FAILURE);
+		}
+		(void) fprintf (stderr,
+		                _("%s: failure while writing changes to %s\n"),
+		                Prog, pw_dbname ());
+		SYSLOG ((LOG_ERR, "failure while writing changes to %s", pw_dbname ()));
 		fail_exit (E_FAILURE);
 	}
-	if (spw_close () == 0) {
+	if (!edit.found) {
+		(void) fprintf (stderr,
+		                _("%s: user '%s' does not exist in %s\n"),
+		                Prog, name, pw_dbname ());
+		fail_exit (E_NOPERM);
+	}
+	if (pw_unlock () == 0) {
+		(void) fprintf (stderr,
+		                _("%s: failed to unlock %s\n"),
+		                Prog, pw_dbname ());
+		SYSLOG ((LOG_ERR, "failed to unlock %s", pw_dbname ()));
+		/* continue */
+	}
+	pw_locked = false;
+}
+
+/*
+ * update_shadow - Change the password and the aging information in
+ *                 /etc/shadow, or the password in /etc/passwd if the
+ *                 user has no shadow entry.
+ */
+static void update_shadow (void)
+{
+	struct commonio_edit edit;
+
+	if (spw_lock () == 0) {
+		(void) fprintf (stderr,
+		                _("%s: cannot lock %s; try again later.\n"),
+		                Prog, spw_dbname ());
+		exit (E_PWDBUSY);
+	}
+	spw_locked = true;
+	memzero (&edit, sizeof edit);
+	edit.name = name;
+	edit.change = change_shadow;
+	if (spw_stream_edits (&edit, 1) == 0) {
+		if (ECANCELED == errno) {
+			fail_exit (E_FAILURE);
+		}
 		(void) fprintf (stderr,
 		                _("%s: failure while writing changes to %s\n"),
 		                Prog, spw_dbname ());
 		SYSLOG ((LOG_ERR, "failure while writing changes to %s", spw_dbname ()));
 		fail_exit (E_FAILURE);
 	}
+	if (!edit.found) {
+		/* Try to update the password in /etc/passwd instead. */
+		update_noshadow ();
+	}
 	if (spw_unlock () == 0) {
 		(void) fprintf (stderr,
 		                _("%s: failed to unlock %s\n"),
@@ -810,7 +955,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 	/*
 	 * The program behaves differently when executed by root than when
@@ -983,11 +1128,7 @@ int main (int argc, char **argv)
 			                Prog);
 			exit (E_NOPERM);
 		}
-		setpwent ();
-		while ( (pw = getpwent ()) != NULL ) {
-			print_status (pw);
-		}
-		endpwent ();
+		print_all_status ();
 		exit (E_SUCCESS);
 	}
 #if 0
@@ -1149,9 +1290,7 @@ int main (int argc, char **argv)
 		update_noshadow ();
 	}
 
-	nscd_flush_cache ("passwd");
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
+	cache_flush_defer (CACHE_DB_PASSWD | CACHE_DB_GROUP);
 
 	SYSLOG ((LOG_INFO, "password for '%s' changed by '%s'", name, myname));
 	closelog ();
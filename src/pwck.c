@@ -40,6 +40,9 @@
 #include <pwd.h>
 #include <stdio.h>
 #include <getopt.h>
+#ifdef HAVE_MNTENT_H
+#include <mntent.h>
+#endif				/* HAVE_MNTENT_H */
 #include "chkname.h"
 #include "commonio.h"
 #include "defines.h"
@@ -47,8 +50,11 @@
 #include "pwio.h"
 #include "shadowio.h"
 #include "getdef.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
+#ifdef ENABLE_SUBIDS
+#include "groupio.h"
+#include "subordinateio.h"
+#endif				/* ENABLE_SUBIDS */
 #ifdef WITH_TCB
 #include "tcbfuncs.h"
 #endif				/* WITH_TCB */
@@ -85,6 +91,51 @@ static bool spw_locked = false;
 static bool read_only = false;
 static bool sort_mode = false;
 static bool quiet = false;		/* don't report warnings, only errors */
+static bool skip_automount = false;
+static bool stream_mode = false;
+static /*@null@*/const char *state_file = NULL;	/* incremental mode */
+#ifdef ENABLE_SUBIDS
+static bool subids_mode = false;	/* check the subordinate IDs */
+#endif				/* ENABLE_SUBIDS */
+
+/*
+ * Lines checked by the last clean run, in incremental mode.
+ * The database 0 is passwd, 1 is shadow.
+ */
+static struct check_state state;
+
+/*
+ * Results of the checks shared by many users: their home directories
+ * (e.g. /nonexistent), their login shells, and their primary groups.
+ */
+static struct check_cache homes;
+static struct check_cache shells;
+static struct check_cache groups;
+
+#ifdef WITH_TCB
+/*
+ * Shadow entries of the users, read concurrently from their tcb
+ * directories in read-only mode, in the order of the passwd file.
+ */
+static const char **tcb_names = NULL;
+static struct spwd **tcb_entries = NULL;
+static size_t tcb_count = 0;
+static size_t tcb_next = 0;
+#endif				/* WITH_TCB */
+
+/*
+ * Mount points, to find the home directories which would be mounted by
+ * autofs when checked.
+ */
+struct mount_point {
+	/*@only@*/char *dir;
+	size_t len;
+	bool autofs;
+};
+
+static /*@null@*/ /*@only@*/struct mount_point *mounts = NULL;
+static size_t mounts_count = 0;
+static bool mounts_read = false;
 
 /* local function prototypes */
 static void fail_exit (int code);
@@ -92,8 +143,23 @@ static /*@noreturn@*/void usage (int status);
 static void process_flags (int argc, char **argv);
 static void open_files (void);
 static void close_files (bool changed);
+static void read_mounts (void);
+static bool is_automounted (const char *path);
+static void check_home (struct check_result *r);
+static void check_shell (struct check_result *r);
+static void check_group (struct check_result *r);
+static void check_entries (void);
+static bool is_known (size_t db, const struct commonio_entry *ent);
+static void save_state (void);
+static bool home_exists (const char *dir);
+static bool shell_exists (const char *shell);
+static bool group_exists (gid_t gid);
 static void check_pw_file (int *errors, bool *changed);
 static void check_spw_file (int *errors, bool *changed);
+static void check_streams (int *errors);
+#ifdef ENABLE_SUBIDS
+static void check_subids (int *errors);
+#endif				/* ENABLE_SUBIDS */
 
 /*
  * fail_exit - do some cleanup and exit with the given error code
@@ -149,6 +215,8 @@ static /*@noreturn@*/void usage (int status)
 		                Prog);
 	}
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("  -i, --incremental STATE_FILE  only check the entries changed since\n"
+	                "                                the last clean run\n"), usageout);
 	(void) fputs (_("  -q, --quiet                   report errors only\n"), usageout);
 	(void) fputs (_("  -r, --read-only               display errors and warnings\n"
 	                "                                but do not change files\n"), usageout);
@@ -159,6 +227,14 @@ static /*@noreturn@*/void usage (int status)
 	{
 		(void) fputs (_("  -s, --sort                    sort entries by UID\n"), usageout);
 	}
+	(void) fputs (_("  -S, --stream                  read the files in bounded memory\n"
+	                "                                (implies --read-only)\n"), usageout);
+#ifdef ENABLE_SUBIDS
+	(void) fputs (_("  -u, --subids                  also check the subordinate user and group\n"
+	                "                                IDs\n"), usageout);
+#endif				/* ENABLE_SUBIDS */
+	(void) fputs (_("  -A, --skip-automount          do not check the home directories\n"
+	                "                                which would be automounted\n"), usageout);
 	(void) fputs ("\n", usageout);
 	exit (status);
 }
@@ -173,18 +249,28 @@ static void process_flags (int argc, char **argv)
 	int c;
 	static struct option long_options[] = {
 		{"help",      no_argument,       NULL, 'h'},
+		{"incremental", required_argument, NULL, 'i'},
 		{"quiet",     no_argument,       NULL, 'q'},
 		{"read-only", no_argument,       NULL, 'r'},
 		{"root",      required_argument, NULL, 'R'},
 		{"sort",      no_argument,       NULL, 's'},
+		{"skip-automount", no_argument,  NULL, 'A'},
+		{"stream",    no_argument,       NULL, 'S'},
+#ifdef ENABLE_SUBIDS
+		{"subids",    no_argument,       NULL, 'u'},
+#endif				/* ENABLE_SUBIDS */
 		{NULL, 0, NULL, '\0'}
 	};
 
 	/*
 	 * Parse the command line arguments
 	 */
-	while ((c = getopt_long (argc, argv, "ehqrR:s",
-	                         long_options, NULL)) != -1) {
+	while ((c = getopt_long (argc, argv,
+	                         "Aehi:qrR:sS"
+#ifdef ENABLE_SUBIDS
+	                         "u"
+#endif				/* ENABLE_SUBIDS */
+	                         , long_options, NULL)) != -1) {
 		switch (c) {
 		case 'h':
 			usage (E_SUCCESS);
@@ -201,6 +287,21 @@ static void process_flags (int argc, char **argv)
 		case 's':
 			sort_mode = true;
 			break;
+		case 'A':
+			skip_automount = true;
+			break;
+		case 'S':
+			stream_mode = true;
+			read_only = true;
+			break;
+		case 'i':
+			state_file = optarg;
+			break;
+#ifdef ENABLE_SUBIDS
+		case 'u':
+			subids_mode = true;
+			break;
+#endif				/* ENABLE_SUBIDS */
 		default:
 			usage (E_USAGE);
 		}
@@ -210,6 +311,17 @@ static void process_flags (int argc, char **argv)
 		fprintf (stderr, _("%s: -s and -r are incompatible\n"), Prog);
 		exit (E_USAGE);
 	}
+	if (stream_mode && (NULL != state_file)) {
+		fprintf (stderr, _("%s: -S and -i are incompatible\n"), Prog);
+		exit (E_USAGE);
+	}
+#ifdef ENABLE_SUBIDS
+	if (subids_mode && (stream_mode || sort_mode)) {
+		fprintf (stderr, _("%s: -u and -%c are incompatible\n"),
+		         Prog, stream_mode ? 'S' : 's');
+		exit (E_USAGE);
+	}
+#endif				/* ENABLE_SUBIDS */
 
 	/*
 	 * Make certain we have the right number of arguments
@@ -241,6 +353,24 @@ static void process_flags (int argc, char **argv)
 	} else if (optind == argc) {
 		is_shadow = spw_file_present ();
 	}
+
+	if (stream_mode) {
+		const char *setting = NULL;
+
+#ifdef WITH_TCB
+		if (getdef_bool ("USE_TCB")) {
+			setting = "USE_TCB";
+		}
+#endif				/* WITH_TCB */
+		if (getdef_bool ("SHARDED_DATABASES")) {
+			setting = "SHARDED_DATABASES";
+		}
+		if (NULL != setting) {
+			fprintf (stderr, _("%s: -S cannot be used with %s\n"),
+			         Prog, setting);
+			exit (E_USAGE);
+		}
+	}
 }
 
 /*
@@ -374,14 +504,357 @@ static void close_files (bool changed)
 	pw_locked = false;
 }
 
+/*
+ * read_mounts - read the mount points of the system
+ */
+static void read_mounts (void)
+{
+#ifdef HAVE_MNTENT_H
+	FILE *fp;
+	struct mntent *ent;
+	size_t allocated = 0;
+#endif				/* HAVE_MNTENT_H */
+
+	mounts_read = true;
+#ifdef HAVE_MNTENT_H
+	fp = setmntent ("/proc/self/mounts", "r");
+	if (NULL == fp) {
+		return;
+	}
+	while ((ent = getmntent (fp)) != NULL) {
+		if (mounts_count == allocated) {
+			struct mount_point *m;
+
+			allocated = (0 == allocated) ? 64 : allocated * 2;
+			m = realloc (mounts, allocated * sizeof (*mounts));
+			if (NULL == m) {
+				/* The remaining mounts are not known */
+				break;
+			}
+			mounts = m;
+		}
+		mounts[mounts_count].dir = xstrdup (ent->mnt_dir);
+		mounts[mounts_count].len = strlen (ent->mnt_dir);
+		mounts[mounts_count].autofs =
+		    (strcmp (ent->mnt_type, "autofs") == 0);
+		mounts_count++;
+	}
+	(void) endmntent (fp);
+#endif				/* HAVE_MNTENT_H */
+}
+
+/*
+ * is_automounted - check if path is on an autofs mount point which is
+ *                  not mounted yet
+ *
+ *	The deepest mount point containing path is autofs when the file
+ *	system of path would be mounted by accessing path.
+ */
+static bool is_automounted (const char *path)
+{
+	size_t i;
+	/*@null@*/const struct mount_point *best = NULL;
+
+	if (!mounts_read) {
+		read_mounts ();
+	}
+
+	for (i = 0; i < mounts_count; i++) {
+		const struct mount_point *m = &mounts[i];
+
+		if (   (strncmp (path, m->dir, m->len) != 0)
+		    || (   ('/' != path[m->len]) && ('\0' != path[m->len])
+		        && (strcmp (m->dir, "/") != 0))) {
+			continue;
+		}
+		/* The last of the mounts on the same directory is used */
+		if ((NULL == best) || (m->len >= best->len)) {
+			best = m;
+		}
+	}
+
+	return (NULL != best) && best->autofs;
+}
+
+/*
+ * check_home - check that a home directory exists
+ */
+static void check_home (struct check_result *r)
+{
+	r->exists = (access (r->name, F_OK) == 0);
+}
+
+/*
+ * check_shell - check that a login shell exists
+ */
+static void check_shell (struct check_result *r)
+{
+	r->exists = (access (r->name, F_OK) == 0);
+}
+
+/*
+ * check_group - check that a group exists
+ */
+static void check_group (struct check_result *r)
+{
+	struct group *gr;
+
+	/* local, no need for xgetgrgid, but it is thread safe */
+	gr = xgetgrgid ((gid_t) r->id);
+	r->exists = (NULL != gr);
+	if (NULL != gr) {
+		gr_free_packed (gr);
+	}
+}
+
+/*
+ * check_entries - check the home directories, shells, and primary
+ *                 groups of all the users
+ *
+ *	The checks are independent, and are done concurrently by
+ *	CHECK_THREADS threads, since each of them may wait for a network
+ *	file system or a name service. The problems are then reported by
+ *	check_pw_file(), in the order of the file.
+ */
+static void check_entries (void)
+{
+	struct commonio_entry *pfe;
+	int nthreads;
+
+	for (pfe = __pw_get_head (); NULL != pfe; pfe = pfe->next) {
+		const struct passwd *pwd = pfe->eptr;
+		struct check_result *r;
+		bool added;
+
+		if (   ('+' == pfe->line[0]) || ('-' == pfe->line[0])
+		    || (NULL == pwd)) {
+			continue;
+		}
+
+		/*
+		 * The homes and shells of the known lines are not checked
+		 * again, but their groups are: the group database may have
+		 * changed.
+		 */
+		if (!is_known (0, pfe)) {
+			r = check_cache_get (&homes, pwd->pw_dir, 0, &added);
+			if (   added && skip_automount
+			    && is_automounted (pwd->pw_dir)) {
+				/* Not checked, and not reported */
+				r->checked = true;
+				r->exists = true;
+			}
+			if ('\0' != pwd->pw_shell[0]) {
+				(void) check_cache_get (&shells, pwd->pw_shell,
+				                        0, &added);
+			}
+		}
+		(void) check_cache_get (&groups, NULL, (id_t) pwd->pw_gid,
+		                        &added);
+	}
+
+	nthreads = getdef_num ("CHECK_THREADS", 1);
+	check_cache_run (&homes, check_home, nthreads);
+	check_cache_run (&shells, check_shell, nthreads);
+#ifdef HAVE_GETGRGID_R
+	check_cache_run (&groups, check_group, nthreads);
+#else				/* !HAVE_GETGRGID_R */
+	check_cache_run (&groups, check_group, 1);
+#endif				/* !HAVE_GETGRGID_R */
+}
+
+/*
+ * home_exists - check that a home directory exists
+ *
+ *	The home directories skipped with --skip-automount are reported
+ *	as existing.
+ */
+static bool home_exists (const char *dir)
+{
+	bool added;
+	struct check_result *r = check_cache_get (&homes, dir, 0, &added);
+
+	if (!r->checked) {
+		if (skip_automount && is_automounted (dir)) {
+			r->exists = true;
+		} else {
+			check_home (r);
+		}
+		r->checked = true;
+	}
+	return r->exists;
+}
+
+/*
+ * shell_exists - check that a login shell exists
+ */
+static bool shell_exists (const char *shell)
+{
+	bool added;
+	struct check_result *r = check_cache_get (&shells, shell, 0, &added);
+
+	if (!r->checked) {
+		check_shell (r);
+		r->checked = true;
+	}
+	return r->exists;
+}
+
+/*
+ * group_exists - check that a group exists
+ */
+static bool group_exists (gid_t gid)
+{
+	bool added;
+	struct check_result *r = check_cache_get (&groups, NULL, (id_t) gid,
+	                                          &added);
+
+	if (!r->checked) {
+		check_group (r);
+		r->checked = true;
+	}
+	return r->exists;
+}
+
+/*
+ * is_known - check if the line of ent was checked by the last clean run
+ *
+ *	In incremental mode, the checks which only depend on the line are
+ *	not done again for these lines. The checks which depend on other
+ *	databases (duplicate names, shadow entries, primary groups) are
+ *	always done, with the indexes of the databases.
+ */
+static bool is_known (size_t db, const struct commonio_entry *ent)
+{
+	return (NULL != state_file) && check_state_known (&state, db, ent->line);
+}
+
+/*
+ * save_state - save the lines of passwd and shadow for the next
+ *              incremental run
+ */
+static void save_state (void)
+{
+	struct commonio_entry *ent;
+
+	for (ent = __pw_get_head (); NULL != ent; ent = ent->next) {
+		check_state_add (&state, 0, ent->line);
+	}
+	if (is_shadow) {
+		for (ent = __spw_get_head (); NULL != ent; ent = ent->next) {
+			if (NULL != ent->line) {
+				check_state_add (&state, 1, ent->line);
+			}
+		}
+	}
+	if (check_state_save (&state, state_file) != 0) {
+		fprintf (stderr,
+		         _("%s: cannot write the state file %s: %s\n"),
+		         Prog, state_file, strerror (errno));
+	}
+}
+
+#ifdef WITH_TCB
+/*
+ * tcb_prefetch - read the shadow entries of all the users
+ *
+ *	In read-only mode, the tcb shadow files are neither locked nor
+ *	changed, and are read concurrently by shadowtcb_read_all()
+ *	instead of being locked and opened one after the other.
+ */
+static void tcb_prefetch (void)
+{
+	struct commonio_entry *pfe;
+	size_t n = 0;
+
+	for (pfe = __pw_get_head (); NULL != pfe; pfe = pfe->next) {
+		n++;
+	}
+	if (0 == n) {
+		return;
+	}
+	tcb_names = (const char **) xmalloc (n * sizeof (*tcb_names));
+	tcb_entries = (struct spwd **) xmalloc (n * sizeof (*tcb_entries));
+	for (pfe = __pw_get_head (); NULL != pfe; pfe = pfe->next) {
+		const struct passwd *pwd = pfe->eptr;
+
+		if (   ('+' == pfe->line[0]) || ('-' == pfe->line[0])
+		    || (NULL == pwd)) {
+			continue;
+		}
+		tcb_names[tcb_count] = pwd->pw_name;
+		tcb_count++;
+	}
+	if (shadowtcb_read_all (tcb_names, tcb_count, tcb_entries)
+	    == SHADOWTCB_FAILURE) {
+		tcb_count = 0;
+	}
+}
+
+/*
+ * tcb_prefetched - get the prefetched shadow entry of pwd
+ *
+ *	The users are checked in the order of the prefetch. NULL is
+ *	returned if the entry of pwd could not be read: it is then
+ *	checked as in read-write mode, to report why.
+ */
+static /*@null@*/struct spwd *tcb_prefetched (const struct passwd *pwd)
+{
+	if ((tcb_next < tcb_count) && (tcb_names[tcb_next] == pwd->pw_name)) {
+		tcb_next++;
+		return tcb_entries[tcb_next - 1];
+	}
+	return NULL;
+}
+
+static void tcb_prefetch_free (void)
+{
+	size_t i;
+
+	for (i = 0; i < tcb_count; i++) {
+		free (tcb_entries[i]);
+	}
+	free (tcb_names);
+	free (tcb_entries);
+	tcb_names = NULL;
+	tcb_entries = NULL;
+	tcb_count = 0;
+	tcb_next = 0;
+}
+#endif				/* WITH_TCB */
+
 /*
  * check_pw_file - check the content of the passwd file
  */
 static void check_pw_file (int *errors, bool *changed)
 {
-	struct commonio_entry *pfe, *tpfe;
+	struct commonio_entry *pfe;
 	struct passwd *pwd;
 	struct spwd *spw;
+	bool known;
+#ifdef WITH_TCB
+	bool prefetched = false;
+#endif				/* WITH_TCB */
+
+	/*
+	 * Do the slow checks first, concurrently.
+	 */
+	if (!quiet) {
+		check_entries ();
+	}
+
+#ifdef WITH_TCB
+	/*
+	 * The tcb directories of all the users are checked in one batch.
+	 */
+	if (   is_shadow && getdef_bool ("USE_TCB")
+	    && (shadowtcb_batch_begin () == SHADOWTCB_FAILURE)) {
+		fail_exit (E_CANTOPEN);
+	}
+	if (is_shadow && getdef_bool ("USE_TCB") && read_only) {
+		tcb_prefetch ();
+	}
+#endif				/* WITH_TCB */
 
 	/*
 	 * Loop through the entire password file.
@@ -424,8 +897,10 @@ static void check_pw_file (int *errors, bool *changed)
 			 */
 		      delete_pw:
 			if (use_system_pw_file) {
-				SYSLOG ((LOG_INFO, "delete passwd line '%s'",
-				         pfe->line));
+				SYSLOG_ENTRY ((LOG_INFO, "delete passwd lines",
+				               pfe->line,
+				               "delete passwd line '%s'",
+				               pfe->line));
 			}
 			*changed = true;
 
@@ -437,31 +912,12 @@ static void check_pw_file (int *errors, bool *changed)
 		 * Password structure is good, start using it.
 		 */
 		pwd = pfe->eptr;
+		known = is_known (0, pfe);
 
 		/*
 		 * Make sure this entry has a unique name.
 		 */
-		for (tpfe = __pw_get_head (); NULL != tpfe; tpfe = tpfe->next) {
-			const struct passwd *ent = tpfe->eptr;
-
-			/*
-			 * Don't check this entry
-			 */
-			if (tpfe == pfe) {
-				continue;
-			}
-
-			/*
-			 * Don't check invalid entries.
-			 */
-			if (NULL == ent) {
-				continue;
-			}
-
-			if (strcmp (pwd->pw_name, ent->pw_name) != 0) {
-				continue;
-			}
-
+		if (__pw_has_duplicate (pfe)) {
 			/*
 			 * Tell the user this entry is a duplicate of
 			 * another and ask them to delete it.
@@ -481,7 +937,7 @@ static void check_pw_file (int *errors, bool *changed)
 		/*
 		 * Check for invalid usernames.  --marekm
 		 */
-		if (!is_valid_user_name (pwd->pw_name)) {
+		if (!known && !is_valid_user_name (pwd->pw_name)) {
 			printf (_("invalid user name '%s'\n"), pwd->pw_name);
 			*errors += 1;
 		}
@@ -489,7 +945,7 @@ static void check_pw_file (int *errors, bool *changed)
 		/*
 		 * Check for invalid user ID.
 		 */
-		if (pwd->pw_uid == (uid_t)-1) {
+		if (!known && (pwd->pw_uid == (uid_t)-1)) {
 			printf (_("invalid user ID '%lu'\n"), (long unsigned int)pwd->pw_uid);
 			*errors += 1;
 		}
@@ -497,8 +953,7 @@ static void check_pw_file (int *errors, bool *changed)
 		/*
 		 * Make sure the primary group exists
 		 */
-		/* local, no need for xgetgrgid */
-		if (!quiet && (NULL == getgrgid (pwd->pw_gid))) {
+		if (!quiet && !group_exists (pwd->pw_gid)) {
 
 			/*
 			 * No primary group, just give a warning
@@ -512,7 +967,7 @@ static void check_pw_file (int *errors, bool *changed)
 		/*
 		 * Make sure the home directory exists
 		 */
-		if (!quiet && (access (pwd->pw_dir, F_OK) != 0)) {
+		if (!quiet && !known && !home_exists (pwd->pw_dir)) {
 			/*
 			 * Home directory doesn't exist, give a warning
 			 */
@@ -524,9 +979,9 @@ static void check_pw_file (int *errors, bool *changed)
 		/*
 		 * Make sure the login shell is executable
 		 */
-		if (   !quiet
+		if (   !quiet && !known
 		    && ('\0' != pwd->pw_shell[0])
-		    && (access (pwd->pw_shell, F_OK) != 0)) {
+		    && !shell_exists (pwd->pw_shell)) {
 
 			/*
 			 * Login shell doesn't exist, give a warning
@@ -541,8 +996,11 @@ static void check_pw_file (int *errors, bool *changed)
 		 */
 
 		if (is_shadow) {
+			spw = NULL;
 #ifdef WITH_TCB
-			if (getdef_bool ("USE_TCB")) {
+			spw = tcb_prefetched (pwd);
+			prefetched = (NULL != spw);
+			if (getdef_bool ("USE_TCB") && !prefetched) {
 				if (shadowtcb_set_user (pwd->pw_name) == SHADOWTCB_FAILURE) {
 					printf (_("no tcb directory for %s\n"),
 					        pwd->pw_name);
@@ -559,15 +1017,29 @@ static void check_pw_file (int *errors, bool *changed)
 						continue;
 					}
 				}
-				if (spw_lock () == 0) {
+				/*
+				 * Drop the privileges once for the lock and
+				 * the open of the user's shadow file.
+				 */
+				if (shadowtcb_drop_priv () == SHADOWTCB_FAILURE) {
+					*errors += 1;
+					continue;
+				}
+				if (spw_lock () != 0) {
+					spw_locked = true;
+					spw_opened = (spw_open (read_only ? O_RDONLY : O_RDWR) != 0);
+				}
+				if (shadowtcb_gain_priv () == SHADOWTCB_FAILURE) {
+					*errors += 1;
+				}
+				if (!spw_locked) {
 					*errors += 1;
 					fprintf (stderr,
 					         _("%s: cannot lock %s.\n"),
 					         Prog, spw_dbname ());
 					continue;
 				}
-				spw_locked = true;
-				if (spw_open (read_only ? O_RDONLY : O_RDWR) == 0) {
+				if (!spw_opened) {
 					fprintf (stderr,
 					         _("%s: cannot open %s\n"),
 					         Prog, spw_dbname ());
@@ -584,10 +1056,11 @@ static void check_pw_file (int *errors, bool *changed)
 					}
 					continue;
 				}
-				spw_opened = true;
 			}
 #endif				/* WITH_TCB */
-			spw = (struct spwd *) spw_locate (pwd->pw_name);
+			if (NULL == spw) {
+				spw = (struct spwd *) spw_locate (pwd->pw_name);
+			}
 			if (NULL == spw) {
 				printf (_("no matching password file entry in %s\n"),
 				        spw_dbname ());
@@ -641,6 +1114,12 @@ static void check_pw_file (int *errors, bool *changed)
 				if (   !quiet
 				    && (strcmp (pwd->pw_passwd,
 				                SHADOW_PASSWD_STRING) != 0)) {
+#ifdef WITH_TCB
+					if (prefetched) {
+						/* For spw_dbname() */
+						(void) shadowtcb_set_user (pwd->pw_name);
+					}
+#endif				/* WITH_TCB */
 					printf (_("user %s has an entry in %s, but its password field in %s is not set to 'x'\n"),
 					        pwd->pw_name, spw_dbname (), pw_dbname ());
 					*errors += 1;
@@ -648,7 +1127,9 @@ static void check_pw_file (int *errors, bool *changed)
 			}
 		}
 #ifdef WITH_TCB
-		if (getdef_bool ("USE_TCB") && spw_locked) {
+		if (   getdef_bool ("USE_TCB") && spw_locked
+		    && (shadowtcb_drop_priv () == SHADOWTCB_SUCCESS)) {
+			/* One privilege transition for the close and unlock */
 			if (spw_opened && (spw_close () == 0)) {
 				fprintf (stderr,
 				         _("%s: failure while writing changes to %s\n"),
@@ -672,9 +1153,20 @@ static void check_pw_file (int *errors, bool *changed)
 			} else {
 				spw_locked = false;
 			}
+			if (shadowtcb_gain_priv () == SHADOWTCB_FAILURE) {
+				*errors += 1;
+			}
 		}
 #endif				/* WITH_TCB */
 	}
+
+#ifdef WITH_TCB
+	if (   is_shadow && getdef_bool ("USE_TCB")
+	    && (shadowtcb_batch_end () == SHADOWTCB_FAILURE)) {
+		*errors += 1;
+	}
+	tcb_prefetch_free ();
+#endif				/* WITH_TCB */
 }
 
 /*
@@ -682,7 +1174,7 @@ static void check_pw_file (int *errors, bool *changed)
  */
 static void check_spw_file (int *errors, bool *changed)
 {
-	struct commonio_entry *spe, *tspe;
+	struct commonio_entry *spe;
 	struct spwd *spw;
 
 	/*
@@ -734,8 +1226,10 @@ static void check_spw_file (int *errors, bool *changed)
 			 */
 		      delete_spw:
 			if (use_system_spw_file) {
-				SYSLOG ((LOG_INFO, "delete shadow line '%s'",
-				         spe->line));
+				SYSLOG_ENTRY ((LOG_INFO, "delete shadow lines",
+				               spe->line,
+				               "delete shadow line '%s'",
+				               spe->line));
 			}
 			*changed = true;
 
@@ -751,27 +1245,7 @@ static void check_spw_file (int *errors, bool *changed)
 		/*
 		 * Make sure this entry has a unique name.
 		 */
-		for (tspe = __spw_get_head (); NULL != tspe; tspe = tspe->next) {
-			const struct spwd *ent = tspe->eptr;
-
-			/*
-			 * Don't check this entry
-			 */
-			if (tspe == spe) {
-				continue;
-			}
-
-			/*
-			 * Don't check invalid entries.
-			 */
-			if (NULL == ent) {
-				continue;
-			}
-
-			if (strcmp (spw->sp_namp, ent->sp_namp) != 0) {
-				continue;
-			}
-
+		if (__spw_has_duplicate (spe)) {
 			/*
 			 * Tell the user this entry is a duplicate of
 			 * another and ask them to delete it.
@@ -813,7 +1287,7 @@ static void check_spw_file (int *errors, bool *changed)
 		/*
 		 * Warn if last password change in the future.  --marekm
 		 */
-		if (!quiet) {
+		if (!quiet && !is_known (1, spe)) {
 			time_t t = time ((time_t *) 0);
 			if (   (t != 0)
 			    && (spw->sp_lstchg > (long) t / SCALE)) {
@@ -825,6 +1299,625 @@ static void check_spw_file (int *errors, bool *changed)
 	}
 }
 
+/*
+ * Stream mode (--stream)
+ *
+ * The files are read twice, line by line, without loading them. The
+ * first pass adds the names of the entries of passwd and shadow to
+ * external sorts (see extsort.c). The sorted names are then merged to
+ * find the duplicates and the entries missing in the other file. These
+ * findings are sorted by line, and reported by the second pass with the
+ * checks of each line, in the order of the files, like in the normal
+ * mode. The memory used does not depend on the size of the files.
+ */
+#define FOUND_DUPLICATE	0x1	/* another entry has the same name */
+#define FOUND_MISSING	0x2	/* no entry in the other file */
+#define FOUND_NOT_X	0x4	/* has a shadow entry, password is not 'x' */
+
+/* The results of the checks cached in stream mode are dropped beyond */
+#define STREAM_CACHE_MAX	4096
+
+struct stream {
+	struct commonio_db *db;
+	struct extsort names;	/* name, line << 1 | (password is 'x') */
+	struct extsort found;	/* line (big endian), FOUND_* flags */
+	unsigned long line;
+	struct stat sb;
+	/*@null@*/int *errors;
+};
+
+static struct stream pw_stream;
+static struct stream spw_stream;
+
+/*
+ * stream_fail - report a failure of the stream mode and exit
+ */
+static /*@noreturn@*/void stream_fail (const struct stream *st)
+{
+	fprintf (stderr, _("%s: cannot check %s: %s\n"),
+	         Prog, st->db->filename, strerror (errno));
+	fail_exit (E_CANTOPEN);
+}
+
+/*
+ * line_key - the key of a line in the sort of the findings
+ */
+static void line_key (unsigned long line, /*@out@*/char key[8])
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		key[i] = (char) (line & 0xff);
+		line >>= 8;
+	}
+}
+
+/*
+ * stream_add - first pass: add the name of an entry
+ */
+static int stream_add (unused const char *line, const void *ent, void *arg)
+{
+	struct stream *st = arg;
+	const char *name;
+	uint64_t value;
+
+	st->line++;
+	if (NULL == ent) {
+		return 0;
+	}
+	if (st == &pw_stream) {
+		const struct passwd *pwd = ent;
+
+		name = pwd->pw_name;
+		value = (strcmp (pwd->pw_passwd, SHADOW_PASSWD_STRING) == 0);
+	} else {
+		name = ((const struct spwd *) ent)->sp_namp;
+		value = 0;
+	}
+	value |= (uint64_t) st->line << 1;
+	return extsort_add (&st->names, name, strlen (name), value);
+}
+
+/*
+ * stream_read - first pass over a file
+ */
+static void stream_read (struct stream *st, struct commonio_db *db)
+{
+	st->db = db;
+	if (stat (db->filename, &st->sb) != 0) {
+		fprintf (stderr, _("%s: cannot open %s\n"), Prog, db->filename);
+		fail_exit (E_CANTOPEN);
+	}
+	if (   (extsort_init (&st->names, EXTSORT_MEMORY) != 0)
+	    || (extsort_init (&st->found, EXTSORT_MEMORY) != 0)
+	    || (commonio_scan_lines (db, stream_add, st) != 0)
+	    || (extsort_sort (&st->names) != 0)) {
+		stream_fail (st);
+	}
+}
+
+/*
+ * stream_next - pop the next name of a sort if it is name
+ */
+static bool stream_next (struct stream *st, const char *name, size_t len,
+                         /*@out@*/uint64_t *value)
+{
+	const char *key;
+	size_t klen;
+
+	if (   (extsort_peek (&st->names, &key, &klen, value) != 1)
+	    || (extsort_keycmp (key, klen, name, len) != 0)) {
+		return false;
+	}
+	if (extsort_pop (&st->names) != 0) {
+		stream_fail (st);
+	}
+	return true;
+}
+
+/*
+ * stream_group - record the findings of the entries of a file with the
+ *                same name
+ */
+static void stream_group (struct stream *st, const char *name, size_t len,
+                          bool in_other)
+{
+	uint64_t value;
+	uint64_t next;
+	bool more;
+	bool dup;
+
+	if (!stream_next (st, name, len, &value)) {
+		return;
+	}
+	more = stream_next (st, name, len, &next);
+	dup = more;
+	for (;;) {
+		unsigned int flags = dup ? FOUND_DUPLICATE : 0;
+		char key[8];
+
+		if (!in_other) {
+			flags |= FOUND_MISSING;
+		} else if (   is_shadow && (st == &pw_stream)
+		           && (0 == (value & 1))) {
+			flags |= FOUND_NOT_X;
+		}
+		if (0 != flags) {
+			line_key ((unsigned long) (value >> 1), key);
+			if (extsort_add (&st->found, key, sizeof key, flags) != 0) {
+				stream_fail (st);
+			}
+		}
+		if (!more) {
+			break;
+		}
+		value = next;
+		more = stream_next (st, name, len, &next);
+	}
+}
+
+/*
+ * stream_join - merge the sorted names of passwd and shadow
+ */
+static void stream_join (void)
+{
+	char *name = NULL;
+	size_t size = 0;
+
+	for (;;) {
+		const char *pk = NULL, *sk = NULL;
+		size_t pl = 0, sl = 0;
+		uint64_t value;
+		bool in_pw, in_spw;
+		int c;
+
+		in_pw = (extsort_peek (&pw_stream.names, &pk, &pl, &value) == 1);
+		in_spw =    is_shadow
+		         && (extsort_peek (&spw_stream.names, &sk, &sl, &value) == 1);
+		if (!in_pw && !in_spw) {
+			break;
+		}
+		if (in_pw && in_spw) {
+			c = extsort_keycmp (pk, pl, sk, sl);
+			in_pw = (c <= 0);
+			in_spw = (c >= 0);
+		}
+		if (!in_pw) {
+			pk = sk;
+			pl = sl;
+		}
+		/* The key is popped with the entries */
+		if (pl + 1 > size) {
+			free (name);
+			size = 2 * pl + 1;
+			name = xmalloc (size);
+		}
+		memcpy (name, pk, pl);
+
+		stream_group (&pw_stream, name, pl, in_spw || !is_shadow);
+		if (is_shadow) {
+			stream_group (&spw_stream, name, pl, in_pw);
+		}
+	}
+	free (name);
+}
+
+/*
+ * stream_found - get the findings of the current line
+ */
+static unsigned int stream_found (struct stream *st)
+{
+	const char *key;
+	size_t len;
+	uint64_t flags;
+	char k[8];
+
+	line_key (st->line, k);
+	if (   (extsort_peek (&st->found, &key, &len, &flags) != 1)
+	    || (len != sizeof k) || (memcmp (key, k, sizeof k) != 0)) {
+		return 0;
+	}
+	if (extsort_pop (&st->found) != 0) {
+		stream_fail (st);
+	}
+	return (unsigned int) flags;
+}
+
+/*
+ * stream_prune - drop the cached results of the checks, to keep the
+ *                memory bounded
+ */
+static void stream_prune (void)
+{
+	if (homes.count > STREAM_CACHE_MAX) {
+		check_cache_free (&homes);
+	}
+	if (shells.count > STREAM_CACHE_MAX) {
+		check_cache_free (&shells);
+	}
+	if (groups.count > STREAM_CACHE_MAX) {
+		check_cache_free (&groups);
+	}
+}
+
+/*
+ * stream_check_pw - second pass: check a line of passwd
+ */
+static int stream_check_pw (const char *line, const void *ent, void *arg)
+{
+	struct stream *st = arg;
+	const struct passwd *pwd = ent;
+	unsigned int flags;
+
+	st->line++;
+	flags = stream_found (st);
+	if (('+' == line[0]) || ('-' == line[0])) {
+		return 0;
+	}
+
+	if (NULL == pwd) {
+		puts (_("invalid password file entry"));
+		printf (_("delete line '%s'? "), line);
+		*st->errors += 1;
+		(void) yes_or_no (true);
+		return 0;
+	}
+
+	if (0 != (flags & FOUND_DUPLICATE)) {
+		puts (_("duplicate password entry"));
+		printf (_("delete line '%s'? "), line);
+		*st->errors += 1;
+		(void) yes_or_no (true);
+	}
+
+	if (!is_valid_user_name (pwd->pw_name)) {
+		printf (_("invalid user name '%s'\n"), pwd->pw_name);
+		*st->errors += 1;
+	}
+
+	if (pwd->pw_uid == (uid_t)-1) {
+		printf (_("invalid user ID '%lu'\n"), (long unsigned int)pwd->pw_uid);
+		*st->errors += 1;
+	}
+
+	if (!quiet && !group_exists (pwd->pw_gid)) {
+		printf (_("user '%s': no group %lu\n"),
+		        pwd->pw_name, (unsigned long) pwd->pw_gid);
+		*st->errors += 1;
+	}
+
+	if (!quiet && !home_exists (pwd->pw_dir)) {
+		printf (_("user '%s': directory '%s' does not exist\n"),
+		        pwd->pw_name, pwd->pw_dir);
+		*st->errors += 1;
+	}
+
+	if (   !quiet
+	    && ('\0' != pwd->pw_shell[0])
+	    && !shell_exists (pwd->pw_shell)) {
+		printf (_("user '%s': program '%s' does not exist\n"),
+		        pwd->pw_name, pwd->pw_shell);
+		*st->errors += 1;
+	}
+
+	if (0 != (flags & FOUND_MISSING)) {
+		printf (_("no matching password file entry in %s\n"),
+		        spw_dbname ());
+		printf (_("add user '%s' in %s? "),
+		        pwd->pw_name, spw_dbname ());
+		*st->errors += 1;
+		(void) yes_or_no (true);
+	} else if (!quiet && (0 != (flags & FOUND_NOT_X))) {
+		printf (_("user %s has an entry in %s, but its password field in %s is not set to 'x'\n"),
+		        pwd->pw_name, spw_dbname (), pw_dbname ());
+		*st->errors += 1;
+	}
+
+	stream_prune ();
+	return 0;
+}
+
+/*
+ * stream_check_spw - second pass: check a line of shadow
+ */
+static int stream_check_spw (const char *line, const void *ent, void *arg)
+{
+	struct stream *st = arg;
+	const struct spwd *spw = ent;
+	unsigned int flags;
+
+	st->line++;
+	flags = stream_found (st);
+	if (('+' == line[0]) || ('-' == line[0])) {
+		return 0;
+	}
+
+	if (NULL == spw) {
+		puts (_("invalid shadow password file entry"));
+		printf (_("delete line '%s'? "), line);
+		*st->errors += 1;
+		(void) yes_or_no (true);
+		return 0;
+	}
+
+	if (0 != (flags & FOUND_DUPLICATE)) {
+		puts (_("duplicate shadow password entry"));
+		printf (_("delete line '%s'? "), line);
+		*st->errors += 1;
+		(void) yes_or_no (true);
+	}
+
+	if (0 != (flags & FOUND_MISSING)) {
+		printf (_("no matching password file entry in %s\n"),
+		        pw_dbname ());
+		printf (_("delete line '%s'? "), line);
+		*st->errors += 1;
+		(void) yes_or_no (true);
+	}
+
+	if (!quiet) {
+		time_t t = time ((time_t *) 0);
+		if (   (t != 0)
+		    && (spw->sp_lstchg > (long) t / SCALE)) {
+			printf (_("user %s: last password change in the future\n"),
+			        spw->sp_namp);
+			*st->errors += 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * stream_check - second pass over a file
+ *
+ *	A file replaced or changed since the first pass is reported: the
+ *	findings of the first pass may not match its lines.
+ */
+static void stream_check (struct stream *st,
+                          int (*check) (const char *line, const void *ent,
+                                        void *arg),
+                          int *errors)
+{
+	struct stat sb;
+
+	extsort_free (&st->names);
+	if (extsort_sort (&st->found) != 0) {
+		stream_fail (st);
+	}
+	st->line = 0;
+	st->errors = errors;
+	if (commonio_scan_lines (st->db, check, st) != 0) {
+		stream_fail (st);
+	}
+	extsort_free (&st->found);
+
+	if (   (stat (st->db->filename, &sb) != 0)
+	    || (sb.st_dev != st->sb.st_dev)
+	    || (sb.st_ino != st->sb.st_ino)
+	    || (sb.st_size != st->sb.st_size)
+	    || (sb.st_mtime != st->sb.st_mtime)) {
+		fprintf (stderr, _("%s: %s was changed during the check\n"),
+		         Prog, st->db->filename);
+		*errors += 1;
+	}
+}
+
+/*
+ * check_streams - check passwd and shadow in stream mode
+ */
+static void check_streams (int *errors)
+{
+	stream_read (&pw_stream, __pw_get_db ());
+	if (is_shadow) {
+		stream_read (&spw_stream, __spw_get_db ());
+	}
+	stream_join ();
+
+	stream_check (&pw_stream, stream_check_pw, errors);
+	if (is_shadow) {
+		stream_check (&spw_stream, stream_check_spw, errors);
+	}
+}
+
+#ifdef ENABLE_SUBIDS
+static int id_cmp (const void *p1, const void *p2)
+{
+	unsigned long id1 = *(const unsigned long *) p1;
+	unsigned long id2 = *(const unsigned long *) p2;
+
+	if (id1 < id2) {
+		return -1;
+	}
+	return (id1 > id2) ? 1 : 0;
+}
+
+static void add_id (unsigned long **ids, size_t *nids, size_t *alloc,
+                    unsigned long id)
+{
+	if (*nids == *alloc) {
+		unsigned long *tmp;
+
+		*alloc = (0 == *alloc) ? 1024 : *alloc * 2;
+		tmp = realloc (*ids, *alloc * sizeof (**ids));
+		if (NULL == tmp) {
+			fprintf (stderr, _("%s: out of memory\n"), Prog);
+			fail_exit (E_CANTOPEN);
+		}
+		*ids = tmp;
+	}
+	(*ids)[*nids] = id;
+	(*nids)++;
+}
+
+/*
+ * subid_owner - find the user of the password file owning a range, by
+ *               its name or its UID
+ */
+static /*@null@*/const struct passwd *subid_owner (const char *owner)
+{
+	const struct passwd *pwd;
+	uid_t uid;
+
+	pwd = pw_locate (owner);
+	if ((NULL == pwd) && (get_uid (owner, &uid) != 0)) {
+		pwd = pw_locate_uid (uid);
+	}
+	return pwd;
+}
+
+/*
+ * same_owner - check if two owners of ranges are the same user, maybe
+ *              one by its name and the other one by its UID
+ */
+static bool same_owner (const char *owner1, const char *owner2)
+{
+	const struct passwd *pwd1, *pwd2;
+
+	if (strcmp (owner1, owner2) == 0) {
+		return true;
+	}
+	pwd1 = subid_owner (owner1);
+	pwd2 = subid_owner (owner2);
+	return (NULL != pwd1) && (NULL != pwd2) && (pwd1->pw_uid == pwd2->pw_uid);
+}
+
+/*
+ * check_subid_file - check the ranges of a subordinate ID file
+ *
+ *	The ranges are walked once, in the order of their starts:
+ *
+ *	- A range which overlaps a range of another owner is an error.
+ *	  The range reaching the highest ID so far is kept, and the range
+ *	  reaching the highest ID among the ranges of the other owners, so
+ *	  that each range is compared to only one of them.
+ *	- The owner of a range must be a user of the password file.
+ *	- A range should not include the ID of a user or of a group. ids
+ *	  are sorted, and walked with the ranges.
+ */
+static void check_subid_file (const char *dbname,
+                              bool (*sorted_range) (size_t i,
+                                                    const char **owner,
+                                                    unsigned long *start,
+                                                    unsigned long *count),
+                              const unsigned long *ids, size_t nids,
+                              int *errors)
+{
+	/* Ranges reaching the highest IDs, 0 is no range */
+	const char *top_owner = NULL, *other_owner = NULL;
+	unsigned long top_start = 0, top_end = 0;
+	unsigned long other_start = 0, other_end = 0;
+	const char *owner;
+	unsigned long start, count;
+	size_t i, j = 0;
+
+	for (i = 0; sorted_range (i, &owner, &start, &count); i++) {
+		unsigned long end = start + count;
+
+		if (   (NULL != top_owner)
+		    && (start < top_end)
+		    && !same_owner (owner, top_owner)) {
+			printf (_("%s: range %lu-%lu of '%s' overlaps range %lu-%lu of '%s'\n"),
+			        dbname, start, end - 1, owner,
+			        top_start, top_end - 1, top_owner);
+			*errors += 1;
+		} else if (   (NULL != other_owner)
+		           && (start < other_end)) {
+			printf (_("%s: range %lu-%lu of '%s' overlaps range %lu-%lu of '%s'\n"),
+			        dbname, start, end - 1, owner,
+			        other_start, other_end - 1, other_owner);
+			*errors += 1;
+		}
+		if ((NULL == top_owner) || (end > top_end)) {
+			if (   (NULL != top_owner)
+			    && !same_owner (owner, top_owner)) {
+				other_owner = top_owner;
+				other_start = top_start;
+				other_end = top_end;
+			}
+			top_owner = owner;
+			top_start = start;
+			top_end = end;
+		} else if (   ((NULL == other_owner) || (end > other_end))
+		           && !same_owner (owner, top_owner)) {
+			other_owner = owner;
+			other_start = start;
+			other_end = end;
+		}
+
+		if (!quiet && (NULL == subid_owner (owner))) {
+			printf (_("%s: range %lu-%lu: user '%s' does not exist\n"),
+			        dbname, start, end - 1, owner);
+			*errors += 1;
+		}
+
+		while ((j < nids) && (ids[j] < start)) {
+			j++;
+		}
+		if (!quiet && (j < nids) && (ids[j] < end)) {
+			printf (_("%s: range %lu-%lu of '%s' includes the ID %lu, which is in use\n"),
+			        dbname, start, end - 1, owner, ids[j]);
+			*errors += 1;
+		}
+	}
+}
+
+/*
+ * check_subids - check /etc/subuid and /etc/subgid
+ *
+ *	The subordinate UIDs are checked against the UIDs of the password
+ *	file, and the subordinate GIDs against the GIDs of the group file.
+ *	The files are only read.
+ */
+static void check_subids (int *errors)
+{
+	unsigned long *ids = NULL;
+	size_t nids = 0, alloc = 0;
+
+	if (sub_uid_file_present ()) {
+		if (sub_uid_open (O_RDONLY) == 0) {
+			fprintf (stderr, _("%s: cannot open %s\n"),
+			         Prog, sub_uid_dbname ());
+			*errors += 1;
+		} else {
+			const struct passwd *pwd;
+
+			(void) pw_rewind ();
+			while ((pwd = pw_next ()) != NULL) {
+				add_id (&ids, &nids, &alloc, pwd->pw_uid);
+			}
+			qsort (ids, nids, sizeof (*ids), id_cmp);
+			check_subid_file (sub_uid_dbname (), sub_uid_sorted_range,
+			                  ids, nids, errors);
+			(void) sub_uid_close ();
+		}
+	}
+
+	if (sub_gid_file_present ()) {
+		if (sub_gid_open (O_RDONLY) == 0) {
+			fprintf (stderr, _("%s: cannot open %s\n"),
+			         Prog, sub_gid_dbname ());
+			*errors += 1;
+		} else {
+			nids = 0;
+			if (gr_open (O_RDONLY) != 0) {
+				const struct group *grp;
+
+				while ((grp = gr_next ()) != NULL) {
+					add_id (&ids, &nids, &alloc, grp->gr_gid);
+				}
+				(void) gr_close ();
+			}
+			qsort (ids, nids, sizeof (*ids), id_cmp);
+			check_subid_file (sub_gid_dbname (), sub_gid_sorted_range,
+			                  ids, nids, errors);
+			(void) sub_gid_close ();
+		}
+	}
+
+	free (ids);
+}
+#endif				/* ENABLE_SUBIDS */
+
 /*
  * pwck - verify password file integrity
  */
@@ -842,15 +1935,28 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 	OPENLOG ("pwck");
 
 	/* Parse the command line arguments */
 	process_flags (argc, argv);
 
+	if (stream_mode) {
+		check_streams (&errors);
+		if (0 != errors) {
+			printf (_("%s: no changes\n"), Prog);
+		}
+		closelog ();
+		return ((0 != errors) ? E_BADENTRY : E_OKAY);
+	}
+
 	open_files ();
 
+	if (NULL != state_file) {
+		check_state_load (&state, state_file);
+	}
+
 	if (sort_mode) {
 		if (pw_sort () != 0) {
 			fprintf (stderr,
@@ -873,13 +1979,26 @@ int main (int argc, char **argv)
 		if (is_shadow) {
 			check_spw_file (&errors, &changed);
 		}
+#ifdef ENABLE_SUBIDS
+		if (subids_mode) {
+			check_subids (&errors);
+		}
+#endif				/* ENABLE_SUBIDS */
+	}
+
+	/*
+	 * After a clean run, all the lines are known for the next
+	 * incremental run. The warnings are not checked in quiet mode.
+	 */
+	if (   (NULL != state_file) && !sort_mode && !quiet
+	    && (0 == errors) && !changed) {
+		save_state ();
 	}
 
 	close_files (changed);
 
 	if (!read_only) {
-		nscd_flush_cache ("passwd");
-		sssd_flush_cache (SSSD_DB_PASSWD);
+		cache_flush_defer (CACHE_DB_PASSWD);
 	}
 
 	/*
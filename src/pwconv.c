@@ -71,8 +71,7 @@
 #include "prototypes.h"
 #include "pwio.h"
 #include "shadowio.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 
 /*
  * exit status values
@@ -174,6 +173,9 @@ int main (int argc, char **argv)
 	struct passwd pwent;
 	const struct spwd *sp;
 	struct spwd spent;
+	char **orphans = NULL;
+	size_t orphans_count = 0, orphans_size = 0, i;
+	long pass_min_days, pass_max_days, pass_warn_age, lstchg;
 
 	Prog = Basename (argv[0]);
 
@@ -181,7 +183,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 	OPENLOG ("pwconv");
 
@@ -228,23 +230,48 @@ int main (int argc, char **argv)
 		if (pw_locate (sp->sp_namp) != NULL) {
 			continue;
 		}
-
-		if (spw_remove (sp->sp_namp) == 0) {
+		if (orphans_count == orphans_size) {
+			orphans_size = (0 == orphans_size) ? 64 : orphans_size * 2;
+			orphans = realloc (orphans,
+			                   orphans_size * sizeof (*orphans));
+			if (NULL == orphans) {
+				fprintf (stderr,
+				         _("%s: failed to allocate memory: %s\n"),
+				         Prog, strerror (errno));
+				fail_exit (E_FAILURE);
+			}
+		}
+		/* The entry is freed by spw_remove() */
+		orphans[orphans_count] = xstrdup (sp->sp_namp);
+		orphans_count++;
+	}
+	for (i = 0; i < orphans_count; i++) {
+		if (spw_remove (orphans[i]) == 0) {
 			/*
 			 * This shouldn't happen (the entry exists) but...
 			 */
 			fprintf (stderr,
 			         _("%s: cannot remove entry '%s' from %s\n"),
-			         Prog, sp->sp_namp, spw_dbname ());
+			         Prog, orphans[i], spw_dbname ());
 			fail_exit (E_FAILURE);
 		}
-		(void) spw_rewind();
+		free (orphans[i]);
 	}
+	free (orphans);
 
 	/*
 	 * Update shadow entries which don't have "x" as pw_passwd. Add any
 	 * missing shadow entries.
 	 */
+	pass_min_days = getdef_num ("PASS_MIN_DAYS", -1);
+	pass_max_days = getdef_num ("PASS_MAX_DAYS", -1);
+	pass_warn_age = getdef_num ("PASS_WARN_AGE", -1);
+	lstchg = (long) gettime () / SCALE;
+	if (0 == lstchg) {
+		/* Better disable aging than requiring a password
+		 * change */
+		lstchg = -1;
+	}
 	(void) pw_rewind ();
 	while ((pw = pw_next ()) != NULL) {
 		sp = spw_locate (pw->pw_name);
@@ -259,20 +286,15 @@ int main (int argc, char **argv)
 			/* add new shadow entry */
 			memset (&spent, 0, sizeof spent);
 			spent.sp_namp   = pw->pw_name;
-			spent.sp_min    = getdef_num ("PASS_MIN_DAYS", -1);
-			spent.sp_max    = getdef_num ("PASS_MAX_DAYS", -1);
-			spent.sp_warn   = getdef_num ("PASS_WARN_AGE", -1);
+			spent.sp_min    = pass_min_days;
+			spent.sp_max    = pass_max_days;
+			spent.sp_warn   = pass_warn_age;
 			spent.sp_inact  = -1;
 			spent.sp_expire = -1;
 			spent.sp_flag   = SHADOW_SP_FLAG_UNSET;
 		}
 		spent.sp_pwdp = pw->pw_passwd;
-		spent.sp_lstchg = (long) gettime () / SCALE;
-		if (0 == spent.sp_lstchg) {
-			/* Better disable aging than requiring a password
-			 * change */
-			spent.sp_lstchg = -1;
-		}
+		spent.sp_lstchg = lstchg;
 		if (spw_update (&spent) == 0) {
 			fprintf (stderr,
 			         _("%s: failed to prepare the new %s entry '%s'\n"),
@@ -328,8 +350,7 @@ int main (int argc, char **argv)
 		/* continue */
 	}
 
-	nscd_flush_cache ("passwd");
-	sssd_flush_cache (SSSD_DB_PASSWD);
+	cache_flush_defer (CACHE_DB_PASSWD);
 
 	return E_SUCCESS;
 }
@@ -41,8 +41,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include "defines.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #include "prototypes.h"
 #include "pwio.h"
 #include "shadowio.h"
@@ -142,7 +141,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 	OPENLOG ("pwunconv");
 
@@ -250,8 +249,7 @@ int main (int argc, char **argv)
 		/* continue */
 	}
 
-	nscd_flush_cache ("passwd");
-	sssd_flush_cache (SSSD_DB_PASSWD);
+	cache_flush_defer (CACHE_DB_PASSWD);
 
 	return 0;
 }
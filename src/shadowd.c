@@ -0,0 +1,1327 @@
+/*
+ *	shadowd - apply the account changes sent on a UNIX socket
+ *
+ *	shadowd locks the passwd, group, shadow and gshadow files once, and
+ *	keeps them open. The requests of its clients are applied to the
+ *	open databases, and the requests received during a short window are
+ *	committed together with commonio_txn_checkpoint(), which writes the
+ *	files as commonio_close() does, but keeps their entries and indexes
+ *	for the next requests. The lines of the replaced and removed
+ *	entries are only released when a database is read again, which
+ *	commonio_txn_checkpoint() does once they take as much memory as
+ *	the database did when it was read.
+ *
+ *	Each request is a line:
+ *
+ *	useradd NAME:UID:GID:GECOS:DIR:SHELL
+ *		Add a user, with a locked password. If UID is empty, a new
+ *		UID is allocated. If GID is empty, a group with the name
+ *		of the user is created. GID can be the name or the ID of an
+ *		existing group.
+ *	usermod NAME:UID:GID:GECOS:DIR:SHELL
+ *		Change the fields which are not empty.
+ *	userdel NAME
+ *		Remove the user, and remove it from the member lists.
+ *	groupadd NAME:GID
+ *		Add a group. If GID is empty, a new GID is allocated.
+ *	groupdel NAME
+ *		Remove a group, unless it is the primary group of a user.
+ *	addmember GROUP:USER
+ *	delmember GROUP:USER
+ *		Add or remove a member of a group.
+ *
+ *	Each request gets an answer line, in order: "ok" once the change
+ *	is committed, or "error: MESSAGE".
+ *
+ *	Only the databases are changed: the home directories, mailboxes,
+ *	and the files of the users are not created, moved, nor removed.
+ *
+ *	SIGHUP reads the databases again. SIGTERM and SIGINT commit the
+ *	pending requests, and stop shadowd.
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <grp.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "chkname.h"
+#include "commonio.h"
+#include "defines.h"
+#include "getdef.h"
+#include "groupio.h"
+#include "cacheflush.h"
+#include "prototypes.h"
+#include "pwio.h"
+#include "shadowio.h"
+#ifdef	SHADOWGRP
+#include "sgroupio.h"
+#endif
+
+/*
+ * exit status values
+ */
+/*@-exitarg@*/
+#define E_SUCCESS	0	/* success */
+#define E_FAILURE	1	/* failure */
+#define E_USAGE		2	/* invalid command syntax */
+
+#define SHADOWD_SOCKET	"/run/shadowd.sock"
+#define MAX_CLIENTS	64
+#define MAX_REQUEST	4096	/* longest request line */
+#define MAX_PENDING	1024	/* requests waiting for the next commit */
+
+/*
+ * Global variables
+ */
+const char *Prog;
+
+static const char *socket_path = SHADOWD_SOCKET;
+static long window_ms = 10;	/* group commit window */
+static bool listening = false;	/* the socket was created */
+
+static bool is_shadow_pwd;
+static bool spw_locked = false;
+static bool pw_locked = false;
+static bool gr_locked = false;
+#ifdef SHADOWGRP
+static bool is_shadow_grp;
+static bool sgr_locked = false;
+#endif
+
+/* IDs found for the new users and groups, see reserve_uids() */
+static struct id_pool uid_pool;
+static struct id_pool gid_pool;
+
+/* The databases changed since the last commit (CACHE_DB_*) */
+static int changed_dbs = 0;
+
+static volatile sig_atomic_t stop = 0;
+static volatile sig_atomic_t reload = 0;
+
+/* A connected client */
+struct client {
+	int fd;			/* -1 if the slot is free */
+	unsigned long gen;	/* incremented when the slot is reused */
+	char buf[MAX_REQUEST];
+	size_t len;
+};
+
+/* A request waiting for the next commit to be answered */
+struct pending {
+	size_t client;
+	unsigned long gen;
+	/*@null@*/ /*@observer@*/const char *error;
+	/*@null@*/ /*@only@*/char *log;	/* logged once committed */
+};
+
+static struct client clients[MAX_CLIENTS];
+static struct pending pending[MAX_PENDING];
+static size_t npending = 0;
+static struct timespec deadline;
+
+/* local function prototypes */
+static /*@noreturn@*/void usage (int status);
+static /*@noreturn@*/void fail_exit (int code);
+static void process_flags (int argc, char **argv);
+static void open_files (void);
+static void close_files (void);
+static void reopen_files (void);
+static /*@null@*/char *log_message (const char *fmt, ...);
+static /*@null@*/const char *find_group (const char *gid, gid_t *ngid);
+static /*@null@*/const char *new_group (const char *name, gid_t gid);
+static /*@null@*/const char *do_useradd (char *args, char **log);
+static /*@null@*/const char *do_usermod (char *args, char **log);
+static /*@null@*/const char *do_userdel (char *args, char **log);
+static /*@null@*/const char *do_groupadd (char *args, char **log);
+static /*@null@*/const char *do_groupdel (char *args, char **log);
+static /*@null@*/const char *change_member (char *args, char **log,
+                                            bool add);
+static /*@null@*/const char *do_addmember (char *args, char **log);
+static /*@null@*/const char *do_delmember (char *args, char **log);
+static void handle_request (size_t c, char *line);
+static bool commit (void);
+static void answer (size_t c, const char *msg);
+static void flush_pending (void);
+static int open_socket (void);
+static void accept_client (int sfd);
+static void drop_client (size_t c);
+static void read_client (size_t c);
+static long ms_left (void);
+static void catch_signal (int sig);
+
+/*
+ * usage - display usage message and exit
+ */
+static /*@noreturn@*/void usage (int status)
+{
+	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
+	(void) fprintf (usageout,
+	                _("Usage: %s [options]\n"
+	                  "\n"
+	                  "Options:\n"),
+	                Prog);
+	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("  -s, --socket PATH             listen on the UNIX socket PATH\n"), usageout);
+	(void) fputs (_("  -w, --window MSEC             commit the requests received during MSEC\n"
+	                "                                milliseconds together\n"), usageout);
+	(void) fputs ("\n", usageout);
+	exit (status);
+}
+
+/*
+ * fail_exit - unlock the files and exit
+ */
+static /*@noreturn@*/void fail_exit (int code)
+{
+	if (spw_locked) {
+		if (spw_unlock () == 0) {
+			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, spw_dbname ());
+			SYSLOG ((LOG_ERR, "failed to unlock %s", spw_dbname ()));
+			/* continue */
+		}
+	}
+	if (pw_locked) {
+		if (pw_unlock () == 0) {
+			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, pw_dbname ());
+			SYSLOG ((LOG_ERR, "failed to unlock %s", pw_dbname ()));
+			/* continue */
+		}
+	}
+	if (gr_locked) {
+		if (gr_unlock () == 0) {
+			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, gr_dbname ());
+			SYSLOG ((LOG_ERR, "failed to unlock %s", gr_dbname ()));
+			/* continue */
+		}
+	}
+#ifdef	SHADOWGRP
+	if (sgr_locked) {
+		if (sgr_unlock () == 0) {
+			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, sgr_dbname ());
+			SYSLOG ((LOG_ERR, "failed to unlock %s", sgr_dbname ()));
+			/* continue */
+		}
+	}
+#endif
+	if (listening) {
+		(void) unlink (socket_path);
+	}
+
+	exit (code);
+}
+
+/*
+ * process_flags - parse the command line options
+ */
+static void process_flags (int argc, char **argv)
+{
+	int c;
+	static struct option long_options[] = {
+		{"help",   no_argument,       NULL, 'h'},
+		{"socket", required_argument, NULL, 's'},
+		{"window", required_argument, NULL, 'w'},
+		{NULL, 0, NULL, '\0'}
+	};
+
+	while ((c = getopt_long (argc, argv, "hs:w:",
+	                         long_options, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			usage (E_SUCCESS);
+			/*@notreached@*/break;
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'w':
+			if (   (getlong (optarg, &window_ms) == 0)
+			    || (window_ms < 0)) {
+				fprintf (stderr,
+				         _("%s: invalid numeric argument '%s'\n"),
+				         Prog, optarg);
+				usage (E_USAGE);
+			}
+			break;
+		default:
+			usage (E_USAGE);
+			/*@notreached@*/break;
+		}
+	}
+
+	if (optind != argc) {
+		usage (E_USAGE);
+	}
+}
+
+/*
+ * open_files - lock and open the password, group and shadow databases
+ *
+ *	The files stay locked until shadowd exits.
+ */
+static void open_files (void)
+{
+	if (pw_lock () == 0) {
+		fprintf (stderr,
+		         _("%s: cannot lock %s; try again later.\n"),
+		         Prog, pw_dbname ());
+		fail_exit (E_FAILURE);
+	}
+	pw_locked = true;
+	if (is_shadow_pwd) {
+		if (spw_lock () == 0) {
+			fprintf (stderr,
+			         _("%s: cannot lock %s; try again later.\n"),
+			         Prog, spw_dbname ());
+			fail_exit (E_FAILURE);
+		}
+		spw_locked = true;
+	}
+	if (gr_lock () == 0) {
+		fprintf (stderr,
+		         _("%s: cannot lock %s; try again later.\n"),
+		         Prog, gr_dbname ());
+		fail_exit (E_FAILURE);
+	}
+	gr_locked = true;
+#ifdef SHADOWGRP
+	if (is_shadow_grp) {
+		if (sgr_lock () == 0) {
+			fprintf (stderr,
+			         _("%s: cannot lock %s; try again later.\n"),
+			         Prog, sgr_dbname ());
+			fail_exit (E_FAILURE);
+		}
+		sgr_locked = true;
+	}
+#endif
+
+	if (pw_open (O_CREAT | O_RDWR) == 0) {
+		fprintf (stderr, _("%s: cannot open %s\n"), Prog, pw_dbname ());
+		fail_exit (E_FAILURE);
+	}
+	if (is_shadow_pwd && (spw_open (O_CREAT | O_RDWR) == 0)) {
+		fprintf (stderr, _("%s: cannot open %s\n"), Prog, spw_dbname ());
+		fail_exit (E_FAILURE);
+	}
+	if (gr_open (O_CREAT | O_RDWR) == 0) {
+		fprintf (stderr, _("%s: cannot open %s\n"), Prog, gr_dbname ());
+		fail_exit (E_FAILURE);
+	}
+#ifdef SHADOWGRP
+	if (is_shadow_grp && (sgr_open (O_CREAT | O_RDWR) == 0)) {
+		fprintf (stderr, _("%s: cannot open %s\n"), Prog, sgr_dbname ());
+		fail_exit (E_FAILURE);
+	}
+#endif
+}
+
+/*
+ * close_files - close and unlock the password, group and shadow databases
+ *
+ *	The pending requests must have been committed.
+ */
+static void close_files (void)
+{
+	if (pw_unlock () == 0) {
+		fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, pw_dbname ());
+		SYSLOG ((LOG_ERR, "failed to unlock %s", pw_dbname ()));
+		/* continue */
+	}
+	pw_locked = false;
+	if (is_shadow_pwd) {
+		if (spw_unlock () == 0) {
+			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, spw_dbname ());
+			SYSLOG ((LOG_ERR, "failed to unlock %s", spw_dbname ()));
+			/* continue */
+		}
+		spw_locked = false;
+	}
+	if (gr_unlock () == 0) {
+		fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, gr_dbname ());
+		SYSLOG ((LOG_ERR, "failed to unlock %s", gr_dbname ()));
+		/* continue */
+	}
+	gr_locked = false;
+#ifdef SHADOWGRP
+	if (is_shadow_grp) {
+		if (sgr_unlock () == 0) {
+			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, sgr_dbname ());
+			SYSLOG ((LOG_ERR, "failed to unlock %s", sgr_dbname ()));
+			/* continue */
+		}
+		sgr_locked = false;
+	}
+#endif
+}
+
+/*
+ * reopen_files - read the databases again, without unlocking them
+ *
+ *	This releases the memory of the lines written since the databases
+ *	were read, and forgets the IDs found for the new entries.
+ *	The pending requests must have been committed.
+ */
+static void reopen_files (void)
+{
+	/* Nothing was changed: the databases are only closed */
+	if (   (pw_close () == 0)
+	    || (is_shadow_pwd && (spw_close () == 0))
+	    || (gr_close () == 0)
+#ifdef SHADOWGRP
+	    || (is_shadow_grp && (sgr_close () == 0))
+#endif
+	   ) {
+		fprintf (stderr, _("%s: cannot read the databases again\n"), Prog);
+		SYSLOG ((LOG_ERR, "cannot read the databases again"));
+		fail_exit (E_FAILURE);
+	}
+
+	if (   (pw_open (O_CREAT | O_RDWR) == 0)
+	    || (is_shadow_pwd && (spw_open (O_CREAT | O_RDWR) == 0))
+	    || (gr_open (O_CREAT | O_RDWR) == 0)
+#ifdef SHADOWGRP
+	    || (is_shadow_grp && (sgr_open (O_CREAT | O_RDWR) == 0))
+#endif
+	   ) {
+		fprintf (stderr, _("%s: cannot read the databases again\n"), Prog);
+		SYSLOG ((LOG_ERR, "cannot read the databases again"));
+		fail_exit (E_FAILURE);
+	}
+
+	id_pool_free (&uid_pool);
+	id_pool_free (&gid_pool);
+	memzero (&uid_pool, sizeof uid_pool);
+	memzero (&gid_pool, sizeof gid_pool);
+}
+
+/*
+ * log_message - format the message logged once a request is committed
+ */
+static /*@null@*/char *log_message (const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+
+	va_start (ap, fmt);
+	(void) vsnprintf (buf, sizeof buf, fmt, ap);
+	va_end (ap);
+	return xstrdup (buf);
+}
+
+/*
+ * find_group - find the GID of an existing group, by name or by ID
+ */
+static /*@null@*/const char *find_group (const char *gid, gid_t *ngid)
+{
+	const struct group *grp;
+
+	if (isdigit (gid[0])) {
+		if (get_gid (gid, ngid) == 0) {
+			return "invalid group ID";
+		}
+		grp = gr_locate_gid (*ngid);
+	} else {
+		grp = gr_locate (gid);
+	}
+	if (NULL == grp) {
+		return "group does not exist";
+	}
+	*ngid = grp->gr_gid;
+	return NULL;
+}
+
+/*
+ * new_group - add a group without members
+ */
+static /*@null@*/const char *new_group (const char *name, gid_t gid)
+{
+	struct group grent;
+	char *empty[1];
+#ifdef SHADOWGRP
+	struct sgrp sgent;
+#endif
+
+	empty[0] = NULL;
+	grent.gr_name = (char *) name;
+	grent.gr_passwd = "!";	/* XXX warning: const */
+	grent.gr_gid = gid;
+	grent.gr_mem = empty;
+#ifdef SHADOWGRP
+	if (is_shadow_grp) {
+		if (NULL != sgr_locate (name)) {
+			return "group exists in the shadow group file";
+		}
+		grent.gr_passwd = SHADOW_PASSWD_STRING;	/* XXX warning: const */
+		sgent.sg_name = (char *) name;
+		sgent.sg_passwd = "!";	/* XXX warning: const */
+		sgent.sg_adm = empty;
+		sgent.sg_mem = empty;
+	}
+#endif
+
+	if (gr_update (&grent) == 0) {
+		return "cannot update the group file";
+	}
+#ifdef SHADOWGRP
+	if (is_shadow_grp && (sgr_update (&sgent) == 0)) {
+		(void) gr_remove (name);
+		return "cannot update the shadow group file";
+	}
+#endif
+	changed_dbs |= CACHE_DB_GROUP;
+	return NULL;
+}
+
+/*
+ * do_useradd - add a user
+ */
+static /*@null@*/const char *do_useradd (char *args, char **log)
+{
+	char *fields[6];
+	struct passwd pwent;
+	struct spwd spent;
+	uid_t uid;
+	gid_t gid;
+	bool user_group = false;
+	const char *err;
+	int i;
+
+	if (split_fields (args, ':', fields, 6) != 6) {
+		return "invalid entry";
+	}
+	if (!is_valid_user_name (fields[0])) {
+		return "invalid user name";
+	}
+	if (NULL != pw_locate (fields[0])) {
+		return "user already exists";
+	}
+	for (i = 3; i < 6; i++) {
+		if (valid_field (fields[i], ":\n") == -1) {
+			return "invalid field";
+		}
+	}
+
+	if ('\0' == fields[1][0]) {
+		if (reserve_uids (&uid_pool, false, 1, &uid, NULL) < 0) {
+			return "no more available UIDs";
+		}
+	} else if (   (get_uid (fields[1], &uid) == 0)
+	           || (uid == (uid_t) -1)) {
+		return "invalid user ID";
+	} else if (NULL != pw_locate_uid (uid)) {
+		return "UID already in use";
+	}
+
+	if ('\0' == fields[2][0]) {
+		if (   (NULL != gr_locate (fields[0]))
+		    || !is_valid_group_name (fields[0])) {
+			return "cannot create a group with the name of the user";
+		}
+		/* Use the UID as GID if possible, like useradd -U */
+		if (reserve_gids (&gid_pool, false, 1, &gid, &uid) < 0) {
+			return "no more available GIDs";
+		}
+		user_group = true;
+	} else {
+		err = find_group (fields[2], &gid);
+		if (NULL != err) {
+			return err;
+		}
+	}
+
+	if (user_group) {
+		err = new_group (fields[0], gid);
+		if (NULL != err) {
+			return err;
+		}
+	}
+
+	pwent.pw_name = fields[0];
+	pwent.pw_passwd = is_shadow_pwd ? SHADOW_PASSWD_STRING : "!";	/* XXX warning: const */
+	pwent.pw_uid = uid;
+	pwent.pw_gid = gid;
+	pwent.pw_gecos = fields[3];
+	pwent.pw_dir = fields[4];
+	pwent.pw_shell = fields[5];
+	if (pw_update (&pwent) == 0) {
+		err = "cannot update the password file";
+		goto undo;
+	}
+
+	if (is_shadow_pwd) {
+		spent.sp_namp = fields[0];
+		spent.sp_pwdp = "!";	/* XXX warning: const */
+		spent.sp_lstchg = (long) gettime () / SCALE;
+		if (0 == spent.sp_lstchg) {
+			/* Better disable aging than requiring a password
+			 * change */
+			spent.sp_lstchg = -1;
+		}
+		spent.sp_min    = getdef_num ("PASS_MIN_DAYS", -1);
+		spent.sp_max    = getdef_num ("PASS_MAX_DAYS", -1);
+		spent.sp_warn   = getdef_num ("PASS_WARN_AGE", -1);
+		spent.sp_inact  = -1;
+		spent.sp_expire = -1;
+		spent.sp_flag   = SHADOW_SP_FLAG_UNSET;
+		if (spw_update (&spent) == 0) {
+			(void) pw_remove (fields[0]);
+			err = "cannot update the shadow password file";
+			goto undo;
+		}
+	}
+	changed_dbs |= CACHE_DB_PASSWD;
+
+	*log = log_message ("new user: name=%s, UID=%lu, GID=%lu, home=%s, shell=%s",
+	                    fields[0], (unsigned long) uid,
+	                    (unsigned long) gid, fields[4], fields[5]);
+	return NULL;
+
+      undo:
+	if (user_group) {
+		(void) gr_remove (fields[0]);
+#ifdef SHADOWGRP
+		if (is_shadow_grp) {
+			(void) sgr_remove (fields[0]);
+		}
+#endif
+	}
+	return err;
+}
+
+/*
+ * do_usermod - change the fields of a user which are not empty
+ */
+static /*@null@*/const char *do_usermod (char *args, char **log)
+{
+	char *fields[6];
+	const struct passwd *pwd;
+	struct passwd pwent;
+	const char *err;
+	int i;
+
+	if (split_fields (args, ':', fields, 6) != 6) {
+		return "invalid entry";
+	}
+	pwd = pw_locate (fields[0]);
+	if (NULL == pwd) {
+		return "user does not exist";
+	}
+	for (i = 3; i < 6; i++) {
+		if (valid_field (fields[i], ":\n") == -1) {
+			return "invalid field";
+		}
+	}
+	pwent = *pwd;
+
+	if ('\0' != fields[1][0]) {
+		if (   (get_uid (fields[1], &pwent.pw_uid) == 0)
+		    || (pwent.pw_uid == (uid_t) -1)) {
+			return "invalid user ID";
+		}
+		if (   (pwent.pw_uid != pwd->pw_uid)
+		    && (NULL != pw_locate_uid (pwent.pw_uid))) {
+			return "UID already in use";
+		}
+	}
+	if ('\0' != fields[2][0]) {
+		err = find_group (fields[2], &pwent.pw_gid);
+		if (NULL != err) {
+			return err;
+		}
+	}
+	if ('\0' != fields[3][0]) {
+		pwent.pw_gecos = fields[3];
+	}
+	if ('\0' != fields[4][0]) {
+		pwent.pw_dir = fields[4];
+	}
+	if ('\0' != fields[5][0]) {
+		pwent.pw_shell = fields[5];
+	}
+
+	if (pw_update (&pwent) == 0) {
+		return "cannot update the password file";
+	}
+	changed_dbs |= CACHE_DB_PASSWD;
+
+	*log = log_message ("change user '%s': UID=%lu, GID=%lu, home=%s, shell=%s",
+	                    fields[0], (unsigned long) pwent.pw_uid,
+	                    (unsigned long) pwent.pw_gid,
+	                    pwent.pw_dir, pwent.pw_shell);
+	return NULL;
+}
+
+/*
+ * do_userdel - remove a user, and its group memberships
+ */
+static /*@null@*/const char *do_userdel (char *args, char **log)
+{
+	const struct group **groups;
+	struct group *ngrp;
+#ifdef SHADOWGRP
+	const struct sgrp **sgroups;
+	struct sgrp *nsgrp;
+#endif
+	size_t count, i;
+
+	if (NULL == pw_locate (args)) {
+		return "user does not exist";
+	}
+
+	if (gr_locate_member (args, &groups, &count) == 0) {
+		return "out of memory";
+	}
+	for (i = 0; i < count; i++) {
+		ngrp = __gr_dup (groups[i]);
+		if (NULL == ngrp) {
+			free (groups);
+			return "out of memory";
+		}
+		ngrp->gr_mem = del_list (ngrp->gr_mem, args);
+		if (gr_update (ngrp) == 0) {
+			gr_free (ngrp);
+			free (groups);
+			return "cannot update the group file";
+		}
+		gr_free (ngrp);
+		changed_dbs |= CACHE_DB_GROUP;
+	}
+	free (groups);
+
+#ifdef SHADOWGRP
+	if (is_shadow_grp) {
+		if (sgr_locate_member (args, &sgroups, &count) == 0) {
+			return "out of memory";
+		}
+		for (i = 0; i < count; i++) {
+			nsgrp = __sgr_dup (sgroups[i]);
+			if (NULL == nsgrp) {
+				free (sgroups);
+				return "out of memory";
+			}
+			nsgrp->sg_mem = del_list (nsgrp->sg_mem, args);
+			nsgrp->sg_adm = del_list (nsgrp->sg_adm, args);
+			if (sgr_update (nsgrp) == 0) {
+				sgr_free (nsgrp);
+				free (sgroups);
+				return "cannot update the shadow group file";
+			}
+			sgr_free (nsgrp);
+		}
+		free (sgroups);
+	}
+#endif
+
+	if (pw_remove (args) == 0) {
+		return "cannot update the password file";
+	}
+	if (is_shadow_pwd && (NULL != spw_locate (args))) {
+		(void) spw_remove (args);
+	}
+	changed_dbs |= CACHE_DB_PASSWD;
+
+	*log = log_message ("delete user '%s'", args);
+	return NULL;
+}
+
+/*
+ * do_groupadd - add a group
+ */
+static /*@null@*/const char *do_groupadd (char *args, char **log)
+{
+	char *fields[2];
+	gid_t gid;
+	const char *err;
+
+	if (split_fields (args, ':', fields, 2) != 2) {
+		return "invalid entry";
+	}
+	if (!is_valid_group_name (fields[0])) {
+		return "invalid group name";
+	}
+	if (NULL != gr_locate (fields[0])) {
+		return "group already exists";
+	}
+
+	if ('\0' == fields[1][0]) {
+		if (reserve_gids (&gid_pool, false, 1, &gid, NULL) < 0) {
+			return "no more available GIDs";
+		}
+	} else if (   (get_gid (fields[1], &gid) == 0)
+	           || (gid == (gid_t) -1)) {
+		return "invalid group ID";
+	} else if (NULL != gr_locate_gid (gid)) {
+		return "GID already in use";
+	}
+
+	err = new_group (fields[0], gid);
+	if (NULL != err) {
+		return err;
+	}
+
+	*log = log_message ("new group: name=%s, GID=%lu",
+	                    fields[0], (unsigned long) gid);
+	return NULL;
+}
+
+/*
+ * do_groupdel - remove a group, unless it is a primary group
+ */
+static /*@null@*/const char *do_groupdel (char *args, char **log)
+{
+	const struct group *grp;
+	const struct passwd *pwd;
+
+	grp = gr_locate (args);
+	if (NULL == grp) {
+		return "group does not exist";
+	}
+
+	(void) pw_rewind ();
+	while ((pwd = pw_next ()) != NULL) {
+		if (pwd->pw_gid == grp->gr_gid) {
+			return "cannot remove the primary group of a user";
+		}
+	}
+
+	if (gr_remove (args) == 0) {
+		return "cannot update the group file";
+	}
+#ifdef SHADOWGRP
+	if (is_shadow_grp && (NULL != sgr_locate (args))) {
+		(void) sgr_remove (args);
+	}
+#endif
+	changed_dbs |= CACHE_DB_GROUP;
+
+	*log = log_message ("group '%s' removed", args);
+	return NULL;
+}
+
+/*
+ * change_member - add or remove a member of a group
+ */
+static /*@null@*/const char *change_member (char *args, char **log,
+                                            bool add)
+{
+	char *fields[2];
+	const struct group *grp;
+	struct group *ngrp;
+#ifdef SHADOWGRP
+	const struct sgrp *sg;
+	struct sgrp *nsg;
+#endif
+
+	if (split_fields (args, ':', fields, 2) != 2) {
+		return "invalid entry";
+	}
+	grp = gr_locate (fields[0]);
+	if (NULL == grp) {
+		return "group does not exist";
+	}
+	if (add && (NULL == pw_locate (fields[1]))) {
+		return "user does not exist";
+	}
+
+	if (is_on_list (grp->gr_mem, fields[1]) != add) {
+		ngrp = __gr_dup (grp);
+		if (NULL == ngrp) {
+			return "out of memory";
+		}
+		ngrp->gr_mem = add ? add_list (ngrp->gr_mem, fields[1])
+		                   : del_list (ngrp->gr_mem, fields[1]);
+		if (gr_update (ngrp) == 0) {
+			gr_free (ngrp);
+			return "cannot update the group file";
+		}
+		gr_free (ngrp);
+		changed_dbs |= CACHE_DB_GROUP;
+	}
+#ifdef SHADOWGRP
+	if (is_shadow_grp) {
+		sg = sgr_locate (fields[0]);
+		if (   (NULL != sg)
+		    && (is_on_list (sg->sg_mem, fields[1]) != add)) {
+			nsg = __sgr_dup (sg);
+			if (NULL == nsg) {
+				return "out of memory";
+			}
+			nsg->sg_mem = add ? add_list (nsg->sg_mem, fields[1])
+			                  : del_list (nsg->sg_mem, fields[1]);
+			if (sgr_update (nsg) == 0) {
+				sgr_free (nsg);
+				return "cannot update the shadow group file";
+			}
+			sgr_free (nsg);
+		}
+	}
+#endif
+
+	*log = log_message (add ? "add '%s' to group '%s'"
+	                        : "delete '%s' from group '%s'",
+	                    fields[1], fields[0]);
+	return NULL;
+}
+
+static /*@null@*/const char *do_addmember (char *args, char **log)
+{
+	return change_member (args, log, true);
+}
+
+static /*@null@*/const char *do_delmember (char *args, char **log)
+{
+	return change_member (args, log, false);
+}
+
+static const struct {
+	const char *name;
+	const char *(*fn) (char *args, char **log);
+} requests[] = {
+	{"useradd",   do_useradd},
+	{"usermod",   do_usermod},
+	{"userdel",   do_userdel},
+	{"groupadd",  do_groupadd},
+	{"groupdel",  do_groupdel},
+	{"addmember", do_addmember},
+	{"delmember", do_delmember},
+};
+
+/*
+ * handle_request - apply a request to the open databases
+ *
+ *	The request is answered after the next commit, even if it failed,
+ *	so that the answers of a client are sent in order.
+ */
+static void handle_request (size_t c, char *line)
+{
+	struct pending *p;
+	char *args;
+	size_t i;
+
+	args = strchr (line, ' ');
+	if (NULL != args) {
+		*args = '\0';
+		args++;
+	} else {
+		args = line + strlen (line);
+	}
+
+	p = &pending[npending];
+	p->client = c;
+	p->gen = clients[c].gen;
+	p->error = "unknown request";
+	p->log = NULL;
+	for (i = 0; i < sizeof requests / sizeof requests[0]; i++) {
+		if (strcmp (line, requests[i].name) == 0) {
+			p->error = requests[i].fn (args, &p->log);
+			break;
+		}
+	}
+
+	if (0 == npending) {
+		(void) clock_gettime (CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += window_ms / 1000;
+		deadline.tv_nsec += (window_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+	npending++;
+}
+
+/*
+ * commit - write the changes of the pending requests
+ *
+ *	On failure, the changes are dropped and the databases are read
+ *	again.
+ */
+static bool commit (void)
+{
+	struct commonio_txn txn;
+
+	if (0 == changed_dbs) {
+		return true;
+	}
+
+	commonio_txn_init (&txn);
+	(void) commonio_txn_add (&txn, __pw_get_db ());
+	if (is_shadow_pwd) {
+		(void) commonio_txn_add (&txn, __spw_get_db ());
+	}
+	(void) commonio_txn_add (&txn, __gr_get_db ());
+#ifdef SHADOWGRP
+	if (is_shadow_grp) {
+		(void) commonio_txn_add (&txn, __sgr_get_db ());
+	}
+#endif
+
+	if (commonio_txn_checkpoint (&txn) == 0) {
+		fprintf (stderr,
+		         _("%s: failure while writing changes to %s\n"),
+		         Prog, txn.failed->filename);
+		SYSLOG ((LOG_ERR, "failure while writing changes to %s", txn.failed->filename));
+		changed_dbs = 0;
+
+		/* The databases were closed, but they are still locked */
+		if (   (pw_open (O_CREAT | O_RDWR) == 0)
+		    || (is_shadow_pwd && (spw_open (O_CREAT | O_RDWR) == 0))
+		    || (gr_open (O_CREAT | O_RDWR) == 0)
+#ifdef SHADOWGRP
+		    || (is_shadow_grp && (sgr_open (O_CREAT | O_RDWR) == 0))
+#endif
+		   ) {
+			fprintf (stderr, _("%s: cannot read the databases again\n"), Prog);
+			SYSLOG ((LOG_ERR, "cannot read the databases again"));
+			fail_exit (E_FAILURE);
+		}
+		return false;
+	}
+
+	cache_flush_defer (changed_dbs);
+	cache_flush_now ();
+	changed_dbs = 0;
+	return true;
+}
+
+/*
+ * answer - send an answer line to a client
+ *
+ *	A client which does not read its answers is dropped.
+ */
+static void answer (size_t c, const char *msg)
+{
+	char buf[256];
+	size_t len;
+	ssize_t n;
+	const char *cp;
+
+	len = (size_t) snprintf (buf, sizeof buf, "%s\n", msg);
+	if (len >= sizeof buf) {
+		len = sizeof buf - 1;
+		buf[len - 1] = '\n';
+	}
+	for (cp = buf; len > 0; cp += n, len -= (size_t) n) {
+		n = send (clients[c].fd, cp, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (EINTR == errno) {
+				n = 0;
+				continue;
+			}
+			drop_client (c);
+			return;
+		}
+	}
+}
+
+/*
+ * flush_pending - commit the pending requests, and answer them
+ */
+static void flush_pending (void)
+{
+	char buf[256];
+	bool ok;
+	size_t i;
+
+	if (0 == npending) {
+		return;
+	}
+
+	ok = commit ();
+	for (i = 0; i < npending; i++) {
+		struct pending *p = &pending[i];
+
+		if (NULL != p->error) {
+			(void) snprintf (buf, sizeof buf, "error: %s", p->error);
+		} else if (!ok) {
+			(void) snprintf (buf, sizeof buf,
+			                 "error: failure while writing changes");
+		} else {
+			if (NULL != p->log) {
+				SYSLOG ((LOG_INFO, "%s", p->log));
+			}
+			(void) snprintf (buf, sizeof buf, "ok");
+		}
+		free (p->log);
+
+		/* The client may be gone */
+		if (   (-1 != clients[p->client].fd)
+		    && (clients[p->client].gen == p->gen)) {
+			answer (p->client, buf);
+		}
+	}
+	npending = 0;
+}
+
+/*
+ * open_socket - listen on the socket of shadowd
+ *
+ *	The socket can only be used by root.
+ */
+static int open_socket (void)
+{
+	struct sockaddr_un addr;
+	mode_t old_umask;
+	int fd;
+
+	if (strlen (socket_path) >= sizeof addr.sun_path) {
+		fprintf (stderr, _("%s: socket path too long: %s\n"),
+		         Prog, socket_path);
+		fail_exit (E_USAGE);
+	}
+
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf (stderr, _("%s: cannot create socket: %s\n"),
+		         Prog, strerror (errno));
+		fail_exit (E_FAILURE);
+	}
+	(void) fcntl (fd, F_SETFD, FD_CLOEXEC);
+	(void) fcntl (fd, F_SETFL, O_NONBLOCK);
+
+	memzero (&addr, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, socket_path);
+	(void) unlink (socket_path);
+
+	old_umask = umask (077);
+	if (   (bind (fd, (struct sockaddr *) &addr, sizeof addr) != 0)
+	    || (listen (fd, 16) != 0)) {
+		fprintf (stderr, _("%s: cannot listen on %s: %s\n"),
+		         Prog, socket_path, strerror (errno));
+		(void) umask (old_umask);
+		(void) close (fd);
+		fail_exit (E_FAILURE);
+	}
+	(void) umask (old_umask);
+	listening = true;
+
+	return fd;
+}
+
+static void accept_client (int sfd)
+{
+	size_t c;
+	int fd;
+
+	fd = accept (sfd, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+	for (c = 0; c < MAX_CLIENTS; c++) {
+		if (-1 == clients[c].fd) {
+			break;
+		}
+	}
+	if (MAX_CLIENTS == c) {
+		(void) close (fd);
+		return;
+	}
+	(void) fcntl (fd, F_SETFD, FD_CLOEXEC);
+	(void) fcntl (fd, F_SETFL, O_NONBLOCK);
+	clients[c].fd = fd;
+	clients[c].gen++;
+	clients[c].len = 0;
+}
+
+static void drop_client (size_t c)
+{
+	(void) close (clients[c].fd);
+	clients[c].fd = -1;
+}
+
+/*
+ * read_client - read the requests of a client, and apply them
+ */
+static void read_client (size_t c)
+{
+	struct client *cl = &clients[c];
+	char *line, *nl;
+	ssize_t n;
+
+	n = read (cl->fd, cl->buf + cl->len, sizeof cl->buf - cl->len);
+	if (n < 0) {
+		if ((EINTR != errno) && (EAGAIN != errno)) {
+			drop_client (c);
+		}
+		return;
+	}
+	if (0 == n) {
+		drop_client (c);
+		return;
+	}
+	cl->len += (size_t) n;
+
+	line = cl->buf;
+	while ((nl = memchr (line, '\n', cl->len - (size_t) (line - cl->buf))) != NULL) {
+		*nl = '\0';
+		if (MAX_PENDING == npending) {
+			flush_pending ();
+			if (-1 == cl->fd) {
+				return;
+			}
+		}
+		handle_request (c, line);
+		line = nl + 1;
+	}
+
+	cl->len -= (size_t) (line - cl->buf);
+	if (cl->len == sizeof cl->buf) {
+		/* The request is too long */
+		drop_client (c);
+		return;
+	}
+	memmove (cl->buf, line, cl->len);
+}
+
+/*
+ * ms_left - milliseconds until the pending requests must be committed
+ */
+static long ms_left (void)
+{
+	struct timespec now;
+	long ms;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &now);
+	ms =   (long) (deadline.tv_sec - now.tv_sec) * 1000
+	     + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+	return (ms < 0) ? 0 : ms;
+}
+
+static void catch_signal (int sig)
+{
+	if (SIGHUP == sig) {
+		reload = 1;
+	} else {
+		stop = 1;
+	}
+}
+
+int main (int argc, char **argv)
+{
+	struct pollfd fds[MAX_CLIENTS + 1];
+	size_t map[MAX_CLIENTS + 1];
+	struct sigaction sa;
+	size_t nfds, c, i;
+	int sfd;
+
+	/*
+	 * Get my name so that I can use it to report errors.
+	 */
+	Prog = Basename (argv[0]);
+
+	(void) setlocale (LC_ALL, "");
+	(void) bindtextdomain (PACKAGE, LOCALEDIR);
+	(void) textdomain (PACKAGE);
+
+	OPENLOG ("shadowd");
+
+	process_flags (argc, argv);
+
+	if (getuid () != 0) {
+		fprintf (stderr, _("%s: Permission denied.\n"), Prog);
+		exit (E_FAILURE);
+	}
+
+	is_shadow_pwd = spw_file_present ();
+#ifdef SHADOWGRP
+	is_shadow_grp = sgr_file_present ();
+#endif
+
+	for (c = 0; c < MAX_CLIENTS; c++) {
+		clients[c].fd = -1;
+		clients[c].gen = 0;
+	}
+
+	memzero (&sa, sizeof sa);
+	sa.sa_handler = catch_signal;
+	(void) sigemptyset (&sa.sa_mask);
+	(void) sigaction (SIGTERM, &sa, NULL);
+	(void) sigaction (SIGINT, &sa, NULL);
+	(void) sigaction (SIGHUP, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	(void) sigaction (SIGPIPE, &sa, NULL);
+
+	open_files ();
+	sfd = open_socket ();
+	SYSLOG ((LOG_INFO, "listening on %s", socket_path));
+
+	while (0 == stop) {
+		int timeout = -1;
+		int ret;
+
+		if (npending > 0) {
+			timeout = (int) ms_left ();
+		}
+
+		nfds = 0;
+		fds[nfds].fd = sfd;
+		fds[nfds].events = POLLIN;
+		nfds++;
+		for (c = 0; c < MAX_CLIENTS; c++) {
+			if (-1 != clients[c].fd) {
+				fds[nfds].fd = clients[c].fd;
+				fds[nfds].events = POLLIN;
+				map[nfds] = c;
+				nfds++;
+			}
+		}
+
+		ret = poll (fds, nfds, timeout);
+		if ((ret < 0) && (EINTR != errno)) {
+			fprintf (stderr, _("%s: poll failed: %s\n"),
+			         Prog, strerror (errno));
+			break;
+		}
+
+		if (ret > 0) {
+			for (i = 1; i < nfds; i++) {
+				if (   (0 != fds[i].revents)
+				    && (-1 != clients[map[i]].fd)) {
+					read_client (map[i]);
+				}
+			}
+			if (0 != fds[0].revents) {
+				accept_client (sfd);
+			}
+		}
+
+		if ((npending > 0) && (ms_left () == 0)) {
+			flush_pending ();
+		}
+		if (0 != reload) {
+			reload = 0;
+			flush_pending ();
+			reopen_files ();
+			SYSLOG ((LOG_INFO, "databases read again"));
+		}
+	}
+
+	flush_pending ();
+	for (c = 0; c < MAX_CLIENTS; c++) {
+		if (-1 != clients[c].fd) {
+			drop_client (c);
+		}
+	}
+	(void) close (sfd);
+	(void) unlink (socket_path);
+	close_files ();
+
+	return (0 == stop) ? E_FAILURE : E_SUCCESS;
+}
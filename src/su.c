@@ -72,6 +72,7 @@
 #include "defines.h"
 #include "pwauth.h"
 #include "getdef.h"
+#include "timing.h"
 #ifdef USE_PAM
 #include "pam_defs.h"
 #endif				/* USE_PAM */
@@ -170,13 +171,15 @@ static RETSIGTYPE die (int killed)
 static bool iswheel (const char *username)
 {
 	struct group *grp;
+	bool ret;
 
-	grp = getgrnam ("wheel"); /* !USE_PAM, no need for xgetgrnam */
-	if (   (NULL ==grp)
-	    || (NULL == grp->gr_mem)) {
+	grp = cred_getgrnam ("wheel");
+	if (NULL == grp) {
 		return false;
 	}
-	return is_on_list (grp->gr_mem, username);
+	ret = is_on_list (grp->gr_mem, username);
+	gr_free (grp);
+	return ret;
 }
 #else				/* USE_PAM */
 static RETSIGTYPE kill_child (int unused(s))
@@ -194,17 +197,7 @@ static RETSIGTYPE kill_child (int unused(s))
 /* borrowed from GNU sh-utils' "su.c" */
 static bool restricted_shell (const char *shellname)
 {
-	/*@observer@*/const char *line;
-
-	setusershell ();
-	while ((line = getusershell ()) != NULL) {
-		if (('#' != *line) && (strcmp (line, shellname) == 0)) {
-			endusershell ();
-			return false;
-		}
-	}
-	endusershell ();
-	return true;
+	return !shell_is_listed (shellname);
 }
 
 static /*@noreturn@*/void su_failure (const char *tty, bool su_to_root)
@@ -309,6 +302,7 @@ static void prepare_pam_close_session (void)
 	}
 
 	/* parent only */
+	timing_reset ();	/* the child reports the startup */
 	sigfillset (&ourset);
 	if (sigprocmask (SIG_BLOCK, &ourset, NULL) != 0) {
 		(void) fprintf (stderr,
@@ -455,8 +449,21 @@ static void usage (int status)
 static void check_perms_pam (const struct passwd *pw)
 {
 	int ret;
+	struct timespec start;
+
+	/*
+	 * The PAM modules translate their prompts and messages with the
+	 * locale of su. Root is usually not prompted (pam_rootok).
+	 */
+	if (!caller_is_root) {
+		nls_load ();
+	}
+
+	timing_start (&start);
 	ret = pam_authenticate (pamh, 0);
+	timing_stop (TIMING_PAM_AUTH, &start, 0, 0);
 	if (PAM_SUCCESS != ret) {
+		nls_load ();
 		SYSLOG (((pw->pw_uid != 0)? LOG_NOTICE : LOG_WARN, "pam_authenticate: %s",
 		         pam_strerror (pamh, ret)));
 		fprintf (stderr, _("%s: %s\n"), Prog, pam_strerror (pamh, ret));
@@ -464,9 +471,12 @@ static void check_perms_pam (const struct passwd *pw)
 		su_failure (caller_tty, 0 == pw->pw_uid);
 	}
 
+	timing_start (&start);
 	ret = pam_acct_mgmt (pamh, 0);
+	timing_stop (TIMING_PAM_ACCT, &start, 0, 0);
 	if (PAM_SUCCESS != ret) {
 		if (caller_is_root) {
+			nls_load ();
 			fprintf (stderr,
 			         _("%s: %s\n(Ignored)\n"),
 			         Prog, pam_strerror (pamh, ret));
@@ -616,7 +626,12 @@ static /*@only@*/struct passwd * check_perms (void)
 	 * The password file entries for the user is gotten and the account
 	 * validated.
 	 */
-	struct passwd *pw = xgetpwnam (name);
+	struct passwd *pw;
+	struct timespec start;
+
+	timing_start (&start);
+	pw = cred_getpwnam (name);
+	timing_stop (TIMING_NSS, &start, 0, 0);
 	if (NULL == pw) {
 		(void) fprintf (stderr,
 		                _("No passwd entry for user '%s'\n"), name);
@@ -645,7 +660,7 @@ static /*@only@*/struct passwd * check_perms (void)
 		         name, tmp_name));
 		strncpy (name, tmp_name, sizeof(name) - 1);
 		name[sizeof(name) - 1] = '\0';
-		pw = xgetpwnam (name);
+		pw = cred_getpwnam (name);
 		if (NULL == pw) {
 			(void) fprintf (stderr,
 			                _("No passwd entry for user '%s'\n"),
@@ -816,17 +831,22 @@ static void process_flags (int argc, char **argv)
 		STRFCPY (name, argv[optind++]);	/* use this login id */
 	}
 	if ('\0' == name[0]) {		/* use default user */
-		struct passwd *root_pw = getpwnam ("root");
+		/* Resolved once, check_perms() gets it from the cache */
+		struct passwd *root_pw = cred_getpwnam ("root");
 		if ((NULL != root_pw) && (0 == root_pw->pw_uid)) {
 			(void) strcpy (name, "root");
 		} else {
-			root_pw = getpwuid (0);
+			if (NULL != root_pw) {
+				pw_free (root_pw);
+			}
+			root_pw = cred_getpwuid (0);
 			if (NULL == root_pw) {
 				SYSLOG ((LOG_CRIT, "There is no UID 0 user."));
 				su_failure (caller_tty, true);
 			}
 			(void) strcpy (name, root_pw->pw_name);
 		}
+		pw_free (root_pw);
 	}
 
 	doshell = (argc == optind);	/* any arguments remaining? */
@@ -961,14 +981,16 @@ int main (int argc, char **argv)
 {
 	const char *cp;
 	struct passwd *pw = NULL;
+	struct timespec start;
 
 #ifdef USE_PAM
 	int ret;
 #endif				/* USE_PAM */
 
-	(void) setlocale (LC_ALL, "");
-	(void) bindtextdomain (PACKAGE, LOCALEDIR);
-	(void) textdomain (PACKAGE);
+	timing_begin ();
+
+	/* The locale is loaded with the first message, see nls.c */
+	nls_defer (LOCALEDIR);
 
 	save_caller_context (argv);
 
@@ -979,7 +1001,9 @@ int main (int argc, char **argv)
 	initenv ();
 
 #ifdef USE_PAM
+	timing_start (&start);
 	ret = pam_start ("su", name, &conv, &pamh);
+	timing_stop (TIMING_PAM_START, &start, 0, 0);
 	if (PAM_SUCCESS != ret) {
 		SYSLOG ((LOG_ERR, "pam_start: error %d", ret);
 		fprintf (stderr,
@@ -1055,6 +1079,7 @@ int main (int argc, char **argv)
 	 * pam_setcred() may do things like resource limits, console groups,
 	 * and much more, depending on the configured modules
 	 */
+	timing_start (&start);
 	ret = pam_setcred (pamh, PAM_ESTABLISH_CRED);
 	if (PAM_SUCCESS != ret) {
 		SYSLOG ((LOG_ERR, "pam_setcred: %s", pam_strerror (pamh, ret)));
@@ -1064,6 +1089,7 @@ int main (int argc, char **argv)
 	}
 
 	ret = pam_open_session (pamh, 0);
+	timing_stop (TIMING_PAM_SESSION, &start, 0, 0);
 	if (PAM_SUCCESS != ret) {
 		SYSLOG ((LOG_ERR, "pam_open_session: %s",
 		         pam_strerror (pamh, ret)));
@@ -1082,7 +1108,9 @@ int main (int argc, char **argv)
 #else				/* !USE_PAM */
 	/* no limits if su from root (unless su must fake login's behavior) */
 	if (!caller_is_root || fakelogin) {
+		timing_start (&start);
 		setup_limits (pw);
+		timing_stop (TIMING_LIMITS, &start, 0, 0);
 	}
 
 	if (setup_uid_gid (pw, caller_on_console) != 0) {
@@ -1105,7 +1133,9 @@ int main (int argc, char **argv)
 	close (audit_fd);
 #endif				/* WITH_AUDIT */
 
+	timing_start (&start);
 	set_environment (pw);
+	timing_stop (TIMING_ENV, &start, 0, 0);
 
 	if (!doshell) {
 		/* There is no need for a controlling terminal.
@@ -1153,6 +1183,7 @@ int main (int argc, char **argv)
 	 * F_SETFD, 1)" in libc/misc/syslog.c, but it is commented out (at
 	 * least in 5.4.33). Why?  --marekm
 	 */
+	timing_exec ();
 	closelog ();
 
 	/*
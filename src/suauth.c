@@ -38,6 +38,7 @@
 #include <sys/types.h>
 #include "defines.h"
 #include "prototypes.h"
+#include "accesstab.h"
 
 #ifndef SUAUTHFILE
 #define SUAUTHFILE "/etc/suauth"
@@ -53,94 +54,84 @@
 /* Really, I could do with a few const char's here defining all the 
  * strings output to the user or the syslog. -- chris
  */
-static int applies (const char *, char *);
+static int applies (const char *, char *const *, int);
 
 static int isgrp (const char *, const char *);
 
-static int lines = 0;
+#define	FIELD_TO	0	/* list of the wanted users */
+#define	FIELD_FROM	1	/* list of the actual users */
+#define	FIELD_ACTION	2
+#define	FIELD_COUNT	3
+static struct access_table table = { SUAUTHFILE, ", " };
 
 
 int check_su_auth (const char *actual_id,
                    const char *wanted_id,
                    bool su_to_root)
 {
-	int posn, endline;
-	const char field[] = ":";
-	FILE *authfile_fd;
-	char temp[1024];
-	char *to_users;
-	char *from_users;
-	char *action;
-
-	if (!(authfile_fd = fopen (SUAUTHFILE, "r"))) {
-		int err = errno;
+	size_t i;
+
+	/*
+	 * The table is only parsed again when the file changed.
+	 */
+	switch (access_table_load (&table)) {
+	case -1:
 		/*
 		 * If the file doesn't exist - default to the standard su
 		 * behaviour (no access control).  If open fails for some
 		 * other reason - maybe someone is trying to fool us with
 		 * file descriptors limit etc., so deny access.  --marekm
 		 */
-		if (ENOENT == err) {
+		if (ENOENT == table.err) {
 			return NOACTION;
 		}
 		SYSLOG ((LOG_ERR,
 		         "could not open/read config file '%s': %s\n",
-		         SUAUTHFILE, strerror (err)));
+		         SUAUTHFILE, strerror (table.err)));
 		return DENY;
-	}
+	case 1:
+		for (i = 0; i < table.count; i++) {
+			struct access_rule *rule = &table.rules[i];
 
-	while (fgets (temp, sizeof (temp), authfile_fd) != NULL) {
-		lines++;
-
-		if (temp[endline = strlen (temp) - 1] != '\n') {
-			SYSLOG ((LOG_ERR,
-				 "%s, line %d: line too long or missing newline",
-				 SUAUTHFILE, lines));
-			continue;
+			if (rule->count != FIELD_COUNT) {
+				SYSLOG ((LOG_ERR,
+					 "%s, line %d. Bad number of fields.\n",
+					 SUAUTHFILE, rule->lineno));
+				rule->ignored = true;
+			}
 		}
+		break;
+	default:
+		break;
+	}
 
-		while (endline > 0 && (temp[endline - 1] == ' '
-				       || temp[endline - 1] == '\t'
-				       || temp[endline - 1] == '\n'))
-			endline--;
-		temp[endline] = '\0';
-
-		posn = 0;
-		while (temp[posn] == ' ' || temp[posn] == '\t')
-			posn++;
+	for (i = 0; i < table.count; i++) {
+		const struct access_rule *rule = &table.rules[i];
+		const char *action;
 
-		if (temp[posn] == '\n' || temp[posn] == '#'
-		    || temp[posn] == '\0') {
-			continue;
-		}
-		if (!(to_users = strtok (temp + posn, field))
-		    || !(from_users = strtok ((char *) NULL, field))
-		    || !(action = strtok ((char *) NULL, field))
-		    || strtok ((char *) NULL, field)) {
-			SYSLOG ((LOG_ERR,
-				 "%s, line %d. Bad number of fields.\n",
-				 SUAUTHFILE, lines));
+		if (rule->ignored) {
 			continue;
 		}
-
-		if (!applies (wanted_id, to_users))
+		if (!applies (wanted_id, rule->fields[FIELD_TO].tokens,
+		              rule->lineno))
 			continue;
-		if (!applies (actual_id, from_users))
+		if (!applies (actual_id, rule->fields[FIELD_FROM].tokens,
+		              rule->lineno))
 			continue;
+		action = (rule->fields[FIELD_ACTION].count == 1)
+		         ? rule->fields[FIELD_ACTION].tokens[0] : "";
 		if (!strcmp (action, "DENY")) {
 			SYSLOG ((su_to_root ? LOG_WARN : LOG_NOTICE,
 				 "DENIED su from '%s' to '%s' (%s)\n",
 				 actual_id, wanted_id, SUAUTHFILE));
 			fputs (_("Access to su to that account DENIED.\n"),
 			       stderr);
-			fclose (authfile_fd);
 			return DENY;
 		} else if (!strcmp (action, "NOPASS")) {
 			SYSLOG ((su_to_root ? LOG_NOTICE : LOG_INFO,
 				 "NO password asked for su from '%s' to '%s' (%s)\n",
 				 actual_id, wanted_id, SUAUTHFILE));
 			fputs (_("Password authentication bypassed.\n"),stderr);
-			fclose (authfile_fd);
 			return NOPWORD;
 		} else if (!strcmp (action, "OWNPASS")) {
 			SYSLOG ((su_to_root ? LOG_NOTICE : LOG_INFO,
@@ -148,27 +139,24 @@ int check_su_auth (const char *actual_id,
 				 actual_id, wanted_id, SUAUTHFILE));
 			fputs (_("Please enter your OWN password as authentication.\n"),
 			       stderr);
-			fclose (authfile_fd);
 			return OWNPWORD;
 		} else {
 			SYSLOG ((LOG_ERR,
 				 "%s, line %d: unrecognized action!\n",
-				 SUAUTHFILE, lines));
+				 SUAUTHFILE, rule->lineno));
 		}
 	}
-	fclose (authfile_fd);
 	return NOACTION;
 }
 
-static int applies (const char *single, char *list)
+static int applies (const char *single, char *const *list, int lines)
 {
-	const char split[] = ", ";
-	char *tok;
+	const char *tok;
 
 	int state = 0;
 
-	for (tok = strtok (list, split); tok != NULL;
-	     tok = strtok (NULL, split)) {
+	for (; NULL != *list; list++) {
+		tok = *list;
 
 		if (!strcmp (tok, "ALL")) {
 			if (state != 0) {
@@ -227,9 +215,9 @@ static int applies (const char *single, char *list)
 
 static int isgrp (const char *name, const char *group)
 {
-	struct group *grp;
+	const struct group *grp;
 
-	grp = getgrnam (group); /* local, no need for xgetgrnam */
+	grp = access_getgr (group); /* looked up once per process */
 
 	if (!grp || !grp->gr_mem)
 		return 0;
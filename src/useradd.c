@@ -55,12 +55,12 @@
 #include <time.h>
 #include <unistd.h>
 #include "chkname.h"
+#include "commonio.h"
 #include "defines.h"
 #include "faillog.h"
 #include "getdef.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #include "prototypes.h"
 #include "pwauth.h"
 #include "pwio.h"
@@ -74,6 +74,7 @@
 #ifdef WITH_TCB
 #include "tcbfuncs.h"
 #endif
+#include "uidrecords.h"
 
 #ifndef SKEL_DIR
 #define SKEL_DIR "/etc/skel"
@@ -134,6 +135,8 @@ static bool sgr_locked = false;
 #ifdef ENABLE_SUBIDS
 static bool is_sub_uid = false;
 static bool is_sub_gid = false;
+static bool add_sub_uids = false;	/* allocate subordinate IDs for this user */
+static bool add_sub_gids = false;
 static bool sub_uid_locked = false;
 static bool sub_gid_locked = false;
 static uid_t sub_uid_start;	/* New subordinate uid range */
@@ -174,6 +177,48 @@ static bool
 
 static bool home_added = false;
 
+/* Synchronized once the users are added, see close_logs() */
+static struct log_file faillog_file = LOG_FILE_INIT (FAILLOG_FILE);
+static struct log_file lastlog_file = LOG_FILE_INIT (LASTLOG_FILE);
+
+/*
+ * Failure counters of pam_tally2, indexed by UID. It does not know the
+ * keyed records, and its records (struct tallylog) are not declared by
+ * a header of PAM.
+ */
+#define TALLYLOG_FILE	"/var/log/tallylog"
+#define TALLYLOG_SIZE	64
+static struct log_file tallylog_file = LOG_UNKEYED_FILE_INIT (TALLYLOG_FILE);
+
+/* Entries of the batch file (-B), "-" for the standard input */
+static /*@null@*/const char *batch_file = NULL;
+static bool batch_entry = false;	/* parsing an entry of the batch file */
+
+/* IDs found for the users of the batch, see reserve_uids() */
+static struct id_pool uid_pool[2];	/* indexed by rflg */
+static struct id_pool gid_pool[2];
+
+/* The defaults restored before each entry of the batch */
+struct user_defaults {
+	gid_t group;
+	const char *gname;
+	const char *home;
+	const char *shell;
+	const char *template;
+	const char *create_mail_spool;
+	long inactive;
+	const char *expire;
+};
+
+/* What remains to do for a user of the batch once the files are written */
+struct batch_user {
+	char *name;
+	uid_t uid;
+#ifdef WITH_SELINUX
+	const char *selinux;
+#endif				/* WITH_SELINUX */
+};
+
 /*
  * exit status values
  */
@@ -220,10 +265,26 @@ static void open_files (void);
 static void open_shadow (void);
 static void faillog_reset (uid_t);
 static void lastlog_reset (uid_t);
-static void tallylog_reset (char *);
+static void close_logs (void);
+static void tallylog_reset (uid_t);
 static void usr_update (void);
+static bool clone_home (void);
 static void create_home (void);
 static void create_mail (void);
+static void check_new_user (void);
+#ifdef ENABLE_SUBIDS
+static void check_sub_ids (void);
+#endif				/* ENABLE_SUBIDS */
+static void add_user (void);
+static int split_args (char *line, char ***argvp);
+static char **read_batch (size_t *nlines);
+static void reset_user (const struct user_defaults *defs);
+static bool parse_entry (const char *line, int lineno,
+                         const struct user_defaults *defs);
+#ifdef WITH_SELINUX
+static int set_seusers (const struct batch_user *users, size_t nusers);
+#endif				/* WITH_SELINUX */
+static int add_batch (void);
 
 /*
  * fail_exit - undo as much as possible
@@ -231,7 +292,9 @@ static void create_mail (void);
 static void fail_exit (int code)
 {
 	if (home_added) {
-		if (rmdir (prefix_user_home) != 0) {
+		/* A cloned home directory is dropped with its files */
+		if (   (home_drop (prefix_user_home) != 0)
+		    && (rmdir (prefix_user_home) != 0)) {
 			fprintf (stderr,
 			         _("%s: %s was created, but could not be removed\n"),
 			         Prog, prefix_user_home);
@@ -815,13 +878,16 @@ static void usage (int status)
 	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
 	(void) fprintf (usageout,
 	                _("Usage: %s [options] LOGIN\n"
+	                  "       %s -B FILE\n"
 	                  "       %s -D\n"
 	                  "       %s -D [options]\n"
 	                  "\n"
 	                  "Options:\n"),
-	                Prog, Prog, Prog);
+	                Prog, Prog, Prog, Prog);
 	(void) fputs (_("  -b, --base-dir BASE_DIR       base directory for the home directory of the\n"
 	                "                                new account\n"), usageout);
+	(void) fputs (_("  -B, --batch FILE              add the users listed in FILE, one set of\n"
+	                "                                options and LOGIN per line\n"), usageout);
 	(void) fputs (_("  -c, --comment COMMENT         GECOS field of the new account\n"), usageout);
 	(void) fputs (_("  -d, --home-dir HOME_DIR       home directory of the new account\n"), usageout);
 	(void) fputs (_("  -D, --defaults                print or change default useradd configuration\n"), usageout);
@@ -935,6 +1001,8 @@ static void grp_update (void)
 {
 	const struct group *grp;
 	struct group *ngrp;
+	size_t i;
+	char event[128];
 
 #ifdef	SHADOWGRP
 	const struct sgrp *sgrp;
@@ -942,18 +1010,16 @@ static void grp_update (void)
 #endif
 
 	/*
-	 * Scan through the entire group file looking for the groups that
-	 * the user is a member of.
+	 * Look up the groups specified as concurrent groups.
+	 * A group listed twice is only updated once: the user is then
+	 * already a member.
 	 * FIXME: we currently do not check that all groups of user_groups
 	 *        were completed with the new user.
 	 */
-	for (gr_rewind (), grp = gr_next (); NULL != grp; grp = gr_next ()) {
-
-		/*
-		 * See if the user specified this group as one of their
-		 * concurrent groups.
-		 */
-		if (!is_on_list (user_groups, grp->gr_name)) {
+	for (i = 0; NULL != user_groups[i]; i++) {
+		grp = gr_locate (user_groups[i]);
+		if (   (NULL == grp)
+		    || is_on_list (grp->gr_mem, user_name)) {
 			continue;
 		}
 
@@ -1000,9 +1066,11 @@ static void grp_update (void)
 		              user_name, AUDIT_NO_ID,
 		              SHADOW_AUDIT_SUCCESS);
 #endif
-		SYSLOG ((LOG_INFO,
-		         "add '%s' to group '%s'",
-		         user_name, ngrp->gr_name));
+		(void) snprintf (event, sizeof event,
+		                 "add to group '%s'", ngrp->gr_name);
+		SYSLOG_ENTRY ((LOG_INFO, event, user_name,
+		               "add '%s' to group '%s'",
+		               user_name, ngrp->gr_name));
 	}
 
 #ifdef	SHADOWGRP
@@ -1010,11 +1078,15 @@ static void grp_update (void)
 		return;
 
 	/*
-	 * Scan through the entire shadow group file looking for the groups
-	 * that the user is a member of. The administrative list isn't
-	 * modified.
+	 * Look up the shadow groups specified as concurrent groups. The
+	 * administrative list isn't modified.
 	 */
-	for (sgr_rewind (), sgrp = sgr_next (); NULL != sgrp; sgrp = sgr_next ()) {
+	for (i = 0; NULL != user_groups[i]; i++) {
+		sgrp = sgr_locate (user_groups[i]);
+		if (   (NULL == sgrp)
+		    || is_on_list (sgrp->sg_mem, user_name)) {
+			continue;
+		}
 
 		/*
 		 * See if the user specified this group as one of their
@@ -1028,10 +1100,6 @@ static void grp_update (void)
 			continue;
 		}
 
-		if (!is_on_list (user_groups, sgrp->sg_name)) {
-			continue;
-		}
-
 		/*
 		 * Make a copy - sgr_update() will free() everything
 		 * from the old entry, and we need it later.
@@ -1075,9 +1143,11 @@ static void grp_update (void)
 		              user_name, AUDIT_NO_ID,
 		              SHADOW_AUDIT_SUCCESS);
 #endif
-		SYSLOG ((LOG_INFO,
-		         "add '%s' to shadow group '%s'",
-		         user_name, nsgrp->sg_name));
+		(void) snprintf (event, sizeof event,
+		                 "add to shadow group '%s'", nsgrp->sg_name);
+		SYSLOG_ENTRY ((LOG_INFO, event, user_name,
+		               "add '%s' to shadow group '%s'",
+		               user_name, nsgrp->sg_name));
 	}
 #endif				/* SHADOWGRP */
 }
@@ -1093,6 +1163,7 @@ static void process_flags (int argc, char **argv)
 {
 	const struct group *grp;
 	bool anyflag = false;
+	bool otherflag = false;	/* other than -B, -R, or -P */
 	char *cp;
 
 	{
@@ -1102,6 +1173,7 @@ static void process_flags (int argc, char **argv)
 		int c;
 		static struct option long_options[] = {
 			{"base-dir",       required_argument, NULL, 'b'},
+			{"batch",          required_argument, NULL, 'B'},
 			{"comment",        required_argument, NULL, 'c'},
 			{"home-dir",       required_argument, NULL, 'd'},
 			{"defaults",       no_argument,       NULL, 'D'},
@@ -1131,9 +1203,9 @@ static void process_flags (int argc, char **argv)
 		};
 		while ((c = getopt_long (argc, argv,
 #ifdef WITH_SELINUX
-		                         "b:c:d:De:f:g:G:hk:K:lmMNop:rR:P:s:u:UZ:",
+		                         "b:B:c:d:De:f:g:G:hk:K:lmMNop:rR:P:s:u:UZ:",
 #else				/* !WITH_SELINUX */
-		                         "b:c:d:De:f:g:G:hk:K:lmMNop:rR:P:s:u:U",
+		                         "b:B:c:d:De:f:g:G:hk:K:lmMNop:rR:P:s:u:U",
 #endif				/* !WITH_SELINUX */
 		                         long_options, NULL)) != -1) {
 			switch (c) {
@@ -1148,6 +1220,12 @@ static void process_flags (int argc, char **argv)
 				def_home = optarg;
 				bflg = true;
 				break;
+			case 'B':
+				if (batch_entry) {
+					usage (E_USAGE);
+				}
+				batch_file = optarg;
+				break;
 			case 'c':
 				if (!VALID (optarg)) {
 					fprintf (stderr,
@@ -1170,7 +1248,7 @@ static void process_flags (int argc, char **argv)
 				dflg = true;
 				break;
 			case 'D':
-				if (anyflag) {
+				if (anyflag || batch_entry) {
 					usage (E_USAGE);
 				}
 				Dflg = true;
@@ -1260,7 +1338,12 @@ static void process_flags (int argc, char **argv)
 				 * override login.defs defaults (-K name=value)
 				 * example: -K UID_MIN=100 -K UID_MAX=499
 				 * note: -K UID_MIN=10,UID_MAX=499 doesn't work yet
+				 * The settings would leak into the other entries
+				 * of a batch.
 				 */
+				if (batch_entry) {
+					usage (E_USAGE);
+				}
 				cp = strchr (optarg, '=');
 				if (NULL == cp) {
 					fprintf (stderr,
@@ -1303,8 +1386,10 @@ static void process_flags (int argc, char **argv)
 				rflg = true;
 				break;
 			case 'R': /* no-op, handled in process_root_flag () */
-				break;
 			case 'P': /* no-op, handled in process_prefix_flag () */
+				if (batch_entry) {
+					usage (E_USAGE);
+				}
 				break;
 			case 's':
 				if (   ( !VALID (optarg) )
@@ -1356,7 +1441,21 @@ static void process_flags (int argc, char **argv)
 				usage (E_USAGE);
 			}
 			anyflag = true;
+			if (('B' != c) && ('R' != c) && ('P' != c)) {
+				otherflag = true;
+			}
+		}
+	}
+
+	/*
+	 * The options of the users are given by the entries of the batch
+	 * file, see parse_entry().
+	 */
+	if ((NULL != batch_file) && !batch_entry) {
+		if (otherflag || (optind != argc)) {
+			usage (E_USAGE);
 		}
+		return;
 	}
 
 	if (!gflg && !Nflg && !Uflg) {
@@ -1519,13 +1618,27 @@ static void close_files (void)
 #endif
 	}
 #ifdef ENABLE_SUBIDS
-	if (is_sub_uid  && (sub_uid_close () == 0)) {
+	if (is_sub_uid && is_sub_gid) {
+		struct commonio_txn txn;
+
+		/* Commit the subordinate UIDs and GIDs together */
+		commonio_txn_init (&txn);
+		(void) commonio_txn_add (&txn, __sub_uid_get_db ());
+		(void) commonio_txn_add (&txn, __sub_gid_get_db ());
+		if (commonio_txn_commit (&txn) == 0) {
+			fprintf (stderr,
+			         _("%s: failure while writing changes to %s\n"),
+			         Prog, txn.failed->filename);
+			SYSLOG ((LOG_ERR, "failure while writing changes to %s", txn.failed->filename));
+			fail_exit ((txn.failed == __sub_uid_get_db ())
+			           ? E_SUB_UID_UPDATE : E_SUB_GID_UPDATE);
+		}
+	} else if (is_sub_uid  && (sub_uid_close () == 0)) {
 		fprintf (stderr,
 		         _("%s: failure while writing changes to %s\n"), Prog, sub_uid_dbname ());
 		SYSLOG ((LOG_ERR, "failure while writing changes to %s", sub_uid_dbname ()));
 		fail_exit (E_SUB_UID_UPDATE);
-	}
-	if (is_sub_gid  && (sub_gid_close () == 0)) {
+	} else if (is_sub_gid  && (sub_gid_close () == 0)) {
 		fprintf (stderr,
 		         _("%s: failure while writing changes to %s\n"), Prog, sub_gid_dbname ());
 		SYSLOG ((LOG_ERR, "failure while writing changes to %s", sub_gid_dbname ()));
@@ -1625,83 +1738,69 @@ static void close_files (void)
  */
 static void open_files (void)
 {
-	if (pw_lock () == 0) {
-		fprintf (stderr,
-		         _("%s: cannot lock %s; try again later.\n"),
-		         Prog, pw_dbname ());
-		exit (E_PW_UPDATE);
-	}
-	pw_locked = true;
-	if (pw_open (O_CREAT | O_RDWR) == 0) {
-		fprintf (stderr, _("%s: cannot open %s\n"), Prog, pw_dbname ());
-		fail_exit (E_PW_UPDATE);
-	}
+	struct commonio_db *dbs[COMMONIO_TXN_MAX];
+	int codes[COMMONIO_TXN_MAX];
+	size_t count = 0, failed;
+	bool lock_shadow = is_shadow_pwd;
 
-	/* shadow file will be opened by open_shadow(); */
+#ifdef WITH_TCB
+	/* The shadow file of the user is locked by open_shadow() */
+	if (getdef_bool ("USE_TCB")) {
+		lock_shadow = false;
+	}
+#endif				/* WITH_TCB */
 
 	/*
-	 * Lock and open the group file.
+	 * Lock all the files at once, so that useradd does not wait for
+	 * a lock while holding the others.
 	 */
-	if (gr_lock () == 0) {
-		fprintf (stderr,
-		         _("%s: cannot lock %s; try again later.\n"),
-		         Prog, gr_dbname ());
-		fail_exit (E_GRP_UPDATE);
-	}
-	gr_locked = true;
-	if (gr_open (O_CREAT | O_RDWR) == 0) {
-		fprintf (stderr, _("%s: cannot open %s\n"), Prog, gr_dbname ());
-		fail_exit (E_GRP_UPDATE);
-	}
+	dbs[count] = __pw_get_db ();
+	codes[count++] = E_PW_UPDATE;
+	if (lock_shadow) {
+		dbs[count] = __spw_get_db ();
+		codes[count++] = E_PW_UPDATE;
+	}
+	dbs[count] = __gr_get_db ();
+	codes[count++] = E_GRP_UPDATE;
 #ifdef  SHADOWGRP
 	if (is_shadow_grp) {
-		if (sgr_lock () == 0) {
-			fprintf (stderr,
-			         _("%s: cannot lock %s; try again later.\n"),
-			         Prog, sgr_dbname ());
-			fail_exit (E_GRP_UPDATE);
-		}
-		sgr_locked = true;
-		if (sgr_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr,
-			         _("%s: cannot open %s\n"),
-			         Prog, sgr_dbname ());
-			fail_exit (E_GRP_UPDATE);
-		}
+		dbs[count] = __sgr_get_db ();
+		codes[count++] = E_GRP_UPDATE;
 	}
 #endif
 #ifdef ENABLE_SUBIDS
 	if (is_sub_uid) {
-		if (sub_uid_lock () == 0) {
-			fprintf (stderr,
-			         _("%s: cannot lock %s; try again later.\n"),
-			         Prog, sub_uid_dbname ());
-			fail_exit (E_SUB_UID_UPDATE);
-		}
-		sub_uid_locked = true;
-		if (sub_uid_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr,
-			         _("%s: cannot open %s\n"),
-			         Prog, sub_uid_dbname ());
-			fail_exit (E_SUB_UID_UPDATE);
-		}
+		dbs[count] = __sub_uid_get_db ();
+		codes[count++] = E_SUB_UID_UPDATE;
 	}
 	if (is_sub_gid) {
-		if (sub_gid_lock () == 0) {
-			fprintf (stderr,
-			         _("%s: cannot lock %s; try again later.\n"),
-			         Prog, sub_gid_dbname ());
-			fail_exit (E_SUB_GID_UPDATE);
-		}
-		sub_gid_locked = true;
-		if (sub_gid_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr,
-			         _("%s: cannot open %s\n"),
-			         Prog, sub_gid_dbname ());
-			fail_exit (E_SUB_GID_UPDATE);
-		}
+		dbs[count] = __sub_gid_get_db ();
+		codes[count++] = E_SUB_GID_UPDATE;
 	}
 #endif				/* ENABLE_SUBIDS */
+	if (commonio_lock_set (dbs, count, &failed) == 0) {
+		fprintf (stderr,
+		         _("%s: cannot lock %s; try again later.\n"),
+		         Prog, dbs[failed]->filename);
+		exit (codes[failed]);
+	}
+	pw_locked = true;
+	spw_locked = lock_shadow;
+	gr_locked = true;
+#ifdef  SHADOWGRP
+	sgr_locked = is_shadow_grp;
+#endif
+#ifdef ENABLE_SUBIDS
+	sub_uid_locked = is_sub_uid;
+	sub_gid_locked = is_sub_gid;
+#endif				/* ENABLE_SUBIDS */
+
+	/* The databases are read concurrently with OPEN_THREADS */
+	if (commonio_open_set (dbs, count, O_CREAT | O_RDWR, &failed) == 0) {
+		fprintf (stderr, _("%s: cannot open %s\n"),
+		         Prog, dbs[failed]->filename);
+		fail_exit (codes[failed]);
+	}
 }
 
 static void open_shadow (void)
@@ -1709,7 +1808,7 @@ static void open_shadow (void)
 	if (!is_shadow_pwd) {
 		return;
 	}
-	if (spw_lock () == 0) {
+	if (!spw_locked && (spw_lock () == 0)) {
 		fprintf (stderr,
 		         _("%s: cannot lock %s; try again later.\n"),
 		         Prog, spw_dbname ());
@@ -1822,7 +1921,8 @@ static void grp_add (void)
 		fail_exit (E_GRP_UPDATE);
 	}
 #endif				/* SHADOWGRP */
-	SYSLOG ((LOG_INFO, "new group: name=%s, GID=%u", user_name, user_gid));
+	SYSLOG_ENTRY ((LOG_INFO, "new groups", user_name,
+	               "new group: name=%s, GID=%u", user_name, user_gid));
 #ifdef WITH_AUDIT
 	audit_logger (AUDIT_ADD_GROUP, Prog,
 	              "adding group",
@@ -1835,21 +1935,10 @@ static void grp_add (void)
 static void faillog_reset (uid_t uid)
 {
 	struct faillog fl;
-	int fd;
-	off_t offset_uid = (off_t) (sizeof fl) * uid;
-
-	if (access (FAILLOG_FILE, F_OK) != 0) {
-		return;
-	}
 
 	memzero (&fl, sizeof (fl));
 
-	fd = open (FAILLOG_FILE, O_RDWR);
-	if (   (-1 == fd)
-	    || (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-	    || (write (fd, &fl, sizeof (fl)) != (ssize_t) sizeof (fl))
-	    || (fsync (fd) != 0)
-	    || (close (fd) != 0)) {
+	if (log_record_write (&faillog_file, uid, &fl, sizeof (fl)) != 0) {
 		fprintf (stderr,
 		         _("%s: failed to reset the faillog entry of UID %lu: %s\n"),
 		         Prog, (unsigned long) uid, strerror (errno));
@@ -1861,28 +1950,18 @@ static void faillog_reset (uid_t uid)
 static void lastlog_reset (uid_t uid)
 {
 	struct lastlog ll;
-	int fd;
-	off_t offset_uid = (off_t) (sizeof ll) * uid;
 	uid_t max_uid;
 
-	if (access (LASTLOG_FILE, F_OK) != 0) {
-		return;
-	}
-
 	max_uid = (uid_t) getdef_ulong ("LASTLOG_UID_MAX", 0xFFFFFFFFUL);
-	if (uid > max_uid) {
-		/* do not touch lastlog for large uids */
+	if ((uid > max_uid) && !uid_keyed ((unsigned long) uid)) {
+		/* do not touch lastlog for large uids, unless their
+		 * records are stored by key */
 		return;
 	}
 
 	memzero (&ll, sizeof (ll));
 
-	fd = open (LASTLOG_FILE, O_RDWR);
-	if (   (-1 == fd)
-	    || (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-	    || (write (fd, &ll, sizeof (ll)) != (ssize_t) sizeof (ll))
-	    || (fsync (fd) != 0)
-	    || (close (fd) != 0)) {
+	if (log_record_write (&lastlog_file, uid, &ll, sizeof (ll)) != 0) {
 		fprintf (stderr,
 		         _("%s: failed to reset the lastlog entry of UID %lu: %s\n"),
 		         Prog, (unsigned long) uid, strerror (errno));
@@ -1891,50 +1970,54 @@ static void lastlog_reset (uid_t uid)
 	}
 }
 
-static void tallylog_reset (char *user_name)
+/*
+ * close_logs - synchronize the faillog and lastlog entries of the new users
+ */
+static void close_logs (void)
+{
+	if (log_file_close (&faillog_file) != 0) {
+		fprintf (stderr,
+		         _("%s: failure while writing changes to %s\n"),
+		         Prog, FAILLOG_FILE);
+		SYSLOG ((LOG_WARN, "failure while writing changes to %s", FAILLOG_FILE));
+		/* continue */
+	}
+	if (log_file_close (&lastlog_file) != 0) {
+		fprintf (stderr,
+		         _("%s: failure while writing changes to %s\n"),
+		         Prog, LASTLOG_FILE);
+		SYSLOG ((LOG_WARN, "failure while writing changes to %s", LASTLOG_FILE));
+		/* continue */
+	}
+	if (log_file_close (&tallylog_file) != 0) {
+		fprintf (stderr,
+		         _("%s: failure while writing changes to %s\n"),
+		         Prog, TALLYLOG_FILE);
+		SYSLOG ((LOG_WARN, "failure while writing changes to %s", TALLYLOG_FILE));
+		/* continue */
+	}
+}
+
+/*
+ * tallylog_reset - reset the pam_tally2 failure counter of uid
+ *
+ *	The record is cleared like the faillog entry, instead of running
+ *	pam_tally2 --reset for each user. Nothing is done if the tallylog
+ *	does not exist.
+ */
+static void tallylog_reset (uid_t uid)
 {
-	const char pam_tally2[] = "/sbin/pam_tally2";
-	const char *pname;
-	pid_t childpid;
-	int failed;
-	int status;
+	char rec[TALLYLOG_SIZE];
 
-	if (access(pam_tally2, X_OK) == -1)
-		return;
+	memzero (rec, sizeof (rec));
 
-	failed = 0;
-	switch (childpid = fork())
-	{
-	case -1: /* error */
-		failed = 1;
-		break;
-	case 0: /* child */
-		pname = strrchr(pam_tally2, '/');
-		if (pname == NULL)
-			pname = pam_tally2;
-		else
-			pname++;        /* Skip the '/' */
-		execl(pam_tally2, pname, "--user", user_name, "--reset", "--quiet", NULL);
-		/* If we come here, something has gone terribly wrong */
-		perror(pam_tally2);
-		exit(42);       /* don't continue, we now have 2 processes running! */
-		/* NOTREACHED */
-		break;
-	default: /* parent */
-		if (waitpid(childpid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
-			failed = 1;
-		break;
-	}
-
-	if (failed)
-	{
+	if (log_record_write (&tallylog_file, uid, rec, sizeof (rec)) != 0) {
 		fprintf (stderr,
-		         _("%s: failed to reset the tallylog entry of user \"%s\"\n"),
-		         Prog, user_name);
-		SYSLOG ((LOG_WARN, "failed to reset the tallylog entry of user \"%s\"", user_name));
+		         _("%s: failed to reset the tallylog entry of UID %lu: %s\n"),
+		         Prog, (unsigned long) uid, strerror (errno));
+		SYSLOG ((LOG_WARN, "failed to reset the tallylog entry of UID %lu", (unsigned long) uid));
+		/* continue */
 	}
-
-	return;
 }
 
 /*
@@ -1959,10 +2042,10 @@ static void usr_update (void)
 	 * Create a syslog entry. We need to do this now in case anything
 	 * happens so we know what we were trying to accomplish.
 	 */
-	SYSLOG ((LOG_INFO,
-	         "new user: name=%s, UID=%u, GID=%u, home=%s, shell=%s",
-	         user_name, (unsigned int) user_id,
-	         (unsigned int) user_gid, user_home, user_shell));
+	SYSLOG_ENTRY ((LOG_INFO, "new users", user_name,
+	               "new user: name=%s, UID=%u, GID=%u, home=%s, shell=%s",
+	               user_name, (unsigned int) user_id,
+	               (unsigned int) user_gid, user_home, user_shell));
 
 	/*
 	 * Initialize faillog and lastlog entries for this UID in case
@@ -1974,6 +2057,7 @@ static void usr_update (void)
 	if ((!lflg) && (prefix_getpwuid (user_id) == NULL)) {
 		faillog_reset (user_id);
 		lastlog_reset (user_id);
+		tallylog_reset (user_id);
 	}
 
 	/*
@@ -2002,14 +2086,14 @@ static void usr_update (void)
 		fail_exit (E_PW_UPDATE);
 	}
 #ifdef ENABLE_SUBIDS
-	if (is_sub_uid &&
+	if (add_sub_uids &&
 	    (sub_uid_add(user_name, sub_uid_start, sub_uid_count) == 0)) {
 		fprintf (stderr,
 		         _("%s: failed to prepare the new %s entry\n"),
 		         Prog, sub_uid_dbname ());
 		fail_exit (E_SUB_UID_UPDATE);
 	}
-	if (is_sub_gid &&
+	if (add_sub_gids &&
 	    (sub_gid_add(user_name, sub_gid_start, sub_gid_count) == 0)) {
 		fprintf (stderr,
 		         _("%s: failed to prepare the new %s entry\n"),
@@ -2121,6 +2205,44 @@ static void create_home (void)
 	}
 }
 
+/*
+ * clone_home - create the user's home directory as a clone of the snapshot
+ *              of the skeleton directory (see HOME_SKEL_SNAPSHOT)
+ *
+ *	It returns false if the home directory must be created and filled
+ *	from the skeleton directory instead.
+ */
+static bool clone_home (void)
+{
+	int ret;
+
+	/* The snapshot is a snapshot of the default skeleton */
+	if (kflg || (access (prefix_user_home, F_OK) == 0)) {
+		return false;
+	}
+
+	ret = home_clone (prefix_user_home, user_id, user_gid,
+	                  0777 & ~getdef_num ("UMASK", GETDEF_DEFAULT_UMASK));
+	if (ret > 0) {
+		return false;
+	}
+	if (ret < 0) {
+		fprintf (stderr,
+		         _("%s: warning: cannot clone the skeleton directory in %s: %s\n"),
+		         Prog, user_home, strerror (errno));
+		return false;
+	}
+
+	home_added = true;
+#ifdef WITH_AUDIT
+	audit_logger (AUDIT_ADD_USER, Prog,
+	              "adding home directory",
+	              user_name, (unsigned int) user_id,
+	              SHADOW_AUDIT_SUCCESS);
+#endif
+	return true;
+}
+
 /*
  * create_mail - create the user's mail spool
  *
@@ -2175,119 +2297,17 @@ static void create_mail (void)
 }
 
 /*
- * main - useradd command
+ * check_new_user - check that the user does not exist yet
+ *
+ *	With -U, the group of the user must not exist either.
+ *	Once the files are locked, the users added by the previous entries
+ *	of a batch are also checked.
  */
-int main (int argc, char **argv)
+static void check_new_user (void)
 {
-#ifdef ACCT_TOOLS_SETUID
-#ifdef USE_PAM
-	pam_handle_t *pamh = NULL;
-	int retval;
-#endif				/* USE_PAM */
-#endif				/* ACCT_TOOLS_SETUID */
-
-#ifdef ENABLE_SUBIDS
-	uid_t uid_min;
-	uid_t uid_max;
-#endif
-
-	/*
-	 * Get my name so that I can use it to report errors.
-	 */
-	Prog = Basename (argv[0]);
-
-	(void) setlocale (LC_ALL, "");
-	(void) bindtextdomain (PACKAGE, LOCALEDIR);
-	(void) textdomain (PACKAGE);
-
-	process_root_flag ("-R", argc, argv);
-
-	prefix = process_prefix_flag("-P", argc, argv);
-
-	OPENLOG ("useradd");
-#ifdef WITH_AUDIT
-	audit_help_open ();
-#endif
-
-	sys_ngroups = sysconf (_SC_NGROUPS_MAX);
-	user_groups = (char **) xmalloc ((1 + sys_ngroups) * sizeof (char *));
-	/*
-	 * Initialize the list to be empty
-	 */
-	user_groups[0] = (char *) 0;
-
-
-	is_shadow_pwd = spw_file_present ();
-#ifdef SHADOWGRP
-	is_shadow_grp = sgr_file_present ();
-#endif
-
-	get_defaults ();
-
-	process_flags (argc, argv);
-
-#ifdef ENABLE_SUBIDS
-	uid_min = (uid_t) getdef_ulong ("UID_MIN", 1000UL);
-	uid_max = (uid_t) getdef_ulong ("UID_MAX", 60000UL);
-	is_sub_uid = sub_uid_file_present () && !rflg &&
-	    (!user_id || (user_id <= uid_max && user_id >= uid_min));
-	is_sub_gid = sub_gid_file_present () && !rflg &&
-	    (!user_id || (user_id <= uid_max && user_id >= uid_min));
-#endif				/* ENABLE_SUBIDS */
-
-#ifdef ACCT_TOOLS_SETUID
-#ifdef USE_PAM
-	{
-		struct passwd *pampw;
-		pampw = getpwuid (getuid ()); /* local, no need for xgetpwuid */
-		if (pampw == NULL) {
-			fprintf (stderr,
-			         _("%s: Cannot determine your user name.\n"),
-			         Prog);
-			fail_exit (1);
-		}
-
-		retval = pam_start ("useradd", pampw->pw_name, &conv, &pamh);
-	}
-
-	if (PAM_SUCCESS == retval) {
-		retval = pam_authenticate (pamh, 0);
-	}
-
-	if (PAM_SUCCESS == retval) {
-		retval = pam_acct_mgmt (pamh, 0);
-	}
-
-	if (PAM_SUCCESS != retval) {
-		fprintf (stderr, _("%s: PAM: %s\n"),
-		         Prog, pam_strerror (pamh, retval));
-		SYSLOG((LOG_ERR, "%s", pam_strerror (pamh, retval)));
-		if (NULL != pamh) {
-			(void) pam_end (pamh, retval);
-		}
-		fail_exit (1);
-	}
-	(void) pam_end (pamh, retval);
-#endif				/* USE_PAM */
-#endif				/* ACCT_TOOLS_SETUID */
-
-	/*
-	 * See if we are messing with the defaults file, or creating
-	 * a new user.
-	 */
-	if (Dflg) {
-		if (gflg || bflg || fflg || eflg || sflg) {
-			exit ((set_defaults () != 0) ? 1 : 0);
-		}
-
-		show_defaults ();
-		exit (E_SUCCESS);
-	}
-
-	/*
-	 * Start with a quick check to see if the user exists.
-	 */
-	if (prefix_getpwnam (user_name) != NULL) { /* local, no need for xgetpwnam */
+	/* local, no need for xgetpwnam */
+	if (   (prefix_getpwnam (user_name) != NULL)
+	    || (pw_locked && (pw_locate (user_name) != NULL))) {
 		fprintf (stderr, _("%s: user '%s' already exists\n"), Prog, user_name);
 #ifdef WITH_AUDIT
 		audit_logger (AUDIT_ADD_USER, Prog,
@@ -2306,7 +2326,8 @@ int main (int argc, char **argv)
 	 */
 	if (Uflg) {
 		/* local, no need for xgetgrnam */
-		if (prefix_getgrnam (user_name) != NULL) {
+		if (   (prefix_getgrnam (user_name) != NULL)
+		    || (gr_locked && (gr_locate (user_name) != NULL))) {
 			fprintf (stderr,
 			         _("%s: group %s exists - if you want to add this user to that group, use -g.\n"),
 			         Prog, user_name);
@@ -2319,29 +2340,60 @@ int main (int argc, char **argv)
 			fail_exit (E_NAME_IN_USE);
 		}
 	}
+}
 
-	/*
-	 * Do the hard stuff:
-	 * - open the files,
-	 * - create the user entries,
-	 * - create the home directory,
-	 * - create user mail spool,
-	 * - flush nscd caches for passwd and group services,
-	 * - then close and update the files.
-	 */
-	open_files ();
+#ifdef ENABLE_SUBIDS
+/*
+ * check_sub_ids - check if subordinate IDs must be allocated for the user
+ */
+static void check_sub_ids (void)
+{
+	uid_t uid_min = (uid_t) getdef_ulong ("UID_MIN", 1000UL);
+	uid_t uid_max = (uid_t) getdef_ulong ("UID_MAX", 60000UL);
 
-	if (!oflg) {
-		/* first, seek for a valid uid to use for this user.
-		 * We do this because later we can use the uid we found as
-		 * gid too ... --gafton */
-		if (!uflg) {
-			if (find_new_uid (rflg, &user_id, NULL) < 0) {
+	add_sub_uids = sub_uid_file_present () && !rflg &&
+	    (!user_id || (user_id <= uid_max && user_id >= uid_min));
+	add_sub_gids = sub_gid_file_present () && !rflg &&
+	    (!user_id || (user_id <= uid_max && user_id >= uid_min));
+}
+#endif				/* ENABLE_SUBIDS */
+
+/*
+ * add_user - create the entries and the home directory of the user
+ *
+ *	The files must be opened with open_files() before.
+ */
+static void add_user (void)
+{
+	bool gid_found = false;
+
+	if (!oflg) {
+		/* first, seek for a valid uid to use for this user.
+		 * We do this because later we can use the uid we found as
+		 * gid too ... --gafton */
+		if (!uflg) {
+			int ret = 0;
+
+			/* The same ID for the user and its group, if possible */
+			if (Uflg) {
+				gid_found = (reserve_ids (&uid_pool[rflg],
+				                          &gid_pool[rflg], rflg,
+				                          &user_id, &user_gid) == 0);
+			}
+			/* The pools of a batch continue after the previous users */
+			if (!gid_found) {
+				ret = (NULL != batch_file)
+				    ? reserve_uids (&uid_pool[rflg], rflg, 1, &user_id, NULL)
+				    : find_new_uid (rflg, &user_id, NULL);
+			}
+
+			if (ret < 0) {
 				fprintf (stderr, _("%s: can't create user\n"), Prog);
 				fail_exit (E_UID_IN_USE);
 			}
 		} else {
-			if (prefix_getpwuid (user_id) != NULL) {
+			if (   (prefix_getpwuid (user_id) != NULL)
+			    || (pw_locate_uid (user_id) != NULL)) {
 				fprintf (stderr,
 				         _("%s: UID %lu is not unique\n"),
 				         Prog, (unsigned long) user_id);
@@ -2366,12 +2418,22 @@ int main (int argc, char **argv)
 		}
 	}
 #endif
-	open_shadow ();
+	if (!spw_locked) {
+		open_shadow ();
+	}
 
 	/* do we have to add a group for that user? This is why we need to
 	 * open the group files in the open_files() function  --gafton */
 	if (Uflg) {
-		if (find_new_gid (rflg, &user_gid, &user_id) < 0) {
+		int ret = 0;
+
+		if (!gid_found) {
+			ret = (NULL != batch_file)
+			    ? reserve_gids (&gid_pool[rflg], rflg, 1, &user_gid, &user_id)
+			    : find_new_gid (rflg, &user_gid, &user_id);
+		}
+
+		if (ret < 0) {
 			fprintf (stderr,
 			         _("%s: can't create group\n"),
 			         Prog);
@@ -2381,7 +2443,22 @@ int main (int argc, char **argv)
 	}
 
 #ifdef ENABLE_SUBIDS
-	if (is_sub_uid) {
+	/*
+	 * Try to give the user the same subordinate UIDs and GIDs, before
+	 * selecting them separately.
+	 */
+	if (add_sub_uids && add_sub_gids) {
+		unsigned long start;
+
+		if (reserve_sub_ids (1, &start, &sub_uid_count) == 0) {
+			sub_uid_start = (uid_t) start;
+			sub_gid_start = (gid_t) start;
+			sub_gid_count = sub_uid_count;
+		} else {
+			sub_uid_count = 0;
+		}
+	}
+	if (add_sub_uids && (0 == sub_uid_count)) {
 		if (find_new_sub_uids(user_name, &sub_uid_start, &sub_uid_count) < 0) {
 			fprintf (stderr,
 			         _("%s: can't create subordinate user IDs\n"),
@@ -2389,7 +2466,7 @@ int main (int argc, char **argv)
 			fail_exit(E_SUB_UID_UPDATE);
 		}
 	}
-	if (is_sub_gid) {
+	if (add_sub_gids && (0 == sub_gid_count)) {
 		if (find_new_sub_gids(user_name, &sub_gid_start, &sub_gid_count) < 0) {
 			fprintf (stderr,
 			         _("%s: can't create subordinate group IDs\n"),
@@ -2401,11 +2478,11 @@ int main (int argc, char **argv)
 
 	usr_update ();
 
-	if (mflg) {
+	if (mflg && !clone_home ()) {
 		create_home ();
 		if (home_added) {
-			copy_tree (def_template, prefix_user_home, false, false,
-			           (uid_t)-1, user_id, (gid_t)-1, user_gid);
+			copy_tree_cached (def_template, prefix_user_home, false,
+			                  (uid_t)-1, user_id, (gid_t)-1, user_gid);
 		} else {
 			fprintf (stderr,
 			         _("%s: warning: the home directory already exists.\n"
@@ -2419,17 +2496,497 @@ int main (int argc, char **argv)
 	if (!rflg) {
 		create_mail ();
 	}
+}
+
+/*
+ * split_args - split an entry of the batch file in arguments
+ *
+ *	The arguments are separated by blanks. Double quotes can be used
+ *	for the arguments with blanks, like comments. The line is modified.
+ *	argv[0] is set to Prog for getopt_long().
+ *
+ *	It returns the number of arguments, or -1 if a quote is not closed.
+ */
+static int split_args (char *line, char ***argvp)
+{
+	/* At most one argument every two characters */
+	char **argv = (char **) xmalloc ((strlen (line) / 2 + 3) * sizeof (char *));
+	char *src = line;
+	char *dst;
+	int argc = 0;
+
+	argv[argc++] = (char *) Prog;
+	for (;;) {
+		while ((' ' == *src) || ('\t' == *src)) {
+			src++;
+		}
+		if ('\0' == *src) {
+			break;
+		}
+
+		/* The argument is unquoted in place */
+		dst = src;
+		argv[argc++] = dst;
+		while (('\0' != *src) && (' ' != *src) && ('\t' != *src)) {
+			if ('"' != *src) {
+				*dst++ = *src++;
+				continue;
+			}
+			for (src++; '"' != *src; src++) {
+				if ('\0' == *src) {
+					free (argv);
+					return -1;
+				}
+				*dst++ = *src;
+			}
+			src++;
+		}
+		if ('\0' != *src) {
+			src++;
+		}
+		*dst = '\0';
+	}
+	argv[argc] = NULL;
+
+	*argvp = argv;
+	return argc;
+}
+
+/*
+ * read_batch - read the lines of the batch file
+ *
+ *	The lines are returned with their newline removed, and *nlines is
+ *	set to their number.
+ */
+static char **read_batch (size_t *nlines)
+{
+	char buf[BUFSIZ];
+	char **lines = NULL;
+	size_t size = 0;
+	FILE *fp;
+	char *cp;
+
+	if (strcmp (batch_file, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen (batch_file, "r");
+		if (NULL == fp) {
+			fprintf (stderr,
+			         _("%s: cannot open %s: %s\n"),
+			         Prog, batch_file, strerror (errno));
+			exit (E_BAD_ARG);
+		}
+	}
+
+	*nlines = 0;
+	while (fgets (buf, (int) sizeof buf, fp) == buf) {
+		cp = strrchr (buf, '\n');
+		if (NULL != cp) {
+			*cp = '\0';
+		} else if (feof (fp) == 0) {
+			fprintf (stderr,
+			         _("%s: line %d: line too long\n"),
+			         Prog, (int) *nlines + 1);
+			exit (E_BAD_ARG);
+		}
+		if (*nlines == size) {
+			char **l;
+
+			size = (0 == size) ? 64 : size * 2;
+			l = realloc (lines, size * sizeof (*l));
+			if (NULL == l) {
+				fprintf (stderr,
+				         _("%s: failed to allocate memory: %s\n"),
+				         Prog, strerror (errno));
+				exit (E_PW_UPDATE);
+			}
+			lines = l;
+		}
+		lines[*nlines] = xstrdup (buf);
+		(*nlines)++;
+	}
+	if (ferror (fp) != 0) {
+		fprintf (stderr,
+		         _("%s: cannot read %s: %s\n"),
+		         Prog, batch_file, strerror (errno));
+		exit (E_BAD_ARG);
+	}
+	if (stdin != fp) {
+		(void) fclose (fp);
+	}
+
+	return lines;
+}
+
+/*
+ * reset_user - forget the options of the previous entry of the batch
+ */
+static void reset_user (const struct user_defaults *defs)
+{
+	size_t i;
+
+	def_group = defs->group;
+	def_gname = defs->gname;
+	def_home = defs->home;
+	def_shell = defs->shell;
+	def_template = defs->template;
+	def_create_mail_spool = defs->create_mail_spool;
+	def_inactive = defs->inactive;
+	def_expire = defs->expire;
+
+	bflg = false;
+	cflg = false;
+	dflg = false;
+	Dflg = false;
+	eflg = false;
+	fflg = false;
+	gflg = false;
+	Gflg = false;
+	kflg = false;
+	lflg = false;
+	mflg = false;
+	Mflg = false;
+	Nflg = false;
+	oflg = false;
+	rflg = false;
+	sflg = false;
+	uflg = false;
+	Uflg = false;
+
+	user_name = "";
+	user_pass = "!";
+	user_id = 0;
+	user_gid = 0;
+	user_comment = "";
+	user_home = "";
+	user_shell = "";
+	create_mail_spool = "";
+	prefix_user_home = NULL;
+#ifdef WITH_SELINUX
+	user_selinux = "";
+#endif				/* WITH_SELINUX */
+	user_expire = -1;
+	for (i = 0; NULL != user_groups[i]; i++) {
+		free (user_groups[i]);
+	}
+	user_groups[0] = NULL;
+	do_grp_update = false;
+	home_added = false;
+}
+
+/*
+ * parse_entry - set the options of the user from an entry of the batch
+ *
+ *	Empty lines and lines starting with '#' are ignored, and false is
+ *	returned. It will not return if the entry is invalid.
+ */
+static bool parse_entry (const char *line, int lineno,
+                         const struct user_defaults *defs)
+{
+	char **argv;
+	int argc;
+
+	line += strspn (line, " \t");
+	if (('\0' == *line) || ('#' == *line)) {
+		return false;
+	}
+
+	/* The names and values stay referenced, the copy is not freed */
+	argc = split_args (xstrdup (line), &argv);
+	if (argc < 0) {
+		fprintf (stderr,
+		         _("%s: line %d: missing closing quote\n"),
+		         Prog, lineno);
+		exit (E_BAD_ARG);
+	}
+
+	reset_user (defs);
+	batch_entry = true;
+	optind = 0;	/* restart the parsing of getopt_long() */
+	process_flags (argc, argv);
+	batch_entry = false;
+
+#ifdef ENABLE_SUBIDS
+	check_sub_ids ();
+#endif				/* ENABLE_SUBIDS */
+	return true;
+}
+
+#ifdef WITH_SELINUX
+/*
+ * set_seusers - add the SELinux user mappings of the batch
+ *
+ *	The mappings are added in a single transaction.
+ */
+static int set_seusers (const struct batch_user *users, size_t nusers)
+{
+	bool begun = false;
+	size_t i;
+
+	for (i = 0; i < nusers; i++) {
+		if ('\0' == users[i].selinux[0]) {
+			continue;
+		}
+		if (!begun) {
+			if (seuser_batch_begin () != 0) {
+				return E_SE_UPDATE;
+			}
+			begun = true;
+		}
+		if (set_seuser (users[i].name, users[i].selinux) != 0) {
+			fprintf (stderr,
+			         _("%s: warning: the user name %s to %s SELinux user mapping failed.\n"),
+			         Prog, users[i].name, users[i].selinux);
+#ifdef WITH_AUDIT
+			audit_logger (AUDIT_ADD_USER, Prog,
+			              "adding SELinux user mapping",
+			              users[i].name, (unsigned int) users[i].uid, 0);
+#endif				/* WITH_AUDIT */
+			seuser_batch_abort ();
+			return E_SE_UPDATE;
+		}
+	}
+	if (begun && (seuser_batch_commit () != 0)) {
+		return E_SE_UPDATE;
+	}
+	return E_SUCCESS;
+}
+#endif				/* WITH_SELINUX */
+
+/*
+ * add_batch - add the users of the batch file
+ *
+ *	All the entries are checked before the files are locked. The
+ *	files are then locked, and written once, with all the users.
+ *	Each user is otherwise added like by a separate useradd.
+ */
+static int add_batch (void)
+{
+	struct user_defaults defs;
+	struct batch_user *users;
+	size_t nusers = 0;
+	bool grp_changed = false;
+	char **lines;
+	size_t nlines;
+	size_t i;
+	int status = E_SUCCESS;
+
+#ifdef WITH_TCB
+	/* Each user has its own shadow file */
+	if (getdef_bool ("USE_TCB")) {
+		fprintf (stderr,
+		         _("%s: -B cannot be used with USE_TCB\n"),
+		         Prog);
+		exit (E_USAGE);
+	}
+#endif				/* WITH_TCB */
+
+	defs.group = def_group;
+	defs.gname = def_gname;
+	defs.home = def_home;
+	defs.shell = def_shell;
+	defs.template = def_template;
+	defs.create_mail_spool = def_create_mail_spool;
+	defs.inactive = def_inactive;
+	defs.expire = def_expire;
+
+	lines = read_batch (&nlines);
+
+	/*
+	 * Check all the entries first, so that nothing is changed if one
+	 * of them is invalid.
+	 */
+	for (i = 0; i < nlines; i++) {
+		if (!parse_entry (lines[i], (int) i + 1, &defs)) {
+			continue;
+		}
+		check_new_user ();
+#ifdef ENABLE_SUBIDS
+		is_sub_uid = is_sub_uid || add_sub_uids;
+		is_sub_gid = is_sub_gid || add_sub_gids;
+#endif				/* ENABLE_SUBIDS */
+	}
+
+	open_files ();
+#ifdef WITH_AUDIT
+	/* The records of the changes are sent once they are written */
+	audit_logger_begin ();
+#endif				/* WITH_AUDIT */
+
+	users = (struct batch_user *) xmalloc ((nlines + 1) * sizeof (*users));
+	for (i = 0; i < nlines; i++) {
+		if (!parse_entry (lines[i], (int) i + 1, &defs)) {
+			continue;
+		}
+		check_new_user ();
+		add_user ();
+		grp_changed = grp_changed || do_grp_update;
+
+		users[nusers].name = xstrdup (user_name);
+		users[nusers].uid = user_id;
+#ifdef WITH_SELINUX
+		users[nusers].selinux = user_selinux;
+#endif				/* WITH_SELINUX */
+		nusers++;
+	}
+	do_grp_update = grp_changed;
+	/* The last home directory is not removed if the files fail */
+	home_added = false;
 
 	close_files ();
+#ifdef WITH_AUDIT
+	audit_logger_commit ();
+#endif				/* WITH_AUDIT */
+	close_logs ();
+	id_pool_free (&uid_pool[0]);
+	id_pool_free (&uid_pool[1]);
+	id_pool_free (&gid_pool[0]);
+	id_pool_free (&gid_pool[1]);
+
+#ifdef WITH_SELINUX
+	status = set_seusers (users, nusers);
+#endif				/* WITH_SELINUX */
+
+	cache_flush_defer (CACHE_DB_PASSWD | CACHE_DB_GROUP);
+
+	return status;
+}
+
+/*
+ * main - useradd command
+ */
+int main (int argc, char **argv)
+{
+#ifdef ACCT_TOOLS_SETUID
+#ifdef USE_PAM
+	pam_handle_t *pamh = NULL;
+	int retval;
+#endif				/* USE_PAM */
+#endif				/* ACCT_TOOLS_SETUID */
 
 	/*
-	 * tallylog_reset needs to be able to lookup
-	 * a valid existing user name,
-	 * so we cannot call it before close_files()
+	 * Get my name so that I can use it to report errors.
+	 */
+	Prog = Basename (argv[0]);
+
+	(void) setlocale (LC_ALL, "");
+	(void) bindtextdomain (PACKAGE, LOCALEDIR);
+	(void) textdomain (PACKAGE);
+
+	process_root_flag ("-R", false, argc, argv);
+
+	prefix = process_prefix_flag("-P", argc, argv);
+
+	OPENLOG ("useradd");
+#ifdef WITH_AUDIT
+	audit_help_open ();
+#endif
+
+	sys_ngroups = sysconf (_SC_NGROUPS_MAX);
+	user_groups = (char **) xmalloc ((1 + sys_ngroups) * sizeof (char *));
+	/*
+	 * Initialize the list to be empty
 	 */
-	if (!lflg && getpwuid (user_id) != NULL) {
-		tallylog_reset (user_name);
+	user_groups[0] = (char *) 0;
+
+
+	is_shadow_pwd = spw_file_present ();
+#ifdef SHADOWGRP
+	is_shadow_grp = sgr_file_present ();
+#endif
+
+	get_defaults ();
+
+	process_flags (argc, argv);
+
+#ifdef ENABLE_SUBIDS
+	if (NULL == batch_file) {
+		check_sub_ids ();
+		is_sub_uid = add_sub_uids;
+		is_sub_gid = add_sub_gids;
 	}
+#endif				/* ENABLE_SUBIDS */
+
+#ifdef ACCT_TOOLS_SETUID
+#ifdef USE_PAM
+	{
+		struct passwd *pampw;
+		pampw = getpwuid (getuid ()); /* local, no need for xgetpwuid */
+		if (pampw == NULL) {
+			fprintf (stderr,
+			         _("%s: Cannot determine your user name.\n"),
+			         Prog);
+			fail_exit (1);
+		}
+
+		retval = pam_start ("useradd", pampw->pw_name, &conv, &pamh);
+	}
+
+	if (PAM_SUCCESS == retval) {
+		retval = pam_authenticate (pamh, 0);
+	}
+
+	if (PAM_SUCCESS == retval) {
+		retval = pam_acct_mgmt (pamh, 0);
+	}
+
+	if (PAM_SUCCESS != retval) {
+		fprintf (stderr, _("%s: PAM: %s\n"),
+		         Prog, pam_strerror (pamh, retval));
+		SYSLOG((LOG_ERR, "%s", pam_strerror (pamh, retval)));
+		if (NULL != pamh) {
+			(void) pam_end (pamh, retval);
+		}
+		fail_exit (1);
+	}
+	(void) pam_end (pamh, retval);
+#endif				/* USE_PAM */
+#endif				/* ACCT_TOOLS_SETUID */
+
+	/*
+	 * See if we are messing with the defaults file, or creating
+	 * a new user.
+	 */
+	if (Dflg) {
+		if (gflg || bflg || fflg || eflg || sflg) {
+			exit ((set_defaults () != 0) ? 1 : 0);
+		}
+
+		show_defaults ();
+		exit (E_SUCCESS);
+	}
+
+	if (NULL != batch_file) {
+		return add_batch ();
+	}
+
+	/*
+	 * Start with a quick check to see if the user exists.
+	 */
+	check_new_user ();
+
+	/*
+	 * Do the hard stuff:
+	 * - open the files,
+	 * - create the user entries,
+	 * - create the home directory,
+	 * - create user mail spool,
+	 * - flush nscd caches for passwd and group services,
+	 * - then close and update the files.
+	 */
+	open_files ();
+#ifdef WITH_AUDIT
+	/* The records of the changes are sent once they are written */
+	audit_logger_begin ();
+#endif				/* WITH_AUDIT */
+
+	add_user ();
+
+	close_files ();
+#ifdef WITH_AUDIT
+	audit_logger_commit ();
+#endif				/* WITH_AUDIT */
+	close_logs ();
 
 #ifdef WITH_SELINUX
 	if (Zflg) {
@@ -2447,9 +3004,7 @@ int main (int argc, char **argv)
 	}
 #endif				/* WITH_SELINUX */
 
-	nscd_flush_cache ("passwd");
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
+	cache_flush_defer (CACHE_DB_PASSWD | CACHE_DB_GROUP);
 
 	return E_SUCCESS;
 }
@@ -52,8 +52,8 @@
 #include "defines.h"
 #include "getdef.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
+#include "commonio.h"
 #include "prototypes.h"
 #include "pwauth.h"
 #include "pwio.h"
@@ -118,6 +118,21 @@ static bool sub_gid_locked = false;
 
 static const char* prefix = "";
 
+/*
+ * Sorted primary GIDs of the users which are not deleted, when several
+ * users are deleted
+ */
+static /*@null@*/gid_t *primary_gids = NULL;
+static size_t nprimary_gids = 0;
+
+/* A user deleted with other users */
+struct deleted_user {
+	const char *name;
+	uid_t uid;
+	gid_t gid;
+	char *home;		/* with the prefix */
+};
+
 /* local function prototypes */
 static void usage (int status);
 static void update_groups (void);
@@ -126,7 +141,7 @@ static void close_files (void);
 static void fail_exit (int);
 static void open_files (void);
 static void update_user (void);
-static void user_cancel (const char *);
+static void user_cancel (const char *const *users, size_t count);
 
 #ifdef EXTRA_CHECK_HOME_DIR
 static bool path_prefix (const char *, const char *);
@@ -136,6 +151,11 @@ static int remove_mailbox (void);
 #ifdef WITH_TCB
 static int remove_tcbdir (const char *user_name, uid_t user_id);
 #endif				/* WITH_TCB */
+static int remove_homes (const char *const *homes, size_t count);
+static int gid_cmp (const void *p1, const void *p2);
+static void scrub_groups (const struct name_set *names);
+static void get_primary_gids (const struct name_set *names);
+static int del_users (char *const *names, size_t count);
 
 /*
  * usage - display usage message and exit
@@ -144,7 +164,7 @@ static void usage (int status)
 {
 	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
 	(void) fprintf (usageout,
-	                _("Usage: %s [options] LOGIN\n"
+	                _("Usage: %s [options] LOGIN...\n"
 	                  "\n"
 	                  "Options:\n"),
 	                Prog);
@@ -176,17 +196,27 @@ static void update_groups (void)
 {
 	const struct group *grp;
 	struct group *ngrp;
+	const struct group **groups;
+	size_t count, i;
+	char event[128];
 
 #ifdef	SHADOWGRP
 	const struct sgrp *sgrp;
 	struct sgrp *nsgrp;
+	const struct sgrp **sgroups;
 #endif				/* SHADOWGRP */
 
 	/*
-	 * Scan through the entire group file looking for the groups that
-	 * the user is a member of.
+	 * Look up the groups that the user is a member of.
 	 */
-	for (gr_rewind (), grp = gr_next (); NULL != grp; grp = gr_next ()) {
+	if (gr_locate_member (user_name, &groups, &count) == 0) {
+		fprintf (stderr,
+		         _("%s: Out of memory. Cannot update %s.\n"),
+		         Prog, gr_dbname ());
+		exit (13);	/* XXX */
+	}
+	for (i = 0; i < count; i++) {
+		grp = groups[i];
 
 		/*
 		 * See if the user specified this group as one of their
@@ -224,9 +254,13 @@ static void update_groups (void)
 		              user_name, (unsigned int) user_id,
 		              SHADOW_AUDIT_SUCCESS);
 #endif				/* WITH_AUDIT */
-		SYSLOG ((LOG_INFO, "delete '%s' from group '%s'\n",
-			 user_name, ngrp->gr_name));
+		(void) snprintf (event, sizeof event,
+		                 "delete '%s' from groups", user_name);
+		SYSLOG_ENTRY ((LOG_INFO, event, ngrp->gr_name,
+		               "delete '%s' from group '%s'\n",
+		               user_name, ngrp->gr_name));
 	}
+	free (groups);
 
 	if (getdef_bool ("USERGROUPS_ENAB")) {
 		remove_usergroup ();
@@ -238,15 +272,20 @@ static void update_groups (void)
 	}
 
 	/*
-	 * Scan through the entire shadow group file looking for the groups
-	 * that the user is a member of. Both the administrative list and
-	 * the ordinary membership list is checked.
+	 * Look up the shadow groups that the user is a member of. Both the
+	 * administrative list and the ordinary membership list are checked.
 	 */
-	for (sgr_rewind (), sgrp = sgr_next ();
-	     NULL != sgrp;
-	     sgrp = sgr_next ()) {
+	if (sgr_locate_member (user_name, &sgroups, &count) == 0) {
+		fprintf (stderr,
+		         _("%s: Out of memory. Cannot update %s.\n"),
+		         Prog, sgr_dbname ());
+		exit (13);	/* XXX */
+	}
+	for (i = 0; i < count; i++) {
 		bool was_member, was_admin;
 
+		sgrp = sgroups[i];
+
 		/*
 		 * See if the user specified this group as one of their
 		 * concurrent groups.
@@ -286,9 +325,13 @@ static void update_groups (void)
 		              user_name, (unsigned int) user_id,
 		              SHADOW_AUDIT_SUCCESS);
 #endif				/* WITH_AUDIT */
-		SYSLOG ((LOG_INFO, "delete '%s' from shadow group '%s'\n",
-		         user_name, nsgrp->sg_name));
+		(void) snprintf (event, sizeof event,
+		                 "delete '%s' from shadow groups", user_name);
+		SYSLOG_ENTRY ((LOG_INFO, event, nsgrp->sg_name,
+		               "delete '%s' from shadow group '%s'\n",
+		               user_name, nsgrp->sg_name));
 	}
+	free (sgroups);
 #endif				/* SHADOWGRP */
 }
 
@@ -305,6 +348,7 @@ static void remove_usergroup (void)
 {
 	const struct group *grp;
 	const struct passwd *pwd = NULL;
+	bool used = false;
 
 	grp = gr_locate (user_name);
 	if (NULL == grp) {
@@ -327,7 +371,11 @@ static void remove_usergroup (void)
 		return;
 	}
 
-	if (!fflg) {
+	if (!fflg && (NULL != primary_gids)) {
+		/* The remaining users were scanned by get_primary_gids() */
+		used = (bsearch (&grp->gr_gid, primary_gids, nprimary_gids,
+		                 sizeof (gid_t), gid_cmp) != NULL);
+	} else if (!fflg) {
 		/*
 		 * Scan the passwd file to check if this group is still
 		 * used as a primary group.
@@ -338,16 +386,19 @@ static void remove_usergroup (void)
 				continue;
 			}
 			if (pwd->pw_gid == grp->gr_gid) {
-				fprintf (stderr,
-				         _("%s: group %s is the primary group of another user and is not removed.\n"),
-				         Prog, grp->gr_name);
+				used = true;
 				break;
 			}
 		}
 		prefix_endpwent ();
 	}
+	if (used) {
+		fprintf (stderr,
+		         _("%s: group %s is the primary group of another user and is not removed.\n"),
+		         Prog, grp->gr_name);
+	}
 
-	if (NULL == pwd) {
+	if (!used) {
 		/*
 		 * We can remove this group, it is not the primary
 		 * group of any remaining user.
@@ -365,9 +416,9 @@ static void remove_usergroup (void)
 		              user_name, AUDIT_NO_ID,
 		              SHADOW_AUDIT_SUCCESS);
 #endif				/* WITH_AUDIT */
-		SYSLOG ((LOG_INFO,
-		         "removed group '%s' owned by '%s'\n",
-		         user_name, user_name));
+		SYSLOG_ENTRY ((LOG_INFO, "removed user groups", user_name,
+		               "removed group '%s' owned by '%s'\n",
+		               user_name, user_name));
 
 #ifdef	SHADOWGRP
 		if (sgr_locate (user_name) != NULL) {
@@ -383,9 +434,10 @@ static void remove_usergroup (void)
 			              user_name, AUDIT_NO_ID,
 			              SHADOW_AUDIT_SUCCESS);
 #endif				/* WITH_AUDIT */
-			SYSLOG ((LOG_INFO,
-			         "removed shadow group '%s' owned by '%s'\n",
-			         user_name, user_name));
+			SYSLOG_ENTRY ((LOG_INFO, "removed shadow user groups",
+			               user_name,
+			               "removed shadow group '%s' owned by '%s'\n",
+			               user_name, user_name));
 
 		}
 #endif				/* SHADOWGRP */
@@ -558,6 +610,18 @@ static void fail_exit (int code)
 
 static void open_files (void)
 {
+	struct commonio_db *dbs[COMMONIO_TXN_MAX];
+#ifdef WITH_AUDIT
+	const char *descs[COMMONIO_TXN_MAX];
+#endif				/* WITH_AUDIT */
+	int codes[COMMONIO_TXN_MAX];
+	size_t count = 0, failed;
+	bool use_tcb = false;
+
+#ifdef WITH_TCB
+	use_tcb = getdef_bool ("USE_TCB");
+#endif				/* WITH_TCB */
+
 	if (pw_lock () == 0) {
 		fprintf (stderr,
 		         _("%s: cannot lock %s; try again later.\n"),
@@ -571,17 +635,11 @@ static void open_files (void)
 		fail_exit (E_PW_UPDATE);
 	}
 	pw_locked = true;
-	if (pw_open (O_CREAT | O_RDWR) == 0) {
-		fprintf (stderr,
-		         _("%s: cannot open %s\n"), Prog, pw_dbname ());
+	dbs[count] = __pw_get_db ();
 #ifdef WITH_AUDIT
-		audit_logger (AUDIT_DEL_USER, Prog,
-		              "opening password file",
-		              user_name, (unsigned int) user_id,
-		              SHADOW_AUDIT_FAILURE);
+	descs[count] = "opening password file";
 #endif				/* WITH_AUDIT */
-		fail_exit (E_PW_UPDATE);
-	}
+	codes[count++] = E_PW_UPDATE;
 	if (is_shadow_pwd) {
 		if (spw_lock () == 0) {
 			fprintf (stderr,
@@ -596,17 +654,12 @@ static void open_files (void)
 			fail_exit (E_PW_UPDATE);
 		}
 		spw_locked = true;
-		if (spw_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr,
-			         _("%s: cannot open %s\n"),
-			         Prog, spw_dbname ());
+		if (!use_tcb) {
+			dbs[count] = __spw_get_db ();
 #ifdef WITH_AUDIT
-			audit_logger (AUDIT_DEL_USER, Prog,
-			              "opening shadow password file",
-			              user_name, (unsigned int) user_id,
-			              SHADOW_AUDIT_FAILURE);
+			descs[count] = "opening shadow password file";
 #endif				/* WITH_AUDIT */
-			fail_exit (E_PW_UPDATE);
+			codes[count++] = E_PW_UPDATE;
 		}
 	}
 	if (gr_lock () == 0) {
@@ -622,16 +675,11 @@ static void open_files (void)
 		fail_exit (E_GRP_UPDATE);
 	}
 	gr_locked = true;
-	if (gr_open (O_CREAT | O_RDWR) == 0) {
-		fprintf (stderr, _("%s: cannot open %s\n"), Prog, gr_dbname ());
+	dbs[count] = __gr_get_db ();
 #ifdef WITH_AUDIT
-		audit_logger (AUDIT_DEL_USER, Prog,
-		              "opening group file",
-		              user_name, (unsigned int) user_id,
-		              SHADOW_AUDIT_FAILURE);
+	descs[count] = "opening group file";
 #endif				/* WITH_AUDIT */
-		fail_exit (E_GRP_UPDATE);
-	}
+	codes[count++] = E_GRP_UPDATE;
 #ifdef	SHADOWGRP
 	if (is_shadow_grp) {
 		if (sgr_lock () == 0) {
@@ -646,18 +694,12 @@ static void open_files (void)
 #endif				/* WITH_AUDIT */
 			fail_exit (E_GRP_UPDATE);
 		}
-		sgr_locked= true;
-		if (sgr_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr, _("%s: cannot open %s\n"),
-			         Prog, sgr_dbname ());
+		sgr_locked = true;
+		dbs[count] = __sgr_get_db ();
 #ifdef WITH_AUDIT
-			audit_logger (AUDIT_DEL_USER, Prog,
-			              "opening shadow group file",
-			              user_name, (unsigned int) user_id,
-			              SHADOW_AUDIT_FAILURE);
+		descs[count] = "opening shadow group file";
 #endif				/* WITH_AUDIT */
-			fail_exit (E_GRP_UPDATE);
-		}
+		codes[count++] = E_GRP_UPDATE;
 	}
 #endif				/* SHADOWGRP */
 #ifdef ENABLE_SUBIDS
@@ -675,17 +717,11 @@ static void open_files (void)
 			fail_exit (E_SUB_UID_UPDATE);
 		}
 		sub_uid_locked = true;
-		if (sub_uid_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr,
-				_("%s: cannot open %s\n"), Prog, sub_uid_dbname ());
+		dbs[count] = __sub_uid_get_db ();
 #ifdef WITH_AUDIT
-			audit_logger (AUDIT_DEL_USER, Prog,
-				"opening subordinate user file",
-				user_name, (unsigned int) user_id,
-				SHADOW_AUDIT_FAILURE);
+		descs[count] = "opening subordinate user file";
 #endif				/* WITH_AUDIT */
-			fail_exit (E_SUB_UID_UPDATE);
-		}
+		codes[count++] = E_SUB_UID_UPDATE;
 	}
 	if (is_sub_gid) {
 		if (sub_gid_lock () == 0) {
@@ -701,19 +737,42 @@ static void open_files (void)
 			fail_exit (E_SUB_GID_UPDATE);
 		}
 		sub_gid_locked = true;
-		if (sub_gid_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr,
-				_("%s: cannot open %s\n"), Prog, sub_gid_dbname ());
+		dbs[count] = __sub_gid_get_db ();
 #ifdef WITH_AUDIT
-			audit_logger (AUDIT_DEL_USER, Prog,
-				"opening subordinate group file",
-				user_name, (unsigned int) user_id,
-				SHADOW_AUDIT_FAILURE);
+		descs[count] = "opening subordinate group file";
 #endif				/* WITH_AUDIT */
-			fail_exit (E_SUB_GID_UPDATE);
-		}
+		codes[count++] = E_SUB_GID_UPDATE;
 	}
 #endif				/* ENABLE_SUBIDS */
+
+	/*
+	 * The files are read concurrently with OPEN_THREADS. The shadow
+	 * file of USE_TCB is opened with spw_open().
+	 */
+	if (commonio_open_set (dbs, count, O_CREAT | O_RDWR, &failed) == 0) {
+		fprintf (stderr,
+		         _("%s: cannot open %s\n"),
+		         Prog, dbs[failed]->filename);
+#ifdef WITH_AUDIT
+		audit_logger (AUDIT_DEL_USER, Prog,
+		              descs[failed],
+		              user_name, (unsigned int) user_id,
+		              SHADOW_AUDIT_FAILURE);
+#endif				/* WITH_AUDIT */
+		fail_exit (codes[failed]);
+	}
+	if (use_tcb && is_shadow_pwd && (spw_open (O_CREAT | O_RDWR) == 0)) {
+		fprintf (stderr,
+		         _("%s: cannot open %s\n"),
+		         Prog, spw_dbname ());
+#ifdef WITH_AUDIT
+		audit_logger (AUDIT_DEL_USER, Prog,
+		              "opening shadow password file",
+		              user_name, (unsigned int) user_id,
+		              SHADOW_AUDIT_FAILURE);
+#endif				/* WITH_AUDIT */
+		fail_exit (E_PW_UPDATE);
+	}
 }
 
 /*
@@ -758,7 +817,8 @@ static void update_user (void)
 	              user_name, (unsigned int) user_id,
 	              SHADOW_AUDIT_SUCCESS);
 #endif				/* WITH_AUDIT */
-	SYSLOG ((LOG_INFO, "delete user '%s'\n", user_name));
+	SYSLOG_ENTRY ((LOG_INFO, "delete users", user_name,
+	               "delete user '%s'\n", user_name));
 }
 
 /*
@@ -766,22 +826,38 @@ static void update_user (void)
  *
  *	user_cancel calls a script for additional cleanups like removal of
  *	cron, at, or print jobs.
+ *
+ *	The script is called for each of the count users, or once for all
+ *	of them if USERDEL_CMD_BATCH is set.
  */
 
-static void user_cancel (const char *user)
+static void user_cancel (const char *const *users, size_t count)
 {
 	const char *cmd;
-	const char *argv[3];
+	const char **argv;
+	size_t i;
 	int status;
 
 	cmd = getdef_str ("USERDEL_CMD");
-	if (NULL == cmd) {
+	if ((NULL == cmd) || (0 == count)) {
 		return;
 	}
+	argv = (const char **) xmalloc ((count + 2) * sizeof (*argv));
 	argv[0] = cmd;
-	argv[1] = user;
-	argv[2] = (char *)0;
-	(void) run_command (cmd, argv, NULL, &status);
+	if ((count > 1) && getdef_bool ("USERDEL_CMD_BATCH")) {
+		for (i = 0; i < count; i++) {
+			argv[i + 1] = users[i];
+		}
+		argv[count + 1] = (char *)0;
+		(void) run_command (cmd, argv, NULL, &status);
+	} else {
+		argv[2] = (char *)0;
+		for (i = 0; i < count; i++) {
+			argv[1] = users[i];
+			(void) run_command (cmd, argv, NULL, &status);
+		}
+	}
+	free (argv);
 }
 
 #ifdef EXTRA_CHECK_HOME_DIR
@@ -992,6 +1068,534 @@ static int remove_tcbdir (const char *user_name, uid_t user_id)
 }
 #endif				/* WITH_TCB */
 
+/*
+ * remove_homes - remove the home directories
+ *
+ *	With USERDEL_ASYNC_REMOVE, the home directories are renamed in
+ *	their parent directory, so that they cannot be found by their name
+ *	anymore, and a single child process removes them, so that userdel
+ *	does not wait for the removal. The directories which cannot be
+ *	renamed are removed synchronously.
+ *
+ *	All the directories are removed with the same pool of threads.
+ *
+ *	The home directories which are volumes cloned from the snapshot of
+ *	the skeleton (see HOME_SKEL_SNAPSHOT) are dropped at once instead.
+ *
+ *	Return 0 on success, -1 if a directory could not be removed.
+ */
+static int remove_homes (const char *const *homes, size_t count)
+{
+	const char **now;	/* removed synchronously */
+	char **trash;		/* renamed, removed in the background */
+	size_t *renamed;	/* index in homes of each trash */
+	size_t nnow = 0;
+	size_t ntrash = 0;
+	size_t i;
+	int err = 0;
+	pid_t pid;
+
+	now = (const char **) xmalloc ((count + 1) * sizeof (char *));
+	trash = (char **) xmalloc ((count + 1) * sizeof (char *));
+	renamed = (size_t *) xmalloc ((count + 1) * sizeof (size_t));
+
+	for (i = 0; i < count; i++) {
+		size_t len = strlen (homes[i]) + 32;
+		int ret = home_drop (homes[i]);
+
+		if (0 == ret) {
+			continue;
+		}
+		if (ret < 0) {
+			fprintf (stderr, _("%s: cannot drop the volume %s: %s\n"),
+			         Prog, homes[i], strerror (errno));
+			err = -1;
+			continue;
+		}
+		if (!getdef_bool ("USERDEL_ASYNC_REMOVE")) {
+			now[nnow] = homes[i];
+			nnow++;
+			continue;
+		}
+		trash[ntrash] = xmalloc (len);
+		(void) snprintf (trash[ntrash], len, "%s.userdel.%lu",
+		                 homes[i], (unsigned long) getpid ());
+		if (rename (homes[i], trash[ntrash]) != 0) {
+			free (trash[ntrash]);
+			now[nnow] = homes[i];
+			nnow++;
+			continue;
+		}
+		renamed[ntrash] = i;
+		ntrash++;
+	}
+
+	if (0 != ntrash) {
+		pid = fork ();
+		if ((pid_t) -1 == pid) {
+			for (i = 0; i < ntrash; i++) {
+				(void) rename (trash[i], homes[renamed[i]]);
+				now[nnow] = homes[renamed[i]];
+				nnow++;
+			}
+		} else if (0 == pid) {
+			int fd;
+
+			/* Do not keep the place of userdel in the lock queues */
+			commonio_close_queues ();
+
+			/*
+			 * Detach from the session and from the standard
+			 * streams, so that the callers waiting for the output
+			 * of userdel do not wait for the removal.
+			 */
+			(void) setsid ();
+			fd = open ("/dev/null", O_RDWR);
+			if (fd >= 0) {
+				(void) dup2 (fd, STDIN_FILENO);
+				(void) dup2 (fd, STDOUT_FILENO);
+				(void) dup2 (fd, STDERR_FILENO);
+				if (fd > STDERR_FILENO) {
+					(void) close (fd);
+				}
+			}
+			if (remove_trees ((const char *const *) trash, ntrash,
+			                  true) != 0) {
+				SYSLOG ((LOG_ERR, "error removing directories"));
+			}
+			_exit (0);
+		} else {
+			for (i = 0; i < ntrash; i++) {
+				SYSLOG ((LOG_INFO,
+				         "removing directory %s (%s) in the background",
+				         homes[renamed[i]], trash[i]));
+			}
+		}
+		for (i = 0; i < ntrash; i++) {
+			free (trash[i]);
+		}
+	}
+
+	if ((0 != nnow) && (remove_trees (now, nnow, true) != 0)) {
+		err = -1;
+	}
+
+	free (now);
+	free (trash);
+	free (renamed);
+	return err;
+}
+
+static int gid_cmp (const void *p1, const void *p2)
+{
+	gid_t g1 = *(const gid_t *) p1;
+	gid_t g2 = *(const gid_t *) p2;
+
+	return (g1 > g2) - (g1 < g2);
+}
+
+/*
+ * scrub_groups - delete the users of names from all the groups
+ *
+ *	The group and gshadow files are walked once, for all the users.
+ */
+static void scrub_groups (const struct name_set *names)
+{
+	const struct group *grp;
+	struct group *ngrp;
+	char **mem;
+	size_t i;
+	char event[128];
+#ifdef	SHADOWGRP
+	const struct sgrp *sgrp;
+	struct sgrp *nsgrp;
+	char **adm;
+#endif				/* SHADOWGRP */
+
+	(void) gr_rewind ();
+	while ((grp = gr_next ()) != NULL) {
+		mem = del_list_set (grp->gr_mem, names);
+		if (mem == grp->gr_mem) {
+			continue;
+		}
+		free (mem);
+
+		ngrp = __gr_dup (grp);
+		if (NULL == ngrp) {
+			fprintf (stderr,
+			         _("%s: Out of memory. Cannot update %s.\n"),
+			         Prog, gr_dbname ());
+			exit (13);	/* XXX */
+		}
+		for (i = 0; NULL != ngrp->gr_mem[i]; i++) {
+			if (!name_set_has (names, ngrp->gr_mem[i])) {
+				continue;
+			}
+#ifdef WITH_AUDIT
+			audit_logger (AUDIT_DEL_USER, Prog,
+			              "deleting user from group",
+			              ngrp->gr_mem[i], AUDIT_NO_ID,
+			              SHADOW_AUDIT_SUCCESS);
+#endif				/* WITH_AUDIT */
+			(void) snprintf (event, sizeof event,
+			                 "delete from group '%s'", ngrp->gr_name);
+			SYSLOG_ENTRY ((LOG_INFO, event, ngrp->gr_mem[i],
+			               "delete '%s' from group '%s'\n",
+			               ngrp->gr_mem[i], ngrp->gr_name));
+		}
+		ngrp->gr_mem = del_list_set (ngrp->gr_mem, names);
+		if (gr_update (ngrp) == 0) {
+			fprintf (stderr,
+			         _("%s: failed to prepare the new %s entry '%s'\n"),
+			         Prog, gr_dbname (), ngrp->gr_name);
+			exit (E_GRP_UPDATE);
+		}
+	}
+
+#ifdef	SHADOWGRP
+	if (!is_shadow_grp) {
+		return;
+	}
+
+	(void) sgr_rewind ();
+	while ((sgrp = sgr_next ()) != NULL) {
+		mem = del_list_set (sgrp->sg_mem, names);
+		adm = del_list_set (sgrp->sg_adm, names);
+		if ((mem == sgrp->sg_mem) && (adm == sgrp->sg_adm)) {
+			continue;
+		}
+		if (mem != sgrp->sg_mem) {
+			free (mem);
+		}
+		if (adm != sgrp->sg_adm) {
+			free (adm);
+		}
+
+		nsgrp = __sgr_dup (sgrp);
+		if (NULL == nsgrp) {
+			fprintf (stderr,
+			         _("%s: Out of memory. Cannot update %s.\n"),
+			         Prog, sgr_dbname ());
+			exit (13);	/* XXX */
+		}
+		for (i = 0; NULL != nsgrp->sg_mem[i]; i++) {
+			if (!name_set_has (names, nsgrp->sg_mem[i])) {
+				continue;
+			}
+#ifdef WITH_AUDIT
+			audit_logger (AUDIT_DEL_USER, Prog,
+			              "deleting user from shadow group",
+			              nsgrp->sg_mem[i], AUDIT_NO_ID,
+			              SHADOW_AUDIT_SUCCESS);
+#endif				/* WITH_AUDIT */
+			(void) snprintf (event, sizeof event,
+			                 "delete from shadow group '%s'",
+			                 nsgrp->sg_name);
+			SYSLOG_ENTRY ((LOG_INFO, event, nsgrp->sg_mem[i],
+			               "delete '%s' from shadow group '%s'\n",
+			               nsgrp->sg_mem[i], nsgrp->sg_name));
+		}
+		nsgrp->sg_mem = del_list_set (nsgrp->sg_mem, names);
+		nsgrp->sg_adm = del_list_set (nsgrp->sg_adm, names);
+		if (sgr_update (nsgrp) == 0) {
+			fprintf (stderr,
+			         _("%s: failed to prepare the new %s entry '%s'\n"),
+			         Prog, sgr_dbname (), nsgrp->sg_name);
+			exit (E_GRP_UPDATE);
+		}
+	}
+#endif				/* SHADOWGRP */
+}
+
+/*
+ * get_primary_gids - get the primary GIDs of the users which are not in
+ *                    names
+ *
+ *	They are used by remove_usergroup() instead of a scan of the passwd
+ *	file for each user.
+ */
+static void get_primary_gids (const struct name_set *names)
+{
+	const struct passwd *pwd;
+	size_t size = 0;
+
+	nprimary_gids = 0;
+	prefix_setpwent ();
+	while ((pwd = prefix_getpwent ()) != NULL) {
+		if (name_set_has (names, pwd->pw_name)) {
+			continue;
+		}
+		if (nprimary_gids == size) {
+			size = (0 == size) ? 1024 : size * 2;
+			primary_gids = realloc (primary_gids,
+			                        size * sizeof (gid_t));
+			if (NULL == primary_gids) {
+				fprintf (stderr,
+				         _("%s: failed to allocate memory: %s\n"),
+				         Prog, strerror (errno));
+				fail_exit (E_GRP_UPDATE);
+			}
+		}
+		primary_gids[nprimary_gids] = pwd->pw_gid;
+		nprimary_gids++;
+	}
+	prefix_endpwent ();
+
+	if (NULL == primary_gids) {
+		/* No other users, but the scan was done */
+		primary_gids = (gid_t *) xmalloc (sizeof (gid_t));
+	}
+	qsort (primary_gids, nprimary_gids, sizeof (gid_t), gid_cmp);
+}
+
+/*
+ * del_users - delete several users
+ *
+ *	The entries of all the users are deleted while the files are
+ *	locked, and the files are written once. The groups are scrubbed in
+ *	a single pass, and the home directories are removed together.
+ */
+static int del_users (char *const *names, size_t count)
+{
+	struct deleted_user *users;
+	struct name_set set;
+	size_t *removed;	/* users whose home directory is removed */
+	const char **homes;
+	size_t nremoved = 0;
+	size_t i;
+	int errors = 0;
+
+#ifdef WITH_TCB
+	/* Each user has its own shadow file */
+	if (getdef_bool ("USE_TCB")) {
+		fprintf (stderr,
+		         _("%s: several users cannot be deleted with USE_TCB\n"),
+		         Prog);
+		exit (E_USAGE);
+	}
+#endif				/* WITH_TCB */
+
+	users = (struct deleted_user *)
+	        xmalloc (count * sizeof (struct deleted_user));
+	name_set_init (&set, count);
+
+	(void) pw_open (O_RDONLY);
+	for (i = 0; i < count; i++) {
+		const struct passwd *pwd;
+		size_t len;
+
+		if (!name_set_add (&set, names[i])) {
+			fprintf (stderr, _("%s: user '%s' is listed twice\n"),
+			         Prog, names[i]);
+			exit (E_USAGE);
+		}
+		pwd = pw_locate (names[i]); /* we care only about local users */
+		if (NULL == pwd) {
+			fprintf (stderr, _("%s: user '%s' does not exist\n"),
+			         Prog, names[i]);
+#ifdef WITH_AUDIT
+			audit_logger (AUDIT_DEL_USER, Prog,
+			              "deleting user not found",
+			              names[i], AUDIT_NO_ID,
+			              SHADOW_AUDIT_FAILURE);
+#endif				/* WITH_AUDIT */
+			exit (E_NOTFOUND);
+		}
+		users[i].name = names[i];
+		users[i].uid = pwd->pw_uid;
+		users[i].gid = pwd->pw_gid;
+		len = strlen (prefix) + strlen (pwd->pw_dir) + 2;
+		users[i].home = xmalloc (len);
+		if ('\0' != prefix[0]) {
+			(void) snprintf (users[i].home, len, "%s/%s",
+			                 prefix, pwd->pw_dir);
+		} else {
+			(void) snprintf (users[i].home, len, "%s", pwd->pw_dir);
+		}
+	}
+	(void) pw_close ();
+
+	/*
+	 * Check to make certain the users are not logged in.
+	 */
+	for (i = 0; i < count; i++) {
+		if (   (prefix[0] == '\0') && !Rflg && !fflg
+		    && (user_busy (users[i].name, users[i].uid) != 0)) {
+#ifdef WITH_AUDIT
+			audit_logger (AUDIT_DEL_USER, Prog,
+			              "deleting user logged in",
+			              users[i].name, AUDIT_NO_ID,
+			              SHADOW_AUDIT_FAILURE);
+#endif				/* WITH_AUDIT */
+			exit (E_USER_BUSY);
+		}
+	}
+
+	/* The failures of open_files() are reported for the first user */
+	user_name = (char *) users[0].name;
+	user_id = users[0].uid;
+	open_files ();
+	for (i = 0; i < count; i++) {
+		user_name = (char *) users[i].name;
+		user_id = users[i].uid;
+		update_user ();
+	}
+	scrub_groups (&set);
+	if (getdef_bool ("USERGROUPS_ENAB")) {
+		if (!fflg) {
+			get_primary_gids (&set);
+		}
+		for (i = 0; i < count; i++) {
+			user_name = (char *) users[i].name;
+			user_id = users[i].uid;
+			user_gid = users[i].gid;
+			remove_usergroup ();
+		}
+		free (primary_gids);
+		primary_gids = NULL;
+	}
+
+	removed = (size_t *) xmalloc ((count + 1) * sizeof (size_t));
+	for (i = 0; rflg && (i < count); i++) {
+		int home_owned;
+
+		user_name = (char *) users[i].name;
+		user_id = users[i].uid;
+		errors += remove_mailbox ();
+
+		home_owned = is_owner (users[i].uid, users[i].home);
+		if (-1 == home_owned) {
+			fprintf (stderr,
+			         _("%s: %s home directory (%s) not found\n"),
+			         Prog, users[i].name, users[i].home);
+			continue;
+		} else if ((0 == home_owned) && !fflg) {
+			fprintf (stderr,
+			         _("%s: %s not owned by %s, not removing\n"),
+			         Prog, users[i].home, users[i].name);
+			errors++;
+			continue;
+		}
+		removed[nremoved] = i;
+		nremoved++;
+	}
+
+#ifdef EXTRA_CHECK_HOME_DIR
+	/* This may be slow, the above should be good enough. */
+	if ((0 != nremoved) && !fflg) {
+		struct passwd *pwd;
+		size_t j;
+
+		/*
+		 * For safety, refuse to remove a home directory if it
+		 * would result in removing the home directory of a user
+		 * which is not deleted.
+		 */
+		prefix_setpwent ();
+		while ((pwd = prefix_getpwent ())) {
+			if (name_set_has (&set, pwd->pw_name)) {
+				continue;
+			}
+			for (i = 0, j = 0; i < nremoved; i++) {
+				const char *home = users[removed[i]].home;
+
+				if (path_prefix (home, pwd->pw_dir)) {
+					fprintf (stderr,
+					         _("%s: not removing directory %s (would remove home of user %s)\n"),
+					         Prog, home, pwd->pw_name);
+					errors++;
+					continue;
+				}
+				removed[j] = removed[i];
+				j++;
+			}
+			nremoved = j;
+		}
+		prefix_endpwent ();
+	}
+#endif				/* EXTRA_CHECK_HOME_DIR */
+
+	homes = (const char **) xmalloc ((count + 1) * sizeof (char *));
+	for (i = 0; i < nremoved; i++) {
+		homes[i] = users[removed[i]].home;
+	}
+	if (0 != nremoved) {
+		bool failed = (remove_homes (homes, nremoved) != 0);
+
+		if (failed) {
+			fprintf (stderr,
+			         _("%s: error removing the home directories\n"),
+			         Prog);
+			errors++;
+		}
+#ifdef WITH_AUDIT
+		for (i = 0; i < nremoved; i++) {
+			audit_logger (AUDIT_DEL_USER, Prog,
+			              "deleting home directory",
+			              users[removed[i]].name,
+			              (unsigned int) users[removed[i]].uid,
+			              failed ? SHADOW_AUDIT_FAILURE
+			                     : SHADOW_AUDIT_SUCCESS);
+		}
+#endif				/* WITH_AUDIT */
+	}
+
+#ifdef WITH_SELINUX
+	if (Zflg) {
+		if (seuser_batch_begin () != 0) {
+			fail_exit (E_SE_UPDATE);
+		}
+		for (i = 0; i < count; i++) {
+			if (del_seuser (users[i].name) != 0) {
+				fprintf (stderr,
+				         _("%s: warning: the user name %s to SELinux user mapping removal failed.\n"),
+				         Prog, users[i].name);
+#ifdef WITH_AUDIT
+				audit_logger (AUDIT_ADD_USER, Prog,
+				              "removing SELinux user mapping",
+				              users[i].name,
+				              (unsigned int) users[i].uid,
+				              SHADOW_AUDIT_FAILURE);
+#endif				/* WITH_AUDIT */
+				seuser_batch_abort ();
+				fail_exit (E_SE_UPDATE);
+			}
+		}
+		if (seuser_batch_commit () != 0) {
+			fail_exit (E_SE_UPDATE);
+		}
+	}
+#endif				/* WITH_SELINUX */
+
+	/*
+	 * Cancel any crontabs or at jobs. Have to do this before we remove
+	 * the entries from /etc/passwd.
+	 */
+	if (prefix[0] == '\0') {
+		const char **cancelled;
+
+		cancelled = (const char **) xmalloc ((count + 1) * sizeof (*cancelled));
+		for (i = 0; i < count; i++) {
+			cancelled[i] = users[i].name;
+		}
+		user_cancel (cancelled, count);
+		free (cancelled);
+	}
+	close_files ();
+
+	cache_flush_defer (CACHE_DB_PASSWD | CACHE_DB_GROUP);
+
+	for (i = 0; i < count; i++) {
+		free (users[i].home);
+	}
+	free (users);
+	free (removed);
+	free (homes);
+	name_set_free (&set);
+
+	return ((0 != errors) ? E_HOMEDIR : E_SUCCESS);
+}
+
 /*
  * main - userdel command
  */
@@ -1014,7 +1618,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 	prefix = process_prefix_flag ("-P", argc, argv);
 
 	OPENLOG ("userdel");
@@ -1085,7 +1689,7 @@ int main (int argc, char **argv)
 		}
 	}
 
-	if ((optind + 1) != argc) {
+	if (optind >= argc) {
 		usage (E_USAGE);
 	}
 
@@ -1134,6 +1738,10 @@ int main (int argc, char **argv)
 	is_sub_gid = sub_gid_file_present ();
 #endif				/* ENABLE_SUBIDS */
 
+	if ((optind + 1) != argc) {
+		return del_users (argv + optind, (size_t) (argc - optind));
+	}
+
 	/*
 	 * Start with a quick check to see if the user exists.
 	 */
@@ -1272,7 +1880,9 @@ int main (int argc, char **argv)
 #endif				/* EXTRA_CHECK_HOME_DIR */
 
 	if (rflg) {
-		if (remove_tree (user_home, true) != 0) {
+		const char *home = user_home;
+
+		if (remove_homes (&home, 1) != 0) {
 			fprintf (stderr,
 			         _("%s: error removing directory %s\n"),
 			         Prog, user_home);
@@ -1320,16 +1930,14 @@ int main (int argc, char **argv)
 	 * the entry from /etc/passwd.
 	 */
 	if(prefix[0] == '\0')
-		user_cancel (user_name);
+		user_cancel ((const char *const *) &user_name, 1);
 	close_files ();
 
 #ifdef WITH_TCB
 	errors += remove_tcbdir (user_name, user_id);
 #endif				/* WITH_TCB */
 
-	nscd_flush_cache ("passwd");
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
+	cache_flush_defer (CACHE_DB_PASSWD | CACHE_DB_GROUP);
 
 	return ((0 != errors) ? E_HOMEDIR : E_SUCCESS);
 }
@@ -52,12 +52,12 @@
 #include <sys/types.h>
 #include <time.h>
 #include "chkname.h"
+#include "commonio.h"
 #include "defines.h"
 #include "faillog.h"
 #include "getdef.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #include "prototypes.h"
 #include "pwauth.h"
 #include "pwio.h"
@@ -71,6 +71,7 @@
 #ifdef WITH_TCB
 #include "tcbfuncs.h"
 #endif
+#include "uidrecords.h"
 
 /*
  * exit status values
@@ -130,6 +131,16 @@ static const char* prefix = "";
 static char* prefix_user_home = NULL;
 static char* prefix_user_newhome = NULL;
 
+/*
+ * Cross-device move of the home directory (MOVE_HOME_RESUME)
+ *
+ * The IDs given to copy_tree(), and whether the move resumes an
+ * interrupted one, according to its journal.
+ */
+static bool move_resume = false;
+static uid_t move_old_uid, move_new_uid;
+static gid_t move_old_gid, move_new_gid;
+
 static bool
     aflg = false,		/* append to existing secondary group set */
     cflg = false,		/* new comment (GECOS) field */
@@ -154,7 +165,52 @@ static bool
     Wflg = false,		/* delete subordinate gids */
 #endif				/* ENABLE_SUBIDS */
     uflg = false,		/* specify new user ID */
-    Uflg = false;		/* unlock the password */
+    Uflg = false,		/* unlock the password */
+    progress_flg = false;	/* report the progress of the move */
+
+/* Value returned by getopt_long for --progress, which has no short option */
+#define OPT_PROGRESS	0x100
+/* Same for --renumber */
+#define OPT_RENUMBER	0x101
+/* Same for --rename */
+#define OPT_RENAME	0x102
+
+/* Mapping file of --renumber */
+static /*@null@*/const char *renumber_file = NULL;
+
+/* Growing list of the moves of --renumber */
+struct move_list {
+	struct uid_move *moves;
+	size_t count;
+	size_t size;
+};
+
+/* Mapping file of --rename */
+static /*@null@*/const char *rename_file = NULL;
+
+/* A user renamed by --rename */
+struct renamed_user {
+	char *old_name;
+	char *new_name;
+	uid_t uid;
+	/*@null@*/char *home;		/* with the prefix, if it is renamed */
+	/*@null@*/char *new_home;
+};
+
+/* Growing list of the users of --rename */
+struct rename_list {
+	struct renamed_user *users;
+	size_t count;
+	size_t size;
+};
+
+/* A user whose UID or primary GID is changed by --renumber */
+struct renumbered_user {
+	char *name;
+	uid_t old_uid;
+	uid_t new_uid;
+	char *home;		/* with the prefix */
+};
 
 static bool is_shadow_pwd;
 
@@ -198,9 +254,42 @@ static void process_flags (int, char **);
 static void close_files (void);
 static void open_files (void);
 static void usr_update (void);
+static void report_copy (const struct tree_progress *progress);
+static void report_remove (const struct tree_progress *progress);
+static /*@only@*/char *move_journal_path (void);
+static int move_journal_write (void);
+static bool move_journal_read (void);
+static void move_journal_remove (void);
 static void move_home (void);
 static void update_lastlog (void);
 static void update_faillog (void);
+static void get_uid_move (struct uid_move *move);
+static void add_move (struct move_list *list, unsigned long from,
+                      unsigned long to);
+static void read_renumber_file (struct move_list *uids,
+                                struct move_list *gids);
+static int move_cmp (const void *p1, const void *p2);
+static int move_to_cmp (const void *p1, const void *p2);
+static void check_moves (struct move_list *list, bool uids);
+static int home_cmp (const void *p1, const void *p2);
+static bool home_nested (char *const *homes, size_t n, const char *home);
+static size_t renumber_homes (struct renumbered_user *users, size_t count,
+                              struct chown_job *jobs,
+                              const struct chown_map *map);
+static void renumber_logs (const struct move_list *uids);
+static void set_user_ids (void *ent, void *arg);
+static void set_group_id (void *ent, void *arg);
+static int renumber (void);
+static void read_rename_file (struct rename_list *list);
+static int rename_cmp (const void *p1, const void *p2);
+static int rename_new_cmp (const void *p1, const void *p2);
+static void check_renames (struct rename_list *list);
+static /*@null@*/const char *renamed (const struct rename_list *list,
+                                      const char *name);
+static /*@null@*/char **rename_members (const struct rename_list *list,
+                                        char *const *members);
+static void rename_home (struct renamed_user *u, struct passwd *pwent);
+static int rename_users (void);
 
 #ifndef NO_MOVE_MAILBOX
 static void move_mailbox (void);
@@ -300,7 +389,7 @@ static int get_groups (char *list)
 			fprintf (stderr,
 			         _("%s: group '%s' is a NIS group.\n"),
 			         Prog, grp->gr_name);
-			gr_free ((struct group *)grp);
+			gr_free_packed ((struct group *)grp);
 			continue;
 		}
 #endif
@@ -309,7 +398,7 @@ static int get_groups (char *list)
 			fprintf (stderr,
 			         _("%s: too many groups specified (max %d).\n"),
 			         Prog, ngroups);
-			gr_free ((struct group *)grp);
+			gr_free_packed ((struct group *)grp);
 			break;
 		}
 
@@ -317,7 +406,7 @@ static int get_groups (char *list)
 		 * Add the group name to the user's list of groups.
 		 */
 		user_groups[ngroups++] = xstrdup (grp->gr_name);
-		gr_free ((struct group *)grp);
+		gr_free_packed ((struct group *)grp);
 	} while (NULL != list);
 
 	user_groups[ngroups] = (char *) 0;
@@ -405,9 +494,11 @@ static /*@noreturn@*/void usage (int status)
 	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
 	(void) fprintf (usageout,
 	                _("Usage: %s [options] LOGIN\n"
+	                  "       %s --renumber FILE\n"
+	                  "       %s --rename FILE [-m]\n"
 	                  "\n"
 	                  "Options:\n"),
-	                Prog);
+	                Prog, Prog, Prog);
 	(void) fputs (_("  -c, --comment COMMENT         new value of the GECOS field\n"), usageout);
 	(void) fputs (_("  -d, --home HOME_DIR           new home directory for the user account\n"), usageout);
 	(void) fputs (_("  -e, --expiredate EXPIRE_DATE  set account expiration date to EXPIRE_DATE\n"), usageout);
@@ -424,9 +515,14 @@ static /*@noreturn@*/void usage (int status)
 	(void) fputs (_("  -m, --move-home               move contents of the home directory to the\n"
 	                "                                new location (use only with -d)\n"), usageout);
 	(void) fputs (_("  -o, --non-unique              allow using duplicate (non-unique) UID\n"), usageout);
+	(void) fputs (_("      --progress                report the progress of the move of the home\n"
+	                "                                directory (use only with -m)\n"), usageout);
 	(void) fputs (_("  -p, --password PASSWORD       use encrypted password for the new password\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -P, --prefix PREFIX_DIR       prefix directory where are located the /etc/* files\n"), usageout);
+	(void) fputs (_("      --rename FILE             rename all the users listed in FILE\n"), usageout);
+	(void) fputs (_("      --renumber FILE           change the UIDs and GIDs of all the users and\n"
+	                "                                groups as listed in FILE\n"), usageout);
 	(void) fputs (_("  -s, --shell SHELL             new login shell for the user account\n"), usageout);
 	(void) fputs (_("  -u, --uid UID                 new UID for the user account\n"), usageout);
 	(void) fputs (_("  -U, --unlock                  unlock the user account\n"), usageout);
@@ -718,6 +814,51 @@ static /*@noreturn@*/void fail_exit (int code)
 }
 
 
+/*
+ * rename_member - Replace user_name by user_newname in a list of members.
+ *
+ *	The list is rebuilt once, with user_newname at the end.
+ */
+static char **rename_member (char **list)
+{
+	char *del[2];
+	char *add[2];
+
+	del[0] = user_name;
+	del[1] = NULL;
+	add[0] = user_newname;
+	add[1] = NULL;
+	return edit_list (list, add, del);
+}
+
+/*
+ * next_group - Return the next group that update_group has to check.
+ *
+ *	These are the groups listing the user (in groups), and then the
+ *	concurrent groups which do not list the user yet. The concurrent
+ *	groups are located when they are reached, after the previous
+ *	groups were updated.
+ */
+static /*@null@*/const struct group *next_group (
+	const struct group **groups, size_t count, size_t *pos)
+{
+	if (*pos < count) {
+		return groups[(*pos)++];
+	}
+	while (Gflg && (NULL != user_groups[*pos - count])) {
+		const struct group *grp;
+
+		grp = gr_locate (user_groups[*pos - count]);
+		(*pos)++;
+		if (   (NULL != grp)
+		    && !is_on_list (grp->gr_mem, user_name)
+		    && !is_on_list (grp->gr_mem, user_newname)) {
+			return grp;
+		}
+	}
+	return NULL;
+}
+
 static void update_group (void)
 {
 	bool is_member;
@@ -725,14 +866,22 @@ static void update_group (void)
 	bool changed;
 	const struct group *grp;
 	struct group *ngrp;
+	const struct group **groups;
+	size_t count, pos = 0;
 
 	changed = false;
 
 	/*
-	 * Scan through the entire group file looking for the groups that
-	 * the user is a member of.
+	 * Look only at the groups that the user is a member of, and at
+	 * the groups specified as concurrent groups.
 	 */
-	while ((grp = gr_next ()) != NULL) {
+	if (gr_locate_member (user_name, &groups, &count) == 0) {
+		fprintf (stderr,
+		         _("%s: Out of memory. Cannot update %s.\n"),
+		         Prog, gr_dbname ());
+		fail_exit (E_GRP_UPDATE);
+	}
+	while ((grp = next_group (groups, count, &pos)) != NULL) {
 		/*
 		 * See if the user specified this group as one of their
 		 * concurrent groups.
@@ -760,10 +909,7 @@ static void update_group (void)
 				 * But the user might have been renamed.
 				 */
 				if (lflg) {
-					ngrp->gr_mem = del_list (ngrp->gr_mem,
-					                         user_name);
-					ngrp->gr_mem = add_list (ngrp->gr_mem,
-					                         user_newname);
+					ngrp->gr_mem = rename_member (ngrp->gr_mem);
 					changed = true;
 #ifdef WITH_AUDIT
 					audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
@@ -817,9 +963,35 @@ static void update_group (void)
 			fail_exit (E_GRP_UPDATE);
 		}
 	}
+	free (groups);
 }
 
 #ifdef SHADOWGRP
+/*
+ * next_sgroup - Return the next shadow group that update_gshadow has to
+ * check (see next_group).
+ */
+static /*@null@*/const struct sgrp *next_sgroup (
+	const struct sgrp **groups, size_t count, size_t *pos)
+{
+	if (*pos < count) {
+		return groups[(*pos)++];
+	}
+	while (Gflg && (NULL != user_groups[*pos - count])) {
+		const struct sgrp *sgrp;
+
+		sgrp = sgr_locate (user_groups[*pos - count]);
+		(*pos)++;
+		if (   (NULL != sgrp)
+		    && !is_on_list (sgrp->sg_mem, user_name)
+		    && !is_on_list (sgrp->sg_adm, user_name)
+		    && !is_on_list (sgrp->sg_mem, user_newname)) {
+			return sgrp;
+		}
+	}
+	return NULL;
+}
+
 static void update_gshadow (void)
 {
 	bool is_member;
@@ -828,14 +1000,23 @@ static void update_gshadow (void)
 	bool changed;
 	const struct sgrp *sgrp;
 	struct sgrp *nsgrp;
+	const struct sgrp **groups;
+	size_t count, pos = 0;
 
 	changed = false;
 
 	/*
-	 * Scan through the entire shadow group file looking for the groups
-	 * that the user is a member of.
+	 * Look only at the shadow groups that the user is a member or an
+	 * administrator of, and at the groups specified as concurrent
+	 * groups.
 	 */
-	while ((sgrp = sgr_next ()) != NULL) {
+	if (sgr_locate_member (user_name, &groups, &count) == 0) {
+		fprintf (stderr,
+		         _("%s: Out of memory. Cannot update %s.\n"),
+		         Prog, sgr_dbname ());
+		fail_exit (E_GRP_UPDATE);
+	}
+	while ((sgrp = next_sgroup (groups, count, &pos)) != NULL) {
 
 		/*
 		 * See if the user was a member of this group
@@ -870,8 +1051,7 @@ static void update_gshadow (void)
 			/* User was an admin of this group but the user
 			 * has been renamed.
 			 */
-			nsgrp->sg_adm = del_list (nsgrp->sg_adm, user_name);
-			nsgrp->sg_adm = add_list (nsgrp->sg_adm, user_newname);
+			nsgrp->sg_adm = rename_member (nsgrp->sg_adm);
 			changed = true;
 #ifdef WITH_AUDIT
 			audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
@@ -890,10 +1070,7 @@ static void update_gshadow (void)
 				 * But the user might have been renamed.
 				 */
 				if (lflg) {
-					nsgrp->sg_mem = del_list (nsgrp->sg_mem,
-					                          user_name);
-					nsgrp->sg_mem = add_list (nsgrp->sg_mem,
-					                          user_newname);
+					nsgrp->sg_mem = rename_member (nsgrp->sg_mem);
 					changed = true;
 #ifdef WITH_AUDIT
 					audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
@@ -952,6 +1129,7 @@ static void update_gshadow (void)
 			fail_exit (E_GRP_UPDATE);
 		}
 	}
+	free (groups);
 }
 #endif				/* SHADOWGRP */
 
@@ -983,6 +1161,8 @@ static void process_flags (int argc, char **argv)
 	const struct group *grp;
 
 	bool anyflag = false;
+	bool otherflag = false;	/* other than --renumber, --rename, -R, -P,
+				 * or -m */
 
 	{
 		/*
@@ -1005,6 +1185,9 @@ static void process_flags (int argc, char **argv)
 			{"password",     required_argument, NULL, 'p'},
 			{"root",         required_argument, NULL, 'R'},
 			{"prefix",       required_argument, NULL, 'P'},
+			{"progress",     no_argument,       NULL, OPT_PROGRESS},
+			{"rename",       required_argument, NULL, OPT_RENAME},
+			{"renumber",     required_argument, NULL, OPT_RENUMBER},
 			{"shell",        required_argument, NULL, 's'},
 			{"uid",          required_argument, NULL, 'u'},
 			{"unlock",       no_argument,       NULL, 'U'},
@@ -1116,6 +1299,15 @@ static void process_flags (int argc, char **argv)
 			case 'o':
 				oflg = true;
 				break;
+			case OPT_PROGRESS:
+				progress_flg = true;
+				break;
+			case OPT_RENUMBER:
+				renumber_file = optarg;
+				break;
+			case OPT_RENAME:
+				rename_file = optarg;
+				break;
 			case 'p':
 				user_pass = optarg;
 				pflg = true;
@@ -1208,7 +1400,28 @@ static void process_flags (int argc, char **argv)
 				usage (E_USAGE);
 			}
 			anyflag = true;
+			if (   (OPT_RENUMBER != c) && (OPT_RENAME != c)
+			    && ('R' != c) && ('P' != c) && ('m' != c)) {
+				otherflag = true;
+			}
+		}
+	}
+
+	/* The changes of --renumber are read by renumber() */
+	if (NULL != renumber_file) {
+		if (   otherflag || mflg || (NULL != rename_file)
+		    || (optind != argc)) {
+			usage (E_USAGE);
+		}
+		return;
+	}
+
+	/* The changes of --rename are read by rename_users() */
+	if (NULL != rename_file) {
+		if (otherflag || (optind != argc)) {
+			usage (E_USAGE);
 		}
+		return;
 	}
 
 	if (optind != argc - 1) {
@@ -1329,6 +1542,13 @@ static void process_flags (int argc, char **argv)
 		usage (E_USAGE);
 	}
 
+	if (progress_flg && !mflg) {
+		fprintf (stderr,
+		         _("%s: %s flag is only allowed with the %s flag\n"),
+		         Prog, "--progress", "-m");
+		usage (E_USAGE);
+	}
+
 	if (user_newid == user_id) {
 		uflg = false;
 		oflg = false;
@@ -1352,7 +1572,15 @@ static void process_flags (int argc, char **argv)
 	if (   (NULL != user_newhome)
 	    && (strcmp (user_newhome, user_home) == 0)) {
 		dflg = false;
-		mflg = false;
+		/*
+		 * The home directory was already changed, but its move
+		 * to another file system may have been interrupted.
+		 */
+		if (   !mflg
+		    || !getdef_bool ("MOVE_HOME_RESUME")
+		    || !move_journal_read ()) {
+			mflg = false;
+		}
 	}
 	if (   (NULL != user_newcomment)
 	    && (strcmp (user_newcomment, user_comment) == 0)) {
@@ -1439,7 +1667,7 @@ static void close_files (void)
 		fail_exit (E_PW_UPDATE);
 	}
 
-	if (Gflg || lflg) {
+	if (Gflg || lflg || (NULL != renumber_file) || (NULL != rename_file)) {
 		if (gr_close () == 0) {
 			fprintf (stderr,
 			         _("%s: failure while writing changes to %s\n"),
@@ -1559,99 +1787,86 @@ static void close_files (void)
  */
 static void open_files (void)
 {
-	if (pw_lock () == 0) {
+	struct commonio_db *dbs[COMMONIO_TXN_MAX];
+	int codes[COMMONIO_TXN_MAX];
+	size_t count = 0, failed;
+	bool lock_groups =    Gflg || lflg || (NULL != renumber_file)
+	                   || (NULL != rename_file);
+	bool use_tcb = false;
+
+#ifdef WITH_TCB
+	use_tcb = is_shadow_pwd && getdef_bool ("USE_TCB");
+#endif				/* WITH_TCB */
+
+	/*
+	 * Lock all the files at once, so that usermod does not wait for
+	 * a lock while holding the others.
+	 */
+	dbs[count] = __pw_get_db ();
+	codes[count++] = E_PW_UPDATE;
+	if (is_shadow_pwd) {
+		dbs[count] = __spw_get_db ();
+		codes[count++] = E_PW_UPDATE;
+	}
+	if (lock_groups) {
+		dbs[count] = __gr_get_db ();
+		codes[count++] = E_GRP_UPDATE;
+#ifdef SHADOWGRP
+		if (is_shadow_grp) {
+			dbs[count] = __sgr_get_db ();
+			codes[count++] = E_GRP_UPDATE;
+		}
+#endif
+	}
+#ifdef ENABLE_SUBIDS
+	if (vflg || Vflg) {
+		dbs[count] = __sub_uid_get_db ();
+		codes[count++] = E_SUB_UID_UPDATE;
+	}
+	if (wflg || Wflg) {
+		dbs[count] = __sub_gid_get_db ();
+		codes[count++] = E_SUB_GID_UPDATE;
+	}
+#endif				/* ENABLE_SUBIDS */
+	if (commonio_lock_set (dbs, count, &failed) == 0) {
 		fprintf (stderr,
 		         _("%s: cannot lock %s; try again later.\n"),
-		         Prog, pw_dbname ());
-		fail_exit (E_PW_UPDATE);
+		         Prog, dbs[failed]->filename);
+		fail_exit (codes[failed]);
 	}
 	pw_locked = true;
-	if (pw_open (O_CREAT | O_RDWR) == 0) {
-		fprintf (stderr,
-		         _("%s: cannot open %s\n"),
-		         Prog, pw_dbname ());
-		fail_exit (E_PW_UPDATE);
+	spw_locked = is_shadow_pwd;
+	gr_locked = lock_groups;
+#ifdef SHADOWGRP
+	sgr_locked = lock_groups && is_shadow_grp;
+#endif
+#ifdef ENABLE_SUBIDS
+	sub_uid_locked = vflg || Vflg;
+	sub_gid_locked = wflg || Wflg;
+#endif				/* ENABLE_SUBIDS */
+
+	/*
+	 * Open the files, which loads all of their entries. They are read
+	 * concurrently with OPEN_THREADS. The shadow file of USE_TCB is
+	 * opened with spw_open().
+	 */
+	if (use_tcb) {
+		memmove (&dbs[1], &dbs[2], (count - 2) * sizeof (dbs[0]));
+		memmove (&codes[1], &codes[2], (count - 2) * sizeof (codes[0]));
+		count--;
 	}
-	if (is_shadow_pwd && (spw_lock () == 0)) {
+	if (commonio_open_set (dbs, count, O_CREAT | O_RDWR, &failed) == 0) {
 		fprintf (stderr,
-		         _("%s: cannot lock %s; try again later.\n"),
-		         Prog, spw_dbname ());
-		fail_exit (E_PW_UPDATE);
+		         _("%s: cannot open %s\n"),
+		         Prog, dbs[failed]->filename);
+		fail_exit (codes[failed]);
 	}
-	spw_locked = true;
-	if (is_shadow_pwd && (spw_open (O_CREAT | O_RDWR) == 0)) {
+	if (use_tcb && (spw_open (O_CREAT | O_RDWR) == 0)) {
 		fprintf (stderr,
 		         _("%s: cannot open %s\n"),
 		         Prog, spw_dbname ());
 		fail_exit (E_PW_UPDATE);
 	}
-
-	if (Gflg || lflg) {
-		/*
-		 * Lock and open the group file. This will load all of the
-		 * group entries.
-		 */
-		if (gr_lock () == 0) {
-			fprintf (stderr,
-			         _("%s: cannot lock %s; try again later.\n"),
-			         Prog, gr_dbname ());
-			fail_exit (E_GRP_UPDATE);
-		}
-		gr_locked = true;
-		if (gr_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr,
-			         _("%s: cannot open %s\n"),
-			         Prog, gr_dbname ());
-			fail_exit (E_GRP_UPDATE);
-		}
-#ifdef SHADOWGRP
-		if (is_shadow_grp && (sgr_lock () == 0)) {
-			fprintf (stderr,
-			         _("%s: cannot lock %s; try again later.\n"),
-			         Prog, sgr_dbname ());
-			fail_exit (E_GRP_UPDATE);
-		}
-		sgr_locked = true;
-		if (is_shadow_grp && (sgr_open (O_CREAT | O_RDWR) == 0)) {
-			fprintf (stderr,
-			         _("%s: cannot open %s\n"),
-			         Prog, sgr_dbname ());
-			fail_exit (E_GRP_UPDATE);
-		}
-#endif
-	}
-#ifdef ENABLE_SUBIDS
-	if (vflg || Vflg) {
-		if (sub_uid_lock () == 0) {
-			fprintf (stderr,
-			         _("%s: cannot lock %s; try again later.\n"),
-			         Prog, sub_uid_dbname ());
-			fail_exit (E_SUB_UID_UPDATE);
-		}
-		sub_uid_locked = true;
-		if (sub_uid_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr,
-			         _("%s: cannot open %s\n"),
-			         Prog, sub_uid_dbname ());
-			fail_exit (E_SUB_UID_UPDATE);
-		}
-	}
-	if (wflg || Wflg) {
-		if (sub_gid_lock () == 0) {
-			fprintf (stderr,
-			         _("%s: cannot lock %s; try again later.\n"),
-			         Prog, sub_gid_dbname ());
-			fail_exit (E_SUB_GID_UPDATE);
-		}
-		sub_gid_locked = true;
-		if (sub_gid_open (O_CREAT | O_RDWR) == 0) {
-			fprintf (stderr,
-			         _("%s: cannot open %s\n"),
-			         Prog, sub_gid_dbname ());
-			fail_exit (E_SUB_GID_UPDATE);
-		}
-	}
-#endif				/* ENABLE_SUBIDS */
 }
 
 /*
@@ -1755,17 +1970,171 @@ static void usr_update (void)
 	}
 }
 
+/*
+ * move_journal_path - the journal of the cross-device move of the home
+ *                     directory
+ *
+ *	It is next to the new home directory, so that it is on the file
+ *	system where the copy is kept.
+ */
+static /*@only@*/char *move_journal_path (void)
+{
+	size_t len = strlen (prefix_user_newhome) + sizeof ".usermod-move";
+	char *path = xmalloc (len);
+
+	(void) snprintf (path, len, "%s.usermod-move", prefix_user_newhome);
+	return path;
+}
+
+/*
+ * move_journal_write - record the cross-device move of the home directory
+ *
+ *	The journal contains the name of the user, the old home directory
+ *	and the ownership change of the copy:
+ *
+ *		<user>
+ *		<old home>
+ *		<old UID> <new UID> <old GID> <new GID>
+ *
+ *	It is written to <journal>+ and renamed.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int move_journal_write (void)
+{
+	char *path = move_journal_path ();
+	char *tmp;
+	size_t len = strlen (path) + 2;
+	int fd;
+	FILE *fp;
+	int err = -1;
+
+	tmp = xmalloc (len);
+	(void) snprintf (tmp, len, "%s+", path);
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+	           0600);
+	if (fd < 0) {
+		goto out;
+	}
+	fp = fdopen (fd, "w");
+	if (NULL == fp) {
+		(void) close (fd);
+		goto out;
+	}
+	if (   (fprintf (fp, "%s\n%s\n%ld %ld %ld %ld\n",
+	                 user_newname, user_home,
+	                 (long) move_old_uid, (long) move_new_uid,
+	                 (long) move_old_gid, (long) move_new_gid) < 0)
+	    || (fflush (fp) != 0)
+	    || (fsync (fileno (fp)) != 0)) {
+		(void) fclose (fp);
+		goto out;
+	}
+	if (   (fclose (fp) == 0)
+	    && (rename (tmp, path) == 0)) {
+		err = 0;
+	}
+
+      out:
+	if (0 != err) {
+		(void) unlink (tmp);
+	}
+	free (tmp);
+	free (path);
+	return err;
+}
+
+/*
+ * move_journal_read - read the journal of an interrupted cross-device
+ *                     move of the home directory
+ *
+ *	If the journal of the new home directory was written for this
+ *	user, the old home directory and the ownership change are taken
+ *	from it, and the move is resumed.
+ *
+ *	Return true if the move shall be resumed.
+ */
+static bool move_journal_read (void)
+{
+	char *path = move_journal_path ();
+	char name[BUFSIZ];
+	char home[BUFSIZ];
+	char ids[128];
+	long old_uid, new_uid, old_gid, new_gid;
+	FILE *fp;
+	bool ok;
+
+	fp = fopen (path, "r");
+	free (path);
+	if (NULL == fp) {
+		return false;
+	}
+	ok =    (fgets (name, sizeof name, fp) == name)
+	     && (fgets (home, sizeof home, fp) == home)
+	     && (fgets (ids, sizeof ids, fp) == ids)
+	     && (sscanf (ids, "%ld %ld %ld %ld",
+	                 &old_uid, &new_uid, &old_gid, &new_gid) == 4);
+	(void) fclose (fp);
+	if (!ok) {
+		return false;
+	}
+	name[strcspn (name, "\n")] = '\0';
+	home[strcspn (home, "\n")] = '\0';
+	if ((strcmp (name, user_name) != 0) || ('/' != home[0])) {
+		return false;
+	}
+
+	user_home = xstrdup (home);
+	if (prefix[0]) {
+		size_t len = strlen (prefix) + strlen (user_home) + 2;
+		prefix_user_home = xmalloc (len);
+		(void) snprintf (prefix_user_home, len, "%s/%s",
+		                 prefix, user_home);
+	} else {
+		prefix_user_home = user_home;
+	}
+	move_old_uid = (uid_t) old_uid;
+	move_new_uid = (uid_t) new_uid;
+	move_old_gid = (gid_t) old_gid;
+	move_new_gid = (gid_t) new_gid;
+	move_resume = true;
+	return true;
+}
+
+/*
+ * move_journal_remove - remove the journal of a completed move
+ */
+static void move_journal_remove (void)
+{
+	char *path = move_journal_path ();
+
+	(void) unlink (path);
+	free (path);
+}
+
 /*
  * move_home - move the user's home directory
  *
  *	move_home() moves the user's home directory to a new location. The
  *	files will be copied if the directory cannot simply be renamed.
+ *
+ *	If MOVE_HOME_RESUME is set, an interrupted copy is kept with a
+ *	journal, and it is resumed by the next usermod -m -d for the same
+ *	home directory.
  */
 static void move_home (void)
 {
 	struct stat sb;
+	bool resumable = getdef_bool ("MOVE_HOME_RESUME");
+
+	if (!move_resume) {
+		move_old_uid = user_id;
+		move_new_uid = uflg ? user_newid : (uid_t)-1;
+		move_old_gid = user_gid;
+		move_new_gid = gflg ? user_newgid : (gid_t)-1;
+	}
 
-	if (access (prefix_user_newhome, F_OK) == 0) {
+	if (!move_resume && (access (prefix_user_newhome, F_OK) == 0)) {
 		/*
 		 * If the new home directory already exist, the user
 		 * should not use -m.
@@ -1798,13 +2167,16 @@ static void move_home (void)
 		}
 #endif
 
-		if (rename (prefix_user_home, prefix_user_newhome) == 0) {
+		if (   !move_resume
+		    && (rename (prefix_user_home, prefix_user_newhome) == 0)) {
 			/* FIXME: rename above may have broken symlinks
 			 *        pointing to the user's home directory
 			 *        with an absolute path. */
-			if (chown_tree (prefix_user_newhome,
-			                user_id,  uflg ? user_newid  : (uid_t)-1,
-			                user_gid, gflg ? user_newgid : (gid_t)-1) != 0) {
+			/* The tree is only walked if the IDs change */
+			if (   (uflg || gflg)
+			    && (chown_tree (prefix_user_newhome,
+			                    user_id,  uflg ? user_newid  : (uid_t)-1,
+			                    user_gid, gflg ? user_newgid : (gid_t)-1) != 0)) {
 				fprintf (stderr,
 				         _("%s: Failed to change ownership of the home directory"),
 				         Prog);
@@ -1818,18 +2190,51 @@ static void move_home (void)
 #endif
 			return;
 		} else {
-			if (EXDEV == errno) {
-				if (copy_tree (prefix_user_home, prefix_user_newhome, true,
-				               true,
-				               user_id,
-				               uflg ? user_newid : (uid_t)-1,
-				               user_gid,
-				               gflg ? user_newgid : (gid_t)-1) == 0) {
-					if (remove_tree (prefix_user_home, true) != 0) {
+			if (move_resume || (EXDEV == errno)) {
+				int err;
+
+				if (   resumable
+				    && !move_resume
+				    && (move_journal_write () != 0)) {
+					fprintf (stderr,
+					         _("%s: cannot record the move of %s: %s\n"),
+					         Prog, prefix_user_home,
+					         strerror (errno));
+					resumable = false;
+				}
+				if (progress_flg) {
+					tree_progress_start (report_copy, 1);
+				}
+				if (move_resume) {
+					err = copy_tree_resume (prefix_user_home,
+					                        prefix_user_newhome,
+					                        true,
+					                        move_old_uid,
+					                        move_new_uid,
+					                        move_old_gid,
+					                        move_new_gid);
+				} else {
+					err = copy_tree (prefix_user_home,
+					                 prefix_user_newhome, true,
+					                 true,
+					                 move_old_uid, move_new_uid,
+					                 move_old_gid, move_new_gid);
+				}
+				tree_progress_stop ();
+				if (0 == err) {
+					if (progress_flg) {
+						tree_progress_start (report_remove, 1);
+					}
+					err = remove_tree (prefix_user_home, true);
+					tree_progress_stop ();
+					if (0 != err) {
 						fprintf (stderr,
 						         _("%s: warning: failed to completely remove old home directory %s"),
 						         Prog, prefix_user_home);
 					}
+					if (resumable) {
+						move_journal_remove ();
+					}
 #ifdef WITH_AUDIT
 					audit_logger (AUDIT_USER_CHAUTHTOK,
 					              Prog,
@@ -1841,6 +2246,14 @@ static void move_home (void)
 					return;
 				}
 
+				if (resumable) {
+					fprintf (stderr,
+					         _("%s: the copy of %s to %s is kept, run %s -m -d %s %s again to resume it\n"),
+					         Prog, prefix_user_home,
+					         prefix_user_newhome, Prog,
+					         user_newhome, user_newname);
+					fail_exit (E_HOMEDIR);
+				}
 				(void) remove_tree (prefix_user_newhome, true);
 			}
 			fprintf (stderr,
@@ -1848,140 +2261,1112 @@ static void move_home (void)
 			         Prog, prefix_user_home, prefix_user_newhome);
 			fail_exit (E_HOMEDIR);
 		}
+	} else if (move_resume) {
+		/* The old home directory was already removed */
+		move_journal_remove ();
+	}
+}
+
+/*
+ * report_copy - report the progress of the copy of the home directory
+ */
+static void report_copy (const struct tree_progress *progress)
+{
+	double rate = 0.0;
+
+	if (progress->elapsed > 0) {
+		rate = (double) progress->bytes / (1024 * 1024) / progress->elapsed;
+	}
+	if (progress->done) {
+		fprintf (stderr,
+		         _("%s: copied %llu files, %llu MiB in %.1f s (%.1f MiB/s)\n"),
+		         Prog, progress->files, progress->bytes >> 20,
+		         progress->elapsed, rate);
+	} else {
+		fprintf (stderr,
+		         _("%s: copied %llu files, %llu MiB (%.1f MiB/s): %s\n"),
+		         Prog, progress->files, progress->bytes >> 20,
+		         rate, progress->path);
+	}
+}
+
+/*
+ * report_remove - report the progress of the removal of the old home
+ *                 directory
+ */
+static void report_remove (const struct tree_progress *progress)
+{
+	if (progress->done) {
+		fprintf (stderr, _("%s: removed %llu files in %.1f s\n"),
+		         Prog, progress->files, progress->elapsed);
+	} else {
+		fprintf (stderr, _("%s: removed %llu files: %s\n"),
+		         Prog, progress->files, progress->path);
 	}
 }
 
+/*
+ * get_uid_move - the move of the lastlog and faillog entries of the user
+ *
+ * The old entry is left alone in case the UID is still used by another
+ * user. Otherwise, it is cleared. If there is no entry for the old UID,
+ * the entry of the new UID is reset.
+ */
+static void get_uid_move (struct uid_move *move)
+{
+	move->from = (unsigned long) user_id;
+	move->to = (unsigned long) user_newid;
+	/* local, no need for xgetpwuid */
+	move->vacate = (prefix_getpwuid (user_id) == NULL);
+}
+
 /*
  * update_lastlog - update the lastlog file
  *
- * Relocate the "lastlog" entries for the user. The old entry is
- * left alone in case the UID was shared. It doesn't hurt anything
- * to just leave it be.
+ * Relocate the "lastlog" entry for the user.
  */
 static void update_lastlog (void)
 {
-	struct lastlog ll;
-	int fd;
-	off_t off_uid = (off_t) user_id * sizeof ll;
-	off_t off_newuid = (off_t) user_newid * sizeof ll;
+	struct log_file lf = LOG_FILE_INIT (LASTLOG_FILE);
+	struct uid_move move;
 	uid_t max_uid;
 
-	if (access (LASTLOG_FILE, F_OK) != 0) {
-		return;
-	}
-
 	max_uid = (uid_t) getdef_ulong ("LASTLOG_MAX_UID", 0xFFFFFFFFUL);
 	if (user_newid > max_uid) {
 		/* do not touch lastlog for large uids */
 		return;
 	}
 
-	fd = open (LASTLOG_FILE, O_RDWR);
-
-	if (-1 == fd) {
+	get_uid_move (&move);
+	if (   (log_records_move (&lf, &move, 1, sizeof (struct lastlog)) != 0)
+	    || (log_file_close (&lf) != 0)) {
 		fprintf (stderr,
 		         _("%s: failed to copy the lastlog entry of user %lu to user %lu: %s\n"),
 		         Prog, (unsigned long) user_id, (unsigned long) user_newid, strerror (errno));
-		return;
-	}
-
-	if (   (lseek (fd, off_uid, SEEK_SET) == off_uid)
-	    && (read (fd, &ll, sizeof ll) == (ssize_t) sizeof ll)) {
-		/* Copy the old entry to its new location */
-		if (   (lseek (fd, off_newuid, SEEK_SET) != off_newuid)
-		    || (write (fd, &ll, sizeof ll) != (ssize_t) sizeof ll)
-		    || (fsync (fd) != 0)
-		    || (close (fd) != 0)) {
-			fprintf (stderr,
-			         _("%s: failed to copy the lastlog entry of user %lu to user %lu: %s\n"),
-			         Prog, (unsigned long) user_id, (unsigned long) user_newid, strerror (errno));
-		}
-	} else {
-		/* Assume lseek or read failed because there is
-		 * no entry for the old UID */
-
-		/* Check if the new UID already has an entry */
-		if (   (lseek (fd, off_newuid, SEEK_SET) == off_newuid)
-		    && (read (fd, &ll, sizeof ll) == (ssize_t) sizeof ll)) {
-			/* Reset the new uid's lastlog entry */
-			memzero (&ll, sizeof (ll));
-			if (   (lseek (fd, off_newuid, SEEK_SET) != off_newuid)
-			    || (write (fd, &ll, sizeof ll) != (ssize_t) sizeof ll)
-			    || (fsync (fd) != 0)
-			    || (close (fd) != 0)) {
-				fprintf (stderr,
-				         _("%s: failed to copy the lastlog entry of user %lu to user %lu: %s\n"),
-				         Prog, (unsigned long) user_id, (unsigned long) user_newid, strerror (errno));
-			}
-		} else {
-			(void) close (fd);
-		}
+		(void) log_file_close (&lf);
 	}
 }
 
 /*
  * update_faillog - update the faillog file
  *
- * Relocate the "faillog" entries for the user. The old entry is
- * left alone in case the UID was shared. It doesn't hurt anything
- * to just leave it be.
+ * Relocate the "faillog" entry for the user.
  */
 static void update_faillog (void)
 {
-	struct faillog fl;
-	int fd;
-	off_t off_uid = (off_t) user_id * sizeof fl;
-	off_t off_newuid = (off_t) user_newid * sizeof fl;
-
-	if (access (FAILLOG_FILE, F_OK) != 0) {
-		return;
-	}
+	struct log_file lf = LOG_FILE_INIT (FAILLOG_FILE);
+	struct uid_move move;
 
-	fd = open (FAILLOG_FILE, O_RDWR);
-
-	if (-1 == fd) {
+	get_uid_move (&move);
+	if (   (log_records_move (&lf, &move, 1, sizeof (struct faillog)) != 0)
+	    || (log_file_close (&lf) != 0)) {
 		fprintf (stderr,
 		         _("%s: failed to copy the faillog entry of user %lu to user %lu: %s\n"),
 		         Prog, (unsigned long) user_id, (unsigned long) user_newid, strerror (errno));
-		return;
+		(void) log_file_close (&lf);
 	}
+}
 
-	if (   (lseek (fd, off_uid, SEEK_SET) == off_uid)
-	    && (read (fd, (char *) &fl, sizeof fl) == (ssize_t) sizeof fl)) {
-		/* Copy the old entry to its new location */
-		if (   (lseek (fd, off_newuid, SEEK_SET) != off_newuid)
-		    || (write (fd, &fl, sizeof fl) != (ssize_t) sizeof fl)
-		    || (fsync (fd) != 0)
-		    || (close (fd) != 0)) {
+/*
+ * add_move - add the move of from to to at the end of list
+ */
+static void add_move (struct move_list *list, unsigned long from,
+                      unsigned long to)
+{
+	if (list->count == list->size) {
+		list->size = (0 == list->size) ? 64 : list->size * 2;
+		list->moves = realloc (list->moves,
+		                       list->size * sizeof (struct uid_move));
+		if (NULL == list->moves) {
 			fprintf (stderr,
-			         _("%s: failed to copy the faillog entry of user %lu to user %lu: %s\n"),
-			         Prog, (unsigned long) user_id, (unsigned long) user_newid, strerror (errno));
-		}
-	} else {
-		/* Assume lseek or read failed because there is
-		 * no entry for the old UID */
-
-		/* Check if the new UID already has an entry */
-		if (   (lseek (fd, off_newuid, SEEK_SET) == off_newuid)
-		    && (read (fd, &fl, sizeof fl) == (ssize_t) sizeof fl)) {
-			/* Reset the new uid's faillog entry */
-			memzero (&fl, sizeof (fl));
-			if (   (lseek (fd, off_newuid, SEEK_SET) != off_newuid)
-			    || (write (fd, &fl, sizeof fl) != (ssize_t) sizeof fl)
-			    || (close (fd) != 0)) {
-				fprintf (stderr,
-				         _("%s: failed to copy the faillog entry of user %lu to user %lu: %s\n"),
-				         Prog, (unsigned long) user_id, (unsigned long) user_newid, strerror (errno));
-			}
-		} else {
-			(void) close (fd);
+			         _("%s: failed to allocate memory: %s\n"),
+			         Prog, strerror (errno));
+			fail_exit (E_PW_UPDATE);
 		}
 	}
+	list->moves[list->count].from = from;
+	list->moves[list->count].to = to;
+	/* nobody keeps the old ID, see check_moves() */
+	list->moves[list->count].vacate = true;
+	list->count++;
 }
 
-#ifndef NO_MOVE_MAILBOX
 /*
- * This is the new and improved code to carefully chown/rename the user's
+ * read_renumber_file - read the moves of the mapping file of --renumber
+ *
+ *	Each line is either "user:OLD_UID:NEW_UID" or
+ *	"group:OLD_GID:NEW_GID". Empty lines and lines starting with '#'
+ *	are ignored.
+ */
+static void read_renumber_file (struct move_list *uids,
+                                struct move_list *gids)
+{
+	char buf[BUFSIZ];
+	unsigned long line = 0;
+	FILE *fp;
+
+	if (strcmp (renumber_file, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen (renumber_file, "r");
+		if (NULL == fp) {
+			fprintf (stderr, _("%s: cannot open %s: %s\n"),
+			         Prog, renumber_file, strerror (errno));
+			exit (E_BAD_ARG);
+		}
+	}
+
+	while (fgets (buf, (int) sizeof buf, fp) == buf) {
+		char *fields[3];
+		char *cp;
+		uid_t old_uid, new_uid;
+		gid_t old_gid, new_gid;
+
+		line++;
+		cp = strchr (buf, '\n');
+		if (NULL != cp) {
+			*cp = '\0';
+		} else if (!feof (fp)) {
+			fprintf (stderr, _("%s: %s: line %lu: line too long\n"),
+			         Prog, renumber_file, line);
+			exit (E_BAD_ARG);
+		}
+		if (('\0' == buf[0]) || ('#' == buf[0])) {
+			continue;
+		}
+
+		if (   (split_fields (buf, ':', fields, 3) != 3)
+		    || (   (strcmp (fields[0], "user") != 0)
+		        && (strcmp (fields[0], "group") != 0))) {
+			fprintf (stderr, _("%s: %s: line %lu: invalid line\n"),
+			         Prog, renumber_file, line);
+			exit (E_BAD_ARG);
+		}
+		if (strcmp (fields[0], "user") == 0) {
+			if (   (get_uid (fields[1], &old_uid) == 0)
+			    || (get_uid (fields[2], &new_uid) == 0)) {
+				fprintf (stderr,
+				         _("%s: %s: line %lu: invalid user ID\n"),
+				         Prog, renumber_file, line);
+				exit (E_BAD_ARG);
+			}
+			add_move (uids, (unsigned long) old_uid,
+			          (unsigned long) new_uid);
+		} else {
+			if (   (get_gid (fields[1], &old_gid) == 0)
+			    || (get_gid (fields[2], &new_gid) == 0)) {
+				fprintf (stderr,
+				         _("%s: %s: line %lu: invalid group ID\n"),
+				         Prog, renumber_file, line);
+				exit (E_BAD_ARG);
+			}
+			add_move (gids, (unsigned long) old_gid,
+			          (unsigned long) new_gid);
+		}
+	}
+
+	if (stdin != fp) {
+		(void) fclose (fp);
+	}
+}
+
+static int move_cmp (const void *p1, const void *p2)
+{
+	const struct uid_move *m1 = p1;
+	const struct uid_move *m2 = p2;
+
+	return (m1->from > m2->from) - (m1->from < m2->from);
+}
+
+static int move_to_cmp (const void *p1, const void *p2)
+{
+	const struct uid_move *m1 = p1;
+	const struct uid_move *m2 = p2;
+
+	return (m1->to > m2->to) - (m1->to < m2->to);
+}
+
+/*
+ * check_moves - check the moves of the users (or of the groups)
+ *
+ *	The moves are sorted by their old ID. An ID can only be moved once,
+ *	two IDs cannot be moved to the same ID, and an ID cannot be moved
+ *	to an ID which is used or moved. This makes the order of the moves
+ *	irrelevant.
+ *
+ *	The files must be open.
+ */
+static void check_moves (struct move_list *list, bool uids)
+{
+	struct uid_move *by_to;
+	size_t i;
+
+	if (0 == list->count) {
+		return;
+	}
+	qsort (list->moves, list->count, sizeof (struct uid_move), move_cmp);
+
+	by_to = (struct uid_move *)
+	        xmalloc (list->count * sizeof (struct uid_move));
+	memcpy (by_to, list->moves, list->count * sizeof (struct uid_move));
+	qsort (by_to, list->count, sizeof (struct uid_move), move_to_cmp);
+
+	for (i = 0; i < list->count; i++) {
+		unsigned long from = list->moves[i].from;
+		unsigned long to = by_to[i].to;
+
+		if ((i > 0) && (list->moves[i - 1].from == from)) {
+			fprintf (stderr,
+			         uids ? _("%s: UID '%lu' is renumbered more than once\n")
+			              : _("%s: GID '%lu' is renumbered more than once\n"),
+			         Prog, from);
+			fail_exit (E_BAD_ARG);
+		}
+		if (   ((i > 0) && (by_to[i - 1].to == to))
+		    || (chown_map_find (list->moves, list->count, to) != NULL)) {
+			fprintf (stderr,
+			         uids ? _("%s: UID '%lu' is the new UID of more than one move\n")
+			              : _("%s: GID '%lu' is the new GID of more than one move\n"),
+			         Prog, to);
+			fail_exit (E_BAD_ARG);
+		}
+		if (uids && (pw_locate_uid ((uid_t) to) != NULL)) {
+			fprintf (stderr,
+			         _("%s: UID '%lu' already exists\n"),
+			         Prog, to);
+			fail_exit (E_UID_IN_USE);
+		}
+		if (!uids && (gr_locate_gid ((gid_t) to) != NULL)) {
+			fprintf (stderr,
+			         _("%s: GID '%lu' already exists\n"),
+			         Prog, to);
+			fail_exit (E_BAD_ARG);
+		}
+	}
+
+	free (by_to);
+}
+
+static int home_cmp (const void *p1, const void *p2)
+{
+	return strcmp (*(char *const *) p1, *(char *const *) p2);
+}
+
+/*
+ * home_nested - check if one of the parent directories of home is in the
+ *               n sorted homes
+ */
+static bool home_nested (char *const *homes, size_t n, const char *home)
+{
+	char *parent = xstrdup (home);
+	char *cp;
+	bool nested = false;
+
+	while (   !nested
+	       && (NULL != (cp = strrchr (parent, '/')))
+	       && (cp != parent)) {
+		*cp = '\0';
+		nested = (bsearch (&parent, homes, n, sizeof (char *),
+		                   home_cmp) != NULL);
+	}
+
+	free (parent);
+	return nested;
+}
+
+/*
+ * renumber_homes - fill jobs with the home directories of the renumbered
+ *                  users which need their files changed
+ *
+ *	A home directory is changed if it is owned by the old or the new UID
+ *	of its user. The same directory, or a directory inside another one,
+ *	is only walked once.
+ *
+ *	It returns the number of jobs.
+ */
+static size_t renumber_homes (struct renumbered_user *users, size_t count,
+                              struct chown_job *jobs,
+                              const struct chown_map *map)
+{
+	char **homes;
+	size_t nhomes = 0;
+	size_t njobs = 0;
+	size_t i;
+
+	homes = (char **) xmalloc ((count + 1) * sizeof (char *));
+	for (i = 0; i < count; i++) {
+		struct stat sb;
+
+		if (   (stat (users[i].home, &sb) == 0)
+		    && (   (sb.st_uid == users[i].old_uid)
+		        || (sb.st_uid == users[i].new_uid))) {
+			homes[nhomes] = users[i].home;
+			nhomes++;
+		}
+	}
+	qsort (homes, nhomes, sizeof (char *), home_cmp);
+
+	for (i = 0; i < nhomes; i++) {
+		if (   ((i > 0) && (strcmp (homes[i - 1], homes[i]) == 0))
+		    || home_nested (homes, nhomes, homes[i])) {
+			continue;
+		}
+		memset (&jobs[njobs], 0, sizeof jobs[njobs]);
+		jobs[njobs].root = homes[i];
+		jobs[njobs].map = map;
+		njobs++;
+	}
+
+	free (homes);
+	return njobs;
+}
+
+/*
+ * renumber_logs - move the lastlog and faillog records of the renumbered
+ *                 users
+ */
+static void renumber_logs (const struct move_list *uids)
+{
+	struct log_file lastlog = LOG_FILE_INIT (LASTLOG_FILE);
+	struct log_file faillog = LOG_FILE_INIT (FAILLOG_FILE);
+	struct uid_move *moves;
+	size_t nmoves = 0;
+	size_t i;
+	unsigned long max_uid;
+
+	if (0 == uids->count) {
+		return;
+	}
+
+	/* do not touch lastlog for large uids */
+	max_uid = getdef_ulong ("LASTLOG_MAX_UID", 0xFFFFFFFFUL);
+	moves = (struct uid_move *)
+	        xmalloc (uids->count * sizeof (struct uid_move));
+	for (i = 0; i < uids->count; i++) {
+		if (uids->moves[i].to <= max_uid) {
+			moves[nmoves] = uids->moves[i];
+			nmoves++;
+		}
+	}
+	if (   (nmoves > 0)
+	    && (   (log_records_move (&lastlog, moves, nmoves,
+	                              sizeof (struct lastlog)) != 0)
+	        || (log_file_close (&lastlog) != 0))) {
+		fprintf (stderr,
+		         _("%s: failed to move the lastlog entries: %s\n"),
+		         Prog, strerror (errno));
+		(void) log_file_close (&lastlog);
+	}
+	free (moves);
+
+	if (   (log_records_move (&faillog, uids->moves, uids->count,
+	                          sizeof (struct faillog)) != 0)
+	    || (log_file_close (&faillog) != 0)) {
+		fprintf (stderr,
+		         _("%s: failed to move the faillog entries: %s\n"),
+		         Prog, strerror (errno));
+		(void) log_file_close (&faillog);
+	}
+}
+
+/*
+ * set_user_ids - set the UID and GID of a passwd entry (see pw_modify)
+ */
+static void set_user_ids (void *ent, void *arg)
+{
+	struct passwd *pw = ent;
+	const struct passwd *ids = arg;
+
+	pw->pw_uid = ids->pw_uid;
+	pw->pw_gid = ids->pw_gid;
+}
+
+/*
+ * set_group_id - set the GID of a group entry (see gr_modify)
+ */
+static void set_group_id (void *ent, void *arg)
+{
+	struct group *gr = ent;
+
+	gr->gr_gid = *(const gid_t *) arg;
+}
+
+/*
+ * renumber - change the UIDs and GIDs listed in the file of --renumber
+ *
+ *	All the passwd and group entries are changed while the files are
+ *	locked, and written at once. Then the mailboxes, the lastlog and
+ *	faillog records, and the home directories follow. The home
+ *	directories are walked together, with all the moves.
+ */
+static int renumber (void)
+{
+	struct move_list uids = { NULL, 0, 0 };
+	struct move_list gids = { NULL, 0, 0 };
+	struct renumbered_user *users;
+	size_t npws = 0;
+	size_t i;
+	const struct passwd *pwd;
+	const struct group *grp;
+	struct chown_map map;
+	struct chown_job *jobs;
+	size_t njobs;
+
+#ifdef WITH_TCB
+	if (getdef_bool ("USE_TCB")) {
+		fprintf (stderr,
+		         _("%s: --renumber cannot be used with USE_TCB\n"),
+		         Prog);
+		exit (E_USAGE);
+	}
+#endif				/* WITH_TCB */
+
+	read_renumber_file (&uids, &gids);
+	if ((0 == uids.count) && (0 == gids.count)) {
+		return E_SUCCESS;
+	}
+
+	open_files ();
+	check_moves (&uids, true);
+	check_moves (&gids, false);
+#ifdef WITH_AUDIT
+	/* The records of the changes are sent once they are written */
+	audit_logger_begin ();
+#endif				/* WITH_AUDIT */
+
+	/*
+	 * Only the IDs change: the entries are changed in place, during
+	 * the walks.
+	 */
+	(void) pw_rewind ();
+	while ((pwd = pw_next ()) != NULL) {
+		npws++;
+	}
+	users = (struct renumbered_user *)
+	        xmalloc ((npws + 1) * sizeof (struct renumbered_user));
+	npws = 0;
+	(void) pw_rewind ();
+	while ((pwd = pw_next ()) != NULL) {
+		const struct uid_move *mu, *mg;
+		struct passwd ids;
+		size_t len;
+
+		mu = chown_map_find (uids.moves, uids.count,
+		                     (unsigned long) pwd->pw_uid);
+		mg = chown_map_find (gids.moves, gids.count,
+		                     (unsigned long) pwd->pw_gid);
+		if ((NULL == mu) && (NULL == mg)) {
+			continue;
+		}
+
+		users[npws].name = xstrdup (pwd->pw_name);
+		users[npws].old_uid = pwd->pw_uid;
+		users[npws].new_uid = pwd->pw_uid;
+		len = strlen (prefix) + strlen (pwd->pw_dir) + 2;
+		users[npws].home = xmalloc (len);
+		if ('\0' != prefix[0]) {
+			(void) snprintf (users[npws].home, len, "%s/%s",
+			                 prefix, pwd->pw_dir);
+		} else {
+			(void) snprintf (users[npws].home, len, "%s",
+			                 pwd->pw_dir);
+		}
+
+		ids.pw_uid = pwd->pw_uid;
+		ids.pw_gid = pwd->pw_gid;
+		if (NULL != mu) {
+			/* Note: no need to check if a prefix is specified */
+			if (   ('\0' == prefix[0])
+			    && (user_busy (pwd->pw_name, pwd->pw_uid) != 0)) {
+				fail_exit (E_USER_BUSY);
+			}
+#ifdef WITH_AUDIT
+			audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+			              "changing uid",
+			              pwd->pw_name, (unsigned int) mu->to, 1);
+#endif				/* WITH_AUDIT */
+			SYSLOG ((LOG_INFO,
+			         "change user '%s' UID from '%d' to '%d'",
+			         pwd->pw_name, pwd->pw_uid, (uid_t) mu->to));
+			ids.pw_uid = (uid_t) mu->to;
+			users[npws].new_uid = ids.pw_uid;
+		}
+		if (NULL != mg) {
+#ifdef WITH_AUDIT
+			audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+			              "changing primary group",
+			              pwd->pw_name, (unsigned int) ids.pw_uid, 1);
+#endif				/* WITH_AUDIT */
+			SYSLOG ((LOG_INFO,
+			         "change user '%s' GID from '%d' to '%d'",
+			         pwd->pw_name, pwd->pw_gid, (gid_t) mg->to));
+			ids.pw_gid = (gid_t) mg->to;
+		}
+		npws++;
+
+		if (pw_modify (pwd->pw_name, set_user_ids, &ids) == 0) {
+			fprintf (stderr,
+			         _("%s: failed to prepare the new %s entry '%s'\n"),
+			         Prog, pw_dbname (), pwd->pw_name);
+			fail_exit (E_PW_UPDATE);
+		}
+	}
+
+	(void) gr_rewind ();
+	while ((grp = gr_next ()) != NULL) {
+		const struct uid_move *m;
+		gid_t gid;
+
+		m = chown_map_find (gids.moves, gids.count,
+		                    (unsigned long) grp->gr_gid);
+		if (NULL == m) {
+			continue;
+		}
+#ifdef WITH_AUDIT
+		audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+		              "changing group id",
+		              grp->gr_name, (unsigned int) m->to, 1);
+#endif				/* WITH_AUDIT */
+		SYSLOG ((LOG_INFO,
+		         "change group '%s' GID from '%lu' to '%lu'",
+		         grp->gr_name, (unsigned long) grp->gr_gid, m->to));
+		gid = (gid_t) m->to;
+		if (gr_modify (grp->gr_name, set_group_id, &gid) == 0) {
+			fprintf (stderr,
+			         _("%s: failed to prepare the new %s entry '%s'\n"),
+			         Prog, gr_dbname (), grp->gr_name);
+			fail_exit (E_GRP_UPDATE);
+		}
+	}
+
+	close_files ();
+#ifdef WITH_AUDIT
+	audit_logger_commit ();
+#endif				/* WITH_AUDIT */
+
+	cache_flush_defer (CACHE_DB_PASSWD | CACHE_DB_GROUP);
+
+#ifndef NO_MOVE_MAILBOX
+	/* move_mailbox() works on the globals of a single user */
+	uflg = true;
+	for (i = 0; i < npws; i++) {
+		if (users[i].old_uid == users[i].new_uid) {
+			continue;
+		}
+		user_name = users[i].name;
+		user_newname = users[i].name;
+		user_id = users[i].old_uid;
+		user_newid = users[i].new_uid;
+		move_mailbox ();
+	}
+#endif				/* NO_MOVE_MAILBOX */
+
+	renumber_logs (&uids);
+
+	map.uids = uids.moves;
+	map.nuids = uids.count;
+	map.gids = gids.moves;
+	map.ngids = gids.count;
+	jobs = (struct chown_job *)
+	       xmalloc ((npws + 1) * sizeof (struct chown_job));
+	njobs = renumber_homes (users, npws, jobs, &map);
+	if ((njobs > 0) && (chown_trees (jobs, njobs) != 0)) {
+		fprintf (stderr,
+		         _("%s: Failed to change ownership of the home directories\n"),
+		         Prog);
+		fail_exit (E_HOMEDIR);
+	}
+
+	free (jobs);
+	for (i = 0; i < npws; i++) {
+		free (users[i].name);
+		free (users[i].home);
+	}
+	free (users);
+	free (uids.moves);
+	free (gids.moves);
+
+	return E_SUCCESS;
+}
+
+/*
+ * read_rename_file - read the users of the mapping file of --rename
+ *
+ *	Each line is "OLD_LOGIN:NEW_LOGIN". Empty lines and lines starting
+ *	with '#' are ignored.
+ */
+static void read_rename_file (struct rename_list *list)
+{
+	char buf[BUFSIZ];
+	unsigned long line = 0;
+	FILE *fp;
+
+	if (strcmp (rename_file, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen (rename_file, "r");
+		if (NULL == fp) {
+			fprintf (stderr, _("%s: cannot open %s: %s\n"),
+			         Prog, rename_file, strerror (errno));
+			exit (E_BAD_ARG);
+		}
+	}
+
+	while (fgets (buf, (int) sizeof buf, fp) == buf) {
+		char *fields[2];
+		char *cp;
+		struct renamed_user *u;
+
+		line++;
+		cp = strchr (buf, '\n');
+		if (NULL != cp) {
+			*cp = '\0';
+		} else if (!feof (fp)) {
+			fprintf (stderr, _("%s: %s: line %lu: line too long\n"),
+			         Prog, rename_file, line);
+			exit (E_BAD_ARG);
+		}
+		if (('\0' == buf[0]) || ('#' == buf[0])) {
+			continue;
+		}
+
+		if (   (split_fields (buf, ':', fields, 2) != 2)
+		    || ('\0' == fields[0][0])) {
+			fprintf (stderr, _("%s: %s: line %lu: invalid line\n"),
+			         Prog, rename_file, line);
+			exit (E_BAD_ARG);
+		}
+		if (!is_valid_user_name (fields[1])) {
+			fprintf (stderr,
+			         _("%s: %s: line %lu: invalid user name '%s'\n"),
+			         Prog, rename_file, line, fields[1]);
+			exit (E_BAD_ARG);
+		}
+
+		if (list->count == list->size) {
+			list->size = (0 == list->size) ? 64 : list->size * 2;
+			list->users = realloc (list->users,
+			                       list->size * sizeof (struct renamed_user));
+			if (NULL == list->users) {
+				fprintf (stderr,
+				         _("%s: failed to allocate memory: %s\n"),
+				         Prog, strerror (errno));
+				exit (E_PW_UPDATE);
+			}
+		}
+		u = &list->users[list->count];
+		memset (u, 0, sizeof *u);
+		u->old_name = xstrdup (fields[0]);
+		u->new_name = xstrdup (fields[1]);
+		list->count++;
+	}
+
+	if (stdin != fp) {
+		(void) fclose (fp);
+	}
+}
+
+static int rename_cmp (const void *p1, const void *p2)
+{
+	const struct renamed_user *u1 = p1;
+	const struct renamed_user *u2 = p2;
+
+	return strcmp (u1->old_name, u2->old_name);
+}
+
+static int rename_new_cmp (const void *p1, const void *p2)
+{
+	const struct renamed_user *const *u1 = p1;
+	const struct renamed_user *const *u2 = p2;
+
+	return strcmp ((*u1)->new_name, (*u2)->new_name);
+}
+
+/*
+ * renamed - the new name of name, or NULL if it is not renamed
+ *
+ *	The users of the list are sorted by their old name.
+ */
+static /*@null@*/const char *renamed (const struct rename_list *list,
+                                      const char *name)
+{
+	struct renamed_user key;
+	const struct renamed_user *u;
+
+	key.old_name = (char *) name;
+	u = bsearch (&key, list->users, list->count,
+	             sizeof (struct renamed_user), rename_cmp);
+	return (NULL != u) ? u->new_name : NULL;
+}
+
+/*
+ * check_renames - check the users of --rename
+ *
+ *	The users are sorted by their old name. A user can only be renamed
+ *	once, two users cannot get the same name, and a user cannot get the
+ *	name of a user which exists, even if it is renamed. This makes the
+ *	order of the renames irrelevant.
+ *
+ *	The files must be open.
+ */
+static void check_renames (struct rename_list *list)
+{
+	struct renamed_user **by_new;
+	size_t i;
+
+	qsort (list->users, list->count, sizeof (struct renamed_user),
+	       rename_cmp);
+
+	by_new = (struct renamed_user **)
+	         xmalloc (list->count * sizeof (struct renamed_user *));
+	for (i = 0; i < list->count; i++) {
+		by_new[i] = &list->users[i];
+	}
+	qsort (by_new, list->count, sizeof (struct renamed_user *),
+	       rename_new_cmp);
+
+	for (i = 0; i < list->count; i++) {
+		struct renamed_user *u = &list->users[i];
+		const char *new_name = by_new[i]->new_name;
+		const struct passwd *pwd;
+
+		if (   (i > 0)
+		    && (strcmp (list->users[i - 1].old_name, u->old_name) == 0)) {
+			fprintf (stderr,
+			         _("%s: user '%s' is renamed more than once\n"),
+			         Prog, u->old_name);
+			fail_exit (E_BAD_ARG);
+		}
+		if ((i > 0) && (strcmp (by_new[i - 1]->new_name, new_name) == 0)) {
+			fprintf (stderr,
+			         _("%s: '%s' is the new name of more than one user\n"),
+			         Prog, new_name);
+			fail_exit (E_BAD_ARG);
+		}
+		if (pw_locate (new_name) != NULL) {
+			fprintf (stderr,
+			         _("%s: user '%s' already exists in %s\n"),
+			         Prog, new_name, pw_dbname ());
+			fail_exit (E_NAME_IN_USE);
+		}
+		pwd = pw_locate (u->old_name);
+		if (NULL == pwd) {
+			fprintf (stderr,
+			         _("%s: user '%s' does not exist in %s\n"),
+			         Prog, u->old_name, pw_dbname ());
+			fail_exit (E_NOTFOUND);
+		}
+		u->uid = pwd->pw_uid;
+	}
+
+	free (by_new);
+}
+
+/*
+ * rename_members - the members with their new names
+ *
+ *	It returns a new list (the names are not copied), or NULL if none
+ *	of the members is renamed.
+ */
+static /*@null@*/char **rename_members (const struct rename_list *list,
+                                        char *const *members)
+{
+	char **renamed_members;
+	bool changed = false;
+	size_t n, i;
+
+	for (n = 0; NULL != members[n]; n++) {
+		changed = changed || (renamed (list, members[n]) != NULL);
+	}
+	if (!changed) {
+		return NULL;
+	}
+
+	renamed_members = (char **) xmalloc ((n + 1) * sizeof (char *));
+	for (i = 0; i < n; i++) {
+		const char *new_name = renamed (list, members[i]);
+
+		renamed_members[i] = (NULL != new_name) ? (char *) new_name
+		                                        : members[i];
+	}
+	renamed_members[n] = NULL;
+	return renamed_members;
+}
+
+/*
+ * rename_home - follow the new name in the home directory of a user
+ *
+ *	With -m, a home directory named after the old login is renamed
+ *	after the new login, in the same directory. The new directory must
+ *	not exist. The directory itself is renamed by rename_users(), once
+ *	the files are written.
+ */
+static void rename_home (struct renamed_user *u, struct passwd *pwent)
+{
+	const char *base;
+	char *dir;
+	size_t len;
+
+	base = strrchr (pwent->pw_dir, '/');
+	if (   !mflg
+	    || (NULL == base)
+	    || (base == pwent->pw_dir)
+	    || (strcmp (base + 1, u->old_name) != 0)) {
+		return;
+	}
+
+	len = (size_t) (base - pwent->pw_dir) + strlen (u->new_name) + 2;
+	dir = xmalloc (len);
+	(void) snprintf (dir, len, "%.*s/%s",
+	                 (int) (base - pwent->pw_dir), pwent->pw_dir,
+	                 u->new_name);
+
+	len = strlen (prefix) + strlen (pwent->pw_dir) + 2;
+	u->home = xmalloc (len);
+	len = strlen (prefix) + strlen (dir) + 2;
+	u->new_home = xmalloc (len);
+	if ('\0' != prefix[0]) {
+		(void) sprintf (u->home, "%s/%s", prefix, pwent->pw_dir);
+		(void) sprintf (u->new_home, "%s/%s", prefix, dir);
+	} else {
+		(void) strcpy (u->home, pwent->pw_dir);
+		(void) strcpy (u->new_home, dir);
+	}
+	if (access (u->new_home, F_OK) == 0) {
+		fprintf (stderr,
+		         _("%s: directory %s exists\n"),
+		         Prog, dir);
+		fail_exit (E_HOMEDIR);
+	}
+	pwent->pw_dir = dir;
+}
+
+/*
+ * rename_users - rename the users listed in the file of --rename
+ *
+ *	The passwd and shadow entries are renamed one by one, and the
+ *	members and administrators of all the groups are then renamed in a
+ *	single walk of group and gshadow. All the changes are written at
+ *	once. Then the mailboxes and, with -m, the home directories
+ *	follow.
+ */
+static int rename_users (void)
+{
+	struct rename_list list = { NULL, 0, 0 };
+	const struct group *grp;
+#ifdef SHADOWGRP
+	const struct sgrp *sgrp;
+#endif				/* SHADOWGRP */
+	bool home_failed = false;
+	size_t i;
+
+#ifdef WITH_TCB
+	if (getdef_bool ("USE_TCB")) {
+		fprintf (stderr,
+		         _("%s: --rename cannot be used with USE_TCB\n"),
+		         Prog);
+		exit (E_USAGE);
+	}
+#endif				/* WITH_TCB */
+
+	read_rename_file (&list);
+	if (0 == list.count) {
+		return E_SUCCESS;
+	}
+
+	open_files ();
+	check_renames (&list);
+#ifdef WITH_AUDIT
+	/* The records of the changes are sent once they are written */
+	audit_logger_begin ();
+#endif				/* WITH_AUDIT */
+
+	for (i = 0; i < list.count; i++) {
+		struct renamed_user *u = &list.users[i];
+		struct passwd pwent;
+		struct spwd spent;
+		const struct spwd *spwd = NULL;
+
+		/* Note: no need to check if a prefix is specified */
+		if (   ('\0' == prefix[0])
+		    && (user_busy (u->old_name, u->uid) != 0)) {
+			fail_exit (E_USER_BUSY);
+		}
+
+		pwent = *pw_locate (u->old_name);
+		pwent.pw_name = u->new_name;
+		rename_home (u, &pwent);
+#ifdef WITH_AUDIT
+		audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+		              "changing name",
+		              u->new_name, (unsigned int) u->uid, 1);
+#endif				/* WITH_AUDIT */
+		SYSLOG ((LOG_INFO, "change user name '%s' to '%s'",
+		         u->old_name, u->new_name));
+		if (NULL != u->home) {
+#ifdef WITH_AUDIT
+			audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+			              "changing home directory",
+			              u->new_name, (unsigned int) u->uid, 1);
+#endif				/* WITH_AUDIT */
+			SYSLOG ((LOG_INFO,
+			         "change user '%s' home from '%s' to '%s'",
+			         u->new_name, u->home, u->new_home));
+		}
+		if (pw_update (&pwent) == 0) {
+			fprintf (stderr,
+			         _("%s: failed to prepare the new %s entry '%s'\n"),
+			         Prog, pw_dbname (), pwent.pw_name);
+			fail_exit (E_PW_UPDATE);
+		}
+		if (pw_remove (u->old_name) == 0) {
+			fprintf (stderr,
+			         _("%s: cannot remove entry '%s' from %s\n"),
+			         Prog, u->old_name, pw_dbname ());
+			fail_exit (E_PW_UPDATE);
+		}
+
+		if (is_shadow_pwd) {
+			spwd = spw_locate (u->old_name);
+		}
+		if (NULL == spwd) {
+			continue;
+		}
+		spent = *spwd;
+		spent.sp_namp = u->new_name;
+		if (spw_update (&spent) == 0) {
+			fprintf (stderr,
+			         _("%s: failed to prepare the new %s entry '%s'\n"),
+			         Prog, spw_dbname (), spent.sp_namp);
+			fail_exit (E_PW_UPDATE);
+		}
+		if (spw_remove (u->old_name) == 0) {
+			fprintf (stderr,
+			         _("%s: cannot remove entry '%s' from %s\n"),
+			         Prog, u->old_name, spw_dbname ());
+			fail_exit (E_PW_UPDATE);
+		}
+	}
+
+	/*
+	 * The groups are walked once, whatever the number of renamed
+	 * users. An updated entry stays in place: the walk continues
+	 * after it.
+	 */
+	(void) gr_rewind ();
+	while ((grp = gr_next ()) != NULL) {
+		struct group ngrp;
+		char **members;
+
+		members = rename_members (&list, grp->gr_mem);
+		if (NULL == members) {
+			continue;
+		}
+#ifdef WITH_AUDIT
+		audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+		              "changing group member",
+		              grp->gr_name, AUDIT_NO_ID, 1);
+#endif				/* WITH_AUDIT */
+		SYSLOG ((LOG_INFO, "change the renamed members of group '%s'",
+		         grp->gr_name));
+		ngrp = *grp;
+		ngrp.gr_mem = members;
+		if (gr_update (&ngrp) == 0) {
+			fprintf (stderr,
+			         _("%s: failed to prepare the new %s entry '%s'\n"),
+			         Prog, gr_dbname (), ngrp.gr_name);
+			fail_exit (E_GRP_UPDATE);
+		}
+		free (members);
+	}
+
+#ifdef SHADOWGRP
+	if (is_shadow_grp) {
+		(void) sgr_rewind ();
+		while ((sgrp = sgr_next ()) != NULL) {
+			struct sgrp nsgrp;
+			char **members;
+			char **admins;
+
+			members = rename_members (&list, sgrp->sg_mem);
+			admins = rename_members (&list, sgrp->sg_adm);
+			if ((NULL == members) && (NULL == admins)) {
+				continue;
+			}
+#ifdef WITH_AUDIT
+			audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+			              "changing member in shadow group",
+			              sgrp->sg_name, AUDIT_NO_ID, 1);
+#endif				/* WITH_AUDIT */
+			SYSLOG ((LOG_INFO,
+			         "change the renamed members of shadow group '%s'",
+			         sgrp->sg_name));
+			nsgrp = *sgrp;
+			if (NULL != members) {
+				nsgrp.sg_mem = members;
+			}
+			if (NULL != admins) {
+				nsgrp.sg_adm = admins;
+			}
+			if (sgr_update (&nsgrp) == 0) {
+				fprintf (stderr,
+				         _("%s: failed to prepare the new %s entry '%s'\n"),
+				         Prog, sgr_dbname (), nsgrp.sg_name);
+				fail_exit (E_GRP_UPDATE);
+			}
+			free (members);
+			free (admins);
+		}
+	}
+#endif				/* SHADOWGRP */
+
+	close_files ();
+#ifdef WITH_AUDIT
+	audit_logger_commit ();
+#endif				/* WITH_AUDIT */
+
+	cache_flush_defer (CACHE_DB_PASSWD | CACHE_DB_GROUP);
+
+	for (i = 0; i < list.count; i++) {
+		struct renamed_user *u = &list.users[i];
+
+#ifndef NO_MOVE_MAILBOX
+		/* move_mailbox() works on the globals of a single user */
+		lflg = true;
+		user_name = u->old_name;
+		user_newname = u->new_name;
+		user_id = u->uid;
+		user_newid = u->uid;
+		move_mailbox ();
+#endif				/* NO_MOVE_MAILBOX */
+
+		if (   (NULL != u->home)
+		    && (rename (u->home, u->new_home) != 0)
+		    && (ENOENT != errno)) {
+			fprintf (stderr,
+			         _("%s: cannot rename directory %s to %s\n"),
+			         Prog, u->home, u->new_home);
+			home_failed = true;
+		}
+	}
+
+	for (i = 0; i < list.count; i++) {
+		free (list.users[i].old_name);
+		free (list.users[i].new_name);
+		free (list.users[i].home);
+		free (list.users[i].new_home);
+	}
+	free (list.users);
+
+	if (home_failed) {
+		fail_exit (E_HOMEDIR);
+	}
+	return E_SUCCESS;
+}
+
+#ifndef NO_MOVE_MAILBOX
+/*
+ * This is the new and improved code to carefully chown/rename the user's
  * mailbox. Maybe I am too paranoid but the mail spool dir sometimes
  * happens to be mode 1777 (this makes mail user agents work without
  * being setgid mail, but is NOT recommended; they all should be fixed
@@ -2107,7 +3492,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 	prefix = process_prefix_flag ("-P", argc, argv);
 
 	OPENLOG ("usermod");
@@ -2180,6 +3565,13 @@ int main (int argc, char **argv)
 #endif				/* USE_PAM */
 #endif				/* ACCT_TOOLS_SETUID */
 
+	if (NULL != renumber_file) {
+		return renumber ();
+	}
+	if (NULL != rename_file) {
+		return rename_users ();
+	}
+
 #ifdef WITH_TCB
 	if (shadowtcb_set_user (user_name) == SHADOWTCB_FAILURE) {
 		exit (E_PW_UPDATE);
@@ -2191,6 +3583,10 @@ int main (int argc, char **argv)
 	 * change the home directory, then close and update the files.
 	 */
 	open_files ();
+#ifdef WITH_AUDIT
+	/* The records of the changes are sent once they are written */
+	audit_logger_begin ();
+#endif				/* WITH_AUDIT */
 	if (   cflg || dflg || eflg || fflg || gflg || Lflg || lflg || pflg
 	    || sflg || uflg || Uflg) {
 		usr_update ();
@@ -2253,6 +3649,9 @@ int main (int argc, char **argv)
 	}
 #endif				/* ENABLE_SUBIDS */
 	close_files ();
+#ifdef WITH_AUDIT
+	audit_logger_commit ();
+#endif				/* WITH_AUDIT */
 
 #ifdef WITH_TCB
 	if (   (lflg || uflg)
@@ -2261,9 +3660,7 @@ int main (int argc, char **argv)
 	}
 #endif
 
-	nscd_flush_cache ("passwd");
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
+	cache_flush_defer (CACHE_DB_PASSWD | CACHE_DB_GROUP);
 
 #ifdef WITH_SELINUX
 	if (Zflg) {
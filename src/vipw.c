@@ -28,6 +28,7 @@
 #ident "$Id$"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #ifdef WITH_SELINUX
 #include <selinux/selinux.h>
@@ -39,10 +40,11 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <utime.h>
+#include "chkname.h"
+#include "commonio.h"
 #include "defines.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
+#include "cacheflush.h"
 #include "prototypes.h"
 #include "pwio.h"
 #include "sgroupio.h"
@@ -79,7 +81,8 @@ static bool tcb_mode = false;
 static void usage (int status);
 static int create_backup_file (FILE *, const char *, struct stat *);
 static void vipwexit (const char *msg, int syserr, int ret);
-static void vipwedit (const char *, int (*)(void), int (*)(void));
+static void vipwedit (const char *, int (*)(void), int (*)(void),
+                      struct commonio_db *, bool (*)(const char *));
 
 /*
  * usage - display usage message and exit
@@ -196,16 +199,441 @@ static void vipwexit (const char *msg, int syserr, int ret)
 #define DEFAULT_EDITOR "vi"
 #endif
 
+/*
+ * Lines of the original and of the edited file
+ *
+ *	The two files are compared line by line, so that only the records
+ *	changed by the edit are checked, and only these records are
+ *	written back through commonio.
+ */
+#define NO_MATCH SIZE_MAX
+
+struct edit_line {
+	char *line;
+	size_t namelen;		/* length of the name (first field) */
+	size_t match;		/* same line in the other file, or NO_MATCH */
+};
+
+struct edit_file {
+	/*@only@*/ /*@null@*/char *buf;
+	/*@only@*/ /*@null@*/struct edit_line *lines;
+	size_t count;
+};
+
+static bool is_nis_line (const char *line)
+{
+	return ('+' == line[0]) || ('-' == line[0]);
+}
+
+/*
+ * read_edit_file - read the lines of path
+ */
+static int read_edit_file (const char *path, struct edit_file *ef)
+{
+	struct stat sb;
+	FILE *fp;
+	char *cp, *end, *nl;
+	size_t len, i;
+
+	ef->buf = NULL;
+	ef->lines = NULL;
+	ef->count = 0;
+
+	fp = fopen (path, "r");
+	if (NULL == fp) {
+		return -1;
+	}
+	if (fstat (fileno (fp), &sb) != 0) {
+		(void) fclose (fp);
+		return -1;
+	}
+	ef->buf = (char *) xmalloc ((size_t) sb.st_size + 1);
+	len = fread (ef->buf, 1, (size_t) sb.st_size, fp);
+	if (ferror (fp) != 0) {
+		(void) fclose (fp);
+		return -1;
+	}
+	(void) fclose (fp);
+	ef->buf[len] = '\0';
+	end = ef->buf + len;
+
+	i = ((len > 0) && ('\n' != end[-1])) ? 1 : 0;
+	for (cp = ef->buf; NULL != (nl = memchr (cp, '\n', (size_t) (end - cp)));
+	     cp = nl + 1) {
+		i++;
+	}
+	ef->lines = (struct edit_line *)
+	            xmalloc ((i + 1) * sizeof (struct edit_line));
+
+	for (cp = ef->buf; cp < end; cp = nl + 1) {
+		nl = memchr (cp, '\n', (size_t) (end - cp));
+		if (NULL == nl) {
+			nl = end;
+		}
+		*nl = '\0';
+		ef->lines[ef->count].line = cp;
+		ef->lines[ef->count].namelen = strcspn (cp, ":");
+		ef->lines[ef->count].match = NO_MATCH;
+		ef->count++;
+	}
+	return 0;
+}
+
+static void free_edit_file (struct edit_file *ef)
+{
+	free (ef->buf);
+	free (ef->lines);
+	ef->buf = NULL;
+	ef->lines = NULL;
+	ef->count = 0;
+}
+
+static int line_cmp (const void *a, const void *b)
+{
+	const struct edit_line *la = *(const struct edit_line *const *) a;
+	const struct edit_line *lb = *(const struct edit_line *const *) b;
+
+	return strcmp (la->line, lb->line);
+}
+
+static int name_cmp (const void *a, const void *b)
+{
+	const struct edit_line *la = *(const struct edit_line *const *) a;
+	const struct edit_line *lb = *(const struct edit_line *const *) b;
+	int c = memcmp (la->line, lb->line,
+	                (la->namelen < lb->namelen) ? la->namelen : lb->namelen);
+
+	if (0 != c) {
+		return c;
+	}
+	return (la->namelen > lb->namelen) - (la->namelen < lb->namelen);
+}
+
+/*
+ * sorted_lines - get the lines of ef, sorted with cmp
+ */
+static struct edit_line **sorted_lines (const struct edit_file *ef,
+                                        int (*cmp) (const void *,
+                                                    const void *))
+{
+	struct edit_line **sorted;
+	size_t i;
+
+	sorted = (struct edit_line **)
+	         xmalloc ((ef->count + 1) * sizeof (struct edit_line *));
+	for (i = 0; i < ef->count; i++) {
+		sorted[i] = &ef->lines[i];
+	}
+	qsort (sorted, ef->count, sizeof (struct edit_line *), cmp);
+	return sorted;
+}
+
+/*
+ * diff_edit_files - match the lines which were not changed by the edit
+ *
+ *	Each line of orig is matched with at most one identical line of
+ *	edit. The unmatched lines of orig were removed or changed, the
+ *	unmatched lines of edit were added or changed.
+ */
+static void diff_edit_files (struct edit_file *orig, struct edit_file *edit)
+{
+	struct edit_line **a = sorted_lines (orig, line_cmp);
+	struct edit_line **b = sorted_lines (edit, line_cmp);
+	size_t i = 0, j = 0;
+
+	while ((i < orig->count) && (j < edit->count)) {
+		int c = strcmp (a[i]->line, b[j]->line);
+
+		if (c < 0) {
+			i++;
+		} else if (c > 0) {
+			j++;
+		} else {
+			a[i]->match = (size_t) (b[j] - edit->lines);
+			b[j]->match = (size_t) (a[i] - orig->lines);
+			i++;
+			j++;
+		}
+	}
+	free (a);
+	free (b);
+}
+
+/*
+ * check_edit - check the records changed by the edit
+ *
+ *	The changed records must be valid entries of db, with a valid
+ *	name, and their names must not be used by another record.
+ *	The problems are reported, and their number is returned.
+ */
+static int check_edit (struct commonio_db *db, const struct edit_file *edit,
+                       bool (*valid_name) (const char *))
+{
+	struct edit_line **sorted = sorted_lines (edit, name_cmp);
+	bool *duplicate;
+	int errors = 0;
+	size_t i;
+
+	duplicate = (bool *) xmalloc ((edit->count + 1) * sizeof (bool));
+	memzero (duplicate, (edit->count + 1) * sizeof (bool));
+	for (i = 1; i < edit->count; i++) {
+		if (   (name_cmp (&sorted[i - 1], &sorted[i]) == 0)
+		    && !is_nis_line (sorted[i]->line)) {
+			duplicate[sorted[i - 1] - edit->lines] = true;
+			duplicate[sorted[i] - edit->lines] = true;
+		}
+	}
+	free (sorted);
+
+	for (i = 0; i < edit->count; i++) {
+		const struct edit_line *l = &edit->lines[i];
+		const void *eptr;
+
+		if ((NO_MATCH != l->match) || is_nis_line (l->line)) {
+			continue;
+		}
+		eptr = db->ops->parse (l->line);
+		if (NULL == eptr) {
+			fprintf (stderr, _("%s: line %lu: invalid entry '%s'\n"),
+			         Prog, (unsigned long) i + 1, l->line);
+			errors++;
+		} else if (!valid_name (db->ops->getname (eptr))) {
+			fprintf (stderr, _("%s: line %lu: invalid name '%s'\n"),
+			         Prog, (unsigned long) i + 1,
+			         db->ops->getname (eptr));
+			errors++;
+		} else if (duplicate[i]) {
+			fprintf (stderr, _("%s: line %lu: duplicate entry '%s'\n"),
+			         Prog, (unsigned long) i + 1,
+			         db->ops->getname (eptr));
+			errors++;
+		}
+	}
+	free (duplicate);
+	return errors;
+}
+
+/*
+ * edit_again - ask what to do with an edited file with errors
+ *
+ *	Return 'e' to edit it again, 's' to save it anyway, or 'q' to quit
+ *	without saving. Without a terminal, the file is saved, as it was
+ *	before the edits were checked.
+ */
+static int edit_again (void)
+{
+	char buf[80];
+
+	if (isatty (STDIN_FILENO) == 0) {
+		return 's';
+	}
+	for (;;) {
+		(void) fputs (_("(e)dit again, (s)ave anyway, or (q)uit without saving? "),
+		              stdout);
+		(void) fflush (stdout);
+		if (fgets (buf, (int) sizeof buf, stdin) != buf) {
+			return 'q';
+		}
+		if (('e' == buf[0]) || ('s' == buf[0]) || ('q' == buf[0])) {
+			return buf[0];
+		}
+	}
+}
+
+/*
+ * commit_edit - write the records changed by the edit through commonio
+ *
+ *	This is only possible if the records which were not removed are
+ *	still in the same order, and if the new records were added at the
+ *	end, so that the database, written with its pending changes (see
+ *	commit_db), is identical to the edited file.
+ *
+ *	It returns false if the edit cannot be written this way: the
+ *	edited file is then renamed over the database, as before.
+ *	The changes which were already applied to db are dropped by the
+ *	unlock of db.
+ */
+static bool commit_edit (struct commonio_db *db,
+                         struct edit_file *orig, struct edit_file *edit)
+{
+	struct edit_line **removed;
+	size_t nremoved = 0;
+	size_t last = 0;
+	bool any = false;
+	bool appending = false;
+	bool orig_nis = false;
+	bool ok = false;
+	size_t i;
+
+	removed = (struct edit_line **)
+	          xmalloc ((orig->count + 1) * sizeof (struct edit_line *));
+	for (i = 0; i < orig->count; i++) {
+		struct edit_line *l = &orig->lines[i];
+
+		if (is_nis_line (l->line)) {
+			orig_nis = true;
+		}
+		if (NO_MATCH != l->match) {
+			continue;
+		}
+		if (is_nis_line (l->line) || ('\0' == l->line[0])) {
+			goto out;
+		}
+		removed[nremoved] = l;
+		nremoved++;
+	}
+	qsort (removed, nremoved, sizeof (struct edit_line *), name_cmp);
+
+	/*
+	 * A changed record takes the place of the removed record with the
+	 * same name. The records without such a name are new.
+	 */
+	for (i = 0; i < edit->count; i++) {
+		struct edit_line *l = &edit->lines[i];
+		struct edit_line **r;
+		size_t idx;
+
+		if (NO_MATCH != l->match) {
+			idx = l->match;
+		} else if (is_nis_line (l->line)) {
+			goto out;
+		} else {
+			r = bsearch (&l, removed, nremoved,
+			             sizeof (struct edit_line *), name_cmp);
+			if (   (NULL == r) || (NO_MATCH != (*r)->match)
+			    || (db->ops->parse ((*r)->line) == NULL)) {
+				appending = true;
+				continue;
+			}
+			(*r)->match = i;
+			idx = (size_t) (*r - orig->lines);
+		}
+		if (appending || (any && (idx <= last))) {
+			goto out;
+		}
+		last = idx;
+		any = true;
+	}
+	if (appending && orig_nis) {
+		/* The new entries would be added before the NIS entries */
+		goto out;
+	}
+
+	if (commonio_open (db, O_RDWR) == 0) {
+		goto out;
+	}
+	for (i = 0; i < nremoved; i++) {
+		if (NO_MATCH != removed[i]->match) {
+			continue;
+		}
+		removed[i]->line[removed[i]->namelen] = '\0';
+		if (commonio_remove (db, removed[i]->line) == 0) {
+			goto out;
+		}
+	}
+	for (i = 0; i < edit->count; i++) {
+		const void *eptr;
+
+		if (NO_MATCH != edit->lines[i].match) {
+			continue;
+		}
+		eptr = db->ops->parse (edit->lines[i].line);
+		if ((NULL == eptr) || (commonio_update (db, eptr) == 0)) {
+			goto out;
+		}
+	}
+	if (commonio_close (db) == 0) {
+		fprintf (stderr,
+		         _("%s: failure while writing changes to %s\n"),
+		         Prog, db->filename);
+		goto out;
+	}
+	ok = true;
+
+      out:
+	free (removed);
+	return ok;
+}
+
+/*
+ * run_editor - edit fileedit with editor
+ *
+ *	It exits if the editor failed.
+ */
+static void run_editor (const char *editor, const char *fileedit)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork ();
+	if (-1 == pid) {
+		vipwexit ("fork", 1, 1);
+	} else if (0 == pid) {
+		/* use the system() call to invoke the editor so that it accepts
+		   command line args in the EDITOR and VISUAL environment vars */
+		char *buf;
+		int status;
+
+		buf = (char *) malloc (strlen (editor) + strlen (fileedit) + 2);
+		snprintf (buf, strlen (editor) + strlen (fileedit) + 2,
+		          "%s %s", editor, fileedit);
+		status = system (buf);
+		if (-1 == status) {
+			fprintf (stderr, _("%s: %s: %s\n"), Prog, editor,
+			         strerror (errno));
+			exit (1);
+		} else if (   WIFEXITED (status)
+		           && (WEXITSTATUS (status) != 0)) {
+			fprintf (stderr, _("%s: %s returned with status %d\n"),
+			         Prog, editor, WEXITSTATUS (status));
+			exit (WEXITSTATUS (status));
+		} else if (WIFSIGNALED (status)) {
+			fprintf (stderr, _("%s: %s killed by signal %d\n"),
+			         Prog, editor, WTERMSIG (status));
+			exit (1);
+		} else {
+			exit (0);
+		}
+	}
+
+	for (;;) {
+		pid = waitpid (pid, &status, WUNTRACED);
+		if ((pid != -1) && (WIFSTOPPED (status) != 0)) {
+			/* The child (editor) was suspended.
+			 * Suspend vipw. */
+			kill (getpid (), SIGSTOP);
+			/* wake child when resumed */
+			kill (pid, SIGCONT);
+		} else {
+			break;
+		}
+	}
+
+	if (-1 == pid) {
+		vipwexit (editor, 1, 1);
+	} else if (   WIFEXITED (status)
+	           && (WEXITSTATUS (status) != 0)) {
+		vipwexit (NULL, 0, WEXITSTATUS (status));
+	} else if (WIFSIGNALED (status)) {
+		fprintf (stderr, _("%s: %s killed by signal %d\n"),
+		         Prog, editor, WTERMSIG(status));
+		vipwexit (NULL, 0, 1);
+	}
+}
+
 /*
  *
  */
 static void
-vipwedit (const char *file, int (*file_lock) (void), int (*file_unlock) (void))
+vipwedit (const char *file, int (*file_lock) (void), int (*file_unlock) (void),
+          struct commonio_db *db, bool (*valid_name) (const char *))
 {
 	const char *editor;
-	pid_t pid;
 	struct stat st1, st2;
-	int status;
+	struct edit_file orig = { NULL, NULL, 0 };
+	struct edit_file edit = { NULL, NULL, 0 };
+	bool checked = false;
+	int answer;
 	FILE *f;
 	/* FIXME: the following should have variable sizes */
 	char filebackup[1024], fileedit[1024];
@@ -294,66 +722,40 @@ vipwedit (const char *file, int (*file_lock) (void), int (*file_unlock) (void))
 		editor = DEFAULT_EDITOR;
 	}
 
-	pid = fork ();
-	if (-1 == pid) {
-		vipwexit ("fork", 1, 1);
-	} else if (0 == pid) {
-		/* use the system() call to invoke the editor so that it accepts
-		   command line args in the EDITOR and VISUAL environment vars */
-		char *buf;
-		int status;
+	/*
+	 * Check the records changed by the edit. If there are errors, ask
+	 * the user what to do (edit again, save changes anyway, or quit
+	 * without saving).
+	 */
+	for (;;) {
+		run_editor (editor, fileedit);
 
-		buf = (char *) malloc (strlen (editor) + strlen (fileedit) + 2);
-		snprintf (buf, strlen (editor) + strlen (fileedit) + 2,
-		          "%s %s", editor, fileedit);
-		status = system (buf);
-		if (-1 == status) {
-			fprintf (stderr, _("%s: %s: %s\n"), Prog, editor,
-			         strerror (errno));
-			exit (1);
-		} else if (   WIFEXITED (status)
-		           && (WEXITSTATUS (status) != 0)) {
-			fprintf (stderr, _("%s: %s returned with status %d\n"),
-			         Prog, editor, WEXITSTATUS (status));
-			exit (WEXITSTATUS (status));
-		} else if (WIFSIGNALED (status)) {
-			fprintf (stderr, _("%s: %s killed by signal %d\n"),
-			         Prog, editor, WTERMSIG (status));
-			exit (1);
-		} else {
-			exit (0);
+		if (stat (fileedit, &st2) != 0) {
+			vipwexit (fileedit, 1, 1);
+		}
+		if (st1.st_mtime == st2.st_mtime) {
+			vipwexit (0, 0, 0);
 		}
-	}
 
-	for (;;) {
-		pid = waitpid (pid, &status, WUNTRACED);
-		if ((pid != -1) && (WIFSTOPPED (status) != 0)) {
-			/* The child (editor) was suspended.
-			 * Suspend vipw. */
-			kill (getpid (), SIGSTOP);
-			/* wake child when resumed */
-			kill (pid, SIGCONT);
-		} else {
+		free_edit_file (&orig);
+		free_edit_file (&edit);
+		if (   (read_edit_file (file, &orig) != 0)
+		    || (read_edit_file (fileedit, &edit) != 0)) {
+			/* Saved as is */
+			checked = false;
+			break;
+		}
+		diff_edit_files (&orig, &edit);
+		checked = (check_edit (db, &edit, valid_name) == 0);
+		if (checked) {
+			break;
+		}
+		answer = edit_again ();
+		if ('q' == answer) {
+			vipwexit (NULL, 0, 1);
+		} else if ('s' == answer) {
 			break;
 		}
-	}
-
-	if (-1 == pid) {
-		vipwexit (editor, 1, 1);
-	} else if (   WIFEXITED (status)
-	           && (WEXITSTATUS (status) != 0)) {
-		vipwexit (NULL, 0, WEXITSTATUS (status));
-	} else if (WIFSIGNALED (status)) {
-		fprintf (stderr, _("%s: %s killed by signal %d\n"),
-		         Prog, editor, WTERMSIG(status));
-		vipwexit (NULL, 0, 1);
-	}
-
-	if (stat (fileedit, &st2) != 0) {
-		vipwexit (fileedit, 1, 1);
-	}
-	if (st1.st_mtime == st2.st_mtime) {
-		vipwexit (0, 0, 0);
 	}
 #ifdef WITH_SELINUX
 	/* unset the fscreatecon */
@@ -364,12 +766,35 @@ vipwedit (const char *file, int (*file_lock) (void), int (*file_unlock) (void))
 	}
 #endif				/* WITH_SELINUX */
 
+	createedit = false;
+
 	/*
-	 * XXX - here we should check fileedit for errors; if there are any,
-	 * ask the user what to do (edit again, save changes anyway, or quit
-	 * without saving). Use pwck or grpck to do the check.  --marekm
+	 * Write only the changed records, with the pending changes of
+	 * commonio, unless the edit moved records around.
 	 */
-	createedit = false;
+	if (
+#ifdef WITH_TCB
+	       !tcb_mode &&
+#endif				/* WITH_TCB */
+	       checked && commit_edit (db, &orig, &edit)) {
+		free_edit_file (&orig);
+		free_edit_file (&edit);
+		if (unlink (fileedit) != 0) {
+			fprintf (stderr, _("%s: failed to remove %s\n"),
+			         Prog, fileedit);
+			/* continue */
+		}
+		if ((*file_unlock) () == 0) {
+			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, fileeditname);
+			SYSLOG ((LOG_ERR, "failed to unlock %s", fileeditname));
+			/* continue */
+		}
+		SYSLOG ((LOG_INFO, "file %s edited", fileeditname));
+		return;
+	}
+	free_edit_file (&orig);
+	free_edit_file (&edit);
+
 #ifdef WITH_TCB
 	if (tcb_mode) {
 		f = fopen (fileedit, "r");
@@ -443,7 +868,7 @@ int main (int argc, char **argv)
 	(void) bindtextdomain (PACKAGE, LOCALEDIR);
 	(void) textdomain (PACKAGE);
 
-	process_root_flag ("-R", argc, argv);
+	process_root_flag ("-R", false, argc, argv);
 
 	do_vipw = (strcmp (Prog, "vigr") != 0);
 
@@ -519,13 +944,15 @@ int main (int argc, char **argv)
 				tcb_mode = true;
 			}
 #endif				/* WITH_TCB */
-			vipwedit (spw_dbname (), spw_lock, spw_unlock);
+			vipwedit (spw_dbname (), spw_lock, spw_unlock,
+			          __spw_get_db (), is_valid_user_name);
 			printf (MSG_WARN_EDIT_OTHER_FILE,
 			        spw_dbname (),
 			        pw_dbname (),
 			        "vipw");
 		} else {
-			vipwedit (pw_dbname (), pw_lock, pw_unlock);
+			vipwedit (pw_dbname (), pw_lock, pw_unlock,
+			          __pw_get_db (), is_valid_user_name);
 			if (spw_file_present ()) {
 				printf (MSG_WARN_EDIT_OTHER_FILE,
 				        pw_dbname (),
@@ -536,14 +963,16 @@ int main (int argc, char **argv)
 	} else {
 #ifdef SHADOWGRP
 		if (editshadow) {
-			vipwedit (sgr_dbname (), sgr_lock, sgr_unlock);
+			vipwedit (sgr_dbname (), sgr_lock, sgr_unlock,
+			          __sgr_get_db (), is_valid_group_name);
 			printf (MSG_WARN_EDIT_OTHER_FILE,
 			        sgr_dbname (),
 			        gr_dbname (),
 			        "vigr");
 		} else {
 #endif				/* SHADOWGRP */
-			vipwedit (gr_dbname (), gr_lock, gr_unlock);
+			vipwedit (gr_dbname (), gr_lock, gr_unlock,
+			          __gr_get_db (), is_valid_group_name);
 #ifdef SHADOWGRP
 			if (sgr_file_present ()) {
 				printf (MSG_WARN_EDIT_OTHER_FILE,
@@ -555,9 +984,7 @@ int main (int argc, char **argv)
 #endif				/* SHADOWGRP */
 	}
 
-	nscd_flush_cache ("passwd");
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
+	cache_flush_defer (CACHE_DB_PASSWD | CACHE_DB_GROUP);
 
 	return E_SUCCESS;
 }
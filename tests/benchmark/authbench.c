@@ -0,0 +1,706 @@
+/*
+ * Benchmark of the startup of login and su.
+ *
+ * "su bench -c true" and "login -f bench" (on a pseudo terminal) are run
+ * many times, and the distribution of their duration is reported, with
+ * the time of each phase of their startup: login.defs sets LOG_TIMINGS,
+ * and the "timings:" line which the tools log before they execute the
+ * shell (see lib/timing.c) is received on /dev/log. exec is the time from
+ * the start of the tool to the execution of the shell, and wall the time
+ * until the tool exits (the shell of the user is /bin/true).
+ *
+ * The tools run in a private mount namespace, where the benchmark mounts
+ * its own files over:
+ *	/etc/nsswitch.conf	passwd, group and shadow from the stub
+ *				module (see nss_bench.c), with a delay of -D
+ *				microseconds per lookup
+ *	/etc/nss-bench.conf	the configuration of the stub module
+ *	/etc/pam.d		a minimal stack (pam_permit), or the
+ *				directory given with -p
+ *	/etc/login.defs		the file given with -L, with LOG_TIMINGS
+ *	/dev/log		the socket of the benchmark
+ * and empty file systems over /var/log and /run, so that the logs, utmp
+ * and the sockets of the daemons (nscd) of the system are not used. The
+ * missing targets are created, and removed at the end.
+ *
+ * It must run as root. libnss_bench.so.2 is taken from -l (or the
+ * current directory), and the tools from -t (or /bin).
+ *
+ * With -o, each run is also written to a report, one JSON object per
+ * line:
+ *	{"tool":"su","run":1,"status":0,"wall_s":0.004120,
+ *	 "exec_s":0.003310,"defs_s":0.000120,...}
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+static const char *Prog = "authbench";
+
+static unsigned long runs = 100;
+static unsigned long nss_delay = 0;
+static const char *tools = "su,login";
+static const char *tools_dir = "/bin";
+static const char *lib_dir = ".";
+static const char *pam_dir = NULL;
+static const char *defs_file = NULL;
+static const char *report_file = NULL;
+
+/* The user of the benchmark */
+#define BENCH_USER	"bench"
+#define BENCH_ID	60100
+
+/* A run which takes longer is killed */
+#define RUN_TIMEOUT_MS	10000
+
+static char work[] = "/tmp/shadow-authbench.XXXXXX";
+static int log_fd = -1;
+static FILE *report = NULL;
+static bool keep_work = false;	/* to see the messages of the failures */
+
+/* The targets created for the mounts, removed at the end */
+static char *created[16];
+static size_t n_created = 0;
+
+/*
+ * The measures of the runs of a tool: wall, then the phases in the
+ * order in which they were first logged
+ */
+#define MAX_PHASES	40
+
+struct phase {
+	char name[32];
+	double *values;		/* seconds, one per run with the phase */
+	unsigned long count;
+};
+
+static struct phase phases[MAX_PHASES];
+static size_t n_phases = 0;
+static unsigned long failures;
+static unsigned long no_timings;
+
+static void usage (int status)
+{
+	FILE *out = (0 == status) ? stdout : stderr;
+
+	(void) fprintf (out,
+	                "Usage: %s [options]\n"
+	                "\n"
+	                "Options:\n"
+	                "  -n RUNS      runs of each tool (default %lu)\n"
+	                "  -w TOOLS     comma separated tools (default %s)\n"
+	                "  -D USEC      delay of the NSS lookups (default %lu)\n"
+	                "  -t DIR       directory of the tools (default %s)\n"
+	                "  -l DIR       directory of libnss_bench.so.2 (default %s)\n"
+	                "  -p DIR       PAM configuration (default: pam_permit)\n"
+	                "  -L FILE      login.defs (default: an empty one)\n"
+	                "  -o REPORT    report of each run, in JSON\n",
+	                Prog, runs, tools, nss_delay, tools_dir, lib_dir);
+	exit (status);
+}
+
+static void cleanup (void)
+{
+	char cmd[sizeof work + 16];
+
+	while (n_created > 0) {
+		n_created--;
+		(void) umount2 (created[n_created], MNT_DETACH);
+		(void) remove (created[n_created]);
+	}
+	if (!keep_work && ('X' != work[sizeof work - 2])) {
+		(void) snprintf (cmd, sizeof cmd, "rm -rf %s", work);
+		(void) system (cmd);
+	}
+}
+
+static void fail (const char *what)
+{
+	(void) fprintf (stderr, "%s: %s failed: %s\n",
+	                Prog, what, strerror (errno));
+	cleanup ();
+	exit (EXIT_FAILURE);
+}
+
+static void write_file (const char *path, const char *content)
+{
+	FILE *fp = fopen (path, "w");
+
+	if (   (NULL == fp)
+	    || (fputs (content, fp) < 0)
+	    || (fclose (fp) != 0)) {
+		fail (path);
+	}
+}
+
+static const char *work_path (const char *name)
+{
+	static char path[4][256];
+	static int next = 0;
+
+	next = (next + 1) % 4;
+	(void) snprintf (path[next], sizeof path[next], "%s/%s", work, name);
+	return path[next];
+}
+
+/*
+ * overlay - mount src over target, in the namespace of the benchmark
+ *
+ *	src is a directory, a file, or NULL for an empty tmpfs. A missing
+ *	target is created (outside of the namespace too, unless it is in
+ *	one of the empty file systems), and removed at the end. A symbolic
+ *	link (/dev/log -> /run/systemd/journal/dev-log) is followed.
+ */
+static void overlay (const char *src, const char *target, bool dir)
+{
+	char link[256];
+	struct stat sb;
+	ssize_t n;
+
+	if ((lstat (target, &sb) == 0) && S_ISLNK (sb.st_mode)) {
+		char *cp;
+
+		n = readlink (target, link, sizeof link - 1);
+		if ((n <= 0) || ('/' != link[0])) {
+			errno = EINVAL;
+			fail (target);
+		}
+		link[n] = '\0';
+		for (cp = strchr (link + 1, '/'); NULL != cp;
+		     cp = strchr (cp + 1, '/')) {
+			*cp = '\0';
+			if ((mkdir (link, 0755) != 0) && (EEXIST != errno)) {
+				fail (link);
+			}
+			*cp = '/';
+		}
+		overlay (src, link, dir);
+		return;
+	}
+	if (lstat (target, &sb) != 0) {
+		int fd;
+
+		if (dir) {
+			if (mkdir (target, 0755) != 0) {
+				fail (target);
+			}
+		} else {
+			fd = open (target, O_WRONLY | O_CREAT | O_EXCL, 0644);
+			if ((fd < 0) || (close (fd) != 0)) {
+				fail (target);
+			}
+		}
+		if (n_created < sizeof created / sizeof created[0]) {
+			created[n_created++] = strdup (target);
+		}
+	}
+	if (NULL == src) {
+		if (mount ("tmpfs", target, "tmpfs", 0, "mode=0755") != 0) {
+			fail (target);
+		}
+	} else if (mount (src, target, NULL, MS_BIND, NULL) != 0) {
+		fail (target);
+	}
+}
+
+static void setup (void)
+{
+	struct sockaddr_un sun;
+	char buf[4096];
+	const char *shell;
+	int size = 1024 * 1024;
+	FILE *in;
+	FILE *out;
+
+	if (mkdtemp (work) == NULL) {
+		fail ("mkdtemp");
+	}
+	/* The user needs to reach its home directory */
+	if (   (chmod (work, 0755) != 0)
+	    || (mkdir (work_path ("home"), 0755) != 0)
+	    || (chown (work_path ("home"), BENCH_ID, BENCH_ID) != 0)
+	    || (mkdir (work_path ("pam.d"), 0755) != 0)) {
+		fail (work);
+	}
+
+	shell = (access ("/bin/true", X_OK) == 0) ? "/bin/true" : "/usr/bin/true";
+	(void) snprintf (buf, sizeof buf,
+	                 "delay %lu\n"
+	                 BENCH_USER ":x:%d:%d:benchmark:%s:%s\n",
+	                 nss_delay, BENCH_ID, BENCH_ID,
+	                 work_path ("home"), shell);
+	write_file (work_path ("nss-bench.conf"), buf);
+	write_file (work_path ("nsswitch.conf"),
+	            "passwd: files bench\n"
+	            "group: files bench\n"
+	            "shadow: files bench\n"
+	            "hosts: files\n");
+	write_file (work_path ("pam.d/other"),
+	            "auth\trequired\tpam_permit.so\n"
+	            "account\trequired\tpam_permit.so\n"
+	            "password\trequired\tpam_deny.so\n"
+	            "session\trequired\tpam_permit.so\n");
+
+	/* login.defs: the given one, with LOG_TIMINGS */
+	out = fopen (work_path ("login.defs"), "w");
+	if (NULL == out) {
+		fail (work_path ("login.defs"));
+	}
+	if (NULL != defs_file) {
+		size_t n;
+
+		in = fopen (defs_file, "r");
+		if (NULL == in) {
+			fail (defs_file);
+		}
+		while ((n = fread (buf, 1, sizeof buf, in)) != 0) {
+			(void) fwrite (buf, 1, n, out);
+		}
+		(void) fclose (in);
+	}
+	(void) fputs ("\nLOG_TIMINGS yes\n", out);
+	if ((ferror (out) != 0) || (fclose (out) != 0)) {
+		fail (work_path ("login.defs"));
+	}
+
+	log_fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (log_fd < 0) {
+		fail ("socket");
+	}
+	memset (&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	(void) snprintf (sun.sun_path, sizeof sun.sun_path, "%s",
+	                 work_path ("log"));
+	if (bind (log_fd, (struct sockaddr *) &sun, sizeof sun) != 0) {
+		fail (work_path ("log"));
+	}
+	(void) chmod (work_path ("log"), 0666);
+	(void) setsockopt (log_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+
+	if (unshare (CLONE_NEWNS) != 0) {
+		fail ("unshare");
+	}
+	if (mount (NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+		fail ("mount");
+	}
+	overlay (work_path ("nsswitch.conf"), "/etc/nsswitch.conf", false);
+	overlay (work_path ("nss-bench.conf"), "/etc/nss-bench.conf", false);
+	overlay ((NULL != pam_dir) ? pam_dir : work_path ("pam.d"),
+	         "/etc/pam.d", true);
+	overlay (work_path ("login.defs"), "/etc/login.defs", false);
+	overlay (NULL, "/var/log", true);
+	overlay (NULL, "/run", true);
+	overlay (work_path ("log"), "/dev/log", false);
+
+	/* The stub module, for the tools (they are not setuid here) */
+	(void) snprintf (buf, sizeof buf, "%s%s%s", lib_dir,
+	                 (NULL != getenv ("LD_LIBRARY_PATH")) ? ":" : "",
+	                 (NULL != getenv ("LD_LIBRARY_PATH")) ?
+	                 getenv ("LD_LIBRARY_PATH") : "");
+	(void) setenv ("LD_LIBRARY_PATH", buf, 1);
+}
+
+static double elapsed (const struct timespec *start)
+{
+	struct timespec now;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &now);
+	return   (double) (now.tv_sec - start->tv_sec)
+	       + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void add_value (const char *name, double value)
+{
+	struct phase *p = NULL;
+	size_t i;
+
+	for (i = 0; i < n_phases; i++) {
+		if (strcmp (phases[i].name, name) == 0) {
+			p = &phases[i];
+			break;
+		}
+	}
+	if (NULL == p) {
+		if (MAX_PHASES == n_phases) {
+			return;
+		}
+		p = &phases[n_phases++];
+		(void) snprintf (p->name, sizeof p->name, "%s", name);
+		p->values = calloc (runs, sizeof p->values[0]);
+		if (NULL == p->values) {
+			fail ("calloc");
+		}
+		p->count = 0;
+	}
+	if (p->count < runs) {
+		p->values[p->count++] = value;
+	}
+}
+
+/*
+ * collect - read the logged messages of a run, and add its phases
+ *
+ *	Only the line logged before the execution of the shell (with
+ *	exec=) is used. The phases are written to the report.
+ */
+static void collect (void)
+{
+	char msg[4096];
+	bool found = false;
+	ssize_t n;
+
+	while ((n = recv (log_fd, msg, sizeof msg - 1, MSG_DONTWAIT)) > 0) {
+		char *cp, *tok, *save;
+
+		msg[n] = '\0';
+		cp = strstr (msg, "timings:");
+		if ((NULL == cp) || (strstr (cp, " exec=") == NULL) || found) {
+			continue;
+		}
+		found = true;
+		for (tok = strtok_r (cp + 8, " \n", &save);
+		     NULL != tok;
+		     tok = strtok_r (NULL, " \n", &save)) {
+			char *eq = strchr (tok, '=');
+			char *end;
+			double value;
+
+			if (NULL == eq) {
+				continue;
+			}
+			*eq = '\0';
+			value = strtod (eq + 1, &end);
+			/* Only the times: the counts have no unit */
+			if ((end == eq + 1) || (strcmp (end, "s") != 0)) {
+				continue;
+			}
+			add_value (tok, value);
+			if (NULL != report) {
+				(void) fprintf (report, ",\"%s_s\":%.6f",
+				                tok, value);
+			}
+		}
+	}
+	if (!found) {
+		no_timings++;
+	}
+}
+
+/*
+ * wait_run - wait for the end of a run, copying its terminal (if any) to
+ *            login.log
+ */
+static int wait_run (pid_t pid, int master)
+{
+	struct timespec start;
+	char buf[4096];
+	int status;
+	int out = -1;
+	ssize_t n;
+
+	if (master >= 0) {
+		out = open (work_path ("login.log"),
+		            O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	}
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &start);
+	for (;;) {
+		pid_t r = waitpid (pid, &status, WNOHANG);
+
+		if (r == pid) {
+			break;
+		}
+		if ((r < 0) && (EINTR != errno)) {
+			fail ("waitpid");
+		}
+		if (elapsed (&start) * 1000 > RUN_TIMEOUT_MS) {
+			(void) kill (pid, SIGKILL);
+			(void) waitpid (pid, &status, 0);
+			break;
+		}
+		if (master >= 0) {
+			struct pollfd pfd = { master, POLLIN, 0 };
+
+			if (poll (&pfd, 1, 1) > 0) {
+				n = read (master, buf, sizeof buf);
+				if (n <= 0) {
+					/* The terminal was closed */
+					(void) usleep (100);
+				} else if (out >= 0) {
+					(void) write (out, buf, (size_t) n);
+				}
+			}
+		} else {
+			(void) usleep (100);
+		}
+	}
+	if (out >= 0) {
+		(void) close (out);
+	}
+	return status;
+}
+
+static pid_t start_su (const char *path)
+{
+	pid_t pid = fork ();
+
+	if (0 == pid) {
+		int fd = open ("/dev/null", O_RDWR);
+
+		(void) dup2 (fd, 0);
+		(void) dup2 (fd, 1);
+		fd = open (work_path ("su.log"), O_WRONLY | O_CREAT | O_APPEND,
+		           0644);
+		(void) dup2 (fd, 2);
+		(void) execl (path, "su", BENCH_USER, "-c", "true", (char *) NULL);
+		_exit (127);
+	}
+	return pid;
+}
+
+static pid_t start_login (const char *path, int *master)
+{
+	const char *slave;
+	pid_t pid;
+
+	*master = posix_openpt (O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (   (*master < 0)
+	    || (grantpt (*master) != 0)
+	    || (unlockpt (*master) != 0)
+	    || ((slave = ptsname (*master)) == NULL)) {
+		fail ("posix_openpt");
+	}
+	pid = fork ();
+	if (0 == pid) {
+		int fd;
+
+		(void) setsid ();
+		fd = open (slave, O_RDWR);
+		if (fd < 0) {
+			_exit (127);
+		}
+		(void) ioctl (fd, TIOCSCTTY, 0);
+		(void) dup2 (fd, 0);
+		(void) dup2 (fd, 1);
+		(void) dup2 (fd, 2);
+		(void) execl (path, "login", "-f", BENCH_USER, (char *) NULL);
+		_exit (127);
+	}
+	return pid;
+}
+
+static int value_cmp (const void *p1, const void *p2)
+{
+	double v1 = *(const double *) p1;
+	double v2 = *(const double *) p2;
+
+	return (v1 > v2) - (v1 < v2);
+}
+
+static double percentile (const struct phase *p, unsigned int pct)
+{
+	unsigned long i = (p->count * pct + 99) / 100;
+
+	return p->values[(i > 0) ? i - 1 : 0];
+}
+
+static void print_phases (const char *tool)
+{
+	size_t i;
+
+	(void) printf ("# %s: %lu runs, %lu failed, %lu without timings\n",
+	               tool, runs, failures, no_timings);
+	(void) printf ("%-14s %8s %10s %10s %10s %10s %10s\n",
+	               "# phase (ms)", "runs", "min", "p50", "p90", "p99",
+	               "max");
+	for (i = 0; i < n_phases; i++) {
+		struct phase *p = &phases[i];
+
+		qsort (p->values, p->count, sizeof p->values[0], value_cmp);
+		(void) printf ("%-14s %8lu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+		               p->name, p->count,
+		               p->values[0] * 1e3,
+		               percentile (p, 50) * 1e3,
+		               percentile (p, 90) * 1e3,
+		               percentile (p, 99) * 1e3,
+		               p->values[p->count - 1] * 1e3);
+		free (p->values);
+	}
+	n_phases = 0;
+	(void) fflush (stdout);
+}
+
+static void bench_tool (const char *tool)
+{
+	char path[1024];
+	unsigned long i;
+
+	failures = 0;
+	no_timings = 0;
+	add_value ("wall", 0);		/* the first row */
+	phases[0].count = 0;
+
+	for (i = 0; i < runs; i++) {
+		struct timespec start;
+		int master = -1;
+		double wall;
+		pid_t pid;
+		int status;
+
+		/* Forget the messages of the previous runs */
+		while (recv (log_fd, path, 1, MSG_DONTWAIT) >= 0) {
+		}
+		(void) snprintf (path, sizeof path, "%s/%s", tools_dir, tool);
+
+		(void) clock_gettime (CLOCK_MONOTONIC, &start);
+		if (strcmp (tool, "login") == 0) {
+			pid = start_login (path, &master);
+		} else {
+			pid = start_su (path);
+		}
+		if (pid < 0) {
+			fail ("fork");
+		}
+		status = wait_run (pid, master);
+		wall = elapsed (&start);
+		if (master >= 0) {
+			(void) close (master);
+		}
+
+		if (!WIFEXITED (status) || (0 != WEXITSTATUS (status))) {
+			failures++;
+		}
+		add_value ("wall", wall);
+		if (NULL != report) {
+			(void) fprintf (report,
+			                "{\"tool\":\"%s\",\"run\":%lu,"
+			                "\"status\":%d,\"wall_s\":%.6f",
+			                tool, i + 1, status, wall);
+		}
+		/* Leave some time to the messages of the exit */
+		(void) usleep (1000);
+		collect ();
+		if (NULL != report) {
+			(void) fputs ("}\n", report);
+		}
+	}
+	print_phases (tool);
+	if (0 != failures) {
+		(void) fprintf (stderr, "%s: %s failed %lu times, see %s\n",
+		                Prog, tool, failures,
+		                work_path ((strcmp (tool, "login") == 0) ?
+		                           "login.log" : "su.log"));
+		keep_work = true;
+	}
+}
+
+int main (int argc, char **argv)
+{
+	char *list, *tool, *save;
+	int c;
+
+	while ((c = getopt (argc, argv, "D:hl:L:n:o:p:t:w:")) != -1) {
+		switch (c) {
+		case 'D':
+			nss_delay = strtoul (optarg, NULL, 10);
+			break;
+		case 'h':
+			usage (EXIT_SUCCESS);
+			break;
+		case 'l':
+			lib_dir = optarg;
+			break;
+		case 'L':
+			defs_file = optarg;
+			break;
+		case 'n':
+			runs = strtoul (optarg, NULL, 10);
+			break;
+		case 'o':
+			report_file = optarg;
+			break;
+		case 'p':
+			pam_dir = optarg;
+			break;
+		case 't':
+			tools_dir = optarg;
+			break;
+		case 'w':
+			tools = optarg;
+			break;
+		default:
+			usage (EXIT_FAILURE);
+		}
+	}
+	if (0 == runs) {
+		usage (EXIT_FAILURE);
+	}
+	if (geteuid () != 0) {
+		(void) fprintf (stderr,
+		                "%s: the tools need a private mount namespace: run as root\n",
+		                Prog);
+		exit (EXIT_FAILURE);
+	}
+	if (NULL != report_file) {
+		report = fopen (report_file, "w");
+		if (NULL == report) {
+			fail (report_file);
+		}
+	}
+
+	list = strdup (tools);
+	if (NULL == list) {
+		fail ("strdup");
+	}
+	for (tool = strtok_r (list, ",", &save);
+	     NULL != tool;
+	     tool = strtok_r (NULL, ",", &save)) {
+		char path[1024];
+
+		(void) snprintf (path, sizeof path, "%s/%s", tools_dir, tool);
+		if (access (path, X_OK) != 0) {
+			fail (path);
+		}
+	}
+	free (list);
+
+	setup ();
+	(void) printf ("# %lu runs, NSS delay %lu us, tools in %s\n",
+	               runs, nss_delay, tools_dir);
+
+	list = strdup (tools);
+	if (NULL == list) {
+		fail ("strdup");
+	}
+	for (tool = strtok_r (list, ",", &save);
+	     NULL != tool;
+	     tool = strtok_r (NULL, ",", &save)) {
+		bench_tool (tool);
+	}
+	free (list);
+
+	if ((NULL != report) && (fclose (report) != 0)) {
+		fail (report_file);
+	}
+	cleanup ();
+	return EXIT_SUCCESS;
+}
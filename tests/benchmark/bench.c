@@ -0,0 +1,518 @@
+/*
+ * Benchmark of the libshadow database functions.
+ *
+ * A synthetic database (passwd, shadow, group, gshadow, subuid, subgid
+ * and login.defs) is generated in a temporary directory, which is used
+ * as the --prefix of the tools. Each benchmark reports the number of
+ * operations, their duration, the operations per second, and the peak
+ * RSS of the process so far.
+ *
+ * This program does not need to run as root, but it needs to write to
+ * the directory given with -d (by default, a new directory in /tmp).
+ * The directory is left for inspection.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "pwio.h"
+#include "shadowio.h"
+#include "groupio.h"
+#ifdef SHADOWGRP
+#include "sgroupio.h"
+#endif
+#ifdef ENABLE_SUBIDS
+#include "subordinateio.h"
+#endif
+
+const char *Prog = "bench";
+
+static unsigned long n_users = 10000;
+static unsigned long n_big = 10;		/* groups with many members */
+static unsigned long n_members = 10000;	/* members of these groups */
+static unsigned long max_members = 1000;	/* MAX_MEMBERS_PER_GROUP */
+static unsigned long rounds = 10;
+static unsigned long n_lookups = 100000;
+static const char *dir = NULL;
+
+static struct timespec bench_start;
+
+static void usage (int status)
+{
+	FILE *out = (0 == status) ? stdout : stderr;
+
+	(void) fprintf (out,
+	                "Usage: %s [options]\n"
+	                "\n"
+	                "Options:\n"
+	                "  -n USERS     number of users (default %lu)\n"
+	                "  -b GROUPS    number of big groups (default %lu)\n"
+	                "  -m MEMBERS   members of the big groups (default %lu)\n"
+	                "  -s MAX       MAX_MEMBERS_PER_GROUP, 0 to disable split groups (default %lu)\n"
+	                "  -r ROUNDS    rounds of the open/close benchmarks (default %lu)\n"
+	                "  -l LOOKUPS   number of lookups (default %lu)\n"
+	                "  -d DIR       directory of the database (default: a new directory in /tmp)\n",
+	                Prog, n_users, n_big, n_members, max_members, rounds,
+	                n_lookups);
+	exit (status);
+}
+
+static void fail (const char *what)
+{
+	(void) fprintf (stderr, "%s: %s failed: %s\n",
+	                Prog, what, strerror (errno));
+	exit (EXIT_FAILURE);
+}
+
+static FILE *create (const char *name)
+{
+	char path[1024];
+	FILE *fp;
+
+	(void) snprintf (path, sizeof path, "%s/etc/%s", dir, name);
+	fp = fopen (path, "w");
+	if (NULL == fp) {
+		fail (path);
+	}
+	return fp;
+}
+
+static void done (FILE *fp, const char *name)
+{
+	if ((ferror (fp) != 0) || (fclose (fp) != 0)) {
+		fail (name);
+	}
+}
+
+/*
+ * generate - Write the synthetic database.
+ *
+ *	Each user u<i> has a UID and a private group g<i> of 1000+i.
+ *	The big groups big<j> have the first n_members users as members.
+ *	In the group file, they are split in lines of max_members members
+ *	(when max_members is not 0), as with MAX_MEMBERS_PER_GROUP.
+ */
+static void generate (void)
+{
+	char path[1024];
+	FILE *fp;
+	unsigned long i, j, k;
+	unsigned long members = (n_members < n_users) ? n_members : n_users;
+
+	(void) snprintf (path, sizeof path, "%s/etc", dir);
+	if ((mkdir (path, 0755) != 0) && (EEXIST != errno)) {
+		fail (path);
+	}
+
+	fp = create ("login.defs");
+	(void) fprintf (fp,
+	                "UID_MIN %lu\nUID_MAX %lu\nGID_MIN %lu\nGID_MAX %lu\n"
+	                "SUB_UID_MIN 100000\nSUB_UID_MAX 4000000000\n"
+	                "SUB_GID_MIN 100000\nSUB_GID_MAX 4000000000\n"
+	                "MAX_MEMBERS_PER_GROUP %lu\n",
+	                1000UL, 1000UL + n_users + 1000UL,
+	                1000UL, 1000UL + n_users + n_big + 1000UL,
+	                max_members);
+	done (fp, "login.defs");
+
+	fp = create ("passwd");
+	(void) fprintf (fp, "root:x:0:0:root:/root:/bin/sh\n");
+	for (i = 0; i < n_users; i++) {
+		(void) fprintf (fp, "u%lu:x:%lu:%lu:User %lu:/home/u%lu:/bin/sh\n",
+		                i, 1000 + i, 1000 + i, i, i);
+	}
+	done (fp, "passwd");
+
+	fp = create ("shadow");
+	(void) fprintf (fp, "root:*:17000:0:99999:7:::\n");
+	for (i = 0; i < n_users; i++) {
+		(void) fprintf (fp,
+		                "u%lu:$6$%08lx$Jd6MZxPjvB1.zhXh9W7NsRbSn6y2UaUCqm9yB5wNdpLaM9f0iXQ8Ujr3z2aI8p4o7fvHkE6bqSNu1oGmRzDQ1:17000:0:99999:7:::\n",
+		                i, i);
+	}
+	done (fp, "shadow");
+
+	fp = create ("group");
+	(void) fprintf (fp, "root:x:0:\n");
+	for (i = 0; i < n_users; i++) {
+		(void) fprintf (fp, "g%lu:x:%lu:\n", i, 1000 + i);
+	}
+	for (j = 0; j < n_big; j++) {
+		i = 0;
+		do {
+			(void) fprintf (fp, "big%lu:x:%lu:", j, 1000 + n_users + j);
+			for (k = 0;
+			     (i < members) && ((0 == max_members) || (k < max_members));
+			     i++, k++) {
+				(void) fprintf (fp, "%su%lu", (0 == k) ? "" : ",", i);
+			}
+			(void) fputc ('\n', fp);
+		} while (i < members);
+	}
+	done (fp, "group");
+
+	fp = create ("gshadow");
+	(void) fprintf (fp, "root:*::\n");
+	for (i = 0; i < n_users; i++) {
+		(void) fprintf (fp, "g%lu:!::\n", i);
+	}
+	for (j = 0; j < n_big; j++) {
+		(void) fprintf (fp, "big%lu:!::", j);
+		for (i = 0; i < members; i++) {
+			(void) fprintf (fp, "%su%lu", (0 == i) ? "" : ",", i);
+		}
+		(void) fputc ('\n', fp);
+	}
+	done (fp, "gshadow");
+
+	/* At most 60000 ranges of 65536 IDs fit below SUB_UID_MAX */
+	fp = create ("subuid");
+	for (i = 0; (i < n_users) && (i < 60000); i++) {
+		(void) fprintf (fp, "u%lu:%lu:65536\n", i, 100000 + i * 65536);
+	}
+	done (fp, "subuid");
+
+	fp = create ("subgid");
+	for (i = 0; (i < n_users) && (i < 60000); i++) {
+		(void) fprintf (fp, "u%lu:%lu:65536\n", i, 100000 + i * 65536);
+	}
+	done (fp, "subgid");
+}
+
+static void start (void)
+{
+	(void) clock_gettime (CLOCK_MONOTONIC, &bench_start);
+}
+
+/*
+ * stop - Report a benchmark of ops operations, started with start().
+ */
+static void stop (const char *name, unsigned long ops)
+{
+	struct timespec now;
+	struct rusage ru;
+	double secs;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &now);
+	secs =   (double) (now.tv_sec - bench_start.tv_sec)
+	       + (double) (now.tv_nsec - bench_start.tv_nsec) / 1e9;
+	if (getrusage (RUSAGE_SELF, &ru) != 0) {
+		ru.ru_maxrss = 0;
+	}
+	(void) printf ("%-24s %10lu %12.6f %14.1f %12ld\n",
+	               name, ops, secs,
+	               (secs > 0) ? (double) ops / secs : 0.0,
+	               ru.ru_maxrss);
+	(void) fflush (stdout);
+}
+
+/*
+ * user_name - Name of a pseudo random user (or a missing user, 1 out
+ *             of 8).
+ */
+static const char *user_name (unsigned long i)
+{
+	static char name[32];
+	unsigned long u = (i * 2654435761UL) % (n_users + n_users / 8 + 1);
+
+	(void) snprintf (name, sizeof name, "u%lu", u);
+	return name;
+}
+
+static void bench_passwd (void)
+{
+	struct passwd pw;
+	const struct passwd *ppw;
+	unsigned long i, found = 0, updates;
+	uid_t uid;
+
+	start ();
+	for (i = 0; i < rounds; i++) {
+		if (pw_open (O_RDONLY) == 0) {
+			fail ("pw_open");
+		}
+		(void) pw_close ();
+	}
+	stop ("pw_open+close (ro)", rounds);
+
+	if (pw_open (O_RDONLY) == 0) {
+		fail ("pw_open");
+	}
+	start ();
+	for (i = 0; i < n_lookups; i++) {
+		if (pw_locate (user_name (i)) != NULL) {
+			found++;
+		}
+	}
+	stop ("pw_locate", n_lookups);
+
+	start ();
+	for (i = 0; i < n_lookups; i++) {
+		if (pw_locate_uid ((uid_t) (1000 + (i * 2654435761UL) % (n_users + 1))) != NULL) {
+			found++;
+		}
+	}
+	stop ("pw_locate_uid", n_lookups);
+	(void) pw_close ();
+
+	if (pw_lock () == 0) {
+		fail ("pw_lock");
+	}
+	if (pw_open (O_RDWR) == 0) {
+		fail ("pw_open");
+	}
+	if (find_new_uid (false, &uid, NULL) != 0) {
+		fail ("find_new_uid");
+	}
+	start ();
+	for (i = 0; i < rounds; i++) {
+		if (find_new_uid (false, &uid, NULL) != 0) {
+			fail ("find_new_uid");
+		}
+	}
+	stop ("find_new_uid", rounds);
+
+	/* Update 1% of the users */
+	updates = n_users / 100 + 1;
+	start ();
+	for (i = 0; i < updates; i++) {
+		ppw = pw_locate (user_name (i));
+		if (NULL == ppw) {
+			continue;
+		}
+		pw = *ppw;
+		pw.pw_gecos = "Updated";
+		if (pw_update (&pw) == 0) {
+			fail ("pw_update");
+		}
+	}
+	stop ("pw_update", updates);
+
+	start ();
+	if (pw_close () == 0) {
+		fail ("pw_close");
+	}
+	stop ("pw_close (changed)", 1);
+	(void) pw_unlock ();
+
+	if (0 == found) {
+		(void) fprintf (stderr, "%s: no users were found\n", Prog);
+	}
+}
+
+static void bench_shadow (void)
+{
+	unsigned long i;
+
+	start ();
+	for (i = 0; i < rounds; i++) {
+		if (spw_open (O_RDONLY) == 0) {
+			fail ("spw_open");
+		}
+		(void) spw_close ();
+	}
+	stop ("spw_open+close (ro)", rounds);
+
+	if (spw_open (O_RDONLY) == 0) {
+		fail ("spw_open");
+	}
+	start ();
+	for (i = 0; i < n_lookups; i++) {
+		(void) spw_locate (user_name (i));
+	}
+	stop ("spw_locate", n_lookups);
+	(void) spw_close ();
+}
+
+/*
+ * bench_group - The open merges the split groups (merge_group_entries)
+ *               and the close splits them again (split_groups).
+ */
+static void bench_group (void)
+{
+	struct group gr;
+	const struct group *pgr;
+	unsigned long i;
+	gid_t gid;
+	char name[32];
+
+	start ();
+	for (i = 0; i < rounds; i++) {
+		if (gr_open (O_RDONLY) == 0) {
+			fail ("gr_open");
+		}
+		(void) gr_close ();
+	}
+	stop ((0 != max_members) ? "gr_open+close (merge)"
+	                         : "gr_open+close (ro)", rounds);
+
+	if (gr_open (O_RDONLY) == 0) {
+		fail ("gr_open");
+	}
+	start ();
+	for (i = 0; i < n_lookups; i++) {
+		(void) snprintf (name, sizeof name, "g%lu",
+		                 (i * 2654435761UL) % (n_users + 1));
+		(void) gr_locate (name);
+	}
+	stop ("gr_locate", n_lookups);
+	(void) gr_close ();
+
+	if (gr_lock () == 0) {
+		fail ("gr_lock");
+	}
+	if (gr_open (O_RDWR) == 0) {
+		fail ("gr_open");
+	}
+	start ();
+	for (i = 0; i < rounds; i++) {
+		if (find_new_gid (false, &gid, NULL) != 0) {
+			fail ("find_new_gid");
+		}
+	}
+	stop ("find_new_gid", rounds);
+
+	/* Change all the big groups, so that they are all split again */
+	start ();
+	for (i = 0; i < n_big; i++) {
+		(void) snprintf (name, sizeof name, "big%lu", i);
+		pgr = gr_locate (name);
+		if (NULL == pgr) {
+			continue;
+		}
+		gr = *pgr;
+		gr.gr_passwd = "*";
+		if (gr_update (&gr) == 0) {
+			fail ("gr_update");
+		}
+	}
+	stop ("gr_update (big)", n_big);
+
+	start ();
+	if (gr_close () == 0) {
+		fail ("gr_close");
+	}
+	stop ((0 != max_members) ? "gr_close (split)" : "gr_close (changed)",
+	      1);
+	(void) gr_unlock ();
+
+#ifdef SHADOWGRP
+	start ();
+	for (i = 0; i < rounds; i++) {
+		if (sgr_open (O_RDONLY) == 0) {
+			fail ("sgr_open");
+		}
+		(void) sgr_close ();
+	}
+	stop ("sgr_open+close (ro)", rounds);
+#endif
+}
+
+#ifdef ENABLE_SUBIDS
+static void bench_subids (void)
+{
+	unsigned long i, count;
+	uid_t start_id;
+
+	start ();
+	for (i = 0; i < rounds; i++) {
+		if (sub_uid_open (O_RDONLY) == 0) {
+			fail ("sub_uid_open");
+		}
+		(void) sub_uid_close ();
+	}
+	stop ("sub_uid_open+close (ro)", rounds);
+
+	if (sub_uid_open (O_RDONLY) == 0) {
+		fail ("sub_uid_open");
+	}
+	start ();
+	for (i = 0; i < rounds; i++) {
+		if (find_new_sub_uids ("new", &start_id, &count) != 0) {
+			fail ("find_new_sub_uids");
+		}
+	}
+	stop ("find_new_sub_uids", rounds);
+	(void) sub_uid_close ();
+}
+#endif
+
+int main (int argc, char **argv)
+{
+	char tmpdir[] = "/tmp/shadow-bench.XXXXXX";
+	char *prefix_argv[4];
+	int c;
+
+	while ((c = getopt (argc, argv, "b:d:hl:m:n:r:s:")) != -1) {
+		switch (c) {
+		case 'b':
+			n_big = strtoul (optarg, NULL, 10);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'h':
+			usage (EXIT_SUCCESS);
+			break;
+		case 'l':
+			n_lookups = strtoul (optarg, NULL, 10);
+			break;
+		case 'm':
+			n_members = strtoul (optarg, NULL, 10);
+			break;
+		case 'n':
+			n_users = strtoul (optarg, NULL, 10);
+			break;
+		case 'r':
+			rounds = strtoul (optarg, NULL, 10);
+			break;
+		case 's':
+			max_members = strtoul (optarg, NULL, 10);
+			break;
+		default:
+			usage (EXIT_FAILURE);
+		}
+	}
+
+	if (NULL == dir) {
+		dir = mkdtemp (tmpdir);
+		if (NULL == dir) {
+			fail ("mkdtemp");
+		}
+	}
+
+	(void) printf ("# %lu users, %lu groups of %lu members (split at %lu), in %s\n",
+	               n_users, n_big, n_members, max_members, dir);
+	start ();
+	generate ();
+	stop ("generate", 1);
+
+	/* Use the generated database, as with --prefix */
+	prefix_argv[0] = (char *) Prog;
+	prefix_argv[1] = "--prefix";
+	prefix_argv[2] = (char *) dir;
+	prefix_argv[3] = NULL;
+	(void) process_prefix_flag ("-P", 3, prefix_argv);
+
+	(void) printf ("%-24s %10s %12s %14s %12s\n",
+	               "# benchmark", "ops", "seconds", "ops/s", "maxrss(KiB)");
+	bench_passwd ();
+	bench_shadow ();
+	bench_group ();
+#ifdef ENABLE_SUBIDS
+	bench_subids ();
+#endif
+
+	return EXIT_SUCCESS;
+}
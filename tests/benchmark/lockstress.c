@@ -0,0 +1,734 @@
+/*
+ * Stress test of the locks of the databases.
+ *
+ * A database (passwd, shadow, group, gshadow and login.defs) with -u
+ * users is generated in a directory, which is used as the --prefix of
+ * the tools. -w writer processes then change it at the same time, with
+ * -n operations each, in turn:
+ *	add	a user s<writer>_<op>, with a group of its own (passwd,
+ *		shadow, group, gshadow), like useradd
+ *	modify	the comment of one of the generated users (passwd), like
+ *		usermod -c
+ *	member	the user of the previous add becomes a member of the group
+ *		"shared" (group, gshadow), like usermod -a -G
+ *
+ * The databases are locked and written like the tools do (-m):
+ *	locked		all the databases of the operation are locked with
+ *			commonio_lock_set(), opened, changed and closed
+ *	txn		the same, but they are written with a transaction
+ *	optimistic	they are opened and changed without the locks,
+ *			then locked with commonio_lock_optimistic(), and
+ *			the operation is started again when another writer
+ *			changed them in the meantime
+ *
+ * The operations per second, the distribution of the time waited for
+ * the locks, and the failures (the operations which could not get their
+ * locks within LOCK_TIMEOUT, set with -T) are reported. LOCK_QUEUE is
+ * set with -q.
+ *
+ * The database is then checked: the users and the members of each
+ * operation which succeeded must be there exactly once, the other ones
+ * must not, and no lock file may be left.
+ *
+ * It must run as root: the locks are not retried for the other users.
+ * The directory is left for inspection.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "commonio.h"
+#include "pwio.h"
+#include "shadowio.h"
+#include "groupio.h"
+#include "sgroupio.h"
+
+const char *Prog = "lockstress";
+
+static unsigned long n_writers = 8;
+static unsigned long n_ops = 100;
+static unsigned long n_users = 1000;
+static unsigned long lock_timeout = 15;
+static bool lock_queue = false;
+static const char *dir = NULL;
+
+enum lock_mode {
+	MODE_LOCKED,
+	MODE_TXN,
+	MODE_OPTIMISTIC
+};
+
+static enum lock_mode mode = MODE_LOCKED;
+static const char *const mode_names[] = { "locked", "txn", "optimistic" };
+
+/* The UIDs and GIDs of the added users */
+#define ADDED_ID	100000
+
+/* The outcome of each operation, shared with the writers */
+enum op_status {
+	OP_PENDING,
+	OP_DONE,
+	OP_TIMEOUT,		/* the locks could not be obtained */
+	OP_SKIPPED,		/* the user of a member operation is missing */
+	OP_ERROR
+};
+
+struct op_result {
+	enum op_status status;
+	unsigned int stale;	/* optimistic attempts started again */
+	double wait;		/* seconds waited for the locks */
+};
+
+static struct op_result *results;
+
+static void usage (int status)
+{
+	FILE *out = (0 == status) ? stdout : stderr;
+
+	(void) fprintf (out,
+	                "Usage: %s [options]\n"
+	                "\n"
+	                "Options:\n"
+	                "  -w WRITERS   number of writer processes (default %lu)\n"
+	                "  -n OPS       operations of each writer (default %lu)\n"
+	                "  -u USERS     users of the generated database (default %lu)\n"
+	                "  -m MODE      locked, txn or optimistic (default %s)\n"
+	                "  -q           set LOCK_QUEUE\n"
+	                "  -T SECONDS   LOCK_TIMEOUT (default %lu)\n"
+	                "  -d DIR       directory of the database (default: a new directory in /tmp)\n",
+	                Prog, n_writers, n_ops, n_users, mode_names[mode],
+	                lock_timeout);
+	exit (status);
+}
+
+static void fail (const char *what)
+{
+	(void) fprintf (stderr, "%s: %s failed: %s\n",
+	                Prog, what, strerror (errno));
+	exit (EXIT_FAILURE);
+}
+
+static FILE *create (const char *name)
+{
+	char path[1024];
+	FILE *fp;
+
+	(void) snprintf (path, sizeof path, "%s/etc/%s", dir, name);
+	fp = fopen (path, "w");
+	if (NULL == fp) {
+		fail (path);
+	}
+	return fp;
+}
+
+static void done (FILE *fp, const char *name)
+{
+	if ((ferror (fp) != 0) || (fclose (fp) != 0)) {
+		fail (name);
+	}
+}
+
+/*
+ * generate - Write the database: the users u<i>, with a UID and a
+ *            private group g<i> of 1000+i, and the empty group shared.
+ */
+static void generate (void)
+{
+	char path[1024];
+	unsigned long i;
+	FILE *fp;
+
+	(void) snprintf (path, sizeof path, "%s/etc", dir);
+	if ((mkdir (path, 0755) != 0) && (EEXIST != errno)) {
+		fail (path);
+	}
+
+	fp = create ("login.defs");
+	(void) fprintf (fp, "LOCK_TIMEOUT %lu\nLOCK_QUEUE %s\n",
+	                lock_timeout, lock_queue ? "yes" : "no");
+	done (fp, "login.defs");
+
+	fp = create ("passwd");
+	(void) fprintf (fp, "root:x:0:0:root:/root:/bin/sh\n");
+	for (i = 0; i < n_users; i++) {
+		(void) fprintf (fp, "u%lu:x:%lu:%lu:User %lu:/home/u%lu:/bin/sh\n",
+		                i, 1000 + i, 1000 + i, i, i);
+	}
+	done (fp, "passwd");
+
+	fp = create ("shadow");
+	(void) fprintf (fp, "root:*:17000:0:99999:7:::\n");
+	for (i = 0; i < n_users; i++) {
+		(void) fprintf (fp, "u%lu:!:17000:0:99999:7:::\n", i);
+	}
+	done (fp, "shadow");
+
+	fp = create ("group");
+	(void) fprintf (fp, "root:x:0:\nshared:x:999:\n");
+	for (i = 0; i < n_users; i++) {
+		(void) fprintf (fp, "g%lu:x:%lu:\n", i, 1000 + i);
+	}
+	done (fp, "group");
+
+	fp = create ("gshadow");
+	(void) fprintf (fp, "root:*::\nshared:!::\n");
+	for (i = 0; i < n_users; i++) {
+		(void) fprintf (fp, "g%lu:!::\n", i);
+	}
+	done (fp, "gshadow");
+}
+
+static double now (void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/*
+ * The changes of the operations, once the databases are open
+ */
+static bool apply_add (const char *name, unsigned long id)
+{
+	static char *empty[] = { NULL };
+	struct passwd pwent;
+	struct spwd spent;
+	struct group grent;
+	struct sgrp sgent;
+
+	pwent.pw_name = (char *) name;
+	pwent.pw_passwd = "x";
+	pwent.pw_uid = (uid_t) id;
+	pwent.pw_gid = (gid_t) id;
+	pwent.pw_gecos = "";
+	pwent.pw_dir = "/home/stress";
+	pwent.pw_shell = "/bin/sh";
+
+	memzero (&spent, sizeof spent);
+	spent.sp_namp = (char *) name;
+	spent.sp_pwdp = "!";
+	spent.sp_lstchg = -1;
+	spent.sp_min = -1;
+	spent.sp_max = -1;
+	spent.sp_warn = -1;
+	spent.sp_inact = -1;
+	spent.sp_expire = -1;
+	spent.sp_flag = SHADOW_SP_FLAG_UNSET;
+
+	grent.gr_name = (char *) name;
+	grent.gr_passwd = "x";
+	grent.gr_gid = (gid_t) id;
+	grent.gr_mem = empty;
+
+	sgent.sg_name = (char *) name;
+	sgent.sg_passwd = "!";
+	sgent.sg_adm = empty;
+	sgent.sg_mem = empty;
+
+	return    (pw_update (&pwent) != 0)
+	       && (spw_update (&spent) != 0)
+	       && (gr_update (&grent) != 0)
+	       && (sgr_update (&sgent) != 0);
+}
+
+static bool apply_modify (const char *name, const char *gecos)
+{
+	const struct passwd *pw = pw_locate (name);
+	struct passwd pwent;
+
+	if (NULL == pw) {
+		return false;
+	}
+	pwent = *pw;
+	pwent.pw_gecos = (char *) gecos;
+	return (pw_update (&pwent) != 0);
+}
+
+/*
+ * apply_member - add name to the members of shared
+ *
+ *	It returns -1 if name does not exist.
+ */
+static int apply_member (const char *name)
+{
+	const struct group *gr = gr_locate ("shared");
+	const struct sgrp *sg = sgr_locate ("shared");
+	struct group *ngr;
+	struct sgrp *nsg;
+	int ok;
+
+	if (pw_locate (name) == NULL) {
+		return -1;
+	}
+	if ((NULL == gr) || (NULL == sg)) {
+		return 0;
+	}
+	ngr = __gr_dup (gr);
+	nsg = __sgr_dup (sg);
+	if ((NULL == ngr) || (NULL == nsg)) {
+		return 0;
+	}
+	ngr->gr_mem = add_list (ngr->gr_mem, name);
+	nsg->sg_mem = add_list (nsg->sg_mem, name);
+	ok = (gr_update (ngr) != 0) && (sgr_update (nsg) != 0);
+	gr_free (ngr);
+	sgr_free (nsg);
+	return ok;
+}
+
+/*
+ * discard - Close the databases without their changes, and unlock them.
+ */
+static void discard (struct commonio_db *const *dbs, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		(void) commonio_unlock (dbs[i]);
+	}
+}
+
+/*
+ * run_op - Run the operation op of a writer.
+ *
+ *	The member operations read passwd, which is thus opened (without
+ *	its lock) when it is not one of the databases of the operation.
+ */
+static void run_op (unsigned long writer, unsigned long op,
+                    struct op_result *r)
+{
+	struct commonio_db *dbs[4];
+	struct commonio_txn txn;
+	char name[64];
+	char gecos[64];
+	size_t count = 0, failed, i;
+	double start;
+	int ret;
+
+	switch (op % 3) {
+	case 0:
+		dbs[count++] = __pw_get_db ();
+		dbs[count++] = __spw_get_db ();
+		dbs[count++] = __gr_get_db ();
+		dbs[count++] = __sgr_get_db ();
+		(void) snprintf (name, sizeof name, "s%lu_%lu", writer, op);
+		break;
+	case 1:
+		dbs[count++] = __pw_get_db ();
+		(void) snprintf (name, sizeof name, "u%lu",
+		                 (writer * n_ops + op) % n_users);
+		(void) snprintf (gecos, sizeof gecos, "writer %lu op %lu",
+		                 writer, op);
+		break;
+	default:
+		dbs[count++] = __gr_get_db ();
+		dbs[count++] = __sgr_get_db ();
+		(void) snprintf (name, sizeof name, "s%lu_%lu",
+		                 writer, op - 2);
+		break;
+	}
+
+	for (;;) {
+		if (MODE_OPTIMISTIC == mode) {
+			for (i = 0; i < count; i++) {
+				if (commonio_open_optimistic (dbs[i],
+				                              O_CREAT | O_RDWR) == 0) {
+					discard (dbs, count);
+					r->status = OP_ERROR;
+					return;
+				}
+			}
+		} else {
+			start = now ();
+			ret = commonio_lock_set (dbs, count, &failed);
+			r->wait += now () - start;
+			if (0 == ret) {
+				r->status = OP_TIMEOUT;
+				return;
+			}
+			for (i = 0; i < count; i++) {
+				if (commonio_open (dbs[i], O_CREAT | O_RDWR) == 0) {
+					discard (dbs, count);
+					r->status = OP_ERROR;
+					return;
+				}
+			}
+		}
+		if ((op % 3 == 2) && (pw_open (O_RDONLY) == 0)) {
+			discard (dbs, count);
+			r->status = OP_ERROR;
+			return;
+		}
+
+		switch (op % 3) {
+		case 0:
+			ret = apply_add (name, ADDED_ID + writer * n_ops + op)
+			      ? 1 : 0;
+			break;
+		case 1:
+			ret = apply_modify (name, gecos) ? 1 : 0;
+			break;
+		default:
+			ret = apply_member (name);
+			break;
+		}
+		if (op % 3 == 2) {
+			(void) pw_close ();
+		}
+		if (ret <= 0) {
+			discard (dbs, count);
+			r->status = (ret < 0) ? OP_SKIPPED : OP_ERROR;
+			return;
+		}
+
+		if (MODE_OPTIMISTIC != mode) {
+			break;
+		}
+		start = now ();
+		ret = commonio_lock_optimistic (dbs, count, &failed);
+		r->wait += now () - start;
+		if (0 != ret) {
+			break;
+		}
+		if (ESTALE != errno) {
+			discard (dbs, count);
+			r->status = OP_TIMEOUT;
+			return;
+		}
+		r->stale++;
+	}
+
+	if (MODE_TXN == mode) {
+		commonio_txn_init (&txn);
+		for (i = 0; i < count; i++) {
+			(void) commonio_txn_add (&txn, dbs[i]);
+		}
+		ret = commonio_txn_commit (&txn);
+	} else {
+		ret = 1;
+		for (i = 0; i < count; i++) {
+			if (commonio_close (dbs[i]) == 0) {
+				ret = 0;
+			}
+		}
+	}
+	for (i = 0; i < count; i++) {
+		(void) commonio_unlock (dbs[i]);
+	}
+	r->status = (0 != ret) ? OP_DONE : OP_ERROR;
+}
+
+static void writer (unsigned long w)
+{
+	unsigned long op;
+
+	for (op = 0; op < n_ops; op++) {
+		run_op (w, op, &results[w * n_ops + op]);
+	}
+	_exit (EXIT_SUCCESS);
+}
+
+static int wait_cmp (const void *p1, const void *p2)
+{
+	double w1 = *(const double *) p1;
+	double w2 = *(const double *) p2;
+
+	return (w1 > w2) - (w1 < w2);
+}
+
+static void report (double secs)
+{
+	unsigned long total = n_writers * n_ops;
+	unsigned long counts[OP_ERROR + 1] = { 0 };
+	unsigned long stale = 0, n = 0, i;
+	double *waits;
+
+	waits = (double *) xmalloc ((total + 1) * sizeof *waits);
+	for (i = 0; i < total; i++) {
+		counts[results[i].status]++;
+		stale += results[i].stale;
+		if (OP_SKIPPED != results[i].status) {
+			waits[n++] = results[i].wait;
+		}
+	}
+	qsort (waits, n, sizeof *waits, wait_cmp);
+	if (0 == n) {
+		waits[n++] = 0;
+	}
+
+	(void) printf ("operations %lu: done %lu, timeouts %lu, skipped %lu, errors %lu, restarted %lu\n",
+	               total, counts[OP_DONE], counts[OP_TIMEOUT],
+	               counts[OP_SKIPPED], counts[OP_ERROR] + counts[OP_PENDING],
+	               stale);
+	(void) printf ("seconds %.3f, operations/s %.1f\n",
+	               secs, (secs > 0) ? (double) counts[OP_DONE] / secs : 0.0);
+	(void) printf ("lock wait (ms): min %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+	               waits[0] * 1e3,
+	               waits[(n - 1) * 50 / 100] * 1e3,
+	               waits[(n - 1) * 90 / 100] * 1e3,
+	               waits[(n - 1) * 99 / 100] * 1e3,
+	               waits[n - 1] * 1e3);
+	free (waits);
+}
+
+static unsigned long errors = 0;
+
+static void inconsistent (const char *fmt, const char *name)
+{
+	(void) fputs ("inconsistent: ", stdout);
+	(void) printf (fmt, name);
+	(void) putchar ('\n');
+	errors++;
+}
+
+static unsigned long count_entries (struct commonio_db *db)
+{
+	unsigned long n = 0;
+
+	(void) commonio_rewind (db);
+	while (commonio_next (db) != NULL) {
+		n++;
+	}
+	return n;
+}
+
+/*
+ * check - Check the database after the run.
+ */
+static bool check (void)
+{
+	static const char *const files[] = {
+		"passwd", "shadow", "group", "gshadow"
+	};
+	unsigned long added = 0, members = 0, w, op;
+	const struct group *shared;
+	const struct sgrp *sshared;
+	char path[1024];
+	char name[64];
+	size_t i;
+
+	for (i = 0; i < sizeof files / sizeof files[0]; i++) {
+		(void) snprintf (path, sizeof path, "%s/etc/%s.lock",
+		                 dir, files[i]);
+		if (access (path, F_OK) == 0) {
+			inconsistent ("%s is left", path);
+		}
+	}
+
+	if (   (pw_open (O_RDONLY) == 0)
+	    || (spw_open (O_RDONLY) == 0)
+	    || (gr_open (O_RDONLY) == 0)
+	    || (sgr_open (O_RDONLY) == 0)) {
+		inconsistent ("%s cannot be read", "the database");
+		return false;
+	}
+
+	for (w = 0; w < n_writers; w++) {
+		for (op = 0; op < n_ops; op += 3) {
+			const struct op_result *r = &results[w * n_ops + op];
+			bool present = (OP_DONE == r->status);
+			const struct passwd *pw;
+			const struct group *gr;
+
+			(void) snprintf (name, sizeof name, "s%lu_%lu", w, op);
+			pw = pw_locate (name);
+			gr = gr_locate (name);
+			if (present) {
+				added++;
+			}
+			if (present != (NULL != pw)) {
+				inconsistent (present ? "user %s is missing"
+				                      : "user %s was added", name);
+			} else if (   (NULL != pw)
+			           && (pw->pw_uid != ADDED_ID + w * n_ops + op)) {
+				inconsistent ("user %s has a wrong UID", name);
+			}
+			if (present != (spw_locate (name) != NULL)) {
+				inconsistent ("shadow entry of %s", name);
+			}
+			if (present != (NULL != gr)) {
+				inconsistent ("group %s", name);
+			} else if (   (NULL != gr)
+			           && (gr->gr_gid != ADDED_ID + w * n_ops + op)) {
+				inconsistent ("group %s has a wrong GID", name);
+			}
+			if (present != (sgr_locate (name) != NULL)) {
+				inconsistent ("gshadow entry of %s", name);
+			}
+		}
+	}
+
+	shared = gr_locate ("shared");
+	sshared = sgr_locate ("shared");
+	if ((NULL == shared) || (NULL == sshared)) {
+		inconsistent ("group %s is missing", "shared");
+		return false;
+	}
+	for (w = 0; w < n_writers; w++) {
+		for (op = 2; op < n_ops; op += 3) {
+			bool present =
+			    (OP_DONE == results[w * n_ops + op].status);
+
+			(void) snprintf (name, sizeof name, "s%lu_%lu",
+			                 w, op - 2);
+			if (present) {
+				members++;
+			}
+			if (present != is_on_list (shared->gr_mem, name)) {
+				inconsistent ("membership of %s in group", name);
+			}
+			if (present != is_on_list (sshared->sg_mem, name)) {
+				inconsistent ("membership of %s in gshadow", name);
+			}
+		}
+	}
+	for (i = 0; NULL != shared->gr_mem[i]; i++) {
+	}
+	if (i != members) {
+		inconsistent ("%s has duplicated members", "shared");
+	}
+
+	/* Duplicated entries */
+	if (count_entries (__pw_get_db ()) != 1 + n_users + added) {
+		inconsistent ("%s has duplicated or lost entries", "passwd");
+	}
+	if (count_entries (__spw_get_db ()) != 1 + n_users + added) {
+		inconsistent ("%s has duplicated or lost entries", "shadow");
+	}
+	if (count_entries (__gr_get_db ()) != 2 + n_users + added) {
+		inconsistent ("%s has duplicated or lost entries", "group");
+	}
+	if (count_entries (__sgr_get_db ()) != 2 + n_users + added) {
+		inconsistent ("%s has duplicated or lost entries", "gshadow");
+	}
+
+	(void) pw_close ();
+	(void) spw_close ();
+	(void) gr_close ();
+	(void) sgr_close ();
+	return (0 == errors);
+}
+
+int main (int argc, char **argv)
+{
+	char tmpdir[] = "/tmp/shadow-lockstress.XXXXXX";
+	char *prefix_argv[4];
+	unsigned long w;
+	double start;
+	int c, status;
+	bool ok = true;
+
+	while ((c = getopt (argc, argv, "d:hm:n:qT:u:w:")) != -1) {
+		switch (c) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'h':
+			usage (EXIT_SUCCESS);
+			break;
+		case 'm':
+			if (strcmp (optarg, "locked") == 0) {
+				mode = MODE_LOCKED;
+			} else if (strcmp (optarg, "txn") == 0) {
+				mode = MODE_TXN;
+			} else if (strcmp (optarg, "optimistic") == 0) {
+				mode = MODE_OPTIMISTIC;
+			} else {
+				usage (EXIT_FAILURE);
+			}
+			break;
+		case 'n':
+			n_ops = strtoul (optarg, NULL, 10);
+			break;
+		case 'q':
+			lock_queue = true;
+			break;
+		case 'T':
+			lock_timeout = strtoul (optarg, NULL, 10);
+			break;
+		case 'u':
+			n_users = strtoul (optarg, NULL, 10);
+			break;
+		case 'w':
+			n_writers = strtoul (optarg, NULL, 10);
+			break;
+		default:
+			usage (EXIT_FAILURE);
+		}
+	}
+	if ((0 == n_writers) || (0 == n_ops) || (0 == n_users)) {
+		usage (EXIT_FAILURE);
+	}
+	if (geteuid () != 0) {
+		(void) fprintf (stderr, "%s: the locks are only retried for root\n",
+		                Prog);
+		exit (EXIT_FAILURE);
+	}
+
+	if (NULL == dir) {
+		dir = mkdtemp (tmpdir);
+		if (NULL == dir) {
+			fail ("mkdtemp");
+		}
+	}
+	generate ();
+
+	prefix_argv[0] = (char *) Prog;
+	prefix_argv[1] = "--prefix";
+	prefix_argv[2] = (char *) dir;
+	prefix_argv[3] = NULL;
+	(void) process_prefix_flag ("-P", 3, prefix_argv);
+
+	results = mmap (NULL, n_writers * n_ops * sizeof *results,
+	                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+	                -1, 0);
+	if (MAP_FAILED == results) {
+		fail ("mmap");
+	}
+
+	(void) printf ("# %lu writers, %lu operations each, %lu users, %s, LOCK_QUEUE %s, LOCK_TIMEOUT %lu, in %s\n",
+	               n_writers, n_ops, n_users, mode_names[mode],
+	               lock_queue ? "yes" : "no", lock_timeout, dir);
+	(void) fflush (stdout);
+
+	start = now ();
+	for (w = 0; w < n_writers; w++) {
+		pid_t pid = fork ();
+
+		if (pid < 0) {
+			fail ("fork");
+		}
+		if (0 == pid) {
+			writer (w);
+		}
+	}
+	while (wait (&status) > 0) {
+		if (!WIFEXITED (status) || (0 != WEXITSTATUS (status))) {
+			ok = false;
+		}
+	}
+	report (now () - start);
+	if (!ok) {
+		(void) printf ("inconsistent: a writer failed\n");
+	}
+
+	if (!check () || !ok) {
+		(void) printf ("consistency: FAILED\n");
+		return EXIT_FAILURE;
+	}
+	(void) printf ("consistency: OK\n");
+	return EXIT_SUCCESS;
+}
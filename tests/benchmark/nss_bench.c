@@ -0,0 +1,281 @@
+/*
+ * NSS module of the benchmark of login and su (see authbench.c).
+ *
+ * With "bench" as the source of passwd, group and shadow in
+ * nsswitch.conf, the users are read from NSS_BENCH_CONF at each lookup,
+ * and each lookup waits for the configured delay, like a remote
+ * directory would:
+ *
+ *	delay 2000
+ *	bench:x:60100:60100:benchmark:/tmp/home:/bin/true
+ *
+ * The delay is in microseconds. The users are in the format of
+ * /etc/passwd; each one has a group of its own (with the name and the
+ * GID of the user) and a locked shadow entry.
+ */
+
+#include <errno.h>
+#include <grp.h>
+#include <nss.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef NSS_BENCH_CONF
+#define NSS_BENCH_CONF	"/etc/nss-bench.conf"
+#endif
+
+struct bench_user {
+	char line[1024];
+	char *name;
+	char *gecos;
+	char *home;
+	char *shell;
+	uid_t uid;
+	gid_t gid;
+};
+
+enum lookup_key {
+	BY_NAME,
+	BY_UID,
+	BY_GID
+};
+
+/*
+ * parse_user - split a line of the configuration in the fields of u
+ */
+static bool parse_user (struct bench_user *u)
+{
+	char *fields[7];
+	char *cp = u->line;
+	char *end;
+	int i;
+
+	cp[strcspn (cp, "\n")] = '\0';
+	for (i = 0; i < 7; i++) {
+		fields[i] = cp;
+		cp = strchr (cp, ':');
+		if ((NULL == cp) != (6 == i)) {
+			return false;
+		}
+		if (NULL != cp) {
+			*cp++ = '\0';
+		}
+	}
+	u->name = fields[0];
+	u->uid = (uid_t) strtoul (fields[2], &end, 10);
+	if (('\0' == fields[2][0]) || ('\0' != *end)) {
+		return false;
+	}
+	u->gid = (gid_t) strtoul (fields[3], &end, 10);
+	if (('\0' == fields[3][0]) || ('\0' != *end)) {
+		return false;
+	}
+	u->gecos = fields[4];
+	u->home = fields[5];
+	u->shell = fields[6];
+	return true;
+}
+
+/*
+ * find_user - find the user of the configuration with the name, UID or
+ *             GID, after the configured delay
+ */
+static enum nss_status find_user (enum lookup_key key, const char *name,
+                                  unsigned long id, struct bench_user *u,
+                                  int *errnop)
+{
+	unsigned long delay = 0;
+	bool found = false;
+	FILE *fp;
+
+	fp = fopen (NSS_BENCH_CONF, "re");
+	if (NULL == fp) {
+		*errnop = errno;
+		return NSS_STATUS_UNAVAIL;
+	}
+	while (!found && (fgets (u->line, sizeof u->line, fp) != NULL)) {
+		if (strncmp (u->line, "delay ", 6) == 0) {
+			delay = strtoul (u->line + 6, NULL, 10);
+			continue;
+		}
+		if (!parse_user (u)) {
+			continue;
+		}
+		switch (key) {
+		case BY_NAME:
+			found = (strcmp (u->name, name) == 0);
+			break;
+		case BY_UID:
+			found = (u->uid == id);
+			break;
+		case BY_GID:
+			found = (u->gid == id);
+			break;
+		}
+	}
+	(void) fclose (fp);
+
+	if (0 != delay) {
+		struct timespec ts;
+
+		ts.tv_sec = (time_t) (delay / 1000000);
+		ts.tv_nsec = (long) (delay % 1000000) * 1000;
+		while ((nanosleep (&ts, &ts) != 0) && (EINTR == errno)) {
+		}
+	}
+
+	if (!found) {
+		*errnop = ENOENT;
+		return NSS_STATUS_NOTFOUND;
+	}
+	return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * store - copy s in the buffer of the caller
+ *
+ *	It returns NULL if the buffer is too small.
+ */
+static char *store (char **buf, size_t *left, const char *s)
+{
+	size_t len = strlen (s) + 1;
+	char *cp = *buf;
+
+	if (len > *left) {
+		return NULL;
+	}
+	memcpy (cp, s, len);
+	*buf += len;
+	*left -= len;
+	return cp;
+}
+
+static enum nss_status fill_passwd (const struct bench_user *u,
+                                    struct passwd *pwd, char *buf,
+                                    size_t buflen, int *errnop)
+{
+	pwd->pw_uid = u->uid;
+	pwd->pw_gid = u->gid;
+	if (   ((pwd->pw_name = store (&buf, &buflen, u->name)) == NULL)
+	    || ((pwd->pw_passwd = store (&buf, &buflen, "x")) == NULL)
+	    || ((pwd->pw_gecos = store (&buf, &buflen, u->gecos)) == NULL)
+	    || ((pwd->pw_dir = store (&buf, &buflen, u->home)) == NULL)
+	    || ((pwd->pw_shell = store (&buf, &buflen, u->shell)) == NULL)) {
+		*errnop = ERANGE;
+		return NSS_STATUS_TRYAGAIN;
+	}
+	return NSS_STATUS_SUCCESS;
+}
+
+static enum nss_status fill_group (const struct bench_user *u,
+                                   struct group *grp, char *buf,
+                                   size_t buflen, int *errnop)
+{
+	/* An empty list of members, aligned for the pointers */
+	size_t pad = (sizeof (char *) - (size_t) buf % sizeof (char *))
+	             % sizeof (char *);
+
+	if (buflen < pad + sizeof (char *)) {
+		*errnop = ERANGE;
+		return NSS_STATUS_TRYAGAIN;
+	}
+	grp->gr_mem = (char **) (void *) (buf + pad);
+	grp->gr_mem[0] = NULL;
+	buf += pad + sizeof (char *);
+	buflen -= pad + sizeof (char *);
+
+	grp->gr_gid = u->gid;
+	if (   ((grp->gr_name = store (&buf, &buflen, u->name)) == NULL)
+	    || ((grp->gr_passwd = store (&buf, &buflen, "x")) == NULL)) {
+		*errnop = ERANGE;
+		return NSS_STATUS_TRYAGAIN;
+	}
+	return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status _nss_bench_getpwnam_r (const char *name, struct passwd *pwd,
+                                       char *buf, size_t buflen,
+                                       int *errnop)
+{
+	struct bench_user u;
+	enum nss_status status;
+
+	status = find_user (BY_NAME, name, 0, &u, errnop);
+	if (NSS_STATUS_SUCCESS != status) {
+		return status;
+	}
+	return fill_passwd (&u, pwd, buf, buflen, errnop);
+}
+
+enum nss_status _nss_bench_getpwuid_r (uid_t uid, struct passwd *pwd,
+                                       char *buf, size_t buflen,
+                                       int *errnop)
+{
+	struct bench_user u;
+	enum nss_status status;
+
+	status = find_user (BY_UID, NULL, uid, &u, errnop);
+	if (NSS_STATUS_SUCCESS != status) {
+		return status;
+	}
+	return fill_passwd (&u, pwd, buf, buflen, errnop);
+}
+
+enum nss_status _nss_bench_getgrnam_r (const char *name, struct group *grp,
+                                       char *buf, size_t buflen,
+                                       int *errnop)
+{
+	struct bench_user u;
+	enum nss_status status;
+
+	status = find_user (BY_NAME, name, 0, &u, errnop);
+	if (NSS_STATUS_SUCCESS != status) {
+		return status;
+	}
+	return fill_group (&u, grp, buf, buflen, errnop);
+}
+
+enum nss_status _nss_bench_getgrgid_r (gid_t gid, struct group *grp,
+                                       char *buf, size_t buflen,
+                                       int *errnop)
+{
+	struct bench_user u;
+	enum nss_status status;
+
+	status = find_user (BY_GID, NULL, gid, &u, errnop);
+	if (NSS_STATUS_SUCCESS != status) {
+		return status;
+	}
+	return fill_group (&u, grp, buf, buflen, errnop);
+}
+
+enum nss_status _nss_bench_getspnam_r (const char *name, struct spwd *spw,
+                                       char *buf, size_t buflen,
+                                       int *errnop)
+{
+	struct bench_user u;
+	enum nss_status status;
+
+	status = find_user (BY_NAME, name, 0, &u, errnop);
+	if (NSS_STATUS_SUCCESS != status) {
+		return status;
+	}
+	spw->sp_lstchg = -1;
+	spw->sp_min = -1;
+	spw->sp_max = -1;
+	spw->sp_warn = -1;
+	spw->sp_inact = -1;
+	spw->sp_expire = -1;
+	spw->sp_flag = (unsigned long) -1;
+	if (   ((spw->sp_namp = store (&buf, &buflen, u.name)) == NULL)
+	    || ((spw->sp_pwdp = store (&buf, &buflen, "!")) == NULL)) {
+		*errnop = ERANGE;
+		return NSS_STATUS_TRYAGAIN;
+	}
+	return NSS_STATUS_SUCCESS;
+}
@@ -0,0 +1,688 @@
+/*
+ * Benchmark of the directory tree walkers of libmisc.
+ *
+ * Trees of several shapes are generated in a directory, and each one is
+ * copied with copy_tree(), given to the current user with chown_tree(),
+ * and removed with remove_tree(), as useradd -m, usermod -u and
+ * userdel -r do. Each walk reports the number of entries, its duration,
+ * the entries and megabytes per second, and the number of calls to the
+ * file system functions made during the walk.
+ *
+ * The shapes are:
+ *	wide		one directory with all the files
+ *	deep		a chain of nested directories, with a few files each
+ *	links		files with several hard links in other directories
+ *	sparse		large files with only a few blocks of data
+ *	xattr		files with extended attributes and an access ACL
+ *	symlinks	a directory of symbolic links to a few files
+ *
+ * The calls are counted by wrapping the functions of the C library with
+ * the --wrap option of the linker (see the Makefile): these are the
+ * calls of the walkers, not the system calls made by the C library
+ * itself.
+ *
+ * Run it in a directory of each file system to compare (for example a
+ * tmpfs and a disk) with -d. COPY_THREADS, CHOWN_THREADS and
+ * REMOVE_THREADS are set with -t. With -c (as root), the page cache is
+ * dropped before each walk.
+ *
+ * The trees are generated in a new directory, or in the directory given
+ * with -d, which must not contain them already. They are left for
+ * inspection.
+ */
+
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <sys/xattr.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include "defines.h"
+#include "prototypes.h"
+
+const char *Prog = "treebench";
+
+static unsigned long n_files = 10000;
+static unsigned long file_size = 4096;
+static unsigned long depth = 64;
+static unsigned long threads = 1;
+static bool drop_caches = false;
+static bool verbose = false;
+static const char *shapes = "wide,deep,links,sparse,xattr,symlinks";
+static const char *dir = NULL;
+
+/* Size of the sparse files, with a block of data at each end */
+#define SPARSE_SIZE	(64UL * 1024 * 1024)
+
+static struct timespec bench_start;
+
+/*
+ * Counted calls
+ */
+#define COUNTED \
+	X(open) X(openat) X(close) X(dup) X(read) X(write) X(pread) \
+	X(pwrite) X(lseek) X(ftruncate) X(fstat) X(fstatat) X(statx) \
+	X(readdir) X(syscall) X(mkdirat) X(unlink) X(unlinkat) X(rename) \
+	X(linkat) X(symlinkat) X(readlinkat) X(mknodat) X(chown) \
+	X(fchown) X(fchownat) X(fchmod) X(fchmodat) X(futimens) \
+	X(utimensat) X(flistxattr) X(llistxattr) X(ioctl) \
+	X(copy_file_range) X(sendfile)
+
+enum {
+#define X(name) CALL_##name,
+	COUNTED
+#undef X
+	CALL_COUNT
+};
+
+static const char *const call_names[] = {
+#define X(name) #name,
+	COUNTED
+#undef X
+};
+
+static unsigned long calls[CALL_COUNT];
+
+static void count (int call)
+{
+	(void) __atomic_fetch_add (&calls[call], 1, __ATOMIC_RELAXED);
+}
+
+#define WRAP(ret, name, params, args)		\
+	extern ret __real_##name params;	\
+	ret __wrap_##name params;		\
+	ret __wrap_##name params		\
+	{					\
+		count (CALL_##name);		\
+		return __real_##name args;	\
+	}
+
+WRAP (int, close, (int fd), (fd))
+WRAP (int, dup, (int fd), (fd))
+WRAP (ssize_t, read, (int fd, void *buf, size_t n), (fd, buf, n))
+WRAP (ssize_t, write, (int fd, const void *buf, size_t n), (fd, buf, n))
+WRAP (ssize_t, pread, (int fd, void *buf, size_t n, off_t off),
+      (fd, buf, n, off))
+WRAP (ssize_t, pwrite, (int fd, const void *buf, size_t n, off_t off),
+      (fd, buf, n, off))
+WRAP (off_t, lseek, (int fd, off_t off, int whence), (fd, off, whence))
+WRAP (int, ftruncate, (int fd, off_t len), (fd, len))
+WRAP (int, fstat, (int fd, struct stat *sb), (fd, sb))
+WRAP (int, fstatat, (int dfd, const char *p, struct stat *sb, int flags),
+      (dfd, p, sb, flags))
+#if defined(HAVE_STATX) && defined(STATX_TYPE)
+WRAP (int, statx, (int dfd, const char *p, int flags, unsigned int mask,
+                   struct statx *stx),
+      (dfd, p, flags, mask, stx))
+#endif
+WRAP (struct dirent *, readdir, (DIR *d), (d))
+WRAP (int, mkdirat, (int dfd, const char *p, mode_t mode), (dfd, p, mode))
+WRAP (int, unlink, (const char *p), (p))
+WRAP (int, unlinkat, (int dfd, const char *p, int flags), (dfd, p, flags))
+WRAP (int, rename, (const char *p1, const char *p2), (p1, p2))
+WRAP (int, linkat, (int dfd1, const char *p1, int dfd2, const char *p2,
+                    int flags),
+      (dfd1, p1, dfd2, p2, flags))
+WRAP (int, symlinkat, (const char *target, int dfd, const char *p),
+      (target, dfd, p))
+WRAP (ssize_t, readlinkat, (int dfd, const char *p, char *buf, size_t n),
+      (dfd, p, buf, n))
+WRAP (int, mknodat, (int dfd, const char *p, mode_t mode, dev_t dev),
+      (dfd, p, mode, dev))
+WRAP (int, chown, (const char *p, uid_t uid, gid_t gid), (p, uid, gid))
+WRAP (int, fchown, (int fd, uid_t uid, gid_t gid), (fd, uid, gid))
+WRAP (int, fchownat, (int dfd, const char *p, uid_t uid, gid_t gid,
+                      int flags),
+      (dfd, p, uid, gid, flags))
+WRAP (int, fchmod, (int fd, mode_t mode), (fd, mode))
+WRAP (int, fchmodat, (int dfd, const char *p, mode_t mode, int flags),
+      (dfd, p, mode, flags))
+WRAP (int, futimens, (int fd, const struct timespec ts[2]), (fd, ts))
+WRAP (int, utimensat, (int dfd, const char *p, const struct timespec ts[2],
+                       int flags),
+      (dfd, p, ts, flags))
+WRAP (ssize_t, flistxattr, (int fd, char *list, size_t n), (fd, list, n))
+WRAP (ssize_t, llistxattr, (const char *p, char *list, size_t n),
+      (p, list, n))
+#ifdef HAVE_COPY_FILE_RANGE
+WRAP (ssize_t, copy_file_range, (int fd1, off_t *off1, int fd2, off_t *off2,
+                                 size_t n, unsigned int flags),
+      (fd1, off1, fd2, off2, n, flags))
+#endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+WRAP (ssize_t, sendfile, (int fd1, int fd2, off_t *off, size_t n),
+      (fd1, fd2, off, n))
+#endif
+
+/* The variadic functions pass on their optional argument */
+extern int __real_open (const char *p, int flags, ...);
+int __wrap_open (const char *p, int flags, ...);
+int __wrap_open (const char *p, int flags, ...)
+{
+	va_list ap;
+	mode_t mode;
+
+	va_start (ap, flags);
+	mode = (0 != (flags & O_CREAT)) ? (mode_t) va_arg (ap, int) : 0;
+	va_end (ap);
+	count (CALL_open);
+	return __real_open (p, flags, mode);
+}
+
+extern int __real_openat (int dfd, const char *p, int flags, ...);
+int __wrap_openat (int dfd, const char *p, int flags, ...);
+int __wrap_openat (int dfd, const char *p, int flags, ...)
+{
+	va_list ap;
+	mode_t mode;
+
+	va_start (ap, flags);
+	mode = (0 != (flags & O_CREAT)) ? (mode_t) va_arg (ap, int) : 0;
+	va_end (ap);
+	count (CALL_openat);
+	return __real_openat (dfd, p, flags, mode);
+}
+
+extern int __real_ioctl (int fd, unsigned long req, ...);
+int __wrap_ioctl (int fd, unsigned long req, ...);
+int __wrap_ioctl (int fd, unsigned long req, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start (ap, req);
+	arg = va_arg (ap, void *);
+	va_end (ap);
+	count (CALL_ioctl);
+	return __real_ioctl (fd, req, arg);
+}
+
+/* Like syscall() itself, always pass on 6 arguments */
+extern long __real_syscall (long number, ...);
+long __wrap_syscall (long number, ...);
+long __wrap_syscall (long number, ...)
+{
+	va_list ap;
+	long a[6];
+	int i;
+
+	va_start (ap, number);
+	for (i = 0; i < 6; i++) {
+		a[i] = va_arg (ap, long);
+	}
+	va_end (ap);
+	count (CALL_syscall);
+	return __real_syscall (number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+static void usage (int status)
+{
+	FILE *out = (0 == status) ? stdout : stderr;
+
+	(void) fprintf (out,
+	                "Usage: %s [options]\n"
+	                "\n"
+	                "Options:\n"
+	                "  -n FILES     number of files of each tree (default %lu)\n"
+	                "  -S SIZE      size of the files (default %lu)\n"
+	                "  -D DEPTH     depth of the deep tree (default %lu)\n"
+	                "  -w SHAPES    comma separated shapes (default %s)\n"
+	                "  -t THREADS   COPY_THREADS, CHOWN_THREADS and REMOVE_THREADS (default %lu)\n"
+	                "  -c           drop the page cache before each walk (root only)\n"
+	                "  -v           report the calls of each function\n"
+	                "  -d DIR       directory of the trees (default: a new directory in /tmp)\n",
+	                Prog, n_files, file_size, depth, shapes, threads);
+	exit (status);
+}
+
+static void fail (const char *what)
+{
+	(void) fprintf (stderr, "%s: %s failed: %s\n",
+	                Prog, what, strerror (errno));
+	exit (EXIT_FAILURE);
+}
+
+/*
+ * The generated trees
+ */
+struct tree {
+	unsigned long entries;	/* names, including the directories */
+	unsigned long bytes;	/* data, once for the hard links */
+};
+
+static void make_dir (struct tree *t, const char *path)
+{
+	if (mkdir (path, 0755) != 0) {
+		fail (path);
+	}
+	t->entries++;
+}
+
+static void make_file (struct tree *t, const char *path, unsigned long size)
+{
+	static char *buf = NULL;
+	int fd;
+
+	if (NULL == buf) {
+		buf = xmalloc (file_size + 1);
+		memset (buf, 'x', file_size + 1);
+	}
+	fd = open (path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (   (fd < 0)
+	    || ((0 != size) && (write (fd, buf, size) != (ssize_t) size))
+	    || (close (fd) != 0)) {
+		fail (path);
+	}
+	t->entries++;
+	t->bytes += size;
+}
+
+static void gen_wide (struct tree *t, const char *root)
+{
+	char path[1024];
+	unsigned long i;
+
+	make_dir (t, root);
+	for (i = 0; i < n_files; i++) {
+		(void) snprintf (path, sizeof path, "%s/f%lu", root, i);
+		make_file (t, path, file_size);
+	}
+}
+
+static void gen_deep (struct tree *t, const char *root)
+{
+	char path[4096];
+	char file[4200];
+	unsigned long per_level = n_files / depth + 1;
+	unsigned long i, j;
+	size_t len;
+
+	(void) snprintf (path, sizeof path, "%s", root);
+	for (i = 0; i < depth; i++) {
+		make_dir (t, path);
+		for (j = 0; j < per_level; j++) {
+			(void) snprintf (file, sizeof file, "%s/f%lu", path, j);
+			make_file (t, file, file_size);
+		}
+		len = strlen (path);
+		if (len + 8 >= sizeof path) {
+			break;
+		}
+		(void) snprintf (path + len, sizeof path - len, "/d%lu", i);
+	}
+}
+
+static void gen_links (struct tree *t, const char *root)
+{
+	static const char *const dirs[] = { "a", "b", "c", "d" };
+	char path[1024];
+	char link_path[1024];
+	unsigned long i;
+	size_t d;
+
+	make_dir (t, root);
+	for (d = 0; d < 4; d++) {
+		(void) snprintf (path, sizeof path, "%s/%s", root, dirs[d]);
+		make_dir (t, path);
+	}
+	/* Each file has 4 names */
+	for (i = 0; i < n_files / 4 + 1; i++) {
+		(void) snprintf (path, sizeof path, "%s/a/f%lu", root, i);
+		make_file (t, path, file_size);
+		for (d = 1; d < 4; d++) {
+			(void) snprintf (link_path, sizeof link_path,
+			                 "%s/%s/f%lu", root, dirs[d], i);
+			if (link (path, link_path) != 0) {
+				fail (link_path);
+			}
+			t->entries++;
+		}
+	}
+}
+
+static void gen_sparse (struct tree *t, const char *root)
+{
+	char path[1024];
+	char block[4096];
+	unsigned long i;
+	int fd;
+
+	memset (block, 'x', sizeof block);
+	make_dir (t, root);
+	for (i = 0; i < n_files / 100 + 1; i++) {
+		(void) snprintf (path, sizeof path, "%s/f%lu", root, i);
+		fd = open (path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (   (fd < 0)
+		    || (pwrite (fd, block, sizeof block, 0) != sizeof block)
+		    || (pwrite (fd, block, sizeof block,
+		                SPARSE_SIZE - sizeof block) != sizeof block)
+		    || (close (fd) != 0)) {
+			fail (path);
+		}
+		t->entries++;
+		t->bytes += SPARSE_SIZE;
+	}
+}
+
+/*
+ * gen_xattr - files with 4 user attributes and an access ACL
+ *
+ *	The ACL (user::rw-, user:<uid+1>:r--, group::r--, mask::r--,
+ *	other::r--) is written in the format of system.posix_acl_access.
+ */
+static void gen_xattr (struct tree *t, const char *root)
+{
+	char path[1024];
+	char name[32];
+	char value[64];
+	uint32_t acl[11];
+	unsigned long i, failed = 0;
+	int a;
+
+	acl[0] = 2;					/* version */
+	acl[1] = 0x0001 | (6U << 16);	acl[2] = (uint32_t) -1;	/* user:: */
+	acl[3] = 0x0002 | (4U << 16);	acl[4] = getuid () + 1;	/* user:N: */
+	acl[5] = 0x0004 | (4U << 16);	acl[6] = (uint32_t) -1;	/* group:: */
+	acl[7] = 0x0010 | (4U << 16);	acl[8] = (uint32_t) -1;	/* mask:: */
+	acl[9] = 0x0020 | (4U << 16);	acl[10] = (uint32_t) -1; /* other:: */
+
+	memset (value, 'v', sizeof value);
+	make_dir (t, root);
+	for (i = 0; i < n_files; i++) {
+		(void) snprintf (path, sizeof path, "%s/f%lu", root, i);
+		make_file (t, path, file_size);
+		for (a = 0; a < 4; a++) {
+			(void) snprintf (name, sizeof name, "user.bench%d", a);
+			if (setxattr (path, name, value, sizeof value, 0) != 0) {
+				failed++;
+			}
+		}
+		if (setxattr (path, "system.posix_acl_access",
+		              acl, sizeof acl, 0) != 0) {
+			failed++;
+		}
+	}
+	if (0 != failed) {
+		(void) fprintf (stderr,
+		                "%s: warning: %lu attributes could not be set: %s\n",
+		                Prog, failed, strerror (errno));
+	}
+}
+
+static void gen_symlinks (struct tree *t, const char *root)
+{
+	char path[1024];
+	char target[64];
+	unsigned long i;
+
+	make_dir (t, root);
+	(void) snprintf (path, sizeof path, "%s/target", root);
+	make_dir (t, path);
+	for (i = 0; i < 16; i++) {
+		(void) snprintf (path, sizeof path, "%s/target/t%lu", root, i);
+		make_file (t, path, file_size);
+	}
+	(void) snprintf (path, sizeof path, "%s/links", root);
+	make_dir (t, path);
+	for (i = 0; i < n_files; i++) {
+		(void) snprintf (path, sizeof path, "%s/links/l%lu", root, i);
+		(void) snprintf (target, sizeof target, "../target/t%lu", i % 16);
+		if (symlink (target, path) != 0) {
+			fail (path);
+		}
+		t->entries++;
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*generate) (struct tree *t, const char *root);
+} generators[] = {
+	{ "wide",	gen_wide },
+	{ "deep",	gen_deep },
+	{ "links",	gen_links },
+	{ "sparse",	gen_sparse },
+	{ "xattr",	gen_xattr },
+	{ "symlinks",	gen_symlinks },
+};
+
+static const char *fs_name (const char *path)
+{
+	static char name[32];
+	struct statfs sfs;
+
+	if (statfs (path, &sfs) != 0) {
+		return "unknown";
+	}
+	switch ((unsigned long) sfs.f_type) {
+	case 0x01021994UL:
+		return "tmpfs";
+	case 0xEF53UL:
+		return "ext2/3/4";
+	case 0x58465342UL:
+		return "xfs";
+	case 0x9123683EUL:
+		return "btrfs";
+	case 0x2FC12FC1UL:
+		return "zfs";
+	case 0x794C7630UL:
+		return "overlayfs";
+	case 0x6969UL:
+		return "nfs";
+	}
+	(void) snprintf (name, sizeof name, "0x%lx",
+	                 (unsigned long) sfs.f_type);
+	return name;
+}
+
+static void start (void)
+{
+	if (drop_caches) {
+		FILE *fp;
+
+		sync ();
+		fp = fopen ("/proc/sys/vm/drop_caches", "w");
+		if (   (NULL == fp)
+		    || (fputs ("3\n", fp) < 0)
+		    || (fclose (fp) != 0)) {
+			fail ("/proc/sys/vm/drop_caches");
+		}
+	}
+	memset (calls, 0, sizeof calls);
+	(void) clock_gettime (CLOCK_MONOTONIC, &bench_start);
+}
+
+/*
+ * stop - Report a walk of the tree t, started with start().
+ */
+static void stop (const char *walk, const char *shape, const struct tree *t)
+{
+	struct timespec now;
+	unsigned long total = 0;
+	char name[64];
+	double secs;
+	int i;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &now);
+	secs =   (double) (now.tv_sec - bench_start.tv_sec)
+	       + (double) (now.tv_nsec - bench_start.tv_nsec) / 1e9;
+	for (i = 0; i < CALL_COUNT; i++) {
+		total += calls[i];
+	}
+	(void) snprintf (name, sizeof name, "%s %s", walk, shape);
+	(void) printf ("%-20s %10lu %12.6f %12.1f %10.1f %10lu %8.2f\n",
+	               name, t->entries, secs,
+	               (secs > 0) ? (double) t->entries / secs : 0.0,
+	               (secs > 0) ? (double) t->bytes / secs / 1e6 : 0.0,
+	               total,
+	               (0 != t->entries) ? (double) total / t->entries : 0.0);
+	if (verbose) {
+		for (i = 0; i < CALL_COUNT; i++) {
+			if (0 != calls[i]) {
+				(void) printf ("#   %-18s %10lu\n",
+				               call_names[i], calls[i]);
+			}
+		}
+	}
+	(void) fflush (stdout);
+}
+
+static bool selected (const char *name)
+{
+	size_t len = strlen (name);
+	const char *cp = shapes;
+
+	while (NULL != cp) {
+		if (   (strncmp (cp, name, len) == 0)
+		    && ((',' == cp[len]) || ('\0' == cp[len]))) {
+			return true;
+		}
+		cp = strchr (cp, ',');
+		if (NULL != cp) {
+			cp++;
+		}
+	}
+	return false;
+}
+
+static void write_defs (void)
+{
+	char path[1024];
+	FILE *fp;
+
+	(void) snprintf (path, sizeof path, "%s/etc", dir);
+	if ((mkdir (path, 0755) != 0) && (EEXIST != errno)) {
+		fail (path);
+	}
+	(void) snprintf (path, sizeof path, "%s/etc/login.defs", dir);
+	fp = fopen (path, "w");
+	if (NULL == fp) {
+		fail (path);
+	}
+	(void) fprintf (fp,
+	                "COPY_THREADS %lu\nCHOWN_THREADS %lu\nREMOVE_THREADS %lu\n",
+	                threads, threads, threads);
+	if ((ferror (fp) != 0) || (fclose (fp) != 0)) {
+		fail (path);
+	}
+}
+
+int main (int argc, char **argv)
+{
+	char tmpdir[] = "/tmp/shadow-treebench.XXXXXX";
+	char *prefix_argv[4];
+	char src[1024];
+	char dst[1024];
+	size_t i;
+	int c;
+
+	while ((c = getopt (argc, argv, "cd:D:hn:S:t:vw:")) != -1) {
+		switch (c) {
+		case 'c':
+			drop_caches = true;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'D':
+			depth = strtoul (optarg, NULL, 10);
+			break;
+		case 'h':
+			usage (EXIT_SUCCESS);
+			break;
+		case 'n':
+			n_files = strtoul (optarg, NULL, 10);
+			break;
+		case 'S':
+			file_size = strtoul (optarg, NULL, 10);
+			break;
+		case 't':
+			threads = strtoul (optarg, NULL, 10);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'w':
+			shapes = optarg;
+			break;
+		default:
+			usage (EXIT_FAILURE);
+		}
+	}
+	if (0 == depth) {
+		depth = 1;
+	}
+
+	if (NULL == dir) {
+		dir = mkdtemp (tmpdir);
+		if (NULL == dir) {
+			fail ("mkdtemp");
+		}
+	} else if ((mkdir (dir, 0755) != 0) && (EEXIST != errno)) {
+		fail (dir);
+	}
+
+	/* Use the thread settings of the benchmark, as with --prefix */
+	write_defs ();
+	prefix_argv[0] = (char *) Prog;
+	prefix_argv[1] = "--prefix";
+	prefix_argv[2] = (char *) dir;
+	prefix_argv[3] = NULL;
+	(void) process_prefix_flag ("-P", 3, prefix_argv);
+
+	(void) printf ("# %lu files of %lu bytes, depth %lu, %lu threads, in %s (%s)\n",
+	               n_files, file_size, depth, threads, dir, fs_name (dir));
+	(void) printf ("%-20s %10s %12s %12s %10s %10s %8s\n",
+	               "# walk", "entries", "seconds", "entries/s", "MB/s",
+	               "calls", "calls/e");
+
+	for (i = 0; i < sizeof generators / sizeof generators[0]; i++) {
+		struct tree t = { 0, 0 };
+
+		if (!selected (generators[i].name)) {
+			continue;
+		}
+		(void) snprintf (src, sizeof src, "%s/%s",
+		                 dir, generators[i].name);
+		(void) snprintf (dst, sizeof dst, "%s/%s.copy",
+		                 dir, generators[i].name);
+		generators[i].generate (&t, src);
+
+		start ();
+		if (copy_tree (src, dst, true, false,
+		               (uid_t) -1, getuid (), (gid_t) -1, getgid ()) != 0) {
+			fail ("copy_tree");
+		}
+		stop ("copy", generators[i].name, &t);
+
+		start ();
+		if (chown_tree (dst, (uid_t) -1, getuid (),
+		                (gid_t) -1, getgid ()) != 0) {
+			fail ("chown_tree");
+		}
+		stop ("chown", generators[i].name, &t);
+
+		start ();
+		if (remove_tree (dst, true) != 0) {
+			fail ("remove_tree");
+		}
+		stop ("remove", generators[i].name, &t);
+	}
+
+	return EXIT_SUCCESS;
+}